@@ -0,0 +1,132 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "AccessPattern.h"
+
+#include "Mutex.h"
+
+namespace encfs {
+
+// requests between halvings of the counts
+static const uint32_t Window = 64;
+// reads or writes needed before they change the policy
+static const uint32_t MinSample = 8;
+// how much deeper than the mount's a streaming file reads ahead
+static const int StreamReadAhead = 4;
+// smallest average read of a one pass stream; smaller sequential reads
+// are as likely a scan of something read again
+static const uint64_t StreamReadBytes = 64 * 1024;
+
+AccessPattern::AccessPattern(int readAheadBlocks)
+    : _readAheadBlocks(readAheadBlocks),
+      _reads(0),
+      _seqReads(0),
+      _backReads(0),
+      _readBytes(0),
+      _writes(0),
+      _seqWrites(0),
+      _lastReadEnd(-1),
+      _lastWriteEnd(-1) {
+  pthread_mutex_init(&_mutex, nullptr);
+  _policy = decide();
+}
+
+AccessPattern::~AccessPattern() { pthread_mutex_destroy(&_mutex); }
+
+bool AccessPattern::read(off_t offset, size_t size, Policy *policy) {
+  Lock lock(_mutex);
+  ++_reads;
+  if (offset == _lastReadEnd) {
+    ++_seqReads;
+  } else if (offset < _lastReadEnd) {
+    ++_backReads;
+  }
+  _readBytes += size;
+  _lastReadEnd = offset + (off_t)size;
+  counted();
+  return update(policy);
+}
+
+bool AccessPattern::write(off_t offset, size_t size, Policy *policy) {
+  Lock lock(_mutex);
+  ++_writes;
+  if (offset == _lastWriteEnd) {
+    ++_seqWrites;
+  }
+  _lastWriteEnd = offset + (off_t)size;
+  counted();
+  return update(policy);
+}
+
+AccessPattern::Policy AccessPattern::policy() const {
+  Lock lock(_mutex);
+  return _policy;
+}
+
+void AccessPattern::counted() {
+  if (_reads + _writes < Window) {
+    return;
+  }
+  _reads /= 2;
+  _seqReads /= 2;
+  _backReads /= 2;
+  _readBytes /= 2;
+  _writes /= 2;
+  _seqWrites /= 2;
+}
+
+bool AccessPattern::update(Policy *policy) {
+  Policy now = decide();
+  bool changed = now != _policy;
+  _policy = now;
+  *policy = now;
+  return changed;
+}
+
+/**
+ * Mostly sequential reads get a deeper read-ahead, and are dropped from the
+ * cache once read when they are large and nothing goes back or writes; a
+ * file read at random gets none.  Writes are buffered unless they are
+ * mostly not appends, which the buffer of the last block never serves.
+ */
+AccessPattern::Policy AccessPattern::decide() const {
+  Policy p;
+  p.readAheadBlocks = _readAheadBlocks;
+  p.dropBehind = false;
+  p.writeBack = true;
+  p.sequential = false;
+  p.scattered = false;
+
+  if (_reads >= MinSample) {
+    bool streaming = _seqReads * 8 >= _reads * 7;
+    if (streaming) {
+      p.readAheadBlocks = _readAheadBlocks * StreamReadAhead;
+      p.dropBehind = _backReads == 0 && _writes == 0 &&
+                     _readBytes >= StreamReadBytes * _reads;
+      p.sequential = true;
+    } else if (_seqReads * 4 < _reads) {
+      p.readAheadBlocks = 0;
+      p.scattered = true;
+    }
+  }
+  if (_writes >= MinSample && _seqWrites * 2 < _writes) {
+    p.writeBack = false;
+  }
+  return p;
+}
+
+}  // namespace encfs
@@ -0,0 +1,82 @@
+#ifndef _AccessPattern_incl_
+#define _AccessPattern_incl_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace encfs {
+
+/*
+    What the recent requests to one open file looked like, to pick how it
+    is read ahead, cached and buffered rather than have one setting for
+    every file of the mount: a media stream wants a deep read-ahead and no
+    room in the block cache for what it has played, a database wants its
+    pages cached and nothing read ahead.
+
+    Counts fade, halved every Window requests, so that the policy follows
+    a file whose use changes.  Until there are a few requests to go by
+    the policy is that of the mount.
+ */
+class AccessPattern {
+ public:
+  struct Policy {
+    // blocks to read ahead once reads are sequential, 0 = none
+    int readAheadBlocks;
+    // one pass streaming: blocks read are dropped from the block cache
+    // rather than push out those of other files
+    bool dropBehind;
+    // small writes to the last block are buffered, see
+    // FileNode::bufferWrite
+    bool writeBack;
+    // reads are front to back, or in no order, as the backing file is
+    // told (see FileIO::advise).  Neither until it is known.
+    bool sequential;
+    bool scattered;
+
+    bool operator==(const Policy &o) const {
+      return readAheadBlocks == o.readAheadBlocks &&
+             dropBehind == o.dropBehind && writeBack == o.writeBack &&
+             sequential == o.sequential && scattered == o.scattered;
+    }
+    bool operator!=(const Policy &o) const { return !(*this == o); }
+  };
+
+  // readAheadBlocks is the mount's read-ahead window, see --readahead
+  explicit AccessPattern(int readAheadBlocks);
+  ~AccessPattern();
+
+  // count a request, and fill in the policy after it.  True if the
+  // policy changed with it.
+  bool read(off_t offset, size_t size, Policy *policy);
+  bool write(off_t offset, size_t size, Policy *policy);
+
+  Policy policy() const;
+
+ private:
+  AccessPattern(const AccessPattern &src);             // not allowed
+  AccessPattern &operator=(const AccessPattern &src);  // not allowed
+
+  // caller holds _mutex
+  void counted();
+  Policy decide() const;
+  bool update(Policy *policy);
+
+  int _readAheadBlocks;
+  mutable pthread_mutex_t _mutex;
+  // since the last halving
+  uint32_t _reads;
+  uint32_t _seqReads;    // starting where the previous read ended
+  uint32_t _backReads;   // starting before it
+  uint64_t _readBytes;
+  uint32_t _writes;
+  uint32_t _seqWrites;   // starting where the previous write ended
+  off_t _lastReadEnd;
+  off_t _lastWriteEnd;
+  Policy _policy;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,120 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "AsCaller.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#ifdef __linux__
+#include <sys/fsuid.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "FileUtils.h"
+
+namespace encfs {
+
+AsCaller::AsCaller(uid_t uid, gid_t gid, mode_t mode, bool kernelChecks)
+    : _uid(uid), _gid(gid), _mode(mode), _chown(false), _olduid(-1),
+      _oldgid(-1), _ok(true) {
+  if (uid == 0 && gid == 0) {
+    return;
+  }
+  // a chown clears the set-ID bits of everything but directories, and
+  // device nodes stay made with the caller's capabilities
+  bool plain = S_ISREG(mode) || S_ISFIFO(mode) || S_ISLNK(mode) ||
+               S_ISSOCK(mode);
+  if (kernelChecks &&
+      (S_ISDIR(mode) || (plain && (mode & (S_ISUID | S_ISGID)) == 0))) {
+    _chown = true;
+    return;
+  }
+
+  if (gid != 0) {
+    _oldgid = setfsgid(gid);
+    if (_oldgid == -1) {
+      int eno = errno;
+      RLOG(DEBUG) << "setfsgid error: " << strerror(eno);
+      _ok = false;
+      return;
+    }
+  }
+  if (uid != 0) {
+    _olduid = setfsuid(uid);
+    if (_olduid == -1) {
+      int eno = errno;
+      RLOG(DEBUG) << "setfsuid error: " << strerror(eno);
+      _ok = false;
+    }
+  }
+}
+
+AsCaller::~AsCaller() {
+  if (_olduid >= 0) {
+    if (setfsuid(_olduid) == -1) {
+      int eno = errno;
+      RLOG(DEBUG) << "setfsuid back error: " << strerror(eno);
+    }
+  }
+  if (_oldgid >= 0) {
+    if (setfsgid(_oldgid) == -1) {
+      int eno = errno;
+      RLOG(DEBUG) << "setfsgid back error: " << strerror(eno);
+    }
+  }
+}
+
+int AsCaller::own(int dirFd, const char *name, int fd) const {
+  if (!_chown) {
+    return 0;
+  }
+
+  // made as root the node has root's group, unless the directory passes
+  // on its own
+  int res = 0;
+  gid_t group = (gid_t)-1;
+  if (_gid != 0) {
+    struct stat dir;
+    res = dirFd == AT_FDCWD ? ::stat(parentDirectory(name).c_str(), &dir)
+                            : ::fstat(dirFd, &dir);
+    if (res == 0 && (dir.st_mode & S_ISGID) == 0) {
+      group = _gid;
+    }
+  }
+  if (res == 0) {
+    uid_t owner = _uid != 0 ? _uid : (uid_t)-1;
+    res = fd >= 0 ? ::fchown(fd, owner, group)
+                  : ::fchownat(dirFd, name, owner, group, AT_SYMLINK_NOFOLLOW);
+  }
+  if (res == 0) {
+    return 0;
+  }
+
+  int eno = errno;
+  RLOG(WARNING) << "chown of new node " << name << " error: " << strerror(eno);
+  // not to be left behind as root's
+  if (::unlinkat(dirFd, name, S_ISDIR(_mode) ? AT_REMOVEDIR : 0) != 0) {
+    RLOG(ERROR) << "could not remove " << name << ": " << strerror(errno);
+  }
+  return -eno;
+}
+
+}  // namespace encfs
@@ -0,0 +1,56 @@
+#ifndef _AsCaller_incl_
+#define _AsCaller_incl_
+
+#include <sys/types.h>
+
+namespace encfs {
+
+/*
+    Makes what a public filesystem (--public) creates on behalf of a caller
+    the caller's, for as long as it lives.
+
+    When the kernel checks permissions against the attributes we report
+    (default_permissions), which are those of the backing nodes, the node
+    can be made as root like everything else and then handed over with a
+    single chown, rather than switching the filesystem ids of the thread
+    there and back around it.  The chown keeps the group a node takes in a
+    set-group-ID directory.  Without default_permissions only the backing
+    filesystem checks the caller, so the ids are always switched; so are
+    they for files whose mode has set-ID bits, which a chown would clear,
+    and for device nodes.
+ */
+class AsCaller {
+ public:
+  // uid / gid of 0 are left as they are.  kernelChecks is true if the
+  // mount has default_permissions.
+  AsCaller(uid_t uid, gid_t gid, mode_t mode, bool kernelChecks);
+  ~AsCaller();
+
+  // false if the ids could not be switched
+  bool ok() const { return _ok; }
+  // true while the thread has the caller's ids, when a cached directory
+  // descriptor would skip the search permission checks of the walk made
+  // as them
+  bool switched() const { return _olduid >= 0 || _oldgid >= 0; }
+
+  // hands the node just made as name in dirFd, open as fd or -1, to the
+  // caller if it was made as root, removing it if that fails.  Returns 0
+  // or -errno.
+  int own(int dirFd, const char *name, int fd) const;
+
+ private:
+  AsCaller(const AsCaller &src);             // not allowed
+  AsCaller &operator=(const AsCaller &src);  // not allowed
+
+  uid_t _uid;
+  gid_t _gid;
+  mode_t _mode;
+  bool _chown;
+  int _olduid;
+  int _oldgid;
+  bool _ok;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,143 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "AttrCache.h"
+
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+AttrCache::AttrCache(size_t maxEntries, int ttlMs)
+    : _maxShardEntries(maxEntries > NumShards ? maxEntries / NumShards : 1),
+      _ttlMs(ttlMs),
+      _hits(0),
+      _misses(0) {
+  for (Shard &shard : _shards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+    shard.generation = 0;
+  }
+}
+
+AttrCache::~AttrCache() {
+  VLOG(1) << "attr cache: " << hits() << " hits, " << misses() << " misses";
+  for (Shard &shard : _shards) {
+    pthread_mutex_destroy(&shard.mutex);
+  }
+}
+
+AttrCache::Shard &AttrCache::shardFor(const char *plainPath) {
+  size_t h = std::hash<std::string>()(plainPath);
+  return _shards[(h ^ (h >> 17)) % NumShards];
+}
+
+bool AttrCache::get(const char *plainPath, struct stat *stbuf,
+                    uint64_t *generation) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  auto it = shard.entries.find(plainPath);
+  if (it != shard.entries.end()) {
+    if (it->second.expires > monotonicMs()) {
+      *stbuf = it->second.stbuf;
+      ++_hits;
+      return true;
+    }
+    shard.entries.erase(it);
+  }
+  ++_misses;
+  *generation = shard.generation;
+  return false;
+}
+
+void AttrCache::add(const char *plainPath, const struct stat &stbuf,
+                    uint64_t generation) {
+  Shard &shard = shardFor(plainPath);
+  int64_t now = monotonicMs();
+
+  Lock lock(shard.mutex);
+  if (shard.generation != generation) {
+    // the file may have changed while it was looked at
+    return;
+  }
+  if (shard.entries.size() >= _maxShardEntries) {
+    makeRoom(shard, now);
+  }
+  Entry &entry = shard.entries[plainPath];
+  entry.stbuf = stbuf;
+  entry.expires = now + _ttlMs;
+}
+
+void AttrCache::makeRoom(Shard &shard, int64_t now) {
+  for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+    if (it->second.expires <= now) {
+      it = shard.entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  if (shard.entries.size() >= _maxShardEntries) {
+    shard.entries.clear();
+  }
+}
+
+void AttrCache::erase(const char *plainPath) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  ++shard.generation;
+  shard.entries.erase(plainPath);
+}
+
+void AttrCache::eraseBelow(const char *plainPath) {
+  size_t len = strlen(plainPath);
+  // "/" or "/dir/" cover everything below them as they are
+  bool isPrefix = len > 0 && plainPath[len - 1] == '/';
+
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    ++shard.generation;
+    auto it = shard.entries.begin();
+    while (it != shard.entries.end()) {
+      const std::string &path = it->first;
+      bool below = path.compare(0, len, plainPath) == 0 &&
+                   (path.size() == len || isPrefix || path[len] == '/');
+      if (below) {
+        it = shard.entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+uint64_t AttrCache::hits() const { return _hits; }
+
+uint64_t AttrCache::misses() const { return _misses; }
+
+}  // namespace encfs
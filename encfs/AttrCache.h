@@ -0,0 +1,75 @@
+#ifndef _AttrCache_incl_
+#define _AttrCache_incl_
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+namespace encfs {
+
+/*
+    The attributes getattr reported for files that are not open, with the
+    size of the plaintext, so that asking again within ttlMs milliseconds
+    neither encodes the path nor stats the backing file.
+
+    The TTL bounds how long a change made behind our back goes unseen;
+    changes made through the filesystem erase the entry of the path right
+    away.  Open files are answered by their FileNode instead.
+
+    Entries are spread over shards by the hash of the path, each with its
+    own lock and share of the bound.
+ */
+class AttrCache {
+ public:
+  AttrCache(size_t maxEntries, int ttlMs);
+  ~AttrCache();
+
+  // true, with stbuf filled in, if the attributes of plainPath were
+  // recorded and have not expired.  Otherwise generation is set for add(),
+  // which records them only if nothing erased the path since.
+  bool get(const char *plainPath, struct stat *stbuf, uint64_t *generation);
+  void add(const char *plainPath, const struct stat &stbuf,
+           uint64_t generation);
+
+  void erase(const char *plainPath);
+  // forget plainPath and every path below it
+  void eraseBelow(const char *plainPath);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  static const int NumShards = 16;
+
+  struct Entry {
+    struct stat stbuf;
+    int64_t expires;
+  };
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string, Entry> entries;
+    uint64_t generation;  // bumped on every erase
+  };
+
+  Shard &shardFor(const char *plainPath);
+  // drop expired entries, or everything if that does not make room
+  void makeRoom(Shard &shard, int64_t now);
+
+  Shard _shards[NumShards];
+  size_t _maxShardEntries;
+  int _ttlMs;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  AttrCache(const AttrCache &);             // not allowed
+  AttrCache &operator=(const AttrCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
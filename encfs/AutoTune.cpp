@@ -0,0 +1,269 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "AutoTune.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "CipherKey.h"
+#include "Error.h"
+#include "FSConfig.h"
+#include "OpStats.h"
+#include "autosprintf.h"
+#include "i18n.h"
+
+using gnu::autosprintf;
+using std::cout;
+
+namespace encfs {
+namespace AutoTune {
+
+// bytes each candidate streams
+static const int StreamBytes = 4 * 1024 * 1024;
+// updates at random places in the mix, and their size
+static const int Updates = 1024;
+static const int UpdateBytes = 4096;
+// block sizes tried, those the cipher allows in between
+static const int MinTuneBlock = 1024;
+static const int MaxTuneBlock = 64 * 1024;
+// scratch file of the directory benchmark, in the root of the volume
+static const char ScratchName[] = ".encfs6.autotune";
+
+// what a block costs, in ns
+struct Costs {
+  double encode;
+  double decode;
+  double mac;
+  double write;
+  double read;
+};
+
+static const char *macName(int macBytes, int macAlgorithm) {
+  if (macBytes == 0) {
+    return "";
+  }
+  return macAlgorithm == BlockMAC_SipHash ? ", SipHash MAC" : ", HMAC";
+}
+
+/**
+ * Time coding StreamBytes in blocks of bs bytes, and their MACs when
+ * macBytes > 0.  False if the cipher fails.
+ */
+static bool timeCipher(const std::shared_ptr<Cipher> &cipher,
+                       const CipherKey &key, int bs, int macBytes,
+                       int macAlgorithm, Costs *costs) {
+  int blocks = StreamBytes / bs;
+  int header = cipher->aeadHeaderSize();
+  std::vector<unsigned char> data((size_t)blocks * bs);
+  std::vector<unsigned char> sealed;
+  if (header > 0) {
+    sealed.resize((size_t)blocks * (bs + header));
+  }
+  cipher->randomize(data.data(), (int)data.size(), false);
+
+  uint64_t start = OpStats::now();
+  for (int i = 0; i < blocks; ++i) {
+    unsigned char *block = &data[(size_t)i * bs];
+    bool ok = header > 0
+                  ? cipher->aeadEncode(block, bs, i,
+                                       &sealed[(size_t)i * (bs + header)], key)
+                  : cipher->blockEncode(block, bs, i, key);
+    if (!ok) {
+      return false;
+    }
+  }
+  uint64_t encoded = OpStats::now();
+  for (int i = 0; i < blocks; ++i) {
+    unsigned char *block = &data[(size_t)i * bs];
+    bool ok = header > 0
+                  ? cipher->aeadDecode(&sealed[(size_t)i * (bs + header)], bs,
+                                       i, block, key)
+                  : cipher->blockDecode(block, bs, i, key);
+    if (!ok) {
+      return false;
+    }
+  }
+  uint64_t decoded = OpStats::now();
+  for (int i = 0; macBytes > 0 && i < blocks; ++i) {
+    const unsigned char *block = &data[(size_t)i * bs];
+    if (macAlgorithm == BlockMAC_SipHash) {
+      cipher->FastMAC_64(block, bs, i, key);
+    } else {
+      cipher->MAC_64(block, bs, key);
+    }
+  }
+  uint64_t maced = OpStats::now();
+
+  costs->encode = (double)(encoded - start) / blocks;
+  costs->decode = (double)(decoded - encoded) / blocks;
+  costs->mac = (double)(maced - decoded) / blocks;
+  return true;
+}
+
+/**
+ * Time writing StreamBytes of data to a scratch file in dir, in raw blocks
+ * of rawBlock bytes, syncing it, and reading them back.  False if the
+ * directory can not be written.
+ */
+static bool timeDirectory(const std::string &dir, int dataBlock, int rawBlock,
+                          Costs *costs) {
+  std::string path = dir + ScratchName;
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  int blocks = StreamBytes / dataBlock;
+  std::vector<unsigned char> buf(rawBlock, 0x5a);
+
+  bool ok = true;
+  uint64_t start = OpStats::now();
+  for (int i = 0; ok && i < blocks; ++i) {
+    ok = ::pwrite(fd, buf.data(), rawBlock, (off_t)i * rawBlock) == rawBlock;
+  }
+  ok = ok && ::fsync(fd) == 0;
+  uint64_t written = OpStats::now();
+  for (int i = 0; ok && i < blocks; ++i) {
+    ok = ::pread(fd, buf.data(), rawBlock, (off_t)i * rawBlock) == rawBlock;
+  }
+  uint64_t read = OpStats::now();
+
+  ::close(fd);
+  ::unlink(path.c_str());
+
+  costs->write = (double)(written - start) / blocks;
+  costs->read = (double)(read - written) / blocks;
+  return ok;
+}
+
+// the smallest key size of alg meeting the floor, or 0
+static int keySizeFor(const Cipher::CipherAlgorithm &alg, int floorBits) {
+  for (int size = alg.keyLength.min(); size <= alg.keyLength.max();
+       size += alg.keyLength.inc()) {
+    if (size >= floorBits) {
+      return size;
+    }
+  }
+  return 0;
+}
+
+// the block sizes of alg that are tried
+static std::vector<int> blockSizesFor(const Cipher::CipherAlgorithm &alg) {
+  std::vector<int> sizes;
+  for (int size = MinTuneBlock; size <= MaxTuneBlock; size *= 2) {
+    int bs = alg.blockSize.closest(size);
+    if (sizes.empty() || sizes.back() != bs) {
+      sizes.push_back(bs);
+    }
+  }
+  return sizes;
+}
+
+bool run(const std::string &dir, const Floor &floor, Choice *best) {
+  // xgroup(setup)
+  cout << _("Benchmarking ciphers, block sizes and MACs on this host and "
+            "filesystem...")
+       << "\n";
+
+  // by raw block size, the directory does not care about the cipher
+  std::map<int, Costs> dirCosts;
+  bool found = false;
+
+  Cipher::AlgorithmList algorithms = Cipher::GetAlgorithmList();
+  for (const Cipher::CipherAlgorithm &alg : algorithms) {
+    int keySize = keySizeFor(alg, floor.keySize);
+    if (keySize == 0) {
+      continue;
+    }
+    std::shared_ptr<Cipher> cipher = Cipher::New(alg.name, keySize);
+    // ciphers of 64 bit blocks, or none, fall short of any floor
+    if (!cipher || cipher->cipherBlockSize() < 16) {
+      continue;
+    }
+    int header = cipher->aeadHeaderSize();
+    if (header > 0 && !floor.allowAead) {
+      continue;
+    }
+    std::vector<int> macAlgorithms;
+    if (header == 0 && floor.authenticate) {
+      macAlgorithms = {BlockMAC_HMAC, BlockMAC_SipHash};
+    } else {
+      macAlgorithms = {BlockMAC_HMAC};
+    }
+    CipherKey key = cipher->newRandomKey();
+
+    for (int bs : blockSizesFor(alg)) {
+      for (int macAlgorithm : macAlgorithms) {
+        int macBytes = header == 0 && floor.authenticate ? 8 : 0;
+        Costs costs;
+        if (!timeCipher(cipher, key, bs, macBytes, macAlgorithm, &costs)) {
+          RLOG(WARNING) << "autotune: " << alg.name << " failed to code "
+                        << bs << " byte blocks";
+          break;
+        }
+        int rawBlock = bs + header + macBytes;
+        auto it = dirCosts.find(rawBlock);
+        if (it == dirCosts.end()) {
+          Costs io;
+          if (!timeDirectory(dir, bs, rawBlock, &io)) {
+            cout << autosprintf(_("Unable to benchmark writes to %s"),
+                                dir.c_str())
+                 << "\n";
+            return false;
+          }
+          it = dirCosts.insert(std::make_pair(rawBlock, io)).first;
+        }
+        costs.write = it->second.write;
+        costs.read = it->second.read;
+
+        // a block streamed is written and read back; an update reads,
+        // decodes, encodes and writes every block it touches
+        double perBlock = costs.encode + costs.decode + 2 * costs.mac +
+                          costs.write + costs.read;
+        double touched = (UpdateBytes + bs - 1) / bs;
+        double ns = perBlock * ((double)StreamBytes / bs + Updates * touched);
+        double mbPerSec = (double)(StreamBytes + Updates * UpdateBytes) /
+                          (1024 * 1024) / (ns / 1e9);
+
+        cout << autosprintf(_("  %s, %i bit key, %i byte blocks%s: %.0f MB/s"),
+                            alg.name.c_str(), keySize, bs,
+                            macName(macBytes, macAlgorithm), mbPerSec)
+             << "\n";
+
+        if (!found || mbPerSec > best->mbPerSec) {
+          found = true;
+          best->alg = alg;
+          best->keySize = keySize;
+          best->blockSize = bs;
+          best->macBytes = macBytes;
+          best->macAlgorithm = macAlgorithm;
+          best->mbPerSec = mbPerSec;
+        }
+      }
+    }
+  }
+  cout << "\n";
+  return found;
+}
+
+}  // namespace AutoTune
+}  // namespace encfs
@@ -0,0 +1,48 @@
+#ifndef _AutoTune_incl_
+#define _AutoTune_incl_
+
+#include <string>
+
+#include "Cipher.h"
+
+namespace encfs {
+
+/*
+    --autotune: a short benchmark, on this host and in the directory a new
+    volume goes to, of the ciphers, block sizes and block MACs the volume
+    could be made with, so that createV6Config can propose the fastest
+    configuration that meets a floor rather than a fixed preset.
+
+    Each candidate is timed coding a few MiB of blocks, and the directory
+    writing and reading them back, a block per syscall.  Its score mixes
+    streaming those MiB with updates of 4 KiB at random places, each of
+    which decodes and encodes a whole block, so that the largest block
+    size does not win just for streaming.
+ */
+namespace AutoTune {
+
+// what a proposed configuration must meet
+struct Floor {
+  int keySize;        // bits of key, at least
+  bool authenticate;  // every block authenticated, by the cipher or a MAC
+  bool allowAead;     // ciphers that authenticate blocks may be used
+                      // (not in reverse mode)
+};
+
+struct Choice {
+  Cipher::CipherAlgorithm alg;
+  int keySize;
+  int blockSize;
+  int macBytes;      // block MAC header, 0 when none is needed
+  int macAlgorithm;  // BlockMACAlgorithm of the header
+  double mbPerSec;   // over the benchmark's mix of streaming and updates
+};
+
+// benchmarks every candidate meeting floor, printing a line for each, in
+// the directory dir, and returns the fastest.  False if none could run.
+bool run(const std::string &dir, const Floor &floor, Choice *best);
+
+}  // namespace AutoTune
+}  // namespace encfs
+
+#endif
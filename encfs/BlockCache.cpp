@@ -0,0 +1,460 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BlockCache.h"
+
+#include <cstring>
+#include <limits>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static std::atomic<uint64_t> gNextOwner(1);
+
+// index bucket holding no entry
+static const uint32_t NoEntry = std::numeric_limits<uint32_t>::max();
+// Page::roomPos of a page with no free slot
+static const uint32_t NoRoom = std::numeric_limits<uint32_t>::max();
+
+// smallest slot, partial blocks of less go in one of these
+static const size_t MinSlot = 64;
+// slots per page at most, one bit each in Page::freeMask
+static const int SlotBits = 4;
+static const size_t MaxSlots = 1 << SlotBits;
+// entries looked at for each eviction
+static const int EvictSamples = 8;
+// ranges of up to this many blocks are erased block by block, rather
+// than by a scan of every shard
+static const off_t SmallRange = 16;
+
+static int classOf(size_t len) {
+  int cls = 0;
+  while ((MinSlot << cls) < len) {
+    ++cls;
+  }
+  return cls;
+}
+
+uint64_t BlockCache::newOwner() { return gNextOwner++; }
+
+uint64_t BlockCache::hashOf(const Key &k) {
+  // 64 bit mix of both halves, consecutive blocks of a file must not land
+  // in the same shard
+  uint64_t h = k.owner * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.blockNum;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+int BlockCache::shardsFor(size_t maxBytes, size_t blockSize) {
+  const size_t MaxShards = 16;
+  const size_t ShardBlocks = 4;
+  size_t shards = blockSize > 0 ? maxBytes / (ShardBlocks * blockSize)
+                                : MaxShards;
+  if (shards > MaxShards) {
+    shards = MaxShards;
+  }
+  return shards > 0 ? (int)shards : 1;
+}
+
+BlockCache::BlockCache(size_t maxBytes, int shards)
+    : _shards(shards > 0 ? shards : 1), _hits(0), _misses(0) {
+  _shardBytes = maxBytes / _shards.size();
+  for (Shard &shard : _shards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+    shard.live = 0;
+    shard.bytes = 0;
+    shard.clock = 0;
+    shard.hand = 0;
+  }
+}
+
+BlockCache::~BlockCache() {
+  VLOG(1) << "block cache: " << hits() << " hits, " << misses()
+          << " misses";
+  for (Shard &shard : _shards) {
+    for (uint32_t e = 0; e < shard.lengths.size(); ++e) {
+      if (shard.lengths[e] != 0) {
+        evict(shard, e);
+      }
+    }
+    pthread_mutex_destroy(&shard.mutex);
+  }
+}
+
+BlockCache::Shard &BlockCache::shardFor(uint64_t hash) {
+  return _shards[hash % _shards.size()];
+}
+
+// caller holds the shard lock, and the index is not empty
+size_t BlockCache::findBucket(const Shard &shard, const Key &key,
+                              uint64_t hash) const {
+  size_t mask = shard.index.size() - 1;
+  uint32_t tag = (uint32_t)(hash >> 32);
+  for (size_t i = tag & mask;; i = (i + 1) & mask) {
+    const Bucket &b = shard.index[i];
+    if (b.entry == NoEntry ||
+        (b.hash == tag && shard.owners[b.entry] == key.owner &&
+         shard.blocks[b.entry] == key.blockNum)) {
+      return i;
+    }
+  }
+}
+
+long BlockCache::findEntry(const Shard &shard, const Key &key,
+                           uint64_t hash) const {
+  if (shard.index.empty()) {
+    return -1;
+  }
+  uint32_t entry = shard.index[findBucket(shard, key, hash)].entry;
+  return entry == NoEntry ? -1 : (long)entry;
+}
+
+// caller holds the shard lock
+void BlockCache::growIndex(Shard &shard) {
+  size_t size = shard.index.empty() ? 64 : shard.index.size() * 2;
+  shard.index.assign(size, Bucket{NoEntry, 0});
+  size_t mask = size - 1;
+  for (uint32_t e = 0; e < shard.lengths.size(); ++e) {
+    if (shard.lengths[e] == 0) {
+      continue;
+    }
+    uint32_t tag =
+        (uint32_t)(hashOf(Key{shard.owners[e], shard.blocks[e]}) >> 32);
+    size_t i = tag & mask;
+    while (shard.index[i].entry != NoEntry) {
+      i = (i + 1) & mask;
+    }
+    shard.index[i] = Bucket{e, tag};
+  }
+}
+
+unsigned char *BlockCache::slotData(const Shard &shard,
+                                    uint32_t entry) const {
+  uint32_t slot = shard.slots[entry];
+  const Page &page = shard.pages[slot >> SlotBits];
+  return page.data + (slot & (MaxSlots - 1)) * page.slotSize;
+}
+
+// caller holds the shard lock
+uint32_t BlockCache::allocSlot(Shard &shard, int cls, size_t limit) {
+  if (shard.roomy.size() <= (size_t)cls) {
+    shard.roomy.resize(cls + 1);
+  }
+  size_t slotSize = MinSlot << cls;
+  for (;;) {
+    std::vector<uint32_t> &roomy = shard.roomy[cls];
+    if (!roomy.empty()) {
+      uint32_t p = roomy.back();
+      Page &page = shard.pages[p];
+      int s = __builtin_ctz(page.freeMask);
+      page.freeMask &= ~(1u << s);
+      if (page.freeMask == 0) {
+        roomy.pop_back();
+        page.roomPos = NoRoom;
+      }
+      return p << SlotBits | s;
+    }
+
+    // pages hold a quarter of the budget at most, so that a few sizes in
+    // use do not starve each other
+    size_t slots = limit / (4 * slotSize);
+    if (slots > MaxSlots) {
+      slots = MaxSlots;
+    } else if (slots == 0) {
+      slots = 1;
+    }
+    if (shard.bytes + slots * slotSize > limit && evictOne(shard)) {
+      continue;
+    }
+
+    uint32_t p;
+    if (shard.freePages.empty()) {
+      p = shard.pages.size();
+      shard.pages.push_back(Page());
+    } else {
+      p = shard.freePages.back();
+      shard.freePages.pop_back();
+    }
+    Page &page = shard.pages[p];
+    page.data = new unsigned char[slots * slotSize];
+    page.slotSize = slotSize;
+    page.slots = slots;
+    page.freeMask = (uint16_t)((1u << slots) - 1);
+    page.roomPos = roomy.size();
+    roomy.push_back(p);
+    shard.bytes += slots * slotSize;
+  }
+}
+
+// caller holds the shard lock, and has cleared the slot
+void BlockCache::freeSlot(Shard &shard, uint32_t slot) {
+  uint32_t p = slot >> SlotBits;
+  Page &page = shard.pages[p];
+  std::vector<uint32_t> &roomy = shard.roomy[classOf(page.slotSize)];
+
+  bool wasFull = page.freeMask == 0;
+  page.freeMask |= 1u << (slot & (MaxSlots - 1));
+  if (page.freeMask != (1u << page.slots) - 1) {
+    if (wasFull) {
+      page.roomPos = roomy.size();
+      roomy.push_back(p);
+    }
+    return;
+  }
+
+  // the page is empty, give its memory back
+  if (!wasFull) {
+    uint32_t last = roomy.back();
+    roomy[page.roomPos] = last;
+    shard.pages[last].roomPos = page.roomPos;
+    roomy.pop_back();
+  }
+  shard.bytes -= page.slots * page.slotSize;
+  delete[] page.data;
+  page.data = nullptr;
+  shard.freePages.push_back(p);
+}
+
+// caller holds the shard lock
+void BlockCache::evict(Shard &shard, uint32_t entry) {
+  Key key = {shard.owners[entry], shard.blocks[entry]};
+
+  // take the bucket out, shifting back those of the same probe run that
+  // could have gone in it
+  size_t mask = shard.index.size() - 1;
+  size_t i = findBucket(shard, key, hashOf(key));
+  for (size_t j = (i + 1) & mask; shard.index[j].entry != NoEntry;
+       j = (j + 1) & mask) {
+    size_t home = shard.index[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      shard.index[i] = shard.index[j];
+      i = j;
+    }
+  }
+  shard.index[i].entry = NoEntry;
+
+  auto owner = shard.ownerBlocks.find(key.owner);
+  if (owner != shard.ownerBlocks.end() && --owner->second == 0) {
+    shard.ownerBlocks.erase(owner);
+  }
+
+  memset(slotData(shard, entry), 0, shard.lengths[entry]);
+  freeSlot(shard, shard.slots[entry]);
+  shard.lengths[entry] = 0;
+  shard.freeEntries.push_back(entry);
+  --shard.live;
+}
+
+// caller holds the shard lock
+bool BlockCache::evictOne(Shard &shard) {
+  if (shard.live == 0) {
+    return false;
+  }
+  uint32_t entries = shard.lengths.size();
+  if (shard.hand >= entries) {
+    shard.hand = 0;
+  }
+  long oldest = -1;
+  for (int seen = 0; seen < EvictSamples && seen < (long)shard.live;) {
+    uint32_t e = shard.hand;
+    shard.hand = e + 1 < entries ? e + 1 : 0;
+    if (shard.lengths[e] == 0) {
+      continue;
+    }
+    ++seen;
+    if (oldest < 0 || shard.stamps[e] < shard.stamps[oldest]) {
+      oldest = e;
+    }
+  }
+  evict(shard, oldest);
+  return true;
+}
+
+ssize_t BlockCache::get(uint64_t owner, off_t blockNum, unsigned char *out,
+                        size_t len) {
+  Key key = {owner, blockNum};
+  uint64_t hash = hashOf(key);
+  Shard &shard = shardFor(hash);
+
+  Lock lock(shard.mutex);
+  long e = findEntry(shard, key, hash);
+  if (e < 0) {
+    ++_misses;
+    return -1;
+  }
+  ++_hits;
+
+  shard.stamps[e] = ++shard.clock;
+  if (shard.lengths[e] < len) {
+    len = shard.lengths[e];
+  }
+  memcpy(out, slotData(shard, e), len);
+  return len;
+}
+
+void BlockCache::put(uint64_t owner, off_t blockNum,
+                     const unsigned char *data, size_t dataLen) {
+  Key key = {owner, blockNum};
+  uint64_t hash = hashOf(key);
+  Shard &shard = shardFor(hash);
+  int cls = classOf(dataLen);
+  size_t limit = _shardBytes;
+
+  Lock lock(shard.mutex);
+  long e = findEntry(shard, key, hash);
+  if (e >= 0) {
+    if (dataLen != 0 && classOf(shard.lengths[e]) == cls) {
+      // same slot size, replace in place
+      unsigned char *slot = slotData(shard, e);
+      if (dataLen < shard.lengths[e]) {
+        memset(slot + dataLen, 0, shard.lengths[e] - dataLen);
+      }
+      memcpy(slot, data, dataLen);
+      shard.lengths[e] = dataLen;
+      shard.stamps[e] = ++shard.clock;
+      return;
+    }
+    evict(shard, e);
+  }
+  if (dataLen == 0 || (MinSlot << cls) > limit) {
+    return;
+  }
+
+  uint32_t slot = allocSlot(shard, cls, limit);
+  uint32_t entry;
+  if (shard.freeEntries.empty()) {
+    entry = shard.lengths.size();
+    shard.owners.push_back(0);
+    shard.blocks.push_back(0);
+    shard.lengths.push_back(0);
+    shard.stamps.push_back(0);
+    shard.slots.push_back(0);
+  } else {
+    entry = shard.freeEntries.back();
+    shard.freeEntries.pop_back();
+  }
+  shard.owners[entry] = owner;
+  shard.blocks[entry] = blockNum;
+  shard.lengths[entry] = dataLen;
+  shard.stamps[entry] = ++shard.clock;
+  shard.slots[entry] = slot;
+  memcpy(slotData(shard, entry), data, dataLen);
+  ++shard.live;
+  ++shard.ownerBlocks[owner];
+
+  // keep the index at most 3/4 full, so probe runs stay short
+  if (shard.live * 4 > shard.index.size() * 3) {
+    growIndex(shard);
+  } else {
+    shard.index[findBucket(shard, key, hash)] =
+        Bucket{entry, (uint32_t)(hash >> 32)};
+  }
+}
+
+bool BlockCache::contains(uint64_t owner, off_t blockNum) {
+  Key key = {owner, blockNum};
+  uint64_t hash = hashOf(key);
+  Shard &shard = shardFor(hash);
+
+  Lock lock(shard.mutex);
+  return findEntry(shard, key, hash) >= 0;
+}
+
+bool BlockCache::holds(uint64_t owner, off_t blockNum,
+                       const unsigned char *data, size_t len) {
+  Key key = {owner, blockNum};
+  uint64_t hash = hashOf(key);
+  Shard &shard = shardFor(hash);
+
+  Lock lock(shard.mutex);
+  long e = findEntry(shard, key, hash);
+  return e >= 0 && shard.lengths[e] == len &&
+         memcmp(slotData(shard, e), data, len) == 0;
+}
+
+void BlockCache::erase(uint64_t owner, off_t blockNum) {
+  Key key = {owner, blockNum};
+  uint64_t hash = hashOf(key);
+  Shard &shard = shardFor(hash);
+
+  Lock lock(shard.mutex);
+  long e = findEntry(shard, key, hash);
+  if (e >= 0) {
+    evict(shard, e);
+  }
+}
+
+void BlockCache::eraseFrom(uint64_t owner, off_t blockNum) {
+  eraseRange(owner, blockNum, std::numeric_limits<off_t>::max());
+}
+
+void BlockCache::eraseRange(uint64_t owner, off_t fromBlock,
+                            off_t toBlock) {
+  if (fromBlock >= toBlock) {
+    return;
+  }
+  if (fromBlock >= 0 && toBlock - fromBlock <= SmallRange) {
+    for (off_t block = fromBlock; block < toBlock; ++block) {
+      erase(owner, block);
+    }
+    return;
+  }
+
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    if (shard.ownerBlocks.count(owner) == 0) {
+      continue;
+    }
+    for (uint32_t e = 0; e < shard.lengths.size(); ++e) {
+      if (shard.lengths[e] != 0 && shard.owners[e] == owner &&
+          shard.blocks[e] >= fromBlock && shard.blocks[e] < toBlock) {
+        evict(shard, e);
+      }
+    }
+  }
+}
+
+uint64_t BlockCache::hits() const { return _hits; }
+
+uint64_t BlockCache::misses() const { return _misses; }
+
+size_t BlockCache::bytesUsed() const {
+  size_t total = 0;
+  for (const Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    total += shard.bytes;
+  }
+  return total;
+}
+
+void BlockCache::setMaxBytes(size_t maxBytes) {
+  size_t limit = maxBytes / _shards.size();
+  _shardBytes = limit;
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    while (shard.bytes > limit && evictOne(shard)) {
+    }
+  }
+}
+
+size_t BlockCache::maxBytes() const { return _shardBytes * _shards.size(); }
+
+}  // namespace encfs
@@ -0,0 +1,157 @@
+#ifndef _BlockCache_incl_
+#define _BlockCache_incl_
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+namespace encfs {
+
+/*
+    LRU cache of decoded file blocks, shared by every BlockFileIO of a
+    filesystem so that all open files draw on one memory budget.
+
+    Entries are keyed by (owner, blockNum), where owner is a number handed
+    out by newOwner() to each BlockFileIO and never reused.  Keys are spread
+    over a number of shards, each with its own lock, so that readers of
+    different files rarely contend.
+
+    A shard keeps no node per block: the metadata of its entries is held
+    column by column in flat arrays indexed by entry number, found through
+    an open addressing table, and block data lives in slots of a few large
+    pages, so that lookups and evictions touch a handful of cache lines
+    even with hundreds of thousands of blocks cached.  The least recently
+    used of a sample of entries is dropped first, by its use stamp.
+
+    Cached data is cleared before its memory is released.
+ */
+class BlockCache {
+ public:
+  // maxBytes is the budget for the pages holding cached block data, split
+  // evenly over shards
+  BlockCache(size_t maxBytes, int shards = 16);
+  ~BlockCache();
+
+  static uint64_t newOwner();
+
+  // shards to split maxBytes over so that each still holds a few blocks of
+  // blockSize bytes, at most 16
+  static int shardsFor(size_t maxBytes, size_t blockSize);
+
+  // copy up to len bytes of a cached block to out.  Returns the number of
+  // bytes copied, or -1 if the block is not cached.
+  ssize_t get(uint64_t owner, off_t blockNum, unsigned char *out,
+              size_t len);
+
+  // store dataLen bytes as the content of a block, replacing any previous
+  // entry.  Blocks larger than a shard's budget are not cached.
+  void put(uint64_t owner, off_t blockNum, const unsigned char *data,
+           size_t dataLen);
+
+  // true if the block is cached.  Does not count as a hit or miss, nor
+  // change the block's LRU position.
+  bool contains(uint64_t owner, off_t blockNum);
+  // true if the block is cached with exactly the len bytes of data.  Like
+  // contains(), not a hit or miss.
+  bool holds(uint64_t owner, off_t blockNum, const unsigned char *data,
+             size_t len);
+
+  void erase(uint64_t owner, off_t blockNum);
+  // drop every block of owner from blockNum onwards
+  void eraseFrom(uint64_t owner, off_t blockNum);
+  // drop the blocks of owner in [fromBlock, toBlock)
+  void eraseRange(uint64_t owner, off_t fromBlock, off_t toBlock);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+  // bytes of pages held, including their free slots
+  size_t bytesUsed() const;
+
+  // changes the budget, dropping the least recently used blocks past it
+  void setMaxBytes(size_t maxBytes);
+  size_t maxBytes() const;
+
+ private:
+  struct Key {
+    uint64_t owner;
+    off_t blockNum;
+  };
+  static uint64_t hashOf(const Key &key);
+
+  // a bucket of the index: an entry number and the upper half of its
+  // key's hash, compared before the key itself
+  struct Bucket {
+    uint32_t entry;
+    uint32_t hash;
+  };
+
+  // slots of one size carved out of one allocation
+  struct Page {
+    unsigned char *data;  // null once released
+    uint32_t slotSize;
+    uint16_t slots;
+    uint16_t freeMask;  // bit set per free slot
+    uint32_t roomPos;   // place in the shard's roomy list of its size
+  };
+
+  struct Shard {
+    mutable pthread_mutex_t mutex;
+
+    // entry metadata, one array per field.  length 0 is a free entry.
+    std::vector<uint64_t> owners;
+    std::vector<off_t> blocks;
+    std::vector<uint32_t> lengths;
+    std::vector<uint64_t> stamps;  // value of clock at last use
+    std::vector<uint32_t> slots;   // page << SlotBits | slot in page
+    std::vector<uint32_t> freeEntries;
+    size_t live;
+
+    std::vector<Bucket> index;  // size is a power of two
+
+    std::vector<Page> pages;
+    std::vector<uint32_t> freePages;
+    // per slot size class, pages with at least one free slot
+    std::vector<std::vector<uint32_t>> roomy;
+
+    // number of entries per owner, so eraseRange can skip shards
+    std::unordered_map<uint64_t, size_t> ownerBlocks;
+    size_t bytes;  // of pages held
+    uint64_t clock;
+    uint32_t hand;  // where the next eviction sample starts
+  };
+
+  Shard &shardFor(uint64_t hash);
+  // index bucket of key, or of the free bucket it would go in
+  size_t findBucket(const Shard &shard, const Key &key,
+                    uint64_t hash) const;
+  void growIndex(Shard &shard);
+  // entry of key, or -1
+  long findEntry(const Shard &shard, const Key &key, uint64_t hash) const;
+  unsigned char *slotData(const Shard &shard, uint32_t entry) const;
+
+  // a free slot of size class cls, evicting entries to make room within
+  // limit.  Returns the slot reference.
+  uint32_t allocSlot(Shard &shard, int cls, size_t limit);
+  void freeSlot(Shard &shard, uint32_t slot);
+
+  void evict(Shard &shard, uint32_t entry);
+  // drops the least recently used of a sample of entries, false if the
+  // shard is empty
+  bool evictOne(Shard &shard);
+
+  std::vector<Shard> _shards;
+  std::atomic<size_t> _shardBytes;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  BlockCache(const BlockCache &);             // not allowed
+  BlockCache &operator=(const BlockCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -1,12 +1,20 @@
 #include "BlockFileIO.h"
+#include <algorithm>
 
+#include <cerrno>
+#include <climits>
 #include <cstring> // for memset, memcpy, NULL
+#include <ctime>
+#include <unistd.h>
+#include <vector>
                    
 #include "Error.h" 
-#include "FSconfig.h"   // for FSConfigPtr
+#include "FSConfig.h"   // for FSConfigPtr
 #include "FileIO.h"     // for IORequest, FileIO
 #include "FileUtils.h"  // for Encfs_Opts;
-#include "MemoryPool.h" // for MemBlock, release, allocation
+#include "MemoryPool.h" // for PoolBlock
+#include "Mutex.h"      // for Lock
+#include "Probes.h"
 
 namespace encfs {
 
@@ -15,21 +23,356 @@ inline Type min(Type A, Type B) {
   return (B < A) ? B : A;
 }
 
-static void clearCache(IORequest& req, unsigned int blockSize) {
-  memset(req.data, 0, blockSize);
-  req.dataLen = 0;
-}
-
-BlockFileIO::BlockFileIO(unsigned int blockSize, const FSConfigPtr& cfg)
-  : _blockSize(blockSize), _allowHoles(cfg->config->config->allowHoles) {
-  CHEKC(_blockSize > 1);
-  _cache.data = new unsigned char[_blockSize];
+BlockFileIO::BlockFileIO(unsigned int blockSize, const FSConfigPtr& cfg,
+                         int statsLayer)
+  : _blockSize(blockSize), _blocks(blockSize),
+    _allowHoles(cfg->config->allowHoles),
+    _headroom(0), _cacheOwner(BlockCache::newOwner()),
+    _revalidate(cfg->reverseEncryption),
+    _revalidateMs(cfg->opts->reverseCheckMs), _haveStamp(false),
+    _stampTime(0), _skipUnchanged(false), _skippedBlocks(0),
+    _readAheadBlocks(0), _readAheadLimit(0), _dropBehind(false),
+    _lastReadEnd(-1), _sequentialReads(0), _readAheadEnd(0),
+    _tailBlock(-1), _tailLen(0), _cacheGeneration(0),
+    _statsLayer(statsLayer) {
+  CHECK(_blockSize > 1);
+  pthread_mutex_init(&_readAheadMutex, nullptr);
+  pthread_mutex_init(&_stampMutex, nullptr);
   _noCache = cfg->opts->noCache;
+  _writePool = cfg->writePool;
+  if (!_noCache) {
+    _cache = cfg->blockCache;
+    _readAheadPool = cfg->readAheadPool;
+    _skipUnchanged = cfg->opts->skipUnchanged;
+    // with large blocks, a window of the usual length would push
+    // everything else out of the cache
+    long maxBlocks = cfg->opts->blockCacheSize / 4 / (long)_blockSize;
+    _readAheadLimit = (int)min(maxBlocks, (long)INT_MAX);
+    setReadAhead(cfg->opts->readAheadBlocks);
+  }
 }
 
 BlockFileIO::~BlockFileIO() {
-  clearCache(_cache, _blockSize);
-  delete[] _cache.data;
+  if (_skippedBlocks != 0) {
+    VLOG(1) << "skipped rewriting " << _skippedBlocks << " unchanged blocks";
+  }
+  if (_cache) {
+    _cache->eraseFrom(_cacheOwner, 0);
+  }
+  dropTail();
+  pthread_mutex_destroy(&_stampMutex);
+  pthread_mutex_destroy(&_readAheadMutex);
+}
+
+void BlockFileIO::setReadAhead(int blocks) {
+  _readAheadBlocks = min(blocks, _readAheadLimit);
+}
+
+void BlockFileIO::setDropBehind(bool drop) {
+  _dropBehind = drop;
+}
+
+void BlockFileIO::setPageSink(PageStore store, PageDrop drop) {
+  Lock lock(_readAheadMutex);
+  _pageStore = std::move(store);
+  _pageDrop = std::move(drop);
+}
+
+void BlockFileIO::disableCache() {
+  if (_cache) {
+    _cache->eraseFrom(_cacheOwner, 0);
+    _cache.reset();
+  }
+  _readAheadLimit = 0;
+  _readAheadBlocks = 0;
+}
+
+// no prefetch started before this may cache anything
+void BlockFileIO::invalidateData(off_t offset, size_t len) {
+  off_t firstBlock = offset / _blockSize;
+  off_t lastBlock = (offset + (off_t)len + _blockSize - 1) / _blockSize;
+  if (_cache) {
+    _cache->eraseRange(_cacheOwner, firstBlock, lastBlock);
+  }
+  dropTail(firstBlock);
+  invalidateReadAhead();
+}
+
+void BlockFileIO::invalidateReadAhead() {
+  Lock lock(_readAheadMutex);
+  ++_cacheGeneration;
+}
+
+static int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool sameVersion(const struct stat& a, const struct stat& b) {
+#if defined(__APPLE__)
+  const struct timespec& am = a.st_mtimespec;
+  const struct timespec& bm = b.st_mtimespec;
+  const struct timespec& ac = a.st_ctimespec;
+  const struct timespec& bc = b.st_ctimespec;
+#else
+  const struct timespec& am = a.st_mtim;
+  const struct timespec& bm = b.st_mtim;
+  const struct timespec& ac = a.st_ctim;
+  const struct timespec& bc = b.st_ctim;
+#endif
+  return a.st_ino == b.st_ino && a.st_size == b.st_size &&
+         am.tv_sec == bm.tv_sec && am.tv_nsec == bm.tv_nsec &&
+         ac.tv_sec == bc.tv_sec && ac.tv_nsec == bc.tv_nsec;
+}
+
+void BlockFileIO::revalidateCache() const {
+  int64_t now = monotonicMs();
+  Lock lock(_stampMutex);
+  if (_haveStamp && now - _stampTime < _revalidateMs) {
+    return;
+  }
+
+  struct stat stbuf;
+  memset(&stbuf, 0, sizeof(stbuf));
+  bool ok = (getAttr(&stbuf) == 0);
+  if (ok && _haveStamp && sameVersion(stbuf, _stamp)) {
+    _stampTime = now;
+    return;
+  }
+
+  if (_haveStamp) {
+    VLOG(1) << "source file changed, dropping cached blocks";
+    // nor may prefetches started before the change cache their data
+    const_cast<BlockFileIO*>(this)->invalidateReadAhead();
+    _cache->eraseFrom(_cacheOwner, 0);
+  }
+  _haveStamp = ok;
+  _stamp = stbuf;
+  _stampTime = now;
+}
+
+/**
+ * Track the access pattern and, once there have been a few back to back
+ * reads, keep the _readAheadBlocks blocks after the current position
+ * queued for prefetching.  The window is topped up when half of it has
+ * been read.
+ */
+void BlockFileIO::readAhead(const IORequest& req) const {
+  int window = _readAheadBlocks;
+  off_t fromBlock;
+  off_t windowEnd;
+  uint64_t generation;
+  {
+    // concurrent readers of the file come through here together
+    Lock lock(_readAheadMutex);
+    if (req.offset == _lastReadEnd) {
+      ++_sequentialReads;
+    } else {
+      _sequentialReads = 0;
+      _readAheadEnd = 0;
+    }
+    _lastReadEnd = req.offset + req.dataLen;
+
+    if (_sequentialReads < 2) {
+      return;
+    }
+
+    off_t nextBlock = _lastReadEnd / _blockSize;
+    windowEnd = nextBlock + window;
+    fromBlock = _readAheadEnd > nextBlock ? _readAheadEnd : nextBlock;
+    if (windowEnd - fromBlock < (window + 1) / 2) {
+      return;
+    }
+    _readAheadEnd = windowEnd;
+    generation = _cacheGeneration;
+  }
+
+  std::shared_ptr<const BlockFileIO> self;
+  try {
+    self = std::static_pointer_cast<const BlockFileIO>(shared_from_this());
+  } catch (const std::bad_weak_ptr&) {
+    // not owned by a shared_ptr, nothing can keep us alive for the job
+    return;
+  }
+
+  _readAheadPool->submit(
+      [self, fromBlock, windowEnd, generation]() {
+        self->prefetch(fromBlock, windowEnd, generation);
+      },
+      ThreadPool::Background);
+}
+
+void BlockFileIO::prefetchStart(int blocks) const {
+  if (blocks <= 0 || !_readAheadPool || !_cache) {
+    return;
+  }
+  uint64_t generation;
+  {
+    Lock lock(_readAheadMutex);
+    generation = _cacheGeneration;
+  }
+
+  std::shared_ptr<const BlockFileIO> self;
+  try {
+    self = std::static_pointer_cast<const BlockFileIO>(shared_from_this());
+  } catch (const std::bad_weak_ptr&) {
+    return;
+  }
+
+  _readAheadPool->submit(
+      [self, blocks, generation]() { self->prefetch(0, blocks, generation); },
+      ThreadPool::Background);
+}
+
+// largest run of decoded blocks handed to a page sink at once
+static const size_t PushRunBytes = 128 * 1024;
+
+/**
+ * Runs on the read-ahead pool: decode blocks [fromBlock, toBlock) into the
+ * cache, skipping those already there.  Stops at end of file, on error, and
+ * as soon as a write or truncate makes the job's generation stale.
+ *
+ * With a page sink, the blocks decoded are gathered into runs for it as
+ * well.  A block already cached breaks the run: it was pushed by the job
+ * that cached it, or read by the kernel.
+ */
+void BlockFileIO::prefetch(off_t fromBlock, off_t toBlock,
+                           uint64_t generation) const {
+  PoolBlock mb(_headroom + _blockSize);
+  IORequest req;
+  req.data = mb.data() + _headroom;
+  req.headroom = _headroom;
+
+  PageStore store;
+  PageDrop drop;
+  {
+    Lock lock(_readAheadMutex);
+    store = _pageStore;
+    drop = _pageDrop;
+  }
+  std::vector<unsigned char> run;
+  off_t runOffset = 0;  // of run[0] in the file
+  if (store) {
+    run.reserve(PushRunBytes + _blockSize);
+  }
+
+  // have the backing file read the whole window in while we decode
+  advise(fromBlock * _blockSize, (toBlock - fromBlock) * _blockSize,
+         Advice::WillNeed);
+
+  bool stale = false;
+  for (off_t blockNum = fromBlock; blockNum < toBlock; ++blockNum) {
+    {
+      Lock lock(_readAheadMutex);
+      if (_cacheGeneration != generation) {
+        stale = true;
+        break;
+      }
+    }
+    if (_cache->contains(_cacheOwner, blockNum)) {
+      if (!run.empty()) {
+        if (pushPages(store, drop, runOffset, run.data(), run.size(), false,
+                      generation) < 0) {
+          stale = true;
+        }
+        memset(run.data(), 0, run.size());
+        run.clear();
+        if (stale) {
+          break;
+        }
+      }
+      continue;
+    }
+
+    req.offset = blockNum * _blockSize;
+    req.dataLen = _blockSize;
+    countIo(OpStats::BlocksRead, 1);
+    ssize_t readSize = readOneBlock(req);
+    if (readSize > 0) {
+      Lock lock(_readAheadMutex);
+      if (_cacheGeneration != generation) {
+        stale = true;
+        break;
+      }
+      _cache->put(_cacheOwner, blockNum, req.data, readSize);
+    }
+    if (store && readSize > 0) {
+      if (run.empty()) {
+        runOffset = req.offset;
+      }
+      run.insert(run.end(), req.data, req.data + readSize);
+    }
+    if (readSize < (ssize_t)_blockSize) {
+      if (!run.empty()) {
+        // a short block ends the file, an error only the run
+        pushPages(store, drop, runOffset, run.data(), run.size(),
+                  readSize >= 0, generation);
+        memset(run.data(), 0, run.size());
+        run.clear();
+      }
+      break;
+    }
+
+    if (store) {
+      if (run.size() >= PushRunBytes) {
+        off_t end = pushPages(store, drop, runOffset, run.data(),
+                              run.size(), false, generation);
+        if (end < 0) {
+          stale = true;
+          break;
+        }
+        // the unaligned rest starts the next run
+        size_t used = (size_t)(end - runOffset);
+        memset(run.data(), 0, used);
+        run.erase(run.begin(), run.begin() + used);
+        runOffset = end;
+      }
+    }
+  }
+  if (!stale && !run.empty()) {
+    pushPages(store, drop, runOffset, run.data(), run.size(), false,
+              generation);
+  }
+
+  memset(mb.data(), 0, _headroom + _blockSize);
+  if (!run.empty()) {
+    memset(run.data(), 0, run.size());
+  }
+}
+
+off_t BlockFileIO::pushPages(const PageStore& store, const PageDrop& drop,
+                             off_t offset, const unsigned char* run,
+                             size_t len, bool atEnd,
+                             uint64_t generation) const {
+  static const off_t pageSize = sysconf(_SC_PAGESIZE);
+  // the kernel only takes whole pages, or the last one of the file
+  off_t start = (offset + pageSize - 1) / pageSize * pageSize;
+  off_t end = offset + (off_t)len;
+  if (!atEnd) {
+    end = end / pageSize * pageSize;
+  }
+  if (end <= start) {
+    return offset;
+  }
+
+  store(start, run + (start - offset), (size_t)(end - start));
+
+  // a write or truncate that came in meanwhile may have found the pages
+  // before we stored over them.  Not dropped under the lock: the kernel
+  // may hold them for a read that needs it.
+  bool stale;
+  {
+    Lock lock(_readAheadMutex);
+    stale = (_cacheGeneration != generation);
+  }
+  if (stale) {
+    if (drop) {
+      drop(start, (size_t)(end - start));
+    }
+    return -1;
+  }
+  return end;
 }
 
 /**
@@ -40,79 +383,239 @@ BlockFileIO::~BlockFileIO() {
  */
 ssize_t BlockFileIO::cacheReadOneBlock (const IORequest& req) const {
   CHECK(req.dataLen <= _blockSize);
-  CHEKC(req.offset % _blockSize == 0);
+  CHECK(req.offset % _blockSize == 0);
 
   /**
-   * we can satisfy the request even if _cache.datalen is too short, because
+   * we can satisfy the request even if the cached block is too short, because
    * we always request a full block during reads. this just means we are
    * in the last block of a file, which may be smaller than the blockSize.
-   * For reverse encryption, the cache must not be used at all, beacuse
-   * the lower file may have changed behind our back
+   * For reverse encryption the lower file may change behind our back, read()
+   * drops the cached blocks when it does (see revalidateCache)
    */
-
-  if ((!_noCache) && (req.offset == _cache.offset) && (_cache.dataLen != 0)) {
-    size_t len = req.dataLen;
-    if (_cache.dataLen < len) {
-      len = _cache.dataLen;
+  off_t blockNum = _blocks.div(req.offset);
+  if (_cache) {
+    ssize_t len = _cache->get(_cacheOwner, blockNum, req.data, req.dataLen);
+    if (len >= 0) {
+      countIo(OpStats::CacheHits, 1);
+      return len;
     }
-    memcpy(req.data, _cache.data, len);
-    return len;
-  }
-  if (_cache.dataLen > 0) {
-    clearCache(_cache, _blockSize);
-
   }
 
-  // cache result of rand - issue reads for full blocks;
+  // issue reads for full blocks, into the caller's buffer if it has room
+  PoolBlock mb;
   IORequest tmp;
   tmp.offset = req.offset;
-  tmp.data = _cache.data;
   tmp.dataLen = _blockSize;
+  if (req.dataLen == _blockSize) {
+    tmp.data = req.data;
+  } else {
+    mb.allocate(_headroom + _blockSize);
+    tmp.data = mb.data() + _headroom;
+    tmp.headroom = _headroom;
+  }
+
+  countIo(OpStats::BlocksRead, 1);
   ssize_t result = readOneBlock(tmp);
   if (result > 0) {
-    _cache.offset = req.offset;
-    _cache.dataLen = result;
+    if (_cache) {
+      _cache->put(_cacheOwner, blockNum, tmp.data, result);
+    }
     if ((size_t)result > req.dataLen) {
       result = req.dataLen;
     }
-    memcpy(req.data, _cache.data, result);
+    if (tmp.data != req.data) {
+      memcpy(req.data, tmp.data, result);
+    }
   }
+
   return result;
 }
 
+bool BlockFileIO::unchanged(off_t blockNum, const unsigned char* data,
+                            size_t len) {
+  if (!_skipUnchanged || !_cache ||
+      !_cache->holds(_cacheOwner, blockNum, data, len)) {
+    return false;
+  }
+  ++_skippedBlocks;
+  return true;
+}
+
 ssize_t BlockFileIO::cacheWriteOneBlock (const IORequest& req) {
-  memcpy(_cache.data, req.data, req.dataLen);
+  off_t blockNum = _blocks.div(req.offset);
+  if (unchanged(blockNum, req.data, req.dataLen)) {
+    return req.dataLen;
+  }
+  invalidateReadAhead();
+
+  // the lower layer encodes in place, so hand it a copy
+  PoolBlock mb(_headroom + _blockSize);
   IORequest tmp;
   tmp.offset = req.offset;
-  tmp.data = _cache.data;
+  tmp.data = mb.data() + _headroom;
   tmp.dataLen = req.dataLen;
+  tmp.headroom = _headroom;
+  memcpy(tmp.data, req.data, req.dataLen);
   ssize_t res = writeOneBlock(tmp);
-  if (res < 0) {
-    clearCache(_cache, _blockSize);
-  } else {
-    memcpY(_cache.data, req.data, req.dataLen);
-    _cache.offset = req.offset;
-    _cache.dataLen = req.dataLen;
+  mb.reset();
+  if (res >= 0) {
+    countIo(OpStats::BlocksWritten, 1);
+  }
+
+  if (res >= 0 && req.dataLen < _blockSize) {
+    keepTail(blockNum, req.data, req.dataLen);
+  } else if (blockNum == _tailBlock) {
+    dropTail();
+  }
+
+  if (_cache) {
+    if (res < 0) {
+      _cache->erase(_cacheOwner, blockNum);
+    } else {
+      _cache->put(_cacheOwner, blockNum, req.data, req.dataLen);
+    }
   }
   return res;
 }
 
+// with --nocache the file may be changed behind our back, so nothing is
+// kept
+void BlockFileIO::keepTail(off_t blockNum, const unsigned char* data,
+                           size_t len) {
+  if (_noCache) {
+    return;
+  }
+  if (!_tail) {
+    _tail.allocate(_blockSize);
+  }
+  memcpy(_tail.data(), data, len);
+  _tailBlock = blockNum;
+  _tailLen = len;
+}
+
+void BlockFileIO::dropTail(off_t fromBlock) {
+  if (_tailBlock >= 0 && _tailBlock >= fromBlock) {
+    memset(_tail.data(), 0, _tailLen);
+    _tailBlock = -1;
+    _tailLen = 0;
+  }
+}
+
+/**
+ * Serve a read request for a run of whole blocks, one block at a time.
+ * Returns the number of bytes read, or -errno in case of failure
+ */
+ssize_t BlockFileIO::readBlocks(const IOVecRequest& req) const {
+  CHECK(req.offset % _blockSize == 0);
+
+  IORequest blockReq;
+  blockReq.offset = req.offset;
+  blockReq.dataLen = _blockSize;
+
+  ssize_t result = 0;
+  for (int i = 0; i < req.iovcnt; ++i) {
+    CHECK(req.iov[i].iov_len % _blockSize == 0);
+    unsigned char* data = (unsigned char*)req.iov[i].iov_base;
+    for (size_t done = 0; done < req.iov[i].iov_len; done += _blockSize) {
+      blockReq.data = data + done;
+      ssize_t readSize = readOneBlock(blockReq);
+      if (readSize < 0) {
+        return readSize;
+      }
+
+      result += readSize;
+      if ((size_t)readSize < _blockSize) {
+        return result;
+      }
+      blockReq.offset += _blockSize;
+    }
+  }
+  return result;
+}
+
+/**
+ * Write a run of whole blocks, one block at a time.
+ * Returns the number of bytes written, or -errno in case of failure
+ */
+ssize_t BlockFileIO::writeBlocks(const IOVecRequest& req) {
+  CHECK(req.offset % _blockSize == 0);
+
+  IORequest blockReq;
+  blockReq.offset = req.offset;
+  blockReq.dataLen = _blockSize;
+
+  for (int i = 0; i < req.iovcnt; ++i) {
+    CHECK(req.iov[i].iov_len % _blockSize == 0);
+    unsigned char* data = (unsigned char*)req.iov[i].iov_base;
+    for (size_t done = 0; done < req.iov[i].iov_len; done += _blockSize) {
+      blockReq.data = data + done;
+      ssize_t res = writeOneBlock(blockReq);
+      if (res < 0) {
+        return res;
+      }
+      blockReq.offset += _blockSize;
+    }
+  }
+  return blockReq.offset - req.offset;
+}
+
+bool BlockFileIO::pipelinesWrites() const { return false; }
+
+ssize_t BlockFileIO::prepareBlocks(const IOVecRequest& req) {
+  (void)req;
+  return 0;
+}
+
+ssize_t BlockFileIO::commitBlocks(const IOVecRequest& req) {
+  return writeBlocks(req);
+}
+
+ssize_t BlockFileIO::read(const IORequest& req) const {
+  ENCFS_PROBE2(block_read_entry, req.offset, req.dataLen);
+  ProbeClock clock(ENCFS_PROBE_ENABLED(block_read_return));
+  ssize_t res = readRequest(req);
+  if (res > 0) {
+    countIo(OpStats::BytesRead, (uint64_t)res);
+  }
+  if (res > 0 && _dropBehind && _cache) {
+    // the blocks this read finished with, including a first one begun
+    // by the read before it
+    off_t first = _blocks.div(req.offset);
+    off_t last = _blocks.div(req.offset + res);
+    _cache->eraseRange(_cacheOwner, first, last);
+    // nor need the backing file's pages of them stay
+    if (last > first) {
+      advise(first * _blockSize, (last - first) * _blockSize,
+             Advice::DontNeed);
+    }
+  }
+  ENCFS_PROBE3(block_read_return, req.offset, res, clock.elapsed());
+  return res;
+}
+
 /**
  * Serve a read requdst of arbitrary size at an arbitrary offset.
  * Stiches together multiple blocks to serve large requests, drops
  * data from the front of the fist block if the requdst is not aligend.
- * Always request aligned data of the size of one block or less from the
- * lower layer.
+ * Runs of blocks that are not cached are read with one readBlocks()
+ * request, with a partial first or last block going through a temporary.
  * Returns the number of  bytes read, or -errno in case of failure
  */
-ssize_t BlockFileIO::read(const IORequest& req) const {
+ssize_t BlockFileIO::readRequest(const IORequest& req) const {
   CHECK(_blockSize != 0);
 
-  int partialOffset = 
-    req.offset % _blockSize; // can be int as _blockSize is int
-  off_t blockNum = req.offset / _blockSize;
+  uint64_t partial;
+  off_t blockNum = _blocks.div(req.offset, &partial);
+  int partialOffset = (int)partial; // can be int as _blockSize is int
   ssize_t result = 0;
 
+  if (_revalidate && _cache) {
+    revalidateCache();
+  }
+  if (_readAheadBlocks > 0 && _readAheadPool && _cache) {
+    readAhead(req);
+  }
+
   if (partialOffset == 0 && req.dataLen <= _blockSize) {
     // read completely within a single block -- can be handled as is by
     // readOneBlock()
@@ -124,7 +627,8 @@ ssize_t BlockFileIO::read(const IORequest& req) const {
 
   // if the request is larger then a block, then request each block
   // individually
-  MemBlock mb;        // in case we need to allocate a temporary block..
+  PoolBlock mb;        // in case we need to allocate a temporary block..
+  PoolBlock tailMb;    // .. and one for the partial end of a run
   IORequest blockReq; // for reuqest we may need to make
   blockReq.dataLen = _blockSize;
   blockReq.data = nullptr;
@@ -133,15 +637,91 @@ ssize_t BlockFileIO::read(const IORequest& req) const {
   while (size != 0u) {
     blockReq.offset = blockNum * _blockSize;
 
+    // blocks the rest of the request touches, and how many of those from
+    // here on are not cached
+    size_t blocks = _blocks.divUp(partialOffset + size);
+    size_t runBlocks = 0;
+    while (runBlocks < blocks &&
+           !(_cache && _cache->contains(_cacheOwner, blockNum + runBlocks))) {
+      ++runBlocks;
+    }
+
+    if (runBlocks >= 2) {
+      size_t runBytes = runBlocks * _blockSize;
+      size_t wanted = min(runBytes - (size_t)partialOffset, size);
+      // start of the run's last block in the output
+      size_t tailStart = runBytes - _blockSize - partialOffset;
+      bool headTmp = partialOffset != 0;
+      bool tailTmp = wanted - tailStart < _blockSize;
+
+      struct iovec iov[3];
+      int iovcnt = 0;
+      if (headTmp) {
+        if (!mb) {
+          mb.allocate(_blockSize);
+        }
+        iov[iovcnt].iov_base = mb.data();
+        iov[iovcnt++].iov_len = _blockSize;
+      }
+      size_t directBlocks = runBlocks - (headTmp ? 1 : 0) - (tailTmp ? 1 : 0);
+      if (directBlocks > 0) {
+        iov[iovcnt].iov_base = out + (headTmp ? _blockSize - partialOffset : 0);
+        iov[iovcnt++].iov_len = directBlocks * _blockSize;
+      }
+      if (tailTmp) {
+        if (!tailMb) {
+          tailMb.allocate(_blockSize);
+        }
+        iov[iovcnt].iov_base = tailMb.data();
+        iov[iovcnt++].iov_len = _blockSize;
+      }
+
+      IOVecRequest runReq;
+      runReq.offset = blockReq.offset;
+      runReq.iov = iov;
+      runReq.iovcnt = iovcnt;
+
+      countIo(OpStats::BlocksRead, runBlocks);
+      ssize_t readSize = readBlocks(runReq);
+      if (readSize < 0) {
+        result = readSize;
+        break;
+      }
+
+      // bytes of the request the run delivered
+      size_t got = 0;
+      if (readSize > partialOffset) {
+        got = min((size_t)readSize - (size_t)partialOffset, wanted);
+      }
+      if (headTmp && got > 0) {
+        memcpy(out, mb.data() + partialOffset,
+               min((size_t)_blockSize - (size_t)partialOffset, got));
+      }
+      if (tailTmp && got > tailStart) {
+        memcpy(out + tailStart, tailMb.data(), got - tailStart);
+      }
+
+      result += got;
+      size -= got;
+      out += got;
+      blockNum += runBlocks;
+      partialOffset = 0;
+
+      if ((size_t)readSize < runBytes) {
+        break;
+      }
+      continue;
+    }
+
     // if we're reading a full block, then read directly into the
     // result buffer instead of using a temporary
     if (partialOffset == 0 && size >= _blockSize) {
       blockReq.data = out;
     } else {
-      if (mb.data == nullptr) {
-        mb = MemoryPool::allocate(_blockSize);
+      if (!mb) {
+        mb.allocate(_blockSize);
       }
-      blockReq.data = mb.data;
+      blockReq.data = mb.data();
     }
     
     ssize_t readSize = cacheReadOneBlock(blockReq);
@@ -154,7 +734,7 @@ ssize_t BlockFileIO::read(const IORequest& req) const {
     }
 
     size_t cpySize = min((size_t) readSize - (size_t)partialOffset, size);
-    CHECK(cpysize <= (size_t)readSize);
+    CHECK(cpySize <= (size_t)readSize);
 
     if (blockReq.data != out) {
       memcpy(out, blockReq.data + partialOffset, cpySize);
@@ -170,16 +750,255 @@ ssize_t BlockFileIO::read(const IORequest& req) const {
       break;
     }
   }
-  if (mb.data != nullptr) {
-    MemoryPool::release(mb);
-  }
   return result;
 }
 
+// full block runs written with one writeBlocks() request are copied to a
+// temporary for encoding, this bounds its size: a whole 1 MiB request
+// goes down as one run
+static const size_t MaxWriteRunBytes = 1024 * 1024;
+// the runs of a pipelined write, small enough for several of them to be
+// in flight within one request
+static const size_t PipelineRunBytes = 128 * 1024;
+
+/**
+ * Write `blocks` temporary blocks from buf with one writeBlocks() request.
+ * Each block sits _headroom bytes after the start of its slot of
+ * _headroom + _blockSize bytes, which is scratch space for the lower
+ * layer.  The data is encoded in place.
+ */
+ssize_t BlockFileIO::writeRun(off_t blockNum, size_t blocks,
+                              unsigned char* buf) {
+  std::vector<struct iovec> iov;
+  ssize_t res = writeBlocks(runRequest(blockNum, blocks, buf, &iov));
+  if (res >= 0) {
+    countIo(OpStats::BlocksWritten, blocks);
+  }
+  return res;
+}
+
+IOVecRequest BlockFileIO::runRequest(off_t blockNum, size_t blocks,
+                                     unsigned char* buf,
+                                     std::vector<struct iovec>* iov) const {
+  iov->resize(_headroom != 0 ? blocks : 1);
+  if (_headroom == 0) {
+    (*iov)[0].iov_base = buf;
+    (*iov)[0].iov_len = blocks * _blockSize;
+  } else {
+    size_t stride = _headroom + _blockSize;
+    for (size_t i = 0; i < blocks; ++i) {
+      (*iov)[i].iov_base = buf + i * stride + _headroom;
+      (*iov)[i].iov_len = _blockSize;
+    }
+  }
+
+  IOVecRequest runReq;
+  runReq.offset = blockNum * _blockSize;
+  runReq.iov = iov->data();
+  runReq.iovcnt = (int)iov->size();
+  runReq.headroom = _headroom;
+  return runReq;
+}
+
+// the run of a pipelined write being stored by the write pool
+struct PendingRun {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool busy;
+  ssize_t res;  // first error of a stored run, or 0
+};
+
+/**
+ * Write `blocks` whole blocks from data in runs of PipelineRunBytes.  Each
+ * run is copied into one of two buffers and encoded by the caller while
+ * the write pool stores the run before it with one commitBlocks() request,
+ * so that coding and backing I/O overlap.  Keeps the cache in step like
+ * cacheWriteChanged().
+ * Returns the number of bytes written, or -errno in case of failure
+ */
+ssize_t BlockFileIO::writePipelined(off_t blockNum, size_t blocks,
+                                    const unsigned char* data) {
+  invalidateReadAhead();
+
+  size_t maxBlocks = PipelineRunBytes / _blockSize;
+  if (maxBlocks < 2) {
+    maxBlocks = 2;
+  }
+  size_t stride = _headroom + _blockSize;
+  PoolBlock slot[2];
+  std::vector<struct iovec> iov[2];
+
+  PendingRun pending;
+  pthread_mutex_init(&pending.mutex, nullptr);
+  pthread_cond_init(&pending.cond, nullptr);
+  pending.busy = false;
+  pending.res = 0;
+
+  ssize_t res = 0;
+  size_t done = 0;
+  for (int k = 0; done < blocks; k ^= 1) {
+    // the run that used this slot before was stored before the one in
+    // flight was handed on
+    size_t n = min(blocks - done, maxBlocks);
+    if (!slot[k]) {
+      slot[k].allocate((int)(maxBlocks * stride));
+    }
+    unsigned char* buf = slot[k].data();
+    for (size_t i = 0; i < n; ++i) {
+      memcpy(buf + i * stride + _headroom, data + (done + i) * _blockSize,
+             _blockSize);
+    }
+    IOVecRequest runReq = runRequest(blockNum + done, n, buf, &iov[k]);
+    res = prepareBlocks(runReq);
+
+    {
+      Lock lock(pending.mutex);
+      while (pending.busy) {
+        pthread_cond_wait(&pending.cond, &pending.mutex);
+      }
+      if (res >= 0 && pending.res < 0) {
+        res = pending.res;
+      }
+      pending.busy = res >= 0;
+    }
+    if (res < 0) {
+      break;
+    }
+
+    PendingRun* run = &pending;
+    _writePool->submit(
+        [this, run, runReq, n]() {
+          ssize_t stored = commitBlocks(runReq);
+          if (stored >= 0) {
+            countIo(OpStats::BlocksWritten, n);
+          }
+          Lock lock(run->mutex);
+          if (stored < 0) {
+            run->res = stored;
+          }
+          run->busy = false;
+          pthread_cond_signal(&run->cond);
+        },
+        ThreadPool::Write);
+    done += n;
+  }
+
+  {
+    Lock lock(pending.mutex);
+    while (pending.busy) {
+      pthread_cond_wait(&pending.cond, &pending.mutex);
+    }
+    if (res >= 0 && pending.res < 0) {
+      res = pending.res;
+    }
+  }
+  pthread_cond_destroy(&pending.cond);
+  pthread_mutex_destroy(&pending.mutex);
+  slot[0].reset();
+  slot[1].reset();
+
+  if (_tailBlock >= blockNum && _tailBlock < blockNum + (off_t)blocks) {
+    dropTail();
+  }
+  if (_cache) {
+    // after an error some runs may be stored, forget them all
+    for (size_t i = 0; i < blocks; ++i) {
+      if (res < 0) {
+        _cache->erase(_cacheOwner, blockNum + i);
+      } else {
+        _cache->put(_cacheOwner, blockNum + i, data + i * _blockSize,
+                    _blockSize);
+      }
+    }
+  }
+  if (res < 0) {
+    return res;
+  }
+  return blocks * _blockSize;
+}
+
 /**
+ * Write a run of whole blocks from data with one writeBlocks() request,
+ * keeping the cache in step.  With --skip-unchanged the blocks the cache
+ * already holds as they are are left out, and the runs between them
+ * written each with one request.
  * Returns the number of bytes written, or -errno in case of failure
  */
-ssize_t BlockFileIO::write(const IORequst& req) {
+ssize_t BlockFileIO::cacheWriteBlocks(off_t blockNum, size_t blocks,
+                                      const unsigned char* data) {
+  if (!_skipUnchanged || !_cache) {
+    return cacheWriteChanged(blockNum, blocks, data);
+  }
+
+  // write the runs of changed blocks between the unchanged ones
+  size_t i = 0;
+  while (i < blocks) {
+    if (unchanged(blockNum + i, data + i * _blockSize, _blockSize)) {
+      ++i;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < blocks && !_cache->holds(_cacheOwner, blockNum + end,
+                                          data + end * _blockSize,
+                                          _blockSize)) {
+      ++end;
+    }
+    ssize_t res =
+        cacheWriteChanged(blockNum + i, end - i, data + i * _blockSize);
+    if (res < 0) {
+      return res;
+    }
+    i = end;
+  }
+  return blocks * _blockSize;
+}
+
+ssize_t BlockFileIO::cacheWriteChanged(off_t blockNum, size_t blocks,
+                                       const unsigned char* data) {
+  invalidateReadAhead();
+
+  // the lower layer encodes in place, so hand it a copy
+  size_t stride = _headroom + _blockSize;
+  PoolBlock mb((int)(blocks * stride));
+  for (size_t i = 0; i < blocks; ++i) {
+    memcpy(mb.data() + i * stride + _headroom, data + i * _blockSize,
+           _blockSize);
+  }
+
+  ssize_t res = writeRun(blockNum, blocks, mb.data());
+  mb.reset();
+
+  if (_tailBlock >= blockNum && _tailBlock < blockNum + (off_t)blocks) {
+    dropTail();
+  }
+  if (_cache) {
+    for (size_t i = 0; i < blocks; ++i) {
+      if (res < 0) {
+        _cache->erase(_cacheOwner, blockNum + i);
+      } else {
+        _cache->put(_cacheOwner, blockNum + i, data + i * _blockSize,
+                    _blockSize);
+      }
+    }
+  }
+  return res;
+}
+
+ssize_t BlockFileIO::write(const IORequest& req) {
+  ENCFS_PROBE2(block_write_entry, req.offset, req.dataLen);
+  ProbeClock clock(ENCFS_PROBE_ENABLED(block_write_return));
+  ssize_t res = writeRequest(req);
+  if (res > 0) {
+    countIo(OpStats::BytesWritten, (uint64_t)res);
+  }
+  ENCFS_PROBE3(block_write_return, req.offset, res, clock.elapsed());
+  return res;
+}
+
+/**
+ * Returns the number of bytes written, or -errno in case of failure
+ */
+ssize_t BlockFileIO::writeRequest(const IORequest& req) {
   CHECK(_blockSize != 0);
 
   off_t fileSize = getSize();
@@ -188,13 +1007,13 @@ ssize_t BlockFileIO::write(const IORequst& req) {
   }
 
   // where write request begin
-  off_t blockNum = req.offset / _blockSize;
-  int partialOffset = 
-    req.offset % _blockSize;    // can be int as _blockSize is int
-                                
+  uint64_t partial;
+  off_t blockNum = _blocks.div(req.offset, &partial);
+  int partialOffset = (int)partial; // can be int as _blockSize is int
+
   // last block of file (for testing write overlaps with file boundary)
-  off_t lastFileBlock = fileSize / _blockSize;
-  size_t lastBlockSize = fileSize % _blockSize;
+  uint64_t lastBlockSize;
+  off_t lastFileBlock = _blocks.div(fileSize, &lastBlockSize);
 
   off_t lastNonEmptyBlock = lastFileBlock;
   if (lastBlockSize == 0) {
@@ -223,7 +1042,7 @@ ssize_t BlockFileIO::write(const IORequst& req) {
   }
   
   // have to merge data with existing block(s) ..
-  MemBlock mb;
+  PoolBlock mb;
 
   IORequest blockReq;
   blockReq.data = nullptr;
@@ -236,20 +1055,56 @@ ssize_t BlockFileIO::write(const IORequst& req) {
     blockReq.offset = blockNum * _blockSize;
     size_t toCopy = min((size_t)_blockSize - (size_t)partialOffset, size);
 
+    // several whole blocks, write them with one request
+    if (partialOffset == 0 && size >= 2 * (size_t)_blockSize) {
+      size_t maxBlocks = MaxWriteRunBytes / _blockSize;
+      if (maxBlocks < 2) {
+        maxBlocks = 2;
+      }
+      size_t blocks = (size_t)_blocks.div(size);
+      if (blocks * _blockSize > PipelineRunBytes && _writePool &&
+          pipelinesWrites() && !(_skipUnchanged && _cache)) {
+        // more than one run, encode each while the last is stored
+        res = writePipelined(blockNum, blocks, inPtr);
+      } else {
+        blocks = min(blocks, maxBlocks);
+        res = cacheWriteBlocks(blockNum, blocks, inPtr);
+      }
+      if (res < 0) {
+        break;
+      }
+
+      size -= blocks * _blockSize;
+      inPtr += blocks * _blockSize;
+      blockNum += blocks;
+      continue;
+    }
+
     if ((toCopy == _blockSize) ||
         (partialOffset == 0 && blockReq.offset + (off_t)toCopy >= fileSize)) {
       blockReq.data = inPtr;
       blockReq.dataLen = toCopy;
     } else {
-      if (mb.data = nullptr) {
-        mb = MemoryPool::allocate(_blockSize);
+      if (!mb) {
+        mb.allocate(_blockSize);
       }
-      memset(mb.data, 0, _blockSize);
-      blockReq.data = mb.data;
+      memset(mb.data(), 0, _blockSize);
+      blockReq.data = mb.data();
 
       if (blockNum > lastNonEmptyBlock) {
         blockReq.dataLen = partialOffset + toCopy;
+      } else if (blockNum == _tailBlock && blockNum == lastFileBlock &&
+                 _tailLen == lastBlockSize) {
+        // appending to the block we wrote last, no need to read and
+        // decode it again
+        memcpy(blockReq.data, _tail.data(), _tailLen);
+        blockReq.dataLen = _tailLen;
+        if (partialOffset + toCopy > blockReq.dataLen) {
+          blockReq.dataLen = partialOffset + toCopy;
+        }
       } else {
+        // read, modify and write back
+        countIo(OpStats::PartialWrites, 1);
         blockReq.dataLen = _blockSize;
         ssize_t readSize = cacheReadOneBlock(blockReq);
         if (readSize < 0) {
@@ -278,10 +1133,6 @@ ssize_t BlockFileIO::write(const IORequst& req) {
     partialOffset = 0;
   }
 
-  if (mb.data != nullptr) {
-    MemoryPool::release(mb);
-  }
-
   if (res < 0) {
     return res;
   }
@@ -290,6 +1141,26 @@ ssize_t BlockFileIO::write(const IORequst& req) {
 
 unsigned int BlockFileIO::blockSize() const {return _blockSize;}
 
+/**
+ * Zero test for whole blocks, 32 bytes per step.  Or-ing words together
+ * rather than branching on each byte lets the compiler vectorize the loop.
+ */
+bool BlockFileIO::isZero(const unsigned char* buf, size_t len) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    uint64_t w[4];
+    memcpy(w, buf + i, sizeof(w));
+    if ((w[0] | w[1] | w[2] | w[3]) != 0) {
+      return false;
+    }
+  }
+  unsigned char tail = 0;
+  for (; i < len; ++i) {
+    tail |= buf[i];
+  }
+  return tail == 0;
+}
+
 /**
  * Returns 0 in case of success , or -errno in case of failure
  */
@@ -300,70 +1171,62 @@ int BlockFileIO::padFile(off_t oldSize, off_t newSize, bool forceWrite) {
   ssize_t res = 0;
 
   IORequest req;
-  MemBlock mb;
+  PoolBlock mb;
 
   if (oldLastBlock == newLastBlock) {
     if (forceWrite) {
-      mb = MemoryPool::allocate(_blockSize);
-      req.data = mb.data;
+      mb.allocate(_blockSize);
+      req.data = mb.data();
 
       req.offset = oldLastBlock * _blockSize;
-      req.dataLen = oldsize % _blockSize;
+      req.dataLen = oldSize % _blockSize;
       int outSize = newSize % _blockSize;
 
       if (outSize != 0) {
-        memset(mb.data, 0, outSize);
+        memset(mb.data(), 0, outSize);
         if ((res = cacheReadOneBlock(req)) >= 0) {
           req.dataLen = outSize;
           res = cacheWriteOneBlock(req);
         }
       }
-    } else 
+    } else {
       VLOG(1) << "optimization: not padding last block";
-    else {
-      mb = MemoryPool::allocate(_blockSize);
-      req.data = mb.data;
-
-      // 1. extend the fist block to full length
-      // 2. write the middle empty blocks
-      // 3. wirte the last block
-
-      req.offset = oldLastBlock * _blockSize;
-      req.dataLen = oldSize % _ blockSize;
-
-      // 1. req.dataLen == 0,iff oldSize was already a multiple of blockSize
-      if (req.dataLen != 0) {
-        VLOG(1) << "padding block " << oldLastBlock;
-        memset(mb.data, 0, _blockSize);
-        if ((res = cacheReadOneBlock(req)) >= 0) {
-          req.dataLen = _blockSize;
-          res = cacheWriteOneBlock(req);
-        }
-        ++oldLastBlock;
-      }
-
-      // 2. pad zero blocks unless holes are allowed
-      if (!_allowHoles) {
-        for (; (res >= 0) && (oldLastBlock != newLastBlock); ++ oldLastBlock) {
-          VLOG(1) << "padding block " << oldLastBlock;
-          req.offset = oldLastBlock * _blockSize;
-          req.dataLen = _blockSize;
-          memset(mb.data, 0, req.dataLen);
-          res = cacheWriteOneBlock(req);
-        }
-      }
-      
-      // 3. only neccessary if write is forced and block is non 0 length
-      if ((res >= 0) && forceWrite && (newBlockSize != 0)) {
-        req.offset = newLastBlock * _blockSize;
-        req.dataLen = newBlockSize;
-        memset(mb.data, 0, req.dataLen);
+    }
+  } else {
+    mb.allocate(_blockSize);
+    req.data = mb.data();
+
+    // 1. extend the fist block to full length
+    // 2. write the middle empty blocks
+    // 3. wirte the last block
+
+    req.offset = oldLastBlock * _blockSize;
+    req.dataLen = oldSize % _blockSize;
+
+    // 1. req.dataLen == 0,iff oldSize was already a multiple of blockSize
+    if (req.dataLen != 0) {
+      VLOG(1) << "padding block " << oldLastBlock;
+      memset(mb.data(), 0, _blockSize);
+      if ((res = cacheReadOneBlock(req)) >= 0) {
+        req.dataLen = _blockSize;
         res = cacheWriteOneBlock(req);
       }
+      ++oldLastBlock;
+    }
+
+    // 2. pad zero blocks unless holes are allowed, they are then left as
+    // holes in the base file
+    if (!_allowHoles && res >= 0 && oldLastBlock < newLastBlock) {
+      res = padBlocks(oldLastBlock, newLastBlock);
     }
     
-  if (mb.data != nullptr) {
-    MemoryPool::release(mb);
+    // 3. only neccessary if write is forced and block is non 0 length
+    if ((res >= 0) && forceWrite && (newBlockSize != 0)) {
+      req.offset = newLastBlock * _blockSize;
+      req.dataLen = newBlockSize;
+      memset(mb.data(), 0, req.dataLen);
+      res = cacheWriteOneBlock(req);
+    }
   }
 
   if (res < 0) {
@@ -374,6 +1237,197 @@ int BlockFileIO::padFile(off_t oldSize, off_t newSize, bool forceWrite) {
 }
 
 
+/**
+ * Write encoded zero blocks [fromBlock, toBlock), in runs of whole blocks
+ * so that they are coded as batches and written with few requests.  The
+ * range lies past the old end of file, nothing of it is cached.
+ * Returns 0 in case of success, or -errno in case of failure
+ */
+int BlockFileIO::padBlocks(off_t fromBlock, off_t toBlock) {
+  VLOG(1) << "padding blocks " << fromBlock << " to " << toBlock;
+  invalidateReadAhead();
+  dropTail(fromBlock);
+  if (_cache) {
+    _cache->eraseFrom(_cacheOwner, fromBlock);
+  }
+
+  size_t maxBlocks = MaxWriteRunBytes / _blockSize;
+  if (maxBlocks < 1) {
+    maxBlocks = 1;
+  }
+  size_t stride = _headroom + _blockSize;
+  PoolBlock mb((int)(maxBlocks * stride));
+
+  ssize_t res = 0;
+  while (res >= 0 && fromBlock < toBlock) {
+    size_t blocks = min((size_t)(toBlock - fromBlock), maxBlocks);
+    // the previous run was encoded in place
+    memset(mb.data(), 0, blocks * stride);
+    res = writeRun(fromBlock, blocks, mb.data());
+    fromBlock += blocks;
+  }
+
+  return res < 0 ? (int)res : 0;
+}
+
+off_t BlockFileIO::baseOffset(off_t offset) const { return offset; }
+
+void BlockFileIO::adviseBase(off_t offset, off_t len, Advice advice,
+                             const FileIO* base) const {
+  if (offset == 0 && len == 0) {
+    base->advise(0, 0, advice);
+    return;
+  }
+  off_t start = baseOffset((off_t)_blocks.div(offset) * _blockSize);
+  off_t baseLen = 0;
+  if (len > 0) {
+    off_t end = (off_t)_blocks.divUp(offset + len) * _blockSize;
+    baseLen = baseOffset(end) - start;
+  }
+  base->advise(start, baseLen, advice);
+}
+
+off_t BlockFileIO::seekBase(off_t offset, bool hole,
+                            const FileIO* base) const {
+  if (!_allowHoles) {
+    return FileIO::seekExtent(offset, hole);
+  }
+  off_t size = getSize();
+  if (size < 0) {
+    return size;
+  }
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  if (offset >= size) {
+    return -ENXIO;
+  }
+
+  // blocks lie in base at a fixed stride, after any header of the file
+  off_t first = baseOffset(0);
+  off_t stride = baseOffset(_blockSize) - first;
+  off_t pos = baseOffset(_blocks.div(offset) * _blockSize);
+  for (;;) {
+    off_t found = base->seekExtent(pos, hole);
+    if (found == -ENXIO) {
+      return hole ? size : -ENXIO;
+    }
+    if (found < 0) {
+      return found;
+    }
+    if (!hole) {
+      // the start of the block the data is in
+      off_t at = std::max(offset, (found - first) / stride * _blockSize);
+      return at < size ? at : -ENXIO;
+    }
+
+    // the first block starting in the hole is one if no data follows
+    // within it, else look again past that data
+    off_t plain = (found - first + stride - 1) / stride * _blockSize;
+    if (plain >= size) {
+      return size;
+    }
+    off_t start = baseOffset(plain);
+    off_t data = base->seekExtent(start, false);
+    if (data == -ENXIO || data >= start + stride) {
+      return std::max(offset, plain);
+    }
+    if (data < 0) {
+      return data;
+    }
+    pos = data;
+  }
+}
+
+/**
+ * Returns 0 in case of success, or -errno in case of failure
+ */
+int BlockFileIO::allocateBase(int mode, off_t offset, off_t len,
+                              FileIO* base) {
+  if (offset < 0 || len <= 0) {
+    return -EINVAL;
+  }
+  if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0) {
+    return -EOPNOTSUPP;
+  }
+  bool keepSize = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+
+  off_t size = getSize();
+  if (size < 0) {
+    return size;
+  }
+  off_t end = offset + len;
+
+  if ((mode & FALLOC_FL_PUNCH_HOLE) == 0) {
+    // reserve whole blocks in the base file, then grow the file if asked
+    off_t from = baseOffset(offset / _blockSize * _blockSize);
+    off_t to = baseOffset((end + _blockSize - 1) / _blockSize * _blockSize);
+    int res = base->allocate(FALLOC_FL_KEEP_SIZE, from, to - from);
+    if (res == 0 && !keepSize && end > size) {
+      res = truncate(end);
+    }
+    return res;
+  }
+
+  if (!keepSize) {
+    return -EINVAL;
+  }
+  // a zero block only reads back as zeros when holes are allowed
+  if (!_allowHoles) {
+    return -EOPNOTSUPP;
+  }
+  if (end > size) {
+    end = size;
+  }
+  if (offset >= end) {
+    return 0;
+  }
+
+  // [firstFull, lastFull) are the blocks entirely inside the range.  A
+  // partial last block of the file is never punched: it is shorter than a
+  // block, so its zeros would not be taken for a hole.
+  off_t firstFull = (offset + _blockSize - 1) / _blockSize;
+  off_t lastFull = end / _blockSize;
+
+  PoolBlock mb(_blockSize);
+  memset(mb.data(), 0, _blockSize);
+
+  int res = 0;
+  IORequest req;
+  req.data = mb.data();
+  if (firstFull >= lastFull) {
+    req.offset = offset;
+    req.dataLen = end - offset;
+    ssize_t writeSize = write(req);
+    res = writeSize < 0 ? (int)writeSize : 0;
+  } else {
+    if (offset < firstFull * _blockSize) {
+      req.offset = offset;
+      req.dataLen = firstFull * _blockSize - offset;
+      ssize_t writeSize = write(req);
+      res = writeSize < 0 ? (int)writeSize : 0;
+    }
+    if (res == 0 && lastFull * _blockSize < end) {
+      req.offset = lastFull * _blockSize;
+      req.dataLen = end - lastFull * _blockSize;
+      ssize_t writeSize = write(req);
+      res = writeSize < 0 ? (int)writeSize : 0;
+    }
+    if (res == 0) {
+      invalidateReadAhead();
+      if (_cache) {
+        _cache->eraseRange(_cacheOwner, firstFull, lastFull);
+      }
+      off_t from = baseOffset(firstFull * _blockSize);
+      off_t to = baseOffset(lastFull * _blockSize);
+      res = base->allocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from,
+                           to - from);
+    }
+  }
+
+  return res;
+}
+
 /**
  * Returns 0 in case of success, or -errno in case of failure
  */
@@ -383,13 +1437,25 @@ int BlockFileIO::truncateBase(off_t size, FileIO* base) {
 
   off_t oldSize = getSize();
 
+  invalidateReadAhead();
+  // cached blocks past the new end of file are stale, and so is the block
+  // that becomes the partial last block.  When shrinking, that one is kept
+  // until it is read back below, and then written short over it.
+  bool shrinkPartial = size < oldSize && partialBlock != 0;
+  if (size != oldSize) {
+    dropTail(size / _blockSize);
+  }
+  if (_cache && size != oldSize) {
+    _cache->eraseFrom(_cacheOwner, size / _blockSize + (shrinkPartial ? 1 : 0));
+  }
+
   if (size > oldSize) {
 
     if (base != nullptr) {
       res = base->truncate(size);
     }
 
-    const bool forceWirte = true;
+    const bool forceWrite = true;
     if (res == 0) {
       res = padFile(oldSize, size, forceWrite);
     }
@@ -397,12 +1463,12 @@ int BlockFileIO::truncateBase(off_t size, FileIO* base) {
 
   } else if (partialBlock != 0) {
     off_t blockNum = size / _blockSize;
-    MemBlock mb = MemoryPool::allocate(blockSize);
+    PoolBlock mb(_blockSize);
 
     IORequest req;
     req.offset = blockNum * _blockSize;
     req.dataLen = _blockSize;
-    req.data = mb.data;
+    req.data = mb.data();
 
     ssize_t readSize = cacheReadOneBlock(req);
 
@@ -410,21 +1476,24 @@ int BlockFileIO::truncateBase(off_t size, FileIO* base) {
       res = readSize;
     }
     else if (base != nullptr) {
-      res = base->truncate(size);
+      // cut at the start of the block, which codes nothing below us, so
+      // that writing it short is an append there rather than a rewrite
+      res = base->truncate(baseOffset(req.offset));
     }
 
     req.dataLen = partialBlock;
     if (res == 0) {
-      ssize_t wirteSize = cacheWriteOneBlock(req);
+      ssize_t writeSize = cacheWriteOneBlock(req);
       if (writeSize < 0) {
         res = writeSize;
       }
     }
-
-    MemoryPool::release(mb);
+    if (res != 0 && _cache) {
+      _cache->erase(_cacheOwner, blockNum);
+    }
   } else {
     if (base != nullptr) {
-      res = base->truncate(size);
+      res = base->truncate(baseOffset(size));
     }
   }
   return res;
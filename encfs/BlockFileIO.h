@@ -1,10 +1,22 @@
 #ifndef _BlockFileIO_incl_
 #define _BlockFileIO_incl_
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <vector>
 
+#include "BlockCache.h"
+#include "Divider.h"
 #include "FSConfig.h"
 #include "FileIO.h"
+#include "MemoryPool.h"
+#include "OpStats.h"
+#include "ThreadPool.h"
 
 namespace encfs {
     /*
@@ -17,7 +29,9 @@ namespace encfs {
      */
     class BlockFileIO : public FileIO {
         public:
-            BlockFileIO(unsigned int blockSize, const FSConfigPtr& cfg);
+            // statsLayer is the first OpStats::IoCounter of the layer
+            BlockFileIO(unsigned int blockSize, const FSConfigPtr& cfg,
+                        int statsLayer);
             virtual ~BlockFileIO();
 
             // implement in terms of block.
@@ -26,26 +40,216 @@ namespace encfs {
 
             virtual unsigned int blockSize() const;
 
+            // drops the cached blocks, tail and read-ahead of the range
+            virtual void invalidateData(off_t offset, size_t len);
+
+            // number of blocks to prefetch into the cache once reads are
+            // seen to be sequential, 0 disables read-ahead.  Only the top
+            // of a stack of BlockFileIOs should read ahead, the lower ones
+            // do not see the application's access pattern.  Bounded by
+            // what the block cache can hold; may be changed while reads
+            // are in flight.
+            void setReadAhead(int blocks);
+
+            // reads up to the first blocks of the file into the cache on
+            // the read-ahead pool, ahead of the read that usually follows
+            // an open (see --open-prefetch).  Blocks already cached are
+            // skipped.
+            void prefetchStart(int blocks) const;
+
+            // drop blocks from the cache once a read has gone past them,
+            // for a file read through once.  Read-ahead still caches the
+            // blocks ahead of the reader.
+            void setDropBehind(bool drop);
+
+            // hands the plaintext read-ahead decodes to store(offset, data,
+            // len) as well, in page aligned runs of it but for the end of
+            // the file, for the kernel to keep in its page cache (see
+            // --push-readahead).  drop(offset, len) is called when a write
+            // or truncate overtook a run already stored.  Empty functions
+            // stop it.
+            using PageStore =
+                std::function<void(off_t, const unsigned char*, size_t)>;
+            using PageDrop = std::function<void(off_t, size_t)>;
+            void setPageSink(PageStore store, PageDrop drop);
+
+            // no prefetch started before this may cache or store anything,
+            // for a write buffered above this layer
+            void invalidateReadAhead();
+
+            // turn off the block cache of this layer, before any I/O.  As
+            // with read-ahead, only the top of a stack should cache: the
+            // blocks of a lower one are cached again, decoded further, by
+            // the layer above.
+            void disableCache();
+
+            // true if all len bytes of buf are zero
+            static bool isZero(const unsigned char* buf, size_t len);
+
         protected:
+
             int truncateBase(off_t size, FileIO* base);
             int padFile(off_t oldSize, off_t newSize, bool forceWrite);
+            // fallocate() in terms of blocks.  Allocation covers whole
+            // blocks of base, extending the file pads it as truncate()
+            // does.  Punched holes (allowHoles only) free the whole blocks
+            // in base and overwrite partial blocks at the edges with zeros.
+            int allocateBase(int mode, off_t offset, off_t len, FileIO* base);
+            // seekExtent() in terms of blocks: with allowHoles, a block is
+            // a hole when all of it is a hole in base
+            off_t seekBase(off_t offset, bool hole, const FileIO* base) const;
+            // advise() in terms of blocks: the range advised in base covers
+            // the blocks of the range, as they are stored there
+            void adviseBase(off_t offset, off_t len, Advice advice,
+                            const FileIO* base) const;
+
+            // where block aligned offset lies in the base file
+            virtual off_t baseOffset(off_t offset) const;
+            int padBlocks(off_t fromBlock, off_t toBlock);
 
             // same as read(), except that the request. offset field is
             // guarenteed to be block aligned, and the request size will not
             // be larger than 1 block
             virtual ssize_t readOneBlock(const IORequest& req) const = 0;
-            virtual ssize_t wirteOneBlock(const IORequest& req) = 0;
+            virtual ssize_t writeOneBlock(const IORequest& req) = 0;
+
+            // read / write a run of whole blocks. The request offset is
+            // block aligned and every buffer holds a multiple of the block
+            // size; reads return fewer bytes at end of file, writes may
+            // encode the buffers in place. The default implementations
+            // call readOneBlock() / writeOneBlock() for each block, derived
+            // classes may code the run in one pass and a single request to
+            // the layer below.
+            virtual ssize_t readBlocks(const IOVecRequest& req) const;
+            virtual ssize_t writeBlocks(const IOVecRequest& req);
+
+            // writeBlocks() in two steps, so that a long write can encode
+            // one run while the run before it is being stored:
+            // prepareBlocks() encodes the buffers in place and
+            // commitBlocks() hands them to the layer below.  Runs are
+            // committed in order, one at a time.  Only used when
+            // pipelinesWrites() is true, the defaults do not split.
+            virtual bool pipelinesWrites() const;
+            virtual ssize_t prepareBlocks(const IOVecRequest& req);
+            virtual ssize_t commitBlocks(const IOVecRequest& req);
 
             ssize_t cacheReadOneBlock(const IORequest& req) const;
             ssize_t cacheWriteOneBlock(const IORequest& req);
+            ssize_t cacheWriteBlocks(off_t blockNum, size_t blocks,
+                                     const unsigned char* data);
 
             unsigned int _blockSize;
+            // divides offsets by _blockSize, without a 64-bit divide
+            Divider _blocks;
             bool _allowHoles;
             bool _noCache;
 
-            // cache last block for speed...
-            mutable IORequest _cache;
-    }
+            // scratch space left in front of each block of the temporaries
+            // handed to readOneBlock() / writeOneBlock() / writeBlocks(),
+            // see IORequest::headroom.  0 unless a derived class sets it.
+            unsigned int _headroom;
+
+            // decoded blocks, shared with the other files of the filesystem.
+            // Null when caching is disabled (--nocache).
+            std::shared_ptr<BlockCache> _cache;
+            uint64_t _cacheOwner;
+
+        private:
+            // read() and write() without their probes
+            ssize_t readRequest(const IORequest& req) const;
+            ssize_t writeRequest(const IORequest& req);
+
+            ssize_t writeRun(off_t blockNum, size_t blocks,
+                             unsigned char* buf);
+            // the request writeRun() hands down, its buffers in iov
+            IOVecRequest runRequest(off_t blockNum, size_t blocks,
+                                    unsigned char* buf,
+                                    std::vector<struct iovec>* iov) const;
+            // write whole blocks from data as a pipeline of runs, see
+            // prepareBlocks()
+            ssize_t writePipelined(off_t blockNum, size_t blocks,
+                                   const unsigned char* data);
+            // cacheWriteBlocks() without the check for unchanged blocks
+            ssize_t cacheWriteChanged(off_t blockNum, size_t blocks,
+                                      const unsigned char* data);
+            // true if the cache shows the block already holds the len
+            // bytes of data, so that writing it can be skipped
+            bool unchanged(off_t blockNum, const unsigned char* data,
+                           size_t len);
+
+            // remember the plaintext of a partial last block just written,
+            // or forget it from fromBlock onwards
+            void keepTail(off_t blockNum, const unsigned char* data,
+                          size_t len);
+            void dropTail(off_t fromBlock = 0);
+
+            // reverse mode: drop the cached blocks if the source file has
+            // changed since they were cached
+            void revalidateCache() const;
+            void readAhead(const IORequest& req) const;
+            void prefetch(off_t fromBlock, off_t toBlock,
+                          uint64_t generation) const;
+            // passes the page aligned part of the len bytes of plaintext at
+            // offset in run to store, all of it if it ends the file.
+            // Returns where that part ended, or -1 if the generation moved
+            // on meanwhile.
+            off_t pushPages(const PageStore& store, const PageDrop& drop,
+                            off_t offset, const unsigned char* run,
+                            size_t len, bool atEnd,
+                            uint64_t generation) const;
+
+            // in reverse mode the file we encode may be changed by others.
+            // Cached blocks are kept while its inode, size, mtime and ctime
+            // stay as they were, checked at most every _revalidateMs.
+            // _stampMutex guards the stamp against concurrent readers.
+            bool _revalidate;
+            int _revalidateMs;
+            mutable bool _haveStamp;
+            mutable struct stat _stamp;
+            mutable int64_t _stampTime;  // monotonic ms of the last check
+            mutable pthread_mutex_t _stampMutex;
+
+            // --skip-unchanged: blocks rewritten with the plaintext the
+            // cache has for them are not encoded and written again
+            bool _skipUnchanged;
+            uint64_t _skippedBlocks;
+
+            std::atomic<int> _readAheadBlocks;
+            int _readAheadLimit;  // largest window setReadAhead() allows
+            std::atomic<bool> _dropBehind;
+            std::shared_ptr<ThreadPool> _readAheadPool;
+            // stores the runs of long writes, null if they are not
+            // pipelined
+            std::shared_ptr<ThreadPool> _writePool;
+
+            // access pattern of read(), under _readAheadMutex since reads
+            // of one file may run concurrently
+            mutable off_t _lastReadEnd;
+            mutable int _sequentialReads;
+            mutable off_t _readAheadEnd;  // first block not yet prefetched
+
+            // plaintext of the partial last block as we last wrote it, so
+            // that an append into it merges without reading it back.  Only
+            // touched by writes, which the FileNode lock serializes.
+            off_t _tailBlock;  // -1 when nothing is kept
+            size_t _tailLen;
+            PoolBlock _tail;
+
+            // bumped by every write and truncate.  Prefetch jobs only cache
+            // blocks while the generation they were started at is current,
+            // so they can not cache data older than a write.
+            mutable pthread_mutex_t _readAheadMutex;
+            uint64_t _cacheGeneration;
+            // see setPageSink(), under _readAheadMutex
+            PageStore _pageStore;
+            PageDrop _pageDrop;
+
+            // adds n to counter c of this layer, see OpStats::IoCounter
+            void countIo(OpStats::BlockCounter c, uint64_t n) const {
+                OpStats::count(_statsLayer + c, n);
+            }
+            int _statsLayer;
+    };
 }
 
 #endif
@@ -1,8 +1,10 @@
 #include "BlockNameIO.h"
 
+#include <cerrno>
 #include <cstring>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include "Cipher.h"
 #include "CipherKey.h"
@@ -127,38 +129,44 @@ int BlockNameIO::encodeName(const char* plaintextName, int length, uint64_t* iv,
   if (_caseInsensitive) {
     encLen = B256ToB32Bytes(encodedStreamLen);
 
-    changeBase2Inline((unsigned char*)encodedName, encodedStreamLen, 8, 5, true);
-
-    B32ToAscii((unsigned char*)encodedName, encLen);
+    B256ToB32Ascii((unsigned char*)encodedName, (unsigned char*)encodedName,
+                   encodedStreamLen);
   } else {
     encLen = B256ToB64Bytes(encodedStreamLen);
 
-    changeBase2Inline((unsigned char*)encodeName, encodedStreamLen, 8, 6,
-        true);
-    B64ToAscii((unsigned char*) encodedName, encLen);
+    B256ToB64Ascii((unsigned char*)encodedName, (unsigned char*)encodedName,
+                   encodedStreamLen);
   }
 
   return encLen;
 }
 
-int BlockNameIO::decodeName(const char* encodeName, int length, uint64_t* iv,
+int BlockNameIO::decodeName(const char* encodedName, int length, uint64_t* iv,
     char* plaintextName, int bufferLength) const {
+  int res = tryDecodeName(encodedName, length, iv, plaintextName, bufferLength);
+  if (res < 0) {
+    throw Error("filename decode failed");
+  }
+  return res;
+}
+
+int BlockNameIO::tryDecodeName(const char* encodedName, int length,
+    uint64_t* iv, char* plaintextName, int bufferLength) const {
   int decLen256 = 
     _caseInsensitive ? B32ToB256Bytes(length) : B64ToB256Bytes(length);
   int decodedStreamLen = decLen256 - 2;
 
   if (decodedStreamLen < _bs) {
     VLOG(1) << "Rejecting filename " << encodedName;
-    throw Error("FileName too small to decode");
+    return -EINVAL;
   }
 
   BUFFER_INIT(tmpBuf, 32, (unsigned int)length);
 
   if (_caseInsensitive) {
-    AsciiToB32((unsigned char*)tmpBuf, (unsigned char*) encodedName, length);
+    B32AsciiToB256((unsigned char*)tmpBuf, (unsigned char*)encodedName, length);
   } else {
-    AsciiToB64((unsigned char*) tmpBuf, (unsigned char*) encodedName, length);
-    changeBase2Inline((unsigned char*)tmpBuf, length, 6, 8, false);
+    B64AsciiToB256((unsigned char*)tmpBuf, (unsigned char*)encodedName, length);
   }
 
   unsigned int mac = ((unsigned int) ((unsigned char) tmpBuf[0])) << 8 |
@@ -173,7 +181,9 @@ int BlockNameIO::decodeName(const char* encodeName, int length, uint64_t* iv,
   ok = _cipher->blockDecode((unsigned char*)tmpBuf + 2, decodedStreamLen,
                             (uint64_t)mac^tmpIV, _key);
   if (!ok) {
-    throw Error("block decode failed in filename decode");
+    VLOG(1) << "block decode failed in filename decode";
+    BUFFER_RESET(tmpBuf);
+    return -EINVAL;
   }
 
   int padding = (unsigned char) tmpBuf[2 + decodeStreamLen-1];
@@ -182,8 +192,8 @@ int BlockNameIO::decodeName(const char* encodeName, int length, uint64_t* iv,
   if (padding > _bs || finalSize < 0) {
     VLOG(1) << "padding, _bs, finalSize = " << padding << ", " << _bs << ", "
             << finalSize;
-
-    throw Error("invalid padding size");
+    BUFFER_RESET(tmpBuf);
+    return -EINVAL;
   }
 
   rAssert(finalSize < bufferLength);
@@ -198,12 +208,173 @@ int BlockNameIO::decodeName(const char* encodeName, int length, uint64_t* iv,
   if (mac2 != mac) {
     VLOG(1) << "checksum mismatch: exptected " << mac << ", got " << mac2
             << " on decode of " << finalSize << " bytes";
-    throw Error("checksum mismatch in filename decode");
+    return -EINVAL;
   }
 
   return finalSize;
 }
 
+/*
+    The names of a batch are laid out in slots of one buffer and coded in
+    place: the MACs of all of them in one call, then the blocks of all of
+    them in another, so that the cipher takes its context once.
+ */
+void BlockNameIO::encodeNameBatch(NameRequest* names, int count,
+                                  bool chained) const {
+  std::vector<size_t> slot(count + 1, 0);
+  for (int i = 0; i < count; ++i) {
+    slot[i + 1] = slot[i] + maxEncodedNameLen((int)names[i].name.size()) + 1;
+  }
+  std::vector<unsigned char> buf(slot[count]);
+  std::vector<Cipher::ChainedMACRequest> macs(count);
+  std::vector<uint64_t> tmpIV(count, 0);
+  std::vector<int> streamLen(count);
+
+  for (int i = 0; i < count; ++i) {
+    int length = (int)names[i].name.size();
+    int padding = _bs - length % _bs;
+    if (padding == 0) {
+      padding = _bs;
+    }
+    unsigned char* at = buf.data() + slot[i];
+    memcpy(at + 2, names[i].name.data(), length);
+    memset(at + 2 + length, (unsigned char)padding, padding);
+    streamLen[i] = length + padding;
+    if (chained && _interface >= 3) {
+      tmpIV[i] = names[i].iv;
+    }
+    macs[i].data = at + 2;
+    macs[i].len = streamLen[i];
+    macs[i].chainedIV = chained ? &names[i].iv : nullptr;
+  }
+
+  std::vector<uint64_t> mac64(count);
+  _cipher->MACBatch(macs.data(), count, mac64.data(), _key);
+
+  std::vector<Cipher::BlockRequest> blocks(count);
+  for (int i = 0; i < count; ++i) {
+    unsigned int mac = Cipher::fold16(mac64[i]);
+    unsigned char* at = buf.data() + slot[i];
+    at[0] = (mac >> 8) & 0xff;
+    at[1] = (mac) & 0xff;
+    blocks[i].buf = at + 2;
+    blocks[i].size = streamLen[i];
+    blocks[i].iv64 = (uint64_t)mac ^ tmpIV[i];
+  }
+  if (!_cipher->blockEncodeBatch(blocks.data(), count, _key)) {
+    throw Error("block encode failed in filename encode");
+  }
+
+  for (int i = 0; i < count; ++i) {
+    unsigned char* at = buf.data() + slot[i];
+    int encodedStreamLen = streamLen[i] + 2;
+    int encLen;
+    if (_caseInsensitive) {
+      encLen = B256ToB32Bytes(encodedStreamLen);
+      B256ToB32Ascii(at, at, encodedStreamLen);
+    } else {
+      encLen = B256ToB64Bytes(encodedStreamLen);
+      B256ToB64Ascii(at, at, encodedStreamLen);
+    }
+    names[i].coded.assign((const char*)at, encLen);
+    names[i].ok = true;
+  }
+}
+
+void BlockNameIO::decodeNameBatch(NameRequest* names, int count,
+                                  bool chained) const {
+  std::vector<size_t> slot(count + 1, 0);
+  for (int i = 0; i < count; ++i) {
+    slot[i + 1] = slot[i] + names[i].name.size() + 1;
+  }
+  std::vector<unsigned char> buf(slot[count]);
+
+  // the names that are worth handing to the cipher, and their MACs
+  std::vector<Cipher::BlockRequest> blocks;
+  std::vector<int> which;
+  std::vector<unsigned int> mac;
+  int cipherBlock = _cipher->cipherBlockSize();
+  for (int i = 0; i < count; ++i) {
+    names[i].ok = false;
+    int length = (int)names[i].name.size();
+    int decLen256 =
+        _caseInsensitive ? B32ToB256Bytes(length) : B64ToB256Bytes(length);
+    int decodedStreamLen = decLen256 - 2;
+    if (decodedStreamLen < _bs || decodedStreamLen % cipherBlock != 0) {
+      VLOG(1) << "Rejecting filename " << names[i].name;
+      continue;
+    }
+
+    unsigned char* at = buf.data() + slot[i];
+    const unsigned char* in = (const unsigned char*)names[i].name.data();
+    if (_caseInsensitive) {
+      B32AsciiToB256(at, (unsigned char*)in, length);
+    } else {
+      B64AsciiToB256(at, (unsigned char*)in, length);
+    }
+    unsigned int m = ((unsigned int)at[0]) << 8 | ((unsigned int)at[1]);
+    uint64_t tmpIV = chained && _interface >= 3 ? names[i].iv : 0;
+
+    Cipher::BlockRequest block;
+    block.buf = at + 2;
+    block.size = decodedStreamLen;
+    block.iv64 = (uint64_t)m ^ tmpIV;
+    blocks.push_back(block);
+    which.push_back(i);
+    mac.push_back(m);
+  }
+  if (blocks.empty()) {
+    return;
+  }
+  if (!_cipher->blockDecodeBatch(blocks.data(), (int)blocks.size(), _key)) {
+    // one at a time, so that the names the cipher takes still decode
+    NameIO::decodeNameBatch(names, count, chained);
+    return;
+  }
+
+  std::vector<Cipher::ChainedMACRequest> macs;
+  std::vector<uint64_t> newIV(blocks.size());
+  std::vector<int> checked;
+  std::vector<int> finalSize(blocks.size());
+  for (size_t j = 0; j < blocks.size(); ++j) {
+    int padding = blocks[j].buf[blocks[j].size - 1];
+    finalSize[j] = blocks[j].size - padding;
+    if (padding > _bs || finalSize[j] < 0) {
+      VLOG(1) << "padding, _bs, finalSize = " << padding << ", " << _bs
+              << ", " << finalSize[j];
+      continue;
+    }
+    newIV[j] = names[which[j]].iv;
+    Cipher::ChainedMACRequest req;
+    req.data = blocks[j].buf;
+    req.len = blocks[j].size;
+    req.chainedIV = chained ? &newIV[j] : nullptr;
+    macs.push_back(req);
+    checked.push_back((int)j);
+  }
+  if (macs.empty()) {
+    return;
+  }
+
+  std::vector<uint64_t> mac64(macs.size());
+  _cipher->MACBatch(macs.data(), (int)macs.size(), mac64.data(), _key);
+  for (size_t k = 0; k < checked.size(); ++k) {
+    int j = checked[k];
+    NameRequest& req = names[which[j]];
+    unsigned int mac2 = Cipher::fold16(mac64[k]);
+    if (mac2 != mac[j]) {
+      VLOG(1) << "checksum mismatch: exptected " << mac[j] << ", got "
+              << mac2 << " on decode of " << finalSize[j] << " bytes";
+      continue;
+    }
+    req.coded.assign((const char*)blocks[j].buf, finalSize[j]);
+    if (chained) {
+      req.iv = newIV[j];
+    }
+    req.ok = true;
+  }
+}
+
 bool BlockNameIO::Enabled() { return true; }
 
 
@@ -38,6 +38,13 @@ protected:
                           char *encodedName, int bufferLength) const;
   virtual int decodedName(const char *encodedName, int length, uint64_t *iv,
                           char *plaintextName, int bufferLength) const;
+  virtual int tryDecodeName(const char *encodedName, int length, uint64_t *iv,
+                            char *plaintextName, int bufferLength) const;
+  // the MACs and the cipher of a batch in one call each
+  virtual void encodeNameBatch(NameRequest *names, int count,
+                               bool chained) const;
+  virtual void decodeNameBatch(NameRequest *names, int count,
+                               bool chained) const;
 
 private:
   int _interface;
@@ -0,0 +1,282 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ByteKernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "openssl.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define ENCFS_KERNELS_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ENCFS_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace encfs {
+
+// length of the chunks reversed by flipBytes, fixed by the volume format
+static const int FlipChunk = 64;
+
+/*
+    Reference implementations.  Also used for the tail of a buffer that is
+    too short for the vector code.
+ */
+static void flipBytes_c(unsigned char* buf, int size) {
+  unsigned char revBuf[FlipChunk];
+
+  int bytesLeft = size;
+  while (bytesLeft != 0) {
+    int toFlip = std::min<int>(sizeof(revBuf), bytesLeft);
+
+    for (int i = 0; i < toFlip; ++i) {
+      revBuf[i] = buf[toFlip - (i+1)];
+    }
+
+    memcpy(buf, revBuf, toFlip);
+    bytesLeft -= toFlip;
+    buf += toFlip;
+  }
+
+  memset(revBuf, 0, sizeof(revBuf));
+}
+
+static void shuffleBytes_c(unsigned char* buf, int size) {
+  for (int i = 0; i < size - 1; ++i) {
+    buf[i+1] ^= buf[i];
+  }
+}
+
+static void unshuffleBytes_c(unsigned char* buf, int size) {
+  for (int i = size-1; i > 0; --i) {
+    buf[i] ^= buf[i-1];
+  }
+}
+
+#if defined(ENCFS_KERNELS_X86)
+
+static inline __m128i reverse_sse2(__m128i v) {
+  // reverse dwords, then words in each dword, then bytes in each word
+  v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void flipBytes_sse2(unsigned char* buf, int size) {
+  while (size >= FlipChunk) {
+    __m128i* p = reinterpret_cast<__m128i*>(buf);
+    __m128i a = _mm_loadu_si128(p);
+    __m128i b = _mm_loadu_si128(p + 1);
+    __m128i c = _mm_loadu_si128(p + 2);
+    __m128i d = _mm_loadu_si128(p + 3);
+    _mm_storeu_si128(p, reverse_sse2(d));
+    _mm_storeu_si128(p + 1, reverse_sse2(c));
+    _mm_storeu_si128(p + 2, reverse_sse2(b));
+    _mm_storeu_si128(p + 3, reverse_sse2(a));
+    buf += FlipChunk;
+    size -= FlipChunk;
+  }
+  if (size > 0) {
+    flipBytes_c(buf, size);
+  }
+}
+
+static void shuffleBytes_sse2(unsigned char* buf, int size) {
+  // prefix XOR within each 16 bytes by log-step shifts, then fold in the
+  // last byte of the previous 16
+  unsigned char carry = 0;
+  int i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i* p = reinterpret_cast<__m128i*>(buf + i);
+    __m128i v = _mm_loadu_si128(p);
+    v = _mm_xor_si128(v, _mm_slli_si128(v, 1));
+    v = _mm_xor_si128(v, _mm_slli_si128(v, 2));
+    v = _mm_xor_si128(v, _mm_slli_si128(v, 4));
+    v = _mm_xor_si128(v, _mm_slli_si128(v, 8));
+    v = _mm_xor_si128(v, _mm_set1_epi8(static_cast<char>(carry)));
+    _mm_storeu_si128(p, v);
+    carry = buf[i + 15];
+  }
+  for (; i < size; ++i) {
+    buf[i] ^= carry;
+    carry = buf[i];
+  }
+}
+
+static void unshuffleBytes_sse2(unsigned char* buf, int size) {
+  // work down from the end, so buf[i-1] still holds its shuffled value
+  int i = size;
+  while (i - 16 >= 1) {
+    i -= 16;
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i*>(buf + i));
+    __m128i prev = _mm_loadu_si128(reinterpret_cast<__m128i*>(buf + i - 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buf + i),
+                     _mm_xor_si128(v, prev));
+  }
+  unshuffleBytes_c(buf, i);
+}
+
+#if defined(__GNUC__)
+#define ENCFS_KERNELS_AVX2 1
+
+__attribute__((target("avx2")))
+static inline __m256i reverse_avx2(__m256i v) {
+  const __m256i mask = _mm256_setr_epi8(
+      15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+      15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  // reverse within each 128 bit lane, then swap the lanes
+  v = _mm256_shuffle_epi8(v, mask);
+  return _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+__attribute__((target("avx2")))
+static void flipBytes_avx2(unsigned char* buf, int size) {
+  while (size >= FlipChunk) {
+    __m256i* p = reinterpret_cast<__m256i*>(buf);
+    __m256i lo = _mm256_loadu_si256(p);
+    __m256i hi = _mm256_loadu_si256(p + 1);
+    _mm256_storeu_si256(p, reverse_avx2(hi));
+    _mm256_storeu_si256(p + 1, reverse_avx2(lo));
+    buf += FlipChunk;
+    size -= FlipChunk;
+  }
+  if (size > 0) {
+    flipBytes_c(buf, size);
+  }
+}
+
+__attribute__((target("avx2")))
+static void unshuffleBytes_avx2(unsigned char* buf, int size) {
+  int i = size;
+  while (i - 32 >= 1) {
+    i -= 32;
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i*>(buf + i));
+    __m256i prev = _mm256_loadu_si256(reinterpret_cast<__m256i*>(buf + i - 1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buf + i),
+                        _mm256_xor_si256(v, prev));
+  }
+  unshuffleBytes_sse2(buf, i);
+}
+#endif  // __GNUC__
+
+#elif defined(ENCFS_KERNELS_NEON)
+
+static inline uint8x16_t reverse_neon(uint8x16_t v) {
+  v = vrev64q_u8(v);
+  return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
+}
+
+static void flipBytes_neon(unsigned char* buf, int size) {
+  while (size >= FlipChunk) {
+    uint8x16_t a = vld1q_u8(buf);
+    uint8x16_t b = vld1q_u8(buf + 16);
+    uint8x16_t c = vld1q_u8(buf + 32);
+    uint8x16_t d = vld1q_u8(buf + 48);
+    vst1q_u8(buf, reverse_neon(d));
+    vst1q_u8(buf + 16, reverse_neon(c));
+    vst1q_u8(buf + 32, reverse_neon(b));
+    vst1q_u8(buf + 48, reverse_neon(a));
+    buf += FlipChunk;
+    size -= FlipChunk;
+  }
+  if (size > 0) {
+    flipBytes_c(buf, size);
+  }
+}
+
+static void shuffleBytes_neon(unsigned char* buf, int size) {
+  const uint8x16_t zero = vdupq_n_u8(0);
+  unsigned char carry = 0;
+  int i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t v = vld1q_u8(buf + i);
+    v = veorq_u8(v, vextq_u8(zero, v, 15));
+    v = veorq_u8(v, vextq_u8(zero, v, 14));
+    v = veorq_u8(v, vextq_u8(zero, v, 12));
+    v = veorq_u8(v, vextq_u8(zero, v, 8));
+    v = veorq_u8(v, vdupq_n_u8(carry));
+    vst1q_u8(buf + i, v);
+    carry = buf[i + 15];
+  }
+  for (; i < size; ++i) {
+    buf[i] ^= carry;
+    carry = buf[i];
+  }
+}
+
+static void unshuffleBytes_neon(unsigned char* buf, int size) {
+  int i = size;
+  while (i - 16 >= 1) {
+    i -= 16;
+    vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), vld1q_u8(buf + i - 1)));
+  }
+  unshuffleBytes_c(buf, i);
+}
+
+#endif
+
+struct ByteKernels {
+  const char* name;
+  void (*shuffle)(unsigned char*, int);
+  void (*unshuffle)(unsigned char*, int);
+  void (*flip)(unsigned char*, int);
+};
+
+static ByteKernels selectKernels() {
+#if defined(ENCFS_KERNELS_X86)
+#if defined(ENCFS_KERNELS_AVX2)
+  if (cpuFeatures().avx2) {
+    // a prefix XOR does not cross 128 bit lanes cheaply, so the 16 byte
+    // version is still the fastest shuffle
+    return ByteKernels{"avx2", shuffleBytes_sse2, unshuffleBytes_avx2,
+                       flipBytes_avx2};
+  }
+#endif
+  return ByteKernels{"sse2", shuffleBytes_sse2, unshuffleBytes_sse2,
+                     flipBytes_sse2};
+#elif defined(ENCFS_KERNELS_NEON)
+  return ByteKernels{"neon", shuffleBytes_neon, unshuffleBytes_neon,
+                     flipBytes_neon};
+#else
+  return ByteKernels{"c", shuffleBytes_c, unshuffleBytes_c, flipBytes_c};
+#endif
+}
+
+static const ByteKernels& kernels() {
+  static const ByteKernels selected = selectKernels();
+  return selected;
+}
+
+void shuffleBytes(unsigned char* buf, int size) {
+  kernels().shuffle(buf, size);
+}
+
+void unshuffleBytes(unsigned char* buf, int size) {
+  kernels().unshuffle(buf, size);
+}
+
+void flipBytes(unsigned char* buf, int size) {
+  kernels().flip(buf, size);
+}
+
+const char* byteKernelName() { return kernels().name; }
+
+}  // namespace encfs
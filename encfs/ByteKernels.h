@@ -0,0 +1,25 @@
+#ifndef _ByteKernels_incl_
+#define _ByteKernels_incl_
+
+namespace encfs {
+    /*
+        Byte mixing passes used by the SSL_Cipher stream mode.  These are part
+        of the on-disk format, so every implementation must give the same
+        output as the plain C loops:
+
+        shuffleBytes   buf[i] ^= buf[i-1], for i = 1 .. size-1 (a prefix XOR)
+        unshuffleBytes inverse of shuffleBytes
+        flipBytes      reverse each 64 byte chunk of buf, the last chunk may
+                       be shorter
+
+        The SIMD version is chosen once at runtime, from cpuFeatures().
+     */
+    void shuffleBytes(unsigned char* buf, int size);
+    void unshuffleBytes(unsigned char* buf, int size);
+    void flipBytes(unsigned char* buf, int size);
+
+    // name of the implementation in use, eg. "avx2", "sse2", "neon", "c"
+    const char* byteKernelName();
+}
+
+#endif
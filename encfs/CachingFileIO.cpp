@@ -0,0 +1,194 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CachingFileIO.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <utility>
+
+#include "MemoryPool.h"
+
+namespace encfs {
+
+static Interface CachingFileIO_iface("FileIO/Caching", 1, 0, 0);
+
+// chunks read from the backing file at once on a miss, at most
+static const size_t MaxFillChunks = 16;
+
+CachingFileIO::CachingFileIO(std::shared_ptr<FileIO> _base,
+                             std::shared_ptr<CiphertextCache> _cache)
+    : base(std::move(_base)), cache(std::move(_cache)) {}
+
+CachingFileIO::~CachingFileIO() {
+  if (file) {
+    cache->detach(file);
+  }
+}
+
+Interface CachingFileIO::interface() const { return CachingFileIO_iface; }
+
+unsigned int CachingFileIO::blockSize() const { return base->blockSize(); }
+
+void CachingFileIO::setFileName(const char *fileName) {
+  base->setFileName(fileName);
+}
+
+const char *CachingFileIO::getFileName() const {
+  return base->getFileName();
+}
+
+bool CachingFileIO::setIV(uint64_t iv) { return base->setIV(iv); }
+
+int CachingFileIO::open(int flags) {
+  int fd = base->open(flags);
+  if (fd >= 0 && !file) {
+    struct stat st;
+    int res = base->getAttr(&st);
+    if (res < 0) {
+      return res;
+    }
+    if (S_ISREG(st.st_mode)) {
+      file = cache->attach(st);
+    }
+  }
+  return fd;
+}
+
+int CachingFileIO::getAttr(struct stat *stbuf) const {
+  return base->getAttr(stbuf);
+}
+
+off_t CachingFileIO::getSize() const { return base->getSize(); }
+
+ssize_t CachingFileIO::read(const IORequest &req) const {
+  struct stat st;
+  if (!file || base->getAttr(&st) != 0) {
+    return base->read(req);
+  }
+  const size_t chunkSize = CiphertextCache::ChunkSize;
+  uint64_t generation = cache->validate(*file, st);
+
+  PoolBlock fill;  // chunks missing from the cache, read from the file
+  size_t done = 0;
+  while (done < req.dataLen && req.offset + (off_t)done < st.st_size) {
+    off_t offset = req.offset + (off_t)done;
+    off_t chunk = offset / (off_t)chunkSize;
+    size_t in = (size_t)(offset % (off_t)chunkSize);
+    size_t want = std::min(req.dataLen - done, chunkSize - in);
+
+    ssize_t got = cache->read(*file, chunk, in, req.data + done, want);
+    if (got < 0) {
+      // the chunks up to the end of the request, some may be cached
+      size_t chunks = std::min(
+          MaxFillChunks, (in + req.dataLen - done + chunkSize - 1) / chunkSize);
+      if (!fill) {
+        fill.allocate((int)(MaxFillChunks * chunkSize));
+      }
+      IORequest fillReq;
+      fillReq.offset = chunk * (off_t)chunkSize;
+      fillReq.data = fill.data();
+      fillReq.dataLen = chunks * chunkSize;
+      ssize_t len = base->read(fillReq);
+      if (len < 0) {
+        return done > 0 ? (ssize_t)done : len;
+      }
+      for (size_t i = 0; i * chunkSize < (size_t)len; ++i) {
+        size_t clen = std::min(chunkSize, (size_t)len - i * chunkSize);
+        // a short chunk must be the end of the file, not a short read
+        if (clen == chunkSize ||
+            fillReq.offset + (off_t)(i * chunkSize + clen) == st.st_size) {
+          cache->put(*file, generation, chunk + (off_t)i,
+                     fill.data() + i * chunkSize, clen);
+        }
+      }
+      size_t copied =
+          (size_t)len > in ? std::min(req.dataLen - done, (size_t)len - in)
+                           : 0;
+      memcpy(req.data + done, fill.data() + in, copied);
+      done += copied;
+      if ((size_t)len < fillReq.dataLen) {
+        break;  // end of the file
+      }
+      continue;
+    }
+    done += got;
+    if ((size_t)got < want) {
+      break;  // end of the file
+    }
+  }
+  return (ssize_t)done;
+}
+
+ssize_t CachingFileIO::write(const IORequest &req) {
+  ssize_t res = base->write(req);
+  drop(req.offset, req.dataLen);
+  return res;
+}
+
+ssize_t CachingFileIO::writev(const IOVecRequest &req) {
+  ssize_t res = base->writev(req);
+  drop(req.offset, req.dataLen());
+  return res;
+}
+
+int CachingFileIO::truncate(off_t size) {
+  int res = base->truncate(size);
+  drop(size, 0);
+  return res;
+}
+
+bool CachingFileIO::isWritable() const { return base->isWritable(); }
+
+bool CachingFileIO::isHole(off_t offset, size_t len) const {
+  return base->isHole(offset, len);
+}
+
+off_t CachingFileIO::seekExtent(off_t offset, bool hole) const {
+  return base->seekExtent(offset, hole);
+}
+
+int CachingFileIO::allocate(int mode, off_t offset, off_t len) {
+  int res = base->allocate(mode, offset, len);
+  if (res == 0 && len > 0) {
+    drop(offset, (size_t)len);
+  }
+  return res;
+}
+
+void CachingFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+int CachingFileIO::passthroughFd() const { return base->passthroughFd(); }
+
+void CachingFileIO::invalidateData(off_t offset, size_t len) {
+  base->invalidateData(offset, len);
+  // the layers above name offsets of their own, drop all of the file
+  drop(0, 0);
+}
+
+void CachingFileIO::advise(off_t offset, off_t len, Advice advice) const {
+  base->advise(offset, len, advice);
+}
+
+void CachingFileIO::drop(off_t offset, size_t len) {
+  if (file) {
+    cache->drop(*file, offset, len);
+  }
+}
+
+}  // namespace encfs
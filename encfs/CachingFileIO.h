@@ -0,0 +1,74 @@
+#ifndef _CachingFileIO_incl_
+#define _CachingFileIO_incl_
+
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "CiphertextCache.h"
+#include "FileIO.h"
+#include "Interface.h"
+
+namespace encfs {
+
+/*
+    A backing file read through the CiphertextCache of the mount
+    (--ciphertext-cache).  Sits right above the RawFileIO of the backing
+    file, under the journal and the coding layers, so what it caches is
+    what the backing file stores.
+
+    Reads are served in whole chunks of the cache, a chunk missing from it
+    read from the backing file and kept.  Every read checks the size and
+    mtime of the backing file first, through the attributes the RawFileIO
+    caches.  Writes, truncates and fallocates go to the backing file and
+    drop the chunks they touch.
+ */
+class CachingFileIO : public FileIO {
+ public:
+  CachingFileIO(std::shared_ptr<FileIO> base,
+                std::shared_ptr<CiphertextCache> cache);
+  virtual ~CachingFileIO();
+
+  virtual Interface interface() const;
+  virtual unsigned int blockSize() const;
+
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+  virtual bool setIV(uint64_t iv);
+
+  virtual int open(int flags);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t write(const IORequest &req);
+  virtual ssize_t writev(const IOVecRequest &req);
+
+  virtual int truncate(off_t size);
+  virtual bool isWritable() const;
+
+  virtual bool isHole(off_t offset, size_t len) const;
+  virtual off_t seekExtent(off_t offset, bool hole) const;
+  virtual int allocate(int mode, off_t offset, off_t len);
+  virtual void invalidateAttr();
+  virtual int passthroughFd() const;
+  virtual void invalidateData(off_t offset, size_t len);
+  // passed on to the backing file, which chunks missing come from
+  virtual void advise(off_t offset, off_t len, Advice advice) const;
+
+ private:
+  CachingFileIO(const CachingFileIO &src);             // not allowed
+  CachingFileIO &operator=(const CachingFileIO &src);  // not allowed
+
+  // drops the chunks of the len bytes at offset, see CiphertextCache::drop
+  void drop(off_t offset, size_t len);
+
+  std::shared_ptr<FileIO> base;
+  std::shared_ptr<CiphertextCache> cache;
+  // of the backing file, set by the first open() of a regular file
+  std::shared_ptr<CiphertextCache::File> file;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,384 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ChangeIndex.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Error.h"
+
+namespace encfs {
+
+static const char Magic[8] = {'E', 'n', 'c', 'F', 'S', 'c', 'i', '1'};
+static const size_t HeaderSize = 8 + 4 * 8;
+static const size_t RecordSize = 10 * 8;
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+static uint64_t fnv64(const unsigned char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// all of len bytes, 0 or -errno
+static int writeAll(int fd, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+ChangeIndex::ChangeIndex(const std::string &path)
+    : _path(path), _id(0), _token(0), _horizon(0) {}
+
+void ChangeIndex::newIndex() {
+  if (RAND_bytes((unsigned char *)&_id, sizeof(_id)) != 1) {
+    _id = (uint64_t)time(nullptr) << 20 ^ (uint64_t)getpid();
+  }
+  _token = 0;
+  _horizon = 0;
+  _entries.clear();
+}
+
+bool ChangeIndex::load() {
+  int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      int eno = errno;
+      RLOG(ERROR) << "unable to open the change index " << _path << ": "
+                  << strerror(eno);
+      return false;
+    }
+    newIndex();
+    return true;
+  }
+
+  std::vector<unsigned char> buf;
+  unsigned char chunk[65536];
+  for (;;) {
+    ssize_t n = ::read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      int eno = errno;
+      RLOG(ERROR) << "unable to read the change index " << _path << ": "
+                  << strerror(eno);
+      ::close(fd);
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    buf.insert(buf.end(), chunk, chunk + n);
+  }
+  ::close(fd);
+
+  // the whole file ends in a checksum of the rest
+  bool good = buf.size() >= HeaderSize + 8 &&
+              memcmp(buf.data(), Magic, sizeof(Magic)) == 0 &&
+              fnv64(buf.data(), buf.size() - 8) ==
+                  get64(&buf[buf.size() - 8]);
+  size_t end = buf.size() - 8;
+  size_t pos = HeaderSize;
+  if (good) {
+    _id = get64(&buf[8]);
+    _token = get64(&buf[16]);
+    _horizon = get64(&buf[24]);
+    uint64_t count = get64(&buf[32]);
+    for (uint64_t i = 0; i < count && good; ++i) {
+      if (end - pos < RecordSize) {
+        good = false;
+        break;
+      }
+      const unsigned char *rec = &buf[pos];
+      uint64_t len = get64(rec + 72);
+      pos += RecordSize;
+      if (end - pos < len) {
+        good = false;
+        break;
+      }
+      Entry &e = _entries[std::string((const char *)&buf[pos], len)];
+      e.ino = get64(rec);
+      e.size = (int64_t)get64(rec + 8);
+      e.mode = get64(rec + 16);
+      e.mtimeSec = (int64_t)get64(rec + 24);
+      e.mtimeNsec = (int64_t)get64(rec + 32);
+      e.ctimeSec = (int64_t)get64(rec + 40);
+      e.ctimeNsec = (int64_t)get64(rec + 48);
+      e.changed = get64(rec + 56);
+      e.deleted = get64(rec + 64) != 0;
+      pos += len;
+    }
+  }
+  if (!good || pos != end) {
+    RLOG(WARNING) << "the change index " << _path
+                  << " is damaged, starting a new one";
+    newIndex();
+    return true;
+  }
+  VLOG(1) << "change index: " << _entries.size() << " paths at token "
+          << _token;
+  return true;
+}
+
+void ChangeIndex::stampOf(const struct stat &st, Entry *e) {
+  e->ino = st.st_ino;
+  e->size = st.st_size;
+  e->mode = st.st_mode;
+#if defined(__APPLE__)
+  e->mtimeSec = st.st_mtimespec.tv_sec;
+  e->mtimeNsec = st.st_mtimespec.tv_nsec;
+  e->ctimeSec = st.st_ctimespec.tv_sec;
+  e->ctimeNsec = st.st_ctimespec.tv_nsec;
+#else
+  e->mtimeSec = st.st_mtim.tv_sec;
+  e->mtimeNsec = st.st_mtim.tv_nsec;
+  e->ctimeSec = st.st_ctim.tv_sec;
+  e->ctimeNsec = st.st_ctim.tv_nsec;
+#endif
+  e->changed = 0;
+  e->deleted = false;
+}
+
+bool ChangeIndex::sameStamp(const Entry &a, const Entry &b) {
+  return a.ino == b.ino && a.size == b.size && a.mode == b.mode &&
+         a.mtimeSec == b.mtimeSec && a.mtimeNsec == b.mtimeNsec &&
+         a.ctimeSec == b.ctimeSec && a.ctimeNsec == b.ctimeNsec;
+}
+
+void ChangeIndex::scanDir(int dirFd, const std::string &dirPath,
+                          const std::string &rootDir, Entries *found) const {
+  DIR *dir = fdopendir(dirFd);
+  if (dir == nullptr) {
+    ::close(dirFd);
+    return;
+  }
+
+  struct dirent *de;
+  while ((de = readdir(dir)) != nullptr) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    std::string path =
+        dirPath.empty() ? de->d_name : dirPath + '/' + de->d_name;
+    // the index may live in the tree it indexes
+    std::string full = rootDir + path;
+    if (full == _path || full == _path + ".new") {
+      continue;
+    }
+
+    struct stat st;
+    if (::fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;  // gone since it was listed
+    }
+    Entry &e = (*found)[path];
+    stampOf(st, &e);
+    if (!S_ISDIR(st.st_mode)) {
+      continue;
+    }
+
+    int fd = ::openat(dirfd(dir), de->d_name,
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+      scanDir(fd, path, rootDir, found);
+      continue;
+    }
+    // what we can not look into is taken to be as it was
+    int eno = errno;
+    RLOG(WARNING) << "unable to scan " << full << ": " << strerror(eno);
+    std::string prefix = path + '/';
+    for (auto it = _entries.lower_bound(prefix);
+         it != _entries.end() &&
+         it->first.compare(0, prefix.size(), prefix) == 0;
+         ++it) {
+      if (!it->second.deleted) {
+        found->insert(*it);
+      }
+    }
+  }
+  closedir(dir);
+}
+
+int ChangeIndex::scan(const std::string &rootDir) {
+  int fd = ::open(rootDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  Entries found;
+  scanDir(fd, std::string(), rootDir, &found);
+
+  uint64_t next = _token + 1;
+  bool changed = false;
+  for (auto &it : found) {
+    auto old = _entries.find(it.first);
+    if (old != _entries.end() && !old->second.deleted &&
+        sameStamp(old->second, it.second)) {
+      it.second.changed = old->second.changed;
+    } else {
+      it.second.changed = next;
+      changed = true;
+    }
+  }
+
+  std::vector<uint64_t> tombstones;
+  for (const auto &it : _entries) {
+    if (found.count(it.first) != 0) {
+      continue;
+    }
+    Entry e = it.second;
+    if (!e.deleted) {
+      e.deleted = true;
+      e.changed = next;
+      changed = true;
+    }
+    tombstones.push_back(e.changed);
+    found.insert(std::make_pair(it.first, e));
+  }
+
+  if (tombstones.size() > MaxTombstones) {
+    // forget the oldest deletions, and so the tokens from before them
+    size_t drop = tombstones.size() - MaxTombstones;
+    std::nth_element(tombstones.begin(), tombstones.begin() + drop - 1,
+                     tombstones.end());
+    uint64_t horizon = tombstones[drop - 1];
+    for (auto it = found.begin(); it != found.end();) {
+      if (it->second.deleted && it->second.changed <= horizon) {
+        it = found.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    _horizon = std::max(_horizon, horizon);
+  }
+
+  _entries.swap(found);
+  if (changed) {
+    _token = next;
+  }
+  VLOG(1) << "change index: scanned " << rootDir << ", "
+          << (changed ? "changed" : "unchanged") << " at token " << _token;
+  return 0;
+}
+
+int ChangeIndex::save() {
+  std::vector<unsigned char> buf(HeaderSize);
+  memcpy(buf.data(), Magic, sizeof(Magic));
+  put64(&buf[8], _id);
+  put64(&buf[16], _token);
+  put64(&buf[24], _horizon);
+  put64(&buf[32], _entries.size());
+  for (const auto &it : _entries) {
+    const Entry &e = it.second;
+    unsigned char rec[RecordSize];
+    put64(rec, e.ino);
+    put64(rec + 8, (uint64_t)e.size);
+    put64(rec + 16, e.mode);
+    put64(rec + 24, (uint64_t)e.mtimeSec);
+    put64(rec + 32, (uint64_t)e.mtimeNsec);
+    put64(rec + 40, (uint64_t)e.ctimeSec);
+    put64(rec + 48, (uint64_t)e.ctimeNsec);
+    put64(rec + 56, e.changed);
+    put64(rec + 64, e.deleted ? 1 : 0);
+    put64(rec + 72, it.first.size());
+    buf.insert(buf.end(), rec, rec + RecordSize);
+    buf.insert(buf.end(), it.first.begin(), it.first.end());
+  }
+  unsigned char sum[8];
+  put64(sum, fnv64(buf.data(), buf.size()));
+  buf.insert(buf.end(), sum, sum + sizeof(sum));
+
+  std::string tmp = _path + ".new";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -errno;
+  }
+  int res = writeAll(fd, buf.data(), buf.size());
+  if (res == 0 && ::fsync(fd) != 0) {
+    res = -errno;
+  }
+  ::close(fd);
+  if (res == 0 && ::rename(tmp.c_str(), _path.c_str()) != 0) {
+    res = -errno;
+  }
+  if (res < 0) {
+    ::unlink(tmp.c_str());
+  }
+  return res;
+}
+
+std::string ChangeIndex::token() const {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%016llx-%llu", (unsigned long long)_id,
+           (unsigned long long)_token);
+  return buf;
+}
+
+bool ChangeIndex::changesSince(
+    const std::string &since,
+    const std::function<void(bool deleted, const std::string &path)> &fn)
+    const {
+  unsigned long long id = 0;
+  unsigned long long token = 0;
+  char extra;
+  bool known = sscanf(since.c_str(), "%16llx-%llu%c", &id, &token, &extra) ==
+                   2 &&
+               id == _id && token >= _horizon && token <= _token;
+
+  for (const auto &it : _entries) {
+    const Entry &e = it.second;
+    if (known ? e.changed > token : !e.deleted) {
+      fn(e.deleted, it.first);
+    }
+  }
+  return known;
+}
+
+}  // namespace encfs
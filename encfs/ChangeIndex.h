@@ -0,0 +1,91 @@
+#ifndef _ChangeIndex_incl_
+#define _ChangeIndex_incl_
+
+#include <functional>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace encfs {
+
+/*
+    The paths of a reverse mount's source tree that changed between scans,
+    for `encfsctl changes`, so that backup tools can copy only the encoded
+    files that changed instead of walking the whole mount.
+
+    A scan lstats the source tree directly, which is far cheaper than
+    going through the mount, and compares every path against the previous
+    scan kept in the index file.  A path changed if its inode, type, size,
+    mtime or ctime did, and is deleted if it is gone; each scan that finds
+    a change gets the next token, which callers hand back to learn what
+    changed since.
+
+    Tokens name the index they came from, so that one from a lost or
+    rebuilt index is not taken for a point in this one.  Only the latest
+    MaxTombstones deletions are kept; changes since a token older than
+    that, or unknown, can only be answered with every path.
+ */
+class ChangeIndex {
+ public:
+  explicit ChangeIndex(const std::string &path);
+
+  // reads the index file, starting a new index if it is missing or
+  // damaged.  False if it can not be read at all.
+  bool load();
+  // scans the tree at rootDir, ending in '/'.  0 or -errno.
+  int scan(const std::string &rootDir);
+  // writes the index file out.  0 or -errno.
+  int save();
+
+  std::string token() const;
+
+  // calls fn with each path, relative to the root, changed or deleted
+  // since the scan that gave token since, in order.  If since is not a
+  // token this index can answer for, calls fn with every path there is
+  // and returns false.
+  bool changesSince(
+      const std::string &since,
+      const std::function<void(bool deleted, const std::string &path)> &fn)
+      const;
+
+ private:
+  static const size_t MaxTombstones = 65536;
+
+  struct Entry {
+    uint64_t ino;
+    int64_t size;
+    uint64_t mode;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t ctimeSec;
+    int64_t ctimeNsec;
+    uint64_t changed;  // token of the scan that saw the change
+    bool deleted;
+  };
+  typedef std::map<std::string, Entry> Entries;
+
+  static void stampOf(const struct stat &st, Entry *e);
+  static bool sameStamp(const Entry &a, const Entry &b);
+
+  // adds what lies below the open directory dirFd, at dirPath, to found.
+  // Takes over dirFd.
+  void scanDir(int dirFd, const std::string &dirPath,
+               const std::string &rootDir, Entries *found) const;
+  void newIndex();
+
+  std::string _path;
+  uint64_t _id;
+  uint64_t _token;
+  // the oldest token deletions are still known from
+  uint64_t _horizon;
+  Entries _entries;
+
+  ChangeIndex(const ChangeIndex &);             // not allowed
+  ChangeIndex &operator=(const ChangeIndex &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -1,7 +1,7 @@
 #include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <list>
-#include <map>
 #include <string>
 #include <utility>
 
@@ -25,35 +25,57 @@ namespace encfs {
     REF_MODULE(NullCipher)
   }
 
+  /*
+      The registered ciphers, in the order of their names.  Plain data with
+      a constant initializer, so registering from the static initializers
+      of other files needs nothing constructed first, and nothing is
+      allocated for it.
+   */
+  static const int MaxCiphers = 16;
+  static const int MaxInterfaceName = 32;
+
   struct CipherAlg {
-    bool hidden;
-    Cipher::cipherConstructor constructor;
-    string description;
-    Interface iface;
+    const char* name = nullptr;  // registered names are string literals
+    const char* description = nullptr;
+    char ifaceName[MaxInterfaceName] = {};
+    int current = 0;
+    int revision = 0;
+    int age = 0;
     Range keyLength;
     Range blockSize;
+    Cipher::CipherConstructor constructor = nullptr;
+    bool hidden = false;
+
+    Interface iface() const {
+      return Interface(ifaceName, current, revision, age);
+    }
   };
 
-  using CipherMap_t = multimap<string, CipherAlg>;
-  static CipherMap_t *gCipherMap = nullptr;
+  static CipherAlg gCiphers[MaxCiphers];
+  static int gCipherCount = 0;
+
+  static const CipherAlg* findCipher(const string& name) {
+    for (int i = 0; i < gCipherCount; ++i) {
+      if (name == gCiphers[i].name) {
+        return &gCiphers[i];
+      }
+    }
+    return nullptr;
+  }
 
   std::list<Cipher::CipherAlgorithm> Cipher::GetAlgorithmList(bool includeHidden) {
     AddSymbolReferences();
 
     list<CipherAlgorithm> result;
-    if (gCipherMap == nullptr) {
-      return result;
-    }
-    CipherMap_t::const_iterator it;
-    CipherMap_t::const_iterator mapEnd = gCipherMap->end();
-    for (it = gCipherMap->begin(); it != mapEnd(); ++it) {
-      if (includeHidden || it->second.hidden) {
+    for (int i = 0; i < gCipherCount; ++i) {
+      const CipherAlg& alg = gCiphers[i];
+      if (includeHidden || !alg.hidden) {
         CipherAlgorithm tmp;
-        tmp.name = it->first;
-        tmp.description = it->second.description;
-        tmp.iface = it->second.iface;
-        tmp.keyLength = it->second.keyLength;
-        tmp.blockSize = it->second.blockSize;
+        tmp.name = alg.name;
+        tmp.description = alg.description;
+        tmp.iface = alg.iface();
+        tmp.keyLength = alg.keyLength;
+        tmp.blockSize = alg.blockSize;
 
         result.push_back(tmp);
       }
@@ -62,11 +84,9 @@ namespace encfs {
   }
 
   bool Cipher::Register(const char* name, const char* description,
-      const Interface& iface, const Range& keyLength,
-      const Range& blockSize, CipherConstructor fn,
-      bool hidden) {
-    Range keyLength(-1,-1,1);
-    Range blockSize(-1,-1,1);
+      const Interface& iface, CipherConstructor fn, bool hidden) {
+    Range keyLength(-1, -1, 1);
+    Range blockSize(-1, -1, 1);
     return Cipher::Register(name, description, iface, keyLength, blockSize, fn, hidden);
   }
 
@@ -74,49 +94,52 @@ namespace encfs {
       const Interface& iface, const Range& keyLength,
       const Range& blockSize, CipherConstructor fn,
       bool hidden) {
-    if (gCipherMap == nullptr) {
-      gCipherMap = new CipherMap_t;
+    if (gCipherCount == MaxCiphers ||
+        iface.name().length() >= (size_t)MaxInterfaceName) {
+      cerr << "Cipher::Register: no room for " << name << "\n";
+      return false;
     }
 
-    CipherAlg ca;
-    ca.hidden  = hidden;
-    ca.constructor = fn;
+    // keep the table in name order, after ciphers of the same name
+    int pos = gCipherCount;
+    while (pos > 0 && strcmp(gCiphers[pos - 1].name, name) > 0) {
+      gCiphers[pos] = gCiphers[pos - 1];
+      --pos;
+    }
+    ++gCipherCount;
+
+    CipherAlg& ca = gCiphers[pos];
+    ca.name = name;
     ca.description = description;
-    ca.iface = iface;
+    strncpy(ca.ifaceName, iface.name().c_str(), MaxInterfaceName - 1);
+    ca.ifaceName[MaxInterfaceName - 1] = '\0';
+    ca.current = iface.current();
+    ca.revision = iface.revision();
+    ca.age = iface.age();
     ca.keyLength = keyLength;
     ca.blockSize = blockSize;
-
-    gCipherMap->insert(make_pair(string(name), ca));
+    ca.constructor = fn;
+    ca.hidden = hidden;
     return true;
   }
 
   std::shared_ptr<Cipher> Cipher::New(const string& name, int keyLen) {
     std::shared_ptr<Cipher> result;
 
-    if (gCipherMap != nullptr) {
-      CipherMap_t::const_iterator it = gCipherMap->find(name);
-      if (it != gCipherMap->end()) {
-        CipherConstructor fn = it->second.constructor;
-        // use current interface..
-        result = (*fn)(it->second.iface, keyLen);
-      }
+    const CipherAlg* alg = findCipher(name);
+    if (alg != nullptr) {
+      // use current interface..
+      result = (*alg->constructor)(alg->iface(), keyLen);
     }
     return result;
   }
 
   std::shared_ptr<Cipher> Cipher::New(const Interface& iface, int keyLen) {
     std::shared_ptr<Cipher> result;
-    if (gCipherMap != nullptr) {
-      CipherMap_t::const_iterator it;
-      CipherMap_t::const_iterator mapEnd = gCipherMap->end();
-
-      for (it = gCipherMap->begin(); it != mapEnd; ++it) {
-        if (it->second.iface.implements(iface)) {
-          CipherConstructor fn = it->second.constructor;
-          result = (*fn)(iface, keyLen);
-
-          break;
-        }
+    for (int i = 0; i < gCipherCount; ++i) {
+      if (gCiphers[i].iface().implements(iface)) {
+        result = (*gCiphers[i].constructor)(iface, keyLen);
+        break;
       }
     }
     return result;
@@ -137,15 +160,65 @@ namespace encfs {
       const CipherKey& key, uint64_t* chainedIV) const {
     uint64_t mac64 = MAC_64(src, len, key, chainedIV);
 
+    return fold16(mac64);
+  }
+
+  unsigned int Cipher::fold16(uint64_t mac64) {
     unsigned int mac32 = ((mac64 >> 32) & 0xffffffff) ^ (mac64 & 0xffffffff);
     unsigned int mac16 = ((mac32 >> 16) & 0xffff) ^ (mac32 & 0xffff);
 
     return mac16;
   }
 
+  void Cipher::MACBatch(const ChainedMACRequest* blocks, int count,
+      uint64_t* macs, const CipherKey& key) const {
+    for (int i = 0; i < count; ++i) {
+      macs[i] = MAC_64(blocks[i].data, blocks[i].len, key, blocks[i].chainedIV);
+    }
+  }
+
+  uint64_t Cipher::FastMAC_64(const unsigned char* src, int len,
+      uint64_t nonce, const CipherKey& key) const {
+    return MAC_64(src, len, key, &nonce);
+  }
+
+  void Cipher::FastMACBatch(const MACRequest* blocks, int count,
+      uint64_t* macs, const CipherKey& key) const {
+    for (int i = 0; i < count; ++i) {
+      macs[i] = FastMAC_64(blocks[i].data, blocks[i].len, blocks[i].nonce, key);
+    }
+  }
+
+  CipherKey Cipher::newArgon2Key(const char* password, int passwdLength,
+      int& passes, int memoryKiB, int lanes, long desiredFunctionDuration,
+      const unsigned char* salt, int saltLen) {
+    (void)password;
+    (void)passwdLength;
+    (void)passes;
+    (void)memoryKiB;
+    (void)lanes;
+    (void)desiredFunctionDuration;
+    (void)salt;
+    (void)saltLen;
+    return CipherKey();
+  }
+
+  bool Cipher::hasArgon2() const { return false; }
+
+  Interface Cipher::volumeInterface(int blockSize, bool newFormats) const {
+    Interface result = interface();
+    if (!newFormats && blockSize <= MaxClassicBlockSize) {
+      // record the version before large blocks and the newer formats, so
+      // that older releases can still mount the volume
+      --result.current();
+      --result.age();
+    }
+    return result;
+  }
+
   bool Cipher::nameEncode(unsigned char* data, int len, uint64_t iv64,
       const CipherKey& key) const {
-    return streamEncoded(data, len, iv64, key);
+    return streamEncode(data, len, iv64, key);
   }
 
   bool Cipher::nameDecode(unsigned char* data, int len, uint64_t iv64,
@@ -153,6 +226,68 @@ namespace encfs {
     return streamDecode(data, len, iv64, key);
   }
 
+  bool Cipher::blockEncodeBatch(const BlockRequest* blocks, int count,
+      const CipherKey& key) const {
+    for (int i = 0; i < count; ++i) {
+      if (!blockEncode(blocks[i].buf, blocks[i].size, blocks[i].iv64, key)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Cipher::nameEncodeBatch(const BlockRequest* names, int count,
+      const CipherKey& key) const {
+    for (int i = 0; i < count; ++i) {
+      if (!nameEncode(names[i].buf, names[i].size, names[i].iv64, key)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Cipher::nameDecodeBatch(const BlockRequest* names, int count,
+      const CipherKey& key) const {
+    for (int i = 0; i < count; ++i) {
+      if (!nameDecode(names[i].buf, names[i].size, names[i].iv64, key)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Cipher::blockDecodeBatch(const BlockRequest* blocks, int count,
+      const CipherKey& key) const {
+    for (int i = 0; i < count; ++i) {
+      if (!blockDecode(blocks[i].buf, blocks[i].size, blocks[i].iv64, key)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int Cipher::aeadHeaderSize() const { return 0; }
+
+  bool Cipher::aeadEncode(const unsigned char* src, int size, uint64_t iv64,
+      unsigned char* dst, const CipherKey& key) const {
+    (void)src;
+    (void)size;
+    (void)iv64;
+    (void)dst;
+    (void)key;
+    return false;
+  }
+
+  bool Cipher::aeadDecode(const unsigned char* src, int size, uint64_t iv64,
+      unsigned char* dst, const CipherKey& key) const {
+    (void)src;
+    (void)size;
+    (void)iv64;
+    (void)dst;
+    (void)key;
+    return false;
+  }
+
   string Cipher::encodeAsString(const CipherKey& key, const CipherKey& encodingKey) {
     int encodedKeySize = this->encodedKeySize();
     auto* keyBuf = new unsigned char[encodedKeySize];
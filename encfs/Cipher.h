@@ -21,7 +21,7 @@ class Cipher {
 public:
   // if no key length was indicated when cipher was registered, then
   // keyLen <= 0 will be used
-  using cipherConstructor = std::shared_ptr<Cipher> (*)(const Interface &iface,
+  using CipherConstructor = std::shared_ptr<Cipher> (*)(const Interface &iface,
                                                         int keyLenBits);
   struct CipherAlgorithm {
     std::string name;
@@ -45,11 +45,21 @@ public:
                        const Interface &iface, const Range &keyLength,
                        const Range &blockSize, CipherConstructor constructor,
                        bool hidden = false);
+
+  // the largest block size older releases could create.  Ciphers allowing
+  // more bump their interface version, see SSL_Cipher.cpp.
+  static const int MaxClassicBlockSize = 4096;
   Cipher();
   virtual ~Cipher();
 
   virtual Interface interface() const = 0;
 
+  // the interface a new volume with blocks of blockSize records: the
+  // oldest version that codes such a volume as this one does.  newFormats
+  // if the volume uses formats that releases before them would misread
+  // rather than refuse, which the current versions mark.
+  virtual Interface volumeInterface(int blockSize, bool newFormats) const;
+
   // create a new key based on a password
   // if iterationCount == 0, then iteration count will be determined
   // by newKey functon and filled in.
@@ -59,6 +69,16 @@ public:
                            int &iterationCount, long desiredFunctionDuration,
                            const unsigned char *salt, int saltLen) = 0;
 
+  // the same with Argon2id, a memory-hard KDF, using memoryKiB of memory
+  // split in lanes worked on in parallel.  If passes == 0, passes is set to
+  // as many as take about desiredFunctionDuration milliseconds.  Returns an
+  // empty key where Argon2id is not available, see hasArgon2().
+  virtual CipherKey newArgon2Key(const char *password, int passwdLength,
+                                 int &passes, int memoryKiB, int lanes,
+                                 long desiredFunctionDuration,
+                                 const unsigned char *salt, int saltLen);
+  virtual bool hasArgon2() const;
+
   // deprecated - for backward compatibility
   virtual CipherKey newKey(const char *password, int passwdLength) = 0;
   // create a new random key
@@ -95,7 +115,118 @@ public:
   // based on reductions of MAC_64
   unsigned int MAC_32(const unsigned char *src, int len, const CipherKey &key,
                       uint64_t *chainedIV = 0) const;
-  unsigned int MAC_16(const unsigned char *src, int len, const Cipher)
+  unsigned int MAC_16(const unsigned char *src, int len, const CipherKey &key,
+                      uint64_t *chainedIV = 0) const;
+
+  /*
+      Fast keyed 64 bit MAC for block headers (BlockMAC_SipHash).  The nonce
+      is authenticated along with the data, so equal data at different
+      positions gets different MACs.  Ciphers without a fast MAC fall back
+      to MAC_64 with the nonce as the chained IV.
+  */
+  virtual uint64_t FastMAC_64(const unsigned char *src, int len,
+                              uint64_t nonce, const CipherKey &key) const;
+
+  // one entry of a batch MAC
+  struct MACRequest {
+    const unsigned char *data;
+    int len;
+    uint64_t nonce;
+  };
+
+  /*
+      FastMAC_64 of several independent buffers, into macs[0..count).
+      Lets a cipher hash several buffers in one pass, so that checking the
+      blocks of a large read is one call rather than one per block.
+  */
+  virtual void FastMACBatch(const MACRequest *blocks, int count,
+                            uint64_t *macs, const CipherKey &key) const;
+
+  // one entry of a batch MAC_64, chainedIV as for MAC_64
+  struct ChainedMACRequest {
+    const unsigned char *data;
+    int len;
+    uint64_t *chainedIV;
+  };
+
+  /*
+      MAC_64 of several buffers, into macs[0..count), in order.  Lets a
+      cipher take its context once for the batch, as for the names of a
+      directory.
+  */
+  virtual void MACBatch(const ChainedMACRequest *blocks, int count,
+                        uint64_t *macs, const CipherKey &key) const;
+  // the reduction of a MAC_64 that MAC_16 returns
+  static unsigned int fold16(uint64_t mac64);
+
+  // functional interfaces
+  /*
+      Stream encoding of data in-place.  The stream data can be any length.
+  */
+  virtual bool streamEncode(unsigned char *data, int len, uint64_t iv64,
+                            const CipherKey &key) const = 0;
+  virtual bool streamDecode(unsigned char *data, int len, uint64_t iv64,
+                            const CipherKey &key) const = 0;
+
+  /*
+      These are just aliases of streamEncode / streamDecode, but there are
+      provided here for backward compatibility for earlier ciphers that has
+      effectively two stream modes - one for encoding partial blocks and
+      another for encoding filenames.
+  */
+  virtual bool nameEncode(unsigned char *data, int len, uint64_t iv64,
+                          const CipherKey &key) const;
+  virtual bool nameDecode(unsigned char *data, int len, uint64_t iv64,
+                          const CipherKey &key) const;
+
+  /*
+      Block encoding of data in-place.  The data size should be a multiple of
+      the cipher block size.
+  */
+  virtual bool blockEncode(unsigned char *buf, int size, uint64_t iv64,
+                           const CipherKey &key) const = 0;
+  virtual bool blockDecode(unsigned char *buf, int size, uint64_t iv64,
+                           const CipherKey &key) const = 0;
+
+  // one entry of a batch block operation
+  struct BlockRequest {
+    unsigned char *buf;
+    int size;
+    uint64_t iv64;
+  };
+
+  /*
+      Block encoding of several independent blocks in-place, each with its own
+      IV.  Equivalent to calling blockEncode / blockDecode on every entry, but
+      lets a cipher amortize per-call setup over the batch.  Stops at the
+      first failure.
+  */
+  virtual bool blockEncodeBatch(const BlockRequest *blocks, int count,
+                                const CipherKey &key) const;
+  virtual bool blockDecodeBatch(const BlockRequest *blocks, int count,
+                                const CipherKey &key) const;
+  // nameEncode / nameDecode of several names in-place, each with its own
+  // IV, likewise.  Stops at the first failure.
+  virtual bool nameEncodeBatch(const BlockRequest *names, int count,
+                               const CipherKey &key) const;
+  virtual bool nameDecodeBatch(const BlockRequest *names, int count,
+                               const CipherKey &key) const;
+
+  /*
+      Authenticated block encoding, for ciphers which provide it.
+      aeadHeaderSize() is the number of bytes (nonce and tag) stored in front
+      of every encoded block; 0 means the cipher has no authenticated mode and
+      the other two calls always fail.
+      aeadEncode reads size bytes from src and writes the header followed by
+      size bytes of ciphertext to dst.  aeadDecode takes the same layout in src
+      and writes size bytes of plaintext to dst, failing if the block does not
+      authenticate.  iv64 is authenticated along with the data.
+  */
+  virtual int aeadHeaderSize() const;
+  virtual bool aeadEncode(const unsigned char *src, int size, uint64_t iv64,
+                          unsigned char *dst, const CipherKey &key) const;
+  virtual bool aeadDecode(const unsigned char *src, int size, uint64_t iv64,
+                          unsigned char *dst, const CipherKey &key) const;
 };
 } // namespace encfs
 
@@ -1,6 +1,7 @@
 #include "CipherFileIO.h"
 
 #include "easylogging++.h"
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
 #include <cstring>
@@ -9,12 +10,21 @@
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <utility>
+#include <vector>
 
 #include "BlockFileIO.h"
 #include "Cipher.h"
 #include "CipherKey.h"
 #include "Error.h"
 #include "FileIO.h"
+#include "FileIVCache.h"
+#include "MemoryPool.h"
+#include "Mutex.h"
+#include "NonceBudget.h"
+#include "OpStats.h"
+#include "Probes.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 
 namespace encfs {
 
@@ -22,23 +32,58 @@ static Interface CipherFileIO_iface("FileIO/Cipher", 2, 0, 1);
 
 const int HEADER_SIZE = 8;
 
+/*
+    With an authenticated cipher every block is stored as
+    [nonce | tag | ciphertext], so BlockFileIO works with blocks that are
+    aeadHeaderSize() bytes smaller than the configured (on-disk) block size.
+ */
+static int dataBlockSize(const FSConfigPtr& cfg) {
+  return cfg->config->blockSize - cfg->cipher->aeadHeaderSize();
+}
+
+// size on disk (excluding the file header) of size bytes of plaintext
+static off_t aeadRawSize(off_t size, int blockSize, int headerSize) {
+  off_t blocks = size / blockSize;
+  int partial = size % blockSize;
+  return blocks * (blockSize + headerSize) +
+         (partial != 0 ? partial + headerSize : 0);
+}
+
+// inverse of aeadRawSize
+static off_t aeadPlainSize(off_t rawSize, int blockSize, int headerSize) {
+  int rawBlockSize = blockSize + headerSize;
+  off_t blocks = rawSize / rawBlockSize;
+  int partial = rawSize % rawBlockSize;
+  return blocks * blockSize + (partial > headerSize ? partial - headerSize : 0);
+}
+
 CipherFileIO::CipherFileIO(std::shared_ptr<FileIO> _base,
-                           const FSconfigPtr& cfg)
-  : BlockFileIO(cfg->config->blockSize, cfg),
+                           const FSConfigPtr& cfg)
+  : BlockFileIO(dataBlockSize(cfg), cfg, OpStats::CipherLayer),
     base(std::move(_base)),
     haveHeader(cfg->config->uniqueIV),
+    aeadHeader(cfg->cipher->aeadHeaderSize()),
     externalIV(0),
     fileIV(0),
-    lastFlags(0) {
+    lastFlags(0),
+    headerPending(false),
+    haveReverseHeader(false),
+    reverseHeaderIV(0) {
   fsConfig = cfg;
   cipher = cfg->cipher;
   key = cfg->key;
 
-  CHECK_EQ(fsConfig->config->blockSize % fsConfig->cipher->cipherBlockSize(), 0)
-      << "FS block size must be multiple of cipher block size";
+  if (aeadHeader == 0) {
+    CHECK_EQ(fsConfig->config->blockSize % fsConfig->cipher->cipherBlockSize(),
+             0)
+        << "FS block size must be multiple of cipher block size";
+  } else {
+    CHECK_GT(blockSize(), 0u) << "FS block size too small for block header";
+  }
+  pthread_mutex_init(&headerMutex, nullptr);
 }
 
-CipherFileIO::~CipherFileIO() = default;
+CipherFileIO::~CipherFileIO() { pthread_mutex_destroy(&headerMutex); }
 
 Interface CipherFileIO::interface () const { return CipherFileIO_iface; }
 
@@ -53,6 +98,8 @@ int CipherFileIO::open(int flags) {
 
 void CipherFileIO::setFileName (const char* fileName) {
   base->setFileName(fileName);
+  // the header comes from the inode, which may be a different one now
+  haveReverseHeader = false;
 }
 
 const char* CipherFileIO::getFileName() const { return base->getFileName(); }
@@ -77,10 +124,8 @@ bool CipherFileIO::setIV(uint64_t iv) {
       VLOG(1) << "setIV failed to re-open for write";
       return false;
     }
-    if (fileIV == 0) {
-      if (initHeader() < 0) {
-        return false;
-      }
+    if (loadHeader() < 0) {
+      return false;
     }
     uint64_t oldIV = externalIV;
     externalIV = iv;
@@ -94,17 +139,30 @@ bool CipherFileIO::setIV(uint64_t iv) {
 
 int CipherFileIO::getAttr(struct stat* stbuf) const {
   int res = base->getAttr(stbuf);
+  if (res == 0) {
+    plainAttr(fsConfig, stbuf);
+  }
+  return res;
+}
 
-  if ((res == 0) && haveHeader && S_ISREG(stbuf->st_mode) &&
-      (stbuf->st_size > 0)) {
-    if (!fsConfig->reverseEncryption) {
+void CipherFileIO::plainAttr(const FSConfigPtr& cfg, struct stat* stbuf) {
+  if (!S_ISREG(stbuf->st_mode) || stbuf->st_size <= 0) {
+    return;
+  }
+
+  if (cfg->config->uniqueIV) {
+    if (!cfg->reverseEncryption) {
       rAssert(stbuf->st_size >= HEADER_SIZE);
       stbuf->st_size -= HEADER_SIZE;
     } else {
       stbuf->st_size += HEADER_SIZE;
     }
   }
-  return res;
+  int aeadHeader = cfg->cipher->aeadHeaderSize();
+  if (aeadHeader > 0 && stbuf->st_size > 0) {
+    stbuf->st_size =
+        aeadPlainSize(stbuf->st_size, dataBlockSize(cfg), aeadHeader);
+  }
 }
 
 off_t CipherFileIO::getSize() const {
@@ -118,12 +176,43 @@ off_t CipherFileIO::getSize() const {
       size += HEADER_SIZE;
     }
   }
+  if (aeadHeader > 0 && size > 0) {
+    size = aeadPlainSize(size, blockSize(), aeadHeader);
+  }
   return size;
 }
 
+/**
+ * Read, or create, the file header on the first I/O that needs it.  Reads
+ * and read-ahead jobs run concurrently, the first one does it while the
+ * others wait.
+ */
+int CipherFileIO::loadHeader() const {
+  if (!haveHeader || fileIV != 0) {
+    return 0;
+  }
+  Lock lock(headerMutex);
+  if (fileIV != 0) {
+    return 0;
+  }
+  return const_cast<CipherFileIO*>(this)->initHeader();
+}
+
 int CipherFileIO::initHeader() {
-  off_t rawSize = base->getSize();
+  struct stat stbuf;
+  int res = base->getAttr(&stbuf);
+  if (res < 0) {
+    return res;
+  }
+  off_t rawSize = stbuf.st_size;
   if (rawSize >= HEADER_SIZE) {
+    uint64_t cached = fsConfig->ivCache ? fsConfig->ivCache->get(stbuf) : 0;
+    if (cached != 0) {
+      VLOG(1) << "using cached file IV";
+      fileIV = cached;
+      return 0;
+    }
+
     VLOG(1) << "reading existing header, rawSize = " << rawSize;
     
     unsigned char buf[8] = {0};
@@ -137,50 +226,45 @@ int CipherFileIO::initHeader() {
       return readSize;
     }
     
-    if (!cipher->streamDecode(buf, sizeof(buf), externalIV, key)) {
+    uint64_t iv = 0;
+    if (!decodeHeader(buf, &iv)) {
       return -EBADMSG;
     }
 
-    fileIV = 0;
-    for (int i = 0; i < 8; ++i) {
-      fileIV = (fileIV << 8) | (int64_t) buf[i];
+    rAssert(iv != 0);
+    fileIV = iv;
+    if (fsConfig->ivCache) {
+      fsConfig->ivCache->put(stbuf, iv);
     }
-
-    rAssert(fileIV != 0);
   } else {
     VLOG(1) << "creating new file IV header";
     
     unsigned char buf[8] = {0};
+    uint64_t iv = 0;
     do {
       if (!cipher->randomize(buf, 8, false)) {
         RLOG(ERROR) << "Unable to generate a random file IV";
         return -EBADMSG;
       }
 
-      fileIV = 0;
       for (int i = 0; i < 8; ++i) {
-        fileIV = (fileIV << 8) | (uint64_t)buf[i];
+        iv = (iv << 8) | (uint64_t)buf[i];
       }
 
-      if (fileIV == 0) {
+      if (iv == 0) {
         RLOG(WARNING) << "Unexpected result: randomize returned 8 null bytes";
       }
-    } while (fileIV == 0);
+    } while (iv == 0);
+    fileIV = iv;
 
     if (base->isWritable()) {
       if (!cipher->streamEncode(buf, sizeof(buf), externalIV, key)) {
         return -EBADMSG;
       }
-
-      IORequest req;
-      req.offset = 0;
-      req.data = buf;
-      req.dataLen = 8;
-
-      ssize_t writeSize = base->write(req);
-      if (writeSize < 0) {
-        return writeSize;
-      }
+      // written with the first block, rather than with a write of its own
+      static_assert(sizeof(pendingHeader) == HEADER_SIZE, "header size");
+      memcpy(pendingHeader, buf, HEADER_SIZE);
+      headerPending = true;
     } else {
       VLOG(1) << "base not writable, IV not written.. ";
     }
@@ -189,6 +273,66 @@ int CipherFileIO::initHeader() {
   return 0;
 }
 
+bool CipherFileIO::decodeHeader(unsigned char* buf, uint64_t* iv) const {
+  if (!cipher->streamDecode(buf, HEADER_SIZE, externalIV, key)) {
+    return false;
+  }
+  *iv = 0;
+  for (int i = 0; i < HEADER_SIZE; ++i) {
+    *iv = (*iv << 8) | (uint64_t)buf[i];
+  }
+  return true;
+}
+
+int CipherFileIO::adoptHeader(unsigned char* buf) {
+  Lock lock(headerMutex);
+  if (fileIV != 0) {
+    return 0;
+  }
+  uint64_t iv = 0;
+  if (!decodeHeader(buf, &iv)) {
+    return -EBADMSG;
+  }
+  rAssert(iv != 0);
+  fileIV = iv;
+  if (fsConfig->ivCache) {
+    struct stat stbuf;
+    if (base->getAttr(&stbuf) == 0) {
+      fsConfig->ivCache->put(stbuf, iv);
+    }
+  }
+  VLOG(1) << "header read with the first block, fileIV = " << iv;
+  return 0;
+}
+
+bool CipherFileIO::wantsHeader(off_t offset) const {
+  return haveHeader && !fsConfig->reverseEncryption && offset == HEADER_SIZE &&
+         fileIV == 0;
+}
+
+ssize_t CipherFileIO::readWithHeader(const IOVecRequest& raw) const {
+  unsigned char header[HEADER_SIZE];
+  std::vector<struct iovec> iov(raw.iovcnt + 1);
+  iov[0].iov_base = header;
+  iov[0].iov_len = HEADER_SIZE;
+  std::copy(raw.iov, raw.iov + raw.iovcnt, iov.begin() + 1);
+  IOVecRequest withHeader;
+  withHeader.offset = 0;
+  withHeader.iov = iov.data();
+  withHeader.iovcnt = (int)iov.size();
+
+  ssize_t res = base->readv(withHeader);
+  if (res < HEADER_SIZE) {
+    // nothing past a header, if there is one: nothing to decode
+    return res < 0 ? res : 0;
+  }
+  int err = const_cast<CipherFileIO*>(this)->adoptHeader(header);
+  if (err < 0) {
+    return err;
+  }
+  return res - HEADER_SIZE;
+}
+
 bool CipherFileIO::writeHeader() {
   if (fileIV == 0) {
     RLOG(ERROR) << "Internal error: fileIV == 0 in writeHeader! !!";
@@ -197,9 +341,10 @@ bool CipherFileIO::writeHeader() {
   VLOG(1) << "writing fileIV " << fileIV;
 
   unsigned char buf[8] = {0};
+  uint64_t iv = fileIV;
   for (int i = 0; i < 8; ++i) {
-    buf[sizeof(buf)-1-i] = (unsigned char)(fileIV & 0xff);
-    fileIV >>= 8;
+    buf[sizeof(buf)-1-i] = (unsigned char)(iv & 0xff);
+    iv >>= 8;
   }
   if (!cipher->streamEncode(buf, sizeof(buf), externalIV, key)) {
     return false;
@@ -210,10 +355,84 @@ bool CipherFileIO::writeHeader() {
   req.data = buf;
   req.dataLen = 8;
 
-  return (base->write(req) >= 0);
+  if (base->write(req) < 0) {
+    return false;
+  }
+  // this one replaces it
+  headerPending = false;
+  return true;
+}
+
+int CipherFileIO::flushHeader() {
+  if (!headerPending) {
+    return 0;
+  }
+  IORequest req;
+  req.offset = 0;
+  req.data = pendingHeader;
+  req.dataLen = HEADER_SIZE;
+  ssize_t res = base->write(req);
+  if (res < 0) {
+    return (int)res;
+  }
+  headerPending = false;
+  return 0;
+}
+
+ssize_t CipherFileIO::writeBase(const IORequest& raw) {
+  if (!headerPending) {
+    return base->write(raw);
+  }
+  struct iovec iov;
+  iov.iov_base = raw.data;
+  iov.iov_len = raw.dataLen;
+  IOVecRequest vreq;
+  vreq.offset = raw.offset;
+  vreq.iov = &iov;
+  vreq.iovcnt = 1;
+  return writeBase(vreq);
+}
+
+ssize_t CipherFileIO::writeBase(const IOVecRequest& raw) {
+  if (!headerPending) {
+    return base->writev(raw);
+  }
+  if (raw.offset != HEADER_SIZE) {
+    int res = flushHeader();
+    if (res < 0) {
+      return res;
+    }
+    return base->writev(raw);
+  }
+
+  // one write of the header and the first block
+  std::vector<struct iovec> iov(raw.iovcnt + 1);
+  iov[0].iov_base = pendingHeader;
+  iov[0].iov_len = HEADER_SIZE;
+  std::copy(raw.iov, raw.iov + raw.iovcnt, iov.begin() + 1);
+  IOVecRequest withHeader;
+  withHeader.offset = 0;
+  withHeader.iov = iov.data();
+  withHeader.iovcnt = (int)iov.size();
+
+  ssize_t res = base->writev(withHeader);
+  if (res < 0) {
+    return res;
+  }
+  if (res < HEADER_SIZE) {
+    return -EIO;
+  }
+  headerPending = false;
+  return res - HEADER_SIZE;
 }
 
 int CipherFileIO::generateReverseHeader(unsigned char* headerBuf) {
+  static_assert(sizeof(reverseHeader) == HEADER_SIZE, "header size");
+  if (haveReverseHeader && reverseHeaderIV == externalIV) {
+    memcpy(headerBuf, reverseHeader, HEADER_SIZE);
+    return 0;
+  }
+
   struct stat stbuf;
   int res = getAttr(&stbuf);
   rAssert(res == 0);
@@ -234,22 +453,141 @@ int CipherFileIO::generateReverseHeader(unsigned char* headerBuf) {
   rAssert(HEADER_SIZE <= 20);
   memcpy(headerBuf, md, HEADER_SIZE);
 
-  fileIV = 0;
+  uint64_t iv = 0;
   for (int i = 0; i < HEADER_SIZE; ++i) {
-    fileIV = (fileIV << 8) | (uint64_t)headerBuf[i];
+    iv = (iv << 8) | (uint64_t)headerBuf[i];
   }
+  fileIV = iv;
 
   VLOG(1) << "fileIV=" << fileIV;
 
   if (!cipher->streamEncode(headerBuf, HEADER_SIZE, externalIV, key)) {
     return -EBADMSG;
   }
+  memcpy(reverseHeader, headerBuf, HEADER_SIZE);
+  reverseHeaderIV = externalIV;
+  haveReverseHeader = true;
   return 0;
 }
 
+off_t CipherFileIO::rawOffset(off_t offset) const {
+  off_t raw = offset;
+  if (aeadHeader > 0) {
+    raw = _blocks.div(offset) * (blockSize() + aeadHeader);
+  }
+  if (haveHeader && !fsConfig->reverseEncryption) {
+    raw += HEADER_SIZE;
+  }
+  return raw;
+}
+
+off_t CipherFileIO::baseOffset(off_t offset) const {
+  return rawOffset(offset);
+}
+
+int CipherFileIO::allocate(int mode, off_t offset, off_t len) {
+  if (fsConfig->reverseEncryption) {
+    return -EPERM;
+  }
+  // as for truncate, we need write access to the file
+  int reopen = 0;
+  if (!base->isWritable()) {
+    int res = base->open(lastFlags | O_RDWR);
+    if (res < 0) {
+      VLOG(1) << "allocate failed to re-open for write";
+      base->open(lastFlags);
+      return res;
+    }
+    reopen = 1;
+  }
+
+  // the base file grows under the header
+  int res = flushHeader();
+  if (res == 0) {
+    res = BlockFileIO::allocateBase(mode, offset, len, base.get());
+  }
+
+  if (reopen == 1) {
+    reopen = base->open(lastFlags);
+    if (res == 0 && reopen < 0) {
+      res = reopen;
+    }
+  }
+  return res;
+}
+
+void CipherFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+int CipherFileIO::passthroughFd() const {
+  if (!fsConfig->config->plainData || haveHeader || aeadHeader != 0 ||
+      fsConfig->reverseEncryption) {
+    return -1;
+  }
+  return base->passthroughFd();
+}
+
+void CipherFileIO::invalidateData(off_t offset, size_t len) {
+  BlockFileIO::invalidateData(offset, len);
+  base->invalidateData(offset, len);
+}
+
+void CipherFileIO::advise(off_t offset, off_t len, Advice advice) const {
+  adviseBase(offset, len, advice, base.get());
+}
+
+/**
+ * With holes allowed, a region of plaintext is a hole when every block over
+ * it is a hole in the base file
+ */
+bool CipherFileIO::isHole(off_t offset, size_t len) const {
+  if (!_allowHoles || fsConfig->reverseEncryption) {
+    return false;
+  }
+  int bs = blockSize();
+  off_t start = rawOffset(offset / bs * bs);
+  off_t end = rawOffset((offset + (off_t)len + bs - 1) / bs * bs);
+  return base->isHole(start, end - start);
+}
+
+off_t CipherFileIO::seekExtent(off_t offset, bool hole) const {
+  if (fsConfig->reverseEncryption) {
+    return FileIO::seekExtent(offset, hole);
+  }
+  return seekBase(offset, hole, base.get());
+}
+
+ssize_t CipherFileIO::readHole(const IORequest& req, off_t rawOff,
+                               size_t rawLen, int headerLen) const {
+  off_t rawSize = base->getSize();
+  if (rawSize < 0) {
+    return rawSize;
+  }
+  size_t avail = 0;
+  if (rawSize > rawOff) {
+    avail = (size_t)(rawSize - rawOff) < rawLen ? (size_t)(rawSize - rawOff)
+                                                : rawLen;
+  }
+  size_t len = avail > (size_t)headerLen ? avail - headerLen : 0;
+  memset(req.data, 0, len);
+  return len;
+}
+
 ssize_t CipherFileIO::readOneBlock(const IORequest& req) const {
+  off_t blockNum = _blocks.div(req.offset);
+  ENCFS_PROBE2(cipher_read_block_entry, blockNum, req.dataLen);
+  ProbeClock clock(ENCFS_PROBE_ENABLED(cipher_read_block_return));
+  ssize_t res = readCipherBlock(req);
+  ENCFS_PROBE3(cipher_read_block_return, blockNum, res, clock.elapsed());
+  return res;
+}
+
+ssize_t CipherFileIO::readCipherBlock(const IORequest& req) const {
+  if (aeadHeader > 0) {
+    return readAuthenticatedBlock(req);
+  }
+
   int bs = blockSize();
-  off_t blockNum = req.offset / bs;
+  off_t blockNum = _blocks.div(req.offset);
 
   IORequest tmpReq = req;
 
@@ -257,37 +595,210 @@ ssize_t CipherFileIO::readOneBlock(const IORequest& req) const {
     tmpReq.offset += HEADER_SIZE;
   }
 
-  ssize_t readSize = base->read(tmpReq);
+  // a block in a hole reads as zeros, no need to read or decode it
+  if (_allowHoles && !fsConfig->reverseEncryption &&
+      base->isHole(tmpReq.offset, tmpReq.dataLen)) {
+    return readHole(req, tmpReq.offset, tmpReq.dataLen, 0);
+  }
+
+  ssize_t readSize;
+  if (wantsHeader(tmpReq.offset)) {
+    struct iovec iov;
+    iov.iov_base = tmpReq.data;
+    iov.iov_len = tmpReq.dataLen;
+    IOVecRequest vreq;
+    vreq.offset = tmpReq.offset;
+    vreq.iov = &iov;
+    vreq.iovcnt = 1;
+    readSize = readWithHeader(vreq);
+  } else {
+    readSize = base->read(tmpReq);
+  }
+  Trace::event(Trace::BlockRead, blockNum, readSize);
 
   bool ok;
   if (readSize > 0) {
-    if (haveHeader && fileIV == 0) {
-      int res = const_cast<CipherFileIO*>(this)->initHeader();
-      if (res < 0) {
-        return res;
-      }
+    int res = loadHeader();
+    if (res < 0) {
+      return res;
     }
     if (readSize != bs) {
-      VLOG(1) << "streamRead(data," << readSize << ", IV)";
-      ok = streamRead(tmpReq,data, (int)readSize,
+      HOT_VLOG(1) << "streamRead(data," << readSize << ", IV)";
+      ok = streamRead(tmpReq.data, (int)readSize,
                       blockNum ^ fileIV);
     } else {
       ok = blockRead(tmpReq.data, (int)readSize,
                      blockNum ^ fileIV);
     }
     if (!ok) {
-      VLOG(1) << "decodeBlock failed for block " << blockNum << ", size "
-              << readSize;
+      HOT_VLOG(1) << "decodeBlock failed for block " << blockNum
+                  << ", size " << readSize;
+      Trace::event(Trace::DecodeFailed, blockNum, readSize);
       readSize = -EBADMSG;
     }
   } else if (readSize == 0) {
-    VLOG(1) << "readSize zero for offset " << req.offset;
+    HOT_VLOG(1) << "readSize zero for offset " << req.offset;
+  }
+
+  return readSize;
+}
+
+/**
+ * Read a run of whole blocks with a single scatter request to the base file
+ * and decode all of the full blocks as one batch. A trailing partial block
+ * (end of file) is stream decoded as in readOneBlock().
+ */
+ssize_t CipherFileIO::readBlocks(const IOVecRequest& req) const {
+  if (aeadHeader > 0) {
+    // each block is opened separately, one block at a time is as cheap
+    return BlockFileIO::readBlocks(req);
+  }
+
+  int bs = blockSize();
+  off_t blockNum = _blocks.div(req.offset);
+
+  IOVecRequest tmpReq = req;
+
+  if (haveHeader && !fsConfig->reverseEncryption) {
+    tmpReq.offset += HEADER_SIZE;
+  }
+
+  size_t len = req.dataLen();
+  if (_allowHoles && !fsConfig->reverseEncryption &&
+      base->isHole(tmpReq.offset, len)) {
+    ssize_t holeLen = 0;
+    off_t rawSize = base->getSize();
+    if (rawSize < 0) {
+      return rawSize;
+    }
+    if (rawSize > tmpReq.offset) {
+      holeLen = (size_t)(rawSize - tmpReq.offset) < len
+                    ? rawSize - tmpReq.offset
+                    : (off_t)len;
+    }
+    size_t left = holeLen;
+    for (int i = 0; i < req.iovcnt && left > 0; ++i) {
+      size_t n = req.iov[i].iov_len < left ? req.iov[i].iov_len : left;
+      memset(req.iov[i].iov_base, 0, n);
+      left -= n;
+    }
+    return holeLen;
+  }
+
+  ssize_t readSize = wantsHeader(tmpReq.offset) ? readWithHeader(tmpReq)
+                                                : base->readv(tmpReq);
+  Trace::event(Trace::BlockRead, blockNum, readSize);
+  if (readSize <= 0) {
+    if (readSize == 0) {
+      HOT_VLOG(1) << "readSize zero for offset " << req.offset;
+    }
+    return readSize;
+  }
+
+  int res = loadHeader();
+  if (res < 0) {
+    return res;
+  }
+
+  // every buffer holds whole blocks, so they can be decoded one by one
+  bool ok = true;
+  size_t remaining = readSize;
+  for (int i = 0; ok && i < req.iovcnt && remaining > 0; ++i) {
+    unsigned char* data = (unsigned char*)req.iov[i].iov_base;
+    size_t len = req.iov[i].iov_len < remaining ? req.iov[i].iov_len
+                                                : remaining;
+    int fullBlocks = (int)(len / bs);
+    int tail = (int)(len % bs);
+
+    if (fullBlocks > 0) {
+      ok = blockReadBatch(data, fullBlocks, blockNum);
+    }
+    if (ok && tail > 0) {
+      HOT_VLOG(1) << "streamRead(data," << tail << ", IV)";
+      ok = streamRead(data + (size_t)fullBlocks * bs, tail,
+                      (blockNum + fullBlocks) ^ fileIV);
+    }
+    blockNum += fullBlocks;
+    remaining -= len;
+  }
+
+  if (!ok) {
+    HOT_VLOG(1) << "decodeBlock failed for blocks starting at "
+                << req.offset / bs << ", size " << readSize;
+    Trace::event(Trace::DecodeFailed, req.offset / bs, readSize);
+    return -EBADMSG;
   }
 
   return readSize;
 }
 
+/**
+ * Encode a run of whole blocks in place as one batch and hand them to the
+ * base file with a single gather request.
+ */
+ssize_t CipherFileIO::writeBlocks(const IOVecRequest& req) {
+  if (!pipelinesWrites()) {
+    // per block framing, or an error reported by writeOneBlock()
+    return BlockFileIO::writeBlocks(req);
+  }
+
+  ssize_t res = prepareBlocks(req);
+  if (res < 0) {
+    return res;
+  }
+  return commitBlocks(req);
+}
+
+bool CipherFileIO::pipelinesWrites() const {
+  return aeadHeader == 0 && !(haveHeader && fsConfig->reverseEncryption);
+}
+
+ssize_t CipherFileIO::prepareBlocks(const IOVecRequest& req) {
+  int bs = blockSize();
+  off_t blockNum = _blocks.div(req.offset);
+
+  int res = loadHeader();
+  if (res < 0) {
+    return res;
+  }
+
+  for (int i = 0; i < req.iovcnt; ++i) {
+    int blocks = (int)(req.iov[i].iov_len / bs);
+    if (!blockWriteBatch((unsigned char*)req.iov[i].iov_base, blocks,
+                         blockNum)) {
+      HOT_VLOG(1) << "encodeBlock failed for blocks starting at "
+                  << blockNum;
+      Trace::event(Trace::EncodeFailed, blockNum, req.iov[i].iov_len);
+      return -EBADMSG;
+    }
+    blockNum += blocks;
+  }
+  return 0;
+}
+
+/**
+ * Store a run encoded by prepareBlocks().  The header is loaded by then,
+ * so this does not race a prepareBlocks() of the next run.
+ */
+ssize_t CipherFileIO::commitBlocks(const IOVecRequest& req) {
+  Trace::event(Trace::BlockWrite, req.offset / blockSize(), req.dataLen());
+  IOVecRequest tmpReq = req;
+  if (haveHeader) {
+    tmpReq.offset += HEADER_SIZE;
+  }
+  return writeBase(tmpReq);
+}
+
 ssize_t CipherFileIO::writeOneBlock(const IORequest& req) {
+  off_t blockNum = _blocks.div(req.offset);
+  ENCFS_PROBE2(cipher_write_block_entry, blockNum, req.dataLen);
+  ProbeClock clock(ENCFS_PROBE_ENABLED(cipher_write_block_return));
+  ssize_t res = writeCipherBlock(req);
+  ENCFS_PROBE3(cipher_write_block_return, blockNum, res, clock.elapsed());
+  return res;
+}
+
+ssize_t CipherFileIO::writeCipherBlock(const IORequest& req) {
   if (haveHeader && fsConfig->reverseEncryption) {
     VLOG(1) << "writing to a reverse mount with per-file IVs is not implemented";
     return -EPERM;
@@ -295,14 +806,16 @@ ssize_t CipherFileIO::writeOneBlock(const IORequest& req) {
 
   unsigned int bs = blockSize();
 
-  off_t blockNum = req.offset / bs;
+  off_t blockNum = _blocks.div(req.offset);
 
-  if (haveHeader && fileIV == 0) {
-    int res = initHeader();
-    if (res < 0) {
-      return res;
-    }
+  ssize_t res = loadHeader();
+  if (res < 0) {
+    return res;
+  }
+  if (aeadHeader > 0) {
+    return writeAuthenticatedBlock(req);
   }
+
   bool ok;
   if (req.dataLen != bs) {
     ok = streamWrite(req.data, (int)req.dataLen,
@@ -312,62 +825,300 @@ ssize_t CipherFileIO::writeOneBlock(const IORequest& req) {
         blockNum ^ fileIV);
   }
 
-  ssize_t res = 0;
   if (ok) {
     if (haveHeader) {
       IORequest tmpReq = req;
       tmpReq.offset += HEADER_SIZE;
-      res = base->write(tmpReq);
+      res = writeBase(tmpReq);
     } else {
       res = base->write(req);
     }
   } else {
-    VLOG(1) << "encodeBlock failed for block " << blockNum << ", size " 
-            << req.dataLen;
+    HOT_VLOG(1) << "encodeBlock failed for block " << blockNum << ", size "
+                << req.dataLen;
+    Trace::event(Trace::EncodeFailed, blockNum, req.dataLen);
+    res = -EBADMSG;
+  }
+  Trace::event(Trace::BlockWrite, blockNum, req.dataLen);
+  return res;
+}
+
+/**
+ * Read and authenticate one block of an AEAD-format file. The plaintext is
+ * decoded straight from the raw block into the caller's buffer.
+ */
+ssize_t CipherFileIO::readAuthenticatedBlock(const IORequest& req) const {
+  if (fsConfig->reverseEncryption) {
+    VLOG(1) << "reverse mode is not supported with authenticated blocks";
+    return -EPERM;
+  }
+
+  int bs = blockSize();
+  off_t blockNum = _blocks.div(req.offset);
+
+  PoolBlock mb(bs + aeadHeader);
+
+  IORequest tmpReq;
+  tmpReq.offset = blockNum * (bs + aeadHeader);
+  if (haveHeader) {
+    tmpReq.offset += HEADER_SIZE;
+  }
+  tmpReq.data = mb.data();
+  tmpReq.dataLen = req.dataLen + aeadHeader;
+
+  if (_allowHoles && base->isHole(tmpReq.offset, tmpReq.dataLen)) {
+    return readHole(req, tmpReq.offset, tmpReq.dataLen, aeadHeader);
+  }
+
+  ssize_t readSize = base->read(tmpReq);
+
+  if (readSize > aeadHeader) {
+    int res = loadHeader();
+    if (res < 0) {
+      return res;
+    }
+
+    int dataLen = (int)readSize - aeadHeader;
+
+    if (_allowHoles && isZero(mb.data(), readSize)) {
+      memset(req.data, 0, dataLen);
+      readSize = dataLen;
+    } else {
+      OpStats::count(OpStats::BlockDecodes);
+      if (cipher->aeadDecode(mb.data(), dataLen, blockNum ^ fileIV, req.data,
+                             key)) {
+        readSize = dataLen;
+      } else {
+        RLOG(WARNING) << "authentication failure in block " << blockNum;
+        readSize = fsConfig->opts->forceDecode ? dataLen : -EBADMSG;
+      }
+    }
+  } else if (readSize > 0) {
+    HOT_VLOG(1) << "readSize " << readSize << " at offset " << req.offset
+                << " too short for block header";
+    readSize = 0;
+  }
+
+  return readSize;
+}
+
+/**
+ * Seal and write one block of an AEAD-format file. The caller's buffer is
+ * left untouched, the ciphertext is built in a temporary block.
+ */
+ssize_t CipherFileIO::writeAuthenticatedBlock(const IORequest& req) {
+  if (fsConfig->reverseEncryption) {
+    VLOG(1) << "reverse mode is not supported with authenticated blocks";
+    return -EPERM;
+  }
+
+  int bs = blockSize();
+  off_t blockNum = _blocks.div(req.offset);
+
+  PoolBlock mb(bs + aeadHeader);
+
+  ssize_t res;
+  if (fsConfig->nonceBudget) {
+    res = fsConfig->nonceBudget->take();
+    if (res < 0) {
+      return res;
+    }
+  }
+  OpStats::count(OpStats::BlockEncodes);
+  if (cipher->aeadEncode(req.data, (int)req.dataLen, blockNum ^ fileIV,
+                         mb.data(), key)) {
+    IORequest tmpReq;
+    tmpReq.offset = blockNum * (bs + aeadHeader);
+    if (haveHeader) {
+      tmpReq.offset += HEADER_SIZE;
+    }
+    tmpReq.data = mb.data();
+    tmpReq.dataLen = req.dataLen + aeadHeader;
+
+    res = writeBase(tmpReq);
+    if (res >= 0) {
+      res = req.dataLen;
+    }
+  } else {
+    HOT_VLOG(1) << "encodeBlock failed for block " << blockNum << ", size "
+                << req.dataLen;
     res = -EBADMSG;
   }
+
   return res;
 }
 
 bool CipherFileIO::blockWrite(unsigned char* buf, int size,
     uint64_t _iv64) const {
-  VLOG(1) << "called blockWrite";
+  HOT_VLOG(1) << "called blockWrite";
+  StatTimer timer(OpStats::Encrypt);
+  timer.addBytes(size);
   if (!fsConfig->reverseEncryption) {
+    OpStats::count(OpStats::BlockEncodes);
     return cipher->blockEncode(buf, size, _iv64, key);
   }
+  OpStats::count(OpStats::BlockDecodes);
   return cipher->blockDecode(buf, size, _iv64, key);
 }
 
 bool CipherFileIO::streamWrite(unsigned char* buf, int size,
     uint64_t _iv64) const {
-  VLOG(1) << "Called streamWrite";
+  HOT_VLOG(1) << "Called streamWrite";
+  StatTimer timer(OpStats::Encrypt);
+  timer.addBytes(size);
   if (!fsConfig->reverseEncryption) {
+    OpStats::count(OpStats::StreamEncodes);
     return cipher->streamEncode(buf, size, _iv64, key);
   }
+  OpStats::count(OpStats::StreamDecodes);
   return cipher->streamDecode(buf, size, _iv64, key);
 }
 
 bool CipherFileIO::blockRead(unsigned char* buf, int size,
     uint64_t _iv64) const {
+  StatTimer timer(OpStats::Decrypt);
+  timer.addBytes(size);
   if (fsConfig->reverseEncryption) {
+    OpStats::count(OpStats::BlockEncodes);
     return cipher->blockEncode(buf, size, _iv64, key);
   }
-  if (_allowHoles) {
-    for (int i = 0; i < size; ++i) {
-      if (buf[i] != 0) {
-        return cipher->blockDeode(buf, size, _iv64, key);
-      }
-    }
+  if (_allowHoles && isZero(buf, size)) {
     return true;
   }
+  OpStats::count(OpStats::BlockDecodes);
   return cipher->blockDecode(buf, size, _iv64, key);
 }
 
+// smallest share of a batch worth handing to another thread
+static const size_t MinParallelBytes = 16 * 1024;
+
+/**
+ * Encode or decode a batch of blocks.  With a crypto pool, large batches
+ * are split into contiguous slices coded in parallel, queued in lane; every
+ * block has its own IV, so the slices are independent.
+ */
+static bool codeBatch(const std::shared_ptr<Cipher>& cipher,
+                      const CipherKey& key, ThreadPool* pool,
+                      ThreadPool::Lane lane,
+                      const std::vector<Cipher::BlockRequest>& batch,
+                      bool encode) {
+  int count = (int)batch.size();
+  size_t bytes = count > 0 ? (size_t)count * batch[0].size : 0;
+
+  int slices = 1;
+  if (pool != nullptr) {
+    slices = (int)(bytes / MinParallelBytes);
+    if (slices > pool->threads() + 1) {
+      slices = pool->threads() + 1;
+    }
+    if (slices > count) {
+      slices = count;
+    }
+  }
+
+  if (slices < 2) {
+    return encode ? cipher->blockEncodeBatch(batch.data(), count, key)
+                  : cipher->blockDecodeBatch(batch.data(), count, key);
+  }
+
+  return pool->forEach(
+      slices,
+      [&](int slice) {
+        int first = (int)((int64_t)count * slice / slices);
+        int last = (int)((int64_t)count * (slice + 1) / slices);
+        return encode
+                   ? cipher->blockEncodeBatch(&batch[first], last - first, key)
+                   : cipher->blockDecodeBatch(&batch[first], last - first, key);
+      },
+      lane);
+}
+
+/**
+ * The per-thread batch of a blockReadBatch() or blockWriteBatch() call,
+ * emptied: a 1 MiB request is 256 entries, rather not allocated on each.
+ * Coding never reenters these on the same thread.
+ */
+static std::vector<Cipher::BlockRequest>& threadBatch(int blocks) {
+  static thread_local std::vector<Cipher::BlockRequest> batch;
+  batch.clear();
+  batch.reserve(blocks);
+  return batch;
+}
+
+/**
+ * Batch equivalent of calling blockRead() on each of `blocks` consecutive full
+ * blocks in buf, the first of which is block number firstBlock.
+ */
+bool CipherFileIO::blockReadBatch(unsigned char* buf, int blocks,
+    uint64_t firstBlock) const {
+  int bs = blockSize();
+
+  std::vector<Cipher::BlockRequest>& batch = threadBatch(blocks);
+  for (int i = 0; i < blocks; ++i) {
+    unsigned char* blockData = buf + (size_t)i * bs;
+
+    // with holes allowed, all-zero blocks are left as they are
+    if (_allowHoles && !fsConfig->reverseEncryption &&
+        isZero(blockData, bs)) {
+      continue;
+    }
+
+    Cipher::BlockRequest block;
+    block.buf = blockData;
+    block.size = bs;
+    block.iv64 = (firstBlock + i) ^ fileIV;
+    batch.push_back(block);
+  }
+
+  if (batch.empty()) {
+    return true;
+  }
+  StatTimer timer(OpStats::Decrypt);
+  timer.addBytes(batch.size() * bs);
+  OpStats::count(fsConfig->reverseEncryption ? OpStats::BlockEncodes
+                                             : OpStats::BlockDecodes,
+                 batch.size());
+  return codeBatch(cipher, key, fsConfig->cryptoPool.get(), ThreadPool::Demand,
+                   batch, fsConfig->reverseEncryption);
+}
+
+/**
+ * Batch equivalent of calling blockWrite() on each of `blocks` consecutive
+ * full blocks in buf, the first of which is block number firstBlock.
+ */
+bool CipherFileIO::blockWriteBatch(unsigned char* buf, int blocks,
+    uint64_t firstBlock) const {
+  int bs = blockSize();
+
+  std::vector<Cipher::BlockRequest>& batch = threadBatch(blocks);
+  batch.resize(blocks);
+  for (int i = 0; i < blocks; ++i) {
+    batch[i].buf = buf + (size_t)i * bs;
+    batch[i].size = bs;
+    batch[i].iv64 = (firstBlock + i) ^ fileIV;
+  }
+
+  if (batch.empty()) {
+    return true;
+  }
+  StatTimer timer(OpStats::Encrypt);
+  timer.addBytes(batch.size() * bs);
+  OpStats::count(fsConfig->reverseEncryption ? OpStats::BlockDecodes
+                                             : OpStats::BlockEncodes,
+                 batch.size());
+  return codeBatch(cipher, key, fsConfig->cryptoPool.get(), ThreadPool::Write,
+                   batch, !fsConfig->reverseEncryption);
+}
+
 bool CipherFileIO::streamRead(unsigned char* buf, int size,
     uint64_t _iv64) const {
+  StatTimer timer(OpStats::Decrypt);
+  timer.addBytes(size);
   if (fsConfig->reverseEncryption) {
+    OpStats::count(OpStats::StreamEncodes);
     return cipher->streamEncode(buf, size, _iv64, key);
   }
+  OpStats::count(OpStats::StreamDecodes);
   return cipher->streamDecode(buf, size, _iv64, key);
 }
 
@@ -387,16 +1138,42 @@ int CipherFileIO::truncate(off_t size) {
     }
     reopen = 1;
   }
-  if (!haveHeader) {
+  off_t oldSize = getSize();
+  if (aeadHeader == 0 && haveHeader && !fsConfig->reverseEncryption &&
+      oldSize >= 0 &&
+      (size == oldSize || (size < oldSize && size % blockSize() == 0))) {
+    // no block is coded, so the header need not be read: it stays on disk
+    // if it is there (an O_TRUNC keeps it), and is still pending if not
+    res = BlockFileIO::truncateBase(size, nullptr);
+    if (res == 0) {
+      off_t rawSize = base->getSize();
+      res = base->truncate(rawSize >= HEADER_SIZE ? size + HEADER_SIZE : 0);
+    }
+  } else if (aeadHeader > 0) {
+    // the base size is not the plain size, so truncate it ourselves
+    res = loadHeader();
+
+    if (res == 0) {
+      res = BlockFileIO::truncateBase(size, nullptr);
+    }
+    if (res == 0) {
+      res = flushHeader();
+    }
+    if (res == 0) {
+      off_t rawSize = aeadRawSize(size, blockSize(), aeadHeader);
+      res = base->truncate(haveHeader ? rawSize + HEADER_SIZE : rawSize);
+    }
+  } else if (!haveHeader) {
     res = BlockFileIO::truncateBase(size, base.get());
   } else {
-    if (i == fileIV) {
-      res = initHeader();
-    }
+    res = loadHeader();
 
     if (res == 0) {
       res = BlockFileIO::truncateBase(size, nullptr);
     }
+    if (res == 0) {
+      res = flushHeader();
+    }
     if (res == 0) {
       res = base->truncate(size + HEADER_SIZE);
     }
@@ -419,18 +1196,23 @@ ssize_t CipherFileIO::read(const IORequest& origReq) const {
    * the read request is handled by the base class
    */
   if (!(fsConfig->reverseEncryption && haveHeader)) {
-    VLOG(1) << "relaying request to base class: offset = " << origReq.offset
-            << ", dataLen= " << origReq.dataLen;
+    HOT_VLOG(1) << "relaying request to base class: offset = "
+                << origReq.offset << ", dataLen= " << origReq.dataLen;
     return BlockFileIO::read(origReq);
   }
 
-  VLOG(1) << "handling reverse unique IV read : offset = " << origReq.offset;
-          << ", dataLen= " << origReq.dataLen;
+  HOT_VLOG(1) << "handling reverse unique IV read : offset = "
+              << origReq.offset << ", dataLen= " << origReq.dataLen;
 
   // generate the five IV header
   // this is needed in any case - without IV the file cannot be decoded
   unsigned char headerBuf[HEADER_SIZE];
-  int res = const_cast<CipherFileIO*>(this)->generateReverseHeader(headerBuf);
+  int res;
+  {
+    // concurrent reads of the file may both get here
+    Lock lock(headerMutex);
+    res = const_cast<CipherFileIO*>(this)->generateReverseHeader(headerBuf);
+  }
   if (res < 0) {
     return res;
   }
@@ -447,7 +1229,7 @@ ssize_t CipherFileIO::read(const IORequest& origReq) const {
       headerBytes = req.dataLen;
     }
 
-    VLOG(1) << "Adding " << headerBytes << " header bytes";
+    HOT_VLOG(1) << "Adding " << headerBytes << " header bytes";
 
     int headerOffset = 
         HEADER_SIZE - headerBytes;
@@ -463,14 +1245,14 @@ ssize_t CipherFileIO::read(const IORequest& origReq) const {
     req.dataLen -= headerBytes;
   }
   ssize_t readBytes = BlockFileIO::read(req);
-  VLOG(1) << "read " << readBytes << " bytes from backing file";
+  HOT_VLOG(1) << "read " << readBytes << " bytes from backing file";
   if (readBytes < 0) {
     return readBytes;
   }
 
   ssize_t sum = 
     headerBytes + readBytes;
-  VLOG(1) << "returning sum = " << sum;
+  HOT_VLOG(1) << "returning sum = " << sum;
   return sum;
 }
 
@@ -1,8 +1,10 @@
 #ifndef _CipherFileIO_incl_
 #define _CipherFileIO_incl_
 
+#include <atomic>
 #include <inttypes.h>
 #include <memory>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -28,7 +30,8 @@ namespace encfs {
             CipherFileIO(std::shared_ptr<FileIO> base, const FSConfigPtr& cfg);
             virtual ~CipherFileIO();
 
-            virtual Interface intefface() const;
+            virtual Interface interface() const;
+            virtual void setFileName(const char* fileName);
             virtual const char* getFileName() const;
             virtual bool setIV(uint64_t iv);
 
@@ -36,35 +39,110 @@ namespace encfs {
 
             virtual int getAttr(struct stat* stbuf) const;
             virtual off_t getSize() const;
+            // turn the attributes of a backing file into the ones getAttr
+            // reports for it, without opening it
+            static void plainAttr(const FSConfigPtr& cfg, struct stat* stbuf);
             
             virtual int truncate(off_t size);
 
             virtual bool isWritable() const;
 
+            virtual bool isHole(off_t offset, size_t len) const;
+            virtual off_t seekExtent(off_t offset, bool hole) const;
+            virtual int allocate(int mode, off_t offset, off_t len);
+            virtual void invalidateAttr();
+
+            // the base descriptor when file data is stored unencoded
+            // (plainData) with no header, block tags or reverse mapping
+            virtual int passthroughFd() const;
+            virtual void invalidateData(off_t offset, size_t len);
+            virtual void advise(off_t offset, off_t len, Advice advice) const;
+
         private:
             virtual ssize_t readOneBlock(const IORequest& req) const;
-            virtual ssize_t wirteOneBlock(const IORequest& req);
+            virtual ssize_t readBlocks(const IOVecRequest& req) const;
+            virtual ssize_t writeBlocks(const IOVecRequest& req);
+            virtual bool pipelinesWrites() const;
+            virtual ssize_t prepareBlocks(const IOVecRequest& req);
+            virtual ssize_t commitBlocks(const IOVecRequest& req);
+            ssize_t readAuthenticatedBlock(const IORequest& req) const;
+            ssize_t writeAuthenticatedBlock(const IORequest& req);
+            virtual ssize_t writeOneBlock(const IORequest& req);
+            // readOneBlock() and writeOneBlock() without their probes
+            ssize_t readCipherBlock(const IORequest& req) const;
+            ssize_t writeCipherBlock(const IORequest& req);
             virtual int generateReverseHeader(unsigned char* data);
 
+            int loadHeader() const;
             int initHeader();
-            bool wirteHeader();
+            // the file IV of an encoded header, false if it does not decode
+            bool decodeHeader(unsigned char* buf, uint64_t* iv) const;
+            // takes the header read along with the first block, unless
+            // another read loaded it first.  0 or -errno.
+            int adoptHeader(unsigned char* buf);
+            // whether a read at raw offset of the first block should fetch
+            // the header with it
+            bool wantsHeader(off_t offset) const;
+            // base->readv of raw, the request of the first blocks, with the
+            // header in front of it: one read of a small file, not two.
+            // Returns the bytes of raw read, or -errno.
+            ssize_t readWithHeader(const IOVecRequest& raw) const;
+            bool writeHeader();
+            // writes the header of a new file, if initHeader() kept it back
+            int flushHeader();
+            // base->write of a raw request, which carries the header kept
+            // back when it starts right after it
+            ssize_t writeBase(const IORequest& raw);
+            ssize_t writeBase(const IOVecRequest& raw);
             bool blockRead(unsigned char* buf, int size, uint64_t iv64) const;
             bool streamRead(unsigned char* buf, int size, uint64_t iv64) const;
+            bool blockReadBatch(unsigned char* buf, int blocks,
+                                uint64_t firstBlock) const;
             bool blockWrite(unsigned char* buf, int size, uint64_t iv64) const;
+            bool blockWriteBatch(unsigned char* buf, int blocks,
+                                 uint64_t firstBlock) const;
             bool streamWrite(unsigned char* buf, int size, uint64_t iv64) const;
 
-            ssize_t read(const IORequest& req) const;
+            // offset in the base file of plaintext offset, which must be
+            // block aligned
+            off_t rawOffset(off_t offset) const;
+            virtual off_t baseOffset(off_t offset) const;
+            // serve a read inside a hole of the base file as zeros.  rawLen
+            // is what a read of the base file would have asked for, headerLen
+            // the part of it that is not plaintext.
+            ssize_t readHole(const IORequest& req, off_t rawOff, size_t rawLen,
+                             int headerLen) const;
 
             std::shared_ptr<FileIO> base;
 
-            FSConfigPtr FSConfig;
+            FSConfigPtr fsConfig;
 
             // if haveHeader is true, then we have a transparent file header
             // which contains a 64 initialization vector
             bool haveHeader;
-            uint64_t fileIV;
+            // size of the per-block nonce and tag when the cipher seals
+            // blocks with an authenticated mode, otherwise 0
+            int aeadHeader;
+            uint64_t externalIV;
+            // set once the header is read, reads test it without a lock
+            std::atomic<uint64_t> fileIV;
+            // serializes the creation of the header, and of the reverse
+            // header, between foreground reads and read-ahead jobs
+            mutable pthread_mutex_t headerMutex;
             int lastFlags;
 
+            // the encoded header of a new file, not written yet.  It goes
+            // out with the first block, or before anything else changes
+            // the base file; a file closed empty needs none.
+            bool headerPending;
+            unsigned char pendingHeader[sizeof(uint64_t)];
+
+            // reverse mode: the encoded header, generated on the first read
+            // and kept while externalIV is the one it was encoded with
+            bool haveReverseHeader;
+            uint64_t reverseHeaderIV;
+            unsigned char reverseHeader[sizeof(uint64_t)];
+
             std::shared_ptr<Cipher> cipher;
             CipherKey key;
     };
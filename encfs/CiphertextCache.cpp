@@ -0,0 +1,420 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CiphertextCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+const char CiphertextCache::DataName[] = "chunks";
+const char CiphertextCache::IndexName[] = "index";
+
+// the index: magic, version, chunk size and record count, then a record
+// per cached chunk
+static const uint32_t IndexMagic = 0x43435345;  // "ESCC"
+static const uint32_t IndexVersion = 1;
+static const size_t IndexHeaderSize = 16;
+// dev, inode, chunk, slot and length, then the size and mtime of the
+// backing file it was read at
+static const size_t RecordSize = 56;
+
+struct CiphertextCache::File {
+  Inode inode;
+  // of the backing file the chunks were read at
+  bool stamped;
+  off_t size;
+  struct timespec mtime;
+  // written through us since, take what it then has at the next validate
+  bool restamp;
+  // moves when chunks are dropped, see put()
+  uint64_t generation;
+  size_t chunks;
+  int users;
+};
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+CiphertextCache::CiphertextCache(const std::string &dir, uint64_t maxBytes)
+    : _dir(dir), _fd(-1) {
+  if (!_dir.empty() && _dir[_dir.length() - 1] != '/') {
+    _dir += '/';
+  }
+  _slots = (uint32_t)std::min<uint64_t>(
+      std::max<uint64_t>(maxBytes / ChunkSize, 1), UINT32_MAX);
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+CiphertextCache::~CiphertextCache() {
+  if (_fd >= 0) {
+    saveIndex();
+    ::close(_fd);
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool CiphertextCache::open() {
+  if (::mkdir(_dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    RLOG(ERROR) << "can not create ciphertext cache " << _dir << ": "
+                << strerror(errno);
+    return false;
+  }
+  std::string path = _dir + DataName;
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (_fd < 0) {
+    RLOG(ERROR) << "can not open " << path << ": " << strerror(errno);
+    return false;
+  }
+  // one process at a time, the slots are not shared
+  if (::flock(_fd, LOCK_EX | LOCK_NB) != 0) {
+    RLOG(ERROR) << "ciphertext cache " << _dir << " is in use";
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+  struct stat st;
+  off_t size = (off_t)_slots * ChunkSize;
+  if (::fstat(_fd, &st) != 0 ||
+      (st.st_size != size && ::ftruncate(_fd, size) != 0)) {
+    RLOG(ERROR) << "can not size " << path << ": " << strerror(errno);
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  _slot.resize(_slots);
+  _free.reserve(_slots);
+  for (uint32_t i = 0; i < _slots; ++i) {
+    _slot[i].len = 0;
+    _slot[i].generation = 0;
+    _slot[i].used = false;
+  }
+  // a new data file holds none of the chunks an index could name
+  bool loaded = st.st_size > 0 && loadIndex();
+  // gone until we write it back, a crash in between leaves no index
+  ::unlink((_dir + IndexName).c_str());
+  for (uint32_t i = _slots; i > 0; --i) {
+    if (!_slot[i - 1].used) {
+      _free.push_back(i - 1);
+    }
+  }
+  VLOG(1) << "ciphertext cache " << _dir << ": " << _slots << " chunks, "
+          << (loaded ? _index.size() : 0) << " cached";
+  return true;
+}
+
+bool CiphertextCache::loadIndex() {
+  std::string path = _dir + IndexName;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  unsigned char header[IndexHeaderSize];
+  bool ok = ::read(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+            get32(header) == IndexMagic && get32(header + 4) == IndexVersion &&
+            get32(header + 8) == ChunkSize;
+  uint32_t count = ok ? get32(header + 12) : 0;
+
+  std::vector<unsigned char> buf((size_t)std::min(count, _slots) * RecordSize);
+  ok = ok && ::read(fd, buf.data(), buf.size()) == (ssize_t)buf.size();
+  ::close(fd);
+  if (!ok) {
+    RLOG(WARNING) << "ignoring damaged ciphertext cache index " << path;
+    return false;
+  }
+
+  for (size_t pos = 0; pos < buf.size(); pos += RecordSize) {
+    const unsigned char *r = &buf[pos];
+    Key key((dev_t)get64(r), (ino_t)get64(r + 8), (off_t)get64(r + 16));
+    uint32_t slot = get32(r + 24);
+    size_t len = get32(r + 28);
+    // a smaller cache than last time keeps the chunks that still fit
+    if (slot >= _slots || _slot[slot].used || len > ChunkSize ||
+        _index.count(key) != 0) {
+      continue;
+    }
+    Inode inode(std::get<0>(key), std::get<1>(key));
+    std::shared_ptr<File> &file = _files[inode];
+    if (!file) {
+      file = std::make_shared<File>();
+      file->inode = inode;
+      file->stamped = true;
+      file->size = (off_t)get64(r + 32);
+      file->mtime.tv_sec = (time_t)get64(r + 40);
+      file->mtime.tv_nsec = (long)get64(r + 48);
+      file->restamp = false;
+      file->generation = 0;
+      file->chunks = 0;
+      file->users = 0;
+    }
+    Slot &s = _slot[slot];
+    s.key = key;
+    s.len = len;
+    s.used = true;
+    s.lru = _lru.insert(_lru.end(), slot);
+    _index[key] = slot;
+    ++file->chunks;
+  }
+  return true;
+}
+
+void CiphertextCache::saveIndex() {
+  std::vector<unsigned char> buf(IndexHeaderSize);
+  uint32_t count = 0;
+  // in the order they were read, so that the next mount evicts the same
+  for (uint32_t slot : _lru) {
+    const Slot &s = _slot[slot];
+    auto it = _files.find(Inode(std::get<0>(s.key), std::get<1>(s.key)));
+    if (it == _files.end() || !it->second->stamped || it->second->restamp) {
+      continue;
+    }
+    const File &file = *it->second;
+    unsigned char r[RecordSize];
+    put64(r, (uint64_t)std::get<0>(s.key));
+    put64(r + 8, (uint64_t)std::get<1>(s.key));
+    put64(r + 16, (uint64_t)std::get<2>(s.key));
+    put32(r + 24, slot);
+    put32(r + 28, (uint32_t)s.len);
+    put64(r + 32, (uint64_t)file.size);
+    put64(r + 40, (uint64_t)file.mtime.tv_sec);
+    put64(r + 48, (uint64_t)file.mtime.tv_nsec);
+    buf.insert(buf.end(), r, r + RecordSize);
+    ++count;
+  }
+  put32(&buf[0], IndexMagic);
+  put32(&buf[4], IndexVersion);
+  put32(&buf[8], ChunkSize);
+  put32(&buf[12], count);
+
+  // the chunks named must be on disk before the index naming them
+  std::string path = _dir + IndexName;
+  std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  bool ok = fd >= 0 && ::fdatasync(_fd) == 0 &&
+            ::write(fd, buf.data(), buf.size()) == (ssize_t)buf.size() &&
+            ::fsync(fd) == 0;
+  if (fd >= 0) {
+    ok = ::close(fd) == 0 && ok;
+  }
+  if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+    RLOG(WARNING) << "can not write ciphertext cache index " << path << ": "
+                  << strerror(errno);
+    ::unlink(tmp.c_str());
+  }
+}
+
+static bool sameStamp(const CiphertextCache::File &file,
+                      const struct stat &st) {
+  return file.size == st.st_size && file.mtime.tv_sec == st.st_mtim.tv_sec &&
+         file.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+std::shared_ptr<CiphertextCache::File> CiphertextCache::attach(
+    const struct stat &st) {
+  Lock lock(_mutex);
+  std::shared_ptr<File> &file = _files[Inode(st.st_dev, st.st_ino)];
+  if (!file) {
+    file = std::make_shared<File>();
+    file->inode = Inode(st.st_dev, st.st_ino);
+    file->stamped = false;
+    file->size = 0;
+    file->mtime.tv_sec = 0;
+    file->mtime.tv_nsec = 0;
+    file->restamp = false;
+    file->generation = 0;
+    file->chunks = 0;
+    file->users = 0;
+  }
+  ++file->users;
+  return file;
+}
+
+void CiphertextCache::detach(const std::shared_ptr<File> &file) {
+  Lock lock(_mutex);
+  if (--file->users == 0 && file->chunks == 0) {
+    _files.erase(file->inode);
+  }
+}
+
+uint64_t CiphertextCache::validate(File &file, const struct stat &st) {
+  Lock lock(_mutex);
+  if (file.stamped && !file.restamp && !sameStamp(file, st)) {
+    VLOG(1) << "backing file " << file.inode.second
+            << " changed, dropping its cached chunks";
+    dropChunks(file, 0, -1);
+  }
+  file.stamped = true;
+  file.restamp = false;
+  file.size = st.st_size;
+  file.mtime = st.st_mtim;
+  return file.generation;
+}
+
+ssize_t CiphertextCache::read(File &file, off_t chunk, size_t offset,
+                              unsigned char *data, size_t len) {
+  uint32_t slot;
+  uint64_t generation;
+  {
+    Lock lock(_mutex);
+    auto it = _index.find(Key(file.inode.first, file.inode.second, chunk));
+    if (it == _index.end()) {
+      return -1;
+    }
+    slot = it->second;
+    Slot &s = _slot[slot];
+    _lru.splice(_lru.begin(), _lru, s.lru);
+    len = offset < s.len ? std::min(len, s.len - offset) : 0;
+    generation = s.generation;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  ssize_t got = ::pread(_fd, data, len, (off_t)slot * ChunkSize + offset);
+  if (got != (ssize_t)len) {
+    RLOG(WARNING) << "ciphertext cache read failed: "
+                  << (got < 0 ? strerror(errno) : "short read");
+    return -1;
+  }
+  Lock lock(_mutex);
+  // taken for another chunk while we read it
+  return _slot[slot].generation == generation ? got : -1;
+}
+
+void CiphertextCache::put(File &file, uint64_t generation, off_t chunk,
+                          const unsigned char *data, size_t len) {
+  Key key(file.inode.first, file.inode.second, chunk);
+  uint32_t slot;
+  {
+    Lock lock(_mutex);
+    if (file.generation != generation || _index.count(key) != 0) {
+      return;
+    }
+    if (_free.empty()) {
+      if (_lru.empty()) {
+        return;  // every slot is being written
+      }
+      release(_lru.back());
+    }
+    // off both lists while it is written, nothing else takes it
+    slot = _free.back();
+    _free.pop_back();
+  }
+  ssize_t res = ::pwrite(_fd, data, len, (off_t)slot * ChunkSize);
+
+  Lock lock(_mutex);
+  if (res != (ssize_t)len || file.generation != generation ||
+      _index.count(key) != 0) {
+    if (res != (ssize_t)len) {
+      RLOG(WARNING) << "ciphertext cache write failed: "
+                    << (res < 0 ? strerror(errno) : "short write");
+    }
+    _free.push_back(slot);
+    return;
+  }
+  Slot &s = _slot[slot];
+  s.key = key;
+  s.len = len;
+  s.used = true;
+  s.lru = _lru.insert(_lru.begin(), slot);
+  _index[key] = slot;
+  ++file.chunks;
+}
+
+void CiphertextCache::drop(File &file, off_t offset, size_t len) {
+  Lock lock(_mutex);
+  off_t first = offset / (off_t)ChunkSize;
+  off_t last = len == 0 ? -1 : (off_t)((offset + len - 1) / ChunkSize);
+  dropChunks(file, first, last);
+  // a short chunk ends the file, which the write may have moved
+  auto end = _index.upper_bound(
+      Key(file.inode.first, file.inode.second,
+          std::numeric_limits<off_t>::max()));
+  if (end != _index.begin()) {
+    --end;
+    if (std::get<0>(end->first) == file.inode.first &&
+        std::get<1>(end->first) == file.inode.second &&
+        _slot[end->second].len < ChunkSize) {
+      uint32_t slot = end->second;
+      release(slot);
+    }
+  }
+  file.restamp = true;
+}
+
+void CiphertextCache::dropChunks(File &file, off_t first, off_t last) {
+  ++file.generation;
+  auto it = _index.lower_bound(Key(file.inode.first, file.inode.second, first));
+  while (it != _index.end() && std::get<0>(it->first) == file.inode.first &&
+         std::get<1>(it->first) == file.inode.second &&
+         (last < 0 || std::get<2>(it->first) <= last)) {
+    uint32_t slot = (it++)->second;
+    release(slot);
+  }
+}
+
+void CiphertextCache::release(uint32_t slot) {
+  Slot &s = _slot[slot];
+  Inode inode(std::get<0>(s.key), std::get<1>(s.key));
+  _index.erase(s.key);
+  _lru.erase(s.lru);
+  s.used = false;
+  ++s.generation;
+  _free.push_back(slot);
+
+  auto it = _files.find(inode);
+  if (it != _files.end()) {
+    File &file = *it->second;
+    if (--file.chunks == 0 && file.users == 0) {
+      _files.erase(it);
+    }
+  }
+}
+
+}  // namespace encfs
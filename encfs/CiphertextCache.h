@@ -0,0 +1,120 @@
+#ifndef _CiphertextCache_incl_
+#define _CiphertextCache_incl_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace encfs {
+
+/*
+    A cache on local disk of the backing files of a mount whose backing
+    directory is slow to reach, NFS, SMB or an object store behind FUSE
+    (--ciphertext-cache).  Read through CachingFileIO, right above the
+    RawFileIO of each backing file, so it holds the bytes as they are
+    stored: encrypted, MACs and all.  Shared by the volumes of a process.
+
+    Backing files are cached in chunks of ChunkSize bytes, in the slots of
+    one data file of a size fixed when the cache is opened; the slot of the
+    least recently read chunk is taken for a new one.  The chunks of a file
+    are looked up by inode and hold while the file has the size and mtime
+    they were read at: a file that changed behind our back loses them at
+    its next read.  Writes through the mount drop the chunks they cover.
+
+    The index of the slots is kept in memory, written next to the data when
+    the cache is closed and removed when it is opened, so that a crash
+    leaves an empty cache rather than one that can not be trusted.
+ */
+class CiphertextCache {
+ public:
+  static const size_t ChunkSize = 64 * 1024;
+  // the data and the index, in the directory of the cache
+  static const char DataName[];
+  static const char IndexName[];
+
+  // the chunks of one backing file cached, defined in CiphertextCache.cpp
+  struct File;
+
+  CiphertextCache(const std::string &dir, uint64_t maxBytes);
+  // writes the index
+  ~CiphertextCache();
+
+  // creates the directory and its data file, and loads the index a
+  // previous mount left.  False if the cache can not be used.
+  bool open();
+
+  // the chunks of the backing file with attributes st, held until
+  // detach()
+  std::shared_ptr<File> attach(const struct stat &st);
+  void detach(const std::shared_ptr<File> &file);
+
+  // drops the chunks of file if the backing file no longer has the size
+  // and mtime of st.  Returns a generation to pass to put() for chunks
+  // read from it from now on.
+  uint64_t validate(File &file, const struct stat &st);
+
+  // copies up to len bytes at offset in chunk into data.  Returns how many
+  // there were, fewer than asked past the end of the file, or -1 if the
+  // chunk is not cached.
+  ssize_t read(File &file, off_t chunk, size_t offset, unsigned char *data,
+               size_t len);
+  // stores the len bytes of chunk read from the backing file, unless
+  // something dropped chunks of file since validate() gave generation
+  void put(File &file, uint64_t generation, off_t chunk,
+           const unsigned char *data, size_t len);
+
+  // drops the chunks of file covering the len bytes at offset, all of
+  // them if len is 0, once the backing file was changed through us.  The
+  // size and mtime it then has are taken at the next validate().
+  void drop(File &file, off_t offset, size_t len);
+
+ private:
+  using Inode = std::pair<dev_t, ino_t>;
+  using Key = std::tuple<dev_t, ino_t, off_t>;
+
+  struct Slot {
+    Key key;
+    size_t len;
+    // moves when the slot is taken for another chunk, see read()
+    uint64_t generation;
+    bool used;
+    std::list<uint32_t>::iterator lru;
+  };
+
+  // frees the slot, and the File of its chunk if that was its last.
+  // Caller holds _mutex.
+  void release(uint32_t slot);
+  // drops the chunks of file from first on, to last if last >= 0.  Caller
+  // holds _mutex.
+  void dropChunks(File &file, off_t first, off_t last);
+
+  bool loadIndex();
+  void saveIndex();
+
+  std::string _dir;
+  uint32_t _slots;
+  int _fd;
+
+  pthread_mutex_t _mutex;
+  std::vector<Slot> _slot;
+  std::vector<uint32_t> _free;
+  // most recently read at the front
+  std::list<uint32_t> _lru;
+  std::map<Key, uint32_t> _index;
+  std::map<Inode, std::shared_ptr<File>> _files;
+
+  CiphertextCache(const CiphertextCache &);             // not allowed
+  CiphertextCache &operator=(const CiphertextCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,507 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CompressedFileIO.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <utility>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "Mutex.h"
+
+#if defined(__has_include)
+#if __has_include(<lz4.h>)
+#define ENCFS_HAVE_LZ4 1
+#include <lz4.h>
+#endif
+#if __has_include(<zstd.h>)
+#define ENCFS_HAVE_ZSTD 1
+#include <zstd.h>
+#endif
+#endif
+
+namespace encfs {
+
+static Interface CompressedFileIO_iface("FileIO/Compressed", 1, 0, 0);
+
+// how the data of a chunk is stored, the first byte of its header
+enum ChunkMethod {
+  Chunk_Zero = 0,    // nothing stored, all zeros (also a hole)
+  Chunk_Stored = 1,  // as it is, compressing did not make it smaller
+  Chunk_LZ4 = 2,
+  Chunk_Zstd = 3
+};
+
+// zstd's default, a good deal faster than the levels that gain little more
+static const int ZstdLevel = 3;
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+// the block size of the layer below, which slots are a multiple of
+static int baseBlockSize(const FSConfigPtr &cfg) {
+  const EncFSConfig &config = *cfg->config;
+  if (config.blockMACBytes != 0 || config.blockMACRandBytes != 0) {
+    return config.blockSize - config.blockMACBytes - config.blockMACRandBytes;
+  }
+  return config.blockSize - cfg->cipher->aeadHeaderSize();
+}
+
+bool CompressedFileIO::supported(int algorithm) {
+  switch (algorithm) {
+    case Compression_None:
+      return true;
+#ifdef ENCFS_HAVE_LZ4
+    case Compression_LZ4:
+      return true;
+#endif
+#ifdef ENCFS_HAVE_ZSTD
+    case Compression_Zstd:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+const char *CompressedFileIO::algorithmName(int algorithm) {
+  switch (algorithm) {
+    case Compression_None:
+      return "none";
+    case Compression_LZ4:
+      return "LZ4";
+    case Compression_Zstd:
+      return "zstd";
+    default:
+      return "unknown";
+  }
+}
+
+off_t CompressedFileIO::slotSize(const FSConfigPtr &cfg) {
+  off_t bs = baseBlockSize(cfg);
+  off_t need = cfg->config->compressionChunk + ChunkHeader;
+  return (need + bs - 1) / bs * bs;
+}
+
+void CompressedFileIO::plainAttr(const FSConfigPtr &cfg, struct stat *stbuf) {
+  if (!S_ISREG(stbuf->st_mode) || stbuf->st_size <= ChunkHeader) {
+    if (S_ISREG(stbuf->st_mode)) {
+      stbuf->st_size = 0;
+    }
+    return;
+  }
+  off_t chunk = cfg->config->compressionChunk;
+  off_t slot = slotSize(cfg);
+  off_t last = (stbuf->st_size - ChunkHeader - 1) / slot;
+  off_t len = stbuf->st_size - last * slot - ChunkHeader;
+  stbuf->st_size = last * chunk + std::min(len, chunk);
+}
+
+CompressedFileIO::CompressedFileIO(std::shared_ptr<FileIO> _base,
+                                   const FSConfigPtr &cfg)
+    : base(std::move(_base)),
+      algorithm(cfg->config->compression),
+      chunkSize(cfg->config->compressionChunk),
+      slot(slotSize(cfg)),
+      cacheChunk(-1),
+      cacheLen(0) {
+  rAssert(chunkSize > 0);
+  rAssert(supported(algorithm));
+  pthread_mutex_init(&cacheMutex, nullptr);
+}
+
+CompressedFileIO::~CompressedFileIO() { pthread_mutex_destroy(&cacheMutex); }
+
+Interface CompressedFileIO::interface() const {
+  return CompressedFileIO_iface;
+}
+
+unsigned int CompressedFileIO::blockSize() const { return chunkSize; }
+
+void CompressedFileIO::setFileName(const char *fileName) {
+  base->setFileName(fileName);
+}
+
+const char *CompressedFileIO::getFileName() const {
+  return base->getFileName();
+}
+
+bool CompressedFileIO::setIV(uint64_t iv) { return base->setIV(iv); }
+
+int CompressedFileIO::open(int flags) { return base->open(flags); }
+
+off_t CompressedFileIO::plainSize(off_t size) const {
+  if (size <= ChunkHeader) {
+    return 0;
+  }
+  off_t last = (size - ChunkHeader - 1) / slot;
+  off_t len = size - last * slot - ChunkHeader;
+  return last * (off_t)chunkSize + std::min(len, (off_t)chunkSize);
+}
+
+off_t CompressedFileIO::baseSize(off_t size) const {
+  if (size <= 0) {
+    return 0;
+  }
+  off_t last = (size - 1) / chunkSize;
+  return last * slot + ChunkHeader + (size - last * (off_t)chunkSize);
+}
+
+int CompressedFileIO::getAttr(struct stat *stbuf) const {
+  int res = base->getAttr(stbuf);
+  if (res == 0 && S_ISREG(stbuf->st_mode)) {
+    stbuf->st_size = plainSize(stbuf->st_size);
+  }
+  return res;
+}
+
+off_t CompressedFileIO::getSize() const {
+  off_t size = base->getSize();
+  return size < 0 ? size : plainSize(size);
+}
+
+ssize_t CompressedFileIO::cachedChunk(off_t chunk, size_t len,
+                                      unsigned char *out) const {
+  Lock lock(cacheMutex);
+  if (cacheChunk != chunk) {
+    return -1;
+  }
+  size_t stored = std::min(cacheLen, len);
+  memcpy(out, cacheData.data(), stored);
+  memset(out + stored, 0, len - stored);
+  return stored;
+}
+
+void CompressedFileIO::keepChunk(off_t chunk, const unsigned char *data,
+                                 size_t len) const {
+  Lock lock(cacheMutex);
+  if (!cacheData) {
+    cacheData.allocate(chunkSize);
+  }
+  memcpy(cacheData.data(), data, len);
+  cacheChunk = chunk;
+  cacheLen = len;
+}
+
+void CompressedFileIO::dropChunk() const {
+  Lock lock(cacheMutex);
+  cacheChunk = -1;
+}
+
+ssize_t CompressedFileIO::readChunk(off_t chunk, size_t len,
+                                    unsigned char *out) const {
+  ssize_t cached = cachedChunk(chunk, len, out);
+  if (cached >= 0) {
+    return cached;
+  }
+
+  unsigned char header[ChunkHeader];
+  memset(header, 0, sizeof(header));
+  IORequest req;
+  req.offset = chunk * slot;
+  req.dataLen = ChunkHeader;
+  req.data = header;
+  ssize_t res = base->read(req);
+  if (res < 0) {
+    return res;
+  }
+
+  int method = header[0];
+  size_t plainLen = get32(header + 4);
+  size_t storedLen = get32(header + 8);
+  bool valid = plainLen <= chunkSize && storedLen <= plainLen;
+  switch (method) {
+    case Chunk_Zero:
+      valid = valid && plainLen == 0;
+      break;
+    case Chunk_Stored:
+      valid = valid && storedLen == plainLen;
+      break;
+    case Chunk_LZ4:
+    case Chunk_Zstd:
+      valid = valid && storedLen > 0;
+      break;
+    default:
+      valid = false;
+  }
+  if (!valid) {
+    RLOG(WARNING) << "bad header of chunk " << chunk << " in "
+                  << getFileName();
+    return -EBADMSG;
+  }
+
+  PoolBlock stored;
+  unsigned char *data = out;
+  if (method != Chunk_Stored && storedLen > 0) {
+    stored.allocate(storedLen);
+    data = stored.data();
+  }
+  if (storedLen > 0) {
+    req.offset = chunk * slot + ChunkHeader;
+    req.dataLen = storedLen;
+    req.data = data;
+    res = base->read(req);
+    if (res < 0) {
+      return res;
+    }
+    if ((size_t)res != storedLen) {
+      RLOG(WARNING) << "short chunk " << chunk << " in " << getFileName();
+      return -EBADMSG;
+    }
+  }
+
+  ssize_t decoded = -1;
+  switch (method) {
+    case Chunk_Zero:
+    case Chunk_Stored:
+      decoded = storedLen;
+      break;
+#ifdef ENCFS_HAVE_LZ4
+    case Chunk_LZ4:
+      decoded = LZ4_decompress_safe((const char *)data, (char *)out,
+                                    (int)storedLen, (int)chunkSize);
+      break;
+#endif
+#ifdef ENCFS_HAVE_ZSTD
+    case Chunk_Zstd: {
+      size_t n = ZSTD_decompress(out, chunkSize, data, storedLen);
+      decoded = ZSTD_isError(n) ? -1 : (ssize_t)n;
+      break;
+    }
+#endif
+    default:
+      break;
+  }
+  if (decoded != (ssize_t)plainLen) {
+    RLOG(WARNING) << "chunk " << chunk << " of " << getFileName()
+                  << " does not decode";
+    return -EBADMSG;
+  }
+
+  keepChunk(chunk, out, plainLen);
+  // a chunk cut short by a truncate that did not finish
+  size_t kept = std::min(plainLen, len);
+  memset(out + kept, 0, len - kept);
+  return kept;
+}
+
+int CompressedFileIO::writeChunk(off_t chunk, const unsigned char *data,
+                                 size_t len) {
+  // zeros at the end read back as such without being stored
+  while (len > 0 && data[len - 1] == 0) {
+    --len;
+  }
+
+  PoolBlock buf(ChunkHeader + len);
+  unsigned char *header = buf.data();
+  unsigned char *coded = header + ChunkHeader;
+  memset(header, 0, ChunkHeader);
+
+  int method = len == 0 ? Chunk_Zero : Chunk_Stored;
+  size_t storedLen = len;
+  // only smaller than the plaintext is worth keeping
+  if (len > 1) {
+    switch (algorithm) {
+#ifdef ENCFS_HAVE_LZ4
+      case Compression_LZ4: {
+        int n = LZ4_compress_default((const char *)data, (char *)coded,
+                                     (int)len, (int)len - 1);
+        if (n > 0) {
+          method = Chunk_LZ4;
+          storedLen = n;
+        }
+        break;
+      }
+#endif
+#ifdef ENCFS_HAVE_ZSTD
+      case Compression_Zstd: {
+        size_t n = ZSTD_compress(coded, len - 1, data, len, ZstdLevel);
+        if (!ZSTD_isError(n)) {
+          method = Chunk_Zstd;
+          storedLen = n;
+        }
+        break;
+      }
+#endif
+      default:
+        break;
+    }
+  }
+  if (method == Chunk_Stored) {
+    memcpy(coded, data, len);
+  }
+
+  header[0] = (unsigned char)method;
+  put32(header + 4, len);
+  put32(header + 8, storedLen);
+
+  IORequest req;
+  req.offset = chunk * slot;
+  req.dataLen = ChunkHeader + storedLen;
+  req.data = header;
+  ssize_t res = base->write(req);
+  if (res < 0) {
+    dropChunk();
+    return (int)res;
+  }
+
+  keepChunk(chunk, data, len);
+  return 0;
+}
+
+ssize_t CompressedFileIO::read(const IORequest &req) const {
+  off_t size = getSize();
+  if (size < 0) {
+    return size;
+  }
+  if (req.offset >= size) {
+    return 0;
+  }
+  off_t end = std::min(size, req.offset + (off_t)req.dataLen);
+
+  PoolBlock buf(chunkSize);
+  off_t pos = req.offset;
+  while (pos < end) {
+    off_t chunk = pos / chunkSize;
+    off_t start = chunk * chunkSize;
+    size_t within = pos - start;
+    size_t len = std::min((off_t)chunkSize, size - start);
+    size_t n = std::min((off_t)(len - within), end - pos);
+
+    ssize_t res = readChunk(chunk, len, buf.data());
+    if (res < 0) {
+      return res;
+    }
+    memcpy(req.data + (pos - req.offset), buf.data() + within, n);
+    pos += n;
+  }
+  return end - req.offset;
+}
+
+ssize_t CompressedFileIO::write(const IORequest &req) {
+  off_t oldSize = getSize();
+  if (oldSize < 0) {
+    return oldSize;
+  }
+  off_t end = req.offset + (off_t)req.dataLen;
+  off_t newSize = std::max(oldSize, end);
+
+  PoolBlock buf;
+  off_t pos = req.offset;
+  while (pos < end) {
+    off_t chunk = pos / chunkSize;
+    off_t start = chunk * chunkSize;
+    size_t within = pos - start;
+    size_t len = std::min((off_t)chunkSize, newSize - start);
+    size_t n = std::min((off_t)(len - within), end - pos);
+    const unsigned char *src = req.data + (pos - req.offset);
+
+    int res;
+    if (within == 0 && n == len) {
+      res = writeChunk(chunk, src, n);
+    } else {
+      // merge with what the chunk holds
+      if (!buf) {
+        buf.allocate(chunkSize);
+      }
+      size_t oldLen = 0;
+      if (start < oldSize) {
+        oldLen = std::min((off_t)chunkSize, oldSize - start);
+        ssize_t got = readChunk(chunk, oldLen, buf.data());
+        if (got < 0) {
+          return got;
+        }
+      }
+      // decoders may have left anything past oldLen
+      memset(buf.data() + oldLen, 0, len - oldLen);
+      memcpy(buf.data() + within, src, n);
+      res = writeChunk(chunk, buf.data(), len);
+    }
+    if (res < 0) {
+      return res;
+    }
+    pos += n;
+  }
+
+  // the last slot ends with the plaintext length
+  if (newSize > oldSize) {
+    int res = base->truncate(baseSize(newSize));
+    if (res < 0) {
+      return res;
+    }
+  }
+  return req.dataLen;
+}
+
+int CompressedFileIO::truncate(off_t size) {
+  off_t oldSize = getSize();
+  if (oldSize < 0) {
+    return (int)oldSize;
+  }
+
+  if (size > 0 && size < oldSize) {
+    // data past the new end would come back if the file grew again
+    off_t chunk = (size - 1) / chunkSize;
+    off_t start = chunk * chunkSize;
+    size_t len = size - start;
+    size_t oldLen = std::min((off_t)chunkSize, oldSize - start);
+    if (len < oldLen) {
+      PoolBlock buf(chunkSize);
+      ssize_t stored = readChunk(chunk, oldLen, buf.data());
+      if (stored < 0) {
+        return (int)stored;
+      }
+      if ((size_t)stored > len) {
+        int res = writeChunk(chunk, buf.data(), len);
+        if (res < 0) {
+          return res;
+        }
+      }
+    }
+  }
+
+  {
+    Lock lock(cacheMutex);
+    if (cacheChunk >= 0 && cacheChunk * (off_t)chunkSize >= size) {
+      cacheChunk = -1;
+    }
+  }
+  return base->truncate(baseSize(size));
+}
+
+bool CompressedFileIO::isWritable() const { return base->isWritable(); }
+
+void CompressedFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+void CompressedFileIO::invalidateData(off_t offset, size_t len) {
+  dropChunk();
+  base->invalidateData(offset, len);
+}
+
+}  // namespace encfs
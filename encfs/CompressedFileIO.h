@@ -0,0 +1,107 @@
+#ifndef _CompressedFileIO_incl_
+#define _CompressedFileIO_incl_
+
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "FSConfig.h"
+#include "FileIO.h"
+#include "Interface.h"
+#include "MemoryPool.h"
+
+namespace encfs {
+
+/*
+    Compresses file data before it is encrypted, in chunks of
+    compressionChunk bytes each coded on its own, so that a read or write
+    only codes the chunks it touches.
+
+    Chunk i lives in a slot of its own in the file below, at i * slotSize:
+    a ChunkHeader saying how its data is coded and how many bytes that
+    takes, then the coded bytes.  The rest of the slot is a hole.  Slots
+    are a whole number of blocks of the layer below, so with allowHoles a
+    chunk takes the blocks its coded bytes need and no more.
+
+    The slot of the last chunk ends right after as many bytes as the chunk
+    has plaintext, whatever it was coded to, so that the plaintext size
+    follows from the size of the file below without looking at a header
+    (plainAttr, for closed files).  A chunk decodes to at most its length
+    and reads as zeros past that, which also makes a header of zeros (a
+    hole) a chunk of zeros, so extending a file writes nothing but the new
+    data.
+
+    The last chunk looked at is kept decoded, for reads and writes smaller
+    than a chunk.
+ */
+class CompressedFileIO : public FileIO {
+ public:
+  static const int ChunkHeader = 16;
+
+  CompressedFileIO(std::shared_ptr<FileIO> base, const FSConfigPtr &cfg);
+  virtual ~CompressedFileIO();
+
+  // true if this build can code chunks with a CompressionAlgorithm
+  static bool supported(int algorithm);
+  static const char *algorithmName(int algorithm);
+
+  // the bytes of the base file one chunk takes
+  static off_t slotSize(const FSConfigPtr &cfg);
+  // as CipherFileIO::plainAttr, for attributes of the layer below
+  static void plainAttr(const FSConfigPtr &cfg, struct stat *stbuf);
+
+  virtual Interface interface() const;
+  // whole chunks are what a write is best buffered to
+  virtual unsigned int blockSize() const;
+
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+  virtual bool setIV(uint64_t iv);
+
+  virtual int open(int flags);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t write(const IORequest &req);
+  virtual int truncate(off_t size);
+  virtual bool isWritable() const;
+
+  virtual void invalidateAttr();
+  virtual void invalidateData(off_t offset, size_t len);
+
+ private:
+  CompressedFileIO(const CompressedFileIO &src);             // not allowed
+  CompressedFileIO &operator=(const CompressedFileIO &src);  // not allowed
+
+  // sizes of the plaintext and of the base file, one from the other
+  off_t plainSize(off_t baseSize) const;
+  off_t baseSize(off_t plainSize) const;
+
+  // the plaintext of chunk, of which len bytes are in the file, into
+  // out[chunkSize].  Returns the bytes that were stored, the rest up to
+  // len being zeros, or -errno.  What is past len in out is undefined.
+  ssize_t readChunk(off_t chunk, size_t len, unsigned char *out) const;
+  // codes len bytes of plaintext as chunk and writes them
+  int writeChunk(off_t chunk, const unsigned char *data, size_t len);
+
+  // the decoded chunk kept, if it is chunk, as readChunk() has it
+  ssize_t cachedChunk(off_t chunk, size_t len, unsigned char *out) const;
+  void keepChunk(off_t chunk, const unsigned char *data, size_t len) const;
+  void dropChunk() const;
+
+  std::shared_ptr<FileIO> base;
+  int algorithm;
+  size_t chunkSize;
+  off_t slot;
+
+  mutable pthread_mutex_t cacheMutex;
+  mutable PoolBlock cacheData;
+  mutable off_t cacheChunk;  // -1 if nothing is kept
+  mutable size_t cacheLen;
+};
+
+}  // namespace encfs
+
+#endif
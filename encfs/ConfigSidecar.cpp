@@ -0,0 +1,319 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ConfigSidecar.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Error.h"
+#include "FSConfig.h"
+#include "Interface.h"
+
+namespace encfs {
+namespace ConfigSidecar {
+
+const char Suffix[] = ".bin";
+
+static const char Magic[8] = {'E', 'n', 'c', 'F', 'S', '6', 'b', '\n'};
+static const uint64_t Version = 3;
+static const size_t DigestBytes = 32;  // SHA-256
+// far beyond any config, so that a stray file is not read whole
+static const off_t MaxBytes = 64 * 1024;
+
+static std::string pathOf(const char *configFile) {
+  return std::string(configFile) + Suffix;
+}
+
+// what ties a copy to the config file it was made from
+static void identity(const struct stat &st, uint64_t out[7]) {
+#if defined(__APPLE__)
+  const struct timespec &mtime = st.st_mtimespec;
+  const struct timespec &ctime = st.st_ctimespec;
+#else
+  const struct timespec &mtime = st.st_mtim;
+  const struct timespec &ctime = st.st_ctim;
+#endif
+  out[0] = (uint64_t)st.st_ino;
+  out[1] = (uint64_t)st.st_uid;
+  out[2] = (uint64_t)st.st_size;
+  out[3] = (uint64_t)mtime.tv_sec;
+  out[4] = (uint64_t)mtime.tv_nsec;
+  out[5] = (uint64_t)ctime.tv_sec;
+  out[6] = (uint64_t)ctime.tv_nsec;
+}
+
+static bool digest(const unsigned char *data, size_t len,
+                   unsigned char md[DigestBytes]) {
+  unsigned int mdLen = 0;
+  return EVP_Digest(data, len, md, &mdLen, EVP_sha256(), nullptr) == 1 &&
+         mdLen == DigestBytes;
+}
+
+namespace {
+
+// little endian, integers in 8 bytes and byte strings after their length
+class Writer {
+ public:
+  void put(uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+      buf.push_back((unsigned char)(v >> (8 * i)));
+    }
+  }
+  void put(const unsigned char *data, size_t len) {
+    put((uint64_t)len);
+    buf.insert(buf.end(), data, data + len);
+  }
+  void put(const std::string &s) {
+    put((const unsigned char *)s.data(), s.size());
+  }
+  void put(const Interface &iface) {
+    put(iface.name());
+    put((uint64_t)iface.current());
+    put((uint64_t)iface.revision());
+    put((uint64_t)iface.age());
+  }
+
+  std::vector<unsigned char> buf;
+};
+
+class Reader {
+ public:
+  Reader(const unsigned char *data, size_t len)
+      : _data(data), _len(len), _ok(true) {}
+
+  bool ok() const { return _ok; }
+  bool done() const { return _ok && _len == 0; }
+
+  uint64_t get() {
+    if (_len < 8) {
+      _ok = false;
+      return 0;
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+      v |= (uint64_t)_data[i] << (8 * i);
+    }
+    _data += 8;
+    _len -= 8;
+    return v;
+  }
+  int getInt() { return (int)(int64_t)get(); }
+  bool getBool() { return get() != 0; }
+  void get(std::vector<unsigned char> *out) {
+    uint64_t len = get();
+    if (!_ok || len > _len) {
+      _ok = false;
+      return;
+    }
+    out->assign(_data, _data + len);
+    _data += len;
+    _len -= len;
+  }
+  void get(std::string *out) {
+    std::vector<unsigned char> bytes;
+    get(&bytes);
+    out->assign(bytes.begin(), bytes.end());
+  }
+  void get(Interface *iface) {
+    std::string name;
+    get(&name);
+    int current = getInt();
+    int revision = getInt();
+    int age = getInt();
+    *iface = Interface(name, current, revision, age);
+  }
+
+ private:
+  const unsigned char *_data;
+  size_t _len;
+  bool _ok;
+};
+
+}  // namespace
+
+bool read(const char *configFile, EncFSConfig *cfg) {
+  std::string path = pathOf(configFile);
+  struct stat st;
+  if (::stat(configFile, &st) != 0) {
+    return false;
+  }
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat sst;
+  std::vector<unsigned char> buf;
+  ssize_t got = -1;
+  if (fstat(fd, &sst) == 0 && S_ISREG(sst.st_mode) &&
+      sst.st_uid == st.st_uid && sst.st_size <= MaxBytes) {
+    buf.resize(sst.st_size);
+    got = ::pread(fd, buf.data(), buf.size(), 0);
+  }
+  ::close(fd);
+
+  if (got != (ssize_t)buf.size() ||
+      buf.size() < sizeof(Magic) + DigestBytes ||
+      memcmp(buf.data(), Magic, sizeof(Magic)) != 0) {
+    VLOG(1) << "ignoring " << path << ", not a config copy";
+    return false;
+  }
+  size_t bodyLen = buf.size() - DigestBytes;
+  unsigned char md[DigestBytes];
+  if (!digest(buf.data(), bodyLen, md) ||
+      memcmp(md, buf.data() + bodyLen, DigestBytes) != 0) {
+    RLOG(WARNING) << "ignoring " << path << ", it is damaged";
+    return false;
+  }
+
+  Reader in(buf.data() + sizeof(Magic), bodyLen - sizeof(Magic));
+  if (in.get() != Version) {
+    VLOG(1) << "ignoring " << path << ", of another version";
+    return false;
+  }
+  uint64_t want[7];
+  identity(st, want);
+  for (uint64_t v : want) {
+    if (in.get() != v) {
+      VLOG(1) << "ignoring " << path << ", " << configFile
+              << " changed since";
+      return false;
+    }
+  }
+
+  EncFSConfig res;
+  in.get(&res.creator);
+  res.subVersion = in.getInt();
+  in.get(&res.cipherIface);
+  in.get(&res.nameIface);
+  res.keySize = in.getInt();
+  res.blockSize = in.getInt();
+  in.get(&res.keyData);
+  in.get(&res.salt);
+  res.kdfIterations = in.getInt();
+  res.desiredKDFDuration = (long)(int64_t)in.get();
+  res.kdfAlgorithm = in.getInt();
+  res.kdfMemoryKiB = in.getInt();
+  res.kdfLanes = in.getInt();
+  res.plainData = in.getBool();
+  res.blockMACBytes = in.getInt();
+  res.blockMACRandBytes = in.getInt();
+  res.blockMACAlgorithm = in.getInt();
+  res.uniqueIV = in.getBool();
+  res.externalIVChaining = in.getBool();
+  res.chainedNameIV = in.getBool();
+  res.allowHoles = in.getBool();
+  res.compression = in.getInt();
+  res.compressionChunk = in.getInt();
+  res.packThreshold = in.getInt();
+  res.objectStore = in.getBool();
+  res.nonceBudget = in.getBool();
+  if (!in.done()) {
+    RLOG(WARNING) << "ignoring " << path << ", it is malformed";
+    return false;
+  }
+
+  res.cfgType = Config_V6;
+  *cfg = res;
+  VLOG(1) << "config read from " << path;
+  return true;
+}
+
+bool write(const char *configFile, const EncFSConfig &cfg) {
+  std::string path = pathOf(configFile);
+  struct stat st;
+  if (::stat(configFile, &st) != 0) {
+    return false;
+  }
+
+  Writer out;
+  out.buf.assign(Magic, Magic + sizeof(Magic));
+  out.put(Version);
+  uint64_t id[7];
+  identity(st, id);
+  for (uint64_t v : id) {
+    out.put(v);
+  }
+  out.put(cfg.creator);
+  out.put((uint64_t)cfg.subVersion);
+  out.put(cfg.cipherIface);
+  out.put(cfg.nameIface);
+  out.put((uint64_t)cfg.keySize);
+  out.put((uint64_t)cfg.blockSize);
+  out.put(cfg.keyData.data(), cfg.keyData.size());
+  out.put(cfg.salt.data(), cfg.salt.size());
+  out.put((uint64_t)cfg.kdfIterations);
+  out.put((uint64_t)cfg.desiredKDFDuration);
+  out.put((uint64_t)cfg.kdfAlgorithm);
+  out.put((uint64_t)cfg.kdfMemoryKiB);
+  out.put((uint64_t)cfg.kdfLanes);
+  out.put((uint64_t)cfg.plainData);
+  out.put((uint64_t)cfg.blockMACBytes);
+  out.put((uint64_t)cfg.blockMACRandBytes);
+  out.put((uint64_t)cfg.blockMACAlgorithm);
+  out.put((uint64_t)cfg.uniqueIV);
+  out.put((uint64_t)cfg.externalIVChaining);
+  out.put((uint64_t)cfg.chainedNameIV);
+  out.put((uint64_t)cfg.allowHoles);
+  out.put((uint64_t)cfg.compression);
+  out.put((uint64_t)cfg.compressionChunk);
+  out.put((uint64_t)cfg.packThreshold);
+  out.put((uint64_t)cfg.objectStore);
+  out.put((uint64_t)cfg.nonceBudget);
+
+  unsigned char md[DigestBytes];
+  if (!digest(out.buf.data(), out.buf.size(), md)) {
+    return false;
+  }
+  out.buf.insert(out.buf.end(), md, md + DigestBytes);
+
+  // written aside and renamed, so that a reader sees a whole copy or none;
+  // it holds the key data, so it is no more readable than the config
+  std::string tmp = path + "." + std::to_string(getpid());
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  st.st_mode & 0666);
+  if (fd < 0) {
+    VLOG(1) << "unable to write " << tmp << ": " << strerror(errno);
+    return false;
+  }
+  bool ok = ::write(fd, out.buf.data(), out.buf.size()) ==
+                (ssize_t)out.buf.size() &&
+            ::fsync(fd) == 0;
+  ok = (::close(fd) == 0) && ok;
+  if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+    RLOG(WARNING) << "unable to save " << path << ": " << strerror(errno);
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool exists(const char *configFile) {
+  struct stat st;
+  return ::lstat(pathOf(configFile).c_str(), &st) == 0;
+}
+
+}  // namespace ConfigSidecar
+}  // namespace encfs
@@ -0,0 +1,42 @@
+#ifndef _ConfigSidecar_incl_
+#define _ConfigSidecar_incl_
+
+namespace encfs {
+
+struct EncFSConfig;
+
+/*
+    A compact binary copy of a parsed V6 config, kept next to it as
+    <config>.bin (.encfs6.xml.bin in the root of a volume), so that a
+    mount, and an encfsctl command run over and over by a script, can take
+    the config with one read rather than an XML parse and base64 decodes.
+
+    The copy is versioned, carries a SHA-256 of itself, and names the
+    inode, owner, size and times of the config it was made from: it is
+    only used while the config is still that file, unchanged, and
+    otherwise the config is parsed as before.  Nothing in it is not also
+    in the config, so it needs no more protection than the config has.
+
+    It is optional: `encfsctl cachecfg` makes one, and once there it is
+    kept up to date by saves of the config and by reads that found it
+    stale.
+ */
+namespace ConfigSidecar {
+
+// appended to the path of the config
+extern const char Suffix[];
+
+// the copy next to configFile into *cfg.  False if there is none, or it
+// is not of the config as it is now.
+bool read(const char *configFile, EncFSConfig *cfg);
+
+// writes the copy of cfg, just read from or saved to configFile
+bool write(const char *configFile, const EncFSConfig &cfg);
+
+// whether configFile has a copy, current or not
+bool exists(const char *configFile);
+
+}  // namespace ConfigSidecar
+}  // namespace encfs
+
+#endif
@@ -1,29 +1,98 @@
 #include "easylogging++.h"
+#include <ctime>
+#include <functional>
 #include <utility>
 
 #include "Context.h"
 #include "DirNode.h"
 #include "Error.h"
+#include "FileNode.h"
+#include "FileUtils.h"
 #include "Mutex.h"
 
 namespace encfs {
+  // whole seconds are enough for an idle timeout given in minutes, and the
+  // coarse clock is read without a system call
+  static int64_t activityClock() {
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec;
+  }
+
+  static int64_t monotonicMs() {
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  // names are encrypted, padded and base64 coded, taking up about 8/6
+  // of the plaintext plus a checksum.  Approximate.
+  static unsigned long plainNameMax(unsigned long cipherNameMax) {
+    return cipherNameMax > 2 ? 6 * (cipherNameMax - 2) / 8 : 0;
+  }
+
   EncFS_Context::EncFS_Context() {
     pthread_cond_init(&wakeupCond, nullptr);
     pthread_mutex_init(&wakeupMutex, nullptr);
     pthread_mutex_init(&contextMutex, nullptr);
-
-    usageCount = 0;
-    idleCount = -1;
+    for (FileShard& shard : fileShards) {
+      pthread_mutex_init(&shard.mutex, nullptr);
+    }
+    for (FuseFhShard& shard : fuseFhShards) {
+      pthread_rwlock_init(&shard.lock, nullptr);
+    }
+    pthread_mutex_init(&inodeMutex, nullptr);
+    linkedOpen = 0;
+    pthread_mutex_init(&releasedMutex, nullptr);
+    pthread_mutex_init(&statfsMutex, nullptr);
+    statfsExpires = 0;
+    nameMax = 0;
+
+    lastActivity = activityClock();
+    warnedActivity = -1;
     isUnmounting = false;
     currentFuseFh = 1;
+    running = false;
   }
 
   EncFS_Context::~EncFS_Context() {
+    releasedIndex.clear();
+    releasedLru.clear();
+    pthread_mutex_destroy(&statfsMutex);
+    pthread_mutex_destroy(&releasedMutex);
+    openInodes.clear();
+    pthread_mutex_destroy(&inodeMutex);
+    for (FuseFhShard& shard : fuseFhShards) {
+      shard.fuseFhMap.clear();
+      pthread_rwlock_destroy(&shard.lock);
+    }
+    for (FileShard& shard : fileShards) {
+      shard.openFiles.clear();
+      pthread_mutex_destroy(&shard.mutex);
+    }
     pthread_mutex_destroy(&contextMutex);
     pthread_mutex_destroy(&wakeupMutex);
     pthread_cond_destroy(&wakeupCond);
+  }
+
+  EncFS_Context::FileShard& EncFS_Context::fileShardFor(
+      const PathName& path) {
+    size_t h = path.hash();
+    return fileShards[(h ^ (h >> 17)) % NumShards];
+  }
 
-    openFiles.clear();
+  // handles are handed out in sequence, so consecutive ones land in
+  // different shards
+  EncFS_Context::FuseFhShard& EncFS_Context::fuseFhShardFor(uint64_t fuseFh) {
+    return fuseFhShards[fuseFh % NumShards];
   }
 
   std::shared_ptr<DirNode> EncFS_Context::getRoot(int* errCode) {
@@ -33,15 +102,15 @@ namespace encfs {
   std::shared_ptr<DirNode> EncFS_Context::getRoot(int* errCode, bool skipUsageCount) {
     std::shared_ptr<DirNode> ret = nullptr;
     do {
-      {
-        Lock lock(contextMutex);
-        if (isUnmounting) {
-          *errCode = -EBUSY;
-          break;
-        }
-        ret = root;
-        if (!skipUsageCount) {
-          ++usageCount;
+      if (isUnmounting) {
+        *errCode = -EBUSY;
+        break;
+      }
+      ret = std::atomic_load(&root);
+      if (!skipUsageCount) {
+        int64_t now = activityClock();
+        if (lastActivity.load(std::memory_order_relaxed) != now) {
+          lastActivity.store(now, std::memory_order_relaxed);
         }
       }
       if (!ret) {
@@ -55,135 +124,419 @@ namespace encfs {
     return ret;
   }
 
+  std::shared_ptr<DirNode> EncFS_Context::currentRoot() const {
+    return std::atomic_load(&root);
+  }
+
   void EncFS_Context::setRoot(const std::shared_ptr<DirNode>& r) {
-    Lock lock(contextMutex);
-    root = r;
+    // kept nodes point to the directory node of the old root
+    forgetAllReleased();
+    std::string dir;
+    {
+      Lock lock(contextMutex, ENCFS_LOCK_SITE("Context::setRoot"));
+      std::atomic_store(&root, r);
+      if (r) {
+        rootCipherDir = r->rootDirectory();
+        dir = rootCipherDir;
+      }
+    }
     if (r) {
-      rootCipherDir = r->rootDirectory();
+      // the backing filesystem's limit holds for the life of the mount
+      struct statvfs st;
+      Lock lock(statfsMutex);
+      statfsExpires = 0;
+      if (::statvfs(dir.c_str(), &st) == 0) {
+        nameMax = plainNameMax(st.f_namemax);
+      }
+    }
+    // a detached idle monitor waits for this.  The monitor holds
+    // wakeupMutex around its check, so the lock is not taken under
+    // contextMutex.
+    if (r) {
+      Lock lock(wakeupMutex);
+      pthread_cond_signal(&wakeupCond);
     }
   }
 
-  bool EncFS_Context::usageAndUnmount(int timeoutCycles) {
-    Lock lock(contextMutex);
-
-    if (root != nullptr) {
-      if (usageCount == 0) {
-        ++idleCount;
+  int EncFS_Context::statfs(struct statvfs* st) {
+    int ttl = opts ? opts->statfsCacheMs : 0;
+    int64_t now = ttl > 0 ? monotonicMs() : 0;
+    std::string dir;
+    {
+      Lock lock(statfsMutex);
+      if (now < statfsExpires) {
+        *st = statfsBuf;
+        return 0;
       }
-      else {
-        idleCount = 0;
+    }
+    {
+      Lock lock(contextMutex, ENCFS_LOCK_SITE("Context::statfs"));
+      dir = rootCipherDir;
+    }
+
+    VLOG(1) << "doing statfs of " << dir;
+    if (::statvfs(dir.c_str(), st) != 0) {
+      return -errno;
+    }
+
+    Lock lock(statfsMutex);
+    if (nameMax == 0) {
+      // the root could not be looked at when it was set
+      nameMax = plainNameMax(st->f_namemax);
+    }
+    st->f_namemax = nameMax;
+    if (ttl > 0) {
+      statfsBuf = *st;
+      statfsExpires = now + ttl;
+    }
+    return 0;
+  }
+
+  bool EncFS_Context::haveOpenFiles(size_t* count) {
+    *count = 0;
+    for (FileShard& shard : fileShards) {
+      Lock lock(shard.mutex);
+      *count += shard.openFiles.size();
+    }
+    return *count != 0;
+  }
+
+  size_t EncFS_Context::openFileCount() {
+    size_t count;
+    haveOpenFiles(&count);
+    return count;
+  }
+
+  int64_t EncFS_Context::idleSeconds() const {
+    return activityClock() - lastActivity.load(std::memory_order_relaxed);
+  }
+
+  bool EncFS_Context::usageAndUnmount(int timeoutSecs, int* waitSecs) {
+    {
+      Lock lock(contextMutex,
+                ENCFS_LOCK_SITE("Context::usageAndUnmount"));
+
+      if (root == nullptr) {
+        *waitSecs = -1;
+        return false;
       }
-      VLOG(1) << "idle cycle count: " << idleCount << ", timeout at "
-              << timeoutCycles;
 
-      usageCount = 0;
+      int64_t last = lastActivity.load(std::memory_order_relaxed);
+      int64_t idle = activityClock() - last;
+      VLOG(1) << "idle for " << idle << "s, timeout at " << timeoutSecs << "s";
 
-      if (idleCount < timeoutCycles) {
+      if (idle < timeoutSecs) {
+        *waitSecs = (int)(timeoutSecs - idle);
         return false;
       }
 
-      if (!openFiles.empty()) {
-        if (idleCount % timeoutCycles == 0) {
-          RLOG(WARNING) << "Filesystem inactive, but " << openFiles.size()
+      size_t openCount;
+      if (haveOpenFiles(&openCount)) {
+        if (warnedActivity != last) {
+          warnedActivity = last;
+          RLOG(WARNING) << "Filesystem inactive, but " << openCount
                         << " files opened: " << this->opts->unmountPoint;
         }
+        // closing them is activity, look again a timeout from now at
+        // the latest
+        *waitSecs = timeoutSecs;
         return false;
       }
       if (!this->opts->mountOnDemand) {
         isUnmounting = true;
       }
-      lock.~Lock();
-      return unmountFS(this);
+      *waitSecs = -1;
     }
-    return false;
+    // unmounting resets the root, under the lock
+    return unmountFS(this);
   }
 
-  std::shared_ptr<FileNode> EncFS_Context::loopupNode(const char* path) {
-    Lock lock(contexMutex);
+  std::shared_ptr<FileNode> EncFS_Context::lookupNode(const char* path) {
+    // a path that is not interned is not open
+    PathName key = PathName::find(path);
+    if (key.empty()) {
+      return std::shared_ptr<FileNode>();
+    }
+    FileShard& shard = fileShardFor(key);
+    Lock lock(shard.mutex, ENCFS_LOCK_SITE("Context::lookupNode"));
 
-    auto it = openFiles.find(std::string(path));
-    if (it != openFiles.end()) {
+    auto it = shard.openFiles.find(key);
+    if (it != shard.openFiles.end()) {
       return it->second.front();
     }
     return std::shared_ptr<FileNode>();
   }
 
   void EncFS_Context::renameNode(const char* from, const char* to) {
-    Lock lock(contexMutex);
-    auto it = openFiles.find(std::string(path));
-    if (it != openFiles.end()) {
-      return it->second.front();
+    PathName fromKey = PathName::find(from);
+    if (fromKey.empty()) {
+      return;
+    }
+    PathName toKey(to);
+    FileShard& fromShard = fileShardFor(fromKey);
+    FileShard& toShard = fileShardFor(toKey);
+
+    // both at once, so that a lookup never misses the node, in a fixed
+    // order so that two renames can't deadlock
+    FileShard* first = &fromShard < &toShard ? &fromShard : &toShard;
+    FileShard* second = &fromShard < &toShard ? &toShard : &fromShard;
+    Lock lock(first->mutex, ENCFS_LOCK_SITE("Context::renameNode"));
+    pthread_mutex_t* secondMutex = second != first ? &second->mutex : nullptr;
+    if (secondMutex != nullptr) {
+      pthread_mutex_lock(secondMutex);
     }
-    return std::shared_ptr<FileNode>();
-  }
 
-  void EncFS_Context::renameNode(const char* from, const char* to) {
-    Lock lock(contexMutex);
-    
-    auto it = openFiles.find(std::string(from));
-    it (it != openFiles.end()) {
+    auto it = fromShard.openFiles.find(fromKey);
+    if (it != fromShard.openFiles.end()) {
       auto val = it->second;
-      openFiles.erase(it);
-      openFiles[std::string(to)] = val;
+      fromShard.openFiles.erase(it);
+      toShard.openFiles[toKey] = val;
+    }
+
+    if (secondMutex != nullptr) {
+      pthread_mutex_unlock(secondMutex);
     }
   }
 
-  void Encfs_Context::putNode(const char* path,
+  void EncFS_Context::putNode(const char* path,
       const std::shared_ptr<FileNode>& node) {
-    Lock lock(contexMutex);
-    auto& list = openFiles[std::string(path)];
+    PathName key(path);
+    FileShard& shard = fileShardFor(key);
+    Lock lock(shard.mutex, ENCFS_LOCK_SITE("Context::putNode"));
+    auto& list = shard.openFiles[key];
 
     list.push_front(node);
-    fuseFhMap[node->fuseFh] = node;
+
+    dev_t dev;
+    ino_t ino;
+    if (node->linked(&dev, &ino)) {
+      Lock inodeLock(inodeMutex);
+      OpenInode& entry = openInodes[InodeKey{dev, ino}];
+      if (!entry.node) {
+        entry.node = node;
+        ++linkedOpen;
+      }
+      // a node lost the race with the first open of another name stays
+      // on its own, and is released as one that is not linked
+      if (entry.node == node) {
+        ++entry.opens;
+      }
+    }
+
+    FuseFhShard& fhShard = fuseFhShardFor(node->fuseFh);
+    WriteLock fhLock(fhShard.lock);
+    fhShard.fuseFhMap[node->fuseFh] = node;
   }
 
   void EncFS_Context::eraseNode(const char* path,
       const std::shared_ptr<FileNode>& fnode) {
-    Lock lock(contexMutex);
-    auto it openFiles.find(std::string(path));
+    PathName key = PathName::find(path);
+    FileShard& shard = fileShardFor(key);
+    Lock lock(shard.mutex, ENCFS_LOCK_SITE("Context::eraseNode"));
+    auto it = shard.openFiles.find(key);
 
 #ifdef __CYGWIN__
-    if (it == openFiles.end()) {
+    if (it == shard.openFiles.end()) {
       RLOG(WARNING) << "FileNode to erase not find, file has certainly be renamed: "
                     << path;
       return;
     }
 #endif
-    rAssert(it != openFiles.end());
+    rAssert(it != shard.openFiles.end());
     auto& list = it->second;
 
-    auot findIter = std::find(list.begin(), list.end(), fnode);
+    auto findIter = std::find(list.begin(), list.end(), fnode);
     rAssert(findIter != list.end());
     list.erase(findIter);
 
-    findIter = std::find(list.begin(), list.end(), fnode);
-    if (findIter == list.end()) {
-      fuseFhMap.erase(fnode->fuseFh);
+    // a linked node may still be open under another name
+    bool last;
+    dev_t dev;
+    ino_t ino;
+    Lock inodeLock(inodeMutex);
+    auto entry = fnode->linked(&dev, &ino)
+                    ? openInodes.find(InodeKey{dev, ino})
+                    : openInodes.end();
+    if (entry != openInodes.end() && entry->second.node == fnode) {
+      last = --entry->second.opens == 0;
+      if (last) {
+        openInodes.erase(entry);
+        --linkedOpen;
+      }
+    } else {
+      last = std::find(list.begin(), list.end(), fnode) == list.end();
+    }
+    if (last) {
+      FuseFhShard& fhShard = fuseFhShardFor(fnode->fuseFh);
+      WriteLock fhLock(fhShard.lock);
+      fhShard.fuseFhMap.erase(fnode->fuseFh);
       fnode->canary = CANARY_RELEASED;
     }
 
     if (list.empty()) {
-      openFiles.erase(it);
+      shard.openFiles.erase(it);
     }
   }
 
+  std::shared_ptr<FileNode> EncFS_Context::lookupInode(dev_t dev,
+                                                       ino_t ino) {
+    Lock lock(inodeMutex);
+    auto it = openInodes.find(InodeKey{dev, ino});
+    if (it != openInodes.end()) {
+      return it->second.node;
+    }
+    return std::shared_ptr<FileNode>();
+  }
+
+  void EncFS_Context::nodeLinked(const char* path, dev_t dev, ino_t ino) {
+    PathName key = PathName::find(path);
+    if (key.empty()) {
+      return;
+    }
+    FileShard& shard = fileShardFor(key);
+    Lock lock(shard.mutex, ENCFS_LOCK_SITE("Context::nodeLinked"));
+    auto it = shard.openFiles.find(key);
+    if (it == shard.openFiles.end()) {
+      return;
+    }
+    const std::shared_ptr<FileNode>& node = it->second.front();
+    if (node->linked(nullptr, nullptr)) {
+      return;
+    }
+
+    Lock inodeLock(inodeMutex);
+    OpenInode& entry = openInodes[InodeKey{dev, ino}];
+    if (entry.node) {
+      // another name was opened as linked first, this one stays apart
+      return;
+    }
+    // every open of it so far was under this, its only name
+    node->setLinked(dev, ino);
+    entry.node = node;
+    entry.opens = std::count(it->second.begin(), it->second.end(), node);
+    ++linkedOpen;
+  }
+
   uint64_t EncFS_Context::nextFuseFh() {
     return currentFuseFh++;
   }
 
-  std::shared_ptr<FileNode> EncFS_Context::loopupFuseFh(uint64_t n) {
-    Lock lock(contextMutex);
-    auto it = fuseFhMap.find(n);
-    if (it == fuseFhMap.end()) {
+  std::shared_ptr<FileNode> EncFS_Context::lookupFuseFh(uint64_t n) {
+    FuseFhShard& shard = fuseFhShardFor(n);
+    ReadLock lock(shard.lock);
+    auto it = shard.fuseFhMap.find(n);
+    if (it == shard.fuseFhMap.end()) {
       return nullptr;
     }
     return it->second;
   }
 
+  static bool sameFile(const struct stat& a, const struct stat& b) {
+#if defined(__APPLE__)
+    const struct timespec& am = a.st_mtimespec;
+    const struct timespec& bm = b.st_mtimespec;
+    const struct timespec& ac = a.st_ctimespec;
+    const struct timespec& bc = b.st_ctimespec;
+#else
+    const struct timespec& am = a.st_mtim;
+    const struct timespec& bm = b.st_mtim;
+    const struct timespec& ac = a.st_ctim;
+    const struct timespec& bc = b.st_ctim;
+#endif
+    // chmod, chown and utimens through the name change the ctime, and
+    // the attributes the node keeps with it
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+           a.st_size == b.st_size && am.tv_sec == bm.tv_sec &&
+           am.tv_nsec == bm.tv_nsec && ac.tv_sec == bc.tv_sec &&
+           ac.tv_nsec == bc.tv_nsec;
+  }
+
+  void EncFS_Context::keepReleased(const char* path,
+                                   const std::shared_ptr<FileNode>& node) {
+    if (!opts || opts->noCache || opts->reverseEncryption) {
+      return;
+    }
+    // nothing is left buffered to change the file after it is stat'ed
+    Released entry;
+    if (node->flush() < 0 ||
+        ::lstat(node->cipherName().c_str(), &entry.stbuf) != 0 ||
+        !S_ISREG(entry.stbuf.st_mode)) {
+      return;
+    }
+    entry.path = PathName(path);
+    entry.node = node;
+    entry.keptAt = activityClock();
+
+    ReleasedList dropped;
+    {
+      FileShard& shard = fileShardFor(entry.path);
+      Lock lock(shard.mutex);
+      if (shard.openFiles.find(entry.path) != shard.openFiles.end()) {
+        // opened again meanwhile, with another node
+        return;
+      }
+
+      Lock releasedLock(releasedMutex);
+      auto it = releasedIndex.find(entry.path);
+      if (it != releasedIndex.end()) {
+        dropped.splice(dropped.end(), releasedLru, it->second);
+        releasedIndex.erase(it);
+      }
+      releasedLru.push_front(std::move(entry));
+      releasedIndex[releasedLru.front().path] = releasedLru.begin();
+
+      while (!releasedLru.empty() &&
+             (releasedLru.size() > MaxReleased ||
+              releasedLru.front().keptAt - releasedLru.back().keptAt >=
+                  ReleasedSecs)) {
+        releasedIndex.erase(releasedLru.back().path);
+        dropped.splice(dropped.end(), releasedLru,
+                       std::prev(releasedLru.end()));
+      }
+    }
+  }
 
+  std::shared_ptr<FileNode> EncFS_Context::reuseNode(const char* path) {
+    Released entry;
+    {
+      Lock lock(releasedMutex);
+      auto it = releasedIndex.find(PathName::find(path));
+      if (it == releasedIndex.end()) {
+        return std::shared_ptr<FileNode>();
+      }
+      entry = std::move(*it->second);
+      releasedLru.erase(it->second);
+      releasedIndex.erase(it);
+    }
 
+    struct stat stbuf;
+    if (activityClock() - entry.keptAt >= ReleasedSecs ||
+        ::lstat(entry.node->cipherName().c_str(), &stbuf) != 0 ||
+        !sameFile(stbuf, entry.stbuf)) {
+      VLOG(1) << "released node changed since: " << entry.node->cipherName();
+      return std::shared_ptr<FileNode>();
+    }
 
+    VLOG(1) << "reusing released node for " << entry.node->cipherName();
+    entry.node->canary = CANARY_OK;
+    return entry.node;
+  }
 
-}
+  void EncFS_Context::forgetReleased(const char* path) {
+    ReleasedList dropped;
+    Lock lock(releasedMutex);
+    auto it = releasedIndex.find(PathName::find(path));
+    if (it != releasedIndex.end()) {
+      dropped.splice(dropped.end(), releasedLru, it->second);
+      releasedIndex.erase(it);
+    }
+  }
 
+  void EncFS_Context::forgetAllReleased() {
+    ReleasedList dropped;
+    Lock lock(releasedMutex);
+    dropped.swap(releasedLru);
+    releasedIndex.clear();
+  }
 
+}
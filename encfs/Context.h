@@ -9,13 +9,20 @@
 #include <pthread.h>
 #include <set>
 #include <string>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unordered_map>
 
+#include "PathName.h"
 #include "encfs.h"
 
 namespace encfs {
 class DirNode;
 class FileNode;
+class IoScheduler;
+class MemoryGovernor;
+class Scrubber;
+class StatsServer;
 struct EncFS_Args;
 struct EncFS_Opts;
 
@@ -24,9 +31,13 @@ public:
   EncFS_Context();
   ~EncFS_Context();
 
-  std::shared_ptr<FileNode> loopupNode(const char *path);
+  std::shared_ptr<FileNode> lookupNode(const char *path);
 
-  bool usageAndUnmount(int timeoutCycles);
+  // unmounts (or detaches, with mountOnDemand) once nothing was done for
+  // timeoutSecs and no file is open, returning true if it unmounted.
+  // Otherwise *waitSecs is how long until that could next be the case, or
+  // -1 while detached, until setRoot() attaches a root again.
+  bool usageAndUnmount(int timeoutSecs, int *waitSecs);
 
   void putNode(const char *path, const std::shared_ptr<FileNode> &node);
 
@@ -34,9 +45,42 @@ public:
 
   void renameNode(const char *oldName, const char *newName);
 
+  // the open node of backing inode dev/ino, of a file opened under a name
+  // once it had more than one (FileNode::setLinked), so that every name
+  // of a hard linked file shares one node: one IO stack, lock and cache.
+  std::shared_ptr<FileNode> lookupInode(dev_t dev, ino_t ino);
+  // true while such a node is open, for callers to skip the stat that
+  // looking one up takes otherwise
+  bool haveLinkedOpen() const { return linkedOpen.load() != 0; }
+  // the file open at path, backing inode dev/ino, just got another name
+  void nodeLinked(const char *path, dev_t dev, ino_t ino);
+
+  // keeps a node that was just released, unless the file is open again,
+  // so that opening it soon after reuses its IO stack: the decoded header,
+  // the open descriptor and what the block cache holds of it.  Off with
+  // --nocache and in reverse mode.
+  void keepReleased(const char *path, const std::shared_ptr<FileNode> &node);
+  // the node kept for path, if its backing file still has the inode, size,
+  // mtime and ctime it was released with, taken out of the cache
+  std::shared_ptr<FileNode> reuseNode(const char *path);
+  // drops the node kept for path, or all of them
+  void forgetReleased(const char *path);
+  void forgetAllReleased();
+
   void setRoot(const std::shared_ptr<DirNode> &root);
   std::shared_ptr<DirNode> getRoot(int *err);
   std::shared_ptr<DirNode> getRoot(int *err, bool skipUsageCount);
+  // the root as it is, null while detached, without attaching it or
+  // counting as activity
+  std::shared_ptr<DirNode> currentRoot() const;
+  size_t openFileCount();
+
+  // statvfs of the backing root, with f_namemax as the name encoding
+  // leaves it.  Kept for opts->statfsCacheMs milliseconds.  Returns 0 on
+  // success, -errno on failure.
+  int statfs(struct statvfs *st);
+  // seconds since the last operation counted as activity
+  int64_t idleSeconds() const;
 
   std::shared_ptr<EncFS_Args> args;
   std::shared_ptr<EncFS_Opts> opts;
@@ -46,16 +90,27 @@ public:
   // root path to cipher dir
   std::string rootCipherDir;
 
-  // for idle moitor
+  // for idle monitor, woken when a root is attached and on shutdown
   bool running;
   pthread_t monitorThread;
   pthread_cond_t wakeupCond;
   pthread_mutex_t wakeupMutex;
 
+  // --stats-socket, if given
+  std::shared_ptr<StatsServer> statsServer;
+  // --scrub, if given
+  std::shared_ptr<Scrubber> scrubber;
+  // --cache-memory, if given
+  std::shared_ptr<MemoryGovernor> memoryGovernor;
+  // --fair-share or --uid-rate, if given.  Set before the mount is served.
+  std::shared_ptr<IoScheduler> ioScheduler;
+
   uint64_t nextFuseFh();
-  std::shared_ptr<FileNode> loopupFuseFh(uint64_t);
+  std::shared_ptr<FileNode> lookupFuseFh(uint64_t);
 
 private:
+  static const int NumShards = 16;
+
   /**
    * This placeholder is what is referenceed in FUSE context (passed
    * to callbacks).
@@ -65,20 +120,96 @@ private:
    * in fileNode, we store a unique Placeholder for each open() until
    * the corresponding release() is called. std::shared_ptr then does
    * our reference counting for us.
+   *
+   * Open files are spread over shards by the hash of their path, and
+   * file handles by their number, so that operations on different files
+   * don't wait for each other.  A path shard is locked before a handle
+   * shard, never the other way around.  Paths are interned, so the keys
+   * share their components with the names of the nodes.
    * */
-  using FileMap =
-      std::unordered_map<std::string, std::list<std::shared_ptr<FileNode>>>;
-
+  using FileMap = std::unordered_map<PathName,
+                                     std::list<std::shared_ptr<FileNode>>,
+                                     PathName::Hash>;
+
+  struct FileShard {
+    pthread_mutex_t mutex;
+    FileMap openFiles;
+  };
+  struct FuseFhShard {
+    pthread_rwlock_t lock;
+    std::unordered_map<uint64_t, std::shared_ptr<FileNode>> fuseFhMap;
+  };
+
+  // released nodes kept, and the seconds until one is no longer reused
+  static const size_t MaxReleased = 64;
+  static const int ReleasedSecs = 10;
+
+  struct Released {
+    PathName path;
+    std::shared_ptr<FileNode> node;
+    struct stat stbuf;  // of the backing file, when released
+    int64_t keptAt;
+  };
+  using ReleasedList = std::list<Released>;
+
+  struct InodeKey {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const InodeKey &o) const {
+      return dev == o.dev && ino == o.ino;
+    }
+  };
+  struct InodeHash {
+    size_t operator()(const InodeKey &k) const {
+      return std::hash<uint64_t>()((uint64_t)k.ino * 31 + (uint64_t)k.dev);
+    }
+  };
+  // a linked node, and how many opens under any name it is in the path
+  // shards for.  The handle goes once the last of them is released.
+  struct OpenInode {
+    std::shared_ptr<FileNode> node;
+    size_t opens = 0;
+  };
+
+  FileShard &fileShardFor(const PathName &path);
+  FuseFhShard &fuseFhShardFor(uint64_t fuseFh);
+  bool haveOpenFiles(size_t *count);
+
+  // guards changes of root, and the idle check
   mutable pthread_mutex_t contextMutex;
-  FileMap openFiles;
-
-  int usageCount;
-  int idleCount;
-  bool isUnmounting;
+  FileShard fileShards[NumShards];
+
+  // seconds on a monotonic clock at the last operation.  Stored only
+  // when the second changes, so that threads racing through getRoot share
+  // the cache line rather than bounce it.
+  std::atomic<int64_t> lastActivity;
+  // activity stamp of the idle period already warned about
+  int64_t warnedActivity;
+  std::atomic<bool> isUnmounting;
+  // read without the lock through std::atomic_load
   std::shared_ptr<DirNode> root;
 
-  std::atmoic<std::uint64_t> currentFuseFh;
-  std::unordered_map<uint64_t, std::shared_ptr<FileNode>> fuseMap;
+  std::atomic<std::uint64_t> currentFuseFh;
+  FuseFhShard fuseFhShards[NumShards];
+
+  // the last statfs(), its expiry on a monotonic clock in milliseconds,
+  // and the longest plaintext name, worked out when the root is set
+  pthread_mutex_t statfsMutex;
+  struct statvfs statfsBuf;
+  int64_t statfsExpires;
+  unsigned long nameMax;
+
+  // taken after a path shard and before a handle shard
+  pthread_mutex_t inodeMutex;
+  std::unordered_map<InodeKey, OpenInode, InodeHash> openInodes;
+  std::atomic<size_t> linkedOpen;  // openInodes.size()
+
+  // taken after a path shard, never before.  Nodes are dropped once it
+  // is released, their destructors may write.
+  pthread_mutex_t releasedMutex;
+  ReleasedList releasedLru;  // most recently released first
+  std::unordered_map<PathName, ReleasedList::iterator, PathName::Hash>
+      releasedIndex;
 };
 
 int remountFS(EncFS_Context *ctx);
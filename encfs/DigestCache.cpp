@@ -0,0 +1,312 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DigestCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+#include "openssl.h"
+
+namespace encfs {
+
+// a journal of over twice the records it needs, and this many more, is
+// rewritten when opened
+static const uint64_t CompactSlack = 4096;
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+static uint64_t fnv64(const unsigned char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// all of len bytes, 0 or -errno
+static int writeAll(int fd, const unsigned char *data, size_t len,
+                    off_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pwrite(fd, data, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+DigestCache::Sum::Sum() : _ctx(EVP_MD_CTX_new()), _pos(0), _pendingBytes(0) {
+  if (_ctx != nullptr &&
+      EVP_DigestInit_ex(_ctx, fetchedDigest(EVP_sha256()), nullptr) != 1) {
+    EVP_MD_CTX_free(_ctx);
+    _ctx = nullptr;
+  }
+}
+
+DigestCache::Sum::~Sum() {
+  if (_ctx != nullptr) {
+    EVP_MD_CTX_free(_ctx);
+  }
+}
+
+void DigestCache::Sum::update(const unsigned char *data, size_t len) {
+  EVP_DigestUpdate(_ctx, data, len);
+  _pos += len;
+}
+
+bool DigestCache::Sum::add(off_t offset, const unsigned char *data,
+                           size_t len) {
+  if (_ctx == nullptr) {
+    return false;
+  }
+  off_t end = offset + (off_t)len;
+  if (end <= _pos) {
+    return true;  // read again
+  }
+  if (offset > _pos) {
+    if (_pendingBytes + len > MaxPendingBytes) {
+      return false;
+    }
+    std::vector<unsigned char> &held = _pending[offset];
+    if (held.size() < len) {
+      _pendingBytes += len - held.size();
+      held.assign(data, data + len);
+    }
+    return true;
+  }
+
+  update(data + (_pos - offset), end - _pos);
+  // and whatever was waiting for it
+  while (!_pending.empty() && _pending.begin()->first <= _pos) {
+    auto it = _pending.begin();
+    off_t heldEnd = it->first + (off_t)it->second.size();
+    if (heldEnd > _pos) {
+      update(it->second.data() + (_pos - it->first), heldEnd - _pos);
+    }
+    _pendingBytes -= it->second.size();
+    _pending.erase(it);
+  }
+  return true;
+}
+
+void DigestCache::Sum::finish(unsigned char *md) {
+  unsigned int len = DigestSize;
+  EVP_DigestFinal_ex(_ctx, md, &len);
+}
+
+DigestCache::DigestCache(const std::string &path)
+    : _path(path), _fd(-1), _journalled(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+DigestCache::~DigestCache() {
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+uint64_t DigestCache::nameHash(const char *name) {
+  return fnv64((const unsigned char *)name, strlen(name));
+}
+
+void DigestCache::stampOf(const struct stat &stbuf, Record *rec) {
+  rec->ino = stbuf.st_ino;
+  rec->size = stbuf.st_size;
+#if defined(__APPLE__)
+  rec->mtimeSec = stbuf.st_mtimespec.tv_sec;
+  rec->mtimeNsec = stbuf.st_mtimespec.tv_nsec;
+#else
+  rec->mtimeSec = stbuf.st_mtim.tv_sec;
+  rec->mtimeNsec = stbuf.st_mtim.tv_nsec;
+#endif
+}
+
+static void encodeRecord(uint64_t hash, uint64_t ino, int64_t size,
+                         int64_t mtimeSec, int64_t mtimeNsec,
+                         const unsigned char *md, unsigned char *out) {
+  put64(out, hash);
+  put64(out + 8, ino);
+  put64(out + 16, (uint64_t)size);
+  put64(out + 24, (uint64_t)mtimeSec);
+  put64(out + 32, (uint64_t)mtimeNsec);
+  memcpy(out + 40, md, DigestCache::DigestSize);
+}
+
+bool DigestCache::open() {
+  _fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat st;
+  if (_fd < 0 || ::fstat(_fd, &st) != 0) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to open the digest cache " << _path << ": "
+                << strerror(eno);
+    return false;
+  }
+
+  // each record ends in a checksum of the rest, so a torn append is seen
+  const size_t size = RecordSize + 8;
+  uint64_t records = st.st_size / size;
+  std::vector<unsigned char> buf(size * 1024);
+  uint64_t n = 0;
+  bool bad = false;
+  while (n < records && !bad) {
+    size_t want = std::min<uint64_t>(records - n, 1024) * size;
+    ssize_t got = ::pread(_fd, buf.data(), want, n * size);
+    if (got < (ssize_t)want) {
+      RLOG(ERROR) << "unable to read the digest cache " << _path;
+      return false;
+    }
+    for (size_t i = 0; i < want; i += size, ++n) {
+      const unsigned char *rec = &buf[i];
+      if (fnv64(rec, RecordSize) != get64(rec + RecordSize)) {
+        bad = true;
+        break;
+      }
+      Record &r = _records[get64(rec)];
+      r.ino = get64(rec + 8);
+      r.size = (int64_t)get64(rec + 16);
+      r.mtimeSec = (int64_t)get64(rec + 24);
+      r.mtimeNsec = (int64_t)get64(rec + 32);
+      memcpy(r.md, rec + 40, DigestSize);
+    }
+  }
+  if (n * size != (uint64_t)st.st_size) {
+    RLOG(WARNING) << "dropping the digest cache " << _path << " from record "
+                  << n;
+    if (::ftruncate(_fd, n * size) != 0) {
+      int eno = errno;
+      RLOG(ERROR) << "unable to truncate " << _path << ": " << strerror(eno);
+      return false;
+    }
+  }
+  _journalled = n;
+  VLOG(1) << "digest cache: " << _records.size() << " files in " << n
+          << " records";
+
+  if (_journalled > 2 * _records.size() + CompactSlack) {
+    Lock lock(_mutex);
+    int res = compact();
+    if (res < 0) {
+      RLOG(WARNING) << "unable to compact " << _path << ": "
+                    << strerror(-res);
+    }
+  }
+  return true;
+}
+
+int DigestCache::compact() {
+  const size_t size = RecordSize + 8;
+  std::string tmp = _path + ".new";
+  int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  std::vector<unsigned char> buf(_records.size() * size);
+  uint64_t n = 0;
+  for (const auto &it : _records) {
+    const Record &r = it.second;
+    unsigned char *out = &buf[n * size];
+    encodeRecord(it.first, r.ino, r.size, r.mtimeSec, r.mtimeNsec, r.md, out);
+    put64(out + RecordSize, fnv64(out, RecordSize));
+    ++n;
+  }
+  int res = writeAll(fd, buf.data(), buf.size(), 0);
+  if (res == 0 && ::fsync(fd) != 0) {
+    res = -errno;
+  }
+  if (res == 0 && ::rename(tmp.c_str(), _path.c_str()) != 0) {
+    res = -errno;
+  }
+  if (res < 0) {
+    ::close(fd);
+    ::unlink(tmp.c_str());
+    return res;
+  }
+
+  VLOG(1) << "compacted the digest cache from " << _journalled << " to " << n
+          << " records";
+  ::close(_fd);
+  _fd = fd;
+  _journalled = n;
+  return 0;
+}
+
+bool DigestCache::get(const char *name, const struct stat &stbuf,
+                      unsigned char *md) {
+  Record now;
+  stampOf(stbuf, &now);
+  Lock lock(_mutex);
+  auto it = _records.find(nameHash(name));
+  if (it == _records.end()) {
+    return false;
+  }
+  const Record &r = it->second;
+  if (r.ino != now.ino || r.size != now.size || r.mtimeSec != now.mtimeSec ||
+      r.mtimeNsec != now.mtimeNsec) {
+    return false;
+  }
+  memcpy(md, r.md, DigestSize);
+  return true;
+}
+
+void DigestCache::add(const char *name, const struct stat &stbuf, Sum *sum) {
+  Record r;
+  stampOf(stbuf, &r);
+  sum->finish(r.md);
+  uint64_t hash = nameHash(name);
+
+  unsigned char out[RecordSize + 8];
+  encodeRecord(hash, r.ino, r.size, r.mtimeSec, r.mtimeNsec, r.md, out);
+  put64(out + RecordSize, fnv64(out, RecordSize));
+
+  Lock lock(_mutex);
+  _records[hash] = r;
+  int res = writeAll(_fd, out, sizeof(out), _journalled * sizeof(out));
+  if (res < 0) {
+    RLOG(WARNING) << "unable to write the digest cache: " << strerror(-res);
+    return;
+  }
+  ++_journalled;
+}
+
+}  // namespace encfs
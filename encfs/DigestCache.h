@@ -0,0 +1,106 @@
+#ifndef _DigestCache_incl_
+#define _DigestCache_incl_
+
+#include <map>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+struct evp_md_ctx_st;
+
+namespace encfs {
+
+/*
+    SHA-256 digests of the encoded files of a reverse mount, kept on disk
+    between mounts (--digest-cache) and read through the user.encfs.digest
+    attribute, so that backup tools can tell an unchanged encoded file
+    without reading it, and so without us encoding it again.
+
+    The encoding of a file in reverse mode only depends on its inode, its
+    data and its encoded name, so a digest holds while the source file has
+    the inode, size and mtime it was taken at.  A digest is taken whenever
+    a file is read from start to end.
+
+    The file is a journal of fixed size records, appended as digests are
+    taken, replayed when the cache is opened and rewritten when most of it
+    is superseded.  The digests are of data any reader of the mount sees,
+    and are stored as they are.
+ */
+class DigestCache {
+ public:
+  static const int DigestSize = 32;
+
+  // the digest of data read in order, from offset 0 on
+  class Sum {
+   public:
+    Sum();
+    ~Sum();
+
+    // the len bytes at offset were read.  Reads may come out of order, up
+    // to a bound; false once the sum can not be completed.
+    bool add(off_t offset, const unsigned char *data, size_t len);
+    // bytes summed from the start
+    off_t summed() const { return _pos; }
+    void finish(unsigned char *md);
+
+   private:
+    static const size_t MaxPendingBytes = 8 * 1024 * 1024;
+
+    void update(const unsigned char *data, size_t len);
+
+    evp_md_ctx_st *_ctx;
+    off_t _pos;
+    // read past _pos, waiting for what lies in between
+    std::map<off_t, std::vector<unsigned char>> _pending;
+    size_t _pendingBytes;
+
+    Sum(const Sum &);             // not allowed
+    Sum &operator=(const Sum &);  // not allowed
+  };
+
+  explicit DigestCache(const std::string &path);
+  ~DigestCache();
+
+  // reads the journal, creating it if missing.  False if it can not be
+  // used at all.
+  bool open();
+
+  // the digest of the file name of the mount, with attributes stbuf, into
+  // md[DigestSize].  False if none is known for its current version.
+  bool get(const char *name, const struct stat &stbuf, unsigned char *md);
+  // records the finished sum of name, read in full at attributes stbuf
+  void add(const char *name, const struct stat &stbuf, Sum *sum);
+
+ private:
+  struct Record {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    unsigned char md[DigestSize];
+  };
+  static const int RecordSize = 8 + 4 * 8 + DigestSize;
+
+  static uint64_t nameHash(const char *name);
+  static void stampOf(const struct stat &stbuf, Record *rec);
+
+  // rewrites the journal with one record per name.  Caller holds _mutex.
+  int compact();
+
+  std::string _path;
+  pthread_mutex_t _mutex;
+  std::unordered_map<uint64_t, Record> _records;  // by nameHash
+  int _fd;
+  uint64_t _journalled;  // records in the journal
+
+  DigestCache(const DigestCache &);             // not allowed
+  DigestCache &operator=(const DigestCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,125 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DirFdCache.h"
+
+#include "easylogging++.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+#if defined(O_PATH)
+// enough for the *at() calls, without read permission on the directory
+static const int DirFlags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+static const int DirFlags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+
+static void closeDir(int *fd) {
+  ::close(*fd);
+  delete fd;
+}
+
+DirFdCache::DirFdCache(size_t maxEntries)
+    : _maxEntries(maxEntries > 0 ? maxEntries : 1), _hits(0), _misses(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+DirFdCache::~DirFdCache() {
+  VLOG(1) << "dir fd cache: " << hits() << " hits, " << misses()
+          << " misses";
+  pthread_mutex_destroy(&_mutex);
+}
+
+DirFdCache::Ref DirFdCache::at(const std::shared_ptr<DirFdCache> &cache,
+                               const char *path) {
+  if (!cache) {
+    return Ref(AT_FDCWD, path);
+  }
+  return cache->get(path);
+}
+
+DirFdCache::Ref DirFdCache::get(const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (slash == nullptr || slash == path || slash[1] == '\0') {
+    // the root, a relative name or a directory path
+    return Ref(AT_FDCWD, path);
+  }
+  std::string dirPath(path, slash - path);
+  const char *name = slash + 1;
+
+  {
+    Lock lock(_mutex, ENCFS_LOCK_SITE("DirFdCache::get"));
+    auto it = _index.find(dirPath);
+    if (it != _index.end()) {
+      _lru.splice(_lru.begin(), _lru, it->second);
+      ++_hits;
+      return Ref(it->second->fd, name);
+    }
+  }
+  ++_misses;
+
+  int fd = ::open(dirPath.c_str(), DirFlags);
+  if (fd < 0) {
+    // the syscall on the full path reports the error
+    return Ref(AT_FDCWD, path);
+  }
+  std::shared_ptr<int> dir(new int(fd), closeDir);
+
+  // dropped entries close once the lock is released
+  EntryList dropped;
+  Lock lock(_mutex, ENCFS_LOCK_SITE("DirFdCache::get"));
+  auto it = _index.find(dirPath);
+  if (it != _index.end()) {
+    // opened by another thread meanwhile, ours closes with its Ref
+    return Ref(dir, name);
+  }
+  _lru.push_front(Entry{dirPath, dir});
+  _index[dirPath] = _lru.begin();
+  while (_lru.size() > _maxEntries) {
+    _index.erase(_lru.back().path);
+    dropped.splice(dropped.end(), _lru, std::prev(_lru.end()));
+  }
+  return Ref(dir, name);
+}
+
+void DirFdCache::eraseBelow(const std::string &dirPath) {
+  EntryList dropped;
+  Lock lock(_mutex, ENCFS_LOCK_SITE("DirFdCache::eraseBelow"));
+  for (auto it = _lru.begin(); it != _lru.end();) {
+    const std::string &path = it->path;
+    bool below = path.compare(0, dirPath.size(), dirPath) == 0 &&
+                 (path.size() == dirPath.size() || path[dirPath.size()] == '/');
+    auto next = std::next(it);
+    if (below) {
+      _index.erase(path);
+      dropped.splice(dropped.end(), _lru, it);
+    }
+    it = next;
+  }
+}
+
+uint64_t DirFdCache::hits() const { return _hits; }
+
+uint64_t DirFdCache::misses() const { return _misses; }
+
+}  // namespace encfs
@@ -0,0 +1,83 @@
+#ifndef _DirFdCache_incl_
+#define _DirFdCache_incl_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+namespace encfs {
+
+/*
+    Descriptors of recently used backing directories, keyed by their
+    cipher path, so that a syscall on a file can go through openat(),
+    fstatat(), mkdirat() or unlinkat() with just its name rather than have
+    the kernel walk every component of its full path again.  Shared by the
+    whole filesystem.
+
+    A descriptor stays open while a Ref to it is held, even once it was
+    pushed out of the cache.  Renames and removals of directories through
+    the mount erase the entries at and below the path; changes made behind
+    our back are not seen, so the cache is only used with caching on and
+    not in reverse mode.
+ */
+class DirFdCache {
+ public:
+  explicit DirFdCache(size_t maxEntries);
+  ~DirFdCache();
+
+  // where a syscall on a path is made: the descriptor of its directory
+  // and its name in it, or AT_FDCWD and the full path when there is no
+  // descriptor.  The name points into the path, which must outlive it.
+  class Ref {
+   public:
+    Ref(int fd, const char *name) : _fd(fd), _name(name) {}
+    Ref(const std::shared_ptr<int> &dir, const char *name)
+        : _dir(dir), _fd(*dir), _name(name) {}
+
+    int fd() const { return _fd; }
+    const char *name() const { return _name; }
+
+   private:
+    std::shared_ptr<int> _dir;
+    int _fd;
+    const char *_name;
+  };
+
+  // the directory of path through cache, which may be null
+  static Ref at(const std::shared_ptr<DirFdCache> &cache, const char *path);
+
+  // closes the descriptors of dirPath and the directories below it, once
+  // they are no longer used
+  void eraseBelow(const std::string &dirPath);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  Ref get(const char *path);
+
+  struct Entry {
+    std::string path;
+    std::shared_ptr<int> fd;  // closes when the last holder lets go
+  };
+  using EntryList = std::list<Entry>;
+
+  pthread_mutex_t _mutex;
+  EntryList _lru;  // most recently used first
+  std::unordered_map<std::string, EntryList::iterator> _index;
+  size_t _maxEntries;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  DirFdCache(const DirFdCache &);             // not allowed
+  DirFdCache &operator=(const DirFdCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,798 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DirIndex.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+const char DirIndex::FileName[] = ".encfs6.index";
+
+// the file: magic, version, IV, MAC of the encrypted body and its length,
+// the inode and times of the directory it was written for, then the body
+static const uint32_t IndexMagic = 0x49445345;  // "ESDI"
+static const uint32_t IndexVersion = 1;
+static const size_t HeaderSize = 64;
+// a body longer than this is not written, nor believed
+static const size_t MaxBodySize = 1024 * 1024 * 1024;
+// directories known, with an index or without
+static const size_t MaxDirs = 4096;
+// seconds a directory must have been left alone for an index to be made
+static const time_t SettleSecs = 2;
+
+static int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool sameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static struct timespec mtimeOf(const struct stat &st) {
+#if defined(__APPLE__)
+  return st.st_mtimespec;
+#else
+  return st.st_mtim;
+#endif
+}
+
+static struct timespec ctimeOf(const struct stat &st) {
+#if defined(__APPLE__)
+  return st.st_ctimespec;
+#else
+  return st.st_ctim;
+#endif
+}
+
+// the times of an entry's attributes, to read and to fill in
+static struct timespec *timesOf(struct stat *st, int which) {
+#if defined(__APPLE__)
+  return which == 0 ? &st->st_atimespec
+                    : which == 1 ? &st->st_mtimespec : &st->st_ctimespec;
+#else
+  return which == 0 ? &st->st_atim : which == 1 ? &st->st_mtim : &st->st_ctim;
+#endif
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+static void add32(std::vector<unsigned char> *out, uint32_t v) {
+  unsigned char buf[4];
+  put32(buf, v);
+  out->insert(out->end(), buf, buf + 4);
+}
+
+static void add64(std::vector<unsigned char> *out, uint64_t v) {
+  unsigned char buf[8];
+  put64(buf, v);
+  out->insert(out->end(), buf, buf + 8);
+}
+
+static void addString(std::vector<unsigned char> *out, const std::string &s) {
+  add32(out, (uint32_t)s.size());
+  out->insert(out->end(), s.begin(), s.end());
+}
+
+static void addTime(std::vector<unsigned char> *out,
+                    const struct timespec &ts) {
+  add64(out, (uint64_t)ts.tv_sec);
+  add64(out, (uint64_t)ts.tv_nsec);
+}
+
+// reads a body, every read past its end fails
+struct BodyReader {
+  const unsigned char *pos;
+  const unsigned char *end;
+
+  bool u32(uint32_t *v) {
+    if (end - pos < 4) {
+      return false;
+    }
+    *v = get32(pos);
+    pos += 4;
+    return true;
+  }
+  bool u64(uint64_t *v) {
+    if (end - pos < 8) {
+      return false;
+    }
+    *v = get64(pos);
+    pos += 8;
+    return true;
+  }
+  bool str(std::string *s) {
+    uint32_t len;
+    if (!u32(&len) || (size_t)(end - pos) < len) {
+      return false;
+    }
+    s->assign((const char *)pos, len);
+    pos += len;
+    return true;
+  }
+  bool time(struct timespec *ts) {
+    uint64_t sec, nsec;
+    if (!u64(&sec) || !u64(&nsec)) {
+      return false;
+    }
+    ts->tv_sec = (time_t)sec;
+    ts->tv_nsec = (long)nsec;
+    return true;
+  }
+};
+
+// the body holds plaintext names
+static void wipe(std::vector<unsigned char> *buf) {
+  volatile unsigned char *p = buf->data();
+  for (size_t i = 0; i < buf->size(); ++i) {
+    p[i] = 0;
+  }
+}
+
+// the inode and times of a directory, as the header of its index has them
+static void putStamp(unsigned char *p, ino_t ino, const struct timespec &mtime,
+                     const struct timespec &ctime) {
+  put64(p, (uint64_t)ino);
+  put64(p + 8, (uint64_t)mtime.tv_sec);
+  put32(p + 16, (uint32_t)mtime.tv_nsec);
+  put64(p + 20, (uint64_t)ctime.tv_sec);
+  put32(p + 28, (uint32_t)ctime.tv_nsec);
+}
+
+static std::string indexPath(const std::string &cipherDir) {
+  if (!cipherDir.empty() && cipherDir[cipherDir.length() - 1] == '/') {
+    return cipherDir + DirIndex::FileName;
+  }
+  return cipherDir + '/' + DirIndex::FileName;
+}
+
+static bool readAll(int fd, unsigned char *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t res = ::pread(fd, buf, len, offset);
+    if (res <= 0) {
+      return false;
+    }
+    buf += res;
+    len -= res;
+    offset += res;
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const unsigned char *buf, size_t len,
+                     off_t offset) {
+  while (len > 0) {
+    ssize_t res = ::pwrite(fd, buf, len, offset);
+    if (res <= 0) {
+      return false;
+    }
+    buf += res;
+    len -= res;
+    offset += res;
+  }
+  return true;
+}
+
+DirIndex::Dir::Dir()
+    : indexed(false),
+      loaded(false),
+      evicted(false),
+      dirty(false),
+      checkedAt(0),
+      ino(0),
+      generation(0),
+      changing(0) {
+  pthread_mutex_init(&mutex, nullptr);
+  memset(&mtime, 0, sizeof(mtime));
+  memset(&ctime, 0, sizeof(ctime));
+}
+
+DirIndex::Dir::~Dir() { pthread_mutex_destroy(&mutex); }
+
+DirIndex::DirIndex(std::shared_ptr<Cipher> cipher, CipherKey key,
+                   size_t minEntries, size_t maxEntries)
+    : _cipher(std::move(cipher)),
+      _key(std::move(key)),
+      _minEntries(minEntries),
+      _maxEntries(maxEntries),
+      _entries(0),
+      _hits(0),
+      _misses(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+DirIndex::~DirIndex() {
+  for (auto &it : _dirs) {
+    Dir *d = it.second.get();
+    Lock lock(d->mutex);
+    save(d);
+  }
+  VLOG(1) << "dir index: " << hits() << " hits, " << misses() << " misses";
+  pthread_mutex_destroy(&_mutex);
+}
+
+std::shared_ptr<DirIndex::Dir> DirIndex::dir(const std::string &cipherDir,
+                                             bool create) {
+  std::shared_ptr<Dir> d;
+  std::vector<std::shared_ptr<Dir>> evicted;
+  {
+    Lock lock(_mutex, ENCFS_LOCK_SITE("DirIndex::dir"));
+    auto it = _dirs.find(cipherDir);
+    if (it != _dirs.end()) {
+      d = it->second;
+      _lru.splice(_lru.begin(), _lru, d->lru);
+    } else if (create) {
+      d = std::make_shared<Dir>();
+      d->path = cipherDir;
+      _lru.push_front(cipherDir);
+      d->lru = _lru.begin();
+      _dirs[cipherDir] = d;
+    } else {
+      return d;
+    }
+    while ((_entries > (long)_maxEntries || _dirs.size() > MaxDirs) &&
+           _lru.back() != cipherDir) {
+      auto victim = _dirs.find(_lru.back());
+      evicted.push_back(victim->second);
+      _dirs.erase(victim);
+      _lru.pop_back();
+    }
+  }
+  for (const std::shared_ptr<Dir> &victim : evicted) {
+    Lock lock(victim->mutex);
+    save(victim.get());
+    drop(victim.get());
+    victim->evicted = true;
+  }
+  return d;
+}
+
+bool DirIndex::current(Dir *d) {
+  if (d->evicted) {
+    return false;
+  }
+  int64_t now = monotonicMs();
+  if (d->loaded && now - d->checkedAt < CheckMs) {
+    return d->indexed;
+  }
+  d->checkedAt = now;
+
+  struct stat st;
+  if (::stat(d->path.c_str(), &st) != 0) {
+    drop(d);
+    return false;
+  }
+  bool same = d->ino == st.st_ino && sameTime(d->mtime, mtimeOf(st)) &&
+              sameTime(d->ctime, ctimeOf(st));
+  if (d->loaded && same) {
+    return d->indexed;
+  }
+  // changed, or never looked at: an index that holds can only be in the
+  // file now
+  drop(d);
+  d->loaded = true;
+  d->ino = st.st_ino;
+  d->mtime = mtimeOf(st);
+  d->ctime = ctimeOf(st);
+  load(d);
+  return d->indexed;
+}
+
+void DirIndex::drop(Dir *d) {
+  if (d->indexed) {
+    _entries -= (long)d->entries.size();
+  }
+  Entries().swap(d->entries);
+  d->indexed = false;
+  d->dirty = false;
+  ++d->generation;
+}
+
+void DirIndex::restamp(Dir *d) {
+  struct stat st;
+  if (::stat(d->path.c_str(), &st) != 0) {
+    drop(d);
+    return;
+  }
+  d->ino = st.st_ino;
+  d->mtime = mtimeOf(st);
+  d->ctime = ctimeOf(st);
+}
+
+void DirIndex::load(Dir *d) {
+  std::string path = indexPath(d->path);
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  // an index written for other times is stale, whatever it holds
+  unsigned char header[HeaderSize];
+  unsigned char stamp[32];
+  putStamp(stamp, d->ino, d->mtime, d->ctime);
+  bool ok = readAll(fd, header, sizeof(header), 0) &&
+            get32(header) == IndexMagic && get32(header + 4) == IndexVersion &&
+            memcmp(header + 32, stamp, sizeof(stamp)) == 0;
+  uint64_t len = ok ? get64(header + 24) : 0;
+  ok = ok && len > 0 && len <= MaxBodySize;
+  std::vector<unsigned char> body;
+  if (ok) {
+    body.resize(len);
+    ok = readAll(fd, body.data(), len, HeaderSize);
+  }
+  ::close(fd);
+  if (!ok) {
+    VLOG(1) << "no current index in " << d->path;
+    return;
+  }
+
+  uint64_t iv = get64(header + 8);
+  uint64_t chain = iv;
+  ok = _cipher->MAC_64(body.data(), (int)len, _key, &chain) ==
+           get64(header + 16) &&
+       _cipher->streamDecode(body.data(), (int)len, iv, _key);
+
+  BodyReader r = {body.data(), body.data() + body.size()};
+  uint64_t ino;
+  struct timespec mtime, ctime;
+  uint32_t count = 0;
+  ok = ok && r.u64(&ino) && r.time(&mtime) && r.time(&ctime) &&
+       r.u32(&count) && ino == (uint64_t)d->ino && sameTime(mtime, d->mtime) &&
+       sameTime(ctime, d->ctime);
+  // each name takes at least 32 bytes
+  ok = ok && (size_t)(r.end - r.pos) / 32 >= count;
+  Entries entries;
+  if (ok) {
+    entries.reserve(count);
+  }
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    std::string name;
+    Entry e;
+    uint64_t inode;
+    uint32_t type, haveAttr;
+    ok = r.str(&name) && r.str(&e.cipherName) && r.u64(&e.iv) &&
+         r.u64(&inode) && r.u32(&type) && r.u32(&haveAttr);
+    e.inode = (ino_t)inode;
+    e.fileType = (int)type;
+    e.haveAttr = haveAttr != 0;
+    memset(&e.attr, 0, sizeof(e.attr));
+    if (ok && e.haveAttr) {
+      uint32_t mode, uid, gid;
+      uint64_t nlink, rdev, size, blksize, blocks;
+      ok = r.u32(&mode) && r.u64(&nlink) && r.u32(&uid) && r.u32(&gid) &&
+           r.u64(&rdev) && r.u64(&size) && r.u64(&blksize) &&
+           r.u64(&blocks) && r.time(timesOf(&e.attr, 0)) &&
+           r.time(timesOf(&e.attr, 1)) && r.time(timesOf(&e.attr, 2));
+      e.attr.st_ino = e.inode;
+      e.attr.st_mode = (mode_t)mode;
+      e.attr.st_nlink = (nlink_t)nlink;
+      e.attr.st_uid = (uid_t)uid;
+      e.attr.st_gid = (gid_t)gid;
+      e.attr.st_rdev = (dev_t)rdev;
+      e.attr.st_size = (off_t)size;
+      e.attr.st_blksize = (blksize_t)blksize;
+      e.attr.st_blocks = (blkcnt_t)blocks;
+    }
+    if (ok) {
+      entries[name] = std::move(e);
+    }
+  }
+  ok = ok && r.pos == r.end;
+  wipe(&body);
+  if (!ok) {
+    RLOG(WARNING) << "ignoring damaged name index " << path;
+    return;
+  }
+
+  d->entries.swap(entries);
+  d->indexed = true;
+  _entries += (long)d->entries.size();
+  VLOG(1) << "loaded an index of " << d->entries.size() << " names from "
+          << path;
+}
+
+void DirIndex::save(Dir *d) {
+  if (!d->indexed || !d->dirty) {
+    return;
+  }
+  d->dirty = false;
+
+  // not over a change made behind our back, which makes it stale
+  struct stat st;
+  if (::stat(d->path.c_str(), &st) != 0 || d->ino != st.st_ino ||
+      !sameTime(d->mtime, mtimeOf(st)) || !sameTime(d->ctime, ctimeOf(st))) {
+    drop(d);
+    return;
+  }
+
+  // a new file changes the times of the directory, one written over does
+  // not
+  std::string path = indexPath(d->path);
+  int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      restamp(d);
+    }
+  }
+  if (fd < 0 || !d->indexed) {
+    RLOG(WARNING) << "unable to write the name index " << path << ": "
+                  << strerror(errno);
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return;
+  }
+
+  std::vector<unsigned char> body;
+  add64(&body, (uint64_t)d->ino);
+  addTime(&body, d->mtime);
+  addTime(&body, d->ctime);
+  add32(&body, (uint32_t)d->entries.size());
+  for (auto &it : d->entries) {
+    Entry &e = it.second;
+    addString(&body, it.first);
+    addString(&body, e.cipherName);
+    add64(&body, e.iv);
+    add64(&body, (uint64_t)e.inode);
+    add32(&body, (uint32_t)e.fileType);
+    add32(&body, e.haveAttr ? 1 : 0);
+    if (e.haveAttr) {
+      add32(&body, (uint32_t)e.attr.st_mode);
+      add64(&body, (uint64_t)e.attr.st_nlink);
+      add32(&body, (uint32_t)e.attr.st_uid);
+      add32(&body, (uint32_t)e.attr.st_gid);
+      add64(&body, (uint64_t)e.attr.st_rdev);
+      add64(&body, (uint64_t)e.attr.st_size);
+      add64(&body, (uint64_t)e.attr.st_blksize);
+      add64(&body, (uint64_t)e.attr.st_blocks);
+      for (int which = 0; which < 3; ++which) {
+        addTime(&body, *timesOf(&e.attr, which));
+      }
+    }
+  }
+
+  unsigned char header[HeaderSize];
+  unsigned char ivBytes[8];
+  bool ok = body.size() <= MaxBodySize && body.size() <= (size_t)INT_MAX &&
+            _cipher->randomize(ivBytes, sizeof(ivBytes), false);
+  uint64_t iv = get64(ivBytes);
+  ok = ok && _cipher->streamEncode(body.data(), (int)body.size(), iv, _key);
+  if (ok) {
+    uint64_t chain = iv;
+    put32(header, IndexMagic);
+    put32(header + 4, IndexVersion);
+    put64(header + 8, iv);
+    put64(header + 16,
+          _cipher->MAC_64(body.data(), (int)body.size(), _key, &chain));
+    put64(header + 24, body.size());
+    putStamp(header + 32, d->ino, d->mtime, d->ctime);
+    // torn by a crash, it fails its MAC
+    ok = writeAll(fd, header, sizeof(header), 0) &&
+         writeAll(fd, body.data(), body.size(), HeaderSize) &&
+         ::ftruncate(fd, HeaderSize + body.size()) == 0;
+  }
+  int eno = errno;
+  ::close(fd);
+  wipe(&body);
+  if (!ok) {
+    RLOG(WARNING) << "unable to write the name index " << path << ": "
+                  << strerror(eno);
+    return;
+  }
+  VLOG(1) << "wrote an index of " << d->entries.size() << " names to "
+          << path;
+}
+
+DirIndex::Answer DirIndex::lookup(const std::string &cipherDir,
+                                  const char *plainName, Entry *entry,
+                                  uint64_t *generation) {
+  std::shared_ptr<Dir> d = dir(cipherDir, true);
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::lookup"));
+  if (!current(d.get())) {
+    ++_misses;
+    return Unknown;
+  }
+  ++_hits;
+  *generation = d->generation;
+  auto it = d->entries.find(plainName);
+  if (it == d->entries.end()) {
+    return Missing;
+  }
+  *entry = it->second;
+  return Found;
+}
+
+void DirIndex::setAttr(const std::string &cipherDir, const char *plainName,
+                       const struct stat &attr, uint64_t generation) {
+  std::shared_ptr<Dir> d = dir(cipherDir, false);
+  if (!d) {
+    return;
+  }
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::setAttr"));
+  if (!d->indexed || d->evicted || d->generation != generation) {
+    return;
+  }
+  auto it = d->entries.find(plainName);
+  if (it != d->entries.end()) {
+    it->second.attr = attr;
+    it->second.haveAttr = true;
+    d->dirty = true;
+  }
+}
+
+void DirIndex::dropAttr(const std::string &cipherDir, const char *plainName) {
+  std::shared_ptr<Dir> d = dir(cipherDir, false);
+  if (!d) {
+    return;
+  }
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::dropAttr"));
+  if (!d->indexed) {
+    return;
+  }
+  ++d->generation;
+  auto it = d->entries.find(plainName);
+  if (it != d->entries.end() && it->second.haveAttr) {
+    it->second.haveAttr = false;
+    d->dirty = true;
+  }
+}
+
+bool DirIndex::listing(const std::string &cipherDir, const struct stat &st,
+                       std::vector<DirListCache::Entry> *out) {
+  std::shared_ptr<Dir> d = dir(cipherDir, true);
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::listing"));
+  if (!current(d.get()) || d->ino != st.st_ino ||
+      !sameTime(d->mtime, mtimeOf(st)) || !sameTime(d->ctime, ctimeOf(st))) {
+    ++_misses;
+    return false;
+  }
+  ++_hits;
+  out->clear();
+  out->reserve(d->entries.size());
+  for (const auto &it : d->entries) {
+    DirListCache::Entry e;
+    e.name = it.first;
+    e.cipherName = it.second.cipherName;
+    e.inode = it.second.inode;
+    e.fileType = it.second.fileType;
+    e.iv = it.second.iv;
+    out->push_back(std::move(e));
+  }
+  return true;
+}
+
+void DirIndex::listed(const std::string &cipherDir, const struct stat &st,
+                      time_t listedAt,
+                      const std::vector<DirListCache::Entry> &entries) {
+  if (entries.size() < _minEntries || entries.size() > _maxEntries ||
+      st.st_mtime + SettleSecs > listedAt ||
+      st.st_ctime + SettleSecs > listedAt) {
+    return;
+  }
+  std::shared_ptr<Dir> d = dir(cipherDir, true);
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::listed"));
+  if (d->evicted || (current(d.get()) && d->ino == st.st_ino &&
+                     sameTime(d->mtime, mtimeOf(st)) &&
+                     sameTime(d->ctime, ctimeOf(st)))) {
+    return;
+  }
+
+  drop(d.get());
+  d->entries.reserve(entries.size());
+  for (const DirListCache::Entry &name : entries) {
+    Entry &e = d->entries[name.name];
+    e.cipherName = name.cipherName;
+    e.iv = name.iv;
+    e.inode = name.inode;
+    e.fileType = name.fileType;
+    e.haveAttr = false;
+  }
+  d->loaded = true;
+  d->indexed = true;
+  d->dirty = true;
+  d->checkedAt = monotonicMs();
+  d->ino = st.st_ino;
+  d->mtime = mtimeOf(st);
+  d->ctime = ctimeOf(st);
+  _entries += (long)d->entries.size();
+  VLOG(1) << "indexed " << d->entries.size() << " names of " << cipherDir;
+}
+
+DirIndex::Change::Change() {}
+
+DirIndex::Change::~Change() {
+  if (_dir) {
+    Lock lock(_dir->mutex, ENCFS_LOCK_SITE("DirIndex::Change"));
+    --_dir->changing;
+  }
+}
+
+void DirIndex::Change::begin(DirIndex *index, const std::string &cipherDir) {
+  std::shared_ptr<Dir> d = index->dir(cipherDir, false);
+  if (!d) {
+    return;
+  }
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::Change::begin"));
+  if (d->evicted) {
+    return;
+  }
+  _dir = d;
+  if (d->changing++ > 0 || !d->indexed) {
+    // the times of the changes under way are taken with them
+    return;
+  }
+  // the index has the times of the directory as of the last change it
+  // took: anything since was made behind our back
+  struct stat st;
+  if (::stat(d->path.c_str(), &st) != 0 || d->ino != st.st_ino ||
+      !sameTime(d->mtime, mtimeOf(st)) || !sameTime(d->ctime, ctimeOf(st))) {
+    VLOG(1) << "index of " << d->path << " changed behind our back";
+    index->drop(d.get());
+    return;
+  }
+  d->checkedAt = monotonicMs();
+}
+
+// a change made through the mount is put in the index only if a Change
+// checked the directory before it was made; otherwise a change behind our
+// back just before it would go unseen
+void DirIndex::added(const std::string &cipherDir, const char *plainName,
+                     const std::string &cipherName, uint64_t iv) {
+  std::shared_ptr<Dir> d = dir(cipherDir, false);
+  if (!d) {
+    return;
+  }
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::added"));
+  if (!d->indexed || d->evicted) {
+    return;
+  }
+  struct stat st;
+  std::string path = cipherDir;
+  if (path.empty() || path[path.length() - 1] != '/') {
+    path += '/';
+  }
+  path += cipherName;
+  if (d->changing == 0 || ::lstat(path.c_str(), &st) != 0) {
+    drop(d.get());
+    return;
+  }
+
+  auto res = d->entries.emplace(plainName, Entry());
+  Entry &e = res.first->second;
+  e.cipherName = cipherName;
+  e.iv = iv;
+  e.inode = st.st_ino;
+  e.fileType = (st.st_mode & S_IFMT) >> 12;
+  e.haveAttr = false;
+  if (res.second) {
+    ++_entries;
+  }
+  ++d->generation;
+  d->dirty = true;
+  restamp(d.get());
+}
+
+void DirIndex::removed(const std::string &cipherDir, const char *plainName) {
+  std::shared_ptr<Dir> d = dir(cipherDir, false);
+  if (!d) {
+    return;
+  }
+  Lock lock(d->mutex, ENCFS_LOCK_SITE("DirIndex::removed"));
+  if (!d->indexed || d->evicted) {
+    return;
+  }
+  if (d->changing == 0) {
+    drop(d.get());
+    return;
+  }
+  if (d->entries.erase(plainName) > 0) {
+    --_entries;
+  }
+  ++d->generation;
+  d->dirty = true;
+  restamp(d.get());
+}
+
+void DirIndex::forgetBelow(const std::string &cipherDir) {
+  std::vector<std::shared_ptr<Dir>> forgotten;
+  {
+    Lock lock(_mutex, ENCFS_LOCK_SITE("DirIndex::forgetBelow"));
+    for (auto it = _dirs.begin(); it != _dirs.end();) {
+      const std::string &path = it->first;
+      if (path.compare(0, cipherDir.length(), cipherDir) == 0 &&
+          (path.length() == cipherDir.length() ||
+           path[cipherDir.length()] == '/')) {
+        forgotten.push_back(it->second);
+        _lru.erase(it->second->lru);
+        it = _dirs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (const std::shared_ptr<Dir> &d : forgotten) {
+    Lock lock(d->mutex);
+    drop(d.get());
+    d->evicted = true;
+  }
+}
+
+bool DirIndex::removeIfEmpty(const std::string &cipherDir) {
+  DIR *dir = ::opendir(cipherDir.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+  bool index = false;
+  bool others = false;
+  struct dirent *de;
+  while (!others && (de = ::readdir(dir)) != nullptr) {
+    if (strcmp(de->d_name, FileName) == 0) {
+      index = true;
+    } else if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+      others = true;
+    }
+  }
+  ::closedir(dir);
+  if (others || !index) {
+    return false;
+  }
+  forgetBelow(cipherDir);
+  return ::unlink(indexPath(cipherDir).c_str()) == 0;
+}
+
+uint64_t DirIndex::hits() const { return _hits; }
+
+uint64_t DirIndex::misses() const { return _misses; }
+
+}  // namespace encfs
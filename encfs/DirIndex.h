@@ -0,0 +1,204 @@
+#ifndef _DirIndex_incl_
+#define _DirIndex_incl_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include "CipherKey.h"
+#include "DirListCache.h"
+
+namespace encfs {
+
+class Cipher;
+
+/*
+    Indexes of large backing directories (--dir-index), so that looking up
+    a name in a directory of millions neither encodes it nor stats the
+    backing directory for it, and listing the directory neither reads nor
+    decodes its names.  Case-insensitive lower filesystems, where a lookup
+    of the lower directory is slow, gain the most.
+
+    A directory gets an index once it is listed in full with minEntries
+    names or more: a hash table of its plaintext names, each with its name
+    in the backing directory, the name IV the chain ends with at it, and
+    the attributes getattr last reported for it.  The index is kept in a
+    file of the directory, FileName, encrypted under the volume key and
+    with a MAC like the WarmCache snapshot, and loaded whole the first time
+    the directory is looked in; every listing skips that file.
+
+    An index holds while the directory has the inode, mtime and ctime it
+    was made with, checked at most every CheckMs.  Names created, renamed
+    and removed through the mount are put in the index, which then takes
+    the directory's new times, so only changes behind the mount's back make
+    it stale; it is then dropped, and made again by the next full listing.
+    The directory is checked again as each change through the mount begins
+    (see Change), so that one behind the mount's back just before it is not
+    taken for ours; one made while a change through the mount is under way
+    goes unseen.  Attributes are dropped wherever the attribute cache drops
+    them, and taken again from the next stat; those of a file changed
+    behind the mount's back, which leaves its directory alone, are not seen
+    until the directory changes.
+
+    The indexes changed are written back when they are evicted and when
+    the mount goes away.  One torn by a crash fails its MAC, one left
+    behind by it names times the directory no longer has, and either is
+    made again.  Bounded by the names held in all indexes together.
+ */
+class DirIndex {
+  // what is known of a backing directory, below
+  struct Dir;
+
+ public:
+  // the index, in each indexed directory
+  static const char FileName[];
+  // how often an index is checked against its directory
+  static const int CheckMs = 1000;
+
+  struct Entry {
+    std::string cipherName;
+    uint64_t iv;  // the name IV the chain ends with at the entry
+    ino_t inode;
+    int fileType;
+    bool haveAttr;
+    struct stat attr;  // as getattr reported it, if haveAttr
+  };
+
+  enum Answer {
+    Unknown,  // the directory has no index that holds
+    Missing,  // there is no such name
+    Found
+  };
+
+  DirIndex(std::shared_ptr<Cipher> cipher, CipherKey key, size_t minEntries,
+           size_t maxEntries);
+  // writes out the indexes changed
+  ~DirIndex();
+
+  // what the index of the backing directory cipherDir knows of plainName.
+  // generation is set for setAttr().
+  Answer lookup(const std::string &cipherDir, const char *plainName,
+                Entry *entry, uint64_t *generation);
+  // the attributes getattr found for plainName, kept unless they were
+  // dropped since the lookup that gave generation
+  void setAttr(const std::string &cipherDir, const char *plainName,
+               const struct stat &attr, uint64_t generation);
+  void dropAttr(const std::string &cipherDir, const char *plainName);
+
+  // the listing of cipherDir, whose stat is st, from its index.  False if
+  // it has none that holds.
+  bool listing(const std::string &cipherDir, const struct stat &st,
+               std::vector<DirListCache::Entry> *out);
+  // the names of cipherDir, read to the end at listedAt from a directory
+  // whose stat before the first name was st, and that has not changed
+  // since.  Made its index if there are enough of them.
+  void listed(const std::string &cipherDir, const struct stat &st,
+              time_t listedAt, const std::vector<DirListCache::Entry> &entries);
+
+  // held around a change made through the mount to the names of a backing
+  // directory, from before the change is made until added() or removed()
+  // took it.  begin() checks the directory against its index, unless
+  // another change is under way, so that the directory's new times are
+  // only taken for those of our own changes.
+  class Change {
+   public:
+    Change();
+    ~Change();
+
+    // before the change, to the backing directory cipherDir
+    void begin(DirIndex *index, const std::string &cipherDir);
+
+   private:
+    std::shared_ptr<Dir> _dir;
+
+    Change(const Change &);             // not allowed
+    Change &operator=(const Change &);  // not allowed
+  };
+
+  // plainName was created, as cipherName with iv, or removed through the
+  // mount, from the backing directory cipherDir, with a Change held.  An
+  // index not told of the change first is dropped.
+  void added(const std::string &cipherDir, const char *plainName,
+             const std::string &cipherName, uint64_t iv);
+  void removed(const std::string &cipherDir, const char *plainName);
+
+  // forgets the indexes of cipherDir and the directories below it, which
+  // were renamed or whose names changed with a rename
+  void forgetBelow(const std::string &cipherDir);
+
+  // before cipherDir is removed: its index, if nothing else is left in
+  // the directory.  True if there was one to remove.
+  bool removeIfEmpty(const std::string &cipherDir);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  using Entries = std::unordered_map<std::string, Entry>;
+
+  // what is known of a backing directory.  Its mutex is taken after
+  // _mutex.
+  struct Dir {
+    pthread_mutex_t mutex;
+    std::string path;
+    bool indexed;         // entries hold, as of checkedAt
+    bool loaded;          // the index file was looked for
+    bool evicted;         // no longer known, what is done to it is lost
+    bool dirty;           // changed since it was read or written
+    int64_t checkedAt;    // when the times were last compared, ms
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint64_t generation;  // bumped as attributes are dropped
+    int changing;         // Changes held
+    Entries entries;
+    std::list<std::string>::iterator lru;
+    Dir();
+    ~Dir();
+  };
+
+  // the state of cipherDir, made if create and it is not known, or null.
+  // Evicts the least recently used past the bounds.
+  std::shared_ptr<Dir> dir(const std::string &cipherDir, bool create);
+  // whether dir has an index that its directory still has the times of,
+  // looking for the index file the first time and after the directory
+  // changed.  Caller holds dir->mutex.
+  bool current(Dir *dir);
+  // drops the entries of dir.  Caller holds dir->mutex.
+  void drop(Dir *dir);
+  // the directory's times, now that the mount changed it.  Caller holds
+  // dir->mutex.
+  void restamp(Dir *dir);
+  // reads the index file of dir.  Caller holds dir->mutex.
+  void load(Dir *dir);
+  // writes dir to its index file, if it changed.  Caller holds
+  // dir->mutex.
+  void save(Dir *dir);
+
+  std::shared_ptr<Cipher> _cipher;
+  CipherKey _key;
+  size_t _minEntries;
+  size_t _maxEntries;
+
+  pthread_mutex_t _mutex;
+  std::unordered_map<std::string, std::shared_ptr<Dir>> _dirs;
+  std::list<std::string> _lru;  // most recently used first
+  std::atomic<long> _entries;   // held in all indexes
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  DirIndex(const DirIndex &);             // not allowed
+  DirIndex &operator=(const DirIndex &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
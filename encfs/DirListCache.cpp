@@ -0,0 +1,152 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DirListCache.h"
+
+#include "easylogging++.h"
+#include <ctime>
+#include <iterator>
+
+#include "Mutex.h"
+
+namespace encfs {
+
+// seconds a directory must have been left alone for its listing to be kept
+static const time_t SettleSecs = 2;
+
+static bool sameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static struct timespec mtimeOf(const struct stat &st) {
+#if defined(__APPLE__)
+  return st.st_mtimespec;
+#else
+  return st.st_mtim;
+#endif
+}
+
+static struct timespec ctimeOf(const struct stat &st) {
+#if defined(__APPLE__)
+  return st.st_ctimespec;
+#else
+  return st.st_ctim;
+#endif
+}
+
+DirListCache::Listing::~Listing() {
+  // the names are plaintext
+  for (Entry &entry : entries) {
+    entry.name.assign(entry.name.size(), ' ');
+  }
+}
+
+DirListCache::DirListCache(size_t maxNames)
+    : _names(0), _maxNames(maxNames), _hits(0), _misses(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+DirListCache::~DirListCache() {
+  VLOG(1) << "dir list cache: " << hits() << " hits, " << misses()
+          << " misses";
+  pthread_mutex_destroy(&_mutex);
+}
+
+std::shared_ptr<const DirListCache::Listing> DirListCache::get(
+    const struct stat &st) {
+  // a stale listing is freed once the lock is released
+  std::shared_ptr<const Listing> listing;
+  Lock lock(_mutex, ENCFS_LOCK_SITE("DirListCache::get"));
+  auto it = _index.find(Key(st.st_dev, st.st_ino));
+  if (it != _index.end()) {
+    listing = it->second->listing;
+    if (sameTime(listing->mtime, mtimeOf(st)) &&
+        sameTime(listing->ctime, ctimeOf(st))) {
+      _lru.splice(_lru.begin(), _lru, it->second);
+      ++_hits;
+      return listing;
+    }
+    _names -= listing->entries.size();
+    _lru.erase(it->second);
+    _index.erase(it);
+  }
+  ++_misses;
+  return std::shared_ptr<const Listing>();
+}
+
+void DirListCache::add(const struct stat &st, time_t listedAt,
+                       std::vector<Entry> entries) {
+  if (entries.size() > _maxNames || st.st_mtime + SettleSecs > listedAt ||
+      st.st_ctime + SettleSecs > listedAt) {
+    // the names of the listing are cleared with the vector
+    Listing dropped;
+    dropped.entries.swap(entries);
+    return;
+  }
+  std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+  listing->entries.swap(entries);
+  listing->mtime = mtimeOf(st);
+  listing->ctime = ctimeOf(st);
+
+  // dropped listings are freed once the lock is released
+  SlotList dropped;
+  Lock lock(_mutex, ENCFS_LOCK_SITE("DirListCache::add"));
+  Key key(st.st_dev, st.st_ino);
+  auto it = _index.find(key);
+  if (it != _index.end()) {
+    _names -= it->second->listing->entries.size();
+    dropped.splice(dropped.end(), _lru, it->second);
+    _index.erase(it);
+  }
+  _lru.push_front(Slot{key, listing});
+  _index[key] = _lru.begin();
+  _names += listing->entries.size();
+  while (_names > _maxNames) {
+    _names -= _lru.back().listing->entries.size();
+    _index.erase(_lru.back().key);
+    dropped.splice(dropped.end(), _lru, std::prev(_lru.end()));
+  }
+}
+
+std::vector<DirListCache::Kept> DirListCache::hottest() {
+  std::vector<Kept> res;
+  Lock lock(_mutex, ENCFS_LOCK_SITE("DirListCache::hottest"));
+  res.reserve(_lru.size());
+  for (const Slot &slot : _lru) {
+    res.push_back(Kept{slot.key.first, slot.key.second, slot.listing});
+  }
+  return res;
+}
+
+void DirListCache::preload(const Kept &kept) {
+  Lock lock(_mutex, ENCFS_LOCK_SITE("DirListCache::preload"));
+  Key key(kept.dev, kept.ino);
+  if (_names + kept.listing->entries.size() > _maxNames ||
+      _index.find(key) != _index.end()) {
+    return;
+  }
+  // behind what this mount listed already
+  _lru.push_back(Slot{key, kept.listing});
+  _index[key] = std::prev(_lru.end());
+  _names += kept.listing->entries.size();
+}
+
+uint64_t DirListCache::hits() const { return _hits; }
+
+uint64_t DirListCache::misses() const { return _misses; }
+
+}  // namespace encfs
@@ -0,0 +1,104 @@
+#ifndef _DirListCache_incl_
+#define _DirListCache_incl_
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+namespace encfs {
+
+/*
+    Fully decoded listings of recently read backing directories, keyed by
+    their device and inode and shared by every handle, so that listing a
+    directory again (ls, build tools, file watchers) copies its names
+    rather than reading and decoding them once more.
+
+    A listing is only handed out while the directory has the mtime and
+    ctime it was read with.  As a change within the granularity of the
+    timestamps would go unseen, listings of directories changed in the
+    last couple of seconds before they were read are not kept.  Bounded by
+    the names held in all listings together; the least recently used go
+    first.  The names are plaintext, and cleared when a listing is freed.
+ */
+class DirListCache {
+ public:
+  struct Entry {
+    std::string name;
+    std::string cipherName;
+    ino_t inode;
+    int fileType;
+    // the name IV the chain ends with at the entry, 0 without chained
+    // names and in listings kept by an earlier mount
+    uint64_t iv = 0;
+  };
+
+  struct Listing {
+    std::vector<Entry> entries;
+    struct timespec mtime;
+    struct timespec ctime;
+
+    ~Listing();
+  };
+
+  // a listing with the device and inode of its directory
+  struct Kept {
+    dev_t dev;
+    ino_t ino;
+    std::shared_ptr<const Listing> listing;
+  };
+
+  explicit DirListCache(size_t maxNames);
+  ~DirListCache();
+
+  // the listing of the directory whose stat is st, or null if it is not
+  // cached or the directory changed since
+  std::shared_ptr<const Listing> get(const struct stat &st);
+
+  // keeps listing, read from the directory whose stat, before the first
+  // name was read, was st, at listedAt
+  void add(const struct stat &st, time_t listedAt,
+           std::vector<Entry> entries);
+
+  // the listings, most recently used first, for a later mount to
+  // preload()
+  std::vector<Kept> hottest();
+  // keeps a listing of an earlier mount, unless its directory is listed
+  // already or there is no room left for it.  get() checks its mtime and
+  // ctime as for any other.
+  void preload(const Kept &kept);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  using Key = std::pair<dev_t, ino_t>;
+  struct Slot {
+    Key key;
+    std::shared_ptr<const Listing> listing;
+  };
+  using SlotList = std::list<Slot>;
+
+  pthread_mutex_t _mutex;
+  SlotList _lru;  // most recently used first
+  std::map<Key, SlotList::iterator> _index;
+  size_t _names;
+  size_t _maxNames;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  DirListCache(const DirListCache &);             // not allowed
+  DirListCache &operator=(const DirListCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -1,24 +1,39 @@
 #include "DirNode.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
-#ifdef _linux_
-#include <sys/fsuid.h>
-#endif
+#include <fcntl.h>
+#include <functional>
+#include <iterator>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utility>
 #include <utime.h>
 
+#include "AsCaller.h"
+#include "AttrCache.h"
+#include "Cipher.h"
 #include "Context.h"
+#include "DirFdCache.h"
+#include "DirIndex.h"
 #include "Error.h"
 #include "FSConfig.h"
+#include "FdCache.h"
 #include "FileNode.h"
 #include "FileUtils.h"
+#include "LinkCache.h"
 #include "Mutex.h"
 #include "NameIO.h"
+#include "NegativeCache.h"
+#include "ObjectStore.h"
+#include "PackStore.h"
+#include "PathCache.h"
+#include "Probes.h"
+#include "ThreadPool.h"
+#include "XattrCache.h"
 #include "easylogging++.h"
 
 using namespace std;
@@ -28,9 +43,58 @@ class DirDeleter {
     void operator() (DIR* d) { ::closedir(d); }
 };
 
+// names read from the directory and decoded together
+static const int NameBatch = 1024;
+// fewest names worth handing to another thread
+static const int MinParallelNames = 64;
+// fewest file headers worth rewriting on another thread
+static const int MinParallelHeaders = 16;
+// the IV header of a file, as CipherFileIO writes it
+static const int HeaderBytes = 8;
+// headers rewritten by a rename in progress, in the root of the backing
+// directory: one line per file, the old and the new name relative to it
+// and the old and the new header, in hex
+static const char RenameJournal[] = ".encfs6.rename";
+
+// names in the root of the backing directory that are not files of the
+// volume: its config and every file kept beside it, its packs, journals,
+// trash, caches and counts, all named with the config's prefix.  The
+// name encodings never write a dot, so no file of the volume has one.
+static const char SidecarPrefix[] = ".encfs6.";
+
+static bool reservedName(const char* name) {
+  return strncmp(SidecarPrefix, name, sizeof(SidecarPrefix) - 1) == 0;
+}
+
+// and those in any directory: its name index
+static bool hiddenName(bool root, const char* name) {
+  return (root && reservedName(name)) || strcmp(DirIndex::FileName, name) == 0;
+}
+
+struct DirTraverse::Batch {
+  struct Entry {
+    string cipherName;
+    string plainName;
+    int fileType;
+    ino_t inode;
+    uint64_t iv;  // at the entry, once decoded
+    bool decoded;
+  };
+  vector<Entry> entries;
+  size_t next;
+
+  Batch() : next(0) {}
+};
+
 DirTraverse::DirTraverse(std::shared_ptr<DIR> _dirPtr, uint64_t _iv,
-                         std::shared_ptr<NameIO> _naming, bool _root)
-  : dir(std::move(_dirPtr)), iv(_iv), naming(std::move(_naming)), root(_root) {}
+                         std::shared_ptr<NameIO> _naming, bool _root,
+                         std::shared_ptr<ThreadPool> _pool)
+  : dir(std::move(_dirPtr)), iv(_iv), naming(std::move(_naming)), root(_root),
+    pool(std::move(_pool)) {
+  if (pool && dir) {
+    batch = std::make_shared<Batch>();
+  }
+}
 
 DirTraverse& DirTraverse::operator=(const DirTraverse& src) = default;
 
@@ -39,6 +103,8 @@ DirTraverse::~DirTraverse() {
   iv = 0;
   naming.reset();
   root = false;
+  batch.reset();
+  pool.reset();
 }
 
 static bool _nextName(struct dirent*& de, const std::shared_ptr<DIR>& dir,
@@ -65,30 +131,225 @@ static bool _nextName(struct dirent*& de, const std::shared_ptr<DIR>& dir,
   return false;
 }
 
+/*
+ * Read the next NameBatch names, and decode them on the pool and the calling
+ * thread.  Returns false at the end of the directory.
+ */
+bool DirTraverse::fillBatch() {
+  Batch& b = *batch;
+  b.entries.clear();
+  b.next = 0;
+
+  struct dirent* de = nullptr;
+  int fileType = 0;
+  ino_t inode = 0;
+  while ((int)b.entries.size() < NameBatch &&
+         _nextName(de, dir, &fileType, &inode)) {
+    if (hiddenName(root, de->d_name)) {
+      VLOG(1) << "skipping filename: " << de->d_name;
+      continue;
+    }
+    Batch::Entry entry;
+    entry.cipherName = de->d_name;
+    entry.fileType = fileType;
+    entry.inode = inode;
+    entry.decoded = false;
+    b.entries.push_back(std::move(entry));
+  }
+
+  int count = (int)b.entries.size();
+  if (count == 0) {
+    return false;
+  }
+
+  // each slice of names goes to the cipher in one batch.  An undecodable
+  // entry is reported when it is reached.
+  auto decode = [this, &b](int first, int last) {
+    std::vector<NameIO::NameRequest> names;
+    std::vector<int> which;
+    names.reserve(last - first);
+    for (int i = first; i < last; ++i) {
+      Batch::Entry& entry = b.entries[i];
+      entry.iv = iv;
+      if (entry.cipherName == "." || entry.cipherName == "..") {
+        entry.plainName = entry.cipherName;
+        entry.decoded = true;
+        continue;
+      }
+      NameIO::NameRequest req;
+      req.name = entry.cipherName;
+      req.iv = iv;
+      req.ok = false;
+      names.push_back(std::move(req));
+      which.push_back(i);
+    }
+    if (!names.empty()) {
+      naming->decodeNames(names.data(), (int)names.size());
+    }
+    for (size_t j = 0; j < names.size(); ++j) {
+      Batch::Entry& entry = b.entries[which[j]];
+      entry.decoded = names[j].ok;
+      if (names[j].ok) {
+        entry.plainName = std::move(names[j].coded);
+        entry.iv = names[j].iv;
+      }
+    }
+    return true;
+  };
+
+  int slices = count / MinParallelNames;
+  if (slices > pool->threads() + 1) {
+    slices = pool->threads() + 1;
+  }
+  if (slices < 2) {
+    decode(0, count);
+  } else {
+    pool->forEach(slices, [&](int slice) {
+      return decode(count * slice / slices, count * (slice + 1) / slices);
+    });
+  }
+  return true;
+}
+
+const std::string* DirTraverse::nextDecoded(int* fileType, ino_t* inode,
+                                            std::string* cipherName,
+                                            uint64_t* nameIV) {
+  Batch& b = *batch;
+  for (;;) {
+    while (b.next < b.entries.size()) {
+      Batch::Entry& entry = b.entries[b.next++];
+      if (!entry.decoded) {
+        VLOG(1) << "error decoding filename: " << entry.cipherName;
+        continue;
+      }
+      if (fileType != nullptr) {
+        *fileType = entry.fileType;
+      }
+      if (inode != nullptr) {
+        *inode = entry.inode;
+      }
+      if (cipherName != nullptr) {
+        *cipherName = entry.cipherName;
+      }
+      if (nameIV != nullptr) {
+        *nameIV = entry.iv;
+      }
+      return &entry.plainName;
+    }
+    if (!fillBatch()) {
+      if (fileType != nullptr) {
+        *fileType = 0;
+      }
+      return nullptr;
+    }
+  }
+}
+
 std::string DirTraverse::nextPlaintextName(int* fileType, ino_t* inode) {
+  if (batch) {
+    const std::string* name = nextDecoded(fileType, inode);
+    return name != nullptr ? *name : string();
+  }
+
   struct dirent* de = nullptr;
   while (_nextName(de, dir, fileType, inode)) {
-    if (root && (strcmp(".encfs6.xml", de->d_name) == 0)) {
+    if (hiddenName(root, de->d_name)) {
       VLOG(1) << "skipping filename: " << de->d_name;
+      continue;
+    }
+    uint64_t localIv = iv;
+    string plainName;
+    if (naming->tryDecodePath(de->d_name, &plainName, &localIv) == 0) {
+      return plainName;
     }
+    // .. .problem decoding, ignore it and continue on to next name..
+    VLOG(1) << "error decoding filename: " << de->d_name;
   }
   return string();
 }
 
-std::string DirTraverse::nextInvalid() {
+int DirTraverse::nextPlaintextName(char* buf, int bufLength, int* fileType,
+                                   ino_t* inode, std::string* cipherName,
+                                   uint64_t* nameIV) {
+  if (batch) {
+    const std::string* name;
+    while ((name = nextDecoded(fileType, inode, cipherName, nameIV)) !=
+           nullptr) {
+      if ((int)name->size() < bufLength) {
+        memcpy(buf, name->c_str(), name->size() + 1);
+        return (int)name->size();
+      }
+      RLOG(WARNING) << "decoded name " << *name << " is too long";
+    }
+    return 0;
+  }
+
   struct dirent* de = nullptr;
+  while (_nextName(de, dir, fileType, inode)) {
+    if (hiddenName(root, de->d_name)) {
+      VLOG(1) << "skipping filename: " << de->d_name;
+      continue;
+    }
+    uint64_t localIv = iv;
+    int len = naming->tryDecodePath(de->d_name, buf, bufLength, &localIv);
+    if (len > 0) {
+      if (cipherName != nullptr) {
+        *cipherName = de->d_name;
+      }
+      if (nameIV != nullptr) {
+        *nameIV = localIv;
+      }
+      return len;
+    }
+    if (len == -ENAMETOOLONG) {
+      RLOG(WARNING) << "decoded name of " << de->d_name << " is too long";
+    } else {
+      VLOG(1) << "error decoding filename: " << de->d_name;
+    }
+  }
+  return 0;
+}
+
+bool DirTraverse::nextEntry(std::string* cipherName, std::string* plainName,
+                            int* fileType) {
+  if (batch) {
+    Batch& b = *batch;
+    while (b.next >= b.entries.size()) {
+      if (!fillBatch()) {
+        return false;
+      }
+    }
+    Batch::Entry& entry = b.entries[b.next++];
+    *cipherName = entry.cipherName;
+    *plainName = entry.decoded ? entry.plainName : string();
+    if (fileType != nullptr) {
+      *fileType = entry.fileType;
+    }
+    return true;
+  }
 
-  while (_nextName(de, dir, (int*)nullptr, (ino_t*)nullptr)) {
-    if (root && (strcmp(".encfs6.xml", de->d_name) == 0)) {
+  struct dirent* de = nullptr;
+  while (_nextName(de, dir, fileType, (ino_t*)nullptr)) {
+    if (hiddenName(root, de->d_name)) {
       VLOG(1) << "skipping filename; " << de->d_name;
       continue;
     }
-    try {
-      uint64_t localIv = iv;
-      naming->decodePath(de->d_name, &localIv);
-      continue;
-    } catch (encfs::Error& ex) {
-      return string(de->d_name);
+    *cipherName = de->d_name;
+    uint64_t localIv = iv;
+    if (naming->tryDecodePath(de->d_name, plainName, &localIv) != 0) {
+      plainName->clear();
+    }
+    return true;
+  }
+  return false;
+}
+
+std::string DirTraverse::nextInvalid() {
+  string cipherName;
+  string plainName;
+  while (nextEntry(&cipherName, &plainName, nullptr)) {
+    if (plainName.empty()) {
+      return cipherName;
     }
   }
   return string();
@@ -97,11 +358,26 @@ std::string DirTraverse::nextInvalid() {
 struct RenameEl {
   string oldCName;
   string newCName;
+  // where the name starts in oldCName and newCName, past the path of the
+  // directory, which is the same for both
+  size_t nameOffset;
 
   string oldPName;
   string newPName;
 
   bool isDirectory;
+
+  // the IVs the chains of the old and the new path end with, which the
+  // header of a file is encoded with
+  uint64_t fromIV;
+  uint64_t toIV;
+
+  // set once the header was rewritten ahead of the rename, with the
+  // attributes from before and both encodings of the header
+  bool headerRewritten;
+  struct stat st;
+  unsigned char oldHeader[HeaderBytes];
+  unsigned char newHeader[HeaderBytes];
 };
 
 class RenameOp {
@@ -109,6 +385,12 @@ class RenameOp {
     DirNode* dn;
     std::shared_ptr<list<RenameEl>> renameList;
     list<RenameEl>::const_iterator last;
+    // the journal of the headers rewritten, empty if there is none
+    string journal;
+
+    bool needsNode(const RenameEl& el) const;
+    bool rewriteHeaders();
+    void restoreHeaders();
 
   public:
     RenameOp(DirNode* _dn, std::shared_ptr<list<RenameEl>> _renameList)
@@ -126,9 +408,13 @@ class RenameOp {
 
     bool apply();
     void undo();
-}
+};
 
 RenameOp::~RenameOp() {
+  // every file is where its header says, renamed or put back by undo()
+  if (!journal.empty()) {
+    ::unlink(journal.c_str());
+  }
   if (renameList) {
     list <RenameEl>::iterator it;
     for (it = renameList->begin(); it != renameList->end(); ++it) {
@@ -138,27 +424,288 @@ RenameOp::~RenameOp() {
   }
 }
 
+/*
+ * With external IV chaining the header of every file depends on its path,
+ * and is rewritten through its node.  Otherwise only open files have a node
+ * that needs to know the new name.
+ */
+bool RenameOp::needsNode(const RenameEl& el) const {
+  if (el.headerRewritten) {
+    return false;
+  }
+  if (dn->fsConfig->config->externalIVChaining) {
+    return true;
+  }
+  return (dn->ctx != nullptr) && dn->ctx->lookupNode(el.oldPName.c_str());
+}
+
+static string toHex(const unsigned char* data, int len) {
+  static const char digits[] = "0123456789abcdef";
+  string out;
+  for (int i = 0; i < len; ++i) {
+    out += digits[data[i] >> 4];
+    out += digits[data[i] & 0xf];
+  }
+  return out;
+}
+
+static bool fromHex(const string& hex, unsigned char* data, int len) {
+  if ((int)hex.size() != 2 * len) {
+    return false;
+  }
+  for (int i = 0; i < 2 * len; ++i) {
+    char c = hex[i];
+    int v;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    data[i / 2] = (unsigned char)((i % 2) == 0 ? v << 4 : data[i / 2] | v);
+  }
+  return true;
+}
+
+// runs job over [0, count) in slices on pool, if there is one and count is
+// worth it
+static bool forSlices(const std::shared_ptr<ThreadPool>& pool, int count,
+                      const std::function<bool(int, int)>& job) {
+  int slices = pool ? count / MinParallelHeaders : 0;
+  if (pool && slices > pool->threads() + 1) {
+    slices = pool->threads() + 1;
+  }
+  if (slices < 2) {
+    return job(0, count);
+  }
+  return pool->forEach(slices, [&](int slice) {
+    return job(count * slice / slices, count * (slice + 1) / slices);
+  });
+}
+
+static bool writeHeaderAt(const string& path, const unsigned char* header) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = ::pwrite(fd, header, HeaderBytes, 0) == HeaderBytes;
+  int eno = errno;
+  ::close(fd);
+  errno = eno;
+  return ok;
+}
+
+/*
+ * With external IV chaining, rewrites the headers of the files that are not
+ * open up front, in parallel on the crypto pool, rather than through a node
+ * for each of them as it is renamed.  Open files still go through their
+ * node, and so does a file we can't open for writing as it is.
+ *
+ * The headers are journaled first, so that a mount after a crash puts back
+ * the header of every file that was not renamed, and writes the new one of
+ * every file that was (see DirNode::recoverRenames).
+ */
+bool RenameOp::rewriteHeaders() {
+  const FSConfigPtr& cfg = dn->fsConfig;
+  if (!cfg->config->externalIVChaining || !cfg->config->uniqueIV) {
+    return true;
+  }
+
+  vector<RenameEl*> files;
+  for (RenameEl& el : *renameList) {
+    if (!el.isDirectory && el.fromIV != el.toIV &&
+        ((dn->ctx == nullptr) || !dn->ctx->lookupNode(el.oldPName.c_str()))) {
+      files.push_back(&el);
+    }
+  }
+  if (files.empty()) {
+    return true;
+  }
+  if (dn->ctx != nullptr) {
+    // kept nodes have the old IVs
+    dn->ctx->forgetAllReleased();
+  }
+
+  // read and re-encode them
+  vector<char> state(files.size(), 0);  // 1: has a header, 2: rewritten
+  bool ok = forSlices(cfg->cryptoPool, (int)files.size(), [&](int a, int b) {
+    for (int i = a; i < b; ++i) {
+      RenameEl& el = *files[i];
+      int fd = ::open(el.oldCName.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        // left to the node
+        continue;
+      }
+      ssize_t n = -1;
+      if (::fstat(fd, &el.st) == 0) {
+        n = ::pread(fd, el.oldHeader, HeaderBytes, 0);
+      }
+      ::close(fd);
+      if (n < 0) {
+        continue;
+      }
+      if ((cfg->packStore && el.st.st_size == PackStore::PlaceholderSize) ||
+          (cfg->objectStore &&
+           el.st.st_size == ObjectStore::PlaceholderSize)) {
+        // maybe a placeholder, the header being in the packs or the object
+        // store: left to the node, which goes through them
+        continue;
+      }
+      if (n < HeaderBytes) {
+        // no header yet, the first write creates it
+        memset(el.oldHeader, 0, HeaderBytes);
+        memset(el.newHeader, 0, HeaderBytes);
+        el.headerRewritten = true;
+        continue;
+      }
+      memcpy(el.newHeader, el.oldHeader, HeaderBytes);
+      if (!cfg->cipher->streamDecode(el.newHeader, HeaderBytes, el.fromIV,
+                                     cfg->key) ||
+          !cfg->cipher->streamEncode(el.newHeader, HeaderBytes, el.toIV,
+                                     cfg->key)) {
+        RLOG(WARNING) << "Aborting rename: cannot recode header of "
+                      << el.oldCName;
+        return false;
+      }
+      state[i] = 1;
+    }
+    return true;
+  });
+  if (!ok) {
+    return false;
+  }
+
+  string text;
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (state[i] == 1) {
+      const RenameEl& el = *files[i];
+      text += el.oldCName.substr(dn->rootDir.size()) + '\t' +
+              el.newCName.substr(dn->rootDir.size()) + '\t' +
+              toHex(el.oldHeader, HeaderBytes) + '\t' +
+              toHex(el.newHeader, HeaderBytes) + '\n';
+    }
+  }
+  if (text.empty()) {
+    return true;
+  }
+  string path = dn->rootDir + RenameJournal;
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  if (fd < 0) {
+    int eno = errno;
+    RLOG(WARNING) << "Error creating " << path << ": " << strerror(eno);
+    return false;
+  }
+  bool written = ::write(fd, text.data(), text.size()) == (ssize_t)text.size() &&
+                 ::fsync(fd) == 0;
+  ::close(fd);
+  if (!written) {
+    RLOG(WARNING) << "Error writing " << path;
+    ::unlink(path.c_str());
+    return false;
+  }
+  journal = path;
+
+  ok = forSlices(cfg->cryptoPool, (int)files.size(), [&](int a, int b) {
+    for (int i = a; i < b; ++i) {
+      if (state[i] != 1) {
+        continue;
+      }
+      RenameEl& el = *files[i];
+      if (writeHeaderAt(el.oldCName, el.newHeader)) {
+        state[i] = 2;
+        el.headerRewritten = true;
+      } else if (errno != EACCES) {
+        RLOG(WARNING) << "Error rewriting header of " << el.oldCName << ": "
+                      << strerror(errno);
+        return false;
+      }
+      // a read-only file is reopened by its node, which knows how
+    }
+    return true;
+  });
+  if (!ok) {
+    restoreHeaders();
+  }
+  return ok;
+}
+
+/*
+ * Puts back the old header of every file that got a new one, for undo().
+ * All of them are at their old names by then.
+ */
+void RenameOp::restoreHeaders() {
+  if (journal.empty()) {
+    return;
+  }
+  for (RenameEl& el : *renameList) {
+    if (el.headerRewritten && !el.isDirectory &&
+        memcmp(el.oldHeader, el.newHeader, HeaderBytes) != 0) {
+      if (!writeHeaderAt(el.oldCName, el.oldHeader)) {
+        RLOG(WARNING) << "Error restoring header of " << el.oldCName;
+      }
+      el.headerRewritten = false;
+    }
+  }
+}
+
+/*
+ * The list holds the entries of a directory next to each other, so they are
+ * renamed relative to the directory, opened once for all of them.
+ */
 bool RenameOp::apply() {
+  std::shared_ptr<DIR> dir;
+  string dirPath;
   try {
+    if (!rewriteHeaders()) {
+      return false;
+    }
     while (last != renameList->end()) {
       VLOG(1) << "renaming " << last->oldCName << " -> " << last->newCName;
-      struct stat st;
-      bool preserve_mtime = ::stat(last->oldCName.c_str(), &st) == 0;
-
-      dn->renameNode(last->oldPName.c_str(), last->newPName.c_str());
+      size_t dirLen = last->nameOffset - 1;
+      if (!dir || dirPath.size() != dirLen ||
+          last->oldCName.compare(0, dirLen, dirPath) != 0) {
+        dirPath = last->oldCName.substr(0, dirLen);
+        dir.reset(opendir(dirPath.c_str()), DirDeleter());
+        if (!dir) {
+          int eno = errno;
+          RLOG(WARNING) << "Error opening " << dirPath << ": "
+                        << strerror(eno);
+          return false;
+        }
+      }
+      int dirFd = ::dirfd(dir.get());
+      const char* oldName = last->oldCName.c_str() + last->nameOffset;
+      const char* newName = last->newCName.c_str() + last->nameOffset;
+
+      // a rewritten header changed the mtime already
+      struct stat st = last->st;
+      bool preserve_mtime = last->headerRewritten ||
+                            ::fstatat(dirFd, oldName, &st, 0) == 0;
+
+      bool node = needsNode(*last);
+      if (node) {
+        dn->renameNode(last->oldPName.c_str(), last->newPName.c_str());
+      }
 
-      if (::rename(last->oldCName.c_str(), last->newCName.c_str()) == -1) {
+      if (::renameat(dirFd, oldName, dirFd, newName) == -1) {
         int eno = errno;
         RLOG(WARNING) << "Error renaming " << last->oldCName << ": "
                       << strerror(eno);
-        dn->renameNode(last->newPName.c_str(), last->oldPName.c_str(), false);
+        if (node) {
+          dn->renameNode(last->newPName.c_str(), last->oldPName.c_str(),
+                         false);
+        }
         return false;
       }
       if (preserve_mtime) {
-        struct utimbuf ut;
-        ut.actime = st.st_atime;
-        ut.modtime = st.st_mtime;
-        ::utime(last->newCName.c_str(), &ut);
+        struct timespec times[2];
+        times[0].tv_sec = st.st_atime;
+        times[0].tv_nsec = 0;
+        times[1].tv_sec = st.st_mtime;
+        times[1].tv_nsec = 0;
+        ::utimensat(dirFd, newName, times, 0);
       }
       ++last;
     }
@@ -174,6 +721,7 @@ void RenameOp::undo() {
 
   if (last == renameList->begin()) {
     VLOG(1) << "nothing to undo";
+    restoreHeaders();
     return;
   }
 
@@ -186,35 +734,138 @@ void RenameOp::undo() {
 
     ::rename(it->newCName.c_str(), it->oldCName.c_str());
     try {
-      dn->renameNode(it->newPName.c_str(), it->oldPName.c_str(), false);
+      if (needsNode(*it)) {
+        dn->renameNode(it->newPName.c_str(), it->oldPName.c_str(), false);
+      }
     } catch (encfs::Error& err) {
       RLOG(WARNING) << err.what();
     }
     ++undoCount;
   };
   RLOG(WARNING) << "Undo rename count: " << undoCount;
+  restoreHeaders();
 }
 
 DirNode::DirNode(EncFS_Context* _ctx, const string &sourceDir,
     const FSConfigPtr& _config) {
-  pthread_mutext_init(&mutex, nullptr);
-  Lock _lock(mutex);
-  
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+  // a stream of lookups must not keep a rename out for good
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&topology, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  for (pthread_mutex_t& m : pathLocks) {
+    pthread_mutex_init(&m, nullptr);
+  }
+
+  nameChanges = 0;
+
   ctx = _ctx;
   rootDir = sourceDir;
   fsConfig = _config;
   naming  = fsConfig->nameCoding;
+
+  if (fsConfig->config->externalIVChaining && !fsConfig->reverseEncryption &&
+      !(fsConfig->opts && fsConfig->opts->readOnly)) {
+    recoverRenames();
+  }
+}
+
+DirNode::~DirNode() {
+  for (pthread_mutex_t& m : pathLocks) {
+    pthread_mutex_destroy(&m);
+  }
+  pthread_rwlock_destroy(&topology);
+}
+
+pthread_mutex_t& DirNode::pathLock(const char* plaintextPath) {
+  size_t h = std::hash<std::string>()(plaintextPath);
+  return pathLocks[(h ^ (h >> 17)) % PathShards];
+}
+
+/*
+ * A rename cut short leaves files with the header of the name they were
+ * not renamed to.  Every file the journal names gets the header of the
+ * name it is found at; one found at neither name was renamed with its
+ * directory, after the header was written.
+ */
+void DirNode::recoverRenames() {
+  string path = rootDir + RenameJournal;
+  FILE* in = fopen(path.c_str(), "r");
+  if (in == nullptr) {
+    return;
+  }
+  RLOG(WARNING) << "Repairing headers after an interrupted rename";
+
+  int fixed = 0;
+  char* line = nullptr;
+  size_t lineSize = 0;
+  ssize_t len;
+  while ((len = getline(&line, &lineSize, in)) > 0) {
+    vector<string> fields;
+    string text(line, line[len - 1] == '\n' ? len - 1 : len);
+    size_t start = 0;
+    for (size_t tab; (tab = text.find('\t', start)) != string::npos;
+         start = tab + 1) {
+      fields.push_back(text.substr(start, tab - start));
+    }
+    fields.push_back(text.substr(start));
+
+    unsigned char headers[2][HeaderBytes];
+    if (fields.size() != 4 || !fromHex(fields[2], headers[0], HeaderBytes) ||
+        !fromHex(fields[3], headers[1], HeaderBytes)) {
+      RLOG(WARNING) << "Skipping a bad line of " << path;
+      continue;
+    }
+    // the old name wants the old header, the new name the new one
+    for (int which = 0; which < 2; ++which) {
+      string name = rootDir + fields[which];
+      int fd = ::open(name.c_str(), O_RDWR | O_CLOEXEC);
+      if (fd < 0) {
+        continue;
+      }
+      unsigned char header[HeaderBytes];
+      if (::pread(fd, header, HeaderBytes, 0) == HeaderBytes &&
+          memcmp(header, headers[1 - which], HeaderBytes) == 0) {
+        if (::pwrite(fd, headers[which], HeaderBytes, 0) == HeaderBytes &&
+            ::fsync(fd) == 0) {
+          ++fixed;
+        } else {
+          RLOG(ERROR) << "Error repairing header of " << name;
+        }
+      }
+      ::close(fd);
+    }
+  }
+  free(line);
+  fclose(in);
+
+  RLOG(WARNING) << "Repaired " << fixed << " headers";
+  ::unlink(path.c_str());
 }
 
 bool DirNode::hasDirectoryNameDependency() const {
   return naming ? naming->getChainedNameIV() : false;
 }
 
-struct DirNode::rootDirectory() {
+string DirNode::rootDirectory() {
   // intercept string by '/'
   return string(rootDir, 0, rootDir.length()-1);
 }
 
+const FSConfigPtr& DirNode::config() const { return fsConfig; }
+
+string DirNode::encodeName(const char* plaintextName, uint64_t* iv) {
+  return naming->encodePath(plaintextName, iv);
+}
+
+string DirNode::decodeName(const char* cipherName, uint64_t* iv) {
+  return naming->decodePath(cipherName, iv);
+}
+
 bool DirNode::touchesMountpoint(const char* realPath) const {
   const string& mountPoint = fsConfig->opts->mountPoint;
 
@@ -237,14 +888,14 @@ bool DirNode::touchesMountpoint(const char* realPath) const {
  * cipherPath: /foobar encoded to cipher /NKAKsn2APtmquuKPoF4QRPxS
  */
 string DirNode::cipherPath(const char* plaintextPath) {
-  return rootDir + naming->encodePath(plaintextPath);
+  return rootDir + encodePath(plaintextPath);
 }
 
 /*
  * Same as cipherpath(), but doest not prefix the ciphertext root directory
  */
 string DirNode::cipherPathWithoutRoot(const char* plaintextPath) {
-  return naming->encodePath(plaintextPath);
+  return encodePath(plaintextPath);
 }
 
 /**
@@ -271,6 +922,192 @@ string DirNode::plainPath(const char* cipherPath_) {
   }
 }
 
+int DirNode::entryAttr(int dirFd, const char* cipherName,
+                       const char* plaintextPath, struct stat* stbuf) {
+  // an open file may have writes its backing file does not show yet
+  std::shared_ptr<FileNode> node;
+  if (ctx != nullptr) {
+    node = ctx->lookupNode(plaintextPath);
+  }
+  if (node) {
+    return node->getAttr(stbuf);
+  }
+
+  if (::fstatat(dirFd, cipherName, stbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+    return -errno;
+  }
+
+  if (S_ISLNK(stbuf->st_mode)) {
+    // the size is that of the plaintext target
+    string target;
+    int res = readLink(dirFd, cipherName, *stbuf, &target);
+    if (res != 0) {
+      return res;
+    }
+    stbuf->st_size = target.length();
+  } else {
+    if (fsConfig->packStore) {
+      fsConfig->packStore->packedAttr(dirFd, cipherName, stbuf);
+    }
+    if (fsConfig->objectStore) {
+      fsConfig->objectStore->objectAttr(dirFd, cipherName, stbuf);
+    }
+    if (fsConfig->writeJournal) {
+      fsConfig->writeJournal->pendingAttr(stbuf);
+    }
+    FileNode::plainAttr(fsConfig, stbuf);
+  }
+  return 0;
+}
+
+// the directory holding plaintextPath, "/" for names in the root
+static string parentPath(const char* plaintextPath) {
+  string dir = parentDirectory(plaintextPath);
+  return dir.empty() ? string("/") : dir;
+}
+
+int DirNode::closedAttr(const char* plaintextPath, struct stat* stbuf) {
+  const std::shared_ptr<AttrCache>& cache = fsConfig->attrCache;
+  uint64_t generation = 0;
+  if (cache && cache->get(plaintextPath, stbuf, &generation)) {
+    return 0;
+  }
+
+  int res;
+  if (indexedAttr(plaintextPath, stbuf, &res)) {
+    if (res == 0 && cache) {
+      cache->add(plaintextPath, *stbuf, generation);
+    }
+    return res;
+  }
+
+  string cyName = rootDir + encodePath(plaintextPath);
+  if (touchesMountpoint(cyName.c_str())) {
+    VLOG(1) << "getattr error: Tried to touch mountpoint: '" << cyName << "'";
+    return -EIO;
+  }
+
+  DirFdCache::Ref at = DirFdCache::at(fsConfig->dirFdCache, cyName.c_str());
+  res = entryAttr(at.fd(), at.name(), plaintextPath, stbuf);
+  if (res == 0 && cache) {
+    cache->add(plaintextPath, *stbuf, generation);
+  }
+  return res;
+}
+
+bool DirNode::indexedAttr(const char* plaintextPath, struct stat* stbuf,
+                          int* res) {
+  const std::shared_ptr<DirIndex>& index = fsConfig->dirIndex;
+  const char* name = strrchr(plaintextPath, '/');
+  if (!index || name == nullptr || name[1] == '\0') {
+    return false;
+  }
+  ++name;
+  // an open file answers for itself
+  if (ctx != nullptr && ctx->lookupNode(plaintextPath)) {
+    return false;
+  }
+
+  string cyDir = rootDir + encodePath(parentPath(plaintextPath).c_str());
+  DirIndex::Entry entry;
+  uint64_t generation = 0;
+  switch (index->lookup(cyDir, name, &entry, &generation)) {
+    case DirIndex::Unknown:
+      return false;
+    case DirIndex::Missing:
+      *res = -ENOENT;
+      return true;
+    case DirIndex::Found:
+      break;
+  }
+  if (entry.haveAttr) {
+    *stbuf = entry.attr;
+    *res = 0;
+    return true;
+  }
+
+  // the name is known, only its attributes are to be had
+  string cyName = cyDir;
+  if (cyName.empty() || cyName[cyName.length() - 1] != '/') {
+    cyName += '/';
+  }
+  cyName += entry.cipherName;
+  if (touchesMountpoint(cyName.c_str())) {
+    *res = -EIO;
+    return true;
+  }
+  DirFdCache::Ref at = DirFdCache::at(fsConfig->dirFdCache, cyName.c_str());
+  *res = entryAttr(at.fd(), at.name(), plaintextPath, stbuf);
+  if (*res == 0) {
+    index->setAttr(cyDir, name, *stbuf, generation);
+  }
+  return true;
+}
+
+void DirNode::cacheAttr(int dirFd, const char* cipherName,
+                        const char* plaintextPath) {
+  const std::shared_ptr<AttrCache>& cache = fsConfig->attrCache;
+  if (!cache) {
+    return;
+  }
+  struct stat st;
+  uint64_t generation = 0;
+  if (cache->get(plaintextPath, &st, &generation)) {
+    return;
+  }
+  // open files answer getattr themselves
+  if (ctx != nullptr && ctx->lookupNode(plaintextPath)) {
+    return;
+  }
+  string cyName = rootDir + encodePath(plaintextPath);
+  if (touchesMountpoint(cyName.c_str())) {
+    return;
+  }
+
+  if (entryAttr(dirFd, cipherName, plaintextPath, &st) == 0) {
+    cache->add(plaintextPath, st, generation);
+  }
+}
+
+void DirNode::forgetAttr(const char* plaintextPath) {
+  if (fsConfig->attrCache) {
+    fsConfig->attrCache->erase(plaintextPath);
+  }
+  const char* name = strrchr(plaintextPath, '/');
+  if (fsConfig->dirIndex && name != nullptr && name[1] != '\0') {
+    fsConfig->dirIndex->dropAttr(
+        rootDir + encodePath(parentPath(plaintextPath).c_str()), name + 1);
+  }
+  // chmod changes ACLs, and creating a name replaces what had it
+  if (fsConfig->xattrCache) {
+    fsConfig->xattrCache->erase(plaintextPath);
+  }
+}
+
+int DirNode::readLink(int dirFd, const char* cipherName,
+                      const struct stat& stbuf, string* target) {
+  const std::shared_ptr<LinkCache>& cache = fsConfig->linkCache;
+  if (cache && cache->get(stbuf, target)) {
+    return 0;
+  }
+
+  std::vector<char> buf(stbuf.st_size + 1, '\0');
+  ssize_t len = ::readlinkat(dirFd, cipherName, buf.data(), stbuf.st_size);
+  if (len < 0) {
+    return -errno;
+  }
+  // other functions expect c-strings to be null-terminated, which readlink
+  // doesn't provide
+  buf[len] = '\0';
+
+  *target = plainPath(buf.data());
+  // a link changed between the lstat and the readlink is not recorded
+  if (cache && !target->empty() && len == stbuf.st_size) {
+    cache->put(stbuf, *target);
+  }
+  return 0;
+}
+
 string DirNode::relativeCipherPath(const char* plaintextPath) {
   try {
     char mark = fsConfig->reverseEncryption ? '+' : '/';
@@ -278,7 +1115,7 @@ string DirNode::relativeCipherPath(const char* plaintextPath) {
       return string(fsConfig->reverseEncryption ? "/" : "+") + 
         naming->encodeName(plaintextPath + 1, strlen(plaintextPath + 1));
     }
-    return naming->encodePath(plaintextPath);
+    return encodePath(plaintextPath);
   } catch (encfs::Error& err) {
     RLOG(ERROR) << "encode err: " << err.what();
     return string();
@@ -286,7 +1123,9 @@ string DirNode::relativeCipherPath(const char* plaintextPath) {
 }
 
 DirTraverse DirNode::openDir(const char* plaintextPath) {
-  string cyName = rootDir + naming->encodePath(plaintextPath);
+  // the IV the names in the directory are chained to
+  uint64_t iv = 0;
+  string cyName = rootDir + encodePath(plaintextPath, &iv);
 
   DIR* dir = ::opendir(cyName.c_str());
   if (dir == nullptr) {
@@ -296,102 +1135,217 @@ DirTraverse DirNode::openDir(const char* plaintextPath) {
   }
   std::shared_ptr<DIR> dp(dir, DirDeleter());
 
-  uint64_t iv = 0;
-
-  try {
-    if (naming->getchainedNameIV()) {
-      naming->encodePath(plaintextPath, &iv);
-    }
-  } catch (encfs::Error& err) {
-    RLOG(ERROR) << "encode err: " << err.what();
-  }
-  return DirTraverse(dp, iv, naming, (strlen(plaintextPath) == 1));
+  return DirTraverse(dp, iv, naming, (strlen(plaintextPath) == 1),
+                     fsConfig->cryptoPool);
 }
 
-bool DirNode::genRenameList(list<RenameEl>& renameList, const char8 fromP,
+namespace {
+// a directory whose entries a recursive rename gives new names
+struct RenameDir {
+  string fromP;
+  string toP;
+  string sourcePath;  // with the names from before the rename
+  uint64_t fromIV;
+  uint64_t toIV;
+};
+
+// an entry of a RenameDir, as read and then coded
+struct RenameName {
+  size_t dir;
+  string cipherName;
+  int fileType;
+  string plainName;
+  string newCName;
+  uint64_t fromIV;  // after the name, for the entries below it
+  uint64_t toIV;
+  bool decoded;
+  bool encoded;
+};
+}  // namespace
+
+/*
+ * Reads the directories one level below the renamed one at a time, the
+ * directories of a level in parallel, and re-encodes all names of the level
+ * on the pool.
+ *
+ * Entries are listed deepest level first, the entries of a directory next
+ * to each other, so a directory is renamed after everything in it and its
+ * path stays valid until then.
+ */
+bool DirNode::genRenameList(list<RenameEl>& renameList, const char* fromP,
     const char* toP) {
   uint64_t fromIV = 0, toIV = 0;
 
-  string fromCPart = naming->encodePath(fromP, &fromIV);
-  string toCPart = naming->encodePath(toP, &toIV);
-
-  string sourcePath = rootDir + fromCPart;
+  string fromCPart = encodePath(fromP, &fromIV);
+  encodePath(toP, &toIV);
 
   // ok ... we wish it was so simple.. should almost never happen;
   if (fromIV == toIV) {
     return true;
   }
 
-  // generate the realdestination path, where we except to find the files..
-  VLOG(1) << "opendir " << sourcePath;
-  std::shared_ptr<DIR> dir =
-    std::shared_ptr<DIR> (opendir(sourcePath.c_str()), DirDeleter());
-  if (!dir) {
-    return false;
-  }
-
-  struct dirent * de = nullptr;
-  while ((de = ::readdir(dir.get())) != nullptr) {
-    uint64_t localIV = fromIV;
-    string plainName;
-
-    if ((de->d_name[0] == '.') &&
-        ((de->d_name[1] == '\0') ||
-         ((de->d_name[1] == '.') && (de->d_name[2] == '\0')))) {
-      continue;
+  std::shared_ptr<ThreadPool> pool = fsConfig->cryptoPool;
+
+  vector<RenameDir> level;
+  level.push_back(RenameDir{fromP, toP, rootDir + fromCPart, fromIV, toIV});
+  vector<list<RenameEl>> levels;
+
+  while (!level.empty()) {
+    // read the names of every directory of the level
+    vector<vector<RenameName>> dirNames(level.size());
+    auto readDir = [&](int d) {
+      const RenameDir& rd = level[d];
+      VLOG(1) << "opendir " << rd.sourcePath;
+      std::shared_ptr<DIR> dir =
+        std::shared_ptr<DIR> (opendir(rd.sourcePath.c_str()), DirDeleter());
+      if (!dir) {
+        return false;
+      }
+      struct dirent* de = nullptr;
+      int fileType = 0;
+      while (_nextName(de, dir, &fileType, (ino_t*)nullptr)) {
+        if ((de->d_name[0] == '.') &&
+            ((de->d_name[1] == '\0') ||
+             ((de->d_name[1] == '.') && (de->d_name[2] == '\0')))) {
+          continue;
+        }
+        RenameName name;
+        name.dir = d;
+        name.cipherName = de->d_name;
+        name.fileType = fileType;
+        name.decoded = false;
+        name.encoded = false;
+        dirNames[d].push_back(std::move(name));
+      }
+      return true;
+    };
+    bool readOk = true;
+    if (pool && level.size() > 1) {
+      readOk = pool->forEach((int)level.size(), readDir);
+    } else {
+      for (size_t d = 0; d < level.size() && readOk; ++d) {
+        readOk = readDir((int)d);
+      }
     }
-
-    try {
-      plainName = naming->decodePath(de->d_name, &localIV);
-    } catch(encfs::Error& ex) {
-      continue;
+    if (!readOk) {
+      return false;
     }
 
-    try {
-      localIV = toIV;
-      string newName = naming->encodePath(plainName.c_str(), &localIV);
+    vector<RenameName> names;
+    for (vector<RenameName>& dirList : dirNames) {
+      std::move(dirList.begin(), dirList.end(), std::back_inserter(names));
+    }
+    dirNames.clear();
+
+    // and give them their new names
+    auto code = [&](int first, int last) {
+      vector<NameIO::NameRequest> reqs(last - first);
+      for (int i = first; i < last; ++i) {
+        reqs[i - first].name = names[i].cipherName;
+        reqs[i - first].iv = level[names[i].dir].fromIV;
+      }
+      naming->decodeNames(reqs.data(), (int)reqs.size());
+      for (int i = first; i < last; ++i) {
+        NameIO::NameRequest& req = reqs[i - first];
+        RenameName& name = names[i];
+        // a name that does not decode is left where it is
+        name.decoded = req.ok;
+        if (req.ok) {
+          name.fromIV = req.iv;
+          name.plainName = req.coded;
+          req.name = req.coded;
+          req.iv = level[name.dir].toIV;
+        } else {
+          req.name.clear();
+        }
+      }
+      naming->encodeNames(reqs.data(), (int)reqs.size());
+      for (int i = first; i < last; ++i) {
+        NameIO::NameRequest& req = reqs[i - first];
+        RenameName& name = names[i];
+        if (!name.decoded) {
+          continue;
+        }
+        if (!req.ok) {
+          RLOG(WARNING) << "Aborting rename: error on file: "
+                        << level[name.dir].sourcePath << '/'
+                        << name.cipherName;
+          return false;
+        }
+        name.toIV = req.iv;
+        name.newCName = req.coded;
+        name.encoded = true;
+      }
+      return true;
+    };
+    int count = (int)names.size();
+    int slices = pool ? count / MinParallelNames : 0;
+    if (pool && slices > pool->threads() + 1) {
+      slices = pool->threads() + 1;
+    }
+    bool codeOk;
+    if (slices < 2) {
+      codeOk = code(0, count);
+    } else {
+      codeOk = pool->forEach(slices, [&](int slice) {
+        return code(count * slice / slices, count * (slice + 1) / slices);
+      });
+    }
+    if (!codeOk) {
+      return false;
+    }
 
-      string oldFull = sourcePath + '/' + de->d_name;
-      string newFull = sourcePath + '/' + newName;
+    list<RenameEl> renames;
+    vector<RenameDir> next;
+    for (RenameName& name : names) {
+      if (!name.decoded) {
+        continue;
+      }
+      const RenameDir& rd = level[name.dir];
 
       RenameEl ren;
-      ren.oldCName = oldFull;
-      ren.newCNmae = newFull;
-      ren.oldPName = string(fromP) + '/' + plainName;
-      ren.newPName = string(toP) + '/' + plainName;
+      ren.oldCName = rd.sourcePath + '/' + name.cipherName;
+      ren.newCName = rd.sourcePath + '/' + name.newCName;
+      ren.nameOffset = rd.sourcePath.size() + 1;
+      ren.oldPName = rd.fromP + '/' + name.plainName;
+      ren.newPName = rd.toP + '/' + name.plainName;
 
       bool isDir;
 #if defined(HAVE_DIRENT_D_TYPE)
-      if (de->d_type != DT_UNKNOWN) {
-        isDir = (de->d_type == DT_DIR);
+      if (name.fileType != DT_UNKNOWN) {
+        isDir = (name.fileType == DT_DIR);
       } else 
 #endif
       {
-        isDir = isDirectory(oldFull.c_str());
+        isDir = isDirectory(ren.oldCName.c_str());
       }
       ren.isDirectory = isDir;
-
-      if (isDir) {
-        if (genRenameList (renameList, ren.oldPName.c_str(),
-              ren.newPName.c_str())) {
-          return false;
-        }
+      ren.fromIV = name.fromIV;
+      ren.toIV = name.toIV;
+      ren.headerRewritten = false;
+      memset(&ren.st, 0, sizeof(ren.st));
+
+      if (isDir && name.fromIV != name.toIV) {
+        next.push_back(RenameDir{ren.oldPName, ren.newPName, ren.oldCName,
+                                 name.fromIV, name.toIV});
       }
 
-      VLOG(1)  << "adding file " << oldFull << "to rename list " ;
-      renameList.push_back(ren);
-    } catch (encfs::Error& err) {
-      RLOG(WARNING) << "Aborting rename: error on file: "
-                    << fromCPart.append(1, '/').append(de->d_name);
-      RLOG(WARNING) << err.what();
-
-      return false;
+      VLOG(1)  << "adding file " << ren.oldCName << " to rename list";
+      name.plainName.assign(name.plainName.size(), ' ');
+      renames.push_back(std::move(ren));
     }
+
+    levels.push_back(std::move(renames));
+    level.swap(next);
+  }
+
+  for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+    renameList.splice(renameList.end(), *it);
   }
   return true;
 }
 
-std::shared_ptr<RenameOp> DirNode::newRenameOp(const char* fromP
+std::shared_ptr<RenameOp> DirNode::newRenameOp(const char* fromP,
     const char* toP) {
   std::shared_ptr<list<RenameEl> > renameList(new list<RenameEl>);
   if (!genRenameList(*renameList.get(), fromP, toP)) {
@@ -401,71 +1355,92 @@ std::shared_ptr<RenameOp> DirNode::newRenameOp(const char* fromP
   return std::make_shared<RenameOp>(this, renameList);
 }
 
-int DirNode::mkdir(const char* plaintextPath, mode_t mode, uid_t uid) {
-  string cyName = rootDir + naming->encodePath(plaintextPath);
+int DirNode::mkdir(const char* plaintextPath, mode_t mode, uid_t uid,
+                   gid_t gid) {
+  string cyName = rootDir + encodePath(plaintextPath);
   rAssert(!cyName.empty());
 
   VLOG(1) << "mkdir on " << cyName;
 
-  int olduid = -1;
-  int oldgid = -1;
-  if (gid != 0) {
-    oldgid = setfsgid(gid);
-    if (oldgid = -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsgid error: " << strerror(eno);
-      return -EPERM;
-    }
-  }
-  if (uid != 0) {
-    olduid = setfsuid(uid);
-    if (olduid = -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsuid error: " << strerror(eno);
-      return -EPERM;
-    }
+  AsCaller caller(uid, gid, mode | S_IFDIR,
+                  fsConfig->opts->defaultPermissions);
+  if (!caller.ok()) {
+    return -EPERM;
   }
 
-  int res = ::mkdir(cyName.c_str(), mode);
+  DirFdCache::Ref at =
+      !caller.switched()
+          ? DirFdCache::at(fsConfig->dirFdCache, cyName.c_str())
+          : DirFdCache::Ref(AT_FDCWD, cyName.c_str());
+  DirIndex::Change indexChange;
+  beginNameChange(plaintextPath, &indexChange);
+  int res = ::mkdirat(at.fd(), at.name(), mode);
 
   if (res == -1) {
     int eno = errno;
     RLOG(WARNING) << "mkdir error on " << cyName << " mode " << mode << ": "
                   << strerror(eno);
-    res = -eno;
+    return -eno;
   }
-
-  if (olduid >= 0) {
-    if (setfsuid(olduid) == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsuid back error: " << strerror(eno);
-    }
-  }
-  if (oldgid >= 0) {
-    if (setfsgid(oldgid) == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsgid back error: " << strerror(eno);
-    }
+  res = caller.own(at.fd(), at.name(), -1);
+  if (res == 0) {
+    nameCreated(plaintextPath);
   }
   return res;
 }
 
 int DirNode::rename(const char* fromPlaintext, const char* toPlaintext) {
-  Lock _lock(mutext);
+  ENCFS_PROBE2(rename_entry, fromPlaintext, toPlaintext);
+  ProbeClock clock(ENCFS_PROBE_ENABLED(rename_return));
+
+  // --interactive: the names below a directory are listed, and coded
+  // anew, while lookups and opens go on, and listed again if a name came
+  // or went before the tree is ours.  mkdir and the like take no lock, so
+  // they could slip into a rename as it was applied as well.
+  std::shared_ptr<RenameOp> listed;
+  uint64_t listedAt = 0;
+  if (fsConfig->opts && fsConfig->opts->interactive &&
+      hasDirectoryNameDependency()) {
+    ReadLock _topology(topology);
+    string fromCName = rootDir + encodePath(fromPlaintext);
+    if (isDirectory(fromCName.c_str())) {
+      listedAt = nameChanges;
+      listed = newRenameOp(fromPlaintext, toPlaintext);
+    }
+  }
+
+  WriteLock _lock(topology);
 
-  string fromCName = rootDir + naming->encodePath(fromPlaintext);
-  string toCName = rootDir + naming->encodePath(toPlaintext);
+  string fromCName = rootDir + encodePath(fromPlaintext);
+  string toCName = rootDir + encodePath(toPlaintext);
   rAssert(!fromCName.empty());
   rAssert(!toCName.empty());
 
   VLOG(1) << "rename " << fromCName << " -> " << toCName;
 
+  // the journal must not be left naming a path the rename takes away
+  if (fsConfig->writeJournal) {
+    int res = fsConfig->writeJournal->settleBelow(fromCName);
+    if (res == 0) {
+      res = fsConfig->writeJournal->settleBelow(toCName);
+    }
+    if (res < 0) {
+      ENCFS_PROBE4(rename_return, fromPlaintext, toPlaintext, res,
+                   clock.elapsed());
+      return res;
+    }
+  }
+
   std::shared_ptr<FileNode> toNode = findOrCreate(toPlaintext);
 
   std::shared_ptr<RenameOp> renameOp;
   if (hasDirectoryNameDependency() && isDirectory(fromCName.c_str())) {
     VLOG(1) << "recursive rename begin";
-    renamop = newRenameOp(fromPlaintext, toPlaintext);
+    if (listed && nameChanges == listedAt) {
+      renameOp = listed;
+    } else {
+      renameOp = newRenameOp(fromPlaintext, toPlaintext);
+    }
 
     if (!renameOp || !renameOp->apply()) {
       if (renameOp) {
@@ -473,14 +1448,35 @@ int DirNode::rename(const char* fromPlaintext, const char* toPlaintext) {
       }
 
       RLOG(WARNING) << "rename aborted";
+      ENCFS_PROBE4(rename_return, fromPlaintext, toPlaintext, -EACCES,
+                   clock.elapsed());
       return -EACCES;
     }
     VLOG(1) << "recursive rename end";
   }
+  DirIndex::Change fromChange, toChange;
+  beginNameChange(fromPlaintext, &fromChange);
+  beginNameChange(toPlaintext, &toChange);
   int res = 0;
   try {
     struct stat st;
     bool preserve_mtime = ::stat(fromCName.c_str(), &st) == 0;
+    // a file renamed over goes away, and its kept descriptor with it
+    struct stat replaced;
+    bool replacing = (fsConfig->fdCache || fsConfig->packStore ||
+                      fsConfig->objectStore) &&
+                     ::lstat(toCName.c_str(), &replaced) == 0;
+    // and with it, the data packed or stored for it
+    uint64_t replacedData =
+        replacing && fsConfig->packStore
+            ? fsConfig->packStore->lastLinkData(toCName.c_str(), replaced)
+            : 0;
+    off_t replacedSize = 0;
+    uint64_t replacedObject =
+        replacing && fsConfig->objectStore
+            ? fsConfig->objectStore->lastLinkData(toCName.c_str(), replaced,
+                                                  &replacedSize)
+            : 0;
 
     renameNode(fromPlaintext, toPlaintext);
     res = ::rename(fromCName.c_str(), toCName.c_str());
@@ -499,6 +1495,34 @@ int DirNode::rename(const char* fromPlaintext, const char* toPlaintext) {
         ctx->eraseNode(toPlaintext, toNode);
       }
 #endif
+      if (replacing && fsConfig->fdCache) {
+        fsConfig->fdCache->erase(replaced);
+      }
+      if (fsConfig->dirFdCache) {
+        // a renamed directory, and one it replaced
+        fsConfig->dirFdCache->eraseBelow(fromCName);
+        fsConfig->dirFdCache->eraseBelow(toCName);
+      }
+      if (fsConfig->dirIndex) {
+        // and their indexes, which a name IV chain leaves stale
+        fsConfig->dirIndex->forgetBelow(fromCName);
+        fsConfig->dirIndex->forgetBelow(toCName);
+      }
+      if (replacedData != 0) {
+        fsConfig->packStore->erase(replacedData);
+      }
+      if (replacedObject != 0) {
+        fsConfig->objectStore->erase(replacedObject, replacedSize);
+      }
+      if (ctx != nullptr) {
+        ctx->forgetReleased(fromPlaintext);
+        ctx->forgetReleased(toPlaintext);
+        // files below a renamed directory keep the names and IVs of
+        // their old paths
+        if (renameOp) {
+          ctx->forgetAllReleased();
+        }
+      }
       if (preserve_mtime) {
         struct utimbuf ut;
         ut.actime = st.st_atime;
@@ -513,15 +1537,27 @@ int DirNode::rename(const char* fromPlaintext, const char* toPlaintext) {
 
   if (res != 0) {
     VLOG(1) << "rename failed: " << strerror(-res);
+  } else {
+    forgetPath(fromPlaintext);
+    forgetPath(toPlaintext);
+    // names below the old one may exist under the new one now
+    nameCreated(toPlaintext);
+    if (fsConfig->negativeCache) {
+      fsConfig->negativeCache->eraseBelow(toPlaintext);
+    }
   }
+  ENCFS_PROBE4(rename_return, fromPlaintext, toPlaintext, res,
+               clock.elapsed());
   return res;
 }
 
 int DirNode::link(const char* to, const char* from) {
-  Lock _lock(mutex);
+  // the new name is locked, the old one stays as it is
+  ReadLock _topology(topology);
+  Lock _lock(pathLock(from), ENCFS_LOCK_SITE("DirNode::link"));
 
-  string toCName = rootDir + naming->encodePath(to);
-  string fromCName = rootDir + naming->encodePaht(from);
+  string toCName = rootDir + encodePath(to);
+  string fromCName = rootDir + encodePath(from);
 
   rAssert(!toCName.empty());
   rAssert(!fromCName.empty());
@@ -532,11 +1568,21 @@ int DirNode::link(const char* to, const char* from) {
   if (fsConfig->config->externalIVChaining) {
     VLOG(1) << "hard links not supported with external IV chaining!";
   } else {
+    DirIndex::Change indexChange;
+    beginNameChange(from, &indexChange);
     res = ::link(toCName.c_str(), fromCName.c_str());
     if (res == -1) {
       res = -errno;
     } else {
+      nameCreated(from);
       res = 0;
+      // an open node of the file is shared with the new name from now on
+      std::shared_ptr<FileNode> node =
+          ctx != nullptr ? ctx->lookupNode(to) : nullptr;
+      struct stat st;
+      if (node && node->getAttr(&st) == 0) {
+        ctx->nodeLinked(to, st.st_dev, st.st_ino);
+      }
     }
   }
   return res;
@@ -552,7 +1598,7 @@ std::shared_ptr<FileNode> DirNode::renameNode(const char* from, const char* to,
   std::shared_ptr<FileNode> node = findOrCreate(from);
   if (node) {
     uint64_t newIV = 0;
-    string cname = rootDir + naming->encodePath(to, &newIV);
+    string cname = rootDir + encodePath(to, &newIV);
     VLOG(1) << "renaming internal node " << node->cipherName() << " -> "
             << cname;
     if (node->setName(to, cname.c_str(), newIV, forwardMode)) {
@@ -572,9 +1618,17 @@ std::shared_ptr<FileNode> DirNode::findOrCreate(const char* plainName) {
 
   if (ctx != nullptr) {
     node = ctx->lookupNode(plainName);
+    // before a kept node, which would not see what the shared one holds
+    // back
+    if (!node && ctx->haveLinkedOpen()) {
+      node = linkedNode(plainName);
+    }
+    if (!node) {
+      node = ctx->reuseNode(plainName);
+    }
     if (!node) {
       uint64_t iv = 0;
-      string cipherName = naming->encodePath(plainName, &iv);
+      string cipherName = encodePath(plainName, &iv);
       uint64_t fuseFh = ctx->nextFuseFh();
       node.reset(new FileNode(this, fsConfig, plainName, 
                  (rootDir + cipherName).c_str(), fuseFh));
@@ -588,22 +1642,73 @@ std::shared_ptr<FileNode> DirNode::findOrCreate(const char* plainName) {
   return node;
 }
 
+std::shared_ptr<FileNode> DirNode::linkedNode(const char* plainName) {
+  if (fsConfig->config->externalIVChaining) {
+    return std::shared_ptr<FileNode>();
+  }
+  string cname = rootDir + encodePath(plainName);
+  DirFdCache::Ref at = DirFdCache::at(fsConfig->dirFdCache, cname.c_str());
+  struct stat st;
+  if (::fstatat(at.fd(), at.name(), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+      !S_ISREG(st.st_mode) || st.st_nlink < 2) {
+    return std::shared_ptr<FileNode>();
+  }
+  std::shared_ptr<FileNode> node = ctx->lookupInode(st.st_dev, st.st_ino);
+  if (node) {
+    VLOG(1) << "sharing node of " << node->cipherName() << " for " << cname;
+    ctx->forgetReleased(plainName);
+  }
+  return node;
+}
+
 shared_ptr<FileNode> DirNode::lookupNode(const char* plainName,
     const char* ) {
-  Lock _lock(mutex);
+  ReadLock _topology(topology);
+  Lock _lock(pathLock(plainName), ENCFS_LOCK_SITE("DirNode::lookupNode"));
   return findOrCreate(plainName);
 }
 
-std::shared_ptr<FileName> DirNode::openNode(const char* plainName,
+std::shared_ptr<FileNode> DirNode::openNode(const char* plainName,
                                             const char* requestor, int flags,
                                             int* result) {
   (void) requestor;
   rAssert(result != nullptr);
-  Lock _lock(mutext);
+  ReadLock _topology(topology);
+  Lock _lock(pathLock(plainName), ENCFS_LOCK_SITE("DirNode::openNode"));
+
+  std::shared_ptr<FileNode> node = findOrCreate(plainName);
+
+  if (!node || (*result = node->open(flags)) < 0) {
+    return std::shared_ptr<FileNode>();
+  }
+
+  // the first name of a hard linked file opened, unless another one was
+  // opened since findOrCreate looked
+  struct stat st;
+  if (ctx != nullptr && !fsConfig->config->externalIVChaining &&
+      !node->linked(nullptr, nullptr) && node->getAttr(&st) == 0 &&
+      st.st_nlink > 1) {
+    std::shared_ptr<FileNode> shared = ctx->lookupInode(st.st_dev, st.st_ino);
+    if (shared && shared != node) {
+      *result = shared->open(flags);
+      return *result >= 0 ? shared : std::shared_ptr<FileNode>();
+    }
+    node->setLinked(st.st_dev, st.st_ino);
+  }
+  return node;
+}
+
+std::shared_ptr<FileNode> DirNode::createNode(const char* plainName, int flags,
+                                              mode_t mode, uid_t uid,
+                                              gid_t gid, int* result) {
+  rAssert(result != nullptr);
+  ReadLock _topology(topology);
+  Lock _lock(pathLock(plainName), ENCFS_LOCK_SITE("DirNode::createNode"));
 
   std::shared_ptr<FileNode> node = findOrCreate(plainName);
 
-  if (node && (*result = node->open(flags)) >= 0) {
+  if (node && (*result = node->create(flags, mode, uid, gid)) >= 0) {
+    ++nameChanges;
     return node;
   }
 
@@ -611,10 +1716,11 @@ std::shared_ptr<FileName> DirNode::openNode(const char* plainName,
 }
 
 int DirNode::unlink(const char* plaintextName) {
-  string cyName = naming->encodePath(plaintextname);
+  string cyName = encodePath(plaintextName);
   VLOG(1) << "unlink " << cyName;
 
-  Lock _lock(mutex);
+  ReadLock _topology(topology);
+  Lock _lock(pathLock(plaintextName), ENCFS_LOCK_SITE("DirNode::unlink"));
 
 #ifndef __CYGWIN__
   if ((ctx != nullptr) && ctx->lookupNode(plaintextName) ) {
@@ -623,13 +1729,196 @@ int DirNode::unlink(const char* plaintextName) {
                   << "is probably in effect";
     return -EBUSY;
   }
+#endif
 
   int res = 0;
   string fullName = rootDir + cyName;
-  res = ::unlink(fullName.c_str());
-  if (res == -1) {
-    res = -errno;
-    VLOG(1) << "unlink error" << sterror(-res);
+  if (fsConfig->writeJournal) {
+    res = fsConfig->writeJournal->settleBelow(fullName);
+    if (res < 0) {
+      return res;
+    }
+  }
+  DirFdCache::Ref at = DirFdCache::at(fsConfig->dirFdCache, fullName.c_str());
+  struct stat stbuf;
+  bool known = (fsConfig->fdCache || fsConfig->packStore ||
+                fsConfig->objectStore || fsConfig->reclaimer) &&
+               ::fstatat(at.fd(), at.name(), &stbuf, AT_SYMLINK_NOFOLLOW) == 0;
+  uint64_t packedData =
+      known && fsConfig->packStore
+          ? fsConfig->packStore->lastLinkData(fullName.c_str(), stbuf)
+          : 0;
+  off_t objectSize = 0;
+  uint64_t objectData =
+      known && fsConfig->objectStore
+          ? fsConfig->objectStore->lastLinkData(fullName.c_str(), stbuf,
+                                                &objectSize)
+          : 0;
+  DirIndex::Change indexChange;
+  beginNameChange(plaintextName, &indexChange);
+  // a large file goes to the trash, and its space is freed later
+  res = -EAGAIN;
+  if (known && fsConfig->reclaimer) {
+    res = fsConfig->reclaimer->defer(at.fd(), at.name(), stbuf);
+  }
+  if (res == -EAGAIN) {
+    res = ::unlinkat(at.fd(), at.name(), 0) == 0 ? 0 : -errno;
+  }
+  if (res < 0) {
+    VLOG(1) << "unlink error" << strerror(-res);
+  } else {
+    forgetPath(plaintextName);
+    // a kept node or descriptor would keep its space
+    if (ctx != nullptr) {
+      ctx->forgetReleased(plaintextName);
+    }
+    if (known && fsConfig->fdCache) {
+      fsConfig->fdCache->erase(stbuf);
+    }
+    if (packedData != 0) {
+      fsConfig->packStore->erase(packedData);
+    }
+    if (objectData != 0) {
+      fsConfig->objectStore->erase(objectData, objectSize);
+    }
   }
   return res;
 }
+
+void DirNode::forgetPath(const char* plaintextPath) {
+  ++nameChanges;
+  indexName(plaintextPath, false);
+  if (fsConfig->dirFdCache) {
+    // a removed directory, or one a new one may be made at
+    fsConfig->dirFdCache->eraseBelow(rootDir + encodePath(plaintextPath));
+  }
+  if (fsConfig->pathCache) {
+    fsConfig->pathCache->erase(plaintextPath);
+  }
+  if (fsConfig->attrCache) {
+    fsConfig->attrCache->eraseBelow(plaintextPath);
+    fsConfig->attrCache->erase(parentPath(plaintextPath).c_str());
+  }
+  if (fsConfig->xattrCache) {
+    fsConfig->xattrCache->eraseBelow(plaintextPath);
+  }
+}
+
+void DirNode::indexName(const char* plaintextPath, bool created) {
+  const std::shared_ptr<DirIndex>& index = fsConfig->dirIndex;
+  const char* name = strrchr(plaintextPath, '/');
+  if (!index || name == nullptr || name[1] == '\0') {
+    return;
+  }
+  string cyDir = rootDir + encodePath(parentPath(plaintextPath).c_str());
+  if (!created) {
+    index->removed(cyDir, name + 1);
+    return;
+  }
+  uint64_t iv = 0;
+  string cyName = encodePath(plaintextPath, &iv);
+  size_t slash = cyName.rfind('/');
+  index->added(cyDir, name + 1,
+               slash == string::npos ? cyName : cyName.substr(slash + 1), iv);
+}
+
+void DirNode::beginNameChange(const char* plaintextPath,
+                              DirIndex::Change* change) {
+  const char* name = strrchr(plaintextPath, '/');
+  if (!fsConfig->dirIndex || name == nullptr || name[1] == '\0') {
+    return;
+  }
+  change->begin(fsConfig->dirIndex.get(),
+                rootDir + encodePath(parentPath(plaintextPath).c_str()));
+}
+
+bool DirNode::knownMissing(const char* plaintextPath, uint64_t* generation) {
+  *generation = 0;
+  return fsConfig->negativeCache &&
+         fsConfig->negativeCache->missing(plaintextPath, generation);
+}
+
+void DirNode::noteMissing(const char* plaintextPath, uint64_t generation) {
+  if (fsConfig->negativeCache) {
+    fsConfig->negativeCache->add(plaintextPath, generation);
+  }
+}
+
+void DirNode::nameCreated(const char* plaintextPath) {
+  ++nameChanges;
+  indexName(plaintextPath, true);
+  if (fsConfig->negativeCache) {
+    fsConfig->negativeCache->invalidateDir(parentDirectory(plaintextPath));
+  }
+  // whatever had the name before, and its parent's times and link count
+  forgetAttr(plaintextPath);
+  forgetAttr(parentPath(plaintextPath).c_str());
+}
+
+void DirNode::nameListed(const char* dirPath, const char* name,
+                         const string& cipherName, uint64_t iv) {
+  const std::shared_ptr<PathCache>& cache = fsConfig->pathCache;
+  if (!cache || !fsConfig->reverseEncryption || fsConfig->plainNames) {
+    return;
+  }
+  string plainPath = dirPath;
+  if (plainPath.empty() || plainPath[plainPath.length() - 1] != '/') {
+    plainPath += '/';
+  }
+  bool top = plainPath.length() == 1;
+  plainPath += name;
+  // the directory was just encoded to be listed, and is cached
+  string cyName = top ? string() : encodePath(dirPath);
+  if (!cyName.empty()) {
+    cyName += '/';
+  }
+  cyName += cipherName;
+  cache->put(plainPath, cyName, iv);
+}
+
+string DirNode::encodePath(const char* plaintextPath, uint64_t* iv) {
+  if (fsConfig->plainNames) {
+    // stored as is, less the leading '/' a coded path goes without
+    while (*plaintextPath == '/') {
+      ++plaintextPath;
+    }
+    if (iv != nullptr) {
+      *iv = 0;
+    }
+    return string(plaintextPath);
+  }
+
+  const std::shared_ptr<PathCache>& cache = fsConfig->pathCache;
+  uint64_t chainIV = 0;
+  string cyName;
+
+  if (!cache) {
+    cyName = naming->encodePath(plaintextPath, &chainIV);
+  } else {
+    string plainPath(plaintextPath);
+    if (!cache->get(plainPath, &cyName, &chainIV)) {
+      const char* name = strrchr(plaintextPath, '/');
+      if (name != nullptr && name > plaintextPath && name[-1] != '/' &&
+          name[1] != '\0') {
+        // the parent is likely cached, or worth caching for its other
+        // entries: start from its encoding and IV, so that only the last
+        // name is encoded
+        string parent(plaintextPath, name - plaintextPath);
+        cyName = encodePath(parent.c_str(), &chainIV);
+        string last = naming->encodePath(name + 1, &chainIV);
+        if (!cyName.empty()) {
+          cyName += '/';
+        }
+        cyName += last;
+      } else {
+        cyName = naming->encodePath(plaintextPath, &chainIV);
+      }
+      cache->put(plainPath, cyName, chainIV);
+    }
+  }
+
+  if (iv != nullptr) {
+    *iv = chainIV;
+  }
+  return cyName;
+}
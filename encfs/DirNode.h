@@ -1,6 +1,7 @@
 #ifndef _DirNode_incl_
 #define _DirNode_incl_
 
+#include <atomic>
 #include <dirent.h>
 #include <inttypes.h>
 #include <list>
@@ -13,6 +14,7 @@
 #include <vector>
 
 #include "CipherKey.h"
+#include "DirIndex.h"
 #include "FSConfig.h"
 #include "FileNode.h"
 #include "NameIO.h"
@@ -23,50 +25,92 @@ namespace encfs {
     class FileNode;
     class NameIO;
     class RenameOp;
+    class ThreadPool;
     struct RenameEl;
 
     class DirTraverse {
         public:
+            // with a pool, names are read in batches and decoded on it
             DirTraverse(std::shared_ptr<DIR> dirPtr, uint64_t iv,
-                        std::shared_ptr<NameIO> naming, bool root);
+                        std::shared_ptr<NameIO> naming, bool root,
+                        std::shared_ptr<ThreadPool> pool =
+                            std::shared_ptr<ThreadPool>());
             ~DirTraverse();
             DirTraverse& operator=(const DirTraverse& src);
 
             // returns FALSE to indicate an invalid DirTraverse (such as when
             // an invalid directory is requested for traverse)
-            bool vaild() const;
+            bool valid() const;
 
             // return next plaintext filename
             // If fileType is not 0, then it is used to return the filetype (or
             // 0 if unknown)
             std::string nextPlaintextName(int* fileType = 0, ino_t* inode=0);
+            // as above, into buf of bufLength bytes without allocating.
+            // Returns the length of the name, 0 if there are no more.
+            // If cipherName is not 0, it is set to the name in the backing
+            // directory, and nameIV, if not 0, to the name IV the chain
+            // ends with at it.
+            int nextPlaintextName(char* buf, int bufLength, int* fileType = 0,
+                                  ino_t* inode = 0,
+                                  std::string* cipherName = 0,
+                                  uint64_t* nameIV = 0);
+
+            // descriptor of the backing directory, -1 if invalid
+            int dirFd() const;
 
             /*
              * Return cipher name of next undecodable filename..
              * The opposite of nextPlaintextName(), as that skips undecodable
              * names ..
              */
-            std::string nextInvaild();
+            std::string nextInvalid();
+
+            /*
+             * Every name in turn, decodable or not: *plainName is left empty
+             * for one that does not decode.  Returns false at the end.  With
+             * a pool, the names are decoded in batches on it.
+             */
+            bool nextEntry(std::string* cipherName, std::string* plainName,
+                           int* fileType = 0);
         private:
+            struct Batch;
+            // the next name of the batch, reading another one as needed.
+            // Null at the end of the directory.
+            const std::string* nextDecoded(int* fileType, ino_t* inode,
+                                           std::string* cipherName = 0,
+                                           uint64_t* nameIV = 0);
+            bool fillBatch();
+
             std::shared_ptr<DIR> dir; // struct DIR
             // initialization vector to use. Not very general purpose, but makes
             // it more efficient to support filename IV chaining..
             uint64_t iv;
             std::shared_ptr<NameIO> naming;
             bool root;
+
+            std::shared_ptr<ThreadPool> pool;
+            // names read ahead of the caller, null without a pool
+            std::shared_ptr<Batch> batch;
     };
-    inline bool DirTraverse::vaild() const { return dir.get() != 0 }
+    inline bool DirTraverse::valid() const { return dir.get() != 0; }
+    inline int DirTraverse::dirFd() const {
+        return dir ? ::dirfd(dir.get()) : -1;
+    }
 
     class DirNode {
         public:
             // sourceDir points to where raw files are sorted
             DirNode(EncFS_Context* ctx, const std::string& sourceDir,
-                    const FSConfig& config);
+                    const FSConfigPtr& config);
             ~DirNode();
 
             // return the path to the root directory
             std::string rootDirectory();
-            
+
+            // the configuration this filesystem was mounted with
+            const FSConfigPtr& config() const;
+
             // recursive lookup check
             bool touchesMountpoint(const char* realPath) const;
 
@@ -82,10 +126,69 @@ namespace encfs {
             std::shared_ptr<FileNode> openNode(const char* plaintextName,
                                                const char* requestor, int flags,
                                                int* openResult);
+            /*
+             * Creates the regular file and opens it, with the descriptor of
+             * the creating open(), as openNode does.  uid/gid as for
+             * FileNode::mknod.
+             */
+            std::shared_ptr<FileNode> createNode(const char* plaintextName,
+                                                 int flags, mode_t mode,
+                                                 uid_t uid, gid_t gid,
+                                                 int* createResult);
             std::string cipherPath(const char* plaintextPath);
             std::string cipherPathWithoutRoot(const char* plaintextPath);
             std::string plainPath(const char* cipherPath);
 
+            /*
+             * The attributes getattr reports for plaintextPath, given the
+             * name cipherName it has in the backing directory dirFd, so
+             * readdir can report them without encoding the path again.
+             * Returns 0 on success, -errno on failure.
+             */
+            int entryAttr(int dirFd, const char* cipherName,
+                          const char* plaintextPath, struct stat* stbuf);
+
+            /*
+             * The attributes getattr reports for plaintextPath when it is
+             * not open, without making a FileNode for it: the backing
+             * file's lstat, with its size translated.  They may come from
+             * the AttrCache.  For callers that only need a stat, such as
+             * the group of a parent directory.  Returns 0 on success,
+             * -errno on failure.
+             */
+            int closedAttr(const char* plaintextPath, struct stat* stbuf);
+
+            /*
+             * Puts the attributes of plaintextPath, named cipherName in the
+             * backing directory dirFd, into the AttrCache ahead of the
+             * getattr that usually follows a listing.  Does nothing if they
+             * are cached already, or the file is open.
+             */
+            void cacheAttr(int dirFd, const char* cipherName,
+                           const char* plaintextPath);
+
+            /*
+             * The attributes of the closed file plaintextPath from the
+             * DirIndex of its directory, stat'ing the file only if the
+             * index has its name but not its attributes.  False if there
+             * is no index to ask; otherwise *res is 0, or -ENOENT if the
+             * index does not have the name.
+             */
+            bool indexedAttr(const char* plaintextPath, struct stat* stbuf,
+                             int* res);
+
+            // the attributes of plaintextPath changed behind FileNode's back
+            void forgetAttr(const char* plaintextPath);
+
+            /*
+             * The decoded target of the backing symlink cipherName, relative
+             * to dirFd (or AT_FDCWD), whose lstat is stbuf.  target is left
+             * empty if it does not decode.  Returns 0 on success, -errno on
+             * failure.
+             */
+            int readLink(int dirFd, const char* cipherName,
+                         const struct stat& stbuf, std::string* target);
+
             // relative cipherPath is the same as cipherPath except that it
             // doesn't prepent the mount point. That it, it doesn't return a
             // fully qualified name, just a relative path within the encrypted
@@ -99,9 +202,40 @@ namespace encfs {
              */
             bool hasDirectoryNameDependency() const;
 
+            // the encoding of a single name in a directory whose chain IV
+            // is *iv, which is then set to the IV of the name, for a caller
+            // that tracks directories itself
+            std::string encodeName(const char* plaintextName, uint64_t* iv);
+            // and the other way round
+            std::string decodeName(const char* cipherName, uint64_t* iv);
+
             // unlink the specified file
             int unlink(const char* plaintextName);
 
+            // drop what is cached about the path and the names below it,
+            // once it is removed behind our back (such as by rmdir)
+            void forgetPath(const char* plaintextPath);
+
+            // lookups of names that turned out not to exist are remembered
+            // for a while, until a name is created in their directory.
+            // generation is that of NegativeCache::missing().
+            bool knownMissing(const char* plaintextPath, uint64_t* generation);
+            void noteMissing(const char* plaintextPath, uint64_t generation);
+            void nameCreated(const char* plaintextPath);
+            // before plaintextPath is created or removed: change is to be
+            // held until nameCreated() or forgetPath() took it, see
+            // DirIndex::Change
+            void beginNameChange(const char* plaintextPath,
+                                 DirIndex::Change* change);
+
+            // reverse mode: the entry name of the directory dirPath was
+            // listed, with cipherName its name in the source directory and
+            // iv the name IV the chain ends with at it.  Recorded in the
+            // path cache, so that the lookups and stats that follow a
+            // listing find the source name without decrypting it again.
+            void nameListed(const char* dirPath, const char* name,
+                            const std::string& cipherName, uint64_t iv);
+
             // traverse directory
             DirTraverse openDir(const char* plainDirName);
 
@@ -137,14 +271,42 @@ namespace encfs {
             bool genRenameList(std::list<RenameEl>& list, const char* fromP,
                                const char* toP);
             std::shared_ptr<FileNode> findOrCreate(const char* plainName);
+            // the node open under another name of the file at plainName,
+            // if it has more than one (see EncFS_Context::lookupInode)
+            std::shared_ptr<FileNode> linkedNode(const char* plainName);
+            // finishes the header rewrites of a rename that was cut short
+            void recoverRenames();
+
+            // naming->encodePath, through the path cache if there is one.
+            // iv, if not null, is set to the IV the chain ends with.  A
+            // path missing from the cache is encoded from the entry of its
+            // directory, cached on the way, so that only its name is.
+            std::string encodePath(const char* plaintextPath,
+                                   uint64_t* iv = nullptr);
+
+            // renames change the names of open nodes, so they hold
+            // topology exclusively.  Lookups, opens, links and unlinks
+            // hold it shared, and the lock of the shard of the plaintext
+            // path they work on, so that those on different paths run in
+            // parallel.  topology is taken before a path lock.
+            static const int PathShards = 64;
+            pthread_rwlock_t topology;
+            pthread_mutex_t pathLocks[PathShards];
+            pthread_mutex_t& pathLock(const char* plaintextPath);
+            // bumped as names are created or removed, so that a recursive
+            // rename listed under a shared topology (--interactive) knows
+            // the list is still right once it holds it exclusively
+            std::atomic<uint64_t> nameChanges;
 
-            pthread_mutex_t mutex;
+            // puts plaintextPath, created or removed, in the DirIndex of
+            // its directory
+            void indexName(const char* plaintextPath, bool created);
 
             EncFS_Context* ctx;
 
             // passed in as configuration
             std::string rootDir;
-            FSConfig fsConfig;
+            FSConfigPtr fsConfig;
 
             std::shared_ptr<NameIO> naming;
     };
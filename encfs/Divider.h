@@ -0,0 +1,74 @@
+#ifndef _Divider_incl_
+#define _Divider_incl_
+
+#include <stdint.h>
+
+namespace encfs {
+
+/*
+    Division of file offsets by a block size fixed when a file is opened,
+    without a 64-bit divide per call: a shift and a mask for powers of two,
+    otherwise a multiply by a precomputed reciprocal, corrected by at most
+    two subtractions.  Offsets must not be negative.
+ */
+class Divider {
+ public:
+  explicit Divider(uint64_t divisor = 1) { reset(divisor); }
+
+  void reset(uint64_t divisor) {
+    _divisor = divisor;
+    _shift = -1;
+    if ((divisor & (divisor - 1)) == 0) {
+      _shift = 0;
+      while ((uint64_t(1) << _shift) < divisor) {
+        ++_shift;
+      }
+    }
+    // floor((2^64 - 1) / divisor) never overestimates the quotient
+    _reciprocal = divisor > 1 ? ~uint64_t(0) / divisor : 0;
+  }
+
+  uint64_t divisor() const { return _divisor; }
+
+  // n / divisor, and n % divisor into *rem if it is not null
+  uint64_t div(uint64_t n, uint64_t *rem = nullptr) const {
+    uint64_t q;
+    if (_shift >= 0) {
+      q = n >> _shift;
+    } else {
+#if defined(__SIZEOF_INT128__)
+      q = (uint64_t)(((unsigned __int128)n * _reciprocal) >> 64);
+      while (n - q * _divisor >= _divisor) {
+        ++q;
+      }
+#else
+      q = n / _divisor;
+#endif
+    }
+    if (rem != nullptr) {
+      *rem = n - q * _divisor;
+    }
+    return q;
+  }
+
+  uint64_t mod(uint64_t n) const {
+    if (_shift >= 0) {
+      return n & (_divisor - 1);
+    }
+    uint64_t rem;
+    div(n, &rem);
+    return rem;
+  }
+
+  // n / divisor, rounded up
+  uint64_t divUp(uint64_t n) const { return div(n + _divisor - 1); }
+
+ private:
+  uint64_t _divisor;
+  int _shift;  // log2 of the divisor, -1 unless it is a power of two
+  uint64_t _reciprocal;
+};
+
+}  // namespace encfs
+
+#endif
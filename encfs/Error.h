@@ -17,13 +17,13 @@ namespace encfs {
 
 #define STR(X) #X
 
-#define rAssert(cond)                               \
-    do {                                            \
-        if ((cond) == false)                        \
-        RLOG(ERROR) << "Assert failed" << STR(cond);\
-        throw encfs::Error(STR(cond));              \
-    }                                               \
-} while (false)
+#define rAssert(cond)                                        \
+    do {                                                     \
+        if ((cond) == false) {                               \
+            RLOG(ERROR) << "Assert failed: " << STR(cond);   \
+            throw encfs::Error(STR(cond));                   \
+        }                                                    \
+    } while (false)
 
 void initLogging(bool enable_debug = false, bool is_daemon = false);
 
@@ -32,7 +32,24 @@ void initLogging(bool enable_debug = false, bool is_daemon = false);
 extern el::base::DispatchAction rlogAction;
 
 #define RLOG(LEVEL, ...) \
-    C##LEVEL(el::base::Writer, rlogAction, ELPP_CURR_FILE_LOGGER_ID);
+    C##LEVEL(el::base::Writer, rlogAction, ELPP_CURR_FILE_LOGGER_ID)
+
+// Verbose logging on the data path, which runs per block.  Levels above
+// ENCFS_MAX_VLOG are compiled out, level check and arguments, so release
+// builds keep only what -DENCFS_MAX_VLOG=N asks for there; Trace records
+// the same events at a fraction of the cost.
+#ifndef ENCFS_MAX_VLOG
+#ifdef NDEBUG
+#define ENCFS_MAX_VLOG 0
+#else
+#define ENCFS_MAX_VLOG 9
+#endif
+#endif
+
+#define HOT_VLOG(level)                 \
+    if ((level) > ENCFS_MAX_VLOG) {     \
+    } else                              \
+        VLOG(level)
 }
 
 #endif
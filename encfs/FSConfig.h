@@ -16,12 +16,53 @@ enum ConfigType {
   Config_V3,
   Config_V4,
   Config_V5,
-  Config_v6
+  Config_V6
+};
+
+// algorithm used for MACFileIO block headers
+enum BlockMACAlgorithm {
+  BlockMAC_HMAC = 0,   // HMAC-SHA1 folded to 64 bits (Cipher::MAC_64)
+  BlockMAC_SipHash = 1 // SipHash-2-4 keyed per volume, block number as nonce
+};
+
+// function deriving the user key from the password
+enum KDFAlgorithm {
+  KDF_PBKDF2 = 0,  // PBKDF2-HMAC-SHA1, kdfIterations rounds
+  KDF_Argon2id = 1 // Argon2id, kdfIterations passes over kdfMemoryKiB
+};
+
+// how file data is compressed before it is encrypted, see CompressedFileIO
+enum CompressionAlgorithm {
+  Compression_None = 0,
+  Compression_LZ4 = 1,
+  Compression_Zstd = 2
 };
 
 struct EncFS_Opts;
+class AttrCache;
+class BlockCache;
+class CiphertextCache;
+class DigestCache;
+class HotFileCache;
+class DirFdCache;
+class DirIndex;
+class DirListCache;
+class FdCache;
+class FileIVCache;
+class PathCache;
+class Reclaimer;
+class NegativeCache;
+class LinkCache;
 class Cipher;
 class NameIO;
+class NonceBudget;
+class ObjectStore;
+class PackStore;
+class SyncBatcher;
+class WriteJournal;
+class ThreadPool;
+class WarmCache;
+class XattrCache;
 
 struct EncFSConfig {
   ConfigType cfgType;
@@ -42,11 +83,15 @@ struct EncFSConfig {
 
   int kdfIterations;
   long desiredKDFDuration;
+  int kdfAlgorithm; // KDFAlgorithm
+  int kdfMemoryKiB; // Argon2id: memory used
+  int kdfLanes;     // Argon2id: lanes, worked on in parallel
 
   bool plainData; // do not encrypt file content
 
   int blockMACBytes;     // MAC header on blocks..
   int blockMACRandBytes; // number of random bytes in the block header
+  int blockMACAlgorithm; // BlockMACAlgorithm used for the MAC header
 
   bool uniqueIV;           // per-file Initialication Vector
   bool externalIVChaining; // IV seeding by filename IV chaining
@@ -54,19 +99,35 @@ struct EncFSConfig {
   bool chainedNameIV; // filename IV chaining
   bool allowHoles;    // allow holes in files (implicit zero blocks)
 
+  int compression;      // CompressionAlgorithm of file data
+  int compressionChunk; // bytes of plaintext compressed together
+
+  int packThreshold; // backing files up to this size are packed, 0 if none
+  bool objectStore;  // file data is kept in an object store (--object-store)
+  bool nonceBudget;  // the blocks sealed are counted, see NonceBudget
+
   EncFSConfig() : keyData(), salt() {
     cfgType = Config_None;
     subVersion = 0;
     plainData = false;
     blockMACBytes = 0;
     blockMACRandBytes = 0;
+    blockMACAlgorithm = BlockMAC_HMAC;
     uniqueIV = false;
     externalIVChaining = false;
     chainedNameIV = false;
     allowHoles = false;
+    compression = Compression_None;
+    compressionChunk = 0;
+    packThreshold = 0;
+    objectStore = false;
+    nonceBudget = false;
 
     kdfIterations = 0;
     desiredKDFDuration = 500;
+    kdfAlgorithm = KDF_PBKDF2;
+    kdfMemoryKiB = 0;
+    kdfLanes = 0;
   }
 
   // deprecated
@@ -77,8 +138,15 @@ struct EncFSConfig {
   unsigned char *getKeyData() const;
   unsigned char *getSaltData() const;
 
+  std::shared_ptr<Cipher> getCipher() const;
+
+  CipherKey getUserKey(bool useStdin);
+  CipherKey getUserKey(const std::string &passwordProgram,
+                       const std::string &rootDir);
+  CipherKey getNewUserKey();
+
 private:
-  Cipher makeKey(const char *password, int passwdLen);
+  CipherKey makeKey(const char *password, int passwdLen);
 };
 
 std::ostream &operator<<(std::ostream &os, const EncFSConfig &cfg);
@@ -93,13 +161,78 @@ struct FSConfig {
 
   std::shared_ptr<NameIO> nameCoding;
 
+  // decoded block cache shared by all open files, or null if disabled
+  std::shared_ptr<BlockCache> blockCache;
+  // decoded copies of hot files, null without --hot-cache
+  std::shared_ptr<HotFileCache> hotCache;
+  // decoded file headers of recently opened files, or null if disabled
+  std::shared_ptr<FileIVCache> ivCache;
+  // encoded paths of recently looked up names, or null if disabled
+  std::shared_ptr<PathCache> pathCache;
+  // recently looked up names that did not exist, or null if disabled
+  std::shared_ptr<NegativeCache> negativeCache;
+  // attributes of recently looked at closed files, null without --attr-ttl
+  std::shared_ptr<AttrCache> attrCache;
+  // extended attributes of recently looked at files, null without
+  // --attr-ttl
+  std::shared_ptr<XattrCache> xattrCache;
+  // decoded targets of recently read symlinks, or null if disabled
+  std::shared_ptr<LinkCache> linkCache;
+  // descriptors of recently released backing files, or null if disabled
+  std::shared_ptr<FdCache> fdCache;
+  // descriptors of recently used backing directories, or null if disabled
+  std::shared_ptr<DirFdCache> dirFdCache;
+  // decoded listings of recently read directories, or null if disabled
+  std::shared_ptr<DirListCache> dirListCache;
+  // indexes of large backing directories, null without --dir-index
+  std::shared_ptr<DirIndex> dirIndex;
+  // runs read-ahead into blockCache, null if read-ahead is disabled
+  std::shared_ptr<ThreadPool> readAheadPool;
+  // stats the names of listings ahead of their getattrs into attrCache,
+  // null without it
+  std::shared_ptr<ThreadPool> statAheadPool;
+  // stores the runs of long writes while the next one is encoded, null
+  // if writes are not pipelined
+  std::shared_ptr<ThreadPool> writePool;
+  // decodes the blocks of large requests, and the names of directory
+  // listings, in parallel, null if disabled
+  std::shared_ptr<ThreadPool> cryptoPool;
+  // coalesces the fsyncs of open files, null without --group-sync
+  std::shared_ptr<SyncBatcher> syncBatcher;
+  // logs the writes to backing files, null without --write-journal
+  std::shared_ptr<WriteJournal> writeJournal;
+  // digests of encoded files read in full, null without --digest-cache
+  std::shared_ptr<DigestCache> digestCache;
+  // holds the data of small files, null unless the volume packs them
+  std::shared_ptr<PackStore> packStore;
+  // holds the data of the files written, null without --object-store
+  std::shared_ptr<ObjectStore> objectStore;
+  // counts the blocks sealed with random nonces, null unless the cipher
+  // seals them and the mount writes
+  std::shared_ptr<NonceBudget> nonceBudget;
+  // local copy of backing file chunks, null without --ciphertext-cache
+  std::shared_ptr<CiphertextCache> ciphertextCache;
+  // frees unlinked large files later, null without --deferred-unlink
+  std::shared_ptr<Reclaimer> reclaimer;
+  // keeps the hot cache entries for the next mount, null without
+  // --warm-restart
+  std::shared_ptr<WarmCache> warmCache;
+
   bool forceDecode;       // force decode on MAC block failures
   bool reverseEncryption; // reverse encryption operation
 
   bool idleTracking; // turn on idle monitoring of filesystem
 
+  // the volume stores names as is (NullNameIO): paths are not recoded
+  bool plainNames;
+  // the volume stores file content as is, with no header, MAC bytes or
+  // compression: files are read and written by RawFileIO alone, with no
+  // blocks to split requests into
+  bool plainFiles;
+
   FSConfig()
-      : forceDecode(false), reverseEncryption(false), idleTracking(false) {}
+      : forceDecode(false), reverseEncryption(false), idleTracking(false),
+        plainNames(false), plainFiles(false) {}
 };
 
 using FSConfigPtr = std::shared_ptr<FSConfig>;
@@ -0,0 +1,183 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FdCache.h"
+
+#include <ctime>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static const struct timespec &ctimeOf(const struct stat &stbuf) {
+#if defined(__APPLE__)
+  return stbuf.st_ctimespec;
+#else
+  return stbuf.st_ctim;
+#endif
+}
+
+static uint64_t monotonicSecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec;
+}
+
+size_t FdCache::KeyHash::operator()(const Key &k) const {
+  uint64_t h = (uint64_t)k.dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.ino;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return (size_t)h;
+}
+
+FdCache::FdCache(size_t maxEntries, int maxAgeSecs)
+    : _maxEntries(maxEntries > 0 ? maxEntries : 1),
+      _maxAgeSecs(maxAgeSecs > 0 ? maxAgeSecs : 1),
+      _hits(0),
+      _misses(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+FdCache::~FdCache() {
+  VLOG(1) << "fd cache: " << hits() << " hits, " << misses() << " misses";
+  for (const Entry &entry : _lru) {
+    ::close(entry.fd);
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+void FdCache::closeAll(const EntryList &closing) {
+  for (const Entry &entry : closing) {
+    ::close(entry.fd);
+  }
+}
+
+void FdCache::remove(EntryList::iterator it, EntryList *closing) {
+  _index.erase(it->key);
+  closing->splice(closing->end(), _lru, it);
+}
+
+void FdCache::expire(uint64_t now, EntryList *closing) {
+  while (!_lru.empty() && now - _lru.back().putAt >= _maxAgeSecs) {
+    remove(std::prev(_lru.end()), closing);
+  }
+}
+
+int FdCache::take(const struct stat &stbuf, bool needWrite, bool *canWrite) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  const struct timespec &ctime = ctimeOf(stbuf);
+  EntryList closing;
+  int fd = -1;
+  {
+    Lock lock(_mutex);
+    expire(monotonicSecs(), &closing);
+
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      Entry &entry = *it->second;
+      if (entry.ctime.tv_sec != ctime.tv_sec ||
+          entry.ctime.tv_nsec != ctime.tv_nsec) {
+        // its mode or owner may have changed, open it again
+        remove(it->second, &closing);
+      } else if (entry.canWrite || !needWrite) {
+        fd = entry.fd;
+        *canWrite = entry.canWrite;
+        _lru.erase(it->second);
+        _index.erase(it);
+      }
+      // a read-only one stays for readers until a writer puts its own back
+    }
+  }
+  if (fd >= 0) {
+    ++_hits;
+  } else {
+    ++_misses;
+  }
+  closeAll(closing);
+  return fd;
+}
+
+void FdCache::put(int fd, bool canWrite) {
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0 || stbuf.st_nlink == 0 ||
+      !S_ISREG(stbuf.st_mode)) {
+    // gone already, nobody will open it again
+    ::close(fd);
+    return;
+  }
+
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  EntryList closing;
+  {
+    Lock lock(_mutex);
+    uint64_t now = monotonicSecs();
+    expire(now, &closing);
+
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      if (it->second->canWrite && !canWrite) {
+        // keep the one that serves everybody
+        _lru.splice(_lru.begin(), _lru, it->second);
+        it->second->ctime = ctimeOf(stbuf);
+        it->second->putAt = now;
+        closing.push_back(Entry());
+        closing.back().fd = fd;
+        fd = -1;
+      } else {
+        remove(it->second, &closing);
+      }
+    }
+
+    if (fd >= 0) {
+      Entry entry;
+      entry.key = key;
+      entry.ctime = ctimeOf(stbuf);
+      entry.fd = fd;
+      entry.canWrite = canWrite;
+      entry.putAt = now;
+      _lru.push_front(entry);
+      _index[key] = _lru.begin();
+    }
+
+    while (_lru.size() > _maxEntries) {
+      remove(std::prev(_lru.end()), &closing);
+    }
+  }
+  closeAll(closing);
+}
+
+void FdCache::erase(const struct stat &stbuf) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  EntryList closing;
+  {
+    Lock lock(_mutex);
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      remove(it->second, &closing);
+    }
+  }
+  closeAll(closing);
+}
+
+uint64_t FdCache::hits() const { return _hits; }
+
+uint64_t FdCache::misses() const { return _misses; }
+
+}  // namespace encfs
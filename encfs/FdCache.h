@@ -0,0 +1,89 @@
+#ifndef _FdCache_incl_
+#define _FdCache_incl_
+
+#include <atomic>
+#include <list>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+namespace encfs {
+
+/*
+    Descriptors of backing files that were released recently, kept open so
+    that opening the file again takes one lstat of its name instead of an
+    open.  Shared by every RawFileIO of a filesystem.
+
+    Entries are keyed by the backing file's device and inode, and only
+    handed out while its ctime is the one recorded when the descriptor was
+    put back: a chmod or chown, or a write from outside, drops the entry
+    and the file is opened again, with the permission checks of an open.
+    An entry is taken out while it is in use, so no two files share one.
+
+    There is one entry per file.  A read-write descriptor serves readers
+    too, and replaces a read-only one that is put back for the same file.
+
+    A file unlinked behind our back keeps its space until its descriptor
+    is pushed out by newer ones or is older than maxAgeSecs; files removed
+    through the mount are erased from the cache.
+ */
+class FdCache {
+ public:
+  FdCache(size_t maxEntries, int maxAgeSecs);
+  ~FdCache();
+
+  // a descriptor of the file stbuf describes, open for writing if
+  // needWrite, or -1.  The caller owns it, *canWrite tells how it is open.
+  int take(const struct stat &stbuf, bool needWrite, bool *canWrite);
+  // hands fd back, taking ownership of it.  Closes it if it cannot be kept.
+  void put(int fd, bool canWrite);
+  // closes the descriptor of the file stbuf describes, if there is one
+  void erase(const struct stat &stbuf);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const Key &o) const {
+      return dev == o.dev && ino == o.ino;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const;
+  };
+  struct Entry {
+    Key key;
+    struct timespec ctime;
+    int fd;
+    bool canWrite;
+    uint64_t putAt;  // monotonic seconds
+  };
+  using EntryList = std::list<Entry>;
+
+  // closes the entries past maxAgeSecs, the oldest being at the back
+  void expire(uint64_t now, EntryList *closing);
+  void remove(EntryList::iterator it, EntryList *closing);
+  // descriptors are closed once the lock is released
+  static void closeAll(const EntryList &closing);
+
+  pthread_mutex_t _mutex;
+  EntryList _lru;  // most recently put first
+  std::unordered_map<Key, EntryList::iterator, KeyHash> _index;
+  size_t _maxEntries;
+  uint64_t _maxAgeSecs;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  FdCache(const FdCache &);             // not allowed
+  FdCache &operator=(const FdCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
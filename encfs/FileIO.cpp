@@ -1,5 +1,7 @@
 #include "FileIO.h"
 
+#include <cerrno>
+
 namespace encfs {
   FileIO::FileIO() = default;
   FileIO::~FileIO() = default;
@@ -10,4 +12,100 @@ namespace encfs {
     (void) iv;
     return true;
   }
+
+  bool FileIO::isHole(off_t offset, size_t len) const {
+    (void) offset;
+    (void) len;
+    return false;
+  }
+
+  off_t FileIO::seekExtent(off_t offset, bool hole) const {
+    off_t size = getSize();
+    if (size < 0) {
+      return size;
+    }
+    if (offset < 0) {
+      return -EINVAL;
+    }
+    if (offset >= size) {
+      return -ENXIO;
+    }
+    return hole ? size : offset;
+  }
+
+  int FileIO::allocate(int mode, off_t offset, off_t len) {
+    (void) mode;
+    (void) offset;
+    (void) len;
+    return -EOPNOTSUPP;
+  }
+
+  void FileIO::invalidateAttr() {}
+
+  int FileIO::passthroughFd() const { return -1; }
+
+  void FileIO::invalidateData(off_t offset, size_t len) {
+    (void) offset;
+    (void) len;
+  }
+
+  void FileIO::advise(off_t offset, off_t len, Advice advice) const {
+    (void) offset;
+    (void) len;
+    (void) advice;
+  }
+
+  size_t IOVecRequest::dataLen() const {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      len += iov[i].iov_len;
+    }
+    return len;
+  }
+
+  /**
+   * Returns the number of bytes read, which is short only at end of file, or
+   * -errno in case of failure
+   */
+  ssize_t FileIO::readv(const IOVecRequest& req) const {
+    IORequest tmp;
+    tmp.offset = req.offset;
+
+    ssize_t result = 0;
+    for (int i = 0; i < req.iovcnt; ++i) {
+      tmp.data = (unsigned char*)req.iov[i].iov_base;
+      tmp.dataLen = req.iov[i].iov_len;
+
+      ssize_t readSize = read(tmp);
+      if (readSize < 0) {
+        return readSize;
+      }
+      result += readSize;
+      if ((size_t)readSize < tmp.dataLen) {
+        break;
+      }
+      tmp.offset += readSize;
+    }
+    return result;
+  }
+
+  /**
+   * Returns the number of bytes written, or -errno in case of failure
+   */
+  ssize_t FileIO::writev(const IOVecRequest& req) {
+    IORequest tmp;
+    tmp.offset = req.offset;
+
+    for (int i = 0; i < req.iovcnt; ++i) {
+      tmp.data = (unsigned char*)req.iov[i].iov_base;
+      tmp.dataLen = req.iov[i].iov_len;
+
+      ssize_t writeSize = write(tmp);
+      if (writeSize < 0) {
+        return writeSize;
+      }
+      tmp.offset += tmp.dataLen;
+    }
+    return tmp.offset - req.offset;
+  }
 }
@@ -2,13 +2,33 @@
 #define _FileIO_incl_
 
 #include <inttypes.h>
+#include <memory>
 #include <stdint.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "Interface.h"
 #include "encfs.h"
 
+// fallocate() modes, as passed on by FUSE
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
 namespace encfs {
+    // how a range of a file is about to be read, see FileIO::advise
+    enum class Advice {
+        Normal,      // no particular order
+        Sequential,  // front to back
+        Random,      // in no order at all
+        WillNeed,    // soon
+        DontNeed     // not again
+    };
+
     struct IORequest {
         off_t offset;
 
@@ -16,12 +36,38 @@ namespace encfs {
         size_t dataLen;
         unsigned char* data;
 
+        // bytes in front of data the callee may use as scratch space, so
+        // that a layer adding a header can build it in place
+        size_t headroom;
+
         IORequest();
     };
 
-    inline IORequest::IORequest() : offset(0), dataLen(0), data(0) {}
+    inline IORequest::IORequest()
+        : offset(0), dataLen(0), data(0), headroom(0) {}
+
+    // scatter / gather form of IORequest: the iovcnt buffers of iov map to
+    // consecutive bytes of the file starting at offset
+    struct IOVecRequest {
+        off_t offset;
 
-    class FileIO {
+        const struct iovec* iov;
+        int iovcnt;
+
+        // scratch bytes in front of every buffer, as for IORequest
+        size_t headroom;
+
+        IOVecRequest();
+        // total bytes of all buffers
+        size_t dataLen() const;
+    };
+
+    inline IOVecRequest::IOVecRequest()
+        : offset(0), iov(0), iovcnt(0), headroom(0) {}
+
+    // FileIO objects are always owned by a shared_ptr; background work on a
+    // file (see BlockFileIO read-ahead) holds a reference while it runs
+    class FileIO : public std::enable_shared_from_this<FileIO> {
         public:
             FileIO();
             virtual ~FileIO();
@@ -49,11 +95,54 @@ namespace encfs {
             virtual off_t getSize() const = 0;
             
             virtual ssize_t read(const IORequest& req) const = 0;
-            virtual ssize_t write(const IORequest& req) const = 0;
+            virtual ssize_t write(const IORequest& req) = 0;
+
+            // scatter / gather versions of read and write. The default
+            // implementations call read() / write() once per buffer,
+            // RawFileIO issues a single preadv / pwritev.
+            virtual ssize_t readv(const IOVecRequest& req) const;
+            virtual ssize_t writev(const IOVecRequest& req);
 
             virtual int truncate(off_t size) = 0;
             virtual bool isWritable() const = 0;
 
+            // true if the len bytes at offset are known to lie in a hole of
+            // the file, and so read as zeros without being stored.  Answers
+            // false when unsure; the default implementation always does.
+            virtual bool isHole(off_t offset, size_t len) const;
+
+            // the first offset at or after offset that lies in a hole
+            // (hole) or holds data (!hole), as lseek(2) SEEK_HOLE /
+            // SEEK_DATA answer: the end of the file counts as a hole, and
+            // an offset at or past it gives -ENXIO.  Other errors are
+            // -errno.  The default implementation sees no holes.
+            virtual off_t seekExtent(off_t offset, bool hole) const;
+
+            // fallocate(2) on the len bytes at offset.  Returns 0 on
+            // success, -errno on failure; the default implementation does
+            // not support it.
+            virtual int allocate(int mode, off_t offset, off_t len);
+
+            // drop any attributes cached by getAttr(), after the file was
+            // changed without going through this FileIO (chmod, utimens..)
+            virtual void invalidateAttr();
+
+            // the descriptor of a backing file that holds the plaintext as
+            // is, at the same offsets, for I/O that bypasses this stack
+            // (splice).  -1 if there is none, which is the default.
+            virtual int passthroughFd() const;
+
+            // len bytes at offset were written through passthroughFd(),
+            // drop whatever is cached of them and of the file size
+            virtual void invalidateData(off_t offset, size_t len);
+
+            // tells the backing file how the len bytes at offset of this
+            // one will be read, len 0 meaning to its end, so that the
+            // filesystem under it reads ahead or drops its pages to suit.
+            // Layers map the range to what they read of their base for it.
+            // Only a hint; the default implementation ignores it.
+            virtual void advise(off_t offset, off_t len, Advice advice) const;
+
         private:
             // not implemented..
             FileIO(const FileIO& );
@@ -0,0 +1,122 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FileIVCache.h"
+
+#include <iterator>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static const struct timespec &mtimeOf(const struct stat &stbuf) {
+#if defined(__APPLE__)
+  return stbuf.st_mtimespec;
+#else
+  return stbuf.st_mtim;
+#endif
+}
+
+size_t FileIVCache::KeyHash::operator()(const Key &k) const {
+  uint64_t h = (uint64_t)k.dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.ino;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return (size_t)h;
+}
+
+FileIVCache::FileIVCache(size_t maxEntries)
+    : _maxEntries(maxEntries > 0 ? maxEntries : 1), _hits(0), _misses(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+FileIVCache::~FileIVCache() {
+  VLOG(1) << "file IV cache: " << hits() << " hits, " << misses()
+          << " misses";
+  pthread_mutex_destroy(&_mutex);
+}
+
+uint64_t FileIVCache::get(const struct stat &stbuf) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  const struct timespec &mtime = mtimeOf(stbuf);
+
+  Lock lock(_mutex);
+  auto it = _index.find(key);
+  if (it == _index.end()) {
+    ++_misses;
+    return 0;
+  }
+
+  Entry &entry = *it->second;
+  if (entry.mtime.tv_sec != mtime.tv_sec ||
+      entry.mtime.tv_nsec != mtime.tv_nsec) {
+    // the file has changed since, the header may be another one
+    _lru.erase(it->second);
+    _index.erase(it);
+    ++_misses;
+    return 0;
+  }
+
+  ++_hits;
+  _lru.splice(_lru.begin(), _lru, it->second);
+  return entry.iv;
+}
+
+void FileIVCache::put(const struct stat &stbuf, uint64_t iv) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+
+  Lock lock(_mutex);
+  auto it = _index.find(key);
+  if (it != _index.end()) {
+    _lru.erase(it->second);
+    _index.erase(it);
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.mtime = mtimeOf(stbuf);
+  entry.iv = iv;
+  _lru.push_front(entry);
+  _index[key] = _lru.begin();
+
+  while (_lru.size() > _maxEntries) {
+    _index.erase(_lru.back().key);
+    _lru.pop_back();
+  }
+}
+
+std::vector<FileIVCache::Entry> FileIVCache::hottest() {
+  Lock lock(_mutex);
+  return std::vector<Entry>(_lru.begin(), _lru.end());
+}
+
+void FileIVCache::preload(const Entry &entry) {
+  Lock lock(_mutex);
+  if (_lru.size() >= _maxEntries || _index.find(entry.key) != _index.end()) {
+    return;
+  }
+  // behind what this mount read already
+  _lru.push_back(entry);
+  _index[entry.key] = std::prev(_lru.end());
+}
+
+uint64_t FileIVCache::hits() const { return _hits; }
+
+uint64_t FileIVCache::misses() const { return _misses; }
+
+}  // namespace encfs
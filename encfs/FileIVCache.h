@@ -0,0 +1,77 @@
+#ifndef _FileIVCache_incl_
+#define _FileIVCache_incl_
+
+#include <atomic>
+#include <list>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+namespace encfs {
+
+/*
+    LRU cache of decoded file IVs, shared by every CipherFileIO of a
+    filesystem, so that opening a file again does not read and decode its
+    header again.
+
+    Entries are keyed by the backing file's device and inode, and only
+    used while its mtime is the one recorded with the IV.  A file that is
+    replaced, or modified behind our back, gets a new mtime and has its
+    header read again.
+ */
+class FileIVCache {
+ public:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const Key &o) const {
+      return dev == o.dev && ino == o.ino;
+    }
+  };
+  struct Entry {
+    Key key;
+    struct timespec mtime;
+    uint64_t iv;
+  };
+
+  explicit FileIVCache(size_t maxEntries);
+  ~FileIVCache();
+
+  // the IV recorded for the file stbuf describes, or 0 if there is none
+  uint64_t get(const struct stat &stbuf);
+  void put(const struct stat &stbuf, uint64_t iv);
+
+  // the entries, most recently used first, for a later mount to preload()
+  std::vector<Entry> hottest();
+  // records entry, kept by an earlier mount, unless its file is recorded
+  // already or there is no room left for it.  get() checks its mtime as
+  // for any other.
+  void preload(const Entry &entry);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key &k) const;
+  };
+  using EntryList = std::list<Entry>;
+
+  pthread_mutex_t _mutex;
+  EntryList _lru;  // most recently used first
+  std::unordered_map<Key, EntryList::iterator, KeyHash> _index;
+  size_t _maxEntries;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  FileIVCache(const FileIVCache &);             // not allowed
+  FileIVCache &operator=(const FileIVCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
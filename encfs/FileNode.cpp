@@ -1,64 +1,285 @@
 #include "FileNode.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
 #include <cstring>
 #include <fcntl.h>
-#ifdef __linux__
-#include <sys/fsuid.h>
-#endif
+#include <sched.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "AsCaller.h"
+#include "AttrCache.h"
+#include "BlockFileIO.h"
+#include "CachingFileIO.h"
 #include "CipherFileIO.h"
+#include "CompressedFileIO.h"
+#include "DirFdCache.h"
+#include "DirIndex.h"
 #include "Error.h"
 #include "FileIO.h"
 #include "FileUtils.h"
+#include "HotFileCache.h"
+#include "IoUringFileIO.h"
+#include "JournalFileIO.h"
 #include "MACFileIO.h"
+#include "MappedFileIO.h"
+#include "MemoryPool.h"
 #include "Mutex.h"
+#include "ObjectFileIO.h"
+#include "OpStats.h"
+#include "PackStore.h"
+#include "PackedFileIO.h"
 #include "RawFileIO.h"
+#include "SyncBatcher.h"
+#include "Trace.h"
+#include "WriteJournal.h"
 
 using namespace std;
 
+namespace encfs {
+
+// total bytes held in write-back buffers, past this writes go straight
+// through rather than start buffering
+static const size_t MaxWriteBackBytes = 64 * 1024 * 1024;
+static std::atomic<size_t> gWriteBackBytes(0);
+
+namespace {
+
+// ReadLock / WriteLock, timing the wait when another thread holds the lock
+// and, with --lock-profile, the wait and hold times of FileNode::rwlock
+class NodeReadLock {
+ public:
+  explicit NodeReadLock(pthread_rwlock_t& lock)
+      : _lock(&lock), _site(nullptr), _since(0) {
+    bool profile = LockProfile::enabled.load(std::memory_order_relaxed);
+    uint64_t waitStart = 0;
+    if (pthread_rwlock_tryrdlock(_lock) != 0) {
+      StatTimer timer(OpStats::LockWait);
+      waitStart = profile ? LockProfile::now() : 0;
+      pthread_rwlock_rdlock(_lock);
+    }
+    if (profile) {
+      _site = &ENCFS_LOCK_SITE("FileNode::rwlock read");
+      _since = LockProfile::acquired(*_site, waitStart);
+    }
+  }
+  ~NodeReadLock() {
+    if (_site != nullptr) {
+      LockProfile::released(*_site, _since);
+    }
+    pthread_rwlock_unlock(_lock);
+  }
+
+ private:
+  NodeReadLock(const NodeReadLock& src);             // not allowed
+  NodeReadLock& operator=(const NodeReadLock& src);  // not allowed
+
+  pthread_rwlock_t* _lock;
+  LockProfile::Site* _site;  // null when not profiled
+  uint64_t _since;
+};
+
+class NodeWriteLock {
+ public:
+  explicit NodeWriteLock(pthread_rwlock_t& lock)
+      : _lock(&lock), _site(nullptr), _since(0) {
+    bool profile = LockProfile::enabled.load(std::memory_order_relaxed);
+    uint64_t waitStart = 0;
+    if (pthread_rwlock_trywrlock(_lock) != 0) {
+      StatTimer timer(OpStats::LockWait);
+      waitStart = profile ? LockProfile::now() : 0;
+      pthread_rwlock_wrlock(_lock);
+    }
+    if (profile) {
+      _site = &ENCFS_LOCK_SITE("FileNode::rwlock write");
+      _since = LockProfile::acquired(*_site, waitStart);
+    }
+  }
+  ~NodeWriteLock() {
+    if (_site != nullptr) {
+      LockProfile::released(*_site, _since);
+    }
+    pthread_rwlock_unlock(_lock);
+  }
+
+ private:
+  NodeWriteLock(const NodeWriteLock& src);             // not allowed
+  NodeWriteLock& operator=(const NodeWriteLock& src);  // not allowed
+
+  pthread_rwlock_t* _lock;
+  LockProfile::Site* _site;  // null when not profiled
+  uint64_t _since;
+};
+
+}  // namespace
+
 FileNode::FileNode(DirNode* parent_, const FSConfigPtr& cfg,
                    const char* plaintextName_, const char* cipherName_,
-                   uint64_t fuseFh) {
-  pthread_mutext_init(&mutex, nullptr);
-  Lock _lock(mutex);
+                   uint64_t fuseFh, const std::shared_ptr<FileIO>& backing)
+    : _pattern(cfg->opts->readAheadBlocks) {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+  // a steady stream of readers must not keep writers out for good
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&rwlock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&_attrLock, nullptr);
+  pthread_mutex_init(&_sumLock, nullptr);
+  _attrValid = false;
+  _attrGeneration = 0;
+  _hotKnown = false;
+  _hotDev = 0;
+  _hotIno = 0;
+  _linked = false;
+  _linkDev = 0;
+  _linkIno = 0;
+  NodeWriteLock _lock(rwlock);
 
   this->canary = CANARY_OK;
 
-  this->pname = plaintextName_;
-  this->_cname = cipherName_;
+  this->_pname = PathName(plaintextName_);
+  this->_cname = PathName(cipherName_);
   this->parent = parent_;
 
   this->fsConfig = cfg;
 
   this->fuseFh = fuseFh;
 
-  std::shared_ptr<FileIO> rawIO(new RawFileIO(_cname));
-  io = std::shared_ptr<FileIO>(new CipherFileIO(rawIO, fsConfig));
+  // in reverse mode the files change behind our back
+  _cacheAttr = !cfg->opts->noCache && !cfg->reverseEncryption;
+  if (backing) {
+    io = backing;
+  } else {
+    std::shared_ptr<RawFileIO> rawIO;
+    if (cfg->opts->ioUring) {
+      rawIO.reset(new IoUringFileIO(_cname.str()));
+    } else if (cfg->opts->mmapReads && cfg->opts->readOnly &&
+               !cfg->opts->directIO) {
+      // nothing writes through us, reads can come from a mapping
+      rawIO.reset(new MappedFileIO(_cname.str()));
+    } else {
+      rawIO.reset(new RawFileIO(_cname.str()));
+    }
+    rawIO->setDirectIO(cfg->opts->directIO);
+    rawIO->setSyncTruncate(cfg->opts->syncTruncate);
+    rawIO->setFdCache(cfg->fdCache);
+    rawIO->setCacheAttr(_cacheAttr);
+    _raw = rawIO;
+    io = rawIO;
+    if (cfg->objectStore) {
+      _object = std::make_shared<ObjectFileIO>(io, cfg->objectStore);
+      io = _object;
+    }
+  }
+  _backingId = 0;
+  _backingOpens = 0;
+  _pushReadAhead = false;
+  // a plain volume has nothing to code, and has the page cache of the
+  // backing file hold what a block cache would
+  if (!cfg->plainFiles) {
+    if (cfg->ciphertextCache) {
+      io = std::shared_ptr<FileIO>(new CachingFileIO(io, cfg->ciphertextCache));
+    }
+    if (cfg->writeJournal) {
+      io = std::shared_ptr<FileIO>(new JournalFileIO(io, cfg->writeJournal));
+    }
+    if (cfg->packStore) {
+      io = std::shared_ptr<FileIO>(new PackedFileIO(io, cfg->packStore));
+    }
+    io = std::shared_ptr<FileIO>(new CipherFileIO(io, fsConfig));
 
-  if ((cfg->config->blockMACBytes != 0) ||
-      (cfg->config->blockMACRandBytes != 0)) {
-    io = std::shared_ptr<FileIO>(new MACFileIO(io, fsConfig));
-  } 
+    if ((cfg->config->blockMACBytes != 0) ||
+        (cfg->config->blockMACRandBytes != 0)) {
+      io = std::shared_ptr<FileIO>(new MACFileIO(io, fsConfig));
+    }
+    if (cfg->config->compression != Compression_None) {
+      // compressed before it is encrypted
+      io = std::shared_ptr<FileIO>(new CompressedFileIO(io, fsConfig));
+    }
+  }
+
+  _blockIO = std::dynamic_pointer_cast<BlockFileIO>(io);
+
+  // the data may change behind our back with --nocache or in reverse mode.
+  // A kernel writeback cache already merges small writes into whole pages,
+  // and a tail kept back from it would land after the mtime it sets.
+  _writeBack = cfg->opts->writeBack && !cfg->opts->noCache &&
+               !cfg->reverseEncryption && !cfg->opts->writebackCache;
+  _dirtyBlock = -1;
+  _dirtyLen = 0;
 }
 
 FileNode::~FileNode() {
+  int res = flushDirty();
+  if (res < 0) {
+    RLOG(WARNING) << "lost buffered write to " << _cname.str() << ": "
+                  << strerror(-res);
+  }
+
   canary = CANARY_DESTROYED;
-  _pname.assign(_pname.length(), '\0');
-  _cname.assign(_cname.length(), '\0');
+  // the names are cleared when the last handle to them goes
+  _pname = PathName();
+  _cname = PathName();
   io.reset();
 
-  pthread_mutex_destroy(&mutex);
+  pthread_mutex_destroy(&_attrLock);
+  pthread_mutex_destroy(&_sumLock);
+  pthread_rwlock_destroy(&rwlock);
 }
 
-const char* FileNode::cipherName() const { return _cname.c_str(); }
-const char* FileNode::plaintextName() const {return _pname.c_str();}
+void FileNode::applyPolicy(const AccessPattern::Policy& policy) const {
+  VLOG(1) << "access policy of " << _cname.str() << ": read-ahead "
+          << policy.readAheadBlocks << ", drop-behind " << policy.dropBehind
+          << ", write-back " << policy.writeBack;
+  if (_blockIO) {
+    _blockIO->setReadAhead(policy.readAheadBlocks);
+    _blockIO->setDropBehind(policy.dropBehind);
+  }
+  // so that the filesystem under the backing file reads ahead for a
+  // stream, and does not for scattered reads
+  Advice advice = Advice::Normal;
+  if (policy.sequential) {
+    advice = Advice::Sequential;
+  } else if (policy.scattered) {
+    advice = Advice::Random;
+  }
+  io->advise(0, 0, advice);
+}
 
-string FileNode::plaintextParent() const { return parentDirectory(_pname); }
+string FileNode::cipherName() const { return _cname.str(); }
+string FileNode::plaintextName() const { return _pname.str(); }
+
+string FileNode::plaintextParent() const {
+  return parentDirectory(_pname.str());
+}
+
+void FileNode::setLinked(dev_t dev, ino_t ino) {
+  if (_linked.load(std::memory_order_acquire)) {
+    return;
+  }
+  _linkDev = dev;
+  _linkIno = ino;
+  _linked.store(true, std::memory_order_release);
+}
+
+bool FileNode::linked(dev_t* dev, ino_t* ino) const {
+  if (!_linked.load(std::memory_order_acquire)) {
+    return false;
+  }
+  if (dev != nullptr) {
+    *dev = _linkDev;
+  }
+  if (ino != nullptr) {
+    *ino = _linkIno;
+  }
+  return true;
+}
 
 static bool setIV(const std::shared_ptr<FileIO>& io, uint64_t iv) {
   struct stat stbuf;
@@ -74,27 +295,35 @@ bool FileNode::setName(const char* plaintextName_, const char* cipherName_,
     VLOG(1) << "calling setIV on " << cipherName_;
   }
 
+  {
+    // data must be written with the IV it was buffered under
+    NodeWriteLock _lock(rwlock);
+    if (flushDirty() < 0 && fsConfig->config->externalIVChaining) {
+      return false;
+    }
+  }
+
   if (setIVFirst) {
     if (fsConfig->config->externalIVChaining && !setIV(io, iv)) {
       return false;
     }
 
     if (plaintextName_ != nullptr) {
-      this->_pname = plaintextName_;
+      this->_pname = PathName(plaintextName_);
     }
     if (cipherName_ != nullptr) {
-      this->_cname = cipherName_;
+      this->_cname = PathName(cipherName_);
       io->setFileName(cipherName_);
     }
   } else {
-    std::string oldPName = _pname;
-    std::string oldCName = _cname;
+    PathName oldPName = _pname;
+    PathName oldCName = _cname;
 
     if (plaintextName_ != nullptr) {
-      this->_pname = plaintextName_;
+      this->_pname = PathName(plaintextName_);
     }
     if (cipherName_ != nullptr) {
-      this->_cname = cipherName_;
+      this->_cname = PathName(cipherName_);
       io->setFileName(cipherName_);
     }
     if(fsConfig->config->externalIVChaining && setIV(io, iv)) {
@@ -106,78 +335,206 @@ bool FileNode::setName(const char* plaintextName_, const char* cipherName_,
 }
 
 int FileNode::mknod(mode_t mode, dev_t rdev, uid_t uid, gid_t gid) {
-  Lock _lock(mutex);
+  NodeWriteLock _lock(rwlock);
 
-  int res;
-  int olduid = -1;
-  int oldgid = -1;
-  if (gid != 0) {
-    oldgid = setfsgid(gid);
-    if (oldgid == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsgid error: " << strerror(eno);
-      return -EPERM;
-    }
-  }
-  if (uid != 0) {
-    olduid = setfsuid(uid);
-    if (olduid = -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsuid error: " << strerror(eno);
-      return -EPERM;
-    }
+  AsCaller caller(uid, gid, mode, fsConfig->opts->defaultPermissions);
+  if (!caller.ok()) {
+    return -EPERM;
   }
 
+  std::string cname = _cname.str();
+  DirFdCache::Ref at =
+      !caller.switched()
+          ? DirFdCache::at(fsConfig->dirFdCache, cname.c_str())
+          : DirFdCache::Ref(AT_FDCWD, cname.c_str());
+  int res;
+  int fd = -1;
   if (S_ISREG(mode)) {
-    res = ::open(_cname.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
-    if (res >= 0) {
-      res = ::close(res);
-    }
+    res = fd = ::openat(at.fd(), at.name(), O_CREAT | O_EXCL | O_WRONLY, mode);
   } else if (S_ISFIFO(mode)) {
-    res = ::mkfifo(_cname.c_str(), mode);
+    res = ::mkfifoat(at.fd(), at.name(), mode);
   } else {
-    res = ::mknod(_cname.c_str(), mode, rdev);
+    res = ::mknodat(at.fd(), at.name(), mode, rdev);
   }
 
   if (res == -1) {
     int eno = errno;
     VLOG(1) << "mknod error: " << strerror(eno);
-    res = -eno;
+    return -eno;
   }
+  res = caller.own(at.fd(), at.name(), fd);
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  return res;
+}
+
+int FileNode::create(int flags, mode_t mode, uid_t uid, gid_t gid) {
+  if (!_raw) {
+    return -ENOTSUP;
+  }
+  {
+    NodeWriteLock _lock(rwlock);
 
-  if (olduid >= 0) {
-    if (setfsuid(olduid) == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsuid back error: " << strerror(eno);
+    AsCaller caller(uid, gid, mode, fsConfig->opts->defaultPermissions);
+    if (!caller.ok()) {
+      return -EPERM;
+    }
+
+    std::string cname = _cname.str();
+    DirFdCache::Ref at =
+        !caller.switched()
+            ? DirFdCache::at(fsConfig->dirFdCache, cname.c_str())
+            : DirFdCache::Ref(AT_FDCWD, cname.c_str());
+    int res = _raw->create(at.fd(), at.name(), mode, flags);
+    if (res >= 0) {
+      res = caller.own(at.fd(), at.name(), _raw->passthroughFd());
+    }
+    if (res < 0) {
+      return res;
+    }
+  }
+  // takes the descriptor just made, the header is written with the first
+  // block
+  return open(flags);
+}
+
+int FileNode::open(int flags) const {
+  NodeWriteLock _lock(rwlock);
+
+  int res = io->open(flags);
+  if (res >= 0 && fsConfig->hotCache && !_hotKnown) {
+    struct stat stbuf;
+    if (io->getAttr(&stbuf) == 0) {
+      _hotDev = stbuf.st_dev;
+      _hotIno = stbuf.st_ino;
+      _hotKnown = true;
     }
   }
-  if (oldgid >= 0) {
-    if (setfsgid(oldgid) == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsgid back error: " << strerror(eno);
+  if ((flags & O_TRUNC) != 0) {
+    dataChanged();
+  } else {
+    attrChanged();
+  }
+  if (res >= 0 && _hotKnown) {
+    struct stat stbuf;
+    if (attrLocked(&stbuf) == 0) {
+      fsConfig->hotCache->opened(stbuf);
     }
   }
+  // most readers start at the beginning, right after the open
+  if (res >= 0 && _blockIO && (flags & O_ACCMODE) != O_WRONLY &&
+      (flags & O_TRUNC) == 0) {
+    _blockIO->prefetchStart(fsConfig->opts->openPrefetchBlocks);
+  }
   return res;
+}
 
+void FileNode::attrChanged() const {
+  {
+    Lock lock(_attrLock);
+    _attrValid = false;
+    ++_attrGeneration;
+  }
+  // and what was seen of it while it was closed
+  if (fsConfig->attrCache) {
+    fsConfig->attrCache->erase(_pname.str().c_str());
+  }
+  if (fsConfig->dirIndex) {
+    string plain = _pname.str();
+    string cipher = _cname.str();
+    size_t plainSlash = plain.rfind('/');
+    size_t cipherSlash = cipher.rfind('/');
+    if (plainSlash != string::npos && cipherSlash != string::npos) {
+      // the root is known by the backing directory with its '/'
+      fsConfig->dirIndex->dropAttr(
+          cipher.substr(0, plainSlash == 0 ? cipherSlash + 1 : cipherSlash),
+          plain.c_str() + plainSlash + 1);
+    }
+  }
+}
 
+void FileNode::dataChanged() const {
+  attrChanged();
+  dropCopies();
 }
-int FileNode::open(int flags) const {
-  Lock _lock(mutex);
 
-  int res = io->open(flags);
-  return res;
+void FileNode::dropCopies() const {
+  if (_hotKnown) {
+    fsConfig->hotCache->erase(_hotDev, _hotIno);
+  }
+  if (fsConfig->digestCache) {
+    Lock lock(_sumLock);
+    _sum.reset();
+  }
 }
 
 int FileNode::getAttr(struct stat* stbuf) const {
-  Lock _lock(mutex);
+  NodeReadLock _lock(rwlock);
+  return attrLocked(stbuf);
+}
 
-  int res = io->getAttr(stbuf);
+int FileNode::attrLocked(struct stat* stbuf) const {
+  int res = 0;
+  uint64_t generation;
+  bool cached = false;
+  {
+    Lock lock(_attrLock);
+    if (_attrValid) {
+      *stbuf = _attr;
+      cached = true;
+    }
+    generation = _attrGeneration;
+  }
+  if (!cached) {
+    res = io->getAttr(stbuf);
+    if (res == 0 && _cacheAttr) {
+      Lock lock(_attrLock);
+      // unless it changed while we were looking
+      if (generation == _attrGeneration) {
+        _attr = *stbuf;
+        _attrValid = true;
+      }
+    }
+  }
+
+  if (res == 0 && _dirtyBlock >= 0) {
+    off_t end = _dirtyBlock * io->blockSize() + _dirtyLen;
+    if (stbuf->st_size < end) {
+      stbuf->st_size = end;
+    }
+  }
   return res;
 }
 
+void FileNode::plainAttr(const FSConfigPtr& cfg, struct stat* stbuf) {
+  CipherFileIO::plainAttr(cfg, stbuf);
+  if ((cfg->config->blockMACBytes != 0) ||
+      (cfg->config->blockMACRandBytes != 0)) {
+    MACFileIO::plainAttr(cfg, stbuf);
+  }
+  if (cfg->config->compression != Compression_None) {
+    CompressedFileIO::plainAttr(cfg, stbuf);
+  }
+}
+
+void FileNode::invalidateAttr() {
+  NodeReadLock _lock(rwlock);
+  io->invalidateAttr();
+  attrChanged();
+}
+
+unsigned int FileNode::blockSize() const { return io->blockSize(); }
+
 off_t FileNode::getSize() const {
-  Lock _lock(mutex);
+  NodeReadLock _lock(rwlock);
   off_t res = io->getSize();
+  if (res >= 0 && _dirtyBlock >= 0) {
+    off_t end = _dirtyBlock * io->blockSize() + _dirtyLen;
+    if (res < end) {
+      res = end;
+    }
+  }
   return res;
 }
 
@@ -186,22 +543,153 @@ ssize_t FileNode::read(off_t offset, unsigned char* data, size_t size) const {
   req.offset = offset;
   req.dataLen = size;
   req.data = data;
+  Trace::event(Trace::FileRead, offset, size);
 
-  Lock _lock(mutex);
+  AccessPattern::Policy policy;
+  if (_pattern.read(offset, size, &policy)) {
+    applyPolicy(policy);
+  }
 
+  {
+    NodeReadLock _lock(rwlock);
+    if (!readsDirty(offset, size)) {
+      if (_hotKnown && _dirtyBlock < 0) {
+        ssize_t res = readHot(req);
+        if (res >= 0) {
+          return res;
+        }
+      }
+      ssize_t res = io->read(req);
+      if (res > 0 && fsConfig->digestCache) {
+        sumRead(offset, data, res);
+      }
+      return res;
+    }
+  }
+
+  // reads reaching the buffered block see it through the block cache,
+  // which takes writing it out first
+  NodeWriteLock _lock(rwlock);
+  if (readsDirty(offset, size)) {
+    int res = flushDirty();
+    if (res < 0) {
+      return res;
+    }
+  }
   return io->read(req);
 }
 
+ssize_t FileNode::readHot(const IORequest& req) const {
+  const std::shared_ptr<HotFileCache>& cache = fsConfig->hotCache;
+  struct stat stbuf;
+  if (attrLocked(&stbuf) != 0) {
+    return -1;
+  }
+  ssize_t res = cache->read(stbuf, req.offset, req.data, req.dataLen);
+  if (res >= 0) {
+    return res;
+  }
+
+  std::shared_ptr<HotFileCache::Copy> copy =
+      cache->startCopy(_pname.str().c_str(), stbuf);
+  if (!copy) {
+    return -1;
+  }
+  IORequest all;
+  all.offset = 0;
+  all.dataLen = copy->size();
+  all.data = copy->data();
+  if (io->read(all) != (ssize_t)copy->size()) {
+    cache->abandon(copy);
+    return -1;
+  }
+  cache->add(copy);
+
+  if (req.offset >= (off_t)copy->size()) {
+    return 0;
+  }
+  size_t len = std::min(req.dataLen, copy->size() - (size_t)req.offset);
+  memcpy(req.data, copy->data() + req.offset, len);
+  return len;
+}
+
+void FileNode::sumRead(off_t offset, const unsigned char* data,
+                       size_t len) const {
+  const std::shared_ptr<DigestCache>& cache = fsConfig->digestCache;
+  Lock lock(_sumLock);
+  if (!_sum) {
+    unsigned char md[DigestCache::DigestSize];
+    if (offset != 0 || attrLocked(&_sumStart) != 0 ||
+        cache->get(_pname.str().c_str(), _sumStart, md)) {
+      return;
+    }
+    _sum.reset(new DigestCache::Sum());
+  }
+  if (!_sum->add(offset, data, len)) {
+    _sum.reset();
+    return;
+  }
+  if (_sum->summed() < _sumStart.st_size) {
+    return;
+  }
+
+  // unless the file changed while it was read
+  struct stat now;
+  if (attrLocked(&now) == 0 && now.st_ino == _sumStart.st_ino &&
+      now.st_size == _sumStart.st_size &&
+      now.st_mtime == _sumStart.st_mtime &&
+      _sum->summed() == now.st_size) {
+    cache->add(_pname.str().c_str(), _sumStart, _sum.get());
+  }
+  _sum.reset();
+}
+
+bool FileNode::readsDirty(off_t offset, size_t size) const {
+  return _dirtyBlock >= 0 &&
+         offset + (off_t)size > _dirtyBlock * (off_t)io->blockSize();
+}
+
 ssize_t FileNode::write(off_t offset, unsigned char* data, size_t size) {
-  VLOG(1) << "FileNode::write offset " << offset << ", data size " << size;
+  HOT_VLOG(1) << "FileNode::write offset " << offset << ", data size " << size;
+  Trace::event(Trace::FileWrite, offset, size);
 
   IORequest req;
   req.offset = offset;
   req.dataLen = size;
   req.data = data;
 
-  Lock _lock(mutex);
+  AccessPattern::Policy policy;
+  if (_pattern.write(offset, size, &policy)) {
+    applyPolicy(policy);
+  }
+
+  if (fsConfig->opts->interactive && size > (size_t)InteractiveWriteSlice) {
+    return writeSliced(offset, data, size);
+  }
+
+  NodeWriteLock _lock(rwlock);
+  dropCopies();
+  if (_writeBack && policy.writeBack) {
+    int res = bufferWrite(offset, data, size);
+    if (res < 0) {
+      return res;
+    }
+    if (res > 0) {
+      if (_pushReadAhead) {
+        // the block read-ahead decodes is not what the kernel now has
+        _blockIO->invalidateReadAhead();
+      }
+      return size;
+    }
+  }
+
+  int flushRes = flushDirty();
+  if (flushRes < 0) {
+    return flushRes;
+  }
+
   ssize_t res = io->write(req);
+  dataChanged();
 
   if (res < 0) {
     return res;
@@ -209,34 +697,337 @@ ssize_t FileNode::write(off_t offset, unsigned char* data, size_t size) {
   return size;
 }
 
+/**
+ * Write a large request in slices of whole blocks, taking the lock for each
+ * one, so that reads and attribute lookups of the file wait for a slice
+ * rather than the whole request.  Others may get in between two slices, as
+ * they may between two writes, and see the first of them written.  A slice
+ * that fails after others were written makes a short write.
+ */
+ssize_t FileNode::writeSliced(off_t offset, unsigned char* data,
+                              size_t size) {
+  unsigned int bs = io->blockSize();
+  size_t slice = InteractiveWriteSlice;
+  if (bs > 1) {
+    slice = std::max<size_t>(bs, slice - slice % bs);
+  }
+
+  size_t done = 0;
+  while (done < size) {
+    off_t at = offset + (off_t)done;
+    // the first slice ends on a block, so that no block is coded twice
+    size_t len = slice - (bs > 1 ? (size_t)(at % bs) : 0);
+    len = std::min(len, size - done);
+
+    ssize_t res;
+    {
+      NodeWriteLock _lock(rwlock);
+      dropCopies();
+      res = flushDirty();
+      if (res >= 0) {
+        IORequest req;
+        req.offset = at;
+        req.dataLen = len;
+        req.data = data + done;
+        res = io->write(req);
+        dataChanged();
+      }
+    }
+    if (res < 0) {
+      return done > 0 ? (ssize_t)done : res;
+    }
+
+    done += len;
+    if (done < size) {
+      // let the writers-first lock hand over to those waiting
+      sched_yield();
+    }
+  }
+  return size;
+}
+
+int FileNode::holdBacking(const std::function<int(int)>& registerFd) {
+  NodeWriteLock _lock(rwlock);
+  ++_backingOpens;
+  if (_backingId == 0) {
+    int fd = fsConfig->plainFiles ? io->passthroughFd() : -1;
+    if (fd < 0 || flushDirty() < 0) {
+      return 0;
+    }
+    int id = registerFd(fd);
+    if (id <= 0) {
+      return 0;
+    }
+    _backingId = id;
+    // reads and writes no longer pass through us
+    _cacheAttr = false;
+    if (_raw) {
+      _raw->setExternalWrites();
+    }
+    dataChanged();
+  }
+  return _backingId;
+}
+
+void FileNode::releaseBacking(const std::function<void(int)>& unregister) {
+  NodeWriteLock _lock(rwlock);
+  if (_backingOpens > 0 && --_backingOpens == 0 && _backingId != 0) {
+    unregister(_backingId);
+    _backingId = 0;
+  }
+}
+
+void FileNode::pushReadAhead(
+    std::function<void(off_t, const unsigned char*, size_t)> store,
+    std::function<void(off_t, size_t)> drop) {
+  NodeWriteLock _lock(rwlock);
+  if (_blockIO) {
+    _pushReadAhead = static_cast<bool>(store);
+    _blockIO->setPageSink(std::move(store), std::move(drop));
+  }
+}
+
+int FileNode::readThroughFd(off_t offset, size_t size) const {
+  {
+    NodeReadLock _lock(rwlock);
+    if (!readsDirty(offset, size)) {
+      return io->passthroughFd();
+    }
+  }
+
+  NodeWriteLock _lock(rwlock);
+  if (readsDirty(offset, size) && flushDirty() < 0) {
+    return -1;
+  }
+  return io->passthroughFd();
+}
+
+ssize_t FileNode::writeThrough(off_t offset, size_t size,
+                               const std::function<ssize_t(int)>& copy) {
+  NodeWriteLock _lock(rwlock);
+  int fd = io->passthroughFd();
+  if (fd < 0) {
+    return -ENOTSUP;
+  }
+
+  int flushRes = flushDirty();
+  if (flushRes < 0) {
+    return flushRes;
+  }
+
+  ssize_t res = copy(fd);
+  // even a failed copy may have written part of the range
+  io->invalidateData(offset, size);
+  dataChanged();
+  return res;
+}
+
+/**
+ * Merge a write into the write-back buffer if it lies within the file's
+ * last block, loading that block first when it is not the buffered one.
+ * The buffer is written out as soon as the block is complete.
+ */
+int FileNode::bufferWrite(off_t offset, const unsigned char* data,
+                          size_t size) {
+  unsigned int bs = io->blockSize();
+  if (bs <= 1 || size == 0) {
+    return 0;
+  }
+
+  off_t blockNum = offset / bs;
+  size_t partialOffset = offset % bs;
+  if (partialOffset + size > bs) {
+    return 0;
+  }
+
+  if (blockNum != _dirtyBlock) {
+    if (partialOffset == 0 && size == bs) {
+      // a whole block gains nothing from buffering
+      return 0;
+    }
+
+    int res = flushDirty();
+    if (res < 0) {
+      return res;
+    }
+
+    off_t fileSize = io->getSize();
+    if (fileSize < 0) {
+      return (int)fileSize;
+    }
+    if (blockNum != fileSize / bs) {
+      return 0;
+    }
+    if (gWriteBackBytes + bs > MaxWriteBackBytes) {
+      return 0;
+    }
+
+    if (!_dirty) {
+      _dirty.allocate(bs);
+    }
+    memset(_dirty.data(), 0, bs);
+
+    IORequest req;
+    req.offset = blockNum * bs;
+    req.dataLen = fileSize % bs;
+    req.data = _dirty.data();
+    ssize_t readSize = 0;
+    if (req.dataLen > 0) {
+      readSize = io->read(req);
+      if (readSize < 0) {
+        return (int)readSize;
+      }
+    }
+
+    _dirtyBlock = blockNum;
+    _dirtyLen = readSize;
+    gWriteBackBytes += bs;
+  }
+
+  memcpy(_dirty.data() + partialOffset, data, size);
+  if (partialOffset + size > _dirtyLen) {
+    _dirtyLen = partialOffset + size;
+  }
+
+  if (_dirtyLen == bs) {
+    int res = flushDirty();
+    if (res < 0) {
+      return res;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Write out and drop the write-back buffer.
+ * Returns 0 on success, -errno on failure
+ */
+int FileNode::flushDirty() const {
+  if (_dirtyBlock < 0) {
+    return 0;
+  }
+
+  unsigned int bs = io->blockSize();
+  IORequest req;
+  req.offset = _dirtyBlock * bs;
+  req.dataLen = _dirtyLen;
+  req.data = _dirty.data();
+  ssize_t res = io->write(req);
+  dataChanged();
+
+  memset(_dirty.data(), 0, bs);
+  _dirtyBlock = -1;
+  _dirtyLen = 0;
+  gWriteBackBytes -= bs;
+
+  if (res < 0) {
+    RLOG(WARNING) << "write-back failed: " << strerror(-res);
+    return (int)res;
+  }
+  return 0;
+}
+
+int FileNode::flush() {
+  NodeWriteLock _lock(rwlock);
+
+  int res = flushDirty();
+  // what was written is in the store once the file is closed
+  if (res == 0 && _object) {
+    res = _object->flush();
+  }
+  return res;
+}
+
 int FileNode::truncate(off_t size) {
-  Lock _lock(mutex);
+  NodeWriteLock _lock(rwlock);
+
+  int res = flushDirty();
+  if (res < 0) {
+    return res;
+  }
+  res = io->truncate(size);
+  dataChanged();
+  return res;
+}
+
+int FileNode::allocate(int mode, off_t offset, off_t len) {
+  NodeWriteLock _lock(rwlock);
 
-  return io->truncate(size);
+  int res = flushDirty();
+  if (res < 0) {
+    return res;
+  }
+  res = io->allocate(mode, offset, len);
+  dataChanged();
+  return res;
+}
+
+off_t FileNode::seekExtent(off_t offset, bool hole) const {
+  {
+    NodeReadLock _lock(rwlock);
+    if (_dirtyBlock < 0) {
+      return io->seekExtent(offset, hole);
+    }
+  }
+
+  NodeWriteLock _lock(rwlock);
+  int res = flushDirty();
+  if (res < 0) {
+    return res;
+  }
+  return io->seekExtent(offset, hole);
 }
 
 int FileNode::sync(bool datasync) {
-  Lock _lock(mutex);
+  int fh;
+  {
+    NodeWriteLock _lock(rwlock);
 
-  int fh = io->open(O_RDONLY);
-  if (fh >= 0 ) {
-    int res = -EIO;
-#if defined(HAVE_FDATASYNC)
-    if (datasync) {
-      res = fdatasync(fh);
-    } else {
-      res = fsync(fh);
+    int res = flushDirty();
+    if (res == 0 && _object) {
+      res = _object->flush();
     }
-#else
-    (void) datasync;
+    if (res < 0) {
+      return res;
+    }
+    fh = io->open(O_RDONLY);
+    if (fh < 0) {
+      return fh;
+    }
+  }
+  // the data of a packed file, and where the index says it is
+  if (fsConfig->packStore) {
+    int res = fsConfig->packStore->sync();
+    if (res < 0) {
+      return res;
+    }
+  }
+  // the writes of every file are in the journal, which is all a crash
+  // needs to put them back
+  if (fsConfig->writeJournal) {
+    return fsConfig->writeJournal->commit();
+  }
+  // the descriptor stays open as long as the node, and the lock is not
+  // held across the sync, so that other syncs of the file can join it
+  if (fsConfig->syncBatcher) {
+    return fsConfig->syncBatcher->sync(fh, datasync);
+  }
+
+  int res = -EIO;
+#if defined(HAVE_FDATASYNC)
+  if (datasync) {
+    res = fdatasync(fh);
+  } else {
     res = fsync(fh);
+  }
+#else
+  (void) datasync;
+  res = fsync(fh);
 #endif
-    if (res == -1) {
-      res = -errno;
-    }
-    return res;
+  if (res == -1) {
+    res = -errno;
   }
-  return fh;
+  return res;
 }
 
 }
@@ -2,6 +2,7 @@
 #define _FileNode_incl_
 
 #include <atomic>
+#include <functional>
 #include <inttypes.h>
 #include <memory>
 #include <pthread.h>
@@ -9,9 +10,13 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "AccessPattern.h"
 #include "CipherKey.h"
+#include "DigestCache.h"
 #include "FSConfig.h"
 #include "FileUtils.h"
+#include "MemoryPool.h"
+#include "PathName.h"
 #include "encfs.h"
 
 #define CANARY_OK 0x46040975
@@ -19,14 +24,22 @@
 #define CANARY_DESTROYED 0x52cdad90
 
 namespace encfs {
+    class BlockFileIO;
     class Cipher;
     class DirNode;
     class FileIO;
+    class ObjectFileIO;
+    class RawFileIO;
+    struct IORequest;
 
     class FileNode {
         public:
+            // backing, if given, is the file the stack is built over in
+            // place of a RawFileIO of cipherName: an in-memory file for
+            // benchmarks, say.  create() is not supported on such a node.
             FileNode(DirNode* parent, const FSConfigPtr& cfg, const char* plaintextName,
-                     const char* cipherName, uint64_t fuseFh);
+                     const char* cipherName, uint64_t fuseFh,
+                     const std::shared_ptr<FileIO>& backing = nullptr);
             ~FileNode();
 
             // Use an atomic type. The canary is accessed without holding any
@@ -36,8 +49,14 @@ namespace encfs {
             // FUSE file handle that is passed to the kernel
             uint64_t fuseFh;
 
-            const char* plaintextName() const;
-            const char* cipherName() const;
+            // the backing inode of a file seen with more than one name;
+            // every name of it opened then shares this node, see
+            // EncFS_Context::lookupInode.  Set once.
+            void setLinked(dev_t dev, ino_t ino);
+            bool linked(dev_t* dev, ino_t* ino) const;
+
+            std::string plaintextName() const;
+            std::string cipherName() const;
 
             // directory portion of plaintextName
             std::string plaintextParent() const;
@@ -53,6 +72,11 @@ namespace encfs {
             // as specified
             int mknod(mode_t mode, dev_t rdev, uid_t uid=0, gid_t gid = 0);
 
+            // create the regular file and open it with flags in one step,
+            // keeping the descriptor that created it.  uid/gid as for
+            // mknod.  Returns < 0 on error (-errno), like open otherwise.
+            int create(int flags, mode_t mode, uid_t uid = 0, gid_t gid = 0);
+
             // Returns < 0 on error (-errno), file descriptor on success
             int open(int flags) const;
 
@@ -60,30 +84,171 @@ namespace encfs {
             int getAttr(struct stat* stbuf) const;
             off_t getSize() const;
 
+            // the attributes getAttr reports for a closed file, from the
+            // attributes of its backing file
+            static void plainAttr(const FSConfigPtr& cfg, struct stat* stbuf);
+
+            // the file was changed through its name (chmod, chown, utimens)
+            void invalidateAttr();
+
             ssize_t read(off_t offset, unsigned char* data, size_t size) const;
             ssize_t write(off_t offset, unsigned char* data, size_t size) ;
 
+            // plaintext bytes in a block of the file; reads of whole blocks
+            // decode each block once
+            unsigned int blockSize() const;
+
+            // the backing descriptor when the file stores its plaintext as
+            // is (see FileIO::passthroughFd), with the buffered block of a
+            // read of size bytes at offset written out first.  -1 if there
+            // is none, or writing out failed.
+            int readThroughFd(off_t offset, size_t size) const;
+
+            // writes size bytes at offset with copy(fd) straight to the
+            // backing file when it stores its plaintext as is, and drops
+            // what is cached of them.  Returns what copy does, or -ENOTSUP
+            // if there is no such file.
+            ssize_t writeThrough(off_t offset, size_t size,
+                                 const std::function<ssize_t(int)>& copy);
+
+            // FUSE passthrough, called on every open of the file:
+            // registerFd(fd) is called, until it succeeds, for the kernel
+            // to read and write the backing file through, and returns the
+            // id fd was registered as, or <= 0.  Nothing about the file is
+            // cached once it is.  Returns the id, or 0 if the file does not
+            // store its plaintext as is or could not be registered.  Every
+            // call is matched by releaseBacking() on release, which calls
+            // unregister(id) after the last one.
+            int holdBacking(const std::function<int(int)>& registerFd);
+            void releaseBacking(const std::function<void(int)>& unregister);
+
+            // --push-readahead: the plaintext read-ahead decodes is also
+            // handed to store(offset, data, len) for the kernel's page
+            // cache, and drop(offset, len) called for what a write
+            // overtook, see BlockFileIO::setPageSink.  A later call
+            // replaces the functions.
+            void pushReadAhead(
+                std::function<void(off_t, const unsigned char*, size_t)> store,
+                std::function<void(off_t, size_t)> drop);
+
             // truncate the file to a particular size
             int truncate(off_t size);
 
+            // fallocate(2) on the plaintext range, returns 0 on success,
+            // -errno on failure
+            int allocate(int mode, off_t offset, off_t len);
+
+            // lseek(2) SEEK_HOLE (hole) or SEEK_DATA on the plaintext,
+            // with the buffered block written out first.  Returns the
+            // offset found or -errno.
+            off_t seekExtent(off_t offset, bool hole) const;
+
             // datasync or full sync
             int sync(bool dataSync);
+
+            // write out buffered data, called when the file is closed.
+            // Returns 0 on success, -errno on failure
+            int flush();
         private:
+            // returns 1 if the write was buffered, 0 if it must be written
+            // through, -errno on failure.  Caller holds the lock.
+            int bufferWrite(off_t offset, const unsigned char* data,
+                            size_t size);
+            // caller holds the lock exclusively
+            int flushDirty() const;
+            // write() of a request larger than InteractiveWriteSlice with
+            // --interactive, a slice at a time
+            ssize_t writeSliced(off_t offset, unsigned char* data,
+                                size_t size);
+            // true if a read of size bytes at offset reaches the buffered
+            // block.  Caller holds the lock.
+            bool readsDirty(off_t offset, size_t size) const;
+            // getAttr(), for a caller holding the lock
+            int attrLocked(struct stat* stbuf) const;
+            // read() from the hot file cache, copying the file into it
+            // first if it qualifies.  -1 when it was not served from
+            // there.  Caller holds the lock.
+            ssize_t readHot(const IORequest& req) const;
+
             // doing locking at the FileNode level isn't as efficient as at the
             // lowest level of RawFileIO, since that means locks are held longer
             // (held during CPU intensive crypto operations!). However it makes
             // it easier to avoid any race conditions with operations such as
             // truncate() which may result in multiple calls down to the FileIO
-            // level.
-            mutable pthread_mutex_t mutex;
+            // level.  Reads and attribute lookups share the lock, so that
+            // readers of one file decode in parallel; everything that changes
+            // the file holds it exclusively.
+            mutable pthread_rwlock_t rwlock;
 
             FSConfigPtr fsConfig;
 
             std::shared_ptr<FileIO> io;
-            std::string _pname;
-            std::string _cname;
+            // the top of io when it is a BlockFileIO, null otherwise
+            std::shared_ptr<BlockFileIO> _blockIO;
+            // read-ahead, cache admission and write-back picked from how
+            // the file is used
+            mutable AccessPattern _pattern;
+            void applyPolicy(const AccessPattern::Policy& policy) const;
+            // the bottom of io, which create() opens; null over a given
+            // backing file
+            std::shared_ptr<RawFileIO> _raw;
+            // above _raw with --object-store, null otherwise
+            std::shared_ptr<ObjectFileIO> _object;
+            // the FUSE passthrough id of the backing file, 0 if it has
+            // none, and the opens holding it
+            int _backingId;
+            int _backingOpens;
+            // see pushReadAhead()
+            bool _pushReadAhead;
+
+            // write-back buffer for the partial last block of the file, so
+            // that runs of small appends are coded and written once per
+            // block rather than once per write.  Reads which reach the block,
+            // and every other change to the file, write it out first.
+            bool _writeBack;
+            mutable off_t _dirtyBlock;   // -1 when nothing is buffered
+            mutable size_t _dirtyLen;    // bytes held, from the block start
+            mutable PoolBlock _dirty;
+            // interned, see PathName
+            PathName _pname;
+            PathName _cname;
             DirNode* parent;
 
+            // what io->getAttr() returned, with the plaintext size worked
+            // out, while _attrGeneration is unchanged.  Everything that
+            // changes the file through us bumps it; only for files nothing
+            // else changes.
+            bool _cacheAttr;
+            mutable pthread_mutex_t _attrLock;
+            mutable struct stat _attr;
+            mutable bool _attrValid;
+            mutable uint64_t _attrGeneration;
+            void attrChanged() const;
+
+            // the backing inode, known once the file was opened with the
+            // hot file cache on
+            mutable bool _hotKnown;
+            mutable dev_t _hotDev;
+            mutable ino_t _hotIno;
+            // set by setLinked(), _linked last
+            std::atomic<bool> _linked;
+            dev_t _linkDev;
+            ino_t _linkIno;
+            // the data changed: attrChanged() and dropCopies()
+            void dataChanged() const;
+            // drop the hot copy, and any digest being taken
+            void dropCopies() const;
+
+            // reverse mode with a digest cache: the digest of what was read
+            // so far, from the start, of the file as it was at _sumStart
+            mutable pthread_mutex_t _sumLock;
+            mutable std::unique_ptr<DigestCache::Sum> _sum;
+            mutable struct stat _sumStart;
+            // counts len bytes read at offset into the sum.  Caller holds
+            // the lock.
+            void sumRead(off_t offset, const unsigned char* data,
+                         size_t len) const;
+
         private:
             FileNode(const FileNode& src);
             FileNode& operator=(const FileNode& src);
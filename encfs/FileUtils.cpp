@@ -26,19 +26,23 @@
 #define _DEFAULT_SOURCE  // Replaces _BSD_SOURCE
 
 #include "easylogging++.h"
+#include <algorithm>
 #include <cctype>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <list>
 #ifdef __APPLE__
+#include <sched.h>
 #include <sys/mount.h>
 #include <sys/param.h>
 #endif
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -46,25 +50,56 @@
 #include <unistd.h>
 #include <vector>
 
+#include "AttrCache.h"
+#include "AutoTune.h"
+#include "BlockCache.h"
 #include "BlockNameIO.h"
 #include "Cipher.h"
 #include "CipherKey.h"
+#include "CiphertextCache.h"
+#include "CompressedFileIO.h"
 #include "ConfigReader.h"
+#include "ConfigSidecar.h"
 #include "ConfigVar.h"
 #include "Context.h"
+#include "DigestCache.h"
+#include "DirFdCache.h"
+#include "DirIndex.h"
+#include "DirListCache.h"
 #include "DirNode.h"
 #include "Error.h"
 #include "FSConfig.h"
+#include "FdCache.h"
+#include "FileIVCache.h"
 #include "FileUtils.h"
+#include "HotFileCache.h"
 #include "Interface.h"
+#include "KeyCache.h"
+#include "LinkCache.h"
+#include "MountCalibration.h"
+#include "Mutex.h"
 #include "NameIO.h"
+#include "NegativeCache.h"
+#include "NonceBudget.h"
+#include "NullNameIO.h"
+#include "OpStats.h"
+#include "ObjectStore.h"
+#include "PackStore.h"
+#include "PathCache.h"
 #include "Range.h"
+#include "Reclaimer.h"
+#include "SyncBatcher.h"
+#include "ThreadPool.h"
+#include "WarmCache.h"
+#include "WriteJournal.h"
+#include "XattrCache.h"
 #include "XmlReader.h"
 #include "autosprintf.h"
 #include "base64.h"
 #include "config.h"
 #include "i18n.h"
 #include "intl/gettext.h"
+#include "openssl.h"
 #include "readpassphrase.h"
 
 using namespace std;
@@ -73,12 +108,22 @@ using gnu::autosprintf;
 namespace encfs {
 
 static const int DefaultBlockSize = 1024;
+// bytes of plaintext compressed together, see selectCompression()
+static const int DefaultCompressionChunk = 64 * 1024;
+static const int MinCompressionChunk = 4 * 1024;
+static const int MaxCompressionChunk = 1024 * 1024;
+// size up to which backing files are packed together, see selectPacking()
+static const int MinPackThreshold = 1024;
+static const int MaxPackThreshold = 1024 * 1024;
 // The maximum length of text passwords.  If longer are needed,
 // use the extpass option, as extpass can return arbitrary length binary data.
 static const int MaxPassBuf = 512;
 
 static const int NormalKDFDuration = 500;     // 1/2 a second
 static const int ParanoiaKDFDuration = 3000;  // 3 seconds
+// Argon2id defaults, see selectKDF()
+static const int DefaultArgon2MemoryMiB = 64;
+static const int MaxArgon2Lanes = 16;
 
 // environment variable names for values encfs stores in the environment when
 // calling an external password program.
@@ -197,15 +242,84 @@ bool userAllowMkdir(int promptno, const char *path, mode_t mode) {
   return false;
 }
 
+static const struct timespec &mtimeOf(const struct stat &stbuf) {
+#if defined(__APPLE__)
+  return stbuf.st_mtimespec;
+#else
+  return stbuf.st_mtim;
+#endif
+}
+
+static const struct timespec &ctimeOf(const struct stat &stbuf) {
+#if defined(__APPLE__)
+  return stbuf.st_ctimespec;
+#else
+  return stbuf.st_ctim;
+#endif
+}
+
+static bool sameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/*
+ * The config file loaded last, so that remounting (--ondemand) or a second
+ * look by encfsctl does not parse it again while the file is unchanged.
+ */
+struct LoadedConfig {
+  string path;
+  ConfigType type;
+  struct stat stbuf;
+  EncFSConfig config;
+};
+static pthread_mutex_t gLoadedConfigMutex = PTHREAD_MUTEX_INITIALIZER;
+static LoadedConfig *gLoadedConfig = nullptr;
+
+static bool sameFile(const struct stat &a, const struct stat &b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+         a.st_size == b.st_size && sameTime(mtimeOf(a), mtimeOf(b)) &&
+         sameTime(ctimeOf(a), ctimeOf(b));
+}
+
 /**
- * Load config file by calling the load function on the filename
+ * Load config file by calling the load function on the filename, unless it
+ * is the file loaded last and has not changed since.  stbuf is the lstat of
+ * path.
  */
 ConfigType readConfig_load(ConfigInfo *nm, const char *path,
-                           EncFSConfig *config) {
+                           const struct stat &stbuf, EncFSConfig *config) {
+  {
+    Lock lock(gLoadedConfigMutex);
+    if (gLoadedConfig != nullptr && gLoadedConfig->type == nm->type &&
+        gLoadedConfig->path == path && sameFile(gLoadedConfig->stbuf, stbuf)) {
+      VLOG(1) << "config file " << path << " unchanged, not read again";
+      *config = gLoadedConfig->config;
+      return nm->type;
+    }
+  }
+
   if (nm->loadFunc != nullptr) {
     try {
-      if ((*nm->loadFunc)(path, config, nm)) {
+      bool ok = nm->type == Config_V6 && ConfigSidecar::read(path, config);
+      if (!ok && (*nm->loadFunc)(path, config, nm)) {
+        ok = true;
+        // a binary copy that was made once is kept up to date
+        if (nm->type == Config_V6 && ConfigSidecar::exists(path)) {
+          config->cfgType = nm->type;
+          ConfigSidecar::write(path, *config);
+        }
+      }
+      if (ok) {
         config->cfgType = nm->type;
+
+        Lock lock(gLoadedConfigMutex);
+        if (gLoadedConfig == nullptr) {
+          gLoadedConfig = new LoadedConfig;
+        }
+        gLoadedConfig->path = path;
+        gLoadedConfig->type = nm->type;
+        gLoadedConfig->stbuf = stbuf;
+        gLoadedConfig->config = *config;
         return nm->type;
       }
     } catch (encfs::Error &err) {
@@ -228,33 +342,35 @@ ConfigType readConfig_load(ConfigInfo *nm, const char *path,
  */
 ConfigType readConfig(const string &rootDir, EncFSConfig *config, const string &cmdConfig) {
   ConfigInfo *nm = ConfigFileMapping;
+  struct stat stbuf;
   while (nm->fileName != nullptr) {
-   // allow command line argument to override default config path 
+    // allow command line argument to override default config path
     if (!cmdConfig.empty()) {
-      if (!fileExists(cmdConfig.c_str())) {
+      if (lstat(cmdConfig.c_str(), &stbuf) != 0) {
         RLOG(ERROR)
             << "fatal: config file specified on command line does not exist: "
             << cmdConfig;
         exit(1);
       }
-      return readConfig_load(nm, cmdConfig.c_str(), config);
-    }    // allow environment variable to override default config path
+      return readConfig_load(nm, cmdConfig.c_str(), stbuf, config);
+    }
+    // allow environment variable to override default config path
     if (nm->environmentOverride != nullptr) {
       char *envFile = getenv(nm->environmentOverride);
       if (envFile != nullptr) {
-        if (!fileExists(envFile)) {
+        if (lstat(envFile, &stbuf) != 0) {
           RLOG(ERROR)
               << "fatal: config file specified by environment does not exist: "
               << envFile;
           exit(1);
         }
-        return readConfig_load(nm, envFile, config);
+        return readConfig_load(nm, envFile, stbuf, config);
       }
     }
     // the standard place to look is in the root directory
     string path = rootDir + nm->fileName;
-    if (fileExists(path.c_str())) {
-      return readConfig_load(nm, path.c_str(), config);
+    if (lstat(path.c_str(), &stbuf) == 0) {
+      return readConfig_load(nm, path.c_str(), stbuf, config);
     }
 
     ++nm;
@@ -325,7 +441,13 @@ bool readV6Config(const char *configFile, EncFSConfig *cfg, ConfigInfo *info) {
   config->read("externalIVChaining", &cfg->externalIVChaining);
   config->read("blockMACBytes", &cfg->blockMACBytes);
   config->read("blockMACRandBytes", &cfg->blockMACRandBytes);
+  config->read("blockMACAlgorithm", &cfg->blockMACAlgorithm);
   config->read("allowHoles", &cfg->allowHoles);
+  config->read("compression", &cfg->compression);
+  config->read("compressionChunk", &cfg->compressionChunk);
+  config->read("packThreshold", &cfg->packThreshold);
+  config->read("objectStore", &cfg->objectStore);
+  config->read("nonceBudget", &cfg->nonceBudget);
 
   int encodedSize;
   config->read("encodedKeySize", &encodedSize);
@@ -344,6 +466,9 @@ bool readV6Config(const char *configFile, EncFSConfig *cfg, ConfigInfo *info) {
 
     config->read("kdfIterations", &cfg->kdfIterations);
     config->read("desiredKDFDuration", &cfg->desiredKDFDuration);
+    config->read("kdfAlgorithm", &cfg->kdfAlgorithm);
+    config->read("kdfMemory", &cfg->kdfMemoryKiB);
+    config->read("kdfLanes", &cfg->kdfLanes);
   } else {
     cfg->kdfIterations = 16;
     cfg->desiredKDFDuration = NormalKDFDuration;
@@ -480,6 +605,19 @@ bool saveConfig(ConfigType type, const string &rootDir,
   return ok;
 }
 
+bool saveConfigSidecar(const string &rootDir, const string &cmdConfig) {
+  EncFSConfig config;
+  if (readConfig(rootDir, &config, cmdConfig) != Config_V6) {
+    return false;
+  }
+  string path;
+  {
+    Lock lock(gLoadedConfigMutex);
+    path = gLoadedConfig->path;
+  }
+  return ConfigSidecar::write(path.c_str(), config);
+}
+
 template <typename T>
 tinyxml2::XMLElement *addEl(tinyxml2::XMLDocument &doc,
                             tinyxml2::XMLNode *parent, const char *name,
@@ -554,16 +692,53 @@ bool writeV6Config(const char *configFile, const EncFSConfig *cfg) {
   addEl(doc, config, "externalIVChaining", (int)cfg->externalIVChaining);
   addEl(doc, config, "blockMACBytes", cfg->blockMACBytes);
   addEl(doc, config, "blockMACRandBytes", cfg->blockMACRandBytes);
+  // only written when not the default.  Older versions would not know the
+  // field, the interface version the volume records has them refuse it.
+  if (cfg->blockMACAlgorithm != BlockMAC_HMAC) {
+    addEl(doc, config, "blockMACAlgorithm", cfg->blockMACAlgorithm);
+  }
   addEl(doc, config, "allowHoles", (int)cfg->allowHoles);
+  // like blockMACAlgorithm, only there when used
+  if (cfg->compression != Compression_None) {
+    addEl(doc, config, "compression", cfg->compression);
+    addEl(doc, config, "compressionChunk", cfg->compressionChunk);
+  }
+  if (cfg->packThreshold != 0) {
+    addEl(doc, config, "packThreshold", cfg->packThreshold);
+  }
+  if (cfg->objectStore) {
+    addEl(doc, config, "objectStore", (int)cfg->objectStore);
+  }
+  if (cfg->nonceBudget) {
+    addEl(doc, config, "nonceBudget", (int)cfg->nonceBudget);
+  }
   addEl(doc, config, "encodedKeySize", (int)cfg->keyData.size());
   addEl(doc, config, "encodedKeyData", cfg->keyData);
   addEl(doc, config, "saltLen", (int)cfg->salt.size());
   addEl(doc, config, "saltData", cfg->salt);
   addEl(doc, config, "kdfIterations", cfg->kdfIterations);
   addEl(doc, config, "desiredKDFDuration", (int)cfg->desiredKDFDuration);
+  // like blockMACAlgorithm, only there when not PBKDF2
+  if (cfg->kdfAlgorithm != KDF_PBKDF2) {
+    addEl(doc, config, "kdfAlgorithm", cfg->kdfAlgorithm);
+    addEl(doc, config, "kdfMemory", cfg->kdfMemoryKiB);
+    addEl(doc, config, "kdfLanes", cfg->kdfLanes);
+  }
 
   auto err = doc.SaveFile(configFile, false);
-  return err == tinyxml2::XML_SUCCESS;
+  if (err != tinyxml2::XML_SUCCESS) {
+    return false;
+  }
+
+  // a binary copy, if there is one, is made of the config as it reads back
+  if (ConfigSidecar::exists(configFile)) {
+    EncFSConfig saved;
+    if (readV6Config(configFile, &saved, nullptr)) {
+      saved.cfgType = Config_V6;
+      ConfigSidecar::write(configFile, saved);
+    }
+  }
+  return true;
 }
 
 bool writeV5Config(const char *configFile, const EncFSConfig *config) {
@@ -686,6 +861,15 @@ static Cipher::CipherAlgorithm selectCipherAlgorithm() {
   }
 }
 
+/**
+ * True if the algorithm seals file blocks with an authenticated mode, in
+ * which case separate block MAC headers are redundant.
+ */
+static bool isAuthenticatedCipher(const Cipher::CipherAlgorithm &alg) {
+  std::shared_ptr<Cipher> cipher = Cipher::New(alg.iface);
+  return cipher && cipher->aeadHeaderSize() > 0;
+}
+
 /**
  * Ask the user which encoding to use for file names
  */
@@ -894,7 +1078,8 @@ static bool selectPlainData(bool insecure) {
 /**
  * Ask the user whether to enable block MAC and random header bytes
  */
-static void selectBlockMAC(int *macBytes, int *macRandBytes, bool forceMac) {
+static void selectBlockMAC(int *macBytes, int *macRandBytes,
+                           int *macAlgorithm, bool forceMac) {
   bool addMAC = false;
   if (!forceMac) {
     // xgroup(setup)
@@ -912,8 +1097,17 @@ static void selectBlockMAC(int *macBytes, int *macRandBytes, bool forceMac) {
     addMAC = true;
   }
 
+  *macAlgorithm = BlockMAC_HMAC;
   if (addMAC) {
     *macBytes = 8;
+
+    // xgroup(setup)
+    if (boolDefaultNo(
+            _("Use the faster SipHash-2-4 algorithm for block authentication\n"
+              "instead of HMAC-SHA1?  Volumes using it can not be mounted\n"
+              "by older versions of EncFS."))) {
+      *macAlgorithm = BlockMAC_SipHash;
+    }
   } else {
     *macBytes = 0;
   }
@@ -992,6 +1186,491 @@ static bool selectZeroBlockPassThrough() {
         "This avoids writing encrypted blocks when file holes are created."));
 }
 
+// a number typed in, or defaultValue if none or one out of [min, max] was
+static int readNumber(int defaultValue, int min, int max);
+
+/**
+ * Ask the user whether to compress file data, and with what
+ */
+static void selectCompression(int *algorithm, int *chunkSize) {
+  *algorithm = Compression_None;
+  *chunkSize = 0;
+
+  std::vector<int> choices;
+  for (int alg : {Compression_LZ4, Compression_Zstd}) {
+    if (CompressedFileIO::supported(alg)) {
+      choices.push_back(alg);
+    }
+  }
+  if (choices.empty()) {
+    return;
+  }
+
+  // xgroup(setup)
+  cout << _("Compress file data before encrypting it?  Compressed volumes
+"
+            "can not be mounted by older versions of EncFS.
+");
+  cout << "0. " << _("no compression") << "
+";
+  for (size_t i = 0; i < choices.size(); ++i) {
+    cout << (i + 1) << ". "
+         << CompressedFileIO::algorithmName(choices[i]) << "
+";
+  }
+  // xgroup(setup)
+  cout << _("Enter the number corresponding to your choice: ");
+  int choice = readNumber(0, 0, (int)choices.size());
+  if (choice == 0) {
+    return;
+  }
+  *algorithm = choices[choice - 1];
+
+  // xgroup(setup)
+  cout << autosprintf(
+      _("Select the size of a compressed chunk, in KiB, from %i to %i.
+"
+        "Larger chunks compress better, smaller ones make random access
+"
+        "cheaper [%i]: "),
+      MinCompressionChunk / 1024, MaxCompressionChunk / 1024,
+      DefaultCompressionChunk / 1024);
+  *chunkSize = readNumber(DefaultCompressionChunk / 1024,
+                          MinCompressionChunk / 1024,
+                          MaxCompressionChunk / 1024) *
+               1024;
+}
+
+/**
+ * Ask the user whether to keep the data of small files in pack files, and
+ * up to what size
+ */
+static int selectPacking() {
+  // xgroup(setup)
+  cout << autosprintf(
+      _("Keep the data of small files together in a few large pack files,\n"
+        "rather than in a file each?  Enter the size in KiB up to which\n"
+        "files are packed, from %i to %i, or 0 to keep every file on its\n"
+        "own.  Packed volumes can not be mounted by older versions of "
+        "EncFS [0]: "),
+      MinPackThreshold / 1024, MaxPackThreshold / 1024);
+  return readNumber(0, MinPackThreshold / 1024, MaxPackThreshold / 1024) *
+         1024;
+}
+
+static int readNumber(int defaultValue, int min, int max) {
+  char answer[10];
+  char *res = fgets(answer, sizeof(answer), stdin);
+  cout << "\n";
+
+  if (res != nullptr) {
+    int value = (int)strtol(answer, nullptr, 10);
+    if (value >= min && value <= max) {
+      return value;
+    }
+  }
+  return defaultValue;
+}
+
+/**
+ * Ask the user whether to derive the key with Argon2id, which spreads its
+ * work over the CPUs, and with how much memory
+ */
+static void selectKDF(int *algorithm, int *memoryKiB, int *lanes) {
+  *algorithm = KDF_PBKDF2;
+  // xgroup(setup)
+  if (!boolDefaultNo(
+          _("Derive the key from the password with Argon2id rather than\n"
+            "PBKDF2?  Argon2id needs memory and can use several CPUs, so\n"
+            "guessing passwords costs more for the same unlock time.\n"
+            "Volumes using it can not be mounted by older versions of\n"
+            "EncFS."))) {
+    return;
+  }
+  *algorithm = KDF_Argon2id;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int defaultLanes = (int)std::max(1L, std::min(cpus, (long)MaxArgon2Lanes));
+  cout << autosprintf(
+      // xgroup(setup)
+      _("Number of Argon2id lanes, the CPUs unlocking can use (1 to %i).\n"
+        "Or just hit enter for the default (%i)\n"),
+      MaxArgon2Lanes, defaultLanes);
+  // xgroup(setup)
+  cout << "\n" << _("lanes: ");
+  *lanes = readNumber(defaultLanes, 1, MaxArgon2Lanes);
+
+  cout << autosprintf(
+      // xgroup(setup)
+      _("Memory Argon2id uses, in MiB.  Every unlock needs it.\n"
+        "Or just hit enter for the default (%i MiB)\n"),
+      DefaultArgon2MemoryMiB);
+  // xgroup(setup)
+  cout << "\n" << _("memory: ");
+  int memoryMiB = readNumber(DefaultArgon2MemoryMiB, 1, 4 * 1024);
+  *memoryKiB = memoryMiB * 1024;
+
+  cout << autosprintf(_("Using Argon2id with %i lanes and %i MiB"), *lanes,
+                      memoryMiB)
+       << "\n\n";
+}
+
+/*
+ * The worker pools and the block cache are shared by the volumes a process
+ * serves, see --volumes: each is made by the first volume that wants it,
+ * with that volume's options, and kept while any volume holds it.
+ */
+static pthread_mutex_t gSharedMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::weak_ptr<BlockCache> gBlockCache;
+static std::weak_ptr<ThreadPool> gReadAheadPool;
+static std::weak_ptr<ThreadPool> gStatAheadPool;
+static std::weak_ptr<ThreadPool> gCryptoPool;
+static std::weak_ptr<ThreadPool> gWritePool;
+static std::weak_ptr<CiphertextCache> gCiphertextCache;
+
+template <typename T, typename Make>
+static std::shared_ptr<T> shared(std::weak_ptr<T> *slot, Make make) {
+  Lock lock(gSharedMutex);
+  std::shared_ptr<T> res = slot->lock();
+  if (!res) {
+    res = make();
+    *slot = res;
+  }
+  return res;
+}
+
+// volumes that need no coding of names or of file content are served
+// without going through it, see FSConfig::plainNames / plainFiles
+static void detectPlainVolume(FSConfig *fsConfig) {
+  const EncFSConfig &config = *fsConfig->config;
+  fsConfig->plainNames =
+      fsConfig->nameCoding->interface().implements(
+          NullNameIO::CurrentInterface());
+  fsConfig->plainFiles =
+      config.plainData && !fsConfig->reverseEncryption && !config.uniqueIV &&
+      !config.externalIVChaining && config.blockMACBytes == 0 &&
+      config.blockMACRandBytes == 0 &&
+      config.compression == Compression_None && !fsConfig->packStore &&
+      !fsConfig->objectStore && fsConfig->cipher->aeadHeaderSize() == 0;
+  if (fsConfig->plainNames || fsConfig->plainFiles) {
+    VLOG(1) << "plain volume: names " << fsConfig->plainNames << ", files "
+            << fsConfig->plainFiles;
+  }
+}
+
+// opens the packs of a volume that keeps small files in them, false if it
+// does and they could not be
+static bool openPackStore(FSConfig *fsConfig, const string &rootDir,
+                          const std::shared_ptr<Cipher> &cipher,
+                          const CipherKey &key) {
+  int threshold = fsConfig->config->packThreshold;
+  if (threshold == 0) {
+    return true;
+  }
+  auto store = std::make_shared<PackStore>(rootDir, cipher, key, threshold);
+  if (!store->open()) {
+    cerr << _("Unable to open the pack files of the volume") << "\n";
+    return false;
+  }
+  fsConfig->packStore = store;
+  return true;
+}
+
+// connects to the object store of a mount with --object-store, false if
+// it could not.  The data of a file already somewhere else, in the packs,
+// would be in neither.  The config records that the volume has a store,
+// so that it is not opened without one: its files would read as empty,
+// and be written where the store never looks.
+static bool openObjectStore(FSConfig *fsConfig, const string &rootDir,
+                            const std::shared_ptr<Cipher> &cipher,
+                            const CipherKey &key) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (opts.objectStoreUrl.empty()) {
+    if (fsConfig->config->objectStore) {
+      cerr << _("This volume keeps its file data in an object store, it "
+                "can only be opened with --object-store")
+           << "\n";
+      return false;
+    }
+    return true;
+  }
+  if (fsConfig->config->packThreshold != 0) {
+    cerr << _("--object-store can not be used on a volume that packs "
+              "small files")
+         << "\n";
+    return false;
+  }
+  auto store = std::make_shared<ObjectStore>(
+      opts.objectStoreUrl, cipher, key, (uint64_t)opts.objectCacheSize);
+  if (!store->open()) {
+    // xgroup(diag)
+    cerr << autosprintf(_("Unable to open the object store %s"),
+                        opts.objectStoreUrl.c_str())
+         << "\n";
+    return false;
+  }
+  fsConfig->objectStore = store;
+  // a volume given its store before the config recorded it, which also
+  // takes the interface version that marks the newer formats if it records
+  // the one before
+  EncFSConfig *config = fsConfig->config.get();
+  if (!config->objectStore) {
+    config->objectStore = true;
+    if (config->cipherIface ==
+        cipher->volumeInterface(config->blockSize, false)) {
+      config->cipherIface = cipher->volumeInterface(config->blockSize, true);
+    }
+    if (!saveConfig(Config_V6, rootDir, config, opts.config)) {
+      cerr << _("Unable to record the object store in the configuration")
+           << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// the blocks the files under dir hold, each sealed at least once
+static uint64_t blocksUnder(const string &dir, int blockSize) {
+  uint64_t blocks = 0;
+  DIR *dp = ::opendir(dir.c_str());
+  if (dp == nullptr) {
+    return 0;
+  }
+  struct dirent *de;
+  while ((de = ::readdir(dp)) != nullptr) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    string path = dir + '/' + de->d_name;
+    struct stat st;
+    if (::lstat(path.c_str(), &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      blocks += blocksUnder(path, blockSize);
+    } else if (S_ISREG(st.st_mode)) {
+      blocks += ((uint64_t)st.st_size + blockSize - 1) / blockSize;
+    }
+  }
+  ::closedir(dp);
+  return blocks;
+}
+
+// reads the count of blocks sealed under the volume key, for a cipher
+// with random nonces, false if it could not.  The config records that the
+// volume keeps the count, so that its file is not lost unnoticed; one made
+// before the count is started from the blocks its files hold.
+static bool openNonceBudget(FSConfig *fsConfig, const string &rootDir,
+                            const std::shared_ptr<Cipher> &cipher,
+                            const CipherKey &key) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (cipher->aeadHeaderSize() == 0 || opts.readOnly ||
+      opts.reverseEncryption) {
+    return true;
+  }
+  EncFSConfig *config = fsConfig->config.get();
+  auto budget = std::make_shared<NonceBudget>(rootDir, cipher, key);
+  auto seed = [&]() { return blocksUnder(rootDir, config->blockSize); };
+  if (!budget->open(config->nonceBudget, seed)) {
+    cerr << _("Unable to read how many blocks the volume key has sealed")
+         << "\n";
+    return false;
+  }
+  if (!config->nonceBudget) {
+    config->nonceBudget = true;
+    if (!saveConfig(Config_V6, rootDir, config, opts.config)) {
+      cerr << _("Unable to record the count of sealed blocks in the "
+                "configuration")
+           << "\n";
+      return false;
+    }
+  }
+  fsConfig->nonceBudget = budget;
+  return true;
+}
+
+// sizes the crypto pool and read-ahead window of a mount with --calibrate
+// that were not given, see MountCalibration
+static void calibrateMount(EncFS_Opts *opts,
+                           const std::shared_ptr<Cipher> &cipher,
+                           const CipherKey &key, int blockSize,
+                           const string &rootDir) {
+  bool readAhead = opts->calibrateReadAhead && !opts->noCache &&
+                   opts->blockCacheSize > 0;
+  if (!opts->calibrateCrypto && !readAhead) {
+    return;
+  }
+  // a reverse mount's rootDir belongs to the user, it gets no scratch file
+  bool writable = !opts->readOnly && !opts->reverseEncryption;
+  MountCalibration::Result result;
+  if (!MountCalibration::measure(cipher, key, blockSize, rootDir, writable,
+                                 &result)) {
+    RLOG(WARNING) << "unable to calibrate the mount, keeping its settings";
+    return;
+  }
+  if (result.latencyUs <= 0) {
+    VLOG(1) << "backing store latency unknown, keeping the settings";
+    return;
+  }
+
+  int cpus = 1;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    cpus = CPU_COUNT(&allowed);
+  }
+  if (opts->calibrateCrypto) {
+    opts->cryptoThreads = MountCalibration::cryptoThreads(
+        result, blockSize, opts->maxWrite, cpus);
+  }
+  if (readAhead) {
+    opts->readAheadBlocks = MountCalibration::readAheadBlocks(
+        result, blockSize, opts->blockCacheSize);
+  }
+  VLOG(1) << "calibrated: " << opts->cryptoThreads << " crypto threads, "
+          << opts->readAheadBlocks << " blocks read ahead";
+}
+
+// a journal left by an interrupted mount holds writes that were synced,
+// and must reach the backing files before anything reads them, whether or
+// not this mount journals.  False if it could not.
+static bool recoverWriteJournal(FSConfig *fsConfig, const string &rootDir) {
+  if (fsConfig->reverseEncryption) {
+    // the backing directory is plaintext, never journaled into
+    return true;
+  }
+  struct stat st;
+  string path = rootDir + WriteJournal::FileName;
+  if (lstat(path.c_str(), &st) != 0 || st.st_size == 0) {
+    return true;
+  }
+  if (fsConfig->opts->readOnly) {
+    cerr << _("The write journal of the volume holds writes of an "
+              "interrupted mount, mount it read-write once to replay them")
+         << "\n";
+    return false;
+  }
+  int res = WriteJournal::recover(rootDir);
+  if (res < 0) {
+    cerr << autosprintf(_("Unable to replay the write journal of the "
+                          "volume: %s"),
+                        strerror(-res))
+         << "\n";
+    return false;
+  }
+  return true;
+}
+
+// replays and opens the write journal of a mount with --write-journal,
+// false if it could not be.  Only volumes with block MACs, written
+// through the block stack, take one.  Without --write-journal a journal
+// left behind is still replayed.
+static bool openWriteJournal(FSConfig *fsConfig, const string &rootDir) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (!opts.writeJournal) {
+    return recoverWriteJournal(fsConfig, rootDir);
+  }
+  const EncFSConfig &config = *fsConfig->config;
+  if ((config.blockMACBytes == 0 && config.blockMACRandBytes == 0) ||
+      fsConfig->plainFiles || fsConfig->reverseEncryption || opts.readOnly) {
+    RLOG(WARNING) << "--write-journal only applies to writable volumes "
+                  << "with block MACs, not used";
+    return recoverWriteJournal(fsConfig, rootDir);
+  }
+  if (fsConfig->packStore || fsConfig->objectStore || opts.directIO) {
+    // packed files, object files and direct I/O do not write where the
+    // journal would
+    RLOG(WARNING) << "--write-journal is not used with packed files, "
+                  << "--object-store or direct I/O";
+    return recoverWriteJournal(fsConfig, rootDir);
+  }
+  auto journal = std::make_shared<WriteJournal>(rootDir);
+  if (!journal->open()) {
+    cerr << _("Unable to open the write journal of the volume") << "\n";
+    return false;
+  }
+  fsConfig->writeJournal = journal;
+  return true;
+}
+
+// opens the local cache of backing file chunks of a mount with
+// --ciphertext-cache, false if it could not be.  Only stored data that is
+// encrypted goes there.
+static bool openCiphertextCache(FSConfig *fsConfig) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (opts.ciphertextCachePath.empty()) {
+    return true;
+  }
+  if (fsConfig->plainFiles || fsConfig->reverseEncryption) {
+    RLOG(WARNING) << "--ciphertext-cache would hold plaintext, not used";
+    return true;
+  }
+  if (opts.directIO) {
+    RLOG(WARNING) << "--ciphertext-cache is not used with direct I/O";
+    return true;
+  }
+  bool opened = true;
+  fsConfig->ciphertextCache = shared(&gCiphertextCache, [&]() {
+    auto cache = std::make_shared<CiphertextCache>(
+        opts.ciphertextCachePath, (uint64_t)opts.ciphertextCacheSize);
+    opened = cache->open();
+    return opened ? cache : std::shared_ptr<CiphertextCache>();
+  });
+  if (!opened) {
+    // xgroup(diag)
+    cerr << autosprintf(_("Unable to open the ciphertext cache %s"),
+                        opts.ciphertextCachePath.c_str())
+         << "\n";
+    return false;
+  }
+  return true;
+}
+
+// opens the trash of a mount with --deferred-unlink, false if it could
+// not be
+static bool openReclaimer(FSConfig *fsConfig, const string &rootDir) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (opts.deferredUnlinkBytes == 0 || opts.readOnly ||
+      fsConfig->reverseEncryption) {
+    return true;
+  }
+  auto reclaimer =
+      std::make_shared<Reclaimer>(rootDir, (off_t)opts.deferredUnlinkBytes);
+  if (!reclaimer->open()) {
+    cerr << _("Unable to open the trash of the volume") << "\n";
+    return false;
+  }
+  fsConfig->reclaimer = reclaimer;
+  return true;
+}
+
+// indexes the large directories of a mount that changes them, so that
+// every change through it can be put in their indexes
+static void openDirIndex(FSConfig *fsConfig) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (opts.dirIndexEntries <= 0 || opts.readOnly || opts.noCache ||
+      fsConfig->reverseEncryption) {
+    return;
+  }
+  fsConfig->dirIndex = std::make_shared<DirIndex>(
+      fsConfig->cipher, fsConfig->key, (size_t)opts.dirIndexEntries,
+      (size_t)DirIndexMaxEntries);
+}
+
+// starts preloading the cache entries an earlier mount with
+// --warm-restart kept, once the caches are made
+static void openWarmCache(FSConfig *fsConfig, const string &rootDir) {
+  const EncFS_Opts &opts = *fsConfig->opts;
+  if (!opts.warmRestart || opts.readOnly || fsConfig->reverseEncryption ||
+      (!fsConfig->pathCache && !fsConfig->ivCache &&
+       !fsConfig->dirListCache)) {
+    return;
+  }
+  fsConfig->warmCache = std::make_shared<WarmCache>(
+      rootDir, fsConfig->cipher, fsConfig->key, fsConfig->pathCache,
+      fsConfig->ivCache, fsConfig->dirListCache);
+  fsConfig->warmCache->open();
+}
+
 RootPtr createV6Config(EncFS_Context *ctx,
                        const std::shared_ptr<EncFS_Opts> &opts) {
   const std::string rootDir = opts->rootDir;
@@ -1036,12 +1715,20 @@ RootPtr createV6Config(EncFS_Context *ctx,
   Interface nameIOIface;        // selectNameCoding()
   int blockMACBytes = 0;        // selectBlockMAC()
   int blockMACRandBytes = 0;    // selectBlockMAC()
+  int blockMACAlgorithm = BlockMAC_HMAC;  // selectBlockMAC()
   bool plainData = false;       // selectPlainData()
   bool uniqueIV = true;         // selectUniqueIV()
   bool chainedIV = true;        // selectChainedIV()
   bool externalIV = false;      // selectExternalChainedIV()
   bool allowHoles = true;       // selectZeroBlockPassThrough()
+  int compression = Compression_None;  // selectCompression()
+  int compressionChunk = 0;            // selectCompression()
+  int packThreshold = 0;               // selectPacking()
   long desiredKDFDuration = NormalKDFDuration;
+  int kdfAlgorithm = KDF_PBKDF2;  // selectKDF()
+  int kdfMemoryKiB = 0;           // selectKDF()
+  int kdfLanes = 0;               // selectKDF()
+  bool manualConfig = false;
 
   if (reverseEncryption) {
     chainedIV = false;
@@ -1061,12 +1748,16 @@ RootPtr createV6Config(EncFS_Context *ctx,
     cout << _("Paranoia configuration selected.") << "\n";
     // look for AES with 256 bit key..
     // Use block filename encryption mode.
-    // Enable per-block HMAC headers at substantial performance penalty..
+    // Authenticate every block, using AES-GCM if available, otherwise
+    // per-block HMAC headers at substantial performance penalty..
     // Enable per-file initialization vector headers.
     // Enable filename initialization vector chaning
     keySize = 256;
     blockSize = DefaultBlockSize;
-    alg = findCipherAlgorithm("AES", keySize);
+    alg = findCipherAlgorithm("AES-GCM", keySize);
+    if (alg.name.empty()) {
+      alg = findCipherAlgorithm("AES", keySize);
+    }
 
 // If case-insensitive system, opt for Block32 filename encoding
 #if defined(DEFAULT_CASE_INSENSITIVE)
@@ -1075,7 +1766,9 @@ RootPtr createV6Config(EncFS_Context *ctx,
     nameIOIface = BlockNameIO::CurrentInterface();
 #endif
 
-    blockMACBytes = 8;
+    if (!isAuthenticatedCipher(alg)) {
+      blockMACBytes = 8;
+    }
     blockMACRandBytes = 0;  // using uniqueIV, so this isn't necessary
     externalIV = true;
     desiredKDFDuration = ParanoiaKDFDuration;
@@ -1100,6 +1793,40 @@ RootPtr createV6Config(EncFS_Context *ctx,
     }
   }
 
+  // the preset is the floor, the benchmark picks the fastest meeting it
+  if (opts->autotune && answer[0] != 'x' && !alg.name.empty()) {
+    AutoTune::Floor floor;
+    floor.keySize = keySize;
+    floor.authenticate = blockMACBytes > 0 || isAuthenticatedCipher(alg);
+    floor.allowAead = !reverseEncryption;
+    AutoTune::Choice choice;
+    if (AutoTune::run(rootDir, floor, &choice)) {
+      // xgroup(setup)
+      cout << autosprintf(_("Fastest: %s with a %i bit key and %i byte "
+                            "blocks"),
+                          choice.alg.name.c_str(), choice.keySize,
+                          choice.blockSize);
+      if (choice.macBytes > 0) {
+        cout << (choice.macAlgorithm == BlockMAC_SipHash
+                     ? _(", SipHash-2-4 block MACs")
+                     : _(", HMAC-SHA1 block MACs"));
+      }
+      cout << "\n";
+      // xgroup(setup)
+      if (configMode != Config_Prompt ||
+          boolDefaultYes(_("Use this configuration?"))) {
+        alg = choice.alg;
+        keySize = choice.keySize;
+        blockSize = choice.blockSize;
+        blockMACBytes = choice.macBytes;
+        blockMACAlgorithm = choice.macAlgorithm;
+      }
+    } else {
+      // xgroup(setup)
+      cout << _("Keeping the preset configuration.") << "\n";
+    }
+  }
+
   if (answer[0] == 'x' || alg.name.empty()) {
     if (answer[0] != 'x') {
       // xgroup(setup)
@@ -1112,6 +1839,7 @@ RootPtr createV6Config(EncFS_Context *ctx,
       cout << _("Manual configuration mode selected.");
     }
     cout << endl;
+    manualConfig = true;
 
     // query user for settings..
     alg = selectCipherAlgorithm();
@@ -1150,8 +1878,27 @@ RootPtr createV6Config(EncFS_Context *ctx,
                << "\n";
           externalIV = false;
         }
-        selectBlockMAC(&blockMACBytes, &blockMACRandBytes, opts->requireMac);
+        if (isAuthenticatedCipher(alg)) {
+          // xgroup(setup)
+          cout << _("The selected cipher authenticates every block, "
+                    "block MAC headers are not needed.")
+               << "\n\n";
+        } else {
+          selectBlockMAC(&blockMACBytes, &blockMACRandBytes,
+                         &blockMACAlgorithm, opts->requireMac);
+        }
         allowHoles = selectZeroBlockPassThrough();
+        selectCompression(&compression, &compressionChunk);
+        if (compression != Compression_None && !allowHoles) {
+          // xgroup(setup)
+          cout << _("Compressed chunks only save space in file holes, "
+                    "enabling file-hole pass-through.")
+               << "\n\n";
+          allowHoles = true;
+        }
+        if (!reverseEncryption) {
+          packThreshold = selectPacking();
+        }
       }
     }
   }
@@ -1166,10 +1913,29 @@ RootPtr createV6Config(EncFS_Context *ctx,
   VLOG(1) << "Using cipher " << alg.name << ", key size " << keySize
           << ", block size " << blockSize;
 
+  if (manualConfig && cipher->hasArgon2()) {
+    selectKDF(&kdfAlgorithm, &kdfMemoryKiB, &kdfLanes);
+  }
+
+  if (reverseEncryption && cipher->aeadHeaderSize() > 0) {
+    cerr << autosprintf(
+        _("Cipher %s authenticates blocks, which is not supported for "
+          "reverse encryption"),
+        alg.name.c_str());
+    return rootInfo;
+  }
+
+  // whether the volume uses formats that releases before them would misread
+  // rather than refuse, see SSL_Cipher.cpp
+  bool newFormats = blockMACAlgorithm != BlockMAC_HMAC ||
+                    kdfAlgorithm != KDF_PBKDF2 ||
+                    compression != Compression_None || packThreshold != 0 ||
+                    !opts->objectStoreUrl.empty();
+
   std::shared_ptr<EncFSConfig> config(new EncFSConfig);
 
   config->cfgType = Config_V6;
-  config->cipherIface = cipher->interface();
+  config->cipherIface = cipher->volumeInterface(blockSize, newFormats);
   config->keySize = keySize;
   config->blockSize = blockSize;
   config->plainData = plainData;
@@ -1178,14 +1944,22 @@ RootPtr createV6Config(EncFS_Context *ctx,
   config->subVersion = V6SubVersion;
   config->blockMACBytes = blockMACBytes;
   config->blockMACRandBytes = blockMACRandBytes;
+  config->blockMACAlgorithm = blockMACAlgorithm;
   config->uniqueIV = uniqueIV;
   config->chainedNameIV = chainedIV;
   config->externalIVChaining = externalIV;
   config->allowHoles = allowHoles;
+  config->compression = compression;
+  config->compressionChunk = compressionChunk;
+  config->packThreshold = packThreshold;
+  config->objectStore = !opts->objectStoreUrl.empty();
 
   config->salt.clear();
   config->kdfIterations = 0;  // filled in by keying function
   config->desiredKDFDuration = desiredKDFDuration;
+  config->kdfAlgorithm = kdfAlgorithm;
+  config->kdfMemoryKiB = kdfMemoryKiB;
+  config->kdfLanes = kdfLanes;
 
   cout << "\n";
   // xgroup(setup)
@@ -1279,6 +2053,102 @@ RootPtr createV6Config(EncFS_Context *ctx,
   fsConfig->reverseEncryption = reverseEncryption;
   fsConfig->idleTracking = enableIdleTracking;
   fsConfig->opts = opts;
+  calibrateMount(opts.get(), cipher, volumeKey, config->blockSize, rootDir);
+  if (!opts->noCache && opts->blockCacheSize > 0) {
+    fsConfig->blockCache = shared(&gBlockCache, [&]() {
+      return std::make_shared<BlockCache>(
+          opts->blockCacheSize,
+          BlockCache::shardsFor(opts->blockCacheSize, config->blockSize));
+    });
+    if (opts->readAheadBlocks > 0 || opts->openPrefetchBlocks > 0) {
+      fsConfig->readAheadPool = shared(&gReadAheadPool, []() {
+        return std::make_shared<ThreadPool>(ReadAheadThreads);
+      });
+    }
+  }
+  if (!opts->noCache && !reverseEncryption) {
+    fsConfig->ivCache = std::make_shared<FileIVCache>(IVCacheEntries);
+
+    size_t fdEntries = FdCacheEntries;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 4 < fdEntries) {
+      fdEntries = limit.rlim_cur / 4;
+    }
+    if (fdEntries > 0) {
+      fsConfig->fdCache =
+          std::make_shared<FdCache>(fdEntries, FdCacheMaxAgeSecs);
+      fsConfig->dirFdCache = std::make_shared<DirFdCache>(
+          std::min<size_t>(DirFdCacheEntries, fdEntries / 2 + 1));
+    }
+  }
+  if (!opts->noCache) {
+    fsConfig->pathCache = std::make_shared<PathCache>(PathCacheEntries);
+    fsConfig->linkCache = std::make_shared<LinkCache>(LinkCacheEntries);
+    // listings hold only while their directory has the times it was read
+    // with, which a reverse mount's source directory keeps, and pay for
+    // encrypting its names once
+    fsConfig->dirListCache = std::make_shared<DirListCache>(DirListCacheNames);
+  }
+  if (opts->groupSyncUs >= 0) {
+    fsConfig->syncBatcher = std::make_shared<SyncBatcher>(opts->groupSyncUs);
+  }
+  // in reverse mode names come and go behind our back
+  if (!opts->noCache && !reverseEncryption && opts->negativeTimeoutMs > 0) {
+    fsConfig->negativeCache = std::make_shared<NegativeCache>(
+        NegativeCacheEntries, opts->negativeTimeoutMs);
+  }
+  if (!opts->noCache && !reverseEncryption && opts->attrTtlMs > 0) {
+    fsConfig->attrCache =
+        std::make_shared<AttrCache>(AttrCacheEntries, opts->attrTtlMs);
+    fsConfig->xattrCache =
+        std::make_shared<XattrCache>(XattrCacheEntries, opts->attrTtlMs);
+    fsConfig->statAheadPool = shared(&gStatAheadPool, []() {
+      return std::make_shared<ThreadPool>(StatAheadThreads);
+    });
+  }
+  if (!opts->noCache && !reverseEncryption && opts->hotCacheSize > 0) {
+    fsConfig->hotCache = std::make_shared<HotFileCache>(
+        opts->hotCacheSize, opts->pinnedPaths, opts->hotOpens);
+  }
+  if (opts->cryptoThreads > 0) {
+    fsConfig->cryptoPool = shared(&gCryptoPool, [&]() {
+      return std::make_shared<ThreadPool>(opts->cryptoThreads, opts->numaPin);
+    });
+  }
+  if (!reverseEncryption && !opts->readOnly) {
+    fsConfig->writePool = shared(&gWritePool, []() {
+      return std::make_shared<ThreadPool>(WritePipelineThreads);
+    });
+  }
+  if (!openPackStore(fsConfig.get(), rootDir, cipher, volumeKey) ||
+      !openObjectStore(fsConfig.get(), rootDir, cipher, volumeKey) ||
+      !openNonceBudget(fsConfig.get(), rootDir, cipher, volumeKey)) {
+    return rootInfo;
+  }
+  detectPlainVolume(fsConfig.get());
+  if (!openWriteJournal(fsConfig.get(), rootDir)) {
+    return rootInfo;
+  }
+  if (!openCiphertextCache(fsConfig.get())) {
+    return rootInfo;
+  }
+  if (!openReclaimer(fsConfig.get(), rootDir)) {
+    return rootInfo;
+  }
+  openDirIndex(fsConfig.get());
+  openWarmCache(fsConfig.get(), rootDir);
+  if (!opts->digestCachePath.empty()) {
+    auto digests = std::make_shared<DigestCache>(opts->digestCachePath);
+    if (!digests->open()) {
+      // xgroup(diag)
+      cerr << autosprintf(_("Unable to open the digest cache %s"),
+                          opts->digestCachePath.c_str())
+           << "\n";
+      return rootInfo;
+    }
+    fsConfig->digestCache = digests;
+  }
 
   rootInfo = std::make_shared<encfs::EncFS_Root>();
   rootInfo->cipher = cipher;
@@ -1345,7 +2215,15 @@ void showFSInfo(const EncFSConfig *config) {
       cout << "\n";
     }
   }
-  if (config->kdfIterations > 0 && !config->salt.empty()) {
+  if (config->kdfAlgorithm == KDF_Argon2id) {
+    cout << autosprintf(
+                _("Using Argon2id, with %i passes over %i MiB in %i lanes"),
+                config->kdfIterations, config->kdfMemoryKiB / 1024,
+                config->kdfLanes)
+         << "\n";
+    cout << autosprintf(_("Salt Size: %i bits"), (int)(8 * config->salt.size()))
+         << "\n";
+  } else if (config->kdfIterations > 0 && !config->salt.empty()) {
     cout << autosprintf(_("Using PBKDF2, with %i iterations"),
                         config->kdfIterations)
          << "\n";
@@ -1369,6 +2247,18 @@ void showFSInfo(const EncFSConfig *config) {
                   config->blockMACBytes + config->blockMACRandBytes)
            << endl;
     }
+    if (config->blockMACBytes != 0 &&
+        config->blockMACAlgorithm == BlockMAC_SipHash) {
+      // xgroup(diag)
+      cout << _("Block MACs computed with SipHash-2-4.\n");
+    }
+  } else if (cipher && cipher->aeadHeaderSize() > 0) {
+    cout << autosprintf(
+                // xgroup(diag)
+                _("Block Size: %i bytes, including %i byte authentication "
+                  "header"),
+                config->blockSize, cipher->aeadHeaderSize())
+         << endl;
   } else {
     // xgroup(diag)
     cout << autosprintf(_("Block Size: %i bytes"), config->blockSize);
@@ -1391,6 +2281,28 @@ void showFSInfo(const EncFSConfig *config) {
     // xgroup(diag)
     cout << _("File holes passed through to ciphertext.\n");
   }
+  if (config->compression != Compression_None) {
+    cout << autosprintf(
+        // xgroup(diag)
+        _("File data compressed with %s, in chunks of %i bytes"),
+        CompressedFileIO::algorithmName(config->compression),
+        config->compressionChunk);
+    if (!CompressedFileIO::supported(config->compression)) {
+      // xgroup(diag)
+      cout << _(" (NOT supported)\n");
+    } else {
+      cout << "\n";
+    }
+  }
+  if (config->packThreshold != 0) {
+    cout << autosprintf(
+                // xgroup(diag)
+                _("Files of up to %i bytes packed together"),
+                config->packThreshold)
+         << "\n";
+  }
+  // xgroup(diag)
+  cout << autosprintf(_("Crypto: %s"), cryptoCapabilities().c_str()) << "\n";
   cout << "\n";
 }
 std::shared_ptr<Cipher> EncFSConfig::getCipher() const {
@@ -1442,8 +2354,20 @@ CipherKey EncFSConfig::makeKey(const char *password, int passwdLen) {
       return userKey;
     }
 
-    userKey = cipher->newKey(password, passwdLen, kdfIterations,
-                             desiredKDFDuration, getSaltData(), salt.size());
+    if (kdfAlgorithm == KDF_Argon2id) {
+      userKey = cipher->newArgon2Key(password, passwdLen, kdfIterations,
+                                     kdfMemoryKiB, kdfLanes,
+                                     desiredKDFDuration, getSaltData(),
+                                     salt.size());
+      if (!userKey) {
+        // xgroup(diag)
+        cerr << _("Argon2id key derivation failed, or is not supported by "
+                  "this build of OpenSSL\n");
+      }
+    } else {
+      userKey = cipher->newKey(password, passwdLen, kdfIterations,
+                               desiredKDFDuration, getSaltData(), salt.size());
+    }
   } else {
     userKey = cipher->newKey(password, passwdLen);
   }
@@ -1505,17 +2429,18 @@ std::string readPassword(int FD) {
   return result;
 }
 
-CipherKey EncFSConfig::getUserKey(const std::string &passProg,
-                                  const std::string &rootDir) {
+// runs the password program and reads what it prints
+static bool runPasswordProgram(const std::string &passProg,
+                               const std::string &rootDir,
+                               std::string *password) {
   // have a child process run the command and get the result back to us.
   int fds[2], pid;
   int res;
-  CipherKey result;
 
   res = socketpair(PF_UNIX, SOCK_STREAM, 0, fds);
   if (res == -1) {
     perror(_("Internal error: socketpair() failed"));
-    return result;
+    return false;
   }
   VLOG(1) << "getUserKey: fds = " << fds[0] << ", " << fds[1];
 
@@ -1524,7 +2449,7 @@ CipherKey EncFSConfig::getUserKey(const std::string &passProg,
     perror(_("Internal error: fork() failed"));
     close(fds[0]);
     close(fds[1]);
-    return result;
+    return false;
   }
 
   if (pid == 0) {
@@ -1567,13 +2492,21 @@ CipherKey EncFSConfig::getUserKey(const std::string &passProg,
   }
 
   close(fds[0]);
-  string password = readPassword(fds[1]);
+  *password = readPassword(fds[1]);
   close(fds[1]);
 
   waitpid(pid, nullptr, 0);
+  return true;
+}
 
-  // convert to key..
-  result = makeKey(password.c_str(), password.length());
+CipherKey EncFSConfig::getUserKey(const std::string &passProg,
+                                  const std::string &rootDir) {
+  CipherKey result;
+  string password;
+  if (runPasswordProgram(passProg, rootDir, &password)) {
+    // convert to key..
+    result = makeKey(password.c_str(), password.length());
+  }
 
   // clear buffer..
   password.assign(password.length(), '\0');
@@ -1581,6 +2514,32 @@ CipherKey EncFSConfig::getUserKey(const std::string &passProg,
   return result;
 }
 
+bool readUserPassword(const EncFS_Opts &opts, std::string *password) {
+  if (!opts.passwordProgram.empty()) {
+    return runPasswordProgram(opts.passwordProgram, opts.rootDir, password);
+  }
+
+  char passBuf[MaxPassBuf];
+  char *res;
+  if (opts.useStdin) {
+    res = fgets(passBuf, sizeof(passBuf), stdin);
+    // Kill the trailing newline.
+    if (res != nullptr && passBuf[0] != '\0' &&
+        passBuf[strlen(passBuf) - 1] == '\n') {
+      passBuf[strlen(passBuf) - 1] = '\0';
+    }
+  } else {
+    // xgroup(common)
+    res = readpassphrase(_("EncFS Password: "), passBuf, sizeof(passBuf),
+                         RPP_ECHO_OFF);
+  }
+  if (res != nullptr) {
+    password->assign(passBuf);
+  }
+  memset(passBuf, 0, sizeof(passBuf));
+  return res != nullptr;
+}
+
 CipherKey EncFSConfig::getNewUserKey() {
   CipherKey userKey;
   char passBuf[MaxPassBuf];
@@ -1612,8 +2571,10 @@ CipherKey EncFSConfig::getNewUserKey() {
 RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
   RootPtr rootInfo;
   std::shared_ptr<EncFSConfig> config(new EncFSConfig);
+  StartupTimer timer("filesystem init");
 
   if (readConfig(opts->rootDir, config.get(), opts->config) != Config_None) {
+    timer.step("read config");
     if (config->blockMACBytes == 0 && opts->requireMac) {
       cout << _(
           "The configuration disabled MAC, but you passed --require-macs\n");
@@ -1646,6 +2607,39 @@ RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
       cout << _("The requested cipher interface is not available\n");
       return rootInfo;
     }
+    timer.step("cipher");
+
+    if (config->compression != Compression_None) {
+      if (!CompressedFileIO::supported(config->compression) ||
+          config->compressionChunk < MinCompressionChunk ||
+          config->compressionChunk > MaxCompressionChunk) {
+        cerr << autosprintf(
+            _("Unable to read data compressed with %s, in chunks of %i "
+              "bytes"),
+            CompressedFileIO::algorithmName(config->compression),
+            config->compressionChunk)
+             << "\n";
+        return rootInfo;
+      }
+      if (opts->reverseEncryption) {
+        cerr << _("Compressed volumes can not be used in reverse mode")
+             << "\n";
+        return rootInfo;
+      }
+    }
+    if (config->packThreshold != 0) {
+      if (config->packThreshold < MinPackThreshold ||
+          config->packThreshold > MaxPackThreshold) {
+        cerr << autosprintf(_("Unable to read files packed up to %i bytes"),
+                            config->packThreshold)
+             << "\n";
+        return rootInfo;
+      }
+      if (opts->reverseEncryption) {
+        cerr << _("Packed volumes can not be used in reverse mode") << "\n";
+        return rootInfo;
+      }
+    }
 
     if (opts->delayMount) {
       rootInfo = std::make_shared<encfs::EncFS_Root>();
@@ -1654,33 +2648,52 @@ RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
       return rootInfo;
     }
 
-    // get user key
-    CipherKey userKey;
+    // a volume key kept from an earlier mount saves the password and the
+    // key derivation
+    CipherKey volumeKey;
+    if (opts->keyCacheSeconds > 0) {
+      volumeKey = KeyCache::fetch(cipher, *config);
+      timer.step("keyring");
+    }
 
-    if (opts->passwordProgram.empty()) {
-      VLOG(1) << "useStdin: " << opts->useStdin;
-      if (opts->annotate) {
-        cerr << "$PROMPT$ passwd" << endl;
+    if (!volumeKey) {
+      // get user key
+      CipherKey userKey;
+
+      if (!opts->password.empty()) {
+        userKey = config->makeKey(opts->password.data(),
+                                  (int)opts->password.size());
+      } else if (opts->passwordProgram.empty()) {
+        VLOG(1) << "useStdin: " << opts->useStdin;
+        if (opts->annotate) {
+          cerr << "$PROMPT$ passwd" << endl;
+        }
+        userKey = config->getUserKey(opts->useStdin);
+      } else {
+        userKey = config->getUserKey(opts->passwordProgram, opts->rootDir);
       }
-      userKey = config->getUserKey(opts->useStdin);
-    } else {
-      userKey = config->getUserKey(opts->passwordProgram, opts->rootDir);
-    }
 
-    if (!userKey) {
-      return rootInfo;
-    }
+      if (!userKey) {
+        return rootInfo;
+      }
+      timer.step("user key");
 
-    VLOG(1) << "cipher key size = " << cipher->encodedKeySize();
-    // decode volume key..
-    CipherKey volumeKey =
-        cipher->readKey(config->getKeyData(), userKey, opts->checkKey);
-    userKey.reset();
+      VLOG(1) << "cipher key size = " << cipher->encodedKeySize();
+      // decode volume key..
+      volumeKey =
+          cipher->readKey(config->getKeyData(), userKey, opts->checkKey);
+      userKey.reset();
 
-    if (!volumeKey) {
-      // xgroup(diag)
-      cout << _("Error decoding volume key, password incorrect\n");
-      return rootInfo;
+      if (!volumeKey) {
+        // xgroup(diag)
+        cout << _("Error decoding volume key, password incorrect\n");
+        return rootInfo;
+      }
+      timer.step("volume key");
+
+      if (opts->keyCacheSeconds > 0) {
+        KeyCache::store(cipher, *config, volumeKey, opts->keyCacheSeconds);
+      }
     }
 
     std::shared_ptr<NameIO> nameCoder =
@@ -1699,6 +2712,7 @@ RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
 
     nameCoder->setChainedNameIV(config->chainedNameIV);
     nameCoder->setReverseEncryption(opts->reverseEncryption);
+    timer.step("name coding");
 
     FSConfigPtr fsConfig(new FSConfig);
     if (config->plainData) {
@@ -1718,11 +2732,96 @@ RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
     fsConfig->forceDecode = opts->forceDecode;
     fsConfig->reverseEncryption = opts->reverseEncryption;
     fsConfig->opts = opts;
+    calibrateMount(opts.get(), cipher, volumeKey, config->blockSize,
+                   opts->rootDir);
+    if (!opts->noCache && opts->blockCacheSize > 0) {
+      fsConfig->blockCache = shared(&gBlockCache, [&]() {
+        return std::make_shared<BlockCache>(
+            opts->blockCacheSize,
+            BlockCache::shardsFor(opts->blockCacheSize, config->blockSize));
+      });
+      if (opts->readAheadBlocks > 0 || opts->openPrefetchBlocks > 0) {
+        fsConfig->readAheadPool = shared(&gReadAheadPool, []() {
+          return std::make_shared<ThreadPool>(ReadAheadThreads);
+        });
+      }
+    }
+    if (!opts->noCache && !opts->reverseEncryption) {
+      fsConfig->ivCache = std::make_shared<FileIVCache>(IVCacheEntries);
+      fsConfig->dirFdCache = std::make_shared<DirFdCache>(DirFdCacheEntries);
+    }
+    if (!opts->noCache) {
+      fsConfig->pathCache = std::make_shared<PathCache>(PathCacheEntries);
+      fsConfig->linkCache = std::make_shared<LinkCache>(LinkCacheEntries);
+      fsConfig->dirListCache =
+          std::make_shared<DirListCache>(DirListCacheNames);
+    }
+    if (!opts->noCache && !opts->reverseEncryption &&
+        opts->negativeTimeoutMs > 0) {
+      fsConfig->negativeCache = std::make_shared<NegativeCache>(
+          NegativeCacheEntries, opts->negativeTimeoutMs);
+    }
+    if (!opts->noCache && !opts->reverseEncryption && opts->attrTtlMs > 0) {
+      fsConfig->attrCache =
+          std::make_shared<AttrCache>(AttrCacheEntries, opts->attrTtlMs);
+      fsConfig->xattrCache =
+          std::make_shared<XattrCache>(XattrCacheEntries, opts->attrTtlMs);
+      fsConfig->statAheadPool = shared(&gStatAheadPool, []() {
+        return std::make_shared<ThreadPool>(StatAheadThreads);
+      });
+    }
+    if (!opts->noCache && !opts->reverseEncryption &&
+        opts->hotCacheSize > 0) {
+      fsConfig->hotCache = std::make_shared<HotFileCache>(
+          opts->hotCacheSize, opts->pinnedPaths, opts->hotOpens);
+    }
+    if (opts->cryptoThreads > 0) {
+      fsConfig->cryptoPool = shared(&gCryptoPool, [&]() {
+        return std::make_shared<ThreadPool>(opts->cryptoThreads,
+                                            opts->numaPin);
+      });
+    }
+    if (!opts->reverseEncryption && !opts->readOnly) {
+      fsConfig->writePool = shared(&gWritePool, []() {
+        return std::make_shared<ThreadPool>(WritePipelineThreads);
+      });
+    }
+    if (!openPackStore(fsConfig.get(), opts->rootDir, cipher, volumeKey) ||
+        !openObjectStore(fsConfig.get(), opts->rootDir, cipher,
+                         volumeKey) ||
+        !openNonceBudget(fsConfig.get(), opts->rootDir, cipher, volumeKey)) {
+      return rootInfo;
+    }
+    detectPlainVolume(fsConfig.get());
+    if (!openWriteJournal(fsConfig.get(), opts->rootDir)) {
+      return rootInfo;
+    }
+    if (!openCiphertextCache(fsConfig.get())) {
+      return rootInfo;
+    }
+    if (!openReclaimer(fsConfig.get(), opts->rootDir)) {
+      return rootInfo;
+    }
+    openDirIndex(fsConfig.get());
+    openWarmCache(fsConfig.get(), opts->rootDir);
+    timer.step("packs");
+    if (!opts->digestCachePath.empty()) {
+      auto digests = std::make_shared<DigestCache>(opts->digestCachePath);
+      if (!digests->open()) {
+        // xgroup(diag)
+        cerr << autosprintf(_("Unable to open the digest cache %s"),
+                            opts->digestCachePath.c_str())
+             << "\n";
+        return rootInfo;
+      }
+      fsConfig->digestCache = digests;
+    }
 
     rootInfo = std::make_shared<encfs::EncFS_Root>();
     rootInfo->cipher = cipher;
     rootInfo->volumeKey = volumeKey;
     rootInfo->root = std::make_shared<DirNode>(ctx, opts->rootDir, fsConfig);
+    timer.step("caches and root");
   } else {
     if (opts->createIfNotFound) {
       // creating a new encrypted filesystem
@@ -4,10 +4,12 @@
 #include <memory>
 #include <string>
 #include <sys/types.h>
+#include <vector>
 
 #include "CipherKey.h"
 #include "FSConfig.h"
 #include "Interface.h"
+#include "MemoryPool.h"
 #include "encfs.h"
 
 namespace encfs {
@@ -42,6 +44,72 @@ namespace encfs {
     using RootPtr = std::shared_ptr<EncFS_Root>;
     enum ConfigMode { Config_Prompt, Config_Standard, Config_Paranoia };
 
+    // default budget for the decoded block cache, see --blockcache
+    const long DefaultBlockCacheSize = 16 * 1024 * 1024;
+    // files whose decoded header is kept, see FileIVCache
+    const int IVCacheEntries = 4096;
+    // plaintext paths whose encoding is kept, see PathCache
+    const int PathCacheEntries = 16384;
+    // symlinks whose decoded target is kept, see LinkCache
+    const int LinkCacheEntries = 4096;
+    // names remembered as missing, see NegativeCache
+    const int NegativeCacheEntries = 16384;
+    // released backing files kept open, see FdCache, at most a quarter
+    // of the process's descriptor limit
+    const int FdCacheEntries = 256;
+    // backing directories kept open for *at() syscalls, see DirFdCache
+    const int DirFdCacheEntries = 128;
+    // names of decoded directory listings kept, see DirListCache
+    const int DirListCacheNames = 65536;
+    // seconds a released descriptor is kept
+    const int FdCacheMaxAgeSecs = 10;
+    // default for --negative-timeout
+    const int DefaultNegativeTimeoutMs = 1000;
+    // closed files whose attributes are kept, see AttrCache
+    const int AttrCacheEntries = 16384;
+    // files whose extended attributes are kept, see XattrCache
+    const int XattrCacheEntries = 4096;
+    // default for --attr-ttl
+    const int DefaultAttrTtlMs = 1000;
+    // default for --statfs-cache
+    const int DefaultStatfsCacheMs = 1000;
+    // default for --hot-opens
+    const int DefaultHotOpens = 4;
+    // default read-ahead window in blocks, see --readahead
+    const int DefaultReadAheadBlocks = 32;
+    // threads prefetching blocks, shared by all open files
+    const int ReadAheadThreads = 2;
+    // threads stat'ing listed names ahead of their getattrs, shared by
+    // all listings, see DirNode::cacheAttr
+    const int StatAheadThreads = 4;
+    // threads storing the runs of long writes, shared by all open files
+    const int WritePipelineThreads = 4;
+    // default for --ciphertext-cache-size
+    const long DefaultCiphertextCacheSize = 1024L * 1024 * 1024;
+    // default for --object-cache-size
+    const long DefaultObjectCacheSize = 256L * 1024 * 1024;
+    // names held by the indexes of all directories with --dir-index
+    const long DirIndexMaxEntries = 4L * 1024 * 1024;
+    // default for --reverse-check, like the kernel's own attribute cache
+    const int DefaultReverseCheckMs = 1000;
+    // largest write request asked of the kernel, see --max-write.  1 MiB
+    // needs max_pages (Linux 4.20, libfuse 3); otherwise it is lowered to
+    // 128 KiB.
+    const int DefaultMaxWrite = 1024 * 1024;
+    // background requests (read-ahead, async writes) the kernel queues
+    // before it throttles, see --max-background
+    const int DefaultMaxBackground = 64;
+    // FUSE worker threads of a multi-threaded mount, and those of them
+    // kept when idle, see --fuse-threads and FuseLoop
+    const int DefaultFuseThreads = 10;
+    const int DefaultMaxIdleThreads = 10;
+    // with --interactive, writes larger than this are made in slices of
+    // whole blocks, the file unlocked between them
+    const int InteractiveWriteSlice = 256 * 1024;
+
+    // transfers that go through pipes rather than copies, see --splice
+    enum SpliceFlags { SpliceRead = 1, SpliceWrite = 2, SpliceMove = 4 };
+
     /**
      * EncFS_Opts store internal settings
      *
@@ -63,11 +131,15 @@ namespace encfs {
         bool forceDecode;           // force decode on MAC block failures
 
         std::string passwordProgram;    // path to password program (or empty)
+        std::string password;       // read by the caller for several
+                                    // volumes, see --volumes, or empty
         bool useStdin;              // read password from stdin rather then
                                     // prompting
         bool annotate;              // print annotation line prompt to stderr.
 
         bool ownerCreate;           // set owner of new files to caller
+        bool defaultPermissions;    // the kernel checks permissions itself
+                                    // (-o default_permissions)
         
         bool reverseEncryption;     // Reverse encryption
 
@@ -77,6 +149,108 @@ namespace encfs {
                                       behind the back of EncFS (for example, in reverse mode).
                                       See main.cpp for longer explaination.
                                     */
+        long blockCacheSize;        // bytes of decoded blocks to cache,
+                                    // shared by all open files
+        int readAheadBlocks;        // blocks to prefetch into the block
+                                    // cache on sequential reads, 0 = off
+        int openPrefetchBlocks;     // leading blocks prefetched when a
+                                    // file is opened for reading, 0 = off
+        int cryptoThreads;          // workers coding blocks of large
+                                    // requests, and names of directory
+                                    // listings, in parallel, 0 = off
+        bool calibrateCrypto;       // size cryptoThreads and
+        bool calibrateReadAhead;    // readAheadBlocks as the volume is
+                                    // mounted, see MountCalibration
+        bool kernelCrypto;          // code file blocks with the kernel's
+                                    // crypto API, see KernelCrypto
+        bool numaPin;               // pin FUSE and crypto workers to
+                                    // their NUMA nodes, see Numa
+        bool writeBack;             // merge small writes to the last block
+                                    // of a file before coding it
+        bool ioUring;               // backing file I/O through io_uring
+        bool directIO;              // open backing files with O_DIRECT
+        bool mmapReads;             // read-only mounts read through mmap
+        bool syncTruncate;          // fsync backing files on truncate
+        bool interactive;           // hold locks briefly rather than make
+                                    // long operations fast, see
+                                    // InteractiveWriteSlice
+        int reverseCheckMs;         // reverse mode: how often cached blocks
+                                    // are checked against the source file
+        long poolCacheSize;         // bytes of freed buffers kept for reuse
+        bool lazyWipe;              // clear freed buffers on reuse, see
+                                    // MemoryPool::WipeLazily
+        long lockedBuffers;         // bytes of buffers taken from locked
+                                    // memory, 0 = off
+        int negativeTimeoutMs;      // how long names found missing are
+                                    // remembered as such, 0 = not at all
+        int attrTtlMs;              // how long attributes of closed files
+                                    // are kept, 0 = not at all
+        int statfsCacheMs;          // how long a statfs result is kept,
+                                    // 0 = not at all
+        long hotCacheSize;          // bytes of decoded copies of hot
+                                    // files, 0 = off
+        std::vector<std::string> pinnedPaths;  // plaintext paths whose
+                                    // files go in the hot file cache
+        int hotOpens;               // opens after which a file goes in
+                                    // the hot file cache, 0 = never
+        std::vector<std::string> uncachedPatterns;  // globs of plaintext
+                                    // paths opened past the kernel's page
+                                    // cache (FUSE direct_io)
+        long uncachedBytes;         // files at least this large opened
+                                    // the same way, 0 = by size never
+        std::string digestCachePath;  // reverse mode: journal of the
+                                    // digests of encoded files, or empty
+        std::string ciphertextCachePath;  // local directory caching chunks
+                                    // of backing files, or empty, see
+                                    // CiphertextCache
+        long ciphertextCacheSize;   // bytes it holds at most
+        std::string objectStoreUrl; // S3 compatible store holding the data
+                                    // of the files, or empty, see
+                                    // ObjectStore
+        long objectCacheSize;       // bytes of chunks it keeps in memory
+        long dirIndexEntries;       // directories of this many names get
+                                    // a name index, 0 = none, see
+                                    // DirIndex
+        bool skipUnchanged;         // skip rewriting blocks whose cached
+                                    // plaintext is the same
+        long cacheMemory;           // bytes the block and hot file caches
+                                    // and the buffer pool share, see
+                                    // MemoryGovernor, 0 = each its own
+        bool memoryPressure;        // shrink the caches of their own sizes
+                                    // under memory pressure, see
+                                    // MemoryGovernor
+        int keyCacheSeconds;        // how long the volume key is kept in
+                                    // the kernel keyring, 0 = not kept
+        int groupSyncUs;            // how long an fsync waits for others
+                                    // to join it, -1 = not batched
+        bool warmRestart;           // keep hot cache entries from one
+                                    // mount to the next, see WarmCache
+        bool pushReadahead;         // store read-ahead in the kernel's
+                                    // page cache (--lowlevel only)
+        bool writeJournal;          // log writes of MAC volumes to a
+                                    // journal, see WriteJournal
+        long deferredUnlinkBytes;   // files at least this large are
+                                    // unlinked in the background, see
+                                    // Reclaimer, 0 = none
+        int maxWrite;               // largest write request, in bytes
+        int maxRead;                // largest read request, 0 = kernel's
+        int maxReadahead;           // kernel read-ahead, 0 = kernel's
+        int maxBackground;          // background requests in flight
+        int congestionThreshold;    // background requests at which the
+                                    // kernel throttles, 0 = 3/4 of max
+        bool bigWrites;             // allow writes larger than a page
+        int splice;                 // SpliceFlags to ask for
+        bool cloneFd;               // a /dev/fuse channel per worker
+        int fuseThreads;            // most FUSE workers, with cloneFd
+        int maxIdleThreads;         // FUSE workers kept when idle
+        int shards;                 // threads serving the requests of a
+                                    // node each, pinned to a core, with
+                                    // cloneFd; 0 = served by the workers
+        int asyncRequests;          // low-level frontend: threads serving
+                                    // reads, writes and syncs off the
+                                    // FUSE threads, 0 = in place
+        bool writebackCache;        // the kernel caches writes, and with
+                                    // them file sizes and mtimes
         bool readOnly;              // Mount read-only
 
         bool insecure;              // Allow to use plain data / to disable
@@ -84,6 +258,8 @@ namespace encfs {
         bool requreMac;             // Throw an error if MAC is disabled
 
         ConfigMode configMode;     
+        bool autotune;              // new volumes: benchmark the settings
+                                    // meeting configMode, see AutoTune
         std::string config;         // path to configuration file (or empty)
 
         EncFS_Opts() {
@@ -97,9 +273,60 @@ namespace encfs {
             useStdin = false;
             annotate = false;
             ownerCreate = false;
+            defaultPermissions = false;
             reverseEncryption = false;
             configMode = Config_Prompt;
+            autotune = false;
             noCache = false;
+            blockCacheSize = DefaultBlockCacheSize;
+            readAheadBlocks = DefaultReadAheadBlocks;
+            openPrefetchBlocks = 0;
+            cryptoThreads = 0;
+            calibrateCrypto = false;
+            calibrateReadAhead = false;
+            kernelCrypto = false;
+            numaPin = false;
+            writeBack = true;
+            ioUring = false;
+            directIO = false;
+            mmapReads = true;
+            syncTruncate = false;
+            interactive = false;
+            reverseCheckMs = DefaultReverseCheckMs;
+            poolCacheSize = MemoryPool::DefaultMaxCachedBytes;
+            lazyWipe = false;
+            lockedBuffers = 0;
+            negativeTimeoutMs = DefaultNegativeTimeoutMs;
+            attrTtlMs = DefaultAttrTtlMs;
+            statfsCacheMs = DefaultStatfsCacheMs;
+            hotCacheSize = 0;
+            hotOpens = DefaultHotOpens;
+            uncachedBytes = 0;
+            skipUnchanged = false;
+            ciphertextCacheSize = DefaultCiphertextCacheSize;
+            objectCacheSize = DefaultObjectCacheSize;
+            dirIndexEntries = 0;
+            cacheMemory = 0;
+            memoryPressure = false;
+            keyCacheSeconds = 0;
+            groupSyncUs = -1;
+            warmRestart = false;
+            pushReadahead = false;
+            writeJournal = false;
+            deferredUnlinkBytes = 0;
+            maxWrite = DefaultMaxWrite;
+            maxRead = 0;
+            maxReadahead = 0;
+            maxBackground = DefaultMaxBackground;
+            congestionThreshold = 0;
+            bigWrites = true;
+            splice = SpliceWrite;
+            cloneFd = true;
+            fuseThreads = DefaultFuseThreads;
+            maxIdleThreads = DefaultMaxIdleThreads;
+            shards = 0;
+            asyncRequests = 0;
+            writebackCache = false;
             readOnly = false;
             insecure = false;
             requreMac = false;
@@ -109,8 +336,8 @@ namespace encfs {
     /*
      * Read existing config file. Looks for any supported configuration version.
      */
-    configType readConfig(const std::string& rootDir, EncFSConfig* config,
-                          const std::stirng& cmdConfig);
+    ConfigType readConfig(const std::string& rootDir, EncFSConfig* config,
+                          const std::string& cmdConfig);
 
     /*
      * Save the configuration. Saves back as the same configuration type as was
@@ -119,10 +346,24 @@ namespace encfs {
     bool saveConfig(ConfigType type, const std::string& rootdir,
                     const EncFSConfig* config, const std::string& cmdConfig);
 
+    /*
+     * Make a binary copy of the V6 configuration next to it, which later
+     * reads take instead of parsing the XML.  See ConfigSidecar.
+     */
+    bool saveConfigSidecar(const std::string& rootDir,
+                           const std::string& cmdConfig);
+
     class EncFS_Context;
     
     RootPtr initFS(EncFS_Context* ctx, const std::shared_ptr<EncFS_Opts>& opts);
 
+    /*
+     * Read a password the way initFS asks for one: from the password
+     * program, stdin or a prompt, as opts say.  For a password used by
+     * several volumes.
+     */
+    bool readUserPassword(const EncFS_Opts& opts, std::string* password);
+
     void unmountFS(const char* mountPoint);
 
     RootPtr createV6Config(EncFS_Context* ctx,
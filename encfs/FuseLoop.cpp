@@ -0,0 +1,719 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FuseLoop.h"
+
+#include "easylogging++.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Error.h"
+#include "FileUtils.h"
+#include "Mutex.h"
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+namespace encfs {
+
+// sizeof(struct fuse_in_header), which the library does not export
+static const ssize_t InHeaderSize = 40;
+// where its opcode and nodeid are
+static const size_t InOpcodeOffset = 4;
+static const size_t InNodeidOffset = 16;
+// opcodes served by the worker that read them even with shards: the first
+// request of a session, and those that are not about a node or must not
+// queue behind one
+static const uint32_t OpForget = 2;
+static const uint32_t OpInit = 26;
+static const uint32_t OpInterrupt = 36;
+static const uint32_t OpDestroy = 38;
+static const uint32_t OpBatchForget = 42;
+
+namespace {
+
+struct Loop;
+
+struct Worker {
+  Loop *loop;
+  struct fuse_chan *ch;
+  char *buf;
+  pthread_t thread;
+};
+
+// a request read by a worker, for a shard to serve.  buf is the worker's
+// buffer, which it swapped for a new one, and the reply goes out on ch.
+struct Message {
+  char *buf;
+  size_t size;
+  struct fuse_chan *ch;
+};
+
+// a thread serving the requests of the nodes that hash to it, pinned to a
+// core of its own
+struct Shard {
+  Loop *loop;
+  int cpu;  // -1 if not pinned
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  std::deque<Message> queue;
+  bool stop;
+  uint64_t served;
+
+  Shard() : loop(nullptr), cpu(-1), stop(false), served(0) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&wake, nullptr);
+  }
+  ~Shard() {
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void post(const Message &msg) {
+    Lock lock(mutex);
+    queue.push_back(msg);
+    pthread_cond_signal(&wake);
+  }
+};
+
+struct Loop {
+  struct fuse_session *se;
+  int masterFd;
+  size_t bufsize;
+  int maxThreads;
+  int maxIdle;
+
+  pthread_mutex_t mutex;
+  std::vector<Worker *> workers;
+  int idle;
+  bool stopping;
+  int error;
+  sem_t finish;  // posted by a worker leaving because the session ended
+
+  // with opts->shards, who serves the requests the workers read; workers
+  // then only read, and stay for as long as the session
+  std::vector<Shard *> shards;
+  // request buffers the shards are done with, under bufMutex
+  pthread_mutex_t bufMutex;
+  std::vector<char *> freeBufs;
+
+  Loop() : idle(0), stopping(false), error(0) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_mutex_init(&bufMutex, nullptr);
+    sem_init(&finish, 0, 0);
+  }
+  ~Loop() {
+    for (char *buf : freeBufs) {
+      free(buf);
+    }
+    sem_destroy(&finish);
+    pthread_mutex_destroy(&bufMutex);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // caller holds mutex
+  bool startWorker();
+  void removeWorker(Worker *w);
+
+  // the shard of the request in buf, null for one the worker serves
+  Shard *shardFor(const char *buf) const;
+  bool startShards(int count);
+  void stopShards();
+  char *takeBuf();
+  void giveBuf(char *buf);
+};
+
+// as the library's own channel reads /dev/fuse, on a cloned descriptor
+int chanReceive(struct fuse_chan **chp, char *buf, size_t size) {
+  struct fuse_chan *ch = *chp;
+  Loop *loop = (Loop *)fuse_chan_data(ch);
+  for (;;) {
+    ssize_t res = ::read(fuse_chan_fd(ch), buf, size);
+    int eno = errno;
+    if (fuse_session_exited(loop->se)) {
+      return 0;
+    }
+    if (res >= 0) {
+      if (res < InHeaderSize) {
+        RLOG(ERROR) << "short read on fuse device";
+        return -EIO;
+      }
+      return (int)res;
+    }
+    if (eno == ENOENT) {
+      // the request was interrupted before we read it
+      continue;
+    }
+    if (eno == ENODEV) {
+      // unmounted
+      fuse_session_exit(loop->se);
+      return 0;
+    }
+    if (eno != EINTR && eno != EAGAIN) {
+      RLOG(ERROR) << "reading fuse device: " << strerror(eno);
+    }
+    return -eno;
+  }
+}
+
+int chanSend(struct fuse_chan *ch, const struct iovec iov[], size_t count) {
+  if (iov == nullptr) {
+    return 0;
+  }
+  ssize_t res = ::writev(fuse_chan_fd(ch), iov, (int)count);
+  if (res < 0) {
+    int eno = errno;
+    Loop *loop = (Loop *)fuse_chan_data(ch);
+    // ENOENT: the request was interrupted and its reply is not wanted
+    if (eno != ENOENT && !fuse_session_exited(loop->se)) {
+      RLOG(ERROR) << "writing fuse device: " << strerror(eno);
+    }
+    return -eno;
+  }
+  return 0;
+}
+
+void chanDestroy(struct fuse_chan *ch) { ::close(fuse_chan_fd(ch)); }
+
+struct fuse_chan_ops ChanOps = {chanReceive, chanSend, chanDestroy};
+
+void *work(void *arg) {
+  Worker *w = (Worker *)arg;
+  Loop *loop = w->loop;
+
+  while (!fuse_session_exited(loop->se)) {
+    struct fuse_buf fbuf;
+    memset(&fbuf, 0, sizeof(fbuf));
+    fbuf.mem = w->buf;
+    fbuf.size = loop->bufsize;
+    struct fuse_chan *ch = w->ch;
+
+    // only ever cancelled while waiting for a request
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+    int res = fuse_session_receive_buf(loop->se, &fbuf, &ch);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+    if (res == -EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      if (res < 0) {
+        fuse_session_exit(loop->se);
+        loop->error = -1;
+      }
+      break;
+    }
+
+    // handed on to the shard of its node, the worker going back to read
+    // with a new buffer
+    Shard *shard = loop->shardFor(w->buf);
+    char *next = shard != nullptr ? loop->takeBuf() : nullptr;
+    if (next != nullptr) {
+      shard->post(Message{w->buf, fbuf.size, ch});
+      w->buf = next;
+      continue;
+    }
+
+    {
+      Lock lock(loop->mutex);
+      if (--loop->idle == 0 && !loop->stopping &&
+          (int)loop->workers.size() < loop->maxThreads) {
+        loop->startWorker();
+      }
+    }
+
+    fuse_session_process_buf(loop->se, &fbuf, ch);
+
+    Lock lock(loop->mutex);
+    // the shards may still reply on the channel of a worker
+    if (++loop->idle > loop->maxIdle && !loop->stopping &&
+        loop->shards.empty()) {
+      --loop->idle;
+      loop->removeWorker(w);
+      pthread_detach(pthread_self());
+      fuse_chan_destroy(w->ch);
+      free(w->buf);
+      delete w;
+      return nullptr;
+    }
+  }
+
+  sem_post(&loop->finish);
+  return nullptr;
+}
+
+bool Loop::startWorker() {
+  int fd = ::open("/dev/fuse", O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    RLOG(WARNING) << "unable to open /dev/fuse: " << strerror(errno);
+    return false;
+  }
+  uint32_t master = (uint32_t)masterFd;
+  if (::ioctl(fd, FUSE_DEV_IOC_CLONE, &master) != 0) {
+    // an older kernel
+    VLOG(1) << "can not clone the fuse channel: " << strerror(errno);
+    ::close(fd);
+    return false;
+  }
+
+  auto *w = new Worker;
+  w->loop = this;
+  w->ch = fuse_chan_new(&ChanOps, fd, bufsize, this);
+  w->buf = (char *)malloc(bufsize);
+  if (w->ch == nullptr || w->buf == nullptr) {
+    if (w->ch != nullptr) {
+      fuse_chan_destroy(w->ch);
+    } else {
+      ::close(fd);
+    }
+    free(w->buf);
+    delete w;
+    return false;
+  }
+
+  // signals are left to the main thread, which waits for the session to end
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int res = pthread_create(&w->thread, nullptr, work, w);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  if (res != 0) {
+    RLOG(WARNING) << "unable to start a fuse worker: " << strerror(res);
+    fuse_chan_destroy(w->ch);
+    free(w->buf);
+    delete w;
+    return false;
+  }
+
+  workers.push_back(w);
+  ++idle;
+  return true;
+}
+
+void Loop::removeWorker(Worker *w) {
+  for (auto it = workers.begin(); it != workers.end(); ++it) {
+    if (*it == w) {
+      workers.erase(it);
+      return;
+    }
+  }
+}
+
+Shard *Loop::shardFor(const char *buf) const {
+  if (shards.empty()) {
+    return nullptr;
+  }
+  uint32_t opcode;
+  uint64_t nodeid;
+  memcpy(&opcode, buf + InOpcodeOffset, sizeof(opcode));
+  memcpy(&nodeid, buf + InNodeidOffset, sizeof(nodeid));
+  switch (opcode) {
+    case OpForget:
+    case OpInit:
+    case OpInterrupt:
+    case OpDestroy:
+    case OpBatchForget:
+      return nullptr;
+    default:
+      break;
+  }
+  // the ops on a file come by its node, those on the names of a directory
+  // by the directory's
+  uint64_t hash = nodeid * 0x9e3779b97f4a7c15ULL;
+  return shards[(hash >> 32) % shards.size()];
+}
+
+char *Loop::takeBuf() {
+  {
+    Lock lock(bufMutex);
+    if (!freeBufs.empty()) {
+      char *buf = freeBufs.back();
+      freeBufs.pop_back();
+      return buf;
+    }
+  }
+  return (char *)malloc(bufsize);
+}
+
+void Loop::giveBuf(char *buf) {
+  Lock lock(bufMutex);
+  freeBufs.push_back(buf);
+}
+
+void *serveShard(void *arg) {
+  Shard *shard = (Shard *)arg;
+  Loop *loop = shard->loop;
+  if (shard->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(shard->cpu, &set);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res != 0) {
+      VLOG(1) << "unable to pin a shard to cpu " << shard->cpu << ": "
+              << strerror(res);
+    }
+  }
+
+  for (;;) {
+    Message msg;
+    {
+      Lock lock(shard->mutex);
+      while (shard->queue.empty() && !shard->stop) {
+        pthread_cond_wait(&shard->wake, &shard->mutex);
+      }
+      if (shard->stop) {
+        break;
+      }
+      msg = shard->queue.front();
+      shard->queue.pop_front();
+    }
+    struct fuse_buf fbuf;
+    memset(&fbuf, 0, sizeof(fbuf));
+    fbuf.mem = msg.buf;
+    fbuf.size = msg.size;
+    fuse_session_process_buf(loop->se, &fbuf, msg.ch);
+    loop->giveBuf(msg.buf);
+    ++shard->served;
+  }
+  return nullptr;
+}
+
+bool Loop::startShards(int count) {
+  // a core each, of those we may run on
+  std::vector<int> cpus;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (int i = 0; i < count; ++i) {
+    auto *shard = new Shard;
+    shard->loop = this;
+    // more shards than cores share them, unpinned
+    shard->cpu = count <= (int)cpus.size() ? cpus[i] : -1;
+    int res = pthread_create(&shard->thread, nullptr, serveShard, shard);
+    if (res != 0) {
+      RLOG(WARNING) << "unable to start a shard: " << strerror(res);
+      delete shard;
+      break;
+    }
+    shards.push_back(shard);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  if ((int)shards.size() < count) {
+    stopShards();
+    return false;
+  }
+  return true;
+}
+
+void Loop::stopShards() {
+  for (Shard *shard : shards) {
+    Lock lock(shard->mutex);
+    shard->stop = true;
+    pthread_cond_signal(&shard->wake);
+  }
+  for (Shard *shard : shards) {
+    pthread_join(shard->thread, nullptr);
+    // what was still queued is not answered, the session is gone
+    for (const Message &msg : shard->queue) {
+      free(msg.buf);
+    }
+    VLOG(1) << "shard served " << shard->served << " requests";
+    delete shard;
+  }
+  shards.clear();
+}
+
+}  // namespace
+
+int fuseSessionLoop(struct fuse_session *se, const EncFS_Opts *opts) {
+  if (!opts->cloneFd) {
+    return fuse_session_loop_mt(se);
+  }
+  struct fuse_chan *master = fuse_session_next_chan(se, nullptr);
+
+  Loop loop;
+  loop.se = se;
+  loop.masterFd = fuse_chan_fd(master);
+  loop.bufsize = fuse_chan_bufsize(master);
+  loop.maxThreads = opts->fuseThreads;
+  loop.maxIdle = opts->maxIdleThreads;
+
+  if (opts->shards > 0 && !loop.startShards(opts->shards)) {
+    RLOG(WARNING) << "serving without shards";
+  }
+  bool started;
+  {
+    Lock lock(loop.mutex);
+    started = loop.startWorker();
+  }
+  if (!started) {
+    loop.stopShards();
+    return fuse_session_loop_mt(se);
+  }
+  VLOG(1) << "serving with a fuse channel per worker, up to "
+          << loop.maxThreads << " workers, " << loop.shards.size()
+          << " shards";
+
+  while (!fuse_session_exited(se)) {
+    // a signal handler ends the session and interrupts the wait
+    sem_wait(&loop.finish);
+  }
+
+  std::vector<Worker *> workers;
+  {
+    Lock lock(loop.mutex);
+    loop.stopping = true;
+    workers = loop.workers;
+  }
+  for (Worker *w : workers) {
+    pthread_cancel(w->thread);
+  }
+  size_t most = workers.size();
+  for (Worker *w : workers) {
+    pthread_join(w->thread, nullptr);
+  }
+  // before the channels they reply on go
+  loop.stopShards();
+  for (Worker *w : workers) {
+    fuse_chan_destroy(w->ch);
+    free(w->buf);
+    delete w;
+  }
+  VLOG(1) << "fuse workers stopped, " << most << " were running";
+
+  fuse_session_reset(se);
+  return loop.error;
+}
+
+int fuseMain(int argc, char *argv[], const struct fuse_operations *op,
+             void *userData, const EncFS_Opts *opts) {
+  char *mountpoint = nullptr;
+  int multithreaded = 0;
+  struct fuse *fuse = fuse_setup(argc, argv, op, sizeof(*op), &mountpoint,
+                                 &multithreaded, userData);
+  if (fuse == nullptr) {
+    return 1;
+  }
+
+  int res;
+  if (multithreaded != 0) {
+    // what fuse_loop_mt does around its loop
+    res = fuse_start_cleanup_thread(fuse);
+    if (res == 0) {
+      res = fuseSessionLoop(fuse_get_session(fuse), opts);
+      fuse_stop_cleanup_thread(fuse);
+    }
+  } else {
+    res = fuse_loop(fuse);
+  }
+
+  fuse_teardown(fuse, mountpoint);
+  return res == -1 ? 1 : 0;
+}
+
+namespace {
+
+struct Mounted {
+  const FuseVolume *volume;
+  char *mountpoint;
+  int multithreaded;
+  struct fuse *fuse;
+  bool started;
+  pthread_t thread;
+  int res;
+};
+
+// posted by the signal handler and by each volume whose loop ended
+sem_t gVolumesWake;
+volatile sig_atomic_t gStopVolumes = 0;
+std::atomic<size_t> gVolumesEnded(0);
+
+void stopVolumes(int) {
+  gStopVolumes = 1;
+  sem_post(&gVolumesWake);
+}
+
+// what fuse_setup does for a mount, but for the signal handlers and
+// going to the background
+bool mountVolume(const struct fuse_operations *op, Mounted *m) {
+  struct fuse_args args = FUSE_ARGS_INIT(m->volume->argc, m->volume->argv);
+  int foreground;
+  m->mountpoint = nullptr;
+  m->fuse = nullptr;
+  if (fuse_parse_cmdline(&args, &m->mountpoint, &m->multithreaded,
+                         &foreground) == -1 ||
+      m->mountpoint == nullptr) {
+    fuse_opt_free_args(&args);
+    free(m->mountpoint);
+    return false;
+  }
+
+  struct fuse_chan *ch = fuse_mount(m->mountpoint, &args);
+  if (ch != nullptr) {
+    m->fuse = fuse_new(ch, &args, op, sizeof(*op), m->volume->userData);
+    if (m->fuse == nullptr) {
+      fuse_unmount(m->mountpoint, ch);
+    }
+  }
+  fuse_opt_free_args(&args);
+  if (m->fuse == nullptr) {
+    RLOG(ERROR) << "unable to mount " << m->mountpoint;
+    free(m->mountpoint);
+    return false;
+  }
+  return true;
+}
+
+void unmountVolume(Mounted *m) {
+  struct fuse_chan *ch =
+      fuse_session_next_chan(fuse_get_session(m->fuse), nullptr);
+  fuse_unmount(m->mountpoint, ch);
+  fuse_destroy(m->fuse);
+  free(m->mountpoint);
+}
+
+void *serveVolume(void *arg) {
+  Mounted *m = (Mounted *)arg;
+  if (m->multithreaded != 0) {
+    m->res = fuse_start_cleanup_thread(m->fuse);
+    if (m->res == 0) {
+      m->res = fuseSessionLoop(fuse_get_session(m->fuse), m->volume->opts);
+      fuse_stop_cleanup_thread(m->fuse);
+    }
+  } else {
+    m->res = fuse_loop(m->fuse);
+  }
+  VLOG(1) << "volume at " << m->mountpoint << " unmounted";
+  ++gVolumesEnded;
+  sem_post(&gVolumesWake);
+  return nullptr;
+}
+
+}  // namespace
+
+int fuseMainVolumes(const std::vector<FuseVolume> &volumes,
+                    const struct fuse_operations *op, bool foreground) {
+  std::vector<Mounted> mounted;
+  for (const FuseVolume &volume : volumes) {
+    Mounted m;
+    m.volume = &volume;
+    m.started = false;
+    m.res = 0;
+    if (mountVolume(op, &m)) {
+      mounted.push_back(m);
+    }
+  }
+  if (mounted.empty()) {
+    return 1;
+  }
+
+  if (fuse_daemonize(foreground ? 1 : 0) == -1) {
+    for (Mounted &m : mounted) {
+      unmountVolume(&m);
+    }
+    return 1;
+  }
+
+  sem_init(&gVolumesWake, 0, 0);
+  gStopVolumes = 0;
+  gVolumesEnded = 0;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stopVolumes;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGHUP, &sa, nullptr);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, nullptr);
+
+  // signals are left to this thread, which unmounts the volumes on them
+  size_t running = 0;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (Mounted &m : mounted) {
+    int res = pthread_create(&m.thread, nullptr, serveVolume, &m);
+    if (res != 0) {
+      RLOG(ERROR) << "unable to serve " << m.mountpoint << ": "
+                  << strerror(res);
+      m.res = -1;
+      continue;
+    }
+    m.started = true;
+    ++running;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  RLOG(INFO) << "serving " << running << " volumes";
+
+  bool stopping = false;
+  while (gVolumesEnded < running) {
+    if (sem_wait(&gVolumesWake) != 0) {
+      continue;
+    }
+    if (gStopVolumes != 0 && !stopping) {
+      stopping = true;
+      // the loops end as the kernel lets go of their mounts
+      for (Mounted &m : mounted) {
+        unmountFS(m.mountpoint);
+      }
+    }
+  }
+
+  int res = 0;
+  for (Mounted &m : mounted) {
+    if (m.started) {
+      pthread_join(m.thread, nullptr);
+    }
+    if (m.res == -1) {
+      res = 1;
+    }
+    unmountVolume(&m);
+  }
+
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGHUP, &sa, nullptr);
+  sem_destroy(&gVolumesWake);
+  return res;
+}
+
+}  // namespace encfs
@@ -0,0 +1,65 @@
+#ifndef _FuseLoop_incl_
+#define _FuseLoop_incl_
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <vector>
+
+namespace encfs {
+
+struct EncFS_Opts;
+
+/*
+    The multi-threaded loop of a mount, with a /dev/fuse channel per worker
+    thread.  With a single channel every worker waits in read() on the same
+    file, and each request wakes them all to contend on the device lock.
+    Here each worker opens /dev/fuse of its own and attaches it to the
+    session's connection with the FUSE_DEV_IOC_CLONE ioctl (Linux 4.2), so
+    that the kernel hands each request to one reader.  A reply goes back on
+    the descriptor its request came in on, which a worker does by replying
+    on its own channel.
+
+    Workers are started when a request finds all of them busy, up to
+    opts->fuseThreads, and leave again once more than opts->maxIdleThreads
+    are idle, as libfuse 3's loop does.  Without opts->cloneFd, or where the
+    first clone fails, the session is served by fuse_session_loop_mt.
+
+    With opts->shards the workers only read: each request is handed, in
+    the buffer it was read into, to the shard its node hashes to, a thread
+    pinned to a core of its own that serves them in order and replies on
+    the worker's channel.  The ops on a file all run on one thread, that
+    of its node, and so do those on the names of a directory; the locks
+    they take are then rarely contended, and the buffers, cipher contexts
+    and caches each thread keeps stay warm on its core.  Workers then stay
+    for as long as the session, as the shards reply on their channels.
+ */
+int fuseSessionLoop(struct fuse_session *se, const EncFS_Opts *opts);
+
+// fuse_main, serving a multi-threaded mount with fuseSessionLoop
+int fuseMain(int argc, char *argv[], const struct fuse_operations *op,
+             void *userData, const EncFS_Opts *opts);
+
+// a mount of fuseMainVolumes: the arguments fuse_main would be given for
+// it, and the private data of its operations
+struct FuseVolume {
+  int argc;
+  char **argv;
+  void *userData;
+  const EncFS_Opts *opts;
+};
+
+/*
+    fuse_main for several mounts served by one process, each by a thread
+    of its own running fuseSessionLoop (or fuse_loop, single-threaded).
+    Mounts them all, then goes to the background unless foreground, and
+    returns once they were all unmounted: through their mount points, or
+    by us on SIGINT, SIGTERM or SIGHUP.  A mount that fails is logged and
+    left out.  Returns 1 if they all failed or a loop ended on an error,
+    else 0.
+ */
+int fuseMainVolumes(const std::vector<FuseVolume> &volumes,
+                    const struct fuse_operations *op, bool foreground);
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,269 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "HotFileCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+// opens counted before the counts start over
+static const size_t MaxCountedFiles = 65536;
+
+static std::atomic<bool> gLockWarned(false);
+
+static bool sameVersion(const struct stat &a, const struct stat &b) {
+#if defined(__APPLE__)
+  const struct timespec &am = a.st_mtimespec;
+  const struct timespec &bm = b.st_mtimespec;
+  const struct timespec &ac = a.st_ctimespec;
+  const struct timespec &bc = b.st_ctimespec;
+#else
+  const struct timespec &am = a.st_mtim;
+  const struct timespec &bm = b.st_mtim;
+  const struct timespec &ac = a.st_ctim;
+  const struct timespec &bc = b.st_ctim;
+#endif
+  return a.st_size == b.st_size && am.tv_sec == bm.tv_sec &&
+         am.tv_nsec == bm.tv_nsec && ac.tv_sec == bc.tv_sec &&
+         ac.tv_nsec == bc.tv_nsec;
+}
+
+HotFileCache::Copy::Copy()
+    : _data(nullptr), _size(0), _mapped(0), _generation(0) {}
+
+HotFileCache::Copy::~Copy() {
+  if (_data != nullptr) {
+    memset(_data, 0, _size);
+    munlock(_data, _mapped);
+    munmap(_data, _mapped);
+  }
+}
+
+size_t HotFileCache::KeyHash::operator()(const Key &k) const {
+  uint64_t h = (uint64_t)k.ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.dev;
+  return (size_t)(h ^ (h >> 29));
+}
+
+HotFileCache::HotFileCache(size_t maxBytes,
+                           const std::vector<std::string> &pinned,
+                           int hotOpens)
+    : _maxBytes(maxBytes),
+      _hotOpens(hotOpens),
+      _bytes(0),
+      _generation(0),
+      _hits(0),
+      _misses(0) {
+  // "/lib/" and "/lib" both pin what is below /lib
+  for (std::string path : pinned) {
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+      path.erase(path.size() - 1);
+    }
+    _pinned.push_back(path);
+  }
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+HotFileCache::~HotFileCache() {
+  VLOG(1) << "hot file cache: " << hits() << " hits, " << misses()
+          << " misses";
+  _copies.clear();
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool HotFileCache::pinned(const char *plainPath) const {
+  for (const std::string &path : _pinned) {
+    if (path == "/") {
+      return true;
+    }
+    size_t len = path.size();
+    if (strncmp(plainPath, path.c_str(), len) == 0 &&
+        (plainPath[len] == '\0' || plainPath[len] == '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void HotFileCache::drop(
+    std::unordered_map<Key, Entry, KeyHash>::iterator it) {
+  _bytes -= it->second.copy->_mapped;
+  _lru.erase(it->second.lru);
+  _copies.erase(it);
+}
+
+void HotFileCache::opened(const struct stat &stbuf) {
+  if (_hotOpens <= 0) {
+    return;
+  }
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  Lock lock(_mutex);
+  if (_copies.count(key) != 0) {
+    return;
+  }
+  if (_opens.size() >= MaxCountedFiles) {
+    _opens.clear();
+  }
+  ++_opens[key];
+}
+
+ssize_t HotFileCache::read(const struct stat &stbuf, off_t offset,
+                           unsigned char *out, size_t len) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  std::shared_ptr<Copy> copy;
+  {
+    Lock lock(_mutex);
+    auto it = _copies.find(key);
+    if (it == _copies.end()) {
+      ++_misses;
+      return -1;
+    }
+    if (!sameVersion(it->second.copy->_stamp, stbuf)) {
+      // changed behind our back
+      drop(it);
+      ++_misses;
+      return -1;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    copy = it->second.copy;
+  }
+  ++_hits;
+
+  // a copy dropped meanwhile stays mapped until we are done with it
+  if (offset >= (off_t)copy->_size) {
+    return 0;
+  }
+  size_t n = std::min(len, copy->_size - (size_t)offset);
+  memcpy(out, copy->_data + offset, n);
+  return (ssize_t)n;
+}
+
+std::shared_ptr<HotFileCache::Copy> HotFileCache::startCopy(
+    const char *plainPath, const struct stat &stbuf) {
+  if (!S_ISREG(stbuf.st_mode) || stbuf.st_size <= 0 ||
+      (size_t)stbuf.st_size > _maxBytes / 4) {
+    return nullptr;
+  }
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+  uint64_t generation;
+  {
+    Lock lock(_mutex);
+    if (_copies.count(key) != 0 || _copying.count(key) != 0) {
+      return nullptr;
+    }
+    auto counted = _opens.find(key);
+    bool hot = _hotOpens > 0 && counted != _opens.end() &&
+               counted->second >= _hotOpens;
+    if (!hot && !pinned(plainPath)) {
+      return nullptr;
+    }
+    _copying.insert(key);
+    generation = _generation;
+  }
+
+  std::shared_ptr<Copy> copy(new Copy());
+  copy->_stamp = stbuf;
+  copy->_generation = generation;
+  copy->_size = stbuf.st_size;
+  long page = sysconf(_SC_PAGESIZE);
+  copy->_mapped = (copy->_size + page - 1) / page * page;
+
+  void *addr = mmap(nullptr, copy->_mapped, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr != MAP_FAILED) {
+#if defined(MADV_DONTDUMP)
+    madvise(addr, copy->_mapped, MADV_DONTDUMP);
+#endif
+    if (mlock(addr, copy->_mapped) == 0) {
+      copy->_data = (unsigned char *)addr;
+      return copy;
+    }
+    if (!gLockWarned.exchange(true)) {
+      RLOG(WARNING) << "unable to lock hot file copies in memory, check the "
+                       "memlock limit (ulimit -l): "
+                    << strerror(errno);
+    }
+    munmap(addr, copy->_mapped);
+  }
+  abandon(copy);
+  return nullptr;
+}
+
+void HotFileCache::add(const std::shared_ptr<Copy> &copy) {
+  Key key = {copy->_stamp.st_dev, copy->_stamp.st_ino};
+  Lock lock(_mutex);
+  _copying.erase(key);
+  if (copy->_generation != _generation) {
+    return;
+  }
+
+  auto it = _copies.find(key);
+  if (it != _copies.end()) {
+    drop(it);
+  }
+  while (!_lru.empty() && _bytes + copy->_mapped > _maxBytes) {
+    drop(_copies.find(_lru.back()));
+  }
+  _lru.push_front(key);
+  Entry &entry = _copies[key];
+  entry.copy = copy;
+  entry.lru = _lru.begin();
+  _bytes += copy->_mapped;
+  _opens.erase(key);
+}
+
+void HotFileCache::abandon(const std::shared_ptr<Copy> &copy) {
+  Key key = {copy->_stamp.st_dev, copy->_stamp.st_ino};
+  Lock lock(_mutex);
+  _copying.erase(key);
+}
+
+void HotFileCache::erase(dev_t dev, ino_t ino) {
+  Key key = {dev, ino};
+  Lock lock(_mutex);
+  ++_generation;
+  auto it = _copies.find(key);
+  if (it != _copies.end()) {
+    drop(it);
+  }
+}
+
+uint64_t HotFileCache::hits() const { return _hits; }
+
+uint64_t HotFileCache::misses() const { return _misses; }
+
+size_t HotFileCache::bytesUsed() const {
+  Lock lock(_mutex);
+  return _bytes;
+}
+
+void HotFileCache::setMaxBytes(size_t maxBytes) {
+  Lock lock(_mutex);
+  _maxBytes = maxBytes;
+  while (!_lru.empty() && _bytes > maxBytes) {
+    drop(_copies.find(_lru.back()));
+  }
+}
+
+}  // namespace encfs
@@ -0,0 +1,131 @@
+#ifndef _HotFileCache_incl_
+#define _HotFileCache_incl_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace encfs {
+
+/*
+    Whole decoded copies of hot files, which FileNode reads from without
+    going through the cipher.  A file is copied on the first read after it
+    qualifies: it lies under one of the pinned paths, or was opened at
+    least hotOpens times, and it is no larger than a quarter of maxBytes.
+
+    Copies live in memory locked against swapping, left out of core dumps
+    and cleared before it is unmapped; a file is not copied when its memory
+    can not be locked.  The least recently read are dropped to stay within
+    maxBytes.
+
+    Files are known by their backing inode, so renames and hard links find
+    the same copy.  A copy serves reads only while the file has the size,
+    mtime and ctime it was made from, and is dropped by any change through
+    the filesystem.
+ */
+class HotFileCache {
+ public:
+  // the decoded data of one file, filled by its reader before add()
+  class Copy {
+   public:
+    ~Copy();
+
+    unsigned char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+   private:
+    friend class HotFileCache;
+    Copy();
+
+    unsigned char *_data;
+    size_t _size;
+    size_t _mapped;
+    struct stat _stamp;
+    uint64_t _generation;
+
+    Copy(const Copy &);             // not allowed
+    Copy &operator=(const Copy &);  // not allowed
+  };
+
+  HotFileCache(size_t maxBytes, const std::vector<std::string> &pinned,
+               int hotOpens);
+  ~HotFileCache();
+
+  // counts an open of the file with attributes stbuf
+  void opened(const struct stat &stbuf);
+
+  // copies up to len bytes at offset of the file with attributes stbuf.
+  // Returns the bytes copied, or -1 if there is no copy of it.
+  ssize_t read(const struct stat &stbuf, off_t offset, unsigned char *out,
+               size_t len);
+
+  // an empty copy for the file plainPath with attributes stbuf, when it
+  // should be cached and nobody is copying it yet, or null.  The caller
+  // fills it and hands it to add(), or to abandon() if that failed.
+  std::shared_ptr<Copy> startCopy(const char *plainPath,
+                                  const struct stat &stbuf);
+  void add(const std::shared_ptr<Copy> &copy);
+  void abandon(const std::shared_ptr<Copy> &copy);
+
+  // the file on inode ino of dev changed
+  void erase(dev_t dev, ino_t ino);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+  size_t bytesUsed() const;
+
+  // changes maxBytes, dropping the least recently read copies past it
+  void setMaxBytes(size_t maxBytes);
+
+ private:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const Key &o) const {
+      return dev == o.dev && ino == o.ino;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const;
+  };
+  struct Entry {
+    std::shared_ptr<Copy> copy;
+    std::list<Key>::iterator lru;
+  };
+
+  bool pinned(const char *plainPath) const;
+  // caller holds _mutex
+  void drop(std::unordered_map<Key, Entry, KeyHash>::iterator it);
+
+  std::atomic<size_t> _maxBytes;
+  std::vector<std::string> _pinned;
+  int _hotOpens;
+
+  mutable pthread_mutex_t _mutex;
+  std::unordered_map<Key, Entry, KeyHash> _copies;
+  std::list<Key> _lru;  // most recently read first
+  size_t _bytes;
+  // files being copied, and the opens counted of files not cached
+  std::unordered_set<Key, KeyHash> _copying;
+  std::unordered_map<Key, int, KeyHash> _opens;
+  // bumped by every erase, so that a copy made meanwhile is not added
+  uint64_t _generation;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  HotFileCache(const HotFileCache &);             // not allowed
+  HotFileCache &operator=(const HotFileCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
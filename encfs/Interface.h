@@ -22,12 +22,12 @@ public:
 
   const std::string &name() const;
   int current() const;
-  int revesion() const;
+  int revision() const;
   int age() const;
 
-  std::string name();
+  std::string &name();
   int &current();
-  int &revesion();
+  int &revision();
   int &age();
 
   Interface &operator=(const Interface &src) = default;
@@ -0,0 +1,132 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IoScheduler.h"
+
+#include "easylogging++.h"
+#include <algorithm>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+IoScheduler::IoScheduler(int slots)
+    : _slots(slots), _busy(0), _virtual(0), _arrivals(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+IoScheduler::~IoScheduler() {
+  for (auto &it : _users) {
+    VLOG(1) << "io scheduler: uid " << it.first << " moved "
+            << it.second.bytes << " bytes, waited " << it.second.waits
+            << " times";
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+IoScheduler::User &IoScheduler::user(uid_t uid) {
+  auto it = _users.find(uid);
+  if (it == _users.end()) {
+    User &u = _users[uid];
+    u.weight = 1;
+    u.finish = 0;
+    u.bytes = 0;
+    u.waits = 0;
+    return u;
+  }
+  return it->second;
+}
+
+void IoScheduler::setWeight(uid_t uid, int weight) {
+  Lock lock(_mutex);
+  user(uid).weight = weight > 0 ? weight : 1;
+}
+
+void IoScheduler::setRate(uid_t uid, uint64_t bytesPerSecond) {
+  Lock lock(_mutex);
+  user(uid).rate.reset(new RateLimit(bytesPerSecond));
+}
+
+IoScheduler::Turn::Turn(IoScheduler *sched, uid_t uid, size_t bytes)
+    : _sched(sched) {
+  if (_sched != nullptr) {
+    _sched->acquire(uid, bytes);
+  }
+}
+
+IoScheduler::Turn::~Turn() {
+  if (_sched != nullptr) {
+    _sched->release();
+  }
+}
+
+void IoScheduler::acquire(uid_t uid, size_t bytes) {
+  // users are never erased, so their rates stay put
+  RateLimit *rate;
+  {
+    Lock lock(_mutex);
+    rate = user(uid).rate.get();
+  }
+  if (rate != nullptr) {
+    rate->take(bytes);
+  }
+
+  Lock lock(_mutex);
+  User &u = user(uid);
+  u.bytes += bytes;
+  if (_slots <= 0) {
+    return;
+  }
+
+  double start = std::max(_virtual, u.finish);
+  u.finish = start + (double)std::max<size_t>(bytes, 1) / u.weight;
+  if (_busy < _slots) {
+    ++_busy;
+    _virtual = std::max(_virtual, start);
+    return;
+  }
+
+  Waiter w;
+  pthread_cond_init(&w.cond, nullptr);
+  w.admitted = false;
+  ++u.waits;
+  _waiting[std::make_pair(start, _arrivals++)] = &w;
+  while (!w.admitted) {
+    pthread_cond_wait(&w.cond, &_mutex);
+  }
+  pthread_cond_destroy(&w.cond);
+}
+
+void IoScheduler::release() {
+  Lock lock(_mutex);
+  if (_slots <= 0) {
+    return;
+  }
+  if (_waiting.empty()) {
+    --_busy;
+    return;
+  }
+  // the slot goes straight to the waiter with the lowest tag
+  auto it = _waiting.begin();
+  _virtual = std::max(_virtual, it->first.first);
+  it->second->admitted = true;
+  pthread_cond_signal(&it->second->cond);
+  _waiting.erase(it);
+}
+
+}  // namespace encfs
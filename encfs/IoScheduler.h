@@ -0,0 +1,94 @@
+#ifndef _IoScheduler_incl_
+#define _IoScheduler_incl_
+
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+#include "RateLimit.h"
+
+namespace encfs {
+
+/*
+    Shares the data path of a mount between the users of it, so that one
+    user's bulk reads and writes, a backup say, do not starve everybody
+    else's.  FUSE serves requests first come, first served; reads, writes
+    and copies instead take a turn here first, by the uid of the caller.
+
+    With slots (--fair-share), at most that many requests are in the
+    cipher and backing I/O at once, and the waiting ones are let in by
+    start-time fair queueing: each uid is charged the bytes of its
+    requests divided by its weight (--uid-weight, 1 by default), and the
+    request with the lowest start tag goes next.  A uid that was idle
+    starts from the tags of those being served, so it can not save up
+    turns.
+
+    A uid may also be held to a rate (--uid-rate), paced by a RateLimit
+    before it waits for a slot, so that a slow uid does not hold one while
+    it sleeps.
+ */
+class IoScheduler {
+ public:
+  // slots 0 only applies the rates
+  explicit IoScheduler(int slots);
+  ~IoScheduler();
+
+  // before any turn is taken
+  void setWeight(uid_t uid, int weight);
+  void setRate(uid_t uid, uint64_t bytesPerSecond);
+
+  // a turn of uid at moving bytes, for the lifetime of the object.  Does
+  // nothing without a scheduler.
+  class Turn {
+   public:
+    Turn(IoScheduler *sched, uid_t uid, size_t bytes);
+    ~Turn();
+
+   private:
+    IoScheduler *_sched;
+
+    Turn(const Turn &);             // not allowed
+    Turn &operator=(const Turn &);  // not allowed
+  };
+
+ private:
+  struct User {
+    double weight;
+    double finish;  // tag the uid's next request starts from at the least
+    std::unique_ptr<RateLimit> rate;
+    uint64_t bytes;
+    uint64_t waits;
+  };
+  struct Waiter {
+    pthread_cond_t cond;
+    bool admitted;
+  };
+
+  // caller holds _mutex
+  User &user(uid_t uid);
+
+  void acquire(uid_t uid, size_t bytes);
+  void release();
+
+  int _slots;
+
+  pthread_mutex_t _mutex;
+  std::unordered_map<uid_t, User> _users;
+  int _busy;
+  // tag of the request let in last, where idle uids start from
+  double _virtual;
+  // number of arrivals, which breaks ties of tags in arrival order
+  uint64_t _arrivals;
+  std::map<std::pair<double, uint64_t>, Waiter *> _waiting;
+
+  IoScheduler(const IoScheduler &);             // not allowed
+  IoScheduler &operator=(const IoScheduler &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
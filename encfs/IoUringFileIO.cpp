@@ -0,0 +1,280 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IoUringFileIO.h"
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+#include <utility>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ENCFS_IO_URING 1
+#endif
+#endif
+
+#ifdef ENCFS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "Error.h"
+#include "OpStats.h"
+
+namespace encfs {
+
+#ifdef ENCFS_IO_URING
+
+namespace {
+
+// requests are submitted and waited for one at a time, a small ring is
+// plenty
+const unsigned RingEntries = 8;
+
+/*
+    Minimal io_uring, driven through the raw system calls so that there is
+    no dependency on liburing.  Only used by the thread that created it.
+ */
+class IoUring {
+ public:
+  IoUring();
+  ~IoUring();
+
+  bool ok() const { return ringFd >= 0; }
+  // process the ring was set up in
+  pid_t owner() const { return pid; }
+
+  // run one IORING_OP_READV / IORING_OP_WRITEV, returns bytes or -errno
+  ssize_t rw(int opcode, int fd, const struct iovec *iov, int iovcnt,
+             off_t offset);
+
+ private:
+  int ringFd;
+  pid_t pid;
+
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+
+  IoUring(const IoUring &);             // not allowed
+  IoUring &operator=(const IoUring &);  // not allowed
+};
+
+IoUring::IoUring()
+    : ringFd(-1),
+      pid(getpid()),
+      sqRing(MAP_FAILED),
+      sqRingSize(0),
+      cqRing(MAP_FAILED),
+      cqRingSize(0),
+      sqes((struct io_uring_sqe *)MAP_FAILED),
+      sqesSize(0) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = (int)syscall(__NR_io_uring_setup, RingEntries, &params);
+  if (fd < 0) {
+    VLOG(1) << "io_uring_setup failed: " << strerror(errno);
+    return;
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMap) {
+    if (cqRingSize > sqRingSize) {
+      sqRingSize = cqRingSize;
+    }
+    cqRingSize = sqRingSize;
+  }
+
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sqRing != MAP_FAILED) {
+    cqRing = singleMap ? sqRing
+                       : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd,
+                              IORING_OFF_CQ_RING);
+  }
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (cqRing != MAP_FAILED) {
+    sqes = (struct io_uring_sqe *)mmap(nullptr, sqesSize,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_SQES);
+  }
+  if (sqes == (struct io_uring_sqe *)MAP_FAILED) {
+    RLOG(WARNING) << "unable to map io_uring: " << strerror(errno);
+    close(fd);
+    return;
+  }
+
+  char *sq = (char *)sqRing;
+  sqTail = (unsigned *)(sq + params.sq_off.tail);
+  sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  sqArray = (unsigned *)(sq + params.sq_off.array);
+
+  char *cq = (char *)cqRing;
+  cqHead = (unsigned *)(cq + params.cq_off.head);
+  cqTail = (unsigned *)(cq + params.cq_off.tail);
+  cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  ringFd = fd;
+}
+
+IoUring::~IoUring() {
+  if (sqes != (struct io_uring_sqe *)MAP_FAILED) {
+    munmap(sqes, sqesSize);
+  }
+  if (cqRing != MAP_FAILED && cqRing != sqRing) {
+    munmap(cqRing, cqRingSize);
+  }
+  if (sqRing != MAP_FAILED) {
+    munmap(sqRing, sqRingSize);
+  }
+  if (ringFd >= 0) {
+    close(ringFd);
+  }
+}
+
+ssize_t IoUring::rw(int opcode, int fd, const struct iovec *iov, int iovcnt,
+                    off_t offset) {
+  // we are the only submitter, and every request is reaped before the next
+  // is queued, so the ring can never be full
+  unsigned tail = *sqTail;
+  unsigned index = tail & *sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (uint8_t)opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = (uint32_t)iovcnt;
+  sqe->off = (uint64_t)offset;
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  unsigned toSubmit = 1;
+  while (true) {
+    unsigned head = *cqHead;
+    if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      int res = cqes[head & *cqMask].res;
+      __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+      return res;
+    }
+
+    int res = (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, 1,
+                           IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (res < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -errno;
+    }
+    toSubmit -= (unsigned)res < toSubmit ? (unsigned)res : toSubmit;
+  }
+}
+
+thread_local std::unique_ptr<IoUring> gThreadRing;
+thread_local bool gThreadRingFailed = false;
+
+// this thread's ring, or null if io_uring can not be used
+IoUring *threadRing() {
+  if (gThreadRing && gThreadRing->owner() != getpid()) {
+    // a forked child must not submit to its parent's ring, start over
+    gThreadRing.reset();
+    gThreadRingFailed = false;
+  }
+  if (!gThreadRing && !gThreadRingFailed) {
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if (ring->ok()) {
+      gThreadRing = std::move(ring);
+    } else {
+      gThreadRingFailed = true;
+    }
+  }
+  return gThreadRing.get();
+}
+
+}  // namespace
+
+#endif
+
+IoUringFileIO::IoUringFileIO() = default;
+
+IoUringFileIO::IoUringFileIO(std::string fileName)
+    : RawFileIO(std::move(fileName)) {}
+
+IoUringFileIO::~IoUringFileIO() = default;
+
+bool IoUringFileIO::supported() {
+#ifdef ENCFS_IO_URING
+  IoUring ring;
+  return ring.ok();
+#else
+  return false;
+#endif
+}
+
+ssize_t IoUringFileIO::sysReadv(const struct iovec *iov, int iovcnt,
+                                off_t offset) const {
+#ifdef ENCFS_IO_URING
+  IoUring *ring = threadRing();
+  if (ring != nullptr) {
+    ssize_t res = ring->rw(IORING_OP_READV, fd, iov, iovcnt, offset);
+    if (res >= 0) {
+      OpStats::count(OpStats::RawReadCalls);
+      OpStats::count(OpStats::RawReadBytes, (uint64_t)res);
+    }
+    return res;
+  }
+#endif
+  return RawFileIO::sysReadv(iov, iovcnt, offset);
+}
+
+ssize_t IoUringFileIO::sysWritev(const struct iovec *iov, int iovcnt,
+                                 off_t offset) const {
+#ifdef ENCFS_IO_URING
+  IoUring *ring = threadRing();
+  if (ring != nullptr) {
+    ssize_t res = ring->rw(IORING_OP_WRITEV, fd, iov, iovcnt, offset);
+    if (res >= 0) {
+      OpStats::count(OpStats::RawWriteCalls);
+      OpStats::count(OpStats::RawWriteBytes, (uint64_t)res);
+    }
+    return res;
+  }
+#endif
+  return RawFileIO::sysWritev(iov, iovcnt, offset);
+}
+
+}  // namespace encfs
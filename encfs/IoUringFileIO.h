@@ -0,0 +1,39 @@
+#ifndef _IoUringFileIO_incl_
+#define _IoUringFileIO_incl_
+
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "RawFileIO.h"
+
+namespace encfs {
+
+/*
+    RawFileIO issuing its reads and writes through io_uring rather than
+    pread / pwrite.
+
+    Every thread submits to a ring of its own, set up on first use, so
+    requests from different FUSE threads never wait on each other's locks
+    or completions.  When a thread can not get a ring (old kernel, seccomp
+    policy, io_uring disabled), it falls back to the plain system calls.
+ */
+class IoUringFileIO : public RawFileIO {
+ public:
+  IoUringFileIO();
+  IoUringFileIO(std::string fileName);
+  virtual ~IoUringFileIO();
+
+  // true if io_uring can be used on this system
+  static bool supported();
+
+ protected:
+  virtual ssize_t sysReadv(const struct iovec *iov, int iovcnt,
+                           off_t offset) const;
+  virtual ssize_t sysWritev(const struct iovec *iov, int iovcnt,
+                            off_t offset) const;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,180 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "JournalFileIO.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <utility>
+
+#include "Error.h"
+
+namespace encfs {
+
+static Interface JournalFileIO_iface("FileIO/Journal", 1, 0, 0);
+
+JournalFileIO::JournalFileIO(std::shared_ptr<FileIO> _base,
+                             std::shared_ptr<WriteJournal> _journal)
+    : base(std::move(_base)), journal(std::move(_journal)), applied(0) {}
+
+JournalFileIO::~JournalFileIO() {}
+
+Interface JournalFileIO::interface() const { return JournalFileIO_iface; }
+
+unsigned int JournalFileIO::blockSize() const { return base->blockSize(); }
+
+void JournalFileIO::setFileName(const char *fileName) {
+  base->setFileName(fileName);
+}
+
+const char *JournalFileIO::getFileName() const {
+  return base->getFileName();
+}
+
+bool JournalFileIO::setIV(uint64_t iv) { return base->setIV(iv); }
+
+void JournalFileIO::refresh() const {
+  if (!file) {
+    return;
+  }
+  uint64_t now = journal->applied(*file);
+  if (applied.exchange(now) != now) {
+    base->invalidateData(0, 0);
+  }
+}
+
+int JournalFileIO::open(int flags) {
+  int fd = base->open(flags);
+  if (fd >= 0 && !file) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      return -errno;
+    }
+    file = journal->attach(st);
+    applied = journal->applied(*file);
+  }
+  return fd;
+}
+
+int JournalFileIO::getAttr(struct stat *stbuf) const {
+  WriteJournal::Reader reader(*journal);
+  refresh();
+  int res = base->getAttr(stbuf);
+  if (res == 0 && S_ISREG(stbuf->st_mode)) {
+    if (file) {
+      stbuf->st_size = std::max(stbuf->st_size, journal->size(*file));
+    } else {
+      journal->pendingAttr(stbuf);
+    }
+  }
+  return res;
+}
+
+off_t JournalFileIO::getSize() const {
+  WriteJournal::Reader reader(*journal);
+  refresh();
+  off_t size = base->getSize();
+  if (size >= 0 && file) {
+    size = std::max(size, journal->size(*file));
+  }
+  return size;
+}
+
+ssize_t JournalFileIO::read(const IORequest &req) const {
+  WriteJournal::Reader reader(*journal);
+  refresh();
+  ssize_t got = base->read(req);
+  if (got < 0 || !file) {
+    return got;
+  }
+  return journal->overlay(*file, req, got);
+}
+
+ssize_t JournalFileIO::write(const IORequest &req) {
+  if (!file) {
+    return base->write(req);
+  }
+  int fd = base->open(O_RDWR);
+  if (fd < 0) {
+    return fd;
+  }
+  int res = journal->write(*file, fd, getFileName(), req.offset, req.data,
+                           req.dataLen);
+  if (res == -EINVAL) {
+    // not under the root, the journal can not name it
+    return base->write(req);
+  }
+  return res < 0 ? res : (ssize_t)req.dataLen;
+}
+
+int JournalFileIO::truncate(off_t size) {
+  if (file) {
+    int res = journal->settle(*file);
+    if (res < 0) {
+      return res;
+    }
+    refresh();
+  }
+  return base->truncate(size);
+}
+
+bool JournalFileIO::isWritable() const { return base->isWritable(); }
+
+bool JournalFileIO::isHole(off_t offset, size_t len) const {
+  WriteJournal::Reader reader(*journal);
+  if (file && journal->size(*file) > 0) {
+    return false;
+  }
+  refresh();
+  return base->isHole(offset, len);
+}
+
+off_t JournalFileIO::seekExtent(off_t offset, bool hole) const {
+  if (file) {
+    int res = journal->settle(*file);
+    if (res < 0) {
+      return res;
+    }
+    refresh();
+  }
+  return base->seekExtent(offset, hole);
+}
+
+int JournalFileIO::allocate(int mode, off_t offset, off_t len) {
+  if (file) {
+    int res = journal->settle(*file);
+    if (res < 0) {
+      return res;
+    }
+    refresh();
+  }
+  return base->allocate(mode, offset, len);
+}
+
+void JournalFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+void JournalFileIO::invalidateData(off_t offset, size_t len) {
+  base->invalidateData(offset, len);
+}
+
+void JournalFileIO::advise(off_t offset, off_t len, Advice advice) const {
+  base->advise(offset, len, advice);
+}
+
+}  // namespace encfs
@@ -0,0 +1,73 @@
+#ifndef _JournalFileIO_incl_
+#define _JournalFileIO_incl_
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "FileIO.h"
+#include "Interface.h"
+#include "WriteJournal.h"
+
+namespace encfs {
+
+/*
+    A backing file whose writes go through the WriteJournal of the mount
+    (--write-journal).  Sits right above the RawFileIO of the backing
+    file, so the journal holds blocks as they are stored, MACs and all.
+
+    Writes are logged rather than written; reads and sizes seen through it
+    include them until a checkpoint has written them into the backing
+    file.  A truncate, and the calls that look at the extents of the
+    backing file, settle the journal first.
+ */
+class JournalFileIO : public FileIO {
+ public:
+  JournalFileIO(std::shared_ptr<FileIO> base,
+                std::shared_ptr<WriteJournal> journal);
+  virtual ~JournalFileIO();
+
+  virtual Interface interface() const;
+  virtual unsigned int blockSize() const;
+
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+  virtual bool setIV(uint64_t iv);
+
+  virtual int open(int flags);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t write(const IORequest &req);
+
+  virtual int truncate(off_t size);
+  virtual bool isWritable() const;
+
+  virtual bool isHole(off_t offset, size_t len) const;
+  virtual off_t seekExtent(off_t offset, bool hole) const;
+  virtual int allocate(int mode, off_t offset, off_t len);
+  virtual void invalidateAttr();
+  virtual void invalidateData(off_t offset, size_t len);
+  virtual void advise(off_t offset, off_t len, Advice advice) const;
+
+ private:
+  JournalFileIO(const JournalFileIO &src);             // not allowed
+  JournalFileIO &operator=(const JournalFileIO &src);  // not allowed
+
+  // drops what base cached of the backing file once a checkpoint wrote
+  // into it.  Called under a WriteJournal::Reader.
+  void refresh() const;
+
+  std::shared_ptr<FileIO> base;
+  std::shared_ptr<WriteJournal> journal;
+  // of the backing file, set by the first open()
+  std::shared_ptr<WriteJournal::File> file;
+  // WriteJournal::applied() as last seen
+  mutable std::atomic<uint64_t> applied;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,110 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "KdfCalibration.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Error.h"
+
+namespace encfs {
+namespace KdfCalibration {
+
+// the calibration file, or empty when there is no cache directory
+static std::string path() {
+  std::string dir;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg != nullptr && xdg[0] == '/') {
+    dir = xdg;
+  } else if (home != nullptr && home[0] == '/') {
+    dir = std::string(home) + "/.cache";
+  } else {
+    return std::string();
+  }
+  return dir + "/encfs-kdf";
+}
+
+// name and rate a line, as `name rate`
+static std::map<std::string, double> load(const std::string &file) {
+  std::map<std::string, double> rates;
+  FILE *in = fopen(file.c_str(), "r");
+  if (in == nullptr) {
+    return rates;
+  }
+  char name[128];
+  double value;
+  while (fscanf(in, "%127s %lf", name, &value) == 2) {
+    if (value > 0) {
+      rates[name] = value;
+    }
+  }
+  fclose(in);
+  return rates;
+}
+
+double rate(const std::string &name) {
+  std::string file = path();
+  if (file.empty()) {
+    return 0;
+  }
+  std::map<std::string, double> rates = load(file);
+  auto it = rates.find(name);
+  return it == rates.end() ? 0 : it->second;
+}
+
+void store(const std::string &name, double iterationsPerMs) {
+  std::string file = path();
+  if (file.empty() || iterationsPerMs <= 0) {
+    return;
+  }
+  std::map<std::string, double> rates = load(file);
+  rates[name] = iterationsPerMs;
+
+  std::string dir = file.substr(0, file.rfind('/'));
+  if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    VLOG(1) << "unable to make " << dir << ": " << strerror(errno);
+    return;
+  }
+  // written aside and renamed, so that volumes made side by side each see
+  // a whole file
+  std::string tmp = file + "." + std::to_string(getpid());
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (out == nullptr) {
+    VLOG(1) << "unable to write " << tmp << ": " << strerror(errno);
+    return;
+  }
+  for (const auto &it : rates) {
+    fprintf(out, "%s %.3f\n", it.first.c_str(), it.second);
+  }
+  bool ok = fclose(out) == 0;
+  if (!ok || ::rename(tmp.c_str(), file.c_str()) != 0) {
+    VLOG(1) << "unable to save " << file << ": " << strerror(errno);
+    ::unlink(tmp.c_str());
+  }
+}
+
+}  // namespace KdfCalibration
+}  // namespace encfs
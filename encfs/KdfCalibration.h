@@ -0,0 +1,33 @@
+#ifndef _KdfCalibration_incl_
+#define _KdfCalibration_incl_
+
+#include <string>
+
+namespace encfs {
+
+/*
+    How fast a key derivation runs on this host, kept in a small file of
+    the user's cache directory ($XDG_CACHE_HOME, or ~/.cache) so that
+    timing it for a new volume or password (TimedPBKDF2) can start at the
+    iteration count that meets the time asked for, rather than work up to
+    it with trial derivations every time.
+
+    The rate is only where the timing starts: the derivation that makes the
+    key is still timed, and repeated with more iterations if it came out
+    short.  What it measured goes back in the file, so the rate follows the
+    host as it is used.  A missing or unreadable file costs only the trial
+    derivations of before.
+ */
+namespace KdfCalibration {
+
+// iterations a millisecond of the derivation named name (its algorithm,
+// digest and output length) remembered on this host, or 0
+double rate(const std::string &name);
+
+// remembers a rate measured for name
+void store(const std::string &name, double iterationsPerMs);
+
+}  // namespace KdfCalibration
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,257 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "KernelCrypto.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/if_alg.h>
+#endif
+
+#include "Error.h"
+#include "Mutex.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+namespace encfs {
+
+static std::atomic<bool> gEnabled(false);
+// set once the fallback to OpenSSL has been reported
+static std::atomic<bool> gWarned(false);
+
+// the largest IV of the algorithms we take
+static const int MaxIVLength = 32;
+
+void KernelCrypto::setEnabled(bool enabled) { gEnabled = enabled; }
+
+bool KernelCrypto::enabled() { return gEnabled; }
+
+#if defined(__linux__)
+
+std::shared_ptr<KernelCrypto> KernelCrypto::New(const char *algName,
+                                                const unsigned char *key,
+                                                int keyLen, int ivLength) {
+  if (ivLength <= 0 || ivLength > MaxIVLength) {
+    return nullptr;
+  }
+  int tfm = ::socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (tfm < 0) {
+    int eno = errno;
+    if (!gWarned.exchange(true)) {
+      RLOG(WARNING) << "kernel crypto is not available, using OpenSSL: "
+                    << strerror(eno);
+    }
+    return nullptr;
+  }
+
+  struct sockaddr_alg sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.salg_family = AF_ALG;
+  strncpy((char *)sa.salg_type, "skcipher", sizeof(sa.salg_type) - 1);
+  strncpy((char *)sa.salg_name, algName, sizeof(sa.salg_name) - 1);
+  if (::bind(tfm, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+      ::setsockopt(tfm, SOL_ALG, ALG_SET_KEY, key, keyLen) != 0) {
+    int eno = errno;
+    if (!gWarned.exchange(true)) {
+      RLOG(WARNING) << "kernel crypto can not use " << algName
+                    << ", using OpenSSL: " << strerror(eno);
+    }
+    ::close(tfm);
+    return nullptr;
+  }
+
+  VLOG(1) << "kernel crypto: using " << algName;
+  return std::shared_ptr<KernelCrypto>(
+      new KernelCrypto(algName, tfm, ivLength));
+}
+
+#else
+
+std::shared_ptr<KernelCrypto> KernelCrypto::New(const char *algName,
+                                                const unsigned char *key,
+                                                int keyLen, int ivLength) {
+  (void)key;
+  (void)keyLen;
+  (void)ivLength;
+  if (!gWarned.exchange(true)) {
+    RLOG(WARNING) << "kernel crypto is not available for " << algName
+                  << ", using OpenSSL";
+  }
+  return nullptr;
+}
+
+#endif
+
+KernelCrypto::KernelCrypto(const std::string &name, int tfm, int ivLength)
+    : _name(name), _tfm(tfm), _ivLength(ivLength) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+KernelCrypto::~KernelCrypto() {
+  for (int fd : _idle) {
+    ::close(fd);
+  }
+  ::close(_tfm);
+  pthread_mutex_destroy(&_mutex);
+}
+
+int KernelCrypto::acquire() {
+  {
+    Lock lock(_mutex);
+    if (!_idle.empty()) {
+      int fd = _idle.back();
+      _idle.pop_back();
+      return fd;
+    }
+  }
+  return ::accept4(_tfm, nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+void KernelCrypto::release(int fd) {
+  Lock lock(_mutex);
+  _idle.push_back(fd);
+}
+
+bool KernelCrypto::encode(unsigned char *buf, int size,
+                          const unsigned char *iv) {
+  return run(true, buf, size, iv);
+}
+
+bool KernelCrypto::decode(unsigned char *buf, int size,
+                          const unsigned char *iv) {
+  return run(false, buf, size, iv);
+}
+
+#if defined(__linux__)
+
+bool KernelCrypto::run(bool encrypt, unsigned char *buf, int size,
+                       const unsigned char *iv) {
+  if (size % _ivLength != 0) {
+    RLOG(ERROR) << "Invalid data size, not multiple of block size";
+    return false;
+  }
+  int fd = acquire();
+  if (fd < 0) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to start a " << _name
+                << " request: " << strerror(eno);
+    return false;
+  }
+
+  unsigned char ivec[MaxIVLength];
+  memcpy(ivec, iv, _ivLength);
+  const uint32_t op = encrypt ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+  union {
+    char buf[CMSG_SPACE(sizeof(uint32_t)) +
+             CMSG_SPACE(sizeof(struct af_alg_iv) + MaxIVLength)];
+    struct cmsghdr align;
+  } control;
+
+  bool ok = true;
+  int done = 0;
+  while (ok && done < size) {
+    int len = size - done < MaxRequestBytes ? size - done : MaxRequestBytes;
+    unsigned char *data = buf + done;
+    // in CBC the next IV is the last cipher block so far
+    unsigned char nextIV[MaxIVLength];
+    if (!encrypt) {
+      memcpy(nextIV, data + len - _ivLength, _ivLength);
+    }
+
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(uint32_t)) +
+                         CMSG_SPACE(sizeof(struct af_alg_iv) + _ivLength);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_OP;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+    memcpy(CMSG_DATA(cmsg), &op, sizeof(op));
+
+    cmsg = CMSG_NXTHDR(&msg, cmsg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_IV;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + _ivLength);
+    struct af_alg_iv *algIV = (struct af_alg_iv *)CMSG_DATA(cmsg);
+    algIV->ivlen = _ivLength;
+    memcpy(algIV->iv, ivec, _ivLength);
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    ssize_t res = ::sendmsg(fd, &msg, 0);
+    if (res == len) {
+      res = ::read(fd, data, len);
+    }
+    if (res != len) {
+      int eno = res < 0 ? errno : EIO;
+      RLOG(ERROR) << _name << " request of " << len
+                  << " bytes failed: " << strerror(eno);
+      ok = false;
+      break;
+    }
+
+    if (encrypt) {
+      memcpy(nextIV, data + len - _ivLength, _ivLength);
+    }
+    memcpy(ivec, nextIV, _ivLength);
+    done += len;
+  }
+
+  memset(&control, 0, sizeof(control));
+  memset(ivec, 0, sizeof(ivec));
+  if (ok) {
+    release(fd);
+  } else {
+    // a failed request may leave data queued on the socket
+    ::close(fd);
+  }
+  return ok;
+}
+
+#else
+
+bool KernelCrypto::run(bool encrypt, unsigned char *buf, int size,
+                       const unsigned char *iv) {
+  (void)encrypt;
+  (void)buf;
+  (void)size;
+  (void)iv;
+  return false;
+}
+
+#endif
+
+}  // namespace encfs
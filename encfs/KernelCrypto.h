@@ -0,0 +1,72 @@
+#ifndef _KernelCrypto_incl_
+#define _KernelCrypto_incl_
+
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace encfs {
+
+/*
+    Block encryption done by the kernel's crypto API through AF_ALG
+    sockets, which hands it to whatever the kernel has for the algorithm:
+    a hardware accelerator such as QAT, CCP or CAAM when one is loaded, or
+    its own AES-NI code otherwise.  SSL_Cipher uses it for file blocks,
+    with the same key and IVs as OpenSSL would, so the data on disk is the
+    same either way (--crypto-engine=kernel).
+
+    Only CBC modes are taken, which let a large block be sent in several
+    requests by chaining the IV.  Each key gets its own transform socket;
+    a request borrows one of its operation sockets, so that concurrent
+    callers, such as the crypto pool, keep several requests in flight.
+
+    The key is handed to the kernel, which keeps it until the transform is
+    closed.
+ */
+class KernelCrypto {
+ public:
+  // whether SSL_Cipher keys are to use the kernel, set before any key is
+  // made
+  static void setEnabled(bool enabled);
+  static bool enabled();
+
+  // an engine for the CBC algorithm algName of the kernel (eg.
+  // "cbc(aes)"), keyed with keyLen bytes of key, or null if the kernel
+  // does not offer it
+  static std::shared_ptr<KernelCrypto> New(const char *algName,
+                                           const unsigned char *key,
+                                           int keyLen, int ivLength);
+  ~KernelCrypto();
+
+  // codes size bytes of buf in place, a multiple of the cipher block
+  // size, starting from iv
+  bool encode(unsigned char *buf, int size, const unsigned char *iv);
+  bool decode(unsigned char *buf, int size, const unsigned char *iv);
+
+ private:
+  // bytes sent in one request, within any kernel's socket buffer
+  static const int MaxRequestBytes = 64 * 1024;
+
+  KernelCrypto(const std::string &name, int tfm, int ivLength);
+
+  bool run(bool encrypt, unsigned char *buf, int size,
+           const unsigned char *iv);
+  int acquire();
+  void release(int fd);
+
+  std::string _name;
+  int _tfm;
+  int _ivLength;
+
+  // idle operation sockets, protected by _mutex
+  pthread_mutex_t _mutex;
+  std::vector<int> _idle;
+
+  KernelCrypto(const KernelCrypto &);             // not allowed
+  KernelCrypto &operator=(const KernelCrypto &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,160 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "KeyCache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <openssl/crypto.h>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "FSConfig.h"
+
+namespace encfs {
+namespace KeyCache {
+
+#ifdef __linux__
+
+// the key is written with a random wrapping key kept next to it, which
+// gives readKey's checksum to tell a damaged or foreign entry
+static const int SecretBytes = 32;
+
+// key permissions, as keyutils names them
+static const uint32_t PossessorAll = 0x3f000000;
+static const uint32_t UserView = 0x00010000;
+static const uint32_t UserRead = 0x00020000;
+static const uint32_t UserSearch = 0x00080000;
+
+// "encfs:" and a hash of the encrypted volume key, which changes with the
+// password
+static std::string description(const EncFSConfig &config) {
+  uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+  auto add = [&hash](const std::vector<unsigned char> &data) {
+    for (unsigned char c : data) {
+      hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+  };
+  add(config.keyData);
+  add(config.salt);
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "encfs:%016llx", (unsigned long long)hash);
+  return buf;
+}
+
+CipherKey fetch(const std::shared_ptr<Cipher> &cipher,
+                const EncFSConfig &config) {
+  CipherKey result;
+  std::string desc = description(config);
+  long id = syscall(__NR_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, "user",
+                    desc.c_str(), 0);
+  if (id < 0) {
+    VLOG(1) << "no volume key in the keyring";
+    return result;
+  }
+
+  std::vector<unsigned char> payload(SecretBytes + cipher->encodedKeySize());
+  long len = syscall(__NR_keyctl, KEYCTL_READ, id, payload.data(),
+                     payload.size());
+  if (len == (long)payload.size()) {
+    CipherKey wrapKey =
+        cipher->newKey((const char *)payload.data(), SecretBytes);
+    if (wrapKey) {
+      result = cipher->readKey(payload.data() + SecretBytes, wrapKey, true);
+    }
+  }
+  OPENSSL_cleanse(payload.data(), payload.size());
+
+  if (result) {
+    VLOG(1) << "volume key taken from the keyring";
+  } else {
+    RLOG(WARNING) << "dropping unreadable volume key from the keyring";
+    syscall(__NR_keyctl, KEYCTL_UNLINK, id, KEY_SPEC_USER_KEYRING);
+  }
+  return result;
+}
+
+bool store(const std::shared_ptr<Cipher> &cipher, const EncFSConfig &config,
+           const CipherKey &volumeKey, int seconds) {
+  std::vector<unsigned char> payload(SecretBytes + cipher->encodedKeySize());
+  bool ok = cipher->randomize(payload.data(), SecretBytes, true);
+  if (ok) {
+    CipherKey wrapKey =
+        cipher->newKey((const char *)payload.data(), SecretBytes);
+    ok = (bool)wrapKey;
+    if (ok) {
+      cipher->writeKey(volumeKey, payload.data() + SecretBytes, wrapKey);
+    }
+  }
+
+  long id = -1;
+  if (ok) {
+    std::string desc = description(config);
+    id = syscall(__NR_add_key, "user", desc.c_str(), payload.data(),
+                 payload.size(), KEY_SPEC_USER_KEYRING);
+  }
+  OPENSSL_cleanse(payload.data(), payload.size());
+  if (id < 0) {
+    RLOG(WARNING) << "unable to keep the volume key in the keyring";
+    return false;
+  }
+
+  // the user keyring is not possessed by later processes, so they need
+  // the user's permission to find and read the entry
+  syscall(__NR_keyctl, KEYCTL_SETPERM, id,
+          PossessorAll | UserView | UserRead | UserSearch);
+  if (syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, id, seconds) < 0) {
+    RLOG(WARNING) << "unable to set the keyring timeout, dropping the key";
+    syscall(__NR_keyctl, KEYCTL_UNLINK, id, KEY_SPEC_USER_KEYRING);
+    return false;
+  }
+  VLOG(1) << "volume key kept in the keyring for " << seconds << "s";
+  return true;
+}
+
+#else
+
+CipherKey fetch(const std::shared_ptr<Cipher> &cipher,
+                const EncFSConfig &config) {
+  (void)cipher;
+  (void)config;
+  return CipherKey();
+}
+
+bool store(const std::shared_ptr<Cipher> &cipher, const EncFSConfig &config,
+           const CipherKey &volumeKey, int seconds) {
+  (void)cipher;
+  (void)config;
+  (void)volumeKey;
+  (void)seconds;
+  return false;
+}
+
+#endif
+
+}  // namespace KeyCache
+}  // namespace encfs
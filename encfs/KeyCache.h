@@ -0,0 +1,39 @@
+#ifndef _KeyCache_incl_
+#define _KeyCache_incl_
+
+#include <memory>
+
+#include "CipherKey.h"
+
+namespace encfs {
+
+class Cipher;
+struct EncFSConfig;
+
+/*
+    Keeps the volume key of a filesystem in the user's kernel keyring for a
+    while (--key-cache), so that mounting it again, on demand or by another
+    encfs of the same user, finds the key without asking for the password
+    and running the key derivation.  An entry is named after the encrypted
+    key in the config, so it only matches the same volume and password, and
+    the kernel drops it when it expires; `keyctl purge user encfs:` drops
+    them all sooner.
+
+    While an entry lives, processes of its user can read the volume key;
+    that is the bargain of turning it on.  Without the kernel keyring
+    (other than Linux) nothing is kept.
+ */
+namespace KeyCache {
+
+// the volume key of config kept earlier, or an empty key
+CipherKey fetch(const std::shared_ptr<Cipher> &cipher,
+                const EncFSConfig &config);
+
+// keeps volumeKey, the key of config, for the given seconds
+bool store(const std::shared_ptr<Cipher> &cipher, const EncFSConfig &config,
+           const CipherKey &volumeKey, int seconds);
+
+}  // namespace KeyCache
+}  // namespace encfs
+
+#endif
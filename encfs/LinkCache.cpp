@@ -0,0 +1,119 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "LinkCache.h"
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static const struct timespec &mtimeOf(const struct stat &stbuf) {
+#if defined(__APPLE__)
+  return stbuf.st_mtimespec;
+#else
+  return stbuf.st_mtim;
+#endif
+}
+
+static const struct timespec &ctimeOf(const struct stat &stbuf) {
+#if defined(__APPLE__)
+  return stbuf.st_ctimespec;
+#else
+  return stbuf.st_ctim;
+#endif
+}
+
+static bool sameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+size_t LinkCache::KeyHash::operator()(const Key &k) const {
+  uint64_t h = (uint64_t)k.dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.ino;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return (size_t)h;
+}
+
+LinkCache::LinkCache(size_t maxEntries)
+    : _maxEntries(maxEntries > 0 ? maxEntries : 1), _hits(0), _misses(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+LinkCache::~LinkCache() {
+  VLOG(1) << "link cache: " << hits() << " hits, " << misses() << " misses";
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool LinkCache::get(const struct stat &stbuf, std::string *target) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+
+  Lock lock(_mutex);
+  auto it = _index.find(key);
+  if (it == _index.end()) {
+    ++_misses;
+    return false;
+  }
+
+  Entry &entry = *it->second;
+  if (!sameTime(entry.mtime, mtimeOf(stbuf)) ||
+      !sameTime(entry.ctime, ctimeOf(stbuf)) || entry.size != stbuf.st_size) {
+    // another link, or one changed since
+    _lru.erase(it->second);
+    _index.erase(it);
+    ++_misses;
+    return false;
+  }
+
+  ++_hits;
+  _lru.splice(_lru.begin(), _lru, it->second);
+  *target = entry.target;
+  return true;
+}
+
+void LinkCache::put(const struct stat &stbuf, const std::string &target) {
+  Key key = {stbuf.st_dev, stbuf.st_ino};
+
+  Lock lock(_mutex);
+  auto it = _index.find(key);
+  if (it != _index.end()) {
+    _lru.erase(it->second);
+    _index.erase(it);
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.mtime = mtimeOf(stbuf);
+  entry.ctime = ctimeOf(stbuf);
+  entry.size = stbuf.st_size;
+  entry.target = target;
+  _lru.push_front(entry);
+  _index[key] = _lru.begin();
+
+  while (_lru.size() > _maxEntries) {
+    _index.erase(_lru.back().key);
+    _lru.pop_back();
+  }
+}
+
+uint64_t LinkCache::hits() const { return _hits; }
+
+uint64_t LinkCache::misses() const { return _misses; }
+
+}  // namespace encfs
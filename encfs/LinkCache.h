@@ -0,0 +1,69 @@
+#ifndef _LinkCache_incl_
+#define _LinkCache_incl_
+
+#include <atomic>
+#include <list>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+namespace encfs {
+
+/*
+    LRU cache of decoded symlink targets, so that stat'ing a link does not
+    read and decode its target every time, and readlink finds it decoded.
+
+    Entries are keyed by the backing link's device and inode, and only used
+    while its mtime, ctime and size are the ones recorded with the target.
+    A link that is replaced gets another inode or ctime, and is read again.
+ */
+class LinkCache {
+ public:
+  explicit LinkCache(size_t maxEntries);
+  ~LinkCache();
+
+  // fills in the target recorded for the link stbuf describes, if any
+  bool get(const struct stat &stbuf, std::string *target);
+  void put(const struct stat &stbuf, const std::string &target);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const Key &o) const {
+      return dev == o.dev && ino == o.ino;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const;
+  };
+  struct Entry {
+    Key key;
+    struct timespec mtime;
+    struct timespec ctime;
+    off_t size;
+    std::string target;
+  };
+  using EntryList = std::list<Entry>;
+
+  pthread_mutex_t _mutex;
+  EntryList _lru;  // most recently used first
+  std::unordered_map<Key, EntryList::iterator, KeyHash> _index;
+  size_t _maxEntries;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  LinkCache(const LinkCache &);             // not allowed
+  LinkCache &operator=(const LinkCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
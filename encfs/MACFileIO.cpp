@@ -11,32 +11,50 @@
 #include "Error.h"
 #include "FileIO.h"
 #include "FileUtils.h"
-#include "FileUtils.h"
 #include "MemoryPool.h"
+#include "OpStats.h"
+#include "Probes.h"
 #include "i18n.h"
 
 using namespace std;
 
+namespace encfs {
+
 static Interface MACFileIO_iface("FileIO/MAC", 2, 1, 0);
 
-int dataBlockSize(const FSConfigPtr& cfg) {
+static int dataBlockSize(const FSConfigPtr& cfg) {
   return cfg->config->blockSize - cfg->config->blockMACBytes - 
          cfg->config->blockMACRandBytes;
 }
 
 MACFileIO::MACFileIO(std::shared_ptr<FileIO> _base, const FSConfigPtr& cfg)
-  : BlockFileIO(dataBlockSize(cfg), cfg),
+  : BlockFileIO(dataBlockSize(cfg), cfg, OpStats::MacLayer),
     base(std::move(_base)),
     cipher(cfg->cipher),
     key(cfg->key),
     macBytes(cfg->config->blockMACBytes),
     randBytes(cfg->config->blockMACRandBytes),
-    warnOnly(cfg->opts->forceDecode) {
+    macAlgorithm(cfg->config->blockMACAlgorithm),
+    warnOnly(cfg->opts->forceDecode),
+    _rawBlocks(dataBlockSize(cfg) + macBytes + randBytes) {
       rAssert(macBytes >= 0 && macBytes <= 8);
       rAssert(randBytes >= 0);
       VLOG(1) << "fs block size = " << cfg->config->blockSize
               << ", macBytes = " << cfg->config->blockMACBytes
-              << ", randBytes = " << cfg->config->blockMACRandBytes;
+              << ", randBytes = " << cfg->config->blockMACRandBytes
+              << ", macAlgorithm = " << cfg->config->blockMACAlgorithm;
+
+      // we cache and read ahead ourselves: a cache in the layer below
+      // would keep every block twice in the shared cache, and prefetching
+      // there would only race with our prefetch jobs
+      auto blockBase = std::dynamic_pointer_cast<BlockFileIO>(base);
+      if (blockBase) {
+        blockBase->disableCache();
+      }
+
+      // have our temporaries leave room for the block header, so blocks
+      // can be read and sealed without copying the payload
+      _headroom = macBytes + randBytes;
     }
 
 MACFileIO::~MACFileIO() = default;
@@ -45,7 +63,7 @@ Interface MACFileIO::interface() const { return MACFileIO_iface; }
 
 int MACFileIO::open(int flags) { return base->open(flags); }
 
-void MACFileIo::setFileName(const char* fileName) {
+void MACFileIO::setFileName(const char* fileName) {
   base->setFileName(fileName);
 }
 
@@ -53,150 +71,484 @@ const char* MACFileIO::getFileName() const { return base->getFileName(); }
 
 bool MACFileIO::setIV(uint64_t iv) { return base->setIV(iv); }
 
-inline static off_t roundUpdivide(off_t numerator, int denominator) {
+inline static off_t roundUpDivide(off_t numerator, int denominator) {
   return (numerator + denominator - 1) / denominator;
 }
 
-static off_t locWithHeader(off_t offset, int blockSize, int headerSize) {
-  off_t blockNum = roundUpDivide(offset, blockSize - headerSize);
-  return offset + blockNum * headerSize;
-}
-
 static off_t locWithoutHeader(off_t offset, int blockSize, int headerSize) {
   off_t blockNum = roundUpDivide(offset, blockSize);
   return offset - blockNum * headerSize;
 }
 
+// where a data offset lies in the base file, and back, with the dividers
+// made for this file's layout: _blocks is by data block, _rawBlocks by
+// block with its header
+off_t MACFileIO::withHeader(off_t offset) const {
+  return offset + (off_t)_blocks.divUp(offset) * (macBytes + randBytes);
+}
+
+off_t MACFileIO::withoutHeader(off_t offset) const {
+  return offset - (off_t)_rawBlocks.divUp(offset) * (macBytes + randBytes);
+}
+
 int MACFileIO::getAttr(struct stat* stbuf) const {
   int res = base->getAttr(stbuf);
 
   if (res == 0 && S_ISREG(stbuf->st_mode)) {
-    int headerSize = macbytes + randBytes;
-    int bs = blockSize() + headerSize;
-    stbuf->st_size = locWithoutHeader(stbuf->st_size, bs, headerSize);
+    stbuf->st_size = withoutHeader(stbuf->st_size);
   }
   return res;
 }
 
-off_t MACFileIO::getSize() const {
-  int headerSize = macBytes + randBytes;
-  int bs = blockSize() + headerSize;
+void MACFileIO::plainAttr(const FSConfigPtr& cfg, struct stat* stbuf) {
+  if (S_ISREG(stbuf->st_mode)) {
+    int headerSize =
+        cfg->config->blockMACBytes + cfg->config->blockMACRandBytes;
+    int bs = dataBlockSize(cfg) + headerSize;
+    stbuf->st_size = locWithoutHeader(stbuf->st_size, bs, headerSize);
+  }
+}
 
+off_t MACFileIO::getSize() const {
   off_t size = base->getSize();
 
   if (size > 0) {
-    size = locWithoutHeader(size, bs, headerSize);
+    size = withoutHeader(size);
   }
   return size;
 }
 
-ssize_t MACFileIO::readOneBlock(const IORequest& req) const {
-  int headerSize = macBytes + randBytes;
+/**
+ * With holes allowed, the part of a read of rawLen bytes at rawOffset in
+ * the base file that is in a hole: the data length the read would have
+ * returned, or -1 if the range is not known to be a hole.  Hole blocks
+ * have no header to check.
+ */
+ssize_t MACFileIO::holeLength(off_t rawOffset, size_t rawLen) const {
+  if (!_allowHoles || !base->isHole(rawOffset, rawLen)) {
+    return -1;
+  }
+  off_t rawSize = base->getSize();
+  if (rawSize < 0) {
+    return -1;
+  }
 
-  int bs = blockSize() + headerSize;
+  off_t end = rawOffset + (off_t)rawLen;
+  if (end > rawSize) {
+    end = rawSize;
+  }
+  if (end <= rawOffset) {
+    return 0;
+  }
+  off_t len = withoutHeader(end) - withoutHeader(rawOffset);
+  // a last block too short to hold its header has no data
+  return len > 0 ? len : 0;
+}
 
-  MemBlock mb = MemoryPool::allocate(bs);
+uint64_t MACFileIO::blockMAC(const unsigned char* data, int len,
+                             off_t blockNum) const {
+  StatTimer timer(OpStats::Mac);
+  timer.addBytes(len);
+  if (macAlgorithm == BlockMAC_SipHash) {
+    return cipher->FastMAC_64(data, len, (uint64_t)blockNum, key);
+  }
+  return cipher->MAC_64(data, len, key);
+}
 
-  IORequest tmp;
-  tmp.offset = loWithHeader(req.offset, bs, headerSize);
-  tmp.data = mb.data;
-  tmp.dataLen = headerSize + req.dataLen;
+void MACFileIO::blockMACs(const Cipher::MACRequest* blocks, int count,
+                          uint64_t* macs) const {
+  StatTimer timer(OpStats::Mac);
+  for (int i = 0; i < count; ++i) {
+    timer.addBytes(blocks[i].len);
+  }
+  if (macAlgorithm == BlockMAC_SipHash) {
+    cipher->FastMACBatch(blocks, count, macs, key);
+    return;
+  }
+  for (int i = 0; i < count; ++i) {
+    macs[i] = cipher->MAC_64(blocks[i].data, blocks[i].len, key);
+  }
+}
 
-  ssize_t readSize = base->read(tmp);
+/*
+ * The bits in which the macBytes low bytes of mac differ from the tag
+ * stored at raw, 0 when they match.  Takes the same time either way.
+ */
+static uint64_t tagDiff(const unsigned char* raw, uint64_t mac,
+                        int macBytes) {
+  uint64_t stored = 0;
+  for (int i = macBytes - 1; i >= 0; --i) {
+    stored = (stored << 8) | raw[i];
+  }
+  uint64_t mask = macBytes < 8 ? ((uint64_t)1 << (8 * macBytes)) - 1
+                               : ~(uint64_t)0;
+  return (stored ^ mac) & mask;
+}
+
+/**
+ * Check the header of a raw block of rawLen bytes, header included.
+ * Returns the number of data bytes in the block, or -EBADMSG when the MAC
+ * does not match
+ */
+ssize_t MACFileIO::checkBlock(const unsigned char* raw, ssize_t rawLen,
+                              off_t blockNum) const {
+  int headerSize = macBytes + randBytes;
 
   bool skipBlock = true;
   if (_allowHoles) {
-    for (int i =0 ; i < readSize; ++i) {
-      if (tmp.data[i] != 0) {
-        skipBlock = false;
-        break;
-      }
-    }
+    skipBlock = isZero(raw, rawLen);
   } else if (macBytes > 0) {
     skipBlock = false;
   }
 
-  if (readSize > headerSize) {
-    if (!skipBlock) {
-      uint64_t mac =
-        cipher->MAC_64(tmp.data + macBytes, readSize - macBytes, key);
-      unsigned char fail = 0;
-      for (int i = 0; i < macBytes; ++i, mac >>= 8) {
-        int test = mac & 0xff;
-        int stored = tmp.data[i];
+  if (rawLen <= headerSize) {
+    HOT_VLOG(1) << "readSize " << rawLen << " in block " << blockNum;
+    return 0;
+  }
+
+  if (!skipBlock) {
+    ProbeClock clock(ENCFS_PROBE_ENABLED(mac_verify));
+    uint64_t mac = blockMAC(raw + macBytes, rawLen - macBytes, blockNum);
+    uint64_t fail = tagDiff(raw, mac, macBytes);
+    ENCFS_PROBE3(mac_verify, blockNum, fail == 0, clock.elapsed());
+    OpStats::count(OpStats::MacVerified);
+
+    if (fail != 0) {
+      OpStats::count(OpStats::MacFailed);
+      RLOG(WARNING) << "MAC comparison failure in block " << blockNum;
+      if (!warnOnly) {
+        return -EBADMSG;
+      }
+    }
+  }
+  return rawLen - headerSize;
+}
 
-        fail |= (test & stored);
+/**
+ * Check the headers of the raw blocks of a run, rawLen bytes of them from
+ * raw, the first being blockNum, as checkBlock does one by one.  The MACs
+ * are computed MACBatch blocks per call, and every tag of a batch is
+ * compared before any is acted on.
+ * Returns 0, or -EBADMSG when a MAC does not match
+ */
+int MACFileIO::checkBlocks(const unsigned char* raw, ssize_t rawLen,
+                           off_t blockNum) const {
+  if (macBytes == 0) {
+    return 0;
+  }
+  int headerSize = macBytes + randBytes;
+  ssize_t bs = blockSize() + headerSize;
+
+  static const int MACBatch = 32;
+  Cipher::MACRequest blocks[MACBatch];
+  const unsigned char* tags[MACBatch];
+  uint64_t macs[MACBatch];
+
+  int res = 0;
+  for (ssize_t done = 0; done < rawLen;) {
+    ProbeClock clock(ENCFS_PROBE_ENABLED(mac_verify));
+    int count = 0;
+    for (; count < MACBatch && done < rawLen; done += bs, ++blockNum) {
+      const unsigned char* block = raw + done;
+      ssize_t len = rawLen - done < bs ? rawLen - done : bs;
+      if (len <= headerSize || (_allowHoles && isZero(block, len))) {
+        continue;
       }
+      blocks[count].data = block + macBytes;
+      blocks[count].len = (int)(len - macBytes);
+      blocks[count].nonce = (uint64_t)blockNum;
+      tags[count] = block;
+      ++count;
+    }
+    if (count == 0) {
+      continue;
+    }
+    blockMACs(blocks, count, macs);
+    OpStats::count(OpStats::MacVerified, count);
 
-      if (fail > 0) {
-        long blockNum = req.offset / bs;
-        RLOG(WARNING) << "MAC comparison failure in block " << blockNum;
-        if (!warnOnly) {
-          MemoryPool::release(mb);
-          return -EBADMSG;
+    uint64_t fail = 0;
+    for (int i = 0; i < count; ++i) {
+      macs[i] = tagDiff(tags[i], macs[i], macBytes);
+      fail |= macs[i];
+    }
+    if (ENCFS_PROBE_ENABLED(mac_verify)) {
+      for (int i = 0; i < count; ++i) {
+        ENCFS_PROBE3(mac_verify, blocks[i].nonce, macs[i] == 0,
+                     clock.elapsed() / count);
+      }
+    }
+
+    if (fail != 0) {
+      for (int i = 0; i < count; ++i) {
+        if (macs[i] != 0) {
+          OpStats::count(OpStats::MacFailed);
+          RLOG(WARNING) << "MAC comparison failure in block "
+                        << blocks[i].nonce;
         }
       }
+      if (!warnOnly) {
+        res = -EBADMSG;
+        break;
+      }
     }
-    readSize -= headerSize;
-    memcpy(req.data, tmp.data + headerSize, readSize);
+  }
+  return res;
+}
+
+/**
+ * Fill in the header of a raw block and copy dataLen bytes of data after it,
+ * unless data already is in place right after the header.
+ * Returns false if no random bytes could be had
+ */
+bool MACFileIO::sealBlock(unsigned char* raw, const unsigned char* data,
+                          size_t dataLen, off_t blockNum) const {
+  int headerSize = macBytes + randBytes;
+
+  memset(raw, 0, headerSize);
+  if (data != raw + headerSize) {
+    memcpy(raw + headerSize, data, dataLen);
+  }
+  if (randBytes > 0) {
+    if (!cipher->randomize(raw + macBytes, randBytes, false)) {
+      return false;
+    }
+  }
+
+  if (macBytes > 0) {
+    uint64_t mac = blockMAC(raw + macBytes, dataLen + randBytes, blockNum);
+
+    for (int i = 0; i < macBytes; ++i) {
+      raw[i] = mac & 0xff;
+      mac >>= 8;
+    }
+  }
+  return true;
+}
+
+/**
+ * Read one block.  When the caller's buffer has room for the header in
+ * front of it, the raw block is read straight into place and the payload
+ * needs no copy.
+ */
+ssize_t MACFileIO::readOneBlock(const IORequest& req) const {
+  int headerSize = macBytes + randBytes;
+
+  int bs = blockSize() + headerSize;
+
+  PoolBlock mb;
+  IORequest tmp;
+  tmp.offset = withHeader(req.offset);
+  tmp.dataLen = headerSize + req.dataLen;
+
+  ssize_t holeLen = holeLength(tmp.offset, tmp.dataLen);
+  if (holeLen >= 0) {
+    memset(req.data, 0, holeLen);
+    return holeLen;
+  }
+
+  if (req.headroom >= (size_t)headerSize) {
+    tmp.data = req.data - headerSize;
+    tmp.headroom = req.headroom - headerSize;
   } else {
-    VLOG(1) << "readSize " << readSize << " at offset " << req.offset;
-    if (readSize > 0) {
-      readSize = 0;
+    mb.allocate(bs);
+    tmp.data = mb.data();
+  }
+
+  ssize_t readSize = base->read(tmp);
+  if (readSize > 0) {
+    readSize = checkBlock(tmp.data, readSize, _blocks.div(req.offset));
+    if (readSize > 0 && tmp.data + headerSize != req.data) {
+      memcpy(req.data, tmp.data + headerSize, readSize);
     }
   }
-  MemoryPool::release(mb);
   return readSize;
 }
 
+/**
+ * Read the raw blocks of a run, headers included, with one request to the
+ * base file and scatter the checked data to the caller's buffers
+ */
+ssize_t MACFileIO::readBlocks(const IOVecRequest& req) const {
+  int headerSize = macBytes + randBytes;
+  int dataSize = blockSize();
+  int bs = dataSize + headerSize;
+
+  size_t blocks = req.dataLen() / dataSize;
+
+  ssize_t holeLen =
+      holeLength(withHeader(req.offset), blocks * bs);
+  if (holeLen >= 0) {
+    size_t left = holeLen;
+    for (int i = 0; i < req.iovcnt && left > 0; ++i) {
+      size_t n = req.iov[i].iov_len < left ? req.iov[i].iov_len : left;
+      memset(req.iov[i].iov_base, 0, n);
+      left -= n;
+    }
+    return holeLen;
+  }
+
+  PoolBlock mb((int)(blocks * bs));
+
+  IORequest tmp;
+  tmp.offset = withHeader(req.offset);
+  tmp.data = mb.data();
+  tmp.dataLen = blocks * bs;
+
+  ssize_t readSize = base->read(tmp);
+  if (readSize < 0) {
+    return readSize;
+  }
+
+  off_t blockNum = req.offset / dataSize;
+  int res = checkBlocks(mb.data(), readSize, blockNum);
+  if (res < 0) {
+    return res;
+  }
+
+  ssize_t result = 0;
+  const unsigned char* raw = mb.data();
+  for (int i = 0; i < req.iovcnt && readSize > 0; ++i) {
+    unsigned char* out = (unsigned char*)req.iov[i].iov_base;
+    for (size_t done = 0; done < req.iov[i].iov_len && readSize > 0;
+         done += dataSize) {
+      ssize_t rawLen = readSize < bs ? readSize : bs;
+      ssize_t dataLen = rawLen > headerSize ? rawLen - headerSize : 0;
+      memcpy(out + done, raw + headerSize, dataLen);
+
+      result += dataLen;
+      raw += bs;
+      readSize -= rawLen;
+      if (dataLen < dataSize) {
+        readSize = 0;
+      }
+    }
+  }
+
+  return result;
+}
 
+/**
+ * Write one block, sealing it in the caller's buffer when there is room for
+ * the header in front of the data
+ */
 ssize_t MACFileIO::writeOneBlock(const IORequest& req) {
   int headerSize = macBytes + randBytes;
 
   int bs = blockSize() + headerSize;
 
-  MemBlock mb = MemoryPool::allocate(bs);
-
+  PoolBlock mb;
   IORequest newReq;
-  newReq.offset = locWithHeader(req.offset, bs, headerSize);
-  newReq.data = mb.data;
+  newReq.offset = withHeader(req.offset);
   newReq.dataLen = headerSize + req.dataLen;
+  if (req.headroom >= (size_t)headerSize) {
+    newReq.data = req.data - headerSize;
+    newReq.headroom = req.headroom - headerSize;
+  } else {
+    mb.allocate(bs);
+    newReq.data = mb.data();
+  }
 
-  memset(newReq.data, 0, headerSize);
-  memcpy(newReq.data + headerSize, req.data, req.dataLen);
-  if (randBytes > 0) {
-    if (!cipher->randomize(newReq.data + macBytes, randBytes, false)) {
-      return -EBADMSG;
+  ssize_t writeSize = -EBADMSG;
+  if (sealBlock(newReq.data, req.data, req.dataLen,
+                _blocks.div(req.offset))) {
+    writeSize = base->write(newReq);
+  }
+
+  return writeSize;
+}
+
+/**
+ * Seal every block of a run and write the raw blocks with one request to
+ * the base file.  When the run is laid out as raw blocks already - one
+ * buffer per block, each right after the previous one's data with room
+ * for the header in between - the headers are filled in place.
+ */
+ssize_t MACFileIO::writeBlocks(const IOVecRequest& req) {
+  int headerSize = macBytes + randBytes;
+  int dataSize = blockSize();
+  int bs = dataSize + headerSize;
+
+  bool inPlace = req.headroom >= (size_t)headerSize && req.iovcnt > 0;
+  for (int i = 0; inPlace && i < req.iovcnt; ++i) {
+    inPlace = req.iov[i].iov_len == (size_t)dataSize &&
+              (unsigned char*)req.iov[i].iov_base ==
+                  (unsigned char*)req.iov[0].iov_base + (size_t)i * bs;
+  }
+  if (inPlace) {
+    unsigned char* first = (unsigned char*)req.iov[0].iov_base - headerSize;
+    off_t blockNum = req.offset / dataSize;
+    for (int i = 0; i < req.iovcnt; ++i) {
+      if (!sealBlock(first + (size_t)i * bs,
+                     (const unsigned char*)req.iov[i].iov_base, dataSize,
+                     blockNum + i)) {
+        return -EBADMSG;
+      }
     }
+
+    IORequest newReq;
+    newReq.offset = withHeader(req.offset);
+    newReq.data = first;
+    newReq.dataLen = (size_t)req.iovcnt * bs;
+    return base->write(newReq);
   }
 
-  if (macBytes > 0) {
-    uint64_t mac =
-      cipher->MAC_64(newReq.data + macBytes, req.dataLen + randBytes, key);
+  size_t blocks = req.dataLen() / dataSize;
+  PoolBlock mb((int)(blocks * bs));
 
-    for (int i = 0; i < macBytes; ++i) {
-      newReq.data[i] = mac & 0xff;
-      mac >>= 8;
+  off_t blockNum = req.offset / dataSize;
+  unsigned char* raw = mb.data();
+  for (int i = 0; i < req.iovcnt; ++i) {
+    const unsigned char* data = (const unsigned char*)req.iov[i].iov_base;
+    for (size_t done = 0; done < req.iov[i].iov_len; done += dataSize) {
+      if (!sealBlock(raw, data + done, dataSize, blockNum)) {
+        return -EBADMSG;
+      }
+      raw += bs;
+      ++blockNum;
     }
   }
 
-  ssize_t writeSize = base->write(newReq);
+  IORequest newReq;
+  newReq.offset = withHeader(req.offset);
+  newReq.data = mb.data();
+  newReq.dataLen = blocks * bs;
 
-  MemoryPool::release(mb);
+  ssize_t writeSize = base->write(newReq);
 
   return writeSize;
 }
 
 int MACFileIO::truncate(off_t size) {
-  int headerSize = macBytes + randBytes;
-  int bs = blockSize() + headerSize;
-
-  int res = BlockFileIO::truncateBase(size, nullptr);
-
-  if (res == 0) {
-    res = base->truncate(locWithHeader(size, bs, headerSize));
+  // shrinking, truncateBase cuts the base at a block boundary before a
+  // new partial last block is written, so that the layer below codes that
+  // block once, rather than again to cut what was just written
+  FileIO* cut = size < getSize() ? base.get() : nullptr;
+  int res = BlockFileIO::truncateBase(size, cut);
+
+  if (res == 0 && cut == nullptr) {
+    res = base->truncate(withHeader(size));
   }
   return res;
 }
 
-bool MACFileIO::isWriteable() const { return base->isWriteable(); }
+off_t MACFileIO::baseOffset(off_t offset) const {
+  return withHeader(offset);
+}
+
+int MACFileIO::allocate(int mode, off_t offset, off_t len) {
+  return BlockFileIO::allocateBase(mode, offset, len, base.get());
+}
+
+off_t MACFileIO::seekExtent(off_t offset, bool hole) const {
+  return seekBase(offset, hole, base.get());
+}
+
+void MACFileIO::advise(off_t offset, off_t len, Advice advice) const {
+  adviseBase(offset, len, advice, base.get());
+}
+
+void MACFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+bool MACFileIO::isWritable() const { return base->isWritable(); }
+
+}  // namespace encfs
@@ -8,6 +8,7 @@
 #include "BlockFileIO.h"
 #include "Cipher.h"
 #include "CipherKey.h"
+#include "Divider.h"
 #include "FSConfig.h"
 #include "Interface.h"
 
@@ -37,21 +38,50 @@ public:
   virtual int open(int flags);
   virtual int getAttr(struct stat *stbuf) const;
   virtual off_t getSize() const;
+  // as CipherFileIO::plainAttr, for attributes of the layer below
+  static void plainAttr(const FSConfigPtr &cfg, struct stat *stbuf);
 
   virtual int truncate(off_t size);
+  virtual int allocate(int mode, off_t offset, off_t len);
+  virtual off_t seekExtent(off_t offset, bool hole) const;
+  virtual void advise(off_t offset, off_t len, Advice advice) const;
+  virtual void invalidateAttr();
 
   virtual bool isWritable() const;
 
 private:
   virtual ssize_t readOneBlock(const IORequest &req) const;
   virtual ssize_t writeOneBlock(const IORequest &req);
+  virtual ssize_t readBlocks(const IOVecRequest &req) const;
+  virtual ssize_t writeBlocks(const IOVecRequest &req);
+
+  ssize_t checkBlock(const unsigned char *raw, ssize_t rawLen,
+                     off_t blockNum) const;
+  int checkBlocks(const unsigned char *raw, ssize_t rawLen,
+                  off_t blockNum) const;
+  ssize_t holeLength(off_t rawOffset, size_t rawLen) const;
+  virtual off_t baseOffset(off_t offset) const;
+  // a data offset as an offset in base, and the other way round
+  off_t withHeader(off_t offset) const;
+  off_t withoutHeader(off_t offset) const;
+  bool sealBlock(unsigned char *raw, const unsigned char *data,
+                 size_t dataLen, off_t blockNum) const;
+
+  // MAC of a block header + data, using the volume's BlockMACAlgorithm
+  uint64_t blockMAC(const unsigned char *data, int len, off_t blockNum) const;
+  // the same of count blocks, their block numbers as nonces
+  void blockMACs(const Cipher::MACRequest *blocks, int count,
+                 uint64_t *macs) const;
 
   std::shared_ptr<FileIO> base;
   std::shared_ptr<Cipher> cipher;
   CipherKey key;
   int macBytes;
   int randBytes;
+  int macAlgorithm;
   bool warnOnly;
+  // divides base offsets by the size of a block with its header
+  Divider _rawBlocks;
 };
 } // namespace encfs
 
@@ -0,0 +1,202 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MappedFileIO.h"
+
+#include <atomic>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "Error.h"
+#include "OpStats.h"
+
+namespace encfs {
+
+// how far ahead of a read the kernel is asked to fetch pages
+static const off_t HintWindow = 1024 * 1024;
+
+static thread_local sigjmp_buf *volatile gFaultJump = nullptr;
+static struct sigaction gOldSigBus;
+static pthread_once_t gSigBusOnce = PTHREAD_ONCE_INIT;
+
+static void onSigBus(int sig, siginfo_t *info, void *ctx) {
+  if (gFaultJump != nullptr) {
+    siglongjmp(*gFaultJump, 1);
+  }
+  // not one of our copies, hand it on
+  if ((gOldSigBus.sa_flags & SA_SIGINFO) != 0) {
+    gOldSigBus.sa_sigaction(sig, info, ctx);
+  } else if (gOldSigBus.sa_handler != SIG_IGN &&
+             gOldSigBus.sa_handler != SIG_DFL) {
+    gOldSigBus.sa_handler(sig);
+  } else {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+static void installSigBus() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = onSigBus;
+  // not blocked in the handler, as it is left through siglongjmp without
+  // restoring the signal mask
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, &gOldSigBus);
+}
+
+static bool guardedCopy(unsigned char *dst, const unsigned char *src,
+                        size_t len) {
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 0) != 0) {
+    gFaultJump = nullptr;
+    return false;
+  }
+  // the fences keep the compiler from moving the copy out from under the
+  // handler
+  gFaultJump = &jump;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  memcpy(dst, src, len);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  gFaultJump = nullptr;
+  return true;
+}
+
+MappedFileIO::MappedFileIO(std::string fileName)
+    : RawFileIO(std::move(fileName)), base(nullptr),
+      mapSize(0),
+      mapLen(0),
+      nextHint(0) {
+  pthread_once(&gSigBusOnce, installSigBus);
+}
+
+MappedFileIO::~MappedFileIO() {
+  if (base != nullptr) {
+    munmap(base, mapSize);
+  }
+}
+
+int MappedFileIO::open(int flags) {
+  int res = RawFileIO::open(flags);
+  if (res < 0 || base != nullptr) {
+    return res;
+  }
+
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0 || !S_ISREG(stbuf.st_mode) ||
+      stbuf.st_size <= 0 || (uint64_t)stbuf.st_size > (size_t)-1) {
+    return res;
+  }
+
+  void *map = mmap(nullptr, (size_t)stbuf.st_size, PROT_READ, MAP_SHARED, fd,
+                   0);
+  if (map == MAP_FAILED) {
+    VLOG(1) << "mmap failed for " << name << ": " << strerror(errno);
+    return res;
+  }
+  madvise(map, (size_t)stbuf.st_size, MADV_SEQUENTIAL);
+
+  base = (unsigned char *)map;
+  mapSize = (size_t)stbuf.st_size;
+  mapLen.store((size_t)stbuf.st_size, std::memory_order_release);
+  return res;
+}
+
+bool MappedFileIO::copyOut(off_t offset, unsigned char *dst,
+                           size_t len) const {
+  size_t mapped = mapLen.load(std::memory_order_acquire);
+  if (offset < 0 || (size_t)offset > mapped || len > mapped - offset) {
+    return false;
+  }
+
+  // keep the kernel one window ahead of the reader
+  off_t end = offset + (off_t)len;
+  off_t hint = nextHint.load(std::memory_order_relaxed);
+  if (end > hint - HintWindow / 2 && end < (off_t)mapped) {
+    off_t from = end & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t count = HintWindow;
+    if ((size_t)from + count > mapped) {
+      count = mapped - from;
+    }
+    madvise(base + from, count, MADV_WILLNEED);
+    nextHint.store(from + (off_t)count, std::memory_order_relaxed);
+  }
+
+  if (!guardedCopy(dst, base + offset, len)) {
+    return false;
+  }
+  // backing bytes, if not through a system call
+  OpStats::count(OpStats::RawReadBytes, len);
+  return true;
+}
+
+ssize_t MappedFileIO::read(const IORequest &req) const {
+  size_t mapped = mapLen.load(std::memory_order_acquire);
+  if (req.offset >= 0 && (size_t)req.offset < mapped) {
+    size_t len = req.dataLen;
+    if (len > mapped - req.offset) {
+      len = mapped - req.offset;
+    }
+    if (copyOut(req.offset, req.data, len)) {
+      if (len == req.dataLen) {
+        return len;
+      }
+      // the file may have grown past the mapping
+      IORequest rest;
+      rest.offset = req.offset + len;
+      rest.data = req.data + len;
+      rest.dataLen = req.dataLen - len;
+      ssize_t res = RawFileIO::read(rest);
+      return (res < 0) ? res : (ssize_t)len + res;
+    }
+  }
+  return RawFileIO::read(req);
+}
+
+ssize_t MappedFileIO::readv(const IOVecRequest &req) const {
+  off_t offset = req.offset;
+  for (int i = 0; i < req.iovcnt; ++i) {
+    if (!copyOut(offset, (unsigned char *)req.iov[i].iov_base,
+                 req.iov[i].iov_len)) {
+      break;
+    }
+    offset += req.iov[i].iov_len;
+    if (i == req.iovcnt - 1) {
+      return offset - req.offset;
+    }
+  }
+  // not entirely inside the mapping
+  return RawFileIO::readv(req);
+}
+
+int MappedFileIO::truncate(off_t size) {
+  int res = RawFileIO::truncate(size);
+  // pages past the new end are gone, stop serving them from the mapping
+  if (res == 0 && size >= 0 && (size_t)size < mapLen) {
+    mapLen.store((size_t)size, std::memory_order_release);
+  }
+  return res;
+}
+
+}  // namespace encfs
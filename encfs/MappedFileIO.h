@@ -0,0 +1,48 @@
+#ifndef _MappedFileIO_incl_
+#define _MappedFileIO_incl_
+
+#include <atomic>
+#include <string>
+#include <sys/types.h>
+
+#include "RawFileIO.h"
+
+namespace encfs {
+
+/*
+    RawFileIO for read-only mounts, serving reads by copying straight out of
+    a shared read-only mapping of the backing file instead of pread.
+
+    The mapping covers the file as it was when first opened; anything past
+    that is read with the plain system calls.  If the backing file shrinks
+    underneath us, touching the lost pages raises SIGBUS, which is caught
+    for the copy and the read retried through pread.
+ */
+class MappedFileIO : public RawFileIO {
+ public:
+  MappedFileIO(std::string fileName);
+  virtual ~MappedFileIO();
+
+  virtual int open(int flags);
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t readv(const IOVecRequest &req) const;
+
+  virtual int truncate(off_t size);
+
+ private:
+  // copy len bytes at offset from the mapping, false if len bytes are not
+  // all mapped or the pages are gone
+  bool copyOut(off_t offset, unsigned char *dst, size_t len) const;
+
+  unsigned char *base;
+  size_t mapSize;
+  // bytes that may be served from the mapping, only ever shrinks
+  std::atomic<size_t> mapLen;
+  // start of the next window to hint to the kernel
+  mutable std::atomic<off_t> nextHint;
+};
+
+}  // namespace encfs
+
+#endif
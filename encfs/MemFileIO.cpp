@@ -0,0 +1,239 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MemFileIO.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+
+#include "Mutex.h"
+
+namespace encfs {
+
+static Interface MemFileIO_iface("FileIO/Mem", 1, 0, 0);
+
+// inode numbers for getAttr(), which some layers need to be set
+static std::atomic<ino_t> gNextInode(1);
+
+const int MemFileIO::PageSize;
+
+struct MemFileIO::Contents {
+  Contents() : size(0) {
+    pthread_rwlock_init(&lock, nullptr);
+    memset(&attr, 0, sizeof(attr));
+    attr.st_mode = S_IFREG | 0600;
+    attr.st_nlink = 1;
+    attr.st_uid = getuid();
+    attr.st_gid = getgid();
+    attr.st_blksize = PageSize;
+    attr.st_ino = gNextInode++;
+    touch();
+  }
+  ~Contents() { pthread_rwlock_destroy(&lock); }
+
+  // the times a write or truncate sets.  Called with the lock held for
+  // writing
+  void touch() {
+    clock_gettime(CLOCK_REALTIME, &attr.st_mtim);
+    attr.st_ctim = attr.st_mtim;
+    attr.st_atim = attr.st_mtim;
+  }
+
+  // drops the pages wholly in [start, end), and zeros the parts of the
+  // pages at either end that are in it
+  void punch(off_t start, off_t end);
+
+  mutable pthread_rwlock_t lock;
+  off_t size;
+  struct stat attr;
+  // by page index; missing pages are holes
+  std::map<off_t, std::unique_ptr<unsigned char[]>> pages;
+};
+
+void MemFileIO::Contents::punch(off_t start, off_t end) {
+  if (start >= end) {
+    return;
+  }
+  auto it = pages.lower_bound(start / PageSize);
+  while (it != pages.end() && it->first * PageSize < end) {
+    off_t pageStart = it->first * PageSize;
+    off_t from = std::max(start, pageStart);
+    off_t to = std::min(end, pageStart + PageSize);
+    if (from == pageStart && to == pageStart + PageSize) {
+      it = pages.erase(it);
+    } else {
+      memset(it->second.get() + (from - pageStart), 0, to - from);
+      ++it;
+    }
+  }
+}
+
+MemFileIO::MemFileIO(const std::string &fileName)
+    : name(fileName), contents(std::make_shared<Contents>()), canWrite(false) {}
+
+MemFileIO::MemFileIO(const std::string &fileName,
+                     const std::shared_ptr<Contents> &contents_)
+    : name(fileName), contents(contents_), canWrite(false) {}
+
+MemFileIO::~MemFileIO() {}
+
+std::shared_ptr<MemFileIO> MemFileIO::reopen() const {
+  return std::shared_ptr<MemFileIO>(new MemFileIO(name, contents));
+}
+
+Interface MemFileIO::interface() const { return MemFileIO_iface; }
+
+void MemFileIO::setFileName(const char *fileName) { name = fileName; }
+
+const char *MemFileIO::getFileName() const { return name.c_str(); }
+
+int MemFileIO::open(int flags) {
+  if ((flags & O_RDWR) != 0 || (flags & O_WRONLY) != 0) {
+    canWrite = true;
+  }
+  return 0;
+}
+
+int MemFileIO::getAttr(struct stat *stbuf) const {
+  ReadLock lock(contents->lock);
+  *stbuf = contents->attr;
+  stbuf->st_size = contents->size;
+  stbuf->st_blocks = (blkcnt_t)contents->pages.size() * (PageSize / 512);
+  return 0;
+}
+
+off_t MemFileIO::getSize() const {
+  ReadLock lock(contents->lock);
+  return contents->size;
+}
+
+ssize_t MemFileIO::read(const IORequest &req) const {
+  ReadLock lock(contents->lock);
+  if (req.offset >= contents->size) {
+    return 0;
+  }
+  size_t len = (size_t)std::min((off_t)req.dataLen, contents->size - req.offset);
+
+  off_t offset = req.offset;
+  unsigned char *out = req.data;
+  for (size_t left = len; left > 0;) {
+    off_t page = offset / PageSize;
+    size_t inPage = offset % PageSize;
+    size_t n = std::min(left, (size_t)PageSize - inPage);
+    auto it = contents->pages.find(page);
+    if (it == contents->pages.end()) {
+      memset(out, 0, n);
+    } else {
+      memcpy(out, it->second.get() + inPage, n);
+    }
+    offset += n;
+    out += n;
+    left -= n;
+  }
+  return len;
+}
+
+ssize_t MemFileIO::write(const IORequest &req) {
+  if (!canWrite) {
+    return -EBADF;
+  }
+  WriteLock lock(contents->lock);
+  off_t offset = req.offset;
+  const unsigned char *in = req.data;
+  for (size_t left = req.dataLen; left > 0;) {
+    off_t page = offset / PageSize;
+    size_t inPage = offset % PageSize;
+    size_t n = std::min(left, (size_t)PageSize - inPage);
+    std::unique_ptr<unsigned char[]> &buf = contents->pages[page];
+    if (!buf) {
+      buf.reset(new unsigned char[PageSize]());
+    }
+    memcpy(buf.get() + inPage, in, n);
+    offset += n;
+    in += n;
+    left -= n;
+  }
+  contents->size = std::max(contents->size, offset);
+  contents->touch();
+  return req.dataLen;
+}
+
+int MemFileIO::truncate(off_t size) {
+  if (size < 0) {
+    return -EINVAL;
+  }
+  WriteLock lock(contents->lock);
+  if (size < contents->size) {
+    // what is cut off reads as zeros if the file grows again
+    off_t end = (contents->size + PageSize - 1) / PageSize * PageSize;
+    contents->punch(size, end);
+  }
+  contents->size = size;
+  contents->touch();
+  return 0;
+}
+
+bool MemFileIO::isWritable() const { return canWrite; }
+
+bool MemFileIO::isHole(off_t offset, size_t len) const {
+  if (len == 0) {
+    return false;
+  }
+  ReadLock lock(contents->lock);
+  if (offset + (off_t)len > contents->size) {
+    return false;
+  }
+  auto it = contents->pages.lower_bound(offset / PageSize);
+  return it == contents->pages.end() ||
+         it->first * PageSize >= offset + (off_t)len;
+}
+
+int MemFileIO::allocate(int mode, off_t offset, off_t len) {
+  if (!canWrite) {
+    return -EBADF;
+  }
+  if (offset < 0 || len <= 0) {
+    return -EINVAL;
+  }
+  WriteLock lock(contents->lock);
+  if ((mode & FALLOC_FL_PUNCH_HOLE) != 0) {
+    // as fallocate(2), punching a hole requires keeping the size
+    if ((mode & FALLOC_FL_KEEP_SIZE) == 0) {
+      return -EINVAL;
+    }
+    contents->punch(offset, std::min(offset + len, contents->size));
+  } else if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+    return -EOPNOTSUPP;
+  } else if ((mode & FALLOC_FL_KEEP_SIZE) == 0) {
+    // allocated ranges read as zeros, the same as holes, so only the size
+    // changes
+    contents->size = std::max(contents->size, offset + len);
+  }
+  contents->touch();
+  return 0;
+}
+
+size_t MemFileIO::residentBytes() const {
+  ReadLock lock(contents->lock);
+  return contents->pages.size() * PageSize;
+}
+
+}  // namespace encfs
@@ -0,0 +1,73 @@
+#ifndef _MemFileIO_incl_
+#define _MemFileIO_incl_
+
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "FileIO.h"
+#include "Interface.h"
+
+namespace encfs {
+
+/*
+    A backing file held in memory, for running the layers above RawFileIO
+    (BlockFileIO, CipherFileIO, MACFileIO) without a disk: in benchmarks,
+    tests and scratch files that never need to reach one.
+
+    The contents are a sparse map of pages, so holes cost nothing, read
+    back as zeros and are reported by isHole().  Every MemFileIO made by
+    reopen() shares the contents of the one it came from, as descriptors
+    of one backing file would.  Reads and writes may come from any thread.
+ */
+class MemFileIO : public FileIO {
+ public:
+  static const int PageSize = 4096;
+
+  explicit MemFileIO(const std::string &fileName);
+  virtual ~MemFileIO();
+
+  // another FileIO on the same contents, not yet opened
+  std::shared_ptr<MemFileIO> reopen() const;
+
+  virtual Interface interface() const;
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+
+  // always succeeds; flags only decide whether the file may be written
+  virtual int open(int flags);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t write(const IORequest &req);
+
+  virtual int truncate(off_t size);
+  virtual bool isWritable() const;
+
+  virtual bool isHole(off_t offset, size_t len) const;
+  // plain allocation, FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE
+  virtual int allocate(int mode, off_t offset, off_t len);
+
+  // bytes of pages held, for checking that holes stay holes
+  size_t residentBytes() const;
+
+ private:
+  MemFileIO(const MemFileIO &src);             // not allowed
+  MemFileIO &operator=(const MemFileIO &src);  // not allowed
+
+  struct Contents;
+  MemFileIO(const std::string &fileName,
+            const std::shared_ptr<Contents> &contents);
+
+  std::string name;
+  std::shared_ptr<Contents> contents;
+  bool canWrite;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,320 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MemoryGovernor.h"
+
+#include "easylogging++.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "BlockCache.h"
+#include "Context.h"
+#include "DirNode.h"
+#include "Error.h"
+#include "FSConfig.h"
+#include "FileUtils.h"
+#include "HotFileCache.h"
+#include "MemoryPool.h"
+
+namespace encfs {
+
+// how often the hits and the cgroup's events are looked at
+static const int GovernMs = 2000;
+// looks without pressure before the budget grows again
+static const int CalmLooks = 5;
+// a stall of 150ms within 2s of the cgroup's tasks waiting on memory
+static const char PsiTrigger[] = "some 150000 2000000";
+// the least either file cache keeps of their part, with a hot file cache
+static const double MinShare = 0.25;
+
+static const char CgroupRoot[] = "/sys/fs/cgroup";
+// the pressure of the whole system, where there is no cgroup's
+static const char SystemPressure[] = "/proc/pressure/memory";
+
+// a PSI trigger armed on the pressure file at path, or -1
+static int openTrigger(const std::string &path) {
+  int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd >= 0 &&
+      write(fd, PsiTrigger, sizeof(PsiTrigger)) != sizeof(PsiTrigger)) {
+    // an older kernel, or a file we may not set triggers on
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+void MemoryGovernor::apportion(EncFS_Opts *opts) {
+  size_t limit = (size_t)opts->cacheMemory;
+  size_t files = limit - limit / 8;
+  opts->poolCacheSize = (long)(limit / 8);
+  if (opts->hotCacheSize > 0) {
+    opts->blockCacheSize = (long)(files / 2);
+    opts->hotCacheSize = (long)(files - files / 2);
+  } else {
+    opts->blockCacheSize = (long)files;
+  }
+}
+
+MemoryGovernor::MemoryGovernor(EncFS_Context *ctx, size_t limit,
+                               bool balance)
+    : _ctx(ctx),
+      _limit(limit),
+      _balance(balance),
+      _budget(limit),
+      _blockShare(0.5),
+      _blockHits(0),
+      _hotHits(0),
+      _calm(0),
+      _psiFd(-1),
+      _events(0),
+      _shrinks(0),
+      _running(false) {
+  _wakeFds[0] = -1;
+  _wakeFds[1] = -1;
+}
+
+MemoryGovernor::~MemoryGovernor() {
+  stop();
+  VLOG(1) << "memory governor: budget shrunk " << _shrinks << " times";
+}
+
+bool MemoryGovernor::start() {
+  if (pipe(_wakeFds) != 0) {
+    RLOG(ERROR) << "memory governor: " << strerror(errno);
+    return false;
+  }
+  fcntl(_wakeFds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(_wakeFds[1], F_SETFD, FD_CLOEXEC);
+  openCgroup();
+
+  int res = pthread_create(&_thread, nullptr, run, this);
+  if (res != 0) {
+    RLOG(ERROR) << "error starting memory governor thread: "
+                << strerror(res);
+    stop();
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+void MemoryGovernor::stop() {
+  if (_running) {
+    char c = 0;
+    if (write(_wakeFds[1], &c, 1) != 1) {
+      RLOG(WARNING) << "could not wake the memory governor thread";
+    }
+    pthread_join(_thread, nullptr);
+    _running = false;
+  }
+  for (int &fd : _wakeFds) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (_psiFd >= 0) {
+    close(_psiFd);
+    _psiFd = -1;
+  }
+}
+
+void *MemoryGovernor::run(void *arg) {
+  ((MemoryGovernor *)arg)->govern();
+  VLOG(1) << "memory governor thread exiting";
+  return nullptr;
+}
+
+void MemoryGovernor::openCgroup() {
+  // a cgroup v2 member has a single "0::/path" line
+  FILE *in = fopen("/proc/self/cgroup", "r");
+  if (in == nullptr) {
+    return;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    if (strncmp(line, "0::", 3) == 0) {
+      std::string path = line + 3;
+      while (!path.empty() && path[path.size() - 1] == '\n') {
+        path.erase(path.size() - 1);
+      }
+      _cgroupDir = std::string(CgroupRoot) + path;
+    }
+  }
+  fclose(in);
+
+  if (!_cgroupDir.empty()) {
+    _events = limitEvents();
+    _psiFd = openTrigger(_cgroupDir + "/memory.pressure");
+  }
+  if (_psiFd < 0) {
+    // the root cgroup has no pressure file of its own
+    _psiFd = openTrigger(SystemPressure);
+  }
+  VLOG(1) << "memory governor: watching "
+          << (_cgroupDir.empty() ? "no cgroup" : _cgroupDir)
+          << (_psiFd >= 0 ? ", with a PSI trigger" : "");
+}
+
+uint64_t MemoryGovernor::limitEvents() const {
+  if (_cgroupDir.empty()) {
+    return 0;
+  }
+  std::string path = _cgroupDir + "/memory.events";
+  FILE *in = fopen(path.c_str(), "r");
+  if (in == nullptr) {
+    return 0;
+  }
+  uint64_t total = 0;
+  char name[64];
+  unsigned long long count;
+  while (fscanf(in, "%63s %llu", name, &count) == 2) {
+    if (strcmp(name, "high") == 0 || strcmp(name, "max") == 0) {
+      total += count;
+    }
+  }
+  fclose(in);
+  return total;
+}
+
+void MemoryGovernor::govern() {
+  apply();
+
+  struct pollfd fds[2];
+  fds[0].fd = _wakeFds[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = _psiFd;
+  fds[1].events = POLLPRI;
+
+  for (;;) {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    int res = poll(fds, _psiFd >= 0 ? 2 : 1, GovernMs);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      RLOG(ERROR) << "memory governor poll: " << strerror(errno);
+      return;
+    }
+    if (fds[0].revents != 0) {
+      return;
+    }
+
+    bool pressure = (fds[1].revents & POLLPRI) != 0;
+    if ((fds[1].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
+      // the cgroup went away
+      close(_psiFd);
+      _psiFd = -1;
+      fds[1].fd = -1;
+    }
+    uint64_t events = limitEvents();
+    if (events != _events) {
+      _events = events;
+      pressure = true;
+    }
+    adjust(pressure);
+  }
+}
+
+void MemoryGovernor::adjust(bool pressure) {
+  size_t budget = _budget;
+  if (pressure) {
+    _calm = 0;
+    budget = std::max(_limit / 8, _budget / 2);
+  } else if (++_calm >= CalmLooks && _budget < _limit) {
+    _calm = 0;
+    budget = std::min(_limit, _budget + _limit / 16);
+  }
+  if (budget != _budget) {
+    VLOG(1) << "memory governor: cache budget " << _budget << " -> "
+            << budget << " bytes";
+    if (budget < _budget) {
+      ++_shrinks;
+    }
+    _budget = budget;
+  }
+  apply();
+
+#if defined(__GLIBC__)
+  if (pressure) {
+    // hand what the caches dropped back to the system
+    malloc_trim(0);
+  }
+#endif
+}
+
+void MemoryGovernor::apply() {
+  if (!_balance) {
+    // each cache as big as it was given, scaled down with the budget
+    const EncFS_Opts &opts = *_ctx->opts;
+    double scale = (double)_budget / (double)_limit;
+    MemoryPool::setMaxCachedBytes((size_t)(opts.poolCacheSize * scale));
+    std::shared_ptr<DirNode> root = _ctx->currentRoot();
+    if (!root) {
+      return;
+    }
+    const FSConfigPtr &cfg = root->config();
+    if (cfg->hotCache) {
+      cfg->hotCache->setMaxBytes((size_t)(opts.hotCacheSize * scale));
+    }
+    if (cfg->blockCache) {
+      cfg->blockCache->setMaxBytes((size_t)(opts.blockCacheSize * scale));
+    }
+    return;
+  }
+
+  size_t pool = _budget / 8;
+  size_t files = _budget - pool;
+  MemoryPool::setMaxCachedBytes(pool);
+
+  std::shared_ptr<DirNode> root = _ctx->currentRoot();
+  if (!root) {
+    return;
+  }
+  const FSConfigPtr &cfg = root->config();
+  if (cfg->hotCache) {
+    uint64_t blockHits = cfg->blockCache ? cfg->blockCache->hits() : 0;
+    uint64_t hotHits = cfg->hotCache->hits();
+    // a remount starts the counts again
+    uint64_t newBlock = blockHits >= _blockHits ? blockHits - _blockHits : 0;
+    uint64_t newHot = hotHits >= _hotHits ? hotHits - _hotHits : 0;
+    _blockHits = blockHits;
+    _hotHits = hotHits;
+
+    double target = (double)(newBlock + 1) / (double)(newBlock + newHot + 2);
+    target = std::min(1.0 - MinShare, std::max(MinShare, target));
+    _blockShare += (target - _blockShare) / 2;
+
+    size_t blockBytes = (size_t)(files * _blockShare);
+    cfg->hotCache->setMaxBytes(files - blockBytes);
+    files = blockBytes;
+  }
+  if (cfg->blockCache) {
+    cfg->blockCache->setMaxBytes(files);
+  }
+}
+
+}  // namespace encfs
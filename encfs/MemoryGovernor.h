@@ -0,0 +1,90 @@
+#ifndef _MemoryGovernor_incl_
+#define _MemoryGovernor_incl_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+namespace encfs {
+
+class EncFS_Context;
+struct EncFS_Opts;
+
+/*
+    Holds the memory caches of a mount to one limit (--cache-memory), so
+    that a mount in a container with a strict memory limit does not add up
+    the separately bounded caches past it.  The limit covers the block
+    cache, the hot file cache and the buffers MemoryPool keeps for reuse;
+    the name, attribute and descriptor caches are bounded by entries and
+    left out.
+
+    The pool gets an eighth of the budget.  The rest goes to the block
+    cache, or is split between it and the hot file cache by the hits each
+    had since the last look, moving half way to that split each time and
+    leaving either at least a quarter.
+
+    Under cgroup v2 the budget also follows the memory pressure of the
+    mount's cgroup: it is halved, down to an eighth of the limit, whenever
+    memory.events counts reaching memory.high or memory.max, or a PSI
+    trigger on memory.pressure fires.  It grows back a sixteenth of the
+    limit at a time once the pressure has stayed away for a while.  Outside
+    a cgroup with its own pressure file, the trigger is set on the pressure
+    of the whole system, /proc/pressure/memory.
+
+    With --memory-pressure and no --cache-memory the caches keep the sizes
+    they were given and are not balanced: the limit is their sum, and all
+    of them shrink and grow back with the budget in proportion.
+ */
+class MemoryGovernor {
+ public:
+  // splits opts->cacheMemory over the cache sizes of opts, before the
+  // caches are made
+  static void apportion(EncFS_Opts *opts);
+
+  // balance: split the budget by hits as above, otherwise scale the
+  // configured cache sizes by the budget
+  MemoryGovernor(EncFS_Context *ctx, size_t limit, bool balance);
+  ~MemoryGovernor();
+
+  bool start();
+  void stop();
+
+ private:
+  MemoryGovernor(const MemoryGovernor &src);             // not allowed
+  MemoryGovernor &operator=(const MemoryGovernor &src);  // not allowed
+
+  static void *run(void *arg);
+  void govern();
+
+  // finds the cgroup and arms the PSI trigger, that of the system when
+  // there is no cgroup to set it on
+  void openCgroup();
+  // the memory.high and memory.max events of the cgroup so far
+  uint64_t limitEvents() const;
+  void adjust(bool pressure);
+  void apply();
+
+  EncFS_Context *_ctx;
+  size_t _limit;
+  bool _balance;
+
+  // only touched by the governing thread
+  size_t _budget;
+  double _blockShare;  // of the file caches' part, with a hot file cache
+  uint64_t _blockHits;
+  uint64_t _hotHits;
+  int _calm;           // looks since the last pressure
+  std::string _cgroupDir;
+  int _psiFd;
+  uint64_t _events;
+  uint64_t _shrinks;
+
+  int _wakeFds[2];
+  bool _running;
+  pthread_t _thread;
+};
+
+}  // namespace encfs
+
+#endif
@@ -1,8 +1,20 @@
 #include "MemoryPool.h"
 
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
-#include <openssl/ossl_typ.h>
+#include <functional>
+#include <new>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Error.h"
+#include "Mutex.h"
+#include "Numa.h"
 
 #ifdef HAVE_VALGRIND_MEMCHECK_H
 #include <valgrind/memcheck.h>
@@ -11,62 +23,373 @@
 #define VALGRIND_MAKE_MEM_UNDEFINED(a, b)
 #endif
 
-#include <openssl/buffer.h>
-
-#define BLOCKDATA(BLOCK) (unsigned char*)(BLOCK)->data->data
+#define BLOCKDATA(BLOCK) (BLOCK)->data
 
 namespace encfs {
 
+/*
+ * Blocks come in power of two size classes, from MinClassSize up to
+ * MaxClassSize.  Each thread keeps a few released blocks of every class for
+ * itself, and passes the rest on to a global depot from which the other
+ * threads refill.  The depot is a fixed array of slots per class which are
+ * claimed and filled with atomic exchanges, so neither side ever takes a
+ * lock.  A block which finds no free slot, or would take the pool past its
+ * limit on cached bytes, is freed.
+ *
+ * On a NUMA host every block belongs to the node of the thread that made
+ * it, and there is a depot for each node: threads refill from their own
+ * node's depot, and a block released on another node goes back to its
+ * home's rather than into the releasing thread's cache.
+ *
+ * Requests larger than MaxClassSize are not pooled.
+ */
+static const int MinClassShift = 6;  // 64 bytes
+static const int NumClasses = 16;    // up to 2 MiB, a 1 MiB block and more
+static const int MaxClassSize = 1 << (MinClassShift + NumClasses - 1);
+
+// per class, the bytes a thread keeps to itself and the bytes the depot
+// holds, within the given bounds on the number of blocks
+static const int ThreadCacheBytes = 256 * 1024;
+static const int ThreadCacheMax = 16;
+static const int DepotBytes = 16 * 1024 * 1024;
+static const int DepotSlots = 64;
+static const int DepotMin = 4;
+
 struct BlockList {
   BlockList* next;
-  int size;
-  BUF_MEM* data;
+  int size;         // capacity of data
+  int used;         // bytes asked for
+  int dirty;        // bytes from the start which may not be cleared
+  int sizeClass;    // -1 if not pooled
+  bool inArena;     // data was carved from the locked arena
+  int node;         // NUMA node the data was placed on
+  unsigned char* data;
 };
 
-static BlockList* allocBlock(int size) {
+static std::atomic<int> gWipePolicy(MemoryPool::WipeOnRelease);
+static std::atomic<size_t> gMaxCachedBytes(MemoryPool::DefaultMaxCachedBytes);
+
+static std::atomic<size_t> gLiveBlocks(0);
+static std::atomic<size_t> gCachedBlocks(0);
+static std::atomic<size_t> gCachedBytes(0);
+static std::atomic<uint64_t> gHits(0);
+static std::atomic<uint64_t> gMisses(0);
+static std::atomic<uint64_t> gTrimmed(0);
+
+static int sizeClassOf(int size) {
+  if (size > MaxClassSize) {
+    return -1;
+  }
+  int cls = 0;
+  while ((1 << (MinClassShift + cls)) < size) {
+    ++cls;
+  }
+  return cls;
+}
+
+static int classSize(int cls) { return 1 << (MinClassShift + cls); }
+
+static int threadCacheMax(int cls) {
+  int n = ThreadCacheBytes / classSize(cls);
+  return n < 1 ? 1 : (n > ThreadCacheMax ? ThreadCacheMax : n);
+}
+
+static int depotSlots(int cls) {
+  int n = DepotBytes / classSize(cls);
+  return n < DepotMin ? DepotMin : (n > DepotSlots ? DepotSlots : n);
+}
+
+/*
+ * The locked arena, off unless setLockedArena is called.  Block data is
+ * carved out of chunks of huge page size, mapped with MAP_HUGETLB where
+ * huge pages are reserved, and otherwise asking for transparent huge
+ * pages.  Chunks are locked into memory, so that plaintext is never
+ * written to swap, and kept out of core dumps.  Memory given back to the
+ * arena is kept on a free list per class and never unmapped.  When the
+ * arena is full, or a chunk can not be mapped or locked, blocks come from
+ * the heap as before.  Each NUMA node carves from chunks of its own.
+ */
+static const size_t ArenaChunkSize = 2 * 1024 * 1024;
+
+static pthread_mutex_t gArenaMutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t gArenaMax = 0;       // bytes the arena may map
+static size_t gArenaMapped = 0;
+// per node, the chunk being carved up
+static unsigned char* gArenaChunk[Numa::MaxNodes];
+static size_t gArenaChunkUsed[Numa::MaxNodes];
+// per node and class.  Never destroyed, threads may still release blocks
+// while the process exits.
+static std::vector<unsigned char*>* const gArenaFree =
+    new std::vector<unsigned char*>[Numa::MaxNodes * NumClasses];
+static bool gArenaFailed = false;
+
+// caller holds gArenaMutex
+static unsigned char* mapArenaChunk(int node) {
+  void* addr = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  addr = mmap(nullptr, ArenaChunkSize, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (addr == MAP_FAILED) {
+    addr = mmap(nullptr, ArenaChunkSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      RLOG(WARNING) << "unable to map locked buffers: " << strerror(errno);
+      return nullptr;
+    }
+#if defined(MADV_HUGEPAGE)
+    madvise(addr, ArenaChunkSize, MADV_HUGEPAGE);
+#endif
+  }
+#if defined(MADV_DONTDUMP)
+  madvise(addr, ArenaChunkSize, MADV_DONTDUMP);
+#endif
+  // before mlock faults the pages in
+  Numa::preferNode(addr, ArenaChunkSize, node);
+
+  if (mlock(addr, ArenaChunkSize) != 0) {
+    RLOG(WARNING) << "unable to lock buffers in memory, check the memlock "
+                     "limit (ulimit -l): "
+                  << strerror(errno);
+    munmap(addr, ArenaChunkSize);
+    return nullptr;
+  }
+  return (unsigned char*)addr;
+}
+
+// class block of node from the arena, or null if it has none to give
+static unsigned char* arenaTake(int cls, int node) {
+  Lock lock(gArenaMutex);
+  if (gArenaMax == 0) {
+    return nullptr;
+  }
+  std::vector<unsigned char*>& freeList =
+      gArenaFree[node * NumClasses + cls];
+  if (!freeList.empty()) {
+    unsigned char* data = freeList.back();
+    freeList.pop_back();
+    return data;
+  }
+
+  size_t size = classSize(cls);
+  size_t align = size < (size_t)MemoryPool::Alignment ? size
+                                                      : MemoryPool::Alignment;
+  size_t offset = (gArenaChunkUsed[node] + align - 1) / align * align;
+  if (gArenaChunk[node] == nullptr || offset + size > ArenaChunkSize) {
+    if (gArenaFailed || gArenaMapped + ArenaChunkSize > gArenaMax) {
+      return nullptr;
+    }
+    unsigned char* chunk = mapArenaChunk(node);
+    if (chunk == nullptr) {
+      // do not try again on every allocation
+      gArenaFailed = true;
+      return nullptr;
+    }
+    gArenaChunk[node] = chunk;
+    gArenaMapped += ArenaChunkSize;
+    offset = 0;
+  }
+  gArenaChunkUsed[node] = offset + size;
+  return gArenaChunk[node] + offset;
+}
+
+// data must have been cleared
+static void arenaGive(unsigned char* data, int cls, int node) {
+  Lock lock(gArenaMutex);
+  gArenaFree[node * NumClasses + cls].push_back(data);
+}
+
+static BlockList* allocBlock(int size, int cls) {
+  int capacity = cls >= 0 ? classSize(cls) : (size > 0 ? size : 1);
+  int node = Numa::currentNode();
+  void* data = cls >= 0 ? arenaTake(cls, node) : nullptr;
+  bool inArena = data != nullptr;
+  // blocks of a page or more start on a page boundary, so they can be
+  // handed straight to O_DIRECT reads and writes
+  size_t align = (capacity >= MemoryPool::Alignment) ? MemoryPool::Alignment
+                                                     : sizeof(void*) * 2;
+  if (!inArena) {
+    if (posix_memalign(&data, align, capacity) != 0) {
+      throw std::bad_alloc();
+    }
+    // whole pages of a block are its own, the pages of the heap not yet
+    // faulted in go to our node
+    if (align == MemoryPool::Alignment) {
+      Numa::preferNode(data, capacity, node);
+    }
+  }
+
   auto* block = new BlockList;
-  block->size = size;
-  block->data = BUF_MEM_new();
-  VALGRIND_MAKE_MEM_NOACCESS(block->data->data, block->data->max);
+  block->next = nullptr;
+  block->size = capacity;
+  block->used = 0;
+  block->dirty = 0;
+  block->sizeClass = cls;
+  block->inArena = inArena;
+  block->node = node;
+  block->data = (unsigned char*)data;
+  VALGRIND_MAKE_MEM_NOACCESS(block->data, block->size);
 
   return block;
 }
 
 static void freeBlock(BlockList* el) {
-  VALGRIND_MAKE_MEM_UNDEFINED(el->data->data, el->data->max);
-  BUF_MEM_free(el->data);
+  VALGRIND_MAKE_MEM_UNDEFINED(el->data, el->size);
+  if (el->dirty > 0) {
+    memset(el->data, 0, el->dirty);
+  }
+  if (el->inArena) {
+    arenaGive(el->data, el->sizeClass, el->node);
+  } else {
+    free(el->data);
+  }
 
   delete el;
 }
 
-static pthread_mutex_t gMPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static void countCached(const BlockList* block) {
+  ++gCachedBlocks;
+  gCachedBytes += block->size;
+}
 
-static BlockList* gMemPool = nullptr;
+static void countUncached(const BlockList* block) {
+  --gCachedBlocks;
+  gCachedBytes -= block->size;
+}
 
-MemBlock MemoryPool::allocate(int size) {
-  pthread_mutex_lock(&gMPoolMutex);
+static std::atomic<BlockList*> gDepot[Numa::MaxNodes][NumClasses][DepotSlots];
 
-  BlockList* parent = nullptr;
-  BlockList* block = gMemPool;
+// where a thread starts looking in the depot, so that threads spread over
+// the slots
+static int depotStart(int cls) {
+  static thread_local size_t hint =
+      std::hash<std::thread::id>()(std::this_thread::get_id());
+  return (int)(hint % depotSlots(cls));
+}
 
-  while (block != nullptr && block->size < size) {
-    parent = block;
-    block = block->next;
+static BlockList* depotTake(int cls) {
+  int slots = depotSlots(cls);
+  int start = depotStart(cls);
+  int node = Numa::currentNode();
+  for (int i = 0; i < slots; ++i) {
+    std::atomic<BlockList*>& slot = gDepot[node][cls][(start + i) % slots];
+    if (slot.load(std::memory_order_relaxed) != nullptr) {
+      BlockList* block = slot.exchange(nullptr, std::memory_order_acquire);
+      if (block != nullptr) {
+        return block;
+      }
+    }
   }
+  return nullptr;
+}
 
-  if (block != nullptr) {
-    if (parent == nullptr) {
-      gMemPool = block->next;
+// false if the depot of the block's node has no room for it
+static bool depotPut(BlockList* block) {
+  int cls = block->sizeClass;
+  int slots = depotSlots(cls);
+  int start = depotStart(cls);
+  for (int i = 0; i < slots; ++i) {
+    std::atomic<BlockList*>& slot =
+        gDepot[block->node][cls][(start + i) % slots];
+    BlockList* expected = nullptr;
+    if (slot.load(std::memory_order_relaxed) == nullptr &&
+        slot.compare_exchange_strong(expected, block,
+                                     std::memory_order_release,
+                                     std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// released blocks kept by one thread, handed to the depot when the
+// thread exits
+struct ThreadCache {
+  BlockList* head[NumClasses];
+  int count[NumClasses];
+
+  ThreadCache() {
+    for (int i = 0; i < NumClasses; ++i) {
+      head[i] = nullptr;
+      count[i] = 0;
+    }
+  }
+  ~ThreadCache() { flush(); }
+
+  void flush() {
+    for (int i = 0; i < NumClasses; ++i) {
+      while (head[i] != nullptr) {
+        BlockList* block = head[i];
+        head[i] = block->next;
+        block->next = nullptr;
+        if (!depotPut(block)) {
+          countUncached(block);
+          freeBlock(block);
+        }
+      }
+      count[i] = 0;
+    }
+  }
+};
+
+static thread_local ThreadCache gThreadCache;
+
+// free blocks of the depot, largest first, until at most maxBytes are
+// cached
+static void trimDepot(size_t maxBytes) {
+  for (int cls = NumClasses - 1; cls >= 0; --cls) {
+    for (int node = 0; node < Numa::nodes(); ++node) {
+      for (int i = 0; i < DepotSlots; ++i) {
+        if (gCachedBytes <= maxBytes) {
+          return;
+        }
+        BlockList* block = gDepot[node][cls][i].exchange(nullptr);
+        if (block != nullptr) {
+          countUncached(block);
+          freeBlock(block);
+        }
+      }
+    }
+  }
+}
+
+MemBlock MemoryPool::allocate(int size) {
+  int cls = sizeClassOf(size);
+
+  BlockList* block = nullptr;
+  if (cls >= 0) {
+    ThreadCache& cache = gThreadCache;
+    block = cache.head[cls];
+    if (block != nullptr) {
+      cache.head[cls] = block->next;
+      --cache.count[cls];
     } else {
-      parent->next = block->next;
+      block = depotTake(cls);
     }
   }
-  pthread_mutex_unlock(&gMPoolMutex);
 
-  if (block == nullptr) {
-    block = allocBlock(size);
+  if (block != nullptr) {
+    ++gHits;
+    countUncached(block);
+  } else {
+    ++gMisses;
+    block = allocBlock(size, cls);
   }
+  ++gLiveBlocks;
   block->next = nullptr;
+  block->used = size > 0 ? size : 0;
+
+  // a lazily wiped block holds what its last user left there.  The new
+  // user gets the bytes it asked for uninitialised, as from a new block,
+  // and is trusted with them; what lies past them is cleared now.
+  if (block->dirty > block->used) {
+    VALGRIND_MAKE_MEM_UNDEFINED(block->data + block->used,
+                                block->dirty - block->used);
+    memset(block->data + block->used, 0, block->dirty - block->used);
+    VALGRIND_MAKE_MEM_NOACCESS(block->data + block->used,
+                               block->dirty - block->used);
+    block->dirty = block->used;
+  }
 
   MemBlock result;
   result.data = BLOCKDATA(block);
@@ -78,38 +401,150 @@ MemBlock MemoryPool::allocate(int size) {
 }
 
 void MemoryPool::release(const MemBlock& mb) {
-  pthread_mutex_lock(&gMPoolMutex);
   auto* block = (BlockList*)mb.internalData;
+  --gLiveBlocks;
 
-  VALGRIND_MAKE_MEM_UNDEFINED(block->data->data, block->size);
-  memset(BLOCKDATA(block), 0, block->size);
-  VALGRIND_MAKE_MEM_NOAccess(block->data->data, block->data->max);
+  // only the part handed out can have been written to, the rest is
+  // covered by dirty
+  if (block->used > block->dirty) {
+    block->dirty = block->used;
+  }
+  if (gWipePolicy == WipeOnRelease && block->dirty > 0) {
+    VALGRIND_MAKE_MEM_UNDEFINED(block->data, block->dirty);
+    memset(BLOCKDATA(block), 0, block->dirty);
+    block->dirty = 0;
+  }
+  VALGRIND_MAKE_MEM_NOACCESS(block->data, block->size);
+  block->used = 0;
 
-  block->next = gMemPool;
-  gMemPool = block;
+  int cls = block->sizeClass;
+  if (cls < 0) {
+    freeBlock(block);
+    return;
+  }
 
-  pthread_mutex_unlock(&gMPoolMutex);
+  size_t maxBytes = gMaxCachedBytes;
+  if (gCachedBytes + (size_t)block->size > maxBytes) {
+    // make room by dropping blocks nobody has asked for in a while.  The
+    // margin keeps us from trimming on every release once at the limit.
+    size_t low = maxBytes - maxBytes / 4;
+    trimDepot(low > (size_t)block->size ? low - block->size : 0);
+    if (gCachedBytes + (size_t)block->size > maxBytes) {
+      ++gTrimmed;
+      freeBlock(block);
+      return;
+    }
+  }
+
+  countCached(block);
+  ThreadCache& cache = gThreadCache;
+  if (block->node == Numa::currentNode() &&
+      cache.count[cls] < threadCacheMax(cls)) {
+    block->next = cache.head[cls];
+    cache.head[cls] = block;
+    ++cache.count[cls];
+  } else if (!depotPut(block)) {
+    countUncached(block);
+    ++gTrimmed;
+    freeBlock(block);
+  }
 }
 
-void MemoryPool::destroyAll() {
-  pthread_mutex_lock(&gMPoolMutex);
+void MemoryPool::setWipePolicy(WipePolicy policy) { gWipePolicy = policy; }
 
-  BlockList* block = gMemPool;
-  gMemPool = nullptr;
+void MemoryPool::setLockedArena(size_t maxBytes) {
+  Lock lock(gArenaMutex);
+  gArenaMax = maxBytes;
+}
 
-  pthread_mutex_unlock(&gMPoolMutex);
+void MemoryPool::setMaxCachedBytes(size_t bytes) {
+  gMaxCachedBytes = bytes;
+  trim(bytes);
+}
 
-  while (block != nullptr) {
-    BlockList* next = block->next;
+MemoryPool::Stats MemoryPool::stats() {
+  Stats st;
+  st.liveBlocks = gLiveBlocks;
+  st.cachedBlocks = gCachedBlocks;
+  st.cachedBytes = gCachedBytes;
+  st.hits = gHits;
+  st.misses = gMisses;
+  st.trimmed = gTrimmed;
+  {
+    Lock lock(gArenaMutex);
+    st.lockedBytes = gArenaMapped;
+  }
+  return st;
+}
 
-    freeBlock(block);
-    block = next;
+void MemoryPool::trim(size_t maxBytes) {
+  ThreadCache& cache = gThreadCache;
+  for (int cls = NumClasses - 1; cls >= 0; --cls) {
+    while (gCachedBytes > maxBytes && cache.head[cls] != nullptr) {
+      BlockList* block = cache.head[cls];
+      cache.head[cls] = block->next;
+      --cache.count[cls];
+      countUncached(block);
+      freeBlock(block);
+    }
   }
+  trimDepot(maxBytes);
 }
 
+PoolBlock::PoolBlock(PoolBlock&& src) noexcept : _data(nullptr), _size(0) {
+  *this = std::move(src);
+}
 
+PoolBlock& PoolBlock::operator=(PoolBlock&& src) noexcept {
+  if (this == &src) {
+    return *this;
+  }
+  reset();
+  _size = src._size;
+  if (src._data == src._small) {
+    memcpy(_small, src._small, src._size);
+    _data = _small;
+    src.reset();
+  } else {
+    _mb = src._mb;
+    _data = src._data;
+    src._mb = MemBlock();
+    src._data = nullptr;
+    src._size = 0;
+  }
+  return *this;
+}
 
+void PoolBlock::allocate(int size) {
+  reset();
+  if (size <= SmallSize) {
+    _data = _small;
+  } else {
+    _mb = MemoryPool::allocate(size);
+    _data = _mb.data;
+  }
+  _size = size > 0 ? size : 0;
+}
 
+void PoolBlock::reset() {
+  if (_data == _small) {
+    memset(_small, 0, _size);
+  } else if (_data != nullptr) {
+    MemoryPool::release(_mb);
+    _mb = MemBlock();
+  }
+  _data = nullptr;
+  _size = 0;
+}
 
+void MemoryPool::destroyAll() {
+  Stats st = stats();
+  VLOG(1) << "memory pool: " << st.hits << " hits, " << st.misses
+          << " misses, " << st.trimmed << " trimmed, " << st.liveBlocks
+          << " blocks in use, " << st.cachedBytes << " bytes cached";
+
+  // blocks cached by other threads go when those threads exit
+  trim(0);
+}
 
 }
@@ -1,6 +1,9 @@
 #ifndef _MemoryPool_incl_
 #define _MemoryPool_incl_
 
+#include <stddef.h>
+#include <stdint.h>
+
 namespace encfs {
 
     struct MemBlock {
@@ -19,13 +22,96 @@ namespace encfs {
      * // do things with storage in mb.data
      * unsigned char *buffer = mb.data;
      * MemoryPool::release(mb);
+     *
+     * Blocks of Alignment bytes or more are aligned to Alignment.
+     * Released blocks are kept by the releasing thread or passed on to
+     * other threads without taking a lock, up to a limit on the bytes
+     * cached.  Their contents are cleared on release.  With WipeLazily
+     * they stay until the block is handed out again, which clears what
+     * lies past the new request and leaves the rest to be overwritten.
+     * Either way nothing goes back to the system without being cleared.
      */
 
     namespace MemoryPool {
+        const int Alignment = 4096;
+        // default limit on the bytes of released blocks kept for reuse
+        const size_t DefaultMaxCachedBytes = 32 * 1024 * 1024;
+
+        enum WipePolicy {
+            WipeOnRelease,  // clear a block as soon as it is released
+            WipeLazily      // clear it when it is reused or freed
+        };
+
+        struct Stats {
+            size_t liveBlocks;    // handed out and not yet released
+            size_t cachedBlocks;  // released and kept for reuse
+            size_t cachedBytes;
+            uint64_t hits;        // allocations served from the pool
+            uint64_t misses;      // allocations of new memory
+            uint64_t trimmed;     // released blocks freed to stay in bounds
+            size_t lockedBytes;   // mapped for the locked arena
+        };
+
         MemBlock allocate(int size);
         void release(const MemBlock& el);
+
+        void setWipePolicy(WipePolicy policy);
+        void setMaxCachedBytes(size_t bytes);
+        // carve blocks out of up to maxBytes of memory locked against
+        // swapping, on huge pages where available.  0 turns it off.
+        void setLockedArena(size_t maxBytes);
+        Stats stats();
+
+        // free cached blocks until no more than maxBytes are cached.
+        // Blocks kept by other threads than the caller are left alone.
+        void trim(size_t maxBytes);
         void destroyAll();
     }
+
+    /*
+     * Owns a block of the pool and gives it back when it goes out of
+     * scope, or is reset.  Moving hands the block on.
+     *
+     * Requests of SmallSize bytes or less are served from storage inside
+     * the handle, without going to the pool, and cleared the same way.
+     * Such data lives wherever the handle does and is not aligned to more
+     * than 16 bytes.
+     */
+    class PoolBlock {
+        public:
+            static const int SmallSize = 64;
+
+            PoolBlock();
+            explicit PoolBlock(int size);
+            PoolBlock(PoolBlock&& src) noexcept;
+            PoolBlock& operator=(PoolBlock&& src) noexcept;
+            ~PoolBlock();
+
+            // give back the current block, if any, and take one of size
+            // bytes
+            void allocate(int size);
+            void reset();
+
+            unsigned char* data() const { return _data; }
+            explicit operator bool() const { return _data != nullptr; }
+
+        private:
+            PoolBlock(const PoolBlock& src);             // not allowed
+            PoolBlock& operator=(const PoolBlock& src);  // not allowed
+
+            MemBlock _mb;
+            unsigned char* _data;
+            int _size;
+            alignas(16) unsigned char _small[SmallSize];
+    };
+
+    inline PoolBlock::PoolBlock() : _data(nullptr), _size(0) {}
+
+    inline PoolBlock::PoolBlock(int size) : _data(nullptr), _size(0) {
+        allocate(size);
+    }
+
+    inline PoolBlock::~PoolBlock() { reset(); }
 }
 
 
@@ -0,0 +1,288 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "MountCalibration.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "OpStats.h"
+
+namespace encfs {
+namespace MountCalibration {
+
+// bytes coded to time the cipher
+static const int CodedBytes = 4 * 1024 * 1024;
+// blocks read back from the directory, their median is its latency
+static const int Samples = 9;
+// scratch file of the directory timing, in the root of the volume
+static const char ScratchName[] = ".encfs6.calibrate";
+// bounds of the read-ahead window
+static const int MinReadAhead = 8;
+static const int MaxReadAhead = 4096;
+
+struct Entry {
+  double value;
+  long stamp;  // time it was measured
+};
+
+// the calibration file, or empty when there is no cache directory
+static std::string path() {
+  std::string dir;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg != nullptr && xdg[0] == '/') {
+    dir = xdg;
+  } else if (home != nullptr && home[0] == '/') {
+    dir = std::string(home) + "/.cache";
+  } else {
+    return std::string();
+  }
+  return dir + "/encfs-mount";
+}
+
+// name, value and stamp a line, as `name value stamp`
+static std::map<std::string, Entry> load(const std::string &file) {
+  std::map<std::string, Entry> entries;
+  FILE *in = fopen(file.c_str(), "r");
+  if (in == nullptr) {
+    return entries;
+  }
+  char name[512];
+  Entry entry;
+  while (fscanf(in, "%511s %lf %ld", name, &entry.value, &entry.stamp) == 3) {
+    if (entry.value > 0) {
+      entries[name] = entry;
+    }
+  }
+  fclose(in);
+  return entries;
+}
+
+static void save(const std::string &file,
+                 const std::map<std::string, Entry> &entries) {
+  std::string dir = file.substr(0, file.rfind('/'));
+  if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    VLOG(1) << "unable to make " << dir << ": " << strerror(errno);
+    return;
+  }
+  // written aside and renamed, so that mounts side by side each see a
+  // whole file
+  std::string tmp = file + "." + std::to_string(getpid());
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (out == nullptr) {
+    VLOG(1) << "unable to write " << tmp << ": " << strerror(errno);
+    return;
+  }
+  for (const auto &it : entries) {
+    fprintf(out, "%s %.3f %ld\n", it.first.c_str(), it.second.value,
+            it.second.stamp);
+  }
+  bool ok = fclose(out) == 0;
+  if (!ok || ::rename(tmp.c_str(), file.c_str()) != 0) {
+    VLOG(1) << "unable to save " << file << ": " << strerror(errno);
+    ::unlink(tmp.c_str());
+  }
+}
+
+// s with what would end a name of the file, and '%', escaped
+static std::string escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '%' || (unsigned char)c <= ' ') {
+      char hex[4];
+      snprintf(hex, sizeof(hex), "%%%02x", (unsigned char)c);
+      out += hex;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+static std::string hostName() {
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0) {
+    return "localhost";
+  }
+  host[sizeof(host) - 1] = '\0';
+  return escape(host);
+}
+
+// MB/s of one core coding CodedBytes in blocks of bs, 0 if the cipher
+// fails
+static double timeCipher(const std::shared_ptr<Cipher> &cipher,
+                         const CipherKey &key, int bs) {
+  int blocks = CodedBytes / bs;
+  int header = cipher->aeadHeaderSize();
+  std::vector<unsigned char> data((size_t)blocks * bs);
+  std::vector<unsigned char> sealed;
+  if (header > 0) {
+    sealed.resize((size_t)bs + header);
+  }
+  cipher->randomize(data.data(), (int)data.size(), false);
+
+  uint64_t start = OpStats::now();
+  for (int i = 0; i < blocks; ++i) {
+    unsigned char *block = &data[(size_t)i * bs];
+    bool ok = header > 0 ? cipher->aeadEncode(block, bs, i, sealed.data(), key)
+                         : cipher->blockEncode(block, bs, i, key);
+    if (!ok) {
+      return 0;
+    }
+  }
+  uint64_t ns = OpStats::now() - start;
+  return ns == 0 ? 0 : (double)blocks * bs * 1000 / (double)ns;
+}
+
+// µs the median of Samples reads of a block of bs from dir takes once out
+// of the page cache, 0 if dir can not be written
+static double timeDirectory(const std::string &dir, int bs) {
+  std::string file = dir + ScratchName;
+  int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return 0;
+  }
+  std::vector<unsigned char> buf(bs, 0x5a);
+  std::vector<uint64_t> times;
+  bool ok = true;
+  for (int i = 0; ok && i < Samples; ++i) {
+    ok = ::pwrite(fd, buf.data(), bs, (off_t)i * bs) == bs;
+  }
+  // clean pages are the ones the kernel lets go of
+  ok = ok && ::fdatasync(fd) == 0;
+  if (ok) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  for (int i = 0; ok && i < Samples; ++i) {
+    uint64_t start = OpStats::now();
+    ok = ::pread(fd, buf.data(), bs, (off_t)i * bs) == bs;
+    times.push_back(OpStats::now() - start);
+  }
+  ::close(fd);
+  ::unlink(file.c_str());
+  if (!ok) {
+    return 0;
+  }
+  std::sort(times.begin(), times.end());
+  return (double)times[Samples / 2] / 1000;
+}
+
+bool measure(const std::shared_ptr<Cipher> &cipher, const CipherKey &key,
+             int blockSize, const std::string &dir, bool writable,
+             Result *out) {
+  std::string file = path();
+  std::map<std::string, Entry> entries;
+  if (!file.empty()) {
+    entries = load(file);
+  }
+  long now = (long)time(nullptr);
+  std::string host = hostName();
+  std::string cryptoName = host + ":crypto:" + cipher->interface().name() +
+                           ":" + std::to_string(cipher->keySize() * 8) +
+                           ":" + std::to_string(blockSize);
+  std::string dirName = host + ":latency:" + escape(dir) + ":" +
+                        std::to_string(blockSize);
+  bool changed = false;
+
+  auto it = entries.find(cryptoName);
+  if (it != entries.end() && now - it->second.stamp < MaxAgeSecs) {
+    out->mbPerSec = it->second.value;
+  } else {
+    out->mbPerSec = timeCipher(cipher, key, blockSize);
+    if (out->mbPerSec <= 0) {
+      return false;
+    }
+    entries[cryptoName] = Entry{out->mbPerSec, now};
+    changed = true;
+  }
+
+  it = entries.find(dirName);
+  if (it != entries.end() && now - it->second.stamp < MaxAgeSecs) {
+    out->latencyUs = it->second.value;
+  } else {
+    out->latencyUs = writable ? timeDirectory(dir, blockSize) : 0;
+    if (out->latencyUs > 0) {
+      entries[dirName] = Entry{out->latencyUs, now};
+      changed = true;
+    }
+  }
+
+  if (changed && !file.empty()) {
+    save(file, entries);
+  }
+  VLOG(1) << "calibration of " << cryptoName << ": " << out->mbPerSec
+          << " MB/s, " << out->latencyUs << " us a block";
+  return true;
+}
+
+// ns one core takes to code a block of result
+static double blockNs(const Result &result, int blockSize) {
+  return (double)blockSize * 1000 / result.mbPerSec;
+}
+
+int cryptoThreads(const Result &result, int blockSize, int maxRequest,
+                  int cpus) {
+  if (result.latencyUs <= 0 || result.mbPerSec <= 0) {
+    return 0;
+  }
+  // a request waits on the backing store anyway; workers only help once
+  // coding it takes longer than that
+  int blocks = maxRequest / blockSize;
+  double requestNs = blocks * blockNs(result, blockSize);
+  double threads = std::ceil(requestNs / (result.latencyUs * 1000));
+  if (threads > cpus) {
+    threads = cpus;
+  }
+  if (threads > blocks) {
+    threads = blocks;
+  }
+  return threads < 2 ? 0 : (int)threads;
+}
+
+int readAheadBlocks(const Result &result, int blockSize, long cacheBytes) {
+  if (result.latencyUs <= 0 || result.mbPerSec <= 0) {
+    return 0;
+  }
+  // twice the blocks decoded while one is read, so that a read is always
+  // under way while the next ones are decoded
+  double blocks =
+      2 * std::ceil(result.latencyUs * 1000 / blockNs(result, blockSize));
+  double cached = (double)cacheBytes / blockSize / 2;
+  if (blocks > cached) {
+    blocks = cached;
+  }
+  if (blocks > MaxReadAhead) {
+    blocks = MaxReadAhead;
+  }
+  return blocks < MinReadAhead ? MinReadAhead : (int)blocks;
+}
+
+}  // namespace MountCalibration
+}  // namespace encfs
@@ -0,0 +1,58 @@
+#ifndef _MountCalibration_incl_
+#define _MountCalibration_incl_
+
+#include <memory>
+#include <string>
+
+#include "CipherKey.h"
+
+namespace encfs {
+
+class Cipher;
+
+/*
+    --calibrate: how fast one core of this host codes the blocks of a
+    volume, and how long its backing directory takes to read a block that
+    is not in the page cache, measured as it is mounted and kept in a small
+    file of the user's cache directory, like KdfCalibration, so that later
+    mounts of the host only look them up.  Entries are by host name, since
+    the cache directory may be on a home shared by hosts that differ, and
+    are measured again once they are MaxAgeSecs old.
+
+    From the two the mount sizes its crypto pool, so that coding a request
+    of maxWrite bytes takes about as long as the backing store takes to
+    answer, and its read-ahead window, so that it holds the blocks one core
+    decodes while a block is read.  Settings given on the command line are
+    kept as they are.
+ */
+namespace MountCalibration {
+
+// entries older than this are measured again
+const long MaxAgeSecs = 7L * 24 * 3600;
+
+struct Result {
+  double mbPerSec;   // one core coding blocks of the volume
+  double latencyUs;  // reading a block of the backing directory, 0 if it
+                     // could not be measured
+};
+
+// measures, or recalls, the costs of cipher coding blocks of blockSize
+// bytes, and of the directory dir, which is only written to, a scratch
+// file, if writable.  False if the cipher fails.
+bool measure(const std::shared_ptr<Cipher> &cipher, const CipherKey &key,
+             int blockSize, const std::string &dir, bool writable,
+             Result *out);
+
+// crypto workers for result with requests of up to maxRequest bytes, at
+// most cpus, 0 when coding in the caller keeps up
+int cryptoThreads(const Result &result, int blockSize, int maxRequest,
+                  int cpus);
+
+// read-ahead blocks for result, at most half of a block cache of
+// cacheBytes
+int readAheadBlocks(const Result &result, int blockSize, long cacheBytes);
+
+}  // namespace MountCalibration
+}  // namespace encfs
+
+#endif
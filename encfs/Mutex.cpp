@@ -0,0 +1,93 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Mutex.h"
+
+#include "easylogging++.h"
+#include <algorithm>
+#include <vector>
+
+namespace encfs {
+
+namespace LockProfile {
+
+std::atomic<bool> enabled(false);
+
+static std::atomic<Site*> gSites(nullptr);
+
+Site::Site(const char* name_)
+    : name(name_), acquired(0), contended(0), waitNs(0), maxWaitNs(0),
+      holdNs(0), next(nullptr) {
+  Site* head = gSites.load(std::memory_order_relaxed);
+  do {
+    next = head;
+  } while (!gSites.compare_exchange_weak(head, this,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
+}
+
+Site* first() { return gSites.load(std::memory_order_acquire); }
+
+uint64_t acquired(Site& site, uint64_t waitStart) {
+  site.acquired.fetch_add(1, std::memory_order_relaxed);
+  uint64_t t = now();
+  if (waitStart == 0) {
+    return t;
+  }
+  uint64_t waited = t - waitStart;
+  site.contended.fetch_add(1, std::memory_order_relaxed);
+  site.waitNs.fetch_add(waited, std::memory_order_relaxed);
+  uint64_t max = site.maxWaitNs.load(std::memory_order_relaxed);
+  while (waited > max &&
+         !site.maxWaitNs.compare_exchange_weak(max, waited,
+                                               std::memory_order_relaxed)) {
+  }
+  return t;
+}
+
+void logSummary() {
+  if (!enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  std::vector<Site*> sites;
+  for (Site* site = first(); site != nullptr; site = site->next) {
+    if (site->acquired.load(std::memory_order_relaxed) != 0) {
+      sites.push_back(site);
+    }
+  }
+  std::sort(sites.begin(), sites.end(), [](Site* a, Site* b) {
+    return a->waitNs.load(std::memory_order_relaxed) >
+           b->waitNs.load(std::memory_order_relaxed);
+  });
+  for (Site* site : sites) {
+    RLOG(INFO) << "lock " << site->name << ": "
+               << site->acquired.load(std::memory_order_relaxed)
+               << " taken, "
+               << site->contended.load(std::memory_order_relaxed)
+               << " waited, "
+               << site->waitNs.load(std::memory_order_relaxed) / 1000
+               << "us waiting (max "
+               << site->maxWaitNs.load(std::memory_order_relaxed) / 1000
+               << "us), "
+               << site->holdNs.load(std::memory_order_relaxed) / 1000
+               << "us held";
+  }
+}
+
+}  // namespace LockProfile
+
+}  // namespace encfs
@@ -1,14 +1,73 @@
 #ifndef _Mutex_incl_
 #define _Mutex_incl_
 
+#include <atomic>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 namespace encfs {
 
+/*
+    Opt-in contention profile of the locks taken through a Site, see
+    --lock-profile.  Each site counts how often it was taken, how often it
+    had to wait, and the time spent waiting for and holding the lock, with
+    relaxed atomic adds.  With profiling off a site costs one load.
+
+    Sites are statics that register themselves on a list that never
+    shrinks, so they can be read at any time:
+
+        Lock lock(mutex, ENCFS_LOCK_SITE("DirNode::rename"));
+ */
+namespace LockProfile {
+
+struct Site {
+    explicit Site(const char* name);
+
+    const char* name;
+    std::atomic<uint64_t> acquired;
+    std::atomic<uint64_t> contended;  // acquisitions that had to wait
+    std::atomic<uint64_t> waitNs;
+    std::atomic<uint64_t> maxWaitNs;
+    std::atomic<uint64_t> holdNs;
+    Site* next;
+};
+
+extern std::atomic<bool> enabled;
+
+// newest site first, null while none was taken yet
+Site* first();
+
+inline uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// record an acquisition whose wait started at waitStart, 0 if it did not
+// wait, and return the time the hold starts
+uint64_t acquired(Site& site, uint64_t waitStart);
+inline void released(Site& site, uint64_t since) {
+    site.holdNs.fetch_add(now() - since, std::memory_order_relaxed);
+}
+
+// log the sites that were taken, busiest first
+void logSummary();
+
+}  // namespace LockProfile
+
+// a site of its own for each place it is written at
+#define ENCFS_LOCK_SITE(name)                           \
+    ([]() -> ::encfs::LockProfile::Site& {              \
+        static ::encfs::LockProfile::Site site(name);   \
+        return site;                                    \
+    }())
 
 class Lock {
     public:
         Lock(pthread_mutex_t& mutex);
+        // profiled at site while LockProfile::enabled
+        Lock(pthread_mutex_t& mutex, LockProfile::Site& site);
         ~Lock();
 
         // leave the lock as it is. When the lock wrapper is destroyed, it
@@ -20,18 +79,68 @@ class Lock {
         Lock& operator=(const Lock& src); // not allowed
 
         pthread_mutex_t* _mutex;
+        LockProfile::Site* _site;  // null when not profiled
+        uint64_t _since;
 };
 
-inline Lock::Lock(pthread_mutex_t& mutex) : _mutex(&mutex) {
-    pthread_mutex_t(mutex);
+inline Lock::Lock(pthread_mutex_t& mutex)
+    : _mutex(&mutex), _site(0), _since(0) {
+    pthread_mutex_lock(_mutex);
+}
+
+inline Lock::Lock(pthread_mutex_t& mutex, LockProfile::Site& site)
+    : _mutex(&mutex), _site(0), _since(0) {
+    if (!LockProfile::enabled.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(_mutex);
+        return;
+    }
+    _site = &site;
+    uint64_t waitStart = 0;
+    if (pthread_mutex_trylock(_mutex) != 0) {
+        waitStart = LockProfile::now();
+        pthread_mutex_lock(_mutex);
+    }
+    _since = LockProfile::acquired(site, waitStart);
 }
 
 inline Lock::~Lock() {
-    if (_mutex) pthread_mutex_t(_mutex);
+    if (_mutex) {
+        if (_site) LockProfile::released(*_site, _since);
+        pthread_mutex_unlock(_mutex);
+    }
 }
 
 inline void Lock::leave() { _mutex = 0; }
 
+// shared and exclusive holds of a reader-writer lock
+class ReadLock {
+    public:
+        ReadLock(pthread_rwlock_t& lock) : _lock(&lock) {
+            pthread_rwlock_rdlock(_lock);
+        }
+        ~ReadLock() { pthread_rwlock_unlock(_lock); }
+
+    private:
+        ReadLock(const ReadLock& src);              // not allowed
+        ReadLock& operator=(const ReadLock& src);   // not allowed
+
+        pthread_rwlock_t* _lock;
+};
+
+class WriteLock {
+    public:
+        WriteLock(pthread_rwlock_t& lock) : _lock(&lock) {
+            pthread_rwlock_wrlock(_lock);
+        }
+        ~WriteLock() { pthread_rwlock_unlock(_lock); }
+
+    private:
+        WriteLock(const WriteLock& src);              // not allowed
+        WriteLock& operator=(const WriteLock& src);   // not allowed
+
+        pthread_rwlock_t* _lock;
+};
+
 }
 
 #endif
@@ -1,17 +1,20 @@
 #include "NameIO.h"
 
 #include "easylogging++.h"
+#include <cerrno>
 #include <cstring>
 
 #include <iostream>
-#include <map>
 #include <utility>
+#include <vector>
 
 #include "BlockNameIO.h"
 #include "CipherKey.h"
 #include "Error.h"
 #include "Interface.h"
 #include "NullNameIO.h"
+#include "OpStats.h"
+#include "Probes.h"
 #include "StreamNameIO.h"
 
 using namespace std;
@@ -28,51 +31,77 @@ namespace encfs {
     REF_MODULE(NullNameIO);
   }
 
+  /*
+      The registered name codings, in the order of their names.  Plain data
+      with a constant initializer, like the cipher table, so registering
+      from static initializers needs nothing constructed first.
+   */
+  static const int MaxNameIOs = 8;
+  static const int MaxInterfaceName = 32;
+
   struct NameIOAlg {
-    bool hidden;
-    NameIO::Constructor constructor;
-    string description;
-    Interface iface;
+    const char* name = nullptr;  // registered names are string literals
+    const char* description = nullptr;
+    char ifaceName[MaxInterfaceName] = {};
+    int current = 0;
+    int revision = 0;
+    int age = 0;
+    NameIO::Constructor constructor = nullptr;
+    bool hidden = false;
+
+    Interface iface() const {
+      return Interface(ifaceName, current, revision, age);
+    }
   };
 
-  using NameIOMap_t = multimap<string, NameIOAlg>;
-  static NameIOMap_t* gNameIOMap = nullptr;
+  static NameIOAlg gNameIOs[MaxNameIOs];
+  static int gNameIOCount = 0;
 
   list<NameIO::Algorithm> NameIO::GetAlgorithmList(bool includeHidden) {
     AddSymbolReferences();
 
     list<Algorithm> result;
-    if (gNameIOMap != nullptr) {
-      NameIOMap_t::const_iterator it;
-      NameIOMap_t::const_iterator end = gNameIOMap->end();
-      for (it = gNameIOMap->begin(); it != end; ++it) {
-        if (includeHidden || !it->second.hidden) {
-          Algorithm tmp;
-          tmp.name = it->first;
-          tmp.description = it->second.description;
-          tmp.iface = it->second.iface;
-
-          result.push_back(tmp);
-        }
+    for (int i = 0; i < gNameIOCount; ++i) {
+      const NameIOAlg& alg = gNameIOs[i];
+      if (includeHidden || !alg.hidden) {
+        Algorithm tmp;
+        tmp.name = alg.name;
+        tmp.description = alg.description;
+        tmp.iface = alg.iface();
+
+        result.push_back(tmp);
       }
     }
     return result;
   }
 
   bool NameIO::Register(const char* name, const char* description,
-                        const Interface& iface, constructor constructor,
+                        const Interface& iface, Constructor constructor,
                         bool hidden) {
-    if (gNameIOMap == nullptr) {
-      gNameIOMap = new NameIOMap_t;
+    if (gNameIOCount == MaxNameIOs ||
+        iface.name().length() >= (size_t)MaxInterfaceName) {
+      cerr << "NameIO::Register: no room for " << name << "\n";
+      return false;
     }
 
-    NameIOAlg alg;
-    alg.hidden = hidden;
-    alg.constructor = constructor;
-    alg.description = description;
-    alg.iface = iface;
+    // keep the table in name order, after codings of the same name
+    int pos = gNameIOCount;
+    while (pos > 0 && strcmp(gNameIOs[pos - 1].name, name) > 0) {
+      gNameIOs[pos] = gNameIOs[pos - 1];
+      --pos;
+    }
+    ++gNameIOCount;
 
-    gNameIOMap->insert(make_pair(string(name), alg));
+    NameIOAlg& alg = gNameIOs[pos];
+    alg.name = name;
+    alg.description = description;
+    strncpy(alg.ifaceName, iface.name().c_str(), MaxInterfaceName - 1);
+    alg.ifaceName[MaxInterfaceName - 1] = '\0';
+    alg.current = iface.current();
+    alg.revision = iface.revision();
+    alg.age = iface.age();
+    alg.constructor = constructor;
+    alg.hidden = hidden;
     return true;
   }
 
@@ -80,11 +109,10 @@ namespace encfs {
                                       const std::shared_ptr<Cipher>& cipher,
                                       const CipherKey& key) {
     std::shared_ptr<NameIO> result;
-    if (gNameIOMap != nullptr) {
-      NameIOMap_t::const_iterator it = gNameIOMap->find(name);
-      if (it != gNameIOMap->end()) {
-        Constructor fn = it->second.constructor;
-        result  = (*fn) (it->second.iface, cipher, key);
+    for (int i = 0; i < gNameIOCount; ++i) {
+      if (name == gNameIOs[i].name) {
+        result = (*gNameIOs[i].constructor)(gNameIOs[i].iface(), cipher, key);
+        break;
       }
     }
     return result;
@@ -94,15 +122,10 @@ namespace encfs {
                                       const std::shared_ptr<Cipher>& cipher,
                                       const CipherKey& key) {
     std::shared_ptr<NameIO> result;
-    if (gNameIOMap != nullptr) {
-      NameIOMap_t::const_iterator it;
-      NameIOMap_t::const_iterator end = gNameIOMap->end();
-      for (it = gNameIOMap->begin(); it != end; ++it) {
-        if (it->second.iface.implements(iface)) {
-          Constructor fn = it->second.constructor;
-          result = (*fn)(iface, cipher, key);
-          break;
-        }
+    for (int i = 0; i < gNameIOCount; ++i) {
+      if (gNameIOs[i].iface().implements(iface)) {
+        result = (*gNameIOs[i].constructor)(iface, cipher, key);
+        break;
       }
     }
     return result;
@@ -120,48 +143,99 @@ namespace encfs {
   
   bool NameIO::getReverseEncryption() const { return reverseEncryption; }
 
-  std::string NameIO::recodePath (
-      const char* path, int (NameIO::*_length)(int)const,
-      int (NameIO::*_code)(const char* , int , uint64_t, char*, int ) const,
-      uint64_t * iv
-      ) const  {
-    string output;
+  /*
+   * Scratch space for coding names and paths, kept per thread so that
+   * coding does not allocate once it has grown to fit.
+   */
+  static std::vector<char>& codingScratch(size_t size) {
+    static thread_local std::vector<char> scratch(256);
+    if (scratch.size() < size) {
+      scratch.resize(size);
+    }
+    return scratch;
+  }
+
+  int NameIO::recodePath(const char* path, CodingLen _length, CodingFunc _code,
+                         uint64_t* iv, char* buf, int bufLength) const {
+    uint64_t startIV = (iv != nullptr) ? *iv : 0;
+    int used = 0;
 
     while (*path != 0) {
       if (*path == '/') {
-        if (!output.empty()) {
-          output += '/';
+        if (used != 0) {
+          if (used + 1 >= bufLength) {
+            break;
+          }
+          buf[used++] = '/';
         }
         ++path;
       } else {
         bool isDotFile = (*path == '.');
         const char* next = strchr(path, '/');
-        int len =  next != nullptr ? next-path : strlen(path);
+        int len = next != nullptr ? next - path : strlen(path);
 
         if (isDotFile && (path[len-1] == '.') && (len <= 2)) {
-          output.append(len, '.');
+          if (used + len >= bufLength) {
+            break;
+          }
+          memset(buf + used, '.', len);
+          used += len;
           path += len;
           continue;
         }
 
         int approxLen = (this->*_length)(len);
         if (approxLen <= 0) {
-          throw Error("Filename too small to decode");
+          // too small to decode
+          if (iv != nullptr) {
+            *iv = startIV;
+          }
+          return -EINVAL;
+        }
+        if (used + approxLen + 1 > bufLength) {
+          break;
         }
-        int bufSize = 0;
-
-        BUFFER_INIT_S(codeBuf, 32, (unsigned int)approxLen + 1, bufSize)
 
-        int codedLen = (this->*_code)(path, len, iv, codeBuf, bufSize);
+        int codedLen = (this->*_code)(path, len, iv, buf + used,
+                                      bufLength - used);
+        if (codedLen < 0) {
+          if (iv != nullptr) {
+            *iv = startIV;
+          }
+          return codedLen;
+        }
         rAssert(codedLen <= approxLen);
-        rAssert(codeBuf[codedLen] == '\0');
         path += len;
+        used += codedLen;
+      }
+    }
+
+    if (*path != 0 || used >= bufLength) {
+      // out of room
+      if (iv != nullptr) {
+        *iv = startIV;
+      }
+      return -1;
+    }
+    buf[used] = '\0';
+    return used;
+  }
 
-        output += (char*) codeBuf;
-        BUFFER_RESET(codeBuf)
+  std::string NameIO::recodePath(const char* path, CodingLen _length,
+                                 CodingFunc _code, uint64_t* iv) const {
+    size_t size = 2 * strlen(path) + 64;
+    for (;;) {
+      std::vector<char>& scratch = codingScratch(size);
+      int len = recodePath(path, _length, _code, iv, scratch.data(),
+                           (int)scratch.size());
+      if (len >= 0) {
+        return std::string(scratch.data(), len);
+      }
+      if (len != -1) {
+        throw Error("Filename too small to decode");
       }
+      size = 2 * scratch.size();
     }
-    return output;
   }
 
   std::string NameIO::encodePath(const char* plaintextPath) const {
@@ -174,7 +248,7 @@ namespace encfs {
     return decodePath(cipherPath, &iv);
   }
 
-  std::string NameIO::_encodeName(const char* plaintextPath, uint64_t* iv) const {
+  std::string NameIO::_encodePath(const char* plaintextPath, uint64_t* iv) const {
     if (!chainedNameIV) {
       iv = nullptr;
     }
@@ -192,13 +266,93 @@ namespace encfs {
   }
 
   std::string NameIO::encodePath(const char* path, uint64_t* iv) const {
-    return getReverseEncryption() ? _decodePath(path, iv) : _encodePath(path, iv);
+    StatTimer timer(OpStats::EncodeName);
+    ENCFS_PROBE1(encode_path_entry, path);
+    ProbeClock clock(ENCFS_PROBE_ENABLED(encode_path_return));
+    std::string res =
+        getReverseEncryption() ? _decodePath(path, iv) : _encodePath(path, iv);
+    ENCFS_PROBE3(encode_path_return, path, res.c_str(), clock.elapsed());
+    return res;
   }
 
   std::string NameIO::decodePath(const char* path, uint64_t* iv) const {
+    StatTimer timer(OpStats::DecodeName);
     return getReverseEncryption() ? _encodePath(path, iv) : _decodePath(path, iv);
   }
 
+  int NameIO::encodePath(const char* path, char* buf, int bufLength,
+                         uint64_t* iv) const {
+    StatTimer timer(OpStats::EncodeName);
+    ENCFS_PROBE1(encode_path_entry, path);
+    ProbeClock clock(ENCFS_PROBE_ENABLED(encode_path_return));
+    uint64_t* chainIV = chainedNameIV ? iv : nullptr;
+    int len;
+    if (getReverseEncryption()) {
+      len = recodePath(path, &NameIO::maxDecodedNameLen, &NameIO::decodeName,
+                       chainIV, buf, bufLength);
+    } else {
+      len = recodePath(path, &NameIO::maxEncodedNameLen, &NameIO::encodeName,
+                       chainIV, buf, bufLength);
+    }
+    if (len < -1) {
+      throw Error("Filename too small to decode");
+    }
+    // buf is only filled in when it was large enough
+    ENCFS_PROBE3(encode_path_return, path, len >= 0 ? buf : "",
+                 clock.elapsed());
+    return len;
+  }
+
+  int NameIO::decodePath(const char* path, char* buf, int bufLength,
+                         uint64_t* iv) const {
+    StatTimer timer(OpStats::DecodeName);
+    uint64_t* chainIV = chainedNameIV ? iv : nullptr;
+    int len;
+    if (getReverseEncryption()) {
+      len = recodePath(path, &NameIO::maxEncodedNameLen, &NameIO::encodeName,
+                       chainIV, buf, bufLength);
+    } else {
+      len = recodePath(path, &NameIO::maxDecodedNameLen, &NameIO::decodeName,
+                       chainIV, buf, bufLength);
+    }
+    if (len < -1) {
+      throw Error("Filename too small to decode");
+    }
+    return len;
+  }
+
+  int NameIO::tryDecodePath(const char* path, char* buf, int bufLength,
+                            uint64_t* iv) const {
+    StatTimer timer(OpStats::DecodeName);
+    uint64_t* chainIV = chainedNameIV ? iv : nullptr;
+    int len;
+    if (getReverseEncryption()) {
+      len = recodePath(path, &NameIO::maxEncodedNameLen, &NameIO::encodeName,
+                       chainIV, buf, bufLength);
+    } else {
+      len = recodePath(path, &NameIO::maxDecodedNameLen,
+                       &NameIO::tryDecodeName, chainIV, buf, bufLength);
+    }
+    return len == -1 ? -ENAMETOOLONG : len;
+  }
+
+  int NameIO::tryDecodePath(const char* path, std::string* plaintextPath,
+                            uint64_t* iv) const {
+    size_t size = 2 * strlen(path) + 64;
+    for (;;) {
+      std::vector<char>& scratch = codingScratch(size);
+      int len = tryDecodePath(path, scratch.data(), (int)scratch.size(), iv);
+      if (len >= 0) {
+        plaintextPath->assign(scratch.data(), len);
+        return 0;
+      }
+      if (len != -ENAMETOOLONG) {
+        return len;
+      }
+      size = 2 * scratch.size();
+    }
+  }
+
   int NameIO::encodeName(const char* input, int length, char* output, int bufferLength) const  {
     return encodeName(input, length, (uint64_t*)nullptr, output, bufferLength);
   }
@@ -208,33 +362,91 @@ namespace encfs {
     return decodeName(input, length, (uint64_t*)nullptr, output, bufferLength);
   }
 
+  int NameIO::tryDecodeName(const char* encodedName, int length, uint64_t* iv,
+                            char* plaintextName, int bufferLength) const {
+    try {
+      return decodeName(encodedName, length, iv, plaintextName, bufferLength);
+    } catch (encfs::Error& err) {
+      return -EINVAL;
+    }
+  }
+
   std::string NameIO::_encodeName(const char* plaintextName, int length) const {
     int approxLen = maxEncodedNameLen(length);
-    int bufSize = 0;
-
-    BUFFER_INIT_S(codeBuf, 32, (unsigned int) approxLen + 1, bufSize);
+    std::vector<char>& codeBuf = codingScratch(approxLen + 1);
 
-    int codedLen = encodeName(plaintextName, length, nullptr, codeBuf, bufSize);
+    int codedLen = encodeName(plaintextName, length, nullptr, codeBuf.data(),
+                              (int)codeBuf.size());
     rAssert(codedLen <= approxLen);
-    rAssert(codeBuf[codedLen] == '\0');
 
-    std::string result = (char*) codeBuf;
-    BUFFER_RESET(codeBuf)
-
-    return result;
+    return std::string(codeBuf.data(), codedLen);
   }
 
-  std::string NameIO::_decodeName(const char* encodedname, int length) const {
+  std::string NameIO::_decodeName(const char* encodedName, int length) const {
     int approxLen = maxDecodedNameLen(length);
-    int bufSize = 0;
+    if (approxLen <= 0) {
+      throw Error("Filename too small to decode");
+    }
+    std::vector<char>& codeBuf = codingScratch(approxLen + 1);
 
-    BUFFER_INIT_S(codeBuf, 32, (unsigned char) approxLen + 1, bufSize);
+    int codedLen = decodeName(encodedName, length, nullptr, codeBuf.data(),
+                              (int)codeBuf.size());
     rAssert(codedLen <= approxLen);
-    rAssert(codeBuf[codedLen] == '\0');
 
-    std::string result = (char*) codeBuf;
-    BUFFER_RESET(codeBuf)
-    return result;
+    return std::string(codeBuf.data(), codedLen);
+  }
+
+  void NameIO::encodeNameBatch(NameRequest* names, int count,
+                               bool chained) const {
+    for (int i = 0; i < count; ++i) {
+      NameRequest& req = names[i];
+      int length = (int)req.name.size();
+      std::vector<char>& buf = codingScratch(maxEncodedNameLen(length) + 1);
+      int len = encodeName(req.name.data(), length, chained ? &req.iv : nullptr,
+                           buf.data(), (int)buf.size());
+      req.coded.assign(buf.data(), len);
+      req.ok = true;
+    }
+  }
+
+  void NameIO::decodeNameBatch(NameRequest* names, int count,
+                               bool chained) const {
+    for (int i = 0; i < count; ++i) {
+      NameRequest& req = names[i];
+      int length = (int)req.name.size();
+      int approxLen = maxDecodedNameLen(length);
+      req.ok = false;
+      if (approxLen <= 0) {
+        continue;
+      }
+      std::vector<char>& buf = codingScratch(approxLen + 1);
+      uint64_t iv = req.iv;
+      int len = tryDecodeName(req.name.data(), length, chained ? &iv : nullptr,
+                              buf.data(), (int)buf.size());
+      if (len >= 0) {
+        req.coded.assign(buf.data(), len);
+        req.iv = iv;
+        req.ok = true;
+      }
+    }
+  }
+
+  void NameIO::encodeNames(NameRequest* names, int count) const {
+    StatTimer timer(OpStats::EncodeName);
+    if (getReverseEncryption()) {
+      decodeNameBatch(names, count, chainedNameIV);
+    } else {
+      encodeNameBatch(names, count, chainedNameIV);
+    }
+  }
+
+  void NameIO::decodeNames(NameRequest* names, int count) const {
+    StatTimer timer(OpStats::DecodeName);
+    if (getReverseEncryption()) {
+      encodeNameBatch(names, count, chainedNameIV);
+    } else {
+      decodeNameBatch(names, count, chainedNameIV);
+    }
   }
 
   std::string NameIO::encodeName(const char* path, int length) const {
@@ -38,7 +38,7 @@ namespace encfs {
                                  const Interface& iface, Constructor constructor,
                                  bool hidden = false);
             NameIO();
-            virtual NameIO();
+            virtual ~NameIO();
 
             virtual Interface interface() const = 0;
 
@@ -53,28 +53,85 @@ namespace encfs {
             std::string encodePath(const char* plaintextPath, uint64_t* iv) const;
             std::string decodePath(const char* encodedPath, uint64_t* iv) const;
 
-            virtual int maxEncodednameLen(int plaintextNameLen) const = 0;
+            // as above, but into buf of bufLength bytes, NUL terminated,
+            // without allocating.  Returns the length of the result, or -1
+            // if it does not fit, in which case iv is left as it was.  A
+            // path needs room for maxEncodedNameLen (or maxDecodedNameLen)
+            // of each name, plus one.
+            int encodePath(const char* plaintextPath, char* buf, int bufLength,
+                           uint64_t* iv) const;
+            int decodePath(const char* encodedPath, char* buf, int bufLength,
+                           uint64_t* iv) const;
+
+            // as decodePath into buf, but a name that does not decode (a
+            // foreign file, or cruft, in the backing directory) returns
+            // -EINVAL rather than throwing, and a buf too small returns
+            // -ENAMETOOLONG.  iv is left as it was on either.  For readdir,
+            // where such names are skipped one per entry.
+            int tryDecodePath(const char* encodedPath, char* buf, int bufLength,
+                              uint64_t* iv) const;
+            // as above, into *plaintextPath.  0 or -EINVAL.
+            int tryDecodePath(const char* encodedPath, std::string* plaintextPath,
+                              uint64_t* iv) const;
+
+            virtual int maxEncodedNameLen(int plaintextNameLen) const = 0;
             virtual int maxDecodedNameLen(int encodedNameLen) const = 0;
 
             std::string encodeName(const char* plaintextName, int length) const;
             std::string decodeName(const char* encodedName, int length) const;
 
+            // one name of a batch
+            struct NameRequest {
+                std::string name;   // to be coded
+                // with chained name IVs, the IV of the directory on the way
+                // in, and the IV the chain ends with at the name on the way
+                // out.  Left alone otherwise.
+                uint64_t iv;
+                std::string coded;
+                bool ok;            // false for a name that does not decode
+            };
+            // every name of a batch coded on its own, as encodeName and
+            // tryDecodePath code a name, but with the cipher taken once for
+            // the batch rather than once per name: for what is known up
+            // front, such as the names of a directory.  A trailing '/' or a
+            // path is not supported.
+            void encodeNames(NameRequest* names, int count) const;
+            void decodeNames(NameRequest* names, int count) const;
+
         protected:
             virtual int encodeName(const char* plaintextName, int length,
-                                   const char* encodedName, int bufferLength) const;
-            virtual int decodedName(const char* encodedName, int length,
+                                   char* encodedName, int bufferLength) const;
+            virtual int decodeName(const char* encodedName, int length,
                                     char* plaintextName, int bufferLength) const;
 
             virtual int encodeName(const char* plaintextName, int length, uint64_t* iv,
                                    char* encodedName, int bufferLength) const = 0;
             virtual int decodeName(const char* encodedName, int length, uint64_t* iv,
                                    char* plaintextName, int bufferLength) const = 0;
+            // as decodeName, but returns -EINVAL for a name that does not
+            // decode.  The default catches what decodeName throws; codings
+            // override it to find out without an exception.
+            virtual int tryDecodeName(const char* encodedName, int length,
+                                      uint64_t* iv, char* plaintextName,
+                                      int bufferLength) const;
+            // the codings of encodeNames and decodeNames in the forward
+            // direction, chained if the names chain IVs.  The defaults code
+            // one name at a time.
+            virtual void encodeNameBatch(NameRequest* names, int count,
+                                         bool chained) const;
+            virtual void decodeNameBatch(NameRequest* names, int count,
+                                         bool chained) const;
 
         private:
-            std::string recodePath(const char* path, int (NameIO::*codingLen)(int) const,
-                                   int (NameIO::*codingFunc)(const char* , int , uint64_t,
-                                                             char* , int) const,
-                                   uint64_t* iv) const ;
+            using CodingLen = int (NameIO::*)(int) const;
+            using CodingFunc = int (NameIO::*)(const char*, int, uint64_t*,
+                                               char*, int) const;
+
+            std::string recodePath(const char* path, CodingLen codingLen,
+                                   CodingFunc codingFunc, uint64_t* iv) const;
+            int recodePath(const char* path, CodingLen codingLen,
+                           CodingFunc codingFunc, uint64_t* iv, char* buf,
+                           int bufLength) const;
             std::string _encodePath(const char* plaintextPath, uint64_t* iv) const;
             std::string _decodePath(const char* encodePath, uint64_t* iv) const;
             std::string _encodeName(const char* plaintextName, int length) const;
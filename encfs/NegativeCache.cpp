@@ -0,0 +1,187 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "NegativeCache.h"
+
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// split "/dir/name" into "/dir" and "name", the directory as
+// parentDirectory() has it
+static void splitPath(const char *plainPath, std::string *dir,
+                      std::string *name) {
+  const char *slash = strrchr(plainPath, '/');
+  if (slash == nullptr) {
+    dir->clear();
+    *name = plainPath;
+    return;
+  }
+  dir->assign(plainPath, slash - plainPath);
+  *name = slash + 1;
+}
+
+NegativeCache::NegativeCache(size_t maxEntries, int ttlMs)
+    : _maxShardEntries(maxEntries > NumShards ? maxEntries / NumShards : 1),
+      _ttlMs(ttlMs),
+      _hits(0),
+      _misses(0) {
+  for (Shard &shard : _shards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+    shard.entries = 0;
+    shard.generation = 0;
+  }
+}
+
+NegativeCache::~NegativeCache() {
+  VLOG(1) << "negative cache: " << hits() << " hits, " << misses()
+          << " misses";
+  for (Shard &shard : _shards) {
+    pthread_mutex_destroy(&shard.mutex);
+  }
+}
+
+NegativeCache::Shard &NegativeCache::shardFor(const std::string &dirPath) {
+  size_t h = std::hash<std::string>()(dirPath);
+  return _shards[(h ^ (h >> 17)) % NumShards];
+}
+
+bool NegativeCache::missing(const char *plainPath, uint64_t *generation) {
+  std::string dir, name;
+  splitPath(plainPath, &dir, &name);
+  Shard &shard = shardFor(dir);
+
+  Lock lock(shard.mutex);
+  auto dirIt = shard.dirs.find(dir);
+  if (dirIt != shard.dirs.end()) {
+    auto it = dirIt->second.find(name);
+    if (it != dirIt->second.end()) {
+      if (it->second > monotonicMs()) {
+        ++_hits;
+        return true;
+      }
+      dirIt->second.erase(it);
+      --shard.entries;
+      if (dirIt->second.empty()) {
+        shard.dirs.erase(dirIt);
+      }
+    }
+  }
+  ++_misses;
+  *generation = shard.generation;
+  return false;
+}
+
+void NegativeCache::add(const char *plainPath, uint64_t generation) {
+  std::string dir, name;
+  splitPath(plainPath, &dir, &name);
+  Shard &shard = shardFor(dir);
+  int64_t now = monotonicMs();
+
+  Lock lock(shard.mutex);
+  if (shard.generation != generation) {
+    // the name may have been created while it was looked up
+    return;
+  }
+  if (shard.entries >= _maxShardEntries) {
+    makeRoom(shard, now);
+  }
+  auto res = shard.dirs[dir].insert(std::make_pair(name, now + _ttlMs));
+  if (res.second) {
+    ++shard.entries;
+  } else {
+    res.first->second = now + _ttlMs;
+  }
+}
+
+void NegativeCache::makeRoom(Shard &shard, int64_t now) {
+  auto dirIt = shard.dirs.begin();
+  while (dirIt != shard.dirs.end()) {
+    NameMap &names = dirIt->second;
+    for (auto it = names.begin(); it != names.end();) {
+      if (it->second <= now) {
+        it = names.erase(it);
+        --shard.entries;
+      } else {
+        ++it;
+      }
+    }
+    if (names.empty()) {
+      dirIt = shard.dirs.erase(dirIt);
+    } else {
+      ++dirIt;
+    }
+  }
+
+  if (shard.entries >= _maxShardEntries) {
+    shard.dirs.clear();
+    shard.entries = 0;
+  }
+}
+
+void NegativeCache::invalidateDir(const std::string &dirPath) {
+  Shard &shard = shardFor(dirPath);
+
+  Lock lock(shard.mutex);
+  ++shard.generation;
+  auto it = shard.dirs.find(dirPath);
+  if (it != shard.dirs.end()) {
+    shard.entries -= it->second.size();
+    shard.dirs.erase(it);
+  }
+}
+
+void NegativeCache::eraseBelow(const char *plainPath) {
+  size_t len = strlen(plainPath);
+  // "/" or "/dir/" cover everything below them as they are
+  bool isPrefix = len > 0 && plainPath[len - 1] == '/';
+
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    ++shard.generation;
+    auto it = shard.dirs.begin();
+    while (it != shard.dirs.end()) {
+      const std::string &path = it->first;
+      bool below = path.compare(0, len, plainPath) == 0 &&
+                   (path.size() == len || isPrefix || path[len] == '/');
+      if (below) {
+        shard.entries -= it->second.size();
+        it = shard.dirs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+uint64_t NegativeCache::hits() const { return _hits; }
+
+uint64_t NegativeCache::misses() const { return _misses; }
+
+}  // namespace encfs
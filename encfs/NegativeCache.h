@@ -0,0 +1,73 @@
+#ifndef _NegativeCache_incl_
+#define _NegativeCache_incl_
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+namespace encfs {
+
+/*
+    Plaintext paths recently found not to exist, so that looking them up
+    again does not encode the path and stat the backing store only to fail
+    once more.
+
+    Entries are kept for ttlMs milliseconds, which bounds how long a name
+    created behind our back stays hidden.  Names created through the
+    filesystem drop what is recorded for their directory right away.
+
+    Entries are grouped by directory, and spread over shards by the hash of
+    the directory, each with its own lock and share of the bound.
+ */
+class NegativeCache {
+ public:
+  NegativeCache(size_t maxEntries, int ttlMs);
+  ~NegativeCache();
+
+  // true if plainPath was recorded as missing and has not expired.
+  // Otherwise generation is set for add(), which records the path only if
+  // no name was created in its directory since.
+  bool missing(const char *plainPath, uint64_t *generation);
+  void add(const char *plainPath, uint64_t generation);
+
+  // a name was created in dirPath
+  void invalidateDir(const std::string &dirPath);
+  // forget every directory at or below plainPath
+  void eraseBelow(const char *plainPath);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  static const int NumShards = 16;
+
+  // names of a directory, with the time they expire
+  using NameMap = std::unordered_map<std::string, int64_t>;
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string, NameMap> dirs;
+    size_t entries;
+    uint64_t generation;  // bumped on every invalidation
+  };
+
+  Shard &shardFor(const std::string &dirPath);
+  // drop expired entries, or everything if that does not make room
+  void makeRoom(Shard &shard, int64_t now);
+
+  Shard _shards[NumShards];
+  size_t _maxShardEntries;
+  int _ttlMs;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  NegativeCache(const NegativeCache &);             // not allowed
+  NegativeCache &operator=(const NegativeCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
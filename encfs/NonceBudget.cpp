@@ -0,0 +1,190 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "NonceBudget.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+const char NonceBudget::FileName[] = ".encfs6.nonces";
+
+// the file: magic, the count and its MAC
+static const unsigned char BudgetMagic[8] = {'E', 'n', 'c', 'F',
+                                             'S', 'n', 'c', 0};
+static const int FileSize = 24;
+// chained into the MAC, so that it is not that of any other file
+static const uint64_t BudgetSeed = 0x6e6f6e636573ULL;
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+NonceBudget::NonceBudget(const std::string &rootDir,
+                         std::shared_ptr<Cipher> cipher, CipherKey key)
+    : _path(rootDir + FileName),
+      _cipher(std::move(cipher)),
+      _key(std::move(key)),
+      _used(0),
+      _reserved(0),
+      _exhausted(false) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+NonceBudget::~NonceBudget() {
+  {
+    Lock lock(_mutex);
+    // those past the reservation were refused
+    uint64_t used = std::min(_used.load(), _reserved.load());
+    if (used < _reserved) {
+      save(used);
+    }
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool NonceBudget::open(bool recorded,
+                       const std::function<uint64_t()> &seed) {
+  Lock lock(_mutex);
+  int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT && recorded) {
+    RLOG(ERROR) << _path << " is missing, the blocks sealed under the key "
+                << "are not known: restore it, or mount read-only and copy "
+                << "the data to a new volume";
+    return false;
+  }
+  if (fd < 0 && errno == ENOENT) {
+    // a volume from before the count
+    uint64_t count = std::min(Budget, seed());
+    int res = save(count);
+    if (res < 0) {
+      RLOG(ERROR) << "unable to write " << _path << ": " << strerror(-res);
+      return false;
+    }
+    _used = count;
+    _reserved = count;
+    VLOG(1) << "at least " << count << " blocks sealed under the volume key";
+    return true;
+  }
+  if (fd < 0) {
+    RLOG(ERROR) << "unable to open " << _path << ": " << strerror(errno);
+    return false;
+  }
+  unsigned char buf[FileSize];
+  ssize_t n = ::pread(fd, buf, sizeof(buf), 0);
+  ::close(fd);
+
+  uint64_t chain = BudgetSeed;
+  if (n != FileSize || memcmp(buf, BudgetMagic, sizeof(BudgetMagic)) != 0 ||
+      _cipher->MAC_64(buf, 16, _key, &chain) != get64(buf + 16)) {
+    RLOG(ERROR) << _path << " is damaged, the blocks sealed under the key "
+                << "are not known";
+    return false;
+  }
+  uint64_t count = get64(buf + 8);
+  _used = count;
+  _reserved = count;
+  VLOG(1) << count << " blocks sealed under the volume key";
+  return true;
+}
+
+int NonceBudget::take() {
+  uint64_t n = _used++;
+  if (n < _reserved) {
+    return 0;
+  }
+
+  Lock lock(_mutex);
+  if (n >= Budget) {
+    if (!_exhausted) {
+      RLOG(ERROR) << "the volume key has sealed " << Budget
+                  << " blocks, the most its random nonces allow: copy the "
+                  << "data to a new volume or rekey it";
+      _exhausted = true;
+    }
+    return -ENOSPC;
+  }
+  if (n < _reserved) {
+    // leased by another thread meanwhile
+    return 0;
+  }
+  uint64_t next = std::min(Budget, (n / Lease + 1) * Lease);
+  int res = save(next);
+  if (res < 0) {
+    RLOG(ERROR) << "unable to write " << _path << ": " << strerror(-res);
+    return res;
+  }
+  if (next > Budget / 2 && _reserved <= Budget / 2) {
+    RLOG(WARNING) << "the volume key has sealed half the blocks its random "
+                  << "nonces allow";
+  }
+  _reserved = next;
+  return 0;
+}
+
+uint64_t NonceBudget::used() const {
+  return std::min(_used.load(), _reserved.load());
+}
+
+int NonceBudget::save(uint64_t count) {
+  unsigned char buf[FileSize];
+  memcpy(buf, BudgetMagic, sizeof(BudgetMagic));
+  put64(buf + 8, count);
+  uint64_t chain = BudgetSeed;
+  put64(buf + 16, _cipher->MAC_64(buf, 16, _key, &chain));
+
+  // written aside and renamed, so that a crash leaves the old count or the
+  // new one
+  std::string tmp = _path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  if (fd < 0) {
+    return -errno;
+  }
+  errno = 0;
+  bool ok = ::pwrite(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf) &&
+            ::fsync(fd) == 0;
+  ok = ::close(fd) == 0 && ok;
+  ok = ok && ::rename(tmp.c_str(), _path.c_str()) == 0;
+  if (!ok) {
+    int eno = errno != 0 ? errno : EIO;
+    ::unlink(tmp.c_str());
+    return -eno;
+  }
+  return 0;
+}
+
+}  // namespace encfs
@@ -0,0 +1,80 @@
+#ifndef _NonceBudget_incl_
+#define _NonceBudget_incl_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+#include "CipherKey.h"
+
+namespace encfs {
+
+class Cipher;
+
+/*
+    The blocks sealed under the volume key by a cipher that picks a random
+    96 bit nonce for each (ssl/aes-gcm, ssl/chacha20).  Past about 2^32 of
+    them two nonces are no longer unlikely to collide, and one collision
+    under GCM gives away the authentication key.  So once Budget blocks
+    are sealed, writes fail with ENOSPC, and the data has to go to a new
+    volume or get a new key (encfsctl rekey).
+
+    The count is kept in a file in the root of the backing directory, with
+    a MAC under the volume key.  It is moved on a Lease at a time, before
+    the blocks of the lease are sealed, so a crash only loses blocks that
+    were counted but not sealed.  The blocks really sealed are written back
+    when the mount goes away.
+
+    The volume config records that the volume has the file, so that one
+    lost or deleted is refused rather than taken for a count of 0.  A
+    volume made before the count, which has neither, starts from the blocks
+    its files hold, the fewest it can have sealed.
+ */
+class NonceBudget {
+ public:
+  // the count, in the root of the backing directory
+  static const char FileName[];
+  static const uint64_t Budget = 1ULL << 32;
+  static const uint64_t Lease = 1ULL << 20;
+
+  NonceBudget(const std::string &rootDir, std::shared_ptr<Cipher> cipher,
+              CipherKey key);
+  // writes back the blocks sealed
+  ~NonceBudget();
+
+  // reads the count.  Without the file, refused if recorded, the config
+  // saying there should be one, and otherwise started at the count that
+  // seed gives.  False if the file is missing, damaged or could not be
+  // read or written.
+  bool open(bool recorded, const std::function<uint64_t()> &seed);
+
+  // before a block is sealed: 0, -ENOSPC past the budget, or -errno if
+  // the count could not be moved on
+  int take();
+
+  // blocks sealed so far, with the earlier mounts
+  uint64_t used() const;
+
+ private:
+  // writes count to the file, 0 or -errno.  Caller holds _mutex.
+  int save(uint64_t count);
+
+  std::string _path;
+  std::shared_ptr<Cipher> _cipher;
+  CipherKey _key;
+
+  pthread_mutex_t _mutex;
+  std::atomic<uint64_t> _used;      // taken, including those refused
+  std::atomic<uint64_t> _reserved;  // counted in the file
+  bool _exhausted;                  // the budget was reported used up
+
+  NonceBudget(const NonceBudget &);             // not allowed
+  NonceBudget &operator=(const NonceBudget &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
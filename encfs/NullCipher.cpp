@@ -11,7 +11,9 @@ using namespace std;
 
 namespace encfs {
 
-static Interface NullInterface("nullCipher", 1, 0, 0);
+// version 2 marks volumes with the newer formats (see createV6Config), which
+// are coded as in version 1
+static Interface NullInterface("nullCipher", 2, 0, 1);
 static Range NullKeyRange(0);
 static Range NullBlockRange(1, 4096, 1);
 
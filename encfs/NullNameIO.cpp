@@ -22,7 +22,7 @@ namespace encfs {
     NameIO::Register("Null", "No encryption of filenames", NNIOIface, NewNNIO);
 
   NullNameIO::NullNameIO() = default;
-  NullNameIO::~NullNameIO() = defualt;
+  NullNameIO::~NullNameIO() = default;
 
   Interface NullNameIO::interface() const { return NNIOIface; }
 
@@ -40,7 +40,7 @@ namespace encfs {
       char* encodedName, int bufferLength) const {
     (void) iv;
     rAssert(length <= bufferLength);
-    memcpy(encodeName, plaintextName, length);
+    memcpy(encodedName, plaintextName, length);
 
     return length;
   }
@@ -0,0 +1,186 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Numa.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "Error.h"
+
+namespace encfs {
+
+namespace Numa {
+
+// calls of currentNode() before the node is looked up again
+static const int NodeRecheck = 256;
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static const char NodeDir[] = "/sys/devices/system/node/node";
+
+static int countNodes() {
+  int count = 0;
+  for (int node = 0;; ++node) {
+    std::string path = NodeDir + std::to_string(node);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      break;
+    }
+    ++count;
+  }
+  if (count < 1) {
+    return 1;
+  }
+  return count < MaxNodes ? count : MaxNodes;
+}
+
+int nodes() {
+  static const int count = countNodes();
+  return count;
+}
+
+int currentNode() {
+  if (nodes() == 1) {
+    return 0;
+  }
+  static thread_local int node = 0;
+  static thread_local int calls = 0;
+  if (calls-- > 0) {
+    return node;
+  }
+  calls = NodeRecheck;
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned int cpu = 0, found = 0;
+  if (syscall(SYS_getcpu, &cpu, &found, nullptr) == 0) {
+    node = (int)(found % MaxNodes);
+  }
+#endif
+  return node;
+}
+
+void preferNode(void *addr, size_t len, int node) {
+  if (nodes() == 1) {
+    return;
+  }
+#if defined(__linux__) && defined(SYS_mbind)
+  unsigned long mask = 1UL << node;
+  // best effort, the kernel falls back to any node when this one is full
+  syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+#else
+  (void)addr;
+  (void)len;
+  (void)node;
+#endif
+}
+
+#if defined(__linux__)
+
+// "0-3,8-11" as in nodeN/cpulist
+static bool parseCpuList(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  bool any = false;
+  while (*p != '\0' && *p != '\n') {
+    char *end = nullptr;
+    long first = strtol(p, &end, 10);
+    if (end == p) {
+      return false;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      ++p;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return false;
+      }
+      p = end;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, set);
+      any = true;
+    }
+    if (*p == ',') {
+      ++p;
+    }
+  }
+  return any;
+}
+
+bool pinThread(int node) {
+  std::string path = NodeDir + std::to_string(node) + "/cpulist";
+  FILE *in = fopen(path.c_str(), "r");
+  if (in == nullptr) {
+    return false;
+  }
+  char list[4096];
+  bool ok = fgets(list, sizeof(list), in) != nullptr;
+  fclose(in);
+
+  cpu_set_t set;
+  if (!ok || !parseCpuList(list, &set)) {
+    RLOG(WARNING) << "can not read the CPUs of NUMA node " << node;
+    return false;
+  }
+  int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (res != 0) {
+    RLOG(WARNING) << "unable to pin a thread to NUMA node " << node << ": "
+                  << strerror(res);
+    return false;
+  }
+  return true;
+}
+
+#else
+
+bool pinThread(int node) {
+  (void)node;
+  return false;
+}
+
+#endif
+
+bool pinThread() {
+  if (nodes() == 1) {
+    return false;
+  }
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned int cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return false;
+  }
+  return pinThread((int)node);
+#else
+  return false;
+#endif
+}
+
+}  // namespace Numa
+
+}  // namespace encfs
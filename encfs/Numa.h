@@ -0,0 +1,42 @@
+#ifndef _Numa_incl_
+#define _Numa_incl_
+
+#include <stddef.h>
+
+namespace encfs {
+
+/*
+    Where memory and threads are on a NUMA host, so that buffers and cipher
+    contexts can be kept on the node of the thread coding with them.  Read
+    from sysfs and the getcpu and mbind system calls, without libnuma; a host
+    without NUMA, or one that does not say, has a single node 0 and all of
+    this costs nothing.
+ */
+namespace Numa {
+
+// nodes beyond this share the state of node % MaxNodes
+static const int MaxNodes = 8;
+
+// nodes of the host, at most MaxNodes
+int nodes();
+
+// the node the calling thread runs on.  Looked up again every so many
+// calls, as the scheduler may move a thread that is not pinned.
+int currentNode();
+
+// asks for the pages of [addr, addr + len) to be placed on node, before they
+// are first touched
+void preferNode(void *addr, size_t len, int node);
+
+// pins the calling thread to the CPUs of the node it runs on, false if that
+// could not be done
+bool pinThread();
+
+// pins the calling thread to the CPUs of node
+bool pinThread(int node);
+
+}  // namespace Numa
+
+}  // namespace encfs
+
+#endif
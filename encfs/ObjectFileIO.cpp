@@ -0,0 +1,311 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ObjectFileIO.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <utility>
+
+#include "Error.h"
+#include "ObjectStore.h"
+
+namespace encfs {
+
+static Interface ObjectFileIO_iface("FileIO/Object", 1, 0, 0);
+
+ObjectFileIO::ObjectFileIO(std::shared_ptr<FileIO> _base,
+                           std::shared_ptr<ObjectStore> _store)
+    : base(std::move(_base)), store(std::move(_store)), knownId(0),
+      knownSize(0) {}
+
+ObjectFileIO::~ObjectFileIO() {}
+
+Interface ObjectFileIO::interface() const { return ObjectFileIO_iface; }
+
+unsigned int ObjectFileIO::blockSize() const { return base->blockSize(); }
+
+void ObjectFileIO::setFileName(const char *fileName) {
+  base->setFileName(fileName);
+}
+
+const char *ObjectFileIO::getFileName() const { return base->getFileName(); }
+
+bool ObjectFileIO::setIV(uint64_t iv) { return base->setIV(iv); }
+
+uint64_t ObjectFileIO::objectId(off_t *size, off_t *baseSize) const {
+  off_t placeholderSize = base->getSize();
+  if (baseSize != nullptr) {
+    *baseSize = placeholderSize;
+  }
+  if (placeholderSize != ObjectStore::PlaceholderSize) {
+    knownId = 0;
+    return 0;
+  }
+
+  uint64_t id = knownId;
+  if (id != 0) {
+    *size = knownSize;
+    return id;
+  }
+  // by name, the backing file need not be open
+  off_t len;
+  if (!store->readPlaceholder(AT_FDCWD, getFileName(), &id, &len)) {
+    return 0;
+  }
+  knownSize = len;
+  knownId = id;
+  *size = len;
+  return id;
+}
+
+int ObjectFileIO::setSize(uint64_t id, off_t size) {
+  unsigned char placeholder[ObjectStore::PlaceholderSize];
+  store->placeholder(id, size, placeholder);
+  IORequest req;
+  req.offset = 0;
+  req.dataLen = sizeof(placeholder);
+  req.data = placeholder;
+  ssize_t res = base->write(req);
+  if (res < 0) {
+    return (int)res;
+  }
+  knownSize = size;
+  knownId = id;
+  return 0;
+}
+
+int ObjectFileIO::open(int flags) {
+  if ((flags & O_TRUNC) == 0) {
+    return base->open(flags);
+  }
+  // the data in the store is dropped along with the placeholder
+  int res = base->open(flags & ~O_TRUNC);
+  if (res < 0) {
+    return res;
+  }
+  int truncRes = truncate(0);
+  return truncRes < 0 ? truncRes : res;
+}
+
+int ObjectFileIO::getAttr(struct stat *stbuf) const {
+  int res = base->getAttr(stbuf);
+  if (res == 0 && S_ISREG(stbuf->st_mode) &&
+      stbuf->st_size == ObjectStore::PlaceholderSize) {
+    off_t size;
+    if (objectId(&size, nullptr) != 0) {
+      stbuf->st_size = size;
+      stbuf->st_blocks = (size + 511) / 512;
+    }
+  }
+  return res;
+}
+
+off_t ObjectFileIO::getSize() const {
+  off_t size, baseSize;
+  uint64_t id = objectId(&size, &baseSize);
+  return id != 0 ? size : baseSize;
+}
+
+ssize_t ObjectFileIO::read(const IORequest &req) const {
+  off_t size;
+  uint64_t id = objectId(&size, nullptr);
+  if (id == 0) {
+    return base->read(req);
+  }
+  struct iovec iov;
+  iov.iov_base = req.data;
+  iov.iov_len = req.dataLen;
+  return store->read(id, size, req.offset, &iov, 1);
+}
+
+ssize_t ObjectFileIO::readv(const IOVecRequest &req) const {
+  off_t size;
+  uint64_t id = objectId(&size, nullptr);
+  if (id == 0) {
+    return base->readv(req);
+  }
+  // all the buffers in one go, a GET per chunk they cover
+  return store->read(id, size, req.offset, req.iov, req.iovcnt);
+}
+
+ssize_t ObjectFileIO::write(const IORequest &req) {
+  if (req.dataLen == 0) {
+    return 0;
+  }
+  off_t size, baseSize;
+  uint64_t id = objectId(&size, &baseSize);
+  if (baseSize < 0) {
+    return baseSize;
+  }
+  bool fresh = id == 0;
+  if (fresh) {
+    if (baseSize != 0) {
+      return base->write(req);
+    }
+    id = store->newId();
+    if (id == 0) {
+      // a file of its own after all
+      return base->write(req);
+    }
+    size = 0;
+  }
+
+  ssize_t res = store->write(id, size, req.offset, req.data, req.dataLen);
+  if (res < 0) {
+    return res;
+  }
+  off_t end = req.offset + (off_t)req.dataLen;
+  if (fresh || end > size) {
+    int sizeRes = setSize(id, std::max(end, size));
+    if (sizeRes < 0) {
+      if (fresh) {
+        store->erase(id, end);
+      }
+      return sizeRes;
+    }
+  }
+  return res;
+}
+
+ssize_t ObjectFileIO::writev(const IOVecRequest &req) {
+  off_t size, baseSize;
+  uint64_t id = objectId(&size, &baseSize);
+  if (baseSize < 0) {
+    return baseSize;
+  }
+  if (id == 0) {
+    if (baseSize != 0) {
+      return base->writev(req);
+    }
+    // the first write makes the placeholder
+    return FileIO::writev(req);
+  }
+
+  // the size recorded once for all the buffers
+  off_t offset = req.offset;
+  off_t newSize = size;
+  for (int i = 0; i < req.iovcnt; ++i) {
+    ssize_t res =
+        store->write(id, newSize, offset,
+                     (const unsigned char *)req.iov[i].iov_base,
+                     req.iov[i].iov_len);
+    if (res < 0) {
+      return res;
+    }
+    offset += (off_t)req.iov[i].iov_len;
+    newSize = std::max(newSize, offset);
+  }
+  if (newSize > size) {
+    int res = setSize(id, newSize);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return offset - req.offset;
+}
+
+int ObjectFileIO::truncate(off_t size) {
+  off_t oldSize, baseSize;
+  uint64_t id = objectId(&oldSize, &baseSize);
+  if (baseSize < 0) {
+    return (int)baseSize;
+  }
+  if (id == 0) {
+    if (baseSize == 0 && size > 0) {
+      // an empty file made larger is an object file with nothing stored
+      id = store->newId();
+      if (id != 0) {
+        return setSize(id, size);
+      }
+    }
+    return base->truncate(size);
+  }
+
+  if (size == 0) {
+    int res = base->truncate(0);
+    if (res == 0) {
+      knownId = 0;
+      store->erase(id, oldSize);
+    }
+    return res;
+  }
+  if (size == oldSize) {
+    return 0;
+  }
+  if (size < oldSize) {
+    int res = store->truncate(id, oldSize, size);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return setSize(id, size);
+}
+
+bool ObjectFileIO::isWritable() const { return base->isWritable(); }
+
+bool ObjectFileIO::isHole(off_t offset, size_t len) const {
+  off_t size;
+  return objectId(&size, nullptr) == 0 && base->isHole(offset, len);
+}
+
+off_t ObjectFileIO::seekExtent(off_t offset, bool hole) const {
+  off_t size;
+  if (objectId(&size, nullptr) != 0) {
+    return FileIO::seekExtent(offset, hole);
+  }
+  return base->seekExtent(offset, hole);
+}
+
+int ObjectFileIO::allocate(int mode, off_t offset, off_t len) {
+  off_t size;
+  uint64_t id = objectId(&size, nullptr);
+  if (id == 0) {
+    return base->allocate(mode, offset, len);
+  }
+  // the store has no space to reserve, only the size can change
+  if ((mode & FALLOC_FL_PUNCH_HOLE) != 0) {
+    return -EOPNOTSUPP;
+  }
+  if ((mode & FALLOC_FL_KEEP_SIZE) != 0 || offset + len <= size) {
+    return 0;
+  }
+  return setSize(id, offset + len);
+}
+
+void ObjectFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+int ObjectFileIO::passthroughFd() const {
+  off_t size;
+  return objectId(&size, nullptr) == 0 ? base->passthroughFd() : -1;
+}
+
+void ObjectFileIO::invalidateData(off_t offset, size_t len) {
+  knownId = 0;
+  base->invalidateData(offset, len);
+}
+
+int ObjectFileIO::flush() {
+  off_t size;
+  uint64_t id = objectId(&size, nullptr);
+  return id != 0 ? store->flush(id) : 0;
+}
+
+}  // namespace encfs
@@ -0,0 +1,86 @@
+#ifndef _ObjectFileIO_incl_
+#define _ObjectFileIO_incl_
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "FileIO.h"
+#include "Interface.h"
+
+namespace encfs {
+
+class ObjectStore;
+
+/*
+    The backing file of a file whose data is kept in the ObjectStore of the
+    mount (--object-store).  Sits right above the RawFileIO of the backing
+    file, below the ciphertext cache and the cipher, so what goes to the
+    store is what the backing file would have held.
+
+    An empty backing file that is written to becomes an object file: its
+    data goes in the store, and the backing file becomes a placeholder
+    naming it and recording its size, rewritten whenever the size changes.
+    Files that had data before the mount used the store stay as they are.
+    The chunks written are stored by flush(), which the node calls on
+    close and fsync, if they were not already.
+ */
+class ObjectFileIO : public FileIO {
+ public:
+  ObjectFileIO(std::shared_ptr<FileIO> base,
+               std::shared_ptr<ObjectStore> store);
+  virtual ~ObjectFileIO();
+
+  virtual Interface interface() const;
+  virtual unsigned int blockSize() const;
+
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+  virtual bool setIV(uint64_t iv);
+
+  virtual int open(int flags);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t write(const IORequest &req);
+  virtual ssize_t readv(const IOVecRequest &req) const;
+  virtual ssize_t writev(const IOVecRequest &req);
+
+  virtual int truncate(off_t size);
+  virtual bool isWritable() const;
+
+  virtual bool isHole(off_t offset, size_t len) const;
+  virtual off_t seekExtent(off_t offset, bool hole) const;
+  virtual int allocate(int mode, off_t offset, off_t len);
+  virtual void invalidateAttr();
+  virtual int passthroughFd() const;
+  virtual void invalidateData(off_t offset, size_t len);
+
+  // stores what was written to the file.  0 or -errno.
+  int flush();
+
+ private:
+  ObjectFileIO(const ObjectFileIO &src);             // not allowed
+  ObjectFileIO &operator=(const ObjectFileIO &src);  // not allowed
+
+  // the id of the file in the store, 0 if it is not an object file, and
+  // *size its size.  *baseSize is set to the size of the backing file, or
+  // -errno.
+  uint64_t objectId(off_t *size, off_t *baseSize) const;
+
+  // records size in the placeholder of id, which is written over the
+  // backing file.  0 or -errno.
+  int setSize(uint64_t id, off_t size);
+
+  std::shared_ptr<FileIO> base;
+  std::shared_ptr<ObjectStore> store;
+  // of the placeholder last read or written, id 0 if none
+  mutable std::atomic<uint64_t> knownId;
+  mutable std::atomic<off_t> knownSize;
+};
+
+}  // namespace encfs
+
+#endif
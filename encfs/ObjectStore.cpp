@@ -0,0 +1,1274 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ObjectStore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/opensslv.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "Mutex.h"
+#include "ThreadPool.h"
+
+namespace encfs {
+
+// the first bytes of a placeholder
+static const unsigned char PlaceholderMagic[8] = {'E', 'n', 'c', 'F',
+                                                  'S', 'o', 'b', 0};
+// chained into the MAC, so that an object placeholder never has the MAC
+// of a packed one
+static const uint64_t PlaceholderSeed = 0x6f626a656374ULL;
+
+// transfers to and from the store at once, each on a connection of its
+// own
+static const int TransferThreads = 8;
+// tries of a request the store answered with a 5xx or 429, backing off
+// from RetryMs
+static const int Retries = 4;
+static const int RetryMs = 100;
+// seconds a connection waits for the store before giving up
+static const int IoTimeoutSecs = 30;
+// bytes of an error answer kept for the log
+static const size_t MaxErrorText = 512;
+
+static const int PagesPerChunk =
+    (int)(ObjectStore::ChunkBytes / ObjectStore::PageBytes);
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static std::string hexOf(const unsigned char *data, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out(len * 2, '0');
+  for (size_t i = 0; i < len; ++i) {
+    out[2 * i] = digits[data[i] >> 4];
+    out[2 * i + 1] = digits[data[i] & 0xf];
+  }
+  return out;
+}
+
+static std::string sha256Hex(const unsigned char *data, size_t len) {
+  unsigned char md[SHA256_DIGEST_LENGTH];
+  SHA256(data, len, md);
+  return hexOf(md, sizeof(md));
+}
+
+static std::string hmacSha256(const std::string &key, const std::string &msg) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  HMAC(EVP_sha256(), key.data(), (int)key.size(),
+       (const unsigned char *)msg.data(), msg.size(), md, &len);
+  return std::string((const char *)md, len);
+}
+
+// percent encoding of a path as SigV4 wants it, '/' left as is
+static std::string uriEncode(const std::string &path) {
+  static const char digits[] = "0123456789ABCDEF";
+  std::string out;
+  for (unsigned char c : path) {
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+        c == '/') {
+      out += (char)c;
+    } else {
+      out += '%';
+      out += digits[c >> 4];
+      out += digits[c & 0xf];
+    }
+  }
+  return out;
+}
+
+static std::string lower(std::string s) {
+  for (char &c : s) {
+    c = (char)tolower((unsigned char)c);
+  }
+  return s;
+}
+
+// pages of a chunk between from and to, a bit each
+static uint32_t pageMask(size_t from, size_t to) {
+  if (from >= to) {
+    return 0;
+  }
+  int first = (int)(from / ObjectStore::PageBytes);
+  int last = (int)((to - 1) / ObjectStore::PageBytes);
+  uint32_t mask = 0;
+  for (int p = first; p <= last; ++p) {
+    mask |= 1u << p;
+  }
+  return mask;
+}
+
+struct ObjectStore::Request {
+  const char *method;
+  std::string key;       // of the object, empty for the bucket
+  std::string range;     // Range header, or empty
+  const unsigned char *body;
+  size_t bodyLen;
+  // where the body of a 2xx answer goes.  A store that ignores the
+  // range answers 200 with all of the object, rangeStart bytes of which
+  // come before the range.
+  unsigned char *out;
+  size_t outLen;
+  size_t rangeStart;
+  size_t seen;           // bytes of the body so far
+  size_t got;            // bytes put in out
+  std::string errorText; // start of the body of any other answer
+
+  // set by sign()
+  std::string path;
+  std::string amzDate;
+  std::string payloadHash;
+  std::string authorization;
+
+  Request(const char *method_, std::string key_)
+      : method(method_), key(std::move(key_)), body(nullptr), bodyLen(0),
+        out(nullptr), outLen(0), rangeStart(0), seen(0), got(0) {}
+
+  void reset() {
+    seen = 0;
+    got = 0;
+    errorText.clear();
+  }
+
+  void sink(int status, const char *data, size_t len) {
+    if (status / 100 != 2 || out == nullptr) {
+      if (errorText.size() < MaxErrorText) {
+        errorText.append(data, std::min(len, MaxErrorText - errorText.size()));
+      }
+      return;
+    }
+    if (status == 200 && seen < rangeStart) {
+      size_t n = std::min(rangeStart - seen, len);
+      seen += n;
+      data += n;
+      len -= n;
+    }
+    seen += len;
+    size_t n = std::min(len, outLen - got);
+    memcpy(out + got, data, n);
+    got += n;
+  }
+};
+
+struct ObjectStore::Connection {
+  int fd;
+  SSL *ssl;
+  std::vector<char> in;
+  size_t inPos;
+  size_t inEnd;
+
+  Connection() : fd(-1), ssl(nullptr), in(16 * 1024), inPos(0), inEnd(0) {}
+  ~Connection() {
+    if (ssl != nullptr) {
+      SSL_free(ssl);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  bool sendAll(const void *data, size_t len) {
+    const char *p = (const char *)data;
+    while (len > 0) {
+      ssize_t n;
+      if (ssl != nullptr) {
+        n = SSL_write(ssl, p, (int)std::min(len, (size_t)INT32_MAX));
+      } else {
+        n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // more bytes into in, false at the end of the stream or on an error
+  bool fill() {
+    if (inPos == inEnd) {
+      inPos = inEnd = 0;
+    }
+    for (;;) {
+      ssize_t n;
+      if (ssl != nullptr) {
+        n = SSL_read(ssl, in.data() + inEnd, (int)(in.size() - inEnd));
+      } else {
+        n = ::recv(fd, in.data() + inEnd, in.size() - inEnd, 0);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+      }
+      if (n <= 0) {
+        return false;
+      }
+      inEnd += n;
+      return true;
+    }
+  }
+
+  // a line, without its CRLF
+  bool readLine(std::string *line) {
+    line->clear();
+    for (;;) {
+      while (inPos < inEnd) {
+        char c = in[inPos++];
+        if (c == '\n') {
+          if (!line->empty() && line->back() == '\r') {
+            line->pop_back();
+          }
+          return true;
+        }
+        *line += c;
+        if (line->size() > 16 * 1024) {
+          return false;
+        }
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+  }
+
+  // len bytes of the body, to request
+  bool readBody(Request &request, int status, uint64_t len) {
+    while (len > 0) {
+      if (inPos == inEnd && !fill()) {
+        return false;
+      }
+      size_t n = (size_t)std::min<uint64_t>(len, inEnd - inPos);
+      request.sink(status, in.data() + inPos, n);
+      inPos += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // the rest of the stream, for an answer that ends with it
+  void readToEnd(Request &request, int status) {
+    for (;;) {
+      if (inPos < inEnd) {
+        request.sink(status, in.data() + inPos, inEnd - inPos);
+        inPos = inEnd;
+      }
+      if (!fill()) {
+        return;
+      }
+    }
+  }
+};
+
+ObjectStore::Chunk::Chunk()
+    : present(0), len(0), dirty(false), writes(0), putting(false) {
+  pthread_mutex_init(&mutex, nullptr);
+}
+
+ObjectStore::Chunk::~Chunk() { pthread_mutex_destroy(&mutex); }
+
+ObjectStore::ObjectStore(const std::string &url,
+                         std::shared_ptr<Cipher> cipher, CipherKey key,
+                         uint64_t cacheBytes)
+    : _url(url),
+      _cipher(std::move(cipher)),
+      _key(std::move(key)),
+      _cacheBytes(cacheBytes),
+      _sslCtx(nullptr),
+      _residentBytes(0),
+      _dirtyBytes(0),
+      _jobs(0) {
+  _endpoint.tls = false;
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_cond_init(&_idle, nullptr);
+}
+
+ObjectStore::~ObjectStore() {
+  if (_pool) {
+    int res = sync();
+    if (res < 0) {
+      RLOG(ERROR) << "data of the object store lost at unmount: "
+                  << strerror(-res);
+    }
+    Lock lock(_mutex);
+    while (_jobs > 0) {
+      pthread_cond_wait(&_idle, &_mutex);
+    }
+  }
+  _pool.reset();
+  for (Connection *conn : _idleConns) {
+    delete conn;
+  }
+  if (_sslCtx != nullptr) {
+    SSL_CTX_free((SSL_CTX *)_sslCtx);
+  }
+  pthread_cond_destroy(&_idle);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool ObjectStore::open() {
+  std::string rest;
+  if (_url.compare(0, 7, "http://") == 0) {
+    rest = _url.substr(7);
+  } else if (_url.compare(0, 8, "https://") == 0) {
+    _endpoint.tls = true;
+    rest = _url.substr(8);
+  } else {
+    RLOG(ERROR) << "object store url is not http:// or https://: " << _url;
+    return false;
+  }
+  size_t slash = rest.find('/');
+  std::string hostPort = rest.substr(0, slash);
+  std::string path = slash == std::string::npos ? "" : rest.substr(slash + 1);
+  size_t colon = hostPort.rfind(':');
+  if (colon != std::string::npos && hostPort.find(']') == std::string::npos) {
+    _endpoint.host = hostPort.substr(0, colon);
+    _endpoint.port = hostPort.substr(colon + 1);
+  } else {
+    _endpoint.host = hostPort;
+    _endpoint.port = _endpoint.tls ? "443" : "80";
+  }
+  while (!path.empty() && path.back() == '/') {
+    path.pop_back();
+  }
+  slash = path.find('/');
+  _endpoint.bucket = path.substr(0, slash);
+  if (slash != std::string::npos) {
+    _endpoint.prefix = path.substr(slash + 1) + "/";
+  }
+  if (_endpoint.host.empty() || _endpoint.bucket.empty()) {
+    RLOG(ERROR) << "object store url has no host or bucket: " << _url;
+    return false;
+  }
+
+  const char *accessKey = getenv("AWS_ACCESS_KEY_ID");
+  const char *secretKey = getenv("AWS_SECRET_ACCESS_KEY");
+  if (accessKey == nullptr || secretKey == nullptr) {
+    RLOG(ERROR) << "AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY must be set "
+                << "for the object store";
+    return false;
+  }
+  _accessKey = accessKey;
+  _secretKey = secretKey;
+  const char *token = getenv("AWS_SESSION_TOKEN");
+  _sessionToken = token != nullptr ? token : "";
+  const char *region = getenv("AWS_REGION");
+  if (region == nullptr) {
+    region = getenv("AWS_DEFAULT_REGION");
+  }
+  _region = region != nullptr ? region : "us-east-1";
+
+  if (_endpoint.tls) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+#else
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+#endif
+    if (ctx == nullptr) {
+      RLOG(ERROR) << "unable to set up TLS for the object store";
+      return false;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+    SSL_CTX_set_default_verify_paths(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    _sslCtx = ctx;
+  }
+
+  Request request("HEAD", "");
+  int status = perform(request);
+  if (status != 200) {
+    RLOG(ERROR) << "object store bucket " << _endpoint.bucket << " at "
+                << _endpoint.host << " can not be reached: "
+                << (status < 0 ? strerror(-status)
+                               : ("HTTP " + std::to_string(status)).c_str());
+    return false;
+  }
+  _pool = std::make_shared<ThreadPool>(TransferThreads);
+  VLOG(1) << "object store " << _endpoint.host << "/" << _endpoint.bucket
+          << "/" << _endpoint.prefix;
+  return true;
+}
+
+std::string ObjectStore::objectKey(uint64_t id, uint64_t chunk) const {
+  char buf[48];
+  snprintf(buf, sizeof(buf), "%016" PRIx64 "/%" PRIu64, id, chunk);
+  return _endpoint.prefix + buf;
+}
+
+void ObjectStore::sign(Request &request) const {
+  request.path = "/" + uriEncode(_endpoint.bucket);
+  if (!request.key.empty()) {
+    request.path += "/" + uriEncode(request.key);
+  }
+
+  time_t now = time(nullptr);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  char amzDate[32];
+  strftime(amzDate, sizeof(amzDate), "%Y%m%dT%H%M%SZ", &tm);
+  request.amzDate = amzDate;
+  std::string date = request.amzDate.substr(0, 8);
+  request.payloadHash = sha256Hex(request.body, request.bodyLen);
+
+  std::string host = _endpoint.host;
+  if (_endpoint.port != (_endpoint.tls ? "443" : "80")) {
+    host += ":" + _endpoint.port;
+  }
+  std::string headers = "host:" + host + "\n" +
+                        "x-amz-content-sha256:" + request.payloadHash + "\n" +
+                        "x-amz-date:" + request.amzDate + "\n";
+  std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+  if (!_sessionToken.empty()) {
+    headers += "x-amz-security-token:" + _sessionToken + "\n";
+    signedHeaders += ";x-amz-security-token";
+  }
+  std::string canonical = std::string(request.method) + "\n" + request.path +
+                          "\n\n" + headers + "\n" + signedHeaders + "\n" +
+                          request.payloadHash;
+  std::string scope = date + "/" + _region + "/s3/aws4_request";
+  std::string toSign =
+      "AWS4-HMAC-SHA256\n" + request.amzDate + "\n" + scope + "\n" +
+      sha256Hex((const unsigned char *)canonical.data(), canonical.size());
+
+  std::string signingKey = hmacSha256(
+      hmacSha256(hmacSha256(hmacSha256("AWS4" + _secretKey, date), _region),
+                 "s3"),
+      "aws4_request");
+  std::string signature = hmacSha256(signingKey, toSign);
+  request.authorization =
+      "AWS4-HMAC-SHA256 Credential=" + _accessKey + "/" + scope +
+      ", SignedHeaders=" + signedHeaders + ", Signature=" +
+      hexOf((const unsigned char *)signature.data(), signature.size());
+}
+
+ObjectStore::Connection *ObjectStore::connect(int *err) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addrs = nullptr;
+  int res = getaddrinfo(_endpoint.host.c_str(), _endpoint.port.c_str(),
+                        &hints, &addrs);
+  if (res != 0) {
+    RLOG(WARNING) << "object store host " << _endpoint.host << ": "
+                  << gai_strerror(res);
+    *err = -EHOSTUNREACH;
+    return nullptr;
+  }
+  std::unique_ptr<Connection> conn(new Connection());
+  *err = -ECONNREFUSED;
+  for (struct addrinfo *ai = addrs; ai != nullptr; ai = ai->ai_next) {
+    int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                      ai->ai_protocol);
+    if (fd < 0) {
+      *err = -errno;
+      continue;
+    }
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      conn->fd = fd;
+      break;
+    }
+    *err = -errno;
+    ::close(fd);
+  }
+  freeaddrinfo(addrs);
+  if (conn->fd < 0) {
+    VLOG(1) << "object store connect failed: " << strerror(-*err);
+    return nullptr;
+  }
+
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  struct timeval tv;
+  tv.tv_sec = IoTimeoutSecs;
+  tv.tv_usec = 0;
+  setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  if (_sslCtx != nullptr) {
+    conn->ssl = SSL_new((SSL_CTX *)_sslCtx);
+    if (conn->ssl == nullptr) {
+      *err = -ENOMEM;
+      return nullptr;
+    }
+    SSL_set_fd(conn->ssl, conn->fd);
+    SSL_set_tlsext_host_name(conn->ssl, _endpoint.host.c_str());
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    SSL_set1_host(conn->ssl, _endpoint.host.c_str());
+#else
+    X509_VERIFY_PARAM_set1_host(SSL_get0_param(conn->ssl),
+                                _endpoint.host.c_str(), 0);
+#endif
+    if (SSL_connect(conn->ssl) != 1 ||
+        SSL_get_verify_result(conn->ssl) != X509_V_OK) {
+      RLOG(WARNING) << "TLS to the object store at " << _endpoint.host
+                    << " failed";
+      *err = -ECONNREFUSED;
+      return nullptr;
+    }
+  }
+  *err = 0;
+  return conn.release();
+}
+
+void ObjectStore::release(Connection *conn, bool keep) {
+  if (keep) {
+    Lock lock(_mutex);
+    if (_idleConns.size() < (size_t)TransferThreads * 2) {
+      _idleConns.push_back(conn);
+      return;
+    }
+  }
+  delete conn;
+}
+
+int ObjectStore::performOnce(Request &request, bool *retry) {
+  *retry = false;
+  Connection *conn = nullptr;
+  bool reused = false;
+  {
+    Lock lock(_mutex);
+    if (!_idleConns.empty()) {
+      conn = _idleConns.back();
+      _idleConns.pop_back();
+      reused = true;
+    }
+  }
+  if (conn == nullptr) {
+    int err;
+    conn = connect(&err);
+    if (conn == nullptr) {
+      return err;
+    }
+  }
+
+  std::string head = std::string(request.method) + " " + request.path +
+                     " HTTP/1.1\r\nHost: " + _endpoint.host;
+  if (_endpoint.port != (_endpoint.tls ? "443" : "80")) {
+    head += ":" + _endpoint.port;
+  }
+  head += "\r\nx-amz-content-sha256: " + request.payloadHash +
+          "\r\nx-amz-date: " + request.amzDate +
+          "\r\nAuthorization: " + request.authorization + "\r\n";
+  if (!_sessionToken.empty()) {
+    head += "x-amz-security-token: " + _sessionToken + "\r\n";
+  }
+  if (!request.range.empty()) {
+    head += "Range: " + request.range + "\r\n";
+  }
+  head += "Content-Length: " + std::to_string(request.bodyLen) + "\r\n\r\n";
+
+  std::string line;
+  // a kept connection the store has closed fails here, and is tried
+  // again on a new one
+  if (!conn->sendAll(head.data(), head.size()) ||
+      (request.bodyLen > 0 && !conn->sendAll(request.body, request.bodyLen)) ||
+      !conn->readLine(&line)) {
+    release(conn, false);
+    *retry = reused;
+    return -EIO;
+  }
+  int status = 0;
+  if (sscanf(line.c_str(), "HTTP/%*d.%*d %d", &status) != 1) {
+    release(conn, false);
+    return -EIO;
+  }
+
+  bool chunked = false;
+  bool close = false;
+  bool haveLength = false;
+  uint64_t length = 0;
+  for (;;) {
+    if (!conn->readLine(&line)) {
+      release(conn, false);
+      return -EIO;
+    }
+    if (line.empty()) {
+      break;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = lower(line.substr(0, colon));
+    size_t start = line.find_first_not_of(" \t", colon + 1);
+    std::string value = start == std::string::npos ? "" : line.substr(start);
+    if (name == "content-length") {
+      haveLength = true;
+      length = strtoull(value.c_str(), nullptr, 10);
+    } else if (name == "transfer-encoding") {
+      chunked = lower(value).find("chunked") != std::string::npos;
+    } else if (name == "connection") {
+      close = lower(value) == "close";
+    }
+  }
+
+  bool complete = true;
+  if (strcmp(request.method, "HEAD") == 0 || status == 204 ||
+      status == 304) {
+    // no body
+  } else if (chunked) {
+    for (;;) {
+      if (!conn->readLine(&line)) {
+        complete = false;
+        break;
+      }
+      uint64_t size = strtoull(line.c_str(), nullptr, 16);
+      if (size == 0) {
+        // trailers, up to the empty line
+        while (conn->readLine(&line) && !line.empty()) {
+        }
+        break;
+      }
+      if (!conn->readBody(request, status, size) || !conn->readLine(&line)) {
+        complete = false;
+        break;
+      }
+    }
+  } else if (haveLength) {
+    complete = conn->readBody(request, status, length);
+  } else {
+    conn->readToEnd(request, status);
+    close = true;
+  }
+  release(conn, complete && !close);
+  return complete ? status : -EIO;
+}
+
+int ObjectStore::perform(Request &request) {
+  sign(request);
+  int status = -EIO;
+  for (int attempt = 0; attempt < Retries; ++attempt) {
+    if (attempt > 0) {
+      usleep((RetryMs << (attempt - 1)) * 1000);
+    }
+    request.reset();
+    bool retry;
+    status = performOnce(request, &retry);
+    if (retry) {
+      // at once, on a new connection
+      request.reset();
+      status = performOnce(request, &retry);
+    }
+    if (status >= 0 && status < 500 && status != 429) {
+      break;
+    }
+  }
+  if (status < 0 || (status / 100 != 2 && status != 404 && status != 416)) {
+    RLOG(WARNING) << "object store " << request.method << " " << request.path
+                  << ": "
+                  << (status < 0 ? strerror(-status)
+                                 : ("HTTP " + std::to_string(status)).c_str())
+                  << " " << request.errorText;
+  }
+  return status;
+}
+
+// -errno of an HTTP status other than the one wanted
+static int statusError(int status) {
+  if (status < 0) {
+    return status;
+  }
+  switch (status) {
+    case 403:
+      return -EACCES;
+    case 404:
+      return -ENOENT;
+    case 507:
+      return -ENOSPC;
+    default:
+      return -EIO;
+  }
+}
+
+uint64_t ObjectStore::newId() const {
+  unsigned char buf[8];
+  uint64_t id = 0;
+  // the odds of picking an id in use are those of a collision of 64
+  // random bits, which is not checked for
+  while (id == 0) {
+    if (!_cipher->randomize(buf, sizeof(buf), false)) {
+      RLOG(WARNING) << "unable to pick an id for an object file";
+      return 0;
+    }
+    id = get64(buf);
+  }
+  return id;
+}
+
+void ObjectStore::placeholder(uint64_t id, off_t size,
+                              unsigned char *out) const {
+  memcpy(out, PlaceholderMagic, sizeof(PlaceholderMagic));
+  put64(out + 8, id);
+  put64(out + 16, (uint64_t)size);
+  uint64_t chain = PlaceholderSeed;
+  put64(out + 24, _cipher->MAC_64(out, 24, _key, &chain));
+}
+
+bool ObjectStore::parsePlaceholder(const unsigned char *in, uint64_t *id,
+                                   off_t *size) const {
+  if (memcmp(in, PlaceholderMagic, sizeof(PlaceholderMagic)) != 0) {
+    return false;
+  }
+  uint64_t chain = PlaceholderSeed;
+  if (_cipher->MAC_64(in, 24, _key, &chain) != get64(in + 24)) {
+    return false;
+  }
+  *id = get64(in + 8);
+  *size = (off_t)get64(in + 16);
+  return *id != 0 && *size >= 0;
+}
+
+bool ObjectStore::readPlaceholder(int dirFd, const char *name, uint64_t *id,
+                                  off_t *size) const {
+  int fd = ::openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  unsigned char buf[PlaceholderSize];
+  ssize_t n = ::pread(fd, buf, sizeof(buf), 0);
+  ::close(fd);
+  return n == PlaceholderSize && parsePlaceholder(buf, id, size);
+}
+
+void ObjectStore::objectAttr(int dirFd, const char *name,
+                             struct stat *stbuf) const {
+  uint64_t id;
+  off_t size;
+  if (!S_ISREG(stbuf->st_mode) || stbuf->st_size != PlaceholderSize ||
+      !readPlaceholder(dirFd, name, &id, &size)) {
+    return;
+  }
+  stbuf->st_size = size;
+  stbuf->st_blocks = (size + 511) / 512;
+}
+
+uint64_t ObjectStore::lastLinkData(const char *path,
+                                   const struct stat &stbuf,
+                                   off_t *size) const {
+  uint64_t id;
+  if (!S_ISREG(stbuf.st_mode) || stbuf.st_nlink > 1 ||
+      stbuf.st_size != PlaceholderSize ||
+      !readPlaceholder(AT_FDCWD, path, &id, size)) {
+    return 0;
+  }
+  return id;
+}
+
+// bytes of the chunk at start that a file of size bytes has
+static size_t storedLen(off_t size, off_t start) {
+  if (size <= start) {
+    return 0;
+  }
+  return (size_t)std::min<off_t>(size - start, ObjectStore::ChunkBytes);
+}
+
+// copies len bytes to the iovcnt buffers of iov, from pos bytes into them
+static void scatter(const struct iovec *iov, int iovcnt, size_t pos,
+                    const unsigned char *src, size_t len) {
+  for (int i = 0; i < iovcnt && len > 0; ++i) {
+    if (pos >= iov[i].iov_len) {
+      pos -= iov[i].iov_len;
+      continue;
+    }
+    size_t n = std::min(len, iov[i].iov_len - pos);
+    memcpy((unsigned char *)iov[i].iov_base + pos, src, n);
+    src += n;
+    len -= n;
+    pos = 0;
+  }
+}
+
+int ObjectStore::fetch(uint64_t id, uint64_t chunk, size_t from, size_t to,
+                       unsigned char *buf) {
+  Request request("GET", objectKey(id, chunk));
+  request.range =
+      "bytes=" + std::to_string(from) + "-" + std::to_string(to - 1);
+  request.rangeStart = from;
+  request.out = buf;
+  request.outLen = to - from;
+  int status = perform(request);
+  if (status == 404 || status == 416) {
+    // never written, or written no further than from
+    memset(buf, 0, to - from);
+    return 0;
+  }
+  if (status != 200 && status != 206) {
+    return statusError(status);
+  }
+  // an object that ends before to
+  memset(buf + request.got, 0, to - from - request.got);
+  return 0;
+}
+
+void ObjectStore::allocate(Chunk *ch, size_t stored) {
+  if (!ch->data.empty()) {
+    return;
+  }
+  ch->data.assign(ChunkBytes, 0);
+  ch->len = stored;
+  // the pages past what is stored are the zeros they hold
+  size_t storedPages = (stored + PageBytes - 1) / PageBytes * PageBytes;
+  ch->present = pageMask(storedPages, ChunkBytes);
+  Lock lock(_mutex);
+  _residentBytes += ChunkBytes;
+}
+
+int ObjectStore::fillPages(uint64_t id, uint64_t chunk, Chunk *ch,
+                           size_t from, size_t to) {
+  uint32_t missing = pageMask(from, to) & ~ch->present;
+  if (missing == 0) {
+    return 0;
+  }
+  int first = __builtin_ctz(missing);
+  int last = 31 - __builtin_clz(missing);
+  size_t begin = first * PageBytes;
+  size_t end = std::min((last + 1) * PageBytes, ChunkBytes);
+  size_t stored = std::max(begin, std::min(end, ch->len));
+
+  // one GET for the lot, into place unless it spans pages held already
+  bool contiguous = missing == pageMask(begin, end);
+  std::vector<unsigned char> scratch;
+  unsigned char *buf = ch->data.data() + begin;
+  if (!contiguous) {
+    scratch.resize(end - begin);
+    buf = scratch.data();
+  }
+  if (stored > begin) {
+    int res = fetch(id, chunk, begin, stored, buf);
+    if (res < 0) {
+      return res;
+    }
+  }
+  memset(buf + (stored - begin), 0, end - stored);
+  if (!contiguous) {
+    for (int p = first; p <= last; ++p) {
+      if ((missing & (1u << p)) != 0) {
+        memcpy(ch->data.data() + p * PageBytes,
+               scratch.data() + (p - first) * PageBytes, PageBytes);
+      }
+    }
+  }
+  ch->present |= missing;
+  return 0;
+}
+
+std::shared_ptr<ObjectStore::Chunk> ObjectStore::chunk(uint64_t id,
+                                                       uint64_t number,
+                                                       bool create) {
+  ChunkKey key(id, number);
+  Lock lock(_mutex);
+  auto it = _chunks.find(key);
+  if (it != _chunks.end()) {
+    _lru.splice(_lru.begin(), _lru, it->second->lru);
+    return it->second;
+  }
+  if (!create) {
+    return std::shared_ptr<Chunk>();
+  }
+  auto ch = std::make_shared<Chunk>();
+  _lru.push_front(key);
+  ch->lru = _lru.begin();
+  _chunks[key] = ch;
+  return ch;
+}
+
+void ObjectStore::trimLocked() {
+  auto it = _lru.end();
+  while (_residentBytes > _cacheBytes && it != _lru.begin()) {
+    --it;
+    auto found = _chunks.find(*it);
+    const std::shared_ptr<Chunk> &ch = found->second;
+    // held by a request, or waiting to be stored
+    if (ch.use_count() > 1 || ch->dirty || ch->putting) {
+      continue;
+    }
+    if (!ch->data.empty()) {
+      _residentBytes -= ChunkBytes;
+    }
+    _chunks.erase(found);
+    it = _lru.erase(it);
+  }
+}
+
+void ObjectStore::dropChunks(uint64_t id, uint64_t from) {
+  Lock lock(_mutex);
+  while (puttingLocked(id, from)) {
+    pthread_cond_wait(&_idle, &_mutex);
+  }
+  auto it = _chunks.lower_bound(ChunkKey(id, from));
+  while (it != _chunks.end() && it->first.first == id) {
+    const std::shared_ptr<Chunk> &ch = it->second;
+    // a put() still queued for it finds nothing to store
+    if (ch->dirty) {
+      ch->dirty = false;
+      _dirtyBytes -= ChunkBytes;
+    }
+    if (!ch->data.empty()) {
+      _residentBytes -= ChunkBytes;
+    }
+    _lru.erase(ch->lru);
+    it = _chunks.erase(it);
+  }
+}
+
+bool ObjectStore::puttingLocked(uint64_t id, uint64_t from) const {
+  auto it = id == 0 ? _chunks.begin() : _chunks.lower_bound(ChunkKey(id, from));
+  for (; it != _chunks.end() && (id == 0 || it->first.first == id); ++it) {
+    if (it->second->putting) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int ObjectStore::put(uint64_t id, uint64_t number,
+                     const std::shared_ptr<Chunk> &ch) {
+  {
+    Lock lock(_mutex);
+    // one PUT of a chunk at a time, so that they land in order
+    while (ch->putting) {
+      pthread_cond_wait(&_idle, &_mutex);
+    }
+    if (!ch->dirty) {
+      return 0;
+    }
+    ch->putting = true;
+  }
+
+  // a chunk is stored whole, the pages it was never read in first
+  std::vector<unsigned char> copy;
+  uint64_t writes = 0;
+  int res;
+  {
+    Lock lock(ch->mutex);
+    res = fillPages(id, number, ch.get(), 0, ch->len);
+    if (res == 0) {
+      copy.assign(ch->data.begin(), ch->data.begin() + ch->len);
+      writes = ch->writes;
+    }
+  }
+  if (res == 0) {
+    Request request("PUT", objectKey(id, number));
+    request.body = copy.data();
+    request.bodyLen = copy.size();
+    int status = perform(request);
+    if (status / 100 != 2) {
+      res = statusError(status);
+    }
+  }
+
+  Lock chunkLock(ch->mutex);
+  Lock lock(_mutex);
+  ch->putting = false;
+  if (res == 0 && ch->writes == writes && ch->dirty) {
+    ch->dirty = false;
+    _dirtyBytes -= ChunkBytes;
+  }
+  pthread_cond_broadcast(&_idle);
+  return res;
+}
+
+void ObjectStore::putLater(uint64_t id, uint64_t number,
+                           const std::shared_ptr<Chunk> &ch) {
+  {
+    Lock lock(_mutex);
+    ++_jobs;
+  }
+  _pool->submit(
+      [this, id, number, ch]() {
+        int res = put(id, number, ch);
+        if (res < 0) {
+          noteError(id, res);
+        }
+        Lock lock(_mutex);
+        --_jobs;
+        pthread_cond_broadcast(&_idle);
+      },
+      ThreadPool::Write);
+}
+
+void ObjectStore::noteError(uint64_t id, int err) {
+  Lock lock(_mutex);
+  _errors.insert(std::make_pair(id, err));
+}
+
+int ObjectStore::putDirty(uint64_t id) {
+  std::vector<std::pair<ChunkKey, std::shared_ptr<Chunk>>> dirty;
+  {
+    Lock lock(_mutex);
+    auto it = id == 0 ? _chunks.begin() : _chunks.lower_bound(ChunkKey(id, 0));
+    for (; it != _chunks.end() && (id == 0 || it->first.first == id); ++it) {
+      if (it->second->dirty) {
+        dirty.push_back(*it);
+      }
+    }
+  }
+  if (dirty.empty()) {
+    return 0;
+  }
+  std::atomic<int> err(0);
+  _pool->forEach(
+      (int)dirty.size(),
+      [&](int i) {
+        int res = put(dirty[i].first.first, dirty[i].first.second,
+                      dirty[i].second);
+        if (res < 0) {
+          err = res;
+          return false;
+        }
+        return true;
+      },
+      ThreadPool::Write);
+  return err;
+}
+
+ssize_t ObjectStore::read(uint64_t id, off_t size, off_t offset,
+                          const struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+  if (offset >= size || total == 0) {
+    return 0;
+  }
+  size_t len = (size_t)std::min<off_t>(total, size - offset);
+  off_t end = offset + (off_t)len;
+  uint64_t first = offset / ChunkBytes;
+  int count = (int)((end - 1) / ChunkBytes - first + 1);
+
+  // the blocks of the request that fall in a chunk come in one GET, the
+  // chunks of the request in parallel
+  std::atomic<int> err(0);
+  auto readChunk = [&](int i) {
+    uint64_t number = first + i;
+    off_t start = (off_t)(number * ChunkBytes);
+    size_t from = (size_t)(std::max(offset, start) - start);
+    size_t to = (size_t)(std::min<off_t>(end, start + ChunkBytes) - start);
+    std::shared_ptr<Chunk> ch = chunk(id, number, true);
+    Lock lock(ch->mutex);
+    allocate(ch.get(), storedLen(size, start));
+    int res = fillPages(id, number, ch.get(), from, to);
+    if (res < 0) {
+      err = res;
+      return false;
+    }
+    scatter(iov, iovcnt, (size_t)(start + from - offset),
+            ch->data.data() + from, to - from);
+    return true;
+  };
+  bool ok = count == 1 ? readChunk(0) : _pool->forEach(count, readChunk);
+  {
+    Lock lock(_mutex);
+    trimLocked();
+  }
+  return ok ? (ssize_t)len : err.load();
+}
+
+ssize_t ObjectStore::write(uint64_t id, off_t size, off_t offset,
+                           const unsigned char *data, size_t len) {
+  off_t end = offset + (off_t)len;
+  for (uint64_t number = offset / ChunkBytes;
+       len > 0 && number <= (uint64_t)((end - 1) / ChunkBytes); ++number) {
+    off_t start = (off_t)(number * ChunkBytes);
+    size_t from = (size_t)(std::max(offset, start) - start);
+    size_t to = (size_t)(std::min<off_t>(end, start + ChunkBytes) - start);
+    std::shared_ptr<Chunk> ch = chunk(id, number, true);
+    {
+      Lock lock(ch->mutex);
+      allocate(ch.get(), storedLen(size, start));
+      // the pages only partly written keep what else they hold
+      int res = 0;
+      if (from % PageBytes != 0) {
+        size_t page = from / PageBytes * PageBytes;
+        res = fillPages(id, number, ch.get(), page, page + PageBytes);
+      }
+      if (res == 0 && to % PageBytes != 0) {
+        size_t page = to / PageBytes * PageBytes;
+        res = fillPages(id, number, ch.get(), page, page + PageBytes);
+      }
+      if (res < 0) {
+        return res;
+      }
+      memcpy(ch->data.data() + from, data + (start + from - offset),
+             to - from);
+      ch->present |= pageMask(from, to);
+      ch->len = std::max(ch->len, to);
+      ++ch->writes;
+      Lock storeLock(_mutex);
+      if (!ch->dirty) {
+        ch->dirty = true;
+        _dirtyBytes += ChunkBytes;
+      }
+    }
+    // written up to its end, which a sequential writer does not come back
+    // to: stored while the writer goes on to the next
+    if (to == ChunkBytes) {
+      putLater(id, number, ch);
+    }
+  }
+
+  bool over;
+  {
+    Lock lock(_mutex);
+    over = _dirtyBytes > std::max<uint64_t>(_cacheBytes / 2, 8 * ChunkBytes);
+    trimLocked();
+  }
+  if (over) {
+    int res = putDirty(0);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return (ssize_t)len;
+}
+
+int ObjectStore::truncate(uint64_t id, off_t oldSize, off_t size) {
+  uint64_t keep = (uint64_t)((size + ChunkBytes - 1) / ChunkBytes);
+  dropChunks(id, keep);
+
+  size_t cut = (size_t)(size % ChunkBytes);
+  if (cut > 0) {
+    uint64_t number = size / ChunkBytes;
+    off_t start = (off_t)(number * ChunkBytes);
+    std::shared_ptr<Chunk> ch = chunk(id, number, true);
+    Lock lock(ch->mutex);
+    allocate(ch.get(), storedLen(oldSize, start));
+    if (cut % PageBytes != 0) {
+      size_t page = cut / PageBytes * PageBytes;
+      int res = fillPages(id, number, ch.get(), page, page + PageBytes);
+      if (res < 0) {
+        return res;
+      }
+    }
+    memset(ch->data.data() + cut, 0, ChunkBytes - cut);
+    ch->present |= pageMask(cut, ChunkBytes);
+    ch->len = cut;
+    ++ch->writes;
+    Lock storeLock(_mutex);
+    if (!ch->dirty) {
+      ch->dirty = true;
+      _dirtyBytes += ChunkBytes;
+    }
+  }
+
+  // the chunks past the new end
+  uint64_t stored = (uint64_t)((oldSize + ChunkBytes - 1) / ChunkBytes);
+  if (keep >= stored) {
+    return 0;
+  }
+  std::atomic<int> err(0);
+  _pool->forEach((int)(stored - keep), [&](int i) {
+    Request request("DELETE", objectKey(id, keep + i));
+    int status = perform(request);
+    if (status / 100 != 2 && status != 404) {
+      err = statusError(status);
+      return false;
+    }
+    return true;
+  });
+  return err;
+}
+
+int ObjectStore::flush(uint64_t id) {
+  int res = putDirty(id);
+  Lock lock(_mutex);
+  while (puttingLocked(id, 0)) {
+    pthread_cond_wait(&_idle, &_mutex);
+  }
+  auto it = _errors.find(id);
+  if (it != _errors.end()) {
+    if (res == 0) {
+      res = it->second;
+    }
+    _errors.erase(it);
+  }
+  return res;
+}
+
+int ObjectStore::sync() {
+  int res = putDirty(0);
+  Lock lock(_mutex);
+  while (puttingLocked(0, 0)) {
+    pthread_cond_wait(&_idle, &_mutex);
+  }
+  if (!_errors.empty()) {
+    if (res == 0) {
+      res = _errors.begin()->second;
+    }
+    _errors.clear();
+  }
+  return res;
+}
+
+void ObjectStore::erase(uint64_t id, off_t size) {
+  dropChunks(id, 0);
+  uint64_t chunks = (uint64_t)((size + ChunkBytes - 1) / ChunkBytes);
+  {
+    Lock lock(_mutex);
+    _errors.erase(id);
+    ++_jobs;
+  }
+  _pool->submit(
+      [this, id, chunks]() {
+        // failures are logged, and leave objects nothing refers to
+        for (uint64_t number = 0; number < chunks; ++number) {
+          Request request("DELETE", objectKey(id, number));
+          perform(request);
+        }
+        Lock lock(_mutex);
+        --_jobs;
+        pthread_cond_broadcast(&_idle);
+      },
+      ThreadPool::Background);
+}
+
+}  // namespace encfs
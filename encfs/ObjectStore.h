@@ -0,0 +1,204 @@
+#ifndef _ObjectStore_incl_
+#define _ObjectStore_incl_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <utility>
+#include <vector>
+
+#include "CipherKey.h"
+
+namespace encfs {
+
+class Cipher;
+class ThreadPool;
+
+/*
+    The data of the backing files of a mount kept in an S3 compatible
+    object store rather than in the backing directory (--object-store, see
+    ObjectFileIO).  Shared by every file of the mount.
+
+    An object file is known by a random 64 bit id.  Its backing file holds
+    the id, the size of the file and a MAC of both, a placeholder of
+    PlaceholderSize bytes, so the name, owner, mode and times of the file,
+    and its size, stay where they are and a rename or link of the backing
+    file takes its data along.  The data is cut into chunks of ChunkBytes,
+    each an object <prefix>/<id>/<chunk>; a chunk that was never written is
+    no object at all and reads as zeros.
+
+    Chunks are read by ranged GETs of the pages of PageBytes a request
+    misses, one GET per chunk however many blocks the request covers, the
+    chunks of a request fetched in parallel, and the pages kept in memory
+    up to cacheBytes.  Writes go to the chunk in memory, fetching the pages
+    they only partly cover, and the chunk is PUT as a whole: in the
+    background once written up to its end, otherwise on flush(), on sync()
+    and when too much is waiting.  Chunks are replaced whole rather than
+    patched, so there is no multipart upload to finish or abort.
+
+    Requests are signed with AWS signature version 4, with the credentials
+    of AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN, in
+    the region of AWS_REGION (us-east-1 if unset); buckets are addressed by
+    path, http://host[:port]/bucket[/prefix], https with the system's CAs.
+ */
+class ObjectStore {
+ public:
+  static const int PlaceholderSize = 32;
+  static const size_t ChunkBytes = 1024 * 1024;
+  static const size_t PageBytes = 128 * 1024;
+
+  ObjectStore(const std::string &url, std::shared_ptr<Cipher> cipher,
+              CipherKey key, uint64_t cacheBytes);
+  // writes out what is waiting
+  ~ObjectStore();
+
+  // parses the url, reads the credentials and checks that the bucket can
+  // be reached.  False if it can not, which leaves the store unusable.
+  bool open();
+
+  // a new id
+  uint64_t newId() const;
+  // the placeholder of id at size, into out[PlaceholderSize]
+  void placeholder(uint64_t id, off_t size, unsigned char *out) const;
+  // the id and size of a placeholder, false if in is not one
+  bool parsePlaceholder(const unsigned char *in, uint64_t *id,
+                        off_t *size) const;
+  // of the placeholder at dirFd / name, false if it is none
+  bool readPlaceholder(int dirFd, const char *name, uint64_t *id,
+                       off_t *size) const;
+
+  // st_size of a closed file, from the attributes of its backing file at
+  // dirFd / name: the size its placeholder records, if it is one
+  void objectAttr(int dirFd, const char *name, struct stat *stbuf) const;
+  // the id of the data that goes with the backing file at path, stat'ed
+  // as stbuf, when it loses its last link, and its size; 0 if there is
+  // none
+  uint64_t lastLinkData(const char *path, const struct stat &stbuf,
+                        off_t *size) const;
+
+  // reads the bytes of id, a file of size bytes, into the iovcnt buffers
+  // of iov from offset on.  Returns the bytes read, short at the end of
+  // the file, or -errno.
+  ssize_t read(uint64_t id, off_t size, off_t offset,
+               const struct iovec *iov, int iovcnt);
+  // writes len bytes at offset of id, a file of size bytes before the
+  // write.  Returns len or -errno.
+  ssize_t write(uint64_t id, off_t size, off_t offset,
+                const unsigned char *data, size_t len);
+  // cuts id, of oldSize bytes, to size, which must be smaller.  0 or
+  // -errno.
+  int truncate(uint64_t id, off_t oldSize, off_t size);
+  // PUTs the chunks of id written to, and waits for those under way.  0,
+  // or the first error since the last flush of id.
+  int flush(uint64_t id);
+  // flushes every id
+  int sync();
+  // drops id, of size bytes, in the background
+  void erase(uint64_t id, off_t size);
+
+  // one request to the store, defined in ObjectStore.cpp
+  struct Request;
+
+ private:
+  struct Endpoint {
+    bool tls;
+    std::string host;
+    std::string port;
+    std::string bucket;
+    std::string prefix;  // with a trailing '/', or empty
+  };
+  // a kept alive connection, defined in ObjectStore.cpp
+  struct Connection;
+
+  // a chunk of an id held in memory.  Its mutex is taken before _mutex.
+  struct Chunk {
+    pthread_mutex_t mutex;
+    std::vector<unsigned char> data;  // ChunkBytes once allocated
+    uint32_t present;   // pages of data that hold the chunk, a bit each
+    size_t len;         // bytes of the chunk the file has
+    bool dirty;         // written to since it was last PUT
+    uint64_t writes;    // generations of data, to tell a write during a PUT
+    bool putting;       // a PUT of it is under way
+    std::list<std::pair<uint64_t, uint64_t>>::iterator lru;
+    Chunk();
+    ~Chunk();
+  };
+  using ChunkKey = std::pair<uint64_t, uint64_t>;  // id, chunk number
+
+  std::string objectKey(uint64_t id, uint64_t chunk) const;
+  // sends request, retrying what may succeed when tried again.  Returns
+  // the HTTP status, or -errno if there was no answer.
+  int perform(Request &request);
+  // one try of request on a kept or a new connection
+  int performOnce(Request &request, bool *retry);
+  Connection *connect(int *err);
+  void release(Connection *conn, bool keep);
+  void sign(Request &request) const;
+
+  // GETs the bytes from..to of chunk of id into buf, zeros where nothing
+  // is stored.  0 or -errno.
+  int fetch(uint64_t id, uint64_t chunk, size_t from, size_t to,
+            unsigned char *buf);
+  // gives ch its data, of which the file has stored bytes.  Caller holds
+  // ch->mutex.
+  void allocate(Chunk *ch, size_t stored);
+  // fills the pages of ch between from and to that it does not hold, in
+  // one GET.  Caller holds ch->mutex.
+  int fillPages(uint64_t id, uint64_t chunk, Chunk *ch, size_t from,
+                size_t to);
+  // the chunk in memory, made if create and it is not there
+  std::shared_ptr<Chunk> chunk(uint64_t id, uint64_t number, bool create);
+  // forgets the chunks of id from number from on, written or not, once
+  // PUTs of them under way are done
+  void dropChunks(uint64_t id, uint64_t from);
+  // true while a chunk of id, from number from on, is being PUT, of any
+  // id if id is 0.  Caller holds _mutex.
+  bool puttingLocked(uint64_t id, uint64_t from) const;
+  // PUTs chunk if it is dirty.  0 or -errno.
+  int put(uint64_t id, uint64_t number, const std::shared_ptr<Chunk> &ch);
+  // queues a put() on the pool, its error kept for the next flush
+  void putLater(uint64_t id, uint64_t number,
+                const std::shared_ptr<Chunk> &ch);
+  // PUTs the dirty chunks of id, of every id if it is 0, in parallel
+  int putDirty(uint64_t id);
+  // drops clean chunks past cacheBytes, least recently used first.
+  // Caller holds _mutex.
+  void trimLocked();
+  void noteError(uint64_t id, int err);
+
+  std::string _url;
+  std::shared_ptr<Cipher> _cipher;
+  CipherKey _key;
+  uint64_t _cacheBytes;
+
+  Endpoint _endpoint;
+  std::string _region;
+  std::string _accessKey;
+  std::string _secretKey;
+  std::string _sessionToken;
+  void *_sslCtx;  // SSL_CTX, null for http
+
+  mutable pthread_mutex_t _mutex;
+  pthread_cond_t _idle;  // _jobs dropped to 0
+  std::map<ChunkKey, std::shared_ptr<Chunk>> _chunks;
+  std::list<ChunkKey> _lru;  // most recently used at the front
+  uint64_t _residentBytes;
+  uint64_t _dirtyBytes;
+  std::map<uint64_t, int> _errors;  // of background PUTs, by id
+  int _jobs;                         // queued on _pool and not done
+  std::vector<Connection *> _idleConns;
+  std::shared_ptr<ThreadPool> _pool;
+
+  ObjectStore(const ObjectStore &);             // not allowed
+  ObjectStore &operator=(const ObjectStore &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,374 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "OpStats.h"
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <pthread.h>
+#include <sstream>
+#include <vector>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+namespace OpStats {
+
+static const char *const Names[NumIds] = {
+    "getattr",         "fgetattr",     "lookup",       "readlink",
+    "opendir",         "readdir",      "releasedir",   "mknod",
+    "mkdir",           "unlink",       "rmdir",        "symlink",
+    "rename",          "link",         "chmod",        "chown",
+    "truncate",        "ftruncate",    "fallocate",    "copy-file-range",
+    "lseek",           "utime",        "utimens",      "open",
+    "create",          "read",         "write",        "statfs",
+    "flush",           "release",      "fsync",        "setxattr",
+    "getxattr",        "listxattr",    "removexattr",  "encode-name",
+    "decode-name",     "encrypt",      "decrypt",      "mac",
+    "backing-read",    "backing-write", "lock-wait"};
+
+const char *name(Id id) {
+  return (id >= 0 && id < NumIds) ? Names[id] : "unknown";
+}
+
+static const char *const IoNames[NumIoCounters] = {
+    "raw-read-calls",       "raw-write-calls",      "raw-other-calls",
+    "raw-read-bytes",       "raw-write-bytes",      "mac-blocks-read",
+    "mac-blocks-written",   "mac-bytes-read",       "mac-bytes-written",
+    "mac-cache-hits",       "mac-partial-writes",   "mac-verified",
+    "mac-failed",           "cipher-blocks-read",   "cipher-blocks-written",
+    "cipher-bytes-read",    "cipher-bytes-written", "cipher-cache-hits",
+    "cipher-partial-writes", "block-encodes",       "block-decodes",
+    "stream-encodes",       "stream-decodes"};
+
+const char *ioName(int counter) {
+  return (counter >= 0 && counter < NumIoCounters) ? IoNames[counter]
+                                                   : "unknown";
+}
+
+uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int bucketOf(uint64_t ns) {
+  if (ns < (uint64_t)SubBuckets) {
+    return (int)ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  int bucket = (e - SubBits + 1) * SubBuckets +
+               (int)((ns >> (e - SubBits)) & (SubBuckets - 1));
+  return bucket < NumBuckets ? bucket : NumBuckets - 1;
+}
+
+uint64_t bucketStart(int bucket) {
+  if (bucket < SubBuckets) {
+    return bucket;
+  }
+  int e = bucket / SubBuckets + SubBits - 1;
+  return (uint64_t)(SubBuckets + bucket % SubBuckets) << (e - SubBits);
+}
+
+uint64_t Summary::percentile(double q) const {
+  if (calls == 0) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)(q * calls);
+  if (target < 1) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < NumBuckets - 1; ++i) {
+    seen += buckets[i];
+    if (seen >= target) {
+      // the top of the bucket, unless no call took that long
+      uint64_t top = bucketStart(i + 1) - 1;
+      return top < maxNs ? top : maxNs;
+    }
+  }
+  return maxNs;
+}
+
+std::atomic<uint64_t> slowThresholdNs(0);
+
+namespace {
+
+// written by the thread that owns it, read by snapshots
+struct Counters {
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> totalNs;
+  std::atomic<uint64_t> maxNs;
+  std::atomic<uint64_t> buckets[NumBuckets];
+};
+
+struct Table {
+  Counters counters[NumIds];
+  std::atomic<uint64_t> io[NumIoCounters];
+};
+
+// only the owner writes, so a load and a store do without the locked
+// read-modify-write
+inline void add(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+inline uint64_t get(const std::atomic<uint64_t> &counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+pthread_mutex_t gTablesMutex = PTHREAD_MUTEX_INITIALIZER;
+// sums of the tables of threads that have exited
+Summary gRetired[NumIds];
+uint64_t gRetiredIo[NumIoCounters];
+
+std::list<Table *> &liveTables() {
+  static std::list<Table *> tables;
+  return tables;
+}
+
+void addTable(Summary *out, const Table &table) {
+  for (int id = 0; id < NumIds; ++id) {
+    const Counters &c = table.counters[id];
+    Summary &s = out[id];
+    s.calls += get(c.calls);
+    s.errors += get(c.errors);
+    s.bytes += get(c.bytes);
+    s.totalNs += get(c.totalNs);
+    uint64_t maxNs = get(c.maxNs);
+    if (maxNs > s.maxNs) {
+      s.maxNs = maxNs;
+    }
+    for (int b = 0; b < NumBuckets; ++b) {
+      s.buckets[b] += get(c.buckets[b]);
+    }
+  }
+}
+
+void addSummary(Summary *out, const Summary *in) {
+  for (int id = 0; id < NumIds; ++id) {
+    out[id].calls += in[id].calls;
+    out[id].errors += in[id].errors;
+    out[id].bytes += in[id].bytes;
+    out[id].totalNs += in[id].totalNs;
+    if (in[id].maxNs > out[id].maxNs) {
+      out[id].maxNs = in[id].maxNs;
+    }
+    for (int b = 0; b < NumBuckets; ++b) {
+      out[id].buckets[b] += in[id].buckets[b];
+    }
+  }
+}
+
+void addIo(uint64_t *out, const Table &table) {
+  for (int i = 0; i < NumIoCounters; ++i) {
+    out[i] += get(table.io[i]);
+  }
+}
+
+// the table of the calling thread, made on its first record and folded
+// into gRetired when the thread exits
+struct TableHolder {
+  Table *table = nullptr;
+
+  ~TableHolder() {
+    if (table == nullptr) {
+      return;
+    }
+    Lock lock(gTablesMutex);
+    addTable(gRetired, *table);
+    addIo(gRetiredIo, *table);
+    liveTables().remove(table);
+    delete table;
+  }
+};
+
+thread_local TableHolder tHolder;
+
+Table *threadTable() {
+  TableHolder &holder = tHolder;
+  if (holder.table == nullptr) {
+    holder.table = new Table();
+    Lock lock(gTablesMutex);
+    liveTables().push_back(holder.table);
+  }
+  return holder.table;
+}
+
+}  // namespace
+
+void record(Id id, uint64_t ns, uint64_t bytes, bool failed) {
+  Counters &c = threadTable()->counters[id];
+  add(c.calls, 1);
+  if (failed) {
+    add(c.errors, 1);
+  }
+  if (bytes != 0) {
+    add(c.bytes, bytes);
+  }
+  add(c.totalNs, ns);
+  if (ns > get(c.maxNs)) {
+    c.maxNs.store(ns, std::memory_order_relaxed);
+  }
+  add(c.buckets[bucketOf(ns)], 1);
+}
+
+void markPhases(PhaseMark *out) {
+  const Table *table = tHolder.table;
+  for (int i = 0; i < NumPhases; ++i) {
+    out->ns[i] =
+        table != nullptr ? get(table->counters[FirstPhase + i].totalNs) : 0;
+  }
+}
+
+// reports logged per second, at most
+static const int SlowReportsPerSecond = 5;
+
+void reportSlow(Id id, uint64_t ns, uint64_t bytes, bool failed,
+                const PhaseMark &start) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static uint64_t second = 0;
+  static int reported = 0;
+  static uint64_t suppressed = 0;
+
+  uint64_t missed;
+  {
+    Lock lock(mutex);
+    uint64_t nowSecond = now() / 1000000000;
+    if (nowSecond != second) {
+      second = nowSecond;
+      reported = 0;
+    }
+    if (reported >= SlowReportsPerSecond) {
+      ++suppressed;
+      return;
+    }
+    ++reported;
+    missed = suppressed;
+    suppressed = 0;
+  }
+
+  PhaseMark end;
+  markPhases(&end);
+
+  std::ostringstream msg;
+  msg << "slow " << name(id) << ": " << ns / 1000.0 << "us";
+  if (failed) {
+    msg << " (failed)";
+  }
+  msg << ", " << bytes << " bytes";
+  for (int i = 0; i < NumPhases; ++i) {
+    uint64_t phaseNs = end.ns[i] - start.ns[i];
+    if (phaseNs != 0) {
+      msg << ", " << name((Id)(FirstPhase + i)) << " " << phaseNs / 1000.0
+          << "us";
+    }
+  }
+  if (missed != 0) {
+    msg << " (" << missed << " more not logged)";
+  }
+  RLOG(WARNING) << msg.str();
+}
+
+void snapshot(Summary *out) {
+  memset(out, 0, sizeof(Summary) * NumIds);
+
+  Lock lock(gTablesMutex);
+  addSummary(out, gRetired);
+  for (const Table *table : liveTables()) {
+    addTable(out, *table);
+  }
+}
+
+void count(int counter, uint64_t n) {
+  add(threadTable()->io[counter], n);
+}
+
+void ioSnapshot(uint64_t *out) {
+  memset(out, 0, sizeof(uint64_t) * NumIoCounters);
+
+  Lock lock(gTablesMutex);
+  for (int i = 0; i < NumIoCounters; ++i) {
+    out[i] = gRetiredIo[i];
+  }
+  for (const Table *table : liveTables()) {
+    addIo(out, *table);
+  }
+}
+
+void logSummary() {
+  std::vector<Summary> summary(NumIds);
+  snapshot(summary.data());
+
+  for (int id = 0; id < NumIds; ++id) {
+    const Summary &s = summary[id];
+    if (s.calls == 0) {
+      continue;
+    }
+    VLOG(1) << "stats: " << name((Id)id) << ": " << s.calls << " calls, "
+            << s.errors << " errors, " << s.bytes << " bytes, mean "
+            << s.totalNs / s.calls << "ns, p50 " << s.percentile(0.5)
+            << "ns, p99 " << s.percentile(0.99) << "ns, p99.9 "
+            << s.percentile(0.999) << "ns, max " << s.maxNs
+            << "ns";
+  }
+
+  uint64_t io[NumIoCounters];
+  ioSnapshot(io);
+  std::ostringstream line;
+  for (int i = 0; i < NumIoCounters; ++i) {
+    if (io[i] != 0) {
+      line << " " << ioName(i) << " " << io[i];
+    }
+  }
+  if (!line.str().empty()) {
+    VLOG(1) << "stats: io:" << line.str();
+  }
+  const Summary &reads = summary[Read];
+  const Summary &writes = summary[Write];
+  if (reads.bytes != 0 || writes.bytes != 0) {
+    VLOG(1) << "stats: amplification: read "
+            << (reads.bytes ? (double)io[RawReadBytes] / reads.bytes : 0)
+            << ", write "
+            << (writes.bytes ? (double)io[RawWriteBytes] / writes.bytes : 0);
+  }
+}
+
+}  // namespace OpStats
+
+StartupTimer::StartupTimer(const char *what)
+    : _what(what), _start(OpStats::now()), _last(_start) {}
+
+StartupTimer::~StartupTimer() {
+  VLOG(1) << "startup: " << _what << " took "
+          << (OpStats::now() - _start) / 1000 << "us";
+}
+
+void StartupTimer::step(const char *name) {
+  uint64_t now = OpStats::now();
+  VLOG(1) << "startup: " << name << " " << (now - _last) / 1000 << "us";
+  _last = now;
+}
+
+}  // namespace encfs
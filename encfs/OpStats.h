@@ -0,0 +1,289 @@
+#ifndef _OpStats_incl_
+#define _OpStats_incl_
+
+#include <atomic>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "OpTrace.h"
+
+namespace encfs {
+
+/*
+    Latency histograms and counters of the filesystem operations, and of
+    the phases they spend their time in: name coding, data coding, MACs,
+    I/O on the backing files and waiting for the lock of a file.
+
+    Each thread records into tables of its own with plain stores, so that
+    nothing on the op path is shared or locked; a snapshot sums the tables
+    of the live threads and of those that have exited.  Latencies fall into
+    log-linear buckets, each range of a power of two split in SubBuckets, so
+    a bucket is within 1/SubBuckets of the values in it.
+ */
+namespace OpStats {
+
+enum Id {
+  // operations
+  Getattr,
+  Fgetattr,
+  Lookup,
+  Readlink,
+  Opendir,
+  Readdir,
+  Releasedir,
+  Mknod,
+  Mkdir,
+  Unlink,
+  Rmdir,
+  Symlink,
+  Rename,
+  Link,
+  Chmod,
+  Chown,
+  Truncate,
+  Ftruncate,
+  Fallocate,
+  CopyFileRange,
+  Lseek,
+  Utime,
+  Utimens,
+  Open,
+  Create,
+  Read,
+  Write,
+  Statfs,
+  Flush,
+  Release,
+  Fsync,
+  Setxattr,
+  Getxattr,
+  Listxattr,
+  Removexattr,
+
+  // phases, timed inside the operations
+  FirstPhase,
+  EncodeName = FirstPhase,
+  DecodeName,
+  Encrypt,
+  Decrypt,
+  Mac,
+  BackingRead,
+  BackingWrite,
+  LockWait,
+
+  NumIds
+};
+
+static const int SubBits = 2;
+static const int SubBuckets = 1 << SubBits;
+// up to 2^41ns, about 37 minutes; longer times go in the last bucket
+static const int NumBuckets = (41 - SubBits + 1) * SubBuckets;
+
+const char *name(Id id);
+
+// nanoseconds on a monotonic clock
+uint64_t now();
+
+// one call of id that took ns and moved bytes, failed if it returned an
+// error
+void record(Id id, uint64_t ns, uint64_t bytes, bool failed);
+
+// the bucket of ns, and the smallest value of a bucket
+int bucketOf(uint64_t ns);
+uint64_t bucketStart(int bucket);
+
+struct Summary {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t totalNs;
+  uint64_t maxNs;
+  uint64_t buckets[NumBuckets];
+
+  // the latency below which a fraction q of the calls fall, to the
+  // precision of the buckets
+  uint64_t percentile(double q) const;
+};
+
+// fills out[NumIds] with the counts so far
+void snapshot(Summary *out);
+
+// logs a line for every id that was called, and the I/O counters
+void logSummary();
+
+/*
+    Counters of the layers of the FileIO stack, kept in the same tables of
+    the threads: the system calls RawFileIO makes on the backing files, and
+    for each BlockFileIO layer the blocks it asks of the layer below, the
+    bytes it serves the layer above, its cache hits and the partial block
+    writes it merges with the block read back.  Backing bytes per byte of
+    the read and write ops is the amplification of a workload.
+ */
+// what a BlockFileIO layer counts, from the first counter of the layer
+enum BlockCounter {
+  BlocksRead,
+  BlocksWritten,
+  BytesRead,
+  BytesWritten,
+  CacheHits,
+  PartialWrites,
+
+  NumBlockCounters
+};
+
+enum IoCounter {
+  RawReadCalls,
+  RawWriteCalls,
+  RawOtherCalls,  // open, stat, seek, truncate, sync, allocate, advise
+  RawReadBytes,
+  RawWriteBytes,
+
+  MacLayer,  // NumBlockCounters of MACFileIO
+  MacVerified = MacLayer + NumBlockCounters,
+  MacFailed,
+
+  CipherLayer,  // NumBlockCounters of CipherFileIO
+  BlockEncodes = CipherLayer + NumBlockCounters,
+  BlockDecodes,
+  StreamEncodes,
+  StreamDecodes,
+
+  NumIoCounters
+};
+
+const char *ioName(int counter);
+
+// adds n to counter of the calling thread
+void count(int counter, uint64_t n = 1);
+
+// fills out[NumIoCounters] with the counts so far
+void ioSnapshot(uint64_t *out);
+
+// operations taking at least this long are logged, with the time the
+// calling thread spent in each phase of them (--slow-op).  0, the default,
+// turns that off.  Phases run on other threads, such as the crypto pool,
+// are not counted.
+extern std::atomic<uint64_t> slowThresholdNs;
+
+static const int NumPhases = NumIds - FirstPhase;
+
+// the time the calling thread has spent in each phase so far
+struct PhaseMark {
+  uint64_t ns[NumPhases];
+};
+void markPhases(PhaseMark *out);
+
+// logs a slow call of id, given the mark taken when it began.  No names
+// are logged.  Limited to a few lines a second, counting the rest.
+void reportSlow(Id id, uint64_t ns, uint64_t bytes, bool failed,
+                const PhaseMark &start);
+
+}  // namespace OpStats
+
+/*
+    Times its scope as a call of id, recorded when it ends.  Operations
+    past the slow threshold are reported along with their phases, and
+    those given a path go into the op trace if one is being recorded.
+ */
+class StatTimer {
+ public:
+  explicit StatTimer(OpStats::Id id)
+      : _id(id),
+        _start(OpStats::now()),
+        _bytes(0),
+        _failed(false),
+        _result(0),
+        _path(nullptr),
+        _path2(nullptr),
+        _offset(0),
+        _size(0),
+        _slowNs(id < OpStats::FirstPhase
+                    ? OpStats::slowThresholdNs.load(std::memory_order_relaxed)
+                    : 0) {
+    if (_slowNs != 0) {
+      OpStats::markPhases(&_phases);
+    }
+  }
+  ~StatTimer() {
+    uint64_t ns = OpStats::now() - _start;
+    OpStats::record(_id, ns, _bytes, _failed);
+    if (_slowNs != 0 && ns >= _slowNs) {
+      OpStats::reportSlow(_id, ns, _bytes, _failed, _phases);
+    }
+    if (_path != nullptr &&
+        OpTrace::enabled.load(std::memory_order_relaxed)) {
+      OpTrace::record((uint16_t)_id, _start, ns, _path, _path2, _offset,
+                      _size, _result);
+    }
+  }
+
+  void addBytes(uint64_t bytes) { _bytes += bytes; }
+
+  // what the op trace records of the call, see OpTrace::Record.  The paths
+  // must outlive the timer.
+  void trace(const char *path, int64_t offset = 0, uint64_t size = 0,
+             const char *path2 = nullptr) {
+    _path = path;
+    _offset = offset;
+    _size = size;
+    _path2 = path2;
+  }
+
+  // passes on the result of an op, noting a failure..
+  int status(int res) {
+    _failed = res < 0;
+    _result = res < 0 ? res : 0;
+    return res;
+  }
+  // ..and, for reads and writes, the bytes moved
+  ssize_t transferred(ssize_t res) {
+    _failed = res < 0;
+    _result = res < 0 ? (int)res : 0;
+    if (res > 0) {
+      _bytes += res;
+    }
+    return res;
+  }
+
+ private:
+  StatTimer(const StatTimer &src);             // not allowed
+  StatTimer &operator=(const StatTimer &src);  // not allowed
+
+  OpStats::Id _id;
+  uint64_t _start;
+  uint64_t _bytes;
+  bool _failed;
+  int _result;
+  // for the op trace, _path null when the call is not traced
+  const char *_path;
+  const char *_path2;
+  int64_t _offset;
+  uint64_t _size;
+  uint64_t _slowNs;  // 0 unless this is an op and slow ops are reported
+  OpStats::PhaseMark _phases;
+};
+
+/*
+    Times the steps of bringing up a mount, logged at -v as they finish:
+    "startup: read config 180us".
+ */
+class StartupTimer {
+ public:
+  explicit StartupTimer(const char *what);
+  ~StartupTimer();
+
+  // logs the time since the last step, or since the start
+  void step(const char *name);
+
+ private:
+  StartupTimer(const StartupTimer &src);             // not allowed
+  StartupTimer &operator=(const StartupTimer &src);  // not allowed
+
+  const char *_what;
+  uint64_t _start;
+  uint64_t _last;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,269 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "OpTrace.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "easylogging++.h"
+
+#include "Mutex.h"
+#include "OpStats.h"
+
+namespace encfs {
+namespace OpTrace {
+
+std::atomic<bool> enabled(false);
+
+namespace {
+
+// records buffered per thread before they are written out
+const size_t BufferRecords = 64;
+
+struct Buffer {
+  pthread_mutex_t mutex;
+  uint32_t thread;
+  std::vector<unsigned char> data;
+
+  Buffer() { pthread_mutex_init(&mutex, nullptr); }
+  ~Buffer() { pthread_mutex_destroy(&mutex); }
+};
+
+// guards the file, the live buffers and the encoder
+pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+int gFd = -1;
+uint64_t gStartNs = 0;
+uint32_t gThreads = 0;
+std::function<std::string(const char *)> gCipherPath;
+
+std::list<Buffer *> &liveBuffers() {
+  static std::list<Buffer *> buffers;
+  return buffers;
+}
+
+void put16(unsigned char *p, uint16_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+bool writeAll(int fd, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    ssize_t res = ::write(fd, data, len);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+    data += res;
+    len -= (size_t)res;
+  }
+  return true;
+}
+
+// writes out the records of buffer, which the caller holds.  Caller holds
+// gMutex.
+void flush(Buffer *buffer) {
+  if (buffer->data.empty()) {
+    return;
+  }
+  if (gFd >= 0 && !writeAll(gFd, buffer->data.data(), buffer->data.size())) {
+    RLOG(WARNING) << "writing the op trace failed: " << strerror(errno)
+                  << ", recording stopped";
+    enabled = false;
+    ::close(gFd);
+    gFd = -1;
+  }
+  buffer->data.clear();
+}
+
+// the buffer of the calling thread, made on its first record and written
+// out when the thread exits
+struct BufferHolder {
+  Buffer *buffer = nullptr;
+
+  ~BufferHolder() {
+    if (buffer == nullptr) {
+      return;
+    }
+    {
+      Lock lock(gMutex);
+      liveBuffers().remove(buffer);
+      Lock bufferLock(buffer->mutex);
+      flush(buffer);
+    }
+    delete buffer;
+  }
+};
+
+thread_local BufferHolder tHolder;
+
+// the hashes of the encoded path of plaintext path and of its directory
+void hashes(const char *path, uint64_t *hash, uint64_t *parent) {
+  *hash = 0;
+  *parent = 0;
+  if (path == nullptr || !gCipherPath) {
+    return;
+  }
+  std::string cipher = gCipherPath(path);
+  if (cipher.empty()) {
+    return;
+  }
+  *hash = hashPath(cipher);
+  std::string::size_type slash = cipher.rfind('/');
+  if (slash == std::string::npos || slash == 0) {
+    *parent = hashPath("/");
+  } else {
+    *parent = hashPath(cipher.substr(0, slash));
+  }
+}
+
+}  // namespace
+
+uint64_t hashPath(const std::string &cipherPath) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : cipherPath) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  // 0 is no path
+  return hash != 0 ? hash : 1;
+}
+
+bool start(const std::string &file,
+           std::function<std::string(const char *)> cipherPath) {
+  int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  if (fd < 0) {
+    RLOG(ERROR) << "can't create the op trace " << file << ": "
+                << strerror(errno);
+    return false;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  unsigned char header[HeaderBytes];
+  memcpy(header, Magic, sizeof(Magic));
+  put32(header + 4, Version);
+  put64(header + 8, (uint64_t)tv.tv_sec * 1000000000 +
+                        (uint64_t)tv.tv_usec * 1000);
+  if (!writeAll(fd, header, sizeof(header))) {
+    RLOG(ERROR) << "can't write the op trace " << file << ": "
+                << strerror(errno);
+    ::close(fd);
+    return false;
+  }
+
+  Lock lock(gMutex);
+  if (gFd >= 0) {
+    ::close(gFd);
+  }
+  gFd = fd;
+  gStartNs = OpStats::now();
+  gCipherPath = std::move(cipherPath);
+  enabled = true;
+  return true;
+}
+
+void stop() {
+  enabled = false;
+  Lock lock(gMutex);
+  for (Buffer *buffer : liveBuffers()) {
+    Lock bufferLock(buffer->mutex);
+    flush(buffer);
+  }
+  if (gFd >= 0) {
+    if (::close(gFd) != 0) {
+      RLOG(WARNING) << "closing the op trace failed: " << strerror(errno);
+    }
+    gFd = -1;
+  }
+}
+
+void record(uint16_t op, uint64_t startNs, uint64_t durationNs,
+            const char *path, const char *path2, int64_t offset,
+            uint64_t size, int result) {
+  BufferHolder &holder = tHolder;
+  if (holder.buffer == nullptr) {
+    holder.buffer = new Buffer();
+    holder.buffer->data.reserve(BufferRecords * RecordBytes);
+    Lock lock(gMutex);
+    holder.buffer->thread = ++gThreads;
+    liveBuffers().push_back(holder.buffer);
+  }
+
+  Record rec;
+  rec.startNs = startNs > gStartNs ? startNs - gStartNs : 0;
+  rec.durationNs = durationNs;
+  hashes(path, &rec.path, &rec.parent);
+  hashes(path2, &rec.path2, &rec.parent2);
+  rec.offset = offset;
+  rec.size = size;
+  rec.thread = holder.buffer->thread;
+  rec.op = op;
+  // errno values fit, whatever else a handler returns is an error
+  rec.result = (int16_t)(result >= 0 ? 0 : result < -32767 ? -EIO : result);
+
+  unsigned char out[RecordBytes];
+  put64(out, rec.startNs);
+  put64(out + 8, rec.durationNs);
+  put64(out + 16, rec.path);
+  put64(out + 24, rec.parent);
+  put64(out + 32, rec.path2);
+  put64(out + 40, rec.parent2);
+  put64(out + 48, (uint64_t)rec.offset);
+  put64(out + 56, rec.size);
+  put32(out + 64, rec.thread);
+  put16(out + 68, rec.op);
+  put16(out + 70, (uint16_t)rec.result);
+
+  Buffer *buffer = holder.buffer;
+  bool full;
+  {
+    Lock bufferLock(buffer->mutex);
+    buffer->data.insert(buffer->data.end(), out, out + sizeof(out));
+    full = buffer->data.size() >= BufferRecords * RecordBytes;
+  }
+  if (full) {
+    Lock lock(gMutex);
+    Lock bufferLock(buffer->mutex);
+    flush(buffer);
+  }
+}
+
+}  // namespace OpTrace
+}  // namespace encfs
@@ -0,0 +1,74 @@
+#ifndef _OpTrace_incl_
+#define _OpTrace_incl_
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <string>
+
+namespace encfs {
+
+/*
+    A capture of every filesystem operation of a mount, to a file, for
+    replaying the workload elsewhere (--record-ops, encfs_bench_replay):
+    performance problems reproduced from what a volume really saw rather
+    than from a synthetic fio profile.
+
+    Each operation is one fixed size binary record.  Names never go into
+    it: a path is kept as a hash of its encoded name, which identifies the
+    backing file without saying anything more than that name does, along
+    with the hash of its parent so that a replay can rebuild the tree.
+
+    Threads fill buffers of their own and write them out when full, so that
+    recording takes no lock per operation.  Records are in order per thread
+    only; a reader sorts them by start time.
+ */
+namespace OpTrace {
+
+// the file starts with Magic and a version, 4 bytes each, then the wall
+// clock time the trace began, in ns, 8 bytes.  Records follow, of
+// RecordBytes each, all fields little endian in the order below.
+static const char Magic[4] = {'E', 'O', 'P', 'T'};
+static const uint32_t Version = 1;
+static const size_t HeaderBytes = 16;
+static const size_t RecordBytes = 72;
+
+struct Record {
+  uint64_t startNs;     // since the trace began
+  uint64_t durationNs;
+  uint64_t path;        // hash of the encoded path, 0 for none
+  uint64_t parent;      // ..of its directory
+  uint64_t path2;       // the other path of a rename, link or copy
+  uint64_t parent2;
+  // read, write, copy, fallocate, lseek: the range; truncate: the new
+  // size in offset; create, mknod, mkdir, chmod: the mode in size;
+  // fsync: 1 in size for a datasync; readdir: the offset it went on from
+  int64_t offset;
+  uint64_t size;
+  uint32_t thread;      // numbered from 1 in the order threads first record
+  uint16_t op;          // an OpStats::Id
+  int16_t result;       // 0 on success, else -errno
+};
+
+// the hash of an encoded path, as recorded.  The root is "/".
+uint64_t hashPath(const std::string &cipherPath);
+
+extern std::atomic<bool> enabled;
+
+// starts recording to file, which is created or truncated.  cipherPath
+// encodes a plaintext path of the volume, the empty string if it can't.
+bool start(const std::string &file,
+           std::function<std::string(const char *)> cipherPath);
+// writes out what the threads have buffered and closes the file
+void stop();
+
+// one operation on path, and path2 for those that take two
+void record(uint16_t op, uint64_t startNs, uint64_t durationNs,
+            const char *path, const char *path2, int64_t offset,
+            uint64_t size, int result);
+
+}  // namespace OpTrace
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,694 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PackStore.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "Cipher.h"
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+const char PackStore::DirName[] = ".encfs6.packs";
+
+static const char IndexName[] = "index";
+static const char PackPrefix[] = "pack.";
+
+// the first bytes of a placeholder
+static const unsigned char PlaceholderMagic[8] = {'E', 'n', 'c', 'F',
+                                                  'S', 'p', 'k', 0};
+// chained into the MACs, so that a placeholder and an index record never
+// have the same MAC
+static const uint64_t PlaceholderSeed = 0x70616b6964ULL;
+static const uint64_t IndexSeed = 0x70616b696478ULL;
+
+// an index of over twice the records it needs, and this many more, is
+// rewritten when opened
+static const uint64_t CompactSlack = 4096;
+
+// ids tried before giving up on packing a file
+static const int NewIdTries = 8;
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get64(const unsigned char *p) {
+  return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+// all of len bytes, 0 or -errno
+static int writeAll(int fd, const unsigned char *data, size_t len,
+                    off_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pwrite(fd, data, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// all of len bytes at offset, 0 or -errno; -EIO if the file ends first
+static int readAll(int fd, unsigned char *data, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pread(fd, data, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      return -EIO;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+struct PackStore::PackFile {
+  int fd;
+  explicit PackFile(int fd_) : fd(fd_) {}
+  ~PackFile() { ::close(fd); }
+};
+
+PackStore::PackStore(const std::string &rootDir,
+                     std::shared_ptr<Cipher> cipher, CipherKey key,
+                     size_t threshold)
+    : _dir(rootDir + DirName + "/"),
+      _cipher(std::move(cipher)),
+      _key(std::move(key)),
+      _threshold(threshold),
+      _pack(0),
+      _packEnd(0),
+      _compacting(false),
+      _indexFd(-1),
+      _records(0),
+      _indexDirty(false) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+PackStore::~PackStore() {
+  if (_indexFd >= 0) {
+    ::close(_indexFd);
+  }
+  pthread_mutex_destroy(&_mutex);
+}
+
+std::string PackStore::packPath(uint32_t pack) const {
+  return _dir + PackPrefix + std::to_string(pack);
+}
+
+int PackStore::openPack(uint32_t pack,
+                        std::shared_ptr<PackFile> *out) const {
+  auto it = _packFiles.find(pack);
+  if (it != _packFiles.end()) {
+    *out = it->second;
+    return 0;
+  }
+  int fd = ::open(packPath(pack).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to open " << packPath(pack) << ": "
+                << strerror(eno);
+    return -eno;
+  }
+  *out = std::make_shared<PackFile>(fd);
+  _packFiles[pack] = *out;
+  return 0;
+}
+
+bool PackStore::open() {
+  std::vector<uint32_t> packs;
+  if (!load(&packs)) {
+    return false;
+  }
+  // packs left sparse by earlier mounts
+  {
+    Lock lock(_mutex);
+    for (uint32_t pack : packs) {
+      if (sparse(pack)) {
+        _sparse.insert(pack);
+      }
+    }
+  }
+  compactSparse();
+  return true;
+}
+
+bool PackStore::load(std::vector<uint32_t> *packs) {
+  Lock lock(_mutex);
+
+  if (::mkdir(_dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to create " << _dir << ": " << strerror(eno);
+    return false;
+  }
+
+  // appends go to the last pack
+  DIR *dir = ::opendir(_dir.c_str());
+  if (dir == nullptr) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to read " << _dir << ": " << strerror(eno);
+    return false;
+  }
+  bool found = false;
+  struct dirent *de;
+  while ((de = ::readdir(dir)) != nullptr) {
+    if (strncmp(de->d_name, PackPrefix, sizeof(PackPrefix) - 1) != 0) {
+      continue;
+    }
+    char *end;
+    unsigned long n = strtoul(de->d_name + sizeof(PackPrefix) - 1, &end, 10);
+    if (*end != '\0') {
+      continue;
+    }
+    packs->push_back((uint32_t)n);
+    if (!found || n > _pack) {
+      _pack = (uint32_t)n;
+      found = true;
+    }
+  }
+  ::closedir(dir);
+  if (found) {
+    struct stat st;
+    if (::stat(packPath(_pack).c_str(), &st) != 0) {
+      int eno = errno;
+      RLOG(ERROR) << "unable to stat " << packPath(_pack) << ": "
+                  << strerror(eno);
+      return false;
+    }
+    _packEnd = st.st_size;
+  }
+
+  std::string indexPath = _dir + IndexName;
+  _indexFd = ::open(indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat st;
+  if (_indexFd < 0 || ::fstat(_indexFd, &st) != 0) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to open " << indexPath << ": " << strerror(eno);
+    return false;
+  }
+
+  uint64_t records = st.st_size / RecordSize;
+  std::vector<unsigned char> buf(RecordSize * 1024);
+  uint64_t n = 0;
+  bool bad = false;
+  while (n < records && !bad) {
+    size_t want = std::min<uint64_t>(records - n, 1024) * RecordSize;
+    ssize_t got = ::pread(_indexFd, buf.data(), want, n * RecordSize);
+    if (got < (ssize_t)want) {
+      RLOG(ERROR) << "unable to read " << indexPath;
+      return false;
+    }
+    for (size_t i = 0; i < want; i += RecordSize, ++n) {
+      int op;
+      uint64_t id;
+      Extent ext;
+      if (!decodeRecord(n, &buf[i], &op, &id, &ext)) {
+        bad = true;
+        break;
+      }
+      if (op == Record_Put) {
+        _extents[id] = ext;
+      } else {
+        _extents.erase(id);
+      }
+    }
+  }
+  if (n * RecordSize != (uint64_t)st.st_size) {
+    // the tail of an append that did not finish
+    RLOG(WARNING) << "dropping the index of " << _dir << " from record " << n;
+    if (::ftruncate(_indexFd, n * RecordSize) != 0) {
+      int eno = errno;
+      RLOG(ERROR) << "unable to truncate " << indexPath << ": "
+                  << strerror(eno);
+      return false;
+    }
+  }
+  _records = n;
+  for (const auto &it : _extents) {
+    _liveBytes[it.second.pack] += it.second.len;
+  }
+  VLOG(1) << "pack index: " << _extents.size() << " files in " << _records
+          << " records";
+
+  if (_records > 2 * _extents.size() + CompactSlack) {
+    int res = compactIndex();
+    if (res < 0) {
+      RLOG(WARNING) << "unable to compact " << indexPath << ": "
+                    << strerror(-res);
+    }
+  }
+  return true;
+}
+
+void PackStore::encodeRecord(uint64_t number, int op, uint64_t id,
+                             const Extent &ext, unsigned char *out) const {
+  memset(out, 0, RecordSize);
+  out[0] = (unsigned char)op;
+  put32(out + 4, ext.pack);
+  put64(out + 8, id);
+  put32(out + 16, ext.offset);
+  put32(out + 20, ext.len);
+  _cipher->streamEncode(out, RecordBody, number, _key);
+  uint64_t chain = number ^ IndexSeed;
+  put64(out + RecordBody, _cipher->MAC_64(out, RecordBody, _key, &chain));
+}
+
+bool PackStore::decodeRecord(uint64_t number, unsigned char *rec, int *op,
+                             uint64_t *id, Extent *ext) const {
+  uint64_t chain = number ^ IndexSeed;
+  if (_cipher->MAC_64(rec, RecordBody, _key, &chain) !=
+      get64(rec + RecordBody)) {
+    return false;
+  }
+  _cipher->streamDecode(rec, RecordBody, number, _key);
+  *op = rec[0];
+  ext->pack = get32(rec + 4);
+  *id = get64(rec + 8);
+  ext->offset = get32(rec + 16);
+  ext->len = get32(rec + 20);
+  return *op == Record_Put || *op == Record_Erase;
+}
+
+int PackStore::appendRecord(int op, uint64_t id, const Extent &ext) {
+  unsigned char rec[RecordSize];
+  encodeRecord(_records, op, id, ext, rec);
+  int res = writeAll(_indexFd, rec, RecordSize, _records * RecordSize);
+  if (res < 0) {
+    RLOG(ERROR) << "unable to write the pack index: " << strerror(-res);
+    return res;
+  }
+  ++_records;
+  _indexDirty = true;
+  return 0;
+}
+
+int PackStore::compactIndex() {
+  std::string path = _dir + IndexName;
+  std::string tmp = path + ".new";
+  int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  std::vector<unsigned char> buf(_extents.size() * RecordSize);
+  uint64_t n = 0;
+  for (const auto &it : _extents) {
+    encodeRecord(n, Record_Put, it.first, it.second, &buf[n * RecordSize]);
+    ++n;
+  }
+  int res = writeAll(fd, buf.data(), buf.size(), 0);
+  if (res == 0 && ::fsync(fd) != 0) {
+    res = -errno;
+  }
+  if (res == 0 && ::rename(tmp.c_str(), path.c_str()) != 0) {
+    res = -errno;
+  }
+  if (res < 0) {
+    ::close(fd);
+    ::unlink(tmp.c_str());
+    return res;
+  }
+
+  VLOG(1) << "compacted the pack index from " << _records << " to " << n
+          << " records";
+  ::close(_indexFd);
+  _indexFd = fd;
+  _records = n;
+  return 0;
+}
+
+uint64_t PackStore::newId() const {
+  for (int i = 0; i < NewIdTries; ++i) {
+    unsigned char buf[8];
+    if (!_cipher->randomize(buf, sizeof(buf), false)) {
+      break;
+    }
+    uint64_t id = get64(buf);
+    Lock lock(_mutex);
+    if (id != 0 && _extents.find(id) == _extents.end()) {
+      return id;
+    }
+  }
+  RLOG(WARNING) << "unable to pick an id for a packed file";
+  return 0;
+}
+
+void PackStore::placeholder(uint64_t id, unsigned char *out) const {
+  memcpy(out, PlaceholderMagic, sizeof(PlaceholderMagic));
+  put64(out + 8, id);
+  uint64_t chain = PlaceholderSeed;
+  put64(out + 16, _cipher->MAC_64(out, 16, _key, &chain));
+}
+
+bool PackStore::parsePlaceholder(const unsigned char *in, uint64_t *id) const {
+  if (memcmp(in, PlaceholderMagic, sizeof(PlaceholderMagic)) != 0) {
+    return false;
+  }
+  uint64_t chain = PlaceholderSeed;
+  if (_cipher->MAC_64(in, 16, _key, &chain) != get64(in + 16)) {
+    return false;
+  }
+  *id = get64(in + 8);
+  return *id != 0;
+}
+
+off_t PackStore::size(uint64_t id) const {
+  Lock lock(_mutex);
+  auto it = _extents.find(id);
+  return it == _extents.end() ? -1 : (off_t)it->second.len;
+}
+
+ssize_t PackStore::read(uint64_t id, off_t offset, unsigned char *buf,
+                        size_t len) const {
+  Extent ext;
+  std::shared_ptr<PackFile> file;
+  {
+    Lock lock(_mutex);
+    auto it = _extents.find(id);
+    if (it == _extents.end()) {
+      return -ENOENT;
+    }
+    ext = it->second;
+    // held, so that a compaction removing the pack meanwhile leaves it open
+    int res = openPack(ext.pack, &file);
+    if (res < 0) {
+      return res;
+    }
+  }
+  if (offset >= (off_t)ext.len) {
+    return 0;
+  }
+
+  size_t want = std::min(len, (size_t)(ext.len - offset));
+  size_t done = 0;
+  while (done < want) {
+    ssize_t n = ::pread(file->fd, buf + done, want - done,
+                        (off_t)ext.offset + offset + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      RLOG(WARNING) << "packed data of " << id << " is cut short in "
+                    << packPath(ext.pack);
+      return -EIO;
+    }
+    done += n;
+  }
+  return done;
+}
+
+int PackStore::put(uint64_t id, const unsigned char *data, size_t len) {
+  int res = store(id, data, len, nullptr);
+  compactSparse();
+  return res;
+}
+
+int PackStore::store(uint64_t id, const unsigned char *data, size_t len,
+                     const Extent *moved) {
+  Extent ext;
+  std::shared_ptr<PackFile> file;
+  {
+    Lock lock(_mutex);
+    if (_packEnd > 0 && _packEnd + (off_t)len > MaxPackBytes) {
+      ++_pack;
+      _packEnd = 0;
+    }
+    int res = openPack(_pack, &file);
+    if (res < 0) {
+      return res;
+    }
+    ext.pack = _pack;
+    ext.offset = (uint32_t)_packEnd;
+    ext.len = (uint32_t)len;
+    _packEnd += len;
+    // not compacted before the record of the data is in
+    ++_writers[ext.pack];
+  }
+
+  // the space is ours, written outside the lock
+  int res = writeAll(file->fd, data, len, ext.offset);
+
+  Lock lock(_mutex);
+  if (--_writers[ext.pack] == 0) {
+    _writers.erase(ext.pack);
+  }
+  if (res < 0) {
+    RLOG(ERROR) << "unable to write " << packPath(ext.pack) << ": "
+                << strerror(-res);
+    return res;
+  }
+  // a sync from now on covers the data
+  _dirtyPacks.insert(ext.pack);
+  auto it = _extents.find(id);
+  if (moved != nullptr &&
+      (it == _extents.end() || it->second.pack != moved->pack ||
+       it->second.offset != moved->offset)) {
+    // stored again or erased while it was copied, the copy is not used
+    return 0;
+  }
+  res = appendRecord(Record_Put, id, ext);
+  if (res < 0) {
+    return res;
+  }
+  if (it != _extents.end()) {
+    release(it->second);
+  }
+  _extents[id] = ext;
+  _liveBytes[ext.pack] += ext.len;
+  return 0;
+}
+
+int PackStore::erase(uint64_t id) {
+  int res = 0;
+  {
+    Lock lock(_mutex);
+    auto it = _extents.find(id);
+    if (it == _extents.end()) {
+      return 0;
+    }
+    Extent none = {0, 0, 0};
+    res = appendRecord(Record_Erase, id, none);
+    if (res == 0) {
+      release(it->second);
+      _extents.erase(it);
+    }
+  }
+  compactSparse();
+  return res;
+}
+
+void PackStore::release(const Extent &ext) {
+  _liveBytes[ext.pack] -= ext.len;
+  if (sparse(ext.pack)) {
+    _sparse.insert(ext.pack);
+  }
+}
+
+bool PackStore::sparse(uint32_t pack) const {
+  if (pack == _pack || _writers.count(pack) != 0) {
+    return false;
+  }
+  auto it = _liveBytes.find(pack);
+  return it == _liveBytes.end() || it->second < CompactLiveBytes;
+}
+
+void PackStore::compactSparse() {
+  for (;;) {
+    uint32_t pack;
+    {
+      Lock lock(_mutex);
+      if (_compacting || _sparse.empty()) {
+        return;
+      }
+      pack = *_sparse.begin();
+      _sparse.erase(_sparse.begin());
+      if (!sparse(pack)) {
+        continue;
+      }
+      _compacting = true;
+    }
+    compactPack(pack);
+    Lock lock(_mutex);
+    _compacting = false;
+  }
+}
+
+void PackStore::compactPack(uint32_t pack) {
+  std::vector<std::pair<uint64_t, Extent>> used;
+  std::shared_ptr<PackFile> file;
+  {
+    Lock lock(_mutex);
+    for (const auto &it : _extents) {
+      if (it.second.pack == pack) {
+        used.push_back(it);
+      }
+    }
+    if (!used.empty() && openPack(pack, &file) < 0) {
+      return;
+    }
+  }
+
+  // nothing is appended to the pack any more, it is read without the lock
+  std::vector<unsigned char> buf;
+  for (const auto &it : used) {
+    buf.resize(it.second.len);
+    int res = readAll(file->fd, buf.data(), buf.size(), it.second.offset);
+    if (res == 0) {
+      res = store(it.first, buf.data(), buf.size(), &it.second);
+    }
+    if (res < 0) {
+      RLOG(WARNING) << "unable to compact " << packPath(pack) << ": "
+                    << strerror(-res);
+      return;
+    }
+  }
+  // the records pointing away from the pack are on disk before it goes
+  if (sync() < 0) {
+    return;
+  }
+
+  Lock lock(_mutex);
+  auto live = _liveBytes.find(pack);
+  if (live != _liveBytes.end() && live->second != 0) {
+    return;
+  }
+  _liveBytes.erase(pack);
+  _sparse.erase(pack);
+  _dirtyPacks.erase(pack);
+  // reads still holding it keep it open
+  _packFiles.erase(pack);
+  if (::unlink(packPath(pack).c_str()) != 0 && errno != ENOENT) {
+    int eno = errno;
+    RLOG(WARNING) << "unable to remove " << packPath(pack) << ": "
+                  << strerror(eno);
+    return;
+  }
+  VLOG(1) << "compacted " << packPath(pack) << ", moving " << used.size()
+          << " files";
+}
+
+bool PackStore::readPlaceholder(int dirFd, const char *name,
+                                uint64_t *id) const {
+  int fd = ::openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  unsigned char buf[PlaceholderSize];
+  ssize_t n = ::pread(fd, buf, sizeof(buf), 0);
+  ::close(fd);
+  return n == PlaceholderSize && parsePlaceholder(buf, id);
+}
+
+void PackStore::packedAttr(int dirFd, const char *name,
+                           struct stat *stbuf) const {
+  uint64_t id;
+  if (!S_ISREG(stbuf->st_mode) || stbuf->st_size != PlaceholderSize ||
+      !readPlaceholder(dirFd, name, &id)) {
+    return;
+  }
+  off_t len = size(id);
+  if (len >= 0) {
+    stbuf->st_size = len;
+    stbuf->st_blocks = (len + 511) / 512;
+  }
+}
+
+uint64_t PackStore::lastLinkData(const char *path,
+                                 const struct stat &stbuf) const {
+  uint64_t id;
+  if (!S_ISREG(stbuf.st_mode) || stbuf.st_nlink > 1 ||
+      stbuf.st_size != PlaceholderSize ||
+      !readPlaceholder(AT_FDCWD, path, &id)) {
+    return 0;
+  }
+  return id;
+}
+
+int PackStore::sync() {
+  std::vector<std::shared_ptr<PackFile>> files;
+  int indexFd = -1;
+  {
+    Lock lock(_mutex);
+    for (uint32_t pack : _dirtyPacks) {
+      auto it = _packFiles.find(pack);
+      if (it != _packFiles.end()) {
+        files.push_back(it->second);
+      }
+    }
+    _dirtyPacks.clear();
+    if (_indexDirty) {
+      indexFd = _indexFd;
+      _indexDirty = false;
+    }
+  }
+
+  std::vector<int> fds;
+  for (const auto &file : files) {
+    fds.push_back(file->fd);
+  }
+  // after the data it points to
+  if (indexFd >= 0) {
+    fds.push_back(indexFd);
+  }
+  for (int fd : fds) {
+    if (::fsync(fd) != 0) {
+      int eno = errno;
+      RLOG(ERROR) << "unable to sync packed data: " << strerror(eno);
+      return -eno;
+    }
+  }
+  return 0;
+}
+
+}  // namespace encfs
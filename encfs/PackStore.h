@@ -0,0 +1,163 @@
+#ifndef _PackStore_incl_
+#define _PackStore_incl_
+
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include "CipherKey.h"
+
+namespace encfs {
+
+class Cipher;
+
+/*
+    The data of small backing files, kept together in a few large pack
+    files rather than in a file each (see PackedFileIO).  Shared by every
+    file of a filesystem.
+
+    A packed file is known by a random 64 bit id.  Its backing file holds
+    the id and a MAC of it, a placeholder of PlaceholderSize bytes, so the
+    name, owner, mode and times of the file stay where they are and a
+    rename, link or copy of the backing file takes its data along.
+
+    Packs are only appended to: storing a file again writes all its data
+    at the end of the current pack, which moves on to a new one past
+    MaxPackBytes.  Where the data of each id is goes in an index, a journal
+    of records encrypted and MACed with the volume key, replayed when the
+    store is opened.
+
+    Once less than CompactLiveBytes of a pack other than the current one
+    is still used, by data neither stored over nor erased, what is left of
+    it is stored again at the end of the current pack and the pack is
+    removed, after the index records pointing away from it are on disk.
+    So the packs hold at most about four times the data in use, plus the
+    current pack.
+ */
+class PackStore {
+ public:
+  static const int PlaceholderSize = 24;
+  static const off_t MaxPackBytes = 64 * 1024 * 1024;
+  // a pack using less than this is compacted
+  static const off_t CompactLiveBytes = MaxPackBytes / 4;
+  // the directory in the root of the backing directory holding the packs
+  static const char DirName[];
+
+  // files up to threshold bytes are packed
+  PackStore(const std::string &rootDir, std::shared_ptr<Cipher> cipher,
+            CipherKey key, size_t threshold);
+  ~PackStore();
+
+  // creates the directory if missing and reads the index.  False if that
+  // failed, which leaves the store unusable.
+  bool open();
+
+  size_t threshold() const { return _threshold; }
+
+  // a new id, unused so far
+  uint64_t newId() const;
+  // the placeholder of id, into out[PlaceholderSize]
+  void placeholder(uint64_t id, unsigned char *out) const;
+  // the id of a placeholder, false if in is not one
+  bool parsePlaceholder(const unsigned char *in, uint64_t *id) const;
+  // the id of the placeholder at dirFd / name, false if it is none
+  bool readPlaceholder(int dirFd, const char *name, uint64_t *id) const;
+
+  // the bytes stored for id, -1 if there is no such id
+  off_t size(uint64_t id) const;
+  // reads up to len bytes of id at offset.  Returns the bytes read, or
+  // -errno.
+  ssize_t read(uint64_t id, off_t offset, unsigned char *buf,
+               size_t len) const;
+  // replaces the data of id with len bytes, 0 or -errno
+  int put(uint64_t id, const unsigned char *data, size_t len);
+  // drops id, 0 or -errno
+  int erase(uint64_t id);
+
+  // st_size of a closed file, from the attributes of its backing file at
+  // dirFd / name: the data packed for it, if it is a placeholder
+  void packedAttr(int dirFd, const char *name, struct stat *stbuf) const;
+  // the id of the data that goes with the backing file at path, stat'ed
+  // as stbuf, when it loses its last link; 0 if there is none
+  uint64_t lastLinkData(const char *path, const struct stat &stbuf) const;
+
+  // flushes what was written to the packs and the index to disk
+  int sync();
+
+ private:
+  struct Extent {
+    uint32_t pack;
+    uint32_t offset;
+    uint32_t len;
+  };
+
+  // index records, each encoded and MACed on its own
+  static const int RecordBody = 24;
+  static const int RecordSize = RecordBody + 8;
+  enum { Record_Put = 1, Record_Erase = 2 };
+
+  // an open pack, closed once neither the store nor a read uses it
+  struct PackFile;
+
+  std::string packPath(uint32_t pack) const;
+  // pack, opened if it was not.  0 or -errno.
+  int openPack(uint32_t pack, std::shared_ptr<PackFile> *out) const;
+
+  // open() but for the compaction, the packs found into packs
+  bool load(std::vector<uint32_t> *packs);
+  // put(), or with moved, the copy of the data of id at moved made by a
+  // compaction, kept only if id is still there
+  int store(uint64_t id, const unsigned char *data, size_t len,
+            const Extent *moved);
+  // the space of ext is no longer used.  Caller holds _mutex.
+  void release(const Extent &ext);
+  // whether pack is to be compacted.  Caller holds _mutex.
+  bool sparse(uint32_t pack) const;
+  // compacts the packs found sparse, unless a compaction already runs
+  void compactSparse();
+  // stores again what is used of pack and removes it
+  void compactPack(uint32_t pack);
+
+  void encodeRecord(uint64_t number, int op, uint64_t id, const Extent &ext,
+                    unsigned char *out) const;
+  bool decodeRecord(uint64_t number, unsigned char *rec, int *op,
+                    uint64_t *id, Extent *ext) const;
+  // appends a record, 0 or -errno
+  int appendRecord(int op, uint64_t id, const Extent &ext);
+  // rewrites the index with one record per id
+  int compactIndex();
+
+  std::string _dir;
+  std::shared_ptr<Cipher> _cipher;
+  CipherKey _key;
+  size_t _threshold;
+
+  mutable pthread_mutex_t _mutex;
+  std::unordered_map<uint64_t, Extent> _extents;
+  mutable std::map<uint32_t, std::shared_ptr<PackFile>> _packFiles;
+  uint32_t _pack;      // written to
+  off_t _packEnd;      // of _pack, space handed out so far
+  std::map<uint32_t, off_t> _liveBytes;  // of each pack, used by _extents
+  std::map<uint32_t, int> _writers;      // puts writing to each pack
+  std::set<uint32_t> _sparse;            // packs to compact
+  bool _compacting;
+  int _indexFd;
+  uint64_t _records;   // in the index
+  // written to since the last sync
+  std::set<uint32_t> _dirtyPacks;
+  bool _indexDirty;
+
+  PackStore(const PackStore &);             // not allowed
+  PackStore &operator=(const PackStore &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,335 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PackedFileIO.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <utility>
+
+#include "Error.h"
+#include "PackStore.h"
+
+namespace encfs {
+
+static Interface PackedFileIO_iface("FileIO/Packed", 1, 0, 0);
+
+PackedFileIO::PackedFileIO(std::shared_ptr<FileIO> _base,
+                           std::shared_ptr<PackStore> _store)
+    : base(std::move(_base)), store(std::move(_store)), knownId(0) {}
+
+PackedFileIO::~PackedFileIO() {}
+
+Interface PackedFileIO::interface() const { return PackedFileIO_iface; }
+
+unsigned int PackedFileIO::blockSize() const { return base->blockSize(); }
+
+void PackedFileIO::setFileName(const char *fileName) {
+  base->setFileName(fileName);
+}
+
+const char *PackedFileIO::getFileName() const { return base->getFileName(); }
+
+bool PackedFileIO::setIV(uint64_t iv) { return base->setIV(iv); }
+
+uint64_t PackedFileIO::packedId(off_t *baseSize) const {
+  off_t size = base->getSize();
+  if (baseSize != nullptr) {
+    *baseSize = size;
+  }
+  if (size != PackStore::PlaceholderSize) {
+    knownId = 0;
+    return 0;
+  }
+
+  uint64_t id = knownId;
+  if (id != 0 && store->size(id) >= 0) {
+    return id;
+  }
+  // by name, the backing file need not be open
+  if (!store->readPlaceholder(AT_FDCWD, getFileName(), &id)) {
+    return 0;
+  }
+  if (store->size(id) < 0) {
+    RLOG(WARNING) << "no packed data for " << getFileName();
+    return 0;
+  }
+  knownId = id;
+  return id;
+}
+
+int PackedFileIO::load(uint64_t id, std::vector<unsigned char> *data) const {
+  off_t len = store->size(id);
+  if (len < 0) {
+    return -EIO;
+  }
+  data->resize(len);
+  ssize_t res = store->read(id, 0, data->data(), len);
+  if (res < 0) {
+    return (int)res;
+  }
+  return res == len ? 0 : -EIO;
+}
+
+int PackedFileIO::pack(uint64_t id, const std::vector<unsigned char> &data) {
+  bool fresh = id == 0;
+  if (fresh) {
+    id = store->newId();
+    if (id == 0) {
+      // a file of its own after all
+      IORequest req;
+      req.offset = 0;
+      req.dataLen = data.size();
+      req.data = const_cast<unsigned char *>(data.data());
+      ssize_t res = base->write(req);
+      return res < 0 ? (int)res : 0;
+    }
+  }
+
+  int res = store->put(id, data.data(), data.size());
+  if (res < 0 || !fresh) {
+    return res;
+  }
+
+  unsigned char placeholder[PackStore::PlaceholderSize];
+  store->placeholder(id, placeholder);
+  IORequest req;
+  req.offset = 0;
+  req.dataLen = sizeof(placeholder);
+  req.data = placeholder;
+  ssize_t written = base->write(req);
+  if (written < 0) {
+    store->erase(id);
+    return (int)written;
+  }
+  knownId = id;
+  return 0;
+}
+
+int PackedFileIO::spill(uint64_t id) {
+  std::vector<unsigned char> data;
+  int res = load(id, &data);
+  if (res < 0) {
+    return res;
+  }
+  size_t len = data.size();
+
+  // over all of the placeholder, cut back to the data if that is shorter
+  if (data.size() < (size_t)PackStore::PlaceholderSize) {
+    data.resize(PackStore::PlaceholderSize, 0);
+  }
+  IORequest req;
+  req.offset = 0;
+  req.dataLen = data.size();
+  req.data = data.data();
+  ssize_t written = base->write(req);
+  if (written < 0) {
+    return (int)written;
+  }
+  if (len < data.size()) {
+    res = base->truncate(len);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  VLOG(1) << "moved " << len << " packed bytes into " << getFileName();
+  knownId = 0;
+  // left in the index if this fails, which only costs its space
+  store->erase(id);
+  return 0;
+}
+
+int PackedFileIO::open(int flags) {
+  if ((flags & O_TRUNC) == 0) {
+    return base->open(flags);
+  }
+  // the packed data is dropped along with the placeholder
+  int res = base->open(flags & ~O_TRUNC);
+  if (res < 0) {
+    return res;
+  }
+  int truncRes = truncate(0);
+  return truncRes < 0 ? truncRes : res;
+}
+
+int PackedFileIO::getAttr(struct stat *stbuf) const {
+  int res = base->getAttr(stbuf);
+  if (res == 0 && S_ISREG(stbuf->st_mode) &&
+      stbuf->st_size == PackStore::PlaceholderSize) {
+    uint64_t id = packedId(nullptr);
+    off_t len = id != 0 ? store->size(id) : -1;
+    if (len >= 0) {
+      stbuf->st_size = len;
+      stbuf->st_blocks = (len + 511) / 512;
+    }
+  }
+  return res;
+}
+
+off_t PackedFileIO::getSize() const {
+  off_t size;
+  uint64_t id = packedId(&size);
+  off_t len = id != 0 ? store->size(id) : -1;
+  return len >= 0 ? len : size;
+}
+
+ssize_t PackedFileIO::read(const IORequest &req) const {
+  uint64_t id = packedId(nullptr);
+  if (id == 0) {
+    return base->read(req);
+  }
+  return store->read(id, req.offset, req.data, req.dataLen);
+}
+
+ssize_t PackedFileIO::readv(const IOVecRequest &req) const {
+  if (packedId(nullptr) == 0) {
+    return base->readv(req);
+  }
+  return FileIO::readv(req);
+}
+
+ssize_t PackedFileIO::write(const IORequest &req) {
+  if (req.dataLen == 0) {
+    return 0;
+  }
+  off_t size;
+  uint64_t id = packedId(&size);
+  if (size < 0) {
+    return size;
+  }
+  off_t end = req.offset + (off_t)req.dataLen;
+  if (id == 0 && (size != 0 || end > (off_t)store->threshold())) {
+    return base->write(req);
+  }
+  if (id != 0 && end > (off_t)store->threshold()) {
+    int res = spill(id);
+    if (res < 0) {
+      return res;
+    }
+    return base->write(req);
+  }
+
+  // the whole file, with the write applied
+  std::vector<unsigned char> data;
+  if (id != 0) {
+    int res = load(id, &data);
+    if (res < 0) {
+      return res;
+    }
+  }
+  if ((off_t)data.size() < end) {
+    data.resize(end, 0);
+  }
+  memcpy(&data[req.offset], req.data, req.dataLen);
+
+  int res = pack(id, data);
+  return res < 0 ? res : (ssize_t)req.dataLen;
+}
+
+ssize_t PackedFileIO::writev(const IOVecRequest &req) {
+  off_t size;
+  uint64_t id = packedId(&size);
+  if (size < 0) {
+    return size;
+  }
+  off_t end = req.offset + (off_t)req.dataLen();
+  if (id == 0 && (size != 0 || end > (off_t)store->threshold())) {
+    return base->writev(req);
+  }
+  // one buffer at a time through write()
+  return FileIO::writev(req);
+}
+
+int PackedFileIO::truncate(off_t size) {
+  off_t baseSize;
+  uint64_t id = packedId(&baseSize);
+  if (baseSize < 0) {
+    return (int)baseSize;
+  }
+  bool small = size > 0 && size <= (off_t)store->threshold();
+  if (id == 0) {
+    if (baseSize == 0 && small) {
+      // an empty file made larger is packed as it would be by a write
+      return pack(0, std::vector<unsigned char>(size, 0));
+    }
+    return base->truncate(size);
+  }
+
+  if (size == 0) {
+    int res = base->truncate(0);
+    if (res == 0) {
+      knownId = 0;
+      store->erase(id);
+    }
+    return res;
+  }
+  if (!small) {
+    int res = spill(id);
+    if (res < 0) {
+      return res;
+    }
+    return base->truncate(size);
+  }
+
+  std::vector<unsigned char> data;
+  int res = load(id, &data);
+  if (res < 0) {
+    return res;
+  }
+  data.resize(size, 0);
+  return pack(id, data);
+}
+
+bool PackedFileIO::isWritable() const { return base->isWritable(); }
+
+bool PackedFileIO::isHole(off_t offset, size_t len) const {
+  return packedId(nullptr) == 0 && base->isHole(offset, len);
+}
+
+off_t PackedFileIO::seekExtent(off_t offset, bool hole) const {
+  if (packedId(nullptr) != 0) {
+    return FileIO::seekExtent(offset, hole);
+  }
+  return base->seekExtent(offset, hole);
+}
+
+int PackedFileIO::allocate(int mode, off_t offset, off_t len) {
+  uint64_t id = packedId(nullptr);
+  if (id != 0) {
+    int res = spill(id);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return base->allocate(mode, offset, len);
+}
+
+void PackedFileIO::invalidateAttr() { base->invalidateAttr(); }
+
+int PackedFileIO::passthroughFd() const {
+  return packedId(nullptr) == 0 ? base->passthroughFd() : -1;
+}
+
+void PackedFileIO::invalidateData(off_t offset, size_t len) {
+  knownId = 0;
+  base->invalidateData(offset, len);
+}
+
+}  // namespace encfs
@@ -0,0 +1,82 @@
+#ifndef _PackedFileIO_incl_
+#define _PackedFileIO_incl_
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "FileIO.h"
+#include "Interface.h"
+
+namespace encfs {
+
+class PackStore;
+
+/*
+    The backing file of a small file, its data kept in a PackStore.  Sits
+    right above the RawFileIO of the backing file, below the cipher.
+
+    An empty backing file that is written to no further than the
+    threshold of the store is packed: its data goes in the store, and the
+    backing file becomes a placeholder naming it.  Every write or truncate
+    of a packed file stores all of it again.  Once it grows past the
+    threshold its data is moved back into the backing file, which it
+    stays in from then on, as do files that were never packed.
+ */
+class PackedFileIO : public FileIO {
+ public:
+  PackedFileIO(std::shared_ptr<FileIO> base, std::shared_ptr<PackStore> store);
+  virtual ~PackedFileIO();
+
+  virtual Interface interface() const;
+  virtual unsigned int blockSize() const;
+
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+  virtual bool setIV(uint64_t iv);
+
+  virtual int open(int flags);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t write(const IORequest &req);
+  virtual ssize_t readv(const IOVecRequest &req) const;
+  virtual ssize_t writev(const IOVecRequest &req);
+
+  virtual int truncate(off_t size);
+  virtual bool isWritable() const;
+
+  virtual bool isHole(off_t offset, size_t len) const;
+  virtual off_t seekExtent(off_t offset, bool hole) const;
+  virtual int allocate(int mode, off_t offset, off_t len);
+  virtual void invalidateAttr();
+  virtual int passthroughFd() const;
+  virtual void invalidateData(off_t offset, size_t len);
+
+ private:
+  PackedFileIO(const PackedFileIO &src);             // not allowed
+  PackedFileIO &operator=(const PackedFileIO &src);  // not allowed
+
+  // the id the file is packed under, 0 if it is not packed.  *baseSize is
+  // set to the size of the backing file, or -errno.
+  uint64_t packedId(off_t *baseSize) const;
+
+  // all the packed data of id
+  int load(uint64_t id, std::vector<unsigned char> *data) const;
+  // stores data as the file, under a new id if id is 0
+  int pack(uint64_t id, const std::vector<unsigned char> &data);
+  // moves the packed data of id into the backing file
+  int spill(uint64_t id);
+
+  std::shared_ptr<FileIO> base;
+  std::shared_ptr<PackStore> store;
+  // of the placeholder last read, 0 if none
+  mutable std::atomic<uint64_t> knownId;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,142 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PathCache.h"
+
+#include <cstring>
+#include <functional>
+#include <iterator>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+PathCache::PathCache(size_t maxEntries)
+    : _maxShardEntries(maxEntries > NumShards ? maxEntries / NumShards : 1),
+      _hits(0),
+      _misses(0) {
+  for (Shard &shard : _shards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+  }
+}
+
+PathCache::~PathCache() {
+  VLOG(1) << "path cache: " << hits() << " hits, " << misses() << " misses";
+  for (Shard &shard : _shards) {
+    pthread_mutex_destroy(&shard.mutex);
+  }
+}
+
+PathCache::Shard &PathCache::shardFor(const std::string &plainPath) {
+  size_t h = std::hash<std::string>()(plainPath);
+  return _shards[(h ^ (h >> 17)) % NumShards];
+}
+
+bool PathCache::get(const std::string &plainPath, std::string *cipherPath,
+                    uint64_t *iv) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  auto it = shard.index.find(plainPath);
+  if (it == shard.index.end()) {
+    ++_misses;
+    return false;
+  }
+
+  ++_hits;
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  *cipherPath = it->second->cipherPath;
+  *iv = it->second->iv;
+  return true;
+}
+
+void PathCache::put(const std::string &plainPath,
+                    const std::string &cipherPath, uint64_t iv) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  auto it = shard.index.find(plainPath);
+  if (it != shard.index.end()) {
+    it->second->cipherPath = cipherPath;
+    it->second->iv = iv;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return;
+  }
+
+  Entry entry;
+  entry.plainPath = plainPath;
+  entry.cipherPath = cipherPath;
+  entry.iv = iv;
+  shard.lru.push_front(entry);
+  shard.index[plainPath] = shard.lru.begin();
+
+  while (shard.lru.size() > _maxShardEntries) {
+    shard.index.erase(shard.lru.back().plainPath);
+    shard.lru.pop_back();
+  }
+}
+
+void PathCache::erase(const char *plainPath) {
+  size_t len = strlen(plainPath);
+  // "/" or "/dir/" cover everything below them as they are
+  bool isPrefix = len > 0 && plainPath[len - 1] == '/';
+
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    auto it = shard.lru.begin();
+    while (it != shard.lru.end()) {
+      const std::string &path = it->plainPath;
+      bool below = path.compare(0, len, plainPath) == 0 &&
+                   (path.size() == len || isPrefix || path[len] == '/');
+      if (below) {
+        shard.index.erase(path);
+        it = shard.lru.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+std::vector<PathCache::Entry> PathCache::hottest() {
+  std::vector<Entry> res;
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    res.insert(res.end(), shard.lru.begin(), shard.lru.end());
+  }
+  return res;
+}
+
+void PathCache::preload(const Entry &entry) {
+  Shard &shard = shardFor(entry.plainPath);
+
+  Lock lock(shard.mutex);
+  if (shard.lru.size() >= _maxShardEntries ||
+      shard.index.find(entry.plainPath) != shard.index.end()) {
+    return;
+  }
+  // behind what this mount looked up already
+  shard.lru.push_back(entry);
+  shard.index[entry.plainPath] = std::prev(shard.lru.end());
+}
+
+uint64_t PathCache::hits() const { return _hits; }
+
+uint64_t PathCache::misses() const { return _misses; }
+
+}  // namespace encfs
@@ -0,0 +1,82 @@
+#ifndef _PathCache_incl_
+#define _PathCache_incl_
+
+#include <atomic>
+#include <list>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace encfs {
+
+/*
+    LRU cache of encoded paths, so that a lookup of a path does not encode
+    every component of it again, and, with chained name IVs, compute the
+    IV chain again.
+
+    An entry maps a plaintext path to its encoding without the root
+    directory, and the IV the chain ends with.  The encoding only depends
+    on the path, so entries never go stale; they are dropped when the name
+    goes away, to keep room for live names and not hold on to plaintext
+    names that no longer exist.
+
+    Entries are spread over shards by the hash of the path, each with its
+    own lock and share of the bound.
+ */
+class PathCache {
+ public:
+  struct Entry {
+    std::string plainPath;
+    std::string cipherPath;
+    uint64_t iv;
+  };
+
+  explicit PathCache(size_t maxEntries);
+  ~PathCache();
+
+  // fills in the encoding of plainPath and its IV, if recorded
+  bool get(const std::string &plainPath, std::string *cipherPath,
+           uint64_t *iv);
+  void put(const std::string &plainPath, const std::string &cipherPath,
+           uint64_t iv);
+
+  // forget plainPath and every path below it
+  void erase(const char *plainPath);
+
+  // the entries, the most recently used of each shard first, for a later
+  // mount to preload()
+  std::vector<Entry> hottest();
+  // records entry, kept by an earlier mount, unless its path is recorded
+  // already or there is no room left for it
+  void preload(const Entry &entry);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  static const int NumShards = 16;
+  using EntryList = std::list<Entry>;
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    EntryList lru;  // most recently used first
+    std::unordered_map<std::string, EntryList::iterator> index;
+  };
+
+  Shard &shardFor(const std::string &plainPath);
+
+  Shard _shards[NumShards];
+  size_t _maxShardEntries;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  PathCache(const PathCache &);             // not allowed
+  PathCache &operator=(const PathCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,231 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PathName.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <pthread.h>
+#include <unordered_map>
+
+#include "Mutex.h"
+
+namespace encfs {
+
+struct PathName::Node {
+  Node *parent;  // null for the first component
+  // handles and child entries.  Drops to zero only under the lock of the
+  // entry's shard, where lookups take their references, so that an entry
+  // is never found while it is being freed.
+  std::atomic<uint32_t> refs;
+  uint32_t len;
+  size_t hash;     // of the parent's hash and the name
+  size_t pathLen;  // of the whole path
+  char name[1];
+};
+
+namespace {
+
+const int NumShards = 16;
+
+struct Shard {
+  pthread_mutex_t mutex;
+  std::unordered_multimap<size_t, PathName::Node *> entries;
+
+  Shard() { pthread_mutex_init(&mutex, nullptr); }
+};
+
+// never destroyed, handles may outlive static destructors
+Shard *gShards = new Shard[NumShards];
+std::atomic<size_t> gEntries(0);
+
+size_t hashOf(const PathName::Node *parent, const char *name, size_t len) {
+  size_t h = parent != nullptr ? parent->hash : 0;
+  // FNV-1a over the name, folded with the parent's hash
+  uint64_t f = 1469598103934665603ULL;
+  for (size_t i = 0; i < len; ++i) {
+    f = (f ^ (unsigned char)name[i]) * 1099511628211ULL;
+  }
+  return h * 31 + (size_t)f;
+}
+
+Shard &shardFor(size_t hash) { return gShards[(hash >> 4) % NumShards]; }
+
+// the component of parent named name, with a reference taken, or null if
+// it is not interned and create is false
+PathName::Node *lookup(PathName::Node *parent, const char *name, size_t len,
+                       bool create) {
+  size_t hash = hashOf(parent, name, len);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex, ENCFS_LOCK_SITE("PathName::lookup"));
+  auto range = shard.entries.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    PathName::Node *n = it->second;
+    if (n->parent == parent && n->len == len &&
+        memcmp(n->name, name, len) == 0) {
+      n->refs.fetch_add(1, std::memory_order_relaxed);
+      return n;
+    }
+  }
+  if (!create) {
+    return nullptr;
+  }
+
+  void *mem = malloc(offsetof(PathName::Node, name) + len + 1);
+  if (mem == nullptr) {
+    throw std::bad_alloc();
+  }
+  PathName::Node *n = new (mem) PathName::Node;
+  n->parent = parent;
+  if (parent != nullptr) {
+    parent->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  n->refs.store(1, std::memory_order_relaxed);
+  n->len = (uint32_t)len;
+  n->hash = hash;
+  n->pathLen = parent != nullptr ? parent->pathLen + 1 + len : len;
+  memcpy(n->name, name, len);
+  n->name[len] = '\0';
+  shard.entries.emplace(hash, n);
+  gEntries.fetch_add(1, std::memory_order_relaxed);
+  return n;
+}
+
+void acquire(PathName::Node *n) {
+  if (n != nullptr) {
+    n->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void release(PathName::Node *n) {
+  while (n != nullptr) {
+    uint32_t refs = n->refs.load(std::memory_order_relaxed);
+    while (refs > 1) {
+      if (n->refs.compare_exchange_weak(refs, refs - 1,
+                                        std::memory_order_acq_rel)) {
+        return;
+      }
+    }
+
+    // maybe the last reference, decide under the shard lock
+    {
+      Shard &shard = shardFor(n->hash);
+      Lock lock(shard.mutex, ENCFS_LOCK_SITE("PathName::release"));
+      if (n->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+      }
+      auto range = shard.entries.equal_range(n->hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == n) {
+          shard.entries.erase(it);
+          break;
+        }
+      }
+    }
+    gEntries.fetch_sub(1, std::memory_order_relaxed);
+
+    // the child's reference to its parent goes with it
+    PathName::Node *parent = n->parent;
+    memset(n->name, 0, n->len);
+    n->~Node();
+    free(n);
+    n = parent;
+  }
+}
+
+// the entries of path, walked one component at a time; the reference on
+// each parent is handed to its child
+PathName::Node *walk(const char *path, bool create) {
+  PathName::Node *node = nullptr;
+  const char *p = path;
+  for (;;) {
+    const char *slash = strchr(p, '/');
+    size_t len = slash != nullptr ? (size_t)(slash - p) : strlen(p);
+    PathName::Node *child = lookup(node, p, len, create);
+    release(node);
+    if (child == nullptr || slash == nullptr) {
+      return child;
+    }
+    node = child;
+    p = slash + 1;
+  }
+}
+
+}  // namespace
+
+PathName::PathName(const char *path) : _node(walk(path, true)) {}
+
+PathName::PathName(const std::string &path)
+    : _node(walk(path.c_str(), true)) {}
+
+PathName::PathName(const PathName &src) : _node(src._node) {
+  acquire(_node);
+}
+
+PathName &PathName::operator=(const PathName &src) {
+  acquire(src._node);
+  release(_node);
+  _node = src._node;
+  return *this;
+}
+
+PathName &PathName::operator=(PathName &&src) {
+  if (this != &src) {
+    release(_node);
+    _node = src._node;
+    src._node = nullptr;
+  }
+  return *this;
+}
+
+PathName::~PathName() { release(_node); }
+
+PathName PathName::find(const char *path) {
+  return PathName(walk(path, false));
+}
+
+std::string PathName::str() const {
+  if (_node == nullptr) {
+    return std::string();
+  }
+  std::string path(_node->pathLen, '\0');
+  size_t pos = _node->pathLen;
+  for (const Node *n = _node; n != nullptr; n = n->parent) {
+    pos -= n->len;
+    memcpy(&path[pos], n->name, n->len);
+    if (n->parent != nullptr) {
+      path[--pos] = '/';
+    }
+  }
+  return path;
+}
+
+size_t PathName::length() const {
+  return _node != nullptr ? _node->pathLen : 0;
+}
+
+size_t PathName::hash() const {
+  return _node != nullptr ? _node->hash : 0;
+}
+
+size_t PathName::entries() {
+  return gEntries.load(std::memory_order_relaxed);
+}
+
+}  // namespace encfs
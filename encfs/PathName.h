@@ -0,0 +1,65 @@
+#ifndef _PathName_incl_
+#define _PathName_incl_
+
+#include <stddef.h>
+#include <string>
+
+namespace encfs {
+
+/*
+    A path interned in a table shared by the whole process: one entry per
+    component, pointing to the entry of its parent, so that the open files
+    under a directory share its entries rather than each holding a copy of
+    the full plaintext and cipher paths.
+
+    A PathName is a counted handle to the entry of the last component.
+    Handles to the same path point to the same entry, so they compare by
+    address.  An entry is freed, its name cleared, with the last handle to
+    it or to a path under it.  The table is sharded by hash, so interning
+    paths of different files rarely waits.
+ */
+class PathName {
+ public:
+  // defined in PathName.cpp
+  struct Node;
+
+  PathName() : _node(nullptr) {}
+  explicit PathName(const char *path);
+  explicit PathName(const std::string &path);
+  PathName(const PathName &src);
+  PathName(PathName &&src) : _node(src._node) { src._node = nullptr; }
+  PathName &operator=(const PathName &src);
+  PathName &operator=(PathName &&src);
+  ~PathName();
+
+  // the handle of path if it is interned, else an empty one.  Never adds
+  // to the table.
+  static PathName find(const char *path);
+
+  // the path, put together from its components
+  std::string str() const;
+  size_t length() const;
+  bool empty() const { return _node == nullptr; }
+  // of the path's content, the same for every handle to it
+  size_t hash() const;
+
+  bool operator==(const PathName &o) const { return _node == o._node; }
+  bool operator!=(const PathName &o) const { return _node != o._node; }
+
+  struct Hash {
+    size_t operator()(const PathName &p) const { return p.hash(); }
+  };
+
+  // components interned by the process
+  static size_t entries();
+
+ private:
+  // takes over a reference to node
+  explicit PathName(Node *node) : _node(node) {}
+
+  Node *_node;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,31 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "Probes.h"
+
+#ifdef ENCFS_USDT
+
+// the semaphores of the probes, raised by the tracers attached to them
+#define ENCFS_DEFINE_PROBE(name)                      \
+  volatile unsigned short ENCFS_PROBE_SEMAPHORE(name) \
+      __attribute__((section(".probes"))) = 0;
+extern "C" {
+ENCFS_PROBE_LIST(ENCFS_DEFINE_PROBE)
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef _Probes_incl_
+#define _Probes_incl_
+
+#include <stdint.h>
+
+#include "OpStats.h"
+
+/*
+    Static tracepoints (USDT) of provider "encfs", for bpftrace, perf and
+    systemtap, e.g.
+
+      bpftrace -e 'usdt:/usr/bin/encfs:encfs:block_read_return
+                   { @ns = hist(arg2); }'
+
+    A probe is a nop until a tracer attaches to it.  Return probes carry
+    the time taken in ns, the clock only being read while a tracer is
+    attached to them: every probe has a semaphore that the tracer raises,
+    tested by ENCFS_PROBE_ENABLED().  Built where <sys/sdt.h> is found
+    (systemtap-sdt-dev), unless ENCFS_NO_USDT is defined.
+
+      block_read_entry(offset, size)     block_read_return(offset, res, ns)
+      block_write_entry(offset, size)    block_write_return(offset, res, ns)
+      cipher_read_block_entry(block, size)
+      cipher_read_block_return(block, res, ns)
+      cipher_write_block_entry(block, size)
+      cipher_write_block_return(block, res, ns)
+      mac_verify(block, ok, ns)
+      raw_pread_entry(fd, offset, size)  raw_pread_return(fd, res, ns)
+      raw_pwrite_entry(fd, offset, size) raw_pwrite_return(fd, res, ns)
+      encode_path_entry(path)            encode_path_return(path, cipher, ns)
+      rename_entry(from, to)             rename_return(from, to, res, ns)
+
+    res is a byte count or -errno, paths are C strings.
+ */
+
+#define ENCFS_PROBE_LIST(X)      \
+  X(block_read_entry)            \
+  X(block_read_return)           \
+  X(block_write_entry)           \
+  X(block_write_return)          \
+  X(cipher_read_block_entry)     \
+  X(cipher_read_block_return)    \
+  X(cipher_write_block_entry)    \
+  X(cipher_write_block_return)   \
+  X(mac_verify)                  \
+  X(raw_pread_entry)             \
+  X(raw_pread_return)            \
+  X(raw_pwrite_entry)            \
+  X(raw_pwrite_return)           \
+  X(encode_path_entry)           \
+  X(encode_path_return)          \
+  X(rename_entry)                \
+  X(rename_return)
+
+#if !defined(ENCFS_NO_USDT) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define ENCFS_USDT 1
+#endif
+#endif
+
+#ifdef ENCFS_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ENCFS_PROBE_SEMAPHORE(name) encfs_##name##_semaphore
+#define ENCFS_DECLARE_PROBE(name) \
+  extern volatile unsigned short ENCFS_PROBE_SEMAPHORE(name);
+extern "C" {
+ENCFS_PROBE_LIST(ENCFS_DECLARE_PROBE)
+}
+
+#define ENCFS_PROBE_ENABLED(name) \
+  __builtin_expect(ENCFS_PROBE_SEMAPHORE(name) != 0, 0)
+#define ENCFS_PROBE1(name, a) DTRACE_PROBE1(encfs, name, a)
+#define ENCFS_PROBE2(name, a, b) DTRACE_PROBE2(encfs, name, a, b)
+#define ENCFS_PROBE3(name, a, b, c) DTRACE_PROBE3(encfs, name, a, b, c)
+#define ENCFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(encfs, name, a, b, c, d)
+
+#else
+
+#define ENCFS_PROBE_ENABLED(name) false
+#define ENCFS_PROBE1(name, a) \
+  do {                        \
+  } while (false)
+#define ENCFS_PROBE2(name, a, b) ENCFS_PROBE1(name, a)
+#define ENCFS_PROBE3(name, a, b, c) ENCFS_PROBE1(name, a)
+#define ENCFS_PROBE4(name, a, b, c, d) ENCFS_PROBE1(name, a)
+
+#endif
+
+namespace encfs {
+
+/*
+    The time since it was made, for the return probe it was made for, or 0
+    if no tracer was attached to that probe then.
+ */
+class ProbeClock {
+ public:
+  explicit ProbeClock(bool enabled) : _start(enabled ? OpStats::now() : 0) {}
+
+  uint64_t elapsed() const {
+    return _start != 0 ? OpStats::now() - _start : 0;
+  }
+
+ private:
+  uint64_t _start;
+};
+
+}  // namespace encfs
+
+#endif
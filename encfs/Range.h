@@ -8,34 +8,27 @@ namespace encfs {
         int increment;
 
         public:
-            Range();
-            Range(int minMax);
-            Range(int min, int max, int increment);
+            // constexpr, so tables of Ranges are initialized at compile time
+            constexpr Range();
+            constexpr Range(int minMax);
+            constexpr Range(int min, int max, int increment);
 
             bool allowed(int value) const;
             int closest(int value) const;
 
-            int min() const;
-            int max() const;
-            int inc() const;
+            constexpr int min() const;
+            constexpr int max() const;
+            constexpr int inc() const;
     };
 
-    inline Range::Range(int minMax) {
-        this->minVal = minMax;
-        this->maxVal = minMax;
-        this->increment = 1;
-    }
+    constexpr Range::Range(int minMax)
+        : minVal(minMax), maxVal(minMax), increment(1) {}
 
-    inline Range::Range(int min_, int max_, int increment_) {
-        this->minVal = min_;
-        this->maxVal = max_;
-        this->increment = increment_;
-        if (increment == 0) {
-            this->increment = 1;
-        }
-    }
+    constexpr Range::Range(int min_, int max_, int increment_)
+        : minVal(min_), maxVal(max_),
+          increment(increment_ == 0 ? 1 : increment_) {}
 
-    inline Range::Range() : minVal(-1), maxVal(-1), increment(1) {}
+    constexpr Range::Range() : minVal(-1), maxVal(-1), increment(1) {}
 
     inline bool Range::allowed(int value) const {
         if (value >= minVal && value <= maxVal) {
@@ -62,9 +55,9 @@ namespace encfs {
         return closest(value + tmp);
     }
 
-    inline int Range::min() const {return minVal;}
-    inline int Range::max() const { return maxVal; }
-    inline int Range::inc() const { return increment; }
+    constexpr int Range::min() const { return minVal; }
+    constexpr int Range::max() const { return maxVal; }
+    constexpr int Range::inc() const { return increment; }
 }
 
 
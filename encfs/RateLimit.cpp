@@ -0,0 +1,60 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RateLimit.h"
+
+#include <time.h>
+
+#include "Mutex.h"
+#include "OpStats.h"
+
+namespace encfs {
+
+RateLimit::RateLimit(uint64_t bytesPerSecond)
+    : _bytesPerSecond(bytesPerSecond), _next(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+RateLimit::~RateLimit() { pthread_mutex_destroy(&_mutex); }
+
+uint64_t RateLimit::reserve(size_t bytes) {
+  if (_bytesPerSecond == 0) {
+    return 0;
+  }
+
+  Lock lock(_mutex);
+  uint64_t now = OpStats::now();
+  if (_next < now) {
+    _next = now;
+  }
+  uint64_t wait = _next - now;
+  _next += (uint64_t)((double)bytes * 1e9 / _bytesPerSecond);
+  return wait;
+}
+
+void RateLimit::take(size_t bytes) {
+  uint64_t wait = reserve(bytes);
+  if (wait > 0) {
+    struct timespec ts;
+    ts.tv_sec = wait / 1000000000;
+    ts.tv_nsec = wait % 1000000000;
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+  }
+}
+
+}  // namespace encfs
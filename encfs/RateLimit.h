@@ -0,0 +1,38 @@
+#ifndef _RateLimit_incl_
+#define _RateLimit_incl_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace encfs {
+
+/*
+    Paces the bytes a set of threads moves to a rate: each take() is given
+    the next slot of time the rate allows and sleeps until it starts, so the
+    rate holds over any stretch longer than one take() without bursts
+    building up while nothing is taken.
+ */
+class RateLimit {
+ public:
+  // bytesPerSecond 0 is no limit
+  explicit RateLimit(uint64_t bytesPerSecond);
+  ~RateLimit();
+
+  void take(size_t bytes);
+  // as take(), but returns the nanoseconds to wait rather than sleeping,
+  // for a caller that must stay wakeable
+  uint64_t reserve(size_t bytes);
+
+ private:
+  RateLimit(const RateLimit &src);             // not allowed
+  RateLimit &operator=(const RateLimit &src);  // not allowed
+
+  uint64_t _bytesPerSecond;
+  pthread_mutex_t _mutex;
+  uint64_t _next;  // OpStats::now() at which the next take() may start
+};
+
+}  // namespace encfs
+
+#endif
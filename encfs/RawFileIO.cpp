@@ -5,14 +5,23 @@
 #include "easylogging++.h"
 #include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <cstring>
+#include <limits>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 
 #include "Error.h"
+#include "FdCache.h"
 #include "FileIO.h"
+#include "MemoryPool.h"
+#include "Mutex.h"
+#include "OpStats.h"
+#include "Probes.h"
 #include "RawFileIO.h"
 
 using namespace std;
@@ -32,15 +41,51 @@ namespace encfs {
   }
 
   RawFileIO::RawFileIO()
-    : knowSize(false), fileSize(0), fd(-1), oldfd(-1), canWrite(false) {}
+    : directIO(false),
+      syncTruncate(false),
+      knownSize(false),
+      fileSize(0),
+      externalWrites(false),
+      cacheAttr(false),
+      attrValid(false),
+      attrGeneration(0),
+      extentStart(0),
+      extentEnd(0),
+      extentIsHole(false),
+      extentGeneration(0),
+      holeGeneration(0),
+      seekHoles(true),
+      fd(-1),
+      oldfd(-1),
+      canWrite(false) {
+    pthread_rwlock_init(&directLock, nullptr);
+    pthread_mutex_init(&holeLock, nullptr);
+    pthread_mutex_init(&attrLock, nullptr);
+  }
 
   RawFileIO::RawFileIO(std::string fileName)
     : name(std::move(fileName)),
+      directIO(false),
+      syncTruncate(false),
       knownSize(false),
       fileSize(0),
+      externalWrites(false),
+      cacheAttr(false),
+      attrValid(false),
+      attrGeneration(0),
+      extentStart(0),
+      extentEnd(0),
+      extentIsHole(false),
+      extentGeneration(0),
+      holeGeneration(0),
+      seekHoles(true),
       fd(-1),
       oldfd(-1),
-      canWrite(false) {}
+      canWrite(false) {
+    pthread_rwlock_init(&directLock, nullptr);
+    pthread_mutex_init(&holeLock, nullptr);
+    pthread_mutex_init(&attrLock, nullptr);
+  }
 
   RawFileIO::~RawFileIO() {
     int _fd = -1;
@@ -54,13 +99,21 @@ namespace encfs {
     }
 
     if (_fd != -1) {
-      close(_fd);
+      if (fdCache && !directIO) {
+        fdCache->put(_fd, canWrite);
+      } else {
+        close(_fd);
+      }
     }
+
+    pthread_mutex_destroy(&attrLock);
+    pthread_mutex_destroy(&holeLock);
+    pthread_rwlock_destroy(&directLock);
   }
 
   Interface RawFileIO::interface() const { return RawFileIO_iface; }
 
-  static int oepn_readonly_workaround(const char* path, int flags) {
+  static int open_readonly_workaround(const char* path, int flags) {
     int fd = -1;
     struct stat stbuf;
     memset(&stbuf, 0, sizeof(struct stat));
@@ -82,19 +135,67 @@ namespace encfs {
       return fd;
     }
 
+    if (fdCache && !directIO) {
+      // one lstat instead of an open, if the file was released lately
+      struct stat stbuf;
+      bool cachedWrite = false;
+      int cachedFd = -1;
+      if (lstat(name.c_str(), &stbuf) == 0 && S_ISREG(stbuf.st_mode)) {
+        cachedFd = fdCache->take(stbuf, requestWrite, &cachedWrite);
+      }
+      if (cachedFd >= 0) {
+        VLOG(1) << "using cached file descriptor " << cachedFd;
+        if (oldfd >= 0) {
+          RLOG(DEBUG) << "leaking FD?: oldfd = " << oldfd << ", fd = " << fd
+                      << ", newfd = " << cachedFd;
+        }
+        canWrite = cachedWrite;
+        oldfd = fd;
+        fd = cachedFd;
+        invalidateAttr();
+        return fd;
+      }
+    }
+
     int finalFlags = requestWrite ? O_RDWR : O_RDONLY;
+#if defined(O_CLOEXEC)
+    // not for the password program or anything else we start
+    finalFlags |= O_CLOEXEC;
+#endif
 #if defined(O_LARGEFILE)
     if ((flags & O_LARGEFILE) != 0) {
       finalFlags |= O_LARGEFILE;
     }
 #endif
 
+#if defined(O_DIRECT)
+    if (directIO) {
+      finalFlags |= O_DIRECT;
+    }
+#endif
+
     int eno = 0;
+    OpStats::count(OpStats::RawOtherCalls);
     int newFd = ::open(name.c_str(), finalFlags);
     if (newFd < 0) {
       eno = errno;
     }
 
+#if defined(O_DIRECT)
+    if ((newFd == -1) && (eno == EINVAL) && ((finalFlags & O_DIRECT) != 0)) {
+      // the backing filesystem does not do direct I/O
+      RLOG(WARNING) << "O_DIRECT not supported for " << name
+                    << ", using cached I/O";
+      directIO = false;
+      finalFlags &= ~O_DIRECT;
+      eno = 0;
+      newFd = ::open(name.c_str(), finalFlags);
+      if (newFd < 0) {
+        eno = errno;
+      }
+    }
+#endif
+
     VLOG(1) << "open file with flags " << finalFlags << ", result = " << newFd;
 
     if ((newFd == -1) && (eno == EACCES)) {
@@ -108,105 +209,635 @@ namespace encfs {
       return -eno;
     }
 
-    if (oldfs >= 0) {
-      RLOG(DEBUG) << "leaking FD?: oldfs = " << oldfd << ", fd = " << fd;
+    if (oldfd >= 0) {
+      RLOG(DEBUG) << "leaking FD?: oldfd = " << oldfd << ", fd = " << fd
                   << ", newfd = " << newFd;
     }
     canWrite = requestWrite;
     oldfd = fd;
     fd = newFd;
+    // the readonly workaround changes the mode, and ctime with it
+    invalidateAttr();
     return fd;
   }
 
+  int RawFileIO::create(int dirFd, const char* fileName, mode_t mode,
+                         int flags) {
+    int finalFlags = O_CREAT | O_EXCL | O_RDWR;
+#if defined(O_CLOEXEC)
+    finalFlags |= O_CLOEXEC;
+#endif
+#if defined(O_LARGEFILE)
+    if ((flags & O_LARGEFILE) != 0) {
+      finalFlags |= O_LARGEFILE;
+    }
+#endif
+#if defined(O_DIRECT)
+    if (directIO) {
+      finalFlags |= O_DIRECT;
+    }
+#endif
+
+    int eno = 0;
+    OpStats::count(OpStats::RawOtherCalls);
+    int newFd = ::openat(dirFd, fileName, finalFlags, mode);
+    if (newFd < 0) {
+      eno = errno;
+    }
+
+#if defined(O_DIRECT)
+    if ((newFd == -1) && (eno == EINVAL) && ((finalFlags & O_DIRECT) != 0)) {
+      // refused once the file was made, so the retry opens what we made
+      RLOG(WARNING) << "O_DIRECT not supported for " << name
+                    << ", using cached I/O";
+      directIO = false;
+      finalFlags &= ~(O_DIRECT | O_EXCL);
+      eno = 0;
+      newFd = ::openat(dirFd, fileName, finalFlags, mode);
+      if (newFd < 0) {
+        eno = errno;
+      }
+    }
+#endif
+
+    VLOG(1) << "create file with flags " << finalFlags << ", result = "
+            << newFd;
+    if (newFd < 0) {
+      VLOG(1) << "create error: " << strerror(eno);
+      return -eno;
+    }
+
+    if (fd >= 0) {
+      RLOG(DEBUG) << "leaking FD?: oldfd = " << oldfd << ", fd = " << fd
+                  << ", newfd = " << newFd;
+    }
+    canWrite = true;
+    oldfd = fd;
+    fd = newFd;
+    knownSize = true;
+    fileSize = 0;
+    invalidateAttr();
+    invalidateHoles();
+    return 0;
+  }
+
+  int RawFileIO::statFile(struct stat* stbuf) const {
+    OpStats::count(OpStats::RawOtherCalls);
+    int res = (fd >= 0) ? fstat(fd, stbuf) : lstat(name.c_str(), stbuf);
+    return (res < 0) ? -errno : 0;
+  }
+
   int RawFileIO::getAttr(struct stat* stbuf) const {
-    int res = lstat(name.c_str(), stbuf);
-    int eno = errno;
+    uint64_t generation;
+    {
+      Lock lock(attrLock);
+      if (attrValid) {
+        *stbuf = attr;
+        return 0;
+      }
+      generation = attrGeneration;
+    }
 
+    int res = statFile(stbuf);
     if (res < 0) {
-      RLOG(DEBUG) << "getAttr errno on " << name << ": " << strerror(eno);
+      RLOG(DEBUG) << "getAttr errno on " << name << ": " << strerror(-res);
+      return res;
     }
 
-    return (res < 0) ? -eno : 0;
+    if (cacheAttr && fd >= 0) {
+      Lock lock(attrLock);
+      // unless the file changed while we were looking
+      if (generation == attrGeneration) {
+        attr = *stbuf;
+        attrValid = true;
+      }
+    }
+    return 0;
   }
 
-  void RawFileIO::setFileName(const char* fileName) { name = fileName; }
+  void RawFileIO::setFileName(const char* fileName) {
+    name = fileName;
+    // renamed, ctime changes
+    invalidateAttr();
+  }
 
   const char* RawFileIO::getFileName() const { return name.c_str(); }
 
   off_t RawFileIO::getSize() const {
-    if (!knowSize) {
+    if (!knownSize || externalWrites) {
       struct stat stbuf;
       memset(&stbuf, 0, sizeof(struct stat));
-      int res = lstat(name.c_str(), &stbuf);
+      int res = statFile(&stbuf);
 
       if (res == 0) {
         const_cast<RawFileIO*>(this)->fileSize = stbuf.st_size;
         const_cast<RawFileIO*>(this)->knownSize = true;
         return fileSize;
       }
-      int eno = errno;
-      RLOG(ERROR) << "getSize on " << name << " failed " << strerror(eno);
-      return -eno;
+      RLOG(ERROR) << "getSize on " << name << " failed " << strerror(-res);
+      return res;
     }
     return fileSize;
   }
 
+  void RawFileIO::setFdCache(std::shared_ptr<FdCache> cache) {
+    fdCache = std::move(cache);
+  }
+
+  void RawFileIO::setCacheAttr(bool enable) {
+    cacheAttr = enable;
+    invalidateAttr();
+  }
+
+  void RawFileIO::setExternalWrites() {
+    externalWrites = true;
+    setCacheAttr(false);
+  }
+
+  void RawFileIO::invalidateAttr() {
+    Lock lock(attrLock);
+    attrValid = false;
+    ++attrGeneration;
+  }
+
+  int RawFileIO::passthroughFd() const { return directIO ? -1 : fd; }
+
+  void RawFileIO::invalidateData(off_t offset, size_t len) {
+    (void) offset;
+    (void) len;
+    invalidateHoles();
+    invalidateAttr();
+    knownSize = false;
+  }
+
+  void RawFileIO::advise(off_t offset, off_t len, Advice advice) const {
+    if (fd < 0 || directIO) {
+      return;
+    }
+    OpStats::count(OpStats::RawOtherCalls);
+#if defined(__linux__)
+    if (advice == Advice::WillNeed && len > 0) {
+      // starts reading at once, where the advice may be taken later
+      if (::readahead(fd, offset, (size_t)len) == 0) {
+        return;
+      }
+    }
+#endif
+#if defined(POSIX_FADV_NORMAL)
+    int flag = POSIX_FADV_NORMAL;
+    switch (advice) {
+      case Advice::Normal:
+        break;
+      case Advice::Sequential:
+        flag = POSIX_FADV_SEQUENTIAL;
+        break;
+      case Advice::Random:
+        flag = POSIX_FADV_RANDOM;
+        break;
+      case Advice::WillNeed:
+        flag = POSIX_FADV_WILLNEED;
+        break;
+      case Advice::DontNeed:
+        flag = POSIX_FADV_DONTNEED;
+        break;
+    }
+    // returns the error rather than setting errno
+    int res = ::posix_fadvise(fd, offset, len, flag);
+    if (res != 0) {
+      VLOG(2) << "posix_fadvise failed: " << strerror(res);
+    }
+#else
+    (void)offset;
+    (void)len;
+    (void)advice;
+#endif
+  }
+
+  void RawFileIO::setSyncTruncate(bool enable) { syncTruncate = enable; }
+
+  void RawFileIO::setDirectIO(bool enable) {
+#if defined(O_DIRECT)
+    directIO = enable;
+#else
+    (void)enable;
+#endif
+  }
+
+  /**
+   * The system calls behind all reads and writes, one buffer goes through
+   * pread / pwrite. Returns the number of bytes transferred or -errno
+   */
+  ssize_t RawFileIO::sysReadv(const struct iovec* iov, int iovcnt,
+                              off_t offset) const {
+    ssize_t res = (iovcnt == 1)
+                      ? ::pread(fd, iov[0].iov_base, iov[0].iov_len, offset)
+                      : ::preadv(fd, iov, iovcnt, offset);
+    if (res < 0) {
+      return -errno;
+    }
+    OpStats::count(OpStats::RawReadCalls);
+    OpStats::count(OpStats::RawReadBytes, (uint64_t)res);
+    return res;
+  }
+
+  ssize_t RawFileIO::sysWritev(const struct iovec* iov, int iovcnt,
+                               off_t offset) const {
+    ssize_t res = (iovcnt == 1)
+                      ? ::pwrite(fd, iov[0].iov_base, iov[0].iov_len, offset)
+                      : ::pwritev(fd, iov, iovcnt, offset);
+    if (res < 0) {
+      return -errno;
+    }
+    OpStats::count(OpStats::RawWriteCalls);
+    OpStats::count(OpStats::RawWriteBytes, (uint64_t)res);
+    return res;
+  }
+
+  static bool isAligned(const struct iovec* iov, int iovcnt, off_t offset) {
+    const uintptr_t mask = MemoryPool::Alignment - 1;
+    if (((uintptr_t)offset & mask) != 0) {
+      return false;
+    }
+    for (int i = 0; i < iovcnt; ++i) {
+      if ((((uintptr_t)iov[i].iov_base | iov[i].iov_len) & mask) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static size_t totalLength(const struct iovec* iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      len += iov[i].iov_len;
+    }
+    return len;
+  }
+
+  ssize_t RawFileIO::ioReadv(const struct iovec* iov, int iovcnt,
+                             off_t offset) const {
+    StatTimer timer(OpStats::BackingRead);
+    ENCFS_PROBE3(raw_pread_entry, fd, offset, totalLength(iov, iovcnt));
+    ProbeClock clock(ENCFS_PROBE_ENABLED(raw_pread_return));
+    ssize_t res;
+    if (!directIO) {
+      res = sysReadv(iov, iovcnt, offset);
+    } else {
+      pthread_rwlock_rdlock(&directLock);
+      res = isAligned(iov, iovcnt, offset)
+                ? sysReadv(iov, iovcnt, offset)
+                : directReadv(iov, iovcnt, offset);
+      pthread_rwlock_unlock(&directLock);
+    }
+    ENCFS_PROBE3(raw_pread_return, fd, res, clock.elapsed());
+    return timer.transferred(res);
+  }
+
+  ssize_t RawFileIO::ioWritev(const struct iovec* iov, int iovcnt,
+                              off_t offset) {
+    StatTimer timer(OpStats::BackingWrite);
+    ENCFS_PROBE3(raw_pwrite_entry, fd, offset, totalLength(iov, iovcnt));
+    ProbeClock clock(ENCFS_PROBE_ENABLED(raw_pwrite_return));
+    ssize_t res;
+    if (!directIO) {
+      res = sysWritev(iov, iovcnt, offset);
+    } else {
+      pthread_rwlock_wrlock(&directLock);
+      res = isAligned(iov, iovcnt, offset)
+                ? sysWritev(iov, iovcnt, offset)
+                : directWritev(iov, iovcnt, offset);
+      pthread_rwlock_unlock(&directLock);
+    }
+    ENCFS_PROBE3(raw_pwrite_return, fd, res, clock.elapsed());
+    // after the write, so that no extent or attributes looked up while it
+    // was in flight stay cached
+    invalidateHoles();
+    invalidateAttr();
+    return timer.transferred(res);
+  }
+
+  /**
+   * Unaligned direct read: read the enclosing aligned range into a pool
+   * block and copy the requested part out.
+   */
+  ssize_t RawFileIO::directReadv(const struct iovec* iov, int iovcnt,
+                                 off_t offset) const {
+    const off_t align = MemoryPool::Alignment;
+    size_t len = totalLength(iov, iovcnt);
+    off_t start = offset - offset % align;
+    off_t end = offset + (off_t)len;
+    end = (end + align - 1) / align * align;
+    if (end - start > INT_MAX) {
+      return -EINVAL;
+    }
+
+    PoolBlock mb((int)(end - start));
+    struct iovec bounce;
+    bounce.iov_base = mb.data();
+    bounce.iov_len = end - start;
+    ssize_t res = sysReadv(&bounce, 1, start);
+
+    if (res >= 0) {
+      size_t skip = offset - start;
+      size_t avail = (size_t)res > skip ? (size_t)res - skip : 0;
+      size_t copied = 0;
+      for (int i = 0; i < iovcnt && copied < avail; ++i) {
+        size_t n = iov[i].iov_len;
+        if (n > avail - copied) {
+          n = avail - copied;
+        }
+        memcpy(iov[i].iov_base, mb.data() + skip + copied, n);
+        copied += n;
+      }
+      res = copied;
+    }
+
+    return res;
+  }
+
+  /**
+   * Unaligned direct write: read the enclosing aligned range, lay the new
+   * data over it and write the whole range back.  When the range runs past
+   * the end of the file, the padding is cut off again afterwards.
+   */
+  ssize_t RawFileIO::directWritev(const struct iovec* iov, int iovcnt,
+                                  off_t offset) {
+    const off_t align = MemoryPool::Alignment;
+    size_t len = totalLength(iov, iovcnt);
+    off_t start = offset - offset % align;
+    off_t end = offset + (off_t)len;
+    end = (end + align - 1) / align * align;
+    if (end - start > INT_MAX) {
+      return -EINVAL;
+    }
+
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) != 0) {
+      return -errno;
+    }
+
+    PoolBlock mb((int)(end - start));
+    struct iovec bounce;
+    bounce.iov_base = mb.data();
+    bounce.iov_len = end - start;
+
+    ssize_t res = 0;
+    if ((offset != start || (offset + (off_t)len) != end) &&
+        start < stbuf.st_size) {
+      res = sysReadv(&bounce, 1, start);
+    }
+    if (res >= 0) {
+      memset(mb.data() + res, 0, (end - start) - res);
+
+      size_t pos = offset - start;
+      for (int i = 0; i < iovcnt; ++i) {
+        memcpy(mb.data() + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+      }
+
+      size_t done = 0;
+      while (done < (size_t)(end - start)) {
+        bounce.iov_base = mb.data() + done;
+        bounce.iov_len = (end - start) - done;
+        res = sysWritev(&bounce, 1, start + done);
+        if (res <= 0) {
+          res = (res == 0) ? -EIO : res;
+          break;
+        }
+        done += res;
+      }
+    }
+
+    off_t newSize = offset + (off_t)len;
+    if (newSize < stbuf.st_size) {
+      newSize = stbuf.st_size;
+    }
+    if (res > 0 && end > newSize && ::ftruncate(fd, newSize) != 0) {
+      res = -errno;
+    }
+
+    return res < 0 ? res : (ssize_t)len;
+  }
+
+  // every write and truncate, the extents seen by isHole() may have changed
+  void RawFileIO::invalidateHoles() {
+    Lock lock(holeLock);
+    ++holeGeneration;
+  }
+
+  bool RawFileIO::isHole(off_t offset, size_t len) const {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if (fd < 0 || len == 0) {
+      return false;
+    }
+    off_t end = offset + (off_t)len;
+
+    uint64_t generation;
+    {
+      Lock lock(holeLock);
+      if (!seekHoles) {
+        return false;
+      }
+      generation = holeGeneration;
+      if (extentGeneration == generation && offset >= extentStart &&
+          offset < extentEnd) {
+        return extentIsHole && end <= extentEnd;
+      }
+    }
+
+    // lseek moves the file position, which nothing here uses
+    off_t start = offset;
+    off_t stop;
+    bool hole;
+    OpStats::count(OpStats::RawOtherCalls);
+    off_t data = ::lseek(fd, offset, SEEK_DATA);
+    if (data < 0) {
+      if (errno != ENXIO) {
+        VLOG(1) << "SEEK_DATA not usable on " << name << ": "
+                << strerror(errno);
+        Lock lock(holeLock);
+        seekHoles = false;
+        return false;
+      }
+      // no data from offset on, up to and past the end of file
+      hole = true;
+      stop = std::numeric_limits<off_t>::max();
+    } else if (data > offset) {
+      hole = true;
+      stop = data;
+    } else {
+      hole = false;
+      OpStats::count(OpStats::RawOtherCalls);
+      stop = ::lseek(fd, offset, SEEK_HOLE);
+      if (stop <= offset) {
+        return false;
+      }
+    }
+
+    Lock lock(holeLock);
+    if (holeGeneration == generation) {
+      extentStart = start;
+      extentEnd = stop;
+      extentIsHole = hole;
+      extentGeneration = generation;
+    }
+    return hole && end <= stop;
+#else
+    (void)offset;
+    (void)len;
+    return false;
+#endif
+  }
+
+  off_t RawFileIO::seekExtent(off_t offset, bool hole) const {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    bool usable;
+    {
+      Lock lock(holeLock);
+      usable = seekHoles;
+    }
+    if (fd >= 0 && usable && offset >= 0) {
+      OpStats::count(OpStats::RawOtherCalls);
+      off_t res = ::lseek(fd, offset, hole ? SEEK_HOLE : SEEK_DATA);
+      if (res >= 0 || errno == ENXIO) {
+        return res >= 0 ? res : -ENXIO;
+      }
+      VLOG(1) << "SEEK_DATA not usable on " << name << ": "
+              << strerror(errno);
+      Lock lock(holeLock);
+      seekHoles = false;
+    }
+#endif
+    return FileIO::seekExtent(offset, hole);
+  }
+
   ssize_t RawFileIO::read(const IORequest& req) const {
     rAssert(fd >= 0);
 
-    ssize_t readSize = pread(fd, req.data, req.dataLen, req.offset);
+    struct iovec iov;
+    iov.iov_base = req.data;
+    iov.iov_len = req.dataLen;
+    ssize_t readSize = ioReadv(&iov, 1, req.offset);
 
     if (readSize < 0) {
-      int eno = errno;
       RLOG(WARNING) << "read failed at offset " << req.offset << " for "
-                    << req.dataLen << " bytes: " << strerror(eno);
-      return -eno;
+                    << req.dataLen << " bytes: " << strerror(-readSize);
     }
 
     return readSize;
   }
 
   ssize_t RawFileIO::write(const IORequest& req) {
-    rAssert(fd >= 0) ;
+    struct iovec iov;
+    iov.iov_base = req.data;
+    iov.iov_len = req.dataLen;
+
+    IOVecRequest vecReq;
+    vecReq.offset = req.offset;
+    vecReq.iov = &iov;
+    vecReq.iovcnt = 1;
+    return writev(vecReq);
+  }
+
+  // preadv / pwritev take at most IOV_MAX buffers per call
+#if defined(IOV_MAX)
+  static const int MaxIOVecs = IOV_MAX;
+#else
+  static const int MaxIOVecs = 1024;
+#endif
+
+  ssize_t RawFileIO::readv(const IOVecRequest& req) const {
+    rAssert(fd >= 0);
+
+    ssize_t result = 0;
+    off_t offset = req.offset;
+    for (int i = 0; i < req.iovcnt; i += MaxIOVecs) {
+      int count = req.iovcnt - i;
+      if (count > MaxIOVecs) {
+        count = MaxIOVecs;
+      }
+      size_t wanted = 0;
+      for (int j = i; j < i + count; ++j) {
+        wanted += req.iov[j].iov_len;
+      }
+
+      ssize_t readSize = ioReadv(req.iov + i, count, offset);
+      if (readSize < 0) {
+        RLOG(WARNING) << "readv failed at offset " << offset << " for "
+                      << wanted << " bytes: " << strerror(-readSize);
+        return readSize;
+      }
+
+      result += readSize;
+      if ((size_t)readSize < wanted) {
+        break;
+      }
+      offset += readSize;
+    }
+    return result;
+  }
+
+  ssize_t RawFileIO::writev(const IOVecRequest& req) {
+    rAssert(fd >= 0);
     rAssert(canWrite);
 
-    void* buf = req.data;
-    ssize_t bytes = req.dataLen;
+    // writes may be short, so work on a copy of the vector that can be
+    // advanced past what has been written
+    std::vector<struct iovec> iov(req.iov, req.iov + req.iovcnt);
+    size_t first = 0;
     off_t offset = req.offset;
 
-    while (bytes != 0) {
-      ssize_t writeSize = ::pwrite(fd, buf, bytes, offset);
+    while (first < iov.size()) {
+      if (iov[first].iov_len == 0) {
+        ++first;
+        continue;
+      }
+      int count = (int)(iov.size() - first);
+      if (count > MaxIOVecs) {
+        count = MaxIOVecs;
+      }
 
+      ssize_t writeSize = ioWritev(&iov[first], count, offset);
       if (writeSize < 0) {
-        int eno = errno;
         knownSize = false;
-        RLOG(WARNING) << "write failed at offset " << offset << " for " << bytes
-                      << " bytes: " << strerror(eno);
-        return -eno;
+        RLOG(WARNING) << "write failed at offset " << offset << ": "
+                      << strerror(-writeSize);
+        return writeSize;
       }
       if (writeSize == 0) {
         return -EIO;
       }
-      bytes -= writeSize;
       offset += writeSize;
-      buf = (void*)( (char*)buf + writeSize );
-    }
-    if (knownSize) {
-      off_t last = req.offset + req.dataLen;
-      if (last > fileSize) {
-        fileSize = last;
+
+      while (writeSize > 0) {
+        size_t step = (size_t)writeSize < iov[first].iov_len
+                          ? (size_t)writeSize
+                          : iov[first].iov_len;
+        iov[first].iov_base = (char*)iov[first].iov_base + step;
+        iov[first].iov_len -= step;
+        writeSize -= step;
+        if (iov[first].iov_len == 0) {
+          ++first;
+        }
       }
     }
-    return req.dataLen;
+
+    if (knownSize && offset > fileSize) {
+      fileSize = offset;
+    }
+    return offset - req.offset;
   }
 
   int RawFileIO::truncate(off_t size) {
+    OpStats::count(OpStats::RawOtherCalls);
     int res;
     if (fd >= 0 && canWrite) {
       res = ::ftruncate(fd, size);
     } else {
       res = ::truncate(name.c_str(), size);
     }
+    invalidateHoles();
+    invalidateAttr();
 
     if (res < 0) {
       int eno = errno;
@@ -219,7 +850,10 @@ namespace encfs {
       fileSize = size;
       knownSize = true;
     }
-    if (fd >= 0 && canWrite) {
+    // otherwise the new size is made durable by the next fsync, like any
+    // other change to the file
+    if (syncTruncate && res == 0 && fd >= 0 && canWrite) {
+      OpStats::count(OpStats::RawOtherCalls);
 #if defined(HAVE_FDATASYNC)
       ::fdatasync(fd);
 #else
@@ -229,7 +863,33 @@ namespace encfs {
     return res;
   }
 
-  bool RawFileIO::isWriteable() const { return canWrite; }
+  int RawFileIO::allocate(int mode, off_t offset, off_t len) {
+    if (fd < 0 || !canWrite) {
+      return -EBADF;
+    }
+    OpStats::count(OpStats::RawOtherCalls);
+#if defined(__linux__)
+    int res = ::fallocate(fd, mode, offset, len);
+    int eno = (res < 0) ? errno : 0;
+#else
+    // only plain allocation can be had portably
+    if (mode != 0) {
+      return -EOPNOTSUPP;
+    }
+    int eno = posix_fallocate(fd, offset, len);
+#endif
+    invalidateHoles();
+    invalidateAttr();
+    knownSize = false;
+
+    if (eno != 0) {
+      VLOG(1) << "fallocate failed for " << name << ": " << strerror(eno);
+      return -eno;
+    }
+    return 0;
+  }
+
+  bool RawFileIO::isWritable() const { return canWrite; }
 
 
 
@@ -1,13 +1,19 @@
 #ifndef _RawFileIO_incl_
 #define _RawFileIO_incl_
 
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
 #include <string>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "FileIO.h"
 #include "Interface.h"
 
 namespace encfs {
+    class FdCache;
+
     class RawFileIO : public FileIO {
         public:
             RawFileIO();
@@ -15,27 +21,130 @@ namespace encfs {
 
             virtual ~RawFileIO();
 
-            virtual Interface inface() const;
+            virtual Interface interface() const;
+            virtual void setFileName(const char* fileName);
             virtual const char* getFileName() const;
 
             virtual int open(int flags);
+            // create the file as name in the directory dirFd, which must
+            // not exist yet, and keep the descriptor of the creating
+            // open(), read-write, for the open() that follows.  Returns
+            // 0 or -errno.
+            int create(int dirFd, const char* fileName, mode_t mode,
+                       int flags);
+            virtual int getAttr(struct stat* stbuf) const;
             virtual off_t getSize() const;
 
             virtual ssize_t read(const IORequest& req) const;
             virtual ssize_t write(const IORequest& req);
 
+            virtual ssize_t readv(const IOVecRequest& req) const;
+            virtual ssize_t writev(const IOVecRequest& req);
+
             virtual int truncate(off_t size);
             virtual bool isWritable() const;
 
+            // open the file with O_DIRECT, bypassing the page cache of the
+            // backing filesystem.  Requests that are not aligned go through
+            // aligned bounce buffers.  Takes effect on the next open().
+            void setDirectIO(bool enable);
+
+            // sync the file after every truncate, rather than leaving that
+            // to the caller's fsync
+            void setSyncTruncate(bool enable);
+
+            // take descriptors from cache on open and hand them back when
+            // done, rather than opening and closing the file.  Not used
+            // for direct I/O.
+            void setFdCache(std::shared_ptr<FdCache> cache);
+
+            // answered with SEEK_DATA / SEEK_HOLE, remembering the extent
+            // around the last offset asked about
+            virtual bool isHole(off_t offset, size_t len) const;
+            virtual off_t seekExtent(off_t offset, bool hole) const;
+
+            virtual int allocate(int mode, off_t offset, off_t len);
+
+            // keep what getAttr() returns for the open file until it is
+            // changed through us or invalidateAttr() is called.  Only for
+            // files that nothing else changes.
+            void setCacheAttr(bool enable);
+
+            // the open file is also written where we do not see it (FUSE
+            // passthrough): its size and attributes are looked up every
+            // time from then on
+            void setExternalWrites();
+            virtual void invalidateAttr();
+
+            // the open descriptor, unless it was opened for direct I/O,
+            // which splice would have to align
+            virtual int passthroughFd() const;
+            virtual void invalidateData(off_t offset, size_t len);
+
+            // posix_fadvise(2) on the open descriptor, readahead(2) for
+            // what will be needed where there is one.  Nothing for direct
+            // I/O, which bypasses the page cache.
+            virtual void advise(off_t offset, off_t len, Advice advice) const;
+
         protected:
+            // issue one read / write of the buffers at offset on fd,
+            // returns bytes transferred or -errno
+            virtual ssize_t sysReadv(const struct iovec* iov, int iovcnt,
+                                     off_t offset) const;
+            virtual ssize_t sysWritev(const struct iovec* iov, int iovcnt,
+                                      off_t offset) const;
+
             std::string name;
 
+            bool directIO;
+            bool syncTruncate;
+            // direct writes that are not aligned read and rewrite the
+            // surrounding aligned range, readers must not see it half done
+            mutable pthread_rwlock_t directLock;
+
             bool knownSize;
             off_t fileSize;
+            bool externalWrites;  // see setExternalWrites()
+
+            // fstat of the open file, valid while attrGeneration is
+            // unchanged
+            bool cacheAttr;
+            mutable pthread_mutex_t attrLock;
+            mutable struct stat attr;
+            mutable bool attrValid;
+            uint64_t attrGeneration;
+
+            // last extent found by isHole(), valid while holeGeneration is
+            // unchanged.  Writes and truncates bump the generation.
+            mutable pthread_mutex_t holeLock;
+            mutable off_t extentStart;
+            mutable off_t extentEnd;
+            mutable bool extentIsHole;
+            mutable uint64_t extentGeneration;
+            uint64_t holeGeneration;
+            mutable bool seekHoles;  // cleared if lseek does not support it
 
             int fd;
             int oldfd;
             bool canWrite;
+            std::shared_ptr<FdCache> fdCache;
+
+        private:
+            void invalidateHoles();
+            // fstat the open file, lstat the name if it is not open
+            int statFile(struct stat* stbuf) const;
+
+            ssize_t ioReadv(const struct iovec* iov, int iovcnt,
+                            off_t offset) const;
+            ssize_t ioWritev(const struct iovec* iov, int iovcnt,
+                             off_t offset);
+            ssize_t directReadv(const struct iovec* iov, int iovcnt,
+                                off_t offset) const;
+            ssize_t directWritev(const struct iovec* iov, int iovcnt,
+                                 off_t offset);
+
+            RawFileIO(const RawFileIO&);             // not allowed
+            RawFileIO& operator=(const RawFileIO&);  // not allowed
     };
 }
 
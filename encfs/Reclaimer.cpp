@@ -0,0 +1,211 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Reclaimer.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+const char Reclaimer::DirName[] = ".encfs6.trash";
+
+Reclaimer::Reclaimer(const std::string &rootDir, off_t minBytes)
+    : _dir(rootDir + DirName),
+      _minBytes(minBytes),
+      _dirFd(-1),
+      _next(0),
+      _running(false),
+      _stopping(false) {
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(&_wake, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+Reclaimer::~Reclaimer() {
+  if (_running) {
+    {
+      Lock lock(_mutex);
+      _stopping = true;
+      pthread_cond_signal(&_wake);
+    }
+    pthread_join(_thread, nullptr);
+  }
+  if (!_queue.empty()) {
+    VLOG(1) << _queue.size() << " files left in " << _dir
+            << " for the next mount";
+  }
+  if (_dirFd >= 0) {
+    ::close(_dirFd);
+  }
+  pthread_cond_destroy(&_wake);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool Reclaimer::open() {
+  if (::mkdir(_dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    RLOG(ERROR) << "unable to create " << _dir << ": " << strerror(errno);
+    return false;
+  }
+  _dirFd = ::open(_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (_dirFd < 0) {
+    RLOG(ERROR) << "unable to open " << _dir << ": " << strerror(errno);
+    return false;
+  }
+
+  // left by an earlier mount
+  DIR *dir = ::fdopendir(::dup(_dirFd));
+  if (dir != nullptr) {
+    while (struct dirent *de = ::readdir(dir)) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+        continue;
+      }
+      _queue.push_back(de->d_name);
+      char *end = nullptr;
+      uint64_t n = strtoull(de->d_name, &end, 10);
+      if (*end == '\0' && n >= _next) {
+        _next = n + 1;
+      }
+    }
+    ::closedir(dir);
+  }
+  if (!_queue.empty()) {
+    VLOG(1) << "reclaiming " << _queue.size() << " files left in " << _dir;
+  }
+
+  int res = pthread_create(&_thread, nullptr, run, this);
+  if (res != 0) {
+    RLOG(ERROR) << "error starting reclaim thread: " << strerror(res);
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+int Reclaimer::defer(int dirFd, const char *name, const struct stat &st) {
+  // a file with other links frees nothing
+  if (!S_ISREG(st.st_mode) || st.st_nlink != 1 || st.st_size < _minBytes) {
+    return -EAGAIN;
+  }
+  std::string entry;
+  {
+    Lock lock(_mutex);
+    entry = std::to_string(_next++);
+  }
+  if (::renameat(dirFd, name, _dirFd, entry.c_str()) != 0) {
+    int eno = errno;
+    // another filesystem mounted below the root, say
+    VLOG(1) << "unable to move " << name << " to the trash: "
+            << strerror(eno);
+    return eno == EXDEV ? -EAGAIN : -eno;
+  }
+  Lock lock(_mutex);
+  _queue.push_back(entry);
+  pthread_cond_signal(&_wake);
+  return 0;
+}
+
+void *Reclaimer::run(void *arg) {
+  ((Reclaimer *)arg)->reclaim();
+  VLOG(1) << "reclaim thread exiting";
+  return nullptr;
+}
+
+void Reclaimer::reclaim() {
+  pthread_mutex_lock(&_mutex);
+  while (!_stopping) {
+    if (_queue.empty()) {
+      pthread_cond_wait(&_wake, &_mutex);
+      continue;
+    }
+    std::string name = _queue.front();
+    pthread_mutex_unlock(&_mutex);
+    bool done = reclaimOne(name);
+    pthread_mutex_lock(&_mutex);
+    if (done) {
+      _queue.pop_front();
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool Reclaimer::reclaimOne(const std::string &name) {
+  int fd = ::openat(_dirFd, name.c_str(),
+                    O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    // from the end, so that each step frees the extents it cut off
+    off_t size = st.st_size;
+    while (size > StepBytes) {
+      size -= StepBytes;
+      if (::ftruncate(fd, size) != 0) {
+        VLOG(1) << "unable to shorten " << _dir << "/" << name << ": "
+                << strerror(errno);
+        break;
+      }
+      Lock lock(_mutex);
+      if (!pause(StepPauseMs)) {
+        ::close(fd);
+        return false;
+      }
+    }
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  if (::unlinkat(_dirFd, name.c_str(), 0) != 0 && errno != ENOENT) {
+    RLOG(WARNING) << "unable to remove " << _dir << "/" << name << ": "
+                  << strerror(errno);
+  }
+  return true;
+}
+
+bool Reclaimer::pause(int ms) {
+  struct timespec deadline;
+#if defined(__APPLE__)
+  clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+#endif
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (!_stopping) {
+    if (pthread_cond_timedwait(&_wake, &_mutex, &deadline) == ETIMEDOUT) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace encfs
@@ -0,0 +1,74 @@
+#ifndef _Reclaimer_incl_
+#define _Reclaimer_incl_
+
+#include <deque>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace encfs {
+
+/*
+    Removes the large files unlinked through a mount in the background
+    (--deferred-unlink), so that an unlink does not hold its FUSE thread
+    for as long as the backing filesystem takes to free their extents.
+
+    An unlinked file is renamed into the trash directory in the root of
+    the backing directory, which listings of the volume skip, and a thread
+    then shortens it a step at a time, pausing in between so as not to
+    starve the mount of the backing disk, and unlinks it.  Whatever a
+    mount left in the trash is reclaimed by the next one.
+ */
+class Reclaimer {
+ public:
+  // the trash, in the root of the backing directory
+  static const char DirName[];
+  // bytes a file is shortened by at a time, and the pause after each
+  static const off_t StepBytes = 256 * 1024 * 1024;
+  static const int StepPauseMs = 50;
+
+  // files of at least minBytes are deferred
+  Reclaimer(const std::string &rootDir, off_t minBytes);
+  // stops the thread, what is left stays in the trash
+  ~Reclaimer();
+
+  // creates the trash, queues what it holds and starts the thread.  False
+  // if the trash can not be used.
+  bool open();
+
+  // moves the file name in the directory dirFd, stat'ed as st, into the
+  // trash if it is worth deferring.  Returns 0 once it is, -EAGAIN if it
+  // should be unlinked in place, or -errno.
+  int defer(int dirFd, const char *name, const struct stat &st);
+
+ private:
+  static void *run(void *arg);
+  void reclaim();
+  // shortens the trash entry name to nothing and unlinks it, false if
+  // stopped before it was done
+  bool reclaimOne(const std::string &name);
+  // waits ms unless stopped first.  Caller holds _mutex.
+  bool pause(int ms);
+
+  std::string _dir;
+  off_t _minBytes;
+  int _dirFd;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _wake;
+  std::deque<std::string> _queue;
+  uint64_t _next;  // names the next entry of the trash
+
+  bool _running;
+  bool _stopping;
+  pthread_t _thread;
+
+  Reclaimer(const Reclaimer &);             // not allowed
+  Reclaimer &operator=(const Reclaimer &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
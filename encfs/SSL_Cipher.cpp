@@ -1,34 +1,57 @@
 #include "easylogging++.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cstring>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/ossl_typ.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+// Argon2id came with 3.2
+#define ENCFS_HAVE_ARGON2 1
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#include <openssl/thread.h>
+#endif
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <pthread.h>
 #include <string>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <vector>
 
+#include "ByteKernels.h"
 #include "Cipher.h"
 #include "Error.h"
 #include "Interface.h"
+#include "KdfCalibration.h"
+#include "KernelCrypto.h"
 #include "Mutex.h"
+#include "Numa.h"
 #include "Range.h"
 #include "SSL_Cipher.h"
 #include "SSL_Compat.h"
 #include "intl/gettext.h"
+#include "openssl.h"
 
 using namespace std;
 
 namespace encfs {
 
-const int MAX_KEYLENGTH = 32;
+const int MAX_KEYLENGTH = 64;  // 512 bit XTS keys
 const int MAX_IVLENGTH = 16;
 const int KEY_CHECKSUM_BYTES = 4;
 
+// per-block header of the authenticated block formats (AES-GCM and
+// ChaCha20-Poly1305): a random nonce followed by the authentication tag
+const int AEAD_NONCE_BYTES = 12;
+const int AEAD_TAG_BYTES = 16;
+
 /**
  * This produces the same result as OpenSSL's EVP_BytesToKey. The difference
  * is that here we explicitly specify the key size, instead of relying on
@@ -41,7 +64,7 @@ const int KEY_CHECKSUM_BYTES = 4;
  * password->data mappings, which is what the salt is meant to frustrate
  */
 int BytesToKey(int keyLen, int ivLen, const EVP_MD* md,
-               const unsigned char* data, unsigned int rounds,
+               const unsigned char* data, int dataLen, unsigned int rounds,
                unsigned char* key, unsigned char* iv) {
   if (data == nullptr || dataLen == 0) {
     return 0;
@@ -51,7 +74,7 @@ int BytesToKey(int keyLen, int ivLen, const EVP_MD* md,
   unsigned int mds = 0;
   int addmd = 0;
   int nkey = key != nullptr ? keyLen : 0;
-  int iv = iv != nullptr ? ivLen : 0;
+  int niv = iv != nullptr ? ivLen : 0;
 
   EVP_MD_CTX * cx = EVP_MD_CTX_new();
   EVP_MD_CTX_init(cx);
@@ -105,7 +128,17 @@ long time_diff(const timeval& end, const timeval& start) {
 int TimedPBKDF2(const char* pass, int passlen, const unsigned char* salt,
                 int saltlen, int keylen, unsigned char* out,
                 long desiredPDFTime) {
+  // start where this host met the time before, rather than work up to it
+  // from 1000 iterations
+  std::string name = "pbkdf2-sha1-" + std::to_string(keylen);
+  double rate = KdfCalibration::rate(name);
   int iter = 1000;
+  if (rate > 0) {
+    double predicted = rate * (double)desiredPDFTime / 1000;
+    if (predicted > iter && predicted < INT_MAX) {
+      iter = (int)predicted;
+    }
+  }
   timeval start, end;
 
   for (;;) {
@@ -126,19 +159,124 @@ int TimedPBKDF2(const char* pass, int passlen, const unsigned char* salt,
     } else if (delta < (5 * desiredPDFTime / 6)) {
       iter = (int)((double)iter * (double) desiredPDFTime / (double)delta);
     } else {
+      KdfCalibration::store(name, (double)iter * 1000 / (double)delta);
       return iter;
     }
   }
 }
 
-static Interface BlowfishInterface("ssl/blowfish", 3, 0, 2);
-static Interface AESInterface("ssl/aes", 3, 0, 2);
-static Interface CAMELLIAInterface("ssl/camellia", 3, 0, 2);
+#ifdef ENCFS_HAVE_ARGON2
+/*
+ * Argon2id of the password into out.  The lanes are worked on by as many
+ * threads as there are CPUs for, which changes how soon the result comes
+ * but not the result.
+ */
+static bool Argon2id(const char* pass, int passlen, const unsigned char* salt,
+                     int saltlen, int passes, int memoryKiB, int lanes,
+                     unsigned char* out, int outlen) {
+  EVP_KDF* kdf = EVP_KDF_fetch(nullptr, "ARGON2ID", nullptr);
+  if (kdf == nullptr) {
+    return false;
+  }
+  EVP_KDF_CTX* ctx = EVP_KDF_CTX_new(kdf);
+  EVP_KDF_free(kdf);
+  if (ctx == nullptr) {
+    return false;
+  }
+
+  uint32_t threads = lanes;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0 && threads > (uint32_t)cpus) {
+    threads = cpus;
+  }
+  // OpenSSL runs no threads of its own until it is allowed to
+  if (threads > 1 && OSSL_get_max_threads(nullptr) < threads &&
+      OSSL_set_max_threads(nullptr, threads) != 1) {
+    threads = 1;
+  }
+
+  uint32_t iter = passes;
+  uint32_t memcost = memoryKiB;
+  uint32_t nlanes = lanes;
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD,
+                                        const_cast<char*>(pass), passlen),
+      OSSL_PARAM_construct_octet_string(
+          OSSL_KDF_PARAM_SALT, const_cast<unsigned char*>(salt), saltlen),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iter),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memcost),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &nlanes),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads),
+      OSSL_PARAM_construct_end()};
+
+  bool ok = EVP_KDF_derive(ctx, out, outlen, params) == 1;
+  EVP_KDF_CTX_free(ctx);
+  return ok;
+}
+
+// as TimedPBKDF2, raising the passes over the memory until the derivation
+// takes about desiredTime microseconds
+static int TimedArgon2(const char* pass, int passlen, const unsigned char* salt,
+                       int saltlen, int memoryKiB, int lanes, int keylen,
+                       unsigned char* out, long desiredTime) {
+  int passes = 1;
+  timeval start, end;
+
+  for (;;) {
+    gettimeofday(&start, nullptr);
+    if (!Argon2id(pass, passlen, salt, saltlen, passes, memoryKiB, lanes, out,
+                  keylen)) {
+      return -1;
+    }
+    gettimeofday(&end, nullptr);
+
+    long delta = std::max(time_diff(end, start), 1L);
+    int next = (int)((double)passes * (double)desiredTime / (double)delta);
+    if (delta >= (5 * desiredTime / 6) || next <= passes) {
+      return passes;
+    }
+    passes = next;
+  }
+}
+#endif
+
+/*
+    Version 4 adds block sizes above Cipher::MaxClassicBlockSize; data is
+    coded as in version 3.  Volumes record version 4 only when they use
+    such blocks, so that releases without large block support refuse them
+    and keep reading the others.
+
+    Version 4 also marks volumes that use formats releases before them
+    would misread rather than refuse: SipHash MACs, Argon2 keys, compressed
+    and packed data, and data kept in an object store so far.  They record
+    it whatever their block size.
+
+    Version 5 codes filenames in a single stream pass, see nameEncode.
+ */
+static Interface BlowfishInterface("ssl/blowfish", 5, 0, 4);
+static Interface AESInterface("ssl/aes", 5, 0, 4);
+static Interface CAMELLIAInterface("ssl/camellia", 5, 0, 4);
+
+// the first version of the interfaces above with single pass names
+static const int SinglePassNameVersion = 5;
+
+static bool singlePassNames(const Interface& iface) {
+  if (iface.current() < SinglePassNameVersion) {
+    return false;
+  }
+  return iface.name() == AESInterface.name() ||
+         iface.name() == BlowfishInterface.name() ||
+         iface.name() == CAMELLIAInterface.name();
+}
+
+// for archive and media volumes, where fewer and larger blocks mean fewer
+// IVs, MAC headers and system calls per byte
+static const int MaxBlockSize = 1024 * 1024;
 
 #ifndef OPENSSL_NO_CAMELLIA
 
 static Range CAMELLIAKeyRange(128, 256, 64);
-static Range CAMELLIABlockRange(64, 4096, 16);
+static Range CAMELLIABlockRange(64, MaxBlockSize, 16);
 
 static std::shared_ptr<Cipher> NewCAMELLIACipher(const Interface& iface,
     int keyLen) {
@@ -180,7 +318,7 @@ static bool CAMELLIA_Cipher_registered =
 #ifndef OPEN_NO_BF
 
 static Range BFKeyRange(128, 256, 32);
-static Range BFBlockRange(64, 4096, 8);
+static Range BFBlockRange(64, MaxBlockSize, 8);
 
 static std::shared_ptr<Cipher> NewBFCipher(const Interface& iface, int keyLen) {
   if (keyLen <= 0) {
@@ -207,7 +345,7 @@ static bool BF_Cipher_registered =
 #ifndef OPENSSL_NO_AES
 
 static Range AESKeyRange(128, 256, 64);
-static Range AESBlockRange(64, 4096, 16);
+static Range AESBlockRange(64, MaxBlockSize, 16);
 
 static std::shared_ptr<Cipher> NewAESCipher(const Interface& iface,
     int keyLen) {
@@ -245,18 +383,223 @@ static std::shared_ptr<Cipher> NewAESCipher(const Interface& iface,
 static bool AES_Cipher_registered = 
   Cipher::Register("AES", "16 byte block cipher", AESInterface, AESKeyRange,
       AESBlockRange, NewAESCipher);
+
+/*
+    AES with authenticated file data.  Keys, filenames and everything else
+    going through the stream / block interfaces are coded exactly as for
+    "ssl/aes"; file blocks are sealed with AES-GCM, with the nonce and tag
+    stored in front of each block (see aeadHeaderSize).
+ */
+// version 2 adds large blocks and marks volumes with the newer formats, as
+// version 4 of "ssl/aes"
+static Interface AESGCMInterface("ssl/aes-gcm", 2, 0, 1);
+
+// the block size includes the per-block nonce and tag
+static Range AESGCMBlockRange(128, MaxBlockSize, 16);
+
+static std::shared_ptr<Cipher> NewAESGCMCipher(const Interface& iface,
+    int keyLen) {
+  if (keyLen <= 0) {
+    keyLen = 256;
+  }
+
+  keyLen = AESKeyRange.closest(keyLen);
+
+  const EVP_CIPHER* blockCipher = nullptr;
+  const EVP_CIPHER* streamCipher = nullptr;
+  const EVP_CIPHER* aeadCipher = nullptr;
+
+  switch (keyLen) {
+    case 128:
+      blockCipher = EVP_aes_128_cbc();
+      streamCipher = EVP_aes_128_cfb();
+      aeadCipher = EVP_aes_128_gcm();
+      break;
+    case 192:
+      blockCipher = EVP_aes_192_cbc();
+      streamCipher = EVP_aes_192_cfb();
+      aeadCipher = EVP_aes_192_gcm();
+      break;
+
+    case 256:
+    default:
+      blockCipher = EVP_aes_256_cbc();
+      streamCipher = EVP_aes_256_cfb();
+      aeadCipher = EVP_aes_256_gcm();
+      break;
+  }
+
+  return std::shared_ptr<Cipher>(new SSL_Cipher(
+        iface, AESGCMInterface, blockCipher, streamCipher, keyLen / 8,
+        aeadCipher));
+}
+
+/*
+    AES in XTS mode for full blocks.  XTS is made for sector-addressed data:
+    each block is encrypted independently under a tweak, here the IV derived
+    from blockNum ^ fileIV by setIVec, and unlike CBC encryption is parallel
+    within the block.  Partial blocks, names and keys use AES-CFB with the
+    first half of the key, as in "ssl/aes".
+
+    Key lengths are XTS key lengths, ie. twice the AES key length.
+ */
+// version 2 adds large blocks and marks volumes with the newer formats, as
+// version 4 of "ssl/aes"
+static Interface AESXTSInterface("ssl/aes-xts", 2, 0, 1);
+
+static Range AESXTSKeyRange(256, 512, 256);
+
+static std::shared_ptr<Cipher> NewAESXTSCipher(const Interface& iface,
+    int keyLen) {
+  if (keyLen <= 0) {
+    keyLen = 512;
+  }
+
+  keyLen = AESXTSKeyRange.closest(keyLen);
+
+  const EVP_CIPHER* blockCipher = nullptr;
+  const EVP_CIPHER* streamCipher = nullptr;
+
+  switch (keyLen) {
+    case 256:
+      blockCipher = EVP_aes_128_xts();
+      streamCipher = EVP_aes_128_cfb();
+      break;
+
+    case 512:
+    default:
+      blockCipher = EVP_aes_256_xts();
+      streamCipher = EVP_aes_256_cfb();
+      break;
+  }
+
+  return std::shared_ptr<Cipher>(new SSL_Cipher(
+        iface, AESXTSInterface, blockCipher, streamCipher, keyLen / 8));
+}
+
+static bool AESXTS_Cipher_registered =
+  Cipher::Register("AES-XTS",
+                   gettext_noop("16 byte block cipher, XTS mode for full blocks"),
+                   AESXTSInterface, AESXTSKeyRange, AESBlockRange,
+                   NewAESXTSCipher);
+
+static bool AESGCM_Cipher_registered =
+  Cipher::Register("AES-GCM",
+                   gettext_noop("16 byte block cipher, authenticated blocks"),
+                   AESGCMInterface, AESKeyRange, AESGCMBlockRange,
+                   NewAESGCMCipher);
+#endif
+
+#if !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+
+/*
+    ChaCha20, for hosts without AES instructions, where it runs several
+    times faster than AES in software.  Being a stream cipher it can not
+    code file blocks in place under a fixed IV as CBC does, that would give
+    away the XOR of the old and new data of every rewritten block, so file
+    blocks are always sealed with ChaCha20-Poly1305 under a random nonce,
+    laid out as for "ssl/aes-gcm".  Keys and names use ChaCha20 in the
+    two pass stream mode; block names are padded to 16 bytes.
+
+    Versions as for "ssl/aes": 4 records large blocks or the newer
+    formats, 3 neither.
+ */
+static Interface ChaChaInterface("ssl/chacha20", 4, 0, 1);
+
+static Range ChaChaKeyRange(256);
+// the block size includes the per-block nonce and tag
+static Range ChaChaBlockRange(128, MaxBlockSize, 16);
+
+static std::shared_ptr<Cipher> NewChaChaCipher(const Interface& iface,
+    int keyLen) {
+  (void)keyLen;
+  return std::shared_ptr<Cipher>(new SSL_Cipher(
+        iface, ChaChaInterface, EVP_chacha20(), EVP_chacha20(), 256 / 8,
+        EVP_chacha20_poly1305()));
+}
+
+static bool ChaCha_Cipher_registered =
+  Cipher::Register("ChaCha20",
+                   gettext_noop("stream cipher, authenticated blocks; fast "
+                                "without AES instructions"),
+                   ChaChaInterface, ChaChaKeyRange, ChaChaBlockRange,
+                   NewChaChaCipher);
+
 #endif
 
 
 
+/*
+    A set of cipher contexts which have been keyed from the master contexts of
+    an SSLKey.  Each encode / decode operation borrows one set for the duration
+    of the call, so concurrent operations on the same key do not contend for a
+    single set of contexts.  A set is cloned by, and so allocated on the NUMA
+    node of, the thread that first needs it, and only lent to threads of that
+    node.
+ */
+struct SSLContextSet {
+  EVP_CIPHER_CTX* block_enc;
+  EVP_CIPHER_CTX* block_dec;
+  EVP_CIPHER_CTX* stream_enc;
+  EVP_CIPHER_CTX* stream_dec;
+
+  HMAC_CTX* mac_ctx;
+
+  // only allocated for ciphers with an authenticated block mode
+  EVP_CIPHER_CTX* aead_enc;
+  EVP_CIPHER_CTX* aead_dec;
+
+  // pre-keyed SHA1 states for IV derivation, see initIVHash
+  EVP_MD_CTX* iv_inner;
+  EVP_MD_CTX* iv_outer;
+  EVP_MD_CTX* md_tmp;
+
+  int node;
+
+  SSLContextSet();
+  ~SSLContextSet();
+
+  SSLContextSet(const SSLContextSet& src) = delete;
+  SSLContextSet& operator=(const SSLContextSet& src) = delete;
+};
+
+SSLContextSet::SSLContextSet() {
+  block_enc = EVP_CIPHER_CTX_new();
+  block_dec = EVP_CIPHER_CTX_new();
+  stream_enc = EVP_CIPHER_CTX_new();
+  stream_dec = EVP_CIPHER_CTX_new();
+  mac_ctx = HMAC_CTX_new();
+  aead_enc = nullptr;
+  aead_dec = nullptr;
+  iv_inner = EVP_MD_CTX_new();
+  iv_outer = EVP_MD_CTX_new();
+  md_tmp = EVP_MD_CTX_new();
+  node = 0;
+}
+
+SSLContextSet::~SSLContextSet() {
+  EVP_CIPHER_CTX_free(block_enc);
+  EVP_CIPHER_CTX_free(block_dec);
+  EVP_CIPHER_CTX_free(stream_enc);
+  EVP_CIPHER_CTX_free(stream_dec);
+  HMAC_CTX_free(mac_ctx);
+  EVP_CIPHER_CTX_free(aead_enc);
+  EVP_CIPHER_CTX_free(aead_dec);
+  EVP_MD_CTX_free(iv_inner);
+  EVP_MD_CTX_free(iv_outer);
+  EVP_MD_CTX_free(md_tmp);
+}
+
 class SSLKey : public AbstractCipherKey {
-  public
+  public:
     pthread_mutex_t mutex;
     unsigned int keySize;
     unsigned int ivLength;
 
     unsigned char* buffer;
 
+    // master contexts, keyed once by initKey and only read afterwards.
+    // Operations never use these directly, they use clones from ctxPool.
     EVP_CIPHER_CTX* block_enc;
     EVP_CIPHER_CTX* block_dec;
     EVP_CIPHER_CTX* stream_enc;
@@ -264,10 +607,35 @@ class SSLKey : public AbstractCipherKey {
 
     HMAC_CTX* mac_ctx;
 
+    // authenticated block mode contexts, nullptr unless the cipher has one
+    EVP_CIPHER_CTX* aead_enc;
+    EVP_CIPHER_CTX* aead_dec;
+
+    // HMAC-SHA1 inner state after absorbing (key ^ ipad) and the IV data,
+    // and outer state after (key ^ opad).  Both are constant for the key, so
+    // setIVec only has to hash the 8 byte seed.
+    EVP_MD_CTX* iv_inner;
+    EVP_MD_CTX* iv_outer;
+
+    // SipHash-2-4 key for FastMAC_64, derived from the key data by initKey
+    uint64_t sipKey[2];
+
+    // the kernel's block cipher, keyed alike, with --crypto-engine=kernel.
+    // Null when it is not used.
+    std::shared_ptr<KernelCrypto> kernel;
+
+    // idle context sets per NUMA node, protected by mutex.  The pool of a
+    // node grows to the peak number of concurrent operations on this key
+    // there.
+    std::vector<SSLContextSet*> ctxPool[Numa::MaxNodes];
+
     SSLKey(int keySize, int ivLength);
 
     ~SSLKey() override;
 
+    SSLContextSet* acquireContext();
+    void releaseContext(SSLContextSet* ctx);
+
     SSLKey(const SSLKey& src) = delete;
     SSLKey(SSLKey&& other) = delete; 
     SSLKey& operator=(const SSLKey& other) = delete;
@@ -286,16 +654,32 @@ SSLKey::SSLKey(int keySize_, int ivLength_) {
 
   block_enc = EVP_CIPHER_CTX_new();
   EVP_CIPHER_CTX_init(block_enc);
-  block_enc = EVP_CIPHER_CTX_new();
+  block_dec = EVP_CIPHER_CTX_new();
   EVP_CIPHER_CTX_init(block_dec);
   stream_enc = EVP_CIPHER_CTX_new();
   EVP_CIPHER_CTX_init(stream_enc);
+  stream_dec = EVP_CIPHER_CTX_new();
+  EVP_CIPHER_CTX_init(stream_dec);
   mac_ctx = HMAC_CTX_new();
   HMAC_CTX_reset(mac_ctx);
+  aead_enc = nullptr;
+  aead_dec = nullptr;
+  iv_inner = EVP_MD_CTX_new();
+  iv_outer = EVP_MD_CTX_new();
+  sipKey[0] = 0;
+  sipKey[1] = 0;
 }
 
 SSLKey::~SSLKey() {
+  for (auto& pool : ctxPool) {
+    for (SSLContextSet* ctx : pool) {
+      delete ctx;
+    }
+    pool.clear();
+  }
+
   memset(buffer, 0, (size_t)keySize + (size_t)ivLength);
+  OPENSSL_cleanse(sipKey, sizeof(sipKey));
 
   OPENSSL_free(buffer);
 
@@ -310,10 +694,83 @@ SSLKey::~SSLKey() {
   EVP_CIPHER_CTX_free(stream_enc);
   EVP_CIPHER_CTX_free(stream_dec);
   HMAC_CTX_free(mac_ctx);
+  EVP_CIPHER_CTX_free(aead_enc);
+  EVP_CIPHER_CTX_free(aead_dec);
+  EVP_MD_CTX_free(iv_inner);
+  EVP_MD_CTX_free(iv_outer);
 
   pthread_mutex_destroy(&mutex);
 }
 
+/*
+    Take an idle context set of the caller's node from the pool, or clone a new
+    one from the master contexts if every set is in use.  The lock is only held
+    while touching the pool, never during the copy or the crypto operation
+    itself.
+ */
+SSLContextSet* SSLKey::acquireContext() {
+  int node = Numa::currentNode();
+  {
+    Lock lock(mutex, ENCFS_LOCK_SITE("SSLKey::acquireContext"));
+    std::vector<SSLContextSet*>& pool = ctxPool[node];
+    if (!pool.empty()) {
+      SSLContextSet* ctx = pool.back();
+      pool.pop_back();
+      return ctx;
+    }
+  }
+
+  auto* ctx = new SSLContextSet();
+  ctx->node = node;
+  if (EVP_CIPHER_CTX_copy(ctx->block_enc, block_enc) != 1 ||
+      EVP_CIPHER_CTX_copy(ctx->block_dec, block_dec) != 1 ||
+      EVP_CIPHER_CTX_copy(ctx->stream_enc, stream_enc) != 1 ||
+      EVP_CIPHER_CTX_copy(ctx->stream_dec, stream_dec) != 1 ||
+      HMAC_CTX_copy(ctx->mac_ctx, mac_ctx) != 1 ||
+      EVP_MD_CTX_copy_ex(ctx->iv_inner, iv_inner) != 1 ||
+      EVP_MD_CTX_copy_ex(ctx->iv_outer, iv_outer) != 1) {
+    delete ctx;
+    throw Error("unable to clone cipher context");
+  }
+
+  if (aead_enc != nullptr) {
+    ctx->aead_enc = EVP_CIPHER_CTX_new();
+    ctx->aead_dec = EVP_CIPHER_CTX_new();
+    if (EVP_CIPHER_CTX_copy(ctx->aead_enc, aead_enc) != 1 ||
+        EVP_CIPHER_CTX_copy(ctx->aead_dec, aead_dec) != 1) {
+      delete ctx;
+      throw Error("unable to clone cipher context");
+    }
+  }
+
+  return ctx;
+}
+
+void SSLKey::releaseContext(SSLContextSet* ctx) {
+  Lock lock(mutex, ENCFS_LOCK_SITE("SSLKey::releaseContext"));
+  ctxPool[ctx->node].push_back(ctx);
+}
+
+/*
+    Borrows a context set from a key for the lifetime of the object.
+ */
+class SSLContextLease {
+  public:
+    explicit SSLContextLease(SSLKey* key)
+        : _key(key), _ctx(key->acquireContext()) {}
+    ~SSLContextLease() { _key->releaseContext(_ctx); }
+
+    SSLContextSet* get() const { return _ctx; }
+    SSLContextSet* operator->() const { return _ctx; }
+
+    SSLContextLease(const SSLContextLease& src) = delete;
+    SSLContextLease& operator=(const SSLContextLease& src) = delete;
+
+  private:
+    SSLKey* _key;
+    SSLContextSet* _ctx;
+};
+
 inline unsigned char* KeyData(const std::shared_ptr<SSLKey>& key) {
   return key->buffer;
 }
@@ -322,19 +779,128 @@ inline unsigned char* IVData(const std::shared_ptr<SSLKey>& key) {
   return key->buffer + key->keySize;
 }
 
+inline const unsigned char* IVData(const SSLKey* key) {
+  return key->buffer + key->keySize;
+}
+
+/*
+    The SSLKey behind a key handed to an operation.  Keys only ever reach a
+    cipher from that same cipher, so this is a plain cast of the pointer:
+    a dynamic_pointer_cast would check the type and take and drop a
+    reference on the key's count, which every thread coding with the key
+    shares, for every block.
+ */
+inline SSLKey* sslKey(const CipherKey& ckey) {
+  return static_cast<SSLKey*>(ckey.get());
+}
+
+/*
+    Precompute the HMAC-SHA1 state used by setIVec.  The IV is
+    HMAC(key, IVData || seed), and everything but the seed is fixed for the
+    lifetime of the key, so the inner hash is advanced past the key pad and
+    the IV data here, once.
+ */
+static void initIVHash(const std::shared_ptr<SSLKey>& key, int keySize) {
+  rAssert(keySize <= SHA_CBLOCK);
+  unsigned char pad[SHA_CBLOCK];
+
+  memset(pad, 0x36, sizeof(pad));
+  for (int i = 0; i < keySize; ++i) {
+    pad[i] ^= KeyData(key)[i];
+  }
+  EVP_DigestInit_ex(key->iv_inner, fetchedDigest(EVP_sha1()), nullptr);
+  EVP_DigestUpdate(key->iv_inner, pad, sizeof(pad));
+  EVP_DigestUpdate(key->iv_inner, IVData(key), key->ivLength);
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (int i = 0; i < keySize; ++i) {
+    pad[i] ^= KeyData(key)[i];
+  }
+  EVP_DigestInit_ex(key->iv_outer, fetchedDigest(EVP_sha1()), nullptr);
+  EVP_DigestUpdate(key->iv_outer, pad, sizeof(pad));
+
+  OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+/*
+    The SipHash key is taken from an HMAC of a fixed label rather than from
+    the key data directly, so the block MAC key is independent of the cipher
+    key.  It starts from the key's HMAC context, which initKey has keyed
+    alike, as the one-shot HMAC() fetches SHA1 again under OpenSSL 3.
+ */
+static void initSipKey(const std::shared_ptr<SSLKey>& key) {
+  static const char label[] = "encfs block MAC";
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdLen = EVP_MAX_MD_SIZE;
+
+  HMAC_CTX* mac = HMAC_CTX_new();
+  HMAC_CTX_copy(mac, key->mac_ctx);
+  HMAC_Update(mac, (const unsigned char*)label, sizeof(label) - 1);
+  HMAC_Final(mac, md, &mdLen);
+  HMAC_CTX_free(mac);
+  rAssert(mdLen >= 16);
+
+  key->sipKey[0] = 0;
+  key->sipKey[1] = 0;
+  for (int i = 7; i >= 0; --i) {
+    key->sipKey[0] = (key->sipKey[0] << 8) | md[i];
+    key->sipKey[1] = (key->sipKey[1] << 8) | md[8 + i];
+  }
+
+  OPENSSL_cleanse(md, sizeof(md));
+}
+
+/*
+    Hand the block cipher to the kernel, for the CBC modes it has.  It is
+    keyed with the same bytes as the OpenSSL contexts, so either codes the
+    blocks alike.
+ */
+static void initKernelCrypto(const std::shared_ptr<SSLKey>& key,
+                             const EVP_CIPHER* blockCipher, int keySize) {
+  const char* name = nullptr;
+  switch (EVP_CIPHER_nid(blockCipher)) {
+    case NID_aes_128_cbc:
+    case NID_aes_192_cbc:
+    case NID_aes_256_cbc:
+      name = "cbc(aes)";
+      break;
+    case NID_bf_cbc:
+      name = "cbc(blowfish)";
+      break;
+    default:
+      VLOG(1) << "kernel crypto: not offloading "
+              << EVP_CIPHER_name(blockCipher);
+      return;
+  }
+
+  int keyLen = EVP_CIPHER_key_length(blockCipher);
+  if ((EVP_CIPHER_flags(blockCipher) & EVP_CIPH_VARIABLE_LENGTH) != 0) {
+    keyLen = keySize;
+  }
+  key->kernel = KernelCrypto::New(name, KeyData(key), keyLen,
+                                  EVP_CIPHER_iv_length(blockCipher));
+}
+
 void initKey(const std::shared_ptr<SSLKey>& key, const EVP_CIPHER* _blockCipher,
-    const EVP_CIPHER* _streamCipher, int _keySize) {
-  Lock lock(key->mutex);
+    const EVP_CIPHER* _streamCipher, const EVP_CIPHER* _aeadCipher,
+    int _keySize) {
+  Lock lock(key->mutex, ENCFS_LOCK_SITE("SSLKey::initKey"));
 
   EVP_EncryptInit_ex(key->block_enc, _blockCipher, nullptr, nullptr, nullptr);
   EVP_DecryptInit_ex(key->block_dec, _blockCipher, nullptr, nullptr, nullptr);
   EVP_EncryptInit_ex(key->stream_enc, _streamCipher, nullptr, nullptr, nullptr);
   EVP_DecryptInit_ex(key->stream_dec, _streamCipher, nullptr, nullptr, nullptr);
 
-  EVP_CIPHER_CTX_set_key_lenth(key->block_enc, _keySize);
-  EVP_CIPHER_CTX_set_key_length(key->block_dec, _keySize);
-  EVP_CIPHER_CTX_set_key_length(key->stream_enc, _keySize);
-  EVP_CIPHER_CTX_set_key_length(key->stream_dec, _keySize);
+  // only variable length ciphers (Blowfish) take the key size, the others
+  // use the first EVP_CIPHER_key_length bytes of the key data
+  if ((EVP_CIPHER_flags(_blockCipher) & EVP_CIPH_VARIABLE_LENGTH) != 0) {
+    EVP_CIPHER_CTX_set_key_length(key->block_enc, _keySize);
+    EVP_CIPHER_CTX_set_key_length(key->block_dec, _keySize);
+  }
+  if ((EVP_CIPHER_flags(_streamCipher) & EVP_CIPH_VARIABLE_LENGTH) != 0) {
+    EVP_CIPHER_CTX_set_key_length(key->stream_enc, _keySize);
+    EVP_CIPHER_CTX_set_key_length(key->stream_dec, _keySize);
+  }
 
   EVP_CIPHER_CTX_set_padding(key->block_enc, 0);
   EVP_CIPHER_CTX_set_padding(key->block_dec, 0);
@@ -346,18 +912,42 @@ void initKey(const std::shared_ptr<SSLKey>& key, const EVP_CIPHER* _blockCipher,
   EVP_EncryptInit_ex(key->stream_enc, nullptr, nullptr, KeyData(key), nullptr);
   EVP_DecryptInit_ex(key->stream_dec, nullptr, nullptr, KeyData(key), nullptr);
 
-  HMAC_Init_ex(key->mac_ctx, KeyData(key), _keySize, EVP_sha1(), nullptr);
+  HMAC_Init_ex(key->mac_ctx, KeyData(key), _keySize, fetchedDigest(EVP_sha1()),
+               nullptr);
+  initIVHash(key, _keySize);
+  initSipKey(key);
+
+  if (KernelCrypto::enabled()) {
+    initKernelCrypto(key, _blockCipher, _keySize);
+  }
+
+  if (_aeadCipher != nullptr) {
+    key->aead_enc = EVP_CIPHER_CTX_new();
+    key->aead_dec = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(key->aead_enc, _aeadCipher, nullptr, nullptr, nullptr);
+    EVP_DecryptInit_ex(key->aead_dec, _aeadCipher, nullptr, nullptr, nullptr);
+    EVP_CIPHER_CTX_ctrl(key->aead_enc, EVP_CTRL_AEAD_SET_IVLEN,
+                        AEAD_NONCE_BYTES, nullptr);
+    EVP_CIPHER_CTX_ctrl(key->aead_dec, EVP_CTRL_AEAD_SET_IVLEN,
+                        AEAD_NONCE_BYTES, nullptr);
+    EVP_EncryptInit_ex(key->aead_enc, nullptr, nullptr, KeyData(key), nullptr);
+    EVP_DecryptInit_ex(key->aead_dec, nullptr, nullptr, KeyData(key), nullptr);
+  }
 }
 
 SSL_Cipher::SSL_Cipher(const Interface& iface_, const Interface& realIface_,
                        const EVP_CIPHER* blockCipher,
-                       const EVP_CIPHER* streamCipher, int keySize_) {
+                       const EVP_CIPHER* streamCipher, int keySize_,
+                       const EVP_CIPHER* aeadCipher) {
   this->iface = iface_;
   this->realIface = realIface_;
-  this->_blockCipher = streamCipher;
-  this->_streamCipher = streamCipher;
+  // keys are made from the fetched implementations, see fetchedCipher
+  this->_blockCipher = fetchedCipher(blockCipher);
+  this->_streamCipher = fetchedCipher(streamCipher);
+  this->_aeadCipher = fetchedCipher(aeadCipher);
   this->_keySize = keySize_;
   this->_ivLength = EVP_CIPHER_iv_length(_blockCipher);
+  this->_singlePassNames = singlePassNames(iface_);
 
   rAssert(_ivLength == 0 || _ivLength == 16);
 
@@ -377,7 +967,22 @@ SSL_Cipher::~SSL_Cipher() =default;
 
 Interface SSL_Cipher::interface() const { return realIface; }
 
-CipherKey SSL_Cipher::neKey(const char* password, int passwdLength,
+Interface SSL_Cipher::volumeInterface(int blockSize, bool newFormats) const {
+  Interface result = realIface;
+  // volumes with neither large blocks nor the newer formats record the
+  // version before them.  Single pass names code the volume differently,
+  // so that version is recorded whatever else the volume uses.
+  if (!newFormats && blockSize <= MaxClassicBlockSize &&
+      !singlePassNames(realIface)) {
+    // record the version before large blocks and the newer formats, so
+    // that older releases can still mount the volume
+    --result.current();
+    --result.age();
+  }
+  return result;
+}
+
+CipherKey SSL_Cipher::newKey(const char* password, int passwdLength,
                             int& iterationCount, long desiredDuration,
                             const unsigned char* salt, int saltLen) {
   std::shared_ptr<SSLKey> key(new SSLKey(_keySize, _ivLength));
@@ -396,36 +1001,79 @@ CipherKey SSL_Cipher::neKey(const char* password, int passwdLength,
   } else {
     if (PKCS5_PBKDF2_HMAC_SHA1(
           password, passwdLength, const_cast<unsigned char*>(salt), saltLen,
-          iterationCount, _keySize + _ivLength, KeyData(key) != 1
-          )) {
+          iterationCount, _keySize + _ivLength, KeyData(key)) != 1) {
       RLOG(WARNING) << "openssl error, PBKDF2 failed";
       return CipherKey();
     }
   }
 
-  initKey(key, _blockCipher, _streamCipher, _keySize);
+  initKey(key, _blockCipher, _streamCipher, _aeadCipher, _keySize);
   return key;
 }
 
+CipherKey SSL_Cipher::newArgon2Key(const char* password, int passwdLength,
+                                   int& passes, int memoryKiB, int lanes,
+                                   long desiredDuration,
+                                   const unsigned char* salt, int saltLen) {
+#ifdef ENCFS_HAVE_ARGON2
+  std::shared_ptr<SSLKey> key(new SSLKey(_keySize, _ivLength));
+
+  if (passes == 0) {
+    int res = TimedArgon2(password, passwdLength, salt, saltLen, memoryKiB,
+                          lanes, _keySize + _ivLength, KeyData(key),
+                          1000 * desiredDuration);
+    if (res <= 0) {
+      RLOG(WARNING) << "openssl error, Argon2id failed";
+      return CipherKey();
+    }
+
+    passes = res;
+  } else if (!Argon2id(password, passwdLength, salt, saltLen, passes,
+                       memoryKiB, lanes, KeyData(key), _keySize + _ivLength)) {
+    RLOG(WARNING) << "openssl error, Argon2id failed";
+    return CipherKey();
+  }
+
+  initKey(key, _blockCipher, _streamCipher, _aeadCipher, _keySize);
+  return key;
+#else
+  return Cipher::newArgon2Key(password, passwdLength, passes, memoryKiB, lanes,
+                              desiredDuration, salt, saltLen);
+#endif
+}
+
+bool SSL_Cipher::hasArgon2() const {
+#ifdef ENCFS_HAVE_ARGON2
+  // the provider loaded may still lack it
+  EVP_KDF* kdf = EVP_KDF_fetch(nullptr, "ARGON2ID", nullptr);
+  EVP_KDF_free(kdf);
+  return kdf != nullptr;
+#else
+  return false;
+#endif
+}
+
 CipherKey SSL_Cipher::newKey(const char* password, int passwdLength) {
-  std:::shared_ptr<SSLKey> key(new SSLKey(_keySize, _ivLength));
+  std::shared_ptr<SSLKey> key(new SSLKey(_keySize, _ivLength));
 
   int bytes = 0;
   if (iface.current() > 1) {
     bytes =
-      BytesToKey(_keySize, _ivLength, EVP_sha1(), (unsigned char*) password,
-                 passwdLength, 16, KeyData(key), IVData(key));
+      BytesToKey(_keySize, _ivLength, fetchedDigest(EVP_sha1()),
+                 (unsigned char*) password, passwdLength, 16, KeyData(key),
+                 IVData(key));
 
     if (bytes != (int)_keySize) {
       RLOG(WARNING) << "newKey: BytesToKey returned " << bytes << ", expecting "
                     << _keySize << " key bytes ";
     }
   } else {
-    EVP_BytesToKey(_blockCipher, EVP_sha1(), nullptr, (unsigned char*) password,
-                   passwdLength, 16, KeyData(key), IVData(key));
+    EVP_BytesToKey(_blockCipher, fetchedDigest(EVP_sha1()), nullptr,
+                   (unsigned char*) password, passwdLength, 16, KeyData(key),
+                   IVData(key));
   }
 
-  initkey(key, _blockCipher, _streamCipher, _keySize);
+  initKey(key, _blockCipher, _streamCipher, _aeadCipher, _keySize);
 
   return key;
 }
@@ -449,21 +1097,22 @@ CipherKey SSL_Cipher::newRandomKey() {
   }
 
   OPENSSL_cleanse(tmpBuf, bufLen);
-  initKey(key, _blockCipher, _streamCipher, _keySize);
+  initKey(key, _blockCipher, _streamCipher, _aeadCipher, _keySize);
 
   return key;
 }
 
-static uint64_t _checksum_64(SSLKey* key, const unsigned char* data,
+static uint64_t _checksum_64(SSLContextSet* ctx, const unsigned char* data,
     int dataLen, const uint64_t* const chainedIV) {
   rAssert(dataLen > 0);
-  Lock lock(key->mutex);
 
   unsigned char md[EVP_MAX_MD_SIZE];
   unsigned int mdLen = EVP_MAX_MD_SIZE;
 
-  HMAC_Init_ex(key->mac_ctx, nullptr, 0, nullptr, nullptr);
-  HMAC_Update(key->mac_ctx, data, dataLen);
+  // resets to the keyed state captured when the context set was cloned, the
+  // key schedule is not recomputed
+  HMAC_Init_ex(ctx->mac_ctx, nullptr, 0, nullptr, nullptr);
+  HMAC_Update(ctx->mac_ctx, data, dataLen);
 
   if (chainedIV != nullptr) {
     uint64_t tmp = *chainedIV;
@@ -472,10 +1121,10 @@ static uint64_t _checksum_64(SSLKey* key, const unsigned char* data,
       h[i] = tmp & 0xff;
       tmp >>= 8;
     }
-    HMAC_Update(key->mac_ctx, md, &mdLen);
+    HMAC_Update(ctx->mac_ctx, h, 8);
   }
 
-  HMAC_Final(key->mac_ctx, md, &mdLen);
+  HMAC_Final(ctx->mac_ctx, md, &mdLen);
 
   rAssert(mdLen >= 8);
 
@@ -492,15 +1141,13 @@ static uint64_t _checksum_64(SSLKey* key, const unsigned char* data,
   return value;
 }
 
-bool SSL_Cipher::randomize(unsigned char* buf, int len,
-    bool ) const {
-  memset(buf, 0, len);
+static bool randBytes(unsigned char* buf, int len) {
   int result = RAND_bytes(buf, len);
   if (result != 1) {
     char errStr[120];
     unsigned long errVal = 0;
     if ((errVal = ERR_get_error()) != 0) {
-      RLOG(WARNING) << "openssl error; " << ERROR_error_string(errVal, errStr);
+      RLOG(WARNING) << "openssl error; " << ERR_error_string(errVal, errStr);
     }
 
     return false;
@@ -508,10 +1155,85 @@ bool SSL_Cipher::randomize(unsigned char* buf, int len,
   return true;
 }
 
+/*
+    Per-thread buffer of RAND_bytes output, used for non-strong requests
+    (file IVs, MAC header random bytes, nonces).  These are usually only a
+    few bytes, so refilling in bulk saves a trip through the locked RAND
+    layer per block.  Bytes are wiped as they are handed out, the buffer is
+    dropped after a fork so parent and child never share output, and the
+    generator is reseeded every RandomPoolReseed refills.
+ */
+static const int RandomPoolSize = 4096;
+static const int RandomPoolReseed = 256;
+
+// bumped in the child of every fork, so pools filled before it are dropped
+static std::atomic<unsigned int> forkGeneration(0);
+static pthread_once_t forkHandlerOnce = PTHREAD_ONCE_INIT;
+
+static void forkChild() { ++forkGeneration; }
+
+static void installForkHandler() {
+  pthread_atfork(nullptr, nullptr, forkChild);
+}
+
+struct RandomPool {
+  unsigned char buf[RandomPoolSize];
+  int avail;  // unused bytes, at the end of buf
+  int refills;
+  unsigned int generation;  // forkGeneration when buf was filled
+
+  RandomPool() : avail(0), refills(0) {
+    pthread_once(&forkHandlerOnce, installForkHandler);
+    generation = forkGeneration;
+  }
+  ~RandomPool() { OPENSSL_cleanse(buf, sizeof(buf)); }
+
+  bool take(unsigned char* out, int len) {
+    if (generation != forkGeneration) {
+      OPENSSL_cleanse(buf, sizeof(buf));
+      avail = 0;
+      generation = forkGeneration;
+    }
+
+    while (len > 0) {
+      if (avail == 0) {
+        if (++refills % RandomPoolReseed == 0) {
+          RAND_poll();
+        }
+        if (!randBytes(buf, sizeof(buf))) {
+          return false;
+        }
+        avail = sizeof(buf);
+      }
+
+      int n = std::min(len, avail);
+      unsigned char* src = buf + sizeof(buf) - avail;
+      memcpy(out, src, n);
+      OPENSSL_cleanse(src, n);
+      avail -= n;
+      out += n;
+      len -= n;
+    }
+    return true;
+  }
+};
+
+static thread_local RandomPool randomPool;
+
+bool SSL_Cipher::randomize(unsigned char* buf, int len,
+    bool strongRandom) const {
+  memset(buf, 0, len);
+  if (strongRandom || len > RandomPoolSize) {
+    return randBytes(buf, len);
+  }
+  return randomPool.take(buf, len);
+}
+
 uint64_t SSL_Cipher::MAC_64(const unsigned char* data, int len,
     const CipherKey& key, uint64_t* chainedIV) const {
-  std::shared_ptr<SSLKey> mk = dynamic_pointer_cast<SSLKey>(key);
-  uint64_t tmp = _checksum_64(mk.get(), data, len, chainedIV);
+  SSLKey* mk = sslKey(key);
+  SSLContextLease ctx(mk);
+  uint64_t tmp = _checksum_64(ctx.get(), data, len, chainedIV);
 
   if (chainedIV != nullptr) {
     *chainedIV = tmp;
@@ -520,6 +1242,179 @@ uint64_t SSL_Cipher::MAC_64(const unsigned char* data, int len,
   return tmp;
 }
 
+void SSL_Cipher::MACBatch(const ChainedMACRequest* blocks, int count,
+                          uint64_t* macs, const CipherKey& key) const {
+  SSLKey* mk = sslKey(key);
+  SSLContextLease ctx(mk);
+  for (int i = 0; i < count; ++i) {
+    macs[i] = _checksum_64(ctx.get(), blocks[i].data, blocks[i].len,
+                           blocks[i].chainedIV);
+    if (blocks[i].chainedIV != nullptr) {
+      *blocks[i].chainedIV = macs[i];
+    }
+  }
+}
+
+static inline uint64_t rotl64(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+static inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2,
+    uint64_t& v3) {
+  v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+  v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+  v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+  v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+}
+
+static inline uint64_t loadLE64(const unsigned char* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+/*
+    SipHash-2-4 of (nonce as 8 little-endian bytes || data).
+ */
+static uint64_t _sipHash_64(const uint64_t k[2], uint64_t nonce,
+    const unsigned char* data, int dataLen) {
+  uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k[1] ^ 0x7465646279746573ULL;
+
+  auto compress = [&](uint64_t m) {
+    v3 ^= m;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= m;
+  };
+
+  compress(nonce);
+
+  const unsigned char* end = data + (dataLen & ~7);
+  for (; data != end; data += 8) {
+    compress(loadLE64(data));
+  }
+
+  // last word holds the remaining bytes and the total length mod 256
+  uint64_t b = ((uint64_t)(dataLen + 8)) << 56;
+  for (int i = (dataLen & 7) - 1; i >= 0; --i) {
+    b |= ((uint64_t)data[i]) << (8 * i);
+  }
+  compress(b);
+
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; ++i) {
+    sipRound(v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SSL_Cipher::SipHash_64(const uint64_t key[2], uint64_t nonce,
+    const unsigned char* data, int len) {
+  return _sipHash_64(key, nonce, data, len);
+}
+
+uint64_t SSL_Cipher::FastMAC_64(const unsigned char* data, int len,
+    uint64_t nonce, const CipherKey& key) const {
+  SSLKey* mk = sslKey(key);
+  // the SipHash key is constant after initKey, so this needs no context
+  return _sipHash_64(mk->sipKey, nonce, data, len);
+}
+
+// buffers hashed side by side by _sipHash4_64
+static const int SipLanes = 4;
+
+/*
+    SipHash-2-4 of SipLanes buffers of the same length, as _sipHash_64 of
+    each.  The lanes go through every round side by side, so that the
+    compiler can keep them in vector registers.
+ */
+static void _sipHash4_64(const uint64_t k[2],
+    const Cipher::MACRequest* blocks, uint64_t* macs) {
+  uint64_t v0[SipLanes], v1[SipLanes], v2[SipLanes], v3[SipLanes];
+  for (int l = 0; l < SipLanes; ++l) {
+    v0[l] = k[0] ^ 0x736f6d6570736575ULL;
+    v1[l] = k[1] ^ 0x646f72616e646f6dULL;
+    v2[l] = k[0] ^ 0x6c7967656e657261ULL;
+    v3[l] = k[1] ^ 0x7465646279746573ULL;
+  }
+
+  auto rounds = [&](int n) {
+    for (int r = 0; r < n; ++r) {
+      for (int l = 0; l < SipLanes; ++l) {
+        sipRound(v0[l], v1[l], v2[l], v3[l]);
+      }
+    }
+  };
+  auto compress = [&](const uint64_t* m) {
+    for (int l = 0; l < SipLanes; ++l) {
+      v3[l] ^= m[l];
+    }
+    rounds(2);
+    for (int l = 0; l < SipLanes; ++l) {
+      v0[l] ^= m[l];
+    }
+  };
+
+  uint64_t m[SipLanes];
+  for (int l = 0; l < SipLanes; ++l) {
+    m[l] = blocks[l].nonce;
+  }
+  compress(m);
+
+  int dataLen = blocks[0].len;
+  int words = dataLen & ~7;
+  for (int off = 0; off < words; off += 8) {
+    for (int l = 0; l < SipLanes; ++l) {
+      m[l] = loadLE64(blocks[l].data + off);
+    }
+    compress(m);
+  }
+
+  for (int l = 0; l < SipLanes; ++l) {
+    const unsigned char* data = blocks[l].data + words;
+    uint64_t b = ((uint64_t)(dataLen + 8)) << 56;
+    for (int i = (dataLen & 7) - 1; i >= 0; --i) {
+      b |= ((uint64_t)data[i]) << (8 * i);
+    }
+    m[l] = b;
+  }
+  compress(m);
+
+  for (int l = 0; l < SipLanes; ++l) {
+    v2[l] ^= 0xff;
+  }
+  rounds(4);
+  for (int l = 0; l < SipLanes; ++l) {
+    macs[l] = v0[l] ^ v1[l] ^ v2[l] ^ v3[l];
+  }
+}
+
+void SSL_Cipher::FastMACBatch(const MACRequest* blocks, int count,
+    uint64_t* macs, const CipherKey& key) const {
+  SSLKey* mk = sslKey(key);
+  int i = 0;
+  while (i < count) {
+    bool sameLen = i + SipLanes <= count;
+    for (int l = 1; sameLen && l < SipLanes; ++l) {
+      sameLen = blocks[i + l].len == blocks[i].len;
+    }
+    if (sameLen) {
+      _sipHash4_64(mk->sipKey, blocks + i, macs + i);
+      i += SipLanes;
+    } else {
+      // a short last block, or the tail of the batch
+      macs[i] = _sipHash_64(mk->sipKey, blocks[i].nonce, blocks[i].data,
+                            blocks[i].len);
+      ++i;
+    }
+  }
+}
+
 CipherKey SSL_Cipher::readKey(const unsigned char* data,
     const CipherKey& masterKey, bool checkKey) {
   std:::shared_ptr<SSLKey> mk = dynamic_pointer_cast<SSLKey>(masterKey);
@@ -548,7 +1443,7 @@ CipherKey SSL_Cipher::readKey(const unsigned char* data,
   memcpy(key->buffer, tmpBuf, (size_t)_keySize + (size_t)_ivLength);
   memset(tmpBuf, 0, sizeof(tmpBuf));
 
-  initKey(key, _blockCipher, _streamCipher, _keySize);
+  initKey(key, _blockCipher, _streamCipher, _aeadCipher, _keySize);
 
   return key;
 }
@@ -595,26 +1490,44 @@ int SSL_Cipher::encodedKeySize() const {
 int SSL_Cipher::keySize() const { return _keySize; }
 
 int SSL_Cipher::cipherBlockSize() const {
+  // XTS reports a block size of 1 as it can steal ciphertext, but data must
+  // still be at least one AES block, so keep everything block aligned
+  if (EVP_CIPHER_mode(_blockCipher) == EVP_CIPH_XTS_MODE) {
+    return 16;
+  }
+  // nor would a stream cipher (ChaCha20) pad names to hide their length
+  if (EVP_CIPHER_block_size(_blockCipher) == 1) {
+    return 16;
+  }
   return EVP_CIPHER_block_size(_blockCipher);
 }
 
 
 void SSL_Cipher::setIVec(unsigned char* ivec, uint64_t seed,
-    const std::shared_ptr<SSLKey>& key) const {
+    const SSLKey* key, SSLContextSet* ctx) const {
   if (iface.current() >= 3) {
-    memcpy(ivec, IVData(key), _ivLength);
+    // the seed is always hashed as 8 little-endian bytes
+    unsigned char seedBuf[8];
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(seedBuf, &seed, sizeof(seedBuf));
+#else
+    for (int i = 0; i < 8; ++i) {
+      seedBuf[i] = (unsigned char) (seed & 0xff);
+      seed >>= 8;
+    }
+#endif
 
     unsigned char md[EVP_MAX_MD_SIZE];
     unsigned int mdLen = EVP_MAX_MD_SIZE;
 
-    for (int i = 0; i < 8; ++i) {
-      md[i] = (unsigned char) (seed & 0xff);
-      seed >>= 8;
-    }
-    HMAC_Init_ex(key->mac_ctx, nullptr, 0, nullptr, nullptr);
-    HMAC_Update(key->mac_ctx, ivec, _ivLength);
-    HMAC_Update(key->mac_ctx, md, 8);
-    HMAC_Final(key->mac_ctx, md, &mdLen);
+    // equivalent to HMAC(key, IVData || seed), starting from the pre-keyed
+    // states computed by initIVHash
+    EVP_MD_CTX_copy_ex(ctx->md_tmp, ctx->iv_inner);
+    EVP_DigestUpdate(ctx->md_tmp, seedBuf, sizeof(seedBuf));
+    EVP_DigestFinal_ex(ctx->md_tmp, md, &mdLen);
+    EVP_MD_CTX_copy_ex(ctx->md_tmp, ctx->iv_outer);
+    EVP_DigestUpdate(ctx->md_tmp, md, mdLen);
+    EVP_DigestFinal_ex(ctx->md_tmp, md, &mdLen);
     rAssert(mdLen >= _ivLength);
 
     memcpy(ivec, md, _ivLength);
@@ -624,7 +1537,7 @@ void SSL_Cipher::setIVec(unsigned char* ivec, uint64_t seed,
 }
 
 void SSL_Cipher::setIVec_old(unsigned char* ivec, unsigned int seed,
-    const std::shared_ptr<SSLKey>& key) const {
+    const SSLKey* key) const {
   unsigned int var1 = 0x060a4011 * seed;
   unsigned int var2 = 0x0221040d * (seed ^ 0xD3FEA11C);
 
@@ -651,63 +1564,37 @@ void SSL_Cipher::setIVec_old(unsigned char* ivec, unsigned int seed,
   }
 }
 
-static void flipBytes(unsigned char* buf, int size) {
-  unsigned char revBuf[64];
-
-  int bytesLeft = size;
-  while (bytesLeft != 0) {
-    int toFlip = std::min<int>(sizeof(revBuf), bytesLeft);
-
-    for (int i = 0; i < toFlip; ++i) {
-      revBuf[i] = buf[toFlip - (i+1)];
-    }
-
-    memcpy(buf, revBuf, toFlip);
-    bytesLeft -= toFlip;
-    buf += toFlip;
-  }
-
-  memset(revBuf, 0, sizeof(revBuf));
-}
-
-static void shuffleBytes(unsigned char* buf, int size) {
-  for (int i = 0; i < size - 1; ++i) {
-    buf[i+1] ^= buf[i];
-  }
-}
-
-static void unshuffleBytes(unsigned char* buf, int size) {
-  for (int i = size-1; i != 0; --i) {
-    buf[i] ^= buf[i-1];
-  }
-}
-
 bool SSL_Cipher::streamEncode(unsigned char* buf, int size, uint64_t iv64,
     const CipherKey& ckey) const {
   rAssert(size > 0);
-  std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
+  SSLKey* key = sslKey(ckey);
   rAssert(key->keySize == _keySize);
   rAssert(key->ivLength == _ivLength);
 
-  Lock lock(key->mutex);
+  SSLContextLease ctx(key);
+  return streamEncodeWith(buf, size, iv64, key, ctx.get());
+}
 
+bool SSL_Cipher::streamEncodeWith(unsigned char* buf, int size,
+                                  uint64_t iv64, SSLKey* key,
+                                  SSLContextSet* ctx) const {
   unsigned char ivec[MAX_IVLENGTH];
   int dstLen = 0, tmpLen = 0;
 
   shuffleBytes(buf, size);
 
-  setIVec(ivec, iv64, key);
-  EVP_EncryptInit_ex(key->stream_enc, nullptr, nullptr, nullptr, ivec);
-  EVP_EncryptUpdate(key->stream_enc, buf, &dstlen, buf, size);
-  EVP_EncryptFinal_ex(key->stream_enc, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64, key, ctx);
+  EVP_EncryptInit_ex(ctx->stream_enc, nullptr, nullptr, nullptr, ivec);
+  EVP_EncryptUpdate(ctx->stream_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(ctx->stream_enc, buf + dstLen, &tmpLen);
 
   flipBytes(buf, size);
   shuffleBytes(buf, size);
 
-  setIVec(ivec, iv64+1, key);
-  EVP_EncryptInit_ex(key->stream_enc, nullptr, nullptr, nullptr, ivec);
-  EVP_EncryptUpdate(key->stream_enc, buf, &dstLen, buf, size);
-  EVP_EncryptFinal_ex(key->stream_enc, buf+dstLen, &tmpLen);
+  setIVec(ivec, iv64 + 1, key, ctx);
+  EVP_EncryptInit_ex(ctx->stream_enc, nullptr, nullptr, nullptr, ivec);
+  EVP_EncryptUpdate(ctx->stream_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(ctx->stream_enc, buf+dstLen, &tmpLen);
 
   dstLen += tmpLen;
   if (dstLen != size) {
@@ -721,27 +1608,113 @@ bool SSL_Cipher::streamEncode(unsigned char* buf, int size, uint64_t iv64,
 bool SSL_Cipher::streamDecode(unsigned char* buf, int size, uint64_t iv64,
     const Cipherkey& ckey) const {
   rAssert(size > 0);
-  std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
+  SSLKey* key = sslKey(ckey);
   rAssert(key->keySize == _keySize);
   rAssert(key->ivLength == _ivLength);
 
-  Lock lock(key->mutex);
+  SSLContextLease ctx(key);
+  return streamDecodeWith(buf, size, iv64, key, ctx.get());
+}
 
+bool SSL_Cipher::streamDecodeWith(unsigned char* buf, int size,
+                                  uint64_t iv64, SSLKey* key,
+                                  SSLContextSet* ctx) const {
   unsigned char ivec[MAX_IVLENGTH];
   int dstLen = 0, tmpLen = 0;
 
-  setIVec(ivec, iv64 + 1, key);
-  EVP_DecryptInit_ex(key->stream_dec, nullptr, nullptr, nullptr, ivec);
-  EVP_DecryptUpdate(key->stream_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(key->stream_dec, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64 + 1, key, ctx);
+  EVP_DecryptInit_ex(ctx->stream_dec, nullptr, nullptr, nullptr, ivec);
+  EVP_DecryptUpdate(ctx->stream_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(ctx->stream_dec, buf + dstLen, &tmpLen);
 
   unshuffleBytes(buf, size);
   flipBytes(buf, size);
 
-  setIVec(ivec, iv64, key);
-  EVP_DecryptInit_ex(key->stream_dec, nullptr, nullptr, nullptr, ivec);
-  EVP_DecryptUpdate(key->stream_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(key->stream_dec, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64, key, ctx);
+  EVP_DecryptInit_ex(ctx->stream_dec, nullptr, nullptr, nullptr, ivec);
+  EVP_DecryptUpdate(ctx->stream_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(ctx->stream_dec, buf + dstLen, &tmpLen);
+
+  unshuffleBytes(buf, size);
+
+  dstLen += tmpLen;
+  if (dstLen != size) {
+    RLOG(ERROR) << "decoding " << size << " bytes, got back " << dstLen << " ("
+                << tmpLen << " in final_ex)";
+    return false;
+  }
+
+  return true;
+
+}
+
+/*
+    With single pass names, the name is shuffled and encrypted once.  The
+    IV is derived from iv64, which includes the name's MAC, so that a
+    change anywhere in the name still changes every byte of the output
+    without the second pass; two names only share a prefix of output when
+    their MACs collide under the same directory IV.
+ */
+bool SSL_Cipher::nameEncode(unsigned char* buf, int size, uint64_t iv64,
+    const CipherKey& ckey) const {
+  rAssert(size > 0);
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
+
+  SSLContextLease ctx(key);
+  return nameEncodeWith(buf, size, iv64, key, ctx.get());
+}
+
+bool SSL_Cipher::nameEncodeWith(unsigned char* buf, int size, uint64_t iv64,
+                                SSLKey* key, SSLContextSet* ctx) const {
+  if (!_singlePassNames) {
+    return streamEncodeWith(buf, size, iv64, key, ctx);
+  }
+
+  unsigned char ivec[MAX_IVLENGTH];
+  int dstLen = 0, tmpLen = 0;
+
+  shuffleBytes(buf, size);
+
+  setIVec(ivec, iv64, key, ctx);
+  EVP_EncryptInit_ex(ctx->stream_enc, nullptr, nullptr, nullptr, ivec);
+  EVP_EncryptUpdate(ctx->stream_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(ctx->stream_enc, buf + dstLen, &tmpLen);
+
+  dstLen += tmpLen;
+  if (dstLen != size) {
+    RLOG(ERROR) << "encoding " << size << " bytes, got back " << dstLen << " ("
+                << tmpLen << " in final_ex)";
+    return false;
+  }
+  return true;
+}
+
+bool SSL_Cipher::nameDecode(unsigned char* buf, int size, uint64_t iv64,
+    const CipherKey& ckey) const {
+  rAssert(size > 0);
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
+
+  SSLContextLease ctx(key);
+  return nameDecodeWith(buf, size, iv64, key, ctx.get());
+}
+
+bool SSL_Cipher::nameDecodeWith(unsigned char* buf, int size, uint64_t iv64,
+                                SSLKey* key, SSLContextSet* ctx) const {
+  if (!_singlePassNames) {
+    return streamDecodeWith(buf, size, iv64, key, ctx);
+  }
+
+  unsigned char ivec[MAX_IVLENGTH];
+  int dstLen = 0, tmpLen = 0;
+
+  setIVec(ivec, iv64, key, ctx);
+  EVP_DecryptInit_ex(ctx->stream_dec, nullptr, nullptr, nullptr, ivec);
+  EVP_DecryptUpdate(ctx->stream_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(ctx->stream_dec, buf + dstLen, &tmpLen);
 
   unshuffleBytes(buf, size);
 
@@ -751,35 +1724,73 @@ bool SSL_Cipher::streamDecode(unsigned char* buf, int size, uint64_t iv64,
                 << tmpLen << " in final_ex)";
     return false;
   }
+  return true;
+}
+
+/*
+    Batch versions of nameEncode / nameDecode, on one context set.
+ */
+bool SSL_Cipher::nameEncodeBatch(const BlockRequest* names, int count,
+                                 const CipherKey& ckey) const {
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
 
+  SSLContextLease ctx(key);
+  for (int i = 0; i < count; ++i) {
+    rAssert(names[i].size > 0);
+    if (!nameEncodeWith(names[i].buf, names[i].size, names[i].iv64, key,
+                        ctx.get())) {
+      return false;
+    }
+  }
   return true;
+}
+
+bool SSL_Cipher::nameDecodeBatch(const BlockRequest* names, int count,
+                                 const CipherKey& ckey) const {
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
 
+  SSLContextLease ctx(key);
+  for (int i = 0; i < count; ++i) {
+    rAssert(names[i].size > 0);
+    if (!nameDecodeWith(names[i].buf, names[i].size, names[i].iv64, key,
+                        ctx.get())) {
+      return false;
+    }
+  }
+  return true;
 }
 
 bool SSL_Cipher::blockEncode(unsigned char *buf, int size, uint64_t iv64,
                              const CipherKey &ckey) const {
   rAssert(size > 0);
-  std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
+  SSLKey* key = sslKey(ckey);
   rAssert(key->keySize == _keySize);
   rAssert(key->ivLength == _ivLength);
 
   // data must be integer number of blocks
-  const int blockMod = size % EVP_CIPHER_CTX_block_size(key->block_enc);
+  const int blockMod = size % cipherBlockSize();
   if (blockMod != 0) {
     RLOG(ERROR) << "Invalid data size, not multiple of block size";
     return false;
   }
 
-  Lock lock(key->mutex);
+  SSLContextLease ctx(key);
 
   unsigned char ivec[MAX_IVLENGTH];
 
   int dstLen = 0, tmpLen = 0;
-  setIVec(ivec, iv64, key);
+  setIVec(ivec, iv64, key, ctx.get());
+  if (key->kernel) {
+    return key->kernel->encode(buf, size, ivec);
+  }
 
-  EVP_EncryptInit_ex(key->block_enc, nullptr, nullptr, nullptr, ivec);
-  EVP_EncryptUpdate(key->block_enc, buf, &dstLen, buf, size);
-  EVP_EncryptFinal_ex(key->block_enc, buf + dstLen, &tmpLen);
+  EVP_EncryptInit_ex(ctx->block_enc, nullptr, nullptr, nullptr, ivec);
+  EVP_EncryptUpdate(ctx->block_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(ctx->block_enc, buf + dstLen, &tmpLen);
   dstLen += tmpLen;
 
   if (dstLen != size) {
@@ -794,27 +1805,30 @@ bool SSL_Cipher::blockEncode(unsigned char *buf, int size, uint64_t iv64,
 bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
                              const CipherKey &ckey) const {
   rAssert(size > 0);
-  std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
+  SSLKey* key = sslKey(ckey);
   rAssert(key->keySize == _keySize);
   rAssert(key->ivLength == _ivLength);
 
   // data must be integer number of blocks
-  const int blockMod = size % EVP_CIPHER_CTX_block_size(key->block_dec);
+  const int blockMod = size % cipherBlockSize();
   if (blockMod != 0) {
     RLOG(ERROR) << "Invalid data size, not multiple of block size";
     return false;
   }
 
-  Lock lock(key->mutex);
+  SSLContextLease ctx(key);
 
   unsigned char ivec[MAX_IVLENGTH];
 
   int dstLen = 0, tmpLen = 0;
-  setIVec(ivec, iv64, key);
+  setIVec(ivec, iv64, key, ctx.get());
+  if (key->kernel) {
+    return key->kernel->decode(buf, size, ivec);
+  }
 
-  EVP_DecryptInit_ex(key->block_dec, nullptr, nullptr, nullptr, ivec);
-  EVP_DecryptUpdate(key->block_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(key->block_dec, buf + dstLen, &tmpLen);
+  EVP_DecryptInit_ex(ctx->block_dec, nullptr, nullptr, nullptr, ivec);
+  EVP_DecryptUpdate(ctx->block_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(ctx->block_dec, buf + dstLen, &tmpLen);
   dstLen += tmpLen;
 
   if (dstLen != size) {
@@ -826,6 +1840,192 @@ bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
   return true;
 }
 
+/*
+    Batch versions of blockEncode / blockDecode.  A single context set is
+    borrowed for the whole batch, and the cipher is only re-initialised with
+    each block's IV rather than looked up and validated per block.
+ */
+bool SSL_Cipher::blockEncodeBatch(const BlockRequest* blocks, int count,
+                                  const CipherKey& ckey) const {
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
+
+  const int cipherBlock = cipherBlockSize();
+
+  SSLContextLease ctx(key);
+
+  unsigned char ivec[MAX_IVLENGTH];
+
+  for (int i = 0; i < count; ++i) {
+    unsigned char* buf = blocks[i].buf;
+    int size = blocks[i].size;
+    rAssert(size > 0);
+
+    if (size % cipherBlock != 0) {
+      RLOG(ERROR) << "Invalid data size, not multiple of block size";
+      return false;
+    }
+
+    int dstLen = 0, tmpLen = 0;
+    setIVec(ivec, blocks[i].iv64, key, ctx.get());
+    if (key->kernel) {
+      if (!key->kernel->encode(buf, size, ivec)) {
+        return false;
+      }
+      continue;
+    }
+
+    EVP_EncryptInit_ex(ctx->block_enc, nullptr, nullptr, nullptr, ivec);
+    EVP_EncryptUpdate(ctx->block_enc, buf, &dstLen, buf, size);
+    EVP_EncryptFinal_ex(ctx->block_enc, buf + dstLen, &tmpLen);
+    dstLen += tmpLen;
+
+    if (dstLen != size) {
+      RLOG(ERROR) << "encoding " << size << " bytes, got back " << dstLen
+                  << " (" << tmpLen << " in final_ex)";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool SSL_Cipher::blockDecodeBatch(const BlockRequest* blocks, int count,
+                                  const CipherKey& ckey) const {
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
+
+  const int cipherBlock = cipherBlockSize();
+
+  SSLContextLease ctx(key);
+
+  unsigned char ivec[MAX_IVLENGTH];
+
+  for (int i = 0; i < count; ++i) {
+    unsigned char* buf = blocks[i].buf;
+    int size = blocks[i].size;
+    rAssert(size > 0);
+
+    if (size % cipherBlock != 0) {
+      RLOG(ERROR) << "Invalid data size, not multiple of block size";
+      return false;
+    }
+
+    int dstLen = 0, tmpLen = 0;
+    setIVec(ivec, blocks[i].iv64, key, ctx.get());
+    if (key->kernel) {
+      if (!key->kernel->decode(buf, size, ivec)) {
+        return false;
+      }
+      continue;
+    }
+
+    EVP_DecryptInit_ex(ctx->block_dec, nullptr, nullptr, nullptr, ivec);
+    EVP_DecryptUpdate(ctx->block_dec, buf, &dstLen, buf, size);
+    EVP_DecryptFinal_ex(ctx->block_dec, buf + dstLen, &tmpLen);
+    dstLen += tmpLen;
+
+    if (dstLen != size) {
+      RLOG(ERROR) << "decoding " << size << " bytes, got back " << dstLen
+                  << " (" << tmpLen << " in final_ex)";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int SSL_Cipher::aeadHeaderSize() const {
+  return _aeadCipher != nullptr ? AEAD_NONCE_BYTES + AEAD_TAG_BYTES : 0;
+}
+
+static void aeadPosition(uint64_t iv64, unsigned char* aad) {
+  for (int i = 0; i < 8; ++i) {
+    aad[i] = (unsigned char)(iv64 & 0xff);
+    iv64 >>= 8;
+  }
+}
+
+/*
+    Seal one block with a fresh random nonce.  iv64 is authenticated as
+    additional data, which binds the block to its position in the file (and to
+    the file, when per-file IVs are enabled).
+    dst receives [nonce | tag | ciphertext].
+ */
+bool SSL_Cipher::aeadEncode(const unsigned char* src, int size, uint64_t iv64,
+                            unsigned char* dst, const CipherKey& ckey) const {
+  rAssert(size > 0);
+  rAssert(_aeadCipher != nullptr);
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+
+  unsigned char* nonce = dst;
+  unsigned char* tag = dst + AEAD_NONCE_BYTES;
+  unsigned char* out = dst + AEAD_NONCE_BYTES + AEAD_TAG_BYTES;
+
+  if (!randomize(nonce, AEAD_NONCE_BYTES, false)) {
+    return false;
+  }
+
+  unsigned char aad[8];
+  aeadPosition(iv64, aad);
+
+  SSLContextLease ctx(key);
+
+  int dstLen = 0, tmpLen = 0;
+  EVP_EncryptInit_ex(ctx->aead_enc, nullptr, nullptr, nullptr, nonce);
+  EVP_EncryptUpdate(ctx->aead_enc, nullptr, &tmpLen, aad, sizeof(aad));
+  EVP_EncryptUpdate(ctx->aead_enc, out, &dstLen, src, size);
+  EVP_EncryptFinal_ex(ctx->aead_enc, out + dstLen, &tmpLen);
+  dstLen += tmpLen;
+
+  if (dstLen != size ||
+      EVP_CIPHER_CTX_ctrl(ctx->aead_enc, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_BYTES,
+                          tag) != 1) {
+    RLOG(ERROR) << "authenticated encoding of " << size << " bytes failed";
+    return false;
+  }
+
+  return true;
+}
+
+/*
+    Open a block sealed by aeadEncode.  src holds [nonce | tag | ciphertext]
+    where the ciphertext is size bytes, and the plaintext is written to dst.
+    Returns false if the block fails authentication.
+ */
+bool SSL_Cipher::aeadDecode(const unsigned char* src, int size, uint64_t iv64,
+                            unsigned char* dst, const CipherKey& ckey) const {
+  rAssert(size > 0);
+  rAssert(_aeadCipher != nullptr);
+  SSLKey* key = sslKey(ckey);
+  rAssert(key->keySize == _keySize);
+
+  const unsigned char* nonce = src;
+  const unsigned char* tag = src + AEAD_NONCE_BYTES;
+  const unsigned char* in = src + AEAD_NONCE_BYTES + AEAD_TAG_BYTES;
+
+  unsigned char aad[8];
+  aeadPosition(iv64, aad);
+
+  SSLContextLease ctx(key);
+
+  int dstLen = 0, tmpLen = 0;
+  EVP_DecryptInit_ex(ctx->aead_dec, nullptr, nullptr, nullptr, nonce);
+  EVP_DecryptUpdate(ctx->aead_dec, nullptr, &tmpLen, aad, sizeof(aad));
+  EVP_DecryptUpdate(ctx->aead_dec, dst, &dstLen, in, size);
+  EVP_CIPHER_CTX_ctrl(ctx->aead_dec, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_BYTES,
+                      const_cast<unsigned char*>(tag));
+  if (EVP_DecryptFinal_ex(ctx->aead_dec, dst + dstLen, &tmpLen) <= 0) {
+    VLOG(1) << "authentication failure decoding " << size << " bytes";
+    return false;
+  }
+
+  return true;
+}
+
 bool SSL_Cipher::Enabled() { return true; }
 
 
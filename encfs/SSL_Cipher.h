@@ -15,6 +15,9 @@ using EVP_CIPHER = struct evp_cipher_st;
 #endif
 
 namespace encfs {
+    class SSLKey;
+    struct SSLContextSet;
+
     /*
         Implements Cipher interface for OpenSSL's ciphers.
     Design:
@@ -46,6 +49,13 @@ namespace encfs {
     is to try and propogate any changed bits to a larger set. If only a single
     pass was made with the stream cipher in CFB mode, then a change to one byte
     may only affect one byte of output, allowing some XOR attacks.
+
+    Filenames need less: their IV already carries a MAC of the name, so
+    any change to the name changes the IV and with it every byte of the
+    output.  From version 5 of "ssl/aes", "ssl/blowfish" and
+    "ssl/camellia" names are coded with steps 1 and 2 only, at half the
+    cost.  Partial blocks keep both passes, as their IV only depends on
+    the block number.
      */
 
     class SSL_Cipher : public Cipher {
@@ -53,13 +63,17 @@ namespace encfs {
         Interface realIface;
         const EVP_CIPHER *_blockCipher;
         const EVP_CIPHER *_streamCipher;
+        // authenticated mode used for file blocks, or nullptr
+        const EVP_CIPHER *_aeadCipher;
         unsigned int _keySize;
         unsigned int _ivLength;
+        // names are coded in one pass, see nameEncode
+        bool _singlePassNames;
 
         public:
             SSL_Cipher(const Interface& iface, const Interface& realIface,
                        const EVP_CIPHER* blockCipher, const EVP_CIPHER* streamCipher,
-                       int keyLength);
+                       int keyLength, const EVP_CIPHER* aeadCipher = nullptr);
             virtual ~SSL_Cipher();
 
             // returns the real interface, not the one we're emulating (if any)
@@ -70,6 +84,15 @@ namespace encfs {
                                      int& iterationCount, long desiredDuration,
                                      const unsigned char* salt, int saltLen);
 
+            virtual CipherKey newArgon2Key(const char* password, int passwdLength,
+                                           int& passes, int memoryKiB, int lanes,
+                                           long desiredDuration,
+                                           const unsigned char* salt, int saltLen);
+            virtual bool hasArgon2() const;
+
+            virtual Interface volumeInterface(int blockSize,
+                                              bool newFormats) const;
+
             // deprecated - for backward compatibility
             virtual CipherKey newKey(const char* password, int passwdLength);
             // create a new random key
@@ -91,6 +114,17 @@ namespace encfs {
 
             virtual uint64_t MAC_64(const unsigned char* src, int len,
                                     const CipherKey& key, uint64_t* augment) const;
+            virtual uint64_t FastMAC_64(const unsigned char* src, int len,
+                                        uint64_t nonce,
+                                        const CipherKey& key) const;
+            // SipHash of buffers of equal length four at a time
+            virtual void FastMACBatch(const MACRequest* blocks, int count,
+                                      uint64_t* macs,
+                                      const CipherKey& key) const;
+            // MAC_64 of each buffer on one context set
+            virtual void MACBatch(const ChainedMACRequest* blocks, int count,
+                                  uint64_t* macs,
+                                  const CipherKey& key) const;
 
             // functional interfaces
             /*
@@ -98,17 +132,70 @@ namespace encfs {
              */
             virtual bool streamEncode(unsigned char* in, int len, uint64_t iv64,
                                       const CipherKey& key) const;
-            virtual bool streamDecode(unsigned char8 in, int len, uint64_t iv64,
+            virtual bool streamDecode(unsigned char* in, int len, uint64_t iv64,
                                       const CipherKey& key) const;
 
+            virtual bool nameEncode(unsigned char* in, int len, uint64_t iv64,
+                                    const CipherKey& key) const;
+            virtual bool nameDecode(unsigned char* in, int len, uint64_t iv64,
+                                    const CipherKey& key) const;
+            // encode / decode a batch of names using one set of contexts
+            virtual bool nameEncodeBatch(const BlockRequest* names, int count,
+                                         const CipherKey& key) const;
+            virtual bool nameDecodeBatch(const BlockRequest* names, int count,
+                                         const CipherKey& key) const;
+
             /*
                 Block encoding is done in-place. Partial blocks are supported, but
                 block are always expected to begin on a block boundary. See blockSize()
              */
             virtual bool blockEncode(unsigned char* buf, int size, uint64_t iv64,
                                      const CipherKey& key) const;
-            virtual bool blockDecode(unsigned char* ivec, unsigned int seed,
-                                     const std::shared_ptr<SSLKey>& key) const;
+            virtual bool blockDecode(unsigned char* buf, int size, uint64_t iv64,
+                                     const CipherKey& key) const;
+
+            // encode / decode a batch of blocks using one set of contexts
+            virtual bool blockEncodeBatch(const BlockRequest* blocks, int count,
+                                          const CipherKey& key) const;
+            virtual bool blockDecodeBatch(const BlockRequest* blocks, int count,
+                                          const CipherKey& key) const;
+
+            virtual int aeadHeaderSize() const;
+            virtual bool aeadEncode(const unsigned char* src, int size,
+                                    uint64_t iv64, unsigned char* dst,
+                                    const CipherKey& key) const;
+            virtual bool aeadDecode(const unsigned char* src, int size,
+                                    uint64_t iv64, unsigned char* dst,
+                                    const CipherKey& key) const;
+
+            // hack to help with static builds
+            static bool Enabled();
+
+            // SipHash-2-4 of (nonce as 8 little-endian bytes || data) under
+            // key, the hash FastMAC_64 takes with the key of a CipherKey
+            static uint64_t SipHash_64(const uint64_t key[2], uint64_t nonce,
+                                       const unsigned char* data, int len);
+
+        private:
+            // ivec is derived using the HMAC context of the borrowed context
+            // set, so callers must already hold one from the key's pool
+            void setIVec(unsigned char* ivec, uint64_t seed,
+                         const SSLKey* key, SSLContextSet* ctx) const;
+
+            // deprecated - for backward compatibility
+            void setIVec_old(unsigned char* ivec, unsigned int seed,
+                             const SSLKey* key) const;
+
+            // the stream and name codings, on a context set the caller
+            // holds
+            bool streamEncodeWith(unsigned char* buf, int size, uint64_t iv64,
+                                  SSLKey* key, SSLContextSet* ctx) const;
+            bool streamDecodeWith(unsigned char* buf, int size, uint64_t iv64,
+                                  SSLKey* key, SSLContextSet* ctx) const;
+            bool nameEncodeWith(unsigned char* buf, int size, uint64_t iv64,
+                                SSLKey* key, SSLContextSet* ctx) const;
+            bool nameDecodeWith(unsigned char* buf, int size, uint64_t iv64,
+                                SSLKey* key, SSLContextSet* ctx) const;
     };
 }
 
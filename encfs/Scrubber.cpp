@@ -0,0 +1,405 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Scrubber.h"
+
+#include "easylogging++.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Cipher.h"
+#include "Context.h"
+#include "DirNode.h"
+#include "Error.h"
+#include "FSConfig.h"
+#include "FileNode.h"
+#include "Mutex.h"
+#include "OpStats.h"
+#include "ThreadPool.h"
+
+namespace encfs {
+
+// bytes read at a time, rounded down to whole blocks; small enough that
+// a paused scrub gets out of the way quickly
+static const size_t ScrubRunSize = 256 * 1024;
+// files changed more recently than this are left for the next pass
+static const int ScrubColdSecs = 3600;
+// the rest between the end of a pass and the start of the next
+static const int ScrubRestSecs = 24 * 3600;
+// how often the state is saved during a pass
+static const uint64_t ScrubSaveNs = 60 * 1000000000ULL;
+// how often a detached mount is looked at again
+static const int ScrubDetachedSecs = 10;
+
+Scrubber::Scrubber(EncFS_Context *ctx, uint64_t bytesPerSecond, int idleSecs,
+                   const std::string &statePath)
+    : _ctx(ctx),
+      _rate(bytesPerSecond),
+      _idleSecs(idleSecs),
+      _statePath(statePath),
+      _stopping(false),
+      _running(false),
+      _savedAt(0),
+      _files(0),
+      _bytes(0),
+      _badBlocks(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_cond_init(&_wake, nullptr);
+}
+
+Scrubber::~Scrubber() {
+  stop();
+  pthread_cond_destroy(&_wake);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool Scrubber::start() {
+  int res = pthread_create(&_thread, nullptr, run, this);
+  if (res != 0) {
+    RLOG(ERROR) << "error starting scrub thread: " << strerror(res);
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+void Scrubber::stop() {
+  if (_running) {
+    {
+      Lock lock(_mutex);
+      _stopping = true;
+      pthread_cond_signal(&_wake);
+    }
+    pthread_join(_thread, nullptr);
+    _running = false;
+  }
+}
+
+void *Scrubber::run(void *arg) {
+#ifdef __linux__
+  // nice and the idle I/O class apply to the calling thread only on Linux
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+  const int IOPRIO_WHO_PROCESS = 1;
+  const int IOPRIO_CLASS_IDLE = 3;
+  const int IOPRIO_CLASS_SHIFT = 13;
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+#endif
+  // what the scrub decodes on the crypto pool waits behind the mount's users
+  ThreadPool::LaneScope lane(ThreadPool::Background);
+  ((Scrubber *)arg)->scrub();
+  VLOG(1) << "scrub thread exiting";
+  return nullptr;
+}
+
+bool Scrubber::wait(uint64_t ns) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  uint64_t at = (uint64_t)now.tv_sec * 1000000000ULL +
+                (uint64_t)now.tv_usec * 1000 + ns;
+  struct timespec wakeupTime;
+  wakeupTime.tv_sec = at / 1000000000ULL;
+  wakeupTime.tv_nsec = at % 1000000000ULL;
+
+  Lock lock(_mutex);
+  while (!_stopping) {
+    if (pthread_cond_timedwait(&_wake, &_mutex, &wakeupTime) == ETIMEDOUT) {
+      break;
+    }
+  }
+  return !_stopping;
+}
+
+bool Scrubber::pause(uint64_t ns) {
+  if (ns > 0 && !wait(ns)) {
+    return false;
+  }
+  for (;;) {
+    uint64_t waitSecs = 0;
+    if (!_ctx->currentRoot()) {
+      waitSecs = ScrubDetachedSecs;
+    } else if (_idleSecs > 0) {
+      int64_t idle = _ctx->idleSeconds();
+      if (idle < _idleSecs) {
+        waitSecs = _idleSecs - idle;
+      }
+    }
+    if (waitSecs == 0) {
+      Lock lock(_mutex);
+      return !_stopping;
+    }
+    if (!wait(waitSecs * 1000000000ULL)) {
+      return false;
+    }
+  }
+}
+
+std::string Scrubber::loadState(const std::shared_ptr<DirNode> &root) {
+  if (_statePath.empty()) {
+    return std::string();
+  }
+  FILE *in = fopen(_statePath.c_str(), "r");
+  if (in == nullptr) {
+    return std::string();
+  }
+  char line[PATH_MAX + 2];
+  std::string cipherPath;
+  if (fgets(line, sizeof(line), in) != nullptr) {
+    cipherPath = line;
+    if (!cipherPath.empty() && cipherPath.back() == '\n') {
+      cipherPath.pop_back();
+    }
+  }
+  fclose(in);
+
+  // a path that no longer decodes, as after the volume was replaced,
+  // starts the pass over
+  return cipherPath.empty() ? cipherPath : root->plainPath(cipherPath.c_str());
+}
+
+void Scrubber::saveState(const std::shared_ptr<DirNode> &root,
+                         const std::string &plainPath, bool force) {
+  if (_statePath.empty()) {
+    return;
+  }
+  uint64_t now = OpStats::now();
+  if (!force && now - _savedAt < ScrubSaveNs) {
+    return;
+  }
+  _savedAt = now;
+
+  std::string cipherPath;
+  if (!plainPath.empty()) {
+    cipherPath = root->cipherPathWithoutRoot(plainPath.c_str());
+  }
+  // written aside and renamed, so that a crash leaves the old state
+  std::string tmp = _statePath + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    RLOG(WARNING) << "unable to save scrub state " << tmp << ": "
+                  << strerror(errno);
+    return;
+  }
+  cipherPath += '\n';
+  bool ok = ::write(fd, cipherPath.data(), cipherPath.length()) ==
+            (ssize_t)cipherPath.length();
+  ok = (::close(fd) == 0) && ok;
+  if (!ok || ::rename(tmp.c_str(), _statePath.c_str()) != 0) {
+    RLOG(WARNING) << "unable to save scrub state " << _statePath << ": "
+                  << strerror(errno);
+    ::unlink(tmp.c_str());
+  }
+}
+
+bool Scrubber::scrubFile(const std::shared_ptr<DirNode> &root,
+                         const std::string &plainPath) {
+  // what the mount has open may be in the middle of a change
+  if (_ctx->lookupNode(plainPath.c_str())) {
+    return true;
+  }
+  std::string cpath = root->cipherPath(plainPath.c_str());
+  struct stat before;
+  if (lstat(cpath.c_str(), &before) != 0 ||
+      before.st_mtime > time(nullptr) - ScrubColdSecs) {
+    return true;
+  }
+
+  std::shared_ptr<FileNode> node = root->lookupNode(plainPath.c_str(), "scrub");
+  int res = node ? node->open(O_RDONLY) : -ENOENT;
+  if (res < 0) {
+    RLOG(ERROR) << "scrub: unable to open " << cpath << ": "
+                << strerror(-res);
+    return true;
+  }
+
+  const FSConfigPtr &cfg = root->config();
+  bool readData =
+      cfg->config->blockMACBytes != 0 || cfg->cipher->aeadHeaderSize() > 0;
+  off_t blockSize = std::max(node->blockSize(), 1u);
+  off_t size = node->getSize();
+  if (!readData) {
+    // decoding the first block decodes the header of the file
+    size = std::min(size, blockSize);
+  }
+  std::vector<unsigned char> buf(
+      std::max(ScrubRunSize / blockSize, (size_t)1) * blockSize);
+
+  std::vector<off_t> bad;
+  for (off_t offset = 0; offset < size; offset += buf.size()) {
+    size_t len = (size_t)std::min((off_t)buf.size(), size - offset);
+    if (!pause(_rate.reserve(len))) {
+      return false;
+    }
+    if (node->read(offset, buf.data(), len) != (ssize_t)len) {
+      // find the blocks of the run that fail
+      for (off_t block = offset; block < offset + (off_t)len;
+           block += blockSize) {
+        size_t n = (size_t)std::min(blockSize, offset + (off_t)len - block);
+        if (node->read(block, buf.data(), n) != (ssize_t)n) {
+          bad.push_back(block / blockSize);
+        }
+      }
+    }
+    _bytes += len;
+  }
+  node.reset();
+
+  // a file changed or opened while it was read proves nothing
+  struct stat after;
+  if (!bad.empty() && lstat(cpath.c_str(), &after) == 0 &&
+      after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+      after.st_mtim.tv_nsec == before.st_mtim.tv_nsec &&
+      after.st_size == before.st_size &&
+      !_ctx->lookupNode(plainPath.c_str())) {
+    for (off_t block : bad) {
+      RLOG(ERROR) << "scrub: corrupt block " << block << " of " << cpath;
+    }
+    _badBlocks += bad.size();
+  }
+  ++_files;
+  return true;
+}
+
+bool Scrubber::scrubDir(const std::shared_ptr<DirNode> &root,
+                        const std::string &dir) {
+  std::string prefix = dir == "/" ? dir : dir + '/';
+
+  std::vector<std::pair<std::string, int>> entries;
+  {
+    DirTraverse dt = root->openDir(dir.c_str());
+    int fileType = 0;
+    for (std::string name = dt.nextPlaintextName(&fileType); !name.empty();
+         name = dt.nextPlaintextName(&fileType)) {
+      if (name != "." && name != "..") {
+        entries.push_back(std::make_pair(name, fileType));
+      }
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+
+  for (const std::pair<std::string, int> &entry : entries) {
+    const std::string &name = entry.first;
+    std::string plainPath = prefix + name;
+
+    // while resuming, _resume is below dir: skip what sorts before the
+    // name it has at this level, and the file itself
+    if (!_resume.empty()) {
+      size_t end = _resume.find('/', prefix.length());
+      std::string at = _resume.substr(
+          prefix.length(),
+          end == std::string::npos ? end : end - prefix.length());
+      if (name < at) {
+        continue;
+      }
+      if (name == at && end == std::string::npos) {
+        _resume.clear();
+        continue;
+      }
+      if (name != at) {
+        _resume.clear();
+      }
+    }
+
+    int fileType = entry.second;
+    if (fileType == DT_UNKNOWN) {
+      struct stat st;
+      std::string cpath = root->cipherPath(plainPath.c_str());
+      if (lstat(cpath.c_str(), &st) != 0) {
+        continue;
+      }
+      fileType = IFTODT(st.st_mode);
+    }
+
+    if (fileType == DT_DIR) {
+      if (!scrubDir(root, plainPath)) {
+        return false;
+      }
+    } else {
+      // what was resumed into is no longer a directory
+      _resume.clear();
+      if (fileType == DT_REG && !scrubFile(root, plainPath)) {
+        return false;
+      }
+    }
+    _checked = plainPath;
+    saveState(root, _checked, false);
+  }
+  return true;
+}
+
+void Scrubber::scrub() {
+  while (pause(0)) {
+    std::shared_ptr<DirNode> root = _ctx->currentRoot();
+    if (!root) {
+      continue;
+    }
+
+    _resume = loadState(root);
+    _checked = _resume;
+    _files = 0;
+    _bytes = 0;
+    _badBlocks = 0;
+    uint64_t start = OpStats::now();
+    RLOG(INFO) << "scrub pass "
+               << (_resume.empty() ? "starting" : "resuming");
+
+    bool done;
+    try {
+      done = scrubDir(root, "/");
+    } catch (encfs::Error &err) {
+      RLOG(ERROR) << "scrub error: " << err.what();
+      done = false;
+    }
+    if (!done) {
+      // stopped, or failed: carry on after what was checked last, in the
+      // next mount or after a while
+      saveState(root, _checked, true);
+      root.reset();
+      if (!wait(ScrubDetachedSecs * 1000000000ULL)) {
+        break;
+      }
+      continue;
+    }
+
+    RLOG(INFO) << "scrub pass done in "
+               << (OpStats::now() - start) / 1000000000ULL << "s: " << _files
+               << " files, " << _bytes / (1024 * 1024) << " MiB, "
+               << _badBlocks << " corrupt blocks";
+    _resume.clear();
+    saveState(root, std::string(), true);
+    root.reset();
+
+    if (!wait(ScrubRestSecs * 1000000000ULL)) {
+      break;
+    }
+  }
+}
+
+}  // namespace encfs
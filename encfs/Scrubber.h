@@ -0,0 +1,82 @@
+#ifndef _Scrubber_incl_
+#define _Scrubber_incl_
+
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+#include "RateLimit.h"
+
+namespace encfs {
+
+class DirNode;
+class EncFS_Context;
+
+/*
+    Reads the files of a mounted volume again in the background (--scrub),
+    at a low CPU and I/O priority and a limited rate, so that blocks whose
+    MAC or AEAD tag no longer matches are found before anyone needs them.
+    On volumes without either only the file headers are decoded.  Files
+    open through the mount, or changed within the last hour, are left for
+    the next pass; with an idle threshold, reading only goes on while
+    nothing has used the mount for that long.
+
+    Each directory is walked in sorted order, so that the progress of a
+    pass is a path: the encoded path of the last file checked is kept in a
+    state file, and a later mount carries on from there.  Corrupt blocks are
+    logged by encoded path, never by name.
+ */
+class Scrubber {
+ public:
+  // bytesPerSecond must not be 0.  idleSecs 0 reads whatever the mount is
+  // doing, statePath empty starts every mount from the beginning.
+  Scrubber(EncFS_Context *ctx, uint64_t bytesPerSecond, int idleSecs,
+           const std::string &statePath);
+  ~Scrubber();
+
+  bool start();
+  void stop();
+
+ private:
+  Scrubber(const Scrubber &src);             // not allowed
+  Scrubber &operator=(const Scrubber &src);  // not allowed
+
+  static void *run(void *arg);
+  void scrub();
+
+  // each returns false once the scrubber is stopped
+  bool scrubDir(const std::shared_ptr<DirNode> &root, const std::string &dir);
+  bool scrubFile(const std::shared_ptr<DirNode> &root,
+                 const std::string &plainPath);
+  // waits ns, and then until the mount is attached and idle enough
+  bool pause(uint64_t ns);
+  bool wait(uint64_t ns);
+
+  void saveState(const std::shared_ptr<DirNode> &root,
+                 const std::string &plainPath, bool force);
+  std::string loadState(const std::shared_ptr<DirNode> &root);
+
+  EncFS_Context *_ctx;
+  RateLimit _rate;
+  int _idleSecs;
+  std::string _statePath;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _wake;  // signalled by stop()
+  bool _stopping;
+  bool _running;
+  pthread_t _thread;
+
+  // only touched by the scrubbing thread
+  std::string _resume;   // the path a pass resumes after, until passed
+  std::string _checked;  // the last path checked
+  uint64_t _savedAt;    // OpStats::now() when the state was last saved
+  uint64_t _files;      // counts of the current pass
+  uint64_t _bytes;
+  uint64_t _badBlocks;
+};
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,464 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "StatsServer.h"
+
+#include "easylogging++.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "BlockCache.h"
+#include "Context.h"
+#include "DirNode.h"
+#include "Error.h"
+#include "HotFileCache.h"
+#include "MemoryPool.h"
+#include "Mutex.h"
+#include "OpStats.h"
+#include "PathName.h"
+#include "ThreadPool.h"
+
+namespace encfs {
+
+// how long a report is handed out again
+static const int ReportMs = 1000;
+
+static void header(std::ostringstream &out, const std::string &name,
+                   const char *type, const char *help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+static double seconds(uint64_t ns) { return (double)ns / 1e9; }
+
+// one family of series for the operations or the phases of OpStats
+static void timings(std::ostringstream &out,
+                    const std::vector<OpStats::Summary> &stats,
+                    const std::string &prefix, const char *label, int first,
+                    int last, bool withErrors) {
+  auto series = [&](const std::string &name, int id) -> std::ostringstream & {
+    out << name << "{" << label << "=\"" << OpStats::name((OpStats::Id)id)
+        << "\"} ";
+    return out;
+  };
+
+  header(out, prefix + "_calls_total", "counter", "Calls made.");
+  for (int id = first; id < last; ++id) {
+    series(prefix + "_calls_total", id) << stats[id].calls << "\n";
+  }
+  if (withErrors) {
+    header(out, prefix + "_errors_total", "counter", "Calls that failed.");
+    for (int id = first; id < last; ++id) {
+      series(prefix + "_errors_total", id) << stats[id].errors << "\n";
+    }
+  }
+  header(out, prefix + "_bytes_total", "counter", "Bytes moved or coded.");
+  for (int id = first; id < last; ++id) {
+    series(prefix + "_bytes_total", id) << stats[id].bytes << "\n";
+  }
+
+  std::string duration = prefix + "_duration_seconds";
+  header(out, duration, "summary", "Time taken per call.");
+  for (int id = first; id < last; ++id) {
+    const OpStats::Summary &s = stats[id];
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+      out << duration << "{" << label << "=\"" << OpStats::name((OpStats::Id)id)
+          << "\",quantile=\"" << q << "\"} " << seconds(s.percentile(q))
+          << "\n";
+    }
+    series(duration + "_sum", id) << seconds(s.totalNs) << "\n";
+    series(duration + "_count", id) << s.calls << "\n";
+  }
+  header(out, prefix + "_duration_max_seconds", "gauge",
+         "Longest call so far.");
+  for (int id = first; id < last; ++id) {
+    series(prefix + "_duration_max_seconds", id) << seconds(stats[id].maxNs)
+                                                 << "\n";
+  }
+}
+
+// the sites of LockProfile, with --lock-profile
+static void locks(std::ostringstream &out) {
+  std::vector<LockProfile::Site *> sites;
+  for (LockProfile::Site *site = LockProfile::first(); site != nullptr;
+       site = site->next) {
+    sites.push_back(site);
+  }
+  auto series = [&](const char *name,
+                    const LockProfile::Site *site) -> std::ostringstream & {
+    out << name << "{site=\"" << site->name << "\"} ";
+    return out;
+  };
+  auto load = [](const std::atomic<uint64_t> &v) {
+    return v.load(std::memory_order_relaxed);
+  };
+
+  header(out, "encfs_lock_acquisitions_total", "counter",
+         "Times a lock was taken.");
+  for (auto *site : sites) {
+    series("encfs_lock_acquisitions_total", site) << load(site->acquired)
+                                                  << "\n";
+  }
+  header(out, "encfs_lock_contended_total", "counter",
+         "Times a lock was held by another thread.");
+  for (auto *site : sites) {
+    series("encfs_lock_contended_total", site) << load(site->contended)
+                                               << "\n";
+  }
+  header(out, "encfs_lock_wait_seconds_total", "counter",
+         "Time spent waiting for a lock.");
+  for (auto *site : sites) {
+    series("encfs_lock_wait_seconds_total", site)
+        << seconds(load(site->waitNs)) << "\n";
+  }
+  header(out, "encfs_lock_wait_max_seconds", "gauge",
+         "Longest wait for a lock.");
+  for (auto *site : sites) {
+    series("encfs_lock_wait_max_seconds", site)
+        << seconds(load(site->maxWaitNs)) << "\n";
+  }
+  header(out, "encfs_lock_hold_seconds_total", "counter",
+         "Time a lock was held.");
+  for (auto *site : sites) {
+    series("encfs_lock_hold_seconds_total", site)
+        << seconds(load(site->holdNs)) << "\n";
+  }
+}
+
+static std::string render(EncFS_Context *ctx) {
+  std::vector<OpStats::Summary> stats(OpStats::NumIds);
+  OpStats::snapshot(stats.data());
+
+  std::ostringstream out;
+  timings(out, stats, "encfs_op", "op", 0, OpStats::FirstPhase, true);
+  timings(out, stats, "encfs_phase", "phase", OpStats::FirstPhase,
+          OpStats::NumIds, false);
+
+  uint64_t io[OpStats::NumIoCounters];
+  OpStats::ioSnapshot(io);
+  header(out, "encfs_io_total", "counter",
+         "Calls, blocks and bytes of the layers of the file I/O stack.");
+  for (int i = 0; i < OpStats::NumIoCounters; ++i) {
+    out << "encfs_io_total{counter=\"" << OpStats::ioName(i) << "\"} "
+        << io[i] << "\n";
+  }
+  // backing bytes per byte read or written through the mount
+  uint64_t readBytes = stats[OpStats::Read].bytes;
+  uint64_t writeBytes = stats[OpStats::Write].bytes;
+  header(out, "encfs_read_amplification", "gauge",
+         "Backing file bytes read per byte read.");
+  out << "encfs_read_amplification "
+      << (readBytes ? (double)io[OpStats::RawReadBytes] / readBytes : 0)
+      << "\n";
+  header(out, "encfs_write_amplification", "gauge",
+         "Backing file bytes written per byte written.");
+  out << "encfs_write_amplification "
+      << (writeBytes ? (double)io[OpStats::RawWriteBytes] / writeBytes : 0)
+      << "\n";
+
+  // without attaching a detached filesystem
+  std::shared_ptr<DirNode> root = ctx->currentRoot();
+  header(out, "encfs_attached", "gauge",
+         "1 if the filesystem is attached to its root.");
+  out << "encfs_attached " << (root ? 1 : 0) << "\n";
+
+  header(out, "encfs_open_files", "gauge", "Files open through the mount.");
+  out << "encfs_open_files " << ctx->openFileCount() << "\n";
+  header(out, "encfs_path_entries", "gauge",
+         "Path components interned for open files.");
+  out << "encfs_path_entries " << PathName::entries() << "\n";
+
+  std::shared_ptr<BlockCache> cache;
+  if (root) {
+    cache = root->config()->blockCache;
+  }
+  if (cache) {
+    header(out, "encfs_block_cache_hits_total", "counter",
+           "Blocks read from the cache.");
+    out << "encfs_block_cache_hits_total " << cache->hits() << "\n";
+    header(out, "encfs_block_cache_misses_total", "counter",
+           "Blocks not found in the cache.");
+    out << "encfs_block_cache_misses_total " << cache->misses() << "\n";
+    header(out, "encfs_block_cache_bytes", "gauge", "Bytes of cached blocks.");
+    out << "encfs_block_cache_bytes " << cache->bytesUsed() << "\n";
+  }
+
+  std::shared_ptr<HotFileCache> hot;
+  if (root) {
+    hot = root->config()->hotCache;
+  }
+  if (hot) {
+    header(out, "encfs_hot_cache_hits_total", "counter",
+           "Reads served from decoded copies of hot files.");
+    out << "encfs_hot_cache_hits_total " << hot->hits() << "\n";
+    header(out, "encfs_hot_cache_misses_total", "counter",
+           "Reads of files without a decoded copy.");
+    out << "encfs_hot_cache_misses_total " << hot->misses() << "\n";
+    header(out, "encfs_hot_cache_bytes", "gauge",
+           "Bytes of locked memory holding hot file copies.");
+    out << "encfs_hot_cache_bytes " << hot->bytesUsed() << "\n";
+  }
+
+  std::shared_ptr<ThreadPool> crypto;
+  if (root) {
+    crypto = root->config()->cryptoPool;
+  }
+  if (crypto) {
+    std::vector<ThreadPool::LaneStats> lanes;
+    for (int lane = 0; lane < ThreadPool::NumLanes; ++lane) {
+      lanes.push_back(crypto->laneStats((ThreadPool::Lane)lane));
+    }
+    auto series = [&](const char *name, int lane) -> std::ostringstream & {
+      out << name << "{lane=\"" << ThreadPool::laneName((ThreadPool::Lane)lane)
+          << "\"} ";
+      return out;
+    };
+    header(out, "encfs_crypto_queue_depth", "gauge",
+           "Crypto pool jobs waiting for a worker.");
+    for (int lane = 0; lane < ThreadPool::NumLanes; ++lane) {
+      series("encfs_crypto_queue_depth", lane) << lanes[lane].queued << "\n";
+    }
+    header(out, "encfs_crypto_jobs_total", "counter",
+           "Crypto pool jobs started.");
+    for (int lane = 0; lane < ThreadPool::NumLanes; ++lane) {
+      series("encfs_crypto_jobs_total", lane) << lanes[lane].jobs << "\n";
+    }
+    header(out, "encfs_crypto_wait_seconds_total", "counter",
+           "Time crypto pool jobs spent queued.");
+    for (int lane = 0; lane < ThreadPool::NumLanes; ++lane) {
+      series("encfs_crypto_wait_seconds_total", lane)
+          << seconds(lanes[lane].waitNs) << "\n";
+    }
+    header(out, "encfs_crypto_wait_max_seconds", "gauge",
+           "Longest a crypto pool job was queued.");
+    for (int lane = 0; lane < ThreadPool::NumLanes; ++lane) {
+      series("encfs_crypto_wait_max_seconds", lane)
+          << seconds(lanes[lane].maxWaitNs) << "\n";
+    }
+  }
+
+  MemoryPool::Stats pool = MemoryPool::stats();
+  header(out, "encfs_pool_live_blocks", "gauge", "Pool blocks in use.");
+  out << "encfs_pool_live_blocks " << pool.liveBlocks << "\n";
+  header(out, "encfs_pool_cached_bytes", "gauge",
+         "Bytes of released blocks kept for reuse.");
+  out << "encfs_pool_cached_bytes " << pool.cachedBytes << "\n";
+  header(out, "encfs_pool_locked_bytes", "gauge",
+         "Bytes mapped for the locked arena.");
+  out << "encfs_pool_locked_bytes " << pool.lockedBytes << "\n";
+  header(out, "encfs_pool_hits_total", "counter",
+         "Allocations served from the pool.");
+  out << "encfs_pool_hits_total " << pool.hits << "\n";
+  header(out, "encfs_pool_misses_total", "counter",
+         "Allocations of new memory.");
+  out << "encfs_pool_misses_total " << pool.misses << "\n";
+  header(out, "encfs_pool_trimmed_total", "counter",
+         "Released blocks freed to stay in bounds.");
+  out << "encfs_pool_trimmed_total " << pool.trimmed << "\n";
+
+  if (LockProfile::enabled.load(std::memory_order_relaxed)) {
+    locks(out);
+  }
+
+  return out.str();
+}
+
+static int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+std::string statsReport(EncFS_Context *ctx) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static std::string report;
+  static int64_t renderedMs = -ReportMs;
+
+  Lock lock(mutex);
+  int64_t now = monotonicMs();
+  if (now - renderedMs >= ReportMs) {
+    report = render(ctx);
+    renderedMs = now;
+  }
+  return report;
+}
+
+StatsServer::StatsServer(EncFS_Context *ctx, const std::string &path)
+    : _ctx(ctx), _path(path), _listenFd(-1), _running(false) {
+  _wakeFds[0] = -1;
+  _wakeFds[1] = -1;
+}
+
+StatsServer::~StatsServer() { stop(); }
+
+static void closeOnExec(int fd) { fcntl(fd, F_SETFD, FD_CLOEXEC); }
+
+bool StatsServer::start() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (_path.length() >= sizeof(addr.sun_path)) {
+    RLOG(ERROR) << "stats socket path too long: " << _path;
+    return false;
+  }
+  strncpy(addr.sun_path, _path.c_str(), sizeof(addr.sun_path) - 1);
+
+  // a socket left behind by a mount that is gone is replaced, one that
+  // still answers is not
+  struct stat st;
+  if (lstat(_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) {
+      bool inUse = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+      close(fd);
+      if (inUse) {
+        RLOG(ERROR) << "stats socket is in use: " << _path;
+        return false;
+      }
+      unlink(_path.c_str());
+    }
+  }
+
+  _listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    RLOG(ERROR) << "stats socket: " << strerror(errno);
+    return false;
+  }
+  closeOnExec(_listenFd);
+  // nobody can connect before listen(), so the mode is set in time
+  if (bind(_listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      chmod(_path.c_str(), 0600) != 0 || listen(_listenFd, 8) != 0 ||
+      pipe(_wakeFds) != 0) {
+    int eno = errno;
+    RLOG(ERROR) << "stats socket " << _path << ": " << strerror(eno);
+    stop();
+    return false;
+  }
+  closeOnExec(_wakeFds[0]);
+  closeOnExec(_wakeFds[1]);
+
+  int res = pthread_create(&_thread, nullptr, run, this);
+  if (res != 0) {
+    RLOG(ERROR) << "error starting stats thread: " << strerror(res);
+    stop();
+    return false;
+  }
+  _running = true;
+  VLOG(1) << "serving stats on " << _path;
+  return true;
+}
+
+void StatsServer::stop() {
+  if (_running) {
+    char c = 0;
+    if (write(_wakeFds[1], &c, 1) != 1) {
+      RLOG(WARNING) << "could not wake the stats thread";
+    }
+    pthread_join(_thread, nullptr);
+    _running = false;
+  }
+  for (int &fd : _wakeFds) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+    unlink(_path.c_str());
+  }
+}
+
+void *StatsServer::run(void *arg) {
+  ((StatsServer *)arg)->serve();
+  return nullptr;
+}
+
+void StatsServer::serve() {
+  struct pollfd fds[2];
+  fds[0].fd = _listenFd;
+  fds[0].events = POLLIN;
+  fds[1].fd = _wakeFds[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      RLOG(ERROR) << "stats socket poll: " << strerror(errno);
+      return;
+    }
+    if (fds[1].revents != 0) {
+      return;
+    }
+    if ((fds[0].revents & POLLIN) == 0) {
+      continue;
+    }
+
+    int fd = accept(_listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    // a reader that stops reading does not hold up the next one for long
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+#if defined(MSG_NOSIGNAL)
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+
+    std::string report = statsReport(_ctx);
+    size_t sent = 0;
+    while (sent < report.length()) {
+      ssize_t res = send(fd, report.data() + sent, report.length() - sent,
+                         flags);
+      if (res < 0 && errno == EINTR) {
+        continue;
+      }
+      if (res <= 0) {
+        break;
+      }
+      sent += res;
+    }
+    close(fd);
+  }
+}
+
+}  // namespace encfs
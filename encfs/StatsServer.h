@@ -0,0 +1,54 @@
+#ifndef _StatsServer_incl_
+#define _StatsServer_incl_
+
+#include <pthread.h>
+#include <string>
+
+namespace encfs {
+
+class EncFS_Context;
+
+/*
+    The counters of a mount, in the Prometheus text exposition format:
+    calls, errors, bytes and latency quantiles of every operation and phase
+    (see OpStats), the counters of the file I/O layers and the read and
+    write amplification they make for, the block cache, the memory pool,
+    the lanes of the crypto pool, the number of open files and, with
+    --lock-profile, the contention of the locks of LockProfile.  Reports
+    are kept for a second, so that a reader asking for the size first and
+    then the text gets the same text both times.
+ */
+std::string statsReport(EncFS_Context *ctx);
+
+/*
+    Serves statsReport() on a Unix socket: every connection is sent the
+    report and closed, e.g. `socat - UNIX-CONNECT:path`.  The socket is
+    only accessible to the owner of the mount.
+ */
+class StatsServer {
+ public:
+  StatsServer(EncFS_Context *ctx, const std::string &path);
+  ~StatsServer();
+
+  // binds the socket and starts serving, false if that failed
+  bool start();
+  void stop();
+
+ private:
+  StatsServer(const StatsServer &src);             // not allowed
+  StatsServer &operator=(const StatsServer &src);  // not allowed
+
+  static void *run(void *arg);
+  void serve();
+
+  EncFS_Context *_ctx;
+  std::string _path;
+  int _listenFd;
+  int _wakeFds[2];  // written to by stop()
+  bool _running;
+  pthread_t _thread;
+};
+
+}  // namespace encfs
+
+#endif
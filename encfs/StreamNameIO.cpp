@@ -1,8 +1,10 @@
 #include "StreamNameIO.h"
 
 #include "easylogging++.h"
+#include <cerrno>
 #include <cstring>
 #include <utility>
+#include <vector>
 
 #include "Cipher.h"
 #include "CipherKey.h"
@@ -77,27 +79,35 @@ int StreamNameIO::encodeName(const char* plaintextName, int length,
   int encodedStreamLen = length + 2;
   int encLen64 = B256ToB64Bytes(encodedStreamLen);
 
-  changeBase2Inline((unsigned char*) encodedName, encodedStreamLen, 8, 6, true);
-  B64ToAscii((unsigned char*) encodedname, encLen64);
+  B256ToB64Ascii((unsigned char*)encodedName, (unsigned char*)encodedName,
+                 encodedStreamLen);
 
   return encLen64;
 }
 
 int StreamNameIO::decodeName(const char* encodedName, int length, uint64_t* iv,
-    char* plaintextName, int bufferlength) const {
+    char* plaintextName, int bufferLength) const {
+  int res = tryDecodeName(encodedName, length, iv, plaintextName, bufferLength);
+  if (res < 0) {
+    throw Error("filename decode failed");
+  }
+  return res;
+}
+
+int StreamNameIO::tryDecodeName(const char* encodedName, int length,
+    uint64_t* iv, char* plaintextName, int bufferlength) const {
   rAssert(length > 2);
   int decLen256 = B64ToB256Bytes(length);
   int decodedStreamLen = decLen256 - 2;
   rAssert(decodedStreamLen <= bufferLength);
 
   if (decodedStreamLen <= 0) {
-    throw Error("Filename too small to decode");
+    return -EINVAL;
   }
 
   BUFFER_INIT(tmpBuf, 32, (unsigned int)length);
 
-  AsciiToB64((unsigned char*) tmpBuf, (unsigned char* )encodedName, length);
-  changeBase2Inline((unsigned char* )tmpBuf, length, 6, 8, false);
+  B64AsciiToB256((unsigned char*)tmpBuf, (unsigned char*)encodedName, length);
 
   uint64_t tmpIV = 0;
   unsigned int mac;
@@ -126,13 +136,149 @@ int StreamNameIO::decodeName(const char* encodedName, int length, uint64_t* iv,
   if (mac2 != mac) {
     VLOG(1) << "checksum mismatch: expected " << mac << ", got " << mac2;
     VLOG(1) << "on decode of " << decodedStreamLen << " bytes";
-    throw Error("checksum mismatch in filename decode");
+    return -EINVAL;
   }
 
   return decodedStreamLen;
 
 }
 
+/*
+    As BlockNameIO's, the MACs of a batch in one call and the stream coding
+    of all its names in another.
+ */
+void StreamNameIO::encodeNameBatch(NameRequest* names, int count,
+                                   bool chained) const {
+  std::vector<size_t> slot(count + 1, 0);
+  for (int i = 0; i < count; ++i) {
+    slot[i + 1] = slot[i] + maxEncodedNameLen((int)names[i].name.size()) + 1;
+  }
+  std::vector<unsigned char> buf(slot[count]);
+  std::vector<Cipher::ChainedMACRequest> macs(count);
+  std::vector<uint64_t> tmpIV(count, 0);
+
+  for (int i = 0; i < count; ++i) {
+    if (chained && _interface >= 2) {
+      tmpIV[i] = names[i].iv;
+    }
+    macs[i].data = (const unsigned char*)names[i].name.data();
+    macs[i].len = (int)names[i].name.size();
+    macs[i].chainedIV = chained ? &names[i].iv : nullptr;
+  }
+
+  std::vector<uint64_t> mac64(count);
+  _cipher->MACBatch(macs.data(), count, mac64.data(), _key);
+
+  std::vector<Cipher::BlockRequest> streams(count);
+  for (int i = 0; i < count; ++i) {
+    unsigned int mac = Cipher::fold16(mac64[i]);
+    int length = (int)names[i].name.size();
+    unsigned char* at = buf.data() + slot[i];
+    unsigned char* encodeBegin;
+    if (_interface >= 1) {
+      at[0] = (mac >> 8) & 0xff;
+      at[1] = (mac) & 0xff;
+      encodeBegin = at + 2;
+    } else {
+      at[length] = (mac >> 8) & 0xff;
+      at[length + 1] = (mac) & 0xff;
+      encodeBegin = at;
+    }
+    memcpy(encodeBegin, names[i].name.data(), length);
+    streams[i].buf = encodeBegin;
+    streams[i].size = length;
+    streams[i].iv64 = (uint64_t)mac ^ tmpIV[i];
+  }
+  _cipher->nameEncodeBatch(streams.data(), count, _key);
+
+  for (int i = 0; i < count; ++i) {
+    unsigned char* at = buf.data() + slot[i];
+    int encodedStreamLen = (int)names[i].name.size() + 2;
+    B256ToB64Ascii(at, at, encodedStreamLen);
+    names[i].coded.assign((const char*)at, B256ToB64Bytes(encodedStreamLen));
+    names[i].ok = true;
+  }
+}
+
+void StreamNameIO::decodeNameBatch(NameRequest* names, int count,
+                                   bool chained) const {
+  std::vector<size_t> slot(count + 1, 0);
+  for (int i = 0; i < count; ++i) {
+    slot[i + 1] = slot[i] + names[i].name.size() + 1;
+  }
+  std::vector<unsigned char> buf(slot[count]);
+
+  std::vector<Cipher::BlockRequest> streams;
+  std::vector<int> which;
+  std::vector<unsigned int> mac;
+  for (int i = 0; i < count; ++i) {
+    names[i].ok = false;
+    int length = (int)names[i].name.size();
+    int decodedStreamLen = length > 2 ? B64ToB256Bytes(length) - 2 : 0;
+    if (decodedStreamLen <= 0) {
+      continue;
+    }
+
+    unsigned char* at = buf.data() + slot[i];
+    B64AsciiToB256(at, (unsigned char*)names[i].name.data(), length);
+    unsigned int m;
+    uint64_t tmpIV = 0;
+    unsigned char* data;
+    if (_interface >= 1) {
+      m = ((unsigned int)at[0]) << 8 | ((unsigned int)at[1]);
+      if (chained && _interface >= 2) {
+        tmpIV = names[i].iv;
+      }
+      data = at + 2;
+    } else {
+      m = ((unsigned int)at[decodedStreamLen]) << 8 |
+          ((unsigned int)at[decodedStreamLen + 1]);
+      data = at;
+    }
+
+    Cipher::BlockRequest stream;
+    stream.buf = data;
+    stream.size = decodedStreamLen;
+    stream.iv64 = (uint64_t)m ^ tmpIV;
+    streams.push_back(stream);
+    which.push_back(i);
+    mac.push_back(m);
+  }
+  if (streams.empty()) {
+    return;
+  }
+  if (!_cipher->nameDecodeBatch(streams.data(), (int)streams.size(), _key)) {
+    NameIO::decodeNameBatch(names, count, chained);
+    return;
+  }
+
+  std::vector<Cipher::ChainedMACRequest> macs(streams.size());
+  std::vector<uint64_t> newIV(streams.size());
+  for (size_t j = 0; j < streams.size(); ++j) {
+    newIV[j] = names[which[j]].iv;
+    macs[j].data = streams[j].buf;
+    macs[j].len = streams[j].size;
+    macs[j].chainedIV = chained ? &newIV[j] : nullptr;
+  }
+  std::vector<uint64_t> mac64(macs.size());
+  _cipher->MACBatch(macs.data(), (int)macs.size(), mac64.data(), _key);
+
+  for (size_t j = 0; j < streams.size(); ++j) {
+    NameRequest& req = names[which[j]];
+    unsigned int mac2 = Cipher::fold16(mac64[j]);
+    if (mac2 != mac[j]) {
+      VLOG(1) << "checksum mismatch: expected " << mac[j] << ", got " << mac2;
+      VLOG(1) << "on decode of " << streams[j].size << " bytes";
+      continue;
+    }
+    req.coded.assign((const char*)streams[j].buf, streams[j].size);
+    if (chained) {
+      req.iv = newIV[j];
+    }
+    req.ok = true;
+  }
+}
+
 bool StreamNameIO::Enabled() { return true; }
 }
 
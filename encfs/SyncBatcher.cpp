@@ -0,0 +1,200 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SyncBatcher.h"
+
+#include <cerrno>
+#include <ctime>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Error.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+static int syncOne(int fd, bool datasync) {
+  int res;
+#if defined(HAVE_FDATASYNC)
+  res = datasync ? fdatasync(fd) : fsync(fd);
+#else
+  (void)datasync;
+  res = fsync(fd);
+#endif
+  return res == -1 ? -errno : 0;
+}
+
+SyncBatcher::SyncBatcher(int windowUs)
+    : _running(false),
+      _windowUs(windowUs > 0 ? windowUs : 0),
+      _calls(0),
+      _syncs(0) {
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(&_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+SyncBatcher::~SyncBatcher() {
+  VLOG(1) << "group sync: " << calls() << " calls, " << syncs()
+          << " syncs";
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+int SyncBatcher::sync(int fd, bool datasync) {
+  ++_calls;
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0) {
+    return -errno;
+  }
+  Waiter self = {fd, stbuf.st_dev, stbuf.st_ino, datasync, 0};
+
+  std::shared_ptr<Batch> batch;
+  {
+    Lock lock(_mutex);
+    bool leader = !_open;
+    if (leader) {
+      _open = std::make_shared<Batch>();
+      _open->done = false;
+    }
+    batch = _open;
+    batch->waiters.push_back(&self);
+
+    if (!leader) {
+      if (batch->waiters.size() >= MaxBatch) {
+        // wake the leader early
+        pthread_cond_broadcast(&_cond);
+      }
+      while (!batch->done) {
+        pthread_cond_wait(&_cond, &_mutex);
+      }
+      return self.result;
+    }
+
+    struct timespec deadline;
+#if defined(__APPLE__)
+    // condition variables wait on the wall clock here
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#endif
+    deadline.tv_nsec += (long)_windowUs * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    bool windowOpen = _windowUs > 0;
+    while (_running ||
+           (windowOpen && batch->waiters.size() < MaxBatch)) {
+      if (_running) {
+        pthread_cond_wait(&_cond, &_mutex);
+      } else if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) ==
+                 ETIMEDOUT) {
+        windowOpen = false;
+      }
+    }
+    // later callers start the next batch
+    _open.reset();
+    _running = true;
+  }
+
+  run(batch.get());
+
+  Lock lock(_mutex);
+  batch->done = true;
+  _running = false;
+  pthread_cond_broadcast(&_cond);
+  return self.result;
+}
+
+void SyncBatcher::run(Batch *batch) {
+  std::vector<Waiter *> &waiters = batch->waiters;
+
+  // the first waiter of each file, and of each filesystem
+  std::vector<Waiter *> files;
+  std::vector<Waiter *> devices;
+  for (Waiter *w : waiters) {
+    bool newFile = true;
+    for (Waiter *f : files) {
+      if (f->dev == w->dev && f->ino == w->ino) {
+        newFile = false;
+        f->datasync = f->datasync && w->datasync;
+        break;
+      }
+    }
+    if (!newFile) {
+      continue;
+    }
+    files.push_back(w);
+    bool newDevice = true;
+    for (Waiter *d : devices) {
+      if (d->dev == w->dev) {
+        newDevice = false;
+        break;
+      }
+    }
+    if (newDevice) {
+      devices.push_back(w);
+    }
+  }
+
+#if defined(__linux__)
+  if (files.size() > devices.size()) {
+    // more than one file on some filesystem
+    for (Waiter *d : devices) {
+      size_t count = 0;
+      for (Waiter *f : files) {
+        count += (f->dev == d->dev) ? 1 : 0;
+      }
+      int res = 0;
+      if (count > 1) {
+        ++_syncs;
+        res = (syncfs(d->fd) == -1) ? -errno : 0;
+      } else {
+        ++_syncs;
+        res = syncOne(d->fd, d->datasync);
+      }
+      for (Waiter *w : waiters) {
+        if (w->dev == d->dev) {
+          w->result = res;
+        }
+      }
+    }
+    return;
+  }
+#endif
+
+  for (Waiter *f : files) {
+    ++_syncs;
+    int res = syncOne(f->fd, f->datasync);
+    for (Waiter *w : waiters) {
+      if (w->dev == f->dev && w->ino == f->ino) {
+        w->result = res;
+      }
+    }
+  }
+}
+
+uint64_t SyncBatcher::calls() const { return _calls; }
+
+uint64_t SyncBatcher::syncs() const { return _syncs; }
+
+}  // namespace encfs
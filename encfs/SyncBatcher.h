@@ -0,0 +1,72 @@
+#ifndef _SyncBatcher_incl_
+#define _SyncBatcher_incl_
+
+#include <atomic>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+namespace encfs {
+
+/*
+    Group commit of the fsyncs of a filesystem (--group-sync).
+
+    The first caller of a batch leads it: it waits for the window, and for
+    the batch before it to finish, while other callers join; then it syncs
+    once for all of them and wakes them with the result.  Each caller's
+    sync starts after it called, so it covers what it wrote.
+
+    Callers on the same file share one fsync, an fdatasync if all of them
+    asked for one.  Where several files of a backing filesystem are in a
+    batch, one syncfs covers them all on Linux.
+ */
+class SyncBatcher {
+ public:
+  // windowUs: how long the leader of a batch waits for others to join.
+  // With 0, only the calls made while a batch is running are joined.
+  explicit SyncBatcher(int windowUs);
+  ~SyncBatcher();
+
+  // fsync, or fdatasync, of fd.  Returns 0 or -errno.
+  int sync(int fd, bool datasync);
+
+  // calls to sync, and the system calls made for them
+  uint64_t calls() const;
+  uint64_t syncs() const;
+
+ private:
+  // a batch is cut short at this many callers
+  static const size_t MaxBatch = 256;
+
+  struct Waiter {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    bool datasync;
+    int result;
+  };
+  struct Batch {
+    std::vector<Waiter *> waiters;
+    bool done;
+  };
+
+  void run(Batch *batch);
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  std::shared_ptr<Batch> _open;  // taking callers, null if none is
+  bool _running;                 // a batch is syncing
+  int _windowUs;
+
+  std::atomic<uint64_t> _calls;
+  std::atomic<uint64_t> _syncs;
+
+  SyncBatcher(const SyncBatcher &);             // not allowed
+  SyncBatcher &operator=(const SyncBatcher &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
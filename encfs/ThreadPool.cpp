@@ -0,0 +1,309 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <utility>
+
+#include "Error.h"
+#include "Mutex.h"
+#include "Numa.h"
+#include "OpStats.h"
+
+namespace encfs {
+
+// jobs of a lane a pinned worker looks through for one of its node
+static const int NodeScan = 8;
+
+static thread_local ThreadPool::Lane tLane = ThreadPool::Demand;
+
+const char *ThreadPool::laneName(Lane lane) {
+  switch (lane) {
+    case Demand:
+      return "demand";
+    case Write:
+      return "write";
+    case Background:
+      return "background";
+    default:
+      return "unknown";
+  }
+}
+
+ThreadPool::LaneScope::LaneScope(Lane lane) : _saved(tLane) {
+  tLane = laneFor(lane);
+}
+
+ThreadPool::LaneScope::~LaneScope() { tLane = _saved; }
+
+ThreadPool::Lane ThreadPool::laneFor(Lane lane) {
+  return lane > tLane ? lane : tLane;
+}
+
+ThreadPool::State::State(int threads)
+    : backgroundRunning(0),
+      backgroundMax(threads > 1 ? threads - 1 : 1),
+      stop(false) {
+  for (int lane = 0; lane < NumLanes; ++lane) {
+    jobs[lane] = 0;
+    waitNs[lane] = 0;
+    maxWaitNs[lane] = 0;
+  }
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&wakeup, nullptr);
+}
+
+ThreadPool::State::~State() {
+  pthread_cond_destroy(&wakeup);
+  pthread_mutex_destroy(&mutex);
+}
+
+int ThreadPool::State::nextLane() const {
+  for (int lane = 0; lane < NumLanes; ++lane) {
+    if (queue[lane].empty()) {
+      continue;
+    }
+    if (lane == Background && backgroundRunning >= backgroundMax) {
+      continue;
+    }
+    return lane;
+  }
+  return NumLanes;
+}
+
+ThreadPool::Job ThreadPool::State::take(int lane, int node) {
+  std::deque<Job> &jobs = queue[lane];
+  auto it = jobs.begin();
+  if (node >= 0) {
+    for (int i = 0; i < NodeScan && it != jobs.end(); ++i, ++it) {
+      if (it->node == node) {
+        break;
+      }
+    }
+    if (it == jobs.end() || it->node != node) {
+      it = jobs.begin();
+    }
+  }
+  Job job = std::move(*it);
+  jobs.erase(it);
+  return job;
+}
+
+namespace {
+
+// one forEach() call. Whoever runs a helper job, or the caller, claims
+// indexes until none are left; helpers that start late find nothing to do.
+struct Batch {
+  std::function<bool(int)> job;
+  int count;
+  std::atomic<int> next;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t finished;
+  int done;
+  bool ok;
+
+  Batch(const std::function<bool(int)> &job, int count)
+      : job(job), count(count), next(0), done(0), ok(true) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&finished, nullptr);
+  }
+  ~Batch() {
+    pthread_cond_destroy(&finished);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void drain() {
+    int ran = 0;
+    bool allOk = true;
+    for (int i = next++; i < count; i = next++) {
+      if (!job(i)) {
+        allOk = false;
+      }
+      ++ran;
+    }
+    if (ran > 0) {
+      Lock lock(mutex);
+      done += ran;
+      ok = ok && allOk;
+      if (done == count) {
+        pthread_cond_broadcast(&finished);
+      }
+    }
+  }
+};
+
+}  // namespace
+
+ThreadPool::ThreadPool(int threads, bool pinNodes)
+    : _threads(threads > 0 ? threads : 1),
+      _pinNodes(pinNodes && Numa::nodes() > 1),
+      _started(false),
+      _state(std::make_shared<State>(_threads)) {}
+
+ThreadPool::~ThreadPool() {
+  // jobs not yet started are dropped, outside the lock as their captures
+  // may run arbitrary destructors
+  std::deque<Job> dropped[NumLanes];
+  {
+    Lock lock(_state->mutex);
+    _state->stop = true;
+    for (int lane = 0; lane < NumLanes; ++lane) {
+      dropped[lane].swap(_state->queue[lane]);
+    }
+    pthread_cond_broadcast(&_state->wakeup);
+  }
+  for (auto &lane : dropped) {
+    lane.clear();
+  }
+
+  for (pthread_t thread : _workers) {
+    if (pthread_equal(thread, pthread_self())) {
+      // destroyed from one of our own jobs, a thread can not join itself
+      pthread_detach(thread);
+    } else {
+      pthread_join(thread, nullptr);
+    }
+  }
+}
+
+int ThreadPool::threads() const { return _threads; }
+
+ThreadPool::LaneStats ThreadPool::laneStats(Lane lane) const {
+  Lock lock(_state->mutex);
+  LaneStats stats;
+  stats.queued = _state->queue[lane].size();
+  stats.jobs = _state->jobs[lane];
+  stats.waitNs = _state->waitNs[lane];
+  stats.maxWaitNs = _state->maxWaitNs[lane];
+  return stats;
+}
+
+void ThreadPool::submit(std::function<void()> job, Lane lane) {
+  lane = laneFor(lane);
+  {
+    Lock lock(_state->mutex);
+    if (_state->stop) {
+      return;
+    }
+
+    if (!_started) {
+      _started = true;
+      for (int i = 0; i < _threads; ++i) {
+        auto *arg = new WorkerArg;
+        arg->state = _state;
+        arg->node = _pinNodes ? i % Numa::nodes() : -1;
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, worker, arg) != 0) {
+          RLOG(WARNING) << "unable to start worker thread " << i;
+          delete arg;
+          break;
+        }
+        _workers.push_back(thread);
+      }
+    }
+
+    if (!_workers.empty()) {
+      Job queued;
+      queued.run = std::move(job);
+      queued.queuedNs = OpStats::now();
+      queued.node = Numa::currentNode();
+      _state->queue[lane].push_back(std::move(queued));
+      pthread_cond_signal(&_state->wakeup);
+      return;
+    }
+  }
+
+  // no threads to run it, do it here rather than dropping it
+  job();
+}
+
+bool ThreadPool::forEach(int count, const std::function<bool(int)> &job,
+                         Lane lane) {
+  if (count <= 0) {
+    return true;
+  }
+  if (count == 1) {
+    return job(0);
+  }
+
+  auto batch = std::make_shared<Batch>(job, count);
+  int helpers = count - 1 < _threads ? count - 1 : _threads;
+  for (int i = 0; i < helpers; ++i) {
+    submit([batch]() { batch->drain(); }, lane);
+  }
+  batch->drain();
+
+  Lock lock(batch->mutex);
+  while (batch->done < batch->count) {
+    pthread_cond_wait(&batch->finished, &batch->mutex);
+  }
+  return batch->ok;
+}
+
+void *ThreadPool::worker(void *arg) {
+  std::shared_ptr<State> state = static_cast<WorkerArg *>(arg)->state;
+  int node = static_cast<WorkerArg *>(arg)->node;
+  delete static_cast<WorkerArg *>(arg);
+  if (node >= 0 && !Numa::pinThread(node)) {
+    node = -1;
+  }
+
+  while (true) {
+    Job job;
+    int lane = NumLanes;
+    {
+      Lock lock(state->mutex);
+      while (!state->stop && (lane = state->nextLane()) == NumLanes) {
+        pthread_cond_wait(&state->wakeup, &state->mutex);
+      }
+      if (state->stop) {
+        break;
+      }
+      job = state->take(lane, node);
+
+      uint64_t waited = OpStats::now() - job.queuedNs;
+      ++state->jobs[lane];
+      state->waitNs[lane] += waited;
+      if (waited > state->maxWaitNs[lane]) {
+        state->maxWaitNs[lane] = waited;
+      }
+      if (lane == Background) {
+        ++state->backgroundRunning;
+      }
+    }
+
+    // the background jobs run at their own lane all the way down
+    {
+      LaneScope scope((Lane)lane);
+      job.run();
+    }
+
+    if (lane == Background) {
+      Lock lock(state->mutex);
+      --state->backgroundRunning;
+      // a background job may have waited on this one's worker
+      if (!state->queue[Background].empty()) {
+        pthread_cond_signal(&state->wakeup);
+      }
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace encfs
@@ -0,0 +1,137 @@
+#ifndef _ThreadPool_incl_
+#define _ThreadPool_incl_
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+namespace encfs {
+
+/*
+    Fixed size pool of worker threads running queued jobs in FIFO order,
+    in lanes by priority: a free worker takes the oldest job of the most
+    urgent lane that has one, so it only works downward to readahead and
+    scrub jobs when no read or write is waiting.  Background jobs are also
+    kept off the last free worker, so that a burst of prefetch can not
+    leave a foreground read queued behind it.
+
+    With pinNodes on a NUMA host the workers are pinned to the nodes in
+    turn, and a worker prefers, among the first jobs of the lane, one that
+    was queued from its own node, so that it codes buffers local to it.
+
+    Threads are only started by the first submit(), as encfs forks into the
+    background after the filesystem is set up and threads created before
+    that would not survive the fork.
+
+    The queue lives in a State shared with the workers, so the pool may be
+    destroyed from inside a job (when the job held the last reference to
+    it) without the worker touching freed memory.
+ */
+class ThreadPool {
+ public:
+  enum Lane {
+    Demand = 0,  // reads somebody is waiting for
+    Write,       // writes and flushes
+    Background,  // readahead and scrub
+    NumLanes
+  };
+
+  struct LaneStats {
+    uint64_t queued;     // jobs waiting now
+    uint64_t jobs;       // jobs started
+    uint64_t waitNs;     // time jobs spent queued
+    uint64_t maxWaitNs;  // longest of those
+  };
+
+  static const char *laneName(Lane lane);
+
+  /*
+      Lowers the lane of the jobs the calling thread submits, for the
+      lifetime of the object, so that work done on behalf of readahead or
+      the scrubber queues behind foreground work even where the code
+      queuing it does not know who it is for.
+   */
+  class LaneScope {
+   public:
+    explicit LaneScope(Lane lane);
+    ~LaneScope();
+
+   private:
+    Lane _saved;
+
+    LaneScope(const LaneScope &);             // not allowed
+    LaneScope &operator=(const LaneScope &);  // not allowed
+  };
+
+  // lane, or the lower one of the calling thread's LaneScope
+  static Lane laneFor(Lane lane);
+
+  explicit ThreadPool(int threads, bool pinNodes = false);
+  ~ThreadPool();
+
+  // queue a job.  Jobs must not throw.
+  void submit(std::function<void()> job, Lane lane = Demand);
+
+  // run job(0) .. job(count - 1) on the pool and the calling thread, and
+  // wait for all of them.  Returns false if any job did.  The caller works
+  // through the jobs as well, so this completes even when every worker is
+  // busy.
+  bool forEach(int count, const std::function<bool(int)> &job,
+               Lane lane = Demand);
+
+  int threads() const;
+
+  LaneStats laneStats(Lane lane) const;
+
+ private:
+  struct Job {
+    std::function<void()> run;
+    uint64_t queuedNs;
+    int node;  // NUMA node of the thread that queued it
+  };
+
+  struct State {
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    std::deque<Job> queue[NumLanes];
+    uint64_t jobs[NumLanes];
+    uint64_t waitNs[NumLanes];
+    uint64_t maxWaitNs[NumLanes];
+    int backgroundRunning;
+    int backgroundMax;  // workers background jobs may hold at once
+    bool stop;
+
+    explicit State(int threads);
+    ~State();
+
+    // the lane a worker should take a job from next, NumLanes for none;
+    // caller holds mutex
+    int nextLane() const;
+    // takes the job of lane that a worker on node should run, node -1
+    // for the oldest; caller holds mutex
+    Job take(int lane, int node);
+  };
+
+  struct WorkerArg {
+    std::shared_ptr<State> state;
+    int node;  // -1 if not pinned
+  };
+
+  static void *worker(void *arg);
+
+  int _threads;
+  bool _pinNodes;
+  bool _started;
+  std::shared_ptr<State> _state;
+  std::vector<pthread_t> _workers;
+
+  ThreadPool(const ThreadPool &);             // not allowed
+  ThreadPool &operator=(const ThreadPool &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
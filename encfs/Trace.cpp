@@ -0,0 +1,194 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Mutex.h"
+#include "OpStats.h"
+
+namespace encfs {
+namespace Trace {
+
+std::atomic<bool> enabled(false);
+
+static const char *const Names[NumEvents] = {
+    "file-read",  "file-write",    "block-read",
+    "block-write", "decode-failed", "encode-failed"};
+
+const char *name(Event event) {
+  return (event >= 0 && event < NumEvents) ? Names[event] : "unknown";
+}
+
+namespace {
+
+/*
+    A slot is written by its thread only.  seq is cleared while the slot
+    changes and set last, so a dump reading the slot from another thread
+    keeps it only if seq is the same before and after.
+ */
+struct Slot {
+  std::atomic<uint64_t> seq;  // (count << 8) | event, 0 while changing
+  std::atomic<uint64_t> ns;
+  std::atomic<uint64_t> a;
+  std::atomic<uint64_t> b;
+};
+
+struct Ring {
+  long tid;
+  uint64_t count;  // events recorded, only used by the writer
+  Slot slots[RingSize];
+};
+
+struct Record {
+  uint64_t ns;
+  long tid;
+  int event;
+  uint64_t a;
+  uint64_t b;
+};
+
+pthread_mutex_t gRingsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+std::list<Ring *> &liveRings() {
+  static std::list<Ring *> rings;
+  return rings;
+}
+
+// the ring of the calling thread, made on its first event and dropped
+// when the thread exits
+struct RingHolder {
+  Ring *ring = nullptr;
+
+  ~RingHolder() {
+    if (ring == nullptr) {
+      return;
+    }
+    Lock lock(gRingsMutex);
+    liveRings().remove(ring);
+    delete ring;
+  }
+};
+
+thread_local RingHolder tHolder;
+
+void collect(const Ring &ring, std::vector<Record> *out) {
+  for (const Slot &slot : ring.slots) {
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq == 0) {
+      continue;
+    }
+    Record rec;
+    rec.ns = slot.ns.load(std::memory_order_relaxed);
+    rec.a = slot.a.load(std::memory_order_relaxed);
+    rec.b = slot.b.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    rec.tid = ring.tid;
+    rec.event = (int)(seq & 0xff);
+    out->push_back(rec);
+  }
+}
+
+std::string render(size_t maxBytes) {
+  std::vector<Record> records;
+  {
+    Lock lock(gRingsMutex);
+    for (const Ring *ring : liveRings()) {
+      collect(*ring, &records);
+    }
+  }
+  std::sort(records.begin(), records.end(),
+            [](const Record &x, const Record &y) { return x.ns < y.ns; });
+
+  // the newest events that fit, formatted from the end
+  std::vector<std::string> lines;
+  size_t bytes = 0;
+  for (auto it = records.rbegin(); it != records.rend(); ++it) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%llu %ld %s %llu %llu\n",
+                       (unsigned long long)it->ns, it->tid,
+                       name((Event)it->event), (unsigned long long)it->a,
+                       (unsigned long long)it->b);
+    if (len < 0 || bytes + len > maxBytes) {
+      break;
+    }
+    bytes += len;
+    lines.emplace_back(line, len);
+  }
+
+  std::string out;
+  out.reserve(bytes);
+  for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+    out += *it;
+  }
+  return out;
+}
+
+}  // namespace
+
+void record(Event event, uint64_t a, uint64_t b) {
+  RingHolder &holder = tHolder;
+  if (holder.ring == nullptr) {
+    holder.ring = new Ring();
+    holder.ring->tid = (long)syscall(SYS_gettid);
+    Lock lock(gRingsMutex);
+    liveRings().push_back(holder.ring);
+  }
+
+  Ring &ring = *holder.ring;
+  Slot &slot = ring.slots[ring.count % RingSize];
+  ++ring.count;
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.ns.store(OpStats::now(), std::memory_order_relaxed);
+  slot.a.store(a, std::memory_order_relaxed);
+  slot.b.store(b, std::memory_order_relaxed);
+  slot.seq.store((ring.count << 8) | (uint64_t)event,
+                 std::memory_order_release);
+}
+
+std::string dump(size_t maxBytes) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static std::string text;
+  static uint64_t renderedNs = 0;
+  static size_t renderedMax = 0;
+
+  Lock lock(mutex);
+  uint64_t now = OpStats::now();
+  if (renderedNs == 0 || now - renderedNs >= 1000000000 ||
+      renderedMax != maxBytes) {
+    text = render(maxBytes);
+    renderedNs = now;
+    renderedMax = maxBytes;
+  }
+  return text;
+}
+
+}  // namespace Trace
+}  // namespace encfs
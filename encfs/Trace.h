@@ -0,0 +1,55 @@
+#ifndef _Trace_incl_
+#define _Trace_incl_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace encfs {
+
+/*
+    A record of the most recent events on the data path, kept for when
+    something needs explaining without logging every block: each thread
+    writes fixed size binary records into a ring of its own, and nothing is
+    formatted until the rings are dumped.  Off unless enabled (--trace), at
+    the cost of one relaxed load per event.
+ */
+namespace Trace {
+
+enum Event {
+  FileRead,     // offset, size
+  FileWrite,    // offset, size
+  // the first of a run of blocks, and its size
+  BlockRead,
+  BlockWrite,
+  DecodeFailed,
+  EncodeFailed,
+
+  NumEvents
+};
+
+// events kept per thread; older ones are overwritten
+static const int RingSize = 1024;
+
+extern std::atomic<bool> enabled;
+
+void record(Event event, uint64_t a, uint64_t b);
+
+inline void event(Event event, uint64_t a, uint64_t b) {
+  if (enabled.load(std::memory_order_relaxed)) {
+    record(event, a, b);
+  }
+}
+
+const char *name(Event event);
+
+// the events of all threads in time order, one per line, as
+// "<ns> <thread> <event> <a> <b>", newest last, and no more than maxBytes
+// of them.  Dumps are kept for a second, as stats reports are.
+std::string dump(size_t maxBytes);
+
+}  // namespace Trace
+
+}  // namespace encfs
+
+#endif
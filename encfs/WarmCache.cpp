@@ -0,0 +1,373 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WarmCache.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "Cipher.h"
+#include "DirListCache.h"
+#include "Error.h"
+#include "FileIVCache.h"
+#include "PathCache.h"
+
+namespace encfs {
+
+const char WarmCache::FileName[] = ".encfs6.warm";
+
+// the file: magic, version, IV, MAC of the encrypted body and its length,
+// then the body
+static const uint32_t WarmMagic = 0x43575345;  // "ESWC"
+static const uint32_t WarmVersion = 1;
+static const size_t HeaderSize = 32;
+// a body longer than this is not written, nor believed
+static const size_t MaxBodySize = 256 * 1024 * 1024;
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+static void add32(std::vector<unsigned char> *out, uint32_t v) {
+  unsigned char buf[4];
+  put32(buf, v);
+  out->insert(out->end(), buf, buf + 4);
+}
+
+static void add64(std::vector<unsigned char> *out, uint64_t v) {
+  unsigned char buf[8];
+  put64(buf, v);
+  out->insert(out->end(), buf, buf + 8);
+}
+
+static void addString(std::vector<unsigned char> *out, const std::string &s) {
+  add32(out, (uint32_t)s.size());
+  out->insert(out->end(), s.begin(), s.end());
+}
+
+// reads a body, every read past its end fails
+struct BodyReader {
+  const unsigned char *pos;
+  const unsigned char *end;
+
+  bool u32(uint32_t *v) {
+    if (end - pos < 4) {
+      return false;
+    }
+    *v = get32(pos);
+    pos += 4;
+    return true;
+  }
+  bool u64(uint64_t *v) {
+    if (end - pos < 8) {
+      return false;
+    }
+    *v = get64(pos);
+    pos += 8;
+    return true;
+  }
+  bool str(std::string *s) {
+    uint32_t len;
+    if (!u32(&len) || (size_t)(end - pos) < len) {
+      return false;
+    }
+    s->assign((const char *)pos, len);
+    pos += len;
+    return true;
+  }
+  bool time(struct timespec *ts) {
+    uint64_t sec, nsec;
+    if (!u64(&sec) || !u64(&nsec)) {
+      return false;
+    }
+    ts->tv_sec = (time_t)sec;
+    ts->tv_nsec = (long)nsec;
+    return true;
+  }
+};
+
+static void addTime(std::vector<unsigned char> *out,
+                    const struct timespec &ts) {
+  add64(out, (uint64_t)ts.tv_sec);
+  add64(out, (uint64_t)ts.tv_nsec);
+}
+
+// the body holds plaintext names
+static void wipe(std::vector<unsigned char> *buf) {
+  volatile unsigned char *p = buf->data();
+  for (size_t i = 0; i < buf->size(); ++i) {
+    p[i] = 0;
+  }
+}
+
+WarmCache::WarmCache(const std::string &rootDir,
+                     std::shared_ptr<Cipher> cipher, CipherKey key,
+                     std::shared_ptr<PathCache> pathCache,
+                     std::shared_ptr<FileIVCache> ivCache,
+                     std::shared_ptr<DirListCache> dirListCache)
+    : _path(rootDir + FileName),
+      _cipher(std::move(cipher)),
+      _key(std::move(key)),
+      _pathCache(std::move(pathCache)),
+      _ivCache(std::move(ivCache)),
+      _dirListCache(std::move(dirListCache)),
+      _running(false) {}
+
+WarmCache::~WarmCache() {
+  if (_running) {
+    pthread_join(_thread, nullptr);
+  }
+  save();
+}
+
+void WarmCache::open() {
+  int res = pthread_create(&_thread, nullptr, run, this);
+  if (res != 0) {
+    RLOG(WARNING) << "error starting warm cache thread: " << strerror(res);
+    return;
+  }
+  _running = true;
+}
+
+void *WarmCache::run(void *arg) {
+  ((WarmCache *)arg)->preload();
+  return nullptr;
+}
+
+void WarmCache::preload() {
+  int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  // whatever comes of it, a crash from now on must not find it again
+  ::unlink(_path.c_str());
+
+  unsigned char header[HeaderSize];
+  std::vector<unsigned char> body;
+  bool ok = ::read(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+            get32(header) == WarmMagic && get32(header + 4) == WarmVersion;
+  uint64_t len = ok ? get64(header + 24) : 0;
+  ok = ok && len > 0 && len <= MaxBodySize;
+  if (ok) {
+    body.resize(len);
+    ok = ::read(fd, body.data(), len) == (ssize_t)len;
+  }
+  ::close(fd);
+
+  uint64_t iv = get64(header + 8);
+  uint64_t chain = iv;
+  ok = ok && _cipher->MAC_64(body.data(), (int)len, _key, &chain) ==
+                 get64(header + 16);
+  ok = ok && _cipher->streamDecode(body.data(), (int)len, iv, _key);
+  if (!ok || !restore(body)) {
+    RLOG(WARNING) << "ignoring damaged cache snapshot " << _path;
+  }
+  wipe(&body);
+}
+
+bool WarmCache::restore(const std::vector<unsigned char> &in) {
+  BodyReader r = {in.data(), in.data() + in.size()};
+  uint32_t count;
+  if (!r.u32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    PathCache::Entry entry;
+    if (!r.str(&entry.plainPath) || !r.str(&entry.cipherPath) ||
+        !r.u64(&entry.iv)) {
+      return false;
+    }
+    if (_pathCache) {
+      _pathCache->preload(entry);
+    }
+  }
+  size_t paths = count;
+
+  if (!r.u32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    FileIVCache::Entry entry;
+    uint64_t dev, ino;
+    if (!r.u64(&dev) || !r.u64(&ino) || !r.time(&entry.mtime) ||
+        !r.u64(&entry.iv)) {
+      return false;
+    }
+    entry.key.dev = (dev_t)dev;
+    entry.key.ino = (ino_t)ino;
+    if (_ivCache) {
+      _ivCache->preload(entry);
+    }
+  }
+  size_t headers = count;
+
+  if (!r.u32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    auto listing = std::make_shared<DirListCache::Listing>();
+    uint64_t dev, ino;
+    uint32_t names;
+    if (!r.u64(&dev) || !r.u64(&ino) || !r.time(&listing->mtime) ||
+        !r.time(&listing->ctime) || !r.u32(&names)) {
+      return false;
+    }
+    // each name takes at least 20 bytes
+    if ((size_t)(r.end - r.pos) / 20 < names) {
+      return false;
+    }
+    listing->entries.resize(names);
+    for (DirListCache::Entry &entry : listing->entries) {
+      uint64_t inode;
+      uint32_t type;
+      if (!r.str(&entry.name) || !r.str(&entry.cipherName) ||
+          !r.u64(&inode) || !r.u32(&type)) {
+        return false;
+      }
+      entry.inode = (ino_t)inode;
+      entry.fileType = (int)type;
+    }
+    if (_dirListCache) {
+      _dirListCache->preload(
+          DirListCache::Kept{(dev_t)dev, (ino_t)ino, listing});
+    }
+  }
+  VLOG(1) << "preloaded " << paths << " paths, " << headers
+          << " file headers and " << count << " listings from " << _path;
+  return r.pos == r.end;
+}
+
+void WarmCache::snapshot(std::vector<unsigned char> *out) {
+  std::vector<PathCache::Entry> paths;
+  if (_pathCache) {
+    paths = _pathCache->hottest();
+  }
+  add32(out, (uint32_t)paths.size());
+  for (PathCache::Entry &entry : paths) {
+    addString(out, entry.plainPath);
+    addString(out, entry.cipherPath);
+    add64(out, entry.iv);
+    entry.plainPath.assign(entry.plainPath.size(), ' ');
+  }
+
+  std::vector<FileIVCache::Entry> headers;
+  if (_ivCache) {
+    headers = _ivCache->hottest();
+  }
+  add32(out, (uint32_t)headers.size());
+  for (const FileIVCache::Entry &entry : headers) {
+    add64(out, (uint64_t)entry.key.dev);
+    add64(out, (uint64_t)entry.key.ino);
+    addTime(out, entry.mtime);
+    add64(out, entry.iv);
+  }
+
+  std::vector<DirListCache::Kept> listings;
+  if (_dirListCache) {
+    listings = _dirListCache->hottest();
+  }
+  add32(out, (uint32_t)listings.size());
+  for (const DirListCache::Kept &kept : listings) {
+    add64(out, (uint64_t)kept.dev);
+    add64(out, (uint64_t)kept.ino);
+    addTime(out, kept.listing->mtime);
+    addTime(out, kept.listing->ctime);
+    add32(out, (uint32_t)kept.listing->entries.size());
+    for (const DirListCache::Entry &entry : kept.listing->entries) {
+      addString(out, entry.name);
+      addString(out, entry.cipherName);
+      add64(out, (uint64_t)entry.inode);
+      add32(out, (uint32_t)entry.fileType);
+    }
+  }
+}
+
+void WarmCache::save() {
+  std::vector<unsigned char> body;
+  snapshot(&body);
+  // three empty counts
+  if (body.size() <= 12 || body.size() > MaxBodySize ||
+      body.size() > (size_t)INT_MAX) {
+    wipe(&body);
+    return;
+  }
+
+  unsigned char header[HeaderSize];
+  unsigned char ivBytes[8];
+  bool ok = _cipher->randomize(ivBytes, sizeof(ivBytes), false);
+  uint64_t iv = get64(ivBytes);
+  ok = ok && _cipher->streamEncode(body.data(), (int)body.size(), iv, _key);
+  if (!ok) {
+    RLOG(WARNING) << "unable to encrypt the cache snapshot";
+    wipe(&body);
+    return;
+  }
+  uint64_t chain = iv;
+  put32(header, WarmMagic);
+  put32(header + 4, WarmVersion);
+  put64(header + 8, iv);
+  put64(header + 16,
+        _cipher->MAC_64(body.data(), (int)body.size(), _key, &chain));
+  put64(header + 24, body.size());
+
+  std::string tmp = _path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  ok = fd >= 0 &&
+       ::write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+       ::write(fd, body.data(), body.size()) == (ssize_t)body.size() &&
+       ::fsync(fd) == 0;
+  if (fd >= 0) {
+    ok = ::close(fd) == 0 && ok;
+  }
+  if (!ok || ::rename(tmp.c_str(), _path.c_str()) != 0) {
+    RLOG(WARNING) << "unable to write the cache snapshot " << _path << ": "
+                  << strerror(errno);
+    ::unlink(tmp.c_str());
+    return;
+  }
+  VLOG(1) << "wrote a cache snapshot of " << body.size() << " bytes to "
+          << _path;
+}
+
+}  // namespace encfs
@@ -0,0 +1,79 @@
+#ifndef _WarmCache_incl_
+#define _WarmCache_incl_
+
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "CipherKey.h"
+
+namespace encfs {
+
+class Cipher;
+class DirListCache;
+class FileIVCache;
+class PathCache;
+
+/*
+    The hot entries of the caches of a mount, kept from one mount to the
+    next (--warm-restart), so that a remount, or a mount on demand after
+    an idle unmount, does not start with every path to encode, header to
+    read and directory to decode again.
+
+    Kept are the caches whose entries are checked against the backing
+    store when used: the encoded paths, which only depend on the key, and
+    the decoded file headers and directory listings, which only hold while
+    the backing file or directory has the inode and mtime they were read
+    with.  The TTL bound caches (negative lookups, attributes) would have
+    expired before anything asked them.
+
+    The snapshot is written when the mount is torn down, encrypted under
+    the volume key and with a MAC, to a file in the root of the backing
+    directory.  The next mount removes it and loads it into its caches on
+    a thread of its own, behind what it has looked up by then; a crash in
+    between leaves nothing to load.
+ */
+class WarmCache {
+ public:
+  // the snapshot, in the root of the backing directory
+  static const char FileName[];
+
+  WarmCache(const std::string &rootDir, std::shared_ptr<Cipher> cipher,
+            CipherKey key, std::shared_ptr<PathCache> pathCache,
+            std::shared_ptr<FileIVCache> ivCache,
+            std::shared_ptr<DirListCache> dirListCache);
+  // waits for the preload, and writes the snapshot
+  ~WarmCache();
+
+  // starts loading the snapshot an earlier mount left, if there is one
+  void open();
+
+ private:
+  static void *run(void *arg);
+  void preload();
+  // the entries of the caches, not yet encrypted
+  void snapshot(std::vector<unsigned char> *out);
+  // puts the entries of a snapshot into the caches, false if it is
+  // malformed
+  bool restore(const std::vector<unsigned char> &in);
+  void save();
+
+  std::string _path;
+  std::shared_ptr<Cipher> _cipher;
+  CipherKey _key;
+  std::shared_ptr<PathCache> _pathCache;
+  std::shared_ptr<FileIVCache> _ivCache;
+  std::shared_ptr<DirListCache> _dirListCache;
+
+  bool _running;
+  pthread_t _thread;
+
+  WarmCache(const WarmCache &);             // not allowed
+  WarmCache &operator=(const WarmCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
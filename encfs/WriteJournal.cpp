@@ -0,0 +1,725 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WriteJournal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iterator>
+#include <unistd.h>
+
+#include "Error.h"
+#include "FileIO.h"
+#include "Mutex.h"
+
+namespace encfs {
+
+const char WriteJournal::FileName[] = ".encfs6.journal";
+
+// a record: magic, path length, data length, 0, offset, then the path
+// relative to the root, the data and a checksum of all of it
+static const uint32_t RecordMagic = 0x4a575345;  // "ESWJ"
+static const size_t HeaderSize = 24;
+static const size_t SumSize = 8;
+
+struct WriteJournal::File {
+  Inode inode;
+  int fd;  // of the backing file, held while it has extents
+  // logged since the last checkpoint began
+  Extents pending;
+  // being written by a checkpoint, under those logged since
+  Extents applying;
+  size_t bytes;  // of both
+  uint64_t applied;
+};
+
+static void put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+// FNV-1a over words rather than bytes, only there to tell a torn append
+static uint64_t checksum(const unsigned char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (; i < len; ++i) {
+    h = (h ^ data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// all of len bytes, 0 or -errno
+static int writeAll(int fd, const unsigned char *data, size_t len,
+                    off_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pwrite(fd, data, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int syncData(int fd) {
+#if defined(HAVE_FDATASYNC)
+  int res = ::fdatasync(fd);
+#else
+  int res = ::fsync(fd);
+#endif
+  return res == -1 ? -errno : 0;
+}
+
+// a path a record may be replayed into: relative, and not out of the root
+static bool safePath(const std::string &path) {
+  if (path.empty() || path[0] == '/') {
+    return false;
+  }
+  size_t start = 0;
+  for (;;) {
+    size_t slash = path.find('/', start);
+    std::string part = path.substr(start, slash - start);
+    if (part.empty() || part == "." || part == "..") {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+    start = slash + 1;
+  }
+}
+
+WriteJournal::WriteJournal(const std::string &rootDir)
+    : _rootDir(rootDir),
+      _path(rootDir + FileName),
+      _fd(-1),
+      _pendingBytes(0),
+      _openFiles(0),
+      _logged(0),
+      _durable(0),
+      _journalEnd(0),
+      _running(false),
+      _stopping(false) {
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(&_wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&_commitMutex, nullptr);
+  pthread_rwlock_init(&_applyLock, nullptr);
+}
+
+WriteJournal::~WriteJournal() {
+  if (_running) {
+    {
+      Lock lock(_mutex);
+      _stopping = true;
+      pthread_cond_signal(&_wake);
+    }
+    pthread_join(_thread, nullptr);
+  }
+  if (_fd >= 0) {
+    int res = checkpoint();
+    if (res < 0) {
+      RLOG(ERROR) << "unable to checkpoint " << _path << ", left for the "
+                  << "next mount: " << strerror(-res);
+    } else {
+      ::unlink(_path.c_str());
+    }
+    ::close(_fd);
+  }
+  for (auto &it : _files) {
+    if (it.second->fd >= 0) {
+      ::close(it.second->fd);
+    }
+  }
+
+  pthread_rwlock_destroy(&_applyLock);
+  pthread_mutex_destroy(&_commitMutex);
+  pthread_cond_destroy(&_wake);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool WriteJournal::open() {
+  _fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat st;
+  if (_fd < 0 || ::fstat(_fd, &st) != 0) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to open the write journal " << _path << ": "
+                << strerror(eno);
+    return false;
+  }
+  if (st.st_size > 0 && replayLeftover() < 0) {
+    return false;
+  }
+
+  int res = pthread_create(&_thread, nullptr, run, this);
+  if (res != 0) {
+    RLOG(ERROR) << "error starting write journal thread: " << strerror(res);
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+int WriteJournal::recover(const std::string &rootDir) {
+  WriteJournal journal(rootDir);
+  journal._fd = ::open(journal._path.c_str(), O_RDWR | O_CLOEXEC);
+  if (journal._fd < 0) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+  int res = journal.replayLeftover();
+  if (res < 0) {
+    // kept for the next mount to try again
+    ::close(journal._fd);
+    journal._fd = -1;
+  }
+  // the destructor removes the journal, now empty
+  return res;
+}
+
+int WriteJournal::replayLeftover() {
+  struct stat st;
+  if (::fstat(_fd, &st) != 0) {
+    return -errno;
+  }
+  if (st.st_size == 0) {
+    return 0;
+  }
+  int res = replay(_fd, st.st_size);
+  if (res < 0) {
+    RLOG(ERROR) << "unable to replay the write journal " << _path << ": "
+                << strerror(-res);
+    return res;
+  }
+  if (::ftruncate(_fd, 0) != 0 || ::fsync(_fd) != 0) {
+    int eno = errno;
+    RLOG(ERROR) << "unable to empty " << _path << ": " << strerror(eno);
+    return -eno;
+  }
+  return 0;
+}
+
+int WriteJournal::replay(int fd, off_t size) {
+  std::vector<unsigned char> buf(size);
+  ssize_t got = ::pread(fd, buf.data(), size, 0);
+  if (got != size) {
+    return got < 0 ? -errno : -EIO;
+  }
+  RLOG(WARNING) << "Replaying the writes of an interrupted mount from "
+                << _path;
+
+  std::map<std::string, int> fds;
+  uint64_t records = 0;
+  size_t pos = 0;
+  int res = 0;
+  while (pos + HeaderSize + SumSize <= (size_t)size) {
+    const unsigned char *rec = &buf[pos];
+    size_t pathLen = get32(rec + 4);
+    size_t dataLen = get32(rec + 8);
+    size_t len = HeaderSize + pathLen + dataLen;
+    if (get32(rec) != RecordMagic || len + SumSize > (size_t)size - pos ||
+        checksum(rec, len) != get64(rec + len)) {
+      break;
+    }
+    std::string path((const char *)rec + HeaderSize, pathLen);
+    off_t offset = (off_t)get64(rec + 16);
+    pos += len + SumSize;
+    ++records;
+
+    auto it = fds.find(path);
+    if (it == fds.end()) {
+      int fileFd = -1;
+      if (safePath(path)) {
+        // a file that went away takes its writes along
+        fileFd = ::open((_rootDir + path).c_str(), O_WRONLY | O_CLOEXEC);
+      } else {
+        RLOG(WARNING) << "Skipping the writes to " << path << " in "
+                      << _path;
+      }
+      it = fds.insert(std::make_pair(path, fileFd)).first;
+    }
+    if (it->second >= 0) {
+      int wres = writeAll(it->second, rec + HeaderSize + pathLen, dataLen,
+                          offset);
+      if (wres < 0) {
+        RLOG(ERROR) << "Error replaying a write to " << path << ": "
+                    << strerror(-wres);
+        res = wres;
+      }
+    }
+  }
+  if (pos != (size_t)size) {
+    RLOG(WARNING) << "Dropping the torn end of " << _path << " at " << pos;
+  }
+
+  for (auto &it : fds) {
+    if (it.second >= 0) {
+      int sres = syncData(it.second);
+      if (sres < 0 && res == 0) {
+        res = sres;
+      }
+      ::close(it.second);
+    }
+  }
+  RLOG(WARNING) << "Replayed " << records << " writes to " << fds.size()
+                << " files";
+  return res;
+}
+
+void *WriteJournal::run(void *arg) {
+  ((WriteJournal *)arg)->checkpoints();
+  VLOG(1) << "write journal thread exiting";
+  return nullptr;
+}
+
+void WriteJournal::checkpoints() {
+  pthread_mutex_lock(&_mutex);
+  while (!_stopping) {
+    struct timespec deadline;
+#if defined(__APPLE__)
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#endif
+    deadline.tv_sec += CheckpointSecs;
+
+    bool timedOut = false;
+    while (!_stopping && !timedOut && _buffer.size() < CommitBytes) {
+      timedOut = pthread_cond_timedwait(&_wake, &_mutex, &deadline) ==
+                 ETIMEDOUT;
+    }
+    if (_stopping) {
+      break;
+    }
+    // a full buffer is only appended, unless the extents pile up
+    bool apply = timedOut || _pendingBytes >= MaxPendingBytes / 2;
+    bool idle = _pendingBytes == 0;
+    pthread_mutex_unlock(&_mutex);
+
+    int res = 0;
+    if (apply && !idle) {
+      res = checkpoint();
+    } else if (!apply) {
+      res = commit();
+    }
+    if (res < 0) {
+      RLOG(ERROR) << "write journal: " << strerror(-res);
+    }
+    pthread_mutex_lock(&_mutex);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+std::shared_ptr<WriteJournal::File> WriteJournal::attach(
+    const struct stat &st) {
+  Inode inode(st.st_dev, st.st_ino);
+  Lock lock(_mutex);
+  std::shared_ptr<File> &file = _files[inode];
+  if (!file) {
+    file = std::make_shared<File>();
+    file->inode = inode;
+    file->fd = -1;
+    file->bytes = 0;
+    file->applied = 0;
+  }
+  return file;
+}
+
+long WriteJournal::insert(Extents *extents, off_t offset,
+                          const unsigned char *data, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  off_t end = offset + (off_t)len;
+  long grown = 0;
+
+  auto it = extents->lower_bound(offset);
+  if (it != extents->begin()) {
+    auto prev = std::prev(it);
+    off_t prevEnd = prev->first + (off_t)prev->second.size();
+    if (prevEnd >= end) {
+      // all within what is there
+      memcpy(prev->second.data() + (offset - prev->first), data, len);
+      return 0;
+    }
+    if (prevEnd > offset) {
+      grown -= prevEnd - offset;
+      prev->second.resize(offset - prev->first);
+    }
+  }
+  while (it != extents->end() && it->first < end) {
+    off_t itEnd = it->first + (off_t)it->second.size();
+    if (itEnd > end) {
+      // keep the part past the new bytes
+      std::vector<unsigned char> tail(it->second.begin() + (end - it->first),
+                                      it->second.end());
+      grown -= end - it->first;
+      extents->erase(it);
+      (*extents)[end].swap(tail);
+      break;
+    }
+    grown -= it->second.size();
+    it = extents->erase(it);
+  }
+  (*extents)[offset].assign(data, data + len);
+  return grown + (long)len;
+}
+
+off_t WriteJournal::endOf(const File &file) {
+  off_t end = 0;
+  for (const Extents *extents : {&file.pending, &file.applying}) {
+    if (!extents->empty()) {
+      auto last = std::prev(extents->end());
+      end = std::max(end, last->first + (off_t)last->second.size());
+    }
+  }
+  return end;
+}
+
+int WriteJournal::write(File &file, int fd, const std::string &path,
+                        off_t offset, const unsigned char *data,
+                        size_t len) {
+  if (path.compare(0, _rootDir.size(), _rootDir) != 0) {
+    return -EINVAL;
+  }
+  std::string name = path.substr(_rootDir.size());
+
+  bool full;
+  {
+    Lock lock(_mutex);
+    if (file.fd < 0) {
+      file.fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      if (file.fd < 0) {
+        return -errno;
+      }
+      ++_openFiles;
+    }
+
+    size_t recLen = HeaderSize + name.size() + len;
+    size_t start = _buffer.size();
+    _buffer.resize(start + recLen + SumSize);
+    unsigned char *rec = &_buffer[start];
+    put32(rec, RecordMagic);
+    put32(rec + 4, name.size());
+    put32(rec + 8, len);
+    put32(rec + 12, 0);
+    put64(rec + 16, (uint64_t)offset);
+    memcpy(rec + HeaderSize, name.data(), name.size());
+    memcpy(rec + HeaderSize + name.size(), data, len);
+    put64(rec + recLen, checksum(rec, recLen));
+    _logged += recLen + SumSize;
+    _bufferPaths.insert(name);
+
+    long grown = insert(&file.pending, offset, data, len);
+    file.bytes += grown;
+    _pendingBytes += grown;
+
+    if (start < CommitBytes && _buffer.size() >= CommitBytes) {
+      pthread_cond_signal(&_wake);
+    }
+    full = _pendingBytes > MaxPendingBytes || _openFiles > MaxFiles;
+  }
+
+  if (full) {
+    int res = checkpoint();
+    if (res < 0) {
+      // the write is logged, and goes with the next checkpoint
+      RLOG(WARNING) << "write journal checkpoint failed: " << strerror(-res);
+    }
+  }
+  return 0;
+}
+
+size_t WriteJournal::overlay(File &file, const IORequest &req,
+                             size_t got) {
+  Lock lock(_mutex);
+  size_t res = got;
+  off_t reqEnd = req.offset + (off_t)req.dataLen;
+  // the older extents first, those logged since go over them
+  for (const Extents *extents : {&file.applying, &file.pending}) {
+    auto it = extents->upper_bound(req.offset);
+    if (it != extents->begin()) {
+      auto prev = std::prev(it);
+      if (prev->first + (off_t)prev->second.size() > req.offset) {
+        it = prev;
+      }
+    }
+    for (; it != extents->end() && it->first < reqEnd; ++it) {
+      off_t from = std::max(it->first, req.offset);
+      off_t to = std::min(it->first + (off_t)it->second.size(), reqEnd);
+      size_t at = from - req.offset;
+      if (at > res) {
+        // a hole up to it, past the end of the backing file
+        memset(req.data + res, 0, at - res);
+      }
+      memcpy(req.data + at, it->second.data() + (from - it->first),
+             to - from);
+      res = std::max(res, (size_t)(to - req.offset));
+    }
+  }
+  // a hole past the end of the backing file, below a later extent
+  off_t end = std::min(endOf(file), reqEnd);
+  if (end > req.offset + (off_t)res) {
+    memset(req.data + res, 0, end - req.offset - res);
+    res = end - req.offset;
+  }
+  return res;
+}
+
+off_t WriteJournal::size(File &file) {
+  Lock lock(_mutex);
+  return endOf(file);
+}
+
+uint64_t WriteJournal::applied(File &file) {
+  Lock lock(_mutex);
+  return file.applied;
+}
+
+void WriteJournal::pendingAttr(struct stat *stbuf) {
+  if (!S_ISREG(stbuf->st_mode)) {
+    return;
+  }
+  Lock lock(_mutex);
+  auto it = _files.find(Inode(stbuf->st_dev, stbuf->st_ino));
+  if (it != _files.end()) {
+    stbuf->st_size = std::max(stbuf->st_size, endOf(*it->second));
+  }
+}
+
+int WriteJournal::append(std::vector<unsigned char> *buf, uint64_t upTo) {
+  if (buf->empty()) {
+    return 0;
+  }
+  int res = writeAll(_fd, buf->data(), buf->size(), _journalEnd);
+  if (res == 0) {
+    res = syncData(_fd);
+  }
+  if (res < 0) {
+    // back in front of what was buffered since, for the next try
+    Lock lock(_mutex);
+    buf->insert(buf->end(), _buffer.begin(), _buffer.end());
+    _buffer.swap(*buf);
+    return res;
+  }
+  _journalEnd += buf->size();
+  Lock lock(_mutex);
+  _durable = upTo;
+  return 0;
+}
+
+int WriteJournal::commit() {
+  uint64_t wanted;
+  {
+    Lock lock(_mutex);
+    wanted = _logged;
+  }
+  Lock commitLock(_commitMutex);
+
+  std::vector<unsigned char> buf;
+  uint64_t upTo;
+  {
+    Lock lock(_mutex);
+    if (_durable >= wanted) {
+      // made durable by whoever held the commit lock before us
+      return 0;
+    }
+    buf.swap(_buffer);
+    upTo = _logged;
+    _paths.insert(_bufferPaths.begin(), _bufferPaths.end());
+    _bufferPaths.clear();
+  }
+  return append(&buf, upTo);
+}
+
+int WriteJournal::checkpoint() {
+  Lock commitLock(_commitMutex);
+
+  // the records and the extents of the same writes, so that emptying the
+  // journal below drops no record of a write still to be applied
+  std::vector<std::shared_ptr<File>> files;
+  std::vector<unsigned char> buf;
+  uint64_t upTo;
+  {
+    Lock lock(_mutex);
+    for (auto &it : _files) {
+      File &file = *it.second;
+      if (file.applying.empty()) {
+        file.applying.swap(file.pending);
+      } else {
+        // left by a checkpoint that failed
+        for (auto &ext : file.pending) {
+          long grown = insert(&file.applying, ext.first, ext.second.data(),
+                              ext.second.size());
+          file.bytes += grown - ext.second.size();
+          _pendingBytes += grown - ext.second.size();
+        }
+        file.pending.clear();
+      }
+      if (!file.applying.empty()) {
+        files.push_back(it.second);
+      }
+    }
+    buf.swap(_buffer);
+    upTo = _logged;
+    _paths.insert(_bufferPaths.begin(), _bufferPaths.end());
+    _bufferPaths.clear();
+  }
+  if (files.empty() && buf.empty() && _journalEnd == 0) {
+    return 0;
+  }
+
+  int res = append(&buf, upTo);
+  if (res < 0) {
+    return res;
+  }
+
+  // only now that the journal holds them may the blocks be written over
+  for (auto &file : files) {
+    int fres = 0;
+    for (auto &ext : file->applying) {
+      fres = writeAll(file->fd, ext.second.data(), ext.second.size(),
+                      ext.first);
+      if (fres < 0) {
+        break;
+      }
+    }
+    if (fres == 0) {
+      fres = syncData(file->fd);
+    }
+    if (fres < 0) {
+      RLOG(ERROR) << "write journal: unable to write back to inode "
+                  << file->inode.second << ": " << strerror(-fres);
+      res = fres;
+    }
+  }
+  if (res < 0) {
+    // all of it stays, in the journal and in memory, for the next try
+    return res;
+  }
+
+  {
+    WriteLock applyLock(_applyLock);
+    Lock lock(_mutex);
+    for (auto &file : files) {
+      size_t bytes = 0;
+      for (auto &ext : file->applying) {
+        bytes += ext.second.size();
+      }
+      file->applying.clear();
+      file->bytes -= bytes;
+      _pendingBytes -= bytes;
+      ++file->applied;
+    }
+  }
+  files.clear();
+
+  if (::ftruncate(_fd, 0) != 0 || ::fsync(_fd) != 0) {
+    return -errno;
+  }
+  _journalEnd = 0;
+
+  Lock lock(_mutex);
+  _paths.clear();
+  for (auto it = _files.begin(); it != _files.end();) {
+    File &file = *it->second;
+    if (file.pending.empty() && file.applying.empty()) {
+      if (file.fd >= 0) {
+        ::close(file.fd);
+        file.fd = -1;
+        --_openFiles;
+      }
+      if (it->second.use_count() == 1) {
+        it = _files.erase(it);
+        continue;
+      }
+    }
+    ++it;
+  }
+  return 0;
+}
+
+int WriteJournal::settle(File &file) {
+  {
+    Lock lock(_mutex);
+    if (file.pending.empty() && file.applying.empty()) {
+      return 0;
+    }
+  }
+  return checkpoint();
+}
+
+int WriteJournal::settleBelow(const std::string &path) {
+  if (path.compare(0, _rootDir.size(), _rootDir) != 0) {
+    return 0;
+  }
+  std::string name = path.substr(_rootDir.size());
+  std::string below = name + "/";
+  {
+    Lock lock(_mutex);
+    bool named = false;
+    for (const std::set<std::string> *paths : {&_paths, &_bufferPaths}) {
+      auto it = paths->lower_bound(below);
+      named = named || paths->count(name) != 0 ||
+              (it != paths->end() && it->compare(0, below.size(), below) == 0);
+    }
+    if (!named) {
+      return 0;
+    }
+  }
+  return checkpoint();
+}
+
+}  // namespace encfs
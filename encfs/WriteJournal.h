@@ -0,0 +1,171 @@
+#ifndef _WriteJournal_incl_
+#define _WriteJournal_incl_
+
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+namespace encfs {
+
+struct IORequest;
+
+/*
+    Write-ahead journal of the backing file writes of a mount
+    (--write-journal), so that the blocks of a MAC volume are never left
+    half written by a crash, and so fail their MAC.  Shared by every file
+    of the filesystem.
+
+    A write goes to a buffer in memory and is kept as an extent of its
+    backing file, which reads and sizes of the file see.  From time to
+    time, at an fsync, or once enough is buffered, the buffer is appended
+    to the journal in the root of the backing directory with one write,
+    and synced: that is all an fsync waits for.  A checkpoint then writes
+    the extents into their backing files, syncs them and empties the
+    journal.
+
+    Records are looked up by inode.  The journal names each backing file
+    by its path, so that a mount after a crash can replay it; a rename or
+    unlink of a path settles the journal first (settleBelow), so that no
+    record it holds names a path that went away.
+ */
+class WriteJournal {
+ public:
+  // the journal, in the root of the backing directory
+  static const char FileName[];
+  // logged bytes held in memory past which writers checkpoint first
+  static const size_t MaxPendingBytes = 64 * 1024 * 1024;
+  // buffered bytes past which the checkpoint thread is woken
+  static const size_t CommitBytes = 4 * 1024 * 1024;
+  // files with logged bytes past which writers checkpoint first, each
+  // holds a descriptor
+  static const size_t MaxFiles = 256;
+  // how often the checkpoint thread runs
+  static const int CheckpointSecs = 5;
+
+  // the pending writes of one backing file, defined in WriteJournal.cpp
+  struct File;
+
+  // held across a look at a backing file and at what is logged for it, so
+  // that no checkpoint drops what it wrote into the file in between
+  class Reader {
+   public:
+    explicit Reader(WriteJournal &journal) : _lock(&journal._applyLock) {
+      pthread_rwlock_rdlock(_lock);
+    }
+    ~Reader() { pthread_rwlock_unlock(_lock); }
+
+   private:
+    pthread_rwlock_t *_lock;
+
+    Reader(const Reader &);             // not allowed
+    Reader &operator=(const Reader &);  // not allowed
+  };
+
+  explicit WriteJournal(const std::string &rootDir);
+  // checkpoints, and removes the journal
+  ~WriteJournal();
+
+  // replays what a crash left in the journal into the backing files, and
+  // starts the checkpoint thread.  False if the journal can not be used.
+  bool open();
+
+  // replays what a crash left in the journal of rootDir into the backing
+  // files and removes the journal, for a mount that does not journal.
+  // Without it the synced writes held there would be lost, and replayed
+  // over newer data by a later mount that journals.  0 if there was
+  // nothing to replay, or -errno.
+  static int recover(const std::string &rootDir);
+
+  // the pending writes of the backing file with attributes st
+  std::shared_ptr<File> attach(const struct stat &st);
+
+  // logs len bytes at offset of the backing file at path, open as fd.
+  // Returns 0 or -errno.
+  int write(File &file, int fd, const std::string &path, off_t offset,
+            const unsigned char *data, size_t len);
+  // puts what is logged for file over req, of which got bytes were read
+  // from the backing file under a Reader.  Returns the bytes read.
+  size_t overlay(File &file, const IORequest &req, size_t got);
+  // end of the bytes logged for file, 0 if there are none
+  off_t size(File &file);
+  // counts the checkpoints that wrote into file, its backing file changed
+  // size and content behind our back when this moves
+  uint64_t applied(File &file);
+  // raises st_size of the backing file stat'ed as stbuf to cover what is
+  // logged for it
+  void pendingAttr(struct stat *stbuf);
+
+  // makes everything logged so far durable in the journal, 0 or -errno
+  int commit();
+  // commits, writes every logged extent into its backing file and empties
+  // the journal.  0 or -errno.
+  int checkpoint();
+  // checkpoints if anything is logged for file
+  int settle(File &file);
+  // checkpoints if the journal names path, or a path below it
+  int settleBelow(const std::string &path);
+
+ private:
+  using Extents = std::map<off_t, std::vector<unsigned char>>;
+  using Inode = std::pair<dev_t, ino_t>;
+
+  static void *run(void *arg);
+  void checkpoints();
+
+  // end of the extents of file.  Caller holds _mutex.
+  static off_t endOf(const File &file);
+  // puts len bytes at offset over what extents holds there, and returns
+  // how many bytes extents grew by
+  static long insert(Extents *extents, off_t offset,
+                     const unsigned char *data, size_t len);
+  // appends buf, the records buffered up to _logged == upTo, to the
+  // journal and syncs it.  Caller holds _commitMutex.  0 or -errno.
+  int append(std::vector<unsigned char> *buf, uint64_t upTo);
+  // writes of a journal from a crash back into their files
+  int replay(int fd, off_t size);
+  // replays and empties the journal open as _fd, 0 or -errno
+  int replayLeftover();
+
+  std::string _rootDir;
+  std::string _path;
+  int _fd;
+
+  // logged writes, their records buffered and their extents per inode
+  pthread_mutex_t _mutex;
+  pthread_cond_t _wake;
+  std::map<Inode, std::shared_ptr<File>> _files;
+  // paths named by the journal, and by the records buffered since it was
+  // last appended to, see settleBelow
+  std::set<std::string> _paths;
+  std::set<std::string> _bufferPaths;
+  std::vector<unsigned char> _buffer;
+  size_t _pendingBytes;
+  size_t _openFiles;  // with logged extents, and so a descriptor
+  uint64_t _logged;   // bytes of records ever buffered
+  uint64_t _durable;  // of them, synced to the journal
+
+  // held by commits and checkpoints, one at a time
+  pthread_mutex_t _commitMutex;
+  off_t _journalEnd;
+  // write locked by a checkpoint dropping the extents it wrote, see
+  // Reader
+  pthread_rwlock_t _applyLock;
+
+  bool _running;
+  bool _stopping;
+  pthread_t _thread;
+
+  WriteJournal(const WriteJournal &);             // not allowed
+  WriteJournal &operator=(const WriteJournal &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
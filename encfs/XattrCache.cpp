@@ -0,0 +1,213 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "XattrCache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#include "Error.h"
+#include "Mutex.h"
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+namespace encfs {
+
+static int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+XattrCache::XattrCache(size_t maxPaths, int ttlMs)
+    : _maxShardPaths(maxPaths > NumShards ? maxPaths / NumShards : 1),
+      _ttlMs(ttlMs),
+      _hits(0),
+      _misses(0) {
+  for (Shard &shard : _shards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+    shard.generation = 0;
+  }
+}
+
+XattrCache::~XattrCache() {
+  VLOG(1) << "xattr cache: " << hits() << " hits, " << misses() << " misses";
+  for (Shard &shard : _shards) {
+    pthread_mutex_destroy(&shard.mutex);
+  }
+}
+
+XattrCache::Shard &XattrCache::shardFor(const char *plainPath) {
+  size_t h = std::hash<std::string>()(plainPath);
+  return _shards[(h ^ (h >> 17)) % NumShards];
+}
+
+// what getxattr or listxattr return for a recorded result, given a buffer
+// of size bytes
+static int answer(int res, const std::string &data, char *buf, size_t size) {
+  if (res < 0 || size == 0) {
+    return res;
+  }
+  if (size < (size_t)res) {
+    return -ERANGE;
+  }
+  memcpy(buf, data.data(), res);
+  return res;
+}
+
+bool XattrCache::get(const char *plainPath, const char *name, char *value,
+                     size_t size, int *res, uint64_t *generation) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  auto pathIt = shard.paths.find(plainPath);
+  if (pathIt != shard.paths.end()) {
+    auto it = pathIt->second.names.find(name);
+    if (it != pathIt->second.names.end()) {
+      if (it->second.expires > monotonicMs()) {
+        *res = answer(it->second.res, it->second.data, value, size);
+        ++_hits;
+        return true;
+      }
+      pathIt->second.names.erase(it);
+    }
+  }
+  ++_misses;
+  *generation = shard.generation;
+  return false;
+}
+
+bool XattrCache::getList(const char *plainPath, char *list, size_t size,
+                         int *res, uint64_t *generation) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  auto pathIt = shard.paths.find(plainPath);
+  if (pathIt != shard.paths.end()) {
+    Value &v = pathIt->second.list;
+    if (v.expires > monotonicMs()) {
+      *res = answer(v.res, v.data, list, size);
+      ++_hits;
+      return true;
+    }
+    v.expires = 0;
+  }
+  ++_misses;
+  *generation = shard.generation;
+  return false;
+}
+
+void XattrCache::add(const char *plainPath, const char *name,
+                     const char *value, int res, uint64_t generation) {
+  store(plainPath, name, value, res, generation);
+}
+
+void XattrCache::addList(const char *plainPath, const char *list, int res,
+                         uint64_t generation) {
+  store(plainPath, nullptr, list, res, generation);
+}
+
+void XattrCache::store(const char *plainPath, const char *name,
+                       const char *data, int res, uint64_t generation) {
+  if (res < 0 ? (res != -ENODATA && res != -ENOATTR)
+              : (size_t)res > MaxValue) {
+    return;
+  }
+  Shard &shard = shardFor(plainPath);
+  int64_t now = monotonicMs();
+
+  Lock lock(shard.mutex);
+  if (shard.generation != generation) {
+    // the attributes may have changed while they were looked up
+    return;
+  }
+  if (shard.paths.size() >= _maxShardPaths &&
+      shard.paths.find(plainPath) == shard.paths.end()) {
+    makeRoom(shard, now);
+  }
+  Entry &entry = shard.paths[plainPath];
+  Value &v = name != nullptr ? entry.names[name] : entry.list;
+  v.res = res;
+  v.data.assign(data, res > 0 ? res : 0);
+  v.expires = now + _ttlMs;
+}
+
+void XattrCache::makeRoom(Shard &shard, int64_t now) {
+  auto pathIt = shard.paths.begin();
+  while (pathIt != shard.paths.end()) {
+    Entry &entry = pathIt->second;
+    for (auto it = entry.names.begin(); it != entry.names.end();) {
+      if (it->second.expires <= now) {
+        it = entry.names.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (entry.list.expires <= now) {
+      entry.list.expires = 0;
+    }
+    if (entry.names.empty() && entry.list.expires == 0) {
+      pathIt = shard.paths.erase(pathIt);
+    } else {
+      ++pathIt;
+    }
+  }
+
+  if (shard.paths.size() >= _maxShardPaths) {
+    shard.paths.clear();
+  }
+}
+
+void XattrCache::erase(const char *plainPath) {
+  Shard &shard = shardFor(plainPath);
+
+  Lock lock(shard.mutex);
+  ++shard.generation;
+  shard.paths.erase(plainPath);
+}
+
+void XattrCache::eraseBelow(const char *plainPath) {
+  size_t len = strlen(plainPath);
+  // "/" or "/dir/" cover everything below them as they are
+  bool isPrefix = len > 0 && plainPath[len - 1] == '/';
+
+  for (Shard &shard : _shards) {
+    Lock lock(shard.mutex);
+    ++shard.generation;
+    auto it = shard.paths.begin();
+    while (it != shard.paths.end()) {
+      const std::string &path = it->first;
+      bool below = path.compare(0, len, plainPath) == 0 &&
+                   (path.size() == len || isPrefix || path[len] == '/');
+      if (below) {
+        it = shard.paths.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+uint64_t XattrCache::hits() const { return _hits; }
+
+uint64_t XattrCache::misses() const { return _misses; }
+
+}  // namespace encfs
@@ -0,0 +1,96 @@
+#ifndef _XattrCache_incl_
+#define _XattrCache_incl_
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+namespace encfs {
+
+/*
+    Extended attributes of recently looked at files, by plaintext path:
+    the values getxattr returned, the names it found missing, and the list
+    listxattr returned, so that the lookups security modules and file
+    browsers make on every access do not go to the backing filesystem.
+
+    Results are kept for ttlMs milliseconds, which bounds how long a change
+    made behind our back goes unseen.  Changes made through the filesystem
+    erase the path right away.  Values larger than MaxValue are not kept.
+
+    Paths are spread over shards by their hash, each with its own lock and
+    share of the bound.
+ */
+class XattrCache {
+ public:
+  static const size_t MaxValue = 4096;
+
+  XattrCache(size_t maxPaths, int ttlMs);
+  ~XattrCache();
+
+  // true if what getxattr returns for name of plainPath is known, with
+  // *res set as getxattr would set it given a buffer of size bytes, and
+  // the value copied to it.  Otherwise generation is set for add().
+  bool get(const char *plainPath, const char *name, char *value, size_t size,
+           int *res, uint64_t *generation);
+  // records res, a length with value the bytes, or -ENODATA (-ENOATTR),
+  // unless the path was erased since generation was handed out.  Other
+  // errors are not recorded.
+  void add(const char *plainPath, const char *name, const char *value,
+           int res, uint64_t generation);
+
+  // the same for listxattr
+  bool getList(const char *plainPath, char *list, size_t size, int *res,
+               uint64_t *generation);
+  void addList(const char *plainPath, const char *list, int res,
+               uint64_t generation);
+
+  void erase(const char *plainPath);
+  // forget plainPath and every path below it
+  void eraseBelow(const char *plainPath);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  static const int NumShards = 16;
+
+  struct Value {
+    int res = 0;  // the length of data, or -errno
+    std::string data;
+    int64_t expires = 0;
+  };
+
+  struct Entry {
+    std::unordered_map<std::string, Value> names;
+    Value list;  // valid if list.expires is not 0
+  };
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string, Entry> paths;
+    uint64_t generation;  // bumped on every erase
+  };
+
+  Shard &shardFor(const char *plainPath);
+  // add() and addList(), the list being the value without a name
+  void store(const char *plainPath, const char *name, const char *data,
+             int res, uint64_t generation);
+  // drop expired values, or everything if that does not make room
+  void makeRoom(Shard &shard, int64_t now);
+
+  Shard _shards[NumShards];
+  size_t _maxShardPaths;
+  int _ttlMs;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+
+  XattrCache(const XattrCache &);             // not allowed
+  XattrCache &operator=(const XattrCache &);  // not allowed
+};
+
+}  // namespace encfs
+
+#endif
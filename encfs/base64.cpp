@@ -1,6 +1,19 @@
 #include "base64.h"
 #include <cctype>   // for toupper
+#include <cstdint>
+#include <cstring>
 #include "Error.h"
+#include "openssl.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#if defined(__GNUC__)
+#define ENCFS_BASE2_AVX2 1
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define ENCFS_BASE2_NEON 1
+#include <arm_neon.h>
+#endif
 
 namespace encfs {
     //change between two power of two, stored as the low bits of the bytes in
@@ -19,7 +32,7 @@ namespace encfs {
         // copy the new bits onto the high bits of the stream
         // The bits that fall off the low end are the output bits.
         while (src != end) {
-            work != ((unsigned long) (*src++)) << workBits;
+            work |= ((unsigned long) (*src++)) << workBits;
             workBits += src2Pow;
 
             while (workBits >= dst2Pow) {
@@ -52,7 +65,7 @@ namespace encfs {
 
         // copy the new bits onto the high bits of the stream.
         // The bits that fall off the low end are the output bits.
-        while ((srcLen != 0) && workBits , dst2Pow) {
+        while ((srcLen != 0) && workBits < dst2Pow) {
             work |= ((unsigned long)(*src++)) << workBits;
             workBits += src2Pow;
             --srcLen;
@@ -110,7 +123,7 @@ namespace encfs {
     }
 
     static const unsigned char Ascii2B64Table[] = 
-        "                                             01 23456789:;       ";
+        "                                            01  23456789:;       ";
 //      0123456789 123456789 123456789 123456789 123456789 123456789 1234 
 //      0         1         2         3         4         5         6
     
@@ -164,6 +177,554 @@ namespace encfs {
         }
     }
 
+    /*
+        Fused filename codecs.  Bits are packed lowest first, as by
+        changeBase2Inline: 3 bytes hold 4 base64 digits, 5 bytes hold 8
+        base32 digits.  Encoding works down from the end of the buffer and
+        decoding up from the start, so that either can be done in place.
+     */
+    static const unsigned char B64Alphabet[] =
+        ",-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    static const unsigned char B32Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+    // the value AsciiToB64 gives ch, also for characters not in the set
+    static inline unsigned char asciiToB64(unsigned char ch) {
+        if (ch >= 'A') {
+            return ch >= 'a' ? ch + 38 - 'a' : ch + 12 - 'A';
+        }
+        return Ascii2B64Table[ch] - '0';
+    }
+
+    static inline unsigned char asciiToB32(unsigned char ch) {
+        int lch = toupper(ch);
+        return (unsigned char) (lch >= 'A' ? lch - 'A' : lch + 26 - '2');
+    }
+
+    // encode the last length % 3 bytes, given the whole length
+    static void b64EncodeTail(unsigned char* out, const unsigned char* in,
+                              int length) {
+        int groups = length / 3;
+        int digits = B256ToB64Bytes(length) - groups * 4;
+        unsigned long work = 0;
+        for (int i = 0; i < length - groups * 3; ++i) {
+            work |= (unsigned long) in[groups * 3 + i] << (8 * i);
+        }
+        for (int i = 0; i < digits; ++i) {
+            out[groups * 4 + i] = B64Alphabet[(work >> (6 * i)) & 0x3f];
+        }
+    }
+
+    static void b64EncodeGroups_c(unsigned char* out, const unsigned char* in,
+                                  int groups) {
+        while (groups != 0) {
+            --groups;
+            const unsigned char* src = in + groups * 3;
+            unsigned long work = src[0] | (src[1] << 8) | (src[2] << 16);
+            unsigned char* dst = out + groups * 4;
+            dst[0] = B64Alphabet[work & 0x3f];
+            dst[1] = B64Alphabet[(work >> 6) & 0x3f];
+            dst[2] = B64Alphabet[(work >> 12) & 0x3f];
+            dst[3] = B64Alphabet[(work >> 18) & 0x3f];
+        }
+    }
+
+    static void b64Decode_c(unsigned char* out, const unsigned char* in,
+                            int length) {
+        unsigned long work = 0;
+        int workBits = 0;
+        while ((length--) != 0) {
+            work |= (unsigned long) asciiToB64(*in++) << workBits;
+            workBits += 6;
+            if (workBits >= 8) {
+                *out++ = work & 0xff;
+                work >>= 8;
+                workBits -= 8;
+            }
+        }
+    }
+
+    static void b32EncodeTail(unsigned char* out, const unsigned char* in,
+                              int length) {
+        int groups = length / 5;
+        int digits = B256ToB32Bytes(length) - groups * 8;
+        uint64_t work = 0;
+        for (int i = 0; i < length - groups * 5; ++i) {
+            work |= (uint64_t) in[groups * 5 + i] << (8 * i);
+        }
+        for (int i = 0; i < digits; ++i) {
+            out[groups * 8 + i] = B32Alphabet[(work >> (5 * i)) & 0x1f];
+        }
+    }
+
+    static void b32EncodeGroups_c(unsigned char* out, const unsigned char* in,
+                                  int groups) {
+        while (groups != 0) {
+            --groups;
+            const unsigned char* src = in + groups * 5;
+            uint64_t work = 0;
+            for (int i = 0; i < 5; ++i) {
+                work |= (uint64_t) src[i] << (8 * i);
+            }
+            unsigned char* dst = out + groups * 8;
+            for (int i = 0; i < 8; ++i) {
+                dst[i] = B32Alphabet[(work >> (5 * i)) & 0x1f];
+            }
+        }
+    }
+
+    static void b32Decode_c(unsigned char* out, const unsigned char* in,
+                            int length) {
+        unsigned long work = 0;
+        int workBits = 0;
+        while ((length--) != 0) {
+            work |= (unsigned long) asciiToB32(*in++) << workBits;
+            workBits += 5;
+            if (workBits >= 8) {
+                *out++ = work & 0xff;
+                work >>= 8;
+                workBits -= 8;
+            }
+        }
+    }
+
+    /*
+        Vector kernels.  Encoders take whole chunks off the top of the
+        groups and return how many groups are left for the C code; decoders
+        take whole chunks from the start and return the characters done,
+        stopping before a chunk with a character outside the set, which is
+        left to the C code to decode as it always was.
+     */
+    static int encodeNone(unsigned char*, const unsigned char*, int groups) {
+        return groups;
+    }
+
+    static int decodeNone(unsigned char*, const unsigned char*, int) {
+        return 0;
+    }
+
+#if defined(ENCFS_BASE2_AVX2)
+
+    __attribute__((target("avx2")))
+    static inline __m256i inRange_avx2(__m256i c, char lo, char hi) {
+        // signed compares, so bytes of 0x80 and above are never in range
+        return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(lo - 1)),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), c));
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256i bits_avx2(__m256i v, int mask) {
+        return _mm256_and_si256(v, _mm256_set1_epi32(mask));
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256i bits64_avx2(__m256i v, uint64_t mask) {
+        return _mm256_and_si256(v, _mm256_set1_epi64x((long long) mask));
+    }
+
+    // 8 groups, 24 bytes to 32 digits
+    __attribute__((target("avx2")))
+    static int b64Encode_avx2(unsigned char* out, const unsigned char* in,
+                              int groups) {
+        // the high half is loaded from byte 8 so as not to read past the
+        // 24 bytes of the chunk
+        const __m256i spread = _mm256_setr_epi8(
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+            4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
+        while (groups >= 8) {
+            groups -= 8;
+            const unsigned char* src = in + groups * 3;
+            __m256i v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8)), 1);
+            v = _mm256_shuffle_epi8(v, spread);
+
+            // one digit per byte of each 24 bit group
+            v = _mm256_or_si256(
+                _mm256_or_si256(bits_avx2(v, 0x3f),
+                                bits_avx2(_mm256_slli_epi32(v, 2), 0x3f00)),
+                _mm256_or_si256(bits_avx2(_mm256_slli_epi32(v, 4), 0x3f0000),
+                                bits_avx2(_mm256_slli_epi32(v, 6), 0x3f000000)));
+
+            // ",-" "0-9" "A-Z" "a-z" start at digits 0, 2, 12 and 38
+            __m256i off = _mm256_set1_epi8(44);
+            off = _mm256_add_epi8(off, _mm256_and_si256(
+                _mm256_cmpgt_epi8(v, _mm256_set1_epi8(1)), _mm256_set1_epi8(2)));
+            off = _mm256_add_epi8(off, _mm256_and_si256(
+                _mm256_cmpgt_epi8(v, _mm256_set1_epi8(11)), _mm256_set1_epi8(7)));
+            off = _mm256_add_epi8(off, _mm256_and_si256(
+                _mm256_cmpgt_epi8(v, _mm256_set1_epi8(37)), _mm256_set1_epi8(6)));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + groups * 4),
+                                _mm256_add_epi8(v, off));
+        }
+        return groups;
+    }
+
+    // 32 digits to 24 bytes
+    __attribute__((target("avx2")))
+    static int b64Decode_avx2(unsigned char* out, const unsigned char* in,
+                              int length) {
+        const __m256i pack = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        alignas(32) unsigned char tmp[32];
+        int done = 0;
+        while (length - done >= 32) {
+            __m256i c = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(in + done));
+            __m256i r1 = inRange_avx2(c, ',', '-');
+            __m256i r2 = inRange_avx2(c, '0', '9');
+            __m256i r3 = inRange_avx2(c, 'A', 'Z');
+            __m256i r4 = inRange_avx2(c, 'a', 'z');
+            __m256i valid = _mm256_or_si256(_mm256_or_si256(r1, r2),
+                                            _mm256_or_si256(r3, r4));
+            if (_mm256_movemask_epi8(valid) != -1) {
+                break;
+            }
+
+            __m256i off = _mm256_or_si256(
+                _mm256_or_si256(_mm256_and_si256(r1, _mm256_set1_epi8(44)),
+                                _mm256_and_si256(r2, _mm256_set1_epi8(46))),
+                _mm256_or_si256(_mm256_and_si256(r3, _mm256_set1_epi8(53)),
+                                _mm256_and_si256(r4, _mm256_set1_epi8(59))));
+            __m256i v = _mm256_sub_epi8(c, off);
+
+            // four digits per 32 bits to 24 bits
+            v = _mm256_or_si256(
+                _mm256_or_si256(bits_avx2(v, 0x3f),
+                                bits_avx2(_mm256_srli_epi32(v, 2), 0xfc0)),
+                _mm256_or_si256(bits_avx2(_mm256_srli_epi32(v, 4), 0x3f000),
+                                bits_avx2(_mm256_srli_epi32(v, 6), 0xfc0000)));
+            _mm256_store_si256(reinterpret_cast<__m256i*>(tmp),
+                               _mm256_shuffle_epi8(v, pack));
+
+            unsigned char* dst = out + done / 4 * 3;
+            memcpy(dst, tmp, 12);
+            memcpy(dst + 12, tmp + 16, 12);
+            done += 32;
+        }
+        return done;
+    }
+
+    // 4 groups, 20 bytes to 32 digits
+    __attribute__((target("avx2")))
+    static int b32Encode_avx2(unsigned char* out, const unsigned char* in,
+                              int groups) {
+        const __m256i spread = _mm256_setr_epi8(
+            0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1,
+            6, 7, 8, 9, 10, -1, -1, -1, 11, 12, 13, 14, 15, -1, -1, -1);
+        while (groups >= 4) {
+            groups -= 4;
+            const unsigned char* src = in + groups * 5;
+            __m256i v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4)), 1);
+            v = _mm256_shuffle_epi8(v, spread);
+
+            // one digit per byte of each 40 bit group
+            __m256i d = bits64_avx2(v, 0x1f);
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 3),
+                                               0x1fULL << 8));
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 6),
+                                               0x1fULL << 16));
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 9),
+                                               0x1fULL << 24));
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 12),
+                                               0x1fULL << 32));
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 15),
+                                               0x1fULL << 40));
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 18),
+                                               0x1fULL << 48));
+            d = _mm256_or_si256(d, bits64_avx2(_mm256_slli_epi64(v, 21),
+                                               0x1fULL << 56));
+
+            // "A-Z" then "2-7"
+            __m256i off = _mm256_sub_epi8(
+                _mm256_set1_epi8('A'),
+                _mm256_and_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8(25)),
+                                 _mm256_set1_epi8('A' - ('2' - 26))));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + groups * 8),
+                                _mm256_add_epi8(d, off));
+        }
+        return groups;
+    }
+
+    // 32 digits to 20 bytes
+    __attribute__((target("avx2")))
+    static int b32Decode_avx2(unsigned char* out, const unsigned char* in,
+                              int length) {
+        const __m256i pack = _mm256_setr_epi8(
+            0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1,
+            0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+        alignas(32) unsigned char tmp[32];
+        int done = 0;
+        while (length - done >= 32) {
+            __m256i c = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(in + done));
+            __m256i upper = inRange_avx2(c, 'A', 'Z');
+            __m256i lower = inRange_avx2(c, 'a', 'z');
+            __m256i digit = inRange_avx2(c, '2', '7');
+            __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), digit);
+            if (_mm256_movemask_epi8(valid) != -1) {
+                break;
+            }
+
+            __m256i off = _mm256_or_si256(
+                _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8('A')),
+                                _mm256_and_si256(lower, _mm256_set1_epi8('a'))),
+                _mm256_and_si256(digit, _mm256_set1_epi8('2' - 26)));
+            __m256i v = _mm256_sub_epi8(c, off);
+
+            // eight digits per 64 bits to 40 bits
+            __m256i w = bits64_avx2(v, 0x1f);
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 3),
+                                               0x1fULL << 5));
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 6),
+                                               0x1fULL << 10));
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 9),
+                                               0x1fULL << 15));
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 12),
+                                               0x1fULL << 20));
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 15),
+                                               0x1fULL << 25));
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 18),
+                                               0x1fULL << 30));
+            w = _mm256_or_si256(w, bits64_avx2(_mm256_srli_epi64(v, 21),
+                                               0x1fULL << 35));
+            _mm256_store_si256(reinterpret_cast<__m256i*>(tmp),
+                               _mm256_shuffle_epi8(w, pack));
+
+            unsigned char* dst = out + done / 8 * 5;
+            memcpy(dst, tmp, 10);
+            memcpy(dst + 10, tmp + 16, 10);
+            done += 32;
+        }
+        return done;
+    }
+
+#elif defined(ENCFS_BASE2_NEON)
+
+    static inline uint8x16_t inRange_neon(uint8x16_t c, unsigned char lo,
+                                          unsigned char hi) {
+        return vcleq_u8(vsubq_u8(c, vdupq_n_u8(lo)), vdupq_n_u8(hi - lo));
+    }
+
+    // 4 groups, 12 bytes to 16 digits
+    static int b64Encode_neon(unsigned char* out, const unsigned char* in,
+                              int groups) {
+        // loaded from 4 bytes before the chunk, so as not to read past it
+        static const unsigned char spreadIdx[16] = {
+            4, 5, 6, 255, 7, 8, 9, 255, 10, 11, 12, 255, 13, 14, 15, 255};
+        const uint8x16_t spread = vld1q_u8(spreadIdx);
+        while (groups >= 6) {
+            groups -= 4;
+            const unsigned char* src = in + groups * 3 - 4;
+            uint32x4_t v =
+                vreinterpretq_u32_u8(vqtbl1q_u8(vld1q_u8(src), spread));
+
+            v = vorrq_u32(
+                vorrq_u32(vandq_u32(v, vdupq_n_u32(0x3f)),
+                          vandq_u32(vshlq_n_u32(v, 2), vdupq_n_u32(0x3f00))),
+                vorrq_u32(
+                    vandq_u32(vshlq_n_u32(v, 4), vdupq_n_u32(0x3f0000)),
+                    vandq_u32(vshlq_n_u32(v, 6), vdupq_n_u32(0x3f000000))));
+            uint8x16_t d = vreinterpretq_u8_u32(v);
+
+            uint8x16_t off = vdupq_n_u8(44);
+            off = vaddq_u8(off, vandq_u8(vcgtq_u8(d, vdupq_n_u8(1)),
+                                         vdupq_n_u8(2)));
+            off = vaddq_u8(off, vandq_u8(vcgtq_u8(d, vdupq_n_u8(11)),
+                                         vdupq_n_u8(7)));
+            off = vaddq_u8(off, vandq_u8(vcgtq_u8(d, vdupq_n_u8(37)),
+                                         vdupq_n_u8(6)));
+            vst1q_u8(out + groups * 4, vaddq_u8(d, off));
+        }
+        return groups;
+    }
+
+    // 16 digits to 12 bytes
+    static int b64Decode_neon(unsigned char* out, const unsigned char* in,
+                              int length) {
+        static const unsigned char packIdx[16] = {
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 255, 255, 255, 255};
+        const uint8x16_t pack = vld1q_u8(packIdx);
+        unsigned char tmp[16];
+        int done = 0;
+        while (length - done >= 16) {
+            uint8x16_t c = vld1q_u8(in + done);
+            uint8x16_t r1 = inRange_neon(c, ',', '-');
+            uint8x16_t r2 = inRange_neon(c, '0', '9');
+            uint8x16_t r3 = inRange_neon(c, 'A', 'Z');
+            uint8x16_t r4 = inRange_neon(c, 'a', 'z');
+            uint8x16_t valid = vorrq_u8(vorrq_u8(r1, r2), vorrq_u8(r3, r4));
+            if (vminvq_u8(valid) != 0xff) {
+                break;
+            }
+
+            uint8x16_t off = vorrq_u8(
+                vorrq_u8(vandq_u8(r1, vdupq_n_u8(44)),
+                         vandq_u8(r2, vdupq_n_u8(46))),
+                vorrq_u8(vandq_u8(r3, vdupq_n_u8(53)),
+                         vandq_u8(r4, vdupq_n_u8(59))));
+            uint32x4_t v = vreinterpretq_u32_u8(vsubq_u8(c, off));
+
+            v = vorrq_u32(
+                vorrq_u32(vandq_u32(v, vdupq_n_u32(0x3f)),
+                          vandq_u32(vshrq_n_u32(v, 2), vdupq_n_u32(0xfc0))),
+                vorrq_u32(vandq_u32(vshrq_n_u32(v, 4), vdupq_n_u32(0x3f000)),
+                          vandq_u32(vshrq_n_u32(v, 6), vdupq_n_u32(0xfc0000))));
+            vst1q_u8(tmp, vqtbl1q_u8(vreinterpretq_u8_u32(v), pack));
+
+            memcpy(out + done / 4 * 3, tmp, 12);
+            done += 16;
+        }
+        return done;
+    }
+
+    // 2 groups, 10 bytes to 16 digits
+    static int b32Encode_neon(unsigned char* out, const unsigned char* in,
+                              int groups) {
+        // loaded from 6 bytes before the chunk, so as not to read past it
+        static const unsigned char spreadIdx[16] = {
+            6, 7, 8, 9, 10, 255, 255, 255, 11, 12, 13, 14, 15, 255, 255, 255};
+        const uint8x16_t spread = vld1q_u8(spreadIdx);
+        while (groups >= 4) {
+            groups -= 2;
+            const unsigned char* src = in + groups * 5 - 6;
+            uint64x2_t v =
+                vreinterpretq_u64_u8(vqtbl1q_u8(vld1q_u8(src), spread));
+
+            uint64x2_t d = vandq_u64(v, vdupq_n_u64(0x1f));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 3),
+                                       vdupq_n_u64(0x1fULL << 8)));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 6),
+                                       vdupq_n_u64(0x1fULL << 16)));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 9),
+                                       vdupq_n_u64(0x1fULL << 24)));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 12),
+                                       vdupq_n_u64(0x1fULL << 32)));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 15),
+                                       vdupq_n_u64(0x1fULL << 40)));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 18),
+                                       vdupq_n_u64(0x1fULL << 48)));
+            d = vorrq_u64(d, vandq_u64(vshlq_n_u64(v, 21),
+                                       vdupq_n_u64(0x1fULL << 56)));
+            uint8x16_t digits = vreinterpretq_u8_u64(d);
+
+            uint8x16_t off = vsubq_u8(
+                vdupq_n_u8('A'),
+                vandq_u8(vcgtq_u8(digits, vdupq_n_u8(25)),
+                         vdupq_n_u8('A' - ('2' - 26))));
+            vst1q_u8(out + groups * 8, vaddq_u8(digits, off));
+        }
+        return groups;
+    }
+
+    // 16 digits to 10 bytes
+    static int b32Decode_neon(unsigned char* out, const unsigned char* in,
+                              int length) {
+        static const unsigned char packIdx[16] = {
+            0, 1, 2, 3, 4, 8, 9, 10, 11, 12, 255, 255, 255, 255, 255, 255};
+        const uint8x16_t pack = vld1q_u8(packIdx);
+        unsigned char tmp[16];
+        int done = 0;
+        while (length - done >= 16) {
+            uint8x16_t c = vld1q_u8(in + done);
+            uint8x16_t upper = inRange_neon(c, 'A', 'Z');
+            uint8x16_t lower = inRange_neon(c, 'a', 'z');
+            uint8x16_t digit = inRange_neon(c, '2', '7');
+            uint8x16_t valid = vorrq_u8(vorrq_u8(upper, lower), digit);
+            if (vminvq_u8(valid) != 0xff) {
+                break;
+            }
+
+            uint8x16_t off = vorrq_u8(
+                vorrq_u8(vandq_u8(upper, vdupq_n_u8('A')),
+                         vandq_u8(lower, vdupq_n_u8('a'))),
+                vandq_u8(digit, vdupq_n_u8('2' - 26)));
+            uint64x2_t v = vreinterpretq_u64_u8(vsubq_u8(c, off));
+
+            uint64x2_t w = vandq_u64(v, vdupq_n_u64(0x1f));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 3),
+                                       vdupq_n_u64(0x1fULL << 5)));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 6),
+                                       vdupq_n_u64(0x1fULL << 10)));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 9),
+                                       vdupq_n_u64(0x1fULL << 15)));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 12),
+                                       vdupq_n_u64(0x1fULL << 20)));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 15),
+                                       vdupq_n_u64(0x1fULL << 25)));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 18),
+                                       vdupq_n_u64(0x1fULL << 30)));
+            w = vorrq_u64(w, vandq_u64(vshrq_n_u64(v, 21),
+                                       vdupq_n_u64(0x1fULL << 35)));
+            vst1q_u8(tmp, vqtbl1q_u8(vreinterpretq_u8_u64(w), pack));
+
+            memcpy(out + done / 8 * 5, tmp, 10);
+            done += 16;
+        }
+        return done;
+    }
+
+#endif
+
+    struct Base2Kernels {
+        const char* name;
+        int (*encode64)(unsigned char*, const unsigned char*, int);
+        int (*decode64)(unsigned char*, const unsigned char*, int);
+        int (*encode32)(unsigned char*, const unsigned char*, int);
+        int (*decode32)(unsigned char*, const unsigned char*, int);
+    };
+
+    static Base2Kernels selectBase2Kernels() {
+#if defined(ENCFS_BASE2_AVX2)
+        if (cpuFeatures().avx2) {
+            return Base2Kernels{"avx2", b64Encode_avx2, b64Decode_avx2,
+                                b32Encode_avx2, b32Decode_avx2};
+        }
+#elif defined(ENCFS_BASE2_NEON)
+        return Base2Kernels{"neon", b64Encode_neon, b64Decode_neon,
+                            b32Encode_neon, b32Decode_neon};
+#endif
+        return Base2Kernels{"c", encodeNone, decodeNone, encodeNone,
+                            decodeNone};
+    }
+
+    static const Base2Kernels& base2Kernels() {
+        static const Base2Kernels selected = selectBase2Kernels();
+        return selected;
+    }
+
+    void B256ToB64Ascii(unsigned char* out, const unsigned char* in, int length) {
+        int groups = length / 3;
+        b64EncodeTail(out, in, length);
+        groups = base2Kernels().encode64(out, in, groups);
+        b64EncodeGroups_c(out, in, groups);
+    }
+
+    void B64AsciiToB256(unsigned char* out, const unsigned char* in, int length) {
+        int done = base2Kernels().decode64(out, in, length);
+        b64Decode_c(out + done / 4 * 3, in + done, length - done);
+    }
+
+    void B256ToB32Ascii(unsigned char* out, const unsigned char* in, int length) {
+        int groups = length / 5;
+        b32EncodeTail(out, in, length);
+        groups = base2Kernels().encode32(out, in, groups);
+        b32EncodeGroups_c(out, in, groups);
+    }
+
+    void B32AsciiToB256(unsigned char* out, const unsigned char* in, int length) {
+        int done = base2Kernels().decode32(out, in, length);
+        b32Decode_c(out + done / 8 * 5, in + done, length - done);
+    }
+
+    const char* base2KernelName() { return base2Kernels().name; }
+
 #define WHITESPACE 64
 #define EQUALS 65
 #define INVALID 66
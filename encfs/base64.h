@@ -15,7 +15,7 @@ namespace encfs {
     inline int B256ToB64Bytes(int numB256Bytes) {
         return (numB256Bytes * 8 + 5) / 6;  // round up
     }
-    inline int B256To32Bytes(int numB256Bytes) {
+    inline int B256ToB32Bytes(int numB256Bytes) {
         return (numB256Bytes * 8 + 4) / 5;  // round up
     }
 
@@ -44,6 +44,27 @@ namespace encfs {
     void AsciiToB32(unsigned char* buf, int length);
     void AsciiToB32(unsigned char* out, const unsigned char* in, int length);
 
+    /*
+        Filename encoding: bytes to base64 (or base32) ASCII, as
+        changeBase2Inline with the partial last value followed by B64ToAscii
+        (or B32ToAscii).  out holds B256ToB64Bytes(length) (or
+        B256ToB32Bytes(length)) bytes.
+
+        Decoding is the reverse, AsciiToB64 (or AsciiToB32) then
+        changeBase2Inline without the partial last byte, giving
+        B64ToB256Bytes(length) (or B32ToB256Bytes(length)) bytes.
+
+        out may be the same buffer as in, but must not otherwise overlap it.
+        Vector code is used where the CPU has it, see base2KernelName().
+     */
+    void B256ToB64Ascii(unsigned char* out, const unsigned char* in, int length);
+    void B64AsciiToB256(unsigned char* out, const unsigned char* in, int length);
+    void B256ToB32Ascii(unsigned char* out, const unsigned char* in, int length);
+    void B32AsciiToB256(unsigned char* out, const unsigned char* in, int length);
+
+    // name of the implementation in use, eg. "avx2", "neon", "c"
+    const char* base2KernelName();
+
     // Decode standard B64 into the output array.
     // Used only to decode legacy Boost XML serialized config format.
     // The output size must be at least B64ToB256Bytes(inputLen).
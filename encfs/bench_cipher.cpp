@@ -0,0 +1,201 @@
+/*****************************************************************************
+ * Copyright (c) 2003, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_cipher: throughput of every registered cipher, over each key
+    size and a spread of block sizes, for 1 .. ncpu threads.  Built against
+    the vendored google/benchmark; takes the usual --benchmark_* flags, eg.
+    --benchmark_filter=AES-XTS/.
+
+    setIVec is private to SSL_Cipher, so its cost is measured as a 1 byte
+    streamEncode, which is two IV derivations and two single byte CFB passes.
+ */
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Cipher.h"
+#include "CipherKey.h"
+#include "Error.h"
+#include "Range.h"
+#include "openssl.h"
+
+using namespace std;
+using namespace encfs;
+
+namespace {
+
+enum Op {
+  BlockEncode,
+  BlockDecode,
+  StreamEncode,
+  StreamDecode,
+  Mac64,
+  FastMac64,
+  IVec
+};
+
+const char *opName(Op op) {
+  switch (op) {
+    case BlockEncode:
+      return "blockEncode";
+    case BlockDecode:
+      return "blockDecode";
+    case StreamEncode:
+      return "streamEncode";
+    case StreamDecode:
+      return "streamDecode";
+    case Mac64:
+      return "MAC_64";
+    case FastMac64:
+      return "FastMAC_64";
+    case IVec:
+      return "setIVec";
+  }
+  return "?";
+}
+
+struct BenchCipher {
+  std::shared_ptr<Cipher> cipher;
+  CipherKey key;
+};
+
+void runOp(benchmark::State &state, const BenchCipher *bc, Op op, int size) {
+  if (op == IVec) {
+    size = 1;
+  }
+  std::vector<unsigned char> buf(size);
+  bc->cipher->randomize(buf.data(), size, false);
+
+  // every thread works on its own range of IVs, as separate files would
+  uint64_t iv = (uint64_t)state.thread_index << 32;
+  bool ok = true;
+  for (auto _ : state) {
+    switch (op) {
+      case BlockEncode:
+        ok = bc->cipher->blockEncode(buf.data(), size, iv, bc->key);
+        break;
+      case BlockDecode:
+        ok = bc->cipher->blockDecode(buf.data(), size, iv, bc->key);
+        break;
+      case StreamEncode:
+      case IVec:
+        ok = bc->cipher->streamEncode(buf.data(), size, iv, bc->key);
+        break;
+      case StreamDecode:
+        ok = bc->cipher->streamDecode(buf.data(), size, iv, bc->key);
+        break;
+      case Mac64:
+        benchmark::DoNotOptimize(bc->cipher->MAC_64(buf.data(), size,
+                                                    bc->key));
+        break;
+      case FastMac64:
+        benchmark::DoNotOptimize(bc->cipher->FastMAC_64(buf.data(), size, iv,
+                                                        bc->key));
+        break;
+    }
+    if (!ok) {
+      state.SkipWithError("cipher operation failed");
+      break;
+    }
+    ++iv;
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * size);
+}
+
+// powers of two inside the range, plus the largest allowed size
+std::vector<int> blockSizes(const Range &range) {
+  std::vector<int> sizes;
+  for (int size = range.min(); size < range.max(); size *= 2) {
+    sizes.push_back(range.closest(size));
+  }
+  sizes.push_back(range.max());
+  return sizes;
+}
+
+std::vector<int> keySizes(const Range &range) {
+  std::vector<int> sizes;
+  for (int size = range.min(); size <= range.max(); size += range.inc()) {
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  START_EASYLOGGINGPP(argc, argv);
+  encfs::initLogging();
+  openssl_init(true);
+
+  benchmark::Initialize(&argc, argv);
+
+  // ciphers must outlive the benchmarks that point to them
+  std::list<BenchCipher> ciphers;
+  int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  const Op ops[] = {BlockEncode, BlockDecode, StreamEncode, StreamDecode,
+                    Mac64,       FastMac64,   IVec};
+
+  Cipher::AlgorithmList algorithms = Cipher::GetAlgorithmList(true);
+  for (const Cipher::CipherAlgorithm &alg : algorithms) {
+    for (int keySize : keySizes(alg.keyLength)) {
+      std::shared_ptr<Cipher> cipher = Cipher::New(alg.name, keySize);
+      if (!cipher) {
+        continue;
+      }
+      BenchCipher bc;
+      bc.cipher = cipher;
+      bc.key = cipher->newRandomKey();
+      if (!bc.key) {
+        continue;
+      }
+      ciphers.push_back(bc);
+      const BenchCipher *bcp = &ciphers.back();
+
+      for (Op op : ops) {
+        std::vector<int> sizes = blockSizes(alg.blockSize);
+        if (op == IVec) {
+          sizes.resize(1);
+        }
+        for (int size : sizes) {
+          // block modes need whole cipher blocks
+          if ((op == BlockEncode || op == BlockDecode) &&
+              size % cipher->cipherBlockSize() != 0) {
+            continue;
+          }
+          std::string name = alg.name + "/" + std::to_string(keySize) + "/" +
+                             opName(op);
+          if (op != IVec) {
+            name += "/" + std::to_string(size);
+          }
+          benchmark::RegisterBenchmark(name.c_str(), runOp, bcp, op, size)
+              ->ThreadRange(1, maxThreads)
+              ->UseRealTime();
+        }
+      }
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  openssl_shutdown(true);
+  return 0;
+}
@@ -0,0 +1,266 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_fileio: read and write throughput of the block layer, a
+    CipherFileIO (and MACFileIO, with block MACs) over a MemFileIO, so that
+    nothing but the layers themselves is timed.  Requests are whole aligned
+    blocks, a block's worth across two, half a block inside one and 16
+    blocks at a time; swept over block sizes, MAC settings, uniqueIV and
+    allowHoles.  Built against the vendored google/benchmark; takes the
+    usual --benchmark_* flags, eg. --benchmark_filter=write/partial.
+
+    Besides bytes/s, every benchmark reports the heap allocations (allocs)
+    and MemoryPool blocks (pool_allocs) taken per request.  The block cache
+    and read-ahead are left off, as they would hide the cost of a block.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "BlockFileIO.h"
+#include "Cipher.h"
+#include "CipherFileIO.h"
+#include "CipherKey.h"
+#include "Error.h"
+#include "FSConfig.h"
+#include "FileUtils.h"
+#include "MACFileIO.h"
+#include "MemFileIO.h"
+#include "MemoryPool.h"
+#include "openssl.h"
+
+using namespace std;
+using namespace encfs;
+
+// every allocation of the process, for allocs per request
+static std::atomic<uint64_t> gAllocs(0);
+
+void *operator new(size_t size) {
+  gAllocs.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace {
+
+// the file the requests go to, in blocks
+const int FileBlocks = 256;
+// blocks in a multi-block request
+const int MultiBlocks = 16;
+
+enum Op { Read, Write };
+
+enum Pattern { Aligned, Unaligned, Partial, Multi };
+
+enum Mac { NoMac, HmacMac, SipHashMac };
+
+const char *patternName(Pattern pattern) {
+  switch (pattern) {
+    case Aligned:
+      return "aligned";
+    case Unaligned:
+      return "unaligned";
+    case Partial:
+      return "partial";
+    case Multi:
+      return "multi";
+  }
+  return "?";
+}
+
+const char *macName(Mac mac) {
+  switch (mac) {
+    case NoMac:
+      return "none";
+    case HmacMac:
+      return "hmac";
+    case SipHashMac:
+      return "siphash";
+  }
+  return "?";
+}
+
+struct Setup {
+  std::shared_ptr<Cipher> cipher;
+  CipherKey key;
+  int blockSize;
+  Mac mac;
+  bool uniqueIV;
+  bool allowHoles;
+};
+
+FSConfigPtr makeConfig(const Setup &setup) {
+  FSConfigPtr cfg = std::make_shared<FSConfig>();
+  cfg->config = std::make_shared<EncFSConfig>();
+  cfg->config->cfgType = Config_V6;
+  cfg->config->blockSize = setup.blockSize;
+  cfg->config->uniqueIV = setup.uniqueIV;
+  cfg->config->allowHoles = setup.allowHoles;
+  if (setup.mac != NoMac) {
+    cfg->config->blockMACBytes = 8;
+    cfg->config->blockMACAlgorithm =
+        setup.mac == SipHashMac ? BlockMAC_SipHash : BlockMAC_HMAC;
+  }
+  cfg->opts = std::make_shared<EncFS_Opts>();
+  cfg->cipher = setup.cipher;
+  cfg->key = setup.key;
+  return cfg;
+}
+
+// the stack FileNode would build over the backing file
+std::shared_ptr<FileIO> makeStack(const FSConfigPtr &cfg) {
+  std::shared_ptr<FileIO> io(
+      new CipherFileIO(std::make_shared<MemFileIO>("bench"), cfg));
+  if (cfg->config->blockMACBytes != 0) {
+    io = std::shared_ptr<FileIO>(new MACFileIO(io, cfg));
+  }
+  return io;
+}
+
+void runOp(benchmark::State &state, const Setup *setup, Op op,
+           Pattern pattern) {
+  FSConfigPtr cfg = makeConfig(*setup);
+  std::shared_ptr<FileIO> io = makeStack(cfg);
+  if (io->open(O_RDWR) < 0) {
+    state.SkipWithError("open failed");
+    return;
+  }
+  int bs = io->blockSize();
+
+  size_t len = bs;
+  off_t skew = 0;
+  switch (pattern) {
+    case Aligned:
+      break;
+    case Unaligned:
+      skew = bs / 2;
+      break;
+    case Partial:
+      len = bs / 2;
+      skew = bs / 4;
+      break;
+    case Multi:
+      len = (size_t)bs * MultiBlocks;
+      break;
+  }
+
+  // random data everywhere, so that no block reads back as a hole
+  std::vector<unsigned char> buf(std::max((size_t)bs * FileBlocks, len));
+  setup->cipher->randomize(buf.data(), buf.size(), false);
+  IORequest req;
+  req.data = buf.data();
+  req.dataLen = (size_t)bs * FileBlocks;
+  if (io->write(req) != (ssize_t)req.dataLen) {
+    state.SkipWithError("filling the file failed");
+    return;
+  }
+
+  // the requests walk the file, staying inside it
+  int spread = FileBlocks - MultiBlocks - 1;
+  int block = 0;
+  req.dataLen = len;
+  uint64_t allocs = gAllocs.load(std::memory_order_relaxed);
+  MemoryPool::Stats pool = MemoryPool::stats();
+  for (auto _ : state) {
+    req.offset = (off_t)block * bs + skew;
+    ssize_t res = op == Read ? io->read(req) : io->write(req);
+    if (res != (ssize_t)len) {
+      state.SkipWithError(op == Read ? "read failed" : "write failed");
+      break;
+    }
+    benchmark::ClobberMemory();
+    block = (block + (pattern == Multi ? MultiBlocks : 1)) % spread;
+  }
+  allocs = gAllocs.load(std::memory_order_relaxed) - allocs;
+  MemoryPool::Stats poolAfter = MemoryPool::stats();
+  uint64_t poolAllocs =
+      (poolAfter.hits + poolAfter.misses) - (pool.hits + pool.misses);
+
+  state.SetBytesProcessed(int64_t(state.iterations()) * len);
+  // the vendored benchmark has no per iteration counters
+  double iterations = std::max((double)state.iterations(), 1.0);
+  state.counters["allocs"] = allocs / iterations;
+  state.counters["pool_allocs"] = poolAllocs / iterations;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  START_EASYLOGGINGPP(argc, argv);
+  encfs::initLogging();
+  openssl_init(true);
+
+  benchmark::Initialize(&argc, argv);
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "No AES cipher found\n";
+    return 1;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  // setups must outlive the benchmarks that point to them
+  std::list<Setup> setups;
+  const int blockSizes[] = {1024, 4096, 65536};
+  const Mac macs[] = {NoMac, HmacMac, SipHashMac};
+  const Pattern patterns[] = {Aligned, Unaligned, Partial, Multi};
+
+  for (int blockSize : blockSizes) {
+    for (Mac mac : macs) {
+      for (int uniqueIV = 0; uniqueIV <= 1; ++uniqueIV) {
+        for (int allowHoles = 0; allowHoles <= 1; ++allowHoles) {
+          Setup setup = {cipher,     key,    blockSize,
+                         mac,        uniqueIV != 0, allowHoles != 0};
+          setups.push_back(setup);
+          const Setup *sp = &setups.back();
+
+          for (Op op : {Read, Write}) {
+            for (Pattern pattern : patterns) {
+              std::string name = std::string(op == Read ? "read" : "write") +
+                                 "/" + patternName(pattern) + "/bs:" +
+                                 std::to_string(blockSize) + "/mac:" +
+                                 macName(mac) +
+                                 "/uniqueIV:" + std::to_string(uniqueIV) +
+                                 "/holes:" + std::to_string(allowHoles);
+              benchmark::RegisterBenchmark(name.c_str(), runOp, sp, op,
+                                           pattern);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  openssl_shutdown(true);
+  return 0;
+}
@@ -0,0 +1,303 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_filenode: one FileNode driven from many threads at once,
+    over a MemFileIO, to see how requests to a shared file scale with the
+    threads making them.  The workloads:
+
+      disjoint    each thread reads through a range of its own
+      append      one thread appends while the others read at random
+      overlap     every thread writes at random over the same 1 MiB
+
+    for 1 .. ncpu threads, on the default volume and on one with block
+    MACs.  Built against the vendored google/benchmark; takes the usual
+    --benchmark_* flags, eg. --benchmark_filter=append/mac:hmac.
+
+    Besides bytes/s over all threads, every benchmark reports the 50th,
+    99th and 99.9th percentile latency of a request in microseconds, each
+    the average over the threads of their own percentile.  The block cache
+    and read-ahead are left off, so that each request codes its blocks.
+ */
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "Cipher.h"
+#include "CipherKey.h"
+#include "Error.h"
+#include "FSConfig.h"
+#include "FileNode.h"
+#include "FileUtils.h"
+#include "MemFileIO.h"
+#include "MemoryPool.h"
+#include "openssl.h"
+
+using namespace std;
+using namespace encfs;
+
+namespace {
+
+// the file as the benchmark starts, and the most the appender grows it by
+// before cutting it back
+const size_t FileBytes = 16 * 1024 * 1024;
+const size_t AppendBytes = 16 * 1024 * 1024;
+// bytes of a read or an append, and of an overlapping write
+const size_t RequestBytes = 64 * 1024;
+const size_t WriteBytes = 4096;
+// the range the overlapping writers share
+const size_t OverlapBytes = 1024 * 1024;
+
+enum Workload { Disjoint, Append, Overlap };
+
+enum Mac { NoMac, HmacMac };
+
+const char *workloadName(Workload workload) {
+  switch (workload) {
+    case Disjoint:
+      return "disjoint";
+    case Append:
+      return "append";
+    case Overlap:
+      return "overlap";
+  }
+  return "?";
+}
+
+struct Setup {
+  std::shared_ptr<Cipher> cipher;
+  CipherKey key;
+  Mac mac;
+};
+
+FSConfigPtr makeConfig(const Setup &setup) {
+  FSConfigPtr cfg = std::make_shared<FSConfig>();
+  cfg->config = std::make_shared<EncFSConfig>();
+  cfg->config->cfgType = Config_V6;
+  cfg->config->blockSize = 1024;
+  cfg->config->uniqueIV = true;
+  if (setup.mac == HmacMac) {
+    cfg->config->blockMACBytes = 8;
+    cfg->config->blockMACAlgorithm = BlockMAC_HMAC;
+  }
+  cfg->opts = std::make_shared<EncFS_Opts>();
+  cfg->opts->readAheadBlocks = 0;
+  cfg->cipher = setup.cipher;
+  cfg->key = setup.key;
+  return cfg;
+}
+
+// the node all threads of a run share, made and dropped by thread 0
+// around the timed loop, which the threads enter and leave together
+std::shared_ptr<FileNode> gNode;
+
+std::shared_ptr<FileNode> makeNode(const Setup &setup) {
+  FSConfigPtr cfg = makeConfig(setup);
+  auto node = std::make_shared<FileNode>(
+      nullptr, cfg, "/bench", "/bench", 1,
+      std::make_shared<MemFileIO>("bench"));
+  if (node->open(O_RDWR) < 0) {
+    return nullptr;
+  }
+
+  // random data everywhere, so that no block reads back as a hole
+  std::vector<unsigned char> buf(RequestBytes);
+  for (size_t done = 0; done < FileBytes; done += buf.size()) {
+    setup.cipher->randomize(buf.data(), buf.size(), false);
+    if (node->write(done, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+      return nullptr;
+    }
+  }
+  return node;
+}
+
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// request latencies of a thread, in buckets a quarter of a power of two
+// wide
+class Latencies {
+ public:
+  Latencies() : _counts(Buckets, 0), _total(0) {}
+
+  void add(uint64_t ns) {
+    ++_counts[bucket(ns)];
+    ++_total;
+  }
+
+  // the upper bound of the bucket holding the fraction q of them
+  double percentileUs(double q) const {
+    uint64_t want = (uint64_t)(q * _total);
+    uint64_t seen = 0;
+    for (int i = 0; i < Buckets; ++i) {
+      seen += _counts[i];
+      if (seen > want) {
+        return upper(i) / 1000.0;
+      }
+    }
+    return upper(Buckets - 1) / 1000.0;
+  }
+
+ private:
+  static const int Buckets = 64 * 4;
+
+  static int bucket(uint64_t ns) {
+    if (ns < 4) {
+      return (int)ns;
+    }
+    int log = 63 - __builtin_clzll(ns);
+    int quarter = (int)((ns >> (log - 2)) & 3);
+    return std::min(log * 4 + quarter, Buckets - 1);
+  }
+  static double upper(int i) {
+    if (i < 4) {
+      return i + 1;
+    }
+    int log = i / 4;
+    return (double)(1ull << log) * (1.0 + ((i % 4) + 1) / 4.0);
+  }
+
+  std::vector<uint64_t> _counts;
+  uint64_t _total;
+};
+
+void runWorkload(benchmark::State &state, const Setup *setup,
+                 Workload workload) {
+  if (state.thread_index == 0) {
+    gNode = makeNode(*setup);
+  }
+
+  int threads = state.threads;
+  int index = state.thread_index;
+  unsigned seed = 1 + index;
+  // disjoint: the range of this thread, read through in turn
+  size_t slice = FileBytes / threads / RequestBytes * RequestBytes;
+  size_t next = 0;
+  // append: where the next append goes, thread 0 only
+  size_t end = FileBytes;
+  bool appender = workload == Append && index == 0;
+
+  std::vector<unsigned char> buf(RequestBytes);
+  setup->cipher->randomize(buf.data(), buf.size(), false);
+  Latencies latencies;
+  int64_t bytes = 0;
+  bool failed = false;
+
+  for (auto _ : state) {
+    FileNode *node = gNode.get();
+    if (node == nullptr) {
+      state.SkipWithError("making the file failed");
+      break;
+    }
+
+    ssize_t res;
+    size_t len = RequestBytes;
+    uint64_t start = nowNs();
+    if (workload == Disjoint) {
+      off_t offset = (off_t)(index * slice + next);
+      res = node->read(offset, buf.data(), len);
+      next = (next + len) % std::max(slice, len);
+    } else if (appender) {
+      if (end >= FileBytes + AppendBytes) {
+        node->truncate(FileBytes);
+        end = FileBytes;
+      }
+      res = node->write(end, buf.data(), len);
+      end += len;
+    } else if (workload == Append) {
+      off_t offset = (off_t)(rand_r(&seed) % (FileBytes / len)) * len;
+      res = node->read(offset, buf.data(), len);
+    } else {
+      len = WriteBytes;
+      off_t offset = rand_r(&seed) % (OverlapBytes - len);
+      res = node->write(offset, buf.data(), len);
+    }
+    latencies.add(nowNs() - start);
+
+    if (res != (ssize_t)len) {
+      failed = true;
+      state.SkipWithError("request failed");
+      break;
+    }
+    bytes += len;
+  }
+
+  state.SetBytesProcessed(bytes);
+  if (!failed) {
+    state.counters["p50_us"] = benchmark::Counter(
+        latencies.percentileUs(0.5), benchmark::Counter::kAvgThreads);
+    state.counters["p99_us"] = benchmark::Counter(
+        latencies.percentileUs(0.99), benchmark::Counter::kAvgThreads);
+    state.counters["p999_us"] = benchmark::Counter(
+        latencies.percentileUs(0.999), benchmark::Counter::kAvgThreads);
+  }
+
+  if (state.thread_index == 0) {
+    gNode.reset();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  START_EASYLOGGINGPP(argc, argv);
+  encfs::initLogging();
+  openssl_init(true);
+
+  benchmark::Initialize(&argc, argv);
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "No AES cipher found\n";
+    return 1;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  // setups must outlive the benchmarks that point to them
+  const Mac macs[] = {NoMac, HmacMac};
+  std::vector<Setup> setups;
+  for (Mac mac : macs) {
+    setups.push_back(Setup{cipher, key, mac});
+  }
+
+  for (const Setup &setup : setups) {
+    for (Workload workload : {Disjoint, Append, Overlap}) {
+      std::string name = std::string(workloadName(workload)) + "/mac:" +
+                         (setup.mac == HmacMac ? "hmac" : "none");
+      benchmark::RegisterBenchmark(name.c_str(), runWorkload, &setup,
+                                   workload)
+          ->ThreadRange(1, maxThreads)
+          ->UseRealTime();
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  MemoryPool::destroyAll();
+  openssl_shutdown(true);
+  return 0;
+}
@@ -0,0 +1,643 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_mount: end to end numbers for a release, through FUSE.  For
+    each of --standard and --paranoia, a volume is created and mounted in a
+    scratch directory by the encfs binary, and a fixed set of workloads run
+    on it:
+
+      small files   create, stat and unlink of many 4 KiB files
+      tree scan     a `git status` walk, readdir and lstat of a tree
+      readdir       listing one directory of many entries
+      metadata      chmod, chown and utimens of every file of a tree, as
+                    `chown -R` or `tar x` restoring metadata do, and
+                    stats of deep paths
+      fio           sequential and random read and write, if fio is found
+
+    After the workloads, the counters of the mount are read from its stats
+    socket (see StatsServer) and kept with the results, which are printed
+    as a table or, with --json, one JSON object a line.  Arguments after --
+    go to encfs, eg. -- --lowlevel --crypto-threads=4.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const char Password[] = "encfs-bench";
+
+struct Options {
+  string encfs;      // the binary to mount with
+  string workDir;    // where the scratch directory goes
+  int smallFiles;    // files of the small files workload
+  int dirEntries;    // entries of the readdir workload
+  int fioSizeMB;     // file size of the fio jobs
+  bool fio;          // run fio even if it is not in the PATH
+  bool json;
+  bool keep;         // leave the scratch directory behind
+  vector<string> extra;  // arguments for encfs
+};
+
+struct Result {
+  string mode;
+  string workload;
+  double value;
+  const char *unit;
+};
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+string jsonString(const string &str) {
+  string out = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += (char)c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += (char)c;
+    }
+  }
+  return out + "\"";
+}
+
+// runs argv, with input on its standard input; its exit status
+int run(const vector<string> &args, const string &input) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    vector<char *> argv;
+    for (const string &arg : args) {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+  close(fds[0]);
+  if (!input.empty() &&
+      write(fds[1], input.data(), input.length()) != (ssize_t)input.length()) {
+    cerr << "unable to write to " << args[0] << "\n";
+  }
+  close(fds[1]);
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// the output of a shell command, empty if it failed
+string capture(const string &command) {
+  string out;
+  FILE *in = popen(command.c_str(), "r");
+  if (in == nullptr) {
+    return out;
+  }
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+    out.append(buf, len);
+  }
+  return pclose(in) == 0 ? out : string();
+}
+
+// true once something other than dir's parent filesystem is mounted there
+bool waitForMount(const string &dir, double seconds) {
+  struct stat parent;
+  if (stat((dir + "/..").c_str(), &parent) != 0) {
+    return false;
+  }
+  for (double end = now() + seconds; now() < end; usleep(50 * 1000)) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) == 0 && st.st_dev != parent.st_dev) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool makeDir(const string &path) {
+  return mkdir(path.c_str(), 0700) == 0 || errno == EEXIST;
+}
+
+bool writeFile(const string &path, const char *data, size_t len) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = write(fd, data, len) == (ssize_t)len;
+  return close(fd) == 0 && ok;
+}
+
+// removes path and everything under it
+void removeTree(const string &path) {
+  DIR *dp = opendir(path.c_str());
+  if (dp != nullptr) {
+    for (struct dirent *de = readdir(dp); de != nullptr; de = readdir(dp)) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+        continue;
+      }
+      string child = path + "/" + de->d_name;
+      struct stat st;
+      if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        removeTree(child);
+      } else {
+        unlink(child.c_str());
+      }
+    }
+    closedir(dp);
+  }
+  rmdir(path.c_str());
+}
+
+// readdir and lstat of everything under path, returns the entries seen
+long scanTree(const string &path) {
+  long entries = 0;
+  DIR *dp = opendir(path.c_str());
+  if (dp == nullptr) {
+    return 0;
+  }
+  for (struct dirent *de = readdir(dp); de != nullptr; de = readdir(dp)) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    string child = path + "/" + de->d_name;
+    struct stat st;
+    if (lstat(child.c_str(), &st) == 0) {
+      ++entries;
+      if (S_ISDIR(st.st_mode)) {
+        entries += scanTree(child);
+      }
+    }
+  }
+  closedir(dp);
+  return entries;
+}
+
+class Bench {
+ public:
+  Bench(const Options &opts, const string &mode, const string &mnt)
+      : _opts(opts), _mode(mode), _mnt(mnt) {}
+
+  bool smallFiles();
+  bool treeScan();
+  bool largeReaddir();
+  bool metadata();
+  bool fio();
+
+  const vector<Result> &results() const { return _results; }
+
+ private:
+  void add(const char *workload, double value, const char *unit) {
+    Result result = {_mode, workload, value, unit};
+    _results.push_back(result);
+  }
+
+  const Options &_opts;
+  string _mode;
+  string _mnt;
+  vector<Result> _results;
+};
+
+bool Bench::smallFiles() {
+  string dir = _mnt + "/small";
+  if (!makeDir(dir)) {
+    return false;
+  }
+  vector<char> data(4096, 'x');
+  int n = _opts.smallFiles;
+
+  double start = now();
+  for (int i = 0; i < n; ++i) {
+    if (!writeFile(dir + "/f" + to_string(i), data.data(), data.size())) {
+      cerr << "small files: create failed: " << strerror(errno) << "\n";
+      return false;
+    }
+  }
+  add("small-create", n / (now() - start), "files/s");
+
+  start = now();
+  for (int i = 0; i < n; ++i) {
+    struct stat st;
+    if (stat((dir + "/f" + to_string(i)).c_str(), &st) != 0) {
+      return false;
+    }
+  }
+  add("small-stat", n / (now() - start), "files/s");
+
+  start = now();
+  for (int i = 0; i < n; ++i) {
+    if (unlink((dir + "/f" + to_string(i)).c_str()) != 0) {
+      return false;
+    }
+  }
+  add("small-unlink", n / (now() - start), "files/s");
+  return rmdir(dir.c_str()) == 0;
+}
+
+// a tree shaped like a source checkout: 8 top level directories of 8
+// subdirectories of 32 files each
+bool Bench::treeScan() {
+  string root = _mnt + "/tree";
+  if (!makeDir(root)) {
+    return false;
+  }
+  const char data[] = "int main() { return 0; }\n";
+  for (int i = 0; i < 8; ++i) {
+    string top = root + "/dir" + to_string(i);
+    makeDir(top);
+    for (int j = 0; j < 8; ++j) {
+      string sub = top + "/sub" + to_string(j);
+      makeDir(sub);
+      for (int k = 0; k < 32; ++k) {
+        if (!writeFile(sub + "/file" + to_string(k) + ".c", data,
+                       sizeof(data) - 1)) {
+          return false;
+        }
+      }
+    }
+  }
+
+  // the first walk fills the caches, as the first `git status` would
+  scanTree(root);
+  const int passes = 5;
+  long entries = 0;
+  double start = now();
+  for (int i = 0; i < passes; ++i) {
+    entries += scanTree(root);
+  }
+  add("tree-scan", entries / (now() - start), "entries/s");
+  removeTree(root);
+  return true;
+}
+
+bool Bench::largeReaddir() {
+  string dir = _mnt + "/large";
+  if (!makeDir(dir)) {
+    return false;
+  }
+  for (int i = 0; i < _opts.dirEntries; ++i) {
+    if (!writeFile(dir + "/entry-with-a-longer-name-" + to_string(i), "", 0)) {
+      return false;
+    }
+  }
+
+  const int passes = 5;
+  long entries = 0;
+  double start = now();
+  for (int i = 0; i < passes; ++i) {
+    DIR *dp = opendir(dir.c_str());
+    if (dp == nullptr) {
+      return false;
+    }
+    while (readdir(dp) != nullptr) {
+      ++entries;
+    }
+    closedir(dp);
+  }
+  add("readdir", entries / (now() - start), "entries/s");
+  removeTree(dir);
+  return true;
+}
+
+// a tree shaped like that of treeScan(), its files changed one at a time,
+// then stat'ed by their full paths
+bool Bench::metadata() {
+  string root = _mnt + "/meta";
+  if (!makeDir(root)) {
+    return false;
+  }
+  vector<string> files;
+  for (int i = 0; i < 8; ++i) {
+    string top = root + "/dir" + to_string(i);
+    makeDir(top);
+    for (int j = 0; j < 8; ++j) {
+      string sub = top + "/sub" + to_string(j);
+      makeDir(sub);
+      for (int k = 0; k < 32; ++k) {
+        files.push_back(sub + "/file" + to_string(k) + ".c");
+        if (!writeFile(files.back(), "", 0)) {
+          return false;
+        }
+      }
+    }
+  }
+  double n = (double)files.size();
+
+  double start = now();
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (chmod(files[i].c_str(), (i & 1) != 0 ? 0644 : 0600) != 0) {
+      cerr << "metadata: chmod failed: " << strerror(errno) << "\n";
+      return false;
+    }
+  }
+  add("meta-chmod", n / (now() - start), "files/s");
+
+  start = now();
+  for (const string &file : files) {
+    if (lchown(file.c_str(), getuid(), getgid()) != 0) {
+      cerr << "metadata: chown failed: " << strerror(errno) << "\n";
+      return false;
+    }
+  }
+  add("meta-chown", n / (now() - start), "files/s");
+
+  struct timespec times[2] = {{1500000000, 0}, {1500000000, 0}};
+  start = now();
+  for (const string &file : files) {
+    if (utimensat(AT_FDCWD, file.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+      cerr << "metadata: utimens failed: " << strerror(errno) << "\n";
+      return false;
+    }
+  }
+  add("meta-utimens", n / (now() - start), "files/s");
+
+  const int passes = 5;
+  start = now();
+  for (int i = 0; i < passes; ++i) {
+    for (const string &file : files) {
+      struct stat st;
+      if (lstat(file.c_str(), &st) != 0) {
+        return false;
+      }
+    }
+  }
+  add("path-lookup", passes * n / (now() - start), "lookups/s");
+  removeTree(root);
+  return true;
+}
+
+// field 7 of fio's terse output is the read bandwidth in KiB/s, field 48
+// the write bandwidth
+bool Bench::fio() {
+  struct Job {
+    const char *name;
+    const char *rw;
+    const char *bs;
+    bool reads;
+  };
+  const Job jobs[] = {{"fio-seq-read", "read", "1M", true},
+                      {"fio-seq-write", "write", "1M", false},
+                      {"fio-rand-read", "randread", "4k", true},
+                      {"fio-rand-write", "randwrite", "4k", false}};
+  for (const Job &job : jobs) {
+    ostringstream cmd;
+    cmd << "fio --name=" << job.name << " --directory='" << _mnt
+        << "' --filename=fio.dat --rw=" << job.rw << " --bs=" << job.bs
+        << " --size=" << _opts.fioSizeMB << "M --runtime=10 --time_based"
+        << " --ioengine=psync --end_fsync=1 --output-format=terse"
+        << " --terse-version=3 2>/dev/null";
+    string out = capture(cmd.str());
+    vector<string> fields;
+    istringstream in(out);
+    for (string field; getline(in, field, ';');) {
+      fields.push_back(field);
+    }
+    if (fields.size() < 48) {
+      cerr << job.name << ": fio failed\n";
+      return false;
+    }
+    double kib = atof(fields[job.reads ? 6 : 47].c_str());
+    add(job.name, kib / 1024, "MiB/s");
+  }
+  unlink((_mnt + "/fio.dat").c_str());
+  return true;
+}
+
+// the report of the stats socket at path, empty if there is none
+string readStats(const string &path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return string();
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  string out;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+      out.append(buf, len);
+    }
+  }
+  close(fd);
+  return out;
+}
+
+// creates, mounts, benches and unmounts a volume made with --mode
+bool benchMode(const Options &opts, const string &mode, const string &scratch,
+               vector<Result> *results, string *stats) {
+  string raw = scratch + "/" + mode + ".raw";
+  string mnt = scratch + "/" + mode + ".mnt";
+  string socket = scratch + "/" + mode + ".stats";
+  if (!makeDir(raw) || !makeDir(mnt)) {
+    cerr << "unable to create " << raw << ": " << strerror(errno) << "\n";
+    return false;
+  }
+
+  vector<string> args = {opts.encfs, "--" + mode, "-S",
+                         "--stats-socket=" + socket};
+  args.insert(args.end(), opts.extra.begin(), opts.extra.end());
+  args.push_back(raw);
+  args.push_back(mnt);
+  // a new volume asks for the password twice
+  string password = string(Password) + "\n" + Password + "\n";
+  if (run(args, password) != 0 || !waitForMount(mnt, 10)) {
+    cerr << mode << ": unable to mount with " << opts.encfs << "\n";
+    return false;
+  }
+
+  Bench bench(opts, mode, mnt);
+  bool ok = bench.smallFiles() && bench.treeScan() && bench.largeReaddir() &&
+            bench.metadata();
+  if (ok && (opts.fio || !capture("command -v fio").empty())) {
+    ok = bench.fio();
+  }
+  *stats = readStats(socket);
+  results->insert(results->end(), bench.results().begin(),
+                  bench.results().end());
+
+  if (run({opts.encfs, "-u", mnt}, "") != 0 &&
+      run({"fusermount", "-u", mnt}, "") != 0) {
+    cerr << mode << ": unable to unmount " << mnt << "\n";
+    return false;
+  }
+  return ok;
+}
+
+void usage(const char *name) {
+  cerr << "usage: " << name
+       << " [--encfs=PATH] [--mode=standard|paranoia] [--files=N]\n"
+          "\t[--dir-entries=N] [--fio-size=MB] [--fio] [--json] "
+          "[--work-dir=DIR]\n"
+          "\t[--keep] [-- encfs options]\n";
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  Options opts;
+  opts.encfs = "encfs";
+  opts.workDir = getenv("TMPDIR") != nullptr ? getenv("TMPDIR") : "/tmp";
+  opts.smallFiles = 2000;
+  opts.dirEntries = 10000;
+  opts.fioSizeMB = 256;
+  opts.fio = false;
+  opts.json = false;
+  opts.keep = false;
+  vector<string> modes;
+
+  static struct option long_options[] = {{"encfs", 1, nullptr, 'e'},
+                                         {"mode", 1, nullptr, 'm'},
+                                         {"files", 1, nullptr, 'f'},
+                                         {"dir-entries", 1, nullptr, 'd'},
+                                         {"fio-size", 1, nullptr, 's'},
+                                         {"fio", 0, nullptr, 'F'},
+                                         {"json", 0, nullptr, 'j'},
+                                         {"work-dir", 1, nullptr, 'w'},
+                                         {"keep", 0, nullptr, 'k'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) {
+      break;
+    }
+    switch (res) {
+      case 'e':
+        opts.encfs = optarg;
+        break;
+      case 'm':
+        if (strcmp(optarg, "standard") != 0 &&
+            strcmp(optarg, "paranoia") != 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        modes.push_back(optarg);
+        break;
+      case 'f':
+        opts.smallFiles = std::max(1, atoi(optarg));
+        break;
+      case 'd':
+        opts.dirEntries = std::max(1, atoi(optarg));
+        break;
+      case 's':
+        opts.fioSizeMB = std::max(1, atoi(optarg));
+        break;
+      case 'F':
+        opts.fio = true;
+        break;
+      case 'j':
+        opts.json = true;
+        break;
+      case 'w':
+        opts.workDir = optarg;
+        break;
+      case 'k':
+        opts.keep = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  opts.extra.assign(argv + optind, argv + argc);
+  if (modes.empty()) {
+    modes = {"standard", "paranoia"};
+  }
+
+  string scratch = opts.workDir + "/encfs-bench.XXXXXX";
+  if (mkdtemp(&scratch[0]) == nullptr) {
+    cerr << "unable to create " << scratch << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  bool ok = true;
+  vector<Result> results;
+  vector<pair<string, string>> stats;
+  for (const string &mode : modes) {
+    string report;
+    ok = benchMode(opts, mode, scratch, &results, &report) && ok;
+    stats.push_back(make_pair(mode, report));
+  }
+
+  for (const Result &r : results) {
+    if (opts.json) {
+      cout << "{\"mode\": " << jsonString(r.mode)
+           << ", \"workload\": " << jsonString(r.workload)
+           << ", \"value\": " << r.value << ", \"unit\": \"" << r.unit
+           << "\"}\n";
+    } else {
+      printf("%-9s %-15s %12.1f %s\n", r.mode.c_str(), r.workload.c_str(),
+             r.value, r.unit);
+    }
+  }
+  for (const auto &s : stats) {
+    if (opts.json) {
+      cout << "{\"mode\": " << jsonString(s.first)
+           << ", \"stats\": " << jsonString(s.second) << "}\n";
+    } else if (!s.second.empty()) {
+      cout << "\n# stats of the " << s.first << " mount\n" << s.second;
+    }
+  }
+
+  if (opts.keep) {
+    cerr << "scratch directory kept in " << scratch << "\n";
+  } else {
+    removeTree(scratch);
+  }
+  return ok ? 0 : 1;
+}
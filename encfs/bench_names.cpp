@@ -0,0 +1,305 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_names: NameIO::encodePath and decodePath for each name
+    coding (Block, its case-insensitive base32 variant, Stream and Null),
+    swept over the depth of the path, the length of its names and
+    chainedNameIV.  The string forms and the ones into a caller's buffer
+    are timed separately, as the buffer form is what the mount uses on its
+    hot paths.  Built against the vendored google/benchmark; takes the
+    usual --benchmark_* flags, eg. --benchmark_filter=block32/decode.
+
+    Items are names coded, so items/s is comparable across depths, and
+    allocs are the heap allocations taken per path.
+
+    <coding>/corpus/... decode a directory's worth of single names as
+    readdir does, of which a share are not names of the volume: foreign
+    files, names too short to decode, random base64 and coded names with a
+    character changed.  throw catches what decodePath throws for them,
+    try takes the error from tryDecodePath.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "BlockNameIO.h"
+#include "Cipher.h"
+#include "CipherKey.h"
+#include "Error.h"
+#include "NameIO.h"
+#include "NullNameIO.h"
+#include "StreamNameIO.h"
+#include "openssl.h"
+
+using namespace std;
+using namespace encfs;
+
+// every allocation of the process, for allocs per path
+static std::atomic<uint64_t> gAllocs(0);
+
+void *operator new(size_t size) {
+  gAllocs.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace {
+
+// distinct paths coded in turn, so no single one stays in the caches
+const int PathCount = 64;
+
+enum Op { Encode, Decode, EncodeBuf, DecodeBuf };
+
+const char *opName(Op op) {
+  switch (op) {
+    case Encode:
+      return "encode";
+    case Decode:
+      return "decode";
+    case EncodeBuf:
+      return "encodeBuf";
+    case DecodeBuf:
+      return "decodeBuf";
+  }
+  return "?";
+}
+
+struct Coding {
+  const char *name;
+  Interface iface;
+};
+
+// a path of depth random names of length characters each
+std::string randomPath(const std::shared_ptr<Cipher> &cipher, int depth,
+                       int length) {
+  static const char chars[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-";
+  std::vector<unsigned char> rand(depth * length);
+  cipher->randomize(rand.data(), rand.size(), false);
+
+  std::string path;
+  for (int i = 0; i < depth; ++i) {
+    path += '/';
+    for (int j = 0; j < length; ++j) {
+      path += chars[rand[i * length + j] % (sizeof(chars) - 1)];
+    }
+  }
+  return path;
+}
+
+// names of a directory, of which invalidPct in a hundred do not decode
+std::vector<std::string> corpus(const std::shared_ptr<NameIO> &naming,
+                                const std::shared_ptr<Cipher> &cipher,
+                                int invalidPct) {
+  static const char *const foreign[] = {".DS_Store", "Thumbs.db",
+                                        "desktop.ini", "README.txt", "a~",
+                                        "x"};
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789,-";
+  const int count = 4 * PathCount;
+
+  std::vector<std::string> names;
+  for (int i = 0; i < count; ++i) {
+    std::string name = naming->encodePath(randomPath(cipher, 1, 16).c_str());
+    name.erase(0, name.find_first_not_of('/'));
+    if ((i * 100) / count >= invalidPct) {
+      names.push_back(name);
+      continue;
+    }
+    if (i % 3 == 0) {
+      name = foreign[(i / 3) % (sizeof(foreign) / sizeof(foreign[0]))];
+    } else if (i % 3 == 1) {
+      std::vector<unsigned char> rand(name.size());
+      cipher->randomize(rand.data(), rand.size(), false);
+      for (size_t j = 0; j < name.size(); ++j) {
+        name[j] = b64[rand[j] % (sizeof(b64) - 1)];
+      }
+    } else {
+      name[name.size() / 2] = name[name.size() / 2] == 'A' ? 'B' : 'A';
+    }
+    names.push_back(name);
+  }
+
+  // spread the invalid ones through the directory
+  std::vector<unsigned char> rand(count);
+  cipher->randomize(rand.data(), rand.size(), false);
+  for (int i = count - 1; i > 0; --i) {
+    std::swap(names[i], names[rand[i] % (i + 1)]);
+  }
+  return names;
+}
+
+void runCorpus(benchmark::State &state, std::shared_ptr<NameIO> naming,
+               std::shared_ptr<Cipher> cipher, bool useTry, int invalidPct) {
+  std::vector<std::string> names = corpus(naming, cipher, invalidPct);
+  std::vector<char> buf(naming->maxDecodedNameLen(256) + 2);
+
+  size_t next = 0;
+  int64_t failed = 0;
+  for (auto _ : state) {
+    const char *name = names[next].c_str();
+    uint64_t iv = 0;
+    if (useTry) {
+      int len = naming->tryDecodePath(name, buf.data(), buf.size(), &iv);
+      failed += len < 0;
+      benchmark::DoNotOptimize(len);
+    } else {
+      try {
+        benchmark::DoNotOptimize(
+            naming->decodePath(name, buf.data(), buf.size(), &iv));
+      } catch (encfs::Error &err) {
+        ++failed;
+      }
+    }
+    benchmark::ClobberMemory();
+    next = (next + 1) % names.size();
+  }
+
+  state.SetItemsProcessed(int64_t(state.iterations()));
+  double iterations = std::max((double)state.iterations(), 1.0);
+  state.counters["invalid"] = failed / iterations;
+}
+
+void runOp(benchmark::State &state, std::shared_ptr<NameIO> naming,
+           std::shared_ptr<Cipher> cipher, Op op, int depth, int length) {
+  std::vector<std::string> plain;
+  std::vector<std::string> encoded;
+  for (int i = 0; i < PathCount; ++i) {
+    plain.push_back(randomPath(cipher, depth, length));
+    encoded.push_back(naming->encodePath(plain.back().c_str()));
+  }
+  const std::vector<std::string> &in =
+      (op == Encode || op == EncodeBuf) ? plain : encoded;
+
+  int maxLen = std::max(naming->maxEncodedNameLen(length),
+                        naming->maxDecodedNameLen(
+                            naming->maxEncodedNameLen(length)));
+  std::vector<char> buf((maxLen + 1) * depth + 1);
+
+  int next = 0;
+  uint64_t allocs = gAllocs.load(std::memory_order_relaxed);
+  for (auto _ : state) {
+    const char *path = in[next].c_str();
+    uint64_t iv = 0;
+    switch (op) {
+      case Encode:
+        benchmark::DoNotOptimize(naming->encodePath(path, &iv));
+        break;
+      case Decode:
+        benchmark::DoNotOptimize(naming->decodePath(path, &iv));
+        break;
+      case EncodeBuf:
+        benchmark::DoNotOptimize(
+            naming->encodePath(path, buf.data(), buf.size(), &iv));
+        break;
+      case DecodeBuf:
+        benchmark::DoNotOptimize(
+            naming->decodePath(path, buf.data(), buf.size(), &iv));
+        break;
+    }
+    benchmark::ClobberMemory();
+    next = (next + 1) % PathCount;
+  }
+  allocs = gAllocs.load(std::memory_order_relaxed) - allocs;
+
+  state.SetItemsProcessed(int64_t(state.iterations()) * depth);
+  // the vendored benchmark has no per iteration counters
+  double iterations = std::max((double)state.iterations(), 1.0);
+  state.counters["allocs"] = allocs / iterations;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  START_EASYLOGGINGPP(argc, argv);
+  encfs::initLogging();
+  openssl_init(true);
+
+  benchmark::Initialize(&argc, argv);
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "No AES cipher found\n";
+    return 1;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  const Coding codings[] = {{"block", BlockNameIO::CurrentInterface(false)},
+                            {"block32", BlockNameIO::CurrentInterface(true)},
+                            {"stream", StreamNameIO::CurrentInterface()},
+                            {"null", NullNameIO::CurrentInterface()}};
+  const Op ops[] = {Encode, Decode, EncodeBuf, DecodeBuf};
+  const int depths[] = {1, 4, 16};
+  const int lengths[] = {8, 32, 128};
+  const int invalidPcts[] = {0, 10, 50};
+
+  for (const Coding &coding : codings) {
+    for (int chained = 0; chained <= 1; ++chained) {
+      std::shared_ptr<NameIO> naming = NameIO::New(coding.iface, cipher, key);
+      if (!naming) {
+        continue;
+      }
+      naming->setChainedNameIV(chained != 0);
+
+      for (Op op : ops) {
+        for (int depth : depths) {
+          for (int length : lengths) {
+            std::string name = std::string(coding.name) + "/" + opName(op) +
+                               "/depth:" + std::to_string(depth) +
+                               "/len:" + std::to_string(length) +
+                               "/chained:" + std::to_string(chained);
+            benchmark::RegisterBenchmark(name.c_str(), runOp, naming, cipher,
+                                         op, depth, length);
+          }
+        }
+      }
+
+      // the null coding decodes any name
+      if (coding.iface.name() == NullNameIO::CurrentInterface().name()) {
+        continue;
+      }
+      for (int useTry = 0; useTry <= 1; ++useTry) {
+        for (int invalidPct : invalidPcts) {
+          std::string name = std::string(coding.name) + "/corpus/" +
+                             (useTry ? "try" : "throw") +
+                             "/invalid:" + std::to_string(invalidPct) +
+                             "/chained:" + std::to_string(chained);
+          benchmark::RegisterBenchmark(name.c_str(), runCorpus, naming, cipher,
+                                       useTry != 0, invalidPct);
+        }
+      }
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  openssl_shutdown(true);
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_pool: MemoryPool::allocate and release under the size mixes
+    the FUSE threads generate, for 1 .. ncpu threads, against malloc and
+    free (and malloc with the clearing on release the pool does).  Each
+    iteration holds a few buffers at once, as a read of several blocks
+    does, then gives them back in turn.  Built against the vendored
+    google/benchmark; takes the usual --benchmark_* flags, eg.
+    --benchmark_filter=pool/mixed.
+
+    The mixes: whole blocks; blocks with a MAC header in front; name
+    buffers of 16 to 256 bytes; and a blend of the three.  Items are
+    buffers allocated, so items/s compares pools across thread counts.
+ */
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Error.h"
+#include "MemoryPool.h"
+
+using namespace std;
+using namespace encfs;
+
+namespace {
+
+// a block of the default volume, and the MAC header of --paranoia
+const int BlockSize = 1024;
+const int MacHeader = 8;
+// buffers held at once by an iteration
+const int Held = 4;
+// sizes drawn per thread ahead of the timing, cycled through
+const int SizeCount = 4096;
+
+enum Mix { Blocks, MacBlocks, Names, Mixed };
+
+enum Allocator { Pool, Malloc, MallocWipe };
+
+const char *mixName(Mix mix) {
+  switch (mix) {
+    case Blocks:
+      return "block";
+    case MacBlocks:
+      return "block+mac";
+    case Names:
+      return "names";
+    case Mixed:
+      return "mixed";
+  }
+  return "?";
+}
+
+const char *allocatorName(Allocator allocator) {
+  switch (allocator) {
+    case Pool:
+      return "pool";
+    case Malloc:
+      return "malloc";
+    case MallocWipe:
+      return "malloc+wipe";
+  }
+  return "?";
+}
+
+// the mix as read and write requests draw it: mostly blocks, with names
+// coded for every lookup
+std::vector<int> drawSizes(Mix mix, unsigned seed) {
+  std::vector<int> sizes(SizeCount);
+  for (int &size : sizes) {
+    int name = 16 + (int)(rand_r(&seed) % 241);
+    switch (mix) {
+      case Blocks:
+        size = BlockSize;
+        break;
+      case MacBlocks:
+        size = BlockSize + MacHeader;
+        break;
+      case Names:
+        size = name;
+        break;
+      case Mixed: {
+        int pick = rand_r(&seed) % 10;
+        size = pick < 5 ? BlockSize : pick < 7 ? BlockSize + MacHeader : name;
+        break;
+      }
+    }
+  }
+  return sizes;
+}
+
+void runMix(benchmark::State &state, Mix mix, Allocator allocator) {
+  std::vector<int> sizes = drawSizes(mix, 1 + state.thread_index);
+  MemBlock pool[Held];
+  unsigned char *heap[Held];
+
+  int next = 0;
+  for (auto _ : state) {
+    int held[Held];
+    for (int i = 0; i < Held; ++i) {
+      held[i] = sizes[next];
+      next = (next + 1) % SizeCount;
+      if (allocator == Pool) {
+        pool[i] = MemoryPool::allocate(held[i]);
+        pool[i].data[0] = 1;
+      } else {
+        heap[i] = (unsigned char *)malloc(held[i]);
+        heap[i][0] = 1;
+      }
+    }
+    benchmark::ClobberMemory();
+    for (int i = Held - 1; i >= 0; --i) {
+      if (allocator == Pool) {
+        MemoryPool::release(pool[i]);
+      } else {
+        if (allocator == MallocWipe) {
+          memset(heap[i], 0, held[i]);
+          benchmark::ClobberMemory();
+        }
+        free(heap[i]);
+      }
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * Held);
+
+  if (allocator == Pool && state.thread_index == 0) {
+    MemoryPool::Stats stats = MemoryPool::stats();
+    uint64_t total = stats.hits + stats.misses;
+    state.counters["hit_rate"] =
+        total > 0 ? (double)stats.hits / (double)total : 0;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  START_EASYLOGGINGPP(argc, argv);
+  encfs::initLogging();
+
+  benchmark::Initialize(&argc, argv);
+
+  int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  const Mix mixes[] = {Blocks, MacBlocks, Names, Mixed};
+  const Allocator allocators[] = {Pool, Malloc, MallocWipe};
+
+  for (Mix mix : mixes) {
+    for (Allocator allocator : allocators) {
+      std::string name =
+          std::string(allocatorName(allocator)) + "/" + mixName(mix);
+      benchmark::RegisterBenchmark(name.c_str(), runMix, mix, allocator)
+          ->ThreadRange(1, maxThreads)
+          ->UseRealTime();
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  MemoryPool::destroyAll();
+  return 0;
+}
@@ -0,0 +1,858 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This library is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GPL in the file COPYING for more
+ * details.
+ *
+ */
+
+/*
+    encfs_bench_replay: replays an op trace recorded by a mount with
+    --record-ops (see OpTrace) against a directory, usually the mount of a
+    scratch volume, to reproduce what a production volume saw and measure
+    an optimisation on it:
+
+      encfs_bench_replay [--speed=X] [--no-setup] [--json] TRACE DIR
+
+    Names are not in the trace, so every path is rebuilt under DIR from
+    the hashes of its encoded name and of its directory.  Before the replay
+    starts, the files, directories and links the trace uses without making
+    them are created, files as long as the furthest byte it touches.
+
+    Each thread of the trace is replayed by one of its own, running the
+    ops of that thread in order: as fast as they go, or with --speed at X
+    times the pace they were recorded at.  Reads and writes go through the
+    descriptor of the open that preceded them where there was one.  At the
+    end, the latencies of every op are printed next to those recorded,
+    with the number of ops whose outcome differed from the recorded one.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#if defined(__linux__)
+#include <sys/xattr.h>
+#endif
+
+#include "OpStats.h"
+#include "OpTrace.h"
+
+using namespace std;
+using namespace encfs;
+
+namespace {
+
+// the xattr the xattr ops of a trace are replayed on, their names are not
+// recorded
+const char ReplayXattr[] = "user.encfs-replay";
+
+struct Options {
+  double speed;  // 0 == as fast as possible
+  bool setup;
+  bool json;
+};
+
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint16_t get16(const unsigned char *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+uint64_t get64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+const char *opName(int op) {
+  static const char *const Names[OpStats::FirstPhase] = {
+      "getattr",  "fgetattr", "lookup",    "readlink",  "opendir",
+      "readdir",  "releasedir", "mknod",   "mkdir",     "unlink",
+      "rmdir",    "symlink",  "rename",    "link",      "chmod",
+      "chown",    "truncate", "ftruncate", "fallocate", "copy_file_range",
+      "lseek",    "utime",    "utimens",   "open",      "create",
+      "read",     "write",    "statfs",    "flush",     "release",
+      "fsync",    "setxattr", "getxattr",  "listxattr", "removexattr"};
+  return (op >= 0 && op < OpStats::FirstPhase) ? Names[op] : "unknown";
+}
+
+// the records of the trace in file, by start time
+bool load(const string &file, vector<OpTrace::Record> *out) {
+  FILE *in = fopen(file.c_str(), "rb");
+  if (in == nullptr) {
+    cerr << "unable to open " << file << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  unsigned char header[OpTrace::HeaderBytes];
+  if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+      memcmp(header, OpTrace::Magic, sizeof(OpTrace::Magic)) != 0 ||
+      get32(header + 4) != OpTrace::Version) {
+    cerr << file << " is not an op trace of this version\n";
+    fclose(in);
+    return false;
+  }
+
+  unsigned char buf[OpTrace::RecordBytes];
+  while (fread(buf, 1, sizeof(buf), in) == sizeof(buf)) {
+    OpTrace::Record rec;
+    rec.startNs = get64(buf);
+    rec.durationNs = get64(buf + 8);
+    rec.path = get64(buf + 16);
+    rec.parent = get64(buf + 24);
+    rec.path2 = get64(buf + 32);
+    rec.parent2 = get64(buf + 40);
+    rec.offset = (int64_t)get64(buf + 48);
+    rec.size = get64(buf + 56);
+    rec.thread = get32(buf + 64);
+    rec.op = get16(buf + 68);
+    rec.result = (int16_t)get16(buf + 70);
+    if (rec.op < OpStats::FirstPhase) {
+      out->push_back(rec);
+    }
+  }
+  fclose(in);
+
+  // each thread's records are in order already, a stable sort keeps them
+  std::stable_sort(out->begin(), out->end(),
+                   [](const OpTrace::Record &x, const OpTrace::Record &y) {
+                     return x.startNs < y.startNs;
+                   });
+  return true;
+}
+
+enum Kind { Unknown, File, Dir, Link };
+
+struct Node {
+  uint64_t parent = 0;  // 0 if never seen with one
+  Kind kind = Unknown;
+  uint64_t extent = 0;  // bytes of a file the trace reaches
+  bool seen = false;
+  bool exists = true;   // before the trace starts
+};
+
+/*
+    The paths of a trace, rebuilt from their hashes: a path is named after
+    its own hash, in the directory of its parent's hash, or in the replay
+    directory when that parent never showed up with one of its own.
+ */
+class Tree {
+ public:
+  explicit Tree(const string &dir) : _dir(dir), _root(OpTrace::hashPath("/")) {}
+
+  void learn(const vector<OpTrace::Record> &records);
+
+  // creates what exists before the trace starts
+  bool setup();
+
+  string pathOf(uint64_t hash) {
+    if (hash == _root || hash == 0) {
+      return _dir;
+    }
+    auto found = _paths.find(hash);
+    if (found != _paths.end()) {
+      return found->second;
+    }
+    string path = _dir;
+    // parents first, stopping at one already named or a cycle of renames
+    vector<uint64_t> chain;
+    for (uint64_t h = hash; h != 0 && h != _root && chain.size() < 64;) {
+      chain.push_back(h);
+      auto it = _nodes.find(h);
+      h = it != _nodes.end() ? it->second.parent : 0;
+      if (h != 0 && _paths.count(h) != 0) {
+        path = _paths[h];
+        break;
+      }
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      char name[24];
+      snprintf(name, sizeof(name), "/%016llx", (unsigned long long)*it);
+      path += name;
+      _paths[*it] = path;
+    }
+    return _paths[hash];
+  }
+
+ private:
+  Node &touch(uint64_t hash, uint64_t parent, bool first, int result,
+              bool made) {
+    Node &node = _nodes[hash];
+    if (parent != 0) {
+      node.parent = parent;
+      Node &dir = _nodes[parent];
+      dir.kind = Dir;
+    }
+    if (!node.seen && first) {
+      node.seen = true;
+      node.exists = !made && result != -ENOENT;
+    }
+    return node;
+  }
+
+  string _dir;
+  uint64_t _root;
+  unordered_map<uint64_t, Node> _nodes;
+  unordered_map<uint64_t, string> _paths;
+};
+
+void Tree::learn(const vector<OpTrace::Record> &records) {
+  for (const OpTrace::Record &rec : records) {
+    if (rec.path == 0) {
+      continue;
+    }
+    bool made = rec.op == OpStats::Create || rec.op == OpStats::Mknod ||
+                rec.op == OpStats::Mkdir || rec.op == OpStats::Symlink;
+    Node &node = touch(rec.path, rec.parent, true, rec.result, made);
+    uint64_t end = 0;
+    switch (rec.op) {
+      case OpStats::Opendir:
+      case OpStats::Readdir:
+      case OpStats::Releasedir:
+      case OpStats::Mkdir:
+      case OpStats::Rmdir:
+        node.kind = Dir;
+        break;
+      case OpStats::Symlink:
+      case OpStats::Readlink:
+        node.kind = Link;
+        break;
+      case OpStats::Read:
+      case OpStats::Write:
+      case OpStats::Fallocate:
+      case OpStats::CopyFileRange:
+        end = (uint64_t)std::max<int64_t>(rec.offset, 0) + rec.size;
+        if (rec.op == OpStats::Read && rec.result == 0) {
+          // reads past the end are short, they say nothing of its size
+          end = (uint64_t)std::max<int64_t>(rec.offset, 0);
+        }
+        node.kind = File;
+        break;
+      case OpStats::Truncate:
+      case OpStats::Ftruncate:
+      case OpStats::Lseek:
+        end = (uint64_t)std::max<int64_t>(rec.offset, 0);
+        node.kind = File;
+        break;
+      case OpStats::Open:
+      case OpStats::Create:
+      case OpStats::Mknod:
+      case OpStats::Flush:
+      case OpStats::Release:
+      case OpStats::Fsync:
+      case OpStats::Fgetattr:
+        node.kind = File;
+        break;
+      default:
+        break;
+    }
+    if (node.exists && end > node.extent) {
+      node.extent = end;
+    }
+
+    if (rec.path2 != 0) {
+      // the new name of a rename or link, made by it
+      bool made2 = rec.op == OpStats::Rename || rec.op == OpStats::Link;
+      Node &other = touch(rec.path2, rec.parent2, true, rec.result, made2);
+      if (other.kind == Unknown) {
+        other.kind = rec.op == OpStats::CopyFileRange ? File : node.kind;
+      }
+    }
+  }
+}
+
+bool Tree::setup() {
+  // parents before their children, which pathOf() names below them
+  vector<pair<string, const Node *>> todo;
+  for (auto &entry : _nodes) {
+    const Node &node = entry.second;
+    if (entry.first == _root || !node.exists) {
+      continue;
+    }
+    todo.emplace_back(pathOf(entry.first), &node);
+  }
+  std::sort(todo.begin(), todo.end(),
+            [](const pair<string, const Node *> &x,
+               const pair<string, const Node *> &y) {
+              return x.first.length() < y.first.length();
+            });
+
+  vector<char> data(1024 * 1024, 'r');
+  for (auto &entry : todo) {
+    const string &path = entry.first;
+    const Node &node = *entry.second;
+    // what a parent left out is made first, as a directory
+    for (string::size_type slash = path.find('/', _dir.length() + 1);
+         slash != string::npos; slash = path.find('/', slash + 1)) {
+      mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    switch (node.kind) {
+      case Dir:
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+          cerr << "unable to create " << path << ": " << strerror(errno)
+               << "\n";
+          return false;
+        }
+        break;
+      case Link:
+        if (symlink("replay-target", path.c_str()) != 0 && errno != EEXIST) {
+          cerr << "unable to create " << path << ": " << strerror(errno)
+               << "\n";
+          return false;
+        }
+        break;
+      case Unknown:
+      case File: {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+          cerr << "unable to create " << path << ": " << strerror(errno)
+               << "\n";
+          return false;
+        }
+        // written out rather than left sparse, holes read faster
+        uint64_t done = 0;
+        while (done < node.extent) {
+          size_t len = (size_t)std::min<uint64_t>(data.size(),
+                                                  node.extent - done);
+          ssize_t res = pwrite(fd, data.data(), len, (off_t)done);
+          if (res <= 0) {
+            cerr << "unable to fill " << path << ": " << strerror(errno)
+                 << "\n";
+            close(fd);
+            return false;
+          }
+          done += (uint64_t)res;
+        }
+        close(fd);
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+    The descriptors the opens of a trace return, held until their release.
+    Opens of one path share a descriptor, as the handles of the trace are
+    not recorded.
+ */
+class Descriptors {
+ public:
+  ~Descriptors() {
+    for (auto &entry : _open) {
+      close(entry.second.fd);
+    }
+  }
+
+  int open(uint64_t hash, const string &path, int flags, mode_t mode) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto found = _open.find(hash);
+      if (found != _open.end()) {
+        ++found->second.refs;
+        return 0;
+      }
+    }
+    int fd = ::open(path.c_str(), flags, mode);
+    if (fd < 0) {
+      return -errno;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    Open &entry = _open[hash];
+    if (entry.refs++ > 0) {
+      // another thread opened it meanwhile
+      ::close(fd);
+    } else {
+      entry.fd = fd;
+    }
+    return 0;
+  }
+
+  int release(uint64_t hash) {
+    int fd = -1;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto found = _open.find(hash);
+      if (found == _open.end()) {
+        return 0;
+      }
+      if (--found->second.refs == 0) {
+        fd = found->second.fd;
+        _open.erase(found);
+      }
+    }
+    return fd >= 0 && ::close(fd) != 0 ? -errno : 0;
+  }
+
+  // the descriptor of hash, -1 if it is not open.  The caller has it until
+  // done() whatever releases it meanwhile.
+  int get(uint64_t hash) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _open.find(hash);
+    if (found == _open.end()) {
+      return -1;
+    }
+    ++found->second.refs;
+    return found->second.fd;
+  }
+  void done(uint64_t hash) { release(hash); }
+
+ private:
+  struct Open {
+    int fd = -1;
+    int refs = 0;
+  };
+  std::mutex _mutex;
+  std::map<uint64_t, Open> _open;
+};
+
+struct Outcome {
+  uint64_t ns;
+  bool differs;  // succeeded where the recorded op failed, or the reverse
+};
+
+class Replay {
+ public:
+  Replay(const Options &opts, Tree *tree) : _opts(opts), _tree(tree) {}
+
+  // the ops of records, run by as many threads as recorded them
+  void run(const vector<OpTrace::Record> &records);
+
+  const vector<Outcome> &outcomes() const { return _outcomes; }
+
+ private:
+  int replay(const OpTrace::Record &rec, const string &path,
+             const string &path2);
+  // runs io on the open descriptor of rec.path, or on one of its own
+  int withFd(const OpTrace::Record &rec, const string &path,
+             int (*io)(int fd, const OpTrace::Record &rec));
+
+  const Options &_opts;
+  Tree *_tree;
+  Descriptors _fds;
+  vector<Outcome> _outcomes;  // by record
+};
+
+int readIo(int fd, const OpTrace::Record &rec) {
+  vector<char> buf((size_t)std::min<uint64_t>(rec.size, 16 * 1024 * 1024));
+  return pread(fd, buf.data(), buf.size(), (off_t)rec.offset) < 0 ? -errno
+                                                                  : 0;
+}
+
+int writeIo(int fd, const OpTrace::Record &rec) {
+  vector<char> buf((size_t)std::min<uint64_t>(rec.size, 16 * 1024 * 1024),
+                   'w');
+  return pwrite(fd, buf.data(), buf.size(), (off_t)rec.offset) < 0 ? -errno
+                                                                   : 0;
+}
+
+int fsyncIo(int fd, const OpTrace::Record &rec) {
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+  int res = rec.size != 0 ? fdatasync(fd) : fsync(fd);
+#else
+  (void)rec;
+  int res = fsync(fd);
+#endif
+  return res != 0 ? -errno : 0;
+}
+
+int ftruncateIo(int fd, const OpTrace::Record &rec) {
+  return ftruncate(fd, (off_t)rec.offset) != 0 ? -errno : 0;
+}
+
+int fstatIo(int fd, const OpTrace::Record &rec) {
+  (void)rec;
+  struct stat st;
+  return fstat(fd, &st) != 0 ? -errno : 0;
+}
+
+int fallocateIo(int fd, const OpTrace::Record &rec) {
+#if defined(__linux__)
+  return fallocate(fd, 0, (off_t)rec.offset, (off_t)rec.size) != 0 ? -errno
+                                                                  : 0;
+#else
+  int res = posix_fallocate(fd, (off_t)rec.offset, (off_t)rec.size);
+  return -res;
+#endif
+}
+
+int lseekIo(int fd, const OpTrace::Record &rec) {
+#if defined(SEEK_DATA)
+  return lseek(fd, (off_t)rec.offset, SEEK_DATA) < 0 ? -errno : 0;
+#else
+  (void)fd;
+  (void)rec;
+  return 0;
+#endif
+}
+
+int Replay::withFd(const OpTrace::Record &rec, const string &path,
+                   int (*io)(int fd, const OpTrace::Record &rec)) {
+  int fd = _fds.get(rec.path);
+  if (fd >= 0) {
+    int res = io(fd, rec);
+    _fds.done(rec.path);
+    return res;
+  }
+  fd = open(path.c_str(), O_RDWR);
+  if (fd < 0 && errno == EACCES) {
+    fd = open(path.c_str(), O_RDONLY);
+  }
+  if (fd < 0) {
+    return -errno;
+  }
+  int res = io(fd, rec);
+  close(fd);
+  return res;
+}
+
+int Replay::replay(const OpTrace::Record &rec, const string &path,
+                   const string &path2) {
+  const char *p = path.c_str();
+  int res = 0;
+  switch (rec.op) {
+    case OpStats::Getattr:
+    case OpStats::Lookup: {
+      struct stat st;
+      res = lstat(p, &st);
+      break;
+    }
+    case OpStats::Fgetattr:
+      return withFd(rec, path, fstatIo);
+    case OpStats::Readlink: {
+      char buf[PATH_MAX];
+      res = readlink(p, buf, sizeof(buf)) < 0 ? -1 : 0;
+      break;
+    }
+    case OpStats::Opendir:
+    case OpStats::Releasedir:
+      // a readdir opens and closes the directory itself
+      return 0;
+    case OpStats::Readdir: {
+      DIR *dp = opendir(p);
+      if (dp == nullptr) {
+        return -errno;
+      }
+      while (readdir(dp) != nullptr) {
+      }
+      closedir(dp);
+      return 0;
+    }
+    case OpStats::Mknod:
+      res = mknod(p, S_IFREG | (rec.size & 07777), 0);
+      break;
+    case OpStats::Mkdir:
+      res = mkdir(p, (mode_t)(rec.size & 07777));
+      break;
+    case OpStats::Unlink:
+      res = unlink(p);
+      break;
+    case OpStats::Rmdir:
+      res = rmdir(p);
+      break;
+    case OpStats::Symlink:
+      res = symlink("replay-target", p);
+      break;
+    case OpStats::Rename:
+      res = rename(p, path2.c_str());
+      break;
+    case OpStats::Link:
+      res = link(p, path2.c_str());
+      break;
+    case OpStats::Chmod:
+      res = chmod(p, (mode_t)(rec.size & 07777));
+      break;
+    case OpStats::Chown:
+      // to the owner it has, which needs no privileges
+      res = lchown(p, (uid_t)-1, (gid_t)-1);
+      break;
+    case OpStats::Truncate:
+      res = truncate(p, (off_t)rec.offset);
+      break;
+    case OpStats::Ftruncate:
+      return withFd(rec, path, ftruncateIo);
+    case OpStats::Fallocate:
+      return withFd(rec, path, fallocateIo);
+    case OpStats::CopyFileRange: {
+      int in = open(p, O_RDONLY);
+      if (in < 0) {
+        return -errno;
+      }
+      int out = open(path2.c_str(), O_WRONLY | O_CREAT, 0644);
+      if (out < 0) {
+        res = -errno;
+        close(in);
+        return res;
+      }
+      vector<char> buf((size_t)std::min<uint64_t>(rec.size, 16 * 1024 * 1024));
+      ssize_t got = pread(in, buf.data(), buf.size(), (off_t)rec.offset);
+      res = got < 0 || (got > 0 && write(out, buf.data(), got) < 0) ? -errno
+                                                                    : 0;
+      close(in);
+      close(out);
+      return res;
+    }
+    case OpStats::Lseek:
+      return withFd(rec, path, lseekIo);
+    case OpStats::Utime:
+    case OpStats::Utimens:
+      res = utimensat(AT_FDCWD, p, nullptr, AT_SYMLINK_NOFOLLOW);
+      break;
+    case OpStats::Open:
+      return _fds.open(rec.path, path, O_RDWR, 0);
+    case OpStats::Create:
+      return _fds.open(rec.path, path, O_RDWR | O_CREAT,
+                       (mode_t)(rec.size & 07777));
+    case OpStats::Read:
+      return withFd(rec, path, readIo);
+    case OpStats::Write:
+      return withFd(rec, path, writeIo);
+    case OpStats::Statfs: {
+      struct statvfs st;
+      res = statvfs(p, &st);
+      break;
+    }
+    case OpStats::Flush:
+      // close(2) of one of the descriptors, which the release follows
+      return 0;
+    case OpStats::Release:
+      return _fds.release(rec.path);
+    case OpStats::Fsync:
+      return withFd(rec, path, fsyncIo);
+#if defined(__linux__)
+    case OpStats::Setxattr:
+      res = lsetxattr(p, ReplayXattr, "replay", 6, 0);
+      break;
+    case OpStats::Getxattr: {
+      char buf[64];
+      ssize_t got = lgetxattr(p, ReplayXattr, buf, sizeof(buf));
+      res = got < 0 && errno != ENODATA ? -1 : 0;
+      break;
+    }
+    case OpStats::Listxattr: {
+      char buf[4096];
+      res = llistxattr(p, buf, sizeof(buf)) < 0 ? -1 : 0;
+      break;
+    }
+    case OpStats::Removexattr:
+      res = lremovexattr(p, ReplayXattr);
+      if (res != 0 && errno == ENODATA) {
+        res = 0;
+      }
+      break;
+#endif
+    default:
+      return 0;
+  }
+  return res != 0 ? -errno : 0;
+}
+
+void Replay::run(const vector<OpTrace::Record> &records) {
+  _outcomes.assign(records.size(), Outcome());
+
+  // the records of each thread of the trace, in order
+  map<uint32_t, vector<size_t>> byThread;
+  for (size_t i = 0; i < records.size(); ++i) {
+    byThread[records[i].thread].push_back(i);
+  }
+  // paths are named up front, Tree is not shared between threads
+  vector<string> paths(records.size());
+  vector<string> paths2(records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    paths[i] = _tree->pathOf(records[i].path);
+    if (records[i].path2 != 0) {
+      paths2[i] = _tree->pathOf(records[i].path2);
+    }
+  }
+
+  uint64_t start = nowNs() + 10 * 1000000;
+  vector<std::thread> threads;
+  for (auto &entry : byThread) {
+    const vector<size_t> *mine = &entry.second;
+    threads.emplace_back([this, &records, &paths, &paths2, mine, start]() {
+      for (size_t i : *mine) {
+        const OpTrace::Record &rec = records[i];
+        uint64_t due = start;
+        if (_opts.speed > 0) {
+          due += (uint64_t)(rec.startNs / _opts.speed);
+        }
+        for (uint64_t now = nowNs(); now < due; now = nowNs()) {
+          uint64_t wait = due - now;
+          struct timespec ts = {(time_t)(wait / 1000000000),
+                                (long)(wait % 1000000000)};
+          nanosleep(&ts, nullptr);
+        }
+        uint64_t begin = nowNs();
+        int res = replay(rec, paths[i], paths2[i]);
+        _outcomes[i].ns = nowNs() - begin;
+        _outcomes[i].differs = (res < 0) != (rec.result < 0);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+uint64_t percentile(vector<uint64_t> *values, double q) {
+  if (values->empty()) {
+    return 0;
+  }
+  size_t at = std::min(values->size() - 1, (size_t)(q * values->size()));
+  std::nth_element(values->begin(), values->begin() + at, values->end());
+  return (*values)[at];
+}
+
+void report(const Options &opts, const vector<OpTrace::Record> &records,
+            const vector<Outcome> &outcomes, double seconds) {
+  struct Row {
+    vector<uint64_t> recorded;
+    vector<uint64_t> replayed;
+    uint64_t differs = 0;
+  };
+  map<int, Row> rows;
+  for (size_t i = 0; i < records.size(); ++i) {
+    Row &row = rows[records[i].op];
+    row.recorded.push_back(records[i].durationNs);
+    row.replayed.push_back(outcomes[i].ns);
+    row.differs += outcomes[i].differs ? 1 : 0;
+  }
+
+  double span = records.empty() ? 0 : records.back().startNs / 1e9;
+  if (opts.json) {
+    printf("{\"ops\": %zu, \"recorded_s\": %.3f, \"replayed_s\": %.3f}\n",
+           records.size(), span, seconds);
+  } else {
+    printf("%zu ops, recorded over %.3fs, replayed in %.3fs\n\n",
+           records.size(), span, seconds);
+    printf("%-16s %9s %11s %11s %11s %11s %8s\n", "op", "count",
+           "rec p50 us", "rec p99 us", "rep p50 us", "rep p99 us", "differ");
+  }
+  for (auto &entry : rows) {
+    Row &row = entry.second;
+    double rec50 = percentile(&row.recorded, 0.5) / 1000.0;
+    double rec99 = percentile(&row.recorded, 0.99) / 1000.0;
+    double rep50 = percentile(&row.replayed, 0.5) / 1000.0;
+    double rep99 = percentile(&row.replayed, 0.99) / 1000.0;
+    if (opts.json) {
+      printf("{\"op\": \"%s\", \"count\": %zu, \"recorded_p50_us\": %.1f, "
+             "\"recorded_p99_us\": %.1f, \"replayed_p50_us\": %.1f, "
+             "\"replayed_p99_us\": %.1f, \"differ\": %llu}\n",
+             opName(entry.first), row.recorded.size(), rec50, rec99, rep50,
+             rep99, (unsigned long long)row.differs);
+    } else {
+      printf("%-16s %9zu %11.1f %11.1f %11.1f %11.1f %8llu\n",
+             opName(entry.first), row.recorded.size(), rec50, rec99, rep50,
+             rep99, (unsigned long long)row.differs);
+    }
+  }
+}
+
+void usage(const char *name) {
+  cerr << "usage: " << name << " [options] TRACE DIR\n"
+       << "  --speed=X\treplay at X times the recorded pace, 0 (the\n"
+       << "\t\tdefault) as fast as the ops go\n"
+       << "  --no-setup\tdo not create what the trace uses before it starts\n"
+       << "  --json\tone JSON object a line rather than a table\n";
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  Options opts;
+  opts.speed = 0;
+  opts.setup = true;
+  opts.json = false;
+
+  static struct option long_options[] = {{"speed", 1, nullptr, 's'},
+                                         {"no-setup", 0, nullptr, 'n'},
+                                         {"json", 0, nullptr, 'j'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) {
+      break;
+    }
+    switch (res) {
+      case 's': {
+        char *end = nullptr;
+        opts.speed = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || opts.speed < 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      }
+      case 'n':
+        opts.setup = false;
+        break;
+      case 'j':
+        opts.json = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  string trace = argv[optind];
+  string dir = argv[optind + 1];
+  while (dir.length() > 1 && dir[dir.length() - 1] == '/') {
+    dir.erase(dir.length() - 1);
+  }
+
+  vector<OpTrace::Record> records;
+  if (!load(trace, &records)) {
+    return 1;
+  }
+  Tree tree(dir);
+  tree.learn(records);
+  if (opts.setup && !tree.setup()) {
+    return 1;
+  }
+
+  Replay replay(opts, &tree);
+  uint64_t start = nowNs();
+  replay.run(records);
+  double seconds = (nowNs() - start) / 1e9;
+  report(opts, records, replay.outcomes(), seconds);
+  return 0;
+}
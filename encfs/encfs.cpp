@@ -17,6 +17,8 @@
 
 #include "encfs.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cinttypes>
 #include <cstddef>
@@ -25,6 +27,7 @@
 #include <cstring>
 #include <ctime>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <limits>
 #include <memory>
 #include <sys/stat.h>
@@ -32,9 +35,6 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <utime.h>
-#ifdef __linux__
-#include <sys/fsuid.h>
-#endif
 
 #if defined(HAVE_SYS_XATTR_H)
 #include <sys/xattr.h>
@@ -47,11 +47,25 @@
 #include <string>
 #include <vector>
 
+#include "AsCaller.h"
 #include "Context.h"
+#include "DigestCache.h"
+#include "DirFdCache.h"
+#include "DirIndex.h"
+#include "DirListCache.h"
 #include "DirNode.h"
 #include "Error.h"
+#include "FSConfig.h"
 #include "FileNode.h"
 #include "FileUtils.h"
+#include "IoScheduler.h"
+#include "Mutex.h"
+#include "Numa.h"
+#include "OpStats.h"
+#include "StatsServer.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "XattrCache.h"
 #include "fuse.h"
 
 #define ESUCCESS 0
@@ -63,10 +77,66 @@ namespace encfs {
 
 #define GET_FN(ctx, finfo) (ctx)->getNode((void *)(uintptr_t)(finfo)->fh)
 
+// set by a frontend that serves requests without a fuse context
+static thread_local const RequestCaller *requestCaller = nullptr;
+
+void setRequestCaller(const RequestCaller *caller) { requestCaller = caller; }
+
 static EncFS_Context *context() {
+  if (requestCaller != nullptr) {
+    return requestCaller->ctx;
+  }
   return (EncFS_Context *)fuse_get_context()->private_data;
 }
 
+string requestCipherPath(const char *path) {
+  EncFS_Context *ctx = context();
+  if (ctx == nullptr) {
+    return string();
+  }
+  int res = 0;
+  std::shared_ptr<DirNode> root = ctx->getRoot(&res, true);
+  if (!root) {
+    return string();
+  }
+  try {
+    return root->cipherPathWithoutRoot(path);
+  } catch (encfs::Error &err) {
+    return string();
+  }
+}
+
+// the uid and gid of the process which made the request
+static void callerIds(uid_t *uid, gid_t *gid) {
+  if (requestCaller != nullptr) {
+    *uid = requestCaller->uid;
+    *gid = requestCaller->gid;
+    return;
+  }
+  fuse_context *fctx = fuse_get_context();
+  *uid = fctx->uid;
+  *gid = fctx->gid;
+}
+
+// the uid reads and writes are scheduled by, see IoScheduler
+static uid_t callerUid() {
+  uid_t uid;
+  gid_t gid;
+  callerIds(&uid, &gid);
+  return uid;
+}
+
+// with --numa-pin, keeps a thread moving data on the node it first did so
+// on, next to the buffers and cipher contexts it made there.  Shards are
+// pinned to a core already.
+static void pinToNode(EncFS_Context *ctx) {
+  static thread_local bool pinned = false;
+  if (!pinned && ctx->opts->numaPin && ctx->opts->shards == 0) {
+    pinned = true;
+    Numa::pinThread();
+  }
+}
+
 /**
  * Helper function - determine if the filesystem is read-only
  * Optionally takes a pointer to the EncFS_Context, will get it from FUSE
@@ -74,28 +144,24 @@ static EncFS_Context *context() {
  */
 static bool isReadOnly(EncFS_Context *ctx) { return ctx->opts->readOnly; }
 
-// helper function -- apply a functor to a cipher path, given the plain path
-static int withCipherPath(
-    const char *opName, const char *path,
-    const function<int(EncFS_Context *, const string &)> &op,
-    bool passReturnCode = false) {
-  EncFS_Context *ctx = context();
-
+// helper function -- apply a functor to a cipher path, given the plain path.
+// The ops are templates rather than std::function so that the functor is
+// called directly, and take the root the op was started with, which keeps
+// it alive, by reference.
+template <typename Op>
+static int withCipherPath(const char *opName, EncFS_Context *ctx,
+                          DirNode &root, const char *path, const Op &op,
+                          bool passReturnCode = false) {
   int res = -EIO;
-  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
-  if (!FSRoot) {
-    return res;
-  }
-
   try {
-    string cyName = FSRoot->cipherPath(path);
-    VLOG(1) << "op: " << opName << " : " << cyName;
+    string cyName = root.cipherPath(path);
+    HOT_VLOG(1) << "op: " << opName << " : " << cyName;
 
     res = op(ctx, cyName);
 
     if (res == -1) {
       int eno = errno;
-      VLOG(1) << "op: " << opName << " error: " << strerror(eno);
+      HOT_VLOG(1) << "op: " << opName << " error: " << strerror(eno);
       res = -eno;
     } else if (!passReturnCode) {
       res = ESUCCESS;
@@ -107,6 +173,31 @@ static int withCipherPath(
   return res;
 }
 
+template <typename Op>
+static int withCipherPath(const char *opName, const char *path, const Op &op,
+                          bool passReturnCode = false) {
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return res;
+  }
+  return withCipherPath(opName, ctx, *FSRoot, path, op, passReturnCode);
+}
+
+// changes made through the name are not seen by an open node of the file
+static void invalidateAttr(EncFS_Context *ctx, const char *path) {
+  std::shared_ptr<FileNode> fnode = ctx->lookupNode(path);
+  if (fnode) {
+    fnode->invalidateAttr();
+  }
+  std::shared_ptr<DirNode> root = ctx->currentRoot();
+  if (root) {
+    root->forgetAttr(path);
+  }
+}
+
 static void checkCanary(const std::shared_ptr<FileNode> &fnode) {
   if (fnode->canary == CANARY_OK) {
     return;
@@ -129,32 +220,24 @@ static void checkCanary(const std::shared_ptr<FileNode> &fnode) {
 }
 
 // helper function -- apply a functor to a node
-static int withFileNode(const char *opName, const char *path,
-                        struct fuse_file_info *fi,
-                        const function<int(FileNode *)> &op) {
-  EncFS_Context *ctx = context();
-
+template <typename Op>
+static int withFileNode(const char *opName, EncFS_Context *ctx, DirNode &root,
+                        const char *path, struct fuse_file_info *fi,
+                        const Op &op) {
   int res = -EIO;
-  bool skipUsageCount = false;
-  if (strlen(path) == 1) {
-    skipUsageCount = true;
-  }
-  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res, skipUsageCount);
-  if (!FSRoot) {
-    return res;
-  }
-
   try {
 
-    auto do_op = [&FSRoot, opName, &op](std::shared_ptr<FileNode> fnode) {
+    auto do_op = [&root, opName,
+                  &op](const std::shared_ptr<FileNode> &fnode) -> int {
       rAssert(fnode != nullptr);
       checkCanary(fnode);
-      VLOG(1) << "op: " << opName << " : " << fnode->cipherName();
+      HOT_VLOG(1) << "op: " << opName << " : " << fnode->cipherName();
 
       // check that we're not recursing into the mount point itself
-      if (FSRoot->touchesMountpoint(fnode->cipherName())) {
-        VLOG(1) << "op: " << opName << " error: Tried to touch mountpoint: '"
-                << fnode->cipherName() << "'";
+      if (root.touchesMountpoint(fnode->cipherName().c_str())) {
+        HOT_VLOG(1) << "op: " << opName
+                    << " error: Tried to touch mountpoint: '"
+                    << fnode->cipherName() << "'";
         return -EIO;
       }
       return op(fnode.get());
@@ -175,7 +258,9 @@ static int withFileNode(const char *opName, const char *path,
       }
       res = do_op(node);
     } else {
-      res = do_op(FSRoot->lookupNode(path, opName));
+      // an open node holds the buffered writes and cached attributes
+      std::shared_ptr<FileNode> node = ctx->lookupNode(path);
+      res = do_op(node ? node : root.lookupNode(path, opName));
     }
 
     if (res < 0) {
@@ -188,6 +273,23 @@ static int withFileNode(const char *opName, const char *path,
   return res;
 }
 
+template <typename Op>
+static int withFileNode(const char *opName, const char *path,
+                        struct fuse_file_info *fi, const Op &op) {
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  bool skipUsageCount = false;
+  if (strlen(path) == 1) {
+    skipUsageCount = true;
+  }
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res, skipUsageCount);
+  if (!FSRoot) {
+    return res;
+  }
+  return withFileNode(opName, ctx, *FSRoot, path, fi, op);
+}
+
 /*
     The log messages below always print encrypted filenames, not
     plaintext.  This avoids possibly leaking information to log files.
@@ -197,58 +299,470 @@ static int withFileNode(const char *opName, const char *path,
     can be done here.
 */
 
-int _do_getattr(FileNode *fnode, struct stat *stbuf) {
+int _do_getattr(DirNode &root, FileNode *fnode, struct stat *stbuf) {
   int res = fnode->getAttr(stbuf);
   if (res == ESUCCESS && S_ISLNK(stbuf->st_mode)) {
-    EncFS_Context *ctx = context();
-    std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
-    if (FSRoot) {
-      // determine plaintext link size..  Easiest to read and decrypt..
-      std::vector<char> buf(stbuf->st_size + 1, '\0');
+    // determine plaintext link size..  Easiest to read and decrypt..
+    string target;
+    res = root.readLink(AT_FDCWD, fnode->cipherName().c_str(), *stbuf,
+                        &target);
+    if (res == ESUCCESS) {
+      stbuf->st_size = target.length();
+    }
+  }
 
-      res = ::readlink(fnode->cipherName(), buf.data(), stbuf->st_size);
-      if (res >= 0) {
-        // other functions expect c-strings to be null-terminated, which
-        // readlink doesn't provide
-        buf[res] = '\0';
+  return res;
+}
 
-        stbuf->st_size = FSRoot->plainPath(buf.data()).length();
+// the attributes of path, which has no file handle at hand
+static int pathAttr(EncFS_Context *ctx, DirNode &root, const char *path,
+                    struct stat *stbuf) {
+  // lookups of missing names are answered without encoding them again
+  uint64_t generation = 0;
+  if (root.knownMissing(path, &generation)) {
+    return -ENOENT;
+  }
 
-        res = ESUCCESS;
-      } else {
-        res = -errno;
-      }
+  int res;
+  if (ctx->lookupNode(path)) {
+    res = withFileNode("getattr", ctx, root, path, nullptr,
+                       [&root, stbuf](FileNode *fnode) {
+                         return _do_getattr(root, fnode, stbuf);
+                       });
+  } else {
+    // a closed file needs no FileNode, only its backing file's stat
+    try {
+      res = root.closedAttr(path, stbuf);
+    } catch (encfs::Error &err) {
+      RLOG(ERROR) << "error caught in getattr: " << err.what();
+      res = -EIO;
     }
   }
-
+  if (res == -ENOENT) {
+    root.noteMissing(path, generation);
+  }
   return res;
 }
 
 int encfs_getattr(const char *path, struct stat *stbuf) {
-  return withFileNode("getattr", path, nullptr, bind(_do_getattr, _1, stbuf));
+  StatTimer timer(OpStats::Getattr);
+  timer.trace(path);
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res, strlen(path) == 1);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+  return timer.status(pathAttr(ctx, *FSRoot, path, stbuf));
 }
 
 int encfs_fgetattr(const char *path, struct stat *stbuf,
                    struct fuse_file_info *fi) {
-  return withFileNode("fgetattr", path, fi, bind(_do_getattr, _1, stbuf));
+  StatTimer timer(OpStats::Fgetattr);
+  timer.trace(path);
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res, strlen(path) == 1);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  DirNode &root = *FSRoot;
+  if (fi == nullptr || fi->fh == 0) {
+    return timer.status(pathAttr(ctx, root, path, stbuf));
+  }
+  res = withFileNode("fgetattr", ctx, root, path, fi,
+                     [&root, stbuf](FileNode *fnode) {
+                       return _do_getattr(root, fnode, stbuf);
+                     });
+  return timer.status(res);
+}
+
+// room for a NAME_MAX name, even encoded in reverse mode
+static const int MaxNameLength = 1024;
+
+#if defined(fuse_fill_dir_flags)
+// readdirplus: the attributes handed to the filler reach the kernel
+static const bool FillerTakesAttrs = true;
+#else
+static const bool FillerTakesAttrs = false;
+#endif
+
+// names a stat-ahead job stats, and jobs queued at most
+static const size_t StatAheadBatch = 32;
+static const int MaxStatAheadJobs = 64;
+
+static std::atomic<int> statAheadJobs(0);
+
+static void closeDir(int *fd) {
+  ::close(*fd);
+  delete fd;
+}
+
+/*
+ * Without readdirplus the kernel follows a listing with a getattr of each
+ * name it shows (ls -l, du, rsync), one after the other.  The names a
+ * readdir lists are stat'ed ahead instead, a batch per job of the
+ * stat-ahead pool, into the attribute cache, where those getattrs find
+ * them.  Batches are dropped while the pool is behind.
+ */
+class StatAhead {
+ public:
+  explicit StatAhead(const std::shared_ptr<DirNode> &root) : _dirFd(-1) {
+    if (!FillerTakesAttrs && requestCaller == nullptr) {
+      _pool = root->config()->statAheadPool;
+    }
+    if (_pool) {
+      _root = root;
+    }
+  }
+
+  bool enabled() const { return (bool)_pool; }
+
+  // stats plainPath, named cipherName in the backing directory dirFd
+  void add(int dirFd, const string &cipherName, const string &plainPath) {
+    if (!_pool || dirFd < 0 || cipherName.empty()) {
+      return;
+    }
+    if (dirFd != _dirFd) {
+      flush();
+      _dirFd = dirFd;
+    }
+    _batch.emplace_back(cipherName, plainPath);
+    if (_batch.size() >= StatAheadBatch) {
+      flush();
+    }
+  }
+
+  // queues the batch, while its directory's descriptor is open.  One not
+  // flushed is dropped.
+  void flush() {
+    if (_batch.empty()) {
+      return;
+    }
+    std::vector<std::pair<string, string>> batch;
+    batch.swap(_batch);
+    if (statAheadJobs.load() >= MaxStatAheadJobs) {
+      return;
+    }
+    // the handle's descriptor closes with it, the job's with the job
+    int fd = ::dup(_dirFd);
+    if (fd < 0) {
+      return;
+    }
+    std::shared_ptr<int> dir(new int(fd), closeDir);
+
+    ++statAheadJobs;
+    std::shared_ptr<DirNode> root = _root;
+    _pool->submit(
+        [root, dir, batch]() {
+          for (const auto &entry : batch) {
+            try {
+              root->cacheAttr(*dir, entry.first.c_str(), entry.second.c_str());
+            } catch (encfs::Error &err) {
+              VLOG(1) << "stat-ahead: " << err.what();
+            }
+          }
+          --statAheadJobs;
+        },
+        ThreadPool::Background);
+  }
+
+ private:
+  std::shared_ptr<DirNode> _root;
+  std::shared_ptr<ThreadPool> _pool;  // null if not stat'ing ahead
+  int _dirFd;                         // of the batch, not ours
+  std::vector<std::pair<string, string>> _batch;
+
+  StatAhead(const StatAhead &);             // not allowed
+  StatAhead &operator=(const StatAhead &);  // not allowed
+};
+
+/*
+ * Hand an entry of the directory dirPath to the filler, with the attributes
+ * getattr would report for it, so that the kernel need not ask for them one
+ * by one.  If they can't be had, or the filler would drop them, only the
+ * type and inode are filled in and the kernel asks as before.
+ */
+static int fillDirEntry(DirNode *FSRoot, StatAhead *ahead, int dirFd,
+                        const char *dirPath, void *buf, fuse_fill_dir_t filler,
+                        const char *name, const string &cipherName,
+                        uint64_t iv, ino_t inode, int fileType,
+                        off_t nextOffset) {
+  if (!cipherName.empty()) {
+    FSRoot->nameListed(dirPath, name, cipherName, iv);
+  }
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  bool haveAttr = false;
+
+  bool wantAttr = FillerTakesAttrs &&
+                  (requestCaller == nullptr || requestCaller->entryAttrs);
+  if ((wantAttr || ahead->enabled()) && dirFd >= 0 && !cipherName.empty()) {
+    string plainPath = dirPath;
+    if (plainPath.empty() || plainPath[plainPath.length() - 1] != '/') {
+      plainPath += '/';
+    }
+    plainPath += name;
+    if (wantAttr) {
+      int res;
+      if (!FSRoot->indexedAttr(plainPath.c_str(), &st, &res)) {
+        res = FSRoot->entryAttr(dirFd, cipherName.c_str(), plainPath.c_str(),
+                                &st);
+      }
+      haveAttr = res == ESUCCESS;
+    } else {
+      ahead->add(dirFd, cipherName, plainPath);
+    }
+  }
+  if (!haveAttr) {
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inode;
+    st.st_mode = fileType << 12;
+  }
+
+#if defined(fuse_fill_dir_flags)
+  return filler(buf, name, &st, nextOffset,
+                haveAttr ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags)0);
+#else
+  return filler(buf, name, &st, nextOffset);
+#endif
+}
+
+static bool sameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/*
+ * An open directory: the names decoded so far, in directory order, so that
+ * a readdir continues at its offset rather than decoding the directory
+ * again.  A rewind reuses them while the backing directory has the mtime
+ * and ctime it had when they were read.  Once read to the end they go in
+ * the DirListCache, from which the next handle of the directory starts.
+ */
+struct DirHandle {
+  using Entry = DirListCache::Entry;
+
+  pthread_mutex_t mutex;
+  DirTraverse dt;
+  bool complete;
+  vector<Entry> entries;
+  struct timespec mtime;
+  struct timespec ctime;
+  struct stat listed;  // of the directory as the names were first read
+  time_t listedAt;
+
+  explicit DirHandle(const DirTraverse &dt_) : dt(dt_), complete(false) {
+    pthread_mutex_init(&mutex, nullptr);
+  }
+
+  ~DirHandle() {
+    clear();
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void setTimes(const struct stat &st) {
+    listed = st;
+    listedAt = time(nullptr);
+#if defined(__APPLE__)
+    mtime = st.st_mtimespec;
+    ctime = st.st_ctimespec;
+#else
+    mtime = st.st_mtim;
+    ctime = st.st_ctim;
+#endif
+  }
+
+  bool changedSince(const struct stat &st) const {
+#if defined(__APPLE__)
+    return !sameTime(mtime, st.st_mtimespec) || !sameTime(ctime, st.st_ctimespec);
+#else
+    return !sameTime(mtime, st.st_mtim) || !sameTime(ctime, st.st_ctim);
+#endif
+  }
+
+  void clear() {
+    // the names are plaintext
+    for (Entry &entry : entries) {
+      entry.name.assign(entry.name.size(), ' ');
+    }
+    entries.clear();
+    complete = false;
+  }
+
+ private:
+  DirHandle(const DirHandle &);             // not allowed
+  DirHandle &operator=(const DirHandle &);  // not allowed
+};
+
+int encfs_opendir(const char *path, struct fuse_file_info *finfo) {
+  StatTimer timer(OpStats::Opendir);
+  timer.trace(path);
+  EncFS_Context *ctx = context();
+
+  int res = ESUCCESS;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  try {
+    string cyName = FSRoot->cipherPath(path);
+    struct stat st;
+    if (::stat(cyName.c_str(), &st) != 0) {
+      return timer.status(-errno);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      return timer.status(-ENOTDIR);
+    }
+
+    DirTraverse dt = FSRoot->openDir(path);
+    if (!dt.valid()) {
+      VLOG(1) << "opendir request invalid, path: '" << path << "'";
+      return timer.status(-EACCES);
+    }
+
+    auto *dh = new DirHandle(dt);
+    dh->setTimes(st);
+    const std::shared_ptr<DirListCache> &cache =
+        FSRoot->config()->dirListCache;
+    std::shared_ptr<const DirListCache::Listing> listing;
+    if (cache) {
+      listing = cache->get(st);
+    }
+    if (listing) {
+      dh->entries = listing->entries;
+      dh->complete = true;
+    } else if (FSRoot->config()->dirIndex &&
+               FSRoot->config()->dirIndex->listing(cyName, st,
+                                                   &dh->entries)) {
+      dh->complete = true;
+    }
+    finfo->fh = (uint64_t)(uintptr_t)dh;
+    VLOG(1) << "opendir on " << cyName;
+    return timer.status(ESUCCESS);
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in opendir: " << err.what();
+    return timer.status(-EIO);
+  }
+}
+
+int encfs_releasedir(const char *path, struct fuse_file_info *finfo) {
+  StatTimer timer(OpStats::Releasedir);
+  timer.trace(path);
+  (void)path;
+  delete (DirHandle *)(uintptr_t)finfo->fh;
+  finfo->fh = 0;
+  return timer.status(ESUCCESS);
+}
+
+// puts the names of dh, read to the end, in the DirListCache and the
+// DirIndex, unless the directory changed while they were read
+static void keepListing(DirNode *FSRoot, DirHandle *dh, const char *path) {
+  const std::shared_ptr<DirListCache> &cache = FSRoot->config()->dirListCache;
+  const std::shared_ptr<DirIndex> &index = FSRoot->config()->dirIndex;
+  if ((!cache && !index) || !dh->dt.valid()) {
+    return;
+  }
+  struct stat st;
+  if (::fstat(dh->dt.dirFd(), &st) != 0 || dh->changedSince(st)) {
+    return;
+  }
+  if (index) {
+    index->listed(FSRoot->cipherPath(path), dh->listed, dh->listedAt,
+                  dh->entries);
+  }
+  if (cache) {
+    cache->add(dh->listed, dh->listedAt, dh->entries);
+  }
+}
+
+static int readdirHandle(DirNode *FSRoot, StatAhead *ahead, DirHandle *dh,
+                         const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset) {
+  if (offset < 0) {
+    return -EINVAL;
+  }
+
+  Lock lock(dh->mutex);
+
+  if (offset == 0 && !dh->entries.empty()) {
+    // a rewind: start over if the directory has changed since
+    struct stat st;
+    string cyName = FSRoot->cipherPath(path);
+    if (::stat(cyName.c_str(), &st) != 0) {
+      return -errno;
+    }
+    if (dh->changedSince(st)) {
+      VLOG(1) << "readdir: relisting " << cyName;
+      dh->clear();
+      dh->dt = FSRoot->openDir(path);
+      dh->setTimes(st);
+    }
+  }
+
+  char name[MaxNameLength];
+  for (size_t index = (size_t)offset;; ++index) {
+    if (index >= dh->entries.size()) {
+      if (dh->complete || index > dh->entries.size()) {
+        break;
+      }
+      int fileType = 0;
+      ino_t inode = 0;
+      DirHandle::Entry entry;
+      int nameLen = dh->dt.valid()
+                        ? dh->dt.nextPlaintextName(name, sizeof(name),
+                                                   &fileType, &inode,
+                                                   &entry.cipherName,
+                                                   &entry.iv)
+                        : 0;
+      if (nameLen == 0) {
+        dh->complete = true;
+        keepListing(FSRoot, dh, path);
+        break;
+      }
+      entry.name.assign(name, nameLen);
+      entry.inode = inode;
+      entry.fileType = fileType;
+      dh->entries.push_back(std::move(entry));
+    }
+
+    // offsets are positions in the listing, counted from 1
+    const DirHandle::Entry &entry = dh->entries[index];
+    if (fillDirEntry(FSRoot, ahead, dh->dt.dirFd(), path, buf, filler,
+                     entry.name.c_str(), entry.cipherName, entry.iv,
+                     entry.inode, entry.fileType, (off_t)index + 1) != 0) {
+      break;
+    }
+  }
+  // while the handle's descriptor is still the one of the entries
+  ahead->flush();
+  return ESUCCESS;
 }
 
 int encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                   off_t offset, struct fuse_file_info *finfo) {
+  StatTimer timer(OpStats::Readdir);
+  timer.trace(path, offset);
   EncFS_Context *ctx = context();
 
-  //unused parameters
-  (void)offset;
-  (void)finfo;
-
   int res = ESUCCESS;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
+    StatAhead ahead(FSRoot);
+    if (finfo != nullptr && finfo->fh != 0) {
+      return timer.status(readdirHandle(FSRoot.get(), &ahead,
+                                        (DirHandle *)(uintptr_t)finfo->fh,
+                                        path, buf, filler, offset));
+    }
 
+    // no handle: list the whole directory in one go
     DirTraverse dt = FSRoot->openDir(path);
 
     VLOG(1) << "readdir on " << FSRoot->cipherPath(path);
@@ -256,46 +770,45 @@ int encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     if (dt.valid()) {
       int fileType = 0;
       ino_t inode = 0;
-
-      std::string name = dt.nextPlaintextName(&fileType, &inode);
-      while (!name.empty()) {
-        struct stat st;
-        st.st_ino = inode;
-        st.st_mode = fileType << 12;
-
-// TODO: add offset support.
-#if defined(fuse_fill_dir_flags)
-        if (filler(buf, name.c_str(), &st, 0, 0)) break;
-#else
-        if (filler(buf, name.c_str(), &st, 0) != 0) {
+      char name[MaxNameLength];
+      string cipherName;
+      uint64_t iv = 0;
+
+      int nameLen = dt.nextPlaintextName(name, sizeof(name), &fileType, &inode,
+                                         &cipherName, &iv);
+      while (nameLen > 0) {
+        if (fillDirEntry(FSRoot.get(), &ahead, dt.dirFd(), path, buf, filler,
+                         name, cipherName, iv, inode, fileType, 0) != 0) {
           break;
         }
-#endif
-
-        name = dt.nextPlaintextName(&fileType, &inode);
+        nameLen = dt.nextPlaintextName(name, sizeof(name), &fileType, &inode,
+                                       &cipherName, &iv);
       }
+      ahead.flush();
     } else {
       VLOG(1) << "readdir request invalid, path: '" << path << "'";
     }
 
-    return res;
+    return timer.status(res);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "Error caught in readdir";
-    return -EIO;
+    return timer.status(-EIO);
   }
 }
 
 int encfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+  StatTimer timer(OpStats::Mknod);
+  timer.trace(path, 0, mode);
   EncFS_Context *ctx = context();
 
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
@@ -307,121 +820,150 @@ int encfs_mknod(const char *path, mode_t mode, dev_t rdev) {
     uid_t uid = 0;
     gid_t gid = 0;
     if (ctx->publicFilesystem) {
-      fuse_context *context = fuse_get_context();
-      uid = context->uid;
-      gid = context->gid;
+      callerIds(&uid, &gid);
     }
+    DirIndex::Change indexChange;
+    FSRoot->beginNameChange(path, &indexChange);
     res = fnode->mknod(mode, rdev, uid, gid);
     // Is this error due to access problems?
     if (ctx->publicFilesystem && -res == EACCES) {
       // try again using the parent dir's group
       string parent = fnode->plaintextParent();
       VLOG(1) << "trying public filesystem workaround for " << parent;
-      std::shared_ptr<FileNode> dnode =
-          FSRoot->lookupNode(parent.c_str(), "mknod");
-
       struct stat st;
-      if (dnode->getAttr(&st) == 0) {
+      if (FSRoot->closedAttr(parent.c_str(), &st) == 0) {
         res = fnode->mknod(mode, rdev, uid, st.st_gid);
       }
     }
+    if (res == ESUCCESS) {
+      FSRoot->nameCreated(path);
+    }
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in mknod: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
 int encfs_mkdir(const char *path, mode_t mode) {
-  fuse_context *fctx = fuse_get_context();
+  StatTimer timer(OpStats::Mkdir);
+  timer.trace(path, 0, mode);
   EncFS_Context *ctx = context();
 
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
     uid_t uid = 0;
     gid_t gid = 0;
     if (ctx->publicFilesystem) {
-      uid = fctx->uid;
-      gid = fctx->gid;
+      callerIds(&uid, &gid);
     }
     res = FSRoot->mkdir(path, mode, uid, gid);
     // Is this error due to access problems?
     if (ctx->publicFilesystem && -res == EACCES) {
       // try again using the parent dir's group
       string parent = parentDirectory(path);
-      std::shared_ptr<FileNode> dnode =
-          FSRoot->lookupNode(parent.c_str(), "mkdir");
-
       struct stat st;
-      if (dnode->getAttr(&st) == 0) {
+      if (FSRoot->closedAttr(parent.c_str(), &st) == 0) {
         res = FSRoot->mkdir(path, mode, uid, st.st_gid);
       }
     }
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in mkdir: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
 int encfs_unlink(const char *path) {
+  StatTimer timer(OpStats::Unlink);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
     // let DirNode handle it atomically so that it can handle race
     // conditions
     res = FSRoot->unlink(path);
+    invalidateAttr(ctx, path);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in unlink: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
-int _do_rmdir(EncFS_Context *, const string &cipherPath) {
-  return rmdir(cipherPath.c_str());
+int _do_rmdir(EncFS_Context *ctx, const string &cipherPath) {
+  int res = rmdir(cipherPath.c_str());
+  if (res == -1 && (errno == ENOTEMPTY || errno == EEXIST)) {
+    // emptied through the mount, it may hold its name index still
+    int eno = errno;
+    std::shared_ptr<DirNode> root = ctx->currentRoot();
+    std::shared_ptr<DirIndex> index;
+    if (root) {
+      index = root->config()->dirIndex;
+    }
+    if (index && index->removeIfEmpty(cipherPath)) {
+      return rmdir(cipherPath.c_str());
+    }
+    errno = eno;
+  }
+  return res;
 }
 
 int encfs_rmdir(const char *path) {
+  StatTimer timer(OpStats::Rmdir);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
-  return withCipherPath("rmdir", path, bind(_do_rmdir, _1, _2));
-}
-
-int _do_readlink(EncFS_Context *ctx, const string &cyName, char *buf,
-                 size_t size) {
-  int res = ESUCCESS;
+  int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
-  res = ::readlink(cyName.c_str(), buf, size - 1);
+  DirIndex::Change indexChange;
+  FSRoot->beginNameChange(path, &indexChange);
+  res = withCipherPath("rmdir", ctx, *FSRoot, path, bind(_do_rmdir, _1, _2));
+  if (res == ESUCCESS) {
+    // the name is gone, drop what DirNode keeps about it
+    FSRoot->forgetPath(path);
+  }
+  return timer.status(res);
+}
 
-  if (res == -1) {
+int _do_readlink(DirNode &root, const string &cyName, char *buf,
+                 size_t size) {
+  DirFdCache::Ref at =
+      DirFdCache::at(root.config()->dirFdCache, cyName.c_str());
+  struct stat stbuf;
+  if (::fstatat(at.fd(), at.name(), &stbuf, AT_SYMLINK_NOFOLLOW) != 0) {
     return -errno;
   }
+  if (!S_ISLNK(stbuf.st_mode)) {
+    return -EINVAL;
+  }
 
-  buf[res] = '\0';  // ensure null termination
   string decodedName;
-  decodedName = FSRoot->plainPath(buf);
+  int res = root.readLink(at.fd(), at.name(), stbuf, &decodedName);
+  if (res != ESUCCESS) {
+    return res;
+  }
 
   if (!decodedName.empty()) {
     strncpy(buf, decodedName.c_str(), size - 1);
@@ -434,24 +976,41 @@ int _do_readlink(EncFS_Context *ctx, const string &cyName, char *buf,
 }
 
 int encfs_readlink(const char *path, char *buf, size_t size) {
-  return withCipherPath("readlink", path,
-                        bind(_do_readlink, _1, _2, buf, size));
+  StatTimer timer(OpStats::Readlink);
+  timer.trace(path);
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  DirNode &root = *FSRoot;
+  res = withCipherPath("readlink", ctx, root, path,
+                       [&root, buf, size](EncFS_Context *,
+                                          const string &cyName) {
+                         return _do_readlink(root, cyName, buf, size);
+                       });
+  return timer.status(res);
 }
 
 /**
  * Create a symbolic link pointing to "to" named "from"
  */
 int encfs_symlink(const char *to, const char *from) {
+  StatTimer timer(OpStats::Symlink);
+  timer.trace(from);
   EncFS_Context *ctx = context();
 
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
@@ -461,84 +1020,74 @@ int encfs_symlink(const char *to, const char *from) {
 
     VLOG(1) << "symlink " << fromCName << " -> " << toCName;
 
-    // use setfsuid / setfsgid so that the new link will be owned by the
-    // uid/gid provided by the fuse_context.
-    int olduid = -1;
-    int oldgid = -1;
+    // the new link is owned by the uid/gid provided by the fuse_context
+    uid_t uid = 0;
+    gid_t gid = 0;
     if (ctx->publicFilesystem) {
-      fuse_context *context = fuse_get_context();
-      oldgid = setfsgid(context->gid);
-      if (oldgid == -1) {
-        int eno = errno;
-        RLOG(DEBUG) << "setfsgid error: " << strerror(eno);
-        return -EPERM;
-      }
-      olduid = setfsuid(context->uid);
-      if (olduid == -1) {
-        int eno = errno;
-        RLOG(DEBUG) << "setfsuid error: " << strerror(eno);
-        return -EPERM;
-      }
+      callerIds(&uid, &gid);
     }
+    AsCaller caller(uid, gid, S_IFLNK | 0777, ctx->opts->defaultPermissions);
+    DirIndex::Change indexChange;
+    FSRoot->beginNameChange(from, &indexChange);
     res = ::symlink(toCName.c_str(), fromCName.c_str());
-    if (olduid >= 0) {
-      if(setfsuid(olduid) == -1) {
-        int eno = errno;
-        RLOG(DEBUG) << "setfsuid back error: " << strerror(eno);
-        // does not return error here as initial setfsuid worked
-      }
-    }
-    if (oldgid >= 0) {
-      if(setfsgid(oldgid) == -1) {
-        int eno = errno;
-        RLOG(DEBUG) << "setfsgid back error: " << strerror(eno);
-        // does not return error here as initial setfsgid worked
+    if (res == 0) {
+      res = caller.own(AT_FDCWD, fromCName.c_str(), -1);
+      if (res < 0) {
+        return timer.status(res);
       }
     }
 
     if (res == -1) {
       res = -errno;
     } else {
+      FSRoot->nameCreated(from);
       res = ESUCCESS;
     }
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in symlink: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
 int encfs_link(const char *to, const char *from) {
+  StatTimer timer(OpStats::Link);
+  timer.trace(to, 0, 0, from);
   EncFS_Context *ctx = context();
 
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
     res = FSRoot->link(to, from);
+    // the link count changed
+    invalidateAttr(ctx, to);
+    invalidateAttr(ctx, from);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in link: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
 int encfs_rename(const char *from, const char *to) {
+  StatTimer timer(OpStats::Rename);
+  timer.trace(from, 0, 0, to);
   EncFS_Context *ctx = context();
 
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
@@ -546,70 +1095,162 @@ int encfs_rename(const char *from, const char *to) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in rename: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
-int _do_chmod(EncFS_Context *, const string &cipherPath, mode_t mode) {
-  return chmod(cipherPath.c_str(), mode);
+// the metadata ops are made on the name of the file in its directory's
+// cached descriptor, so that a `chown -R` or a `tar x` restoring times
+// does not have the kernel walk the whole path of every file again
+int _do_chmod(DirNode &root, const string &cipherPath, mode_t mode) {
+  DirFdCache::Ref at =
+      DirFdCache::at(root.config()->dirFdCache, cipherPath.c_str());
+  return ::fchmodat(at.fd(), at.name(), mode, 0);
 }
 
 int encfs_chmod(const char *path, mode_t mode) {
+  StatTimer timer(OpStats::Chmod);
+  timer.trace(path, 0, mode);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
+  }
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
   }
-  return withCipherPath("chmod", path, bind(_do_chmod, _1, _2, mode));
+
+  DirNode &root = *FSRoot;
+  res = withCipherPath("chmod", ctx, root, path,
+                       [&root, mode](EncFS_Context *, const string &cyName) {
+                         return _do_chmod(root, cyName, mode);
+                       });
+  invalidateAttr(ctx, path);
+  return timer.status(res);
 }
 
-int _do_chown(EncFS_Context *, const string &cyName, uid_t u, gid_t g) {
-  int res = lchown(cyName.c_str(), u, g);
+int _do_chown(DirNode &root, const string &cyName, uid_t u, gid_t g) {
+  DirFdCache::Ref at =
+      DirFdCache::at(root.config()->dirFdCache, cyName.c_str());
+  int res = ::fchownat(at.fd(), at.name(), u, g, AT_SYMLINK_NOFOLLOW);
   return (res == -1) ? -errno : ESUCCESS;
 }
 
 int encfs_chown(const char *path, uid_t uid, gid_t gid) {
+  StatTimer timer(OpStats::Chown);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
+  }
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
   }
-  return withCipherPath("chown", path, bind(_do_chown, _1, _2, uid, gid));
+
+  DirNode &root = *FSRoot;
+  res = withCipherPath(
+      "chown", ctx, root, path,
+      [&root, uid, gid](EncFS_Context *, const string &cyName) {
+        return _do_chown(root, cyName, uid, gid);
+      });
+  invalidateAttr(ctx, path);
+  return timer.status(res);
 }
 
 int _do_truncate(FileNode *fnode, off_t size) { return fnode->truncate(size); }
 
 int encfs_truncate(const char *path, off_t size) {
+  StatTimer timer(OpStats::Truncate);
+  timer.trace(path, size);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
-  return withFileNode("truncate", path, nullptr, bind(_do_truncate, _1, size));
+  return timer.status(
+      withFileNode("truncate", path, nullptr, bind(_do_truncate, _1, size)));
 }
 
 int encfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  StatTimer timer(OpStats::Ftruncate);
+  timer.trace(path, size);
+  EncFS_Context *ctx = context();
+  if (isReadOnly(ctx)) {
+    return timer.status(-EROFS);
+  }
+  return timer.status(
+      withFileNode("ftruncate", path, fi, bind(_do_truncate, _1, size)));
+}
+
+#if FUSE_VERSION >= 29
+int _do_fallocate(FileNode *fnode, int mode, off_t offset, off_t len) {
+  return fnode->allocate(mode, offset, len);
+}
+
+int encfs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                    struct fuse_file_info *fi) {
+  StatTimer timer(OpStats::Fallocate);
+  timer.trace(path, offset, len);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
-  return withFileNode("ftruncate", path, fi, bind(_do_truncate, _1, size));
+  int res = withFileNode("fallocate", path, fi,
+                         bind(_do_fallocate, _1, mode, offset, len));
+  return timer.status(res);
 }
+#endif
 
-int _do_utime(EncFS_Context *, const string &cyName, struct utimbuf *buf) {
+int _do_utime(DirNode &root, const string &cyName, struct utimbuf *buf) {
+#ifdef HAVE_UTIMENSAT
+  DirFdCache::Ref at =
+      DirFdCache::at(root.config()->dirFdCache, cyName.c_str());
+  struct timespec ts[2];
+  if (buf != nullptr) {
+    ts[0].tv_sec = buf->actime;
+    ts[0].tv_nsec = 0;
+    ts[1].tv_sec = buf->modtime;
+    ts[1].tv_nsec = 0;
+  }
+  int res = utimensat(at.fd(), at.name(), buf != nullptr ? ts : nullptr, 0);
+#else
+  (void)root;
   int res = utime(cyName.c_str(), buf);
+#endif
   return (res == -1) ? -errno : ESUCCESS;
 }
 
 int encfs_utime(const char *path, struct utimbuf *buf) {
+  StatTimer timer(OpStats::Utime);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
-  return withCipherPath("utime", path, bind(_do_utime, _1, _2, buf));
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  DirNode &root = *FSRoot;
+  res = withCipherPath("utime", ctx, root, path,
+                       [&root, buf](EncFS_Context *, const string &cyName) {
+                         return _do_utime(root, cyName, buf);
+                       });
+  invalidateAttr(ctx, path);
+  return timer.status(res);
 }
 
-int _do_utimens(EncFS_Context *, const string &cyName,
+int _do_utimens(DirNode &root, const string &cyName,
                 const struct timespec ts[2]) {
 #ifdef HAVE_UTIMENSAT
-  int res = utimensat(AT_FDCWD, cyName.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+  DirFdCache::Ref at =
+      DirFdCache::at(root.config()->dirFdCache, cyName.c_str());
+  int res = utimensat(at.fd(), at.name(), ts, AT_SYMLINK_NOFOLLOW);
 #else
+  (void)root;
   struct timeval tv[2];
   tv[0].tv_sec = ts[0].tv_sec;
   tv[0].tv_usec = ts[0].tv_nsec / 1000;
@@ -622,25 +1263,67 @@ int _do_utimens(EncFS_Context *, const string &cyName,
 }
 
 int encfs_utimens(const char *path, const struct timespec ts[2]) {
+  StatTimer timer(OpStats::Utimens);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
+  }
+  // write out what an open file holds back, so that it does not change
+  // the times again later
+  std::shared_ptr<FileNode> fnode = ctx->lookupNode(path);
+  if (fnode) {
+    int res = fnode->flush();
+    if (res < 0) {
+      return timer.status(res);
+    }
+  }
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  DirNode &root = *FSRoot;
+  res = withCipherPath("utimens", ctx, root, path,
+                       [&root, ts](EncFS_Context *, const string &cyName) {
+                         return _do_utimens(root, cyName, ts);
+                       });
+  invalidateAttr(ctx, path);
+  return timer.status(res);
+}
+
+/*
+ * True if the file at path is to be read and written past the kernel's
+ * page cache (direct_io), see --uncached and --uncached-over: streaming a
+ * large file then goes through our block cache and read-ahead and does
+ * not push everything else out of the page cache.
+ */
+static bool uncached(EncFS_Context *ctx, const char *path,
+                     const std::shared_ptr<FileNode> &fnode) {
+  const EncFS_Opts &opts = *ctx->opts;
+  for (const std::string &pattern : opts.uncachedPatterns) {
+    if (fnmatch(pattern.c_str(), path, 0) == 0) {
+      return true;
+    }
   }
-  return withCipherPath("utimens", path, bind(_do_utimens, _1, _2, ts));
+  return opts.uncachedBytes > 0 && fnode->getSize() >= opts.uncachedBytes;
 }
 
 int encfs_open(const char *path, struct fuse_file_info *file) {
+  StatTimer timer(OpStats::Open);
+  timer.trace(path);
   EncFS_Context *ctx = context();
 
   if (isReadOnly(ctx) &&
       (((file->flags & O_WRONLY) != 0) || ((file->flags & O_RDWR) != 0))) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
   int res = -EIO;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) {
-    return res;
+    return timer.status(res);
   }
 
   try {
@@ -654,6 +1337,9 @@ int encfs_open(const char *path, struct fuse_file_info *file) {
       if (res >= 0) {
         ctx->putNode(path, fnode);
         file->fh = fnode->fuseFh;
+        if (uncached(ctx, path, fnode)) {
+          file->direct_io = 1;
+        }
         res = ESUCCESS;
       }
     }
@@ -661,16 +1347,70 @@ int encfs_open(const char *path, struct fuse_file_info *file) {
     RLOG(ERROR) << "error caught in open: " << err.what();
   }
 
-  return res;
+  return timer.status(res);
 }
 
 int encfs_create(const char *path, mode_t mode, struct fuse_file_info *file) {
-  int res = encfs_mknod(path, mode, 0);
-  if (res != 0) {
-    return res;
+  StatTimer timer(OpStats::Create);
+  timer.trace(path, 0, mode);
+  EncFS_Context *ctx = context();
+
+  if (isReadOnly(ctx)) {
+    return timer.status(-EROFS);
+  }
+  if (!S_ISREG(mode)) {
+    // not made by open(), mknod and open them as before
+    int res = encfs_mknod(path, mode, 0);
+    if (res != 0) {
+      return timer.status(res);
+    }
+    return timer.status(encfs_open(path, file));
   }
 
-  return encfs_open(path, file);
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  try {
+    uid_t uid = 0;
+    gid_t gid = 0;
+    if (ctx->publicFilesystem) {
+      callerIds(&uid, &gid);
+    }
+    DirIndex::Change indexChange;
+    FSRoot->beginNameChange(path, &indexChange);
+    // one open() creates the backing file and is kept for its I/O
+    std::shared_ptr<FileNode> fnode =
+        FSRoot->createNode(path, file->flags, mode, uid, gid, &res);
+    // Is this error due to access problems?
+    if (!fnode && ctx->publicFilesystem && -res == EACCES) {
+      // try again using the parent dir's group
+      string parent = parentDirectory(path);
+      VLOG(1) << "trying public filesystem workaround for " << parent;
+      struct stat st;
+      if (FSRoot->closedAttr(parent.c_str(), &st) == 0) {
+        fnode = FSRoot->createNode(path, file->flags, mode, uid, st.st_gid,
+                                   &res);
+      }
+    }
+
+    if (fnode) {
+      VLOG(1) << "encfs_create for " << fnode->cipherName() << ", flags "
+              << file->flags;
+      FSRoot->nameCreated(path);
+      ctx->putNode(path, fnode);
+      file->fh = fnode->fuseFh;
+      if (uncached(ctx, path, fnode)) {
+        file->direct_io = 1;
+      }
+      res = ESUCCESS;
+    }
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in create: " << err.what();
+  }
+  return timer.status(res);
 }
 
 int _do_flush(FileNode *fnode) {
@@ -678,7 +1418,12 @@ int _do_flush(FileNode *fnode) {
      close the file.  However it is important to call close() for some
      underlying filesystems (like NFS).
   */
-  int res = fnode->open(O_RDONLY);
+  int res = fnode->flush();
+  if (res < 0) {
+    return res;
+  }
+
+  res = fnode->open(O_RDONLY);
   if (res >= 0) {
     int fh = res;
     int nfh = dup(fh);
@@ -696,24 +1441,30 @@ int _do_flush(FileNode *fnode) {
 
 // Called on each close() of a file descriptor
 int encfs_flush(const char *path, struct fuse_file_info *fi) {
-  return withFileNode("flush", path, fi, bind(_do_flush, _1));
+  StatTimer timer(OpStats::Flush);
+  timer.trace(path);
+  return timer.status(withFileNode("flush", path, fi, bind(_do_flush, _1)));
 }
 
 /*
-Note: This is advisory -- it might benefit us to keep file nodes around for a
-bit after they are released just in case they are reopened soon.  But that
-requires a cache layer.
+Note: This is advisory.  The node is kept for a bit after its last release,
+in case the file is opened again soon (see EncFS_Context::keepReleased).
  */
 int encfs_release(const char *path, struct fuse_file_info *finfo) {
+  StatTimer timer(OpStats::Release);
+  timer.trace(path);
   EncFS_Context *ctx = context();
 
   try {
     auto fnode = ctx->lookupFuseFh(finfo->fh);
     ctx->eraseNode(path, fnode);
-    return ESUCCESS;
+    if (fnode->canary == CANARY_RELEASED) {
+      ctx->keepReleased(path, fnode);
+    }
+    return timer.status(ESUCCESS);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in release: " << err.what();
-    return -EIO;
+    return timer.status(-EIO);
   }
 }
 
@@ -723,25 +1474,134 @@ ssize_t _do_read(FileNode *fnode, unsigned char *ptr, size_t size, off_t off) {
 
 int encfs_read(const char *path, char *buf, size_t size, off_t offset,
                struct fuse_file_info *file) {
+  StatTimer timer(OpStats::Read);
+  timer.trace(path, offset, size);
   // Unfortunately we have to convert from ssize_t (pread) to int (fuse), so
   // let's check this will be OK
   if (size > (size_t)std::numeric_limits<int>::max()) {
     size = std::numeric_limits<int>::max();
   }
-  return withFileNode("read", path, file,
-                      bind(_do_read, _1, (unsigned char *)buf, size, offset));
+  pinToNode(context());
+  IoScheduler::Turn turn(context()->ioScheduler.get(), callerUid(), size);
+  int res = withFileNode("read", path, file,
+                         bind(_do_read, _1, (unsigned char *)buf, size,
+                              offset));
+  return (int)timer.transferred(res);
+}
+
+#if FUSE_VERSION >= 29
+/*
+    Files that hold their plaintext as is (plainData, without MAC bytes) are
+    read and written by splicing between the kernel and the backing file,
+    so the data never passes through our buffers.  Everything else decodes
+    into, or encodes from, a buffer of ours as read / write do.
+*/
+int encfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                   off_t offset, struct fuse_file_info *file) {
+  StatTimer timer(OpStats::Read);
+  timer.trace(path, offset, size);
+  if (size > (size_t)std::numeric_limits<int>::max()) {
+    size = std::numeric_limits<int>::max();
+  }
+  pinToNode(context());
+  IoScheduler::Turn turn(context()->ioScheduler.get(), callerUid(), size);
+  auto op = [=, &timer](FileNode *fnode) {
+    auto *bv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+    if (bv == nullptr) {
+      return -ENOMEM;
+    }
+    *bv = FUSE_BUFVEC_INIT(size);
+
+    int fd = fnode->readThroughFd(offset, size);
+    if (fd >= 0) {
+      bv->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD |
+                                               FUSE_BUF_FD_SEEK);
+      bv->buf[0].fd = fd;
+      bv->buf[0].pos = offset;
+      *bufp = bv;
+      // at most, the splice stops at the end of the file
+      timer.addBytes(size);
+      return 0;
+    }
+
+    void *mem = malloc(size > 0 ? size : 1);
+    if (mem == nullptr) {
+      free(bv);
+      return -ENOMEM;
+    }
+    ssize_t res = fnode->read(offset, (unsigned char *)mem, size);
+    if (res < 0) {
+      free(mem);
+      free(bv);
+      return (int)res;
+    }
+    bv->buf[0].mem = mem;
+    bv->buf[0].size = res;
+    *bufp = bv;
+    timer.addBytes(res);
+    return 0;
+  };
+  return timer.status(withFileNode("read_buf", path, file, op));
+}
+
+int encfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                    struct fuse_file_info *file) {
+  StatTimer timer(OpStats::Write);
+  size_t size = fuse_buf_size(buf);
+  timer.trace(path, offset, size);
+  if (size > (size_t)std::numeric_limits<int>::max()) {
+    size = std::numeric_limits<int>::max();
+  }
+  EncFS_Context *ctx = context();
+  if (isReadOnly(ctx)) {
+    return timer.status(-EROFS);
+  }
+  pinToNode(ctx);
+  IoScheduler::Turn turn(ctx->ioScheduler.get(), callerUid(), size);
+  int res = withFileNode("write_buf", path, file, [=](FileNode *fnode) {
+    ssize_t res = fnode->writeThrough(offset, size, [=](int fd) {
+      struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+      dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD |
+                                               FUSE_BUF_FD_SEEK);
+      dst.buf[0].fd = fd;
+      dst.buf[0].pos = offset;
+      return fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags)0);
+    });
+    if (res != -ENOTSUP) {
+      return (int)res;
+    }
+
+    // one buffer in memory is coded where it is, as write does
+    if (buf->count == 1 && (buf->buf[0].flags & FUSE_BUF_IS_FD) == 0) {
+      return (int)fnode->write(offset, (unsigned char *)buf->buf[0].mem,
+                               size);
+    }
+    PoolBlock data(size);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = data.data();
+    res = fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags)0);
+    if (res < 0) {
+      return (int)res;
+    }
+    return (int)fnode->write(offset, data.data(), res);
+  });
+  return (int)timer.transferred(res);
 }
+#endif
 
 int _do_fsync(FileNode *fnode, int dataSync) {
   return fnode->sync(dataSync != 0);
 }
 
 int encfs_fsync(const char *path, int dataSync, struct fuse_file_info *file) {
+  StatTimer timer(OpStats::Fsync);
+  timer.trace(path, 0, dataSync != 0 ? 1 : 0);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
-  return withFileNode("fsync", path, file, bind(_do_fsync, _1, dataSync));
+  return timer.status(
+      withFileNode("fsync", path, file, bind(_do_fsync, _1, dataSync)));
 }
 
 ssize_t _do_write(FileNode *fnode, unsigned char *ptr, size_t size,
@@ -751,6 +1611,8 @@ ssize_t _do_write(FileNode *fnode, unsigned char *ptr, size_t size,
 
 int encfs_write(const char *path, const char *buf, size_t size, off_t offset,
                 struct fuse_file_info *file) {
+  StatTimer timer(OpStats::Write);
+  timer.trace(path, offset, size);
   // Unfortunately we have to convert from ssize_t (pwrite) to int (fuse), so
   // let's check this will be OK
   if (size > (size_t)std::numeric_limits<int>::max()) {
@@ -758,35 +1620,136 @@ int encfs_write(const char *path, const char *buf, size_t size, off_t offset,
   }
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
+  }
+  pinToNode(ctx);
+  IoScheduler::Turn turn(ctx->ioScheduler.get(), callerUid(), size);
+  int res = withFileNode("write", path, file,
+                         bind(_do_write, _1, (unsigned char *)buf, size,
+                              offset));
+  return (int)timer.transferred(res);
+}
+
+#if FUSE_USE_VERSION >= 34
+// plaintext moved at a time when copy_file_range decodes and encodes again
+static const size_t CopyChunk = 1024 * 1024;
+
+ssize_t _do_copy_file_range(FileNode *src, off_t offIn, FileNode *dst,
+                            off_t offOut, size_t size) {
+  if (src == dst && offIn < offOut + (off_t)size &&
+      offOut < offIn + (off_t)size) {
+    return -EINVAL;
+  }
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // between files that hold their plaintext as is, the backing filesystem
+  // copies, and may share the blocks rather than copy them
+  int inFd = src->readThroughFd(offIn, size);
+  if (inFd >= 0) {
+    ssize_t res = dst->writeThrough(offOut, size, [=](int outFd) {
+      loff_t in = offIn;
+      loff_t out = offOut;
+      ssize_t res = ::copy_file_range(inFd, &in, outFd, &out, size, 0);
+      return res < 0 ? (ssize_t)-errno : res;
+    });
+    if (res >= 0 || (res != -ENOTSUP && res != -EOPNOTSUPP &&
+                     res != -EXDEV && res != -ENOSYS)) {
+      return res;
+    }
+  }
+#endif
+
+  // decoded from one stack straight into the other, in chunks that after
+  // the first are whole blocks of dst
+  unsigned int bs = dst->blockSize();
+  size_t chunk = std::max((size_t)bs, CopyChunk - CopyChunk % bs);
+  PoolBlock buf(chunk);
+  size_t done = 0;
+  while (done < size) {
+    size_t len = std::min(chunk - (size_t)((offOut + done) % bs), size - done);
+    ssize_t res = src->read(offIn + done, buf.data(), len);
+    if (res <= 0) {
+      return done > 0 ? (ssize_t)done : res;
+    }
+    ssize_t written = dst->write(offOut + done, buf.data(), res);
+    if (written < 0) {
+      return done > 0 ? (ssize_t)done : written;
+    }
+    done += written;
+    if ((size_t)res < len) {
+      break;  // the end of src
+    }
+  }
+  return done;
+}
+
+ssize_t encfs_copy_file_range(const char *pathIn, struct fuse_file_info *fiIn,
+                              off_t offIn, const char *pathOut,
+                              struct fuse_file_info *fiOut, off_t offOut,
+                              size_t size, int flags) {
+  StatTimer timer(OpStats::CopyFileRange);
+  timer.trace(pathIn, offIn, size, pathOut);
+  if (flags != 0) {
+    return timer.status(-EINVAL);
+  }
+  EncFS_Context *ctx = context();
+  if (isReadOnly(ctx)) {
+    return timer.status(-EROFS);
+  }
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  ssize_t copied = -EIO;
+  pinToNode(ctx);
+  IoScheduler::Turn turn(ctx->ioScheduler.get(), callerUid(), size);
+  res = withFileNode("copy_file_range", ctx, *FSRoot, pathIn, fiIn,
+                     [&](FileNode *src) {
+    return withFileNode("copy_file_range", ctx, *FSRoot, pathOut, fiOut,
+                        [&](FileNode *dst) {
+      copied = _do_copy_file_range(src, offIn, dst, offOut, size);
+      return copied < 0 ? (int)copied : 0;
+    });
+  });
+  return timer.transferred(res < 0 ? res : copied);
+}
+#endif
+
+#if FUSE_USE_VERSION >= 38
+// the kernel answers SEEK_SET, SEEK_CUR and SEEK_END itself
+off_t encfs_lseek(const char *path, off_t offset, int whence,
+                  struct fuse_file_info *fi) {
+  StatTimer timer(OpStats::Lseek);
+  timer.trace(path, offset);
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return timer.status(-EINVAL);
   }
-  return withFileNode("write", path, file,
-                      bind(_do_write, _1, (unsigned char *)buf, size, offset));
+  off_t found = -EIO;
+  int res = withFileNode("lseek", path, fi, [&](FileNode *fnode) {
+    found = fnode->seekExtent(offset, whence == SEEK_HOLE);
+    return found < 0 ? (int)found : 0;
+  });
+  return res < 0 ? timer.status(res) : found;
 }
+#endif
 
 // statfs works even if encfs is detached..
 int encfs_statfs(const char *path, struct statvfs *st) {
+  StatTimer timer(OpStats::Statfs);
+  timer.trace(path);
   EncFS_Context *ctx = context();
 
   int res = -EIO;
   try {
     (void)path;  // path should always be '/' for now..
     rAssert(st != nullptr);
-    string cyName = ctx->rootCipherDir;
-
-    VLOG(1) << "doing statfs of " << cyName;
-    res = statvfs(cyName.c_str(), st);
-    if (res == 0) {
-      // adjust maximum name length..
-      st->f_namemax = 6 * (st->f_namemax - 2) / 8;  // approx..
-    }
-    if (res == -1) {
-      res = -errno;
-    }
+    res = ctx->statfs(st);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in statfs: " << err.what();
   }
-  return res;
+  return timer.status(res);
 }
 
 #ifdef HAVE_XATTR
@@ -799,13 +1762,17 @@ int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
 }
 int encfs_setxattr(const char *path, const char *name, const char *value,
                    size_t size, int flags, uint32_t position) {
+  StatTimer timer(OpStats::Setxattr);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
   (void)flags;
-  return withCipherPath("setxattr", path, bind(_do_setxattr, _1, _2, name,
-                                               value, size, position));
+  int res = withCipherPath("setxattr", path, bind(_do_setxattr, _1, _2, name,
+                                                  value, size, position));
+  invalidateAttr(ctx, path);
+  return timer.status(res);
 }
 #else
 int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
@@ -814,15 +1781,111 @@ int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
 }
 int encfs_setxattr(const char *path, const char *name, const char *value,
                    size_t size, int flags) {
+  StatTimer timer(OpStats::Setxattr);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
-  return withCipherPath("setxattr", path,
-                        bind(_do_setxattr, _1, _2, name, value, size, flags));
+  int res = withCipherPath("setxattr", path,
+                           bind(_do_setxattr, _1, _2, name, value, size,
+                                flags));
+  invalidateAttr(ctx, path);
+  return timer.status(res);
 }
 #endif
 
+// the stats report and the trace, as attributes of the mount root that
+// listxattr leaves out.  Served without getRoot, so reading them neither
+// attaches a detached filesystem nor keeps one from going idle.
+static const char StatsXattr[] = "user.encfs.stats";
+static const char TraceXattr[] = "user.encfs.trace";
+// the largest attribute value the kernel takes
+static const size_t MaxXattrSize = 64 * 1024;
+
+// reverse mode with --digest-cache: the SHA-256 of a file's encoding, in
+// hex, when that is known
+static const char DigestXattr[] = "user.encfs.digest";
+
+static bool isStatsXattr(const char *path, const char *name) {
+  return strcmp(path, "/") == 0 &&
+         (strcmp(name, StatsXattr) == 0 || strcmp(name, TraceXattr) == 0);
+}
+
+static int statsXattr(const char *name, char *value, size_t size) {
+  string report = strcmp(name, StatsXattr) == 0
+                      ? statsReport(context())
+                      : Trace::dump(MaxXattrSize);
+  if (size == 0) {
+    return report.length();
+  }
+  if (size < report.length()) {
+    return -ERANGE;
+  }
+  memcpy(value, report.data(), report.length());
+  return report.length();
+}
+
+static int digestXattr(EncFS_Context *ctx, DirNode &root, const char *path,
+                       char *value, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  const std::shared_ptr<DigestCache> &cache = root.config()->digestCache;
+  struct stat stbuf;
+  int res = pathAttr(ctx, root, path, &stbuf);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char md[DigestCache::DigestSize];
+  if (!cache->get(path, stbuf, md)) {
+    return -ENODATA;
+  }
+  const int len = 2 * DigestCache::DigestSize;
+  if (size == 0) {
+    return len;
+  }
+  if (size < (size_t)len) {
+    return -ERANGE;
+  }
+  for (int i = 0; i < DigestCache::DigestSize; ++i) {
+    value[2 * i] = digits[md[i] >> 4];
+    value[2 * i + 1] = digits[md[i] & 0x0f];
+  }
+  return len;
+}
+
+/*
+    getxattr of name through the xattr cache, op doing the real one into
+    value.  Only results that say everything about the attribute are kept:
+    its value when it fit, or that it is missing.
+ */
+template <typename Op>
+static int cachedGetxattr(const char *path, const char *name, char *value,
+                          size_t size, const Op &op) {
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return res;
+  }
+
+  if (FSRoot->config()->digestCache && strcmp(name, DigestXattr) == 0) {
+    return digestXattr(ctx, *FSRoot, path, value, size);
+  }
+
+  const std::shared_ptr<XattrCache> &cache = FSRoot->config()->xattrCache;
+  uint64_t generation = 0;
+  if (cache && cache->get(path, name, value, size, &res, &generation)) {
+    return res;
+  }
+
+  res = withCipherPath("getxattr", ctx, *FSRoot, path, op, true);
+  if (cache && (res < 0 || size > 0)) {
+    cache->add(path, name, value, res, generation);
+  }
+  return res;
+}
+
 #ifdef XATTR_ADD_OPT
 int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
                  void *value, size_t size, uint32_t pos) {
@@ -831,9 +1894,21 @@ int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
 }
 int encfs_getxattr(const char *path, const char *name, char *value, size_t size,
                    uint32_t position) {
-  return withCipherPath(
-      "getxattr", path,
-      bind(_do_getxattr, _1, _2, name, (void *)value, size, position), true);
+  StatTimer timer(OpStats::Getxattr);
+  timer.trace(path);
+  if (isStatsXattr(path, name)) {
+    return timer.status(statsXattr(name, value, size));
+  }
+  if (position != 0) {
+    // resource forks are read in pieces, and not cached
+    return timer.status(withCipherPath(
+        "getxattr", path,
+        bind(_do_getxattr, _1, _2, name, (void *)value, size, position),
+        true));
+  }
+  return timer.status(cachedGetxattr(
+      path, name, value, size,
+      bind(_do_getxattr, _1, _2, name, (void *)value, size, position)));
 }
 #else
 int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
@@ -842,9 +1917,14 @@ int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
 }
 int encfs_getxattr(const char *path, const char *name, char *value,
                    size_t size) {
-  return withCipherPath("getxattr", path,
-                        bind(_do_getxattr, _1, _2, name, (void *)value, size),
-                        true);
+  StatTimer timer(OpStats::Getxattr);
+  timer.trace(path);
+  if (isStatsXattr(path, name)) {
+    return timer.status(statsXattr(name, value, size));
+  }
+  return timer.status(cachedGetxattr(
+      path, name, value, size,
+      bind(_do_getxattr, _1, _2, name, (void *)value, size)));
 }
 #endif
 
@@ -860,8 +1940,28 @@ int _do_listxattr(EncFS_Context *, const string &cyName, char *list,
 }
 
 int encfs_listxattr(const char *path, char *list, size_t size) {
-  return withCipherPath("listxattr", path,
-                        bind(_do_listxattr, _1, _2, list, size), true);
+  StatTimer timer(OpStats::Listxattr);
+  timer.trace(path);
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
+    return timer.status(res);
+  }
+
+  const std::shared_ptr<XattrCache> &cache = FSRoot->config()->xattrCache;
+  uint64_t generation = 0;
+  if (cache && cache->getList(path, list, size, &res, &generation)) {
+    return timer.status(res);
+  }
+
+  res = withCipherPath("listxattr", ctx, *FSRoot, path,
+                       bind(_do_listxattr, _1, _2, list, size), true);
+  if (cache && res >= 0 && size > 0) {
+    cache->addList(path, list, res, generation);
+  }
+  return timer.status(res);
 }
 
 int _do_removexattr(EncFS_Context *, const string &cyName, const char *name) {
@@ -875,13 +1975,17 @@ int _do_removexattr(EncFS_Context *, const string &cyName, const char *name) {
 }
 
 int encfs_removexattr(const char *path, const char *name) {
+  StatTimer timer(OpStats::Removexattr);
+  timer.trace(path);
   EncFS_Context *ctx = context();
   if (isReadOnly(ctx)) {
-    return -EROFS;
+    return timer.status(-EROFS);
   }
 
-  return withCipherPath("removexattr", path,
-                        bind(_do_removexattr, _1, _2, name));
+  int res = withCipherPath("removexattr", path,
+                           bind(_do_removexattr, _1, _2, name));
+  invalidateAttr(ctx, path);
+  return timer.status(res);
 }
 
 #endif  // HAVE_XATTR
@@ -1,12 +1,13 @@
 #ifndef _encfs_incl_
 #define _encfs_incl_
 
-#incldue "easylogging++.h"
+#include "easylogging++.h"
 #include <fuse.h>
+#include <string>
 #include <sys/types.h>
 #include <unistd.h>
 
-#incldue "config.h"
+#include "config.h"
 
 namespace encfs {
 #if defined(HAVE_SYS_XATTR_H) | defined(HAVE_ATTR_XATTR_H)
@@ -31,16 +32,38 @@ namespace encfs {
         return oldgid;
     }
 #endif
+    class EncFS_Context;
+
+    /*
+     * The filesystem and caller of the request the current thread serves.
+     * The high-level frontend leaves it unset, and they come from
+     * fuse_get_context(); the low-level frontend has no fuse context and
+     * sets them for each request.
+     */
+    struct RequestCaller {
+        EncFS_Context* ctx;
+        uid_t uid;
+        gid_t gid;
+        bool entryAttrs;  // readdir reports full entry attributes
+    };
+    void setRequestCaller(const RequestCaller* caller);
+
+    // the encoded path of path in the volume of the request the current
+    // thread serves, empty if it can't be had (see --record-ops)
+    std::string requestCipherPath(const char* path);
+
     int encfs_getattr(const char* path, struct stat* stbuf);
     int encfs_fgetattr(const char* path, struct stat* stbuf,
                       struct fuse_file_info* fi);
     int encfs_readlink(const char* path, char* buf, size_t size);
+    int encfs_opendir(const char* path, struct fuse_file_info* finfo);
     int encfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
                       off_t offset, struct fuse_file_info* finfo);
+    int encfs_releasedir(const char* path, struct fuse_file_info* finfo);
     int encfs_mknod(const char* path, mode_t mode, dev_t rdev);
     int encfs_mkdir(const char* path, mode_t mode);
     int encfs_unlink(const char* path);
-    int encfs_rmkdir(const char* path);
+    int encfs_rmdir(const char* path);
     int encfs_symlink(const char* from, const char* to);
     int encfs_rename(const char* from, const char* to);
     int encfs_link(const char* to, const char* from);
@@ -48,6 +71,10 @@ namespace encfs {
     int encfs_chown(const char* path, uid_t uid, gid_t gid);
     int encfs_truncate(const char* path, off_t size);
     int encfs_ftruncate(const char* path, off_t size, struct fuse_file_info* fi);
+#if FUSE_VERSION >= 29
+    int encfs_fallocate(const char* path, int mode, off_t offset, off_t len,
+                        struct fuse_file_info* fi);
+#endif
     int encfs_utime(const char* path, struct utimbuf* buf);
     int encfs_open(const char* path, struct fuse_file_info* info);
     int encfs_create(const char* path, mode_t mode, struct fuse_file_info* info);
@@ -56,9 +83,25 @@ namespace encfs {
                    struct fuse_file_info* info);
     int encfs_write(const char* path, const char* buf, size_t size, off_t offset,
                     struct fuse_file_info* info);
-    int encfs_statfs(const char*, struct stavfs* fst);
+#if FUSE_VERSION >= 29
+    int encfs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+                       off_t offset, struct fuse_file_info* info);
+    int encfs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset,
+                        struct fuse_file_info* info);
+#endif
+#if FUSE_USE_VERSION >= 34
+    ssize_t encfs_copy_file_range(const char* pathIn, struct fuse_file_info* fiIn,
+                                  off_t offIn, const char* pathOut,
+                                  struct fuse_file_info* fiOut, off_t offOut,
+                                  size_t size, int flags);
+#endif
+#if FUSE_USE_VERSION >= 38
+    off_t encfs_lseek(const char* path, off_t offset, int whence,
+                      struct fuse_file_info* fi);
+#endif
+    int encfs_statfs(const char*, struct statvfs* fst);
     int encfs_flush(const char*, struct fuse_file_info* info);
-    int encfs_fsync(const char* path, int flags, struct fuse_file_info* info);
+    int encfs_fsync(const char* path, int dataSync, struct fuse_file_info* info);
 
 #ifdef HAVE_XATTR
 #ifdef XATTR_ADD_OPT
@@ -71,6 +114,9 @@ namespace encfs {
                        size_t size, int flags);
     int encfs_getxattr(const char* path, const char* name, char* value,
                        size_t size);
+#endif
+    int encfs_listxattr(const char* path, char* list, size_t size);
+    int encfs_removexattr(const char* path, const char* name);
 #endif
     int encfs_utimens(const char* path, const struct timespec ts[2]);
 }
@@ -15,23 +15,35 @@
  * more details.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <dirent.h>
 #include <fcntl.h>
+#include <functional>
 #include <getopt.h>
 #include <iostream>
 #include <limits.h>
 #include <memory>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #define NO_DES
 #include <openssl/ssl.h>
 
+#include "BlockFileIO.h"
+#include "ChangeIndex.h"
 #include "Cipher.h"
 #include "CipherKey.h"
 #include "Context.h"
@@ -41,6 +53,11 @@
 #include "FileNode.h"
 #include "FileUtils.h"
 #include "Interface.h"
+#include "Mutex.h"
+#include "OpStats.h"
+#include "PathCache.h"
+#include "RateLimit.h"
+#include "ThreadPool.h"
 #include "autosprintf.h"
 #include "config.h"
 #include "i18n.h"
@@ -65,7 +82,13 @@ static int cmd_encode(int argc, char **argv);
 static int cmd_showcruft(int argc, char **argv);
 static int cmd_cat(int argc, char **argv);
 static int cmd_export(int argc, char **argv);
+static int cmd_import(int argc, char **argv);
+static int cmd_convert(int argc, char **argv);
+static int cmd_verify(int argc, char **argv);
+static int cmd_bench(int argc, char **argv);
+static int cmd_changes(int argc, char **argv);
 static int cmd_showKey(int argc, char **argv);
+static int cmd_cachecfg(int argc, char **argv);
 
 struct CommandOpts {
   const char *name;
@@ -81,6 +104,10 @@ struct CommandOpts {
     {"showKey", 1, 1, cmd_showKey, "(root dir)",
      // xgroup(usage)
      gettext_noop("  -- show key")},
+    {"cachecfg", 1, 1, cmd_cachecfg, "(root dir)",
+     // xgroup(usage)
+     gettext_noop("  -- keep a binary copy of the config next to it, which\n"
+                  "\tlater commands and mounts read instead of the XML")},
     {"passwd", 1, 1, chpasswd, "(root dir)",
      // xgroup(usage)
      gettext_noop("  -- change password for volume")},
@@ -92,24 +119,66 @@ struct CommandOpts {
      // xgroup(usage)
      gettext_noop("  -- check password for volume, taking password"
                   " from standard input.\n\tNo prompts are issued.")},
-    {"ls", 1, 2, cmd_ls, 0, 0},
-    {"showcruft", 1, 1, cmd_showcruft, "(root dir)",
+    {"ls", 1, 7, cmd_ls,
+     "[--recursive] [--long] [--json] [--threads=N] (root dir) [path]",
+     // xgroup(usage)
+     gettext_noop("  -- lists the decoded names in the volume, with their\n"
+                  "\tplaintext sizes, reading the backing directory")},
+    {"showcruft", 1, 4, cmd_showcruft, "[--threads=N] [--json] (root dir)",
      // xgroup(usage)
-     gettext_noop("  -- show undecodable filenames in the volume")},
+     gettext_noop("  -- show undecodable filenames in the volume,\n"
+                  "\tlooking through N directories at once")},
     {"cat", 2, 4, cmd_cat, "[--extpass=prog] [--reverse] (root dir) path",
      // xgroup(usage)
      gettext_noop("  -- decodes the file and cats it to standard out")},
     {"decode", 1, 100, cmd_decode,
-     "[--extpass=prog] (root dir) [encoded-name ...]",
+     "[--extpass=prog] [--null] [--threads=N] (root dir) [encoded-name ...]",
      // xgroup(usage)
-     gettext_noop("  -- decodes name and prints plaintext version")},
+     gettext_noop("  -- decodes name and prints plaintext version; without\n"
+                  "\tnames, decodes the paths on standard input, one per\n"
+                  "\tline (NUL-terminated with --null), N at once")},
     {"encode", 1, 100, cmd_encode,
-     "[--extpass=prog] (root dir) [plaintext-name ...]",
+     "[--extpass=prog] [--null] [--threads=N] (root dir) [plaintext-name ...]",
+     // xgroup(usage)
+     gettext_noop("  -- encodes a filename and print result; without\n"
+                  "\tnames, encodes the paths on standard input, as decode")},
+    {"export", 2, 6, cmd_export,
+     "[--threads=N] [--progress] [--since=manifest] (root dir) path",
+     // xgroup(usage)
+     gettext_noop("  -- decrypts a volume and writes results to path,\n"
+                  "\tcopying N files at once (default: one per CPU);\n"
+                  "\twith --since, only what changed since the export\n"
+                  "\tthat wrote the manifest, which is then updated")},
+    {"import", 2, 4, cmd_import, "[--threads=N] [--progress] (root dir) path",
+     // xgroup(usage)
+     gettext_noop("  -- encrypts the tree at path into the volume, copying\n"
+                  "\tN files at once; run again to finish an interrupted import")},
+    {"convert", 2, 6, cmd_convert,
+     "[--threads=N] [--progress] [--standard|--paranoia] (root dir) "
+     "(new root dir)",
+     // xgroup(usage)
+     gettext_noop("  -- re-encrypts the volume into a new one, set up as encfs\n"
+                  "\twould set it up; run again to finish an interrupted one")},
+    {"rekey", 1, 5, cmd_convert,
+     "[--threads=N] [--progress] [--standard|--paranoia] (root dir)",
+     // xgroup(usage)
+     gettext_noop("  -- converts the volume in place, to a new key and\n"
+                  "\tsettings, removing each old file once it is converted")},
+    {"verify", 1, 4, cmd_verify,
+     "[--threads=N] [--rate=MB/s] [--progress] (root dir)",
+     // xgroup(usage)
+     gettext_noop("  -- checks every name, and every block MAC, of the volume\n"
+                  "\twith N threads, reading at most MB/s")},
+    {"bench", 1, 4, cmd_bench, "[--size=MB] [--threads=N] [--json] (root dir)",
      // xgroup(usage)
-     gettext_noop("  -- encodes a filename and print result")},
-    {"export", 2, 2, cmd_export, "(root dir) path",
+     gettext_noop("  -- measures file and name coding on scratch files,\n"
+                  "\twith and without a MAC, reading with 1 .. N threads")},
+    {"changes", 2, 4, cmd_changes,
+     "[--extpass=prog] --index=FILE [--since=TOKEN] (source dir)",
      // xgroup(usage)
-     gettext_noop("  -- decrypts a volume and writes results to path")},
+     gettext_noop("  -- lists the encoded paths of a reverse mount of the source\n"
+                  "\tdir changed (+) or deleted (-) since TOKEN, then the new\n"
+                  "\ttoken; a first line \"full\" lists every path instead")},
     {"--version", 0, 0, showVersion, "",
      // xgroup(usage)
      gettext_noop("  -- print version number and exit")},
@@ -216,13 +285,30 @@ static int showInfo(int argc, char **argv) {
   return EXIT_SUCCESS;
 }
 
-static RootPtr initRootInfo(int &argc, char **&argv) {
+// how encode and decode read paths from standard input
+struct NameStream {
+  bool nul;     // NUL-terminated rather than one per line
+  int threads;  // translating at once
+
+  NameStream() : nul(false) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (int)std::max(1L, std::min(cpus, 16L));
+  }
+};
+
+// stream, if not null, takes --null and --threads
+static RootPtr initRootInfo(int &argc, char **&argv,
+                            NameStream *stream = nullptr) {
   RootPtr result;
   std::shared_ptr<EncFS_Opts> opts(new EncFS_Opts());
   opts->createIfNotFound = false;
   opts->checkKey = false;
 
-  static struct option long_options[] = {{"extpass", 1, 0, 'p'}, {"reverse", 0, nullptr, 'r'}, {0, 0, 0, 0}};
+  static struct option long_options[] = {{"extpass", 1, 0, 'p'},
+                                         {"reverse", 0, nullptr, 'r'},
+                                         {"null", 0, nullptr, '0'},
+                                         {"threads", 1, nullptr, 't'},
+                                         {0, 0, 0, 0}};
 
   for (;;) {
     int option_index = 0;
@@ -237,6 +323,28 @@ static RootPtr initRootInfo(int &argc, char **&argv) {
       case 'r':
         opts->reverseEncryption = true;
         break;
+      case '0':
+        if (stream == nullptr) {
+          RLOG(WARNING) << "getopt error: " << res;
+          break;
+        }
+        stream->nul = true;
+        break;
+      case 't': {
+        if (stream == nullptr) {
+          RLOG(WARNING) << "getopt error: " << res;
+          break;
+        }
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return result;
+        }
+        stream->threads = (int)n;
+        break;
+      }
       default:
         RLOG(WARNING) << "getopt error: " << res;
         break;
@@ -284,6 +392,20 @@ static RootPtr initRootInfo(const char *crootDir) {
   return result;
 }
 
+static int cmd_cachecfg(int argc, char **argv) {
+  (void)argc;
+  string rootDir = argv[1];
+  if (!checkDir(rootDir)) return EXIT_FAILURE;
+
+  if (!saveConfigSidecar(rootDir, "")) {
+    // xgroup(diag)
+    cerr << _("Unable to save a copy of the config, only version 6 "
+              "configurations have one\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
 static int cmd_showKey(int argc, char **argv) {
   (void)argc;
   RootPtr rootInfo = initRootInfo(argv[1]);
@@ -301,8 +423,128 @@ static int cmd_showKey(int argc, char **argv) {
   }
 }
 
+// paths read from standard input and translated at a time
+static const size_t NameChunk = 4096;
+// directories whose decoding the decode of a stream remembers
+static const int DecodedDirEntries = 16384;
+
+/*
+    Translates the paths of standard input in order, a chunk at a time,
+    spread over threads.  Encoding goes through the path cache of the
+    volume, and decoding through a memo of the same kind keyed by the
+    encoded directory, so that the names and IV chain of a directory are
+    only coded once for every path below it.  A path that does not
+    translate gives an empty one.
+ */
+class NameTranslator {
+ public:
+  NameTranslator(const RootPtr &rootInfo, bool encode, int threads)
+      : _root(rootInfo->root),
+        _encode(encode),
+        _threads(threads),
+        _pool(threads - 1),
+        _decoded(DecodedDirEntries),
+        _failed(false) {}
+
+  // EXIT_SUCCESS once every path was written, EXIT_FAILURE if not
+  int run(char separator);
+
+ private:
+  string translate(const string &path);
+  string decodeDir(const string &cipherDir, uint64_t *iv);
+
+  std::shared_ptr<DirNode> _root;
+  bool _encode;
+  int _threads;
+  ThreadPool _pool;
+  PathCache _decoded;  // encoded directory -> decoded one, and its IV
+  std::atomic<bool> _failed;
+};
+
+int NameTranslator::run(char separator) {
+  std::vector<string> paths;
+  std::vector<string> results;
+  for (;;) {
+    paths.clear();
+    string path;
+    while (paths.size() < NameChunk && getline(cin, path, separator)) {
+      paths.push_back(path);
+    }
+    if (paths.empty()) {
+      break;
+    }
+
+    results.assign(paths.size(), string());
+    _pool.forEach(_threads, [&](int worker) {
+      for (size_t i = worker; i < paths.size(); i += _threads) {
+        results[i] = translate(paths[i]);
+      }
+      return true;
+    });
+    for (const string &result : results) {
+      cout << result << separator;
+    }
+    if (!cout) {
+      return EXIT_FAILURE;
+    }
+  }
+  cout << flush;
+  return _failed || !cout ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+string NameTranslator::translate(const string &path) {
+  if (_encode) {
+    try {
+      return _root->cipherPathWithoutRoot(path.c_str());
+    } catch (encfs::Error &err) {
+      RLOG(ERROR) << "encode err: " << err.what();
+      _failed = true;
+      return string();
+    }
+  }
+
+  // names marked with '+' and paths plainPath takes apart itself go to it
+  size_t slash = path.rfind('/');
+  if (slash == string::npos || slash == 0 || slash + 1 == path.length() ||
+      path[0] == '+' || path[0] == '/' || path.find("//") != string::npos) {
+    string plain = _root->plainPath(path.c_str());
+    if (plain.empty() && !path.empty()) {
+      _failed = true;
+    }
+    return plain;
+  }
+  try {
+    uint64_t iv = 0;
+    string dir = decodeDir(path.substr(0, slash), &iv);
+    return dir + '/' + _root->decodeName(path.c_str() + slash + 1, &iv);
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "decode err: " << err.what();
+    _failed = true;
+    return string();
+  }
+}
+
+string NameTranslator::decodeDir(const string &cipherDir, uint64_t *iv) {
+  string plainDir;
+  if (_decoded.get(cipherDir, &plainDir, iv)) {
+    return plainDir;
+  }
+  size_t slash = cipherDir.rfind('/');
+  if (slash == string::npos) {
+    *iv = 0;
+    plainDir = _root->decodeName(cipherDir.c_str(), iv);
+  } else {
+    plainDir = decodeDir(cipherDir.substr(0, slash), iv);
+    plainDir += '/';
+    plainDir += _root->decodeName(cipherDir.c_str() + slash + 1, iv);
+  }
+  _decoded.put(cipherDir, plainDir, *iv);
+  return plainDir;
+}
+
 static int cmd_decode(int argc, char **argv) {
-  RootPtr rootInfo = initRootInfo(argc, argv);
+  NameStream stream;
+  RootPtr rootInfo = initRootInfo(argc, argv, &stream);
   if (!rootInfo) return EXIT_FAILURE;
 
   if (argc > 0) {
@@ -311,16 +553,15 @@ static int cmd_decode(int argc, char **argv) {
       cout << name << "\n";
     }
   } else {
-    char buf[PATH_MAX + 1];
-    while (cin.getline(buf, PATH_MAX)) {
-      cout << rootInfo->root->plainPath(buf) << "\n";
-    }
+    NameTranslator translator(rootInfo, false, stream.threads);
+    return translator.run(stream.nul ? '\0' : '\n');
   }
   return EXIT_SUCCESS;
 }
 
 static int cmd_encode(int argc, char **argv) {
-  RootPtr rootInfo = initRootInfo(argc, argv);
+  NameStream stream;
+  RootPtr rootInfo = initRootInfo(argc, argv, &stream);
   if (!rootInfo) return EXIT_FAILURE;
 
   if (argc > 0) {
@@ -329,57 +570,25 @@ static int cmd_encode(int argc, char **argv) {
       cout << name << "\n";
     }
   } else {
-    char buf[PATH_MAX + 1];
-    while (cin.getline(buf, PATH_MAX)) {
-      cout << rootInfo->root->cipherPathWithoutRoot(buf) << "\n";
-    }
+    NameTranslator translator(rootInfo, true, stream.threads);
+    return translator.run(stream.nul ? '\0' : '\n');
   }
   return EXIT_SUCCESS;
 }
 
-static int cmd_ls(int argc, char **argv) {
-  (void)argc;
-
-  RootPtr rootInfo = initRootInfo(argv[1]);
-
-  if (!rootInfo) return EXIT_FAILURE;
-
-  // show files in directory
-  {
-    DirTraverse dt = rootInfo->root->openDir("/");
-    if (dt.valid()) {
-      for (string name = dt.nextPlaintextName(); !name.empty();
-           name = dt.nextPlaintextName()) {
-        std::shared_ptr<FileNode> fnode =
-            rootInfo->root->lookupNode(name.c_str(), "encfsctl-ls");
-        struct stat stbuf;
-        fnode->getAttr(&stbuf);
-
-        struct tm stm;
-        localtime_r(&stbuf.st_mtime, &stm);
-        stm.tm_year += 1900;
-        // TODO: when I add "%s" to the end and name.c_str(), I get a
-        // seg fault from within strlen.  Why ???
-        printf("%11i %4i-%02i-%02i %02i:%02i:%02i %s\n", int(stbuf.st_size),
-               int(stm.tm_year), int(stm.tm_mon), int(stm.tm_mday),
-               int(stm.tm_hour), int(stm.tm_min), int(stm.tm_sec),
-               name.c_str());
-      }
-    }
-  }
-
-  return EXIT_SUCCESS;
-}
+// bytes read from a file at a time, rounded down to whole blocks
+static const size_t ContentsBufferSize = 1024 * 1024;
+// the granularity of holes in exported files, a page
+static const int HoleSize = 4096;
 
-// apply an operation to every block in the file
-template <typename T>
-int processContents(const std::shared_ptr<EncFS_Root> &rootInfo,
-                    const char *path, T &op) {
-  int errCode = 0;
+// opens path for reading, as a plaintext or as an enciphered path
+static std::shared_ptr<FileNode> openContents(
+    const std::shared_ptr<EncFS_Root> &rootInfo, const char *path,
+    int *errCode) {
   std::shared_ptr<FileNode> node;
 
   try {
-    node = rootInfo->root->openNode(path, "encfsctl", O_RDONLY, &errCode);
+    node = rootInfo->root->openNode(path, "encfsctl", O_RDONLY, errCode);
   }
   catch(...) {}
 
@@ -390,22 +599,46 @@ int processContents(const std::shared_ptr<EncFS_Root> &rootInfo,
       node = rootInfo->root->lookupNode(plainName.c_str(), "encfsctl");
     }
     if (node) {
-      errCode = node->open(O_RDONLY);
-      if (errCode < 0) node.reset();
+      *errCode = node->open(O_RDONLY);
+      if (*errCode < 0) node.reset();
     }
   }
+  return node;
+}
+
+// ContentsBufferSize, in whole blocks of node
+static size_t contentsBufferSize(const FileNode &node) {
+  size_t blockSize = std::max(node.blockSize(), 1u);
+  return std::max(ContentsBufferSize / blockSize, (size_t)1) * blockSize;
+}
+
+// apply an operation to the contents of a file, read in large runs of
+// whole blocks
+template <typename T>
+int processContents(const std::shared_ptr<EncFS_Root> &rootInfo,
+                    const char *path, T &op) {
+  int errCode = 0;
+  std::shared_ptr<FileNode> node = openContents(rootInfo, path, &errCode);
 
   if (!node) {
     cerr << "unable to open " << path << "\n";
     return errCode;
   } else {
-    unsigned char buf[512];
-    int blocks = (node->getSize() + sizeof(buf) - 1) / sizeof(buf);
-    // read all the data in blocks
-    for (int i = 0; i < blocks; ++i) {
-      int bytes = node->read(i * sizeof(buf), buf, sizeof(buf));
-      int res = op(buf, bytes);
+    std::vector<unsigned char> buf(contentsBufferSize(*node));
+
+    off_t size = node->getSize();
+    for (off_t offset = 0; offset < size;) {
+      ssize_t bytes = node->read(offset, buf.data(), buf.size());
+      if (bytes < 0) {
+        cerr << "unable to read " << path << ": " << strerror(-bytes) << "\n";
+        return (int)bytes;
+      }
+      if (bytes == 0) {
+        break;
+      }
+      int res = op(buf.data(), (int)bytes);
       if (res < 0) return res;
+      offset += bytes;
     }
   }
   return 0;
@@ -413,16 +646,309 @@ int processContents(const std::shared_ptr<EncFS_Root> &rootInfo,
 
 class WriteOutput {
   int _fd;
+  bool _sparse;  // seek over pages of zeros rather than writing them
+  off_t _offset;
+
+  int writeAll(const unsigned char *buf, int count) {
+    int done = 0;
+    while (done < count) {
+      ssize_t res = _sparse ? pwrite(_fd, buf + done, count - done, _offset)
+                            : write(_fd, buf + done, count - done);
+      if (res < 0) {
+        if (errno == EINTR) continue;
+        return -errno;
+      }
+      done += res;
+      _offset += res;
+    }
+    return count;
+  }
 
  public:
-  WriteOutput(int fd) { _fd = fd; }
-  ~WriteOutput() { close(_fd); }
+  explicit WriteOutput(int fd, bool sparse = false)
+      : _fd(fd), _sparse(sparse), _offset(0) {}
+  ~WriteOutput() {
+    if (_fd >= 0) close(_fd);
+  }
+
+  int operator()(const unsigned char *buf, int count) {
+    if (!_sparse) {
+      return writeAll(buf, count);
+    }
+
+    int done = 0;
+    while (done < count) {
+      int n = std::min(HoleSize, count - done);
+      if (BlockFileIO::isZero(buf + done, n)) {
+        _offset += n;
+        done += n;
+        continue;
+      }
+      // write the run of pages up to the next hole at once
+      int end = done + n;
+      while (end < count) {
+        int m = std::min(HoleSize, count - end);
+        if (BlockFileIO::isZero(buf + end, m)) break;
+        end += m;
+      }
+      int res = writeAll(buf + done, end - done);
+      if (res < 0) return res;
+      done = end;
+    }
+    return count;
+  }
 
-  int operator()(const void *buf, int count) {
-    return (int)write(_fd, buf, count);
+  // gives the file its size, which a hole at its end does not set.
+  // Returns 0 or -errno.
+  int finish() {
+    if (_sparse && ftruncate(_fd, _offset) != 0) {
+      return -errno;
+    }
+    return 0;
   }
 };
 
+/*
+    Writes runs of a file to a descriptor from a thread of its own, so that
+    the next run is decoded while the last one is written: the reader takes
+    a buffer(), reads into it and queues it, and the two buffers alternate.
+
+    Into a pipe, runs are moved with vmsplice rather than copied.  The pipe
+    then refers to the pages of the buffer until they are read, so a buffer
+    is only filled again once a pipe's worth has been written after it, and
+    is replaced by a new one if not.
+ */
+class StreamOutput {
+ public:
+  StreamOutput(int fd, size_t bufferSize);
+  ~StreamOutput();
+
+  // the buffer to read the next run into, once it is free
+  unsigned char *buffer();
+  // queues count bytes read into the last buffer().  Returns count, or
+  // -errno once writing failed.
+  int operator()(const unsigned char *buf, int count);
+  // waits for what is queued to be written, 0 or -errno
+  int finish();
+
+ private:
+  StreamOutput(const StreamOutput &src);             // not allowed
+  StreamOutput &operator=(const StreamOutput &src);  // not allowed
+
+  struct Slot {
+    std::vector<unsigned char> data;
+    size_t len;
+    bool full;       // queued, not written yet
+    bool spliced;    // the pipe may still refer to data
+    uint64_t endPos; // bytes written to fd up to the end of it
+  };
+
+  static void *run(void *arg);
+  void writeOut();
+  // writes or splices all of slot, 0 or -errno.  Called without the lock
+  // from the thread, so it leaves the counting to its caller.
+  int put(Slot &slot);
+  // counts slot as written, with the lock held
+  void written(Slot &slot);
+
+  int _fd;
+  size_t _bufferSize;
+  size_t _pipeSize;  // capacity of the pipe fd is, 0 if not spliced into
+  Slot _slots[2];
+  int _next;  // the slot buffer() hands out
+  std::vector<std::vector<unsigned char>> _retired;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  uint64_t _written;
+  int _error;
+  bool _done;
+  bool _running;
+  pthread_t _thread;
+};
+
+StreamOutput::StreamOutput(int fd, size_t bufferSize)
+    : _fd(fd),
+      _bufferSize(bufferSize),
+      _pipeSize(0),
+      _next(0),
+      _written(0),
+      _error(0),
+      _done(false),
+      _running(false) {
+  for (Slot &slot : _slots) {
+    slot.data.resize(bufferSize);
+    slot.len = 0;
+    slot.full = false;
+    slot.spliced = false;
+    slot.endPos = 0;
+  }
+#if defined(__linux__) && defined(F_GETPIPE_SZ)
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    int pipeSize = fcntl(fd, F_GETPIPE_SZ);
+    // a buffer must cover the pipe for the other one to be out of it
+    if (pipeSize > 0 && (size_t)pipeSize <= bufferSize) {
+      _pipeSize = pipeSize;
+    }
+  }
+#endif
+
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_cond_init(&_cond, nullptr);
+  _running = pthread_create(&_thread, nullptr, run, this) == 0;
+}
+
+StreamOutput::~StreamOutput() {
+  finish();
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+unsigned char *StreamOutput::buffer() {
+  Lock lock(_mutex);
+  Slot &slot = _slots[_next];
+  while (slot.full) {
+    pthread_cond_wait(&_cond, &_mutex);
+  }
+  if (slot.spliced && _written - slot.endPos < _pipeSize) {
+    // keep the pages the pipe refers to as they are
+    _retired.push_back(std::move(slot.data));
+    slot.data = std::vector<unsigned char>(_bufferSize);
+  }
+  slot.spliced = false;
+  return slot.data.data();
+}
+
+int StreamOutput::operator()(const unsigned char *buf, int count) {
+  Lock lock(_mutex);
+  Slot &slot = _slots[_next];
+  rAssert(buf == slot.data.data());
+  if (!_running) {
+    // no thread, write it here
+    slot.len = count;
+    int res = put(slot);
+    if (res < 0) {
+      _error = res;
+    } else {
+      written(slot);
+    }
+  } else {
+    slot.len = count;
+    slot.full = true;
+    pthread_cond_broadcast(&_cond);
+  }
+  _next ^= 1;
+  return _error < 0 ? _error : count;
+}
+
+int StreamOutput::finish() {
+  if (_running) {
+    {
+      Lock lock(_mutex);
+      _done = true;
+      pthread_cond_broadcast(&_cond);
+    }
+    pthread_join(_thread, nullptr);
+    _running = false;
+  }
+  return _error;
+}
+
+void *StreamOutput::run(void *arg) {
+  static_cast<StreamOutput *>(arg)->writeOut();
+  return nullptr;
+}
+
+void StreamOutput::writeOut() {
+  Lock lock(_mutex);
+  for (int i = 0;; i ^= 1) {
+    Slot &slot = _slots[i];
+    while (!slot.full && !_done) {
+      pthread_cond_wait(&_cond, &_mutex);
+    }
+    if (!slot.full) {
+      break;
+    }
+
+    if (_error == 0) {
+      pthread_mutex_unlock(&_mutex);
+      int res = put(slot);
+      pthread_mutex_lock(&_mutex);
+      if (res < 0) {
+        _error = res;
+      } else {
+        written(slot);
+      }
+    }
+    // after a failure runs are dropped, the reader stops at the next one
+    slot.full = false;
+    pthread_cond_broadcast(&_cond);
+  }
+}
+
+int StreamOutput::put(Slot &slot) {
+  size_t done = 0;
+  while (done < slot.len) {
+    ssize_t res;
+#if defined(__linux__) && defined(SPLICE_F_GIFT)
+    if (_pipeSize > 0) {
+      struct iovec iov;
+      iov.iov_base = slot.data.data() + done;
+      iov.iov_len = slot.len - done;
+      res = vmsplice(_fd, &iov, 1, 0);
+      slot.spliced = true;
+    } else
+#endif
+    {
+      res = write(_fd, slot.data.data() + done, slot.len - done);
+    }
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    done += res;
+  }
+  return 0;
+}
+
+void StreamOutput::written(Slot &slot) {
+  _written += slot.len;
+  slot.endPos = _written;
+}
+
+// writes a file to fd, decoding while the last run is being written
+static int streamContents(const std::shared_ptr<EncFS_Root> &rootInfo,
+                          const char *path, int fd) {
+  int errCode = 0;
+  std::shared_ptr<FileNode> node = openContents(rootInfo, path, &errCode);
+  if (!node) {
+    cerr << "unable to open " << path << "\n";
+    return errCode;
+  }
+
+  size_t bufferSize = contentsBufferSize(*node);
+  StreamOutput output(fd, bufferSize);
+
+  off_t size = node->getSize();
+  for (off_t offset = 0; offset < size;) {
+    unsigned char *buf = output.buffer();
+    ssize_t bytes = node->read(offset, buf, bufferSize);
+    if (bytes < 0) {
+      cerr << "unable to read " << path << ": " << strerror(-bytes) << "\n";
+      output.finish();
+      return (int)bytes;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    int res = output(buf, (int)bytes);
+    if (res < 0) return res;
+    offset += bytes;
+  }
+  return output.finish();
+}
+
 static int cmd_cat(int argc, char **argv) {
   RootPtr rootInfo = initRootInfo(argc, argv);
 
@@ -434,10 +960,7 @@ static int cmd_cat(int argc, char **argv) {
   if (path[0] == '/') {
     path++;
   }
-  WriteOutput output(STDOUT_FILENO);
-  int errCode = processContents(rootInfo, path, output);
-
-  return errCode;
+  return streamContents(rootInfo, path, STDOUT_FILENO);
 }
 
 static int copyLink(const struct stat &stBuf,
@@ -462,8 +985,27 @@ static int copyLink(const struct stat &stBuf,
   return EXIT_SUCCESS;
 }
 
+// counts what an export has written, for its progress line
+class CountOutput {
+  WriteOutput &_out;
+  std::atomic<uint64_t> &_bytes;
+
+ public:
+  CountOutput(WriteOutput &out, std::atomic<uint64_t> &bytes)
+      : _out(out), _bytes(bytes) {}
+
+  int operator()(const unsigned char *buf, int count) {
+    int res = _out(buf, count);
+    if (res > 0) {
+      _bytes.fetch_add(res, std::memory_order_relaxed);
+    }
+    return res;
+  }
+};
+
 static int copyContents(const std::shared_ptr<EncFS_Root> &rootInfo,
-                        const char *encfsName, const char *targetName) {
+                        const char *encfsName, const char *targetName,
+                        std::atomic<uint64_t> &bytes) {
   std::shared_ptr<FileNode> node =
       rootInfo->root->lookupNode(encfsName, "encfsctl");
 
@@ -490,9 +1032,19 @@ static int copyContents(const std::shared_ptr<EncFS_Root> &rootInfo,
       }
     } else {
       int outfd = creat(targetName, st.st_mode);
+      if (outfd < 0) {
+        cerr << "unable to create " << targetName << ": " << strerror(errno)
+             << "\n";
+        return EXIT_FAILURE;
+      }
 
-      WriteOutput output(outfd);
-      processContents(rootInfo, encfsName, output);
+      WriteOutput output(outfd, true);
+      CountOutput counted(output, bytes);
+      if (processContents(rootInfo, encfsName, counted) < 0 ||
+          output.finish() < 0) {
+        cerr << "unable to export " << encfsName << "\n";
+        return EXIT_FAILURE;
+      }
     }
   }
   return EXIT_SUCCESS;
@@ -505,124 +1057,2176 @@ static bool endsWith(const string &str, char ch) {
     return str[str.length() - 1] == ch;
 }
 
-static int traverseDirs(const std::shared_ptr<EncFS_Root> &rootInfo,
-                        string volumeDir, string destDir) {
-  if (!endsWith(volumeDir, '/')) volumeDir.append("/");
-  if (!endsWith(destDir, '/')) destDir.append("/");
-
-  // Lookup directory node so we can create a destination directory
-  // with the same permissions
-  {
-    struct stat st;
-    std::shared_ptr<FileNode> dirNode =
-        rootInfo->root->lookupNode(volumeDir.c_str(), "encfsctl");
-    if (dirNode->getAttr(&st)) return EXIT_FAILURE;
-
-    mkdir(destDir.c_str(), st.st_mode);
-  }
+/*
+    Runs the jobs of walking a tree, copying it into or out of a volume or
+    checking it, on a pool of threads: directories are listed and files
+    handled as jobs, so that as many files as there are threads are in
+    flight.  The first failure stops new work from starting.
+ */
+class CopyJobs {
+ public:
+  CopyJobs(int threads, bool progress);
+  ~CopyJobs();
 
-  // show files in directory
-  DirTraverse dt = rootInfo->root->openDir(volumeDir.c_str());
-  if (dt.valid()) {
-    for (string name = dt.nextPlaintextName(); !name.empty();
-         name = dt.nextPlaintextName()) {
-      // Recurse to subdirectories
-      if (name != "." && name != "..") {
-        string plainPath = volumeDir + name;
-        string cpath = rootInfo->root->cipherPath(plainPath.c_str());
-        string destName = destDir + name;
-
-        int r = EXIT_SUCCESS;
-        struct stat stBuf;
-        if (!lstat(cpath.c_str(), &stBuf)) {
-          if (S_ISDIR(stBuf.st_mode)) {
-            traverseDirs(rootInfo, (plainPath + '/').c_str(), destName + '/');
-          } else if (S_ISLNK(stBuf.st_mode)) {
-            r = copyLink(stBuf, rootInfo, cpath, destName);
-          } else {
-            r = copyContents(rootInfo, plainPath.c_str(), destName.c_str());
-          }
-        } else {
-          r = EXIT_FAILURE;
-        }
+  // runs first and every job queued meanwhile.  EXIT_SUCCESS once all of
+  // them did, else EXIT_FAILURE
+  int run(std::function<int()> first);
+  void queue(std::function<int()> job);
 
-        if (r != EXIT_SUCCESS) return r;
-      }
-    }
-  }
-  return EXIT_SUCCESS;
-}
+  // counted for the progress line
+  std::atomic<uint64_t> files;
+  std::atomic<uint64_t> bytes;
 
-static int cmd_export(int argc, char **argv) {
-  (void)argc;
+ private:
+  CopyJobs(const CopyJobs &src);             // not allowed
+  CopyJobs &operator=(const CopyJobs &src);  // not allowed
 
-  RootPtr rootInfo = initRootInfo(argv[1]);
+  void showProgress(bool last);
 
-  if (!rootInfo) return EXIT_FAILURE;
+  bool _progress;
+  ThreadPool _pool;
 
-  string destDir = argv[2];
-  // if the dir doesn't exist, then create it (with user permission)
-  if (!checkDir(destDir) && !userAllowMkdir(destDir.c_str(), 0700))
-    return EXIT_FAILURE;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _done;  // signalled when _pending drops to 0
+  int _pending;
+  std::atomic<bool> _failed;
+  time_t _start;
+};
 
-  return traverseDirs(rootInfo, "/", destDir);
+CopyJobs::CopyJobs(int threads, bool progress)
+    : files(0),
+      bytes(0),
+      _progress(progress),
+      _pool(threads),
+      _pending(0),
+      _failed(false),
+      _start(time(nullptr)) {
+  pthread_mutex_init(&_mutex, nullptr);
+  pthread_cond_init(&_done, nullptr);
 }
 
-int showcruft(const std::shared_ptr<EncFS_Root> &rootInfo,
-              const char *dirName) {
-  int found = 0;
-  DirTraverse dt = rootInfo->root->openDir(dirName);
-  if (dt.valid()) {
-    bool showedDir = false;
-    for (string name = dt.nextInvalid(); !name.empty();
-         name = dt.nextInvalid()) {
-      string cpath = rootInfo->root->cipherPath(dirName);
-      cpath += '/';
-      cpath += name;
+CopyJobs::~CopyJobs() {
+  pthread_cond_destroy(&_done);
+  pthread_mutex_destroy(&_mutex);
+}
 
-      if (!showedDir) {
-        // just before showing a list of files in a directory
-        cout << autosprintf(_("In directory %s: \n"), dirName);
-        showedDir = true;
+void CopyJobs::queue(std::function<int()> job) {
+  {
+    Lock lock(_mutex);
+    ++_pending;
+  }
+  _pool.submit([this, job]() {
+    if (!_failed) {
+      int r = EXIT_FAILURE;
+      try {
+        r = job();
+      } catch (...) {
       }
-      ++found;
-      cout << cpath << "\n";
+      if (r != EXIT_SUCCESS) {
+        _failed = true;
+      }
+    }
+
+    Lock lock(_mutex);
+    if (--_pending == 0) {
+      pthread_cond_signal(&_done);
     }
+  });
+}
 
-    // now go back and look for directories to recurse into..
-    dt = rootInfo->root->openDir(dirName);
-    if (dt.valid()) {
-      for (string name = dt.nextPlaintextName(); !name.empty();
-           name = dt.nextPlaintextName()) {
-        if (name == "." || name == "..") continue;
+void CopyJobs::showProgress(bool last) {
+  if (!_progress) {
+    return;
+  }
+  time_t elapsed = std::max(time(nullptr) - _start, (time_t)1);
+  uint64_t mib = bytes / (1024 * 1024);
+  cerr << "\r"
+       << autosprintf(_("%llu files, %llu MiB, %llu MiB/s"),
+                      (unsigned long long)files, (unsigned long long)mib,
+                      (unsigned long long)(mib / elapsed))
+       << (last ? "\n" : "") << flush;
+}
 
-        string plainPath = dirName;
-        plainPath += '/';
-        plainPath += name;
+int CopyJobs::run(std::function<int()> first) {
+  queue(first);
 
-        string cpath = rootInfo->root->cipherPath(plainPath.c_str());
+  Lock lock(_mutex);
+  while (_pending > 0) {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += 1;
+    pthread_cond_timedwait(&_done, &_mutex, &wake);
+    showProgress(false);
+  }
+  showProgress(true);
+  return _failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-        if (isDirectory(cpath.c_str()))
-          found += showcruft(rootInfo, plainPath.c_str());
-      }
+// Copies the plaintext of a volume into a directory.
+/*
+    The files an export wrote, so that the next one only decodes those that
+    changed since: each by the inode, mtime and size of its backing file,
+    and the plaintext path it was written to.  One line per file, the path
+    last and preceded by its length, so that any name can be read back.
+ */
+struct ExportManifest {
+  struct Entry {
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    string path;
+  };
+  std::vector<Entry> entries;
+
+  // false if path is there but can't be read; a missing one is empty
+  bool read(const string &path);
+  // replaces path, once the whole manifest is written
+  bool write(const string &path) const;
+};
+
+static const char ManifestHeader[] = "encfsctl export manifest 1\n";
+
+bool ExportManifest::read(const string &path) {
+  FILE *in = fopen(path.c_str(), "r");
+  if (in == nullptr) {
+    if (errno == ENOENT) return true;
+    cerr << "unable to open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  char header[sizeof(ManifestHeader)] = {0};
+  bool ok = fgets(header, sizeof(header), in) != nullptr &&
+            strcmp(header, ManifestHeader) == 0;
+  while (ok) {
+    unsigned long long inode, size, length;
+    long long sec;
+    long nsec;
+    int n = fscanf(in, "%llu %lld %ld %llu %llu ", &inode, &sec, &nsec, &size,
+                   &length);
+    if (n == EOF) break;
+    Entry entry;
+    entry.path.resize(length);
+    ok = n == 5 && length > 0 && length < PATH_MAX &&
+         fread(&entry.path[0], 1, length, in) == length && getc(in) == '\n';
+    if (ok) {
+      entry.inode = (ino_t)inode;
+      entry.mtime.tv_sec = (time_t)sec;
+      entry.mtime.tv_nsec = nsec;
+      entry.size = (off_t)size;
+      entries.push_back(std::move(entry));
     }
   }
+  fclose(in);
+  if (!ok) {
+    cerr << "unable to read the manifest " << path << "\n";
+  }
+  return ok;
+}
 
-  return found;
+bool ExportManifest::write(const string &path) const {
+  string tmp = path + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "w");
+  if (out == nullptr) {
+    cerr << "unable to create " << tmp << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  bool ok = fputs(ManifestHeader, out) >= 0;
+  for (const Entry &entry : entries) {
+    if (!ok) break;
+    ok = fprintf(out, "%llu %lld %ld %llu %llu ",
+                 (unsigned long long)entry.inode,
+                 (long long)entry.mtime.tv_sec, (long)entry.mtime.tv_nsec,
+                 (unsigned long long)entry.size,
+                 (unsigned long long)entry.path.length()) > 0 &&
+         fwrite(entry.path.data(), 1, entry.path.length(), out) ==
+             entry.path.length() &&
+         putc('\n', out) != EOF;
+  }
+  ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+  ok = fclose(out) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    cerr << "unable to write the manifest " << path << "\n";
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
 }
 
 /*
-    iterate recursively through the filesystem and print out names of files
-    which have filenames which cannot be decoded with the given key..
-*/
-static int cmd_showcruft(int argc, char **argv) {
-  (void)argc;
+    Decodes a volume into a directory, listing directories and copying
+    files as jobs of a CopyJobs pool.  Since an earlier export, whose
+    ExportManifest is given, files are only noted as the volume is walked;
+    those whose backing file kept its inode, mtime and size are left as
+    they are, or moved to their new name when renamed in the volume, and
+    only the rest is decoded, before the manifest is rewritten.
+ */
+class Exporter {
+ public:
+  Exporter(const std::shared_ptr<EncFS_Root> &rootInfo, int threads,
+           bool progress)
+      : _rootInfo(rootInfo),
+        _jobs(threads, progress),
+        _since(nullptr),
+        _skipped(0),
+        _moved(0) {
+    pthread_mutex_init(&_mutex, nullptr);
+  }
+  ~Exporter() { pthread_mutex_destroy(&_mutex); }
+
+  // EXIT_SUCCESS once everything is copied, else EXIT_FAILURE.  since, if
+  // not null, is what the last export wrote, and is replaced by what this
+  // one did.
+  int run(const string &volumeDir, const string &destDir,
+          ExportManifest *since = nullptr);
+
+  // files left as they were, or moved, by an incremental export
+  uint64_t skipped() const { return _skipped; }
+  uint64_t moved() const { return _moved; }
+
+ private:
+  Exporter(const Exporter &src);             // not allowed
+  Exporter &operator=(const Exporter &src);  // not allowed
+
+  int exportDir(string volumeDir, string destDir);
+  // what an incremental export does once the volume was walked
+  int update(const string &destRoot);
+
+  std::shared_ptr<EncFS_Root> _rootInfo;
+  CopyJobs _jobs;
+
+  ExportManifest *_since;
+  pthread_mutex_t _mutex;
+  ExportManifest _found;  // the files of the walk, for update()
+  uint64_t _skipped;
+  uint64_t _moved;
+};
 
-  RootPtr rootInfo = initRootInfo(argv[1]);
+int Exporter::exportDir(string volumeDir, string destDir) {
+  if (!endsWith(volumeDir, '/')) volumeDir.append("/");
+  if (!endsWith(destDir, '/')) destDir.append("/");
 
-  if (!rootInfo) return EXIT_FAILURE;
+  // stat the directory so we can create a destination directory with the
+  // same permissions
+  {
+    struct stat st;
+    string dirPath = volumeDir.length() > 1
+                         ? volumeDir.substr(0, volumeDir.length() - 1)
+                         : volumeDir;
+    if (_rootInfo->root->closedAttr(dirPath.c_str(), &st) != 0)
+      return EXIT_FAILURE;
 
-  int filesFound = showcruft(rootInfo, "/");
+    mkdir(destDir.c_str(), st.st_mode);
+  }
+
+  DirTraverse dt = _rootInfo->root->openDir(volumeDir.c_str());
+  if (dt.valid()) {
+    for (string name = dt.nextPlaintextName(); !name.empty();
+         name = dt.nextPlaintextName()) {
+      if (name == "." || name == "..") {
+        continue;
+      }
+      string plainPath = volumeDir + name;
+      string cpath = _rootInfo->root->cipherPath(plainPath.c_str());
+      string destName = destDir + name;
+
+      struct stat stBuf;
+      if (lstat(cpath.c_str(), &stBuf) != 0) {
+        return EXIT_FAILURE;
+      }
+      if (S_ISDIR(stBuf.st_mode)) {
+        _jobs.queue([this, plainPath, destName]() {
+          return exportDir(plainPath + '/', destName + '/');
+        });
+      } else if (S_ISLNK(stBuf.st_mode)) {
+        // links are cheap to make again
+        if (_since != nullptr) unlink(destName.c_str());
+        int r = copyLink(stBuf, _rootInfo, cpath, destName);
+        if (r != EXIT_SUCCESS) return r;
+        ++_jobs.files;
+      } else if (_since != nullptr) {
+        ExportManifest::Entry entry;
+        entry.inode = stBuf.st_ino;
+        entry.mtime = stBuf.st_mtim;
+        entry.size = stBuf.st_size;
+        entry.path = plainPath;
+        Lock lock(_mutex);
+        _found.entries.push_back(std::move(entry));
+      } else {
+        _jobs.queue([this, plainPath, destName]() {
+          int r = copyContents(_rootInfo, plainPath.c_str(), destName.c_str(),
+                               _jobs.bytes);
+          ++_jobs.files;
+          return r;
+        });
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+int Exporter::run(const string &volumeDir, const string &destDir,
+                  ExportManifest *since) {
+  _since = since;
+  int r = _jobs.run(
+      [this, volumeDir, destDir]() { return exportDir(volumeDir, destDir); });
+  if (r != EXIT_SUCCESS || since == nullptr) {
+    return r;
+  }
+
+  string destRoot = destDir;
+  while (endsWith(destRoot, '/')) destRoot.erase(destRoot.length() - 1);
+  return update(destRoot);
+}
+
+static bool sameMtime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+int Exporter::update(const string &destRoot) {
+  // the last export's copy of each backing file still there unchanged
+  std::unordered_map<ino_t, const ExportManifest::Entry *> before;
+  for (const ExportManifest::Entry &old : _since->entries) {
+    before.insert(std::make_pair(old.inode, &old));
+  }
+
+  std::unordered_set<string> current;
+  std::vector<std::pair<const ExportManifest::Entry *,
+                        const ExportManifest::Entry *>> moves;
+  std::vector<const ExportManifest::Entry *> copies;
+  for (const ExportManifest::Entry &entry : _found.entries) {
+    current.insert(entry.path);
+    auto it = before.find(entry.inode);
+    if (it == before.end() || !sameMtime(it->second->mtime, entry.mtime) ||
+        it->second->size != entry.size) {
+      copies.push_back(&entry);
+      continue;
+    }
+    const ExportManifest::Entry *old = it->second;
+    // a hard link's other names are copied
+    before.erase(it);
+    struct stat st;
+    if (old->path != entry.path) {
+      moves.push_back(std::make_pair(old, &entry));
+    } else if (lstat((destRoot + entry.path).c_str(), &st) == 0) {
+      ++_skipped;
+    } else {
+      copies.push_back(&entry);
+    }
+  }
+
+  // renamed copies go out of the way first, so that names swapped in the
+  // volume, or given to other files, are not written over
+  std::vector<string> staged;
+  for (size_t i = 0; i < moves.size(); ++i) {
+    string tmp(autosprintf("%s/.encfsctl-export-%i-%zu", destRoot.c_str(),
+                           (int)getpid(), i));
+    if (rename((destRoot + moves[i].first->path).c_str(), tmp.c_str()) != 0) {
+      tmp.clear();
+    }
+    staged.push_back(tmp);
+  }
+  // the copies of files gone from the volume
+  for (const auto &gone : before) {
+    if (current.count(gone.second->path) == 0) {
+      unlink((destRoot + gone.second->path).c_str());
+    }
+  }
+  for (size_t i = 0; i < moves.size(); ++i) {
+    string dest = destRoot + moves[i].second->path;
+    if (!staged[i].empty() && rename(staged[i].c_str(), dest.c_str()) == 0) {
+      ++_moved;
+    } else {
+      if (!staged[i].empty()) unlink(staged[i].c_str());
+      copies.push_back(moves[i].second);
+    }
+  }
+
+  int r = _jobs.run([this, &copies, &destRoot]() {
+    for (const ExportManifest::Entry *entry : copies) {
+      string plainPath = entry->path;
+      string destName = destRoot + entry->path;
+      _jobs.queue([this, plainPath, destName]() {
+        int r = copyContents(_rootInfo, plainPath.c_str(), destName.c_str(),
+                             _jobs.bytes);
+        ++_jobs.files;
+        return r;
+      });
+    }
+    return EXIT_SUCCESS;
+  });
+  if (r != EXIT_SUCCESS) {
+    return r;
+  }
+  _since->entries.swap(_found.entries);
+  return EXIT_SUCCESS;
+}
+
+static int cmd_export(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)std::max(1L, std::min(cpus, 16L));
+  bool progress = false;
+  string manifestPath;
+
+  static struct option long_options[] = {{"threads", 1, nullptr, 't'},
+                                         {"progress", 0, nullptr, 'P'},
+                                         {"since", 1, nullptr, 's'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        threads = (int)n;
+        break;
+      }
+      case 'P':
+        progress = true;
+        break;
+      case 's':
+        manifestPath = optarg;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  RootPtr rootInfo = initRootInfo(argv[optind]);
+
+  if (!rootInfo) return EXIT_FAILURE;
+
+  string destDir = argv[optind + 1];
+  // if the dir doesn't exist, then create it (with user permission)
+  if (!checkDir(destDir) && !userAllowMkdir(destDir.c_str(), 0700))
+    return EXIT_FAILURE;
+
+  Exporter exporter(rootInfo, threads, progress);
+  if (manifestPath.empty()) {
+    return exporter.run("/", destDir);
+  }
+
+  ExportManifest manifest;
+  if (!manifest.read(manifestPath)) return EXIT_FAILURE;
+  int r = exporter.run("/", destDir, &manifest);
+  if (r != EXIT_SUCCESS || !manifest.write(manifestPath)) return EXIT_FAILURE;
+  cerr << autosprintf(_("%llu files unchanged, %llu moved"),
+                      (unsigned long long)exporter.skipped(),
+                      (unsigned long long)exporter.moved())
+       << "\n";
+  return EXIT_SUCCESS;
+}
+
+// makes plainPath in the volume, with the permissions of srcSt, unless it
+// is there already.  It is kept writable by its owner, as it is filled in
+// after it is made.
+static int makeVolumeDir(DirNode &root, const string &plainPath,
+                         const struct stat &srcSt) {
+  string cpath = root.cipherPath(plainPath.c_str());
+  struct stat st;
+  if (lstat(cpath.c_str(), &st) == 0) {
+    if (S_ISDIR(st.st_mode)) return EXIT_SUCCESS;
+    cerr << plainPath << " is in the volume already, not as a directory\n";
+    return EXIT_FAILURE;
+  }
+
+  int res = root.mkdir(plainPath.c_str(), (srcSt.st_mode & 07777) | S_IRWXU);
+  if (res < 0) {
+    cerr << "unable to create " << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/*
+    Encrypts a plaintext tree into a volume through DirNode and FileNode, as
+    the mount would but without FUSE in between, copying files in runs of
+    whole blocks.  An import can be run again after it was interrupted: a
+    file is given the size and mtime of its source once it is complete, and
+    files that have both already are left alone.  Anything else found in
+    the way is copied again.
+ */
+class Importer {
+ public:
+  Importer(const std::shared_ptr<EncFS_Root> &rootInfo, int threads,
+           bool progress)
+      : _rootInfo(rootInfo), _jobs(threads, progress), _skipped(0) {}
+
+  // EXIT_SUCCESS once everything is copied, else EXIT_FAILURE
+  int run(const string &srcDir, const string &volumeDir);
+
+  // files found complete from an earlier run
+  uint64_t skipped() const { return _skipped; }
+
+ private:
+  Importer(const Importer &src);             // not allowed
+  Importer &operator=(const Importer &src);  // not allowed
+
+  int importDir(string srcDir, string volumeDir);
+  int importLink(const string &src, const string &plainPath);
+  int importFile(const string &src, const struct stat &srcSt,
+                 const string &plainPath);
+  int copyIn(int fd, const struct stat &srcSt, const string &plainPath);
+  bool imported(const string &plainPath, const struct stat &srcSt);
+
+  std::shared_ptr<EncFS_Root> _rootInfo;
+  CopyJobs _jobs;
+  std::atomic<uint64_t> _skipped;
+};
+
+int Importer::importDir(string srcDir, string volumeDir) {
+  if (!endsWith(srcDir, '/')) srcDir.append("/");
+  if (!endsWith(volumeDir, '/')) volumeDir.append("/");
+
+  std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(srcDir.c_str()), closedir);
+  if (!dp) {
+    cerr << "unable to read " << srcDir << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  for (struct dirent *de = readdir(dp.get()); de != nullptr;
+       de = readdir(dp.get())) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    string src = srcDir + de->d_name;
+    string plainPath = volumeDir + de->d_name;
+
+    struct stat stBuf;
+    if (lstat(src.c_str(), &stBuf) != 0) {
+      cerr << "unable to stat " << src << ": " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+    if (S_ISDIR(stBuf.st_mode)) {
+      int r = makeVolumeDir(*_rootInfo->root, plainPath, stBuf);
+      if (r != EXIT_SUCCESS) return r;
+      _jobs.queue(
+          [this, src, plainPath]() { return importDir(src, plainPath); });
+    } else if (S_ISLNK(stBuf.st_mode)) {
+      int r = importLink(src, plainPath);
+      if (r != EXIT_SUCCESS) return r;
+      ++_jobs.files;
+    } else if (S_ISREG(stBuf.st_mode)) {
+      _jobs.queue([this, src, stBuf, plainPath]() {
+        int r = importFile(src, stBuf, plainPath);
+        ++_jobs.files;
+        return r;
+      });
+    } else {
+      cerr << "skipping special file " << src << "\n";
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+// links are encoded as encfs_symlink does
+int Importer::importLink(const string &src, const string &plainPath) {
+  char target[PATH_MAX + 1];
+  ssize_t len = ::readlink(src.c_str(), target, PATH_MAX);
+  if (len < 0) {
+    cerr << "unable to read link " << src << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  target[len] = '\0';
+
+  string cpath = _rootInfo->root->cipherPath(plainPath.c_str());
+  struct stat st;
+  if (lstat(cpath.c_str(), &st) == 0) {
+    if (S_ISLNK(st.st_mode)) {
+      ++_skipped;
+      return EXIT_SUCCESS;
+    }
+    cerr << plainPath << " is in the volume already, not as a link\n";
+    return EXIT_FAILURE;
+  }
+
+  string ctarget = _rootInfo->root->relativeCipherPath(target);
+  if (ctarget.empty() || ::symlink(ctarget.c_str(), cpath.c_str()) != 0) {
+    cerr << "unable to create symlink " << plainPath << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+bool Importer::imported(const string &plainPath, const struct stat &srcSt) {
+  std::shared_ptr<FileNode> node =
+      _rootInfo->root->lookupNode(plainPath.c_str(), "encfsctl");
+  struct stat st;
+  return node && node->getAttr(&st) == 0 && S_ISREG(st.st_mode) &&
+         st.st_size == srcSt.st_size &&
+         st.st_mtim.tv_sec == srcSt.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == srcSt.st_mtim.tv_nsec;
+}
+
+int Importer::importFile(const string &src, const struct stat &srcSt,
+                         const string &plainPath) {
+  if (imported(plainPath, srcSt)) {
+    ++_skipped;
+    return EXIT_SUCCESS;
+  }
+
+  int fd = ::open(src.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "unable to open " << src << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  int r = copyIn(fd, srcSt, plainPath);
+  close(fd);
+  if (r != EXIT_SUCCESS) {
+    cerr << "unable to import " << src << "\n";
+  }
+  return r;
+}
+
+int Importer::copyIn(int fd, const struct stat &srcSt,
+                     const string &plainPath) {
+  DirNode &root = *_rootInfo->root;
+  string cpath = root.cipherPath(plainPath.c_str());
+
+  // what an interrupted run left is started over
+  struct stat st;
+  if (lstat(cpath.c_str(), &st) == 0 && root.unlink(plainPath.c_str()) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  std::shared_ptr<FileNode> node =
+      root.lookupNode(plainPath.c_str(), "encfsctl");
+  int res = node ? node->mknod(S_IFREG | S_IRUSR | S_IWUSR, 0) : -ENOENT;
+  if (res >= 0) res = node->open(O_RDWR);
+  if (res < 0) {
+    cerr << "unable to create " << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // holes in the source stay holes where the volume allows them, widened
+  // to whole blocks
+  bool holes = root.config()->config->allowHoles;
+  off_t blockSize = std::max(node->blockSize(), 1u);
+  std::vector<unsigned char> buf(contentsBufferSize(*node));
+  off_t size = srcSt.st_size;
+  for (off_t offset = 0; offset < size;) {
+    off_t end = size;
+    if (holes) {
+      off_t data = lseek(fd, offset, SEEK_DATA);
+      if (data < 0 && errno == ENXIO) break;  // only a hole is left
+      if (data >= 0) {
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        offset = data - data % blockSize;
+        if (hole >= 0) {
+          hole += (blockSize - hole % blockSize) % blockSize;
+          end = std::min(end, hole);
+        }
+      }
+    }
+
+    while (offset < end) {
+      size_t len = (size_t)std::min((off_t)buf.size(), end - offset);
+      ssize_t got = pread(fd, buf.data(), len, offset);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) {
+        cerr << plainPath << ": "
+             << (got < 0 ? strerror(errno) : "source changed while read")
+             << "\n";
+        return EXIT_FAILURE;
+      }
+      ssize_t wrote = node->write(offset, buf.data(), got);
+      if (wrote < 0) {
+        cerr << plainPath << ": " << strerror(-wrote) << "\n";
+        return EXIT_FAILURE;
+      }
+      offset += got;
+      _jobs.bytes.fetch_add(got, std::memory_order_relaxed);
+    }
+  }
+
+  res = node->truncate(size);
+  if (res >= 0) res = node->flush();
+  node.reset();
+  if (res < 0) {
+    cerr << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // the mtime goes last: it marks the file as complete
+  struct timespec times[2] = {srcSt.st_atim, srcSt.st_mtim};
+  if (::chmod(cpath.c_str(), srcSt.st_mode & 07777) != 0 ||
+      ::utimensat(AT_FDCWD, cpath.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+    cerr << plainPath << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int Importer::run(const string &srcDir, const string &volumeDir) {
+  return _jobs.run(
+      [this, srcDir, volumeDir]() { return importDir(srcDir, volumeDir); });
+}
+
+static int cmd_import(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)std::max(1L, std::min(cpus, 16L));
+  bool progress = false;
+
+  static struct option long_options[] = {{"threads", 1, nullptr, 't'},
+                                         {"progress", 0, nullptr, 'P'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        threads = (int)n;
+        break;
+      }
+      case 'P':
+        progress = true;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  string srcDir = argv[optind + 1];
+  if (!checkDir(srcDir)) return EXIT_FAILURE;
+
+  RootPtr rootInfo = initRootInfo(argv[optind]);
+  if (!rootInfo) return EXIT_FAILURE;
+
+  // a source inside the backing directory would import itself
+  char volumeReal[PATH_MAX];
+  char srcReal[PATH_MAX];
+  if (realpath(rootInfo->root->rootDirectory().c_str(), volumeReal) !=
+          nullptr &&
+      realpath(srcDir.c_str(), srcReal) != nullptr) {
+    string volume = string(volumeReal) + "/";
+    string src = string(srcReal) + "/";
+    if (src.compare(0, volume.length(), volume) == 0 ||
+        volume.compare(0, src.length(), src) == 0) {
+      cerr << _("The source and the volume must not contain each other")
+           << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  Importer importer(rootInfo, threads, progress);
+  int r = importer.run(srcDir, "/");
+  if (importer.skipped() > 0) {
+    cerr << autosprintf(_("%llu files were imported already"),
+                        (unsigned long long)importer.skipped())
+         << "\n";
+  }
+  return r;
+}
+
+// where an in-place conversion builds the new volume, in the old one's
+// backing directory, and the journal of a conversion in the new one's
+static const char ConvertDirName[] = ".encfsctl-convert";
+static const char ConvertJournalName[] = ".encfsctl-convert.journal";
+
+/*
+    The entries a conversion is done with, by their encoded path in the old
+    volume, a line each, so that a conversion that was interrupted carries
+    on where it stopped.  Only whole lines count: one cut short by a crash
+    is converted again.
+ */
+class ConvertJournal {
+ public:
+  ConvertJournal() : _fd(-1) { pthread_mutex_init(&_mutex, nullptr); }
+  ~ConvertJournal() {
+    if (_fd >= 0) close(_fd);
+    pthread_mutex_destroy(&_mutex);
+  }
+
+  // reads what path holds already, and opens it to add to
+  bool open(const string &path);
+  // with add(), safe from any thread: what open() read does not change
+  bool done(const string &cpath) const { return _done.count(cpath) != 0; }
+  bool add(const string &cpath);
+
+ private:
+  ConvertJournal(const ConvertJournal &src);             // not allowed
+  ConvertJournal &operator=(const ConvertJournal &src);  // not allowed
+
+  int _fd;
+  pthread_mutex_t _mutex;
+  std::unordered_set<string> _done;
+};
+
+bool ConvertJournal::open(const string &path) {
+  FILE *in = fopen(path.c_str(), "r");
+  if (in != nullptr) {
+    string line;
+    for (int c = getc(in); c != EOF; c = getc(in)) {
+      if (c == '\n') {
+        _done.insert(line);
+        line.clear();
+      } else {
+        line += (char)c;
+      }
+    }
+    fclose(in);
+  }
+
+  _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (_fd < 0) {
+    cerr << "unable to open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  // a line cut short is ended, so that what follows it is whole
+  struct stat st;
+  if (fstat(_fd, &st) == 0 && st.st_size > 0) {
+    char last = 0;
+    if (pread(_fd, &last, 1, st.st_size - 1) == 1 && last != '\n' &&
+        ::write(_fd, "\n", 1) != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ConvertJournal::add(const string &cpath) {
+  string line = cpath + '\n';
+  Lock lock(_mutex);
+  return ::write(_fd, line.data(), line.length()) == (ssize_t)line.length();
+}
+
+/*
+    Re-encrypts the contents of one volume into another, which may have a
+    different key, cipher, block size, MAC or name coding: directories are
+    made as they are found, and files, links and special files converted as
+    jobs on the walker's pool, read and written through FileNode in runs of
+    whole blocks of the new volume.  Every entry converted goes into the
+    journal; in place, the old copy is then removed, its new one synced
+    first.
+ */
+class Converter {
+ public:
+  Converter(const RootPtr &from, const RootPtr &to, ConvertJournal &journal,
+            bool inPlace, int threads, bool progress)
+      : _from(from),
+        _to(to),
+        _journal(journal),
+        _inPlace(inPlace),
+        _jobs(threads, progress),
+        _skipped(0) {}
+
+  // EXIT_SUCCESS once everything is converted, else EXIT_FAILURE
+  int run() {
+    return _jobs.run([this]() { return convertDir("/"); });
+  }
+
+  // entries done by an earlier run
+  uint64_t skipped() const { return _skipped; }
+
+ private:
+  Converter(const Converter &src);             // not allowed
+  Converter &operator=(const Converter &src);  // not allowed
+
+  int convertDir(const string &dirName);
+  int convertFile(const string &plainPath, const struct stat &st);
+  int convertLink(const string &plainPath, const struct stat &st);
+  int convertSpecial(const string &plainPath, const struct stat &st);
+  // sets the permissions and times of st on what plainPath was converted
+  // to, and records that it was
+  int finish(const string &plainPath, const string &journalPath,
+             const struct stat &st, bool setTimes);
+
+  RootPtr _from;
+  RootPtr _to;
+  ConvertJournal &_journal;
+  bool _inPlace;
+  CopyJobs _jobs;
+  std::atomic<uint64_t> _skipped;
+};
+
+int Converter::convertDir(const string &dirName) {
+  DirNode &from = *_from->root;
+  string prefix = dirName == "/" ? dirName : dirName + '/';
+
+  DirTraverse dt = from.openDir(dirName.c_str());
+  if (!dt.valid()) {
+    cerr << "unable to read " << from.cipherPath(dirName.c_str()) << "\n";
+    return EXIT_FAILURE;
+  }
+  string cipherName;
+  string plainName;
+  int fileType = 0;
+  while (dt.nextEntry(&cipherName, &plainName, &fileType)) {
+    if (dirName == "/" && cipherName == ConvertDirName) continue;
+    if (plainName.empty()) {
+      cerr << "skipping undecodable name " << cipherName << " in "
+           << from.cipherPath(dirName.c_str()) << "\n";
+      continue;
+    }
+    if (plainName == "." || plainName == "..") continue;
+
+    string plainPath = prefix + plainName;
+    string journalPath = from.cipherPathWithoutRoot(plainPath.c_str());
+    string cpath = from.cipherPath(plainPath.c_str());
+    struct stat st;
+    if (lstat(cpath.c_str(), &st) != 0) {
+      cerr << "unable to stat " << cpath << ": " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      int r = makeVolumeDir(*_to->root, plainPath, st);
+      if (r != EXIT_SUCCESS) return r;
+      _jobs.queue([this, plainPath]() { return convertDir(plainPath); });
+      continue;
+    }
+    if (_journal.done(journalPath)) {
+      // in place, the old copy goes once the new one is in the journal,
+      // which may be all an earlier run did not get to
+      if (_inPlace) ::unlink(cpath.c_str());
+      ++_skipped;
+      ++_jobs.files;
+      continue;
+    }
+    if (S_ISREG(st.st_mode)) {
+      _jobs.queue([this, plainPath, st]() {
+        int r = convertFile(plainPath, st);
+        ++_jobs.files;
+        return r;
+      });
+    } else {
+      int r = S_ISLNK(st.st_mode) ? convertLink(plainPath, st)
+                                  : convertSpecial(plainPath, st);
+      if (r != EXIT_SUCCESS) return r;
+      ++_jobs.files;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+int Converter::convertFile(const string &plainPath, const struct stat &st) {
+  DirNode &to = *_to->root;
+
+  // what an interrupted run left is started over
+  struct stat cur;
+  string newPath = to.cipherPath(plainPath.c_str());
+  if (lstat(newPath.c_str(), &cur) == 0 && to.unlink(plainPath.c_str()) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  int res = 0;
+  std::shared_ptr<FileNode> in =
+      _from->root->openNode(plainPath.c_str(), "encfsctl", O_RDONLY, &res);
+  if (!in) {
+    cerr << "unable to open " << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+  std::shared_ptr<FileNode> out = to.lookupNode(plainPath.c_str(), "encfsctl");
+  res = out ? out->mknod(S_IFREG | S_IRUSR | S_IWUSR, 0) : -ENOENT;
+  if (res >= 0) res = out->open(O_RDWR);
+  if (res < 0) {
+    cerr << "unable to create " << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // runs of zeros stay holes where the new volume allows them
+  bool holes = to.config()->config->allowHoles;
+  std::vector<unsigned char> buf(contentsBufferSize(*out));
+  off_t size = in->getSize();
+  for (off_t offset = 0; offset < size;) {
+    size_t len = (size_t)std::min((off_t)buf.size(), size - offset);
+    ssize_t got = in->read(offset, buf.data(), len);
+    if (got <= 0) {
+      cerr << plainPath << ": " << (got < 0 ? strerror(-got) : "short read")
+           << "\n";
+      return EXIT_FAILURE;
+    }
+    if (!holes || !BlockFileIO::isZero(buf.data(), got)) {
+      ssize_t wrote = out->write(offset, buf.data(), got);
+      if (wrote < 0) {
+        cerr << plainPath << ": " << strerror(-wrote) << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+    offset += got;
+    _jobs.bytes.fetch_add(got, std::memory_order_relaxed);
+  }
+
+  res = out->truncate(size);
+  if (res >= 0) res = out->flush();
+  // in place, the only other copy is removed next
+  if (res >= 0 && _inPlace) res = out->sync(true);
+  in.reset();
+  out.reset();
+  if (res < 0) {
+    cerr << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+  return finish(plainPath, _from->root->cipherPathWithoutRoot(plainPath.c_str()),
+                st, true);
+}
+
+// links are encoded as encfs_symlink does
+int Converter::convertLink(const string &plainPath, const struct stat &st) {
+  string cpath = _from->root->cipherPath(plainPath.c_str());
+  string target;
+  if (_from->root->readLink(AT_FDCWD, cpath.c_str(), st, &target) != 0 ||
+      target.empty()) {
+    cerr << "unable to read link " << plainPath << "\n";
+    return EXIT_FAILURE;
+  }
+
+  string newPath = _to->root->cipherPath(plainPath.c_str());
+  string ctarget = _to->root->relativeCipherPath(target.c_str());
+  ::unlink(newPath.c_str());
+  if (ctarget.empty() || ::symlink(ctarget.c_str(), newPath.c_str()) != 0) {
+    cerr << "unable to create symlink " << plainPath << "\n";
+    return EXIT_FAILURE;
+  }
+  return finish(plainPath, _from->root->cipherPathWithoutRoot(plainPath.c_str()),
+                st, false);
+}
+
+// fifos and device nodes; sockets belong to whoever listened on them
+int Converter::convertSpecial(const string &plainPath, const struct stat &st) {
+  if (S_ISSOCK(st.st_mode)) {
+    cerr << "skipping socket " << plainPath << "\n";
+    return EXIT_SUCCESS;
+  }
+  string newPath = _to->root->cipherPath(plainPath.c_str());
+  ::unlink(newPath.c_str());
+  std::shared_ptr<FileNode> node =
+      _to->root->lookupNode(plainPath.c_str(), "encfsctl");
+  int res = node ? node->mknod(st.st_mode, st.st_rdev) : -ENOENT;
+  if (res < 0) {
+    cerr << "unable to create " << plainPath << ": " << strerror(-res) << "\n";
+    return EXIT_FAILURE;
+  }
+  return finish(plainPath, _from->root->cipherPathWithoutRoot(plainPath.c_str()),
+                st, true);
+}
+
+int Converter::finish(const string &plainPath, const string &journalPath,
+                      const struct stat &st, bool setTimes) {
+  string newPath = _to->root->cipherPath(plainPath.c_str());
+  if (setTimes) {
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    if (::chmod(newPath.c_str(), st.st_mode & 07777) != 0 ||
+        ::utimensat(AT_FDCWD, newPath.c_str(), times, AT_SYMLINK_NOFOLLOW) !=
+            0) {
+      cerr << plainPath << ": " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  if (!_journal.add(journalPath)) {
+    cerr << "unable to write the journal: " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  if (_inPlace) {
+    string cpath = _from->root->cipherPath(plainPath.c_str());
+    if (::unlink(cpath.c_str()) != 0) {
+      cerr << "unable to remove " << cpath << ": " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+// removes the directories under and at path, which must hold nothing else
+static bool removeEmptyTree(const string &path) {
+  std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(path.c_str()), closedir);
+  if (!dp) {
+    cerr << "unable to read " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  for (struct dirent *de = readdir(dp.get()); de != nullptr;
+       de = readdir(dp.get())) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    string child = path + '/' + de->d_name;
+    struct stat st;
+    if (lstat(child.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      cerr << "not converted: " << child << "\n";
+      return false;
+    }
+    if (!removeEmptyTree(child)) return false;
+  }
+  if (::rmdir(path.c_str()) != 0) {
+    cerr << "unable to remove " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+/*
+    The end of an in-place conversion, once every entry is in the new
+    volume, which can be run again if it is interrupted.  While the new
+    config is still in convertDir, the old tree holds nothing but
+    directories, which are removed before the config replaces the old one.
+    Then the new tree moves up into rootDir.
+ */
+static int finishInPlace(const string &rootDir, const string &convertDir) {
+  string newConfig = convertDir + ".encfs6.xml";
+  if (access(newConfig.c_str(), F_OK) == 0) {
+    std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(rootDir.c_str()),
+                                             closedir);
+    if (!dp) return EXIT_FAILURE;
+    for (struct dirent *de = readdir(dp.get()); de != nullptr;
+         de = readdir(dp.get())) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+          strcmp(de->d_name, ConvertDirName) == 0 ||
+          strcmp(de->d_name, ".encfs6.xml") == 0) {
+        continue;
+      }
+      // the copy of the old config, stale once the new one is in place
+      if (strcmp(de->d_name, ".encfs6.xml.bin") == 0) {
+        ::unlink((rootDir + de->d_name).c_str());
+        continue;
+      }
+      string path = rootDir + de->d_name;
+      struct stat st;
+      if (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        cerr << "not converted: " << path << "\n";
+        return EXIT_FAILURE;
+      }
+      if (!removeEmptyTree(path)) return EXIT_FAILURE;
+    }
+    if (::rename(newConfig.c_str(), (rootDir + ".encfs6.xml").c_str()) != 0) {
+      cerr << "unable to replace the config: " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(convertDir.c_str()),
+                                           closedir);
+  if (!dp) return EXIT_FAILURE;
+  for (struct dirent *de = readdir(dp.get()); de != nullptr;
+       de = readdir(dp.get())) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+        strcmp(de->d_name, ConvertJournalName) == 0) {
+      continue;
+    }
+    if (::rename((convertDir + de->d_name).c_str(),
+                 (rootDir + de->d_name).c_str()) != 0) {
+      cerr << "unable to move " << convertDir << de->d_name << ": "
+           << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  ::unlink((convertDir + ConvertJournalName).c_str());
+  if (::rmdir(convertDir.c_str()) != 0) {
+    cerr << "unable to remove " << convertDir << ": " << strerror(errno)
+         << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int cmd_convert(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)std::max(1L, std::min(cpus, 16L));
+  bool progress = false;
+  bool inPlace = strcmp(argv[0], "rekey") == 0;
+  ConfigMode configMode = Config_Prompt;
+
+  static struct option long_options[] = {{"threads", 1, nullptr, 't'},
+                                         {"progress", 0, nullptr, 'P'},
+                                         {"in-place", 0, nullptr, 'i'},
+                                         {"standard", 0, nullptr, '1'},
+                                         {"paranoia", 0, nullptr, '2'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        threads = (int)n;
+        break;
+      }
+      case 'P':
+        progress = true;
+        break;
+      case 'i':
+        inPlace = true;
+        break;
+      case '1':
+        configMode = Config_Standard;
+        break;
+      case '2':
+        configMode = Config_Paranoia;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != (inPlace ? 1 : 2)) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  string rootDir = argv[optind];
+  if (!checkDir(rootDir)) return EXIT_FAILURE;
+
+  string newRoot;
+  if (inPlace) {
+    // both configs have to be where the volumes are, to be told apart
+    if (getenv("ENCFS6_CONFIG") != nullptr ||
+        access((rootDir + ".encfs6.xml").c_str(), F_OK) != 0) {
+      cerr << _("An in-place conversion needs the config in the root dir")
+           << "\n";
+      return EXIT_FAILURE;
+    }
+    newRoot = rootDir + ConvertDirName + "/";
+    if (isDirectory(newRoot.c_str()) &&
+        access((newRoot + ".encfs6.xml").c_str(), F_OK) != 0 &&
+        access((newRoot + ConvertJournalName).c_str(), F_OK) == 0) {
+      // every entry was converted, and the new config moved up already
+      return finishInPlace(rootDir, newRoot);
+    }
+    if (::mkdir(newRoot.c_str(), 0700) != 0 && errno != EEXIST) {
+      cerr << "unable to create " << newRoot << ": " << strerror(errno)
+           << "\n";
+      return EXIT_FAILURE;
+    }
+  } else {
+    newRoot = argv[optind + 1];
+    // if the dir doesn't exist, then create it (with user permission)
+    if (!checkDir(newRoot) &&
+        (!userAllowMkdir(newRoot.c_str(), 0700) || !checkDir(newRoot))) {
+      return EXIT_FAILURE;
+    }
+    char fromReal[PATH_MAX];
+    char toReal[PATH_MAX];
+    if (realpath(rootDir.c_str(), fromReal) != nullptr &&
+        realpath(newRoot.c_str(), toReal) != nullptr) {
+      string from = string(fromReal) + "/";
+      string to = string(toReal) + "/";
+      if (from.compare(0, to.length(), to) == 0 ||
+          to.compare(0, from.length(), from) == 0) {
+        cerr << _("The volumes must not contain each other, see --in-place")
+             << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  // a volume there already is only carried on with when its conversion is
+  string journalPath = newRoot + ConvertJournalName;
+  bool resuming = access(journalPath.c_str(), F_OK) == 0;
+  if (!resuming && access((newRoot + ".encfs6.xml").c_str(), F_OK) == 0) {
+    cerr << autosprintf(_("%s holds a volume already"), newRoot.c_str())
+         << "\n";
+    return EXIT_FAILURE;
+  }
+  ConvertJournal journal;
+  if (!journal.open(journalPath)) return EXIT_FAILURE;
+
+  cout << _("The volume to convert:") << "\n";
+  RootPtr from = initRootInfo(rootDir.c_str());
+  if (!from) return EXIT_FAILURE;
+
+  cout << (resuming ? _("Carrying on converting into:")
+                    : _("The volume to convert into:"))
+       << "\n";
+  std::shared_ptr<EncFS_Opts> opts(new EncFS_Opts());
+  opts->rootDir = newRoot;
+  opts->createIfNotFound = true;
+  opts->checkKey = true;
+  opts->configMode = configMode;
+  RootPtr to = initFS(ctx.get(), opts);
+  if (!to) {
+    cerr << _("Unable to initialize encrypted filesystem - check path.\n");
+    return EXIT_FAILURE;
+  }
+
+  Converter converter(from, to, journal, inPlace, threads, progress);
+  int r = converter.run();
+  if (converter.skipped() > 0) {
+    cerr << autosprintf(_("%llu files were converted already"),
+                        (unsigned long long)converter.skipped())
+         << "\n";
+  }
+  if (r != EXIT_SUCCESS) {
+    cerr << _("Run the same command again to carry on") << "\n";
+    return r;
+  }
+
+  if (inPlace) {
+    from.reset();
+    to.reset();
+    return finishInPlace(rootDir, newRoot);
+  }
+  ::unlink(journalPath.c_str());
+  return EXIT_SUCCESS;
+}
+
+/*
+    Checks a whole volume: the names of every directory decode, and so do
+    the headers of files and the targets of links.  On volumes whose blocks
+    carry a MAC, or are authenticated by the cipher, every block of every
+    file is read as well, in large runs; a run that fails is read again a
+    block at a time to find the blocks that are corrupt.  Directories and
+    files are checked as jobs on a pool of threads, all reads paced by one
+    RateLimit.
+ */
+class Verifier {
+ public:
+  Verifier(const std::shared_ptr<EncFS_Root> &rootInfo, int threads,
+           bool progress, uint64_t bytesPerSecond);
+  ~Verifier();
+
+  // EXIT_SUCCESS if nothing was found wrong, else EXIT_FAILURE
+  int run();
+
+ private:
+  Verifier(const Verifier &src);             // not allowed
+  Verifier &operator=(const Verifier &src);  // not allowed
+
+  int verifyDir(const string &dirName);
+  int verifyFile(const string &plainPath);
+  void verifyLink(const string &plainPath);
+  // reads len bytes at offset, a block at a time, reporting bad blocks
+  void findCorrupt(const FileNode &node, const string &plainPath,
+                   off_t offset, size_t len, unsigned char *buf);
+  void report(const autosprintf &line);
+
+  std::shared_ptr<EncFS_Root> _rootInfo;
+  CopyJobs _jobs;
+  RateLimit _rate;
+  bool _readData;  // read every block, not only the header
+
+  pthread_mutex_t _mutex;  // one report at a time on cout
+  std::atomic<uint64_t> _badNames;
+  std::atomic<uint64_t> _badFiles;
+  std::atomic<uint64_t> _badBlocks;
+};
+
+Verifier::Verifier(const std::shared_ptr<EncFS_Root> &rootInfo, int threads,
+                   bool progress, uint64_t bytesPerSecond)
+    : _rootInfo(rootInfo),
+      _jobs(threads, progress),
+      _rate(bytesPerSecond),
+      _badNames(0),
+      _badFiles(0),
+      _badBlocks(0) {
+  const FSConfigPtr &cfg = rootInfo->root->config();
+  _readData = cfg->config->blockMACBytes != 0 ||
+              cfg->cipher->aeadHeaderSize() > 0;
+  pthread_mutex_init(&_mutex, nullptr);
+}
+
+Verifier::~Verifier() { pthread_mutex_destroy(&_mutex); }
+
+void Verifier::report(const autosprintf &line) {
+  Lock lock(_mutex);
+  cout << line << "\n" << flush;
+}
+
+int Verifier::verifyDir(const string &dirName) {
+  DirNode &root = *_rootInfo->root;
+  string cdir = root.cipherPath(dirName.c_str());
+  string prefix = dirName == "/" ? dirName : dirName + '/';
+
+  DirTraverse dt = root.openDir(dirName.c_str());
+  if (!dt.valid()) {
+    report(autosprintf(_("unreadable directory %s"), dirName.c_str()));
+    ++_badNames;
+    return EXIT_SUCCESS;
+  }
+  for (string name = dt.nextInvalid(); !name.empty(); name = dt.nextInvalid()) {
+    report(autosprintf(_("undecodable name %s/%s"), cdir.c_str(),
+                       name.c_str()));
+    ++_badNames;
+  }
+
+  dt = root.openDir(dirName.c_str());
+  int fileType = 0;
+  for (string name = dt.nextPlaintextName(&fileType); !name.empty();
+       name = dt.nextPlaintextName(&fileType)) {
+    if (name == "." || name == "..") continue;
+    string plainPath = prefix + name;
+
+    if (fileType == DT_UNKNOWN) {
+      struct stat st;
+      string cpath = root.cipherPath(plainPath.c_str());
+      if (lstat(cpath.c_str(), &st) != 0) continue;
+      fileType = IFTODT(st.st_mode);
+    }
+    if (fileType == DT_DIR) {
+      _jobs.queue([this, plainPath]() { return verifyDir(plainPath); });
+    } else if (fileType == DT_LNK) {
+      verifyLink(plainPath);
+      ++_jobs.files;
+    } else if (fileType == DT_REG) {
+      _jobs.queue([this, plainPath]() {
+        int r = verifyFile(plainPath);
+        ++_jobs.files;
+        return r;
+      });
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+void Verifier::verifyLink(const string &plainPath) {
+  string cpath = _rootInfo->root->cipherPath(plainPath.c_str());
+  struct stat st;
+  string target;
+  if (lstat(cpath.c_str(), &st) != 0 ||
+      _rootInfo->root->readLink(AT_FDCWD, cpath.c_str(), st, &target) != 0 ||
+      target.empty()) {
+    report(autosprintf(_("undecodable link %s"), plainPath.c_str()));
+    ++_badNames;
+  }
+}
+
+int Verifier::verifyFile(const string &plainPath) {
+  int res = 0;
+  std::shared_ptr<FileNode> node =
+      _rootInfo->root->openNode(plainPath.c_str(), "encfsctl", O_RDONLY, &res);
+  if (!node) {
+    report(autosprintf(_("unreadable file %s: %s"), plainPath.c_str(),
+                       strerror(-res)));
+    ++_badFiles;
+    return EXIT_SUCCESS;
+  }
+
+  // decoding the first block decodes the header of the file
+  off_t size = node->getSize();
+  size_t blockSize = std::max(node->blockSize(), 1u);
+  std::vector<unsigned char> buf(_readData ? contentsBufferSize(*node)
+                                           : blockSize);
+  if (!_readData) {
+    size = std::min(size, (off_t)blockSize);
+  }
+
+  uint64_t before = _badBlocks;
+  for (off_t offset = 0; offset < size; offset += buf.size()) {
+    size_t len = (size_t)std::min((off_t)buf.size(), size - offset);
+    _rate.take(len);
+    ssize_t bytes = node->read(offset, buf.data(), len);
+    if (bytes != (ssize_t)len) {
+      findCorrupt(*node, plainPath, offset, len, buf.data());
+    }
+    _jobs.bytes.fetch_add(len, std::memory_order_relaxed);
+  }
+  if (_badBlocks != before) {
+    ++_badFiles;
+  }
+  return EXIT_SUCCESS;
+}
+
+void Verifier::findCorrupt(const FileNode &node, const string &plainPath,
+                           off_t offset, size_t len, unsigned char *buf) {
+  size_t blockSize = std::max(node.blockSize(), 1u);
+  for (size_t done = 0; done < len; done += blockSize) {
+    size_t n = std::min(blockSize, len - done);
+    ssize_t bytes = node.read(offset + done, buf, n);
+    if (bytes != (ssize_t)n) {
+      report(autosprintf(_("corrupt block %lli of %s: %s"),
+                         (long long)((offset + done) / blockSize),
+                         plainPath.c_str(),
+                         bytes < 0 ? strerror(-bytes) : _("short read")));
+      ++_badBlocks;
+    }
+  }
+}
+
+int Verifier::run() {
+  int r = _jobs.run([this]() { return verifyDir("/"); });
+
+  cout << autosprintf(_("%llu files, %llu MiB checked: %llu corrupt blocks "
+                        "in %llu files, %llu undecodable names"),
+                      (unsigned long long)_jobs.files,
+                      (unsigned long long)(_jobs.bytes / (1024 * 1024)),
+                      (unsigned long long)_badBlocks,
+                      (unsigned long long)_badFiles,
+                      (unsigned long long)_badNames)
+       << "\n";
+  if (r != EXIT_SUCCESS || _badNames > 0 || _badFiles > 0) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int cmd_verify(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)std::max(1L, std::min(cpus, 16L));
+  bool progress = false;
+  uint64_t rate = 0;
+
+  static struct option long_options[] = {{"threads", 1, nullptr, 't'},
+                                         {"rate", 1, nullptr, 'r'},
+                                         {"progress", 0, nullptr, 'P'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        threads = (int)n;
+        break;
+      }
+      case 'r': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 1024 * 1024) {
+          cerr << autosprintf(_("Invalid rate: %s"), optarg) << "\n";
+          return EXIT_FAILURE;
+        }
+        rate = (uint64_t)n * 1024 * 1024;
+        break;
+      }
+      case 'P':
+        progress = true;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 1) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  RootPtr rootInfo = initRootInfo(argv[optind]);
+  if (!rootInfo) return EXIT_FAILURE;
+
+  Verifier verifier(rootInfo, threads, progress, rate);
+  return verifier.run();
+}
+
+static int cmd_changes(int argc, char **argv) {
+  std::shared_ptr<EncFS_Opts> opts(new EncFS_Opts());
+  opts->createIfNotFound = false;
+  opts->checkKey = false;
+  opts->reverseEncryption = true;
+  string indexPath;
+  string since;
+
+  static struct option long_options[] = {{"extpass", 1, nullptr, 'p'},
+                                         {"index", 1, nullptr, 'i'},
+                                         {"since", 1, nullptr, 's'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 'p':
+        opts->passwordProgram.assign(optarg);
+        break;
+      case 'i':
+        indexPath = optarg;
+        break;
+      case 's':
+        since = optarg;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 1 || indexPath.empty()) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+  if (indexPath[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+      cerr << _("Unable to find the current directory") << "\n";
+      return EXIT_FAILURE;
+    }
+    indexPath = string(cwd) + '/' + indexPath;
+  }
+
+  opts->rootDir = argv[optind];
+  if (!checkDir(opts->rootDir)) return EXIT_FAILURE;
+  ctx->publicFilesystem = opts->ownerCreate;
+  RootPtr rootInfo = initFS(ctx.get(), opts);
+  if (!rootInfo) {
+    cerr << _("Unable to initialize encrypted filesystem - check path.\n");
+    return EXIT_FAILURE;
+  }
+
+  ChangeIndex index(indexPath);
+  if (!index.load()) return EXIT_FAILURE;
+  int res = index.scan(opts->rootDir);
+  if (res == 0) res = index.save();
+  if (res < 0) {
+    cerr << autosprintf(_("Unable to update the change index %s: %s"),
+                        indexPath.c_str(), strerror(-res))
+         << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // the answer is listed after the scan is saved, so that a caller that
+  // fails part way can ask again with its old token
+  std::vector<std::pair<bool, string>> changes;
+  bool known = index.changesSince(
+      since, [&changes](bool deleted, const string &path) {
+        changes.push_back(std::make_pair(deleted, path));
+      });
+  if (!known) cout << "full\n";
+  for (const auto &change : changes) {
+    // in reverse mode, "decoding" a source path gives its encoded path
+    string encoded = rootInfo->root->plainPath(change.second.c_str());
+    if (encoded.empty()) {
+      cerr << autosprintf(_("Unable to encode %s"), change.second.c_str())
+           << "\n";
+      return EXIT_FAILURE;
+    }
+    cout << (change.first ? "- " : "+ ") << encoded << "\n";
+  }
+  cout << "token " << index.token() << "\n";
+  return cout.good() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+    encfsctl bench: how fast a volume codes file contents and names,
+    measured offline on scratch files of its own.  The files live in a
+    directory in the backing root, removed when done, reached through
+    DirNodes that share the volume's key and codings but none of its caches
+    or pools, so that every read codes its blocks again and the thread
+    sweep is not mixed up with the crypto pool.  The backing files themselves
+    are read from the page cache.
+ */
+
+// bytes moved at a time by the random I/O runs
+static const int BenchIOSize = 4096;
+// random reads and writes per run, at most
+static const int BenchRandomOps = 16384;
+// paths encoded and decoded by the name run
+static const int BenchNames = 20000;
+
+struct BenchResult {
+  int macBytes;
+  double seqWrite;   // MiB/s
+  double seqRead;    // MiB/s
+  double randRead;   // BenchIOSize ops/s
+  double randWrite;  // BenchIOSize ops/s
+};
+
+static double perSecond(double amount, uint64_t startNs) {
+  uint64_t ns = std::max(OpStats::now() - startNs, (uint64_t)1);
+  return amount * 1e9 / ns;
+}
+
+// xorshift64, so that every run reads and writes the same offsets
+static uint64_t nextRandom(uint64_t &state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+// the volume's configuration with the given MAC header, without caches
+static FSConfigPtr benchConfig(const FSConfigPtr &volume, int macBytes) {
+  FSConfigPtr cfg = std::make_shared<FSConfig>(*volume);
+  cfg->config = std::make_shared<EncFSConfig>(*volume->config);
+  if (cfg->config->blockMACBytes != macBytes) {
+    cfg->config->blockMACBytes = macBytes;
+    cfg->config->blockMACRandBytes = 0;
+  }
+  cfg->blockCache.reset();
+  cfg->ivCache.reset();
+  cfg->pathCache.reset();
+  cfg->negativeCache.reset();
+  cfg->attrCache.reset();
+  cfg->xattrCache.reset();
+  cfg->linkCache.reset();
+  cfg->readAheadPool.reset();
+  cfg->cryptoPool.reset();
+  return cfg;
+}
+
+// writes, reads back and then reads and writes at random a file of size
+// bytes of random data, so that no block passes through as a hole
+static bool benchData(DirNode &dir, const char *name, off_t size,
+                      BenchResult *out) {
+  std::shared_ptr<FileNode> node = dir.lookupNode(name, "encfsctl");
+  int res = node ? node->mknod(S_IFREG | 0600, 0) : -ENOENT;
+  if (res >= 0) res = node->open(O_RDWR);
+  if (res < 0) {
+    cerr << "unable to create " << name << ": " << strerror(-res) << "\n";
+    return false;
+  }
+
+  std::vector<unsigned char> buf(contentsBufferSize(*node));
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = (unsigned char)nextRandom(seed);
+  }
+  double mib = (double)size / (1024 * 1024);
+
+  uint64_t start = OpStats::now();
+  for (off_t offset = 0; offset < size; offset += buf.size()) {
+    size_t len = (size_t)std::min((off_t)buf.size(), size - offset);
+    if (node->write(offset, buf.data(), len) != (ssize_t)len) {
+      cerr << "unable to write " << name << "\n";
+      return false;
+    }
+  }
+  if (node->flush() < 0) return false;
+  out->seqWrite = perSecond(mib, start);
+
+  start = OpStats::now();
+  for (off_t offset = 0; offset < size; offset += buf.size()) {
+    size_t len = (size_t)std::min((off_t)buf.size(), size - offset);
+    if (node->read(offset, buf.data(), len) != (ssize_t)len) {
+      cerr << "unable to read " << name << "\n";
+      return false;
+    }
+  }
+  out->seqRead = perSecond(mib, start);
+
+  off_t blocks = size / BenchIOSize;
+  int ops = (int)std::min(blocks, (off_t)BenchRandomOps);
+  start = OpStats::now();
+  for (int i = 0; i < ops; ++i) {
+    off_t offset = (off_t)(nextRandom(seed) % blocks) * BenchIOSize;
+    if (node->read(offset, buf.data(), BenchIOSize) != BenchIOSize) {
+      cerr << "unable to read " << name << "\n";
+      return false;
+    }
+  }
+  out->randRead = perSecond(ops, start);
+
+  start = OpStats::now();
+  for (int i = 0; i < ops; ++i) {
+    off_t offset = (off_t)(nextRandom(seed) % blocks) * BenchIOSize;
+    if (node->write(offset, buf.data(), BenchIOSize) != BenchIOSize) {
+      cerr << "unable to write " << name << "\n";
+      return false;
+    }
+  }
+  if (node->flush() < 0) return false;
+  out->randWrite = perSecond(ops, start);
+
+  return true;
+}
+
+// reads the size bytes of name with threads readers at once, each taking
+// every threads'th run of blocks.  MiB/s, or -1 if a read failed.
+static double benchThreads(DirNode &dir, const char *name, off_t size,
+                           int threads) {
+  int res = 0;
+  std::shared_ptr<FileNode> node =
+      dir.openNode(name, "encfsctl", O_RDONLY, &res);
+  if (!node) return -1;
+
+  size_t chunk = contentsBufferSize(*node);
+  int runs = (int)((size + chunk - 1) / chunk);
+  ThreadPool pool(threads - 1);
+
+  uint64_t start = OpStats::now();
+  bool ok = pool.forEach(threads, [&](int reader) {
+    std::vector<unsigned char> buf(chunk);
+    for (int run = reader; run < runs; run += threads) {
+      off_t offset = (off_t)run * chunk;
+      size_t len = (size_t)std::min((off_t)chunk, size - offset);
+      if (node->read(offset, buf.data(), len) != (ssize_t)len) return false;
+    }
+    return true;
+  });
+  double rate = perSecond((double)size / (1024 * 1024), start);
+  return ok ? rate : -1;
+}
+
+// encodes BenchNames paths and decodes them again, in paths a second
+static bool benchNames(DirNode &dir, double *encodeRate, double *decodeRate) {
+  std::vector<string> plain;
+  std::vector<string> encoded;
+  plain.reserve(BenchNames);
+  encoded.reserve(BenchNames);
+  char path[64];
+  for (int i = 0; i < BenchNames; ++i) {
+    snprintf(path, sizeof(path), "/dir-%02d/file-%06d.txt", i % 16, i);
+    plain.push_back(path);
+  }
+
+  uint64_t start = OpStats::now();
+  for (const string &p : plain) {
+    encoded.push_back(dir.cipherPathWithoutRoot(p.c_str()));
+  }
+  *encodeRate = perSecond(BenchNames, start);
+
+  bool ok = true;
+  start = OpStats::now();
+  for (int i = 0; i < BenchNames; ++i) {
+    if (dir.plainPath(encoded[i].c_str()) != plain[i]) ok = false;
+  }
+  *decodeRate = perSecond(BenchNames, start);
+
+  if (!ok) cerr << "names did not decode to what was encoded\n";
+  return ok;
+}
+
+// removes the scratch directory of a bench and what is in it
+static void removeBenchDir(const string &dir) {
+  std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(dir.c_str()), closedir);
+  if (dp) {
+    for (struct dirent *de = readdir(dp.get()); de != nullptr;
+         de = readdir(dp.get())) {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+        unlink((dir + de->d_name).c_str());
+      }
+    }
+  }
+  rmdir(dir.c_str());
+}
+
+static void showBench(const FSConfigPtr &cfg, off_t size,
+                      const std::vector<BenchResult> &data, double encodeRate,
+                      double decodeRate,
+                      const std::vector<std::pair<int, double>> &sweep,
+                      bool json) {
+  int volumeMAC = cfg->config->blockMACBytes;
+  if (json) {
+    cout << "{\"size\": " << size
+         << ", \"blockSize\": " << cfg->config->blockSize
+         << ", \"data\": [";
+    for (size_t i = 0; i < data.size(); ++i) {
+      const BenchResult &r = data[i];
+      cout << (i ? ", " : "")
+           << autosprintf("{\"macBytes\": %i, \"volume\": %s, "
+                          "\"seqWriteMiBps\": %.1f, \"seqReadMiBps\": %.1f, "
+                          "\"randReadIOPS\": %.0f, \"randWriteIOPS\": %.0f}",
+                          r.macBytes, r.macBytes == volumeMAC ? "true" : "false",
+                          r.seqWrite, r.seqRead, r.randRead, r.randWrite);
+    }
+    cout << "], "
+         << autosprintf("\"names\": {\"count\": %i, \"encodePerSec\": %.0f, "
+                        "\"decodePerSec\": %.0f}",
+                        BenchNames, encodeRate, decodeRate)
+         << ", \"threads\": [";
+    for (size_t i = 0; i < sweep.size(); ++i) {
+      cout << (i ? ", " : "")
+           << autosprintf("{\"threads\": %i, \"seqReadMiBps\": %.1f}",
+                          sweep[i].first, sweep[i].second);
+    }
+    cout << "]}\n";
+    return;
+  }
+
+  cout << autosprintf(_("%lli MiB file, %i byte blocks, %i byte I/O at random"),
+                      (long long)(size / (1024 * 1024)),
+                      cfg->config->blockSize, BenchIOSize)
+       << "\n\n"
+       << autosprintf("%-20s %10s %10s %10s %10s\n", "", _("seq write"),
+                      _("seq read"), _("rand read"), _("rand write"))
+       << autosprintf("%-20s %10s %10s %10s %10s\n", "", "MiB/s", "MiB/s",
+                      "IOPS", "IOPS");
+  for (const BenchResult &r : data) {
+    string label = r.macBytes != 0
+                       ? string(autosprintf(_("MAC %i bytes"), r.macBytes))
+                       : string(_("no MAC"));
+    if (r.macBytes == volumeMAC) label += _(" (volume)");
+    cout << autosprintf("%-20s %10.1f %10.1f %10.0f %10.0f\n", label.c_str(),
+                        r.seqWrite, r.seqRead, r.randRead, r.randWrite);
+  }
+  cout << "\n"
+       << autosprintf(_("names: %.0f encoded/s, %.0f decoded/s"), encodeRate,
+                      decodeRate)
+       << "\n\n"
+       << autosprintf("%-8s %10s\n", _("threads"), _("seq read"));
+  for (const std::pair<int, double> &s : sweep) {
+    cout << autosprintf("%-8i %10.1f\n", s.first, s.second);
+  }
+}
+
+static int cmd_bench(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxThreads = (int)std::max(1L, std::min(cpus, 16L));
+  off_t size = 64 * 1024 * 1024;
+  bool json = false;
+
+  static struct option long_options[] = {{"size", 1, nullptr, 's'},
+                                         {"threads", 1, nullptr, 't'},
+                                         {"json", 0, nullptr, 'j'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 's': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 65536) {
+          cerr << autosprintf(_("Invalid size: %s"), optarg) << "\n";
+          return EXIT_FAILURE;
+        }
+        size = (off_t)n * 1024 * 1024;
+        break;
+      }
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        maxThreads = (int)n;
+        break;
+      }
+      case 'j':
+        json = true;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 1) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  RootPtr rootInfo = initRootInfo(argv[optind]);
+  if (!rootInfo) return EXIT_FAILURE;
+
+  const FSConfigPtr &volume = rootInfo->root->config();
+  string scratch = rootInfo->root->rootDirectory() + "/.encfsctl-bench.XXXXXX";
+  if (mkdtemp(&scratch[0]) == nullptr) {
+    cerr << "unable to create " << scratch << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  scratch.append("/");
+
+  // the volume as configured, and with the MAC header toggled, where a MAC
+  // can be had: not on plain data or on ciphers authenticating each block
+  std::vector<int> macs(1, volume->config->blockMACBytes);
+  if (!volume->config->plainData && volume->cipher->aeadHeaderSize() == 0) {
+    macs.push_back(volume->config->blockMACBytes != 0 ? 0 : 8);
+  }
+
+  std::vector<BenchResult> data;
+  std::vector<std::pair<int, double>> sweep;
+  double encodeRate = 0, decodeRate = 0;
+  bool ok = true;
+  try {
+    DirNode dir(ctx.get(), scratch, benchConfig(volume, macs[0]));
+    for (size_t i = 0; ok && i < macs.size(); ++i) {
+      DirNode macDir(ctx.get(), scratch, benchConfig(volume, macs[i]));
+      BenchResult r;
+      r.macBytes = macs[i];
+      string name = string(autosprintf("/data-%i", macs[i]));
+      ok = benchData(macDir, name.c_str(), size, &r);
+      data.push_back(r);
+    }
+
+    if (ok) ok = benchNames(dir, &encodeRate, &decodeRate);
+
+    string name = string(autosprintf("/data-%i", macs[0]));
+    for (int threads = 1; ok; threads = std::min(threads * 2, maxThreads)) {
+      double rate = benchThreads(dir, name.c_str(), size, threads);
+      ok = rate >= 0;
+      sweep.push_back(std::make_pair(threads, rate));
+      if (threads == maxThreads) break;
+    }
+  } catch (encfs::Error &err) {
+    cerr << "bench failed: " << err.what() << "\n";
+    ok = false;
+  }
+  removeBenchDir(scratch);
+
+  if (!ok) return EXIT_FAILURE;
+  showBench(volume, size, data, encodeRate, decodeRate, sweep, json);
+  return EXIT_SUCCESS;
+}
+
+// str as a JSON string, quoted; bytes that are not printable ASCII are
+// escaped one by one, as names need not be UTF-8
+static string jsonString(const string &str) {
+  string out = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += (char)c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += (char)c;
+    }
+  }
+  return out + "\"";
+}
+
+/*
+    Finds the names of a volume that do not decode.  Each directory is read
+    once, its names decoded in batches on the crypto pool, and is a job on
+    the walker's pool; the names found are printed a directory at a time,
+    or as one JSON object a line.
+ */
+class CruftFinder {
+ public:
+  CruftFinder(const std::shared_ptr<EncFS_Root> &rootInfo, int threads,
+              bool json)
+      : _rootInfo(rootInfo), _jobs(threads, false), _json(json), _found(0) {
+    pthread_mutex_init(&_mutex, nullptr);
+  }
+  ~CruftFinder() { pthread_mutex_destroy(&_mutex); }
+
+  // the number of undecodable names, or -1 if the walk failed
+  int run();
+
+ private:
+  CruftFinder(const CruftFinder &src);             // not allowed
+  CruftFinder &operator=(const CruftFinder &src);  // not allowed
+
+  int findDir(const string &dirName);
+
+  std::shared_ptr<EncFS_Root> _rootInfo;
+  CopyJobs _jobs;
+  bool _json;
+  pthread_mutex_t _mutex;  // one directory at a time on cout
+  std::atomic<int> _found;
+};
+
+int CruftFinder::findDir(const string &dirName) {
+  DirNode &root = *_rootInfo->root;
+  string prefix = dirName == "/" ? dirName : dirName + '/';
+
+  DirTraverse dt = root.openDir(dirName.c_str());
+  if (!dt.valid()) return EXIT_SUCCESS;
+
+  std::vector<string> invalid;
+  string cipherName;
+  string plainName;
+  int fileType = 0;
+  while (dt.nextEntry(&cipherName, &plainName, &fileType)) {
+    if (plainName.empty()) {
+      invalid.push_back(cipherName);
+      continue;
+    }
+    if (plainName == "." || plainName == "..") continue;
+
+    string plainPath = prefix + plainName;
+    if (fileType == DT_UNKNOWN) {
+      string cpath = root.cipherPath(plainPath.c_str());
+      fileType = isDirectory(cpath.c_str()) ? DT_DIR : DT_REG;
+    }
+    if (fileType == DT_DIR) {
+      _jobs.queue([this, plainPath]() { return findDir(plainPath); });
+    }
+  }
+
+  if (!invalid.empty()) {
+    string cdir = root.cipherPath(dirName.c_str());
+    if (!endsWith(cdir, '/')) cdir += '/';
+
+    Lock lock(_mutex);
+    if (!_json) {
+      // just before showing a list of files in a directory
+      cout << autosprintf(_("In directory %s: \n"), dirName.c_str());
+    }
+    for (const string &name : invalid) {
+      if (_json) {
+        cout << "{\"dir\": " << jsonString(dirName)
+             << ", \"path\": " << jsonString(cdir + name) << "}\n";
+      } else {
+        cout << cdir << name << "\n";
+      }
+    }
+    _found += (int)invalid.size();
+  }
+  return EXIT_SUCCESS;
+}
+
+int CruftFinder::run() {
+  int r = _jobs.run([this]() { return findDir("/"); });
+  cout << flush;
+  return r == EXIT_SUCCESS ? (int)_found : -1;
+}
+
+/*
+    iterate recursively through the filesystem and print out names of files
+    which have filenames which cannot be decoded with the given key..
+*/
+static int cmd_showcruft(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)std::max(1L, std::min(cpus, 16L));
+  bool json = false;
+
+  static struct option long_options[] = {{"threads", 1, nullptr, 't'},
+                                         {"json", 0, nullptr, 'j'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        threads = (int)n;
+        break;
+      }
+      case 'j':
+        json = true;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 1) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  RootPtr rootInfo = initRootInfo(argv[optind]);
+
+  if (!rootInfo) return EXIT_FAILURE;
+
+  CruftFinder finder(rootInfo, threads, json);
+  int filesFound = finder.run();
+  if (filesFound < 0) return EXIT_FAILURE;
 
   // TODO: the singular version should say "Found an invalid file", but all the
   // translations
@@ -635,6 +3239,289 @@ static int cmd_showcruft(int argc, char **argv) {
   return EXIT_SUCCESS;
 }
 
+// entries a job of ls stats and prints at a time
+static const size_t ListChunk = 256;
+
+// the permission bits of mode as ls shows them, with the type in front
+static string modeString(mode_t mode) {
+  char str[] = "?rwxrwxrwx";
+  if (S_ISREG(mode))
+    str[0] = '-';
+  else if (S_ISDIR(mode))
+    str[0] = 'd';
+  else if (S_ISLNK(mode))
+    str[0] = 'l';
+  else if (S_ISFIFO(mode))
+    str[0] = 'p';
+  else if (S_ISCHR(mode))
+    str[0] = 'c';
+  else if (S_ISBLK(mode))
+    str[0] = 'b';
+  else if (S_ISSOCK(mode))
+    str[0] = 's';
+  for (int i = 0; i < 9; ++i) {
+    if ((mode & (0400 >> i)) == 0) str[i + 1] = '-';
+  }
+  if (mode & S_ISUID) str[3] = (mode & S_IXUSR) ? 's' : 'S';
+  if (mode & S_ISGID) str[6] = (mode & S_IXGRP) ? 's' : 'S';
+  if (mode & S_ISVTX) str[9] = (mode & S_IXOTH) ? 't' : 'T';
+  return str;
+}
+
+static const char *typeName(mode_t mode) {
+  if (S_ISREG(mode)) return "file";
+  if (S_ISDIR(mode)) return "dir";
+  if (S_ISLNK(mode)) return "link";
+  if (S_ISFIFO(mode)) return "fifo";
+  if (S_ISCHR(mode)) return "char";
+  if (S_ISBLK(mode)) return "block";
+  if (S_ISSOCK(mode)) return "socket";
+  return "unknown";
+}
+
+/*
+    Lists a volume from its backing directory, without mounting it: the
+    names of a directory are decoded in batches on the crypto pool, and
+    its entries stated, their sizes made plaintext ones, and printed in
+    chunks, each a job on the walker's pool, as are the directories found
+    when listing recursively.  Entries come out in no set order across
+    chunks, so a recursive listing shows whole paths, one a line.
+ */
+class Lister {
+ public:
+  Lister(const std::shared_ptr<EncFS_Root> &rootInfo, int threads,
+         bool recursive, bool longList, bool json)
+      : _rootInfo(rootInfo),
+        _jobs(threads, false),
+        _recursive(recursive),
+        _long(longList),
+        _json(json) {
+    pthread_mutex_init(&_mutex, nullptr);
+  }
+  ~Lister() { pthread_mutex_destroy(&_mutex); }
+
+  // lists plainPath: the entries of a directory, or a single entry
+  int run(const string &plainPath);
+
+ private:
+  Lister(const Lister &src);             // not allowed
+  Lister &operator=(const Lister &src);  // not allowed
+
+  struct Entry {
+    string cipherName;
+    string plainPath;
+  };
+
+  int listDir(const string &dirName);
+  // stats and prints entries, found in the backing directory of dt
+  int listChunk(const std::shared_ptr<DirTraverse> &dt,
+                const std::vector<Entry> &entries);
+  // one line for an entry whose plaintext attributes are st
+  void format(const string &plainPath, const struct stat &st,
+              const string &target, string *out);
+
+  std::shared_ptr<EncFS_Root> _rootInfo;
+  CopyJobs _jobs;
+  bool _recursive;
+  bool _long;
+  bool _json;
+  pthread_mutex_t _mutex;  // one chunk at a time on cout
+};
+
+int Lister::listDir(const string &dirName) {
+  DirNode &root = *_rootInfo->root;
+  string prefix = dirName == "/" ? dirName : dirName + '/';
+
+  // kept open until the last chunk of it is stated
+  std::shared_ptr<DirTraverse> dt =
+      std::make_shared<DirTraverse>(root.openDir(dirName.c_str()));
+  if (!dt->valid()) {
+    cerr << "unable to read " << root.cipherPath(dirName.c_str()) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Entry> entries;
+  Entry entry;
+  string plainName;
+  while (dt->nextEntry(&entry.cipherName, &plainName)) {
+    if (plainName.empty() || plainName == "." || plainName == "..") continue;
+    entry.plainPath = prefix + plainName;
+    entries.push_back(entry);
+    if (entries.size() == ListChunk) {
+      _jobs.queue([this, dt, entries]() { return listChunk(dt, entries); });
+      entries.clear();
+    }
+  }
+  return entries.empty() ? EXIT_SUCCESS : listChunk(dt, entries);
+}
+
+int Lister::listChunk(const std::shared_ptr<DirTraverse> &dt,
+                      const std::vector<Entry> &entries) {
+  DirNode &root = *_rootInfo->root;
+  int dirFd = dt->dirFd();
+
+  string out;
+  for (const Entry &entry : entries) {
+    struct stat st;
+    int res = root.entryAttr(dirFd, entry.cipherName.c_str(),
+                             entry.plainPath.c_str(), &st);
+    if (res < 0) {
+      // removed since it was read
+      if (res == -ENOENT) continue;
+      cerr << entry.plainPath << ": " << strerror(-res) << "\n";
+      return EXIT_FAILURE;
+    }
+
+    string target;
+    if (S_ISLNK(st.st_mode) && (_long || _json)) {
+      struct stat linkSt;
+      if (::fstatat(dirFd, entry.cipherName.c_str(), &linkSt,
+                    AT_SYMLINK_NOFOLLOW) == 0) {
+        root.readLink(dirFd, entry.cipherName.c_str(), linkSt, &target);
+      }
+    }
+    format(entry.plainPath, st, target, &out);
+
+    if (_recursive && S_ISDIR(st.st_mode)) {
+      string plainPath = entry.plainPath;
+      _jobs.queue([this, plainPath]() { return listDir(plainPath); });
+    }
+  }
+
+  Lock lock(_mutex);
+  cout << out;
+  return EXIT_SUCCESS;
+}
+
+void Lister::format(const string &plainPath, const struct stat &st,
+                    const string &target, string *out) {
+  string name = plainPath;
+  if (!_recursive) {
+    name = plainPath.substr(plainPath.rfind('/') + 1);
+    if (name.empty()) name = plainPath;
+  }
+
+  if (_json) {
+    *out += string(autosprintf(
+        "{\"path\": %s, \"type\": \"%s\", \"size\": %lld, \"mode\": %u, "
+        "\"nlink\": %llu, \"uid\": %u, \"gid\": %u, \"mtime\": %lld",
+        jsonString(plainPath).c_str(), typeName(st.st_mode),
+        (long long)st.st_size, (unsigned)(st.st_mode & 07777),
+        (unsigned long long)st.st_nlink, (unsigned)st.st_uid,
+        (unsigned)st.st_gid, (long long)st.st_mtime));
+    if (S_ISLNK(st.st_mode)) *out += ", \"target\": " + jsonString(target);
+    *out += "}\n";
+    return;
+  }
+
+  struct tm stm;
+  localtime_r(&st.st_mtime, &stm);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &stm);
+
+  if (_long) {
+    *out += string(autosprintf("%s %3llu %5u %5u %11lld %s ",
+                               modeString(st.st_mode).c_str(),
+                               (unsigned long long)st.st_nlink,
+                               (unsigned)st.st_uid, (unsigned)st.st_gid,
+                               (long long)st.st_size, date));
+    *out += name;
+    if (S_ISLNK(st.st_mode)) *out += " -> " + target;
+  } else {
+    *out += string(autosprintf("%11lld %s ", (long long)st.st_size, date));
+    *out += name;
+  }
+  *out += '\n';
+}
+
+int Lister::run(const string &plainPath) {
+  DirNode &root = *_rootInfo->root;
+  string cpath = root.cipherPath(plainPath.c_str());
+  int r;
+  if (plainPath == "/" || isDirectory(cpath.c_str())) {
+    r = _jobs.run([this, plainPath]() { return listDir(plainPath); });
+  } else {
+    struct stat st;
+    if (lstat(cpath.c_str(), &st) != 0) {
+      cerr << plainPath << ": " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+    // a single entry is stated relative to its directory, as any other
+    string::size_type slash = cpath.rfind('/');
+    string cdir = cpath.substr(0, slash + 1);
+    std::shared_ptr<DIR> dir(opendir(cdir.c_str()), closedir);
+    if (!dir) {
+      cerr << "unable to read " << cdir << ": " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+    Entry entry = {cpath.substr(slash + 1), plainPath};
+    std::shared_ptr<DirTraverse> dt = std::make_shared<DirTraverse>(
+        dir, 0, std::shared_ptr<NameIO>(), false);
+    r = listChunk(dt, std::vector<Entry>(1, entry));
+  }
+  cout << flush;
+  return r;
+}
+
+static int cmd_ls(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)std::max(1L, std::min(cpus, 16L));
+  bool recursive = false;
+  bool longList = false;
+  bool json = false;
+
+  static struct option long_options[] = {{"threads", 1, nullptr, 't'},
+                                         {"recursive", 0, nullptr, 'R'},
+                                         {"long", 0, nullptr, 'l'},
+                                         {"json", 0, nullptr, 'j'},
+                                         {0, 0, 0, 0}};
+  for (;;) {
+    int option_index = 0;
+    int res = getopt_long(argc, argv, "Rl", long_options, &option_index);
+    if (res == -1) break;
+
+    switch (res) {
+      case 't': {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 1 || n > 256) {
+          cerr << autosprintf(_("Invalid number of threads: %s"), optarg)
+               << "\n";
+          return EXIT_FAILURE;
+        }
+        threads = (int)n;
+        break;
+      }
+      case 'R':
+        recursive = true;
+        break;
+      case 'l':
+        longList = true;
+        break;
+      case 'j':
+        json = true;
+        break;
+      default:
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2) {
+    cerr << _("Incorrect number of arguments") << "\n";
+    return EXIT_FAILURE;
+  }
+
+  RootPtr rootInfo = initRootInfo(argv[optind]);
+
+  if (!rootInfo) return EXIT_FAILURE;
+
+  string path = argc - optind == 2 ? argv[optind + 1] : "/";
+  if (path.empty() || path[0] != '/') path = '/' + path;
+  while (path.length() > 1 && endsWith(path, '/')) path.erase(path.length() - 1);
+
+  Lister lister(rootInfo, threads, recursive, longList, json);
+  return lister.run(path);
+}
+
 static int do_chpasswd(bool useStdin, bool annotate, bool checkOnly, int argc,
                        char **argv) {
   (void)argc;
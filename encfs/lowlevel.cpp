@@ -0,0 +1,1602 @@
+/*****************************************************************************
+ * Copyright (c) 2004, Valient Gough
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lowlevel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "easylogging++.h"
+
+#include "Context.h"
+#include "DirNode.h"
+#include "Error.h"
+#include "FileNode.h"
+#include "FileUtils.h"
+#include "FuseLoop.h"
+#include "MemoryPool.h"
+#include "Mutex.h"
+#include "OpStats.h"
+#include "ThreadPool.h"
+#include "encfs.h"
+
+using namespace std;
+
+namespace encfs {
+
+// backing directories kept open to look up the names in them
+static const int MaxDirFds = 1024;
+static std::atomic<int> openDirFds(0);
+
+/*
+    An inode the kernel holds references to, by the path it was looked up
+    by.  A rename moves it and what is below it; a name that is removed, or
+    renamed over, leaves its inode unlinked until the kernel forgets it.
+ */
+struct Inode {
+  fuse_ino_t id;
+  uint64_t nlookup;
+  std::shared_ptr<Inode> parent;  // null for the root
+  string plainPath;
+  string cipherName;  // the name in the backing directory of parent
+  string cipherPath;  // the full backing path
+  uint64_t iv;        // chain IV of plainPath, for the names below it
+  bool unlinked;
+  int dirFd;  // the backing directory, once a name was looked up in it
+  ino_t backingIno;
+  // other inodes have the same backing file (hard links), read without
+  // the table lock on every write
+  std::atomic<bool> aliased;
+
+  Inode()
+      : id(0),
+        nlookup(0),
+        iv(0),
+        unlinked(false),
+        dirFd(-1),
+        backingIno(0),
+        aliased(false) {}
+  ~Inode() {
+    if (dirFd >= 0) {
+      ::close(dirFd);
+      --openDirFds;
+    }
+  }
+};
+
+// what an Inode was at one point, for use outside the table lock
+struct NodeInfo {
+  std::shared_ptr<Inode> parent;
+  string plainPath;
+  string cipherName;
+  string cipherPath;
+  uint64_t iv;
+  bool unlinked;
+};
+
+static string childPath(const string &dir, const char *name) {
+  string path = dir;
+  if (path.empty() || path[path.length() - 1] != '/') {
+    path += '/';
+  }
+  return path += name;
+}
+
+class InodeTable {
+ public:
+  explicit InodeTable(const string &rootCipherPath);
+  ~InodeTable();
+
+  std::shared_ptr<Inode> get(fuse_ino_t id);
+  void snapshot(const std::shared_ptr<Inode> &node, NodeInfo *info);
+
+  // a lookup of the name at plainPath, below parent, which found the
+  // backing file backingIno
+  std::shared_ptr<Inode> add(const std::shared_ptr<Inode> &parent,
+                             const string &plainPath, const string &cipherName,
+                             uint64_t iv, ino_t backingIno);
+  void forget(fuse_ino_t id, uint64_t nlookup);
+
+  // the inode of the linked name plainPath, 0 if there is none
+  fuse_ino_t idOf(const string &plainPath);
+  // the other inodes with the backing file of node
+  std::vector<fuse_ino_t> aliases(const std::shared_ptr<Inode> &node);
+
+  void unlinked(const string &plainPath);
+  void renamed(DirNode *root, const string &from, const string &to,
+               const std::shared_ptr<Inode> &newParent);
+
+  // the backing directory of node opened to look up names relative to, or
+  // -1 if it can't be, in which case cipherPath is its full path
+  int dirFd(const std::shared_ptr<Inode> &node, string *cipherPath);
+
+ private:
+  pthread_mutex_t mutex;
+  fuse_ino_t nextId;
+  std::unordered_map<fuse_ino_t, std::shared_ptr<Inode>> byId;
+  // the inodes of the names that are still linked
+  std::unordered_map<string, std::shared_ptr<Inode>> byPath;
+  std::unordered_multimap<ino_t, fuse_ino_t> byBackingIno;
+
+  void drop(const std::shared_ptr<Inode> &node);
+
+  InodeTable(const InodeTable &);             // not allowed
+  InodeTable &operator=(const InodeTable &);  // not allowed
+};
+
+InodeTable::InodeTable(const string &rootCipherPath)
+    : nextId(FUSE_ROOT_ID + 1) {
+  pthread_mutex_init(&mutex, nullptr);
+
+  auto root = std::make_shared<Inode>();
+  root->id = FUSE_ROOT_ID;
+  root->nlookup = 1;
+  root->plainPath = "/";
+  root->cipherPath = rootCipherPath;
+  byId[root->id] = root;
+  byPath[root->plainPath] = root;
+}
+
+InodeTable::~InodeTable() { pthread_mutex_destroy(&mutex); }
+
+std::shared_ptr<Inode> InodeTable::get(fuse_ino_t id) {
+  Lock lock(mutex);
+  auto it = byId.find(id);
+  if (it == byId.end()) {
+    return std::shared_ptr<Inode>();
+  }
+  return it->second;
+}
+
+void InodeTable::snapshot(const std::shared_ptr<Inode> &node, NodeInfo *info) {
+  Lock lock(mutex);
+  info->parent = node->parent;
+  info->plainPath = node->plainPath;
+  info->cipherName = node->cipherName;
+  info->cipherPath = node->cipherPath;
+  info->iv = node->iv;
+  info->unlinked = node->unlinked;
+}
+
+std::shared_ptr<Inode> InodeTable::add(const std::shared_ptr<Inode> &parent,
+                                       const string &plainPath,
+                                       const string &cipherName, uint64_t iv,
+                                       ino_t backingIno) {
+  Lock lock(mutex);
+  auto it = byPath.find(plainPath);
+  if (it != byPath.end()) {
+    if (it->second->backingIno == backingIno) {
+      ++it->second->nlookup;
+      return it->second;
+    }
+    // replaced behind our back: the kernel gets a new inode for the name
+    it->second->unlinked = true;
+    byPath.erase(it);
+  }
+
+  auto node = std::make_shared<Inode>();
+  node->id = nextId++;
+  node->nlookup = 1;
+  node->parent = parent;
+  node->plainPath = plainPath;
+  node->cipherName = cipherName;
+  node->cipherPath = parent->cipherPath + '/' + cipherName;
+  node->iv = iv;
+  node->backingIno = backingIno;
+  byId[node->id] = node;
+  byPath[plainPath] = node;
+
+  auto range = byBackingIno.equal_range(backingIno);
+  for (auto alias = range.first; alias != range.second; ++alias) {
+    byId[alias->second]->aliased = true;
+    node->aliased = true;
+  }
+  byBackingIno.insert(std::make_pair(backingIno, node->id));
+  return node;
+}
+
+void InodeTable::drop(const std::shared_ptr<Inode> &node) {
+  byId.erase(node->id);
+  auto pit = byPath.find(node->plainPath);
+  if (pit != byPath.end() && pit->second == node) {
+    byPath.erase(pit);
+  }
+  auto range = byBackingIno.equal_range(node->backingIno);
+  for (auto alias = range.first; alias != range.second; ++alias) {
+    if (alias->second == node->id) {
+      byBackingIno.erase(alias);
+      break;
+    }
+  }
+}
+
+fuse_ino_t InodeTable::idOf(const string &plainPath) {
+  Lock lock(mutex);
+  auto it = byPath.find(plainPath);
+  return it == byPath.end() ? 0 : it->second->id;
+}
+
+std::vector<fuse_ino_t> InodeTable::aliases(
+    const std::shared_ptr<Inode> &node) {
+  std::vector<fuse_ino_t> ids;
+  if (!node->aliased) {
+    return ids;
+  }
+  Lock lock(mutex);
+  auto range = byBackingIno.equal_range(node->backingIno);
+  for (auto alias = range.first; alias != range.second; ++alias) {
+    if (alias->second != node->id) {
+      ids.push_back(alias->second);
+    }
+  }
+  return ids;
+}
+
+void InodeTable::forget(fuse_ino_t id, uint64_t nlookup) {
+  std::shared_ptr<Inode> node;  // released outside the lock
+  Lock lock(mutex);
+  auto it = byId.find(id);
+  if (it == byId.end() || id == FUSE_ROOT_ID) {
+    return;
+  }
+  node = it->second;
+  if (node->nlookup > nlookup) {
+    node->nlookup -= nlookup;
+    return;
+  }
+  drop(node);
+}
+
+void InodeTable::unlinked(const string &plainPath) {
+  Lock lock(mutex);
+  auto it = byPath.find(plainPath);
+  if (it != byPath.end()) {
+    it->second->unlinked = true;
+    byPath.erase(it);
+  }
+}
+
+void InodeTable::renamed(DirNode *root, const string &from, const string &to,
+                         const std::shared_ptr<Inode> &newParent) {
+  if (from == to) {
+    return;
+  }
+  Lock lock(mutex);
+
+  auto it = byPath.find(to);
+  if (it != byPath.end()) {
+    it->second->unlinked = true;
+    byPath.erase(it);
+  }
+
+  std::vector<std::shared_ptr<Inode>> moved;
+  for (const auto &entry : byPath) {
+    const string &path = entry.first;
+    if (path.compare(0, from.length(), from) == 0 &&
+        (path.length() == from.length() || path[from.length()] == '/')) {
+      moved.push_back(entry.second);
+    }
+  }
+  // parents before their children, so that each name is encoded from the
+  // new IV of its parent
+  std::sort(moved.begin(), moved.end(),
+            [](const std::shared_ptr<Inode> &a, const std::shared_ptr<Inode> &b) {
+              return a->plainPath.length() < b->plainPath.length();
+            });
+
+  bool chained = root->hasDirectoryNameDependency();
+  for (const auto &node : moved) {
+    bool top = node->plainPath.length() == from.length();
+    byPath.erase(node->plainPath);
+    node->plainPath = to + node->plainPath.substr(from.length());
+    if (top) {
+      node->parent = newParent;
+    }
+    if (top || chained) {
+      uint64_t iv = node->parent->iv;
+      const char *name = strrchr(node->plainPath.c_str(), '/') + 1;
+      node->cipherName = root->encodeName(name, &iv);
+      node->iv = iv;
+    }
+    node->cipherPath = node->parent->cipherPath + '/' + node->cipherName;
+    byPath[node->plainPath] = node;
+  }
+}
+
+int InodeTable::dirFd(const std::shared_ptr<Inode> &node, string *cipherPath) {
+  {
+    Lock lock(mutex);
+    if (node->dirFd >= 0) {
+      return node->dirFd;
+    }
+    *cipherPath = node->cipherPath;
+  }
+  if (openDirFds >= MaxDirFds) {
+    return -1;
+  }
+
+#ifdef O_PATH
+  int flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+  int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+  int fd = ::open(cipherPath->empty() ? "/" : cipherPath->c_str(), flags);
+  if (fd < 0) {
+    return -1;
+  }
+
+  Lock lock(mutex);
+  if (node->dirFd >= 0) {
+    ::close(fd);
+  } else {
+    node->dirFd = fd;
+    ++openDirFds;
+  }
+  // the inode is held by the caller, which keeps the descriptor open
+  return node->dirFd;
+}
+
+// options of the high-level library, which we implement ourselves
+struct LowLevelOpts {
+  double attrTimeout;
+  double entryTimeout;
+  double negativeTimeout;
+  bool directIo;
+  bool keepCache;
+
+  LowLevelOpts()
+      : attrTimeout(1.0),
+        entryTimeout(1.0),
+        negativeTimeout(0.0),
+        directIo(false),
+        keepCache(false) {}
+};
+
+/*
+    The channel to the kernel for notifications sent from off the FUSE
+    threads, by read-ahead jobs which may outlive the session: they check
+    it is still there first, and it is cleared before the channel goes.
+ */
+class KernelChannel {
+ public:
+  KernelChannel() : _ch(nullptr) { pthread_rwlock_init(&_lock, nullptr); }
+  ~KernelChannel() { pthread_rwlock_destroy(&_lock); }
+
+  void set(struct fuse_chan *ch) {
+    WriteLock lock(_lock);
+    _ch = ch;
+  }
+
+  // --push-readahead: len bytes of the plaintext of ino at offset into the
+  // kernel's page cache
+  void store(fuse_ino_t ino, off_t offset, const unsigned char *data,
+             size_t len) {
+#if FUSE_VERSION >= 29
+    ReadLock lock(_lock);
+    if (_ch == nullptr) {
+      return;
+    }
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(len);
+    buf.buf[0].mem = const_cast<unsigned char *>(data);
+    int res = fuse_lowlevel_notify_store(_ch, ino, offset, &buf,
+                                         (enum fuse_buf_copy_flags)0);
+    if (res != 0 && res != -ENOENT) {
+      VLOG(1) << "storing pages of inode " << ino
+              << " failed: " << strerror(-res);
+    }
+#else
+    (void)ino;
+    (void)offset;
+    (void)data;
+    (void)len;
+#endif
+  }
+
+  // drops the pages of ino a store() should not have left there
+  void drop(fuse_ino_t ino, off_t offset, size_t len) {
+#if FUSE_VERSION >= 28
+    ReadLock lock(_lock);
+    if (_ch == nullptr) {
+      return;
+    }
+    int res = fuse_lowlevel_notify_inval_inode(_ch, ino, offset, (off_t)len);
+    if (res != 0 && res != -ENOENT) {
+      VLOG(1) << "invalidating inode " << ino
+              << " failed: " << strerror(-res);
+    }
+#else
+    (void)ino;
+    (void)offset;
+    (void)len;
+#endif
+  }
+
+ private:
+  pthread_rwlock_t _lock;
+  struct fuse_chan *_ch;
+
+  KernelChannel(const KernelChannel &);             // not allowed
+  KernelChannel &operator=(const KernelChannel &);  // not allowed
+};
+
+struct LowLevel {
+  EncFS_Context *ctx;
+  ConnectionInit init;
+  LowLevelOpts opts;
+  std::unique_ptr<InodeTable> inodes;
+  struct fuse_chan *ch;  // for notifications to the kernel
+  // runs reads, writes and syncs off the FUSE threads, see --async-requests.
+  // Null when they are served in place.
+  std::unique_ptr<ThreadPool> async;
+  // the kernel reads and writes the files of a plain volume itself, see
+  // holdBacking()
+  bool passthrough;
+  // for pushReadAhead(), null without --push-readahead
+  std::shared_ptr<KernelChannel> pages;
+};
+
+static LowLevel *lowLevel(fuse_req_t req) {
+  return (LowLevel *)fuse_req_userdata(req);
+}
+
+// has the encfs_* handlers this thread calls serve the caller of req
+class CallerScope {
+ public:
+  CallerScope(fuse_req_t req, LowLevel *ll) {
+    const struct fuse_ctx *fctx = fuse_req_ctx(req);
+    caller.ctx = ll->ctx;
+    caller.uid = fctx->uid;
+    caller.gid = fctx->gid;
+    // there is no readdirplus to take them
+    caller.entryAttrs = false;
+    setRequestCaller(&caller);
+  }
+  ~CallerScope() { setRequestCaller(nullptr); }
+
+ private:
+  RequestCaller caller;
+};
+
+static void replyErr(fuse_req_t req, int res) { fuse_reply_err(req, -res); }
+
+// the path of inode ino for the path based handlers
+static int nodePath(LowLevel *ll, fuse_ino_t ino, string *path) {
+  std::shared_ptr<Inode> node = ll->inodes->get(ino);
+  if (!node) {
+    return -ESTALE;
+  }
+  NodeInfo info;
+  ll->inodes->snapshot(node, &info);
+  *path = info.plainPath;
+  return 0;
+}
+
+static int nodeAttr(LowLevel *ll, fuse_ino_t ino, struct stat *st) {
+  if (ino == FUSE_ROOT_ID) {
+    return encfs_getattr("/", st);
+  }
+
+  std::shared_ptr<Inode> node = ll->inodes->get(ino);
+  if (!node) {
+    return -ESTALE;
+  }
+  NodeInfo info;
+  ll->inodes->snapshot(node, &info);
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ll->ctx->getRoot(&res);
+  if (!FSRoot) {
+    return res;
+  }
+  // an unlinked file is only there while it is open
+  if (info.unlinked && !ll->ctx->lookupNode(info.plainPath.c_str())) {
+    return -ENOENT;
+  }
+
+  try {
+    string dirPath;
+    int dirFd = ll->inodes->dirFd(info.parent, &dirPath);
+    if (dirFd >= 0) {
+      return FSRoot->entryAttr(dirFd, info.cipherName.c_str(),
+                               info.plainPath.c_str(), st);
+    }
+    return FSRoot->entryAttr(AT_FDCWD, info.cipherPath.c_str(),
+                             info.plainPath.c_str(), st);
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in getattr: " << err.what();
+    return -EIO;
+  }
+}
+
+static void fillEntry(LowLevel *ll, fuse_ino_t id, const struct stat &st,
+                      struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  e->ino = id;
+  e->attr = st;
+  e->attr_timeout = ll->opts.attrTimeout;
+  e->entry_timeout = ll->opts.entryTimeout;
+}
+
+// looks up name in the directory parent: only the name is encoded, from
+// the IV of the parent, and it is stat'ed relative to the parent
+static int lookupEntry(LowLevel *ll, fuse_ino_t parent, const char *name,
+                       struct fuse_entry_param *e) {
+  std::shared_ptr<Inode> dir = ll->inodes->get(parent);
+  if (!dir) {
+    return -ESTALE;
+  }
+  NodeInfo info;
+  ll->inodes->snapshot(dir, &info);
+  if (info.unlinked) {
+    return -ENOENT;
+  }
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ll->ctx->getRoot(&res);
+  if (!FSRoot) {
+    return res;
+  }
+
+  string path = childPath(info.plainPath, name);
+  try {
+    uint64_t generation = 0;
+    if (FSRoot->knownMissing(path.c_str(), &generation)) {
+      return -ENOENT;
+    }
+
+    uint64_t iv = info.iv;
+    string cipherName = FSRoot->encodeName(name, &iv);
+
+    struct stat st;
+    string dirPath;
+    int dirFd = ll->inodes->dirFd(dir, &dirPath);
+    if (dirFd >= 0) {
+      res = FSRoot->entryAttr(dirFd, cipherName.c_str(), path.c_str(), &st);
+    } else {
+      string cyName = info.cipherPath + '/' + cipherName;
+      res = FSRoot->entryAttr(AT_FDCWD, cyName.c_str(), path.c_str(), &st);
+    }
+    if (res == -ENOENT) {
+      FSRoot->noteMissing(path.c_str(), generation);
+    }
+    if (res != 0) {
+      return res;
+    }
+
+    std::shared_ptr<Inode> node =
+        ll->inodes->add(dir, path, cipherName, iv, st.st_ino);
+    fillEntry(ll, node->id, st, e);
+    return 0;
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in lookup: " << err.what();
+    return -EIO;
+  }
+}
+
+// replies to a request which created name in parent with its entry
+static void replyCreated(fuse_req_t req, LowLevel *ll, fuse_ino_t parent,
+                         const char *name, int res) {
+  struct fuse_entry_param e;
+  if (res == 0) {
+    res = lookupEntry(ll, parent, name, &e);
+  }
+  if (res == 0) {
+    fuse_reply_entry(req, &e);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+static int entryPath(LowLevel *ll, fuse_ino_t parent, const char *name,
+                     string *path) {
+  int res = nodePath(ll, parent, path);
+  if (res == 0) {
+    *path = childPath(*path, name);
+  }
+  return res;
+}
+
+/*
+    The kernel caches the attributes and pages of an inode, and updates them
+    itself after the requests it sends about it.  Inodes are per name here,
+    so it can't know that a change through one name of a hard linked file
+    changes the others: tell it.  This is called after the reply, since the
+    kernel may hold locks until it has it.
+ */
+static void invalidateAliases(LowLevel *ll, fuse_ino_t ino, bool data) {
+#if FUSE_VERSION >= 28
+  std::shared_ptr<Inode> node = ll->inodes->get(ino);
+  if (!node || ll->ch == nullptr) {
+    return;
+  }
+  for (fuse_ino_t alias : ll->inodes->aliases(node)) {
+    // a negative offset drops the attributes but not the pages
+    int res = fuse_lowlevel_notify_inval_inode(ll->ch, alias, data ? 0 : -1, 0);
+    if (res != 0 && res != -ENOENT) {
+      VLOG(1) << "invalidating inode " << alias
+              << " failed: " << strerror(-res);
+    }
+  }
+#else
+  (void)ll;
+  (void)ino;
+  (void)data;
+#endif
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+  auto *ll = (LowLevel *)userdata;
+  ll->init(ll->ctx, conn);
+#if defined(FUSE_CAP_PASSTHROUGH)
+  int res = 0;
+  std::shared_ptr<DirNode> root = ll->ctx->getRoot(&res);
+  // the kernel does not pass through files it caches writes to, and has
+  // direct_io take precedence
+  if (root && root->config()->plainFiles && !ll->opts.directIo &&
+      (conn->capable & FUSE_CAP_PASSTHROUGH) != 0 &&
+      (conn->want & FUSE_CAP_WRITEBACK_CACHE) == 0) {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    // backing files are on a filesystem of their own, not another stack
+    conn->max_backing_stack_depth = 1;
+    ll->passthrough = true;
+  }
+#endif
+}
+
+/*
+    With FUSE passthrough, the kernel reads and writes the files of a plain
+    volume (see FSConfig::plainFiles) straight from their backing files,
+    registered with it on open, so that their data never comes up to us.
+    Registering takes CAP_SYS_ADMIN; files it fails for are served as
+    usual.
+ */
+static void holdBacking(fuse_req_t req, LowLevel *ll,
+                        struct fuse_file_info *fi) {
+#if defined(FUSE_CAP_PASSTHROUGH)
+  if (!ll->passthrough) {
+    return;
+  }
+  std::shared_ptr<FileNode> fnode = ll->ctx->lookupFuseFh(fi->fh);
+  if (!fnode) {
+    return;
+  }
+  int id = fnode->holdBacking([req](int fd) {
+    int res = fuse_passthrough_open(req, fd);
+    if (res <= 0) {
+      VLOG(1) << "fuse_passthrough_open failed: " << strerror(errno);
+    }
+    return res;
+  });
+  if (id > 0) {
+    fi->backing_id = id;
+  }
+#else
+  (void)req;
+  (void)ll;
+  (void)fi;
+#endif
+}
+
+/*
+    With --push-readahead, what read-ahead decodes of a file goes into the
+    kernel's page cache as well, so that the reads it prefetched for are
+    served by the kernel without coming up to us.  Called after the open
+    reply: the kernel drops the pages of a file it opens without
+    keep_cache once it has it.
+ */
+static void pushReadAhead(LowLevel *ll, fuse_ino_t ino,
+                          const struct fuse_file_info *fi) {
+  if (!ll->pages || fi->direct_io) {
+    return;
+  }
+  std::shared_ptr<FileNode> fnode = ll->ctx->lookupFuseFh(fi->fh);
+  if (!fnode) {
+    return;
+  }
+  std::shared_ptr<KernelChannel> pages = ll->pages;
+  fnode->pushReadAhead(
+      [pages, ino](off_t offset, const unsigned char *data, size_t len) {
+        pages->store(ino, offset, data, len);
+      },
+      [pages, ino](off_t offset, size_t len) {
+        pages->drop(ino, offset, len);
+      });
+}
+
+// matches holdBacking(), before the file is released
+static void releaseBacking(fuse_req_t req, LowLevel *ll,
+                           const struct fuse_file_info *fi) {
+#if defined(FUSE_CAP_PASSTHROUGH)
+  if (!ll->passthrough) {
+    return;
+  }
+  std::shared_ptr<FileNode> fnode = ll->ctx->lookupFuseFh(fi->fh);
+  if (fnode) {
+    fnode->releaseBacking(
+        [req](int id) { fuse_passthrough_close(req, id); });
+  }
+#else
+  (void)req;
+  (void)ll;
+  (void)fi;
+#endif
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+  string path;
+  StatTimer timer(OpStats::Lookup);
+  if (OpTrace::enabled && entryPath(ll, parent, name, &path) == 0) {
+    timer.trace(path.c_str());
+  }
+
+  struct fuse_entry_param e;
+  int res = timer.status(lookupEntry(ll, parent, name, &e));
+  if (res == 0) {
+    fuse_reply_entry(req, &e);
+  } else if (res == -ENOENT && ll->opts.negativeTimeout > 0) {
+    // have the kernel remember the name is missing
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = ll->opts.negativeTimeout;
+    fuse_reply_entry(req, &e);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino,
+                      unsigned long nlookup) {
+  lowLevel(req)->inodes->forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void ll_forget_multi(fuse_req_t req, size_t count,
+                            struct fuse_forget_data *forgets) {
+  LowLevel *ll = lowLevel(req);
+  for (size_t i = 0; i < count; ++i) {
+    ll->inodes->forget(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+#endif
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  (void)fi;
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+  string path;
+  StatTimer timer(OpStats::Getattr);
+  if (OpTrace::enabled && nodePath(ll, ino, &path) == 0) {
+    timer.trace(path.c_str());
+  }
+
+  struct stat st;
+  int res = timer.status(nodeAttr(ll, ino, &st));
+  if (res == 0) {
+    fuse_reply_attr(req, &st, ll->opts.attrTimeout);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+#if defined(__APPLE__)
+static struct timespec accessTime(const struct stat &st) {
+  return st.st_atimespec;
+}
+static struct timespec modifyTime(const struct stat &st) {
+  return st.st_mtimespec;
+}
+#else
+static struct timespec accessTime(const struct stat &st) { return st.st_atim; }
+static struct timespec modifyTime(const struct stat &st) { return st.st_mtim; }
+#endif
+
+static int setTimes(LowLevel *ll, fuse_ino_t ino, const string &path,
+                    const struct stat *attr, int toSet) {
+  // times that are not set are kept, so that it works without utimensat
+  struct stat st;
+  int res = nodeAttr(ll, ino, &st);
+  if (res != 0) {
+    return res;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  struct timespec ts[2];
+  ts[0] = accessTime(st);
+  ts[1] = modifyTime(st);
+  if ((toSet & FUSE_SET_ATTR_ATIME) != 0) {
+    ts[0] = accessTime(*attr);
+  }
+  if ((toSet & FUSE_SET_ATTR_MTIME) != 0) {
+    ts[1] = modifyTime(*attr);
+  }
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+  if ((toSet & FUSE_SET_ATTR_ATIME_NOW) != 0) {
+    ts[0] = now;
+  }
+  if ((toSet & FUSE_SET_ATTR_MTIME_NOW) != 0) {
+    ts[1] = now;
+  }
+#endif
+  return encfs_utimens(path.c_str(), ts);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int toSet, struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0 && (toSet & FUSE_SET_ATTR_MODE) != 0) {
+    res = encfs_chmod(path.c_str(), attr->st_mode);
+  }
+  if (res == 0 && (toSet & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) != 0) {
+    uid_t uid = (toSet & FUSE_SET_ATTR_UID) != 0 ? attr->st_uid : (uid_t)-1;
+    gid_t gid = (toSet & FUSE_SET_ATTR_GID) != 0 ? attr->st_gid : (gid_t)-1;
+    res = encfs_chown(path.c_str(), uid, gid);
+  }
+  if (res == 0 && (toSet & FUSE_SET_ATTR_SIZE) != 0) {
+    res = fi != nullptr ? encfs_ftruncate(path.c_str(), attr->st_size, fi)
+                        : encfs_truncate(path.c_str(), attr->st_size);
+  }
+  int timeFlags = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+  timeFlags |= FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+#endif
+  if (res == 0 && (toSet & timeFlags) != 0) {
+    res = setTimes(ll, ino, path, attr, toSet);
+  }
+
+  struct stat st;
+  if (res == 0) {
+    res = nodeAttr(ll, ino, &st);
+  }
+  if (res == 0) {
+    fuse_reply_attr(req, &st, ll->opts.attrTimeout);
+    invalidateAliases(ll, ino, (toSet & FUSE_SET_ATTR_SIZE) != 0);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  char buf[PATH_MAX + 1];
+  if (res == 0) {
+    res = encfs_readlink(path.c_str(), buf, sizeof(buf));
+  }
+  if (res == 0) {
+    fuse_reply_readlink(req, buf);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, dev_t rdev) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = entryPath(ll, parent, name, &path);
+  if (res == 0) {
+    res = encfs_mknod(path.c_str(), mode, rdev);
+  }
+  replyCreated(req, ll, parent, name, res);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = entryPath(ll, parent, name, &path);
+  if (res == 0) {
+    res = encfs_mkdir(path.c_str(), mode);
+  }
+  replyCreated(req, ll, parent, name, res);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                       const char *name) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = entryPath(ll, parent, name, &path);
+  if (res == 0) {
+    res = encfs_symlink(link, path.c_str());
+  }
+  replyCreated(req, ll, parent, name, res);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                    const char *newname) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  string newPath;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = entryPath(ll, newparent, newname, &newPath);
+  }
+  if (res == 0) {
+    res = encfs_link(path.c_str(), newPath.c_str());
+  }
+  replyCreated(req, ll, newparent, newname, res);
+  if (res == 0) {
+    invalidateAliases(ll, ino, false);
+  }
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = entryPath(ll, parent, name, &path);
+  fuse_ino_t ino = 0;
+  if (res == 0) {
+    ino = ll->inodes->idOf(path);
+    res = encfs_unlink(path.c_str());
+  }
+  if (res == 0) {
+    ll->inodes->unlinked(path);
+  }
+  replyErr(req, res);
+  if (res == 0 && ino != 0) {
+    // the other names lost a link
+    invalidateAliases(ll, ino, false);
+  }
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = entryPath(ll, parent, name, &path);
+  if (res == 0) {
+    res = encfs_rmdir(path.c_str());
+  }
+  if (res == 0) {
+    ll->inodes->unlinked(path);
+  }
+  replyErr(req, res);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string from;
+  string to;
+  int res = entryPath(ll, parent, name, &from);
+  if (res == 0) {
+    res = entryPath(ll, newparent, newname, &to);
+  }
+  std::shared_ptr<Inode> toDir = ll->inodes->get(newparent);
+  if (res == 0 && !toDir) {
+    res = -ESTALE;
+  }
+  fuse_ino_t moved = 0;
+  fuse_ino_t replaced = 0;
+  if (res == 0) {
+    moved = ll->inodes->idOf(from);
+    replaced = ll->inodes->idOf(to);
+    res = encfs_rename(from.c_str(), to.c_str());
+  }
+  if (res == 0) {
+    std::shared_ptr<DirNode> FSRoot = ll->ctx->getRoot(&res);
+    try {
+      if (FSRoot) {
+        ll->inodes->renamed(FSRoot.get(), from, to, toDir);
+      }
+    } catch (encfs::Error &err) {
+      RLOG(ERROR) << "error caught in rename: " << err.what();
+      res = -EIO;
+    }
+  }
+  replyErr(req, res);
+  if (res == 0) {
+    // the change time of the one, and the links of the other
+    if (moved != 0) {
+      invalidateAliases(ll, moved, false);
+    }
+    if (replaced != 0) {
+      invalidateAliases(ll, replaced, false);
+    }
+  }
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_open(path.c_str(), fi);
+  }
+  if (res != 0) {
+    replyErr(req, res);
+    return;
+  }
+  if (ll->opts.directIo) {
+    fi->direct_io = 1;
+  }
+  if (ll->opts.keepCache) {
+    fi->keep_cache = 1;
+  }
+  holdBacking(req, ll, fi);
+  if (fuse_reply_open(req, fi) == -ENOENT) {
+    // the request was interrupted, there will be no release
+    releaseBacking(req, ll, fi);
+    encfs_release(path.c_str(), fi);
+    return;
+  }
+  pushReadAhead(ll, ino, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = entryPath(ll, parent, name, &path);
+  if (res == 0) {
+    res = encfs_create(path.c_str(), mode, fi);
+  }
+  if (res != 0) {
+    replyErr(req, res);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  res = lookupEntry(ll, parent, name, &e);
+  if (res != 0) {
+    encfs_release(path.c_str(), fi);
+    replyErr(req, res);
+    return;
+  }
+  if (ll->opts.directIo) {
+    fi->direct_io = 1;
+  }
+  if (ll->opts.keepCache) {
+    fi->keep_cache = 1;
+  }
+  holdBacking(req, ll, fi);
+  if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+    releaseBacking(req, ll, fi);
+    encfs_release(path.c_str(), fi);
+    return;
+  }
+  pushReadAhead(ll, e.ino, fi);
+}
+
+/*
+    With --async-requests, reads, writes and syncs are answered from a pool
+    of their own rather than on the FUSE thread they came in on, which the
+    low-level interface allows.  The FUSE threads then only take requests
+    off the device, so a backing store that takes milliseconds per pread
+    holds up a pool thread rather than a reader of /dev/fuse, and as many
+    requests as the pool has threads, and the kernel lets queue, are in
+    flight at once.  Reads queue in the pool's demand lane, writes and
+    syncs in its write lane.
+ */
+template <typename Op>
+static void serve(LowLevel *ll, ThreadPool::Lane lane, Op op) {
+  if (ll->async) {
+    ll->async->submit(std::move(op), lane);
+  } else {
+    op();
+  }
+}
+
+static void doRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res != 0) {
+    replyErr(req, res);
+    return;
+  }
+
+  MemBlock mb = MemoryPool::allocate((int)size);
+  res = encfs_read(path.c_str(), (char *)mb.data, size, off, fi);
+  if (res >= 0) {
+    fuse_reply_buf(req, (const char *)mb.data, res);
+  } else {
+    replyErr(req, res);
+  }
+  MemoryPool::release(mb);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+  struct fuse_file_info info = *fi;
+  serve(lowLevel(req), ThreadPool::Demand, [=]() mutable {
+    doRead(req, ino, size, off, &info);
+  });
+}
+
+static void doWrite(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                    size_t size, off_t off, struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_write(path.c_str(), buf, size, off, fi);
+  }
+  if (res >= 0) {
+    fuse_reply_write(req, res);
+    invalidateAliases(ll, ino, true);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  if (!ll->async) {
+    doWrite(req, ino, buf, size, off, fi);
+    return;
+  }
+  // the data lives in the receive buffer of the FUSE thread, which is
+  // reused as soon as we return
+  auto data = std::make_shared<PoolBlock>((int)size);
+  memcpy(data->data(), buf, size);
+  struct fuse_file_info info = *fi;
+  serve(ll, ThreadPool::Write, [=]() mutable {
+    doWrite(req, ino, (const char *)data->data(), size, off, &info);
+  });
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_flush(path.c_str(), fi);
+  }
+  replyErr(req, res);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  releaseBacking(req, ll, fi);
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_release(path.c_str(), fi);
+  }
+  replyErr(req, res);
+}
+
+static void doFsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                    struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_fsync(path.c_str(), datasync, fi);
+  }
+  replyErr(req, res);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi) {
+  struct fuse_file_info info = *fi;
+  serve(lowLevel(req), ThreadPool::Write, [=]() mutable {
+    doFsync(req, ino, datasync, &info);
+  });
+}
+
+#if FUSE_VERSION >= 29
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                         off_t offset, off_t length,
+                         struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_fallocate(path.c_str(), mode, offset, length, fi);
+  }
+  replyErr(req, res);
+  if (res == 0) {
+    invalidateAliases(ll, ino, true);
+  }
+}
+#endif
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_opendir(path.c_str(), fi);
+  }
+  if (res != 0) {
+    replyErr(req, res);
+  } else if (fuse_reply_open(req, fi) == -ENOENT) {
+    encfs_releasedir(path.c_str(), fi);
+  }
+}
+
+// the reply of a readdir, filled by encfs_readdir
+struct DirReply {
+  fuse_req_t req;
+  std::vector<char> data;
+  size_t used;
+};
+
+#if defined(fuse_fill_dir_flags)
+static int addDirEntry(void *buf, const char *name, const struct stat *st,
+                       off_t off, enum fuse_fill_dir_flags flags) {
+  (void)flags;
+#else
+static int addDirEntry(void *buf, const char *name, const struct stat *st,
+                       off_t off) {
+#endif
+  auto *reply = (DirReply *)buf;
+  size_t len = fuse_add_direntry(reply->req, nullptr, 0, name, nullptr, 0);
+  if (reply->used + len > reply->data.size()) {
+    return 1;
+  }
+  fuse_add_direntry(reply->req, reply->data.data() + reply->used,
+                    reply->data.size() - reply->used, name, st, off);
+  reply->used += len;
+  return 0;
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  DirReply reply;
+  reply.req = req;
+  reply.data.resize(size);
+  reply.used = 0;
+  if (res == 0) {
+    res = encfs_readdir(path.c_str(), &reply, addDirEntry, off, fi);
+  }
+  if (res == 0) {
+    fuse_reply_buf(req, reply.data.data(), reply.used);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  (void)ino;
+  replyErr(req, encfs_releasedir(nullptr, fi));
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  (void)ino;
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  struct statvfs st;
+  int res = encfs_statfs("/", &st);
+  if (res == 0) {
+    fuse_reply_statfs(req, &st);
+  } else {
+    replyErr(req, res);
+  }
+}
+
+#if defined(HAVE_XATTR) && !defined(XATTR_ADD_OPT)
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        const char *value, size_t size, int flags) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_setxattr(path.c_str(), name, value, size, flags);
+  }
+  replyErr(req, res);
+}
+
+// replies with the size of a value or list, or the value or list itself
+static void replyXattr(fuse_req_t req, size_t size, const char *buf,
+                       int res) {
+  if (res < 0) {
+    replyErr(req, res);
+  } else if (size == 0) {
+    fuse_reply_xattr(req, res);
+  } else {
+    fuse_reply_buf(req, buf, res);
+  }
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        size_t size) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  std::vector<char> buf(size);
+  if (res == 0) {
+    res = encfs_getxattr(path.c_str(), name, size ? buf.data() : nullptr,
+                         size);
+  }
+  replyXattr(req, size, buf.data(), res);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  std::vector<char> buf(size);
+  if (res == 0) {
+    res = encfs_listxattr(path.c_str(), size ? buf.data() : nullptr, size);
+  }
+  replyXattr(req, size, buf.data(), res);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+  LowLevel *ll = lowLevel(req);
+  CallerScope caller(req, ll);
+
+  string path;
+  int res = nodePath(ll, ino, &path);
+  if (res == 0) {
+    res = encfs_removexattr(path.c_str(), name);
+  }
+  replyErr(req, res);
+}
+#endif
+
+static bool takeTimeout(const string &opt, const char *name, double *out) {
+  size_t len = strlen(name);
+  if (opt.compare(0, len, name) != 0 || opt[len] != '=') {
+    return false;
+  }
+  *out = strtod(opt.c_str() + len + 1, nullptr);
+  return true;
+}
+
+// one option of a -o list, true if it is one of the library's
+static bool takeLibraryOpt(const string &opt, LowLevelOpts *opts) {
+  // inode numbers are always those of the backing files, and there are no
+  // paths to keep
+  static const char *ignored[] = {"use_ino",      "readdir_ino", "hard_remove",
+                                  "auto_cache",   "noauto_cache", "nopath",
+                                  "noforget",     "intr",        nullptr};
+  for (int i = 0; ignored[i] != nullptr; ++i) {
+    if (opt == ignored[i]) {
+      return true;
+    }
+  }
+  if (opt == "direct_io") {
+    opts->directIo = true;
+    return true;
+  }
+  if (opt == "kernel_cache") {
+    opts->keepCache = true;
+    return true;
+  }
+  return takeTimeout(opt, "attr_timeout", &opts->attrTimeout) ||
+         takeTimeout(opt, "entry_timeout", &opts->entryTimeout) ||
+         takeTimeout(opt, "negative_timeout", &opts->negativeTimeout);
+}
+
+// the arguments without the options of the high-level library
+static std::vector<string> takeLibraryOpts(int argc, char *argv[],
+                                           LowLevelOpts *opts) {
+  std::vector<string> kept;
+  for (int i = 0; i < argc; ++i) {
+    string list;
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      list = argv[++i];
+    } else if (strncmp(argv[i], "-o", 2) == 0 && argv[i][2] != '\0') {
+      list = argv[i] + 2;
+    } else {
+      kept.push_back(argv[i]);
+      continue;
+    }
+
+    string rest;
+    size_t start = 0;
+    while (start <= list.length()) {
+      size_t end = list.find(',', start);
+      if (end == string::npos) {
+        end = list.length();
+      }
+      string opt = list.substr(start, end - start);
+      if (!opt.empty() && !takeLibraryOpt(opt, opts)) {
+        rest += (rest.empty() ? "" : ",") + opt;
+      }
+      start = end + 1;
+    }
+    if (!rest.empty()) {
+      kept.push_back("-o" + rest);
+    }
+  }
+  return kept;
+}
+
+int encfs_lowlevel_main(int argc, char *argv[], EncFS_Context *ctx,
+                        ConnectionInit init) {
+  LowLevel ll;
+  ll.ctx = ctx;
+  ll.init = init;
+  ll.ch = nullptr;
+  ll.passthrough = false;
+  if (ctx->opts->pushReadahead) {
+    ll.pages = std::make_shared<KernelChannel>();
+  }
+
+  std::vector<string> kept = takeLibraryOpts(argc, argv, &ll.opts);
+  std::vector<char *> llArgv;
+  for (auto &arg : kept) {
+    llArgv.push_back(&arg[0]);
+  }
+  llArgv.push_back(nullptr);
+
+  // the root directory, without its trailing slash
+  const string &rootDir = ctx->opts->rootDir;
+  ll.inodes.reset(new InodeTable(rootDir.substr(0, rootDir.length() - 1)));
+  if (ctx->opts->asyncRequests > 0) {
+    // threads start with the first request, after fuse_daemonize
+    ll.async.reset(new ThreadPool(ctx->opts->asyncRequests));
+  }
+
+  struct fuse_lowlevel_ops ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.init = ll_init;
+  ops.lookup = ll_lookup;
+  ops.forget = ll_forget;
+#if FUSE_VERSION >= 29
+  ops.forget_multi = ll_forget_multi;
+#endif
+  ops.getattr = ll_getattr;
+  ops.setattr = ll_setattr;
+  ops.readlink = ll_readlink;
+  ops.mknod = ll_mknod;
+  ops.mkdir = ll_mkdir;
+  ops.unlink = ll_unlink;
+  ops.rmdir = ll_rmdir;
+  ops.symlink = ll_symlink;
+  ops.rename = ll_rename;
+  ops.link = ll_link;
+  ops.open = ll_open;
+  ops.create = ll_create;
+  ops.read = ll_read;
+  ops.write = ll_write;
+  ops.flush = ll_flush;
+  ops.release = ll_release;
+  ops.fsync = ll_fsync;
+#if FUSE_VERSION >= 29
+  ops.fallocate = ll_fallocate;
+#endif
+  ops.opendir = ll_opendir;
+  ops.readdir = ll_readdir;
+  ops.releasedir = ll_releasedir;
+  ops.statfs = ll_statfs;
+#if defined(HAVE_XATTR) && !defined(XATTR_ADD_OPT)
+  ops.setxattr = ll_setxattr;
+  ops.getxattr = ll_getxattr;
+  ops.listxattr = ll_listxattr;
+  ops.removexattr = ll_removexattr;
+#endif
+
+  struct fuse_args args = FUSE_ARGS_INIT((int)kept.size(), llArgv.data());
+  char *mountpoint = nullptr;
+  int multithreaded = 0;
+  int foreground = 0;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) ==
+      -1) {
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+
+  int err = -1;
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  ll.ch = ch;
+  if (ch != nullptr && ll.pages) {
+    ll.pages->set(ch);
+  }
+  if (ch != nullptr) {
+    struct fuse_session *se =
+        fuse_lowlevel_new(&args, &ops, sizeof(ops), (void *)&ll);
+    if (se != nullptr) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        if (fuse_daemonize(foreground) != -1) {
+          err = multithreaded != 0 ? fuseSessionLoop(se, ctx->opts.get())
+                                   : fuse_session_loop(se);
+        }
+        // answer what is being served while the session is still there
+        ll.async.reset();
+        if (ll.pages) {
+          // read-ahead jobs still running push nowhere
+          ll.pages->set(nullptr);
+        }
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+
+  free(mountpoint);
+  fuse_opt_free_args(&args);
+  return err != 0 ? 1 : 0;
+}
+
+}  // namespace encfs
@@ -0,0 +1,38 @@
+#ifndef _lowlevel_incl_
+#define _lowlevel_incl_
+
+#include <fuse.h>
+
+namespace encfs {
+
+class EncFS_Context;
+
+// sets up a connection once the kernel has made it, as fuse's init does
+using ConnectionInit = void (*)(EncFS_Context *ctx,
+                                struct fuse_conn_info *conn);
+
+/*
+    Serves the filesystem through the FUSE low-level interface, given the
+    arguments fuse_main would take.
+
+    Requests come by inode rather than by path: each inode the kernel knows
+    about keeps the encoding of its name and the IV chain of its path, so a
+    lookup encodes one name and stats it relative to the backing directory
+    of its parent, rather than encoding every component of the path and
+    walking it.  Everything else goes through the path based handlers of
+    encfs.cpp, given the path of the inode.
+
+    Changes made through the mount are pushed to the kernel's caches, so
+    long attr_timeout and entry_timeout values are safe as long as nothing
+    else changes the backing directory (see --cache-timeout).
+
+    Options only the high-level library knows (attr_timeout, entry_timeout,
+    negative_timeout, direct_io, kernel_cache, use_ino and the like) are
+    taken here rather than passed on.  Reverse mode is not supported.
+ */
+int encfs_lowlevel_main(int argc, char *argv[], EncFS_Context *ctx,
+                        ConnectionInit init);
+
+}  // namespace encfs
+
+#endif
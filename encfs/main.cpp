@@ -17,16 +17,20 @@
  */
 
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <exception>
+#include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <pthread.h>
 #include <sstream>
+#include <stdint.h>
 #include <string>
 #ifdef __CYGWIN__
 #include <sys/cygwin.h>
@@ -34,16 +38,30 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 #include "Context.h"
 #include "Error.h"
 #include "FileUtils.h"
+#include "FuseLoop.h"
+#include "IoScheduler.h"
+#include "IoUringFileIO.h"
+#include "KernelCrypto.h"
+#include "MemoryGovernor.h"
 #include "MemoryPool.h"
+#include "Mutex.h"
+#include "OpStats.h"
+#include "OpTrace.h"
+#include "Scrubber.h"
+#include "StatsServer.h"
+#include "Trace.h"
 #include "autosprintf.h"
 #include "config.h"
 #include "encfs.h"
 #include "fuse.h"
 #include "i18n.h"
+#include "lowlevel.h"
 #include "openssl.h"
 
 /* Arbitrary identifiers for long options that do
@@ -54,6 +72,74 @@
 #define LONG_OPT_NOATTRCACHE 516
 #define LONG_OPT_REQUIRE_MAC 517
 #define LONG_OPT_INSECURE 518
+#define LONG_OPT_BLOCKCACHE 519
+#define LONG_OPT_READAHEAD 520
+#define LONG_OPT_CRYPTO_THREADS 521
+#define LONG_OPT_NOWRITEBACK 522
+#define LONG_OPT_IO_URING 523
+#define LONG_OPT_DIRECT_IO 524
+#define LONG_OPT_NOMMAP 525
+#define LONG_OPT_SYNC_TRUNCATE 526
+#define LONG_OPT_REVERSE_CHECK 527
+#define LONG_OPT_POOL_CACHE 528
+#define LONG_OPT_LAZY_WIPE 529
+#define LONG_OPT_LOCKED_BUFFERS 530
+#define LONG_OPT_NEGATIVE_TIMEOUT 531
+#define LONG_OPT_LOWLEVEL 532
+#define LONG_OPT_MAX_WRITE 533
+#define LONG_OPT_MAX_READ 534
+#define LONG_OPT_MAX_READAHEAD 535
+#define LONG_OPT_MAX_BACKGROUND 536
+#define LONG_OPT_CONGESTION 537
+#define LONG_OPT_NOBIGWRITES 538
+#define LONG_OPT_SPLICE 539
+#define LONG_OPT_CACHE_TIMEOUT 540
+#define LONG_OPT_WRITEBACK_CACHE 541
+#define LONG_OPT_STATS_SOCKET 542
+#define LONG_OPT_TRACE 543
+#define LONG_OPT_SLOW_OP 544
+#define LONG_OPT_KEY_CACHE 545
+#define LONG_OPT_SCRUB 546
+#define LONG_OPT_SCRUB_IDLE 547
+#define LONG_OPT_SCRUB_STATE 548
+#define LONG_OPT_GROUP_SYNC 549
+#define LONG_OPT_ATTR_TTL 550
+#define LONG_OPT_STATFS_CACHE 551
+#define LONG_OPT_HOT_CACHE 552
+#define LONG_OPT_PIN 553
+#define LONG_OPT_HOT_OPENS 554
+#define LONG_OPT_DIGEST_CACHE 555
+#define LONG_OPT_SKIP_UNCHANGED 556
+#define LONG_OPT_CRYPTO_ENGINE 557
+#define LONG_OPT_CACHE_MEMORY 558
+#define LONG_OPT_FAIR_SHARE 559
+#define LONG_OPT_UID_WEIGHT 560
+#define LONG_OPT_UID_RATE 561
+#define LONG_OPT_NUMA_PIN 562
+#define LONG_OPT_FUSE_THREADS 563
+#define LONG_OPT_MAX_IDLE_THREADS 564
+#define LONG_OPT_NOCLONE_FD 565
+#define LONG_OPT_ASYNC_REQUESTS 566
+#define LONG_OPT_LOCK_PROFILE 567
+#define LONG_OPT_VOLUMES 568
+#define LONG_OPT_WRITE_JOURNAL 569
+#define LONG_OPT_AUTOTUNE 570
+#define LONG_OPT_UNCACHED 571
+#define LONG_OPT_UNCACHED_OVER 572
+#define LONG_OPT_MEMORY_PRESSURE 573
+#define LONG_OPT_OPEN_PREFETCH 574
+#define LONG_OPT_CIPHERTEXT_CACHE 575
+#define LONG_OPT_CIPHERTEXT_CACHE_SIZE 576
+#define LONG_OPT_DEFERRED_UNLINK 577
+#define LONG_OPT_WARM_RESTART 578
+#define LONG_OPT_PUSH_READAHEAD 579
+#define LONG_OPT_RECORD_OPS 580
+#define LONG_OPT_OBJECT_STORE 581
+#define LONG_OPT_OBJECT_CACHE_SIZE 582
+#define LONG_OPT_SHARDS 583
+#define LONG_OPT_CALIBRATE 584
+#define LONG_OPT_INTERACTIVE 585
+#define LONG_OPT_DIR_INDEX 586
 
 using namespace std;
 using namespace encfs;
@@ -75,11 +161,26 @@ const int MaxFuseArgs = 32;
 struct EncFS_Args {
   bool isDaemon;    // true == spawn in background, log to syslog
   bool isThreaded;  // true == threaded
+  bool lowLevel;    // true == serve through the FUSE low-level API
   bool isVerbose;   // false == only enable warning/error messages
   int idleTimeout;  // 0 == idle time in minutes to trigger unmount
   const char *fuseArgv[MaxFuseArgs];
   int fuseArgc;
   std::string syslogTag;  // syslog tag to use when logging using syslog
+  std::string negativeTimeoutArg;  // storage for the FUSE option
+  std::string maxReadArg;          // storage for the FUSE option
+  std::string cacheTimeoutArg;     // storage for the FUSE option
+  int cacheTimeout;  // seconds the kernel caches attributes, 0 == default
+  std::string statsSocket;  // absolute path of the stats socket, or empty
+  std::string recordOps;    // absolute path of the op trace, or empty
+  int scrubRate;            // MiB/s the scrubber reads, 0 == no scrubber
+  int scrubIdleSecs;        // idle seconds before scrubbing, 0 == always
+  std::string scrubState;   // absolute path of the scrub state, or empty
+  int fairSlots;            // reads and writes served at once, shared out
+                            // by uid, 0 == first come first served
+  std::vector<std::pair<uid_t, int>> uidWeights;      // --uid-weight
+  std::vector<std::pair<uid_t, uint64_t>> uidRates;   // --uid-rate, bytes/s
+  std::string volumesFile;  // --volumes, or empty
 
   std::shared_ptr<EncFS_Opts> opts;
 
@@ -91,9 +192,37 @@ struct EncFS_Args {
     ostringstream ss;
     ss << (isDaemon ? "(daemon) " : "(fg) ");
     ss << (isThreaded ? "(threaded) " : "(UP) ");
+    if (lowLevel) {
+      ss << "(lowlevel) ";
+    }
     if (idleTimeout > 0) {
       ss << "(timeout " << idleTimeout << ") ";
     }
+    if (!statsSocket.empty()) {
+      ss << "(stats " << statsSocket << ") ";
+    }
+    if (scrubRate > 0) {
+      ss << "(scrub " << scrubRate << "MiB/s";
+      if (scrubIdleSecs > 0) {
+        ss << " idle " << scrubIdleSecs << "s";
+      }
+      ss << ") ";
+    }
+    if (fairSlots > 0) {
+      ss << "(fair-share " << fairSlots << ") ";
+    }
+    if (Trace::enabled) {
+      ss << "(trace) ";
+    }
+    if (!recordOps.empty()) {
+      ss << "(record-ops " << recordOps << ") ";
+    }
+    if (LockProfile::enabled) {
+      ss << "(lock-profile) ";
+    }
+    if (OpStats::slowThresholdNs > 0) {
+      ss << "(slow-op " << OpStats::slowThresholdNs / 1000000 << "ms) ";
+    }
     if (opts->checkKey) {
       ss << "(keyCheck) ";
     }
@@ -115,6 +244,9 @@ struct EncFS_Args {
     if (opts->mountOnDemand) {
       ss << "(mountOnDemand) ";
     }
+    if (opts->keyCacheSeconds > 0) {
+      ss << "(keyCache " << opts->keyCacheSeconds << "s) ";
+    }
     if (opts->delayMount) {
       ss << "(delayMount) ";
     }
@@ -168,10 +300,247 @@ static void usage(const char *name) {
             "reverse encryption\n")
        << _("  --reversewrite\t\t"
             "reverse encryption with writes enabled\n")
+       << _("  --autotune\t\t"
+            "when creating a volume, benchmark the ciphers,\n"
+            "\t\t\tblock sizes and MACs on this host and in rootDir\n"
+            "\t\t\tand propose the fastest that meets the standard\n"
+            "\t\t\t(or with --paranoia, the paranoia) settings\n")
        << _("  -c, --config=path\t\t"
             "specifies config file (overrides ENV variable)\n")
        << _("  -u, --unmount\t\t"
             "unmounts specified mountPoint\n")
+       << _("  --volumes=FILE\t"
+            "serve every volume listed in FILE from this one\n"
+            "\t\t\tprocess, sharing its worker threads and block\n"
+            "\t\t\tcache; a line each with the options, rootDir\n"
+            "\t\t\tand mountPoint of the volume.  With --extpass\n"
+            "\t\t\tor --stdinpass, one password is read for the\n"
+            "\t\t\tvolumes that ask for none, and they are\n"
+            "\t\t\tunlocked in parallel\n")
+       << _("  --blockcache=MB\t"
+            "memory for decoded blocks, shared by all open files\n"
+            "\t\t\t(default 16, 0 disables the block cache)\n")
+       << _("  --readahead=BLOCKS\t"
+            "blocks to prefetch when a file is read sequentially\n"
+            "\t\t\t(default 32, 0 disables read-ahead)\n")
+       << _("  --open-prefetch=BLOCKS\t"
+            "decode the first BLOCKS blocks of a file into the\n"
+            "\t\t\tblock cache as it is opened for reading, for\n"
+            "\t\t\treaders that only look at its start (default 0)\n")
+       << _("  --crypto-threads=N\t"
+            "decode large reads and directory listings on N\n"
+            "\t\t\tworker threads, or 'auto' for one per CPU\n"
+            "\t\t\t(default 0, decode in the caller)\n")
+       << _("  --calibrate\t\t"
+            "size the crypto threads and read-ahead that are not\n"
+            "\t\t\tgiven by how fast this host codes the volume's\n"
+            "\t\t\tblocks and rootDir reads them, measured as it is\n"
+            "\t\t\tmounted and remembered for a week in ~/.cache\n")
+       << _("  --interactive\t\t"
+            "keep other operations waiting briefly: large writes\n"
+            "\t\t\tunlock the file between slices, and recursive\n"
+            "\t\t\trenames list what they move without blocking the\n"
+            "\t\t\tdirectory tree\n")
+       << _("  --crypto-engine=NAME	"
+            "code file blocks with 'openssl' (default), or with\n"
+            "\t\t\t'kernel' crypto, using any accelerator it has\n")
+       << _("  --numa-pin\t\t"
+            "keep FUSE and crypto threads on the NUMA node they\n"
+            "\t\t\tstart on, next to their buffers\n")
+       << _("  --nowriteback\t\t"
+            "write small appends through instead of merging them\n")
+       << _("  --io-uring\t\t"
+            "read and write the backing files through io_uring\n")
+       << _("  --direct-io		"
+            "bypass the page cache of the backing filesystem\n")
+       << _("  --nommap		"
+            "read-only mounts read with pread instead of mmap\n")
+       << _("  --sync-truncate	"
+            "sync backing files to disk after every truncate\n")
+       << _("  --reverse-check=MS\t"
+            "reverse mode: check source files for changes at most\n"
+            "\t\t\tevery MS milliseconds before using cached blocks\n"
+            "\t\t\t(default 1000, 0 checks on every read)\n")
+       << _("  --pool-cache=MB\t"
+            "keep at most MB megabytes of freed buffers for reuse\n"
+            "\t\t\t(default 32)\n")
+       << _("  --lazy-wipe\t\t"
+            "clear freed buffers when they are reused rather than\n"
+            "\t\t\twhen they are freed\n")
+       << _("  --locked-buffers=MB\t"
+            "take up to MB megabytes of buffers from memory locked\n"
+            "\t\t\tagainst swapping, on huge pages where available\n")
+       << _("  --group-sync=US\t"
+            "let an fsync wait up to US microseconds for others,\n"
+            "\t\t\tand sync them together (0 joins only those made\n"
+            "\t\t\twhile another runs)\n")
+       << _("  --write-journal\t"
+            "on volumes with block MACs, log writes to a journal\n"
+            "\t\t\tin the root of the backing directory, so a crash\n"
+            "\t\t\tleaves no torn block; an fsync only syncs it\n")
+       << _("  --warm-restart\t"
+            "keep the encoded paths, file headers and directory\n"
+            "\t\t\tlistings cached, encrypted, from one mount to the\n"
+            "\t\t\tnext\n")
+       << _("  --push-readahead\t"
+            "with --lowlevel, store what read-ahead decodes in\n"
+            "\t\t\tthe kernel's page cache, so the reads it was done\n"
+            "\t\t\tfor do not come up to encfs\n")
+       << _("  --deferred-unlink=MB\t"
+            "move unlinked files of at least MB megabytes to a\n"
+            "\t\t\ttrash in the root of the backing directory, and\n"
+            "\t\t\tfree their space in the background\n")
+       << _("  --negative-timeout=MS\t"
+            "remember names found not to exist for MS milliseconds\n"
+            "\t\t\t(default 1000, 0 looks them up every time)\n")
+       << _("  --attr-ttl=MS\t\t"
+            "remember the attributes of closed files, and the\n"
+            "\t\t\textended attributes of all files, for MS milliseconds\n"
+            "\t\t\t(default 1000, 0 asks the backing filesystem every\n"
+            "\t\t\ttime)\n")
+       << _("  --statfs-cache=MS\t"
+            "answer statfs from the last result for MS milliseconds\n"
+            "\t\t\t(default 1000, 0 asks the backing filesystem every\n"
+            "\t\t\ttime)\n")
+       << _("  --hot-cache=MB\t"
+            "keep decoded copies of hot files in up to MB megabytes\n"
+            "\t\t\tof locked memory (default 0, off)\n")
+       << _("  --pin=PATH\t\t"
+            "copy the files below PATH into the hot file cache when\n"
+            "\t\t\tread (may be given more than once)\n")
+       << _("  --uncached=GLOB\t"
+            "open the files whose path matches GLOB past the\n"
+            "\t\t\tkernel's page cache, so that streaming them goes\n"
+            "\t\t\tthrough the block cache and read-ahead of encfs\n"
+            "\t\t\tonly (may be given more than once)\n"
+            "  --uncached-over=MB\t"
+            "the same for files of at least MB megabytes\n")
+       << _("  --hot-opens=N\t\t"
+            "copy files into the hot file cache once opened N\n"
+            "\t\t\ttimes (default 4, 0 only copies pinned files)\n")
+       << _("  --digest-cache=PATH\t"
+            "reverse mode: keep digests of the encoded files in\n"
+            "\t\t\tPATH, read as the user.encfs.digest attribute\n")
+       << _("  --ciphertext-cache=DIR\t"
+            "keep chunks of the backing files, as stored, in the\n"
+            "\t\t\tlocal directory DIR, for backing directories on a\n"
+            "\t\t\tslow network filesystem\n")
+       << _("  --ciphertext-cache-size=MB\n"
+            "\t\t\tmegabytes the ciphertext cache holds (default\n"
+            "\t\t\t1024)\n")
+       << _("  --object-store=URL\t"
+            "keep the data of the files written in the S3\n"
+            "\t\t\tcompatible store at http[s]://host/bucket[/prefix],\n"
+            "\t\t\twith the credentials of AWS_ACCESS_KEY_ID and\n"
+            "\t\t\tAWS_SECRET_ACCESS_KEY; with --ciphertext-cache for a\n"
+            "\t\t\tcache on local disk\n")
+       << _("  --object-cache-size=MB\n"
+            "\t\t\tmegabytes of the object store held in memory\n"
+            "\t\t\t(default 256)\n")
+       << _("  --dir-index=N\t\t"
+            "keep an encrypted index of the names and attributes\n"
+            "\t\t\tof directories of N names or more, so that lookups\n"
+            "\t\t\tand listings of them skip the backing directory;\n"
+            "\t\t\tfiles changed behind the mount's back keep their\n"
+            "\t\t\told attributes until their directory changes\n")
+       << _("  --skip-unchanged	"
+            "do not encode and write again blocks rewritten with\n"
+            "\t\t\tthe data the block cache has for them; the backing\n"
+            "\t\t\tfile's mtime is then left as it was\n")
+       << _("  --cache-memory=MB\t"
+            "hold the block cache, the hot file cache and the\n"
+            "\t\t\tbuffer pool to MB megabytes together, shrinking\n"
+            "\t\t\tthem under cgroup memory pressure\n")
+       << _("  --memory-pressure\t"
+            "without --cache-memory, shrink the block cache, the\n"
+            "\t\t\thot file cache and the buffer pool in proportion\n"
+            "\t\t\tunder cgroup or system memory pressure, and grow\n"
+            "\t\t\tthem back once it clears\n")
+       << _("  --max-write=KB\t"
+            "largest write request the kernel sends (default\n"
+            "\t\t\t1024, as far as kernel and libfuse allow)\n"
+            "  --max-read=KB\t\t"
+            "largest read request the kernel sends\n"
+            "  --max-readahead=KB\t"
+            "kernel read-ahead (default: the kernel's maximum)\n"
+            "  --max-background=N\t"
+            "background requests the kernel keeps in flight\n"
+            "\t\t\t(default 64)\n"
+            "  --congestion-threshold=N\t"
+            "background requests at which the kernel throttles\n"
+            "\t\t\t(default 3/4 of --max-background)\n"
+            "  --nobigwrites\t\t"
+            "have the kernel write a page at a time\n"
+            "  --splice=LIST\t\t"
+            "move data through pipes: any of read,write,move,\n"
+            "\t\t\tor none (default write)\n"
+            "  --fuse-threads=N\t"
+            "most threads serving FUSE requests, each reading\n"
+            "\t\t\ta /dev/fuse of its own (default 10)\n"
+            "  --max-idle-threads=N\t"
+            "FUSE threads kept when idle (default 10)\n"
+            "  --noclone-fd\t\t"
+            "have all FUSE threads read one /dev/fuse\n")
+       << _("  --shards=N\t\t"
+            "serve the requests of each file on one of N\n"
+            "\t\t\tthreads, a core each, the FUSE threads only\n"
+            "\t\t\treading them (0 for one per core)\n")
+       << _("  --writeback-cache\t"
+            "have the kernel cache writes and merge them into\n"
+            "\t\t\twhole pages (Linux 3.15 and later)\n")
+       << _("  --lowlevel\t\t"
+            "serve requests by inode through the FUSE low-level\n"
+            "\t\t\tinterface rather than by path\n")
+       << _("  --cache-timeout=S\t"
+            "have the kernel cache attributes and names for S\n"
+            "\t\t\tseconds, for mounts nothing else writes behind\n"
+            "\t\t\t(needs --lowlevel)\n")
+       << _("  --async-requests=N\t"
+            "serve reads, writes and syncs on N threads of their\n"
+            "\t\t\town, keeping up to N in flight on slow backing\n"
+            "\t\t\tstores (needs --lowlevel)\n")
+       << _("  --stats-socket=PATH\t"
+            "serve operation counters and latencies on a Unix\n"
+            "\t\t\tsocket, as the user.encfs.stats attribute of\n"
+            "\t\t\tthe mount root is\n")
+       << _("  --slow-op=MS\t\t"
+            "log operations taking MS milliseconds or more, with\n"
+            "\t\t\tthe time spent coding names and data, waiting\n"
+            "\t\t\tfor file locks and on the backing files\n")
+       << _("  --lock-profile\t"
+            "count the acquisitions, waits and hold times of the\n"
+            "\t\t\tfile, directory, context and key locks, served\n"
+            "\t\t\tby --stats-socket and logged at unmount\n")
+       << _("  --trace\t\t"
+            "keep the recent block reads and writes of every\n"
+            "\t\t\tthread, read as the user.encfs.trace attribute\n"
+            "\t\t\tof the mount root\n")
+       << _("  --record-ops=FILE\t"
+            "record every operation, with its time and the hash\n"
+            "\t\t\tof the encoded path, to FILE for replaying with\n"
+            "\t\t\tencfs_bench_replay\n")
+       << _("  --key-cache=S\t\t"
+            "keep the volume key in the kernel keyring for S\n"
+            "\t\t\tseconds, so that mounting again (--ondemand) needs\n"
+            "\t\t\tno password; processes of the user can read it\n")
+       << _("  --scrub=MB\t\t"
+            "check the MACs of files not changed for an hour in\n"
+            "\t\t\tthe background, reading at most MB megabytes a\n"
+            "\t\t\tsecond at idle priority\n"
+            "  --scrub-idle=S\t"
+            "scrub only once the mount was idle for S seconds\n"
+            "  --scrub-state=PATH\t"
+            "keep the progress of the scrub in PATH, so that the\n"
+            "\t\t\tnext mount carries on where this one stopped\n")
+       << _("  --fair-share=N\t"
+            "serve at most N reads and writes at once, letting the\n"
+            "\t\t\twaiting ones in fairly by the user making them\n"
+            "  --uid-weight=UID:W\t"
+            "give user UID W times the share of others (default\n"
+            "\t\t\t1, may be given more than once)\n"
+            "  --uid-rate=UID:MB\t"
+            "hold the reads and writes of user UID to MB\n"
+            "\t\t\tmegabytes a second (may be given more than once)\n")
 
        // xgroup(usage)
        << _("  --extpass=program\tUse external program for password prompt\n"
@@ -210,13 +579,46 @@ static string slashTerminate(const string &src) {
   return result;
 }
 
+// true if the comma separated fuse option list has option
+static bool hasMountOption(const char *list, const char *option) {
+  istringstream in(list);
+  string item;
+  while (getline(in, item, ',')) {
+    if (item == option) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// parses "UID:N" into *uid and *value
+static bool parseUidValue(const char *arg, uid_t *uid, long *value) {
+  char *end = nullptr;
+  long id = strtol(arg, &end, 10);
+  if (end == arg || *end != ':' || id < 0) {
+    return false;
+  }
+  const char *num = end + 1;
+  *value = strtol(num, &end, 10);
+  if (end == num || *end != '\0') {
+    return false;
+  }
+  *uid = (uid_t)id;
+  return true;
+}
+
 static bool processArgs(int argc, char *argv[],
                         const std::shared_ptr<EncFS_Args> &out) {
   // set defaults
   out->isDaemon = true;
   out->isThreaded = true;
+  out->lowLevel = false;
+  out->cacheTimeout = 0;
   out->isVerbose = false;
   out->idleTimeout = 0;
+  out->scrubRate = 0;
+  out->scrubIdleSecs = 0;
+  out->fairSlots = 0;
   out->fuseArgc = 0;
   out->syslogTag = "encfs";
   out->opts->idleTracking = false;
@@ -231,6 +633,10 @@ static bool processArgs(int argc, char *argv[],
   out->opts->unmount = false;
 
   bool useDefaultFlags = true;
+  // --calibrate sizes what is not given
+  bool calibrate = false;
+  bool readAheadGiven = false;
+  bool cryptoThreadsGiven = false;
 
   // pass executable name through
   out->fuseArgv[0] = lastPathElement(argv[0]);
@@ -262,16 +668,84 @@ static bool processArgs(int argc, char *argv[],
       {"nocache", 0, nullptr, LONG_OPT_NOCACHE},         // disable all caching
       {"nodatacache", 0, nullptr, LONG_OPT_NODATACACHE}, // disable data caching
       {"noattrcache", 0, nullptr, LONG_OPT_NOATTRCACHE}, // disable attr caching
+      {"blockcache", 1, nullptr, LONG_OPT_BLOCKCACHE},   // block cache size
+      {"readahead", 1, nullptr, LONG_OPT_READAHEAD},     // read-ahead blocks
+      {"open-prefetch", 1, nullptr, LONG_OPT_OPEN_PREFETCH}, // open prefetch
+      {"crypto-threads", 1, nullptr, LONG_OPT_CRYPTO_THREADS}, // crypto pool
+      {"calibrate", 0, nullptr, LONG_OPT_CALIBRATE},  // measured pool sizes
+      {"interactive", 0, nullptr, LONG_OPT_INTERACTIVE},  // short lock holds
+      {"crypto-engine", 1, nullptr, LONG_OPT_CRYPTO_ENGINE}, // block cipher
+      {"numa-pin", 0, nullptr, LONG_OPT_NUMA_PIN},           // NUMA local
+      {"nowriteback", 0, nullptr, LONG_OPT_NOWRITEBACK}, // no write merging
+      {"io-uring", 0, nullptr, LONG_OPT_IO_URING},       // io_uring backend
+      {"direct-io", 0, nullptr, LONG_OPT_DIRECT_IO},     // O_DIRECT backend
+      {"nommap", 0, nullptr, LONG_OPT_NOMMAP},           // no mmap reads
+      {"sync-truncate", 0, nullptr, LONG_OPT_SYNC_TRUNCATE}, // strict truncate
+      {"reverse-check", 1, nullptr, LONG_OPT_REVERSE_CHECK}, // cache checks
+      {"pool-cache", 1, nullptr, LONG_OPT_POOL_CACHE},   // buffer pool size
+      {"lazy-wipe", 0, nullptr, LONG_OPT_LAZY_WIPE},     // wipe on reuse
+      {"locked-buffers", 1, nullptr, LONG_OPT_LOCKED_BUFFERS}, // mlock arena
+      {"negative-timeout", 1, nullptr, LONG_OPT_NEGATIVE_TIMEOUT}, // ENOENT
+      {"lowlevel", 0, nullptr, LONG_OPT_LOWLEVEL},       // inode frontend
+      {"max-write", 1, nullptr, LONG_OPT_MAX_WRITE},     // request sizes
+      {"max-read", 1, nullptr, LONG_OPT_MAX_READ},
+      {"max-readahead", 1, nullptr, LONG_OPT_MAX_READAHEAD},
+      {"max-background", 1, nullptr, LONG_OPT_MAX_BACKGROUND}, // queue depth
+      {"fuse-threads", 1, nullptr, LONG_OPT_FUSE_THREADS},     // workers
+      {"max-idle-threads", 1, nullptr, LONG_OPT_MAX_IDLE_THREADS},
+      {"noclone-fd", 0, nullptr, LONG_OPT_NOCLONE_FD},  // one channel
+      {"shards", 1, nullptr, LONG_OPT_SHARDS},  // a thread per core
+      {"async-requests", 1, nullptr, LONG_OPT_ASYNC_REQUESTS},  // ll pool
+      {"congestion-threshold", 1, nullptr, LONG_OPT_CONGESTION},
+      {"nobigwrites", 0, nullptr, LONG_OPT_NOBIGWRITES}, // page sized writes
+      {"splice", 1, nullptr, LONG_OPT_SPLICE},           // pipe transfers
+      {"cache-timeout", 1, nullptr, LONG_OPT_CACHE_TIMEOUT}, // kernel caches
+      {"writeback-cache", 0, nullptr, LONG_OPT_WRITEBACK_CACHE}, // page cache
+      {"stats-socket", 1, nullptr, LONG_OPT_STATS_SOCKET}, // counters
+      {"trace", 0, nullptr, LONG_OPT_TRACE},             // event rings
+      {"record-ops", 1, nullptr, LONG_OPT_RECORD_OPS},   // op trace
+      {"lock-profile", 0, nullptr, LONG_OPT_LOCK_PROFILE}, // lock contention
+      {"slow-op", 1, nullptr, LONG_OPT_SLOW_OP},         // latency warnings
+      {"key-cache", 1, nullptr, LONG_OPT_KEY_CACHE},     // keyring timeout
+      {"scrub", 1, nullptr, LONG_OPT_SCRUB},             // background verify
+      {"scrub-idle", 1, nullptr, LONG_OPT_SCRUB_IDLE},   // only when idle
+      {"scrub-state", 1, nullptr, LONG_OPT_SCRUB_STATE}, // scrub progress
+      {"group-sync", 1, nullptr, LONG_OPT_GROUP_SYNC},   // batched fsync
+      {"write-journal", 0, nullptr, LONG_OPT_WRITE_JOURNAL},  // logged writes
+      {"deferred-unlink", 1, nullptr, LONG_OPT_DEFERRED_UNLINK},  // trash
+      {"warm-restart", 0, nullptr, LONG_OPT_WARM_RESTART},  // cache snapshot
+      {"push-readahead", 0, nullptr, LONG_OPT_PUSH_READAHEAD},  // page cache
+      {"attr-ttl", 1, nullptr, LONG_OPT_ATTR_TTL},       // closed file attrs
+      {"statfs-cache", 1, nullptr, LONG_OPT_STATFS_CACHE}, // df results
+      {"hot-cache", 1, nullptr, LONG_OPT_HOT_CACHE},     // hot file copies
+      {"pin", 1, nullptr, LONG_OPT_PIN},                 // always copied
+      {"hot-opens", 1, nullptr, LONG_OPT_HOT_OPENS},     // copied when hot
+      {"uncached", 1, nullptr, LONG_OPT_UNCACHED},       // direct_io files
+      {"uncached-over", 1, nullptr, LONG_OPT_UNCACHED_OVER},
+      {"digest-cache", 1, nullptr, LONG_OPT_DIGEST_CACHE}, // reverse digests
+      {"ciphertext-cache", 1, nullptr, LONG_OPT_CIPHERTEXT_CACHE}, // local
+      {"ciphertext-cache-size", 1, nullptr, LONG_OPT_CIPHERTEXT_CACHE_SIZE},
+      {"object-store", 1, nullptr, LONG_OPT_OBJECT_STORE},  // S3 backend
+      {"object-cache-size", 1, nullptr, LONG_OPT_OBJECT_CACHE_SIZE},
+      {"dir-index", 1, nullptr, LONG_OPT_DIR_INDEX},  // large directories
+      {"skip-unchanged", 0, nullptr, LONG_OPT_SKIP_UNCHANGED}, // no rewrites
+      {"cache-memory", 1, nullptr, LONG_OPT_CACHE_MEMORY}, // shared budget
+      {"memory-pressure", 0, nullptr, LONG_OPT_MEMORY_PRESSURE},
+      {"fair-share", 1, nullptr, LONG_OPT_FAIR_SHARE},   // per-uid queueing
+      {"uid-weight", 1, nullptr, LONG_OPT_UID_WEIGHT},
+      {"uid-rate", 1, nullptr, LONG_OPT_UID_RATE},
       {"verbose", 0, nullptr, 'v'},               // verbose mode
       {"version", 0, nullptr, 'V'},               // version
       {"reverse", 0, nullptr, 'r'},               // reverse encryption
       {"reversewrite", 0, nullptr, 'R'},          // reverse encryption with write enabled
       {"standard", 0, nullptr, '1'},              // standard configuration
       {"paranoia", 0, nullptr, '2'},              // standard configuration
+      {"autotune", 0, nullptr, LONG_OPT_AUTOTUNE},  // benchmarked config
       {"require-macs", 0, nullptr, LONG_OPT_REQUIRE_MAC},  // require MACs
       {"insecure", 0, nullptr, LONG_OPT_INSECURE},// allows to use null data encryption
       {"config", 1, nullptr, 'c'},                // command-line-supplied config location
       {"unmount", 1, nullptr, 'u'},               // unmount
+      {"volumes", 1, nullptr, LONG_OPT_VOLUMES},  // many mounts
       {nullptr, 0, nullptr, 0}};
 
   while (true) {
@@ -325,6 +799,9 @@ static bool processArgs(int argc, char *argv[],
          * line instead of ENV variable */
         out->opts->config.assign(optarg);
         break;
+      case LONG_OPT_VOLUMES:
+        out->volumesFile.assign(optarg);
+        break;
       case 'u':
         //we want to log to console, not to syslog, in case of error
         out->isDaemon = false;
@@ -398,6 +875,614 @@ static bool processArgs(int argc, char *argv[],
       case LONG_OPT_NODATACACHE:
         out->opts->noCache = true;
         break;
+      case LONG_OPT_NOWRITEBACK:
+        out->opts->writeBack = false;
+        break;
+      case LONG_OPT_SYNC_TRUNCATE:
+        out->opts->syncTruncate = true;
+        break;
+      case LONG_OPT_CRYPTO_ENGINE:
+        if (strcmp(optarg, "kernel") == 0) {
+          out->opts->kernelCrypto = true;
+        } else if (strcmp(optarg, "openssl") == 0) {
+          out->opts->kernelCrypto = false;
+        } else {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid crypto engine: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        break;
+      case LONG_OPT_SKIP_UNCHANGED:
+        out->opts->skipUnchanged = true;
+        break;
+      case LONG_OPT_NUMA_PIN:
+        out->opts->numaPin = true;
+        break;
+      case LONG_OPT_LAZY_WIPE:
+        out->opts->lazyWipe = true;
+        break;
+      case LONG_OPT_NOMMAP:
+        out->opts->mmapReads = false;
+        break;
+      case LONG_OPT_DIRECT_IO:
+        out->opts->directIO = true;
+        break;
+      case LONG_OPT_IO_URING:
+        if (IoUringFileIO::supported()) {
+          out->opts->ioUring = true;
+        } else {
+          // xgroup(usage)
+          cerr << _("io_uring is not available, using normal file I/O")
+               << "\n";
+        }
+        break;
+      case LONG_OPT_BLOCKCACHE: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb < 0) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid block cache size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        // in 64 bits, and clamped rather than overflowed
+        const long maxMb = LONG_MAX / (1024 * 1024);
+        out->opts->blockCacheSize =
+            (long)((int64_t)(mb < maxMb ? mb : maxMb) * 1024 * 1024);
+        break;
+      }
+      case LONG_OPT_POOL_CACHE: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb < 0 || mb > 64 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid pool cache size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->poolCacheSize = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_LOCKED_BUFFERS: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb < 0 || mb > 64 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid locked buffer size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->lockedBuffers = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_NEGATIVE_TIMEOUT: {
+        char *end = nullptr;
+        long ms = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || ms < 0 || ms > 3600 * 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid negative timeout: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->negativeTimeoutMs = (int)ms;
+        break;
+      }
+      case LONG_OPT_GROUP_SYNC: {
+        char *end = nullptr;
+        long us = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || us < 0 || us > 1000 * 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid group sync window: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->groupSyncUs = (int)us;
+        break;
+      }
+      case LONG_OPT_WRITE_JOURNAL:
+        out->opts->writeJournal = true;
+        break;
+      case LONG_OPT_WARM_RESTART:
+        out->opts->warmRestart = true;
+        break;
+      case LONG_OPT_PUSH_READAHEAD:
+        out->opts->pushReadahead = true;
+        break;
+      case LONG_OPT_DEFERRED_UNLINK: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb <= 0 || mb > 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid deferred unlink size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->deferredUnlinkBytes = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_AUTOTUNE:
+        out->opts->autotune = true;
+        break;
+      case LONG_OPT_ATTR_TTL: {
+        char *end = nullptr;
+        long ms = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || ms < 0 || ms > 3600 * 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid attribute TTL: %s"), optarg) << "\n";
+          return false;
+        }
+        out->opts->attrTtlMs = (int)ms;
+        break;
+      }
+      case LONG_OPT_STATFS_CACHE: {
+        char *end = nullptr;
+        long ms = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || ms < 0 || ms > 3600 * 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid statfs cache time: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->statfsCacheMs = (int)ms;
+        break;
+      }
+      case LONG_OPT_CACHE_MEMORY: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb <= 0 || mb > 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid cache memory size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->cacheMemory = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_MEMORY_PRESSURE:
+        out->opts->memoryPressure = true;
+        break;
+      case LONG_OPT_HOT_CACHE: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb < 0 || mb > 64 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid hot file cache size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->hotCacheSize = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_PIN:
+        if (optarg[0] != '/') {
+          // xgroup(usage)
+          cerr << autosprintf(_("Pinned path must be absolute: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->pinnedPaths.push_back(optarg);
+        break;
+      case LONG_OPT_UNCACHED:
+        out->opts->uncachedPatterns.push_back(optarg);
+        break;
+      case LONG_OPT_UNCACHED_OVER: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb < 0 || mb > 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid uncached file size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->uncachedBytes = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_HOT_OPENS: {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n < 0 || n > 1000000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid hot file open count: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->hotOpens = (int)n;
+        break;
+      }
+      case LONG_OPT_LOWLEVEL:
+        out->lowLevel = true;
+        break;
+      case LONG_OPT_MAX_WRITE:
+      case LONG_OPT_MAX_READ:
+      case LONG_OPT_MAX_READAHEAD: {
+        char *end = nullptr;
+        long kb = strtol(optarg, &end, 10);
+        long min = res == LONG_OPT_MAX_WRITE ? 4 : 0;
+        if (end == optarg || *end != '\0' || kb < min || kb > 64 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid request size: %s"), optarg) << "\n";
+          return false;
+        }
+        if (res == LONG_OPT_MAX_WRITE) {
+          out->opts->maxWrite = (int)kb * 1024;
+        } else if (res == LONG_OPT_MAX_READ) {
+          out->opts->maxRead = (int)kb * 1024;
+        } else {
+          out->opts->maxReadahead = (int)kb * 1024;
+        }
+        break;
+      }
+      case LONG_OPT_MAX_BACKGROUND:
+      case LONG_OPT_CONGESTION: {
+        char *end = nullptr;
+        long count = strtol(optarg, &end, 10);
+        long min = res == LONG_OPT_MAX_BACKGROUND ? 1 : 0;
+        if (end == optarg || *end != '\0' || count < min || count > 65535) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid request count: %s"), optarg) << "\n";
+          return false;
+        }
+        if (res == LONG_OPT_MAX_BACKGROUND) {
+          out->opts->maxBackground = (int)count;
+        } else {
+          out->opts->congestionThreshold = (int)count;
+        }
+        break;
+      }
+      case LONG_OPT_FUSE_THREADS:
+      case LONG_OPT_MAX_IDLE_THREADS: {
+        char *end = nullptr;
+        long count = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || count < 1 || count > 4096) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid thread count: %s"), optarg) << "\n";
+          return false;
+        }
+        if (res == LONG_OPT_FUSE_THREADS) {
+          out->opts->fuseThreads = (int)count;
+        } else {
+          out->opts->maxIdleThreads = (int)count;
+        }
+        break;
+      }
+      case LONG_OPT_NOCLONE_FD:
+        out->opts->cloneFd = false;
+        break;
+      case LONG_OPT_ASYNC_REQUESTS: {
+        char *end = nullptr;
+        long count = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || count < 1 || count > 4096) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid thread count: %s"), optarg) << "\n";
+          return false;
+        }
+        out->opts->asyncRequests = (int)count;
+        break;
+      }
+      case LONG_OPT_SHARDS: {
+        char *end = nullptr;
+        long count = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || count < 0 || count > 4096) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid thread count: %s"), optarg) << "\n";
+          return false;
+        }
+        if (count == 0) {
+          count = sysconf(_SC_NPROCESSORS_ONLN);
+          if (count < 1) {
+            count = 1;
+          }
+        }
+        out->opts->shards = (int)count;
+        break;
+      }
+      case LONG_OPT_CACHE_TIMEOUT: {
+        char *end = nullptr;
+        long seconds = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || seconds < 1 ||
+            seconds > 24 * 3600) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid cache timeout: %s"), optarg) << "\n";
+          return false;
+        }
+        out->cacheTimeout = (int)seconds;
+        break;
+      }
+      case LONG_OPT_WRITEBACK_CACHE:
+        out->opts->writebackCache = true;
+        break;
+      case LONG_OPT_SLOW_OP: {
+        char *end = nullptr;
+        long ms = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || ms < 0 || ms > 3600 * 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid slow operation threshold: %s"),
+                              optarg)
+               << "\n";
+          return false;
+        }
+        OpStats::slowThresholdNs = (uint64_t)ms * 1000000;
+        break;
+      }
+      case LONG_OPT_TRACE:
+        Trace::enabled = true;
+        break;
+      case LONG_OPT_LOCK_PROFILE:
+        LockProfile::enabled = true;
+        break;
+      case LONG_OPT_KEY_CACHE: {
+        char *end = nullptr;
+        long seconds = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || seconds < 0 ||
+            seconds > 7 * 24 * 3600) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid key cache timeout: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->keyCacheSeconds = (int)seconds;
+        break;
+      }
+      case LONG_OPT_FAIR_SHARE: {
+        char *end = nullptr;
+        long slots = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || slots < 0 || slots > 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid fair share: %s"), optarg) << "\n";
+          return false;
+        }
+        out->fairSlots = (int)slots;
+        break;
+      }
+      case LONG_OPT_UID_WEIGHT: {
+        uid_t uid;
+        long weight;
+        if (!parseUidValue(optarg, &uid, &weight) || weight < 1 ||
+            weight > 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid uid weight: %s"), optarg) << "\n";
+          return false;
+        }
+        out->uidWeights.push_back(std::make_pair(uid, (int)weight));
+        break;
+      }
+      case LONG_OPT_UID_RATE: {
+        uid_t uid;
+        long mb;
+        if (!parseUidValue(optarg, &uid, &mb) || mb < 1 ||
+            mb > 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid uid rate: %s"), optarg) << "\n";
+          return false;
+        }
+        out->uidRates.push_back(
+            std::make_pair(uid, (uint64_t)mb * 1024 * 1024));
+        break;
+      }
+      case LONG_OPT_SCRUB: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb < 0 || mb > 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid scrub rate: %s"), optarg) << "\n";
+          return false;
+        }
+        out->scrubRate = (int)mb;
+        break;
+      }
+      case LONG_OPT_SCRUB_IDLE: {
+        char *end = nullptr;
+        long seconds = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || seconds < 0 ||
+            seconds > 7 * 24 * 3600) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid scrub idle time: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->scrubIdleSecs = (int)seconds;
+        break;
+      }
+      case LONG_OPT_SCRUB_STATE:
+        out->scrubState = optarg;
+        // the daemon changes to /, as for --stats-socket
+        if (optarg[0] != '/') {
+          char cwd[PATH_MAX];
+          if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid scrub state: %s"), optarg) << "\n";
+            return false;
+          }
+          out->scrubState = slashTerminate(cwd) + optarg;
+        }
+        break;
+      case LONG_OPT_DIGEST_CACHE:
+        out->opts->digestCachePath = optarg;
+        if (optarg[0] != '/') {
+          char cwd[PATH_MAX];
+          if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid digest cache: %s"), optarg)
+                 << "\n";
+            return false;
+          }
+          out->opts->digestCachePath = slashTerminate(cwd) + optarg;
+        }
+        break;
+      case LONG_OPT_CIPHERTEXT_CACHE:
+        out->opts->ciphertextCachePath = optarg;
+        if (optarg[0] != '/') {
+          char cwd[PATH_MAX];
+          if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid ciphertext cache: %s"), optarg)
+                 << "\n";
+            return false;
+          }
+          out->opts->ciphertextCachePath = slashTerminate(cwd) + optarg;
+        }
+        break;
+      case LONG_OPT_CIPHERTEXT_CACHE_SIZE: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb <= 0 ||
+            mb > 16 * 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid ciphertext cache size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->ciphertextCacheSize = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_OBJECT_STORE:
+        out->opts->objectStoreUrl = optarg;
+        break;
+      case LONG_OPT_OBJECT_CACHE_SIZE: {
+        char *end = nullptr;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || mb <= 0 ||
+            mb > 16 * 1024 * 1024) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid object cache size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->objectCacheSize = mb * 1024 * 1024;
+        break;
+      }
+      case LONG_OPT_DIR_INDEX: {
+        char *end = nullptr;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || n <= 0 ||
+            n > (long)DirIndexMaxEntries) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid directory index size: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->dirIndexEntries = n;
+        break;
+      }
+      case LONG_OPT_RECORD_OPS:
+        out->recordOps = optarg;
+        // the daemon changes to /, as for --stats-socket
+        if (optarg[0] != '/') {
+          char cwd[PATH_MAX];
+          if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid op trace: %s"), optarg) << "\n";
+            return false;
+          }
+          out->recordOps = slashTerminate(cwd) + optarg;
+        }
+        break;
+      case LONG_OPT_STATS_SOCKET:
+        out->statsSocket = optarg;
+        // the daemon changes to /, so a relative path is taken from here
+        if (optarg[0] != '/') {
+          char cwd[PATH_MAX];
+          if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid stats socket: %s"), optarg) << "\n";
+            return false;
+          }
+          out->statsSocket = slashTerminate(cwd) + optarg;
+        }
+        break;
+      case LONG_OPT_NOBIGWRITES:
+        out->opts->bigWrites = false;
+        break;
+      case LONG_OPT_SPLICE: {
+        int flags = 0;
+        string list = optarg;
+        size_t start = 0;
+        while (start <= list.length()) {
+          size_t end = list.find(',', start);
+          if (end == string::npos) {
+            end = list.length();
+          }
+          string name = list.substr(start, end - start);
+          if (name == "read") {
+            flags |= SpliceRead;
+          } else if (name == "write") {
+            flags |= SpliceWrite;
+          } else if (name == "move") {
+            flags |= SpliceMove;
+          } else if (name != "none") {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid splice mode: %s"), name.c_str())
+                 << "\n";
+            return false;
+          }
+          start = end + 1;
+        }
+        out->opts->splice = flags;
+        break;
+      }
+      case LONG_OPT_REVERSE_CHECK: {
+        char *end = nullptr;
+        long ms = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || ms < 0 || ms > 3600 * 1000) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid reverse check interval: %s"), optarg)
+               << "\n";
+          return false;
+        }
+        out->opts->reverseCheckMs = (int)ms;
+        break;
+      }
+      case LONG_OPT_READAHEAD: {
+        char *end = nullptr;
+        long blocks = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || blocks < 0 || blocks > 4096) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid read-ahead: %s"), optarg) << "\n";
+          return false;
+        }
+        out->opts->readAheadBlocks = (int)blocks;
+        readAheadGiven = true;
+        break;
+      }
+      case LONG_OPT_OPEN_PREFETCH: {
+        char *end = nullptr;
+        long blocks = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || blocks < 0 || blocks > 64) {
+          // xgroup(usage)
+          cerr << autosprintf(_("Invalid open prefetch: %s"), optarg) << "\n";
+          return false;
+        }
+        out->opts->openPrefetchBlocks = (int)blocks;
+        break;
+      }
+      case LONG_OPT_CRYPTO_THREADS: {
+        long threads;
+        if (strcmp(optarg, "auto") == 0) {
+          threads = sysconf(_SC_NPROCESSORS_ONLN);
+          if (threads < 1) {
+            threads = 1;
+          }
+        } else {
+          char *end = nullptr;
+          threads = strtol(optarg, &end, 10);
+          if (end == optarg || *end != '\0' || threads < 0 || threads > 256) {
+            // xgroup(usage)
+            cerr << autosprintf(_("Invalid crypto thread count: %s"), optarg)
+                 << "\n";
+            return false;
+          }
+        }
+        out->opts->cryptoThreads = (int)threads;
+        cryptoThreadsGiven = true;
+        break;
+      }
+      case LONG_OPT_CALIBRATE:
+        calibrate = true;
+        break;
+      case LONG_OPT_INTERACTIVE:
+        out->opts->interactive = true;
+        break;
       case LONG_OPT_NOATTRCACHE:
         PUSHARG("-oattr_timeout=0");
         PUSHARG("-oentry_timeout=0");
@@ -415,6 +1500,9 @@ static bool processArgs(int argc, char *argv[],
         useDefaultFlags = false;
         break;
       case 'o':
+        if (hasMountOption(optarg, "default_permissions")) {
+          out->opts->defaultPermissions = true;
+        }
         PUSHARG("-o");
         PUSHARG(optarg);
         break;
@@ -477,6 +1565,16 @@ static bool processArgs(int argc, char *argv[],
     return false;
   }
 
+  // the volumes and their options come from the file
+  if (!out->volumesFile.empty()) {
+    if (optind != argc) {
+      // xgroup(usage)
+      cerr << _("--volumes takes no rootDir or mountPoint") << endl;
+      return false;
+    }
+    return true;
+  }
+
   // we should have at least 2 arguments left over - the source directory and
   // the mount point.
   if (optind + 2 <= argc) {
@@ -491,6 +1589,33 @@ static bool processArgs(int argc, char *argv[],
     return false;
   }
 
+  // have the kernel remember missing names as long as we do.  Names that
+  // come and go behind our back are looked up every time.
+  if (out->opts->negativeTimeoutMs > 0 && !out->opts->noCache &&
+      !out->opts->reverseEncryption) {
+    char timeout[64];
+    snprintf(timeout, sizeof(timeout), "-onegative_timeout=%d.%03d",
+             out->opts->negativeTimeoutMs / 1000,
+             out->opts->negativeTimeoutMs % 1000);
+    out->negativeTimeoutArg = timeout;
+    PUSHARG(out->negativeTimeoutArg.c_str());
+  }
+
+  if (out->cacheTimeout > 0) {
+    char timeouts[64];
+    snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%d,entry_timeout=%d",
+             out->cacheTimeout, out->cacheTimeout);
+    out->cacheTimeoutArg = timeouts;
+    PUSHARG(out->cacheTimeoutArg.c_str());
+  }
+
+  if (out->opts->maxRead > 0) {
+    char maxRead[64];
+    snprintf(maxRead, sizeof(maxRead), "-omax_read=%d", out->opts->maxRead);
+    out->maxReadArg = maxRead;
+    PUSHARG(out->maxReadArg.c_str());
+  }
+
   // If there are still extra unparsed arguments, pass them onto FUSE..
   if (optind < argc) {
     rAssert(out->fuseArgc < MaxFuseArgs);
@@ -502,6 +1627,9 @@ static bool processArgs(int argc, char *argv[],
     }
   }
 
+  out->opts->calibrateCrypto = calibrate && !cryptoThreadsGiven;
+  out->opts->calibrateReadAhead = calibrate && !readAheadGiven;
+
   // Add default flags unless --no-default-flags was passed
   if (useDefaultFlags) {
 
@@ -517,6 +1645,7 @@ static bool processArgs(int argc, char *argv[],
     // https://github.com/vgough/encfs/issues/112 for more info.
     PUSHARG("-o");
     PUSHARG("default_permissions");
+    out->opts->defaultPermissions = true;
 
 #if defined(__APPLE__)
     // With OSXFuse, the 'local' flag selects a local filesystem mount icon in
@@ -559,6 +1688,124 @@ static bool processArgs(int argc, char *argv[],
     }
   }
 
+  if (out->lowLevel && out->opts->reverseEncryption) {
+    cerr <<
+        // xgroup(usage)
+        _("The low-level interface does not support reverse encryption")
+         << endl;
+    return false;
+  }
+
+  // reverse mode has no MACs to check, and its files are the plaintext
+  if (out->scrubRate > 0 && out->opts->reverseEncryption) {
+    cerr <<
+        // xgroup(usage)
+        _("--scrub can not be used with --reverse")
+         << endl;
+    return false;
+  }
+
+  // the kernel would keep sizes and data the backing files no longer have
+  if (out->opts->writebackCache &&
+      (out->opts->noCache || out->opts->reverseEncryption)) {
+    cerr <<
+        // xgroup(usage)
+        _("--writeback-cache can not be used with --nocache or --reverse")
+         << endl;
+    return false;
+  }
+
+  // unchanged blocks are only known from the block cache
+  if (out->opts->skipUnchanged &&
+      (out->opts->noCache || out->opts->reverseEncryption)) {
+    cerr <<
+        // xgroup(usage)
+        _("--skip-unchanged can not be used with --nocache or --reverse")
+         << endl;
+    return false;
+  }
+
+  if (!out->uidWeights.empty() && out->fairSlots == 0) {
+    cerr <<
+        // xgroup(usage)
+        _("--uid-weight needs --fair-share")
+         << endl;
+    return false;
+  }
+
+  if (out->opts->cacheMemory > 0 && out->opts->noCache) {
+    cerr <<
+        // xgroup(usage)
+        _("--cache-memory can not be used with --nocache")
+         << endl;
+    return false;
+  }
+
+  if (!out->opts->digestCachePath.empty() && !out->opts->reverseEncryption) {
+    cerr <<
+        // xgroup(usage)
+        _("--digest-cache needs --reverse")
+         << endl;
+    return false;
+  }
+
+  // a reverse mount's backing files are plaintext
+  if (!out->opts->ciphertextCachePath.empty() &&
+      out->opts->reverseEncryption) {
+    cerr <<
+        // xgroup(usage)
+        _("--ciphertext-cache can not be used with --reverse")
+         << endl;
+    return false;
+  }
+
+  // the data of a reverse mount is the plaintext where it is
+  if (!out->opts->objectStoreUrl.empty() && out->opts->reverseEncryption) {
+    cerr <<
+        // xgroup(usage)
+        _("--object-store can not be used with --reverse")
+         << endl;
+    return false;
+  }
+
+  // only the low-level frontend knows the inodes to invalidate
+  if (out->cacheTimeout > 0 && (!out->lowLevel || out->opts->noCache)) {
+    cerr <<
+        // xgroup(usage)
+        _("--cache-timeout needs --lowlevel, and can not be used with "
+          "--nocache")
+         << endl;
+    return false;
+  }
+  // notifications go through the low-level channel, and stored pages
+  // would replace dirty ones the kernel caches writes in
+  if (out->opts->pushReadahead &&
+      (!out->lowLevel || out->opts->noCache || out->opts->writebackCache)) {
+    cerr <<
+        // xgroup(usage)
+        _("--push-readahead needs --lowlevel, and can not be used with "
+          "--nocache or --writeback-cache")
+         << endl;
+    return false;
+  }
+  if (out->opts->asyncRequests > 0 && !out->lowLevel) {
+    // xgroup(usage)
+    cerr << _("--async-requests needs --lowlevel") << endl;
+    return false;
+  }
+  // the shards get their requests from the channel of each FUSE thread,
+  // and serve them where they are
+  if (out->opts->shards > 0 &&
+      (!out->isThreaded || !out->opts->cloneFd ||
+       out->opts->asyncRequests > 0)) {
+    cerr <<
+        // xgroup(usage)
+        _("--shards can not be used with -s, --noclone-fd or "
+          "--async-requests")
+         << endl;
+    return false;
+  }
+
   if (out->opts->delayMount && !out->opts->mountOnDemand) {
     cerr <<
         // xgroup(usage)
@@ -615,12 +1862,68 @@ static bool processArgs(int argc, char *argv[],
 
 static void *idleMonitor(void *);
 
-void *encfs_init(fuse_conn_info *conn) {
-  auto *ctx = (EncFS_Context *)fuse_get_context()->private_data;
-
+// set up a new connection, for either frontend
+static void initConnection(EncFS_Context *ctx, fuse_conn_info *conn) {
   // set fuse connection options
   conn->async_read = 1u;
 
+  // request sizes and queue depths.  The kernel and libfuse lower what
+  // they can not do.  Writes (and reads) past 128 KiB take max_pages,
+  // which libfuse 3 asks the kernel for from max_write; libfuse 2 caps
+  // max_write at its 128 KiB buffers.
+  const std::shared_ptr<EncFS_Opts> &opts = ctx->opts;
+  conn->max_write = opts->maxWrite;
+  if (opts->maxReadahead > 0) {
+    conn->max_readahead = opts->maxReadahead;
+  }
+#if FUSE_VERSION >= 29
+  conn->max_background = opts->maxBackground;
+  conn->congestion_threshold = opts->congestionThreshold > 0
+                                   ? opts->congestionThreshold
+                                   : opts->maxBackground * 3 / 4;
+#endif
+#ifdef FUSE_CAP_BIG_WRITES
+  if (opts->bigWrites) {
+    conn->want |= (conn->capable & FUSE_CAP_BIG_WRITES);
+  } else {
+    conn->want &= ~FUSE_CAP_BIG_WRITES;
+  }
+#endif
+  if (opts->writebackCache) {
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if ((conn->capable & FUSE_CAP_WRITEBACK_CACHE) != 0) {
+      conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    } else {
+      RLOG(WARNING) << "the kernel does not offer a writeback cache";
+    }
+#else
+    RLOG(WARNING) << "this FUSE version has no writeback cache";
+#endif
+  }
+
+#ifdef FUSE_CAP_SPLICE_WRITE
+  // data is coded in our buffers, so splicing saves a copy at most
+  const struct {
+    int flag;
+    unsigned cap;
+  } splices[] = {{SpliceRead, FUSE_CAP_SPLICE_READ},
+                 {SpliceWrite, FUSE_CAP_SPLICE_WRITE},
+                 {SpliceMove, FUSE_CAP_SPLICE_MOVE}};
+  for (const auto &splice : splices) {
+    if ((opts->splice & splice.flag) != 0) {
+      conn->want |= (conn->capable & splice.cap);
+    } else {
+      conn->want &= ~splice.cap;
+    }
+  }
+#endif
+
+#if defined(FUSE_CAP_READDIRPLUS) && FUSE_USE_VERSION >= 30
+  // readdir fills in the attributes of the entries, have the kernel take
+  // them instead of looking each one up
+  conn->want |= (conn->capable & FUSE_CAP_READDIRPLUS);
+#endif
+
 #ifdef __CYGWIN__
   // WinFsp needs this to partially handle read-only FS
   // See https://github.com/billziss-gh/winfsp/issues/157 for details
@@ -641,6 +1944,35 @@ void *encfs_init(fuse_conn_info *conn) {
       RLOG(ERROR) << "error starting idle monitor thread, "
                      "res = "
                   << res << ", " << strerror(res);
+      ctx->running = false;
+    }
+  }
+
+  if (!ctx->args->statsSocket.empty() && !ctx->statsServer) {
+    auto server = std::make_shared<StatsServer>(ctx, ctx->args->statsSocket);
+    if (server->start()) {
+      ctx->statsServer = server;
+    }
+  }
+
+  if (ctx->args->scrubRate > 0 && !ctx->scrubber) {
+    auto scrubber = std::make_shared<Scrubber>(
+        ctx, (uint64_t)ctx->args->scrubRate * 1024 * 1024,
+        ctx->args->scrubIdleSecs, ctx->args->scrubState);
+    if (scrubber->start()) {
+      ctx->scrubber = scrubber;
+    }
+  }
+
+  if ((opts->cacheMemory > 0 || opts->memoryPressure) &&
+      !ctx->memoryGovernor) {
+    bool balance = opts->cacheMemory > 0;
+    size_t limit = balance ? (size_t)opts->cacheMemory
+                           : (size_t)(opts->blockCacheSize +
+                                      opts->hotCacheSize + opts->poolCacheSize);
+    auto governor = std::make_shared<MemoryGovernor>(ctx, limit, balance);
+    if (limit > 0 && governor->start()) {
+      ctx->memoryGovernor = governor;
     }
   }
 
@@ -649,10 +1981,248 @@ void *encfs_init(fuse_conn_info *conn) {
     close(oldStderr);
     oldStderr = -1;
   }
+}
 
+void *encfs_init(fuse_conn_info *conn) {
+  auto *ctx = (EncFS_Context *)fuse_get_context()->private_data;
+  initConnection(ctx, conn);
   return (void *)ctx;
 }
 
+// the context of a mount whose root was just opened, before it is served
+static void setupContext(EncFS_Context *ctx, const RootPtr &rootInfo,
+                         const std::shared_ptr<EncFS_Args> &args) {
+  // turn off delayMount, as our prior call to initFS has already
+  // respected any delay, and we want future calls to actually
+  // mount.
+  args->opts->delayMount = false;
+
+  // set the globally visible root directory node
+  ctx->setRoot(rootInfo->root);
+  ctx->args = args;
+  ctx->opts = args->opts;
+
+  if (args->fairSlots > 0 || !args->uidRates.empty()) {
+    auto sched = std::make_shared<IoScheduler>(args->fairSlots);
+    for (const auto &it : args->uidWeights) {
+      sched->setWeight(it.first, it.second);
+    }
+    for (const auto &it : args->uidRates) {
+      sched->setRate(it.first, it.second);
+    }
+    ctx->ioScheduler = sched;
+  }
+}
+
+// stops the threads initConnection started for a mount, once it is no
+// longer served
+static void stopContext(EncFS_Context *ctx) {
+  if (ctx->args->idleTimeout > 0 && ctx->running) {
+    ctx->running = false;
+    // wake up the thread if it is waiting..
+    VLOG(1) << "waking up monitoring thread";
+    pthread_mutex_lock(&ctx->wakeupMutex);
+    pthread_cond_signal(&ctx->wakeupCond);
+    pthread_mutex_unlock(&ctx->wakeupMutex);
+    VLOG(1) << "joining with idle monitoring thread";
+    pthread_join(ctx->monitorThread, nullptr);
+    VLOG(1) << "join done";
+  }
+  if (ctx->statsServer) {
+    ctx->statsServer->stop();
+    ctx->statsServer.reset();
+  }
+  if (ctx->scrubber) {
+    ctx->scrubber->stop();
+    ctx->scrubber.reset();
+  }
+  if (ctx->memoryGovernor) {
+    ctx->memoryGovernor->stop();
+    ctx->memoryGovernor.reset();
+  }
+}
+
+// FUSE workers each volume of --volumes keeps when idle, unless its line
+// says otherwise: most of them are idle most of the time
+static const int VolumeIdleThreads = 1;
+
+// one volume of --volumes
+struct Volume {
+  std::vector<std::string> words;
+  std::vector<char *> argv;
+  std::shared_ptr<EncFS_Args> args;
+  std::shared_ptr<EncFS_Context> ctx;
+  RootPtr rootInfo;
+  pthread_t thread;
+};
+
+// opens a volume, on a thread of its own
+static void *openVolume(void *arg) {
+  Volume *v = (Volume *)arg;
+  v->rootInfo = initFS(v->ctx.get(), v->args->opts);
+  // the key is made, the password is no longer needed
+  std::string &password = v->args->opts->password;
+  password.assign(password.size(), '\0');
+  password.clear();
+  return nullptr;
+}
+
+/*
+ * --volumes: serve the volumes listed in the file, a line each with the
+ * arguments its own encfs command would take: options, the root
+ * directory and the mount point, then any FUSE options.  Arguments are
+ * split at white space; blank lines and those starting with '#' are
+ * skipped.
+ *
+ * A password given to the daemon itself, with --extpass or --stdinpass,
+ * is read once and used by every volume whose line asks for none of its
+ * own.  The volumes that prompt for their own password are opened in
+ * turn; the others, whose key derivation and check take the time, are
+ * opened at once, a thread each.  Then they are mounted together.
+ */
+static int runVolumes(const std::shared_ptr<EncFS_Args> &daemonArgs,
+                      const fuse_operations *op) {
+  // nodes stay put, the parsed arguments point into the words
+  std::list<Volume> volumes;
+
+  const string &file = daemonArgs->volumesFile;
+  ifstream in(file.c_str());
+  if (!in) {
+    // xgroup(usage)
+    cerr << autosprintf(_("Unable to read the volumes of %s"), file.c_str())
+         << endl;
+    return EXIT_FAILURE;
+  }
+  string line;
+  for (int lineNo = 1; getline(in, line); ++lineNo) {
+    istringstream words(line);
+    string word;
+    if (!(words >> word) || word[0] == '#') {
+      continue;
+    }
+    volumes.emplace_back();
+    Volume &v = volumes.back();
+    v.words.push_back("encfs");
+    do {
+      v.words.push_back(word);
+    } while (words >> word);
+    for (string &w : v.words) {
+      v.argv.push_back(&w[0]);
+    }
+    v.argv.push_back(nullptr);
+
+    v.args = std::make_shared<EncFS_Args>();
+    for (int i = 0; i < MaxFuseArgs; ++i) {
+      v.args->fuseArgv[i] = nullptr;
+    }
+    v.args->opts->maxIdleThreads = VolumeIdleThreads;
+    optind = 0;  // getopt starts over
+    bool ok = processArgs((int)v.words.size(), v.argv.data(), v.args);
+    if (ok && (v.args->lowLevel || !v.args->volumesFile.empty() ||
+               v.args->opts->unmount || v.args->opts->cacheMemory > 0 ||
+               v.args->opts->memoryPressure)) {
+      // xgroup(usage)
+      cerr << _("--lowlevel, --volumes, --unmount, --cache-memory and "
+                "--memory-pressure can not be used for a volume of "
+                "--volumes")
+           << endl;
+      ok = false;
+    }
+    if (!ok) {
+      // xgroup(usage)
+      cerr << autosprintf(_("Invalid volume on line %i of %s"), lineNo,
+                          file.c_str())
+           << endl;
+      return EXIT_FAILURE;
+    }
+    // one process, one way of logging
+    v.args->isDaemon = daemonArgs->isDaemon;
+  }
+  if (volumes.empty()) {
+    // xgroup(usage)
+    cerr << autosprintf(_("No volumes in %s"), file.c_str()) << endl;
+    return EXIT_FAILURE;
+  }
+
+  const EncFS_Opts &daemonOpts = *daemonArgs->opts;
+  if (!daemonOpts.passwordProgram.empty() || daemonOpts.useStdin) {
+    string password;
+    if (!readUserPassword(daemonOpts, &password)) {
+      // xgroup(usage)
+      cerr << _("Unable to read the password of the volumes") << endl;
+      return EXIT_FAILURE;
+    }
+    for (Volume &v : volumes) {
+      EncFS_Opts &opts = *v.args->opts;
+      if (opts.passwordProgram.empty() && !opts.useStdin) {
+        opts.password = password;
+      }
+    }
+    password.assign(password.size(), '\0');
+  }
+
+  // those that prompt first, one at a time, then the rest all at once
+  std::vector<Volume *> started;
+  for (Volume &v : volumes) {
+    v.ctx = std::make_shared<EncFS_Context>();
+    v.ctx->publicFilesystem = v.args->opts->ownerCreate;
+    if (v.args->opts->password.empty() &&
+        v.args->opts->passwordProgram.empty()) {
+      openVolume(&v);
+    }
+  }
+  for (Volume &v : volumes) {
+    if (!v.args->opts->password.empty() ||
+        !v.args->opts->passwordProgram.empty()) {
+      int res = pthread_create(&v.thread, nullptr, openVolume, &v);
+      if (res != 0) {
+        RLOG(WARNING) << "error starting a thread to open a volume: "
+                      << strerror(res);
+        openVolume(&v);
+      } else {
+        started.push_back(&v);
+      }
+    }
+  }
+  for (Volume *v : started) {
+    pthread_join(v->thread, nullptr);
+  }
+
+  std::vector<FuseVolume> mounts;
+  for (Volume &v : volumes) {
+    if (!v.rootInfo) {
+      // xgroup(usage)
+      cerr << autosprintf(_("Unable to open the volume at %s"),
+                          v.args->opts->rootDir.c_str())
+           << endl;
+      return EXIT_FAILURE;
+    }
+    setupContext(v.ctx.get(), v.rootInfo, v.args);
+
+    FuseVolume mount;
+    mount.argc = v.args->fuseArgc;
+    mount.argv = const_cast<char **>(v.args->fuseArgv);
+    mount.userData = v.ctx.get();
+    mount.opts = v.args->opts.get();
+    mounts.push_back(mount);
+  }
+
+  // as for a single mount
+  umask(0);
+  if (daemonArgs->isDaemon) {
+    oldStderr = dup(STDERR_FILENO);
+  }
+
+  int res = fuseMainVolumes(mounts, op, !daemonArgs->isDaemon);
+
+  for (Volume &v : volumes) {
+    stopContext(v.ctx.get());
+    v.rootInfo.reset();
+    v.ctx->setRoot(std::shared_ptr<DirNode>());
+  }
+  return res == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
 #if defined(ENABLE_NLS) && defined(LOCALEDIR)
   setlocale(LC_ALL, "");
@@ -694,7 +2264,9 @@ int main(int argc, char *argv[]) {
 
   encfs_oper.getattr = encfs_getattr;
   encfs_oper.readlink = encfs_readlink;
+  encfs_oper.opendir = encfs_opendir;
   encfs_oper.readdir = encfs_readdir;
+  encfs_oper.releasedir = encfs_releasedir;
   encfs_oper.mknod = encfs_mknod;
   encfs_oper.mkdir = encfs_mkdir;
   encfs_oper.unlink = encfs_unlink;
@@ -719,20 +2291,55 @@ int main(int argc, char *argv[]) {
   encfs_oper.listxattr = encfs_listxattr;
   encfs_oper.removexattr = encfs_removexattr;
 #endif  // HAVE_XATTR
-  // encfs_oper.opendir = encfs_opendir;
-  // encfs_oper.readdir = encfs_readdir;
-  // encfs_oper.releasedir = encfs_releasedir;
   // encfs_oper.fsyncdir = encfs_fsyncdir;
   encfs_oper.init = encfs_init;
   // encfs_oper.access = encfs_access;
   encfs_oper.create = encfs_create;
   encfs_oper.ftruncate = encfs_ftruncate;
+#if FUSE_VERSION >= 29
+  encfs_oper.fallocate = encfs_fallocate;
+  encfs_oper.read_buf = encfs_read_buf;
+  encfs_oper.write_buf = encfs_write_buf;
+#endif
+#if FUSE_USE_VERSION >= 34
+  encfs_oper.copy_file_range = encfs_copy_file_range;
+#endif
+#if FUSE_USE_VERSION >= 38
+  encfs_oper.lseek = encfs_lseek;
+#endif
   encfs_oper.fgetattr = encfs_fgetattr;
   // encfs_oper.lock = encfs_lock;
   encfs_oper.utimens = encfs_utimens;
   // encfs_oper.bmap = encfs_bmap;
 
-  openssl_init(encfsArgs->isThreaded);
+  {
+    StartupTimer timer("crypto library");
+    openssl_init(encfsArgs->isThreaded);
+  }
+
+  if (encfsArgs->opts->cacheMemory > 0) {
+    MemoryGovernor::apportion(encfsArgs->opts.get());
+  }
+  MemoryPool::setMaxCachedBytes(encfsArgs->opts->poolCacheSize);
+  if (encfsArgs->opts->lazyWipe) {
+    MemoryPool::setWipePolicy(MemoryPool::WipeLazily);
+  }
+  MemoryPool::setLockedArena(encfsArgs->opts->lockedBuffers);
+  KernelCrypto::setEnabled(encfsArgs->opts->kernelCrypto);
+  if (!encfsArgs->recordOps.empty() &&
+      !OpTrace::start(encfsArgs->recordOps, requestCipherPath)) {
+    return EXIT_FAILURE;
+  }
+
+  if (!encfsArgs->volumesFile.empty()) {
+    int res = runVolumes(encfsArgs, &encfs_oper);
+    OpTrace::stop();
+    OpStats::logSummary();
+    LockProfile::logSummary();
+    MemoryPool::destroyAll();
+    openssl_shutdown(encfsArgs->isThreaded);
+    return res;
+  }
 
   // context is not a smart pointer because it will live for the life of
   // the filesystem.
@@ -743,15 +2350,7 @@ int main(int argc, char *argv[]) {
   int returnCode = EXIT_FAILURE;
 
   if (rootInfo) {
-    // turn off delayMount, as our prior call to initFS has already
-    // respected any delay, and we want future calls to actually
-    // mount.
-    encfsArgs->opts->delayMount = false;
-
-    // set the globally visible root directory node
-    ctx->setRoot(rootInfo->root);
-    ctx->args = encfsArgs;
-    ctx->opts = encfsArgs->opts;
+    setupContext(ctx.get(), rootInfo, encfsArgs);
 
     if (!encfsArgs->isThreaded && encfsArgs->idleTimeout > 0) {
       // xgroup(usage)
@@ -785,9 +2384,16 @@ int main(int argc, char *argv[]) {
       time(&startTime);
 
       // fuse_main returns an error code in newer versions of fuse..
-      int res = fuse_main(encfsArgs->fuseArgc,
-                          const_cast<char **>(encfsArgs->fuseArgv), &encfs_oper,
-                          (void *)ctx.get());
+      int res;
+      if (encfsArgs->lowLevel) {
+        res = encfs_lowlevel_main(encfsArgs->fuseArgc,
+                                  const_cast<char **>(encfsArgs->fuseArgv),
+                                  ctx.get(), initConnection);
+      } else {
+        res = fuseMain(encfsArgs->fuseArgc,
+                       const_cast<char **>(encfsArgs->fuseArgv), &encfs_oper,
+                       (void *)ctx.get(), encfsArgs->opts.get());
+      }
 
       time(&endTime);
 
@@ -818,23 +2424,16 @@ int main(int argc, char *argv[]) {
       RLOG(ERROR) << "Internal error: Caught unexpected exception";
     }
 
-    if (ctx->args->idleTimeout > 0) {
-      ctx->running = false;
-      // wake up the thread if it is waiting..
-      VLOG(1) << "waking up monitoring thread";
-      pthread_mutex_lock(&ctx->wakeupMutex);
-      pthread_cond_signal(&ctx->wakeupCond);
-      pthread_mutex_unlock(&ctx->wakeupMutex);
-      VLOG(1) << "joining with idle monitoring thread";
-      pthread_join(ctx->monitorThread, nullptr);
-      VLOG(1) << "join done";
-    }
+    stopContext(ctx.get());
   }
 
   // cleanup so that we can check for leaked resources..
   rootInfo.reset();
   ctx->setRoot(std::shared_ptr<DirNode>());
 
+  OpTrace::stop();
+  OpStats::logSummary();
+  LockProfile::logSummary();
   MemoryPool::destroyAll();
   openssl_shutdown(encfsArgs->isThreaded);
 
@@ -847,14 +2446,16 @@ int main(int argc, char *argv[]) {
     commit suicide) if the filesystem stays idle too long.  Idle time is only
     checked if there are no open files, as I don't want to risk problems by
     having the filesystem unmounted from underneath open files!
-*/
-const int ActivityCheckInterval = 10;
 
+    Operations only stamp the time of the last activity, the thread sleeps
+    until the timeout would run out from that stamp and looks again.  A
+    detached filesystem (--ondemand) sleeps until it is attached again.
+*/
 static void *idleMonitor(void *_arg) {
   auto *ctx = (EncFS_Context *)_arg;
   std::shared_ptr<EncFS_Args> arg = ctx->args;
 
-  const int timeoutCycles = 60 * arg->idleTimeout / ActivityCheckInterval;
+  const int timeoutSecs = 60 * arg->idleTimeout;
 
   bool unmountres = false;
 
@@ -865,15 +2466,22 @@ static void *idleMonitor(void *_arg) {
   pthread_mutex_lock(&ctx->wakeupMutex);
 
   while (ctx->running) {
-    unmountres = ctx->usageAndUnmount(timeoutCycles);
+    int waitSecs;
+    unmountres = ctx->usageAndUnmount(timeoutSecs, &waitSecs);
     if (unmountres) {
       break;
     }
 
+    if (waitSecs < 0) {
+      pthread_cond_wait(&ctx->wakeupCond, &ctx->wakeupMutex);
+      continue;
+    }
+    // waking early or late only means looking again, against the
+    // monotonic stamps
     struct timeval currentTime;
     gettimeofday(&currentTime, nullptr);
     struct timespec wakeupTime;
-    wakeupTime.tv_sec = currentTime.tv_sec + ActivityCheckInterval;
+    wakeupTime.tv_sec = currentTime.tv_sec + waitSecs;
     wakeupTime.tv_nsec = currentTime.tv_usec * 1000;
     pthread_cond_timedwait(&ctx->wakeupCond, &ctx->wakeupMutex, &wakeupTime);
   }
@@ -21,8 +21,20 @@
 #include "openssl.h"
 
 #include <cstdlib>
+#include <map>
 #include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
 #include <pthread.h>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
 
 #define NO_DES
 #include <openssl/rand.h>
@@ -31,7 +43,10 @@
 #include <openssl/engine.h>
 #endif
 
+#include "ByteKernels.h"
 #include "Error.h"
+#include "Mutex.h"
+#include "base64.h"
 
 namespace encfs {
 
@@ -68,21 +83,180 @@ void pthreads_locking_cleanup() {
   }
 }
 
+static CpuFeatures probeCpuFeatures() {
+  CpuFeatures f = CpuFeatures();
+
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0) {
+    f.aesni = (ecx & bit_AES) != 0;
+    f.pclmul = (ecx & bit_PCLMUL) != 0;
+
+    // the ymm registers are only usable if the OS saves them
+    bool osAVX = false;
+    if ((ecx & bit_OSXSAVE) != 0 && (ecx & bit_AVX) != 0) {
+      unsigned int xcr0lo = 0, xcr0hi = 0;
+      __asm__("xgetbv" : "=a"(xcr0lo), "=d"(xcr0hi) : "c"(0));
+      osAVX = (xcr0lo & 0x6) == 0x6;
+    }
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0) {
+      f.avx2 = osAVX && (ebx & bit_AVX2) != 0;
+      f.shani = (ebx & bit_SHA) != 0;
+      f.vaes = osAVX && (ecx & bit_VAES) != 0;
+    }
+  }
+#elif defined(__aarch64__) && defined(__linux__)
+  unsigned long hwcap = getauxval(AT_HWCAP);
+  f.neon = (hwcap & HWCAP_ASIMD) != 0;
+  f.armce = (hwcap & HWCAP_AES) != 0 && (hwcap & HWCAP_PMULL) != 0;
+  f.armsha = (hwcap & HWCAP_SHA1) != 0 && (hwcap & HWCAP_SHA2) != 0;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  f.neon = true;
+#endif
+
+  return f;
+}
+
+const CpuFeatures &cpuFeatures() {
+  static const CpuFeatures features = probeCpuFeatures();
+  return features;
+}
+
+std::string cryptoCapabilities() {
+  const CpuFeatures &f = cpuFeatures();
+
+  std::string cpu;
+  auto add = [&cpu](bool present, const char *name) {
+    if (present) {
+      if (!cpu.empty()) {
+        cpu += ' ';
+      }
+      cpu += name;
+    }
+  };
+  add(f.aesni, "aes-ni");
+  add(f.vaes, "vaes");
+  add(f.pclmul, "pclmul");
+  add(f.shani, "sha-ni");
+  add(f.avx2, "avx2");
+  add(f.armce, "armv8-ce");
+  add(f.armsha, "armv8-sha");
+  add(f.neon, "neon");
+  if (cpu.empty()) {
+    cpu = "none, software crypto";
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  std::string result = OpenSSL_version(OPENSSL_VERSION);
+#else
+  std::string result = SSLeay_version(SSLEAY_VERSION);
+#endif
+  result += "; CPU features: ";
+  result += cpu;
+  result += "; byte kernels: ";
+  result += byteKernelName();
+  result += "; name encoding: ";
+  result += base2KernelName();
+  return result;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+
+// fetched algorithms by the object they stand for, protected by
+// fetchMutex.  Failed fetches map to the object itself.
+static pthread_mutex_t fetchMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<const EVP_CIPHER *, const EVP_CIPHER *> fetchedCiphers;
+static std::map<const EVP_MD *, const EVP_MD *> fetchedDigests;
+
+const EVP_CIPHER *fetchedCipher(const EVP_CIPHER *cipher) {
+  if (cipher == nullptr) {
+    return nullptr;
+  }
+  Lock lock(fetchMutex);
+  auto it = fetchedCiphers.find(cipher);
+  if (it != fetchedCiphers.end()) {
+    return it->second;
+  }
+
+  const EVP_CIPHER *result =
+      EVP_CIPHER_fetch(nullptr, EVP_CIPHER_get0_name(cipher), nullptr);
+  if (result == nullptr) {
+    ERR_clear_error();
+    VLOG(1) << "unable to fetch cipher " << EVP_CIPHER_get0_name(cipher);
+    result = cipher;
+  }
+  fetchedCiphers[cipher] = result;
+  return result;
+}
+
+const EVP_MD *fetchedDigest(const EVP_MD *md) {
+  if (md == nullptr) {
+    return nullptr;
+  }
+  Lock lock(fetchMutex);
+  auto it = fetchedDigests.find(md);
+  if (it != fetchedDigests.end()) {
+    return it->second;
+  }
+
+  const EVP_MD *result = EVP_MD_fetch(nullptr, EVP_MD_get0_name(md), nullptr);
+  if (result == nullptr) {
+    ERR_clear_error();
+    VLOG(1) << "unable to fetch digest " << EVP_MD_get0_name(md);
+    result = md;
+  }
+  fetchedDigests[md] = result;
+  return result;
+}
+
+static void freeFetched() {
+  Lock lock(fetchMutex);
+  for (auto &it : fetchedCiphers) {
+    if (it.second != it.first) {
+      EVP_CIPHER_free(const_cast<EVP_CIPHER *>(it.second));
+    }
+  }
+  fetchedCiphers.clear();
+  for (auto &it : fetchedDigests) {
+    if (it.second != it.first) {
+      EVP_MD_free(const_cast<EVP_MD *>(it.second));
+    }
+  }
+  fetchedDigests.clear();
+}
+
+#else
+
+const EVP_CIPHER *fetchedCipher(const EVP_CIPHER *cipher) { return cipher; }
+
+const EVP_MD *fetchedDigest(const EVP_MD *md) { return md; }
+
+static void freeFetched() {}
+
+#endif
+
 void openssl_init(bool threaded) {
-  // initialize the SSL library
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  // initialize the SSL library.  From 1.1 on it initializes itself as it is
+  // first used, and the ciphers use the CPU's AES and SHA instructions
+  // without an engine, so a mount does not pay for loading them all.
   SSL_load_error_strings();
   SSL_library_init();
 
-  unsigned int randSeed = 0;
-  RAND_bytes((unsigned char *)&randSeed, sizeof(randSeed));
-  srand(randSeed);
-
 #ifndef OPENSSL_NO_ENGINE
   /* Load all bundled ENGINEs into memory and make them visible */
   ENGINE_load_builtin_engines();
   /* Register all of them for every algorithm they collectively implement */
   ENGINE_register_all_complete();
 #endif  // NO_ENGINE
+#endif
+
+  unsigned int randSeed = 0;
+  RAND_bytes((unsigned char *)&randSeed, sizeof(randSeed));
+  srand(randSeed);
+
+  VLOG(1) << "crypto: " << cryptoCapabilities();
 
   if (threaded) {
     // provide locking functions to OpenSSL since we'll be running with
@@ -93,7 +267,9 @@ void openssl_init(bool threaded) {
 }
 
 void openssl_shutdown(bool threaded) {
-#ifndef OPENSSL_NO_ENGINE
+  freeFetched();
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(OPENSSL_NO_ENGINE)
   ENGINE_cleanup();
 #endif
 
@@ -1,9 +1,46 @@
 #ifndef _openssl_incl_
 #define _openssl_incl_
 
+#include <openssl/ossl_typ.h>
+#include <string>
+
 namespace encfs {
     void openssl_init(bool isThreaded);
     void openssl_shutdown(bool isThreaded);
+
+    /*
+        CPU features relevant to the crypto paths.  Probed once, by
+        openssl_init or on first use.  OpenSSL picks its own AES, GCM and SHA
+        code from the same features, the byte kernels in ByteKernels.cpp and
+        the filename codecs in base64.cpp use avx2.
+     */
+    struct CpuFeatures {
+        bool aesni;   // x86 AES-NI
+        bool vaes;    // x86 vector AES (AVX2/AVX-512 wide AES)
+        bool pclmul;  // x86 carry-less multiply, used by GCM
+        bool shani;   // x86 SHA extensions
+        bool avx2;    // x86 AVX2, with OS support for the ymm state
+        bool armce;   // ARMv8 crypto extensions (AES + PMULL)
+        bool armsha;  // ARMv8 SHA1 / SHA2 instructions
+        bool neon;    // ARM Advanced SIMD
+    };
+
+    const CpuFeatures& cpuFeatures();
+
+    // one line description of the crypto implementation in use, for
+    // encfsctl info and filesystem creation
+    std::string cryptoCapabilities();
+
+    /*
+        The provider's implementation of an algorithm, fetched once.  From
+        OpenSSL 3 on, every init with one of the EVP_aes_256_cbc() style
+        objects looks the implementation up again, under the provider
+        store's lock; the fetched objects are kept until openssl_shutdown.
+        Before 3, or when the fetch fails (Blowfish without the legacy
+        provider), the argument is returned as it is.
+     */
+    const EVP_CIPHER* fetchedCipher(const EVP_CIPHER* cipher);
+    const EVP_MD* fetchedDigest(const EVP_MD* md);
 }
 
 #endif
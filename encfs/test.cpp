@@ -16,28 +16,81 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <ftw.h>
+#include <functional>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
+#include <pthread.h>
 #include <sstream>
 #include <string>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
+#include "AttrCache.h"
+#include "BlockCache.h"
 #include "BlockNameIO.h"
+#include "ByteKernels.h"
+#include "CachingFileIO.h"
 #include "Cipher.h"
+#include "CipherFileIO.h"
 #include "CipherKey.h"
+#include "CiphertextCache.h"
+#include "CompressedFileIO.h"
+#include "ConfigSidecar.h"
+#include "DirFdCache.h"
+#include "DirIndex.h"
+#include "DirListCache.h"
 #include "DirNode.h"
+#include "Divider.h"
 #include "Error.h"
 #include "FSConfig.h"
+#include "FileIVCache.h"
+#include "FileNode.h"
 #include "FileUtils.h"
+#include "HotFileCache.h"
 #include "Interface.h"
+#include "JournalFileIO.h"
+#include "LinkCache.h"
+#include "MACFileIO.h"
+#include "MemFileIO.h"
 #include "MemoryPool.h"
+#include "Mutex.h"
 #include "NameIO.h"
+#include "NegativeCache.h"
+#include "NonceBudget.h"
+#include "ObjectStore.h"
+#include "OpStats.h"
+#include "PackStore.h"
+#include "PathCache.h"
+#include "PathName.h"
 #include "Range.h"
+#include "RawFileIO.h"
+#include "Reclaimer.h"
+#include "SSL_Cipher.h"
 #include "StreamNameIO.h"
+#include "ThreadPool.h"
+#include "WriteJournal.h"
+#include "XattrCache.h"
+#include "base64.h"
 #include "easylogging++.h"
 
 #define NO_DES
@@ -370,29 +423,3201 @@ bool runTests(const std::shared_ptr<Cipher> &cipher, bool verbose) {
   return true;
 }
 
+// code one block of the largest size the cipher allows
+static bool testLargeBlock(const Cipher::CipherAlgorithm &alg) {
+  int size = alg.blockSize.max();
+  cerr << alg.name << ", block size " << size << ":  ";
+
+  std::shared_ptr<Cipher> cipher = Cipher::New(alg.name);
+  if (!cipher) {
+    cerr << "FAILED TO CREATE\n";
+    return false;
+  }
+  if (cipher->aeadHeaderSize() > 0) {
+    // sealed by CipherFileIO, not through blockEncode
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  MemBlock orig = MemoryPool::allocate(size);
+  MemBlock data = MemoryPool::allocate(size);
+  for (int i = 0; i < size; ++i) {
+    orig.data[i] = data.data[i] = rand();
+  }
+
+  bool ok = cipher->blockEncode(data.data, size, 1, key) &&
+            memcmp(data.data, orig.data, size) != 0 &&
+            cipher->blockDecode(data.data, size, 1, key) &&
+            memcmp(data.data, orig.data, size) == 0;
+
+  MemoryPool::release(data);
+  MemoryPool::release(orig);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
 static bool testCipherSize(const string &name, int keySize, int blockSize,
                            bool verbose) {
   cerr << name << ", key length " << keySize << ", block size " << blockSize
        << ":  ";
 
-  std::shared_ptr<Cipher> cipher = Cipher::New(name, keySize);
-  if (!cipher) {
-    cerr << "FAILED TO CREATE\n";
+  std::shared_ptr<Cipher> cipher = Cipher::New(name, keySize);
+  if (!cipher) {
+    cerr << "FAILED TO CREATE\n";
+    return false;
+  } else {
+    try {
+      if (runTests(cipher, verbose)) {
+        cerr << "OK\n";
+      } else {
+        cerr << "FAILED\n";
+        return false;
+      }
+    } catch (encfs::Error &er) {
+      cerr << "Error: " << er.what() << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// one key coding on several threads at once gives what it gives on one
+static bool testSharedKey() {
+  cerr << "one key on several threads:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  const int blocks = 32;
+  std::vector<unsigned char> plain(blocks * FSBlockSize);
+  cipher->randomize(plain.data(), (int)plain.size(), false);
+  std::vector<unsigned char> expect = plain;
+  std::vector<uint64_t> macs(blocks);
+  for (int i = 0; i < blocks; ++i) {
+    cipher->blockEncode(&expect[i * FSBlockSize], FSBlockSize, i, key);
+    macs[i] = cipher->MAC_64(&plain[i * FSBlockSize], FSBlockSize, key);
+  }
+
+  std::atomic<bool> ok(true);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&]() {
+      for (int round = 0; ok && round < 50; ++round) {
+        std::vector<unsigned char> data = plain;
+        for (int i = 0; i < blocks; ++i) {
+          unsigned char *block = &data[i * FSBlockSize];
+          if (cipher->MAC_64(block, FSBlockSize, key) != macs[i] ||
+              !cipher->blockEncode(block, FSBlockSize, i, key)) {
+            ok = false;
+          }
+        }
+        if (data != expect) {
+          ok = false;
+        }
+        for (int i = 0; i < blocks; ++i) {
+          cipher->blockDecode(&data[i * FSBlockSize], FSBlockSize, i, key);
+        }
+        if (data != plain) {
+          ok = false;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// the IV of a block depends on every byte of its 64 bit seed
+static bool testBlockIVs() {
+  cerr << "block IV seeds:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  std::vector<unsigned char> plain(FSBlockSize);
+  cipher->randomize(plain.data(), FSBlockSize, false);
+
+  const uint64_t seed = 0x0123456789abcdefULL;
+  std::vector<unsigned char> base = plain;
+  bool ok = cipher->blockEncode(base.data(), FSBlockSize, seed, key);
+  for (int byte = 0; ok && byte < 8; ++byte) {
+    uint64_t other = seed ^ ((uint64_t)1 << (byte * 8));
+    std::vector<unsigned char> data = plain;
+    ok = cipher->blockEncode(data.data(), FSBlockSize, other, key) &&
+         data != base &&
+         cipher->blockDecode(data.data(), FSBlockSize, other, key) &&
+         data == plain;
+  }
+  ok = ok && cipher->blockDecode(base.data(), FSBlockSize, seed, key) &&
+       base == plain;
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a new directory for the tests below, with a trailing slash, or ""
+static string makeTestDir() {
+  string dir = "/tmp/encfstestXXXXXX";
+  if (mkdtemp(&dir[0]) == nullptr) {
+    return "";
+  }
+  return dir + "/";
+}
+
+static int removeEntry(const char *path, const struct stat *, int,
+                       struct FTW *) {
+  return ::remove(path);
+}
+
+static void removeTestDir(const string &dir) {
+  nftw(dir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// the config of a file stack with blocks of blockSize
+static FSConfigPtr blockConfig(const std::shared_ptr<Cipher> &cipher,
+                               const CipherKey &key, int blockSize) {
+  FSConfigPtr cfg = std::make_shared<FSConfig>();
+  cfg->config = std::make_shared<EncFSConfig>();
+  cfg->config->cfgType = Config_V6;
+  cfg->config->blockSize = blockSize;
+  cfg->opts = std::make_shared<EncFS_Opts>();
+  cfg->cipher = cipher;
+  cfg->key = key;
+  return cfg;
+}
+
+// a backing file for a file stack, created empty in dir
+static std::shared_ptr<FileIO> newRawFile(const string &dir,
+                                          const string &name) {
+  string path = dir + name;
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  return std::make_shared<RawFileIO>(path);
+}
+
+static bool writeAt(FileIO &io, off_t offset, const unsigned char *data,
+                    size_t len) {
+  IORequest req;
+  req.offset = offset;
+  req.data = const_cast<unsigned char *>(data);
+  req.dataLen = len;
+  return io.write(req) == (ssize_t)len;
+}
+
+static bool readAt(const FileIO &io, off_t offset, unsigned char *data,
+                   size_t len) {
+  IORequest req;
+  req.offset = offset;
+  req.data = data;
+  req.dataLen = len;
+  return io.read(req) == (ssize_t)len;
+}
+
+// batches code as block by block does, and reads of block runs return
+// what was written
+static bool testBlockBatches() {
+  cerr << "block batches:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  const int count = 5;
+  std::vector<unsigned char> plain(count * FSBlockSize);
+  cipher->randomize(plain.data(), (int)plain.size(), false);
+  std::vector<unsigned char> single = plain, batch = plain;
+  Cipher::BlockRequest blocks[count];
+  for (int i = 0; i < count; ++i) {
+    cipher->blockEncode(&single[i * FSBlockSize], FSBlockSize, 100 + i, key);
+    blocks[i].buf = &batch[i * FSBlockSize];
+    blocks[i].size = FSBlockSize;
+    blocks[i].iv64 = 100 + i;
+  }
+  bool ok = cipher->blockEncodeBatch(blocks, count, key) && batch == single &&
+            cipher->blockDecodeBatch(blocks, count, key) && batch == plain;
+
+  string dir = makeTestDir();
+  ok = ok && !dir.empty();
+  if (!dir.empty()) {
+    FSConfigPtr cfg = blockConfig(cipher, key, FSBlockSize);
+    CipherFileIO io(newRawFile(dir, "batch"), cfg);
+    int bs = io.blockSize();
+    // ten and a half blocks, read as a run, and from inside a block
+    const size_t size = 10 * bs + bs / 2;
+    std::vector<unsigned char> data(size), got(size);
+    cipher->randomize(data.data(), (int)size, false);
+    ok = ok && io.open(O_RDWR) >= 0 && writeAt(io, 0, data.data(), size) &&
+         readAt(io, 0, got.data(), size) && got == data &&
+         readAt(io, 10, got.data(), size - 10) &&
+         memcmp(got.data(), &data[10], size - 10) == 0;
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// sealed blocks must not open once any byte of them, their position or
+// the key changes
+static bool testAeadTamper(const string &name) {
+  cerr << name << " tamper detection:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New(name);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  int header = cipher->aeadHeaderSize();
+  const int size = FSBlockSize;
+  std::vector<unsigned char> plain(size), out(size);
+  std::vector<unsigned char> sealed(size + header), again(size + header);
+  cipher->randomize(plain.data(), size, false);
+
+  bool ok = header > 0 &&
+            cipher->aeadEncode(plain.data(), size, 7, sealed.data(), key) &&
+            cipher->aeadDecode(sealed.data(), size, 7, out.data(), key) &&
+            out == plain;
+  // sealing the same block again picks another nonce
+  ok = ok && cipher->aeadEncode(plain.data(), size, 7, again.data(), key) &&
+       memcmp(again.data(), sealed.data(), header) != 0;
+
+  // the nonce and tag, and a sample of the ciphertext
+  for (int i = 0; ok && i < size + header; i += (i < header ? 1 : 17)) {
+    std::vector<unsigned char> bad = sealed;
+    bad[i] ^= (unsigned char)(1 << (i % 8));
+    ok = !cipher->aeadDecode(bad.data(), size, 7, out.data(), key);
+  }
+  ok = ok && !cipher->aeadDecode(sealed.data(), size, 8, out.data(), key);
+  ok = ok && !cipher->aeadDecode(sealed.data(), size - 1, 7, out.data(), key);
+  CipherKey other = cipher->newRandomKey();
+  ok = ok && !cipher->aeadDecode(sealed.data(), size, 7, out.data(), other);
+
+  // a file whose first block was changed on disk only fails that block
+  string dir = makeTestDir();
+  ok = ok && !dir.empty();
+  if (!dir.empty()) {
+    FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+    CipherFileIO io(newRawFile(dir, "sealed"), cfg);
+    int bs = io.blockSize();
+    std::vector<unsigned char> data(3 * bs), got(bs);
+    cipher->randomize(data.data(), (int)data.size(), false);
+    ok = ok && bs == 1024 - header && io.open(O_RDWR) >= 0 &&
+         writeAt(io, 0, data.data(), data.size()) &&
+         readAt(io, bs, got.data(), bs) &&
+         memcmp(got.data(), &data[bs], bs) == 0;
+
+    unsigned char byte = 0;
+    int fd = ::open((dir + "sealed").c_str(), O_RDWR);
+    ok = ok && fd >= 0 && ::pread(fd, &byte, 1, header + 5) == 1;
+    byte ^= 0x10;
+    ok = ok && ::pwrite(fd, &byte, 1, header + 5) == 1;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    IORequest req;
+    req.data = got.data();
+    req.dataLen = bs;
+    ok = ok && io.read(req) < 0 && readAt(io, 2 * bs, got.data(), bs);
+    removeTestDir(dir);
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// XTS blocks round trip, and depend on the tweak the IV gives them
+static bool testXTS() {
+  cerr << "AES-XTS tweaks:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES-XTS");
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  bool ok = true;
+  for (int keySize = 256; ok && keySize <= 512; keySize += 256) {
+    cipher = Cipher::New("AES-XTS", keySize);
+    CipherKey key = cipher->newRandomKey();
+    const int size = 512;
+    std::vector<unsigned char> orig(size), data(size), other(size);
+    cipher->randomize(orig.data(), size, false);
+    data = orig;
+    other = orig;
+
+    ok = cipher->blockEncode(data.data(), size, 1, key) && data != orig &&
+         cipher->blockEncode(other.data(), size, 2, key) && other != data;
+    // decoding under another tweak does not give the block back
+    std::vector<unsigned char> wrong = data;
+    ok = ok && cipher->blockDecode(wrong.data(), size, 2, key) &&
+         wrong != orig;
+    ok = ok && cipher->blockDecode(data.data(), size, 1, key) && data == orig;
+
+    // partial blocks go through the stream mode
+    data = orig;
+    ok = ok && cipher->streamEncode(data.data(), 100, 1, key) &&
+         cipher->streamDecode(data.data(), 100, 1, key) && data == orig;
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// the stream mode passes in use against the plain loops that define them,
+// for every size up to a few chunks and at every alignment
+static bool testByteKernels() {
+  cerr << "byte kernels (" << byteKernelName() << "):  ";
+  const int maxSize = 600;
+  std::vector<unsigned char> orig(maxSize + 32), data, expect;
+  for (size_t i = 0; i < orig.size(); ++i) {
+    orig[i] = (unsigned char)rand();
+  }
+  bool ok = true;
+  for (int align = 0; ok && align < 32; ++align) {
+    for (int size = 0; ok && size <= maxSize; ++size) {
+      data = orig;
+      expect = orig;
+      unsigned char *buf = &data[align];
+      unsigned char *ref = &expect[align];
+      shuffleBytes(buf, size);
+      for (int i = 1; i < size; ++i) {
+        ref[i] ^= ref[i - 1];
+      }
+      ok = data == expect;
+      unshuffleBytes(buf, size);
+      ok = ok && data == orig;
+
+      flipBytes(buf, size);
+      expect = orig;
+      for (int start = 0; start < size; start += 64) {
+        int len = std::min(64, size - start);
+        std::reverse(ref + start, ref + start + len);
+      }
+      ok = ok && data == expect;
+    }
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// the reference vectors of SipHash-2-4, whose messages start with the
+// nonce, and a MAC stack that uses it
+static bool testSipHash() {
+  cerr << "SipHash-2-4 block MACs:  ";
+  const uint64_t key[2] = {0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL};
+  const uint64_t nonce = 0x0706050403020100ULL;
+  unsigned char msg[64];
+  for (int i = 0; i < (int)sizeof(msg); ++i) {
+    msg[i] = (unsigned char)i;
+  }
+  struct {
+    int len;  // of the message, nonce included
+    uint64_t hash;
+  } vectors[] = {{8, 0x93f5f5799a932462ULL},
+                 {15, 0xa129ca6149be45e5ULL},
+                 {16, 0x3f2acc7f57c29bdbULL},
+                 {23, 0xa80c038ccd5ccec8ULL},
+                 {64, 0xacd2c40b8502cad8ULL}};
+  bool ok = true;
+  for (const auto &v : vectors) {
+    ok = ok && SSL_Cipher::SipHash_64(key, nonce, msg + 8, v.len - 8) ==
+                   v.hash;
+  }
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  ok = ok && !dir.empty();
+  if (ok && cipher) {
+    CipherKey ckey = cipher->newRandomKey();
+    ok = cipher->FastMAC_64(msg, sizeof(msg), 1, ckey) !=
+         cipher->FastMAC_64(msg, sizeof(msg), 2, ckey);
+
+    // blocks that read back as written until one changes on disk
+    FSConfigPtr cfg = blockConfig(cipher, ckey, 1024);
+    cfg->config->blockMACBytes = 8;
+    cfg->config->blockMACAlgorithm = BlockMAC_SipHash;
+    std::shared_ptr<FileIO> cipherIO(
+        new CipherFileIO(newRawFile(dir, "mac"), cfg));
+    MACFileIO io(cipherIO, cfg);
+    int bs = io.blockSize();
+    std::vector<unsigned char> data(2 * bs), got(bs);
+    cipher->randomize(data.data(), (int)data.size(), false);
+    ok = ok && io.open(O_RDWR) >= 0 &&
+         writeAt(io, 0, data.data(), data.size()) &&
+         readAt(io, 0, got.data(), bs) &&
+         memcmp(got.data(), data.data(), bs) == 0;
+    int fd = ::open((dir + "mac").c_str(), O_RDWR);
+    unsigned char byte = 0x55;
+    ok = ok && fd >= 0 && ::pwrite(fd, &byte, 1, 1024 + 100) == 1;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    IORequest req;
+    req.offset = bs;
+    req.data = got.data();
+    req.dataLen = bs;
+    ok = ok && io.read(req) < 0;
+
+    // the config keeps which MAC the volume uses
+    EncFSConfig config;
+    config.cipherIface = cipher->interface();
+    config.blockMACAlgorithm = BlockMAC_SipHash;
+    EncFSConfig read;
+    string path = dir + "config";
+    ok = ok && writeV6Config(path.c_str(), &config) &&
+         readV6Config(path.c_str(), &read, nullptr) &&
+         read.blockMACAlgorithm == BlockMAC_SipHash;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// the versions that mark the newer formats still open the volumes of the
+// versions before them
+static bool testFormatVersions() {
+  cerr << "format interface versions:  ";
+  struct {
+    const char *name;
+    Interface current;
+  } ciphers[] = {{"AES", Interface("ssl/aes", 5, 0, 4)},
+                 {"AES-GCM", Interface("ssl/aes-gcm", 2, 0, 1)},
+                 {"Null", Interface("nullCipher", 2, 0, 1)}};
+  bool ok = true;
+  for (const auto &c : ciphers) {
+    std::shared_ptr<Cipher> cipher = Cipher::New(c.name);
+    if (!cipher) {
+      continue;
+    }
+    Interface before = c.current;
+    --before.current();
+    --before.age();
+    ok = ok && cipher->interface() == c.current &&
+         Cipher::New(before) != nullptr;
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// buffered random bytes are not handed out twice, and a forked child does
+// not get the bytes its parent gets next
+static bool testRandomBuffer() {
+  cerr << "buffered random bytes:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  unsigned char a[16], b[16];
+  bool ok = cipher->randomize(a, sizeof(a), false) &&
+            cipher->randomize(b, sizeof(b), false) &&
+            memcmp(a, b, sizeof(a)) != 0;
+
+  int fds[2];
+  ok = ok && pipe(fds) == 0;
+  if (ok) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      unsigned char child[16];
+      bool sent =
+          cipher->randomize(child, sizeof(child), false) &&
+          write(fds[1], child, sizeof(child)) == (ssize_t)sizeof(child);
+      _exit(sent ? 0 : 1);
+    }
+    unsigned char child[16];
+    ok = pid > 0 && cipher->randomize(a, sizeof(a), false) &&
+         read(fds[0], child, sizeof(child)) == (ssize_t)sizeof(child) &&
+         memcmp(a, child, sizeof(a)) != 0;
+    int status = 0;
+    ok = ok && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// cached blocks are dropped least recently used first, and one cache
+// serves several files
+static bool testBlockCache() {
+  cerr << "block cache:  ";
+  BlockCache cache(4 * FSBlockSize, 1);
+  uint64_t a = BlockCache::newOwner();
+  uint64_t b = BlockCache::newOwner();
+  unsigned char block[FSBlockSize];
+  unsigned char out[FSBlockSize];
+  memset(block, 0, sizeof(block));
+  for (int i = 0; i < 4; ++i) {
+    block[0] = (unsigned char)i;
+    cache.put(a, i, block, sizeof(block));
+  }
+  bool ok = cache.get(a, 0, out, sizeof(out)) == (ssize_t)sizeof(out) &&
+            out[0] == 0 && cache.get(b, 0, out, sizeof(out)) == -1;
+  // block 1 is now the least recently used
+  cache.put(b, 0, block, sizeof(block));
+  ok = ok && cache.get(a, 1, out, sizeof(out)) == -1 &&
+       cache.get(a, 0, out, sizeof(out)) == (ssize_t)sizeof(out) &&
+       cache.bytesUsed() <= 4 * FSBlockSize;
+  cache.erase(a, 0);
+  cache.eraseFrom(a, 3);
+  ok = ok && cache.get(a, 0, out, sizeof(out)) == -1 &&
+       cache.get(a, 2, out, sizeof(out)) == (ssize_t)sizeof(out) &&
+       out[0] == 2 && cache.get(a, 3, out, sizeof(out)) == -1 &&
+       cache.get(b, 0, out, sizeof(out)) == (ssize_t)sizeof(out);
+  // holds() compares, without counting as a hit or miss
+  block[0] = 2;
+  ok = ok && cache.holds(a, 2, block, sizeof(block)) &&
+       !cache.holds(a, 2, block, 100) && !cache.holds(a, 3, block, 100);
+  block[0] = 9;
+  ok = ok && !cache.holds(a, 2, block, sizeof(block));
+  ok = ok && cache.hits() == 4 && cache.misses() == 4;
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  ok = ok && !dir.empty();
+  if (ok && cipher) {
+    // two files sharing a cache too small for both
+    CipherKey key = cipher->newRandomKey();
+    FSConfigPtr cfg = blockConfig(cipher, key, FSBlockSize);
+    cfg->blockCache = std::make_shared<BlockCache>(8 * FSBlockSize, 1);
+    CipherFileIO one(newRawFile(dir, "one"), cfg);
+    CipherFileIO two(newRawFile(dir, "two"), cfg);
+    const size_t size = 12 * FSBlockSize;
+    std::vector<unsigned char> first(size), second(size), got(size);
+    cipher->randomize(first.data(), (int)size, false);
+    cipher->randomize(second.data(), (int)size, false);
+    ok = one.open(O_RDWR) >= 0 && two.open(O_RDWR) >= 0 &&
+         writeAt(one, 0, first.data(), size) &&
+         writeAt(two, 0, second.data(), size);
+    for (int round = 0; ok && round < 2; ++round) {
+      ok = readAt(one, 0, got.data(), size) && got == first &&
+           readAt(two, 0, got.data(), size) && got == second;
+    }
+    ok = ok && cfg->blockCache->bytesUsed() <= 8 * FSBlockSize;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// polls cond for up to 10 seconds
+static bool waitFor(const std::function<bool()> &cond) {
+  for (int i = 0; i < 10000; ++i) {
+    if (cond()) {
+      return true;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+// a backing file whose reads from threads other than the one that made
+// it wait at a gate once armed, after reading, so that a read-ahead job
+// can be held with the data it read in hand.  It counts the reads, a
+// vector read as one.
+class GatedFileIO : public FileIO {
+ public:
+  explicit GatedFileIO(std::shared_ptr<FileIO> base)
+      : base(std::move(base)),
+        owner(pthread_self()),
+        armed(false),
+        entered(false),
+        released(false),
+        reads(0),
+        writes(0) {}
+
+  virtual Interface interface() const { return base->interface(); }
+  virtual void setFileName(const char *name) { base->setFileName(name); }
+  virtual const char *getFileName() const { return base->getFileName(); }
+  virtual int open(int flags) { return base->open(flags); }
+  virtual int getAttr(struct stat *stbuf) const {
+    return base->getAttr(stbuf);
+  }
+  virtual off_t getSize() const { return base->getSize(); }
+  virtual ssize_t read(const IORequest &req) const {
+    ++reads;
+    ssize_t result = base->read(req);
+    hold();
+    return result;
+  }
+  virtual ssize_t readv(const IOVecRequest &req) const {
+    ++reads;
+    ssize_t result = base->readv(req);
+    hold();
+    return result;
+  }
+  virtual ssize_t write(const IORequest &req) {
+    ++writes;
+    return base->write(req);
+  }
+  virtual int truncate(off_t size) { return base->truncate(size); }
+  virtual bool isWritable() const { return base->isWritable(); }
+
+  std::shared_ptr<FileIO> base;
+  pthread_t owner;
+  std::atomic<bool> armed;
+  mutable std::atomic<bool> entered;
+  std::atomic<bool> released;
+  mutable std::atomic<int> reads;
+  std::atomic<int> writes;
+
+ private:
+  void hold() const {
+    if (armed && !pthread_equal(pthread_self(), owner)) {
+      entered = true;
+      while (!released) {
+        usleep(1000);
+      }
+    }
+  }
+};
+
+// sequential reads fill the cache ahead of them, and a job that read
+// blocks before a write to them does not cache what it read
+static bool testReadAhead() {
+  cerr << "read-ahead:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, FSBlockSize);
+  cfg->blockCache = std::make_shared<BlockCache>(1 << 20);
+  cfg->readAheadPool = std::make_shared<ThreadPool>(1);
+  const int blocks = 16;
+  std::vector<unsigned char> old(blocks * FSBlockSize);
+  std::vector<unsigned char> fresh(old.size()), got(old.size());
+  cipher->randomize(old.data(), (int)old.size(), false);
+  cipher->randomize(fresh.data(), (int)fresh.size(), false);
+  bool ok;
+  {
+    CipherFileIO writer(newRawFile(dir, "ahead"), cfg);
+    ok = writer.open(O_RDWR) >= 0 &&
+         writeAt(writer, 0, old.data(), old.size());
+  }
+
+  // a new stack, whose cache is empty, reads the window into the cache
+  {
+    std::shared_ptr<CipherFileIO> io(
+        new CipherFileIO(std::make_shared<RawFileIO>(dir + "ahead"), cfg));
+    io->setReadAhead(8);
+    size_t before = cfg->blockCache->bytesUsed();
+    for (int i = 0; ok && i < 3; ++i) {
+      ok = readAt(*io, i * FSBlockSize, got.data(), FSBlockSize) &&
+           memcmp(got.data(), &old[i * FSBlockSize], FSBlockSize) == 0;
+    }
+    ok = ok && waitFor([&]() {
+      return cfg->blockCache->bytesUsed() >= before + 8 * FSBlockSize;
+    });
+    ok = ok && waitFor([&]() { return io.use_count() == 1; });
+  }
+
+  // one whose job is held after reading while the blocks are written
+  auto gate = std::make_shared<GatedFileIO>(
+      std::make_shared<RawFileIO>(dir + "ahead"));
+  std::shared_ptr<CipherFileIO> io(new CipherFileIO(gate, cfg));
+  io->setReadAhead(8);
+  gate->armed = true;
+  for (int i = 0; ok && i < 3; ++i) {
+    ok = readAt(*io, i * FSBlockSize, got.data(), FSBlockSize);
+  }
+  ok = ok && waitFor([&]() { return gate->entered.load(); });
+  ok = ok && writeAt(*io, 0, fresh.data(), fresh.size());
+  gate->released = true;
+  // the job holds a reference until it is done
+  ok = ok && waitFor([&]() { return io.use_count() == 1; });
+  ok = ok && readAt(*io, 0, got.data(), got.size()) && got == fresh;
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// scatter / gather requests map their buffers onto consecutive bytes,
+// also past IOV_MAX buffers, and block runs with partial ends round trip
+// through a MAC stack
+static bool testBlockRuns() {
+  cerr << "scatter / gather block runs:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  std::shared_ptr<FileIO> raw = newRawFile(dir, "raw");
+  const int count = IOV_MAX + 100;
+  const int piece = 7;
+  std::vector<unsigned char> data(count * piece), got(count * piece);
+  cipher->randomize(data.data(), (int)data.size(), false);
+  std::vector<struct iovec> iov(count);
+  for (int i = 0; i < count; ++i) {
+    iov[i].iov_base = &data[i * piece];
+    iov[i].iov_len = piece;
+  }
+  IOVecRequest req;
+  req.offset = 3;
+  req.iov = iov.data();
+  req.iovcnt = count;
+  bool ok = raw->open(O_RDWR) >= 0 &&
+            raw->writev(req) == (ssize_t)data.size() &&
+            readAt(*raw, 3, got.data(), got.size()) && got == data;
+  for (int i = 0; i < count; ++i) {
+    iov[i].iov_base = &got[(count - 1 - i) * piece];
+  }
+  ok = ok && raw->readv(req) == (ssize_t)data.size();
+  for (int i = 0; ok && i < count; ++i) {
+    ok = memcmp(&got[(count - 1 - i) * piece], &data[i * piece], piece) == 0;
+  }
+
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->blockMACBytes = 8;
+  cfg->config->blockMACRandBytes = 4;
+  std::shared_ptr<FileIO> cipherIO(
+      new CipherFileIO(newRawFile(dir, "run"), cfg));
+  MACFileIO io(cipherIO, cfg);
+  int bs = io.blockSize();
+  const size_t size = 40 * bs;
+  std::vector<unsigned char> file(size), back(size), patch(30 * bs);
+  cipher->randomize(file.data(), (int)size, false);
+  cipher->randomize(patch.data(), (int)patch.size(), false);
+  // a run that starts and ends inside a block, over what was written
+  ok = ok && io.open(O_RDWR) >= 0 && writeAt(io, 0, file.data(), size) &&
+       writeAt(io, bs / 2, patch.data(), patch.size());
+  memcpy(&file[bs / 2], patch.data(), patch.size());
+  ok = ok && readAt(io, 0, back.data(), size) && back == file &&
+       readAt(io, 3, back.data(), size - 3) &&
+       memcmp(back.data(), &file[3], size - 3) == 0;
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// forEach runs every job once, and a file coded in parallel slices reads
+// back through a stack that codes it in one pass, and the other way
+static bool testCryptoPool() {
+  cerr << "crypto pool:  ";
+  auto pool = std::make_shared<ThreadPool>(3);
+  std::vector<std::atomic<int>> runs(100);
+  for (auto &run : runs) {
+    run = 0;
+  }
+  bool ok = pool->forEach(100, [&](int i) {
+    ++runs[i];
+    return true;
+  });
+  for (auto &run : runs) {
+    ok = ok && run == 1;
+  }
+  ok = ok && !pool->forEach(10, [](int i) { return i != 7; });
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (ok && cipher && !dir.empty()) {
+    CipherKey key = cipher->newRandomKey();
+    FSConfigPtr serial = blockConfig(cipher, key, 1024);
+    FSConfigPtr parallel = blockConfig(cipher, key, 1024);
+    parallel->cryptoPool = pool;
+    const size_t size = 512 * 1024;
+    std::vector<unsigned char> data(size), got(size);
+    cipher->randomize(data.data(), (int)size, false);
+    CipherFileIO one(newRawFile(dir, "one"), parallel);
+    CipherFileIO two(newRawFile(dir, "two"), serial);
+    ok = one.open(O_RDWR) >= 0 && two.open(O_RDWR) >= 0 &&
+         writeAt(one, 0, data.data(), size) &&
+         writeAt(two, 0, data.data(), size);
+    CipherFileIO oneSerial(std::make_shared<RawFileIO>(dir + "one"), serial);
+    CipherFileIO twoParallel(std::make_shared<RawFileIO>(dir + "two"),
+                             parallel);
+    ok = ok && oneSerial.open(O_RDONLY) >= 0 &&
+         twoParallel.open(O_RDONLY) >= 0 &&
+         readAt(oneSerial, 0, got.data(), size) && got == data &&
+         readAt(twoParallel, 0, got.data(), size) && got == data;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// small appends to the last block are held until a read reaches it or
+// the file is flushed, and reads see them either way
+static bool testWriteBack() {
+  cerr << "write-back of the last block:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  string path = dir + "appended";
+  newRawFile(dir, "appended");
+  const int writes = 50;
+  const int piece = 100;
+  std::vector<unsigned char> data(writes * piece), got(writes * piece);
+  cipher->randomize(data.data(), (int)data.size(), false);
+  struct stat st;
+  bool ok;
+  {
+    FileNode node(nullptr, cfg, "appended", path.c_str(), 0);
+    ok = node.open(O_RDWR) >= 0;
+    for (int i = 0; ok && i < writes; ++i) {
+      ok = node.write(i * piece, &data[i * piece], piece) == piece;
+    }
+    // the partial last block is still buffered
+    ok = ok && node.getSize() == (off_t)data.size() &&
+         ::stat(path.c_str(), &st) == 0 && st.st_size < (off_t)data.size();
+    ok = ok && node.read(0, got.data(), got.size()) == (ssize_t)got.size() &&
+         got == data;
+    ok = ok && node.write(data.size(), data.data(), 10) == 10 &&
+         node.flush() == 0 && ::stat(path.c_str(), &st) == 0 &&
+         st.st_size == (off_t)data.size() + 10;
+  }
+  {
+    FileNode node(nullptr, cfg, "appended", path.c_str(), 0);
+    ok = ok && node.open(O_RDONLY) >= 0 &&
+         node.read(0, got.data(), got.size()) == (ssize_t)got.size() &&
+         got == data;
+  }
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// random writes and reads through a MAC stack, whose blocks are sealed
+// and checked in front of their data, against a copy kept in memory
+static bool testMACInPlace() {
+  cerr << "MAC blocks sealed in place:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->blockMACBytes = 8;
+  cfg->config->blockMACRandBytes = 8;
+  std::shared_ptr<FileIO> cipherIO(
+      new CipherFileIO(newRawFile(dir, "mac"), cfg));
+  MACFileIO io(cipherIO, cfg);
+  const size_t maxSize = 20 * 1024;
+  std::vector<unsigned char> model, data(4096), got(maxSize);
+  bool ok = io.open(O_RDWR) >= 0;
+  for (int i = 0; ok && i < 300; ++i) {
+    off_t offset = rand() % maxSize;
+    size_t len = 1 + rand() % (data.size() - 1);
+    if (i % 2 == 0) {
+      cipher->randomize(data.data(), (int)len, false);
+      ok = writeAt(io, offset, data.data(), len);
+      if (model.size() < offset + len) {
+        model.resize(offset + len);
+      }
+      memcpy(&model[offset], data.data(), len);
+    } else if ((size_t)offset < model.size()) {
+      len = std::min(len, model.size() - offset);
+      ok = readAt(io, offset, got.data(), len) &&
+           memcmp(got.data(), &model[offset], len) == 0;
+    }
+  }
+  ok = ok && io.getSize() == (off_t)model.size() &&
+       readAt(io, 0, got.data(), model.size()) &&
+       memcmp(got.data(), model.data(), model.size()) == 0;
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// holes of the backing file are known as such until written, and read as
+// zeros through a stack that allows them
+static bool testHoles() {
+  cerr << "file holes:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  const off_t far = 1 << 20;
+  std::vector<unsigned char> data(4096), got(4096), zero(4096);
+  cipher->randomize(data.data(), (int)data.size(), false);
+  std::shared_ptr<FileIO> raw = newRawFile(dir, "raw");
+  bool ok = raw->open(O_RDWR) >= 0 &&
+            writeAt(*raw, 0, data.data(), data.size()) &&
+            writeAt(*raw, far, data.data(), data.size());
+  // whether this filesystem keeps holes at all
+  int fd = ::open((dir + "raw").c_str(), O_RDONLY);
+  bool fsHoles = fd >= 0 && lseek(fd, 0, SEEK_HOLE) < far;
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  ok = ok && !raw->isHole(0, data.size()) &&
+       raw->isHole(far / 2, data.size()) == fsHoles &&
+       !raw->isHole(far, data.size()) && !raw->isHole(far - 10, 20);
+  ok = ok && writeAt(*raw, far / 2, data.data(), data.size()) &&
+       !raw->isHole(far / 2, data.size());
+
+  // blocks in the hole read as zeros, those written around it as written
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->allowHoles = true;
+  CipherFileIO io(newRawFile(dir, "sparse"), cfg);
+  ok = ok && io.open(O_RDWR) >= 0 &&
+       writeAt(io, 0, data.data(), data.size()) &&
+       writeAt(io, far, data.data(), data.size()) &&
+       readAt(io, far / 2, got.data(), got.size()) && got == zero &&
+       readAt(io, far, got.data(), got.size()) && got == data &&
+       readAt(io, 0, got.data(), got.size()) && got == data;
+
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// gaps left by writes and truncates past the end of a file without holes
+// read back as zeros, with or without MAC headers
+static bool testPadding() {
+  cerr << "padding past end of file:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  bool ok = true;
+  for (int mac = 0; ok && mac < 2; ++mac) {
+    FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+    cfg->config->blockMACBytes = mac ? 8 : 0;
+    std::shared_ptr<FileIO> io(
+        new CipherFileIO(newRawFile(dir, mac ? "mac" : "plain"), cfg));
+    if (mac) {
+      io = std::make_shared<MACFileIO>(io, cfg);
+    }
+    const size_t far = 300 * 1024 + 17;
+    const size_t end = 600 * 1024 + 5;
+    std::vector<unsigned char> model(end), got(end);
+    cipher->randomize(model.data(), 100, false);
+    cipher->randomize(&model[far], 100, false);
+    ok = io->open(O_RDWR) >= 0 && writeAt(*io, 0, model.data(), 100) &&
+         writeAt(*io, far, &model[far], 100) && io->truncate(end) == 0 &&
+         io->getSize() == (off_t)end && readAt(*io, 0, got.data(), end) &&
+         got == model;
+  }
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// readers of one file run alongside a writer appending to it, and every
+// byte below the size they see reads as written
+static bool testParallelReads() {
+  cerr << "parallel reads of one file:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->blockCache = std::make_shared<BlockCache>(1 << 20);
+  string path = dir + "shared";
+  newRawFile(dir, "shared");
+  const size_t half = 128 * 1024;
+  std::vector<unsigned char> model(2 * half);
+  cipher->randomize(model.data(), (int)model.size(), false);
+  FileNode node(nullptr, cfg, "shared", path.c_str(), 0);
+  std::atomic<bool> ok(node.open(O_RDWR) >= 0 &&
+                       node.write(0, model.data(), half) == (ssize_t)half);
+
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    for (size_t at = half; ok && at < model.size(); at += 300) {
+      size_t len = std::min((size_t)300, model.size() - at);
+      if (node.write(at, &model[at], len) != (ssize_t)len) {
+        ok = false;
+      }
+    }
+    done = true;
+  });
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&, t]() {
+      std::vector<unsigned char> got(model.size());
+      while (ok && !done) {
+        off_t offset;
+        size_t len;
+        if (t == 0) {
+          // the tail, up to the buffered block
+          offset = half;
+          len = node.getSize() - half;
+        } else {
+          offset = rand() % half;
+          len = 1 + rand() % (half - offset);
+        }
+        if (node.read(offset, got.data(), len) != (ssize_t)len ||
+            memcmp(got.data(), &model[offset], len) != 0) {
+          ok = false;
+        }
+      }
+    });
+  }
+  writer.join();
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  std::vector<unsigned char> got(model.size());
+  ok = ok && node.read(0, got.data(), got.size()) == (ssize_t)got.size() &&
+       got == model;
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a reopened file takes its IV from the cache while its mtime is the one
+// recorded, and reads its header again once the file changed
+static bool testIVCache() {
+  cerr << "file IV cache:  ";
+  FileIVCache small(2);
+  struct stat a, b, c;
+  memset(&a, 0, sizeof(a));
+  a.st_dev = 1;
+  a.st_ino = 1;
+  a.st_mtim.tv_nsec = 5;
+  b = a;
+  b.st_ino = 2;
+  c = a;
+  c.st_ino = 3;
+  small.put(a, 11);
+  small.put(b, 22);
+  bool ok = small.get(a) == 11 && small.get(b) == 22;
+  small.put(c, 33);
+  // a was used least recently
+  ok = ok && small.get(a) == 0 && small.get(c) == 33;
+  b.st_mtim.tv_nsec = 6;
+  ok = ok && small.get(b) == 0;
+
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (ok && cipher && !dir.empty()) {
+    CipherKey key = cipher->newRandomKey();
+    FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+    cfg->config->uniqueIV = true;
+    cfg->ivCache = std::make_shared<FileIVCache>(16);
+    std::vector<unsigned char> data(5000), got(5000);
+    cipher->randomize(data.data(), (int)data.size(), false);
+    {
+      CipherFileIO io(newRawFile(dir, "iv"), cfg);
+      ok = io.open(O_RDWR) >= 0 && writeAt(io, 0, data.data(), data.size());
+    }
+    // the first reopen reads the header, the second finds it cached
+    for (int open = 0; ok && open < 2; ++open) {
+      uint64_t hits = cfg->ivCache->hits();
+      CipherFileIO io(std::make_shared<RawFileIO>(dir + "iv"), cfg);
+      ok = io.open(O_RDONLY) >= 0 &&
+           readAt(io, 0, got.data(), got.size()) && got == data &&
+           cfg->ivCache->hits() == hits + open;
+    }
+    // changed behind the cache's back
+    struct timespec times[2] = {{0, UTIME_OMIT}, {12345, 0}};
+    ok = ok && utimensat(AT_FDCWD, (dir + "iv").c_str(), times, 0) == 0;
+    uint64_t misses = cfg->ivCache->misses();
+    {
+      CipherFileIO io(std::make_shared<RawFileIO>(dir + "iv"), cfg);
+      ok = ok && io.open(O_RDONLY) >= 0 &&
+           readAt(io, 0, got.data(), got.size()) && got == data &&
+           cfg->ivCache->misses() == misses + 1;
+    }
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// appends into the partial last block merge with what was written last
+// without reading it back, until the file no longer ends with that copy
+static bool testAppends() {
+  cerr << "appends to the last block:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  if (!cipher || dir.empty()) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  auto gate = std::make_shared<GatedFileIO>(newRawFile(dir, "appended"));
+  CipherFileIO io(gate, cfg);
+  std::vector<unsigned char> model(3000), got(3000);
+  cipher->randomize(model.data(), (int)model.size(), false);
+  bool ok = io.open(O_RDWR) >= 0 && writeAt(io, 0, model.data(), 50);
+  for (size_t at = 50; ok && at < model.size(); at += 50) {
+    ok = writeAt(io, at, &model[at], 50);
+  }
+  ok = ok && gate->reads == 0 && readAt(io, 0, got.data(), got.size()) &&
+       got == model;
+
+  // another writer extends the last block, so that the copy is stale
+  CipherFileIO other(std::make_shared<RawFileIO>(dir + "appended"), cfg);
+  model.resize(3200);
+  cipher->randomize(&model[2900], 300, false);
+  ok = ok && other.open(O_RDWR) >= 0 &&
+       writeAt(other, 2900, &model[2900], 200);
+  int reads = gate->reads;
+  got.resize(model.size());
+  ok = ok && writeAt(io, 3100, &model[3100], 100) && gate->reads > reads &&
+       readAt(io, 0, got.data(), got.size()) && got == model;
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Pooled blocks are aligned, come back cleared and can be passed between
+// threads.
+static bool testMemoryPool() {
+  cerr << "Memory pool:  ";
+
+  bool ok = true;
+  const int sizes[] = {1, 63, 64, 100, 4096, (1 << 20) + 4096, 3 << 20};
+  for (int size : sizes) {
+    MemBlock mb = MemoryPool::allocate(size);
+    if (size >= MemoryPool::Alignment &&
+        ((uintptr_t)mb.data % MemoryPool::Alignment) != 0) {
+      ok = false;
+    }
+    memset(mb.data, 0xa5, size);
+    MemoryPool::release(mb);
+
+    // the same thread gets the block it just gave back
+    mb = MemoryPool::allocate(size);
+    for (int i = 0; i < size && ok; ++i) {
+      ok = mb.data[i] == 0;
+    }
+    MemoryPool::release(mb);
+  }
+
+  // blocks allocated here are released by the workers, which allocate and
+  // check blocks of their own at the same time
+  std::vector<MemBlock> handed;
+  for (int i = 0; i < 64; ++i) {
+    handed.push_back(MemoryPool::allocate(64 + i * 97));
+  }
+
+  const int numThreads = 4;
+  std::atomic<int> bad(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&handed, &bad, t]() {
+      for (size_t i = t; i < handed.size(); i += numThreads) {
+        MemoryPool::release(handed[i]);
+      }
+      unsigned int seed = t + 1;
+      for (int round = 0; round < 500; ++round) {
+        int size = 1 + rand_r(&seed) % 70000;
+        MemBlock mb = MemoryPool::allocate(size);
+        memset(mb.data, t + 1, size);
+        std::this_thread::yield();
+        for (int i = 0; i < size; ++i) {
+          if (mb.data[i] != t + 1) {
+            ++bad;
+            break;
+          }
+        }
+        MemoryPool::release(mb);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ok = ok && bad == 0;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// The pool keeps no more than its limit, and lazy wiping clears what a
+// reused block holds past the new request.
+static bool testPoolLimits() {
+  cerr << "Memory pool limits:  ";
+
+  MemoryPool::Stats before = MemoryPool::stats();
+  MemoryPool::setMaxCachedBytes(64 * 1024);
+  std::vector<MemBlock> blocks;
+  for (int i = 0; i < 64; ++i) {
+    blocks.push_back(MemoryPool::allocate(4096));
+  }
+  for (const MemBlock &mb : blocks) {
+    MemoryPool::release(mb);
+  }
+  MemoryPool::Stats after = MemoryPool::stats();
+  bool ok = after.cachedBytes <= 64 * 1024 && after.trimmed > before.trimmed &&
+            after.liveBlocks == before.liveBlocks;
+
+  MemoryPool::setWipePolicy(MemoryPool::WipeLazily);
+  MemBlock mb = MemoryPool::allocate(1000);
+  memset(mb.data, 0x5a, 1000);
+  MemoryPool::release(mb);
+  before = MemoryPool::stats();
+  mb = MemoryPool::allocate(100);
+  ok = ok && MemoryPool::stats().hits == before.hits + 1;
+  for (int i = 100; i < 1000 && ok; ++i) {
+    ok = mb.data[i] == 0;
+  }
+  MemoryPool::release(mb);
+
+  MemoryPool::setWipePolicy(MemoryPool::WipeOnRelease);
+  MemoryPool::trim(0);
+  MemoryPool::setMaxCachedBytes(MemoryPool::DefaultMaxCachedBytes);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Blocks carved from the locked arena go back to it cleared.  Skipped
+// where the memlock limit does not allow a chunk to be locked.
+static bool testLockedArena() {
+  cerr << "Locked buffers:  ";
+
+  // nothing cached here, so the next allocation takes new memory
+  MemoryPool::trim(0);
+  MemoryPool::setLockedArena(4 * 1024 * 1024);
+  MemBlock mb = MemoryPool::allocate(64 * 1024);
+  if (MemoryPool::stats().lockedBytes == 0) {
+    MemoryPool::release(mb);
+    MemoryPool::setLockedArena(0);
+    cerr << "skipped\n";
+    return true;
+  }
+
+  bool ok = ((uintptr_t)mb.data % MemoryPool::Alignment) == 0;
+  memset(mb.data, 0x3c, 64 * 1024);
+  unsigned char *data = mb.data;
+  MemoryPool::release(mb);
+  MemoryPool::trim(0);
+
+  // freed blocks are kept by the arena, not unmapped
+  mb = MemoryPool::allocate(64 * 1024);
+  ok = ok && mb.data == data;
+  for (int i = 0; i < 64 * 1024 && ok; ++i) {
+    ok = mb.data[i] == 0;
+  }
+  MemoryPool::release(mb);
+  MemoryPool::trim(0);
+  MemoryPool::setLockedArena(0);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// PoolBlock hands its data on when moved and gives the block back once.
+static bool testPoolBlock() {
+  cerr << "Pool block handles:  ";
+
+  size_t live = MemoryPool::stats().liveBlocks;
+  bool ok = true;
+  {
+    PoolBlock small(PoolBlock::SmallSize);
+    memset(small.data(), 7, PoolBlock::SmallSize);
+    PoolBlock large(4096);
+    unsigned char *data = large.data();
+    ok = MemoryPool::stats().liveBlocks == live + 1;
+
+    PoolBlock movedSmall(std::move(small));
+    PoolBlock movedLarge;
+    movedLarge = std::move(large);
+    ok = ok && !small && !large && movedLarge.data() == data &&
+         movedSmall.data()[PoolBlock::SmallSize - 1] == 7 &&
+         MemoryPool::stats().liveBlocks == live + 1;
+
+    movedLarge.allocate(10);
+    ok = ok && MemoryPool::stats().liveBlocks == live;
+    movedLarge.allocate(10000);
+  }
+  ok = ok && MemoryPool::stats().liveBlocks == live;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// The path cache keeps to its bound and forgets a name and all below it.
+static bool testPathCache() {
+  cerr << "Path cache:  ";
+
+  PathCache cache(64);
+  cache.put("/a", "A", 1);
+  cache.put("/a/b", "A/B", 2);
+  cache.put("/a/b/c", "A/B/C", 3);
+  cache.put("/ab", "AB", 4);
+
+  std::string cipher;
+  uint64_t iv = 0;
+  bool ok = cache.get("/a/b", &cipher, &iv) && cipher == "A/B" && iv == 2;
+
+  cache.erase("/a/b");
+  ok = ok && !cache.get("/a/b", &cipher, &iv) &&
+       !cache.get("/a/b/c", &cipher, &iv) && cache.get("/a", &cipher, &iv) &&
+       cache.get("/ab", &cipher, &iv) && cipher == "AB";
+
+  cache.erase("/");
+  ok = ok && !cache.get("/a", &cipher, &iv) && !cache.get("/ab", &cipher, &iv);
+
+  PathCache small(16);
+  for (int i = 0; i < 100; ++i) {
+    small.put("/" + std::to_string(i), std::to_string(i), i);
+  }
+  int kept = 0;
+  for (int i = 0; i < 100; ++i) {
+    kept += small.get("/" + std::to_string(i), &cipher, &iv) ? 1 : 0;
+  }
+  ok = ok && kept > 0 && kept <= 16;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// The fused filename codecs give what the two step conversions give, and
+// decode back to the input, in place or not.
+static bool testNameCodecs() {
+  cerr << "Name codecs (" << base2KernelName() << "):  ";
+
+  bool ok = true;
+  unsigned int seed = 37;
+  for (int len = 0; len <= 200 && ok; ++len) {
+    std::vector<unsigned char> in(len);
+    for (auto &c : in) {
+      c = rand_r(&seed);
+    }
+    for (int pow2 : {6, 5}) {
+      int encLen = pow2 == 6 ? B256ToB64Bytes(len) : B256ToB32Bytes(len);
+      int decLen = pow2 == 6 ? B64ToB256Bytes(encLen) : B32ToB256Bytes(encLen);
+
+      std::vector<unsigned char> expect(in);
+      expect.resize(encLen + 1);
+      changeBase2Inline(expect.data(), len, 8, pow2, true);
+      if (pow2 == 6) {
+        B64ToAscii(expect.data(), encLen);
+      } else {
+        B32ToAscii(expect.data(), encLen);
+      }
+
+      std::vector<unsigned char> enc(encLen + 1);
+      std::vector<unsigned char> inPlace(in);
+      inPlace.resize(encLen + 1);
+      std::vector<unsigned char> dec(decLen + 1);
+      if (pow2 == 6) {
+        B256ToB64Ascii(enc.data(), in.data(), len);
+        B256ToB64Ascii(inPlace.data(), inPlace.data(), len);
+        B64AsciiToB256(dec.data(), enc.data(), encLen);
+      } else {
+        B256ToB32Ascii(enc.data(), in.data(), len);
+        B256ToB32Ascii(inPlace.data(), inPlace.data(), len);
+        B32AsciiToB256(dec.data(), enc.data(), encLen);
+      }
+      ok = ok && decLen == len &&
+           memcmp(enc.data(), expect.data(), encLen) == 0 &&
+           memcmp(inPlace.data(), expect.data(), encLen) == 0 &&
+           memcmp(dec.data(), in.data(), len) == 0;
+    }
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Coding a path into a buffer gives what the string form gives, and
+// leaves the IV alone when the buffer is too small.
+static bool testPathBuffers() {
+  cerr << "Path coding into buffers:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  std::shared_ptr<NameIO> codings[] = {
+      std::shared_ptr<NameIO>(
+          new StreamNameIO(StreamNameIO::CurrentInterface(), cipher, key)),
+      std::shared_ptr<NameIO>(
+          new BlockNameIO(BlockNameIO::CurrentInterface(), cipher, key,
+                          cipher->cipherBlockSize()))};
+  const char *path = "/some/rather/long/path name/to a file.txt";
+
+  bool ok = true;
+  for (auto &coding : codings) {
+    coding->setChainedNameIV(true);
+    uint64_t iv = 0, bufIV = 0;
+    string encoded = coding->encodePath(path, &iv);
+    char buf[1024];
+    int len = coding->encodePath(path, buf, sizeof(buf), &bufIV);
+    ok = ok && len == (int)encoded.size() && encoded == buf && iv == bufIV;
+
+    uint64_t smallIV = 7;
+    ok = ok && coding->encodePath(path, buf, len, &smallIV) == -1 &&
+         smallIV == 7;
+
+    char plain[1024];
+    iv = 0;
+    len = coding->decodePath(encoded.c_str(), plain, sizeof(plain), &iv);
+    ok = ok && len == (int)strlen(path) && strcmp(plain, path) == 0 &&
+         iv == bufIV;
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Missing names are remembered until they expire or their directory
+// changes, and a lookup racing a create records nothing.
+static bool testNegativeCache() {
+  cerr << "Negative lookups:  ";
+
+  NegativeCache cache(100, 100);
+  uint64_t gen = 0;
+  bool ok = !cache.missing("/d/x", &gen);
+  cache.add("/d/x", gen);
+  ok = ok && cache.missing("/d/x", &gen) && !cache.missing("/d/y", &gen);
+
+  // a name created in /d between the lookup and add
+  cache.invalidateDir("/d");
+  cache.add("/d/y", gen);
+  ok = ok && !cache.missing("/d/x", &gen) && !cache.missing("/d/y", &gen);
+
+  ok = ok && !cache.missing("/d/e/z", &gen);
+  cache.add("/d/e/z", gen);
+  ok = ok && cache.missing("/d/e/z", &gen);
+  cache.eraseBelow("/d");
+  ok = ok && !cache.missing("/d/e/z", &gen);
+
+  ok = ok && !cache.missing("/old", &gen);
+  cache.add("/old", gen);
+  ok = ok && cache.missing("/old", &gen);
+  usleep(200 * 1000);
+  ok = ok && !cache.missing("/old", &gen);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Link targets are found for the link they were recorded for, and not
+// once the link looks changed.
+static bool testLinkCache() {
+  cerr << "Link target cache:  ";
+  string dir = makeTestDir();
+  if (dir.empty()) {
+    cerr << "FAILED\n";
+    return false;
+  }
+
+  struct stat st[3];
+  bool ok = true;
+  for (int i = 0; i < 3; ++i) {
+    string link = dir + "link" + std::to_string(i);
+    ok = ok && symlink("target", link.c_str()) == 0 &&
+         lstat(link.c_str(), &st[i]) == 0;
+  }
+
+  LinkCache cache(2);
+  string target;
+  if (ok) {
+    cache.put(st[0], "zero");
+    ok = cache.get(st[0], &target) && target == "zero" &&
+         !cache.get(st[1], &target);
+
+    struct stat changed = st[0];
+    changed.st_size += 1;
+    ok = ok && !cache.get(changed, &target) && !cache.get(st[0], &target);
+
+    // the least recently used goes first
+    cache.put(st[0], "zero");
+    cache.put(st[1], "one");
+    ok = ok && cache.get(st[0], &target);
+    cache.put(st[2], "two");
+    ok = ok && cache.get(st[0], &target) && !cache.get(st[1], &target) &&
+         cache.get(st[2], &target) && target == "two";
+  }
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Argon2id keys depend on the password and every parameter, passes can
+// be tuned to a duration, and the config keeps the parameters.
+static bool testArgon2() {
+  cerr << "Argon2id keys:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher || !cipher->hasArgon2()) {
+    cerr << "skipped\n";
+    return true;
+  }
+
+  const unsigned char salt[16] = {1, 2, 3, 4, 5, 6, 7, 8,
+                                  9, 10, 11, 12, 13, 14, 15, 16};
+  const int memoryKiB = 8 * 1024;
+  int passes = 2;
+  CipherKey key = cipher->newArgon2Key("password", 8, passes, memoryKiB, 2, 0,
+                                       salt, sizeof(salt));
+  CipherKey same = cipher->newArgon2Key("password", 8, passes, memoryKiB, 2,
+                                        0, salt, sizeof(salt));
+  CipherKey otherPassword = cipher->newArgon2Key(
+      "passwore", 8, passes, memoryKiB, 2, 0, salt, sizeof(salt));
+  CipherKey otherLanes = cipher->newArgon2Key("password", 8, passes, memoryKiB,
+                                              4, 0, salt, sizeof(salt));
+  CipherKey otherMemory = cipher->newArgon2Key(
+      "password", 8, passes, memoryKiB * 2, 2, 0, salt, sizeof(salt));
+  bool ok = key && same && otherPassword && otherLanes && otherMemory &&
+            passes == 2 && cipher->compareKey(key, same) &&
+            !cipher->compareKey(key, otherPassword) &&
+            !cipher->compareKey(key, otherLanes) &&
+            !cipher->compareKey(key, otherMemory);
+
+  // passes == 0 asks for them to be chosen, and reported
+  int tuned = 0;
+  CipherKey timed = cipher->newArgon2Key("password", 8, tuned, memoryKiB, 2,
+                                         100, salt, sizeof(salt));
+  CipherKey again = cipher->newArgon2Key("password", 8, tuned, memoryKiB, 2,
+                                         100, salt, sizeof(salt));
+  ok = ok && timed && tuned > 0 && again && cipher->compareKey(timed, again);
+
+  string dir = makeTestDir();
+  ok = ok && !dir.empty();
+  if (!dir.empty()) {
+    EncFSConfig config;
+    config.cipherIface = cipher->interface();
+    config.kdfAlgorithm = KDF_Argon2id;
+    config.kdfIterations = passes;
+    config.kdfMemoryKiB = memoryKiB;
+    config.kdfLanes = 2;
+    EncFSConfig read;
+    string path = dir + "config";
+    ok = ok && writeV6Config(path.c_str(), &config) &&
+         readV6Config(path.c_str(), &read, nullptr) &&
+         read.kdfAlgorithm == KDF_Argon2id && read.kdfIterations == passes &&
+         read.kdfMemoryKiB == memoryKiB && read.kdfLanes == 2;
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// MemFileIO keeps holes free, shares contents with its reopened files and
+// carries a cipher stack as a disk file does.
+static bool testMemFile() {
+  cerr << "Memory backed files:  ";
+  const int page = MemFileIO::PageSize;
+  std::vector<unsigned char> data(page), got(page);
+  for (int i = 0; i < page; ++i) {
+    data[i] = (unsigned char)(i * 7 + 1);
+  }
+
+  auto mem = std::make_shared<MemFileIO>("mem");
+  bool ok = mem->open(O_RDWR) >= 0 && writeAt(*mem, 0, data.data(), page) &&
+            writeAt(*mem, 10 * page, data.data(), page) &&
+            mem->getSize() == 11 * page && mem->residentBytes() == 2 * page &&
+            mem->isHole(page, 9 * page) && !mem->isHole(0, page) &&
+            readAt(*mem, 5 * page, got.data(), page) &&
+            std::all_of(got.begin(), got.end(),
+                        [](unsigned char c) { return c == 0; });
+
+  std::shared_ptr<MemFileIO> other = mem->reopen();
+  ok = ok && other->open(O_RDONLY) >= 0 &&
+       readAt(*other, 10 * page, got.data(), page) && got == data &&
+       !writeAt(*other, 0, data.data(), page);
+
+  ok = ok &&
+       mem->allocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, page) ==
+           0 &&
+       mem->residentBytes() == page && mem->getSize() == 11 * page &&
+       mem->truncate(page) == 0 && mem->residentBytes() == 0 &&
+       other->getSize() == page;
+
+  // a cipher stack over memory reads back what it wrote
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (cipher) {
+    CipherKey key = cipher->newRandomKey();
+    FSConfigPtr cfg = blockConfig(cipher, key, FSBlockSize);
+    CipherFileIO io(std::make_shared<MemFileIO>("cipher"), cfg);
+    const size_t size = 3 * FSBlockSize + 100;
+    std::vector<unsigned char> plain(size), back(size);
+    cipher->randomize(plain.data(), (int)size, false);
+    ok = ok && io.open(O_RDWR) >= 0 && writeAt(io, 0, plain.data(), size) &&
+         readAt(io, 0, back.data(), size) && back == plain;
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Divider gives what the divide and modulo operators give, for powers of
+// two and the block sizes MAC headers leave.
+static bool testDivider() {
+  cerr << "Offset division:  ";
+  const uint64_t divisors[] = {1, 2, 1016, 1024, 4088, 4096, 65528, 1 << 20};
+  const uint64_t edges[] = {0, 1, ~uint64_t(0), ~uint64_t(0) >> 1,
+                            (uint64_t)1 << 40};
+
+  bool ok = true;
+  unsigned int seed = 77;
+  for (uint64_t d : divisors) {
+    Divider div(d);
+    std::vector<uint64_t> values(edges, edges + 5);
+    for (uint64_t k = 0; k < 4; ++k) {
+      values.push_back(d * 1000 + k - 1);
+    }
+    for (int i = 0; i < 10000; ++i) {
+      values.push_back(((uint64_t)rand_r(&seed) << 31) ^ rand_r(&seed));
+    }
+    for (uint64_t n : values) {
+      uint64_t rem = 0;
+      ok = ok && div.div(n, &rem) == n / d && rem == n % d &&
+           div.mod(n) == n % d;
+      if (n < ~uint64_t(0) - d) {
+        ok = ok && div.divUp(n) == (n + d - 1) / d;
+      }
+    }
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// A new file's header is kept back until the first write, truncate or
+// allocation, and the file reads back the same afterwards.
+static bool testPendingHeader() {
+  cerr << "Deferred file headers:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->uniqueIV = true;
+  const off_t header = sizeof(uint64_t);
+
+  std::vector<unsigned char> data(3000), got(3000);
+  cipher->randomize(data.data(), (int)data.size(), false);
+  bool ok = true;
+
+  // written with the first block, from the start, later on, or by truncate
+  const off_t offsets[] = {0, 5000, -1};
+  for (off_t offset : offsets) {
+    auto mem = std::make_shared<MemFileIO>("header");
+    {
+      CipherFileIO io(mem, cfg);
+      ok = ok && io.open(O_RDWR) >= 0 && mem->getSize() == 0;
+      if (offset >= 0) {
+        ok = ok && writeAt(io, offset, data.data(), data.size());
+      } else {
+        ok = ok && io.truncate(data.size()) == 0;
+      }
+    }
+    off_t size = offset >= 0 ? offset + (off_t)data.size() : data.size();
+    ok = ok && mem->getSize() == size + header;
+
+    CipherFileIO io(mem->reopen(), cfg);
+    ok = ok && io.open(O_RDONLY) >= 0 && io.getSize() == size &&
+         readAt(io, size - data.size(), got.data(), got.size());
+    if (offset >= 0) {
+      ok = ok && got == data;
+    } else {
+      ok = ok && std::all_of(got.begin(), got.end(),
+                             [](unsigned char c) { return c == 0; });
+    }
+  }
+
+  // a file closed empty has no header, and can be opened again
+  auto mem = std::make_shared<MemFileIO>("empty");
+  {
+    CipherFileIO io(mem, cfg);
+    ok = ok && io.open(O_RDWR) >= 0;
+  }
+  CipherFileIO io(mem->reopen(), cfg);
+  ok = ok && mem->getSize() == 0 && io.open(O_RDWR) >= 0 &&
+       writeAt(io, 0, data.data(), 100) && readAt(io, 0, got.data(), 100) &&
+       memcmp(got.data(), data.data(), 100) == 0;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Attributes are answered until they expire or the path is erased, and a
+// lookup racing a change records nothing.
+static bool testAttrCache() {
+  cerr << "Attribute cache:  ";
+
+  AttrCache cache(100, 100);
+  struct stat st, got;
+  memset(&st, 0, sizeof(st));
+  st.st_size = 1234;
+  uint64_t gen = 0;
+  bool ok = !cache.get("/a", &got, &gen);
+  cache.add("/a", st, gen);
+  ok = ok && cache.get("/a", &got, &gen) && got.st_size == 1234;
+
+  // changed between the lookup and add
+  ok = ok && !cache.get("/b", &got, &gen);
+  cache.erase("/b");
+  cache.add("/b", st, gen);
+  ok = ok && !cache.get("/b", &got, &gen);
+
+  cache.erase("/a");
+  ok = ok && !cache.get("/a", &got, &gen);
+
+  ok = ok && !cache.get("/d/e", &got, &gen);
+  cache.add("/d/e", st, gen);
+  ok = ok && !cache.get("/de", &got, &gen);
+  cache.add("/de", st, gen);
+  cache.eraseBelow("/d");
+  ok = ok && !cache.get("/d/e", &got, &gen) && cache.get("/de", &got, &gen);
+
+  usleep(200 * 1000);
+  ok = ok && !cache.get("/de", &got, &gen);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Cached attribute values answer as getxattr would for every buffer size,
+// missing names are remembered, and errors and large values are not.
+static bool testXattrCache() {
+  cerr << "Extended attribute cache:  ";
+
+  XattrCache cache(100, 10000);
+  char buf[16];
+  int res = 0;
+  uint64_t gen = 0;
+  bool ok = !cache.get("/f", "user.a", buf, sizeof(buf), &res, &gen);
+  cache.add("/f", "user.a", "hello", 5, gen);
+  ok = ok && cache.get("/f", "user.a", buf, 0, &res, &gen) && res == 5 &&
+       cache.get("/f", "user.a", buf, 2, &res, &gen) && res == -ERANGE &&
+       cache.get("/f", "user.a", buf, sizeof(buf), &res, &gen) && res == 5 &&
+       memcmp(buf, "hello", 5) == 0;
+
+  ok = ok && !cache.get("/f", "user.none", buf, sizeof(buf), &res, &gen);
+  cache.add("/f", "user.none", nullptr, -ENODATA, gen);
+  ok = ok && cache.get("/f", "user.none", buf, sizeof(buf), &res, &gen) &&
+       res == -ENODATA;
+
+  ok = ok && !cache.get("/f", "user.io", buf, sizeof(buf), &res, &gen);
+  cache.add("/f", "user.io", nullptr, -EIO, gen);
+  std::string big(XattrCache::MaxValue + 1, 'x');
+  cache.add("/f", "user.big", big.data(), (int)big.size(), gen);
+  ok = ok && !cache.get("/f", "user.io", buf, sizeof(buf), &res, &gen) &&
+       !cache.get("/f", "user.big", buf, sizeof(buf), &res, &gen);
+
+  const char list[] = "user.a\0user.b";
+  ok = ok && !cache.getList("/f", buf, sizeof(buf), &res, &gen);
+  cache.addList("/f", list, sizeof(list), gen);
+  ok = ok && cache.getList("/f", buf, sizeof(buf), &res, &gen) &&
+       res == (int)sizeof(list) && memcmp(buf, list, sizeof(list)) == 0;
+
+  // a change while looking, and a change afterwards
+  ok = ok && !cache.get("/g", "user.a", buf, sizeof(buf), &res, &gen);
+  cache.erase("/g");
+  cache.add("/g", "user.a", "x", 1, gen);
+  cache.erase("/f");
+  ok = ok && !cache.get("/g", "user.a", buf, sizeof(buf), &res, &gen) &&
+       !cache.get("/f", "user.a", buf, sizeof(buf), &res, &gen) &&
+       !cache.getList("/f", buf, sizeof(buf), &res, &gen);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// compressed files round trip through writes over chunks and truncation
+static bool testCompression() {
+  cerr << "compressed files:  ";
+  int algorithm = CompressedFileIO::supported(Compression_LZ4)
+                      ? Compression_LZ4
+                      : Compression_Zstd;
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher || !CompressedFileIO::supported(algorithm)) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->compression = algorithm;
+  cfg->config->compressionChunk = 16 * 1024;
+  std::shared_ptr<FileIO> cipherIO(
+      new CipherFileIO(std::make_shared<MemFileIO>("zip"), cfg));
+  std::shared_ptr<FileIO> io(new CompressedFileIO(cipherIO, cfg));
+
+  // text that compresses, with a run that does not in the middle
+  const size_t size = 100000;
+  std::vector<unsigned char> data(size), got(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = (unsigned char)("encrypted filesystem "[i % 21]);
+  }
+  cipher->randomize(&data[30000], 5000, false);
+
+  bool ok = io->open(O_RDWR) >= 0 && writeAt(*io, 0, data.data(), size) &&
+            io->getSize() == (off_t)size && cipherIO->getSize() < 50000 &&
+            readAt(*io, 0, got.data(), size) && got == data;
+  // a write into a chunk in the middle
+  memset(&data[40000], 'x', 3000);
+  ok = ok && writeAt(*io, 40000, &data[40000], 3000) &&
+       readAt(*io, 0, got.data(), size) && got == data;
+  ok = ok && io->truncate(50000) == 0 && io->getSize() == 50000 &&
+       readAt(*io, 0, got.data(), 50000) &&
+       memcmp(got.data(), data.data(), 50000) == 0;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// packed files round trip, and what is left of them survives a reopen
+static bool testPacking() {
+  cerr << "packed files:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  string dir = makeTestDir();
+  if (dir.empty()) {
+    cerr << "FAILED (no directory)\n";
+    return false;
+  }
+  CipherKey key = cipher->newRandomKey();
+  const size_t fileBytes = 4096;
+  const int files = 20;
+  std::vector<unsigned char> data(fileBytes), got(fileBytes);
+  std::vector<uint64_t> ids;
+  bool ok;
+  {
+    PackStore store(dir, cipher, key, fileBytes);
+    ok = store.open();
+
+    unsigned char holder[PackStore::PlaceholderSize];
+    uint64_t id = 0;
+    store.placeholder(1234, holder);
+    ok = ok && store.parsePlaceholder(holder, &id) && id == 1234;
+    holder[9] ^= 1;
+    ok = ok && !store.parsePlaceholder(holder, &id);
+
+    for (int i = 0; ok && i < files; ++i) {
+      memset(data.data(), i, fileBytes - i);
+      ids.push_back(store.newId());
+      ok = ids.back() != 0 &&
+           store.put(ids.back(), data.data(), fileBytes - i) == 0 &&
+           store.size(ids.back()) == (off_t)(fileBytes - i);
+    }
+    // every other file goes
+    for (int i = 1; ok && i < files; i += 2) {
+      ok = store.erase(ids[i]) == 0 && store.size(ids[i]) == -1;
+    }
+    ok = ok && store.sync() == 0;
+  }
+  {
+    PackStore store(dir, cipher, key, fileBytes);
+    ok = ok && store.open();
+    for (int i = 0; ok && i < files; ++i) {
+      if (i % 2 != 0) {
+        ok = store.size(ids[i]) == -1;
+        continue;
+      }
+      size_t len = fileBytes - i;
+      memset(data.data(), i, len);
+      ok = store.size(ids[i]) == (off_t)len &&
+           store.read(ids[i], 0, got.data(), fileBytes) == (ssize_t)len &&
+           memcmp(got.data(), data.data(), len) == 0;
+    }
+  }
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Hot files are copied once they qualify, serve reads while unchanged,
+// and are dropped on any change.  Skipped where the memlock limit does not
+// allow a copy to be locked.
+static bool testHotFiles() {
+  cerr << "Hot file copies:  ";
+  HotFileCache cache(1024 * 1024, {"/pinned"}, 2);
+
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFREG | 0644;
+  st.st_dev = 1;
+  st.st_ino = 10;
+  st.st_size = 5000;
+  std::vector<unsigned char> data(st.st_size), got(st.st_size);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (unsigned char)(i * 13);
+  }
+
+  std::shared_ptr<HotFileCache::Copy> copy = cache.startCopy("/pinned/a", st);
+  if (!copy) {
+    cerr << "skipped\n";
+    return true;
+  }
+  // one copy at a time
+  bool ok = !cache.startCopy("/pinned/a", st) && copy->size() == data.size();
+  memcpy(copy->data(), data.data(), data.size());
+  cache.add(copy);
+  ok = ok && cache.read(st, 0, got.data(), got.size()) == st.st_size &&
+       got == data && cache.read(st, 4000, got.data(), got.size()) == 1000 &&
+       memcmp(got.data(), &data[4000], 1000) == 0;
+
+  // changed behind our back, or through the filesystem
+  struct stat changed = st;
+  changed.st_mtim.tv_sec += 1;
+  ok = ok && cache.read(changed, 0, got.data(), got.size()) == -1 &&
+       cache.read(st, 0, got.data(), got.size()) == -1;
+
+  // hot after two opens
+  struct stat other = st;
+  other.st_ino = 11;
+  ok = ok && !cache.startCopy("/b", other);
+  cache.opened(other);
+  cache.opened(other);
+  copy = cache.startCopy("/b", other);
+  ok = ok && copy;
+  if (copy) {
+    // a change while copying keeps the copy out
+    cache.erase(other.st_dev, other.st_ino);
+    cache.add(copy);
+    ok = ok && cache.read(other, 0, got.data(), got.size()) == -1;
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// With skipUnchanged, rewriting blocks with what the cache holds for them
+// writes nothing, and a run with one changed block writes only that one.
+static bool testSkipUnchanged() {
+  cerr << "unchanged block rewrites:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, FSBlockSize);
+  cfg->opts->skipUnchanged = true;
+  cfg->blockCache = std::make_shared<BlockCache>(64 * FSBlockSize, 1);
+  auto gated = std::make_shared<GatedFileIO>(std::make_shared<MemFileIO>("s"));
+  CipherFileIO io(gated, cfg);
+  int bs = io.blockSize();
+
+  const size_t size = 8 * bs;
+  std::vector<unsigned char> data(size), got(size);
+  cipher->randomize(data.data(), (int)size, false);
+  bool ok = io.open(O_RDWR) >= 0 && writeAt(io, 0, data.data(), size) &&
+            readAt(io, 0, got.data(), size) && got == data;
+
+  int writes = gated->writes;
+  ok = ok && writeAt(io, 0, data.data(), size) && gated->writes == writes &&
+       writeAt(io, 2 * bs, &data[2 * bs], bs) && gated->writes == writes;
+
+  data[3 * bs + 10] ^= 1;
+  ok = ok && writeAt(io, 0, data.data(), size) &&
+       gated->writes == writes + 1 && readAt(io, 0, got.data(), size) &&
+       got == data;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// new volumes record the oldest version that codes them as they are coded
+static bool testVolumeInterface() {
+  cerr << "volume interface versions:  ";
+  struct {
+    const char *name;
+    int classic;  // blocks up to MaxClassicBlockSize, no newer formats
+    int large;
+    int newer;
+  } ciphers[] = {{"AES", 5, 5, 5}, {"AES-GCM", 1, 2, 2}, {"Null", 1, 2, 2}};
+  bool ok = true;
+  for (const auto &c : ciphers) {
+    std::shared_ptr<Cipher> cipher = Cipher::New(c.name);
+    if (!cipher) {
+      continue;
+    }
+    Interface classic = cipher->volumeInterface(4096, false);
+    Interface large = cipher->volumeInterface(65536, false);
+    Interface newer = cipher->volumeInterface(4096, true);
+    ok = ok && classic.current() == c.classic &&
+         large.current() == c.large && newer.current() == c.newer &&
+         cipher->volumeInterface(65536, true).current() == c.newer &&
+         Cipher::New(classic) && Cipher::New(large) && Cipher::New(newer);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// A free worker takes the most urgent lane first, and a LaneScope lowers
+// the lane of what its thread submits.
+static bool testPoolLanes() {
+  cerr << "thread pool lanes:  ";
+  ThreadPool pool(1);
+  std::atomic<bool> started(false), released(false);
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<ThreadPool::Lane> order;
+  auto record = [&](ThreadPool::Lane lane) {
+    return [&mutex, &order, lane]() {
+      Lock lock(mutex);
+      order.push_back(lane);
+    };
+  };
+
+  // the only worker is busy while the others queue up
+  pool.submit(
+      [&]() {
+        started = true;
+        while (!released) {
+          usleep(1000);
+        }
+      },
+      ThreadPool::Write);
+  bool ok = waitFor([&]() { return started.load(); });
+  pool.submit(record(ThreadPool::Background), ThreadPool::Background);
+  pool.submit(record(ThreadPool::Write), ThreadPool::Write);
+  pool.submit(record(ThreadPool::Demand));
+  released = true;
+  ok = ok && waitFor([&]() {
+         Lock lock(mutex);
+         return order.size() == 3;
+       });
+  {
+    Lock lock(mutex);
+    ok = ok && order[0] == ThreadPool::Demand &&
+         order[1] == ThreadPool::Write && order[2] == ThreadPool::Background;
+  }
+  ok = ok && pool.laneStats(ThreadPool::Demand).jobs == 1 &&
+       pool.laneStats(ThreadPool::Write).jobs == 2 &&
+       pool.laneStats(ThreadPool::Background).jobs == 1;
+
+  {
+    ThreadPool::LaneScope scope(ThreadPool::Background);
+    ok = ok &&
+         ThreadPool::laneFor(ThreadPool::Demand) == ThreadPool::Background;
+  }
+  ok = ok && ThreadPool::laneFor(ThreadPool::Demand) == ThreadPool::Demand;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Interned paths share their parents' entries, compare by address and
+// free what only they used.
+static bool testPathNames() {
+  cerr << "interned paths:  ";
+  size_t before = PathName::entries();
+  bool ok;
+  {
+    PathName a("/dir/sub/file");
+    size_t withA = PathName::entries();
+    PathName b(std::string("/dir/sub/other"));
+    PathName same("/dir/sub/file");
+    ok = withA > before && PathName::entries() == withA + 1 && a == same &&
+         a != b && a.hash() == same.hash() && a.str() == "/dir/sub/file" &&
+         a.length() == strlen("/dir/sub/file") && b.str() == "/dir/sub/other";
+
+    // find() sees parents, and never adds
+    ok = ok && !PathName::find("/dir/sub").empty() &&
+         PathName::find("/dir/none").empty() &&
+         PathName::entries() == withA + 1;
+
+    PathName moved(std::move(b));
+    ok = ok && b.empty() && moved.str() == "/dir/sub/other";
+    moved = PathName();
+    ok = ok && PathName::entries() == withA;
+  }
+  ok = ok && PathName::entries() == before;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Truncates that code no block leave the file header unread, and shrinking
+// a MAC file to a partial block codes that block once.
+static bool testTruncateCoding() {
+  cerr << "truncate coding:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->uniqueIV = true;
+  auto mem = std::make_shared<MemFileIO>("trunc");
+  const size_t size = 5 * 1024;
+  std::vector<unsigned char> data(size), got(size);
+  cipher->randomize(data.data(), (int)size, false);
+  bool ok;
+  {
+    CipherFileIO io(mem, cfg);
+    ok = io.open(O_RDWR) >= 0 && writeAt(io, 0, data.data(), size);
+  }
+  {
+    auto gated = std::make_shared<GatedFileIO>(mem->reopen());
+    CipherFileIO io(gated, cfg);
+    int bs = io.blockSize();
+    ok = ok && io.open(O_RDWR) >= 0 && io.truncate(3 * bs) == 0 &&
+         io.truncate(3 * bs) == 0 && gated->reads == 0 &&
+         io.getSize() == 3 * bs && readAt(io, 0, got.data(), 3 * bs) &&
+         memcmp(got.data(), data.data(), 3 * bs) == 0;
+  }
+
+  // a MAC stack over a file of whole blocks, cut into its third block
+  cfg->config->blockMACBytes = 8;
+  auto gated = std::make_shared<GatedFileIO>(std::make_shared<MemFileIO>("m"));
+  std::shared_ptr<FileIO> cipherIO(new CipherFileIO(gated, cfg));
+  MACFileIO io(cipherIO, cfg);
+  int bs = io.blockSize();
+  ok = ok && io.open(O_RDWR) >= 0 && writeAt(io, 0, data.data(), 4 * bs);
+  int writes = gated->writes;
+  off_t cut = 2 * bs + 100;
+  ok = ok && io.truncate(cut) == 0 && gated->writes == writes + 1 &&
+       io.getSize() == cut && readAt(io, 0, got.data(), cut) &&
+       memcmp(got.data(), data.data(), cut) == 0;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// Many entries survive deletions from the middle of their index chains,
+// blocks of mixed sizes share pages, and pages go once they are empty.
+static bool testBlockCacheTables() {
+  cerr << "block cache tables:  ";
+  BlockCache cache(1 << 20, 2);
+  uint64_t owner = BlockCache::newOwner();
+  unsigned char block[FSBlockSize];
+  unsigned char out[FSBlockSize];
+  const int count = 1000;
+  for (int i = 0; i < count; ++i) {
+    memset(block, i & 0xff, sizeof(block));
+    cache.put(owner, i, block, 1 + i % FSBlockSize);
+  }
+  bool ok = cache.bytesUsed() > 0 && cache.bytesUsed() <= (1 << 20);
+
+  for (int i = 1; i < count; i += 2) {
+    cache.erase(owner, i);
+  }
+  cache.eraseRange(owner, 100, 110);
+  for (int i = 0; ok && i < count; ++i) {
+    bool kept = i % 2 == 0 && (i < 100 || i >= 110);
+    ssize_t len = cache.get(owner, i, out, sizeof(out));
+    if (kept) {
+      ok = len == 1 + i % FSBlockSize && out[0] == (i & 0xff) &&
+           out[len - 1] == (i & 0xff);
+    } else {
+      ok = len == -1;
+    }
+  }
+
+  cache.eraseFrom(owner, 0);
+  ok = ok && cache.bytesUsed() == 0 && !cache.contains(owner, 0);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// writes through the journal are seen at once and reach the backing file
+// at a checkpoint, and a journal left by a crash is replayed by the next
+// open, or recovered by a mount that does not journal
+static bool testWriteJournal() {
+  cerr << "write journal:  ";
+  string dir = makeTestDir();
+  if (dir.empty()) {
+    cerr << "FAILED (no directory)\n";
     return false;
-  } else {
+  }
+  string path = dir + "file";
+  string journalPath = dir + WriteJournal::FileName;
+  std::vector<unsigned char> before(8192, 'a'), after(8192, 'a');
+  std::vector<unsigned char> got(after.size());
+  memset(&after[100], 'b', 500);
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  bool ok = fd >= 0 && ::pwrite(fd, before.data(), before.size(), 0) ==
+                           (ssize_t)before.size();
+  std::vector<unsigned char> journal;
+  {
+    auto wj = std::make_shared<WriteJournal>(dir);
+    ok = ok && wj->open();
+    JournalFileIO io(std::make_shared<RawFileIO>(path), wj);
+    ok = ok && io.open(O_RDWR) >= 0 && writeAt(io, 100, &after[100], 500) &&
+         readAt(io, 0, got.data(), got.size()) && got == after &&
+         io.getSize() == (off_t)after.size() && wj->commit() == 0 &&
+         ::pread(fd, got.data(), got.size(), 0) == (ssize_t)got.size() &&
+         got == before;
+
+    // the journal as a crash would leave it, before the checkpoint
+    struct stat jst;
+    ok = ok && ::stat(journalPath.c_str(), &jst) == 0 && jst.st_size > 0;
+    if (ok) {
+      journal.resize(jst.st_size);
+      int jfd = ::open(journalPath.c_str(), O_RDONLY | O_CLOEXEC);
+      ok = jfd >= 0 && ::pread(jfd, journal.data(), journal.size(), 0) ==
+                           (ssize_t)journal.size();
+      if (jfd >= 0) {
+        ::close(jfd);
+      }
+    }
+    ok = ok && wj->checkpoint() == 0 &&
+         ::pread(fd, got.data(), got.size(), 0) == (ssize_t)got.size() &&
+         got == after && ::stat(journalPath.c_str(), &jst) == 0 &&
+         jst.st_size == 0;
+  }
+
+  // undo the checkpoint, and put the journal back
+  auto crash = [&]() {
+    bool undone = ::pwrite(fd, before.data(), before.size(), 0) ==
+                  (ssize_t)before.size();
+    int jfd =
+        ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    undone = undone && jfd >= 0 &&
+             ::pwrite(jfd, journal.data(), journal.size(), 0) ==
+                 (ssize_t)journal.size();
+    if (jfd >= 0) {
+      ::close(jfd);
+    }
+    return undone;
+  };
+  ok = ok && crash();
+  {
+    WriteJournal wj(dir);
+    ok = ok && wj.open() &&
+         ::pread(fd, got.data(), got.size(), 0) == (ssize_t)got.size() &&
+         got == after;
+  }
+
+  // a mount without the journal replays it too, and removes it
+  struct stat jst;
+  ok = ok && crash() && WriteJournal::recover(dir) == 0 &&
+       ::pread(fd, got.data(), got.size(), 0) == (ssize_t)got.size() &&
+       got == after && ::stat(journalPath.c_str(), &jst) != 0;
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// batched MACs are those of FastMAC_64 one buffer at a time, and a large
+// MAC read fails on one bad block in its batch
+static bool testMACBatch() {
+  cerr << "batched MACs:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+  const int maxCount = 11;
+  std::vector<unsigned char> data(maxCount * 4096);
+  cipher->randomize(data.data(), (int)data.size(), false);
+  Cipher::MACRequest blocks[maxCount];
+  for (int i = 0; i < maxCount; ++i) {
+    blocks[i].data = &data[i * 4096];
+    // one short block in the middle of the batch
+    blocks[i].len = i == 6 ? 100 : 4096;
+    blocks[i].nonce = 1000 + i;
+  }
+  bool ok = true;
+  for (int count = 0; count <= maxCount; ++count) {
+    uint64_t macs[maxCount];
+    cipher->FastMACBatch(blocks, count, macs, key);
+    for (int i = 0; i < count; ++i) {
+      ok = ok && macs[i] == cipher->FastMAC_64(blocks[i].data, blocks[i].len,
+                                               blocks[i].nonce, key);
+    }
+  }
+
+  FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+  cfg->config->blockMACBytes = 8;
+  cfg->config->blockMACAlgorithm = BlockMAC_SipHash;
+  auto mem = std::make_shared<MemFileIO>("macs");
+  std::shared_ptr<FileIO> cipherIO(new CipherFileIO(mem, cfg));
+  MACFileIO io(cipherIO, cfg);
+  int bs = io.blockSize();
+  const size_t size = 32 * bs;
+  std::vector<unsigned char> plain(size), got(size);
+  cipher->randomize(plain.data(), (int)size, false);
+  ok = ok && io.open(O_RDWR) >= 0 && writeAt(io, 0, plain.data(), size) &&
+       readAt(io, 0, got.data(), size) && got == plain;
+
+  // flip a byte of block 20 below the MAC layer
+  unsigned char byte;
+  IORequest req;
+  req.offset = 20 * 1024 + 500;
+  req.data = &byte;
+  req.dataLen = 1;
+  ok = ok && mem->read(req) == 1;
+  byte ^= 0x10;
+  ok = ok && mem->write(req) == 1;
+  req.offset = 0;
+  req.data = got.data();
+  req.dataLen = size;
+  ok = ok && io.read(req) < 0 && readAt(io, 0, got.data(), 20 * bs) &&
+       memcmp(got.data(), plain.data(), 20 * bs) == 0;
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// names that do not decode are reported with an error code instead of an
+// exception, and a short buffer with -ENAMETOOLONG
+static bool testForeignNames() {
+  cerr << "Foreign names:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  std::shared_ptr<NameIO> codings[] = {
+      std::shared_ptr<NameIO>(
+          new StreamNameIO(StreamNameIO::CurrentInterface(), cipher, key)),
+      std::shared_ptr<NameIO>(
+          new BlockNameIO(BlockNameIO::CurrentInterface(), cipher, key,
+                          cipher->cipherBlockSize()))};
+
+  bool ok = true;
+  for (auto &coding : codings) {
+    uint64_t iv = 0;
+    string encoded = coding->encodePath("a file.txt", &iv);
+    string altered = encoded;
+    char &c = altered[altered.size() / 2];
+    c = c == 'A' ? 'B' : 'A';
+    const char *foreign[] = {"a", "foreign.txt", "AbCdEfGhIjKlMnOpQrSt",
+                             altered.c_str()};
     try {
-      if (runTests(cipher, verbose)) {
-        cerr << "OK\n";
-      } else {
-        cerr << "FAILED\n";
+      for (const char *name : foreign) {
+        string plain;
+        iv = 0;
+        ok = ok && coding->tryDecodePath(name, &plain, &iv) == -EINVAL;
+      }
+      string plain;
+      iv = 0;
+      ok = ok && coding->tryDecodePath(encoded.c_str(), &plain, &iv) == 0 &&
+           plain == "a file.txt";
+      char buf[4];
+      iv = 0;
+      ok = ok && coding->tryDecodePath(encoded.c_str(), buf, sizeof(buf),
+                                       &iv) == -ENAMETOOLONG;
+    } catch (encfs::Error &err) {
+      ok = false;
+    }
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// the binary copy of a config reads back as the config, and is ignored
+// once the config changes or the copy is damaged
+static bool testConfigSidecar() {
+  cerr << "Config binary copy:  ";
+  string dir = makeTestDir();
+  bool ok = !dir.empty();
+  if (ok) {
+    EncFSConfig config;
+    config.cipherIface = Interface("ssl/aes", 3, 0, 2);
+    config.keySize = 256;
+    config.blockSize = 4096;
+    config.blockMACBytes = 8;
+    unsigned char keyBuf[44];
+    for (int i = 0; i < (int)sizeof(keyBuf); ++i) {
+      keyBuf[i] = (unsigned char)i;
+    }
+    config.assignKeyData(keyBuf, sizeof(keyBuf));
+    config.salt.assign(20, 0x5a);
+
+    string path = dir + "config";
+    string copy = path + ConfigSidecar::Suffix;
+    EncFSConfig read;
+    ok = writeV6Config(path.c_str(), &config) &&
+         !ConfigSidecar::exists(path.c_str()) &&
+         ConfigSidecar::write(path.c_str(), config) &&
+         ConfigSidecar::exists(path.c_str()) &&
+         ConfigSidecar::read(path.c_str(), &read) &&
+         read.cipherIface == config.cipherIface && read.keySize == 256 &&
+         read.blockSize == 4096 && read.blockMACBytes == 8 &&
+         read.keyData == config.keyData && read.salt == config.salt;
+
+    // a damaged copy is not used
+    int fd = ::open(copy.c_str(), O_RDWR);
+    unsigned char byte = 0;
+    ok = ok && fd >= 0 && ::pread(fd, &byte, 1, 40) == 1;
+    byte ^= 1;
+    ok = ok && ::pwrite(fd, &byte, 1, 40) == 1;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    ok = ok && !ConfigSidecar::read(path.c_str(), &read);
+
+    // nor is one of the config before it was saved again
+    ok = ok && ConfigSidecar::write(path.c_str(), config) &&
+         ConfigSidecar::read(path.c_str(), &read);
+    config.blockSize = 65536;
+    ok = ok && writeV6Config(path.c_str(), &config) &&
+         !ConfigSidecar::read(path.c_str(), &read) &&
+         ConfigSidecar::exists(path.c_str());
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// with unique IVs, the first read of a reopened file takes the header
+// with block 0 in one backing read
+static bool testHeaderWithFirstBlock() {
+  cerr << "header read with block 0:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  bool ok = cipher && !dir.empty();
+  if (ok) {
+    CipherKey key = cipher->newRandomKey();
+    FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+    cfg->config->uniqueIV = true;
+    std::vector<unsigned char> data(3000), got(3000);
+    cipher->randomize(data.data(), (int)data.size(), false);
+    const size_t sizes[] = {700, 3000};
+    for (size_t size : sizes) {
+      string name = "h" + std::to_string(size);
+      {
+        CipherFileIO io(newRawFile(dir, name), cfg);
+        ok = ok && io.open(O_RDWR) >= 0 &&
+             writeAt(io, 0, data.data(), size);
+      }
+      auto raw = std::make_shared<RawFileIO>(dir + name);
+      auto gated = std::make_shared<GatedFileIO>(raw);
+      CipherFileIO io(gated, cfg);
+      size_t first = std::min(size, (size_t)1024);
+      ok = ok && io.open(O_RDONLY) >= 0 &&
+           readAt(io, 0, got.data(), first) && gated->reads == 1 &&
+           memcmp(got.data(), data.data(), first) == 0;
+      // later blocks are read alone
+      if (size > 1024) {
+        ok = ok && readAt(io, 1024, got.data(), 1024) && gated->reads == 2 &&
+             memcmp(got.data(), &data[1024], 1024) == 0;
+      }
+    }
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// backing file chunks are read once into the local cache, and writes
+// through it or changes behind its back are not served stale
+static bool testCiphertextCache() {
+  cerr << "ciphertext cache:  ";
+  string dir = makeTestDir();
+  bool ok = !dir.empty();
+  if (ok) {
+    auto cache = std::make_shared<CiphertextCache>(dir + "cache", 1 << 20);
+    const size_t size = 200000;
+    std::vector<unsigned char> data(size), got(size);
+    for (size_t i = 0; i < size; ++i) {
+      data[i] = (unsigned char)(i * 7 + i / 251);
+    }
+    auto raw = newRawFile(dir, "file");
+    auto gated = std::make_shared<GatedFileIO>(raw);
+    CachingFileIO io(gated, cache);
+    ok = cache->open() && io.open(O_RDWR) >= 0 &&
+         writeAt(io, 0, data.data(), size) &&
+         readAt(io, 0, got.data(), size) && got == data;
+
+    // served from the cache
+    int reads = gated->reads;
+    ok = ok && readAt(io, 70000, got.data(), 100000) &&
+         memcmp(got.data(), &data[70000], 100000) == 0 &&
+         gated->reads == reads;
+
+    // a write drops the chunk it touched
+    memset(&data[70000], 0xee, 10);
+    ok = ok && writeAt(io, 70000, &data[70000], 10) &&
+         readAt(io, 0, got.data(), size) && got == data &&
+         gated->reads > reads;
+
+    // a change behind our back, with a new mtime
+    int fd = ::open((dir + "file").c_str(), O_RDWR);
+    memset(&data[5], 0x11, 5);
+    ok = ok && fd >= 0 && ::pwrite(fd, &data[5], 5, 5) == 5;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, {12345, 0}};
+    ok = ok && utimensat(AT_FDCWD, (dir + "file").c_str(), times, 0) == 0;
+    raw->invalidateAttr();
+    ok = ok && readAt(io, 0, got.data(), size) && got == data;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a large unlinked file is moved to the trash and removed from there in
+// the background, a small one is left to unlink in place, and what a
+// mount left in the trash goes at the next one
+static bool testReclaimer() {
+  cerr << "deferred unlink:  ";
+  string dir = makeTestDir();
+  bool ok = !dir.empty();
+  if (ok) {
+    string trash = dir + Reclaimer::DirName;
+    auto trashEmpty = [&trash]() {
+      DIR *d = ::opendir(trash.c_str());
+      if (d == nullptr) {
         return false;
       }
-    } catch (encfs::Error &er) {
-      cerr << "Error: " << er.what() << "\n";
+      int entries = 0;
+      while (struct dirent *de = ::readdir(d)) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+          ++entries;
+        }
+      }
+      ::closedir(d);
+      return entries == 0;
+    };
+    auto makeFile = [](const string &path, off_t size) {
+      int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+      bool made = fd >= 0 && ::ftruncate(fd, size) == 0;
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return made;
+    };
+
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    {
+      Reclaimer reclaimer(dir, 4096);
+      struct stat big, small;
+      ok = dirFd >= 0 && reclaimer.open() && makeFile(dir + "big", 1 << 20) &&
+           makeFile(dir + "small", 100) &&
+           ::stat((dir + "big").c_str(), &big) == 0 &&
+           ::stat((dir + "small").c_str(), &small) == 0 &&
+           reclaimer.defer(dirFd, "big", big) == 0 &&
+           ::access((dir + "big").c_str(), F_OK) != 0 &&
+           reclaimer.defer(dirFd, "small", small) == -EAGAIN &&
+           ::access((dir + "small").c_str(), F_OK) == 0 &&
+           waitFor(trashEmpty);
+    }
+    if (dirFd >= 0) {
+      ::close(dirFd);
+    }
+
+    ok = ok && makeFile(trash + "/left", 1 << 20);
+    Reclaimer next(dir, 4096);
+    ok = ok && next.open() && waitFor(trashEmpty);
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a batch of names codes as the names do one at a time, chained or not,
+// and a name of the batch that does not decode leaves the others alone
+static bool testNameBatches() {
+  cerr << "name batches:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  CipherKey key = cipher->newRandomKey();
+
+  std::shared_ptr<NameIO> codings[] = {
+      std::shared_ptr<NameIO>(
+          new StreamNameIO(StreamNameIO::CurrentInterface(), cipher, key)),
+      std::shared_ptr<NameIO>(
+          new BlockNameIO(BlockNameIO::CurrentInterface(), cipher, key,
+                          cipher->cipherBlockSize()))};
+  const int count = 20;
+  const uint64_t dirIV = 0x1234567890abcdefULL;
+
+  bool ok = true;
+  for (auto &coding : codings) {
+    for (int chained = 0; chained < 2; ++chained) {
+      coding->setChainedNameIV(chained != 0);
+      NameIO::NameRequest names[count];
+      for (int i = 0; i < count; ++i) {
+        names[i].name = string(1 + i * 9, (char)('a' + i)) + ".txt";
+        names[i].iv = dirIV;
+      }
+      coding->encodeNames(names, count);
+      for (int i = 0; i < count; ++i) {
+        uint64_t iv = dirIV;
+        string coded = coding->encodePath(names[i].name.c_str(), &iv);
+        ok = ok && names[i].coded == coded &&
+             (!chained || names[i].iv == iv);
+      }
+
+      NameIO::NameRequest back[count];
+      for (int i = 0; i < count; ++i) {
+        back[i].name = names[i].coded;
+        back[i].iv = dirIV;
+      }
+      // one that does not decode
+      back[7].name = "foreign.txt";
+      coding->decodeNames(back, count);
+      for (int i = 0; i < count; ++i) {
+        ok = ok && (i == 7 ? !back[i].ok
+                           : back[i].ok && back[i].coded == names[i].name);
+      }
+    }
+  }
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a placeholder names its object and size under a MAC of the volume key,
+// backing files that are not one are told apart, and the volume config
+// keeps that the volume has a store
+static bool testObjectPlaceholders() {
+  cerr << "object store placeholders:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  bool ok = cipher && !dir.empty();
+  if (ok) {
+    CipherKey key = cipher->newRandomKey();
+    ObjectStore store("http://localhost/bucket", cipher, key, 1 << 20);
+    ObjectStore other("http://localhost/bucket", cipher,
+                      cipher->newRandomKey(), 1 << 20);
+    unsigned char holder[ObjectStore::PlaceholderSize];
+    uint64_t id = 0;
+    off_t size = 0;
+    store.placeholder(99, 123456, holder);
+    ok = store.parsePlaceholder(holder, &id, &size) && id == 99 &&
+         size == 123456 && !other.parsePlaceholder(holder, &id, &size);
+
+    // on disk, next to a file of the same size that is not one
+    int fd = ::open((dir + "p").c_str(), O_WRONLY | O_CREAT, 0600);
+    ok = ok && fd >= 0 && ::write(fd, holder, sizeof(holder)) ==
+                              (ssize_t)sizeof(holder);
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    holder[17] ^= 1;
+    ok = ok && !store.parsePlaceholder(holder, &id, &size);
+    fd = ::open((dir + "q").c_str(), O_WRONLY | O_CREAT, 0600);
+    ok = ok && fd >= 0 && ::write(fd, holder, sizeof(holder)) ==
+                              (ssize_t)sizeof(holder);
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    struct stat st;
+    ok = ok && dirFd >= 0 && store.readPlaceholder(dirFd, "p", &id, &size) &&
+         id == 99 && size == 123456 &&
+         !store.readPlaceholder(dirFd, "q", &id, &size) &&
+         ::stat((dir + "p").c_str(), &st) == 0;
+    if (ok) {
+      store.objectAttr(dirFd, "p", &st);
+      ok = st.st_size == 123456;
+    }
+    if (dirFd >= 0) {
+      ::close(dirFd);
+    }
+
+    // the volume config keeps that it has a store, its binary copy too
+    EncFSConfig config;
+    config.cipherIface = cipher->interface();
+    config.objectStore = true;
+    EncFSConfig read, copied;
+    string path = dir + "config";
+    ok = ok && writeV6Config(path.c_str(), &config) &&
+         readV6Config(path.c_str(), &read, nullptr) && read.objectStore &&
+         ConfigSidecar::write(path.c_str(), read) &&
+         ConfigSidecar::read(path.c_str(), &copied) && copied.objectStore;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// each layer of a MAC stack counts the blocks and bytes it moves, the
+// backing file its system calls, and a bad block shows as a failed MAC
+static bool testIoCounters() {
+  cerr << "I/O counters:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  bool ok = cipher && !dir.empty();
+  if (ok) {
+    CipherKey key = cipher->newRandomKey();
+    FSConfigPtr cfg = blockConfig(cipher, key, 1024);
+    cfg->config->blockMACBytes = 8;
+    std::shared_ptr<FileIO> cipherIO(
+        new CipherFileIO(newRawFile(dir, "counted"), cfg));
+    MACFileIO io(cipherIO, cfg);
+    int bs = io.blockSize();
+    std::vector<unsigned char> data(3 * bs), got(3 * bs);
+    cipher->randomize(data.data(), (int)data.size(), false);
+
+    uint64_t before[OpStats::NumIoCounters], after[OpStats::NumIoCounters];
+    auto delta = [&](int counter) { return after[counter] - before[counter]; };
+    OpStats::ioSnapshot(before);
+    ok = io.open(O_RDWR) >= 0 && writeAt(io, 0, data.data(), data.size()) &&
+         readAt(io, 0, got.data(), got.size()) && got == data;
+    OpStats::ioSnapshot(after);
+    ok = ok && delta(OpStats::RawWriteCalls) > 0 &&
+         delta(OpStats::RawWriteBytes) >= 3 * 1024 &&
+         delta(OpStats::RawReadCalls) > 0 &&
+         delta(OpStats::MacLayer + OpStats::BytesWritten) >= data.size() &&
+         delta(OpStats::MacLayer + OpStats::BytesRead) >= data.size() &&
+         delta(OpStats::CipherLayer + OpStats::BlocksWritten) >= 3 &&
+         delta(OpStats::BlockEncodes) >= 3 &&
+         delta(OpStats::MacVerified) >= 3;
+
+    int fd = ::open((dir + "counted").c_str(), O_RDWR);
+    unsigned char byte = 0x55;
+    ok = ok && fd >= 0 && ::pwrite(fd, &byte, 1, 1024 + 100) == 1;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    OpStats::ioSnapshot(before);
+    MACFileIO reread(std::shared_ptr<FileIO>(new CipherFileIO(
+                         std::make_shared<RawFileIO>(dir + "counted"), cfg)),
+                     cfg);
+    ok = ok && reread.open(O_RDONLY) >= 0 &&
+         !readAt(reread, bs, got.data(), bs);
+    OpStats::ioSnapshot(after);
+    ok = ok && delta(OpStats::MacFailed) >= 1;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// metadata changes made on the name in the cached descriptor of the
+// directory reach the file, with one descriptor opened per directory,
+// and without a cache through the full path
+static bool testMetadataAt() {
+  cerr << "metadata through directory fds:  ";
+  string dir = makeTestDir();
+  bool ok = !dir.empty() && ::mkdir((dir + "sub").c_str(), 0700) == 0;
+  if (ok) {
+    auto cache = std::make_shared<DirFdCache>(16);
+    std::shared_ptr<DirFdCache> none;
+    for (int i = 0; ok && i < 4; ++i) {
+      string path = dir + "sub/f" + std::to_string(i);
+      int fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0600);
+      ok = fd >= 0;
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      // the last file without the cache
+      DirFdCache::Ref at = DirFdCache::at(i < 3 ? cache : none, path.c_str());
+      struct timespec ts[2] = {{1000 + i, 0}, {2000 + i, 0}};
+      struct stat st;
+      ok = ok &&
+           (i < 3 ? at.fd() != AT_FDCWD &&
+                        string(at.name()) == "f" + std::to_string(i)
+                  : at.fd() == AT_FDCWD && at.name() == path.c_str()) &&
+           ::fchmodat(at.fd(), at.name(), 0640, 0) == 0 &&
+           ::fchownat(at.fd(), at.name(), getuid(), getgid(),
+                      AT_SYMLINK_NOFOLLOW) == 0 &&
+           ::utimensat(at.fd(), at.name(), ts, AT_SYMLINK_NOFOLLOW) == 0 &&
+           ::stat(path.c_str(), &st) == 0 && (st.st_mode & 0777) == 0640 &&
+           st.st_mtim.tv_sec == 2000 + i;
+    }
+    ok = ok && cache->misses() == 1 && cache->hits() == 2;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a directory listed in full is answered from its index, which follows
+// the changes made through the mount, is written for the next mount, and
+// is dropped once the directory changes behind its back, even just before
+// a change through the mount
+static bool testDirIndex() {
+  cerr << "directory name index:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  string dir = makeTestDir();
+  bool ok = cipher && !dir.empty();
+  if (ok) {
+    CipherKey key = cipher->newRandomKey();
+    string cipherDir = dir.substr(0, dir.length() - 1);
+    auto create = [&dir](const string &name) {
+      int fd = ::open((dir + name).c_str(), O_WRONLY | O_CREAT, 0600);
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return fd >= 0;
+    };
+    std::vector<DirListCache::Entry> entries(5);
+    for (int i = 0; i < 5; ++i) {
+      entries[i].name = "p" + std::to_string(i);
+      entries[i].cipherName = "c" + std::to_string(i);
+      entries[i].fileType = DT_REG;
+      ok = ok && create(entries[i].cipherName);
+    }
+    struct stat st;
+    ok = ok && ::stat(cipherDir.c_str(), &st) == 0;
+
+    DirIndex::Entry e;
+    uint64_t gen;
+    {
+      DirIndex index(cipher, key, 4, 1000);
+      // listed long after the directory last changed
+      index.listed(cipherDir, st, st.st_mtime + 100, entries);
+      ok = ok &&
+           index.lookup(cipherDir, "p3", &e, &gen) == DirIndex::Found &&
+           e.cipherName == "c3" &&
+           index.lookup(cipherDir, "p9", &e, &gen) == DirIndex::Missing;
+
+      // through the mount
+      {
+        DirIndex::Change change;
+        change.begin(&index, cipherDir);
+        ok = ok && create("c5");
+        index.added(cipherDir, "p5", "c5", 0);
+      }
+      {
+        DirIndex::Change change;
+        change.begin(&index, cipherDir);
+        ok = ok && ::unlink((dir + "c1").c_str()) == 0;
+        index.removed(cipherDir, "p1");
+      }
+      ok = ok &&
+           index.lookup(cipherDir, "p5", &e, &gen) == DirIndex::Found &&
+           index.lookup(cipherDir, "p1", &e, &gen) == DirIndex::Missing;
+    }
+
+    // the next mount reads it back
+    DirIndex index(cipher, key, 4, 1000);
+    ok = ok && index.lookup(cipherDir, "p5", &e, &gen) == DirIndex::Found &&
+         e.cipherName == "c5" &&
+         index.lookup(cipherDir, "p1", &e, &gen) == DirIndex::Missing;
+
+    // behind its back, seen once it checks again
+    ok = ok && create("c9");
+    usleep((DirIndex::CheckMs + 100) * 1000);
+    ok = ok && index.lookup(cipherDir, "p0", &e, &gen) == DirIndex::Unknown;
+
+    // nor is one just before a change through the mount taken for ours
+    ok = ok && ::stat(cipherDir.c_str(), &st) == 0;
+    index.listed(cipherDir, st, st.st_mtime + 100, entries);
+    ok = ok && index.lookup(cipherDir, "p0", &e, &gen) == DirIndex::Found;
+    usleep(10000);
+    ok = ok && create("c7");
+    {
+      DirIndex::Change change;
+      change.begin(&index, cipherDir);
+      ok = ok && create("c8");
+      index.added(cipherDir, "p8", "c8", 0);
+    }
+    ok = ok && index.lookup(cipherDir, "p8", &e, &gen) == DirIndex::Unknown;
+  }
+  if (!dir.empty()) {
+    removeTestDir(dir);
+  }
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// a pack left mostly unused is compacted away once its data moved, and
+// what it still held survives the move and a reopen
+static bool testPackCompaction() {
+  cerr << "pack compaction:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", 256);
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  string dir = makeTestDir();
+  if (dir.empty()) {
+    cerr << "FAILED (no directory)\n";
+    return false;
+  }
+  CipherKey key = cipher->newRandomKey();
+  const size_t fileBytes = 1024 * 1024;
+  const int files = (int)(PackStore::MaxPackBytes / fileBytes) + 1;
+  std::vector<unsigned char> data(fileBytes), got(fileBytes);
+  std::vector<uint64_t> ids;
+  bool ok;
+  {
+    PackStore store(dir, cipher, key, fileBytes);
+    ok = store.open();
+
+    // the first pack filled, the last file in the second
+    for (int i = 0; ok && i < files; ++i) {
+      memset(data.data(), i, fileBytes);
+      ids.push_back(store.newId());
+      ok = ids.back() != 0 &&
+           store.put(ids.back(), data.data(), fileBytes) == 0 &&
+           store.size(ids.back()) == (off_t)fileBytes;
+    }
+    // all but the first file of the first pack go, which compacts it
+    for (int i = 1; ok && i < files - 1; ++i) {
+      ok = store.erase(ids[i]) == 0 && store.size(ids[i]) == -1;
+    }
+    struct stat st;
+    ok = ok && store.sync() == 0 &&
+         ::stat((dir + PackStore::DirName + "/pack.0").c_str(), &st) != 0 &&
+         errno == ENOENT;
+  }
+  {
+    // what is left survives the move and a reopen
+    PackStore store(dir, cipher, key, fileBytes);
+    ok = ok && store.open();
+    memset(data.data(), 0, fileBytes);
+    ok = ok && store.read(ids[0], 0, got.data(), fileBytes) ==
+                   (ssize_t)fileBytes &&
+         got == data;
+    memset(data.data(), files - 1, fileBytes);
+    ok = ok && store.read(ids[files - 1], 0, got.data(), fileBytes) ==
+                   (ssize_t)fileBytes &&
+         got == data && store.size(ids[1]) == -1;
+  }
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// the count of sealed blocks carries over to the next mount, a count
+// changed behind its back or lost from a volume that records one is refused,
+// and a volume made before the count starts from its seed
+static bool testNonceBudget() {
+  cerr << "nonce budget:  ";
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES-GCM");
+  if (!cipher) {
+    cerr << "skipped\n";
+    return true;
+  }
+  string dir = makeTestDir();
+  if (dir.empty()) {
+    cerr << "FAILED (no directory)\n";
+    return false;
+  }
+  CipherKey key = cipher->newRandomKey();
+  auto noSeed = []() { return (uint64_t)0; };
+  string path = dir + NonceBudget::FileName;
+  bool ok;
+  {
+    NonceBudget budget(dir, cipher, key);
+    ok = !budget.open(true, noSeed) && ::access(path.c_str(), F_OK) != 0;
+  }
+  {
+    NonceBudget budget(dir, cipher, key);
+    ok = ok && budget.open(false, noSeed) && budget.take() == 0 &&
+         budget.take() == 0 && budget.take() == 0 && budget.used() == 3;
+  }
+  {
+    NonceBudget budget(dir, cipher, key);
+    ok = ok && budget.open(true, noSeed) && budget.used() == 3;
+  }
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  unsigned char zero = 0;
+  ok = ok && fd >= 0 && ::pwrite(fd, &zero, 1, 8) == 1;
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  {
+    NonceBudget budget(dir, cipher, key);
+    ok = ok && !budget.open(true, noSeed);
+  }
+  ::unlink(path.c_str());
+  {
+    NonceBudget budget(dir, cipher, key);
+    ok = ok && budget.open(false, []() { return (uint64_t)1234; }) &&
+         budget.used() == 1234;
+  }
+  {
+    NonceBudget budget(dir, cipher, key);
+    ok = ok && budget.open(true, noSeed) && budget.used() == 1234;
+  }
+
+  // the volume config keeps that it has the count, its binary copy too
+  EncFSConfig config;
+  config.cipherIface = cipher->interface();
+  config.nonceBudget = true;
+  EncFSConfig read, copied;
+  string configPath = dir + "config";
+  ok = ok && writeV6Config(configPath.c_str(), &config) &&
+       readV6Config(configPath.c_str(), &read, nullptr) && read.nonceBudget &&
+       ConfigSidecar::write(configPath.c_str(), read) &&
+       ConfigSidecar::read(configPath.c_str(), &copied) && copied.nonceBudget;
+  removeTestDir(dir);
+
+  cerr << (ok ? "OK\n" : "FAILED\n");
+  return ok;
+}
+
+// --perf: throughput of every cipher, key and block size, against a baseline
+struct PerfOptions {
+  string baseline;  // file the results are compared with, or written to
+  double seconds;   // spent on each combination
+  double maxDrop;   // percent below the baseline that fails
+  bool update;      // write the results as the new baseline
+};
+
+static double nowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// MB/s of blockEncode followed by blockDecode on a block of size bytes,
+// over seconds.  0 if the cipher failed.
+static double measureBlocks(const std::shared_ptr<Cipher> &cipher,
+                            const CipherKey &key, int size, double seconds) {
+  MemBlock data = MemoryPool::allocate(size);
+  cipher->randomize(data.data, size, false);
+
+  uint64_t bytes = 0;
+  uint64_t iv = 1;
+  double start = nowSeconds();
+  double elapsed = 0;
+  bool ok = true;
+  do {
+    // check the clock every few blocks only
+    for (int i = 0; ok && i < 64; ++i, ++iv) {
+      ok = cipher->blockEncode(data.data, size, iv, key) &&
+           cipher->blockDecode(data.data, size, iv, key);
+      bytes += 2 * size;
+    }
+    elapsed = nowSeconds() - start;
+  } while (ok && elapsed < seconds);
+
+  MemoryPool::release(data);
+  return ok ? bytes / elapsed / (1024 * 1024) : 0;
+}
+
+// lines of "name MB/s"
+static std::map<string, double> readBaseline(const string &path) {
+  std::map<string, double> result;
+  std::ifstream in(path.c_str());
+  string name;
+  double rate;
+  while (in >> name >> rate) {
+    result[name] = rate;
+  }
+  return result;
+}
+
+static bool writeBaseline(const string &path,
+                          const std::map<string, double> &results) {
+  string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp.c_str());
+    for (const auto &result : results) {
+      out << result.first << " " << result.second << "\n";
+    }
+    if (!out) {
       return false;
     }
   }
-  return true;
+  return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+/*
+    Measures each cipher, key length and power of two block size in turn.
+    With no baseline yet, or with --perf-update, the results become the
+    baseline; otherwise every combination must reach (100 - maxDrop)% of
+    its baseline.  Combinations missing from the baseline are only shown.
+ */
+static int runPerf(const std::list<Cipher::CipherAlgorithm> &algorithms,
+                   const PerfOptions &opts) {
+  std::map<string, double> baseline = readBaseline(opts.baseline);
+  bool update = opts.update || baseline.empty();
+  std::map<string, double> results;
+  int failures = 0;
+
+  for (const Cipher::CipherAlgorithm &alg : algorithms) {
+    for (int keySize = alg.keyLength.min(); keySize <= alg.keyLength.max();
+         keySize += alg.keyLength.inc()) {
+      std::shared_ptr<Cipher> cipher = Cipher::New(alg.name, keySize);
+      // sealed by CipherFileIO, not through blockEncode
+      if (!cipher || cipher->aeadHeaderSize() > 0) {
+        continue;
+      }
+      CipherKey key = cipher->newRandomKey();
+
+      for (int size = alg.blockSize.min(); size <= alg.blockSize.max();
+           size *= 2) {
+        int blockSize = alg.blockSize.closest(size);
+        std::ostringstream name;
+        name << alg.name << "/" << keySize << "/" << blockSize;
+        double rate = measureBlocks(cipher, key, blockSize, opts.seconds);
+        results[name.str()] = rate;
+
+        cerr << name.str() << ": " << (int)rate << " MB/s";
+        auto it = baseline.find(name.str());
+        if (!update && it != baseline.end() && it->second > 0) {
+          double change = (rate - it->second) * 100 / it->second;
+          cerr << " (" << (change >= 0 ? "+" : "") << (int)change << "%)";
+          if (change < -opts.maxDrop) {
+            cerr << "  REGRESSION";
+            ++failures;
+          }
+        }
+        cerr << "\n";
+      }
+    }
+  }
+
+  if (update) {
+    if (!writeBaseline(opts.baseline, results)) {
+      cerr << "unable to write " << opts.baseline << "\n";
+      return 1;
+    }
+    cerr << "\nbaseline written to " << opts.baseline << "\n";
+    return 0;
+  }
+  if (failures > 0) {
+    cerr << "\n" << failures << " combinations more than " << opts.maxDrop
+         << "% below " << opts.baseline << "\n";
+    return 1;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -411,6 +3636,28 @@ int main(int argc, char *argv[]) {
 
   srand(time(0));
 
+  bool perf = false;
+  PerfOptions perfOpts = {"encfs-perf.baseline", 0.5, 10, false};
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--perf") {
+      perf = true;
+    } else if (arg.compare(0, 11, "--baseline=") == 0) {
+      perfOpts.baseline = arg.substr(11);
+    } else if (arg.compare(0, 12, "--perf-time=") == 0) {
+      perfOpts.seconds = atof(arg.c_str() + 12);
+    } else if (arg.compare(0, 11, "--max-drop=") == 0) {
+      perfOpts.maxDrop = atof(arg.c_str() + 11);
+    } else if (arg == "--perf-update") {
+      perf = true;
+      perfOpts.update = true;
+    }
+  }
+  if (perfOpts.seconds <= 0 || perfOpts.maxDrop < 0) {
+    cerr << "--perf-time must be above 0 and --max-drop at least 0\n";
+    return 1;
+  }
+
   // get a list of the available algorithms
   std::list<Cipher::CipherAlgorithm> algorithms = Cipher::GetAlgorithmList();
   std::list<Cipher::CipherAlgorithm>::const_iterator it;
@@ -425,6 +3672,12 @@ int main(int argc, char *argv[]) {
   }
   cerr << "\n";
 
+  if (perf) {
+    int r = runPerf(algorithms, perfOpts);
+    MemoryPool::destroyAll();
+    return r;
+  }
+
   cerr << "Testing interfaces\n";
   for (it = algorithms.begin(); it != algorithms.end(); ++it) {
     int blockSize = it->blockSize.closest(256);
@@ -440,6 +3693,14 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  cerr << "\nTesting large blocks\n";
+  for (it = algorithms.begin(); it != algorithms.end(); ++it) {
+    if (it->blockSize.max() > Cipher::MaxClassicBlockSize &&
+        !testLargeBlock(*it)) {
+      return 1;
+    }
+  }
+
   // run one test with verbose output too..
   std::shared_ptr<Cipher> cipher = Cipher::New("AES", 192);
   if (!cipher) {
@@ -452,6 +3713,185 @@ int main(int argc, char *argv[]) {
     runTests(cipher, true);
   }
 
+  cerr << "\nTesting components\n";
+  if (!testSharedKey()) {
+    return 1;
+  }
+  if (!testBlockIVs()) {
+    return 1;
+  }
+  if (!testBlockBatches()) {
+    return 1;
+  }
+  if (!testAeadTamper("AES-GCM")) {
+    return 1;
+  }
+  if (!testXTS()) {
+    return 1;
+  }
+  if (!testByteKernels()) {
+    return 1;
+  }
+  if (!testSipHash()) {
+    return 1;
+  }
+  if (!testFormatVersions()) {
+    return 1;
+  }
+  if (!testRandomBuffer()) {
+    return 1;
+  }
+  if (!testBlockCache()) {
+    return 1;
+  }
+  if (!testReadAhead()) {
+    return 1;
+  }
+  if (!testBlockRuns()) {
+    return 1;
+  }
+  if (!testCryptoPool()) {
+    return 1;
+  }
+  if (!testWriteBack()) {
+    return 1;
+  }
+  if (!testMACInPlace()) {
+    return 1;
+  }
+  if (!testHoles()) {
+    return 1;
+  }
+  if (!testPadding()) {
+    return 1;
+  }
+  if (!testParallelReads()) {
+    return 1;
+  }
+  if (!testIVCache()) {
+    return 1;
+  }
+  if (!testAppends()) {
+    return 1;
+  }
+  if (!testMemoryPool()) {
+    return 1;
+  }
+  if (!testPoolLimits()) {
+    return 1;
+  }
+  if (!testLockedArena()) {
+    return 1;
+  }
+  if (!testPoolBlock()) {
+    return 1;
+  }
+  if (!testPathCache()) {
+    return 1;
+  }
+  if (!testNameCodecs()) {
+    return 1;
+  }
+  if (!testPathBuffers()) {
+    return 1;
+  }
+  if (!testNegativeCache()) {
+    return 1;
+  }
+  if (!testLinkCache()) {
+    return 1;
+  }
+  if (!testArgon2()) {
+    return 1;
+  }
+  if (!testMemFile()) {
+    return 1;
+  }
+  if (!testDivider()) {
+    return 1;
+  }
+  if (!testPendingHeader()) {
+    return 1;
+  }
+  if (!testAttrCache()) {
+    return 1;
+  }
+  if (!testXattrCache()) {
+    return 1;
+  }
+  if (!testCompression()) {
+    return 1;
+  }
+  if (!testPacking()) {
+    return 1;
+  }
+  if (!testHotFiles()) {
+    return 1;
+  }
+  if (!testSkipUnchanged()) {
+    return 1;
+  }
+  if (!testAeadTamper("ChaCha20")) {
+    return 1;
+  }
+  if (!testVolumeInterface()) {
+    return 1;
+  }
+  if (!testPoolLanes()) {
+    return 1;
+  }
+  if (!testPathNames()) {
+    return 1;
+  }
+  if (!testTruncateCoding()) {
+    return 1;
+  }
+  if (!testBlockCacheTables()) {
+    return 1;
+  }
+  if (!testWriteJournal()) {
+    return 1;
+  }
+  if (!testMACBatch()) {
+    return 1;
+  }
+  if (!testForeignNames()) {
+    return 1;
+  }
+  if (!testConfigSidecar()) {
+    return 1;
+  }
+  if (!testHeaderWithFirstBlock()) {
+    return 1;
+  }
+  if (!testCiphertextCache()) {
+    return 1;
+  }
+  if (!testReclaimer()) {
+    return 1;
+  }
+  if (!testNameBatches()) {
+    return 1;
+  }
+  if (!testObjectPlaceholders()) {
+    return 1;
+  }
+  if (!testIoCounters()) {
+    return 1;
+  }
+  if (!testMetadataAt()) {
+    return 1;
+  }
+  if (!testDirIndex()) {
+    return 1;
+  }
+  if (!testPackCompaction()) {
+    return 1;
+  }
+  if (!testNonceBudget()) {
+    return 1;
+  }
+
   MemoryPool::destroyAll();
 
   return 0;